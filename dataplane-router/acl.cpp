@@ -0,0 +1,410 @@
+#include "acl.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <array>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+
+namespace router {
+
+namespace {
+
+constexpr uint8_t IP_PROTO_TCP = 6;
+constexpr uint8_t IP_PROTO_UDP = 17;
+// Fragment offset, in host byte order: only the first fragment has the ports
+constexpr uint16_t IP_FRAGMENT_OFFSET_MASK = 0x1fff;
+constexpr uint16_t MAX_PORT = 0xffff;
+
+uint32_t prefix_mask(uint8_t len) {
+  return len ? ~uint32_t{0} << (32 - len) : 0;
+}
+
+// Service masks of the tuples: the rules of any protocol, those of a
+// protocol, and those of a protocol and a single destination port
+constexpr uint32_t ANY_SERVICE = 0;
+constexpr uint32_t PROTO_SERVICE = 0xff0000;
+constexpr uint32_t PORT_SERVICE = 0xffffff;
+
+uint32_t service_mask_of(const AclRule &rule) {
+  if (rule.proto == AclRule::ANY_PROTO) {
+    return ANY_SERVICE;
+  }
+  return rule.dest_port_min == rule.dest_port_max ? PORT_SERVICE
+                                                  : PROTO_SERVICE;
+}
+
+size_t slot_hash(uint64_t addresses, uint32_t service) {
+  uint64_t hash = (addresses ^ service) * 0x9e3779b97f4a7c15;
+  return static_cast<size_t>(hash >> 32 ^ hash >> 52);
+}
+
+std::string_view next_token(std::string_view &line) {
+  size_t begin = line.find_first_not_of(" \t\r");
+  if (begin == std::string_view::npos) {
+    line = {};
+    return {};
+  }
+  line.remove_prefix(begin);
+  size_t end = std::min(line.find_first_of(" \t\r"), line.size());
+  std::string_view token = line.substr(0, end);
+  line.remove_prefix(end);
+  return token;
+}
+
+template <typename T> bool parse_number(std::string_view text, T &value) {
+  auto [end, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  return ec == std::errc{} && end == text.data() + text.size();
+}
+
+// Parse "a.b.c.d/len", "a.b.c.d" or "any" into a host byte order prefix
+void parse_prefix(std::string_view text, uint32_t &address, uint8_t &len) {
+  if (text == "any") {
+    address = 0;
+    len = 0;
+    return;
+  }
+
+  size_t slash = std::min(text.find('/'), text.size());
+  len = 32;
+  if (slash < text.size() &&
+      (!parse_number(text.substr(slash + 1), len) || len > 32)) {
+    throw std::runtime_error("invalid prefix length");
+  }
+  std::string dotted{text.substr(0, slash)};
+  struct in_addr parsed;
+  if (inet_pton(AF_INET, dotted.c_str(), &parsed) != 1) {
+    throw std::runtime_error("invalid address");
+  }
+  address = util::ntoh(static_cast<uint32_t>(parsed.s_addr)) & prefix_mask(len);
+}
+
+uint8_t parse_proto(std::string_view text) {
+  if (text == "any") {
+    return AclRule::ANY_PROTO;
+  }
+  if (text == "icmp") {
+    return IP_PROTO_ICMP;
+  }
+  if (text == "tcp") {
+    return IP_PROTO_TCP;
+  }
+  if (text == "udp") {
+    return IP_PROTO_UDP;
+  }
+  uint8_t proto;
+  if (!parse_number(text, proto)) {
+    throw std::runtime_error("invalid protocol");
+  }
+  return proto;
+}
+
+// Parse "any", a port or "min-max"
+void parse_ports(std::string_view text, uint16_t &min, uint16_t &max) {
+  if (text == "any") {
+    min = 0;
+    max = MAX_PORT;
+    return;
+  }
+  size_t dash = text.find('-');
+  if (dash == std::string_view::npos) {
+    if (!parse_number(text, min)) {
+      throw std::runtime_error("invalid port");
+    }
+    max = min;
+    return;
+  }
+  if (!parse_number(text.substr(0, dash), min) ||
+      !parse_number(text.substr(dash + 1), max) || min > max) {
+    throw std::runtime_error("invalid port range");
+  }
+}
+
+AclRule parse_rule(std::string_view line) {
+  AclRule rule{.action = AclRule::Action::PERMIT,
+               .source = 0,
+               .source_len = 0,
+               .dest = 0,
+               .dest_len = 0,
+               .proto = AclRule::ANY_PROTO,
+               .source_port_min = 0,
+               .source_port_max = MAX_PORT,
+               .dest_port_min = 0,
+               .dest_port_max = MAX_PORT};
+
+  std::string_view action = next_token(line);
+  if (action == "deny") {
+    rule.action = AclRule::Action::DENY;
+  } else if (action != "permit") {
+    throw std::runtime_error("expected permit or deny");
+  }
+
+  std::string_view source = next_token(line);
+  std::string_view dest = next_token(line);
+  if (dest.empty()) {
+    throw std::runtime_error("expected a source and a destination");
+  }
+  parse_prefix(source, rule.source, rule.source_len);
+  parse_prefix(dest, rule.dest, rule.dest_len);
+
+  if (std::string_view proto = next_token(line); !proto.empty()) {
+    rule.proto = parse_proto(proto);
+  }
+  std::string_view source_ports = next_token(line);
+  if (!source_ports.empty()) {
+    std::string_view dest_ports = next_token(line);
+    if (dest_ports.empty()) {
+      throw std::runtime_error("expected the destination ports");
+    }
+    if (rule.proto != IP_PROTO_TCP && rule.proto != IP_PROTO_UDP) {
+      throw std::runtime_error("ports are only matched for TCP and UDP");
+    }
+    parse_ports(source_ports, rule.source_port_min, rule.source_port_max);
+    parse_ports(dest_ports, rule.dest_port_min, rule.dest_port_max);
+  }
+
+  if (!next_token(line).empty()) {
+    throw std::runtime_error("unexpected text after the rule");
+  }
+  return rule;
+}
+
+} // namespace
+
+AclKey AclKey::of(const struct ip_hdr *ip_hdr, size_t length) {
+  AclKey key{.source = util::ntoh(ip_hdr->source_addr),
+             .dest = util::ntoh(ip_hdr->dest_addr),
+             .proto = ip_hdr->proto,
+             .has_ports = false,
+             .source_port = 0,
+             .dest_port = 0};
+
+  size_t header_len = size_t{ip_hdr->ihl} * 4;
+  if ((key.proto == IP_PROTO_TCP || key.proto == IP_PROTO_UDP) &&
+      !(util::ntoh(ip_hdr->frag) & IP_FRAGMENT_OFFSET_MASK) &&
+      length >= header_len + 2 * sizeof(uint16_t)) {
+    // The source and destination ports, both at the start of a TCP or UDP
+    // header
+    std::array<uint16_t, 2> ports;
+    std::memcpy(ports.data(),
+                reinterpret_cast<const std::byte *>(ip_hdr) + header_len,
+                sizeof(ports));
+    key.has_ports = true;
+    key.source_port = util::ntoh(ports[0]);
+    key.dest_port = util::ntoh(ports[1]);
+  }
+  return key;
+}
+
+Acl::Acl(tcb::span<const AclRule> rules) {
+  // The rules of every value of the fields of a tuple, in order, by tuple
+  std::map<std::tuple<uint32_t, uint32_t, uint32_t>,
+           std::map<std::pair<uint64_t, uint32_t>, std::vector<uint32_t>>>
+      groups;
+  actions_.reserve(rules.size());
+  for (uint32_t i = 0; i < rules.size(); ++i) {
+    const AclRule &rule = rules[i];
+    actions_.push_back(rule.action);
+    uint32_t service_mask = service_mask_of(rule);
+    uint64_t addresses =
+        uint64_t{rule.source & prefix_mask(rule.source_len)} << 32 |
+        (rule.dest & prefix_mask(rule.dest_len));
+    uint32_t service =
+        (uint32_t{rule.proto} << 16 | rule.dest_port_min) & service_mask;
+    groups[{prefix_mask(rule.source_len), prefix_mask(rule.dest_len),
+            service_mask}][{addresses, service}]
+        .push_back(i);
+  }
+
+  entries_.reserve(rules.size());
+  for (const auto &[fields, rules_by_values] : groups) {
+    const auto &[source_mask, dest_mask, service_mask] = fields;
+    Tuple tuple{.source_mask = source_mask,
+                .dest_mask = dest_mask,
+                .service_mask = service_mask,
+                .first_rule = NO_RULE,
+                .slots = std::vector<Slot>(
+                    util::next_power_of_two(2 * rules_by_values.size()),
+                    Slot{0, 0, 0, 0})};
+    size_t slot_mask = tuple.slots.size() - 1;
+    for (const auto &[values, indices] : rules_by_values) {
+      const auto &[addresses, service] = values;
+      size_t i = slot_hash(addresses, service) & slot_mask;
+      while (tuple.slots[i].begin != tuple.slots[i].end) {
+        i = (i + 1) & slot_mask;
+      }
+      auto begin = static_cast<uint32_t>(entries_.size());
+      tuple.slots[i] = {addresses, service, begin,
+                        begin + static_cast<uint32_t>(indices.size())};
+      for (uint32_t index : indices) {
+        const AclRule &rule = rules[index];
+        entries_.push_back({.rule = index,
+                            .proto = rule.proto,
+                            .source_port_min = rule.source_port_min,
+                            .source_port_max = rule.source_port_max,
+                            .dest_port_min = rule.dest_port_min,
+                            .dest_port_max = rule.dest_port_max});
+      }
+      tuple.first_rule = std::min(tuple.first_rule, indices.front());
+    }
+    tuples_.push_back(std::move(tuple));
+  }
+
+  std::sort(tuples_.begin(), tuples_.end(),
+            [](const Tuple &a, const Tuple &b) {
+              return a.first_rule < b.first_rule;
+            });
+
+  // Index the tuples by the source and destination prefixes of their rules
+  std::map<std::tuple<uint32_t, uint32_t, uint32_t>, size_t> tuple_indices;
+  for (size_t t = 0; t < tuples_.size(); ++t) {
+    const Tuple &tuple = tuples_[t];
+    tuple_indices[{tuple.source_mask, tuple.dest_mask, tuple.service_mask}] =
+        t;
+  }
+  PrefixTuples tuples_by_source;
+  PrefixTuples tuples_by_dest;
+  for (const AclRule &rule : rules) {
+    uint32_t source_mask = prefix_mask(rule.source_len);
+    uint32_t dest_mask = prefix_mask(rule.dest_len);
+    size_t t = tuple_indices[{source_mask, dest_mask, service_mask_of(rule)}];
+    uint64_t bit = uint64_t{1} << std::min(t, OVERFLOW_TUPLE);
+    tuples_by_source[source_mask][rule.source & source_mask] |= bit;
+    tuples_by_dest[dest_mask][rule.dest & dest_mask] |= bit;
+  }
+  source_indexes_ = build_prefix_indexes(tuples_by_source);
+  dest_indexes_ = build_prefix_indexes(tuples_by_dest);
+}
+
+auto Acl::build_prefix_indexes(const PrefixTuples &tuples_by_prefix)
+    -> std::vector<PrefixIndex> {
+  std::vector<PrefixIndex> indexes;
+  for (const auto &[mask, tuples] : tuples_by_prefix) {
+    PrefixIndex index{.mask = mask,
+                      .slots = std::vector<PrefixSlot>(
+                          util::next_power_of_two(2 * tuples.size()),
+                          PrefixSlot{0, 0})};
+    size_t slot_mask = index.slots.size() - 1;
+    for (const auto &[prefix, bits] : tuples) {
+      size_t i = slot_hash(prefix, 0) & slot_mask;
+      while (index.slots[i].tuples) {
+        i = (i + 1) & slot_mask;
+      }
+      index.slots[i] = {bits, prefix};
+    }
+    indexes.push_back(std::move(index));
+  }
+  return indexes;
+}
+
+uint64_t Acl::lookup_tuples(const std::vector<PrefixIndex> &indexes,
+                            uint32_t address) {
+  uint64_t tuples = 0;
+  for (const PrefixIndex &index : indexes) {
+    uint32_t prefix = address & index.mask;
+    size_t slot_mask = index.slots.size() - 1;
+    for (size_t i = slot_hash(prefix, 0) & slot_mask; index.slots[i].tuples;
+         i = (i + 1) & slot_mask) {
+      if (index.slots[i].prefix == prefix) {
+        tuples |= index.slots[i].tuples;
+        break;
+      }
+    }
+  }
+  return tuples;
+}
+
+bool Acl::matches(const Entry &entry, const AclKey &key) {
+  if (entry.proto != AclRule::ANY_PROTO && entry.proto != key.proto) {
+    return false;
+  }
+  if (entry.source_port_min == 0 && entry.source_port_max == MAX_PORT &&
+      entry.dest_port_min == 0 && entry.dest_port_max == MAX_PORT) {
+    return true;
+  }
+  return key.has_ports && key.source_port >= entry.source_port_min &&
+         key.source_port <= entry.source_port_max &&
+         key.dest_port >= entry.dest_port_min &&
+         key.dest_port <= entry.dest_port_max;
+}
+
+AclRule::Action Acl::classify(const AclKey &key) const {
+  // Only the tuples having rules whose source prefix holds the source of the
+  // packet, and rules whose destination prefix holds its destination, can
+  // match it
+  uint64_t candidates = lookup_tuples(dest_indexes_, key.dest);
+  if (candidates) {
+    candidates &= lookup_tuples(source_indexes_, key.source);
+  }
+
+  uint32_t best = NO_RULE;
+  for (; candidates; candidates &= candidates - 1) {
+    size_t t = __builtin_ctzll(candidates);
+    size_t last = t == OVERFLOW_TUPLE ? tuples_.size() : t + 1;
+    for (; t < last; ++t) {
+      // The tuples left only hold later rules
+      if (tuples_[t].first_rule >= best) {
+        return actions_[best];
+      }
+      best = std::min(best, probe(tuples_[t], key));
+    }
+  }
+  return best == NO_RULE ? AclRule::Action::PERMIT : actions_[best];
+}
+
+uint32_t Acl::probe(const Tuple &tuple, const AclKey &key) const {
+  uint64_t addresses = uint64_t{key.source & tuple.source_mask} << 32 |
+                       (key.dest & tuple.dest_mask);
+  uint32_t service = service_of(key) & tuple.service_mask;
+  size_t slot_mask = tuple.slots.size() - 1;
+  for (size_t i = slot_hash(addresses, service) & slot_mask;
+       tuple.slots[i].begin != tuple.slots[i].end; i = (i + 1) & slot_mask) {
+    const Slot &slot = tuple.slots[i];
+    if (slot.addresses == addresses && slot.service == service) {
+      for (uint32_t e = slot.begin; e < slot.end; ++e) {
+        if (matches(entries_[e], key)) {
+          return entries_[e].rule;
+        }
+      }
+      break;
+    }
+  }
+  return NO_RULE;
+}
+
+std::vector<AclRule> load_acl(const char *path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+
+  std::vector<AclRule> rules;
+  std::string line;
+  for (size_t line_number = 1; std::getline(file, line); ++line_number) {
+    std::string_view text = line;
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos || text[begin] == '#') {
+      continue;
+    }
+    try {
+      rules.push_back(parse_rule(text));
+    } catch (const std::runtime_error &e) {
+      throw std::runtime_error(std::string{path} + ":" +
+                               std::to_string(line_number) + ": " + e.what());
+    }
+  }
+  return rules;
+}
+
+} // namespace router
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "lib_wrapper.hpp"
+#include "span.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief A rule of the ingress ACL. The addresses are in host byte order,
+ * their bits past the prefix length being 0.
+ */
+struct AclRule {
+  enum class Action : uint8_t { PERMIT, DENY };
+
+  // Matches any protocol
+  constexpr static uint8_t ANY_PROTO = 0;
+
+  Action action;
+  uint32_t source;
+  uint8_t source_len;
+  uint32_t dest;
+  uint8_t dest_len;
+  uint8_t proto;
+  // Inclusive ranges of the TCP and UDP ports. A range narrower than all the
+  // ports never matches the packets without ports (other protocols, or
+  // fragments past the first one).
+  uint16_t source_port_min;
+  uint16_t source_port_max;
+  uint16_t dest_port_min;
+  uint16_t dest_port_max;
+};
+
+/**
+ * @brief The fields of an IPv4 packet the ACL rules match on, in host byte
+ * order.
+ */
+struct AclKey {
+  uint32_t source;
+  uint32_t dest;
+  uint8_t proto;
+  // Only set for the TCP and UDP packets that carry their ports
+  bool has_ports;
+  uint16_t source_port;
+  uint16_t dest_port;
+
+  /**
+   * @brief Get the key of a packet.
+   *
+   * @param ip_hdr The IPv4 header of the packet
+   * @param length The bytes available from the IPv4 header on
+   */
+  static AclKey of(const struct ip_hdr *ip_hdr, size_t length);
+};
+
+/**
+ * @brief An ingress ACL, compiled for tuple space search: the rules are
+ * grouped by the fields they fix (a tuple: the lengths of their prefixes, and
+ * whether they fix the protocol and a single destination port), and each
+ * tuple keeps a hash table from the values of those fields to its rules, in
+ * order. The tuples are pruned by the addresses of the packet first: one hash
+ * probe per prefix length of the rules gives the tuples having a rule for its
+ * source, and those having one for its destination, and only the tuples in
+ * both are probed, in the order of their first rule, until no tuple left can
+ * hold an earlier match. A packet thus costs a hash probe per prefix length
+ * and per tuple left, whatever the number of rules.
+ */
+class Acl {
+public:
+  /**
+   * @brief Compile the rules, the first rule matching a packet deciding its
+   * fate. The packets matching no rule are permitted.
+   */
+  explicit Acl(tcb::span<const AclRule> rules);
+
+  /**
+   * @brief Get the action of the first rule matching a packet.
+   */
+  AclRule::Action classify(const AclKey &key) const;
+
+  bool permits(const AclKey &key) const {
+    return classify(key) == AclRule::Action::PERMIT;
+  }
+
+  size_t rule_count() const { return actions_.size(); }
+  size_t tuple_count() const { return tuples_.size(); }
+
+private:
+  // Index of the rule of no match
+  constexpr static uint32_t NO_RULE = UINT32_MAX;
+  // The tuples indexed by destination share the last bit from this one on
+  constexpr static size_t OVERFLOW_TUPLE = 63;
+
+  // What is left to check of a rule once its addresses matched
+  struct Entry {
+    uint32_t rule;
+    uint8_t proto;
+    uint16_t source_port_min;
+    uint16_t source_port_max;
+    uint16_t dest_port_min;
+    uint16_t dest_port_max;
+  };
+
+  // The rules of a pair of masked addresses and a masked service (see
+  // service_of), as a range of entries_. Empty slots have an empty range.
+  struct Slot {
+    uint64_t addresses;
+    uint32_t service;
+    uint32_t begin;
+    uint32_t end;
+  };
+
+  struct Tuple {
+    uint32_t source_mask;
+    uint32_t dest_mask;
+    uint32_t service_mask;
+    // The first rule of the tuple, in the order of the rules
+    uint32_t first_rule;
+    // Open addressing with linear probing, a power of two of slots, at most
+    // half full
+    std::vector<Slot> slots;
+  };
+
+  // The tuples having a rule of an address prefix, as bits of their indices.
+  // Empty slots have no tuple.
+  struct PrefixSlot {
+    uint64_t tuples;
+    uint32_t prefix;
+  };
+
+  // The source or destination prefixes of the rules, of a length
+  struct PrefixIndex {
+    uint32_t mask;
+    // Open addressing with linear probing, as Tuple::slots
+    std::vector<PrefixSlot> slots;
+  };
+
+  // The tuples of every prefix, by prefix mask
+  using PrefixTuples = std::map<uint32_t, std::map<uint32_t, uint64_t>>;
+
+  // The protocol and the destination port of a packet, as one word
+  static uint32_t service_of(const AclKey &key) {
+    return uint32_t{key.proto} << 16 | key.dest_port;
+  }
+  static bool matches(const Entry &entry, const AclKey &key);
+  // The first rule of the tuple matching the packet, NO_RULE if none
+  uint32_t probe(const Tuple &tuple, const AclKey &key) const;
+  static std::vector<PrefixIndex>
+  build_prefix_indexes(const PrefixTuples &tuples_by_prefix);
+  // The tuples of the prefixes holding an address
+  static uint64_t lookup_tuples(const std::vector<PrefixIndex> &indexes,
+                                uint32_t address);
+
+  // By their first rule
+  std::vector<Tuple> tuples_;
+  std::vector<PrefixIndex> source_indexes_;
+  std::vector<PrefixIndex> dest_indexes_;
+  std::vector<Entry> entries_;
+  std::vector<AclRule::Action> actions_;
+};
+
+/**
+ * @brief Read an ACL file, made of one rule per line, in order:
+ * "action source dest [proto [source_ports dest_ports]]", e.g.
+ * "deny 10.0.0.0/8 192.168.1.0/24 tcp any 22". The action is "permit" or
+ * "deny", the addresses are prefixes ("a.b.c.d/len", a single address without
+ * the length, or "any"), the protocol is "any", "icmp", "tcp", "udp" or a
+ * number, and the ports, only given for TCP and UDP, are "any", a port or a
+ * "min-max" range. Empty lines and those starting with '#' are skipped.
+ *
+ * @throws std::system_error if the file cannot be read
+ * @throws std::runtime_error if a line is malformed
+ */
+std::vector<AclRule> load_acl(const char *path);
+
+} // namespace router
@@ -0,0 +1,345 @@
+#include "adjacency-table.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+namespace router {
+
+AdjacencyTable::AdjacencyTable(size_t capacity)
+    : chunks_((capacity + CHUNK_SIZE - 1) / CHUNK_SIZE),
+      group_chunks_(chunks_.size()) {
+  if (capacity >= GROUP_FLAG) {
+    throw std::invalid_argument("Adjacency table capacity too large");
+  }
+}
+
+AdjacencyTable::index_t AdjacencyTable::get(uint32_t next_hop,
+                                            iface_t interface) {
+  std::lock_guard lock(mutex_);
+  if (auto it = indices_.find(key(next_hop, interface));
+      it != indices_.end()) {
+    return it->second;
+  }
+
+  if (!free_.empty()) {
+    index_t index = free_.back();
+    free_.pop_back();
+    Adjacency &adjacency = at(index);
+    adjacency.next_hop.store(next_hop, std::memory_order_relaxed);
+    adjacency.interface.store(interface, std::memory_order_relaxed);
+    indices_.emplace(key(next_hop, interface), index);
+    return index;
+  }
+  if (size_ == chunks_.size() * CHUNK_SIZE) {
+    throw std::length_error("Adjacency table is full");
+  }
+  return add(next_hop, interface);
+}
+
+AdjacencyTable::index_t AdjacencyTable::add(uint32_t next_hop,
+                                            iface_t interface) {
+  auto &chunk = chunks_[size_ >> CHUNK_SHIFT];
+  if (!chunk) {
+    chunk = std::make_unique<Adjacency[]>(CHUNK_SIZE);
+  }
+
+  auto index = static_cast<index_t>(size_++);
+  Adjacency &adjacency = at(index);
+  adjacency.next_hop.store(next_hop, std::memory_order_relaxed);
+  adjacency.interface.store(interface, std::memory_order_relaxed);
+  indices_.emplace(key(next_hop, interface), index);
+  return index;
+}
+
+void AdjacencyTable::add_free() {
+  auto &chunk = chunks_[size_ >> CHUNK_SHIFT];
+  if (!chunk) {
+    chunk = std::make_unique<Adjacency[]>(CHUNK_SIZE);
+  }
+  free_.push_back(static_cast<index_t>(size_++));
+}
+
+AdjacencyTable::index_t
+AdjacencyTable::get_group(tcb::span<const index_t> paths) {
+  if (paths.empty() || paths.size() > MAX_PATHS) {
+    throw std::invalid_argument("Invalid number of paths in a next hop group");
+  }
+  if (paths.size() == 1) {
+    return paths[0];
+  }
+
+  std::lock_guard lock(mutex_);
+  auto key = group_key(paths);
+  if (auto it = group_indices_.find(key); it != group_indices_.end()) {
+    return it->second;
+  }
+
+  if (!free_groups_.empty()) {
+    index_t index = free_groups_.back();
+    free_groups_.pop_back();
+    Group &group = group_at(index);
+    group.size = static_cast<uint32_t>(paths.size());
+    std::copy(paths.begin(), paths.end(), group.paths.begin());
+    group_indices_.emplace(std::move(key), index);
+    return index;
+  }
+  if (group_count_ == group_chunks_.size() * CHUNK_SIZE) {
+    throw std::length_error("Next hop group table is full");
+  }
+  return add_group(paths, std::move(key));
+}
+
+AdjacencyTable::index_t
+AdjacencyTable::add_group(tcb::span<const index_t> paths,
+                          std::vector<index_t> key) {
+  auto &chunk = group_chunks_[group_count_ >> CHUNK_SHIFT];
+  if (!chunk) {
+    chunk = std::make_unique<Group[]>(CHUNK_SIZE);
+  }
+
+  auto index = static_cast<index_t>(group_count_++) | GROUP_FLAG;
+  Group &group = group_at(index);
+  group.size = static_cast<uint32_t>(paths.size());
+  std::copy(paths.begin(), paths.end(), group.paths.begin());
+  group_indices_.emplace(std::move(key), index);
+  return index;
+}
+
+void AdjacencyTable::add_free_group() {
+  auto &chunk = group_chunks_[group_count_ >> CHUNK_SHIFT];
+  if (!chunk) {
+    chunk = std::make_unique<Group[]>(CHUNK_SIZE);
+  }
+  free_groups_.push_back(static_cast<index_t>(group_count_++) | GROUP_FLAG);
+}
+
+bool AdjacencyTable::is_free(index_t index) const {
+  std::lock_guard lock(mutex_);
+  return is_free_locked(index);
+}
+
+bool AdjacencyTable::is_free_locked(index_t index) const {
+  // A reclaimed slot keeps its last content, which may have been registered
+  // again in another slot since
+  if (is_group(index)) {
+    auto it = group_indices_.find(group_key(paths(index)));
+    return it == group_indices_.end() || it->second != index;
+  }
+  auto it = indices_.find(key(next_hop(index), interface(index)));
+  return it == indices_.end() || it->second != index;
+}
+
+void AdjacencyTable::reclaim(tcb::span<const index_t> used) {
+  std::lock_guard lock(mutex_);
+  std::vector<bool> used_adjacencies(size_);
+  std::vector<bool> used_groups(group_count_);
+  for (index_t index : used) {
+    if (!is_group(index)) {
+      used_adjacencies[index] = true;
+      continue;
+    }
+    used_groups[index & ~GROUP_FLAG] = true;
+    for (index_t path : paths(index)) {
+      used_adjacencies[path] = true;
+    }
+  }
+
+  for (auto it = group_indices_.begin(); it != group_indices_.end();) {
+    if (used_groups[it->second & ~GROUP_FLAG]) {
+      ++it;
+      continue;
+    }
+    free_groups_.push_back(it->second);
+    it = group_indices_.erase(it);
+  }
+  for (auto it = indices_.begin(); it != indices_.end();) {
+    if (used_adjacencies[it->second]) {
+      ++it;
+      continue;
+    }
+    // Unresolved, so that its header is not used by the next hop it is
+    // reused for
+    at(it->second).sequence.store(0, std::memory_order_relaxed);
+    free_.push_back(it->second);
+    it = indices_.erase(it);
+  }
+}
+
+bool AdjacencyTable::restore(
+    tcb::span<const std::pair<uint32_t, iface_t>> adjacencies,
+    tcb::span<const tcb::span<const index_t>> groups) {
+  std::lock_guard lock(mutex_);
+  if (adjacencies.size() < size_ || groups.size() < group_count_ ||
+      adjacencies.size() > chunks_.size() * CHUNK_SIZE ||
+      groups.size() > group_chunks_.size() * CHUNK_SIZE) {
+    return false;
+  }
+
+  // Those already in the table must be at their saved index, free or not, and
+  // the others in neither the table nor the snapshot twice
+  std::unordered_map<uint64_t, index_t> new_indices;
+  for (size_t i = 0; i < adjacencies.size(); ++i) {
+    auto [next_hop, interface] = adjacencies[i];
+    auto index = static_cast<index_t>(i);
+    bool free = interface == FREE_INTERFACE;
+    if (i < size_) {
+      if (free != is_free_locked(index) ||
+          (!free && (this->next_hop(index) != next_hop ||
+                     this->interface(index) != interface))) {
+        return false;
+      }
+    } else if (!free &&
+               (indices_.count(key(next_hop, interface)) ||
+                !new_indices.emplace(key(next_hop, interface), index)
+                     .second)) {
+      return false;
+    }
+  }
+  std::map<std::vector<index_t>, index_t> new_group_indices;
+  for (size_t i = 0; i < groups.size(); ++i) {
+    auto paths = groups[i];
+    auto index = static_cast<index_t>(i) | GROUP_FLAG;
+    if (paths.empty()) {
+      if (i < group_count_ && !is_free_locked(index)) {
+        return false;
+      }
+      continue;
+    }
+    if (paths.size() < 2 || paths.size() > MAX_PATHS ||
+        std::any_of(paths.begin(), paths.end(), [&](index_t path) {
+          return path >= adjacencies.size() ||
+                 adjacencies[path].second == FREE_INTERFACE;
+        })) {
+      return false;
+    }
+    auto key = group_key(paths);
+    if (i < group_count_) {
+      auto it = group_indices_.find(key);
+      if (it == group_indices_.end() || it->second != index) {
+        return false;
+      }
+    } else if (group_indices_.count(key) ||
+               !new_group_indices.emplace(std::move(key), index).second) {
+      return false;
+    }
+  }
+
+  for (size_t i = size_; i < adjacencies.size(); ++i) {
+    if (adjacencies[i].second == FREE_INTERFACE) {
+      add_free();
+    } else {
+      add(adjacencies[i].first, adjacencies[i].second);
+    }
+  }
+  for (size_t i = group_count_; i < groups.size(); ++i) {
+    if (groups[i].empty()) {
+      add_free_group();
+    } else {
+      add_group(groups[i], group_key(groups[i]));
+    }
+  }
+  return true;
+}
+
+void AdjacencyTable::update(index_t index,
+                            const std::array<uint8_t, 6> &dest_mac,
+                            const std::array<uint8_t, 6> &source_mac,
+                            uint16_t eth_type, uint32_t fresh_until) {
+  Adjacency &adjacency = at(index);
+
+  // The workers resolving the same adjacency concurrently would all write the
+  // same header, so only one of them does it. Nor does a worker that looked up
+  // the ARP entry before update_next_hop wrote a newer one: the header is
+  // unchanged since the sequence was read if the exchange succeeds.
+  uint32_t sequence = adjacency.sequence.load(std::memory_order_acquire);
+  if ((sequence & 1) ||
+      (sequence != 0 &&
+       !util::is_before(adjacency.fresh_until.load(std::memory_order_relaxed),
+                        fresh_until)) ||
+      !adjacency.sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                  std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+    return;
+  }
+  write_header(adjacency, sequence, dest_mac, source_mac, eth_type,
+               fresh_until);
+}
+
+void AdjacencyTable::update_next_hop(
+    uint32_t next_hop, const std::array<uint8_t, 6> &dest_mac,
+    const std::array<std::array<uint8_t, 6>, ROUTER_NUM_INTERFACES>
+        &source_macs,
+    uint16_t eth_type, uint32_t fresh_until) {
+  // Held so that the adjacencies are neither reclaimed nor reused meanwhile
+  std::lock_guard lock(mutex_);
+  for (iface_t interface = 0; interface < ROUTER_NUM_INTERFACES; ++interface) {
+    auto it = indices_.find(key(next_hop, interface));
+    if (it == indices_.end()) {
+      continue;
+    }
+    Adjacency &adjacency = at(it->second);
+    uint32_t sequence = adjacency.sequence.load(std::memory_order_relaxed);
+    while ((sequence & 1) ||
+           !adjacency.sequence.compare_exchange_weak(
+               sequence, sequence + 1, std::memory_order_acquire,
+               std::memory_order_relaxed)) {
+      if (sequence & 1) {
+        std::this_thread::yield();
+        sequence = adjacency.sequence.load(std::memory_order_relaxed);
+      }
+    }
+    write_header(adjacency, sequence, dest_mac, source_macs[interface],
+                 eth_type, fresh_until);
+  }
+}
+
+void AdjacencyTable::write_header(Adjacency &adjacency, uint32_t sequence,
+                                  const std::array<uint8_t, 6> &dest_mac,
+                                  const std::array<uint8_t, 6> &source_mac,
+                                  uint16_t eth_type, uint32_t fresh_until) {
+  std::atomic_thread_fence(std::memory_order_release);
+
+  std::array<std::byte, 16> bytes{};
+  auto *eth_hdr = reinterpret_cast<struct ether_hdr *>(bytes.data());
+  std::memcpy(eth_hdr->ethr_dhost, dest_mac.data(), dest_mac.size());
+  std::memcpy(eth_hdr->ethr_shost, source_mac.data(), source_mac.size());
+  eth_hdr->ethr_type = util::hton(eth_type);
+
+  std::array<uint64_t, 2> words;
+  std::memcpy(words.data(), bytes.data(), bytes.size());
+  adjacency.header[0].store(words[0], std::memory_order_relaxed);
+  adjacency.header[1].store(words[1], std::memory_order_relaxed);
+  adjacency.fresh_until.store(fresh_until, std::memory_order_relaxed);
+
+  // Skip 0 when wrapping around, as it marks the unresolved adjacencies
+  uint32_t next_sequence = sequence + 2 == 0 ? 2 : sequence + 2;
+  adjacency.sequence.store(next_sequence, std::memory_order_release);
+}
+
+bool AdjacencyTable::rewrite(index_t index, tcb::span<std::byte> frame,
+                             uint32_t now) const {
+  const Adjacency &adjacency = at(index);
+
+  uint32_t sequence = adjacency.sequence.load(std::memory_order_acquire);
+  if (sequence == 0 || (sequence & 1)) {
+    return false;
+  }
+  std::array<uint64_t, 2> words{
+      adjacency.header[0].load(std::memory_order_relaxed),
+      adjacency.header[1].load(std::memory_order_relaxed)};
+  uint32_t fresh_until = adjacency.fresh_until.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (adjacency.sequence.load(std::memory_order_relaxed) != sequence ||
+      !util::is_before(now, fresh_until)) {
+    return false;
+  }
+
+  // Compiles to two overlapping 8-byte stores
+  std::memcpy(frame.data(), words.data(), ETHER_HDR_SIZE);
+  return true;
+}
+
+} // namespace router
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "common.hpp"
+#include "lib_wrapper.hpp"
+#include "span.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief Table of the adjacencies of the router, i.e. the distinct
+ * (next hop, output interface) pairs used by the routes.
+ *
+ * The routing table stores the index of an adjacency instead of a whole
+ * route. Once the next hop is resolved, the adjacency holds the Ethernet
+ * header of the frames sent to it, so forwarding a packet only copies the
+ * prebuilt header instead of looking up the ARP cache and building it.
+ *
+ * The header is only used until the ARP entry it comes from is due for a
+ * refresh: past that point, the frames go through the ARP cache again, which
+ * refreshes the entry and updates the adjacency. When an ARP reply changes the
+ * MAC address of a next hop, all its adjacencies are updated right away. The
+ * adjacencies are read without any lock (each header is guarded by a sequence
+ * lock). They are allocated in chunks that never move, so the table can grow
+ * while it is being read, and those no route uses anymore are reclaimed once
+ * the routing table stopped publishing them, their slots being reused.
+ *
+ * The routes with several equal-cost paths store the index of a next hop
+ * group instead, the set of the adjacencies of their paths, kept in the same
+ * way. A packet routed to a group is sent to one of its adjacencies, selected
+ * from the hash of its flow.
+ */
+class AdjacencyTable {
+public:
+  using index_t = uint32_t;
+
+  // Maximum number of paths of a next hop group
+  constexpr static size_t MAX_PATHS = 16;
+  // Set in the indices of the next hop groups, the i-th group having the
+  // index i | GROUP_FLAG
+  constexpr static index_t GROUP_FLAG = index_t{1} << 31;
+
+  /**
+   * @param capacity The maximum number of adjacencies
+   */
+  explicit AdjacencyTable(size_t capacity = size_t{1} << 20);
+
+  AdjacencyTable(const AdjacencyTable &) = delete;
+  AdjacencyTable &operator=(const AdjacencyTable &) = delete;
+
+  // The interface of the free adjacencies in a snapshot (see restore)
+  constexpr static iface_t FREE_INTERFACE = ~iface_t{0};
+
+  /**
+   * @brief Find the adjacency of a next hop, adding it if needed, in a free
+   * slot if there is one.
+   *
+   * @throws std::length_error if the table is full
+   */
+  index_t get(uint32_t next_hop, iface_t interface);
+
+  // The number of adjacency slots, indexed from 0, the free ones included
+  size_t size() const {
+    std::lock_guard lock(mutex_);
+    return size_;
+  }
+
+  /**
+   * @brief Find the next hop group made of the given adjacencies, adding it
+   * if needed. A group is identified by its set of adjacencies, whatever
+   * their order.
+   *
+   * @param paths The adjacencies of the paths, at most MAX_PATHS
+   * @return The index of the group, for which `is_group` is true, or the
+   * adjacency itself if there is only one
+   *
+   * @throws std::length_error if the table of groups is full
+   * @throws std::invalid_argument if there are no paths or too many of them
+   */
+  index_t get_group(tcb::span<const index_t> paths);
+
+  /**
+   * @brief Register the adjacencies and the next hop groups of a snapshot at
+   * the indices they were saved with: i for the i-th adjacency, and
+   * i | GROUP_FLAG for the i-th group. Nothing is registered unless all of
+   * them can be, the table holding at most the first of them already.
+   *
+   * @param adjacencies The next hop and the interface of every adjacency,
+   * FREE_INTERFACE for the free slots
+   * @param groups The paths of every group, adjacencies of the snapshot, none
+   * for the free slots
+   * @return false, leaving the table untouched, if the snapshot does not
+   * match the table, is inconsistent or does not fit
+   */
+  bool restore(tcb::span<const std::pair<uint32_t, iface_t>> adjacencies,
+               tcb::span<const tcb::span<const index_t>> groups);
+
+  // Whether an index is that of a next hop group rather than an adjacency
+  static constexpr bool is_group(index_t index) { return index & GROUP_FLAG; }
+
+  // The number of next hop group slots, indexed from 0 (without GROUP_FLAG),
+  // the free ones included
+  size_t group_count() const {
+    std::lock_guard lock(mutex_);
+    return group_count_;
+  }
+
+  // Whether an adjacency or a group slot has been reclaimed and not reused
+  bool is_free(index_t index) const;
+
+  /**
+   * @brief Reclaim the adjacencies and the groups that are neither in `used`
+   * nor paths of a group in it, their slots being reused by the next ones.
+   * A reclaimed adjacency is unresolved, so its previous header is never used
+   * again.
+   *
+   * Must only be called once no reader can reach the others anymore: after
+   * the routing table that stopped using them has been published and the
+   * lookups that may still use the previous one have finished.
+   *
+   * @param used The adjacencies and the groups of the routes
+   */
+  void reclaim(tcb::span<const index_t> used);
+
+  // The adjacencies of a group, as given to get_group
+  tcb::span<const index_t> paths(index_t group) const {
+    const Group &entry = group_at(group);
+    return {entry.paths.data(), entry.size};
+  }
+
+  /**
+   * @brief Select the adjacency of a packet. The flows are spread evenly over
+   * the paths of a group, while an adjacency is its own only path.
+   *
+   * @param index An adjacency or a next hop group
+   * @param flow_hash The hash of the flow of the packet (see flow_hash)
+   */
+  index_t select(index_t index, uint32_t flow_hash) const {
+    if (!is_group(index)) {
+      return index;
+    }
+    const Group &group = group_at(index);
+    return group.paths[(uint64_t{flow_hash} * group.size) >> 32];
+  }
+
+  uint32_t next_hop(index_t index) const {
+    return at(index).next_hop.load(std::memory_order_relaxed);
+  }
+  iface_t interface(index_t index) const {
+    return at(index).interface.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Set the Ethernet header of the frames sent to an adjacency.
+   *
+   * @param fresh_until Time until which the header can be used, as given by
+   * util::coarse_now_ms. The header is left as it is if it is already fresh
+   * until then, having been written from a newer ARP entry.
+   */
+  void update(index_t index, const std::array<uint8_t, 6> &dest_mac,
+              const std::array<uint8_t, 6> &source_mac, uint16_t eth_type,
+              uint32_t fresh_until);
+
+  /**
+   * @brief Set the Ethernet header of all the adjacencies of a next hop, once
+   * its ARP entry changed. Unlike `update`, waits for the workers writing the
+   * same headers, so that none of them is left with the previous address.
+   *
+   * @param source_macs The MAC address of every interface
+   * @param fresh_until As for `update`
+   */
+  void update_next_hop(
+      uint32_t next_hop, const std::array<uint8_t, 6> &dest_mac,
+      const std::array<std::array<uint8_t, 6>, ROUTER_NUM_INTERFACES>
+          &source_macs,
+      uint16_t eth_type, uint32_t fresh_until);
+
+  /**
+   * @brief Write the Ethernet header of an adjacency at the start of a frame.
+   *
+   * @return false, leaving the frame untouched, if the adjacency is not
+   * resolved or its header is stale
+   */
+  bool rewrite(index_t index, tcb::span<std::byte> frame, uint32_t now) const;
+
+private:
+  struct alignas(64) Adjacency {
+    // Only changed when the slot is reused, which no reader can see, but read
+    // concurrently by the offload thread
+    std::atomic<uint32_t> next_hop{0};
+    std::atomic<iface_t> interface{0};
+    // Even when the header is stable, odd while it is being updated and 0
+    // until the adjacency is first resolved
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint32_t> fresh_until{0};
+    // The Ethernet header, padded to 16 bytes
+    std::array<std::atomic<uint64_t>, 2> header{};
+  };
+
+  struct Group {
+    uint32_t size;
+    std::array<index_t, MAX_PATHS> paths;
+  };
+
+  constexpr static size_t CHUNK_SHIFT = 10;
+  constexpr static size_t CHUNK_SIZE = size_t{1} << CHUNK_SHIFT;
+
+  Adjacency &at(index_t index) const {
+    return chunks_[index >> CHUNK_SHIFT][index & (CHUNK_SIZE - 1)];
+  }
+
+  Group &group_at(index_t index) const {
+    index &= ~GROUP_FLAG;
+    return group_chunks_[index >> CHUNK_SHIFT][index & (CHUNK_SIZE - 1)];
+  }
+
+  static uint64_t key(uint32_t next_hop, iface_t interface) {
+    return (uint64_t{next_hop} << 32) | interface;
+  }
+  static std::vector<index_t> group_key(tcb::span<const index_t> paths) {
+    std::vector<index_t> key(paths.begin(), paths.end());
+    std::sort(key.begin(), key.end());
+    return key;
+  }
+
+  // Append an adjacency or a group that is not in the table yet, with
+  // mutex_ held
+  index_t add(uint32_t next_hop, iface_t interface);
+  index_t add_group(tcb::span<const index_t> paths, std::vector<index_t> key);
+  // Append a free slot, with mutex_ held
+  void add_free();
+  void add_free_group();
+  // With mutex_ held
+  bool is_free_locked(index_t index) const;
+  // Write the header of an adjacency whose sequence lock is held, `sequence`
+  // being its value before it was taken
+  static void write_header(Adjacency &adjacency, uint32_t sequence,
+                           const std::array<uint8_t, 6> &dest_mac,
+                           const std::array<uint8_t, 6> &source_mac,
+                           uint16_t eth_type, uint32_t fresh_until);
+
+  // Allocated up front, so that the readers never see it move. A new
+  // adjacency, and the chunk holding it, is only published to the readers by
+  // the routing table update that follows, which orders these writes.
+  std::vector<std::unique_ptr<Adjacency[]>> chunks_;
+  // Only accessed by the writers, with mutex_ held
+  size_t size_{0};
+  // The live adjacencies, the free slots having no entry
+  std::unordered_map<uint64_t, index_t> indices_{};
+  std::vector<index_t> free_{};
+  // The groups, allocated and published in the same way
+  std::vector<std::unique_ptr<Group[]>> group_chunks_;
+  size_t group_count_{0};
+  // Keyed by the sorted adjacencies of the live groups
+  std::map<std::vector<index_t>, index_t> group_indices_{};
+  std::vector<index_t> free_groups_{};
+  mutable std::mutex mutex_{};
+};
+
+} // namespace router
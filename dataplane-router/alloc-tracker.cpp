@@ -0,0 +1,188 @@
+#include "alloc-tracker.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace alloc_tracker {
+
+namespace {
+
+// The scopes whose allocations are counted apart, the others being counted
+// under the last one
+constexpr size_t MAX_SCOPES = 16;
+
+struct ScopeCount {
+  std::atomic<const char *> name{nullptr};
+  std::atomic<uint64_t> allocations{0};
+};
+
+std::array<ScopeCount, MAX_SCOPES> scope_counts;
+std::atomic<uint64_t> total_violations{0};
+std::atomic<bool> armed{false};
+
+// Plain thread-local data, usable from operator new without any
+// initialization of its own
+thread_local Counters counters{};
+// The outermost no-allocation scope of the thread, if any
+thread_local const char *current_scope = nullptr;
+
+ScopeCount &scope_count(const char *name) {
+  for (auto &count : scope_counts) {
+    const char *seen = count.name.load(std::memory_order_acquire);
+    if (seen == nullptr &&
+        count.name.compare_exchange_strong(seen, name,
+                                           std::memory_order_acq_rel)) {
+      return count;
+    }
+    if (seen == name) {
+      return count;
+    }
+  }
+  return scope_counts.back();
+}
+
+void count_violation(size_t size) {
+  const char *scope = current_scope;
+  // Whatever is done here is not checked again
+  current_scope = nullptr;
+  scope_count(scope).allocations.fetch_add(1, std::memory_order_relaxed);
+  total_violations.fetch_add(1, std::memory_order_relaxed);
+#ifdef DEBUG
+  if (armed.load(std::memory_order_relaxed)) {
+    std::fprintf(stderr, "Allocation of %zu bytes in the no-allocation scope %s\n",
+                 size, scope);
+    std::abort();
+  }
+#else
+  (void)size;
+#endif
+  current_scope = scope;
+}
+
+void *allocate(size_t size, size_t alignment) {
+  void *ptr = nullptr;
+  if (alignment <= alignof(std::max_align_t)) {
+    ptr = std::malloc(size == 0 ? 1 : size);
+  } else if (posix_memalign(&ptr, alignment, size == 0 ? 1 : size) != 0) {
+    ptr = nullptr;
+  }
+  if (ptr) {
+    ++counters.allocations;
+    counters.bytes += size;
+    if (current_scope) {
+      count_violation(size);
+    }
+  }
+  return ptr;
+}
+
+void *allocate_or_throw(size_t size, size_t alignment) {
+  void *ptr = allocate(size, alignment);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void deallocate(void *ptr) {
+  if (ptr) {
+    ++counters.deallocations;
+    std::free(ptr);
+  }
+}
+
+} // namespace
+
+const Counters &thread_counters() { return counters; }
+
+NoAllocScope::NoAllocScope(const char *name) : previous_(current_scope) {
+  if (!current_scope) {
+    current_scope = name;
+  }
+}
+
+NoAllocScope::~NoAllocScope() { current_scope = previous_; }
+
+void arm() { armed.store(true, std::memory_order_relaxed); }
+
+uint64_t violations() {
+  return total_violations.load(std::memory_order_relaxed);
+}
+
+void dump(std::FILE *out) {
+  std::fprintf(out, "%-24s %12s\n", "no-allocation scope", "allocations");
+  for (const auto &count : scope_counts) {
+    const char *name = count.name.load(std::memory_order_acquire);
+    if (name) {
+      std::fprintf(out, "%-24s %12lu\n", name,
+                   static_cast<unsigned long>(
+                       count.allocations.load(std::memory_order_relaxed)));
+    }
+  }
+}
+
+} // namespace alloc_tracker
+
+using alloc_tracker::allocate;
+using alloc_tracker::allocate_or_throw;
+using alloc_tracker::deallocate;
+
+constexpr size_t DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+void *operator new(size_t size) {
+  return allocate_or_throw(size, DEFAULT_ALIGNMENT);
+}
+void *operator new[](size_t size) {
+  return allocate_or_throw(size, DEFAULT_ALIGNMENT);
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, DEFAULT_ALIGNMENT);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, DEFAULT_ALIGNMENT);
+}
+void *operator new(size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef ENABLE_ALLOC_TRACKING
+
+#define NO_ALLOC_SCOPE(name) (void)0
+
+#else
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#define ALLOC_CONCAT_(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_(a, b)
+
+// Check that the rest of the enclosing scope allocates nothing, name being a
+// string literal
+#define NO_ALLOC_SCOPE(name)                                                   \
+  alloc_tracker::NoAllocScope ALLOC_CONCAT(no_alloc_scope_, __LINE__) { name }
+
+namespace alloc_tracker {
+
+// The allocations made through the global operator new by a thread, and the
+// deallocations made through operator delete
+struct Counters {
+  uint64_t allocations;
+  uint64_t deallocations;
+  uint64_t bytes;
+};
+
+/**
+ * @brief The counters of the calling thread, updated by every operator new
+ * and operator delete it calls
+ */
+const Counters &thread_counters();
+
+/**
+ * @brief Check that the rest of the enclosing scope allocates nothing. An
+ * allocation made in the scope is counted for it, and aborts the process in
+ * the debug builds once the checks have been armed. Scopes may nest, the
+ * allocations being counted for the outermost one.
+ */
+class NoAllocScope {
+public:
+  explicit NoAllocScope(const char *name);
+  ~NoAllocScope();
+
+  NoAllocScope(const NoAllocScope &) = delete;
+  NoAllocScope &operator=(const NoAllocScope &) = delete;
+
+private:
+  const char *previous_;
+};
+
+/**
+ * @brief Make the allocations in the no-allocation scopes abort the debug
+ * builds from now on. Called once the caches and the buffers that grow with
+ * the first packets are warm, the allocations being only counted until then.
+ */
+void arm();
+
+/**
+ * @brief The allocations made in the no-allocation scopes so far, over all
+ * the threads
+ */
+uint64_t violations();
+
+/**
+ * @brief Print the allocations made in every no-allocation scope
+ *
+ * @param out The stream to print to
+ */
+void dump(std::FILE *out);
+
+} // namespace alloc_tracker
+
+#endif // ENABLE_ALLOC_TRACKING
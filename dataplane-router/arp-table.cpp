@@ -1,22 +1,324 @@
 #include "arp-table.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
 
 namespace router::arp {
 
-std::optional<ArpTableEntry> ArpTable::lookup(uint32_t ip) const {
-  auto it = arp_table_.find(ip);
-  if (it != arp_table_.end()) {
-    return it->second;
+namespace {
+
+// The times of the entries are compared with wrap-around, as 32-bit
+// milliseconds, so no delay may exceed half of their range
+std::chrono::milliseconds checked_delay(std::chrono::milliseconds delay) {
+  if (delay.count() < 0 || delay.count() > INT32_MAX) {
+    throw std::invalid_argument("Invalid neighbor cache delay");
+  }
+  return delay;
+}
+
+} // namespace
+
+template <typename Address>
+NeighborCache<Address>::NeighborCache(Config config)
+    : config_(config),
+      cache_(util::next_power_of_two(
+          std::max<size_t>(config.cache_capacity / SLOTS_PER_BUCKET, 1))),
+      buffers_(config.pending_pool_size) {
+  checked_delay(config.max_pending_age);
+  checked_delay(config.max_request_interval);
+  checked_delay(config.entry_ttl);
+  free_buffers_.reserve(buffers_.size());
+  for (size_t i = buffers_.size(); i > 0; --i) {
+    free_buffers_.push_back(static_cast<uint32_t>(i - 1));
+  }
+}
+
+template <typename Address>
+size_t NeighborCache<Address>::bucket_of(const Address &ip) const {
+  return detail::hash_address(ip) & (cache_.size() - 1);
+}
+
+template <typename Address>
+const typename NeighborCache<Address>::CacheSlot *
+NeighborCache<Address>::find_slot(const Address &ip) const {
+  size_t mask = cache_.size() - 1;
+  size_t bucket = bucket_of(ip);
+
+  for (size_t probes = 0; probes < cache_.size(); ++probes) {
+    for (const auto &slot : cache_[bucket].slots) {
+      if (slot.state == SlotState::FREE) {
+        return nullptr;
+      }
+      if (slot.ip == ip) {
+        return &slot;
+      }
+    }
+    bucket = (bucket + 1) & mask;
+  }
+  return nullptr;
+}
+
+template <typename Address>
+typename NeighborCache<Address>::CacheSlot &
+NeighborCache<Address>::claim_slot(const Address &ip) {
+  if (const CacheSlot *slot = find_slot(ip)) {
+    return const_cast<CacheSlot &>(*slot);
+  }
+
+  // Keep the load factor under 3/4 so that the probe sequences stay short
+  if ((cache_used_ + 1) * 4 > cache_.size() * SLOTS_PER_BUCKET * 3) {
+    rehash(util::coarse_now_ms());
+  }
+
+  size_t mask = cache_.size() - 1;
+  size_t bucket = bucket_of(ip);
+  while (true) {
+    for (auto &slot : cache_[bucket].slots) {
+      if (slot.state == SlotState::FREE) {
+        slot = CacheSlot{};
+        slot.ip = ip;
+        slot.state = SlotState::DYNAMIC;
+        ++cache_used_;
+        return slot;
+      }
+    }
+    bucket = (bucket + 1) & mask;
   }
-  return std::nullopt;
 }
 
-std::optional<std::vector<PendingPacket>>
-ArpTable::retrieve_pending_packets(uint32_t ip) {
+template <typename Address> void NeighborCache<Address>::rehash(uint32_t now) {
+  std::vector<CacheSlot> live;
+  for (const auto &bucket : cache_) {
+    for (const auto &slot : bucket.slots) {
+      if (slot.is_live(now)) {
+        live.push_back(slot);
+      }
+    }
+  }
+
+  size_t buckets = cache_.size();
+  while ((live.size() + 1) * 2 > buckets * SLOTS_PER_BUCKET) {
+    buckets *= 2;
+  }
+
+  cache_.assign(buckets, CacheBucket{});
+  cache_used_ = 0;
+  for (const auto &slot : live) {
+    claim_slot(slot.ip) = slot;
+  }
+}
+
+template <typename Address>
+void NeighborCache<Address>::add_entry(NeighborEntry<Address> entry) {
+  uint32_t expires_at = util::coarse_now_ms() +
+                        static_cast<uint32_t>(config_.entry_ttl.count());
+
+  std::unique_lock lock(mutex_);
+  CacheSlot &slot = claim_slot(entry.ip);
+  if (slot.state == SlotState::STATIC) {
+    return;
+  }
+  slot.mac = entry.mac;
+  slot.expires_at = expires_at;
+  __atomic_store_n(&slot.refreshing, 0, __ATOMIC_RELAXED);
+}
+
+template <typename Address>
+void NeighborCache<Address>::add_static_entry(NeighborEntry<Address> entry) {
+  std::unique_lock lock(mutex_);
+  CacheSlot &slot = claim_slot(entry.ip);
+  slot.mac = entry.mac;
+  slot.state = SlotState::STATIC;
+  __atomic_store_n(&slot.refreshing, 0, __ATOMIC_RELAXED);
+}
+
+template <typename Address>
+void NeighborCache<Address>::add_stale_entry(NeighborEntry<Address> entry) {
+  uint32_t now = util::coarse_now_ms();
+
+  std::unique_lock lock(mutex_);
+  if (is_resolved(entry.ip, now)) {
+    return;
+  }
+  CacheSlot &slot = claim_slot(entry.ip);
+  slot.mac = entry.mac;
+  slot.state = SlotState::DYNAMIC;
+  slot.expires_at = now + static_cast<uint32_t>(config_.refresh_ahead.count());
+  __atomic_store_n(&slot.refreshing, 0, __ATOMIC_RELAXED);
+}
+
+template <typename Address>
+std::vector<NeighborEntry<Address>>
+NeighborCache<Address>::dynamic_entries() const {
+  uint32_t now = util::coarse_now_ms();
+
+  std::vector<NeighborEntry<Address>> entries;
+  std::shared_lock lock(mutex_);
+  for (const auto &bucket : cache_) {
+    for (const auto &slot : bucket.slots) {
+      if (slot.state == SlotState::DYNAMIC && slot.is_live(now)) {
+        entries.push_back({slot.ip, slot.mac});
+      }
+    }
+  }
+  return entries;
+}
+
+template <typename Address>
+std::optional<ArpLookup> NeighborCache<Address>::lookup(const Address &ip) const {
+  uint32_t now = util::coarse_now_ms();
+
+  std::shared_lock lock(mutex_);
+  const CacheSlot *slot = find_slot(ip);
+  if (!slot || !slot->is_live(now)) {
+    return std::nullopt;
+  }
+  if (slot->state == SlotState::STATIC) {
+    // Still checked once in a while by the adjacencies, which only hold on to
+    // their header until the refresh time
+    return ArpLookup{slot->mac, false,
+                     now + static_cast<uint32_t>(config_.entry_ttl.count())};
+  }
+
+  bool refresh = false;
+  uint32_t refresh_at =
+      slot->expires_at - static_cast<uint32_t>(config_.refresh_ahead.count());
+  if (!util::is_before(now, refresh_at)) {
+    // Only the first reader past the refresh time reports it
+    refresh = !__atomic_exchange_n(&slot->refreshing, 1, __ATOMIC_RELAXED);
+  }
+  return ArpLookup{slot->mac, refresh, refresh_at};
+}
+
+template <typename Address>
+PendingOutcome
+NeighborCache<Address>::add_pending_packet(const Address &ip,
+                                          iface_t next_hop_iface,
+                                          tcb::span<const std::byte> frame) {
+  auto now = Clock::now();
+  auto deadline = now - config_.max_pending_age;
+
+  std::unique_lock lock(mutex_);
+  if (is_resolved(ip, util::coarse_now_ms())) {
+    return {PendingResult::RESOLVED, false};
+  }
+
+  auto &queue = pending_packets_[ip];
+  bool send_request = schedule_request(queue, now);
+  auto drop = [&] {
+    stats::count_drop(next_hop_iface, stats::DropReason::ARP_QUEUE_FULL);
+    return PendingOutcome{PendingResult::DROPPED, send_request};
+  };
+
+  if (frame.size() > PENDING_BUFFER_SIZE) {
+    return drop();
+  }
+
+  expire_pending_packets(queue, deadline);
+
+  if (free_buffers_.empty()) {
+    // Reclaim the buffers of the packets that can no longer be sent
+    for (auto it = pending_packets_.begin(); it != pending_packets_.end();) {
+      expire_pending_packets(it->second, deadline);
+      // Forget the resolutions that have neither packets nor a request in
+      // flight anymore
+      if (it->second.count == 0 && it->second.next_request_at <= now &&
+          it->first != ip) {
+        it = pending_packets_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  bool full = queue.count == MAX_PENDING_PER_HOP || free_buffers_.empty();
+  if (full) {
+    if (config_.overflow_policy == OverflowPolicy::DROP_NEWEST ||
+        queue.count == 0) {
+      // The resolution stays in progress even without packets, so that the
+      // next ones do not trigger new requests
+      return drop();
+    }
+
+    // Reuse the buffer of the oldest packet of the queue
+    PendingPacket oldest = queue.pop();
+    stats::count_drop(oldest.next_hop_iface, stats::DropReason::ARP_QUEUE_FULL);
+    stats::page().pending_packets.fetch_sub(1, std::memory_order_relaxed);
+    free_buffers_.push_back(oldest.buffer);
+  }
+
+  uint32_t buffer = free_buffers_.back();
+  free_buffers_.pop_back();
+  std::copy(frame.begin(), frame.end(), buffers_[buffer].begin());
+  queue.push({.next_hop_iface = next_hop_iface,
+              .buffer = buffer,
+              .length = static_cast<uint32_t>(frame.size()),
+              .queued_at = now});
+  stats::add(stats::page().pending_packets);
+  return {PendingResult::QUEUED, send_request};
+}
+
+template <typename Address>
+bool NeighborCache<Address>::schedule_request(PendingQueue &queue,
+                                              Clock::time_point now) const {
+  if (now < queue.next_request_at) {
+    return false;
+  }
+
+  // Double the interval after every request, up to the maximum
+  auto interval = config_.request_interval;
+  for (unsigned int i = 0;
+       i < queue.requests_sent && interval < config_.max_request_interval;
+       ++i) {
+    interval *= 2;
+  }
+  interval = std::min(interval, config_.max_request_interval);
+
+  queue.next_request_at = now + interval;
+  ++queue.requests_sent;
+  return true;
+}
+
+template <typename Address>
+std::optional<typename NeighborCache<Address>::PendingQueue>
+NeighborCache<Address>::take_pending_queue(const Address &ip) {
+  std::unique_lock lock(mutex_);
   auto node = pending_packets_.extract(ip);
   if (node) {
-    return std::move(node.mapped());
+    return node.mapped();
   }
   return std::nullopt;
 }
 
-} // namespace router::arp
\ No newline at end of file
+template <typename Address>
+void NeighborCache<Address>::release_pending_queue(const PendingQueue &queue) {
+  std::unique_lock lock(mutex_);
+  for (size_t i = 0; i < queue.count; ++i) {
+    free_buffers_.push_back(queue.at(i).buffer);
+  }
+  stats::page().pending_packets.fetch_sub(queue.count,
+                                          std::memory_order_relaxed);
+}
+
+template <typename Address>
+void NeighborCache<Address>::expire_pending_packets(
+    PendingQueue &queue, Clock::time_point deadline) {
+  while (queue.count > 0 && queue.at(0).queued_at < deadline) {
+    PendingPacket packet = queue.pop();
+    drop_aged(packet);
+    free_buffers_.push_back(packet.buffer);
+    stats::page().pending_packets.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+template <typename Address>
+void NeighborCache<Address>::drop_aged(const PendingPacket &packet) {
+  stats::count_drop(packet.next_hop_iface, stats::DropReason::ARP_TIMEOUT);
+}
+
+template class NeighborCache<uint32_t>;
+template class NeighborCache<Ipv6Address>;
+
+} // namespace router::arp
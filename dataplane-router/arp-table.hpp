@@ -1,43 +1,318 @@
 #pragma once
 
 #include "common.hpp"
+#include "ipv6.hpp"
 #include "lib_wrapper.hpp"
+#include "page-allocator.hpp"
+#include "span.hpp"
+#include "util.hpp"
 #include <array>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <unordered_map>
 #include <vector>
 
 namespace router::arp {
 
-struct PendingPacket {
-  iface_t next_hop_iface;
-  std::vector<std::byte> frame;
+template <typename Address> struct NeighborEntry {
+  Address ip;
+  std::array<uint8_t, 6> mac;
 };
 
-struct ArpTableEntry {
-  uint32_t ip;
+using ArpTableEntry = NeighborEntry<uint32_t>;
+
+struct ArpLookup {
   std::array<uint8_t, 6> mac;
+  // The entry is about to expire and the caller should refresh it with a
+  // unicast ARP request. Reported to a single caller per entry.
+  bool refresh;
+  // Time from which the entry is due for a refresh, as given by
+  // util::coarse_now_ms
+  uint32_t refresh_at;
+};
+
+// What to do with a packet waiting for a resolution when its queue is full
+enum class OverflowPolicy {
+  // Evict the oldest packet of the queue to make room for the new one
+  DROP_OLDEST,
+  // Drop the new packet
+  DROP_NEWEST,
+};
+
+enum class PendingResult {
+  QUEUED,
+  // The address has been resolved in the meantime by another worker, so the
+  // packet has not been queued and should be sent directly
+  RESOLVED,
+  DROPPED,
 };
 
-class ArpTable {
+struct PendingOutcome {
+  PendingResult result;
+  // Whether an ARP request (or a neighbor solicitation) must be sent for the
+  // next hop. Only the first
+  // packet towards an unresolved next hop triggers one, then the requests are
+  // retransmitted with an exponential backoff while packets keep coming.
+  bool send_request;
+};
+
+// Configuration of a NeighborCache, the same for ARP and NDP
+struct NeighborCacheConfig {
+  // Number of buffers shared by all the pending packets
+  size_t pending_pool_size = 1024;
+  OverflowPolicy overflow_policy = OverflowPolicy::DROP_OLDEST;
+  std::chrono::milliseconds max_pending_age{3000};
+  // Delay before the first ARP request (or neighbor solicitation) is
+  // retransmitted, doubled after every retransmission up to
+  // max_request_interval
+  std::chrono::milliseconds request_interval{100};
+  std::chrono::milliseconds max_request_interval{3200};
+  // Lifetime of a resolved entry
+  std::chrono::milliseconds entry_ttl{60000};
+  // How long before expiring an entry is due for a refresh
+  std::chrono::milliseconds refresh_ahead{5000};
+  // Initial number of entries of the cache, grown as needed
+  size_t cache_capacity = 1024;
+};
+
+namespace detail {
+
+// Fibonacci hashing spreads the consecutive addresses of a subnet, folding
+// the high bits back since they are the well mixed ones
+inline uint32_t hash_address(uint32_t ip) {
+  uint32_t hash = ip * 0x9e3779b1u;
+  return hash ^ (hash >> 16);
+}
+
+inline uint32_t hash_address(const Ipv6Address &ip) {
+  std::array<uint32_t, 4> words;
+  std::memcpy(words.data(), ip.data(), sizeof(words));
+  return hash_address(words[0] ^ words[1] ^ words[2] ^ words[3]);
+}
+
+struct AddressHash {
+  template <typename Address> size_t operator()(const Address &ip) const {
+    return hash_address(ip);
+  }
+};
+
+} // namespace detail
+
+/**
+ * @brief Cache of the MAC addresses of the neighbors, shared by all the RX
+ * workers. The same cache holds the IPv4 neighbors resolved with ARP
+ * (ArpTable) and the IPv6 ones resolved with Neighbor Discovery (NdpTable).
+ * Lookups only take a shared lock, while the rare updates (ARP replies or
+ * neighbor advertisements, and packets waiting for a resolution) take an
+ * exclusive one.
+ *
+ * The entries are stored in an open addressing hash table made of
+ * cache-line-sized buckets, so a lookup usually touches a single cache line.
+ * Every entry expires `entry_ttl` after it was last confirmed by an ARP
+ * reply, and shortly before that it is reported as due for a refresh, so that
+ * it can be renewed without the forwarding ever stalling on a miss. The static
+ * entries, preloaded from a neighbor table, are never expired nor refreshed.
+ *
+ * The packets waiting for a resolution are copied into a fixed pool of
+ * buffers allocated upfront, and each next hop has a bounded queue, so an
+ * unreachable next hop can neither exhaust the memory nor cause allocations
+ * per packet. Packets that waited longer than `max_pending_age` are dropped.
+ */
+template <typename Address> class NeighborCache {
 public:
-  void add_entry(ArpTableEntry entry) {
-    arp_table_.try_emplace(entry.ip, entry);
+  using Clock = std::chrono::steady_clock;
+
+  // Size of a pending packet buffer, larger frames are dropped
+  constexpr static size_t PENDING_BUFFER_SIZE = 2048;
+  // Maximum number of packets waiting for the same next hop
+  constexpr static size_t MAX_PENDING_PER_HOP = 32;
+
+  using Config = NeighborCacheConfig;
+
+  NeighborCache() : NeighborCache(Config{}) {}
+  explicit NeighborCache(Config config);
+
+  /**
+   * @brief Add an entry, or update the MAC address of an existing one, and
+   * restart its lifetime.
+   */
+  void add_entry(NeighborEntry<Address> entry);
+
+  /**
+   * @brief Add a static entry, or turn an existing entry into one. A static
+   * entry never expires nor is due for a refresh, and the ARP replies do not
+   * change it.
+   */
+  void add_static_entry(NeighborEntry<Address> entry);
+
+  /**
+   * @brief Add an entry restored from a previous run of the router, unless
+   * the address already has one. The entry is due for a refresh right away,
+   * so it is used while it is confirmed by a unicast ARP request, and expires
+   * `refresh_ahead` later if it is not.
+   */
+  void add_stale_entry(NeighborEntry<Address> entry);
+
+  // The live dynamic entries, the static ones being preloaded on every start
+  std::vector<NeighborEntry<Address>> dynamic_entries() const;
+
+  const Config &config() const { return config_; }
+
+  std::optional<ArpLookup> lookup(const Address &ip) const;
+
+  /**
+   * @brief Queue a copy of a packet until the MAC address of `ip` is
+   * resolved, marking the resolution of `ip` as in progress.
+   *
+   * @param ip The address of the next hop
+   * @param next_hop_iface The interface the packet is to be sent on
+   * @param frame The frame to copy
+   * @return What happened to the packet and whether an ARP request is due
+   */
+  [[nodiscard]] PendingOutcome
+  add_pending_packet(const Address &ip, iface_t next_hop_iface,
+                     tcb::span<const std::byte> frame);
+
+  /**
+   * @brief Hand the packets waiting for `ip` to `send`, then give their
+   * buffers back to the pool. No lock is held while `send` runs, so it may
+   * use the table.
+   *
+   * @param ip The address that has just been resolved
+   * @param send Called as send(iface_t next_hop_iface, tcb::span<std::byte>
+   * frame) for every packet, in the order they were queued
+   * @return The number of packets handed to `send`
+   */
+  template <typename Fn>
+  size_t flush_pending_packets(const Address &ip, Fn &&send) {
+    auto queue = take_pending_queue(ip);
+    if (!queue) {
+      return 0;
+    }
+
+    size_t sent = 0;
+    auto deadline = Clock::now() - config_.max_pending_age;
+    for (size_t i = 0; i < queue->count; ++i) {
+      const auto &packet = queue->at(i);
+      if (packet.queued_at < deadline) {
+        drop_aged(packet);
+        continue;
+      }
+      // The buffer is reserved until released below, so it is safe to use it
+      // without holding the lock
+      send(packet.next_hop_iface,
+           tcb::span<std::byte>(buffers_[packet.buffer].data(),
+                                packet.length));
+      ++sent;
+    }
+
+    release_pending_queue(*queue);
+    return sent;
   }
 
-  void add_pending_packet(uint32_t ip, PendingPacket packet) {
-    pending_packets_[ip].push_back(packet);
+private:
+  constexpr static size_t SLOTS_PER_BUCKET = 4;
+
+  // A byte, so that a slot has no padding
+  enum class SlotState : uint8_t { FREE, DYNAMIC, STATIC };
+
+  struct CacheSlot {
+    Address ip;
+    std::array<uint8_t, 6> mac;
+    SlotState state;
+    // Set once the refresh of the entry has been reported, accessed
+    // atomically by the readers
+    mutable uint8_t refreshing;
+    // Expiration time, as given by util::coarse_now_ms (dynamic entries
+    // only)
+    uint32_t expires_at;
+
+    bool is_live(uint32_t now) const {
+      return state == SlotState::STATIC ||
+             (state == SlotState::DYNAMIC && util::is_before(now, expires_at));
+    }
+  };
+  // 16 bytes for IPv4, so that a bucket fits in a cache line
+  static_assert(sizeof(CacheSlot) == sizeof(Address) + 12,
+                "A cache slot must not have padding");
+
+  struct alignas(64) CacheBucket {
+    std::array<CacheSlot, SLOTS_PER_BUCKET> slots;
+  };
+
+  size_t bucket_of(const Address &ip) const;
+  // Find the slot of `ip`, expired or not, or nullptr. Must be called with
+  // the lock held.
+  const CacheSlot *find_slot(const Address &ip) const;
+  // Find or claim the slot of `ip`. Must be called with the exclusive lock.
+  CacheSlot &claim_slot(const Address &ip);
+  bool is_resolved(const Address &ip, uint32_t now) const {
+    const CacheSlot *slot = find_slot(ip);
+    return slot && slot->is_live(now);
   }
+  // Rebuild the cache without its expired entries, growing it if needed
+  void rehash(uint32_t now);
 
-  std::optional<ArpTableEntry> lookup(uint32_t ip) const;
+  struct PendingPacket {
+    iface_t next_hop_iface;
+    uint32_t buffer;
+    uint32_t length;
+    Clock::time_point queued_at;
+  };
 
-  [[nodiscard]] std::optional<std::vector<PendingPacket>>
-  retrieve_pending_packets(uint32_t ip);
+  // Resolution in progress of a next hop, with the ring of the packets
+  // waiting for it
+  struct PendingQueue {
+    std::array<PendingPacket, MAX_PENDING_PER_HOP> packets;
+    size_t head = 0;
+    size_t count = 0;
+    // When the next ARP request can be sent, and how many were sent so far
+    Clock::time_point next_request_at{};
+    unsigned int requests_sent = 0;
 
-private:
-  std::unordered_map<uint32_t, ArpTableEntry> arp_table_{};
-  std::unordered_map<uint32_t, std::vector<PendingPacket>> pending_packets_{};
+    const PendingPacket &at(size_t i) const {
+      return packets[(head + i) % MAX_PENDING_PER_HOP];
+    }
+    void push(const PendingPacket &packet) {
+      packets[(head + count++) % MAX_PENDING_PER_HOP] = packet;
+    }
+    PendingPacket pop() {
+      PendingPacket packet = packets[head];
+      head = (head + 1) % MAX_PENDING_PER_HOP;
+      --count;
+      return packet;
+    }
+  };
+
+  std::optional<PendingQueue> take_pending_queue(const Address &ip);
+  void release_pending_queue(const PendingQueue &queue);
+
+  // Drop the packets of a queue that waited for too long. Must be called with
+  // the lock held.
+  void expire_pending_packets(PendingQueue &queue, Clock::time_point deadline);
+  void drop_aged(const PendingPacket &packet);
+  // Check whether an ARP request is due for a resolution in progress, and
+  // schedule the next one if it is
+  bool schedule_request(PendingQueue &queue, Clock::time_point now) const;
+
+  Config config_;
+  mutable std::shared_mutex mutex_{};
+  memory::PageVector<CacheBucket> cache_{};
+  size_t cache_used_{0};
+  std::unordered_map<Address, PendingQueue, detail::AddressHash>
+      pending_packets_{};
+  memory::PageVector<std::array<std::byte, PENDING_BUFFER_SIZE>> buffers_;
+  std::vector<uint32_t> free_buffers_{};
 };
 
-} // namespace router::arp
\ No newline at end of file
+using ArpTable = NeighborCache<uint32_t>;
+using NdpTable = NeighborCache<Ipv6Address>;
+
+extern template class NeighborCache<uint32_t>;
+extern template class NeighborCache<Ipv6Address>;
+
+} // namespace router::arp
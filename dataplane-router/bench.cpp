@@ -0,0 +1,841 @@
+/**
+ * Micro-benchmark of the routing table, for every longest prefix match
+ * backend: the time to build the table and to apply an update, its memory
+ * footprint, and the lookup throughput (one at a time, in batches of a burst,
+ * and through the route cache) and latency percentiles.
+ *
+ * Usage: ./bench <rtable> [cache_size] [destinations]
+ *        ./bench --synthetic [cache_size] [destinations]
+ *        ./bench --acl
+ *        ./bench --flows
+ *        ./bench --rings
+ *
+ * With --synthetic, the tables are generated with 10k, 100k and 1M routes
+ * whose prefix lengths follow those of a BGP full table, instead of being read
+ * from a file.
+ *
+ * The lookups are made with two distributions of destinations: uniform, every
+ * lookup going to a random address of a random route, and Zipf, lookups
+ * concentrated on a few of `destinations` addresses like the skewed traffic
+ * seen in production. The hardware counters (cycles, instructions, cache,
+ * branch and TLB misses) of each way of looking up are reported per lookup,
+ * when the processor and the kernel let them be counted.
+ *
+ * With --acl, the ingress ACL classifier is benchmarked instead, with 1k and
+ * 10k generated rules: the time to compile the rules, and the classification
+ * throughput of packets half of which are aimed at the rules, checked against
+ * a linear scan of the rules.
+ *
+ * With --flows, the flow table is benchmarked instead, for 100k and 1M flows:
+ * the rate of the insertions up to 90% of its capacity, and that of the
+ * lookups of tracked and untracked flows, from one thread and from several
+ * at once.
+ *
+ * With --rings, the rings between threads are benchmarked instead, for pairs
+ * of CPUs as far apart as the affinity of the process allows (SMT siblings,
+ * cores, sockets): the throughput of SpscRing and of MpscRing with several
+ * producers, one value at a time and in batches of a burst, and the latency
+ * of a round trip through two SpscRings, the consumers spinning or sleeping
+ * on a RingWaiter while their ring is empty.
+ */
+#include "acl.hpp"
+#include "adjacency-table.hpp"
+#include "flow-table.hpp"
+#include "mpsc-ring.hpp"
+#include "lib_wrapper.hpp"
+#include "pmu-counters.hpp"
+#include "ring-waiter.hpp"
+#include "route-cache.hpp"
+#include "routing-table.hpp"
+#include "rtable-loader.hpp"
+#include "spsc-ring.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <pthread.h>
+#include <random>
+#include <sched.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+constexpr size_t LOOKUPS = 1e7;
+// Number of lookups timed one by one for the latency percentiles
+constexpr size_t TIMED_LOOKUPS = 1e6;
+// Size of the batches given to lookup_batch, that of an RX burst
+constexpr size_t BATCH_SIZE = 32;
+// Sizes of the tables generated with --synthetic
+constexpr std::array<size_t, 3> SYNTHETIC_SIZES{10'000, 100'000, 1'000'000};
+
+// Sizes of the ACLs generated with --acl
+constexpr std::array<size_t, 2> ACL_SIZES{1'000, 10'000};
+// Number of packets classified by the ACL benchmark
+constexpr size_t ACL_PACKETS = 1e6;
+
+// Capacities of the flow tables of --flows, filled to 90%
+constexpr std::array<size_t, 2> FLOW_TABLE_SIZES{100'000, 1'000'000};
+constexpr size_t FLOW_FILL_PERCENT = 90;
+// Number of threads looking up the flows at once
+constexpr size_t FLOW_READERS = 4;
+
+// Slots of the rings of --rings, values passed through them, and round trips
+// timed one by one
+constexpr size_t RING_CAPACITY = 1024;
+constexpr size_t RING_VALUES = 1e7;
+constexpr size_t RING_ROUND_TRIPS = 1e5;
+// Number of threads pushing to the MpscRing at once
+constexpr size_t RING_PRODUCERS = 3;
+// Time a consumer sleeps for at most, without being notified
+constexpr auto RING_IDLE_TIMEOUT = std::chrono::milliseconds{1};
+
+constexpr std::array<const char *, 4> BACKENDS{"binary", "patricia",
+                                               "multibit", "dir-24-8"};
+
+// Share of every prefix length (from /8 to /32) in a BGP full table, in
+// thousandths. More than half of the routes are /24, the longest prefix
+// accepted between networks, and most of the others are between /16 and /23.
+constexpr std::array<double, 25> PREFIX_LEN_WEIGHTS{
+    // /8 to /15
+    0.1, 0.1, 0.3, 0.8, 1.5, 2.5, 4, 6,
+    // /16 to /23
+    15, 11, 17, 33, 45, 50, 120, 100,
+    // /24
+    590,
+    // /25 to /32, only seen in internal routes
+    1, 0.8, 0.6, 0.5, 0.4, 0.3, 0.2, 0.4};
+
+// Probability that a prefix longer than /16 is carved out of a route already
+// generated, as the more specific routes announced inside an aggregate
+constexpr double NESTED_RATIO = 0.3;
+
+/**
+ * @brief Generate `count` distinct routes with the prefix lengths of a BGP
+ * full table, in the public unicast space. The next hops are spread over 64
+ * neighbours on 4 interfaces.
+ */
+std::vector<route_table_entry> generate_routes(size_t count,
+                                               std::mt19937 &rng) {
+  std::discrete_distribution<size_t> len_dist(PREFIX_LEN_WEIGHTS.begin(),
+                                              PREFIX_LEN_WEIGHTS.end());
+  std::uniform_int_distribution<uint32_t> address_dist(0x01000000, 0xdfffffff);
+  std::uniform_int_distribution<uint32_t> neighbour_dist(0, 63);
+  std::bernoulli_distribution nested_dist(NESTED_RATIO);
+
+  std::vector<route_table_entry> routes;
+  routes.reserve(count);
+  // (prefix, length) of the generated routes, to skip the duplicates
+  std::unordered_set<uint64_t> seen;
+  seen.reserve(count);
+  while (routes.size() < count) {
+    size_t prefix_len = 8 + len_dist(rng);
+    uint32_t address = address_dist(rng);
+    if (prefix_len > 16 && !routes.empty() && nested_dist(rng)) {
+      const auto &aggregate =
+          routes[std::uniform_int_distribution<size_t>(0, routes.size() - 1)(
+              rng)];
+      uint32_t mask = router::util::ntoh(aggregate.mask);
+      address = (router::util::ntoh(aggregate.prefix) & mask) | (address & ~mask);
+    }
+    uint32_t mask = ~uint32_t{0} << (32 - prefix_len);
+    uint32_t prefix = address & mask;
+    if (!seen.insert(uint64_t{prefix} << 8 | prefix_len).second) {
+      continue;
+    }
+
+    uint32_t neighbour = neighbour_dist(rng);
+    routes.push_back(
+        {router::util::hton(prefix),
+         router::util::hton(0x0a000000u | (neighbour % 4) << 8 | (neighbour + 1)),
+         router::util::hton(mask), static_cast<int>(neighbour % 4)});
+  }
+  return routes;
+}
+
+// Destination addresses, in network byte order, covered by random routes
+std::vector<uint32_t>
+make_destinations(const std::vector<route_table_entry> &routes, size_t count,
+                  std::mt19937 &rng) {
+  std::uniform_int_distribution<size_t> route_dist(0, routes.size() - 1);
+  std::uniform_int_distribution<uint32_t> host_dist;
+
+  std::vector<uint32_t> destinations(count);
+  for (auto &destination : destinations) {
+    const auto &route = routes[route_dist(rng)];
+    destination = route.prefix | (host_dist(rng) & ~route.mask);
+  }
+  return destinations;
+}
+
+// Lookup sequence following a Zipf distribution of exponent 1 over the
+// destinations
+std::vector<uint32_t> make_zipf_lookups(const std::vector<uint32_t> &destinations,
+                                        std::mt19937 &rng) {
+  std::vector<double> weights(destinations.size());
+  for (size_t i = 0; i < weights.size(); ++i) {
+    weights[i] = 1.0 / static_cast<double>(i + 1);
+  }
+  std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+
+  std::vector<uint32_t> lookups(LOOKUPS);
+  for (auto &lookup : lookups) {
+    lookup = destinations[zipf(rng)];
+  }
+  return lookups;
+}
+
+template <typename Fn> double time_ms(Fn &&fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+pmu::Counters &pmu_counters() {
+  static pmu::Counters counters;
+  return counters;
+}
+
+// The time of the lookups, in ns per lookup, their hardware counts being set
+// in counts
+template <typename Fn>
+double time_per_lookup(Fn &&lookup, pmu::Counts &counts) {
+  return time_ms([&] { counts = pmu_counters().measure(lookup); }) * 1e6 /
+         LOOKUPS;
+}
+
+struct Latency {
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+};
+
+// Percentiles of the duration of single lookups, in ticks, without the cost of
+// reading the counter
+Latency time_lookup_latency(const router::RoutingTable &rtable,
+                            const std::vector<uint32_t> &lookups) {
+  size_t count = std::min(TIMED_LOOKUPS, lookups.size());
+  std::vector<uint64_t> durations(count);
+
+  for (auto &duration : durations) {
+    uint64_t start = router::util::read_tsc();
+    duration = router::util::read_tsc() - start;
+  }
+  std::sort(durations.begin(), durations.end());
+  uint64_t overhead = durations[count / 2];
+
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t start = router::util::read_tsc();
+    auto adjacency = rtable.lookup(lookups[i]);
+    // Force the result to be computed before the end of the timing
+    asm volatile("" : : "r"(adjacency.value_or(0)) : "memory");
+    uint64_t duration = router::util::read_tsc() - start;
+    durations[i] = duration > overhead ? duration - overhead : 0;
+  }
+  std::sort(durations.begin(), durations.end());
+  return {durations[count / 2], durations[count * 99 / 100],
+          durations[count * 999 / 1000]};
+}
+
+void bench_lookups(const char *distribution, const router::RoutingTable &rtable,
+                   const std::vector<uint32_t> &lookups, size_t cache_size) {
+  // Accumulated so that the lookups cannot be optimized away, and compared
+  // to check that all the ways of looking up agree
+  uint64_t raw_sum = 0;
+  pmu::Counts raw_counts;
+  double raw_ns = time_per_lookup([&] {
+    for (uint32_t dest_ip : lookups) {
+      raw_sum += rtable.lookup(dest_ip).value_or(0);
+    }
+  }, raw_counts);
+
+  std::vector<std::optional<router::AdjacencyTable::index_t>> results(
+      BATCH_SIZE);
+  uint64_t batch_sum = 0;
+  pmu::Counts batch_counts;
+  double batch_ns = time_per_lookup([&] {
+    for (size_t first = 0; first < lookups.size(); first += BATCH_SIZE) {
+      size_t size = std::min(BATCH_SIZE, lookups.size() - first);
+      rtable.lookup_batch(tcb::span<const uint32_t>(&lookups[first], size),
+                          results);
+      for (size_t i = 0; i < size; ++i) {
+        batch_sum += results[i].value_or(0);
+      }
+    }
+  }, batch_counts);
+
+  router::RouteCache cache{cache_size};
+  size_t hits = 0;
+  uint64_t cached_sum = 0;
+  pmu::Counts cached_counts;
+  double cached_ns = time_per_lookup([&] {
+    for (uint32_t dest_ip : lookups) {
+      uint64_t generation = rtable.generation();
+      auto adjacency = cache.lookup(dest_ip, generation);
+      if (adjacency) {
+        ++hits;
+      } else if ((adjacency = rtable.lookup(dest_ip))) {
+        cache.insert(dest_ip, *adjacency, generation);
+      }
+      cached_sum += adjacency.value_or(0);
+    }
+  }, cached_counts);
+
+  Latency latency = time_lookup_latency(rtable, lookups);
+
+  printf("  %-8s raw %6.2f ns (%6.1f M/s), batch %6.2f ns (%6.1f M/s), "
+         "cached %6.2f ns (%5.1f%% hits), latency p50 %llu p99 %llu "
+         "p99.9 %llu ticks%s\n",
+         distribution, raw_ns, 1e3 / raw_ns, batch_ns, 1e3 / batch_ns,
+         cached_ns, 100.0 * static_cast<double>(hits) / LOOKUPS,
+         static_cast<unsigned long long>(latency.p50),
+         static_cast<unsigned long long>(latency.p99),
+         static_cast<unsigned long long>(latency.p999),
+         raw_sum == batch_sum && raw_sum == cached_sum ? "" : " MISMATCH");
+  pmu::print_per_unit(stdout, "    raw:    ", raw_counts, LOOKUPS, "lookup");
+  pmu::print_per_unit(stdout, "    batch:  ", batch_counts, LOOKUPS, "lookup");
+  pmu::print_per_unit(stdout, "    cached: ", cached_counts, LOOKUPS,
+                      "lookup");
+}
+
+void bench_table(const std::vector<route_table_entry> &routes,
+                 size_t cache_size, size_t destination_count,
+                 std::mt19937 &rng) {
+  auto uniform_lookups = make_destinations(routes, LOOKUPS, rng);
+  auto zipf_lookups = make_zipf_lookups(
+      make_destinations(routes, destination_count, rng), rng);
+  printf("%zu routes, route cache of %zu entries, Zipf over %zu "
+         "destinations\n",
+         routes.size(), cache_size, destination_count);
+  if (!pmu_counters().available()) {
+    printf("(no hardware counters: perf_event_open cannot count them here)\n");
+  }
+
+  for (const char *name : BACKENDS) {
+    router::AdjacencyTable adjacencies;
+    router::RoutingTable rtable{adjacencies,
+                                *router::RoutingTable::backend_from_string(name)};
+
+    double insert_ms = time_ms([&] { rtable.add_entries(routes); });
+    // A single route changed on the full table, rebuilding the whole version
+    route_table_entry update = routes.front();
+    update.next_hop = routes.back().next_hop;
+    double update_ms = time_ms([&] { rtable.add_entry(update); });
+
+    printf("%s: insert %.1f ms (%.0f ns/route), update %.1f ms, %.1f MB\n",
+           name, insert_ms, insert_ms * 1e6 / static_cast<double>(routes.size()),
+           update_ms,
+           static_cast<double>(rtable.memory_usage()) / (1024 * 1024));
+    bench_lookups("uniform", rtable, uniform_lookups, cache_size);
+    bench_lookups("zipf", rtable, zipf_lookups, cache_size);
+  }
+}
+
+/**
+ * @brief Generate `count` rules looking like those of an edge firewall: hosts
+ * and subnets of a few /16, allowed to or denied from services on given
+ * ports, ending with a rule denying everything.
+ */
+std::vector<router::AclRule> generate_acl(size_t count, std::mt19937 &rng) {
+  constexpr std::array<uint8_t, 5> SOURCE_LENS{0, 8, 16, 24, 32};
+  constexpr std::array<uint8_t, 3> DEST_LENS{16, 24, 32};
+  constexpr std::array<uint8_t, 3> PROTOS{router::AclRule::ANY_PROTO, 6, 17};
+  std::uniform_int_distribution<size_t> source_len_dist(0,
+                                                        SOURCE_LENS.size() - 1);
+  std::uniform_int_distribution<size_t> dest_len_dist(0, DEST_LENS.size() - 1);
+  std::uniform_int_distribution<size_t> proto_dist(0, PROTOS.size() - 1);
+  std::uniform_int_distribution<uint32_t> address_dist;
+  std::uniform_int_distribution<uint32_t> site_dist(0, 7);
+  std::uniform_int_distribution<uint16_t> port_dist(1, 1023);
+  std::bernoulli_distribution deny_dist(0.3);
+  std::bernoulli_distribution range_dist(0.2);
+
+  std::vector<router::AclRule> rules(count);
+  for (auto &rule : rules) {
+    auto mask = [](uint8_t len) { return len ? ~0u << (32 - len) : 0; };
+    rule.action = deny_dist(rng) ? router::AclRule::Action::DENY
+                                 : router::AclRule::Action::PERMIT;
+    rule.source_len = SOURCE_LENS[source_len_dist(rng)];
+    rule.source = address_dist(rng) & mask(rule.source_len);
+    rule.dest_len = DEST_LENS[dest_len_dist(rng)];
+    rule.dest =
+        (0x0a000000u | site_dist(rng) << 16 | (address_dist(rng) & 0xffff)) &
+        mask(rule.dest_len);
+    rule.proto = PROTOS[proto_dist(rng)];
+    rule.source_port_min = 0;
+    rule.source_port_max = 0xffff;
+    rule.dest_port_min = 0;
+    rule.dest_port_max = 0xffff;
+    if (rule.proto != router::AclRule::ANY_PROTO) {
+      rule.dest_port_min = port_dist(rng);
+      rule.dest_port_max =
+          range_dist(rng) ? rule.dest_port_min + 100 : rule.dest_port_min;
+    }
+  }
+  rules.back() = {router::AclRule::Action::DENY, 0, 0, 0, 0,
+                  router::AclRule::ANY_PROTO, 0, 0xffff, 0, 0xffff};
+  return rules;
+}
+
+// Packets half of which fall in a random rule, the others being random
+std::vector<router::AclKey>
+make_acl_packets(const std::vector<router::AclRule> &rules, std::mt19937 &rng) {
+  std::uniform_int_distribution<size_t> rule_dist(0, rules.size() - 1);
+  std::uniform_int_distribution<uint32_t> address_dist;
+  std::uniform_int_distribution<uint16_t> port_dist;
+  std::bernoulli_distribution aimed_dist(0.5);
+
+  std::vector<router::AclKey> packets(ACL_PACKETS);
+  for (auto &packet : packets) {
+    packet = {address_dist(rng), address_dist(rng), 6, true, port_dist(rng),
+              port_dist(rng)};
+    if (aimed_dist(rng)) {
+      const auto &rule = rules[rule_dist(rng)];
+      auto host = [](uint8_t len) { return len ? ~(~0u << (32 - len)) : ~0u; };
+      packet.source = rule.source | (packet.source & host(rule.source_len));
+      packet.dest = rule.dest | (packet.dest & host(rule.dest_len));
+      if (rule.proto != router::AclRule::ANY_PROTO) {
+        packet.proto = rule.proto;
+      }
+      packet.dest_port = rule.dest_port_min;
+    }
+  }
+  return packets;
+}
+
+// The first rule matching a packet, for checking the classifier
+router::AclRule::Action
+classify_linear(const std::vector<router::AclRule> &rules,
+                const router::AclKey &key) {
+  auto in_prefix = [](uint32_t address, uint32_t prefix, uint8_t len) {
+    return len == 0 || (address >> (32 - len)) == (prefix >> (32 - len));
+  };
+  for (const auto &rule : rules) {
+    bool any_ports = rule.source_port_min == 0 &&
+                     rule.source_port_max == 0xffff &&
+                     rule.dest_port_min == 0 && rule.dest_port_max == 0xffff;
+    if (in_prefix(key.source, rule.source, rule.source_len) &&
+        in_prefix(key.dest, rule.dest, rule.dest_len) &&
+        (rule.proto == router::AclRule::ANY_PROTO || rule.proto == key.proto) &&
+        (any_ports ||
+         (key.has_ports && key.source_port >= rule.source_port_min &&
+          key.source_port <= rule.source_port_max &&
+          key.dest_port >= rule.dest_port_min &&
+          key.dest_port <= rule.dest_port_max))) {
+      return rule.action;
+    }
+  }
+  return router::AclRule::Action::PERMIT;
+}
+
+void bench_acl(size_t rule_count, std::mt19937 &rng) {
+  auto rules = generate_acl(rule_count, rng);
+  auto packets = make_acl_packets(rules, rng);
+
+  std::optional<router::Acl> acl;
+  double compile_ms = time_ms([&] { acl.emplace(rules); });
+
+  size_t permitted = 0;
+  double classify_ms = time_ms([&] {
+    for (const auto &packet : packets) {
+      permitted += acl->permits(packet);
+    }
+  });
+  double ns = classify_ms * 1e6 / static_cast<double>(packets.size());
+
+  // Only a sample is checked, the linear scan being slow on large ACLs
+  size_t mismatches = 0;
+  for (size_t i = 0; i < packets.size(); i += 97) {
+    mismatches +=
+        acl->classify(packets[i]) != classify_linear(rules, packets[i]);
+  }
+
+  printf("%zu ACL rules in %zu tuples: compile %.1f ms, classify %.1f ns "
+         "(%.1f M/s), %.1f%% permitted%s\n",
+         rules.size(), acl->tuple_count(), compile_ms, ns, 1e3 / ns,
+         100.0 * static_cast<double>(permitted) /
+             static_cast<double>(packets.size()),
+         mismatches ? " MISMATCH" : "");
+}
+
+// Random 5-tuples of TCP and UDP flows
+std::vector<router::FlowKey> make_flow_keys(size_t count, std::mt19937 &rng) {
+  std::uniform_int_distribution<uint32_t> address_dist;
+  std::uniform_int_distribution<uint16_t> port_dist;
+  std::bernoulli_distribution udp_dist(0.3);
+
+  std::vector<router::FlowKey> keys(count);
+  for (auto &key : keys) {
+    key = {address_dist(rng), address_dist(rng), port_dist(rng),
+           port_dist(rng), static_cast<uint8_t>(udp_dist(rng) ? 17 : 6)};
+  }
+  return keys;
+}
+
+void bench_flows(size_t capacity, std::mt19937 &rng) {
+  size_t count = capacity * FLOW_FILL_PERCENT / 100;
+  // The first half is inserted, the second one only looked up
+  auto keys = make_flow_keys(2 * count, rng);
+  std::vector<router::FlowKey> tracked(keys.begin(), keys.begin() + count);
+  std::vector<router::FlowKey> untracked(keys.begin() + count, keys.end());
+  std::shuffle(tracked.begin(), tracked.end(), rng);
+  uint32_t now = router::util::coarse_now_ms();
+
+  router::FlowTable table({capacity, std::chrono::minutes(1)});
+  double insert_ms = time_ms([&] {
+    for (size_t i = 0; i < count; ++i) {
+      table.insert(keys[i], static_cast<uint32_t>(i), 64, now);
+    }
+  });
+
+  // Accumulated so that the lookups cannot be optimized away
+  size_t found = 0;
+  double hit_ms = time_ms([&] {
+    for (const auto &key : tracked) {
+      found += table.lookup(key, now).has_value();
+    }
+  });
+  size_t false_hits = 0;
+  double miss_ms = time_ms([&] {
+    for (const auto &key : untracked) {
+      false_hits += table.lookup(key, now).has_value();
+    }
+  });
+
+  // Every reader goes through all the tracked flows, from its own offset,
+  // while a writer fills the rest of the table, moving flows between their
+  // buckets
+  auto stats = table.stats();
+  std::vector<size_t> reader_found(FLOW_READERS);
+  double parallel_ms = time_ms([&] {
+    std::thread writer([&] {
+      for (size_t i = 0; i < capacity - count; ++i) {
+        table.insert(untracked[i], 0, 64, now);
+      }
+    });
+    std::vector<std::thread> readers;
+    for (size_t r = 0; r < FLOW_READERS; ++r) {
+      readers.emplace_back([&, r] {
+        size_t offset = r * count / FLOW_READERS;
+        for (size_t i = 0; i < count; ++i) {
+          reader_found[r] +=
+              table.lookup(tracked[(offset + i) % count], now).has_value();
+        }
+      });
+    }
+    for (auto &reader : readers) {
+      reader.join();
+    }
+    writer.join();
+  });
+
+  auto per_op = [&](double ms) {
+    return ms * 1e6 / static_cast<double>(count);
+  };
+  bool mismatch =
+      found != stats.flows || false_hits != 0 ||
+      std::any_of(reader_found.begin(), reader_found.end(),
+                  [&](size_t value) { return value != found; });
+  printf("%zu flows in a table of %zu: insert %.1f ns (%zu failed, %zu "
+         "displaced), lookup hit %.1f ns, miss %.1f ns, %zu readers %.1f M/s "
+         "in total while filling it%s\n",
+         count, table.capacity(), per_op(insert_ms),
+         static_cast<size_t>(stats.insert_failures),
+         static_cast<size_t>(stats.displacements), per_op(hit_ms),
+         per_op(miss_ms), FLOW_READERS,
+         static_cast<double>(FLOW_READERS * count) / parallel_ms / 1e3,
+         mismatch ? " MISMATCH" : "");
+}
+
+// The CPUs the process may run on
+std::vector<int> allowed_cpus() {
+  cpu_set_t cpuset;
+  std::vector<int> cpus;
+  if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &cpuset)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+// Start a thread pinned to a CPU, or left anywhere if the CPU is negative
+template <typename Fn> std::thread pinned_thread(int cpu, Fn &&fn) {
+  std::thread thread(std::forward<Fn>(fn));
+  if (cpu >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset);
+  }
+  return thread;
+}
+
+// Wait for the other side of a ring, giving the CPU up after a while in case
+// it shares it
+void backoff(size_t &spins) {
+  if (++spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    spins = 0;
+    std::this_thread::yield();
+  }
+}
+
+// Millions of values per second through an SpscRing, from a thread on the
+// producer CPU to one on the consumer CPU, in batches of up to `batch` slots
+double spsc_throughput(int producer_cpu, int consumer_cpu, size_t batch,
+                       bool &mismatch) {
+  router::SpscRing<uint64_t> ring(RING_CAPACITY);
+  uint64_t sum = 0;
+  double ms = time_ms([&] {
+    auto producer = pinned_thread(producer_cpu, [&] {
+      size_t spins = 0;
+      for (uint64_t value = 0; value < RING_VALUES;) {
+        size_t count = std::min({ring.writable(), batch, RING_VALUES - value});
+        if (count == 0) {
+          backoff(spins);
+          continue;
+        }
+        for (size_t i = 0; i < count; ++i) {
+          ring.producer_at(i) = value++;
+        }
+        ring.push(count);
+      }
+    });
+    auto consumer = pinned_thread(consumer_cpu, [&] {
+      size_t spins = 0;
+      for (size_t received = 0; received < RING_VALUES;) {
+        size_t count = std::min(ring.readable(), batch);
+        if (count == 0) {
+          backoff(spins);
+          continue;
+        }
+        for (size_t i = 0; i < count; ++i) {
+          sum += ring.at(i);
+        }
+        ring.pop(count);
+        received += count;
+      }
+    });
+    producer.join();
+    consumer.join();
+  });
+  mismatch = mismatch || sum != RING_VALUES * (RING_VALUES - 1) / 2;
+  return static_cast<double>(RING_VALUES) / ms / 1e3;
+}
+
+// Millions of values per second through an MpscRing, from RING_PRODUCERS
+// threads spread over the producer CPUs to one on the consumer CPU
+double mpsc_throughput(const std::vector<int> &producer_cpus, int consumer_cpu,
+                       size_t batch, bool &mismatch) {
+  router::MpscRing<uint64_t> ring(RING_CAPACITY);
+  constexpr size_t per_producer = RING_VALUES / RING_PRODUCERS;
+  constexpr size_t total = per_producer * RING_PRODUCERS;
+  uint64_t sum = 0;
+  double ms = time_ms([&] {
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < RING_PRODUCERS; ++p) {
+      producers.push_back(pinned_thread(
+          producer_cpus[p % producer_cpus.size()], [&, p] {
+            size_t spins = 0;
+            uint64_t value = p * per_producer;
+            const uint64_t end = value + per_producer;
+            while (value < end) {
+              size_t count = std::min<size_t>(batch, end - value);
+              bool pushed =
+                  batch == 1
+                      ? ring.try_push([&](uint64_t &slot) { slot = value; })
+                      : ring.try_push_batch(count,
+                                            [&](uint64_t &slot, size_t i) {
+                                              slot = value + i;
+                                            });
+              if (!pushed) {
+                backoff(spins);
+                continue;
+              }
+              value += count;
+            }
+          }));
+    }
+    auto consumer = pinned_thread(consumer_cpu, [&] {
+      size_t spins = 0;
+      for (size_t received = 0; received < total;) {
+        size_t count = ring.readable(std::max<size_t>(batch, 1));
+        if (count == 0) {
+          backoff(spins);
+          continue;
+        }
+        for (size_t i = 0; i < count; ++i) {
+          sum += ring.at(i);
+        }
+        ring.pop(count);
+        received += count;
+      }
+    });
+    for (auto &producer : producers) {
+      producer.join();
+    }
+    consumer.join();
+  });
+  mismatch = mismatch || sum != total * (total - 1) / 2;
+  return static_cast<double>(total) / ms / 1e3;
+}
+
+// Percentiles of the round trip of a value sent from the first CPU to the
+// second and back, in ticks, the consumers spinning or sleeping on a
+// RingWaiter while their ring is empty
+Latency round_trip_latency(int first_cpu, int second_cpu, bool sleeping) {
+  router::SpscRing<uint64_t> forward(RING_CAPACITY);
+  router::SpscRing<uint64_t> backward(RING_CAPACITY);
+  router::RingWaiter forward_waiter;
+  router::RingWaiter backward_waiter;
+
+  // Take the next value of the ring, waiting for it
+  auto receive = [sleeping](router::SpscRing<uint64_t> &ring,
+                            router::RingWaiter &waiter) {
+    size_t spins = 0;
+    while (ring.readable() == 0) {
+      if (sleeping) {
+        waiter.wait([&] { return ring.readable() > 0; }, RING_IDLE_TIMEOUT);
+      } else {
+        backoff(spins);
+      }
+    }
+    uint64_t value = ring.at(0);
+    ring.pop(1);
+    return value;
+  };
+  auto send = [sleeping](router::SpscRing<uint64_t> &ring,
+                         router::RingWaiter &waiter, uint64_t value) {
+    // Never full, a single value being in flight
+    *ring.producer_slot() = value;
+    ring.push();
+    if (sleeping) {
+      waiter.notify();
+    }
+  };
+
+  std::vector<uint64_t> durations(RING_ROUND_TRIPS);
+  auto echo = pinned_thread(second_cpu, [&] {
+    for (size_t i = 0; i < RING_ROUND_TRIPS; ++i) {
+      send(backward, backward_waiter, receive(forward, forward_waiter));
+    }
+  });
+  auto timer = pinned_thread(first_cpu, [&] {
+    for (auto &duration : durations) {
+      uint64_t start = router::util::read_tsc();
+      send(forward, forward_waiter, start);
+      duration = router::util::read_tsc() - receive(backward, backward_waiter);
+    }
+  });
+  timer.join();
+  echo.join();
+
+  std::sort(durations.begin(), durations.end());
+  return {durations[RING_ROUND_TRIPS / 2],
+          durations[RING_ROUND_TRIPS * 99 / 100],
+          durations[RING_ROUND_TRIPS * 999 / 1000]};
+}
+
+void bench_rings() {
+  auto cpus = allowed_cpus();
+  if (cpus.empty()) {
+    cpus.push_back(-1);
+  }
+  // The first CPU with its neighbour, likely its SMT sibling or a core of the
+  // same cache, with one in the middle and with the last one, likely on
+  // other cores or sockets
+  std::vector<std::pair<int, int>> pairs;
+  for (size_t index : {size_t{1}, cpus.size() / 2, cpus.size() - 1}) {
+    std::pair<int, int> pair{cpus[0], cpus[std::min(index, cpus.size() - 1)]};
+    if (std::find(pairs.begin(), pairs.end(), pair) == pairs.end()) {
+      pairs.push_back(pair);
+    }
+  }
+
+  bool mismatch = false;
+  for (auto [first, second] : pairs) {
+    double single = spsc_throughput(first, second, 1, mismatch);
+    double batched = spsc_throughput(first, second, BATCH_SIZE, mismatch);
+    Latency spinning = round_trip_latency(first, second, false);
+    Latency sleeping = round_trip_latency(first, second, true);
+    printf("SpscRing CPUs %d -> %d: %.1f M/s one at a time, %.1f M/s in "
+           "batches of %zu; round trip p50/p99/p99.9 %lu/%lu/%lu ticks "
+           "spinning, %lu/%lu/%lu ticks sleeping\n",
+           first, second, single, batched, BATCH_SIZE, spinning.p50,
+           spinning.p99, spinning.p999, sleeping.p50, sleeping.p99,
+           sleeping.p999);
+  }
+
+  // The producers on every other CPU, the consumer on the first one
+  std::vector<int> producer_cpus(cpus.begin() + (cpus.size() > 1 ? 1 : 0),
+                                 cpus.end());
+  double single = mpsc_throughput(producer_cpus, cpus[0], 1, mismatch);
+  double batched =
+      mpsc_throughput(producer_cpus, cpus[0], BATCH_SIZE, mismatch);
+  printf("MpscRing %zu producers on %zu CPUs -> CPU %d: %.1f M/s one at a "
+         "time, %.1f M/s in batches of %zu%s\n",
+         RING_PRODUCERS, producer_cpus.size(), cpus[0], single, batched,
+         BATCH_SIZE, mismatch ? " MISMATCH" : "");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s <rtable | --synthetic> [cache_size] [destinations]\n"
+            "       %s --acl\n"
+            "       %s --flows\n"
+            "       %s --rings\n",
+            argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  size_t cache_size = router::util::next_power_of_two(
+      argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4096);
+  size_t destination_count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4096;
+
+  std::mt19937 rng{42};
+  if (std::strcmp(argv[1], "--acl") == 0) {
+    for (size_t size : ACL_SIZES) {
+      bench_acl(size, rng);
+    }
+    return 0;
+  }
+  if (std::strcmp(argv[1], "--flows") == 0) {
+    for (size_t size : FLOW_TABLE_SIZES) {
+      bench_flows(size, rng);
+    }
+    return 0;
+  }
+  if (std::strcmp(argv[1], "--rings") == 0) {
+    bench_rings();
+    return 0;
+  }
+  if (std::strcmp(argv[1], "--synthetic") == 0) {
+    for (size_t size : SYNTHETIC_SIZES) {
+      bench_table(generate_routes(size, rng), cache_size, destination_count,
+                  rng);
+    }
+    return 0;
+  }
+
+  auto routes = router::load_rtable(argv[1]);
+  if (routes.empty()) {
+    fprintf(stderr, "No routes read from %s\n", argv[1]);
+    return 1;
+  }
+  bench_table(routes, cache_size, destination_count, rng);
+  return 0;
+}
@@ -1,19 +1,45 @@
 #pragma once
 
+#include "page-allocator.hpp"
+#include <algorithm>
 #include <array>
 #include <cstddef>
-#include <memory>
+#include <cstdint>
+#include <iterator>
 #include <optional>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace trie {
 
+/**
+ * @brief What a trie over keys of `Bits` bits is made of, to compare it with
+ * the other longest prefix match structures and to spot the pathological
+ * tables.
+ */
+template <size_t Bits> struct TrieStats {
+  size_t node_count;
+  // Bytes allocated for the nodes and the values
+  size_t memory_usage;
+  // Nodes at each depth, the root being at depth 0
+  std::array<size_t, Bits + 1> nodes_per_depth;
+  // Prefixes of each length
+  std::array<size_t, Bits + 1> prefixes_per_length;
+  size_t max_depth;
+  // Nodes a lookup goes through below the root, on average over the sample
+  double average_lookup_depth;
+};
+
 template <typename Key, typename Value = std::nullptr_t,
           typename = std::enable_if_t<std::is_integral_v<Key> &&
                                       std::is_unsigned_v<Key>>>
 class BinaryTrie {
   constexpr static size_t BITS = sizeof(Key) * 8;
+  // Number of lookups advanced in lockstep by longest_prefix_match_batch
+  constexpr static size_t BATCH_SIZE = 16;
+  // Number of paths looked up by stats
+  constexpr static size_t STATS_SAMPLE_SIZE = 4096;
 
 public:
   /**
@@ -28,19 +54,80 @@ public:
     * @param value The value to insert.
 */
   void insert(Key path, size_t prefix_len, Value value) {
-    Node *cur = root_.get();
+    uint32_t cur = ROOT;
 
     Key mask = 1 << (BITS - 1);
     for (size_t i = 0; i < prefix_len; ++i) {
       size_t index = path & mask ? 1 : 0;
       mask >>= 1;
-      if (!cur->children_[index]) {
-        cur->children_[index] = std::make_unique<Node>();
+      if (!nodes_[cur].children_[index]) {
+        // Allocating may reallocate nodes_, so the index is stored after it
+        uint32_t child = allocate_node();
+        nodes_[cur].children_[index] = child;
+      }
+      cur = nodes_[cur].children_[index];
+    }
+
+    Node &node = nodes_[cur];
+    if (node.value_) {
+      values_[node.value_ - 1] = std::move(value);
+    } else {
+      node.value_ = allocate_value(std::move(value));
+    }
+  }
+
+  /**
+   * @brief Replace the contents of the trie with a range of prefixes, built
+   * in a single pass.
+   * When the prefixes are sorted by path, then by length, each one shares
+   * with the previous one the longest prefix it shares with any of them: it
+   * is inserted from the end of that common prefix instead of from the root,
+   * and the exact number of nodes is known up front. Unsorted prefixes give
+   * the same trie, only more slowly. A prefix given several times keeps its
+   * last value, as with repeated inserts.
+   *
+   * @param first, last The prefixes, as elements with `path`, `prefix_len`
+   * and `value` members. The bits of a path past its prefix length must be
+   * 0.
+   */
+  template <typename It> void build(It first, It last) {
+    nodes_.assign(1, Node{});
+    values_.clear();
+    free_nodes_.clear();
+    free_values_.clear();
+
+    // Each prefix adds the nodes past its common prefix with the previous one
+    size_t node_count = 1;
+    for (It it = first, previous = first; it != last; previous = it++) {
+      size_t depth = it == first ? 0 : common_prefix_len(*previous, *it);
+      node_count += it->prefix_len - depth;
+    }
+    nodes_.reserve(node_count);
+    values_.reserve(std::distance(first, last));
+
+    // The nodes on the path of the previous prefix, by depth
+    std::array<uint32_t, BITS + 1> stack{ROOT};
+    for (It it = first, previous = first; it != last; previous = it++) {
+      size_t depth = it == first ? 0 : common_prefix_len(*previous, *it);
+      uint32_t cur = stack[depth];
+      for (; depth < it->prefix_len; ++depth) {
+        size_t index = (it->path >> (BITS - 1 - depth)) & 1;
+        if (!nodes_[cur].children_[index]) {
+          // Allocating may reallocate nodes_, so the index is stored after it
+          uint32_t child = allocate_node();
+          nodes_[cur].children_[index] = child;
+        }
+        cur = nodes_[cur].children_[index];
+        stack[depth + 1] = cur;
+      }
+
+      Node &node = nodes_[cur];
+      if (node.value_) {
+        values_[node.value_ - 1] = it->value;
+      } else {
+        node.value_ = allocate_value(it->value);
       }
-      cur = cur->children_[index].get();
     }
-    cur->value_ = std::move(value);
-    cur->is_end_of_key_ = true;
   }
 
   /**
@@ -54,28 +141,85 @@ public:
     std::nullopt if no match is found.
 */
   std::optional<Value> longest_prefix_match(Key path) const {
-    Node *cur = root_.get();
-    Node *result = nullptr;
+    uint32_t cur = ROOT;
+    uint32_t result = nodes_[ROOT].value_;
 
     Key mask = 1 << (BITS - 1);
     for (size_t i = 0; i < BITS; ++i) {
       size_t index = path & mask ? 1 : 0;
       mask >>= 1;
-      if (!cur->children_[index]) {
+      if (!nodes_[cur].children_[index]) {
         break;
       }
-      cur = cur->children_[index].get();
-      if (cur->is_end_of_key_) {
-        result = cur;
+      cur = nodes_[cur].children_[index];
+      if (nodes_[cur].value_) {
+        result = nodes_[cur].value_;
       }
     }
 
     if (result) {
-      return result->value_;
+      return values_[result - 1];
     }
     return std::nullopt;
   }
 
+  /**
+   * @brief Find the longest prefix match of several paths.
+   * The lookups go down the trie in lockstep, groups of BATCH_SIZE of them
+   * moving one level at a time: the next node of each lookup is prefetched
+   * while the others advance, so that their cache misses overlap instead of
+   * adding up.
+   *
+   * @param paths The paths to search for.
+   * @param results Receives the result of `longest_prefix_match` for each
+   * path.
+   * @param count The number of paths.
+   */
+  void longest_prefix_match_batch(const Key *paths,
+                                  std::optional<Value> *results,
+                                  size_t count) const {
+    for (size_t first = 0; first < count; first += BATCH_SIZE) {
+      size_t size = std::min(BATCH_SIZE, count - first);
+      std::array<uint32_t, BATCH_SIZE> cur;
+      std::array<uint32_t, BATCH_SIZE> best;
+      // The lookups still going down, compacted at the front
+      std::array<uint8_t, BATCH_SIZE> active;
+      for (size_t i = 0; i < size; ++i) {
+        cur[i] = ROOT;
+        best[i] = 0;
+        active[i] = static_cast<uint8_t>(i);
+      }
+
+      size_t active_count = size;
+      for (size_t depth = 0; active_count > 0; ++depth) {
+        size_t still_active = 0;
+        for (size_t j = 0; j < active_count; ++j) {
+          size_t i = active[j];
+          const Node &node = nodes_[cur[i]];
+          if (node.value_) {
+            best[i] = node.value_;
+          }
+          if (depth == BITS) {
+            continue;
+          }
+          uint32_t child =
+              node.children_[(paths[first + i] >> (BITS - 1 - depth)) & 1];
+          if (child) {
+            __builtin_prefetch(&nodes_[child]);
+            cur[i] = child;
+            active[still_active++] = static_cast<uint8_t>(i);
+          }
+        }
+        active_count = still_active;
+      }
+
+      for (size_t i = 0; i < size; ++i) {
+        results[first + i] =
+            best[i] ? std::optional<Value>{values_[best[i] - 1]} : std::nullopt;
+      }
+    }
+  }
+
   /**
     * @brief Erase a value from the trie at a given path with a specified
     * prefix length.
@@ -93,50 +237,189 @@ public:
 
     Key mask = 1 << (BITS - 1);
 
-    Node *cur = root_.get();
+    uint32_t cur = ROOT;
     for (size_t i = 0; i < prefix_len; ++i) {
       size_t index = path & mask ? 1 : 0;
       mask >>= 1;
 
-      if (!cur->children_[index]) {
+      if (!nodes_[cur].children_[index]) {
         return false;
       }
       path_buffer_.push_back(cur);
-      cur = cur->children_[index].get();
+      cur = nodes_[cur].children_[index];
     }
 
-    if (!cur->is_end_of_key_) {
+    if (!nodes_[cur].value_) {
       return false;
     }
-    cur->is_end_of_key_ = false;
-    cur->value_.reset();
+    free_value(nodes_[cur].value_);
+    nodes_[cur].value_ = 0;
 
-    mask = 1 << (BITS - 1);
     // Iterate in reverse to remove empty nodes
-    for (size_t i = 0; i < prefix_len; ++i) {
-      size_t index = (path & mask) ? 1 : 0;
-      mask >>= 1;
-      Node *parent = path_buffer_[i];
-      Node *child = parent->children_[index].get();
-      if (child->is_end_of_key_ || child->children_[0] || child->children_[1]) {
+    for (size_t i = prefix_len; i-- > 0;) {
+      size_t index = (path >> (BITS - 1 - i)) & 1;
+      Node &parent = nodes_[path_buffer_[i]];
+      uint32_t child = parent.children_[index];
+      const Node &child_node = nodes_[child];
+      if (child_node.value_ || child_node.children_[0] ||
+          child_node.children_[1]) {
         break;
       }
 
-      parent->children_[index].reset();
+      parent.children_[index] = 0;
+      free_node(child);
     }
 
     return true;
   }
 
+  /**
+   * @brief Write the whole trie with `writer` (see snapshot.hpp), to be
+   * restored as is by `load`.
+   */
+  template <typename Writer> void save(Writer &writer) const {
+    writer.write(nodes_);
+    writer.write(values_);
+    writer.write(free_nodes_);
+    writer.write(free_values_);
+  }
+
+  /**
+   * @brief Replace the trie with one written by `save`.
+   */
+  template <typename Reader> void load(Reader &reader) {
+    reader.read(nodes_);
+    reader.read(values_);
+    reader.read(free_nodes_);
+    reader.read(free_values_);
+  }
+
+  // Number of nodes in use, the root included
+  size_t node_count() const { return nodes_.size() - free_nodes_.size(); }
+
+  // Bytes allocated for the nodes and the values
+  size_t memory_usage() const {
+    return nodes_.capacity() * sizeof(Node) +
+           values_.capacity() * sizeof(Value) +
+           (free_nodes_.capacity() + free_values_.capacity()) *
+               sizeof(uint32_t);
+  }
+
+  /**
+   * @brief Walk the whole trie to gather its statistics.
+   * The lookup depth is averaged over paths spread evenly over the key space
+   * by a fixed SplitMix64 sequence, so that two tables are compared over the
+   * same paths.
+   *
+   * @param sample_size The number of paths looked up.
+   */
+  TrieStats<BITS> stats(size_t sample_size = STATS_SAMPLE_SIZE) const {
+    TrieStats<BITS> stats{};
+    stats.node_count = node_count();
+    stats.memory_usage = memory_usage();
+
+    // Depth first, the nodes left to visit along with their depth
+    std::vector<std::pair<uint32_t, size_t>> stack{{ROOT, 0}};
+    while (!stack.empty()) {
+      auto [cur, depth] = stack.back();
+      stack.pop_back();
+      const Node &node = nodes_[cur];
+      ++stats.nodes_per_depth[depth];
+      if (node.value_) {
+        ++stats.prefixes_per_length[depth];
+      }
+      stats.max_depth = std::max(stats.max_depth, depth);
+      for (uint32_t child : node.children_) {
+        if (child) {
+          stack.emplace_back(child, depth + 1);
+        }
+      }
+    }
+
+    uint64_t state = 0;
+    size_t total_depth = 0;
+    for (size_t i = 0; i < sample_size; ++i) {
+      state += 0x9e3779b97f4a7c15;
+      uint64_t path = state;
+      path = (path ^ (path >> 30)) * 0xbf58476d1ce4e5b9;
+      path = (path ^ (path >> 27)) * 0x94d049bb133111eb;
+      total_depth += lookup_depth(static_cast<Key>(path ^ (path >> 31)));
+    }
+    stats.average_lookup_depth =
+        sample_size ? static_cast<double>(total_depth) /
+                          static_cast<double>(sample_size)
+                    : 0;
+    return stats;
+  }
+
 private:
+  // Nodes reference each other (and their values) through 32-bit indices in
+  // the pools below instead of pointers, so the whole trie lives in a few
+  // contiguous blocks. Index 0 is the root for nodes, and means "none" for
+  // children (the root is never a child) and values (stored as index + 1).
   struct Node {
-    std::array<std::unique_ptr<Node>, 2> children_{nullptr, nullptr};
-    std::optional<Value> value_;
-    bool is_end_of_key_ = false;
+    std::array<uint32_t, 2> children_{0, 0};
+    uint32_t value_{0};
   };
 
-  std::unique_ptr<Node> root_{std::make_unique<Node>()};
-  std::vector<Node *> path_buffer_;
+  constexpr static uint32_t ROOT = 0;
+
+  // Number of leading bits shared by two prefixes
+  template <typename Prefix>
+  static size_t common_prefix_len(const Prefix &a, const Prefix &b) {
+    static_assert(BITS <= 64, "Keys are compared as 64-bit integers");
+    Key diff = a.path ^ b.path;
+    size_t common = diff ? __builtin_clzll(diff) - (64 - BITS) : BITS;
+    return std::min({common, size_t{a.prefix_len}, size_t{b.prefix_len}});
+  }
+
+  // Number of nodes longest_prefix_match goes through below the root
+  size_t lookup_depth(Key path) const {
+    uint32_t cur = ROOT;
+    size_t depth = 0;
+    for (; depth < BITS; ++depth) {
+      uint32_t child = nodes_[cur].children_[(path >> (BITS - 1 - depth)) & 1];
+      if (!child) {
+        break;
+      }
+      cur = child;
+    }
+    return depth;
+  }
+
+  uint32_t allocate_node() {
+    if (!free_nodes_.empty()) {
+      uint32_t node = free_nodes_.back();
+      free_nodes_.pop_back();
+      return node;
+    }
+    nodes_.emplace_back();
+    return static_cast<uint32_t>(nodes_.size() - 1);
+  }
+
+  void free_node(uint32_t node) {
+    nodes_[node] = Node{};
+    free_nodes_.push_back(node);
+  }
+
+  uint32_t allocate_value(Value value) {
+    if (!free_values_.empty()) {
+      uint32_t slot = free_values_.back();
+      free_values_.pop_back();
+      values_[slot - 1] = std::move(value);
+      return slot;
+    }
+    values_.push_back(std::move(value));
+    return static_cast<uint32_t>(values_.size());
+  }
+
+  void free_value(uint32_t slot) { free_values_.push_back(slot); }
+
+  memory::PageVector<Node> nodes_{Node{}};
+  std::vector<Value> values_{};
+  std::vector<uint32_t> free_nodes_{};
+  std::vector<uint32_t> free_values_{};
+  std::vector<uint32_t> path_buffer_;
 };
 
 } // namespace trie
\ No newline at end of file
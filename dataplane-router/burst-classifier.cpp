@@ -0,0 +1,194 @@
+#include "burst-classifier.hpp"
+#include "lib_wrapper.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace router {
+
+namespace {
+
+constexpr size_t MAX_FRAMES = BurstClasses::MAX_FRAMES;
+
+// Offsets of the fields checked, from the start of the frame
+constexpr size_t ETHER_TYPE_OFFSET = 12;
+constexpr size_t VERSION_IHL_OFFSET = ETHER_HDR_SIZE;
+constexpr size_t TTL_OFFSET = ETHER_HDR_SIZE + 8;
+constexpr size_t DEST_ADDR_OFFSET = ETHER_HDR_SIZE + 16;
+// Ethernet and IPv4 headers, without options
+constexpr size_t IPV4_HEADERS_SIZE = ETHER_HDR_SIZE + IP_HDR_SIZE;
+
+// The ethertypes as loaded from the frames, in network byte order
+constexpr uint32_t WIRE_ETHERTYPE_IP = util::hton(ETHERTYPE_IP);
+constexpr uint32_t WIRE_ETHERTYPE_ARP = util::hton(ETHERTYPE_ARP);
+// Version 4, with a header of 5 words
+constexpr uint32_t PLAIN_VERSION_IHL = 0x45;
+
+// The fields of a burst, one array per field, so that the fields of 8 frames
+// are loaded at once
+struct BurstHeaders {
+  // The ethertype in the low half, then the version/IHL byte and the TTL
+  alignas(32) std::array<uint32_t, MAX_FRAMES> words;
+  alignas(32) std::array<uint32_t, MAX_FRAMES> lengths;
+  alignas(32) std::array<uint32_t, MAX_FRAMES> dest_addrs;
+};
+
+// The fields missing from a frame too short for them are left 0, which
+// matches no class but the other one
+void gather_headers(tcb::span<const RxFrame> frames, BurstHeaders &headers) {
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const std::byte *data = frames[i].packet.data();
+    size_t size = frames[i].packet.size();
+    uint16_t ethertype = 0;
+    uint32_t word = 0;
+    uint32_t dest_addr = 0;
+    if (size >= ETHER_HDR_SIZE) {
+      std::memcpy(&ethertype, data + ETHER_TYPE_OFFSET, sizeof(ethertype));
+      word = ethertype;
+    }
+    if (size >= IPV4_HEADERS_SIZE) {
+      word |= std::to_integer<uint32_t>(data[VERSION_IHL_OFFSET]) << 16 |
+              std::to_integer<uint32_t>(data[TTL_OFFSET]) << 24;
+      std::memcpy(&dest_addr, data + DEST_ADDR_OFFSET, sizeof(dest_addr));
+    }
+    headers.words[i] = word;
+    headers.lengths[i] = static_cast<uint32_t>(std::min<size_t>(size, 0xffff));
+    headers.dest_addrs[i] = dest_addr;
+  }
+
+  // Up to the next 8 frames, so that the kernels never read uninitialized
+  // lanes
+  size_t padded = std::min((frames.size() + 7) & ~size_t{7}, MAX_FRAMES);
+  for (size_t i = frames.size(); i < padded; ++i) {
+    headers.words[i] = 0;
+    headers.lengths[i] = 0;
+    headers.dest_addrs[i] = 0;
+  }
+}
+
+// The frames of the burst, as a mask
+uint64_t valid_mask(size_t count) {
+  return count == MAX_FRAMES ? ~uint64_t{0} : (uint64_t{1} << count) - 1;
+}
+
+// Everything left is checked one frame at a time
+BurstClasses finish_classes(BurstClasses classes, size_t count) {
+  uint64_t valid = valid_mask(count);
+  classes.forward &= valid;
+  classes.local &= valid;
+  classes.arp &= valid;
+  classes.other = valid & ~(classes.forward | classes.local | classes.arp);
+  return classes;
+}
+
+using ClassifyKernel = BurstClasses (*)(const BurstHeaders &headers,
+                                        size_t count,
+                                        tcb::span<const uint32_t> local);
+
+BurstClasses classify_generic(const BurstHeaders &headers, size_t count,
+                              tcb::span<const uint32_t> local_addresses) {
+  BurstClasses classes{};
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t word = headers.words[i];
+    uint32_t ethertype = word & 0xffff;
+    bool complete = ethertype == WIRE_ETHERTYPE_IP &&
+                    headers.lengths[i] >= IPV4_HEADERS_SIZE;
+    bool local = complete && std::find(local_addresses.begin(),
+                                       local_addresses.end(),
+                                       headers.dest_addrs[i]) !=
+                                 local_addresses.end();
+    bool forward = complete && !local &&
+                   ((word >> 16) & 0xff) == PLAIN_VERSION_IHL &&
+                   (word >> 24) > 1;
+
+    uint64_t bit = uint64_t{1} << i;
+    classes.forward |= forward ? bit : 0;
+    classes.local |= local ? bit : 0;
+    classes.arp |= ethertype == WIRE_ETHERTYPE_ARP ? bit : 0;
+  }
+  return finish_classes(classes, count);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) uint64_t lanes_mask(__m256i lanes) {
+  return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(lanes)));
+}
+
+__attribute__((target("avx2"))) BurstClasses
+classify_avx2(const BurstHeaders &headers, size_t count,
+              tcb::span<const uint32_t> local_addresses) {
+  const __m256i low_half = _mm256_set1_epi32(0xffff);
+  const __m256i low_byte = _mm256_set1_epi32(0xff);
+  const __m256i ethertype_ip = _mm256_set1_epi32(WIRE_ETHERTYPE_IP);
+  const __m256i ethertype_arp = _mm256_set1_epi32(WIRE_ETHERTYPE_ARP);
+  const __m256i min_length = _mm256_set1_epi32(IPV4_HEADERS_SIZE - 1);
+  const __m256i plain_version_ihl = _mm256_set1_epi32(PLAIN_VERSION_IHL);
+  const __m256i min_ttl = _mm256_set1_epi32(1);
+
+  BurstClasses classes{};
+  for (size_t i = 0; i < count; i += 8) {
+    __m256i words = _mm256_load_si256(
+        reinterpret_cast<const __m256i *>(&headers.words[i]));
+    __m256i lengths = _mm256_load_si256(
+        reinterpret_cast<const __m256i *>(&headers.lengths[i]));
+    __m256i dest_addrs = _mm256_load_si256(
+        reinterpret_cast<const __m256i *>(&headers.dest_addrs[i]));
+
+    __m256i ethertypes = _mm256_and_si256(words, low_half);
+    __m256i complete =
+        _mm256_and_si256(_mm256_cmpeq_epi32(ethertypes, ethertype_ip),
+                         _mm256_cmpgt_epi32(lengths, min_length));
+
+    __m256i local = _mm256_setzero_si256();
+    for (uint32_t address : local_addresses) {
+      local = _mm256_or_si256(
+          local, _mm256_cmpeq_epi32(dest_addrs,
+                                    _mm256_set1_epi32(static_cast<int>(address))));
+    }
+    local = _mm256_and_si256(local, complete);
+
+    __m256i plain = _mm256_cmpeq_epi32(
+        _mm256_and_si256(_mm256_srli_epi32(words, 16), low_byte),
+        plain_version_ihl);
+    __m256i alive = _mm256_cmpgt_epi32(_mm256_srli_epi32(words, 24), min_ttl);
+    __m256i forward = _mm256_andnot_si256(
+        local, _mm256_and_si256(complete, _mm256_and_si256(plain, alive)));
+
+    classes.forward |= lanes_mask(forward) << i;
+    classes.local |= lanes_mask(local) << i;
+    classes.arp |=
+        lanes_mask(_mm256_cmpeq_epi32(ethertypes, ethertype_arp)) << i;
+  }
+  return finish_classes(classes, count);
+}
+#endif
+
+// Pick the AVX2 kernel if the CPU has it, before main runs
+ClassifyKernel select_kernel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return classify_avx2;
+  }
+#endif
+  return classify_generic;
+}
+
+const ClassifyKernel kernel = select_kernel();
+
+} // namespace
+
+BurstClasses classify_burst(tcb::span<const RxFrame> frames,
+                            tcb::span<const uint32_t> local_addresses) {
+  BurstHeaders headers;
+  gather_headers(frames, headers);
+  return kernel(headers, frames.size(), local_addresses);
+}
+
+} // namespace router
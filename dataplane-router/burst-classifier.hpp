@@ -0,0 +1,41 @@
+#pragma once
+
+#include "packet-buffer.hpp"
+#include "span.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace router {
+
+/**
+ * @brief The groups the frames of a burst fall in, as bitmasks of their
+ * indices, so that each group can be handled in its own loop.
+ */
+struct BurstClasses {
+  // Frames classified at once, one bit each
+  constexpr static size_t MAX_FRAMES = 64;
+
+  // IPv4 packets to be forwarded: long enough for their headers, without
+  // options, with a TTL above 1 and not destined to the router
+  uint64_t forward;
+  // IPv4 packets destined to one of the addresses of the router
+  uint64_t local;
+  uint64_t arp;
+  // The rest, to be checked one by one: the frames too short for their
+  // headers, the IPv4 packets with options or whose TTL expires, IPv6 and the
+  // unknown ethertypes
+  uint64_t other;
+};
+
+/**
+ * @brief Classify the frames of a burst from their headers, in one pass.
+ * The fields checked are first gathered from the frames into arrays, one per
+ * field, then compared for 8 frames at once with AVX2 when the CPU has it.
+ *
+ * @param frames At most BurstClasses::MAX_FRAMES frames
+ * @param local_addresses The IPv4 addresses of the router
+ */
+BurstClasses classify_burst(tcb::span<const RxFrame> frames,
+                            tcb::span<const uint32_t> local_addresses);
+
+} // namespace router
@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+"""Throughput benchmark of the routers, on the topology of the tests.
+
+Traffic is sent from h-0 to h-2, so it crosses router0 and router1, while
+h-1 pings h-3 through the same routers to measure the latency under load.
+Every combination of route table size and frame size is measured: the
+routers are restarted with a route table cut down to the size, the
+generator (iperf3 or pktgen) runs for the warmup and the window, and the
+frames forwarded are counted on the interface of h-2 during the window.
+"""
+import argparse
+import ipaddress
+import json
+import os
+import re
+import statistics
+import time
+
+import info
+
+BENCH_DIR = os.path.join(info.LOGDIR, "bench")
+IPERF_PORT = 5201
+# Ethernet + IPv4 + UDP headers, the frame sizes not counting the FCS
+UDP_OVERHEAD = 14 + 20 + 8
+MIN_FRAME = 60
+
+SENDER = 0
+RECEIVER = 2
+PING_SENDER = 1
+PING_RECEIVER = 3
+
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(prog="topo.py bench")
+    parser.add_argument("--sizes", default="64,128,512,1024,1514",
+                        help="frame sizes, in bytes")
+    parser.add_argument("--routes", default="100,10000,full",
+                        help="route table sizes, or full for the whole tables")
+    parser.add_argument("--generator", choices=["iperf3", "pktgen"],
+                        default="iperf3")
+    parser.add_argument("--streams", type=int, default=4,
+                        help="parallel iperf3 streams")
+    parser.add_argument("--warmup", type=float, default=2)
+    parser.add_argument("--duration", type=float, default=10,
+                        help="measurement window, in seconds")
+    parser.add_argument("--env", action="append", default=[],
+                        metavar="NAME=VALUE",
+                        help="environment variable of the routers")
+    parser.add_argument("--output", default=os.path.join(BENCH_DIR,
+                                                         "results.json"))
+    return parser.parse_args(argv)
+
+
+def topology_addresses():
+    addresses = [info.get("host_ip", h) for h in range(info.N_HOSTS)]
+    for i in range(info.N_ROUTERS):
+        for j in range(i + 1, info.N_ROUTERS):
+            addresses.append(info.get("r2r_ip1", i, j))
+            addresses.append(info.get("r2r_ip2", i, j))
+    return [ipaddress.ip_address(a) for a in addresses]
+
+
+def cut_rtable(router, size):
+    """Write the first `size` routes of the table of a router, keeping the
+    ones covering the addresses of the topology so that it still works."""
+    src = info.get("rtable", router)
+    if size == "full":
+        return src
+
+    addresses = topology_addresses()
+    needed, others = [], []
+    with open(src, "r") as fin:
+        for line in fin:
+            fields = line.split()
+            if len(fields) != 4:
+                continue
+            network = ipaddress.ip_network("{}/{}".format(fields[0], fields[2]),
+                                           strict=False)
+            if any(a in network for a in addresses):
+                needed.append(line)
+            else:
+                others.append(line)
+
+    routes = others[:max(int(size) - len(needed), 0)] + needed
+    dst = os.path.join(BENCH_DIR, "rtable{}-{}.txt".format(router, size))
+    with open(dst, "w") as fout:
+        fout.writelines(routes)
+    return dst
+
+
+def interface_counters(host, iface):
+    """Get the (rx_packets, tx_packets) of an interface of a host."""
+    for line in host.cmd("cat /proc/net/dev").splitlines():
+        name, _, counters = line.partition(":")
+        if name.strip() == iface:
+            fields = counters.split()
+            return int(fields[1]), int(fields[9])
+    raise RuntimeError("No interface {} on {}".format(iface, host))
+
+
+class Iperf3(object):
+    def __init__(self, nm, streams):
+        self.sender = nm.hosts[SENDER]
+        self.receiver = nm.hosts[RECEIVER]
+        self.streams = streams
+        self.receiver.cmd("iperf3 -s -D -p {}".format(IPERF_PORT))
+        time.sleep(1)
+
+    def start(self, frame_size, seconds):
+        payload = frame_size - UDP_OVERHEAD
+        cmd = "iperf3 -c {} -p {} -u -b 0 -l {} -P {} -t {} > /dev/null 2>&1 &"
+        self.sender.cmd(cmd.format(info.get("host_ip", RECEIVER), IPERF_PORT,
+                                   payload, self.streams, int(seconds + 1)))
+
+    def wait(self):
+        self.sender.cmd("while pgrep -f 'iperf3 -c' > /dev/null; "
+                        "do sleep 0.1; done")
+
+    def close(self):
+        self.receiver.cmd("pkill -f 'iperf3 -s'")
+
+
+class Pktgen(object):
+    """The kernel packet generator, configured through /proc/net/pktgen in
+    the namespace of the sender."""
+
+    def __init__(self, nm):
+        self.sender = nm.hosts[SENDER]
+        self.iface = info.get("host_if_name", SENDER)
+        self.sender.cmd("modprobe pktgen")
+        if "No such file" in self.sender.cmd("ls /proc/net/pktgen/pgctrl"):
+            raise RuntimeError("pktgen is not available")
+
+    def pgset(self, path, command):
+        self.sender.cmd("echo '{}' > /proc/net/pktgen/{}".format(command, path))
+
+    def start(self, frame_size, seconds):
+        self.pgset("kpktgend_0", "rem_device_all")
+        self.pgset("kpktgend_0", "add_device {}".format(self.iface))
+        for command in ["count 0", "delay 0", "clone_skb 0",
+                        # pktgen counts the FCS
+                        "pkt_size {}".format(frame_size + 4),
+                        "dst {}".format(info.get("host_ip", RECEIVER)),
+                        "dst_mac {}".format(info.get("router_mac", SENDER, 0)),
+                        "udp_dst_min 9", "udp_dst_max 9"]:
+            self.pgset(self.iface, command)
+        self.sender.cmd("timeout {} sh -c 'echo start > /proc/net/pktgen/pgctrl'"
+                        " > /dev/null 2>&1 &".format(seconds + 1))
+
+    def wait(self):
+        self.sender.cmd("while pgrep -f 'pktgen/pgctrl' > /dev/null; "
+                        "do sleep 0.1; done")
+        self.pgset("pgctrl", "stop")
+
+    def close(self):
+        self.pgset("kpktgend_0", "rem_device_all")
+
+
+def start_ping(nm, seconds, output):
+    cmd = "ping -i 0.01 -w {} {} > {} 2>&1 &"
+    nm.hosts[PING_SENDER].cmd(cmd.format(int(seconds),
+                                         info.get("host_ip", PING_RECEIVER),
+                                         output))
+
+
+def ping_latencies(output):
+    with open(output, "r") as fin:
+        return [float(t) for t in re.findall(r"time=([0-9.]+) ms", fin.read())]
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(int(len(ordered) * fraction), len(ordered) - 1)]
+
+
+def measure(nm, generator, frame_size, args):
+    receiver = nm.hosts[RECEIVER]
+    receiver_if = info.get("host_if_name", RECEIVER)
+    sender = nm.hosts[SENDER]
+    sender_if = info.get("host_if_name", SENDER)
+    ping_file = os.path.join(BENCH_DIR, "ping.txt")
+
+    generator.start(frame_size, args.warmup + args.duration)
+    time.sleep(args.warmup)
+
+    rx_start, _ = interface_counters(receiver, receiver_if)
+    _, tx_start = interface_counters(sender, sender_if)
+    start_ping(nm, args.duration, ping_file)
+    started = time.monotonic()
+    time.sleep(args.duration)
+    rx_end, _ = interface_counters(receiver, receiver_if)
+    _, tx_end = interface_counters(sender, sender_if)
+    elapsed = time.monotonic() - started
+
+    generator.wait()
+    nm.hosts[PING_SENDER].cmd("wait")
+
+    forwarded = rx_end - rx_start
+    sent = tx_end - tx_start
+    latencies = ping_latencies(ping_file)
+    return {
+        "frame_size": frame_size,
+        "mpps": forwarded / elapsed / 1e6,
+        "gbps": forwarded * frame_size * 8 / elapsed / 1e9,
+        "loss": 1 - forwarded / sent if sent else 0.0,
+        "latency_avg_ms": statistics.mean(latencies) if latencies else None,
+        "latency_p99_ms": percentile(latencies, 0.99) if latencies else None,
+    }
+
+
+def format_latency(value):
+    return "{:.3f}".format(value) if value is not None else "-"
+
+
+def run(nm, argv):
+    args = parse_args(argv)
+    sizes = [max(int(s), MIN_FRAME) for s in args.sizes.split(",")]
+    env = "".join("{} ".format(e) for e in args.env)
+    os.makedirs(BENCH_DIR, exist_ok=True)
+
+    if args.generator == "pktgen":
+        generator = Pktgen(nm)
+    else:
+        generator = Iperf3(nm, args.streams)
+
+    results = []
+    print("{:>8} {:>6} {:>8} {:>8} {:>7} {:>9} {:>9}".format(
+        "routes", "size", "Mpps", "Gbps", "loss", "avg ms", "p99 ms"))
+    try:
+        for routes in args.routes.split(","):
+            rtables = [cut_rtable(i, routes) for i in range(info.N_ROUTERS)]
+            nm.stop_routers()
+            nm.start_routers(rtables=rtables, env=env)
+            # Resolve the next hops before measuring
+            for h in (SENDER, PING_SENDER):
+                nm.hosts[h].cmd("ping -c 3 -i 0.2 {}".format(
+                    info.get("host_ip", h + 2)))
+
+            for size in sizes:
+                result = measure(nm, generator, size, args)
+                result["routes"] = routes
+                results.append(result)
+                print("{:>8} {:>6} {:>8.3f} {:>8.3f} {:>6.1%} {:>9} {:>9}".format(
+                    routes, size, result["mpps"], result["gbps"],
+                    result["loss"], format_latency(result["latency_avg_ms"]),
+                    format_latency(result["latency_p99_ms"])), flush=True)
+    finally:
+        generator.close()
+        nm.stop_routers()
+
+    with open(args.output, "w") as fout:
+        json.dump({"generator": args.generator, "env": args.env,
+                   "results": results}, fout, indent=2)
+    print("\nResults written to {}".format(args.output))
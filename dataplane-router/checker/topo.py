@@ -192,7 +192,7 @@ class FullNM(object):
         self.add_hosts_entries()
         self.add_default_routes()
 
-    def start_routers(self):
+    def start_routers(self, rtables=None, env=""):
         ifaces = ""
         for i in range(len(self.routers)):
             for j in range(i + 1, len(self.routers)):
@@ -204,21 +204,28 @@ class FullNM(object):
         for i, (router, _) in enumerate(self.routers):
             out = info.get("out_file", i)
             err = info.get("err_file", i)
-            rtable = info.get("rtable", i)
+            rtable = rtables[i] if rtables else info.get("rtable", i)
             rname = "router{}".format(i)
             router.cmd("ln -s build/router {}".format(rname))
             if not len(router.cmd("pgrep {}".format(rname))):
-                cmd = "./{} {} {} > {} 2> {} &".format(rname, rtable, ifaces,
-                                                       out, err)
+                cmd = "{}./{} {} {} > {} 2> {} &".format(env, rname, rtable,
+                                                         ifaces, out, err)
                 router.cmd(cmd)
 
             if int(router.cmd("ps -aux | grep {} | wc -l".format(rname))) == 1:
-                cmd = 'bash -c "exec -a {} ./router {} {} > {} 2> {} &"'.format(rname, rtable, ifaces,
+                cmd = '{}bash -c "exec -a {} ./router {} {} > {} 2> {} &"'.format(env, rname, rtable, ifaces,
                                                 out, err)
                 print("Starting {}".format(rname))
                 router.cmd(cmd)
         time.sleep(2)
 
+    def stop_routers(self):
+        for i, (router, _) in enumerate(self.routers):
+            # Started either through the symlink or under its name
+            pattern = "'^(\\./)?router{} '".format(i)
+            router.cmd("pkill -f {}".format(pattern))
+            router.cmd("while pgrep -f {} > /dev/null; do sleep 0.1; done".format(pattern))
+
     def setup_capture(self, testname, log):
         nr = len(self.routers)
         for i, (router, hosts) in enumerate(self.routers):
@@ -329,7 +336,7 @@ def should_skip(testname):
     return False
 
 
-def main(run_tests=False, run=None):
+def main(run_tests=False, run=None, bench_args=None):
     topo = FullTopo(nr=info.N_ROUTERS, nh=info.N_HOSTSEACH)
 
     net = Mininet(topo, controller=None, link = Link)
@@ -366,6 +373,9 @@ def main(run_tests=False, run=None):
             total_points += current_points
 
         print(f"\nTOTAL: {round(total_points)}/100")
+    elif bench_args is not None:
+        import bench
+        bench.run(nm, bench_args)
     elif run is not None:
         print("{:=^80}\n".format(f" Running test \"{run}\" "))
         results = nm.run_test(run)
@@ -388,6 +398,8 @@ if __name__ == "__main__":
         testname = sys.argv[2]
         assert(testname in tests.TESTS.keys()), "Unknown test name!"
         main(run=testname)
+    elif len(sys.argv) > 1 and sys.argv[1] == "bench":
+        main(bench_args=sys.argv[2:])
     else:
         setLogLevel("info")
         main()
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "page-allocator.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace lpm {
+
+/**
+ * @brief DIR-24-8 longest prefix match table for 32-bit keys.
+ *
+ * The first level (tbl24) has one entry for every value of the 24 most
+ * significant bits of the key. Prefixes up to /24 are expanded directly in
+ * tbl24, so most lookups take a single memory access. Entries covered by a
+ * longer prefix point to a 256-entry group in the second level (tbl8), that is
+ * indexed by the last 8 bits of the key.
+ *
+ * Every entry is a 32-bit word:
+ * - bit 31: the entry is valid
+ * - bit 30: the entry points to a tbl8 group (only in tbl24)
+ * - bits 24-29: the length of the prefix owning the entry
+ * - bits 0-23: the index of the value or of the tbl8 group
+ *
+ * The table needs 64MB for tbl24 and 1KB for every tbl8 group.
+ */
+template <typename Value> class Dir24_8 {
+  constexpr static size_t TBL24_SIZE = size_t{1} << 24;
+  // Number of lookups interleaved by longest_prefix_match_batch
+  constexpr static size_t BATCH_SIZE = 16;
+  constexpr static size_t TBL8_GROUP_SIZE = size_t{1} << 8;
+
+  constexpr static uint32_t VALID = uint32_t{1} << 31;
+  constexpr static uint32_t EXTENDED = uint32_t{1} << 30;
+  constexpr static uint32_t DEPTH_SHIFT = 24;
+  constexpr static uint32_t DEPTH_MASK = 0x3f;
+  constexpr static uint32_t INDEX_MASK = (uint32_t{1} << 24) - 1;
+
+public:
+  Dir24_8() : tbl24_(TBL24_SIZE, 0) {}
+
+  /**
+   * @brief Insert a value for the prefix of length `prefix_len` of `path`.
+   * Prefixes can be inserted in any order, longer prefixes always taking
+   * precedence over the shorter ones that cover them.
+   *
+   * @param path The prefix, in host byte order.
+   * @param prefix_len The length of the prefix in bits.
+   * @param value The value to insert.
+   *
+   * @throws std::length_error if the table runs out of value or group indices
+   */
+  void insert(uint32_t path, size_t prefix_len, Value value) {
+    if (prefix_len == 0) {
+      default_value_ = std::move(value);
+      return;
+    }
+
+    if (values_.size() > INDEX_MASK) {
+      throw std::length_error("DIR-24-8 table is full");
+    }
+    values_.push_back(std::move(value));
+    uint32_t entry = make_entry(values_.size() - 1, prefix_len);
+
+    if (prefix_len <= 24) {
+      size_t count = size_t{1} << (24 - prefix_len);
+      size_t first = (path >> 8) & ~(count - 1);
+
+      for (size_t i = first; i < first + count; ++i) {
+        if (tbl24_[i] & EXTENDED) {
+          // Update the entries of the group that are not owned by a longer
+          // prefix
+          size_t group = tbl24_[i] & INDEX_MASK;
+          for (size_t j = 0; j < TBL8_GROUP_SIZE; ++j) {
+            update_entry(tbl8_[group * TBL8_GROUP_SIZE + j], entry);
+          }
+        } else {
+          update_entry(tbl24_[i], entry);
+        }
+      }
+      return;
+    }
+
+    uint32_t &tbl24_entry = tbl24_[path >> 8];
+    if (!(tbl24_entry & EXTENDED)) {
+      tbl24_entry = VALID | EXTENDED | allocate_group(tbl24_entry);
+    }
+
+    size_t count = size_t{1} << (32 - prefix_len);
+    size_t first = (tbl24_entry & INDEX_MASK) * TBL8_GROUP_SIZE +
+                   ((path & 0xff) & ~(count - 1));
+    for (size_t i = first; i < first + count; ++i) {
+      update_entry(tbl8_[i], entry);
+    }
+  }
+
+  /**
+   * @brief Insert a range of prefixes, in order.
+   * Provided for the same bulk interface as trie::BinaryTrie::build, the
+   * order of the inserts not mattering here.
+   *
+   * @param first, last The prefixes, as elements with `path`, `prefix_len`
+   * and `value` members
+   *
+   * @throws std::length_error if the table runs out of value or group indices
+   */
+  template <typename It> void build(It first, It last) {
+    values_.reserve(values_.size() + std::distance(first, last));
+    for (It it = first; it != last; ++it) {
+      insert(it->path, it->prefix_len, it->value);
+    }
+  }
+
+  /**
+   * @brief Find the longest prefix match for a given key.
+   *
+   * @param path The key to search for, in host byte order.
+   * @return The value associated with the longest prefix match, or
+   * std::nullopt if no match is found.
+   */
+  std::optional<Value> longest_prefix_match(uint32_t path) const {
+    uint32_t entry = tbl24_[path >> 8];
+    if (entry & EXTENDED) {
+      entry = tbl8_[(entry & INDEX_MASK) * TBL8_GROUP_SIZE + (path & 0xff)];
+    }
+
+    if (entry & VALID) {
+      return values_[entry & INDEX_MASK];
+    }
+    return default_value_;
+  }
+
+  /**
+   * @brief Find the longest prefix match of several keys.
+   * The tbl24 entries of a group of BATCH_SIZE keys are all prefetched before
+   * any of them is read, then the tbl8 entries the group needs, so that the
+   * cache misses of the different keys overlap instead of adding up.
+   *
+   * @param paths The keys to search for, in host byte order.
+   * @param results Receives the result of `longest_prefix_match` for each
+   * key.
+   * @param count The number of keys.
+   */
+  void longest_prefix_match_batch(const uint32_t *paths,
+                                  std::optional<Value> *results,
+                                  size_t count) const {
+    for (size_t first = 0; first < count; first += BATCH_SIZE) {
+      size_t size = std::min(BATCH_SIZE, count - first);
+      for (size_t i = 0; i < size; ++i) {
+        __builtin_prefetch(&tbl24_[paths[first + i] >> 8]);
+      }
+
+      std::array<uint32_t, BATCH_SIZE> entries;
+      for (size_t i = 0; i < size; ++i) {
+        uint32_t path = paths[first + i];
+        entries[i] = tbl24_[path >> 8];
+        if (entries[i] & EXTENDED) {
+          __builtin_prefetch(
+              &tbl8_[(entries[i] & INDEX_MASK) * TBL8_GROUP_SIZE + (path & 0xff)]);
+        }
+      }
+
+      for (size_t i = 0; i < size; ++i) {
+        uint32_t entry = entries[i];
+        if (entry & EXTENDED) {
+          entry = tbl8_[(entry & INDEX_MASK) * TBL8_GROUP_SIZE +
+                        (paths[first + i] & 0xff)];
+        }
+        results[first + i] = entry & VALID
+                                 ? std::optional<Value>{values_[entry & INDEX_MASK]}
+                                 : default_value_;
+      }
+    }
+  }
+
+  /**
+   * @brief Write the whole table with `writer` (see snapshot.hpp), to be
+   * restored as is by `load`.
+   */
+  template <typename Writer> void save(Writer &writer) const {
+    writer.write(tbl24_);
+    writer.write(tbl8_);
+    writer.write(values_);
+    writer.write(default_value_);
+  }
+
+  /**
+   * @brief Replace the table with one written by `save`.
+   */
+  template <typename Reader> void load(Reader &reader) {
+    reader.read(tbl24_);
+    reader.read(tbl8_);
+    reader.read(values_);
+    reader.read(default_value_);
+  }
+
+  // Bytes allocated for tbl24, the tbl8 groups and the values
+  size_t memory_usage() const {
+    return (tbl24_.capacity() + tbl8_.capacity()) * sizeof(uint32_t) +
+           values_.capacity() * sizeof(Value);
+  }
+
+private:
+  static constexpr uint32_t make_entry(size_t index, size_t prefix_len) {
+    return VALID | (static_cast<uint32_t>(prefix_len) << DEPTH_SHIFT) |
+           static_cast<uint32_t>(index);
+  }
+
+  static constexpr uint32_t depth(uint32_t entry) {
+    return (entry >> DEPTH_SHIFT) & DEPTH_MASK;
+  }
+
+  // Overwrite `slot` unless it is owned by a longer prefix than `entry`
+  static void update_entry(uint32_t &slot, uint32_t entry) {
+    if (!(slot & VALID) || depth(slot) <= depth(entry)) {
+      slot = entry;
+    }
+  }
+
+  // Allocate a tbl8 group whose entries all inherit the given tbl24 entry and
+  // return its index
+  uint32_t allocate_group(uint32_t inherited_entry) {
+    size_t group = tbl8_.size() / TBL8_GROUP_SIZE;
+    if (group > INDEX_MASK) {
+      throw std::length_error("DIR-24-8 tbl8 groups exhausted");
+    }
+    tbl8_.resize(tbl8_.size() + TBL8_GROUP_SIZE, inherited_entry);
+    return static_cast<uint32_t>(group);
+  }
+
+  memory::PageVector<uint32_t> tbl24_;
+  memory::PageVector<uint32_t> tbl8_{};
+  std::vector<Value> values_{};
+  std::optional<Value> default_value_{};
+};
+
+} // namespace lpm
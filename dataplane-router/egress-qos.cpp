@@ -0,0 +1,237 @@
+#include "egress-qos.hpp"
+#include "ipv6.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace router {
+
+static_assert((EgressScheduler::CLASS_QUEUE_SIZE &
+               (EgressScheduler::CLASS_QUEUE_SIZE - 1)) == 0,
+              "The slots of the rings are indexed with a mask");
+
+namespace {
+
+constexpr size_t SLOT_MASK = EgressScheduler::CLASS_QUEUE_SIZE - 1;
+
+// Offsets of the fields holding the DSCP, from the start of the frame
+constexpr size_t ETHER_TYPE_OFFSET = 12;
+constexpr size_t IPV4_TOS_OFFSET = ETHER_HDR_SIZE + 1;
+constexpr size_t IPV6_TRAFFIC_CLASS_OFFSET = ETHER_HDR_SIZE;
+
+// The code points of RFC 4594 not following the class selectors
+constexpr uint8_t DSCP_LE = 1;
+constexpr uint8_t DSCP_CS1 = 8;
+
+} // namespace
+
+TrafficClass traffic_class(uint8_t dscp) {
+  if (dscp == DSCP_LE || dscp == DSCP_CS1) {
+    return TrafficClass::SCAVENGER;
+  }
+  // The class selector, i.e. the old IP precedence
+  switch (dscp >> 3) {
+  case 6:
+  case 7:
+    return TrafficClass::NETWORK_CONTROL;
+  case 5:
+    return TrafficClass::REALTIME;
+  case 1:
+  case 2:
+  case 3:
+  case 4:
+    return TrafficClass::ASSURED;
+  default:
+    return TrafficClass::BEST_EFFORT;
+  }
+}
+
+TrafficClass frame_traffic_class(tcb::span<const std::byte> frame) {
+  if (frame.size() < ETHER_HDR_SIZE + sizeof(uint16_t)) {
+    return TrafficClass::NETWORK_CONTROL;
+  }
+  auto byte = [&](size_t offset) {
+    return std::to_integer<uint8_t>(frame[offset]);
+  };
+  switch (byte(ETHER_TYPE_OFFSET) << 8 | byte(ETHER_TYPE_OFFSET + 1)) {
+  case ETHERTYPE_IP:
+    return traffic_class(byte(IPV4_TOS_OFFSET) >> 2);
+  case ETHERTYPE_IPV6: {
+    // The traffic class straddles the first two bytes, after the version
+    uint8_t tc = byte(IPV6_TRAFFIC_CLASS_OFFSET) << 4 |
+                 byte(IPV6_TRAFFIC_CLASS_OFFSET + 1) >> 4;
+    return traffic_class(tc >> 2);
+  }
+  default:
+    return TrafficClass::NETWORK_CONTROL;
+  }
+}
+
+EgressScheduler::EgressScheduler(const EgressQosConfig &config) {
+  for (auto &queue : queues_) {
+    queue.copies.resize(CLASS_QUEUE_SIZE * MAX_PACKET_LEN);
+  }
+  for (size_t i = 0; i < DRR_CLASS_COUNT; ++i) {
+    quanta_[i] = size_t{std::max(config.weights[i], 1u)} * MAX_PACKET_LEN;
+  }
+  if (config.rate > 0) {
+    ns_per_byte_ = 8e9 / static_cast<double>(config.rate);
+    tolerance_ = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::nano>(config.burst * ns_per_byte_));
+  }
+}
+
+bool EgressScheduler::enqueue(char *frame, size_t length,
+                              const vnet_hdr *offload, bool copy) {
+  size_t cls = static_cast<size_t>(frame_traffic_class(
+      {reinterpret_cast<const std::byte *>(frame), length}));
+  ClassQueue &queue = queues_[cls];
+  if (queue.count == CLASS_QUEUE_SIZE) {
+    return false;
+  }
+
+  size_t index = (queue.head + queue.count) & SLOT_MASK;
+  Slot &slot = queue.slots[index];
+  if (copy) {
+    slot.frame = reinterpret_cast<char *>(queue.copies.data() +
+                                          index * MAX_PACKET_LEN);
+    std::memcpy(slot.frame, frame, length);
+  } else {
+    slot.frame = frame;
+  }
+  slot.length = length;
+  slot.copied = copy;
+  slot.has_offload = offload != nullptr;
+  if (offload) {
+    // Whether the checksum was verified only matters on the way in
+    slot.offload = *offload;
+    slot.offload.flags &= ~VNET_HDR_F_DATA_VALID;
+  } else {
+    slot.offload = {};
+  }
+
+  ++queue.count;
+  ++queued_;
+  if (cls >= STRICT_CLASS_COUNT) {
+    ++drr_queued_;
+  }
+  return true;
+}
+
+size_t EgressScheduler::next_class() {
+  for (size_t cls = 0; cls < STRICT_CLASS_COUNT; ++cls) {
+    if (queues_[cls].count > 0) {
+      return cls;
+    }
+  }
+  if (drr_queued_ == 0) {
+    return TRAFFIC_CLASS_COUNT;
+  }
+  // Every round adds to the deficit of the classes holding frames, so one of
+  // them ends up with enough for its head, however long
+  while (true) {
+    ClassQueue &queue = queues_[STRICT_CLASS_COUNT + current_];
+    if (queue.count > 0) {
+      if (!granted_) {
+        queue.deficit += quanta_[current_];
+        granted_ = true;
+      }
+      if (queue.slots[queue.head].length <= queue.deficit) {
+        return STRICT_CLASS_COUNT + current_;
+      }
+    }
+    current_ = (current_ + 1) % DRR_CLASS_COUNT;
+    granted_ = false;
+  }
+}
+
+bool EgressScheduler::shaper_allows(Clock::time_point now) const {
+  // The last frame sent may take the bucket below empty, so that a frame
+  // longer than the burst still goes out
+  return ns_per_byte_ == 0 || next_send_ - now <= tolerance_;
+}
+
+void EgressScheduler::take_tokens(size_t length, Clock::time_point now) {
+  if (ns_per_byte_ == 0) {
+    return;
+  }
+  next_send_ = std::max(next_send_, now) +
+               std::chrono::duration_cast<Clock::duration>(
+                   std::chrono::duration<double, std::nano>(
+                       static_cast<double>(length) * ns_per_byte_));
+}
+
+size_t EgressScheduler::dequeue(char *frames[], size_t lengths[],
+                                vnet_hdr offloads[], size_t max,
+                                bool &has_offloads, Clock::time_point now) {
+  size_t count = 0;
+  while (count < max && shaper_allows(now)) {
+    size_t cls = next_class();
+    if (cls == TRAFFIC_CLASS_COUNT) {
+      break;
+    }
+
+    ClassQueue &queue = queues_[cls];
+    const Slot &slot = queue.slots[queue.head];
+    frames[count] = slot.frame;
+    lengths[count] = slot.length;
+    offloads[count] = slot.offload;
+    has_offloads |= slot.has_offload;
+    ++count;
+    take_tokens(slot.length, now);
+
+    queue.head = (queue.head + 1) & SLOT_MASK;
+    --queue.count;
+    --queued_;
+    if (cls >= STRICT_CLASS_COUNT) {
+      --drr_queued_;
+      queue.deficit -= slot.length;
+      // An empty class does not keep its deficit for the next round
+      if (queue.count == 0) {
+        queue.deficit = 0;
+        current_ = (current_ + 1) % DRR_CLASS_COUNT;
+        granted_ = false;
+      }
+    }
+  }
+  return count;
+}
+
+size_t EgressScheduler::retain() {
+  size_t dropped = 0;
+  for (size_t cls = 0; cls < TRAFFIC_CLASS_COUNT; ++cls) {
+    ClassQueue &queue = queues_[cls];
+    // The frames kept are packed from the head, moving the copies along with
+    // their slots
+    size_t kept = 0;
+    for (size_t i = 0; i < queue.count; ++i) {
+      Slot slot = queue.slots[(queue.head + i) & SLOT_MASK];
+      if (!slot.copied && slot.length > MAX_PACKET_LEN) {
+        continue;
+      }
+      size_t index = (queue.head + kept) & SLOT_MASK;
+      char *copy = reinterpret_cast<char *>(queue.copies.data() +
+                                            index * MAX_PACKET_LEN);
+      if (slot.frame != copy) {
+        std::memmove(copy, slot.frame, slot.length);
+        slot.frame = copy;
+        slot.copied = true;
+      }
+      queue.slots[index] = slot;
+      ++kept;
+    }
+
+    size_t lost = queue.count - kept;
+    queue.count = kept;
+    queued_ -= lost;
+    if (cls >= STRICT_CLASS_COUNT) {
+      drr_queued_ -= lost;
+      if (kept == 0) {
+        queue.deficit = 0;
+      }
+    }
+    dropped += lost;
+  }
+  return dropped;
+}
+
+} // namespace router
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "lib_wrapper.hpp"
+#include "span.hpp"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief The classes the frames sent on an interface are queued in, from
+ * their DSCP. The first STRICT_CLASS_COUNT classes are served in strict
+ * priority, the others share what is left by deficit round robin.
+ */
+enum class TrafficClass : uint8_t {
+  // CS6 and CS7 (routing protocols), and the frames without an IP header,
+  // such as ARP
+  NETWORK_CONTROL,
+  // CS5, VOICE-ADMIT and EF: the latency-sensitive traffic
+  REALTIME,
+  // CS2 to CS4 and the AF classes
+  ASSURED,
+  // Default forwarding (0), and the code points not listed here
+  BEST_EFFORT,
+  // CS1 and LE: the bulk traffic, below best effort
+  SCAVENGER,
+  COUNT,
+};
+
+constexpr size_t TRAFFIC_CLASS_COUNT = static_cast<size_t>(TrafficClass::COUNT);
+constexpr size_t STRICT_CLASS_COUNT = 2;
+constexpr size_t DRR_CLASS_COUNT = TRAFFIC_CLASS_COUNT - STRICT_CLASS_COUNT;
+
+/**
+ * @brief Get the class of a DSCP, following the service classes of RFC 4594.
+ */
+TrafficClass traffic_class(uint8_t dscp);
+
+/**
+ * @brief Get the class of an Ethernet frame, from the DSCP of its IPv4 or
+ * IPv6 header.
+ */
+TrafficClass frame_traffic_class(tcb::span<const std::byte> frame);
+
+// Configuration of the egress QoS, the same for every interface
+struct EgressQosConfig {
+  // Weights of the classes served by deficit round robin (ASSURED,
+  // BEST_EFFORT and SCAVENGER), each getting as many quanta of
+  // MAX_PACKET_LEN bytes per round
+  std::array<uint32_t, DRR_CLASS_COUNT> weights{4, 2, 1};
+  // Rate every interface is shaped to, in bits per second (0 for no
+  // shaping), and the bytes that can be sent at once above it
+  uint64_t rate = 0;
+  uint32_t burst = 64 * 1024;
+};
+
+/**
+ * @brief The egress queues of an interface: one queue per traffic class,
+ * drained in strict priority for NETWORK_CONTROL and REALTIME, then by
+ * deficit round robin for the other classes, and optionally shaped by a
+ * token bucket.
+ *
+ * The token bucket is a single deadline, like those of IcmpRateLimiter: every
+ * frame sent moves it by its transmission time at the shaping rate, and the
+ * bucket is empty once it runs ahead of the current time by more than the
+ * burst. The frames left behind stay in their queues, to be sent by a later
+ * dequeue, and a queue that fills up drops the frames of its class only.
+ * Like TxQueues, which holds one scheduler per interface when the QoS is
+ * enabled, the schedulers are not synchronized.
+ */
+class EgressScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Frames held by the queue of a class
+  constexpr static size_t CLASS_QUEUE_SIZE = 64;
+
+  explicit EgressScheduler(const EgressQosConfig &config);
+
+  /**
+   * @brief Queue a frame in the queue of its class.
+   *
+   * @param copy Whether to copy the frame right away, its buffer being reused
+   * as soon as the call returns. Otherwise, the frame must stay valid until
+   * the next call to `retain`. Copied frames cannot be longer than
+   * MAX_PACKET_LEN.
+   * @return false if the queue of the class is full, the frame not being
+   * queued
+   */
+  bool enqueue(char *frame, size_t length, const vnet_hdr *offload,
+               bool copy);
+
+  /**
+   * @brief Take the next frames to be sent, in the order of the scheduling,
+   * until the shaper runs out of tokens. The frames taken stay valid until
+   * the next call to `enqueue`.
+   *
+   * @param max Size of the arrays, at most as many frames being taken
+   * @param has_offloads Set if one of the frames taken has offload metadata
+   * @return The number of frames taken
+   */
+  size_t dequeue(char *frames[], size_t lengths[], vnet_hdr offloads[],
+                 size_t max, bool &has_offloads, Clock::time_point now);
+
+  /**
+   * @brief Copy the frames left in the queues whose buffers are about to be
+   * reused. The super-frames, too long for the queues to hold, are dropped.
+   *
+   * @return The number of frames dropped
+   */
+  size_t retain();
+
+  size_t queued() const { return queued_; }
+
+private:
+  struct Slot {
+    char *frame;
+    size_t length;
+    vnet_hdr offload;
+    bool has_offload;
+    // Whether the frame is in the buffer of its slot
+    bool copied;
+  };
+
+  // A ring of slots, each with a buffer of MAX_PACKET_LEN bytes for its copy
+  struct ClassQueue {
+    std::array<Slot, CLASS_QUEUE_SIZE> slots{};
+    size_t head = 0;
+    size_t count = 0;
+    std::vector<std::byte> copies;
+    // The bytes the class can still send in the current round (DRR classes
+    // only)
+    size_t deficit = 0;
+  };
+
+  // The class whose head is sent next, TRAFFIC_CLASS_COUNT if none
+  size_t next_class();
+  bool shaper_allows(Clock::time_point now) const;
+  void take_tokens(size_t length, Clock::time_point now);
+
+  std::array<ClassQueue, TRAFFIC_CLASS_COUNT> queues_;
+  // Bytes added to the deficit of each DRR class per round
+  std::array<size_t, DRR_CLASS_COUNT> quanta_;
+  // The DRR class being served, and whether it already got its quantum for
+  // this round
+  size_t current_ = 0;
+  bool granted_ = false;
+  size_t drr_queued_ = 0;
+  size_t queued_ = 0;
+  // Transmission time of a byte at the shaping rate, and how far the bucket
+  // can run ahead of the current time, in ns (0 for no shaping)
+  double ns_per_byte_ = 0;
+  Clock::duration tolerance_{};
+  Clock::time_point next_send_{};
+};
+
+} // namespace router
@@ -0,0 +1,361 @@
+#include "fib-sync.hpp"
+#include "lib_wrapper.hpp"
+#include "logger.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace router {
+
+namespace {
+
+// Large enough for a dump message, which takes up to a page (or 32KB)
+constexpr size_t BUFFER_SIZE = 1 << 16;
+// Receive buffer of the notifications, for a convergence event to fit in it
+// while a batch is applied
+constexpr int EVENTS_BUFFER_SIZE = 16 << 20;
+// Time the background thread waits for notifications when none is pending
+constexpr int IDLE_POLL_MS = 100;
+
+[[noreturn]] void throw_errno(const std::string &what) {
+  throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+int open_socket(uint32_t groups) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1) {
+    throw_errno("Cannot open a netlink socket");
+  }
+  sockaddr_nl address{};
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = groups;
+  if (bind(fd, reinterpret_cast<const sockaddr *>(&address),
+           sizeof(address)) == -1) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    throw_errno("Cannot bind a netlink socket");
+  }
+  return fd;
+}
+
+uint32_t read_u32(const rtattr *attr) {
+  uint32_t value = 0;
+  std::memcpy(&value, RTA_DATA(attr),
+              std::min<size_t>(RTA_PAYLOAD(attr), sizeof(value)));
+  return value;
+}
+
+uint64_t prefix_key(uint32_t prefix, uint32_t mask) {
+  return uint64_t{prefix} << 32 | mask;
+}
+
+} // namespace
+
+FibSync::FibSync(RoutingTable &rtable, const Config &config)
+    : rtable_(rtable), config_(config), buffer_(BUFFER_SIZE) {
+  for (size_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+    ifindices_[i] = get_interface_ifindex(i);
+  }
+  events_fd_ = open_socket(RTMGRP_IPV4_ROUTE);
+  try {
+    // Forcing the size needs CAP_NET_ADMIN, it is capped by
+    // net.core.rmem_max otherwise
+    int size = EVENTS_BUFFER_SIZE;
+    if (setsockopt(events_fd_, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+                   sizeof(size)) == -1) {
+      setsockopt(events_fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    dump_fd_ = open_socket(0);
+  } catch (...) {
+    close(events_fd_);
+    throw;
+  }
+  // After subscribing, so that no change is missed between the dump and the
+  // notifications. The notifications received before the dump are applied
+  // after it, which is harmless as each one sets the whole state of a route.
+  try {
+    dump();
+  } catch (...) {
+    close(events_fd_);
+    close(dump_fd_);
+    throw;
+  }
+  thread_ = std::thread(&FibSync::run, this);
+}
+
+FibSync::~FibSync() {
+  stopping_.store(true);
+  thread_.join();
+  close(events_fd_);
+  close(dump_fd_);
+}
+
+bool FibSync::parse_route(const void *message, size_t size,
+                          Route &route) const {
+  if (size < NLMSG_LENGTH(sizeof(rtmsg))) {
+    return false;
+  }
+  const auto *header = static_cast<const nlmsghdr *>(message);
+  const auto *rtm = static_cast<const rtmsg *>(NLMSG_DATA(header));
+  if (rtm->rtm_family != AF_INET || rtm->rtm_dst_len > 32) {
+    return false;
+  }
+
+  uint32_t table = rtm->rtm_table;
+  uint32_t dest = 0;
+  uint32_t gateway = 0;
+  int oif = 0;
+  const rtattr *multipath = nullptr;
+  route.metric = 0;
+  int length = static_cast<int>(RTM_PAYLOAD(header));
+  for (const rtattr *attr = RTM_RTA(rtm); RTA_OK(attr, length);
+       attr = RTA_NEXT(attr, length)) {
+    switch (attr->rta_type) {
+    case RTA_TABLE:
+      table = read_u32(attr);
+      break;
+    case RTA_DST:
+      dest = read_u32(attr);
+      break;
+    case RTA_GATEWAY:
+      gateway = read_u32(attr);
+      break;
+    case RTA_OIF:
+      oif = static_cast<int>(read_u32(attr));
+      break;
+    case RTA_PRIORITY:
+      route.metric = read_u32(attr);
+      break;
+    case RTA_MULTIPATH:
+      multipath = attr;
+      break;
+    }
+  }
+  if (table != config_.table) {
+    return false;
+  }
+
+  route.mask = rtm->rtm_dst_len == 0
+                   ? 0
+                   : util::hton(~uint32_t{0} << (32 - rtm->rtm_dst_len));
+  route.prefix = dest & route.mask;
+  route.paths.clear();
+  if (rtm->rtm_type != RTN_UNICAST) {
+    return true;
+  }
+
+  auto add_path = [&](uint32_t next_hop, int ifindex) {
+    auto it = std::find(ifindices_.begin(), ifindices_.end(), ifindex);
+    if (next_hop == 0 || it == ifindices_.end()) {
+      return;
+    }
+    route.paths.push_back(
+        {.prefix = route.prefix,
+         .next_hop = next_hop,
+         .mask = route.mask,
+         .interface = static_cast<int>(it - ifindices_.begin())});
+  };
+  if (!multipath) {
+    add_path(gateway, oif);
+    return true;
+  }
+  const auto *nexthop = static_cast<const rtnexthop *>(RTA_DATA(multipath));
+  int remaining = static_cast<int>(RTA_PAYLOAD(multipath));
+  while (RTNH_OK(nexthop, remaining)) {
+    uint32_t path_gateway = 0;
+    int attrs_length = nexthop->rtnh_len - static_cast<int>(RTNH_LENGTH(0));
+    for (const rtattr *attr = RTNH_DATA(nexthop); RTA_OK(attr, attrs_length);
+         attr = RTA_NEXT(attr, attrs_length)) {
+      if (attr->rta_type == RTA_GATEWAY) {
+        path_gateway = read_u32(attr);
+      }
+    }
+    add_path(path_gateway, nexthop->rtnh_ifindex);
+    remaining -= RTNH_ALIGN(nexthop->rtnh_len);
+    nexthop = RTNH_NEXT(nexthop);
+  }
+  return true;
+}
+
+void FibSync::apply_route(Route route, bool deleted) {
+  uint64_t key = prefix_key(route.prefix, route.mask);
+  if (deleted) {
+    auto it = routes_.find(key);
+    if (it == routes_.end() || it->second.erase(route.metric) == 0) {
+      return;
+    }
+    if (it->second.empty()) {
+      routes_.erase(it);
+    }
+  } else {
+    routes_[key][route.metric] = std::move(route.paths);
+  }
+
+  Clock::time_point now = Clock::now();
+  if (changed_.empty()) {
+    first_change_ = now;
+  }
+  last_change_ = now;
+  changed_.insert(key);
+}
+
+void FibSync::dump() {
+  std::unordered_map<uint64_t, PrefixRoutes> routes;
+  bool interrupted = true;
+  while (interrupted) {
+    interrupted = false;
+    routes.clear();
+    struct {
+      nlmsghdr header;
+      rtmsg message;
+    } request{};
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETROUTE;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++dump_sequence_;
+    request.message.rtm_family = AF_INET;
+    if (send(dump_fd_, &request, sizeof(request), 0) == -1) {
+      throw_errno("Cannot request the kernel routes");
+    }
+
+    bool done = false;
+    while (!done) {
+      ssize_t received = recv(dump_fd_, buffer_.data(), buffer_.size(), 0);
+      if (received == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw_errno("Cannot dump the kernel routes");
+      }
+      int length = static_cast<int>(received);
+      for (auto *header = reinterpret_cast<const nlmsghdr *>(buffer_.data());
+           NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+        if (header->nlmsg_seq != dump_sequence_) {
+          continue;
+        }
+        // The table changed during the dump, which must be restarted
+        if (header->nlmsg_flags & NLM_F_DUMP_INTR) {
+          interrupted = true;
+        }
+        if (header->nlmsg_type == NLMSG_DONE) {
+          done = true;
+        } else if (header->nlmsg_type == NLMSG_ERROR) {
+          const auto *error = static_cast<const nlmsgerr *>(NLMSG_DATA(header));
+          errno = -error->error;
+          throw_errno("Cannot dump the kernel routes");
+        } else if (header->nlmsg_type == RTM_NEWROUTE) {
+          Route route;
+          if (parse_route(header, header->nlmsg_len, route)) {
+            routes[prefix_key(route.prefix, route.mask)][route.metric] =
+                std::move(route.paths);
+          }
+        }
+      }
+    }
+  }
+
+  // The prefixes mirrored before are withdrawn, those of the dump added back
+  for (const auto &[key, prefix_routes] : routes_) {
+    changed_.insert(key);
+  }
+  for (const auto &[key, prefix_routes] : routes) {
+    changed_.insert(key);
+  }
+  routes_ = std::move(routes);
+  LOG_INFO("Mirroring {} prefixes of the kernel routing table {}",
+           routes_.size(), config_.table);
+  flush();
+}
+
+void FibSync::flush() {
+  std::vector<RoutingTableEntry> withdrawn;
+  std::vector<RoutingTableEntry> added;
+  withdrawn.reserve(changed_.size());
+  for (uint64_t key : changed_) {
+    RoutingTableEntry entry{};
+    entry.prefix = static_cast<uint32_t>(key >> 32);
+    entry.mask = static_cast<uint32_t>(key);
+    withdrawn.push_back(entry);
+    auto it = routes_.find(key);
+    if (it != routes_.end()) {
+      // The paths of the lowest metric, none if that route is not mirrored
+      const auto &paths = it->second.begin()->second;
+      added.insert(added.end(), paths.begin(), paths.end());
+    }
+  }
+  changed_.clear();
+  rtable_.update_entries(withdrawn, added);
+  LOG_DEBUG("Applied the changes of {} prefixes from the kernel",
+            withdrawn.size());
+}
+
+bool FibSync::receive() {
+  while (true) {
+    ssize_t received =
+        recv(events_fd_, buffer_.data(), buffer_.size(), MSG_DONTWAIT);
+    if (received == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // ENOBUFS when notifications were dropped
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    int length = static_cast<int>(received);
+    for (auto *header = reinterpret_cast<const nlmsghdr *>(buffer_.data());
+         NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+      if (header->nlmsg_type != RTM_NEWROUTE &&
+          header->nlmsg_type != RTM_DELROUTE) {
+        continue;
+      }
+      Route route;
+      if (parse_route(header, header->nlmsg_len, route)) {
+        apply_route(std::move(route), header->nlmsg_type == RTM_DELROUTE);
+      }
+    }
+  }
+}
+
+void FibSync::run() {
+  while (!stopping_.load()) {
+    if (resync_.exchange(false)) {
+      try {
+        dump();
+      } catch (const std::exception &e) {
+        LOG_ERROR("Cannot resynchronize with the kernel routes: {}", e.what());
+        // Retried on the next round
+        resync_.store(true);
+      }
+    }
+
+    auto deadline = [this] {
+      return std::min(last_change_ + config_.quiet_time,
+                      first_change_ + config_.max_delay);
+    };
+    int timeout = IDLE_POLL_MS;
+    if (!changed_.empty()) {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline() -
+                                                               Clock::now());
+      timeout = static_cast<int>(
+          std::clamp<int64_t>(left.count(), 0, IDLE_POLL_MS));
+    }
+    pollfd events{.fd = events_fd_, .events = POLLIN, .revents = 0};
+    if (poll(&events, 1, timeout) > 0 && !receive()) {
+      LOG_WARN("Kernel route notifications lost, dumping the routes again");
+      resync_.store(true);
+    }
+    if (!changed_.empty() && Clock::now() >= deadline()) {
+      flush();
+    }
+  }
+}
+
+} // namespace router
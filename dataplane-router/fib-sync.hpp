@@ -0,0 +1,127 @@
+#pragma once
+
+#include "routing-table.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace router {
+
+// Configuration of a FibSync
+struct FibSyncConfig {
+  // The kernel routing table mirrored, the main one by default
+  uint32_t table = 254;
+  // Time without any change after which a batch is applied
+  std::chrono::milliseconds quiet_time{10};
+  // Time after its first change after which a batch is applied anyway, when
+  // the changes keep coming
+  std::chrono::milliseconds max_delay{200};
+};
+
+/**
+ * @brief Mirroring of the IPv4 routes of a kernel routing table into a
+ * RoutingTable, listening to the route notifications of netlink
+ * (RTM_NEWROUTE / RTM_DELROUTE).
+ *
+ * The routing table is rebuilt by every update, so a background thread
+ * applies the notifications in batches: they are gathered until no change
+ * came for `quiet_time`, or until the first one waits for `max_delay`, then
+ * all the prefixes changed by them are withdrawn and added back with their
+ * latest paths in a single RoutingTable::update_entries. A convergence event
+ * with tens of thousands of notifications thus costs a few rebuilds, the
+ * changes of the same prefix being merged.
+ *
+ * The table is dumped when the mirror starts, and again when notifications
+ * were lost (the socket buffer overflowed) or on `resync`: the routes mirrored
+ * before are then replaced with the dumped ones.
+ *
+ * Only the unicast routes through a gateway, on the interfaces of the router,
+ * are mirrored (with all the paths of the multipath routes), the others only
+ * withdrawing the prefix. Among the routes of a prefix with different
+ * metrics, the one of the lowest metric is used, as by the kernel. The kernel
+ * routes replace the routes of the same prefixes given to the routing table
+ * by other means.
+ */
+class FibSync {
+public:
+  using Config = FibSyncConfig;
+
+  /**
+   * @brief Subscribe to the route notifications, mirror the current routes of
+   * the table and start the background thread.
+   *
+   * @throws std::runtime_error if the netlink sockets cannot be opened or the
+   * table cannot be dumped
+   */
+  FibSync(RoutingTable &rtable, const Config &config);
+  ~FibSync();
+
+  FibSync(const FibSync &) = delete;
+  FibSync &operator=(const FibSync &) = delete;
+
+  /**
+   * @brief Dump the kernel table again, e.g. after all the routes of the
+   * routing table were replaced. Done asynchronously, by the background
+   * thread.
+   */
+  void resync() { resync_.store(true); }
+
+private:
+  using Clock = std::chrono::steady_clock;
+  using RoutingTableEntry = RoutingTable::RoutingTableEntry;
+  // The paths of the routes of a prefix, by metric
+  using PrefixRoutes = std::map<uint32_t, std::vector<RoutingTableEntry>>;
+
+  // A route notified or dumped, of a prefix and a metric
+  struct Route {
+    uint32_t prefix;
+    uint32_t mask;
+    uint32_t metric;
+    // Empty for a route that is not mirrored, or withdrawn
+    std::vector<RoutingTableEntry> paths;
+  };
+
+  // Parse an RTM_NEWROUTE or RTM_DELROUTE message, false if it is not a
+  // route of the table
+  bool parse_route(const void *message, size_t size, Route &route) const;
+  // Record a notified route into the mirror, for the next batch
+  void apply_route(Route route, bool deleted);
+  // Replace the mirror with a dump of the table, then apply it at once
+  void dump();
+  // Apply the prefixes changed since the last batch to the routing table
+  void flush();
+  // Read the pending notifications, false if some were lost
+  bool receive();
+  void run();
+
+  RoutingTable &rtable_;
+  Config config_;
+  // Subscribed to the notifications
+  int events_fd_;
+  // For the dumps, which are answered on their own socket
+  int dump_fd_;
+  uint32_t dump_sequence_ = 0;
+  // The kernel indices of the interfaces
+  std::array<int, ROUTER_NUM_INTERFACES> ifindices_{};
+
+  // Only accessed by the background thread, once started
+  std::unordered_map<uint64_t, PrefixRoutes> routes_{};
+  // The prefixes changed since the last batch
+  std::unordered_set<uint64_t> changed_{};
+  Clock::time_point first_change_{};
+  Clock::time_point last_change_{};
+  std::vector<std::byte> buffer_;
+
+  std::atomic<bool> resync_{false};
+  std::atomic<bool> stopping_{false};
+  std::thread thread_{};
+};
+
+} // namespace router
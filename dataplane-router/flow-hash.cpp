@@ -0,0 +1,87 @@
+#include "flow-hash.hpp"
+#include "util.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace router {
+
+namespace {
+
+constexpr uint8_t IP_PROTO_TCP = 6;
+constexpr uint8_t IP_PROTO_UDP = 17;
+// More fragments flag and fragment offset, in host byte order
+constexpr uint16_t IP_FRAGMENT_MASK = 0x3fff;
+// Initial value of the hash, so that an all-zero flow does not hash to 0
+constexpr uint32_t SEED = 0x9e3779b9;
+
+using FlowHashKernel = uint32_t (*)(uint64_t addresses, uint32_t ports,
+                                    uint32_t proto);
+
+// Multiplicative mix, for the CPUs without a CRC32 instruction
+uint32_t flow_hash_generic(uint64_t addresses, uint32_t ports,
+                           uint32_t proto) {
+  uint64_t hash = (addresses ^ SEED) * 0x9e3779b97f4a7c15;
+  hash ^= (uint64_t{ports} << 8 | proto) * 0xc2b2ae3d27d4eb4f;
+  hash ^= hash >> 29;
+  hash *= 0xbf58476d1ce4e5b9;
+  return static_cast<uint32_t>(hash >> 32);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+flow_hash_crc32(uint64_t addresses, uint32_t ports, uint32_t proto) {
+  uint64_t hash = _mm_crc32_u64(SEED, addresses);
+  hash = _mm_crc32_u32(static_cast<uint32_t>(hash), ports);
+  return _mm_crc32_u32(static_cast<uint32_t>(hash), proto);
+}
+#elif defined(__ARM_FEATURE_CRC32)
+uint32_t flow_hash_crc32(uint64_t addresses, uint32_t ports, uint32_t proto) {
+  uint32_t hash = __crc32cd(SEED, addresses);
+  hash = __crc32cw(hash, ports);
+  return __crc32cw(hash, proto);
+}
+#endif
+
+// Pick the CRC32 instruction if the CPU has one, before main runs
+FlowHashKernel select_kernel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return flow_hash_crc32;
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  // Always available when the compiler targets it
+  return flow_hash_crc32;
+#endif
+  return flow_hash_generic;
+}
+
+const FlowHashKernel kernel = select_kernel();
+
+} // namespace
+
+uint32_t flow_hash(const struct ip_hdr *ip_hdr, size_t length) {
+  uint64_t addresses =
+      uint64_t{ip_hdr->source_addr} << 32 | ip_hdr->dest_addr;
+  uint32_t ports = 0;
+
+  size_t header_len = size_t{ip_hdr->ihl} * 4;
+  bool has_ports =
+      (ip_hdr->proto == IP_PROTO_TCP || ip_hdr->proto == IP_PROTO_UDP) &&
+      !(util::ntoh(ip_hdr->frag) & IP_FRAGMENT_MASK);
+  if (has_ports && length >= header_len + sizeof(ports)) {
+    // The source and destination ports, both at the start of a TCP or UDP
+    // header
+    std::memcpy(&ports, reinterpret_cast<const std::byte *>(ip_hdr) + header_len,
+                sizeof(ports));
+  }
+  return kernel(addresses, ports, ip_hdr->proto);
+}
+
+} // namespace router
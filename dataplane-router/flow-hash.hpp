@@ -0,0 +1,24 @@
+#pragma once
+
+#include "lib_wrapper.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace router {
+
+/**
+ * @brief Hash of the flow of an IPv4 packet, used to pick one of the
+ * equal-cost paths of its route so that all the packets of a flow take the
+ * same one.
+ * The hash covers the addresses and the protocol and, for the TCP and UDP
+ * packets that are not fragments, the ports. The fragments of a datagram only
+ * hash their addresses and protocol, so they follow the same path whether
+ * they carry the ports or not. It is computed with the CRC32C instruction
+ * when the CPU has one.
+ *
+ * @param ip_hdr The IP header, whose length has already been checked
+ * @param length The number of bytes available from the start of the header
+ */
+uint32_t flow_hash(const struct ip_hdr *ip_hdr, size_t length);
+
+} // namespace router
@@ -0,0 +1,445 @@
+#include "flow-table.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace router {
+
+namespace {
+
+constexpr uint8_t IP_PROTO_TCP = 6;
+constexpr uint8_t IP_PROTO_UDP = 17;
+// More fragments flag and fragment offset, in host byte order
+constexpr uint16_t IP_FRAGMENT_MASK = 0x3fff;
+// Share of the slots that can be filled before the inserts start failing
+constexpr size_t MAX_LOAD_PERCENT = 90;
+
+// Checked before anything is allocated
+size_t checked_capacity(size_t capacity) {
+  if (capacity == 0 || capacity >= UINT32_MAX) {
+    throw std::invalid_argument("Invalid flow table capacity");
+  }
+  return capacity;
+}
+
+uint32_t checked_timeout(std::chrono::milliseconds timeout) {
+  if (timeout.count() <= 0 || timeout.count() > INT32_MAX) {
+    throw std::invalid_argument("Invalid flow idle timeout");
+  }
+  return static_cast<uint32_t>(timeout.count());
+}
+
+} // namespace
+
+FlowKey FlowKey::of(const struct ip_hdr *ip_hdr, size_t length) {
+  FlowKey key{.source = ip_hdr->source_addr,
+              .dest = ip_hdr->dest_addr,
+              .source_port = 0,
+              .dest_port = 0,
+              .proto = ip_hdr->proto};
+
+  size_t header_len = size_t{ip_hdr->ihl} * 4;
+  if ((key.proto == IP_PROTO_TCP || key.proto == IP_PROTO_UDP) &&
+      !(util::ntoh(ip_hdr->frag) & IP_FRAGMENT_MASK) &&
+      length >= header_len + 2 * sizeof(uint16_t)) {
+    const auto *ports = reinterpret_cast<const std::byte *>(ip_hdr) + header_len;
+    std::memcpy(&key.source_port, ports, sizeof(key.source_port));
+    std::memcpy(&key.dest_port, ports + sizeof(key.source_port),
+                sizeof(key.dest_port));
+  }
+  return key;
+}
+
+FlowTable::FlowTable(const Config &config)
+    : idle_timeout_ms_(checked_timeout(config.idle_timeout)),
+      // The wheel spans twice the timeout, so a flow is always filed ahead of
+      // the tick being processed
+      tick_ms_(std::max<uint32_t>(
+          1, (idle_timeout_ms_ + WHEEL_SLOTS / 2 - 1) / (WHEEL_SLOTS / 2))),
+      bucket_mask_(util::next_power_of_two(std::max<size_t>(
+                       2, (checked_capacity(config.capacity) * 100 /
+                               MAX_LOAD_PERCENT +
+                           SLOTS_PER_BUCKET - 1) /
+                              SLOTS_PER_BUCKET)) -
+                   1),
+      buckets_(bucket_mask_ + 1), entries_(config.capacity),
+      wheel_tick_(util::coarse_now_ms() / tick_ms_) {
+  for (auto &bucket : buckets_) {
+    for (auto &entry : bucket.entries) {
+      entry.store(NO_ENTRY, std::memory_order_relaxed);
+    }
+  }
+  wheel_.fill(NO_ENTRY);
+  // Handed out from the start of the entries
+  free_entries_.resize(config.capacity);
+  for (size_t i = 0; i < free_entries_.size(); ++i) {
+    free_entries_[i] = static_cast<uint32_t>(free_entries_.size() - 1 - i);
+  }
+}
+
+FlowTable::KeyWords FlowTable::key_words(const FlowKey &key) {
+  return {uint64_t{key.source} << 32 | key.dest,
+          uint64_t{key.source_port} << 24 | uint64_t{key.dest_port} << 8 |
+              key.proto};
+}
+
+uint64_t FlowTable::hash_of(const KeyWords &words) {
+  uint64_t hash = (words[0] ^ 0x9e3779b97f4a7c15) * 0xbf58476d1ce4e5b9;
+  hash ^= (words[1] + (hash >> 31)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 29);
+}
+
+bool FlowTable::is_live(const Entry &entry, uint32_t now) const {
+  return util::is_before(
+      now, entry.last_seen.load(std::memory_order_relaxed) + idle_timeout_ms_);
+}
+
+uint32_t FlowTable::probe(const Bucket &bucket, uint16_t tag,
+                          const KeyWords &words, FlowState *state) const {
+  while (true) {
+    uint32_t version = bucket.version.load(std::memory_order_acquire);
+    if (version & 1) {
+      continue;
+    }
+
+    uint32_t found = NO_ENTRY;
+    for (size_t slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+      if (bucket.tags[slot].load(std::memory_order_relaxed) != tag) {
+        continue;
+      }
+      uint32_t index = bucket.entries[slot].load(std::memory_order_relaxed);
+      if (index == NO_ENTRY) {
+        continue;
+      }
+      const Entry &entry = entries_[index];
+      if (entry.key[0].load(std::memory_order_relaxed) == words[0] &&
+          entry.key[1].load(std::memory_order_relaxed) == words[1]) {
+        *state = {entry.adjacency.load(std::memory_order_relaxed),
+                  entry.packets.load(std::memory_order_relaxed),
+                  entry.bytes.load(std::memory_order_relaxed),
+                  entry.last_seen.load(std::memory_order_relaxed)};
+        found = index;
+        break;
+      }
+    }
+
+    // The entry was read consistently if the bucket did not change meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (bucket.version.load(std::memory_order_relaxed) == version) {
+      return found;
+    }
+  }
+}
+
+uint32_t FlowTable::find(const KeyWords &words, uint64_t hash,
+                         FlowState *state) const {
+  uint16_t tag = tag_of(hash);
+  size_t first = primary_bucket(hash);
+  size_t second = alternate_bucket(first, tag);
+  while (true) {
+    uint64_t moves = moves_.load(std::memory_order_acquire);
+    uint32_t found = probe(buckets_[first], tag, words, state);
+    if (found == NO_ENTRY && second != first) {
+      found = probe(buckets_[second], tag, words, state);
+    }
+    if (found != NO_ENTRY) {
+      return found;
+    }
+    // A miss is only certain if no flow moved between its buckets meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(moves & 1) && moves_.load(std::memory_order_relaxed) == moves) {
+      return NO_ENTRY;
+    }
+  }
+}
+
+std::optional<FlowState> FlowTable::lookup(const FlowKey &key,
+                                           uint32_t now) const {
+  KeyWords words = key_words(key);
+  FlowState state;
+  if (find(words, hash_of(words), &state) == NO_ENTRY ||
+      !util::is_before(now, state.last_seen + idle_timeout_ms_)) {
+    return std::nullopt;
+  }
+  return state;
+}
+
+std::optional<FlowState> FlowTable::hit(const FlowKey &key, size_t bytes,
+                                        uint32_t now) {
+  KeyWords words = key_words(key);
+  FlowState state;
+  uint32_t index = find(words, hash_of(words), &state);
+  if (index == NO_ENTRY ||
+      !util::is_before(now, state.last_seen + idle_timeout_ms_)) {
+    return std::nullopt;
+  }
+
+  Entry &entry = entries_[index];
+  entry.packets.fetch_add(1, std::memory_order_relaxed);
+  entry.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  if (state.last_seen != now) {
+    entry.last_seen.store(now, std::memory_order_relaxed);
+  }
+  return state;
+}
+
+std::optional<FlowTable::Location>
+FlowTable::locate(const KeyWords &words, uint64_t hash) const {
+  uint16_t tag = tag_of(hash);
+  size_t first = primary_bucket(hash);
+  for (size_t bucket : {first, alternate_bucket(first, tag)}) {
+    for (size_t slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+      uint32_t index =
+          buckets_[bucket].entries[slot].load(std::memory_order_relaxed);
+      if (index != NO_ENTRY &&
+          buckets_[bucket].tags[slot].load(std::memory_order_relaxed) == tag &&
+          entries_[index].key[0].load(std::memory_order_relaxed) == words[0] &&
+          entries_[index].key[1].load(std::memory_order_relaxed) == words[1]) {
+        return Location{bucket, slot};
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+void FlowTable::set_slot(Location location, uint16_t tag, uint32_t entry) {
+  Bucket &bucket = buckets_[location.bucket];
+  uint32_t version = bucket.version.load(std::memory_order_relaxed);
+  bucket.version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  bucket.tags[location.slot].store(tag, std::memory_order_relaxed);
+  bucket.entries[location.slot].store(entry, std::memory_order_relaxed);
+  bucket.version.store(version + 2, std::memory_order_release);
+}
+
+void FlowTable::remove(Location location) {
+  set_slot(location, 0, NO_ENTRY);
+}
+
+void FlowTable::move_flow(Location from, Location to) {
+  const Bucket &source = buckets_[from.bucket];
+  uint16_t tag = source.tags[from.slot].load(std::memory_order_relaxed);
+  uint32_t entry = source.entries[from.slot].load(std::memory_order_relaxed);
+
+  uint64_t moves = moves_.load(std::memory_order_relaxed);
+  moves_.store(moves + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  // Copied before being removed, so the flow is always in one of the buckets
+  set_slot(to, tag, entry);
+  remove(from);
+  moves_.store(moves + 2, std::memory_order_release);
+  displacements_.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::optional<FlowTable::Location> FlowTable::make_room(size_t first,
+                                                        size_t second) {
+  // A node is a bucket reached by moving the flow of `slot` of the bucket of
+  // its parent
+  struct Node {
+    size_t bucket;
+    int32_t parent;
+    size_t slot;
+  };
+  std::array<Node, MAX_PATH_NODES> nodes;
+  size_t count = 0;
+  nodes[count++] = {first, -1, 0};
+  nodes[count++] = {second, -1, 0};
+
+  for (size_t i = 0; i < count; ++i) {
+    const Bucket &bucket = buckets_[nodes[i].bucket];
+    for (size_t slot = 0; slot < SLOTS_PER_BUCKET; ++slot) {
+      if (bucket.entries[slot].load(std::memory_order_relaxed) != NO_ENTRY) {
+        continue;
+      }
+      // Move the flows along the path, from its free end
+      Location free{nodes[i].bucket, slot};
+      for (size_t j = i; nodes[j].parent >= 0; j = nodes[j].parent) {
+        Location from{nodes[nodes[j].parent].bucket, nodes[j].slot};
+        // A path going through the same bucket twice may have emptied the
+        // slot already
+        const Bucket &source = buckets_[from.bucket];
+        if (source.entries[from.slot].load(std::memory_order_relaxed) ==
+                NO_ENTRY ||
+            alternate_bucket(from.bucket, source.tags[from.slot].load(
+                                              std::memory_order_relaxed)) !=
+                free.bucket) {
+          return std::nullopt;
+        }
+        move_flow(from, free);
+        free = from;
+      }
+      return free;
+    }
+
+    for (size_t slot = 0; slot < SLOTS_PER_BUCKET && count < nodes.size();
+         ++slot) {
+      uint16_t tag = bucket.tags[slot].load(std::memory_order_relaxed);
+      nodes[count++] = {alternate_bucket(nodes[i].bucket, tag),
+                        static_cast<int32_t>(i), slot};
+    }
+  }
+  return std::nullopt;
+}
+
+bool FlowTable::insert(const FlowKey &key, uint32_t adjacency, size_t bytes,
+                       uint32_t now) {
+  KeyWords words = key_words(key);
+  uint64_t hash = hash_of(words);
+  std::lock_guard lock(mutex_);
+  advance_wheel(now);
+
+  if (auto location = locate(words, hash)) {
+    Entry &entry = entries_[buckets_[location->bucket].entries[location->slot]
+                                .load(std::memory_order_relaxed)];
+    if (!is_live(entry, now)) {
+      // A flow of the same key that expired and was not reclaimed yet
+      entry.packets.store(1, std::memory_order_relaxed);
+      entry.bytes.store(bytes, std::memory_order_relaxed);
+    }
+    entry.adjacency.store(adjacency, std::memory_order_relaxed);
+    entry.last_seen.store(now, std::memory_order_relaxed);
+    return true;
+  }
+
+  if (free_entries_.empty()) {
+    insert_failures_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  uint16_t tag = tag_of(hash);
+  size_t first = primary_bucket(hash);
+  size_t second = alternate_bucket(first, tag);
+  std::optional<Location> location;
+  for (size_t bucket : {first, second}) {
+    for (size_t slot = 0; slot < SLOTS_PER_BUCKET && !location; ++slot) {
+      if (buckets_[bucket].entries[slot].load(std::memory_order_relaxed) ==
+          NO_ENTRY) {
+        location = Location{bucket, slot};
+      }
+    }
+  }
+  if (!location) {
+    location = make_room(first, second);
+  }
+  if (!location) {
+    insert_failures_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Not reachable by the lookups until its slot is set
+  uint32_t index = free_entries_.back();
+  free_entries_.pop_back();
+  Entry &entry = entries_[index];
+  entry.key[0].store(words[0], std::memory_order_relaxed);
+  entry.key[1].store(words[1], std::memory_order_relaxed);
+  entry.adjacency.store(adjacency, std::memory_order_relaxed);
+  entry.packets.store(1, std::memory_order_relaxed);
+  entry.bytes.store(bytes, std::memory_order_relaxed);
+  entry.last_seen.store(now, std::memory_order_relaxed);
+  wheel_link(index);
+  set_slot(*location, tag, index);
+
+  flows_.fetch_add(1, std::memory_order_relaxed);
+  inserted_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool FlowTable::erase(const FlowKey &key) {
+  KeyWords words = key_words(key);
+  std::lock_guard lock(mutex_);
+  auto location = locate(words, hash_of(words));
+  if (!location) {
+    return false;
+  }
+  uint32_t index = buckets_[location->bucket].entries[location->slot].load(
+      std::memory_order_relaxed);
+  remove(*location);
+  wheel_unlink(index);
+  free_entries_.push_back(index);
+  flows_.fetch_sub(1, std::memory_order_relaxed);
+  return true;
+}
+
+size_t FlowTable::expire(uint32_t now) {
+  std::lock_guard lock(mutex_);
+  return advance_wheel(now);
+}
+
+void FlowTable::wheel_link(uint32_t index) {
+  Entry &entry = entries_[index];
+  size_t slot = wheel_slot(entry.last_seen.load(std::memory_order_relaxed) +
+                           idle_timeout_ms_);
+  entry.wheel_prev = NO_ENTRY;
+  entry.wheel_next = wheel_[slot];
+  if (entry.wheel_next != NO_ENTRY) {
+    entries_[entry.wheel_next].wheel_prev = index;
+  }
+  wheel_[slot] = index;
+}
+
+void FlowTable::wheel_unlink(uint32_t index) {
+  Entry &entry = entries_[index];
+  if (entry.wheel_prev != NO_ENTRY) {
+    entries_[entry.wheel_prev].wheel_next = entry.wheel_next;
+  } else {
+    // The head of its slot
+    auto head = std::find(wheel_.begin(), wheel_.end(), index);
+    if (head != wheel_.end()) {
+      *head = entry.wheel_next;
+    }
+  }
+  if (entry.wheel_next != NO_ENTRY) {
+    entries_[entry.wheel_next].wheel_prev = entry.wheel_prev;
+  }
+  entry.wheel_prev = entry.wheel_next = NO_ENTRY;
+}
+
+size_t FlowTable::advance_wheel(uint32_t now) {
+  uint32_t now_tick = now / tick_ms_;
+  uint32_t pending = now_tick - wheel_tick_;
+  if (pending == 0 || util::is_before(now_tick, wheel_tick_)) {
+    return 0;
+  }
+
+  // Only the ticks already over are processed, and a whole turn of the wheel
+  // visits every flow
+  size_t expired = 0;
+  for (uint32_t i = 0; i < std::min<uint32_t>(pending, WHEEL_SLOTS); ++i) {
+    size_t slot = (wheel_tick_ + i) % WHEEL_SLOTS;
+    uint32_t index = wheel_[slot];
+    wheel_[slot] = NO_ENTRY;
+    while (index != NO_ENTRY) {
+      Entry &entry = entries_[index];
+      uint32_t next = entry.wheel_next;
+      if (is_live(entry, now)) {
+        // Seen since it was filed
+        wheel_link(index);
+      } else {
+        KeyWords words{entry.key[0].load(std::memory_order_relaxed),
+                       entry.key[1].load(std::memory_order_relaxed)};
+        if (auto location = locate(words, hash_of(words))) {
+          remove(*location);
+        }
+        entry.wheel_prev = entry.wheel_next = NO_ENTRY;
+        free_entries_.push_back(index);
+        ++expired;
+      }
+      index = next;
+    }
+  }
+  wheel_tick_ = now_tick;
+
+  flows_.fetch_sub(expired, std::memory_order_relaxed);
+  expired_.fetch_add(expired, std::memory_order_relaxed);
+  return expired;
+}
+
+FlowTableStats FlowTable::stats() const {
+  return {flows_.load(std::memory_order_relaxed),
+          inserted_.load(std::memory_order_relaxed),
+          expired_.load(std::memory_order_relaxed),
+          insert_failures_.load(std::memory_order_relaxed),
+          displacements_.load(std::memory_order_relaxed)};
+}
+
+} // namespace router
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "lib_wrapper.hpp"
+#include "page-allocator.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief The 5-tuple of an IPv4 flow, in network byte order. As for
+ * flow_hash, the ports are only set for the TCP and UDP packets that are not
+ * fragments, so all the fragments of a datagram belong to the same flow.
+ */
+struct FlowKey {
+  uint32_t source;
+  uint32_t dest;
+  uint16_t source_port;
+  uint16_t dest_port;
+  uint8_t proto;
+
+  /**
+   * @brief Get the key of a packet.
+   *
+   * @param ip_hdr The IPv4 header of the packet
+   * @param length The bytes available from the IPv4 header on
+   */
+  static FlowKey of(const struct ip_hdr *ip_hdr, size_t length);
+
+  bool operator==(const FlowKey &other) const {
+    return source == other.source && dest == other.dest &&
+           source_port == other.source_port && dest_port == other.dest_port &&
+           proto == other.proto;
+  }
+};
+
+// What the table keeps of a flow
+struct FlowState {
+  // The adjacency the flow is pinned to
+  uint32_t adjacency;
+  uint64_t packets;
+  uint64_t bytes;
+  // When the last packet of the flow was seen, as given by
+  // util::coarse_now_ms
+  uint32_t last_seen;
+};
+
+struct FlowTableConfig {
+  // Maximum number of flows, the memory of the table being allocated upfront
+  size_t capacity = size_t{1} << 20;
+  // Flows idle for longer are expired
+  std::chrono::milliseconds idle_timeout{30000};
+};
+
+struct FlowTableStats {
+  size_t flows;
+  uint64_t inserted;
+  uint64_t expired;
+  // Flows not inserted because the table was full, or no cuckoo path to a
+  // free slot was found
+  uint64_t insert_failures;
+  // Flows moved to their other bucket to make room for a new one
+  uint64_t displacements;
+};
+
+/**
+ * @brief Table of the IPv4 flows seen by the router, for the features that
+ * keep state per flow, shared by all the RX workers.
+ *
+ * The table is a bucketized cuckoo hash: every flow has two candidate
+ * buckets of 8 slots, each bucket filling a cache line with a 16-bit tag of
+ * the hash of every flow it holds, so a lookup reads at most two buckets and,
+ * almost always, the entry of the flow only. When both buckets of a new flow
+ * are full, a breadth-first search finds the shortest chain of flows to move
+ * to their other bucket, and they are moved from the free end of the chain,
+ * so a flow always stays in one of its buckets.
+ *
+ * Lookups take no lock: every bucket is guarded by a sequence lock, and a
+ * table-wide counter of moves lets a lookup that missed retry if a flow moved
+ * between its two buckets meanwhile. The writers (new flows, expiry)
+ * serialize on a mutex. A flow seen by a lookup racing with its expiry may
+ * have that packet counted on the flow reusing its entry.
+ *
+ * The memory is bounded: the entries and buckets are allocated upfront for
+ * `capacity` flows, and a new flow is not tracked when the table is full.
+ * The flows idle for longer than `idle_timeout` are missed by the lookups
+ * right away, and reclaimed by a timer wheel advanced by the writers: each
+ * slot of the wheel lists the flows due to expire in its tick, which are
+ * either expired or filed again according to their last packet.
+ */
+class FlowTable {
+public:
+  using Config = FlowTableConfig;
+
+  constexpr static size_t SLOTS_PER_BUCKET = 8;
+
+  explicit FlowTable(const Config &config = Config{});
+
+  FlowTable(const FlowTable &) = delete;
+  FlowTable &operator=(const FlowTable &) = delete;
+
+  /**
+   * @brief Get the state of a live flow.
+   *
+   * @param now The current time, as given by util::coarse_now_ms
+   */
+  std::optional<FlowState> lookup(const FlowKey &key, uint32_t now) const;
+
+  /**
+   * @brief Prefetch the buckets of a flow, so that the lookups of a burst
+   * overlap their cache misses instead of taking them one after the other.
+   */
+  void prefetch(const FlowKey &key) const {
+    uint64_t hash = hash_of(key_words(key));
+    size_t first = primary_bucket(hash);
+    __builtin_prefetch(&buckets_[first]);
+    __builtin_prefetch(&buckets_[alternate_bucket(first, tag_of(hash))]);
+  }
+
+  /**
+   * @brief Count a packet of a live flow, refreshing it.
+   *
+   * @return The state of the flow before the packet, or nullopt if the flow
+   * is not tracked
+   */
+  std::optional<FlowState> hit(const FlowKey &key, size_t bytes, uint32_t now);
+
+  /**
+   * @brief Start tracking a flow with its first packet, or pin a tracked flow
+   * to another adjacency, its packet having been counted by `hit`.
+   *
+   * @return false if the flow could not be inserted
+   */
+  bool insert(const FlowKey &key, uint32_t adjacency, size_t bytes,
+              uint32_t now);
+
+  // Stop tracking a flow, returning false if it was not tracked
+  bool erase(const FlowKey &key);
+
+  /**
+   * @brief Reclaim the flows idle for longer than the timeout, which the
+   * writers otherwise only do on insertion.
+   *
+   * @return The number of flows expired
+   */
+  size_t expire(uint32_t now);
+
+  size_t capacity() const { return entries_.size(); }
+  FlowTableStats stats() const;
+
+private:
+  constexpr static uint32_t NO_ENTRY = UINT32_MAX;
+  constexpr static size_t WHEEL_SLOTS = 128;
+  // Buckets visited by the search of a cuckoo path
+  constexpr static size_t MAX_PATH_NODES = 256;
+
+  struct alignas(64) Bucket {
+    // Odd while the bucket is being changed
+    std::atomic<uint32_t> version{0};
+    std::array<std::atomic<uint16_t>, SLOTS_PER_BUCKET> tags{};
+    std::array<std::atomic<uint32_t>, SLOTS_PER_BUCKET> entries{};
+  };
+
+  struct Entry {
+    // The key, as the two words of `key_words`
+    std::array<std::atomic<uint64_t>, 2> key{};
+    std::atomic<uint32_t> adjacency{0};
+    std::atomic<uint32_t> last_seen{0};
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+    // The list of the slot of the timer wheel holding the entry, only
+    // accessed by the writers
+    uint32_t wheel_prev = NO_ENTRY;
+    uint32_t wheel_next = NO_ENTRY;
+  };
+
+  // Where a flow lies in the buckets
+  struct Location {
+    size_t bucket;
+    size_t slot;
+  };
+
+  using KeyWords = std::array<uint64_t, 2>;
+
+  static KeyWords key_words(const FlowKey &key);
+  static uint64_t hash_of(const KeyWords &words);
+  static uint16_t tag_of(uint64_t hash) {
+    return static_cast<uint16_t>(hash >> 48);
+  }
+  size_t primary_bucket(uint64_t hash) const { return hash & bucket_mask_; }
+  // The other bucket of a flow, whichever of the two `bucket` is
+  size_t alternate_bucket(size_t bucket, uint16_t tag) const {
+    return (bucket ^ (size_t{tag} * 0x5bd1e995u)) & bucket_mask_;
+  }
+  bool is_live(const Entry &entry, uint32_t now) const;
+
+  // Find the entry of a key without any lock, copying its state out
+  uint32_t find(const KeyWords &words, uint64_t hash,
+                FlowState *state) const;
+  uint32_t probe(const Bucket &bucket, uint16_t tag, const KeyWords &words,
+                 FlowState *state) const;
+
+  // The following must be called with the mutex held
+  std::optional<Location> locate(const KeyWords &words, uint64_t hash) const;
+  std::optional<Location> make_room(size_t first, size_t second);
+  void move_flow(Location from, Location to);
+  void set_slot(Location location, uint16_t tag, uint32_t entry);
+  void remove(Location location);
+  size_t wheel_slot(uint32_t deadline) const {
+    return (deadline / tick_ms_) % WHEEL_SLOTS;
+  }
+  void wheel_link(uint32_t entry);
+  void wheel_unlink(uint32_t entry);
+  size_t advance_wheel(uint32_t now);
+
+  uint32_t idle_timeout_ms_;
+  uint32_t tick_ms_;
+  size_t bucket_mask_;
+  memory::PageVector<Bucket> buckets_;
+  memory::PageVector<Entry> entries_;
+  // Bumped before and after a flow is moved, so odd while one is
+  alignas(64) std::atomic<uint64_t> moves_{0};
+
+  mutable std::mutex mutex_{};
+  std::vector<uint32_t> free_entries_{};
+  std::array<uint32_t, WHEEL_SLOTS> wheel_{};
+  // The next tick of the wheel to process
+  uint32_t wheel_tick_;
+  std::atomic<size_t> flows_{0};
+  std::atomic<uint64_t> inserted_{0};
+  std::atomic<uint64_t> expired_{0};
+  std::atomic<uint64_t> insert_failures_{0};
+  std::atomic<uint64_t> displacements_{0};
+};
+
+} // namespace router
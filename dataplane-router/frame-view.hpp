@@ -0,0 +1,87 @@
+#pragma once
+
+#include "ipv6.hpp"
+#include "lib_wrapper.hpp"
+#include "packet-buffer.hpp"
+#include "span.hpp"
+#include <cstddef>
+#include <optional>
+
+namespace router {
+
+/**
+ * @brief View of a received frame whose ethernet and network headers have
+ * been checked to be in bounds, once, when it was parsed.
+ * The offsets of the headers are constants of the network header type, so the
+ * handlers get their headers without any further size check, and only need
+ * one for the headers of the payload (`payload_header`). Like PacketBuffer,
+ * it does not own the frame and is meant to be passed around by value.
+ *
+ * @tparam NetworkHeader The header following the ethernet one (ip_hdr or
+ * ipv6_hdr). The IPv4 options and the IPv6 extension headers are not parsed,
+ * the payload starting right after the fixed header.
+ */
+template <typename NetworkHeader> class FrameView {
+public:
+  constexpr static size_t NETWORK_OFFSET = ETHER_HDR_SIZE;
+  constexpr static size_t PAYLOAD_OFFSET =
+      NETWORK_OFFSET + sizeof(NetworkHeader);
+
+  /**
+   * @return The view of the frame, or std::nullopt if it is too small to hold
+   * its headers
+   */
+  static std::optional<FrameView> parse(PacketBuffer packet) {
+    if (packet.size() < PAYLOAD_OFFSET) {
+      return std::nullopt;
+    }
+    return FrameView(packet);
+  }
+
+  PacketBuffer packet() const { return packet_; }
+  tcb::span<std::byte> frame() const { return packet_.frame(); }
+
+  struct ether_hdr *ether_header() const {
+    return reinterpret_cast<struct ether_hdr *>(packet_.data());
+  }
+
+  NetworkHeader *network_header() const {
+    return reinterpret_cast<NetworkHeader *>(packet_.data() + NETWORK_OFFSET);
+  }
+
+  tcb::span<std::byte> payload() const {
+    return packet_.frame().subspan(PAYLOAD_OFFSET);
+  }
+
+  /**
+   * @return The header at the start of the payload, or nullptr if the payload
+   * is too small to hold it
+   */
+  template <typename Header> Header *payload_header() const {
+    if (packet_.size() < PAYLOAD_OFFSET + sizeof(Header)) {
+      return nullptr;
+    }
+    return reinterpret_cast<Header *>(packet_.data() + PAYLOAD_OFFSET);
+  }
+
+  /**
+   * @brief Cut the frame after the first `length` bytes of the payload, e.g.
+   * to drop the ethernet padding of a short frame. Does nothing if the
+   * payload is already shorter.
+   */
+  void truncate_payload(size_t length) {
+    if (PAYLOAD_OFFSET + length < packet_.size()) {
+      packet_.resize(PAYLOAD_OFFSET + length);
+    }
+  }
+
+private:
+  explicit FrameView(PacketBuffer packet) : packet_(packet) {}
+
+  PacketBuffer packet_;
+};
+
+using Ipv4FrameView = FrameView<struct ip_hdr>;
+using Ipv6FrameView = FrameView<struct ipv6_hdr>;
+
+} // namespace router
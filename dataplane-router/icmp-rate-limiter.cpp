@@ -0,0 +1,64 @@
+#include "icmp-rate-limiter.hpp"
+#include <algorithm>
+#include <ctime>
+
+namespace router {
+
+static_assert(IcmpRateLimiter::SOURCE_SLOTS == 1 << 12,
+              "slot() keeps the 12 high bits of the hash");
+
+IcmpRateLimiter::IcmpRateLimiter(const Config &config)
+    : global_(make_bucket(config.messages_per_sec
+                              ? 1000000 / config.messages_per_sec
+                              : 0,
+                          config.messages_burst)),
+      source_(make_bucket(uint64_t{config.source_interval_ms} * 1000,
+                          config.source_burst)),
+      source_next_us_(std::make_unique<std::atomic<uint64_t>[]>(SOURCE_SLOTS)) {
+}
+
+IcmpRateLimiter::Bucket IcmpRateLimiter::make_bucket(uint64_t interval_us,
+                                                     uint32_t burst) {
+  // An interval of 0 (no limit, or more than a message per microsecond)
+  // disables the bucket
+  return {interval_us, interval_us * (std::max(burst, 1u) - 1)};
+}
+
+uint64_t IcmpRateLimiter::now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool IcmpRateLimiter::take(std::atomic<uint64_t> &next_us, const Bucket &bucket,
+                           uint64_t now_us) {
+  if (bucket.interval_us == 0) {
+    return true;
+  }
+  uint64_t next = next_us.load(std::memory_order_relaxed);
+  while (true) {
+    // The bucket refills while it lags behind the current time
+    uint64_t start = std::max(next, now_us);
+    if (start - now_us > bucket.tolerance_us) {
+      return false;
+    }
+    if (next_us.compare_exchange_weak(next, start + bucket.interval_us,
+                                      std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+}
+
+IcmpRateLimiter::Verdict IcmpRateLimiter::allow(uint64_t key, uint64_t now_us) {
+  if (!take(source_next_us_[slot(key)], source_, now_us)) {
+    return Verdict::SOURCE_LIMITED;
+  }
+  // The token of the destination is not given back: its errors are still
+  // being sent too often
+  if (!take(global_next_us_, global_, now_us)) {
+    return Verdict::GLOBAL_LIMITED;
+  }
+  return Verdict::ALLOWED;
+}
+
+} // namespace router
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace router {
+
+// Rate limits of an IcmpRateLimiter
+struct IcmpRateLimits {
+  // Errors sent per second to all the destinations together (0 for no
+  // limit), and how many of them can be sent at once
+  uint32_t messages_per_sec = 1000;
+  uint32_t messages_burst = 50;
+  // Minimum interval between two errors to the same destination, in ms (0 for
+  // no limit), and how many of them can be sent at once
+  uint32_t source_interval_ms = 1000;
+  uint32_t source_burst = 6;
+};
+
+/**
+ * @brief Token buckets limiting the ICMP errors sent by the router, like the
+ * icmp_ratelimit and icmp_msgs_per_sec sysctls of Linux: one bucket for each
+ * destination of the errors (the source of the offending packet), and one
+ * for all the errors together.
+ *
+ * Each bucket is a single timestamp updated with a compare-and-swap (the
+ * "virtual scheduling" form of a token bucket): the bucket is empty once it
+ * runs ahead of the current time by more than the burst, and every message
+ * moves it one interval further. Checking a bucket is cheap enough to be
+ * done before anything of the error is built, and can be done from all the
+ * workers at once.
+ *
+ * The per-destination buckets live in a fixed hash table without keys, so
+ * two destinations sharing a slot share their limit.
+ */
+class IcmpRateLimiter {
+public:
+  using Config = IcmpRateLimits;
+
+  enum class Verdict {
+    ALLOWED,
+    // The bucket of the destination is empty
+    SOURCE_LIMITED,
+    // The global bucket is empty
+    GLOBAL_LIMITED,
+  };
+
+  // Number of per-destination buckets
+  constexpr static size_t SOURCE_SLOTS = 4096;
+
+  IcmpRateLimiter() : IcmpRateLimiter(Config{}) {}
+  explicit IcmpRateLimiter(const Config &config);
+
+  /**
+   * @brief Take a token for an error to the destination identified by `key`
+   * (e.g. its IPv4 address), checking its own bucket first so that a single
+   * flooding source does not drain the global one.
+   *
+   * @param now_us The current time, given by `now_us`
+   */
+  Verdict allow(uint64_t key, uint64_t now_us);
+  Verdict allow(uint64_t key) { return allow(key, now_us()); }
+
+  // Coarse monotonic time in microseconds, with the resolution of
+  // util::coarse_now_ms
+  static uint64_t now_us();
+
+private:
+  struct Bucket {
+    // Time to add to the bucket for each message, 0 for no limit
+    uint64_t interval_us;
+    // How far the bucket can run ahead of the current time
+    uint64_t tolerance_us;
+  };
+
+  static Bucket make_bucket(uint64_t interval_us, uint32_t burst);
+  static bool take(std::atomic<uint64_t> &next_us, const Bucket &bucket,
+                   uint64_t now_us);
+  static size_t slot(uint64_t key) {
+    // Fibonacci hashing, keeping the well mixed high bits of the product
+    return static_cast<size_t>((key * 0x9e3779b97f4a7c15u) >> 52) &
+           (SOURCE_SLOTS - 1);
+  }
+
+  Bucket global_;
+  Bucket source_;
+  alignas(64) std::atomic<uint64_t> global_next_us_{0};
+  std::unique_ptr<std::atomic<uint64_t>[]> source_next_us_;
+};
+
+} // namespace router
@@ -6,31 +6,313 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+/* Smallest receive buffer, see get_max_frame_len for the actual one */
 #define MAX_PACKET_LEN 1400
+/* Largest frame received with the offload metadata: an Ethernet header and
+ * an IP packet of the largest size, as built by GRO */
+#define MAX_SUPER_FRAME_LEN (14 + 65535)
+
+/* Offload metadata of a frame, received and sent before it with
+ * PACKET_VNET_HDR. Same layout as the virtio_net_hdr of <linux/virtio_net.h>,
+ * which cannot be included from C++, in host byte order. */
+struct vnet_hdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+/* Flags of a vnet_hdr: the checksum at csum_start + csum_offset only holds
+ * the sum of the pseudo-header, and is to be completed over the rest of the
+ * frame from csum_start; or the checksum was already verified */
+#define VNET_HDR_F_NEEDS_CSUM 1
+#define VNET_HDR_F_DATA_VALID 2
+/* gso_type of a frame that is not to be segmented */
+#define VNET_HDR_GSO_NONE 0
 #define ROUTER_NUM_INTERFACES 3
 
 /*
  * @brief Sends a packet on a specific interface.
  *
- * @param length - will be set to the total number of bytes received.
- * @param frame_data - region of memory in which the data will be copied; should
- *        have at least MAX_PACKET_LEN bytes allocated
+ * @param length - the length in bytes of the frame
+ * @param frame_data - the frame, of at most MAX_PACKET_LEN bytes
  * @param interface - index of the output interface
- * Returns: the interface it has been received from.
+ * Returns: the number of bytes sent, or -1 if the frame could not be sent.
  */
 int send_to_link(size_t length, char *frame_data, size_t interface);
 
+/*
+ * @brief Sends a burst of packets on a specific interface, using as few
+ * system calls as possible.
+ *
+ * @param interface - index of the output interface
+ * @param frames - array of count frames to be sent
+ * @param lengths - the length in bytes of each frame
+ * @param count - number of frames to send
+ * Returns: the number of frames sent, those which failed being dropped.
+ */
+size_t send_burst_to_link(size_t interface, char *frames[], size_t lengths[],
+                          size_t count);
+
 /*
  * @brief Receives a packet. Blocking function, blocks if there is no packet to
  * be received.
  *
  * @param frame_data - region of memory in which the data will be copied; should
- *        have at least MAX_PACKET_LEN bytes allocated
+ *        have at least get_max_frame_len() bytes allocated
  * @param length - will be set to the total number of bytes received.
  * Returns: the interface it has been received from.
  */
 size_t recv_from_any_link(char *frame_data, size_t *length);
 
+/*
+ * @brief Receives a burst of packets from any interface. Blocking function,
+ * blocks until at least one packet is available, then drains up to
+ * max_frames packets from all the ready interfaces with recvmmsg, splitting
+ * the burst evenly between them. The interfaces are watched by an epoll
+ * instance set up by init, and the first interface served is rotated on
+ * every call.
+ *
+ * @param frames - array of max_frames buffers in which the data will be
+ *        copied; each should have at least get_max_frame_len() bytes
+ *        allocated
+ * @param lengths - will be set to the number of bytes of each received frame
+ * @param frame_interfaces - will be set to the interface of each frame
+ * @param max_frames - maximum number of frames to receive
+ * Returns: the number of frames received.
+ */
+size_t recv_burst_from_any_link(char *frames[], size_t lengths[],
+                                size_t frame_interfaces[], size_t max_frames);
+
+/*
+ * @brief Receives at most one packet from every ready interface, as the
+ * classic select loop does: blocks in select until at least one interface is
+ * readable, then reads a single frame from each with recv. Every frame costs
+ * a system call, and every wait a scan of all the sockets, so it is only
+ * meant as a baseline for the other receive functions. The poll mode is
+ * ignored, the receive timeout is not.
+ *
+ * Parameters and return value as for recv_burst_from_any_link.
+ */
+size_t recv_from_ready_links_select(char *frames[], size_t lengths[],
+                                    size_t frame_interfaces[],
+                                    size_t max_frames);
+
+/*
+ * @brief Same as recv_from_ready_links_select, waiting for the interfaces
+ * with the epoll instance set up by init instead of select.
+ */
+size_t recv_from_ready_links_epoll(char *frames[], size_t lengths[],
+                                   size_t frame_interfaces[],
+                                   size_t max_frames);
+
+/*
+ * @brief Switches all the interfaces to TPACKET_V3 RX/TX rings mapped in user
+ * space. Must be called after init. Afterwards, frames are sent through the
+ * TX rings and must be received with recv_burst_from_rings.
+ */
+void init_rings(void);
+
+/*
+ * @brief Receives a burst of packets straight from the RX rings, without
+ * copying them. Blocking function, blocks until at least one packet is
+ * available.
+ *
+ * @param frames - will be set to point to each frame inside its ring block;
+ *        the frames stay valid, and may be modified in place, until the next
+ *        call to this function
+ * @param lengths - will be set to the number of bytes of each received frame
+ * @param frame_interfaces - will be set to the interface of each frame
+ * @param max_frames - maximum number of frames to receive
+ * Returns: the number of frames received.
+ */
+size_t recv_burst_from_rings(char *frames[], size_t lengths[],
+                             size_t frame_interfaces[], size_t max_frames);
+
+/*
+ * @brief Same as recv_burst_from_rings, also returning whether the checksums
+ * of the frames need to be verified, from the status of their frame headers
+ * (VNET_HDR_F_DATA_VALID if not), as the only offload metadata.
+ */
+size_t recv_burst_from_rings_vnet(char *frames[], size_t lengths[],
+                                  size_t frame_interfaces[],
+                                  struct vnet_hdr vnet_hdrs[],
+                                  size_t max_frames);
+
+/* Size of the AF_XDP frames, and room free before each received frame */
+#define XSK_FRAME_SIZE 2048
+#define XSK_FRAME_HEADROOM 256
+
+/*
+ * @brief Switches all the interfaces to AF_XDP sockets, sharing a single
+ * UMEM. Must be called after init. An XDP program is attached to every
+ * interface, redirecting the frames of its queue 0 to its socket, so the
+ * interfaces must have a single RX queue or steer the traffic to the first
+ * one. Afterwards, frames are sent through the TX rings of the sockets and
+ * must be received with recv_burst_from_xdp.
+ */
+void init_xdp(void);
+
+/*
+ * @brief Receives a burst of packets straight from the UMEM, without copying
+ * them. Blocking function, blocks until at least one packet is available.
+ *
+ * @param frames - will be set to point to each frame inside its UMEM chunk,
+ *        XSK_FRAME_HEADROOM bytes after the start of the chunk of
+ *        XSK_FRAME_SIZE bytes; the frames stay valid, and may be modified in
+ *        place and grown within their chunk, until the next call to this
+ *        function. Sending a frame still in its chunk hands the chunk to the
+ *        TX ring of the output interface instead of copying it
+ * @param lengths - will be set to the number of bytes of each received frame
+ * @param frame_interfaces - will be set to the interface of each frame
+ * @param max_frames - maximum number of frames to receive
+ * Returns: the number of frames received.
+ */
+size_t recv_burst_from_xdp(char *frames[], size_t lengths[],
+                           size_t frame_interfaces[], size_t max_frames);
+
+/*
+ * @brief Receives a burst of packets from a specific interface. Blocking
+ * function, blocks until at least one packet is available. Safe to call
+ * concurrently for different interfaces.
+ *
+ * @param interface - index of the input interface
+ * @param frames - array of max_frames buffers in which the data will be
+ *        copied; each should have at least get_max_frame_len() bytes
+ *        allocated.
+ *        When the rings are enabled, it will instead be set to point to each
+ *        frame inside the RX ring of the interface (or inside the UMEM with
+ *        AF_XDP), the frames staying valid until the next call for the same
+ *        interface
+ * @param lengths - will be set to the number of bytes of each received frame
+ * @param max_frames - maximum number of frames to receive
+ * Returns: the number of frames received.
+ */
+size_t recv_burst_from_link(size_t interface, char *frames[], size_t lengths[],
+                            size_t max_frames);
+
+/*
+ * @brief Enables PACKET_VNET_HDR on all the sockets, so that the frames
+ * merged by GRO are received whole, up to MAX_SUPER_FRAME_LEN bytes, with
+ * their offload metadata (GSO type and size, partial checksum) in a
+ * vnet_hdr, and can be sent back out with it, the output device or the
+ * kernel segmenting them. Must be called after init, and cannot be combined
+ * with the rings or AF_XDP. Afterwards, the functions without a vnet_hdrs
+ * parameter keep receiving up to get_max_frame_len() bytes of each frame,
+ * dropping its metadata, and send the frames without any offload.
+ */
+void init_vnet_hdr(void);
+
+/*
+ * @brief Enables PACKET_AUXDATA on all the sockets, so that the receive
+ * functions with a vnet_hdrs parameter tell which frames had their checksums
+ * validated by the NIC (TP_STATUS_CSUM_VALID), or come from a local sender
+ * that left them to be computed on transmission (TP_STATUS_CSUMNOTREADY).
+ * Costs a control message per received frame. Only needed with the plain
+ * sockets: the frame headers of the rings always carry this status, and the
+ * vnet_hdr of init_vnet_hdr the full offload metadata. Must be called after
+ * init.
+ */
+void init_auxdata(void);
+
+/*
+ * @brief Same as recv_burst_from_any_link, also returning the offload
+ * metadata of the frames: all of it with init_vnet_hdr, otherwise only
+ * whether their checksums need to be verified (VNET_HDR_F_DATA_VALID if
+ * not), with init_auxdata, and nothing without either.
+ *
+ * @param frames - with init_vnet_hdr, each buffer should have at least
+ *        MAX_SUPER_FRAME_LEN bytes allocated
+ * @param vnet_hdrs - will be set to the offload metadata of each frame
+ */
+size_t recv_burst_from_any_link_vnet(char *frames[], size_t lengths[],
+                                     size_t frame_interfaces[],
+                                     struct vnet_hdr vnet_hdrs[],
+                                     size_t max_frames);
+
+/*
+ * @brief Same as recv_burst_from_link, also returning the offload metadata
+ * of the frames, as recv_burst_from_any_link_vnet does. With the rings, the
+ * checksum status of the frames is always returned, and with AF_XDP nothing.
+ *
+ * @param frames - with init_vnet_hdr, each buffer should have at least
+ *        MAX_SUPER_FRAME_LEN bytes allocated
+ * @param vnet_hdrs - will be set to the offload metadata of each frame
+ */
+size_t recv_burst_from_link_vnet(size_t interface, char *frames[],
+                                 size_t lengths[],
+                                 struct vnet_hdr vnet_hdrs[],
+                                 size_t max_frames);
+
+/*
+ * @brief Same as send_burst_to_link, sending each frame with its offload
+ * metadata, e.g. a super-frame with the GSO type and size it was received
+ * with. The metadata is ignored without init_vnet_hdr.
+ *
+ * @param vnet_hdrs - the offload metadata of each frame
+ */
+size_t send_burst_to_link_vnet(size_t interface, char *frames[],
+                               size_t lengths[],
+                               const struct vnet_hdr vnet_hdrs[],
+                               size_t count);
+
+/*
+ * @brief Switches the receive functions to poll mode, for the deployments
+ * where latency matters more than CPU time: instead of blocking as soon as no
+ * frame is available, they keep polling the interfaces, pausing a little
+ * longer between polls, and only block once the interfaces have been idle for
+ * spin_us microseconds. The sockets are also set up to busy poll the driver
+ * queues (SO_BUSY_POLL, which needs CAP_NET_ADMIN above the
+ * net.core.busy_read sysctl). Must be called after init, and after init_rings
+ * or init_xdp when used.
+ */
+void init_busy_poll(unsigned int spin_us);
+
+/*
+ * @brief Bounds the time the burst receive functions block for: once no
+ * frame arrived for timeout_ms milliseconds, they return 0 frames, e.g. for
+ * the caller to send the frames it holds back. Must be called after init.
+ */
+void init_recv_timeout(unsigned int timeout_ms);
+
+/* Size of the huge pages the large areas are rounded up to */
+#define HUGE_PAGE_SIZE (2u << 20)
+
+/* The pages an area returned by alloc_pages is backed by */
+enum page_backing {
+  PAGES_HUGETLB,     /* Huge pages reserved in the hugetlb pool */
+  PAGES_TRANSPARENT, /* Normal pages the kernel may merge into huge pages */
+  PAGES_NORMAL,
+  PAGE_BACKING_COUNT
+};
+
+/*
+ * @brief Maps a large, zeroed, area for the lookup tables and the buffer
+ * pools, where the TLB misses of the normal pages are costly. The area is
+ * backed by huge pages from the hugetlb pool (MAP_HUGETLB) when some are
+ * free, otherwise by pages marked for the transparent huge pages (madvise
+ * MADV_HUGEPAGE) when they are enabled, and by normal pages as a last
+ * resort. Thread safe.
+ *
+ * @param size - the size of the area in bytes, rounded up to HUGE_PAGE_SIZE
+ * @param populate - whether to fault all the pages in right away, for the
+ *        areas used from the start, like the UMEM
+ * @param backing - if not NULL, will be set to the pages the area got
+ * Returns: the area, aligned on HUGE_PAGE_SIZE, or NULL if it cannot be mapped.
+ */
+void *alloc_pages(size_t size, int populate, enum page_backing *backing);
+
+/*
+ * @brief Unmaps an area returned by alloc_pages. Does nothing for NULL.
+ */
+void free_pages(void *area);
+
+/*
+ * @brief The number of bytes currently mapped by alloc_pages with a backing.
+ */
+size_t get_pages_usage(enum page_backing backing);
+
 /* Route table entry */
 struct route_table_entry {
   uint32_t prefix;
@@ -56,6 +338,30 @@ char *get_interface_ip(int interface);
  */
 void get_interface_mac(size_t interface, uint8_t *mac);
 
+/**
+ * @brief Get the kernel index of an interface (as given by if_nametoindex),
+ * e.g. to redirect frames to it from an XDP program.
+ *
+ * @param interface The interface of the router
+ */
+int get_interface_ifindex(size_t interface);
+
+/**
+ * @brief Get the MTU of an interface, as read by init (SIOCGIFMTU), i.e. the
+ * largest IP packet it sends, without the Ethernet header.
+ *
+ * @param interface The interface of the router
+ */
+int get_interface_mtu(size_t interface);
+
+/**
+ * @brief Get the number of bytes of every frame the receive functions copy
+ * into the buffers of the caller, which must have at least as many: the
+ * frames of the largest MTU of the interfaces, once init has read them, and
+ * never less than MAX_PACKET_LEN.
+ */
+size_t get_max_frame_len(void);
+
 /**
  * @brief Homework infrastructure function.
  *
@@ -75,6 +381,16 @@ void get_interface_mac(size_t interface, uint8_t *mac);
  */
 uint16_t checksum(uint16_t *data, size_t length);
 
+/**
+ * @brief Portable version of checksum, adding one 16-bit word at a time.
+ * checksum uses vectorized kernels (SSE2, AVX2 or NEON), chosen at startup
+ * depending on the features of the CPU, and must always agree with it.
+ *
+ * @param data memory area to checksum
+ * @param length in bytes
+ */
+uint16_t checksum_scalar(uint16_t *data, size_t length);
+
 /**
  * hwaddr_aton - Convert ASCII string to MAC address (colon-delimited format)
  * @txt: MAC address as a string (e.g., "00:11:22:33:44:55")
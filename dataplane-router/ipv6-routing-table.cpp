@@ -0,0 +1,108 @@
+#include "ipv6-routing-table.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <utility>
+
+namespace router {
+
+namespace {
+
+using RoutingTableEntry = Ipv6RoutingTable::RoutingTableEntry;
+
+bool same_prefix(const RoutingTableEntry &a, const RoutingTableEntry &b) {
+  return a.prefix_len == b.prefix_len && a.prefix == b.prefix;
+}
+
+// A route as given to the bulk build of the trie
+struct Prefix {
+  ipv6_key_t path;
+  uint8_t prefix_len;
+  uint32_t value;
+};
+
+} // namespace
+
+Ipv6RoutingTable::Ipv6RoutingTable() : version_(new Version{}) {}
+
+Ipv6RoutingTable::~Ipv6RoutingTable() { delete version_.load(); }
+
+void Ipv6RoutingTable::add_entries(tcb::span<const RoutingTableEntry> entries) {
+  std::lock_guard lock(update_mutex_);
+  routes_.insert(routes_.end(), entries.begin(), entries.end());
+  publish();
+}
+
+void Ipv6RoutingTable::remove_entries(
+    tcb::span<const RoutingTableEntry> entries) {
+  std::lock_guard lock(update_mutex_);
+  auto is_withdrawn = [entries](const RoutingTableEntry &route) {
+    return std::any_of(entries.begin(), entries.end(), [&](const auto &entry) {
+      return entry.prefix_len == route.prefix_len &&
+             ipv6::mask(entry.prefix, entry.prefix_len) == route.prefix;
+    });
+  };
+  routes_.erase(std::remove_if(routes_.begin(), routes_.end(), is_withdrawn),
+                routes_.end());
+  publish();
+}
+
+void Ipv6RoutingTable::replace_entries(
+    tcb::span<const RoutingTableEntry> entries) {
+  std::lock_guard lock(update_mutex_);
+  routes_.assign(entries.begin(), entries.end());
+  publish();
+}
+
+void Ipv6RoutingTable::publish() {
+  for (auto &route : routes_) {
+    route.prefix = ipv6::mask(route.prefix, route.prefix_len);
+  }
+  // Only keep the last route given for every prefix. The sort is stable, so
+  // it is the last one of each run.
+  std::stable_sort(routes_.begin(), routes_.end(),
+                   [](const RoutingTableEntry &a, const RoutingTableEntry &b) {
+                     return a.prefix < b.prefix ||
+                            (a.prefix == b.prefix &&
+                             a.prefix_len < b.prefix_len);
+                   });
+  auto last = routes_.begin();
+  for (auto it = routes_.begin(); it != routes_.end(); ++it) {
+    if (std::next(it) == routes_.end() || !same_prefix(*it, *std::next(it))) {
+      *last++ = *it;
+    }
+  }
+  routes_.erase(last, routes_.end());
+
+  auto version = std::make_unique<Version>();
+  std::vector<Prefix> prefixes;
+  prefixes.reserve(routes_.size());
+  // The index of every distinct next hop in version->next_hops
+  std::map<std::pair<Ipv6Address, iface_t>, uint32_t> next_hop_indices;
+  for (const auto &route : routes_) {
+    auto [it, inserted] = next_hop_indices.try_emplace(
+        {route.next_hop, route.interface},
+        static_cast<uint32_t>(version->next_hops.size()));
+    if (inserted) {
+      version->next_hops.push_back({route.next_hop, route.interface});
+    }
+    prefixes.push_back({.path = ipv6::to_key(route.prefix),
+                        .prefix_len = route.prefix_len,
+                        .value = it->second});
+  }
+  version->lpm.build(prefixes.begin(), prefixes.end());
+
+  // Swap in the new version, then free the old one once the lookups that may
+  // still be using it have finished
+  const Version *old_version = version_.exchange(version.release());
+  rcu::synchronize();
+  delete old_version;
+}
+
+size_t Ipv6RoutingTable::memory_usage() const {
+  rcu::ReadGuard guard;
+  return version_.load()->lpm.memory_usage();
+}
+
+} // namespace router
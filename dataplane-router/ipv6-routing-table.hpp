@@ -0,0 +1,107 @@
+#pragma once
+
+#include "common.hpp"
+#include "ipv6.hpp"
+#include "multibit_trie.hpp"
+#include "rcu.hpp"
+#include "span.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief Routing table of the IPv6 routes, updated with RCU like
+ * RoutingTable: every update builds a new version off the hot path, the
+ * lookups never take a lock.
+ *
+ * The longest prefix match is a multibit trie with a 16-bit root followed by
+ * 8-bit strides, so a lookup touches one slot per byte of the matched prefix
+ * past the first two: 3 for a /32, 5 for a /48, 7 for a /64, instead of one
+ * node per bit. Wider strides below the root would allocate a node of 64K
+ * slots for every distinct /16 of the table.
+ *
+ * A route with the same prefix as an existing one replaces it: there is no
+ * ECMP for IPv6.
+ */
+class Ipv6RoutingTable {
+public:
+  struct RoutingTableEntry {
+    Ipv6Address prefix;
+    uint8_t prefix_len;
+    // The unspecified address (::) for the routes of the directly connected
+    // networks, whose destinations are neighbors of the router
+    Ipv6Address next_hop;
+    iface_t interface;
+  };
+
+  struct NextHop {
+    Ipv6Address address;
+    iface_t interface;
+  };
+
+  Ipv6RoutingTable();
+  ~Ipv6RoutingTable();
+
+  Ipv6RoutingTable(const Ipv6RoutingTable &) = delete;
+  Ipv6RoutingTable &operator=(const Ipv6RoutingTable &) = delete;
+
+  void add_entries(tcb::span<const RoutingTableEntry> entries);
+
+  /**
+   * @brief Withdraw the routes having the same prefix as one of the given
+   * entries.
+   */
+  void remove_entries(tcb::span<const RoutingTableEntry> entries);
+
+  void replace_entries(tcb::span<const RoutingTableEntry> entries);
+
+  /**
+   * @brief Find the next hop of the longest prefix matching a destination.
+   * For a directly connected destination, the next hop is the destination
+   * itself.
+   */
+  [[nodiscard]] std::optional<NextHop> lookup(const Ipv6Address &dest) const {
+    rcu::ReadGuard guard;
+    const Version *version = version_.load();
+    auto index = version->lpm.longest_prefix_match(ipv6::to_key(dest));
+    if (!index) {
+      return std::nullopt;
+    }
+    NextHop next_hop = version->next_hops[*index];
+    if (ipv6::is_unspecified(next_hop.address)) {
+      next_hop.address = dest;
+    }
+    return next_hop;
+  }
+
+  // Bytes allocated by the published version of the longest prefix match
+  // structure
+  size_t memory_usage() const;
+
+private:
+  using Lpm = trie::MultibitTrie<ipv6_key_t, uint32_t, 16, 8, 8, 8, 8, 8, 8,
+                                 8, 8, 8, 8, 8, 8, 8, 8>;
+
+  // The trie stores the index of the next hop of each route in next_hops
+  struct Version {
+    Lpm lpm;
+    std::vector<NextHop> next_hops;
+  };
+
+  // Build a new version from routes_ and publish it, waiting for the previous
+  // one to be unused before freeing it. Must be called with update_mutex_
+  // held.
+  void publish();
+
+  std::atomic<const Version *> version_;
+  // The routes of the published version, only accessed by the writers
+  std::vector<RoutingTableEntry> routes_{};
+  std::mutex update_mutex_{};
+};
+
+} // namespace router
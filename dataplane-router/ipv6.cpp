@@ -0,0 +1,47 @@
+#include "ipv6.hpp"
+#include "lib_wrapper.hpp"
+
+#include <arpa/inet.h>
+
+namespace router::ipv6 {
+
+std::optional<Ipv6Address> parse(std::string_view text) {
+  // inet_pton needs a NUL-terminated string
+  std::array<char, INET6_ADDRSTRLEN> buffer;
+  if (text.size() >= buffer.size()) {
+    return std::nullopt;
+  }
+  std::copy(text.begin(), text.end(), buffer.begin());
+  buffer[text.size()] = '\0';
+
+  Ipv6Address address;
+  if (inet_pton(AF_INET6, buffer.data(), address.data()) != 1) {
+    return std::nullopt;
+  }
+  return address;
+}
+
+uint16_t icmpv6_checksum(const struct ipv6_hdr *ip_hdr, const void *message,
+                         size_t length) {
+  // The one's complement sum of the pseudo-header: both addresses, the
+  // length of the message and the next header
+  uint32_t sum = 0;
+  auto add_address = [&sum](const Ipv6Address &address) {
+    for (size_t i = 0; i < address.size(); i += 2) {
+      sum += static_cast<uint32_t>(address[i] << 8 | address[i + 1]);
+    }
+  };
+  add_address(ip_hdr->source_addr);
+  add_address(ip_hdr->dest_addr);
+  sum += static_cast<uint32_t>(length >> 16) +
+         static_cast<uint32_t>(length & 0xffff) + IPV6_NEXT_HEADER_ICMPV6;
+
+  // checksum gives the complement of the folded sum of the message
+  sum += static_cast<uint16_t>(~checksum(
+      const_cast<uint16_t *>(static_cast<const uint16_t *>(message)), length));
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<uint16_t>(~sum);
+}
+
+} // namespace router::ipv6
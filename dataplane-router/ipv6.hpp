@@ -0,0 +1,183 @@
+#pragma once
+
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+namespace router {
+
+// An IPv6 address, as stored in the headers (network byte order)
+using Ipv6Address = std::array<uint8_t, 16>;
+
+// An IPv6 address as a 128-bit integer in host byte order, the key of the
+// longest prefix match structures
+using ipv6_key_t = unsigned __int128;
+
+constexpr uint16_t ETHERTYPE_IPV6 = 0x86dd;
+
+struct ipv6_hdr {
+  // Version (4 bits), traffic class (8 bits) and flow label (20 bits)
+  uint32_t ver_tc_flow;
+  uint16_t payload_len;
+  uint8_t next_header;
+  uint8_t hop_limit;
+  Ipv6Address source_addr;
+  Ipv6Address dest_addr;
+} __attribute__((packed));
+
+struct icmpv6_hdr {
+  uint8_t type;
+  uint8_t code;
+  uint16_t checksum;
+  // Meaning depends on the type (identifier and sequence of the echo
+  // messages, flags of the neighbor advertisements, unused in the errors)
+  uint32_t data;
+} __attribute__((packed));
+
+// Neighbor solicitation and advertisement, after the ICMPv6 header whose data
+// holds the flags of the advertisements (RFC 4861)
+struct nd_msg {
+  Ipv6Address target;
+} __attribute__((packed));
+
+// Source or target link-layer address option of a neighbor discovery message
+struct nd_lladdr_option {
+  uint8_t type;
+  // In units of 8 bytes
+  uint8_t length;
+  uint8_t mac[6];
+} __attribute__((packed));
+
+constexpr size_t IPV6_HDR_SIZE = sizeof(struct ipv6_hdr);
+constexpr uint8_t IPV6_VERSION = 6;
+constexpr uint8_t IPV6_NEXT_HEADER_ICMPV6 = 58;
+constexpr uint8_t IPV6_DEFAULT_HOP_LIMIT = 64;
+// Every link must carry packets of that size, the ICMPv6 errors never exceed
+// it (RFC 8200)
+constexpr size_t IPV6_MIN_MTU = 1280;
+
+constexpr size_t ICMPV6_HDR_SIZE = sizeof(struct icmpv6_hdr);
+constexpr uint8_t ICMPV6_TYPE_UNREACH = 1;
+constexpr uint8_t ICMPV6_CODE_UNREACH_NO_ROUTE = 0;
+constexpr uint8_t ICMPV6_CODE_UNREACH_BEYOND_SCOPE = 2;
+constexpr uint8_t ICMPV6_TYPE_TIME_EXCEEDED = 3;
+constexpr uint8_t ICMPV6_CODE_HOP_LIMIT_EXCEEDED = 0;
+// The types below this one are errors, which never trigger another error
+constexpr uint8_t ICMPV6_TYPE_ECHO_REQUEST = 128;
+constexpr uint8_t ICMPV6_TYPE_ECHO_REPLY = 129;
+constexpr uint8_t ICMPV6_TYPE_NEIGHBOR_SOLICIT = 135;
+constexpr uint8_t ICMPV6_TYPE_NEIGHBOR_ADVERT = 136;
+
+constexpr size_t ND_MSG_SIZE = ICMPV6_HDR_SIZE + sizeof(struct nd_msg);
+constexpr size_t ND_OPTION_LLADDR_SIZE = sizeof(struct nd_lladdr_option);
+constexpr uint8_t ND_OPTION_SOURCE_LLADDR = 1;
+constexpr uint8_t ND_OPTION_TARGET_LLADDR = 2;
+// The neighbor discovery messages are only accepted with this hop limit,
+// which proves they have not been forwarded
+constexpr uint8_t ND_HOP_LIMIT = 255;
+// Flags of the neighbor advertisements, in host byte order
+constexpr uint32_t ND_ADVERT_ROUTER = uint32_t{1} << 31;
+constexpr uint32_t ND_ADVERT_SOLICITED = uint32_t{1} << 30;
+constexpr uint32_t ND_ADVERT_OVERRIDE = uint32_t{1} << 29;
+
+namespace ipv6 {
+
+constexpr Ipv6Address UNSPECIFIED{};
+constexpr Ipv6Address ALL_NODES{0xff, 0x02, 0, 0, 0, 0, 0, 0,
+                                0,    0,    0, 0, 0, 0, 0, 1};
+constexpr Ipv6Address ALL_ROUTERS{0xff, 0x02, 0, 0, 0, 0, 0, 0,
+                                  0,    0,    0, 0, 0, 0, 0, 2};
+
+inline ipv6_key_t to_key(const Ipv6Address &address) {
+  uint64_t high;
+  uint64_t low;
+  std::memcpy(&high, address.data(), sizeof(high));
+  std::memcpy(&low, address.data() + sizeof(high), sizeof(low));
+  return ipv6_key_t{util::ntoh(high)} << 64 | util::ntoh(low);
+}
+
+inline Ipv6Address from_key(ipv6_key_t key) {
+  Ipv6Address address;
+  uint64_t high = util::hton(static_cast<uint64_t>(key >> 64));
+  uint64_t low = util::hton(static_cast<uint64_t>(key));
+  std::memcpy(address.data(), &high, sizeof(high));
+  std::memcpy(address.data() + sizeof(high), &low, sizeof(low));
+  return address;
+}
+
+// Keep the `prefix_len` most significant bits of an address
+inline Ipv6Address mask(const Ipv6Address &address, size_t prefix_len) {
+  if (prefix_len == 0) {
+    return UNSPECIFIED;
+  }
+  return from_key(to_key(address) & (~ipv6_key_t{0} << (128 - prefix_len)));
+}
+
+constexpr bool is_multicast(const Ipv6Address &address) {
+  return address[0] == 0xff;
+}
+
+// fe80::/10
+constexpr bool is_link_local(const Ipv6Address &address) {
+  return address[0] == 0xfe && (address[1] & 0xc0) == 0x80;
+}
+
+inline bool is_unspecified(const Ipv6Address &address) {
+  return address == UNSPECIFIED;
+}
+
+// The solicited-node multicast group of an address, ff02::1:ffXX:XXXX, to
+// which the neighbor solicitations for it are sent (RFC 4291)
+inline Ipv6Address solicited_node(const Ipv6Address &address) {
+  Ipv6Address group{0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff};
+  std::copy(address.begin() + 13, address.end(), group.begin() + 13);
+  return group;
+}
+
+// The MAC address of a multicast group, 33:33 followed by its last 4 bytes
+// (RFC 2464)
+inline std::array<uint8_t, 6> multicast_mac(const Ipv6Address &group) {
+  return {0x33, 0x33, group[12], group[13], group[14], group[15]};
+}
+
+// The link-local address of an interface, with the modified EUI-64 identifier
+// of its MAC address (RFC 4291)
+inline Ipv6Address link_local(const std::array<uint8_t, 6> &mac) {
+  Ipv6Address address{0xfe, 0x80};
+  address[8] = static_cast<uint8_t>(mac[0] ^ 0x02);
+  address[9] = mac[1];
+  address[10] = mac[2];
+  address[11] = 0xff;
+  address[12] = 0xfe;
+  std::copy(mac.begin() + 3, mac.end(), address.begin() + 13);
+  return address;
+}
+
+/**
+ * @brief Parse an address in the text form of RFC 4291 (e.g. "2001:db8::1")
+ *
+ * @return The address, or std::nullopt if the text is not a valid address
+ */
+std::optional<Ipv6Address> parse(std::string_view text);
+
+/**
+ * @brief Checksum of an ICMPv6 message, which includes the pseudo-header of
+ * its IPv6 header (RFC 8200), in host byte order. Computed with the checksum
+ * field set to 0, it is the value of the field; computed over a received
+ * message, it is 0 if the message is intact.
+ *
+ * @param ip_hdr The IPv6 header of the message, for its addresses
+ * @param message The ICMPv6 header followed by its payload
+ * @param length The length of the message
+ */
+uint16_t icmpv6_checksum(const struct ipv6_hdr *ip_hdr, const void *message,
+                         size_t length);
+
+} // namespace ipv6
+
+} // namespace router
@@ -1,19 +1,45 @@
+#define _GNU_SOURCE
 #include "lib.h"
 
 #include <arpa/inet.h>
 #include <asm/byteorder.h>
+#include <errno.h>
+#include <linux/bpf.h>
 #include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <linux/virtio_net.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 int interfaces[ROUTER_NUM_INTERFACES];
+/* Kernel indices of the interfaces, for the AF_XDP sockets */
+static int interface_indices[ROUTER_NUM_INTERFACES];
+/* MTUs of the interfaces, read by init */
+static int interface_mtus[ROUTER_NUM_INTERFACES];
+/* Bytes read of every frame received in a buffer of the caller: a frame of
+ * the largest MTU of the interfaces, and never less than MAX_PACKET_LEN */
+static size_t max_frame_len = MAX_PACKET_LEN;
 
 int get_sock(const char *if_name) {
   int res;
@@ -35,21 +61,1117 @@ int get_sock(const char *if_name) {
   return s;
 }
 
+/* epoll instance watching all the interfaces, set up once by init */
+static int link_epoll_fd = -1;
+/* Same, for the AF_XDP sockets of the interfaces */
+static int xsk_epoll_fd = -1;
+/* Interface served first by the next receive call. It is rotated on every
+ * call, so that no interface is favoured because of its index. */
+static int next_link;
+
+/* Returns an epoll instance watching the sockets fds[0..count), each
+ * identified by its index */
+static int create_link_epoll(const int fds[], int count) {
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  DIE(epoll_fd == -1, "epoll_create1");
+
+  for (int i = 0; i < count; i++) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    int res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+    DIE(res == -1, "epoll_ctl");
+  }
+  return epoll_fd;
+}
+
+/* Returns the interface to serve first and advances the rotation */
+static int rotate_links(void) {
+  int first = next_link;
+  next_link = (next_link + 1) % ROUTER_NUM_INTERFACES;
+  return first;
+}
+
+/* Longest time the receive calls block for, set up by init_recv_timeout, -1
+ * when they block until a frame arrives */
+static int recv_timeout_ms = -1;
+
+/*
+ * Blocks until at least one of the sockets watched by epoll_fd is readable,
+ * or until the receive timeout expires, and fills ready with their
+ * interfaces, in round-robin order. Returns their number, 0 on timeout.
+ */
+static size_t wait_ready_links(int epoll_fd, int ready[]) {
+  struct epoll_event events[ROUTER_NUM_INTERFACES];
+  int readable[ROUTER_NUM_INTERFACES] = {0};
+  int res;
+
+  do {
+    res = epoll_wait(epoll_fd, events, ROUTER_NUM_INTERFACES,
+                     recv_timeout_ms);
+  } while (res == -1 && errno == EINTR);
+  DIE(res == -1, "epoll_wait");
+
+  for (int i = 0; i < res; i++)
+    readable[events[i].data.u32] = 1;
+
+  size_t count = 0;
+  int first = rotate_links();
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+    int link = (first + i) % ROUTER_NUM_INTERFACES;
+    if (readable[link])
+      ready[count++] = link;
+  }
+  return count;
+}
+
+/* Fills ready with all the interfaces, in round-robin order, for the polls
+ * made without waiting for them to be readable. Returns their number. */
+static size_t all_links(int ready[]) {
+  int first = rotate_links();
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++)
+    ready[i] = (first + i) % ROUTER_NUM_INTERFACES;
+  return ROUTER_NUM_INTERFACES;
+}
+
+/* Poll mode, set up by init_busy_poll: time the receive calls keep polling
+ * idle interfaces before blocking, 0 when they block right away */
+static uint64_t poll_spin_ns;
+
+/* Bound on the pauses made between two polls of idle interfaces. A pause
+ * takes from a few to about a hundred cycles, depending on the CPU. */
+#define POLL_MAX_PAUSES 16
+
+/* Spinning state of a receive call */
+struct link_poll {
+  /* End of the spinning, 0 until the first poll that found no frame */
+  uint64_t deadline_ns;
+  /* Pauses made after the next idle poll */
+  unsigned int pauses;
+};
+
+/* Tells the CPU the thread is spinning, freeing the pipeline for the other
+ * hardware thread of the core and saving power */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Called when a poll of the interfaces found no frame. In poll mode, pauses a
+ * little longer at each call and returns 1 for the caller to poll again, until
+ * the interfaces have been idle for the spin time: it then returns 0, and the
+ * caller blocks until a frame arrives. Always returns 0 outside poll mode.
+ */
+static int link_poll_again(struct link_poll *idle) {
+  if (poll_spin_ns == 0)
+    return 0;
+
+  uint64_t now = monotonic_ns();
+  if (idle->deadline_ns == 0) {
+    idle->deadline_ns = now + poll_spin_ns;
+    idle->pauses = 1;
+  } else if (now >= idle->deadline_ns) {
+    idle->deadline_ns = 0;
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < idle->pauses; i++)
+    cpu_relax();
+  if (idle->pauses < POLL_MAX_PAUSES)
+    idle->pauses *= 2;
+  return 1;
+}
+
+/* Maximum number of frames passed to a single recvmmsg/sendmmsg call */
+#define LINK_BURST_MAX 64
+
+/* TPACKET_V3 ring geometry, per interface */
+#define RING_BLOCK_SIZE (1 << 16)
+/* Smallest TX ring slot, doubled until a frame of the largest MTU fits */
+#define RING_MIN_FRAME_SIZE (1 << 11)
+#define RING_RX_BLOCKS 64
+#define RING_TX_BLOCKS 32
+/* Time after which the kernel hands a partially filled RX block to us */
+#define RING_RX_BLOCK_TIMEOUT_MS 1
+/* Offset of the frame data in a TX ring slot */
+#define RING_TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct ring {
+  uint8_t *map;
+  size_t map_size;
+  struct tpacket_req3 rx_req;
+  struct tpacket_req3 tx_req;
+
+  /* Block currently being read, or the next one to wait for */
+  unsigned int rx_block;
+  /* Next packet of the current block, NULL if the block is not open */
+  struct tpacket3_hdr *rx_pkt;
+  uint32_t rx_pkts_left;
+  /* Fully read blocks, returned to the kernel on the next receive call, as
+   * the frames handed out from them must stay valid until then */
+  unsigned int rx_release_block;
+  unsigned int rx_release_count;
+
+  /* Next TX slot to fill */
+  unsigned int tx_frame;
+  /* Serializes the senders sharing the TX ring */
+  pthread_mutex_t tx_lock;
+};
+
+static struct ring rings[ROUTER_NUM_INTERFACES];
+static int rings_enabled;
+
+static struct tpacket_block_desc *ring_rx_block(struct ring *ring,
+                                                unsigned int block) {
+  return (struct tpacket_block_desc *)(ring->map +
+                                       (size_t)block * RING_BLOCK_SIZE);
+}
+
+static struct tpacket3_hdr *ring_tx_frame(struct ring *ring,
+                                          unsigned int frame) {
+  size_t rx_size = (size_t)RING_RX_BLOCKS * RING_BLOCK_SIZE;
+  return (struct tpacket3_hdr *)(ring->map + rx_size +
+                                 (size_t)frame * ring->tx_req.tp_frame_size);
+}
+
+/* Size of the ring slots, holding a frame of the largest MTU after its
+ * header */
+static unsigned int ring_frame_size(void) {
+  unsigned int size = RING_MIN_FRAME_SIZE;
+  while (size - RING_TX_DATA_OFFSET < max_frame_len)
+    size *= 2;
+  DIE(size > RING_BLOCK_SIZE, "MTU too large for the packet rings");
+  return size;
+}
+
+static void setup_ring(int intidx) {
+  struct ring *ring = &rings[intidx];
+  int version = TPACKET_V3;
+  int res;
+
+  res = setsockopt(interfaces[intidx], SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version));
+  DIE(res == -1, "setsockopt PACKET_VERSION");
+
+  memset(ring, 0, sizeof(*ring));
+  pthread_mutex_init(&ring->tx_lock, NULL);
+  ring->rx_req.tp_block_size = RING_BLOCK_SIZE;
+  ring->rx_req.tp_block_nr = RING_RX_BLOCKS;
+  ring->rx_req.tp_frame_size = ring_frame_size();
+  ring->rx_req.tp_frame_nr =
+      RING_RX_BLOCKS * (RING_BLOCK_SIZE / ring->rx_req.tp_frame_size);
+  ring->rx_req.tp_retire_blk_tov = RING_RX_BLOCK_TIMEOUT_MS;
+  res = setsockopt(interfaces[intidx], SOL_PACKET, PACKET_RX_RING,
+                   &ring->rx_req, sizeof(ring->rx_req));
+  DIE(res == -1, "setsockopt PACKET_RX_RING");
+
+  /* The kernel does not support block transmission, so the TX ring is a
+   * plain array of frames */
+  ring->tx_req.tp_block_size = RING_BLOCK_SIZE;
+  ring->tx_req.tp_block_nr = RING_TX_BLOCKS;
+  ring->tx_req.tp_frame_size = ring_frame_size();
+  ring->tx_req.tp_frame_nr =
+      RING_TX_BLOCKS * (RING_BLOCK_SIZE / ring->tx_req.tp_frame_size);
+  res = setsockopt(interfaces[intidx], SOL_PACKET, PACKET_TX_RING,
+                   &ring->tx_req, sizeof(ring->tx_req));
+  DIE(res == -1, "setsockopt PACKET_TX_RING");
+
+  /* Both rings share one mapping, the RX ring coming first */
+  ring->map_size = (size_t)(RING_RX_BLOCKS + RING_TX_BLOCKS) * RING_BLOCK_SIZE;
+  ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_LOCKED | MAP_POPULATE, interfaces[intidx],
+                   0);
+  DIE(ring->map == MAP_FAILED, "mmap packet ring");
+}
+
+void init_rings(void) {
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++)
+    setup_ring(i);
+  rings_enabled = 1;
+}
+
+/* Returns the fully read RX blocks of a ring to the kernel */
+static void ring_release_rx_blocks(struct ring *ring) {
+  while (ring->rx_release_count > 0) {
+    struct tpacket_block_desc *block =
+        ring_rx_block(ring, ring->rx_release_block);
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    ring->rx_release_block = (ring->rx_release_block + 1) % RING_RX_BLOCKS;
+    ring->rx_release_count--;
+  }
+}
+
+/*
+ * Sets the offload metadata of a frame received with the given status, from
+ * its ring frame header or its auxiliary data: only whether its checksums
+ * need to be verified. They do not if the NIC validated them, nor if the
+ * frame comes from a local sender, which leaves the transport checksum to be
+ * computed on transmission but always computes the IP header checksum.
+ */
+static void vnet_hdr_from_status(struct vnet_hdr *hdr, uint32_t status) {
+  memset(hdr, 0, sizeof(*hdr));
+  if (status & (TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY))
+    hdr->flags = VNET_HDR_F_DATA_VALID;
+}
+
+/*
+ * Hands out up to max_frames frames of an interface's RX ring, opening new
+ * blocks as the kernel fills them, along with their checksum status if
+ * vnet_hdrs is not NULL. Returns the number of frames read.
+ */
+static size_t ring_recv_burst(int intidx, char *frames[], size_t lengths[],
+                              struct vnet_hdr vnet_hdrs[],
+                              size_t max_frames) {
+  struct ring *ring = &rings[intidx];
+  size_t count = 0;
+
+  while (count < max_frames) {
+    if (ring->rx_pkt == NULL) {
+      struct tpacket_block_desc *block = ring_rx_block(ring, ring->rx_block);
+      uint32_t status = __atomic_load_n(&block->hdr.bh1.block_status,
+                                        __ATOMIC_ACQUIRE);
+      if (!(status & TP_STATUS_USER))
+        break;
+
+      ring->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)block +
+                                             block->hdr.bh1.offset_to_first_pkt);
+      ring->rx_pkts_left = block->hdr.bh1.num_pkts;
+    }
+
+    while (ring->rx_pkts_left > 0 && count < max_frames) {
+      struct tpacket3_hdr *pkt = ring->rx_pkt;
+      frames[count] = (char *)pkt + pkt->tp_mac;
+      lengths[count] = pkt->tp_snaplen;
+      if (vnet_hdrs)
+        vnet_hdr_from_status(&vnet_hdrs[count], pkt->tp_status);
+      count++;
+
+      ring->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)pkt +
+                                             pkt->tp_next_offset);
+      ring->rx_pkts_left--;
+    }
+
+    if (ring->rx_pkts_left == 0) {
+      if (ring->rx_release_count == 0)
+        ring->rx_release_block = ring->rx_block;
+      ring->rx_release_count++;
+      ring->rx_block = (ring->rx_block + 1) % RING_RX_BLOCKS;
+      ring->rx_pkt = NULL;
+    }
+  }
+
+  return count;
+}
+
+static size_t recv_burst_from_rings_hdrs(char *frames[], size_t lengths[],
+                                         size_t frame_interfaces[],
+                                         struct vnet_hdr vnet_hdrs[],
+                                         size_t max_frames) {
+  struct link_poll idle = {0};
+  size_t count = 0;
+
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++)
+    ring_release_rx_blocks(&rings[i]);
+
+  while (1) {
+    /* Split the burst evenly between the interfaces, so a busy interface
+     * cannot starve the others */
+    size_t share = max_frames / ROUTER_NUM_INTERFACES;
+    if (share == 0)
+      share = 1;
+
+    int first = rotate_links();
+    for (int round = 0; round < 2 && count < max_frames; round++) {
+      for (int k = 0; k < ROUTER_NUM_INTERFACES && count < max_frames; k++) {
+        int i = (first + k) % ROUTER_NUM_INTERFACES;
+        /* The second round hands the unused shares to the busy interfaces */
+        size_t limit = round == 0 ? share : max_frames;
+        if (limit > max_frames - count)
+          limit = max_frames - count;
+
+        size_t received = ring_recv_burst(i, frames + count, lengths + count,
+                                          vnet_hdrs ? vnet_hdrs + count : NULL,
+                                          limit);
+        for (size_t j = 0; j < received; j++)
+          frame_interfaces[count + j] = i;
+        count += received;
+      }
+    }
+
+    if (count > 0)
+      return count;
+    if (link_poll_again(&idle))
+      continue;
+
+    /* A packet socket with an RX ring is readable once its current block has
+     * been handed to user space */
+    int ready[ROUTER_NUM_INTERFACES];
+    if (wait_ready_links(link_epoll_fd, ready) == 0)
+      return 0;
+  }
+}
+
+size_t recv_burst_from_rings(char *frames[], size_t lengths[],
+                             size_t frame_interfaces[], size_t max_frames) {
+  return recv_burst_from_rings_hdrs(frames, lengths, frame_interfaces, NULL,
+                                    max_frames);
+}
+
+size_t recv_burst_from_rings_vnet(char *frames[], size_t lengths[],
+                                  size_t frame_interfaces[],
+                                  struct vnet_hdr vnet_hdrs[],
+                                  size_t max_frames) {
+  return recv_burst_from_rings_hdrs(frames, lengths, frame_interfaces,
+                                    vnet_hdrs, max_frames);
+}
+
+/* Asks the kernel to transmit the pending frames of a TX ring. A blocking
+ * call returns once all of them have been sent. */
+static void ring_flush_tx(int intidx, int flags) {
+  int ret;
+  do {
+    ret = sendto(interfaces[intidx], NULL, 0, flags, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  DIE(ret < 0 && errno != EAGAIN && errno != ENOBUFS, "sendto packet ring");
+}
+
+/*
+ * Queues a burst of frames on an interface's TX ring and kicks the
+ * transmission with a single system call.
+ */
+static size_t ring_send_burst(int intidx, char *frames[], size_t lengths[],
+                              size_t count) {
+  struct ring *ring = &rings[intidx];
+
+  pthread_mutex_lock(&ring->tx_lock);
+
+  for (size_t i = 0; i < count; i++) {
+    struct tpacket3_hdr *hdr = ring_tx_frame(ring, ring->tx_frame);
+
+    /* Wait for the slot to be released by the kernel if the ring is full */
+    while (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+           TP_STATUS_AVAILABLE) {
+      DIE(hdr->tp_status & TP_STATUS_WRONG_FORMAT, "packet ring frame format");
+      ring_flush_tx(intidx, 0);
+    }
+
+    size_t length = lengths[i];
+    if (length > ring->tx_req.tp_frame_size - RING_TX_DATA_OFFSET)
+      length = ring->tx_req.tp_frame_size - RING_TX_DATA_OFFSET;
+
+    /* The RX and TX rings of different interfaces are distinct mappings, so
+     * the frame has to be copied once into the slot of the output ring */
+    memcpy((uint8_t *)hdr + RING_TX_DATA_OFFSET, frames[i], length);
+    hdr->tp_len = length;
+    hdr->tp_snaplen = length;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+                     __ATOMIC_RELEASE);
+
+    ring->tx_frame = (ring->tx_frame + 1) % ring->tx_req.tp_frame_nr;
+  }
+
+  ring_flush_tx(intidx, MSG_DONTWAIT);
+  pthread_mutex_unlock(&ring->tx_lock);
+  return count;
+}
+
+/* AF_XDP ring sizes, per interface and per ring */
+#define XSK_RING_SIZE 2048
+/* Chunks of the UMEM shared by all the interfaces */
+#define XSK_NUM_FRAMES (ROUTER_NUM_INTERFACES * 2 * XSK_RING_SIZE)
+
+_Static_assert(XSK_FRAME_HEADROOM == XDP_PACKET_HEADROOM,
+               "the RX frames start after the XDP headroom of their chunk");
+
+/* A single-producer, single-consumer ring shared with the kernel */
+struct xsk_queue {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *descs;
+  void *map;
+  size_t map_size;
+};
+
+struct xsk {
+  int fd;
+  struct xsk_queue rx;
+  struct xsk_queue tx;
+  struct xsk_queue fill;
+  struct xsk_queue completion;
+
+  /* Chunks handed out by the last receive call, released on the next one,
+   * as the frames must stay valid until then */
+  uint64_t held[LINK_BURST_MAX];
+  size_t held_count;
+
+  /* Serializes the senders sharing the TX ring, and the reaping of its
+   * completion ring */
+  pthread_mutex_t tx_lock;
+};
+
+static struct xsk xsks[ROUTER_NUM_INTERFACES];
+static int xdp_enabled;
+
+/*
+ * The UMEM, a single area of XSK_NUM_FRAMES chunks of XSK_FRAME_SIZE bytes
+ * shared by the sockets of all the interfaces. A frame received on one
+ * interface is thus sent on any other by handing the descriptor of its chunk
+ * to the TX ring of the output interface, without copying it.
+ */
+static uint8_t *umem_area;
+/* References to each chunk: the receive call that handed it out, and every
+ * transmission in flight. A chunk is free once there are none left. */
+static uint32_t umem_refs[XSK_NUM_FRAMES];
+/* Free chunks, given to the fill rings as they empty */
+static uint64_t umem_free[XSK_NUM_FRAMES];
+static size_t umem_free_count;
+static pthread_mutex_t umem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static void umem_put_chunk(uint64_t chunk) {
+  if (__atomic_sub_fetch(&umem_refs[chunk / XSK_FRAME_SIZE], 1,
+                         __ATOMIC_ACQ_REL) != 0)
+    return;
+  pthread_mutex_lock(&umem_lock);
+  umem_free[umem_free_count++] = chunk;
+  pthread_mutex_unlock(&umem_lock);
+}
+
+/* Takes up to count free chunks, each with one reference. Returns their
+ * number. */
+static size_t umem_get_chunks(uint64_t chunks[], size_t count) {
+  pthread_mutex_lock(&umem_lock);
+  if (count > umem_free_count)
+    count = umem_free_count;
+  umem_free_count -= count;
+  memcpy(chunks, umem_free + umem_free_count, count * sizeof(chunks[0]));
+  pthread_mutex_unlock(&umem_lock);
+
+  for (size_t i = 0; i < count; i++)
+    __atomic_store_n(&umem_refs[chunks[i] / XSK_FRAME_SIZE], 1,
+                     __ATOMIC_RELAXED);
+  return count;
+}
+
+static void xsk_map_queue(int fd, struct xsk_queue *queue,
+                          const struct xdp_ring_offset *offsets,
+                          size_t desc_size, off_t pgoff) {
+  queue->map_size = offsets->desc + XSK_RING_SIZE * desc_size;
+  queue->map = mmap(NULL, queue->map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  DIE(queue->map == MAP_FAILED, "mmap xsk ring");
+  queue->producer = (uint32_t *)((uint8_t *)queue->map + offsets->producer);
+  queue->consumer = (uint32_t *)((uint8_t *)queue->map + offsets->consumer);
+  queue->flags = (uint32_t *)((uint8_t *)queue->map + offsets->flags);
+  queue->descs = (uint8_t *)queue->map + offsets->desc;
+}
+
+/* Number of entries the kernel has produced and we have not consumed yet */
+static uint32_t xsk_queue_ready(const struct xsk_queue *queue) {
+  return __atomic_load_n(queue->producer, __ATOMIC_ACQUIRE) -
+         *queue->consumer;
+}
+
+/* Number of entries we can produce before the ring is full */
+static uint32_t xsk_queue_free(const struct xsk_queue *queue) {
+  return XSK_RING_SIZE - (*queue->producer -
+                          __atomic_load_n(queue->consumer, __ATOMIC_ACQUIRE));
+}
+
+static void setup_xsk(int intidx) {
+  struct xsk *xsk = &xsks[intidx];
+  int ring_size = XSK_RING_SIZE;
+  int res;
+
+  memset(xsk, 0, sizeof(*xsk));
+  pthread_mutex_init(&xsk->tx_lock, NULL);
+  xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+  DIE(xsk->fd == -1, "socket AF_XDP");
+
+  /* The UMEM is registered once, by the socket of the first interface, and
+   * shared by the others. Every socket has its own fill and completion
+   * rings nonetheless. */
+  if (intidx == 0) {
+    struct xdp_umem_reg reg = {.addr = (uintptr_t)umem_area,
+                               .len = (uint64_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE,
+                               .chunk_size = XSK_FRAME_SIZE,
+                               .headroom = 0};
+    res = setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg));
+    DIE(res == -1, "setsockopt XDP_UMEM_REG");
+  }
+  res = setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+                   sizeof(ring_size));
+  DIE(res == -1, "setsockopt XDP_UMEM_FILL_RING");
+  res = setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+                   sizeof(ring_size));
+  DIE(res == -1, "setsockopt XDP_UMEM_COMPLETION_RING");
+  res = setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size,
+                   sizeof(ring_size));
+  DIE(res == -1, "setsockopt XDP_RX_RING");
+  res = setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size,
+                   sizeof(ring_size));
+  DIE(res == -1, "setsockopt XDP_TX_RING");
+
+  struct xdp_mmap_offsets offsets;
+  socklen_t optlen = sizeof(offsets);
+  res = getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen);
+  DIE(res == -1, "getsockopt XDP_MMAP_OFFSETS");
+  xsk_map_queue(xsk->fd, &xsk->rx, &offsets.rx, sizeof(struct xdp_desc),
+                XDP_PGOFF_RX_RING);
+  xsk_map_queue(xsk->fd, &xsk->tx, &offsets.tx, sizeof(struct xdp_desc),
+                XDP_PGOFF_TX_RING);
+  xsk_map_queue(xsk->fd, &xsk->fill, &offsets.fr, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_FILL_RING);
+  xsk_map_queue(xsk->fd, &xsk->completion, &offsets.cr, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_COMPLETION_RING);
+
+  /* The sockets sharing the UMEM inherit the flags of its owner */
+  struct sockaddr_xdp addr = {.sxdp_family = AF_XDP,
+                              .sxdp_ifindex = interface_indices[intidx],
+                              .sxdp_queue_id = 0};
+  if (intidx == 0) {
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP;
+  } else {
+    addr.sxdp_flags = XDP_SHARED_UMEM;
+    addr.sxdp_shared_umem_fd = xsks[0].fd;
+  }
+  res = bind(xsk->fd, (struct sockaddr *)&addr, sizeof(addr));
+  DIE(res == -1, "bind AF_XDP");
+}
+
+/*
+ * Loads and attaches to an interface the XDP program that redirects the
+ * frames of its queue 0 to its socket, through a one-entry XSKMAP. The frames
+ * of the other queues are passed to the kernel stack.
+ */
+static void attach_xdp_program(int intidx) {
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(int);
+  attr.max_entries = 1;
+  int map_fd = bpf(BPF_MAP_CREATE, &attr);
+  DIE(map_fd == -1, "bpf BPF_MAP_CREATE");
+
+  uint32_t queue = 0;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uintptr_t)&queue;
+  attr.value = (uintptr_t)&xsks[intidx].fd;
+  DIE(bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1, "bpf BPF_MAP_UPDATE_ELEM");
+
+  /* return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS); */
+  struct bpf_insn program[] = {
+      {.code = BPF_LDX | BPF_MEM | BPF_W,
+       .dst_reg = BPF_REG_2,
+       .src_reg = BPF_REG_1,
+       .off = offsetof(struct xdp_md, rx_queue_index)},
+      {.code = BPF_LD | BPF_DW | BPF_IMM,
+       .dst_reg = BPF_REG_1,
+       .src_reg = BPF_PSEUDO_MAP_FD,
+       .imm = map_fd},
+      {.code = 0},
+      {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS},
+      {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+      {.code = BPF_JMP | BPF_EXIT},
+  };
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t)program;
+  attr.insn_cnt = sizeof(program) / sizeof(program[0]);
+  attr.license = (uintptr_t) "GPL";
+  int prog_fd = bpf(BPF_PROG_LOAD, &attr);
+  DIE(prog_fd == -1, "bpf BPF_PROG_LOAD");
+
+  /* The link detaches the program when the router exits */
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = prog_fd;
+  attr.link_create.target_ifindex = interface_indices[intidx];
+  attr.link_create.attach_type = BPF_XDP;
+  DIE(bpf(BPF_LINK_CREATE, &attr) == -1, "bpf BPF_LINK_CREATE");
+}
+
+void init_xdp(void) {
+  /* Without multi-buffer support, a frame must fit in a single chunk */
+  DIE(max_frame_len > XSK_FRAME_SIZE - XSK_FRAME_HEADROOM,
+      "MTU too large for the AF_XDP frames");
+  umem_area = alloc_pages((size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE, 1, NULL);
+  DIE(umem_area == NULL, "mmap umem");
+  for (size_t i = 0; i < XSK_NUM_FRAMES; i++)
+    umem_free[i] = (uint64_t)i * XSK_FRAME_SIZE;
+  umem_free_count = XSK_NUM_FRAMES;
+
+  int fds[ROUTER_NUM_INTERFACES];
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+    setup_xsk(i);
+    attach_xdp_program(i);
+    fds[i] = xsks[i].fd;
+  }
+  xsk_epoll_fd = create_link_epoll(fds, ROUTER_NUM_INTERFACES);
+  xdp_enabled = 1;
+}
+
+/* Frees the chunks of the frames the kernel has finished transmitting. The TX
+ * lock of the socket must be held. */
+static void xsk_reap_completions(struct xsk *xsk) {
+  uint32_t count = xsk_queue_ready(&xsk->completion);
+  uint32_t consumer = *xsk->completion.consumer;
+  const uint64_t *addrs = xsk->completion.descs;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t addr = addrs[(consumer + i) & (XSK_RING_SIZE - 1)];
+    umem_put_chunk(addr - addr % XSK_FRAME_SIZE);
+  }
+  __atomic_store_n(xsk->completion.consumer, consumer + count,
+                   __ATOMIC_RELEASE);
+}
+
+/* Gives the free chunks to the fill ring of a socket, for the kernel to
+ * receive the next frames into */
+static void xsk_refill(struct xsk *xsk) {
+  uint64_t chunks[XSK_RING_SIZE];
+  size_t count = umem_get_chunks(chunks, xsk_queue_free(&xsk->fill));
+  uint32_t producer = *xsk->fill.producer;
+  uint64_t *addrs = xsk->fill.descs;
+
+  for (size_t i = 0; i < count; i++)
+    addrs[(producer + i) & (XSK_RING_SIZE - 1)] = chunks[i];
+  __atomic_store_n(xsk->fill.producer, producer + count, __ATOMIC_RELEASE);
+
+  /* The kernel may be waiting for chunks to receive into */
+  if (__atomic_load_n(xsk->fill.flags, __ATOMIC_ACQUIRE) &
+      XDP_RING_NEED_WAKEUP)
+    recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/*
+ * Hands out up to max_frames frames of an interface's RX ring, after
+ * releasing the frames handed out by the previous call. Returns the number of
+ * frames read.
+ */
+static size_t xsk_recv_burst(int intidx, char *frames[], size_t lengths[],
+                             size_t max_frames) {
+  struct xsk *xsk = &xsks[intidx];
+
+  for (size_t i = 0; i < xsk->held_count; i++)
+    umem_put_chunk(xsk->held[i]);
+  xsk->held_count = 0;
+
+  /* Recycle the transmitted chunks if no sender is doing it */
+  if (pthread_mutex_trylock(&xsk->tx_lock) == 0) {
+    xsk_reap_completions(xsk);
+    pthread_mutex_unlock(&xsk->tx_lock);
+  }
+  xsk_refill(xsk);
+
+  if (max_frames > LINK_BURST_MAX)
+    max_frames = LINK_BURST_MAX;
+  uint32_t count = xsk_queue_ready(&xsk->rx);
+  if (count > max_frames)
+    count = max_frames;
+
+  uint32_t consumer = *xsk->rx.consumer;
+  const struct xdp_desc *descs = xsk->rx.descs;
+  for (uint32_t i = 0; i < count; i++) {
+    const struct xdp_desc *desc = &descs[(consumer + i) & (XSK_RING_SIZE - 1)];
+    frames[i] = (char *)umem_area + desc->addr;
+    lengths[i] = desc->len;
+    /* The chunk was given to the fill ring with one reference, which is now
+     * that of this call */
+    xsk->held[i] = desc->addr - desc->addr % XSK_FRAME_SIZE;
+  }
+  xsk->held_count = count;
+  __atomic_store_n(xsk->rx.consumer, consumer + count, __ATOMIC_RELEASE);
+
+  /* In poll mode, the system call runs the busy polling of the driver, which
+   * fills the RX ring for the next call */
+  if (count == 0 && poll_spin_ns != 0)
+    recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+  return count;
+}
+
+size_t recv_burst_from_xdp(char *frames[], size_t lengths[],
+                           size_t frame_interfaces[], size_t max_frames) {
+  struct link_poll idle = {0};
+  size_t count = 0;
+
+  while (1) {
+    /* Split the burst evenly between the interfaces, so a busy interface
+     * cannot starve the others. Every interface is visited, to release the
+     * frames handed out by the previous call. */
+    size_t share = max_frames / ROUTER_NUM_INTERFACES;
+    if (share == 0)
+      share = 1;
+
+    int first = rotate_links();
+    for (int k = 0; k < ROUTER_NUM_INTERFACES; k++) {
+      int i = (first + k) % ROUTER_NUM_INTERFACES;
+      size_t limit = share;
+      if (limit > max_frames - count)
+        limit = max_frames - count;
+
+      size_t received =
+          xsk_recv_burst(i, frames + count, lengths + count, limit);
+      for (size_t j = 0; j < received; j++)
+        frame_interfaces[count + j] = i;
+      count += received;
+    }
+
+    if (count > 0)
+      return count;
+    if (link_poll_again(&idle))
+      continue;
+
+    int ready[ROUTER_NUM_INTERFACES];
+    if (wait_ready_links(xsk_epoll_fd, ready) == 0)
+      return 0;
+  }
+}
+
+/*
+ * Queues a burst of frames on an interface's TX ring and kicks the
+ * transmission with a single system call. The frames received in the UMEM
+ * are sent in place; the other ones are copied into a free chunk first.
+ */
+static size_t xsk_send_burst(int intidx, char *frames[], size_t lengths[],
+                             size_t count) {
+  struct xsk *xsk = &xsks[intidx];
+  const uint8_t *umem_end = umem_area + (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+  size_t sent = 0;
+
+  pthread_mutex_lock(&xsk->tx_lock);
+
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *data = (uint8_t *)frames[i];
+    size_t length = lengths[i];
+    uint64_t addr;
+
+    if (data >= umem_area && data < umem_end) {
+      addr = data - umem_area;
+      __atomic_add_fetch(&umem_refs[addr / XSK_FRAME_SIZE], 1,
+                         __ATOMIC_RELAXED);
+    } else {
+      if (umem_get_chunks(&addr, 1) == 0) {
+        /* Out of chunks, the frame is dropped as a full NIC queue would */
+        continue;
+      }
+      if (length > XSK_FRAME_SIZE)
+        length = XSK_FRAME_SIZE;
+      memcpy(umem_area + addr, data, length);
+    }
+
+    /* Wait for the kernel to make room if the ring is full */
+    while (xsk_queue_free(&xsk->tx) == 0) {
+      sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+      xsk_reap_completions(xsk);
+    }
+
+    uint32_t producer = *xsk->tx.producer;
+    struct xdp_desc *desc =
+        &((struct xdp_desc *)xsk->tx.descs)[producer & (XSK_RING_SIZE - 1)];
+    desc->addr = addr;
+    desc->len = length;
+    desc->options = 0;
+    __atomic_store_n(xsk->tx.producer, producer + 1, __ATOMIC_RELEASE);
+    sent++;
+  }
+
+  if (__atomic_load_n(xsk->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+    sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+  xsk_reap_completions(xsk);
+
+  pthread_mutex_unlock(&xsk->tx_lock);
+  return sent;
+}
+
+_Static_assert(sizeof(struct vnet_hdr) == sizeof(struct virtio_net_hdr),
+               "vnet_hdr must match virtio_net_hdr");
+
+/* Whether the sockets carry a vnet_hdr before every frame */
+static int vnet_hdr_enabled;
+/* Header of the frames sent without offload metadata */
+static const struct vnet_hdr no_vnet_hdr;
+
+void init_vnet_hdr(void) {
+  int version = 1;
+
+  DIE(rings_enabled || xdp_enabled,
+      "PACKET_VNET_HDR needs the sockets, without the rings or AF_XDP");
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+    int res = setsockopt(interfaces[i], SOL_PACKET, PACKET_VNET_HDR, &version,
+                         sizeof(version));
+    DIE(res == -1, "setsockopt PACKET_VNET_HDR");
+  }
+  vnet_hdr_enabled = 1;
+}
+
+/* Whether the sockets receive the status of every frame as auxiliary data */
+static int auxdata_enabled;
+
+void init_auxdata(void) {
+  int enable = 1;
+
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+    int res = setsockopt(interfaces[i], SOL_PACKET, PACKET_AUXDATA, &enable,
+                         sizeof(enable));
+    DIE(res == -1, "setsockopt PACKET_AUXDATA");
+  }
+  auxdata_enabled = 1;
+}
+
 int send_to_link(size_t length, char *frame_data, size_t intidx) {
   /*
    * Note that "buffer" should be at least the MTU size of the
    * interface, eg 1500 bytes
    */
+  if (send_burst_to_link(intidx, &frame_data, &length, 1) == 0)
+    return -1;
+  return length;
+}
+
+/*
+ * Sends frames on an interface with sendmmsg. With PACKET_VNET_HDR, every
+ * frame is preceded by its header from vnet_hdrs, or by an empty one if
+ * vnet_hdrs is NULL.
+ */
+static size_t send_burst_to_socket(int intidx, char *frames[],
+                                   size_t lengths[],
+                                   const struct vnet_hdr vnet_hdrs[],
+                                   size_t count) {
+  struct mmsghdr msgs[LINK_BURST_MAX];
+  struct iovec iovecs[LINK_BURST_MAX][2];
+  size_t done = 0;
+  size_t sent = 0;
+
+  while (done < count) {
+    size_t batch = count - done;
+    if (batch > LINK_BURST_MAX)
+      batch = LINK_BURST_MAX;
+
+    memset(msgs, 0, batch * sizeof(msgs[0]));
+    for (size_t i = 0; i < batch; i++) {
+      struct iovec *iov = iovecs[i];
+      if (vnet_hdr_enabled) {
+        iov->iov_base = (void *)(vnet_hdrs ? &vnet_hdrs[done + i]
+                                           : &no_vnet_hdr);
+        iov->iov_len = sizeof(struct vnet_hdr);
+        iov++;
+      }
+      iov->iov_base = frames[done + i];
+      iov->iov_len = lengths[done + i];
+      msgs[i].msg_hdr.msg_iov = iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = iov - iovecs[i] + 1;
+    }
+
+    int ret = sendmmsg(interfaces[intidx], msgs, batch, 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0) {
+      /* The first frame of the batch failed (e.g. ENOBUFS, or the interface
+       * going down): it is dropped, not counted as sent, and the next ones
+       * are tried */
+      done++;
+      continue;
+    }
+    done += ret;
+    sent += ret;
+  }
+
+  return sent;
+}
+
+size_t send_burst_to_link(size_t intidx, char *frames[], size_t lengths[],
+                          size_t count) {
+  if (rings_enabled)
+    return ring_send_burst(intidx, frames, lengths, count);
+  if (xdp_enabled)
+    return xsk_send_burst(intidx, frames, lengths, count);
+  return send_burst_to_socket(intidx, frames, lengths, NULL, count);
+}
+
+size_t send_burst_to_link_vnet(size_t intidx, char *frames[],
+                               size_t lengths[],
+                               const struct vnet_hdr vnet_hdrs[],
+                               size_t count) {
+  if (rings_enabled)
+    return ring_send_burst(intidx, frames, lengths, count);
+  if (xdp_enabled)
+    return xsk_send_burst(intidx, frames, lengths, count);
+  return send_burst_to_socket(intidx, frames, lengths, vnet_hdrs, count);
+}
+
+/*
+ * Receives up to max_frames frames from an interface in a single recvmmsg
+ * call. Returns the number of frames received, 0 if none is available
+ * when flags contains MSG_DONTWAIT. With PACKET_VNET_HDR, the header of
+ * every frame is received into vnet_hdrs, and the frames can be as large as
+ * MAX_SUPER_FRAME_LEN; if vnet_hdrs is NULL, the headers are dropped and only
+ * get_max_frame_len() bytes of every frame are received. Otherwise, vnet_hdrs is
+ * set from the auxiliary data of the frames with PACKET_AUXDATA.
+ */
+static size_t recv_burst_from_socket(int intidx, char *frames[],
+                                     size_t lengths[],
+                                     struct vnet_hdr vnet_hdrs[],
+                                     size_t max_frames, int flags) {
+  struct mmsghdr msgs[LINK_BURST_MAX];
+  struct iovec iovecs[LINK_BURST_MAX][2];
+  struct vnet_hdr dropped_hdr;
+  size_t hdr_len = vnet_hdr_enabled ? sizeof(struct vnet_hdr) : 0;
+  int auxdata = vnet_hdrs && auxdata_enabled && !vnet_hdr_enabled;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+  } controls[LINK_BURST_MAX];
   int ret;
-  ret = write(interfaces[intidx], frame_data, length);
-  DIE(ret == -1, "write");
+
+  if (max_frames > LINK_BURST_MAX)
+    max_frames = LINK_BURST_MAX;
+
+  memset(msgs, 0, max_frames * sizeof(msgs[0]));
+  for (size_t i = 0; i < max_frames; i++) {
+    struct iovec *iov = iovecs[i];
+    if (vnet_hdr_enabled) {
+      iov->iov_base = vnet_hdrs ? &vnet_hdrs[i] : &dropped_hdr;
+      iov->iov_len = hdr_len;
+      iov++;
+    }
+    iov->iov_base = frames[i];
+    iov->iov_len =
+        vnet_hdrs && vnet_hdr_enabled ? MAX_SUPER_FRAME_LEN : max_frame_len;
+    msgs[i].msg_hdr.msg_iov = iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = iov - iovecs[i] + 1;
+    if (auxdata) {
+      msgs[i].msg_hdr.msg_control = controls[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+    }
+  }
+
+  do {
+    ret = recvmmsg(interfaces[intidx], msgs, max_frames, flags, NULL);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0) {
+    DIE(errno != EAGAIN && errno != EWOULDBLOCK, "recvmmsg");
+    return 0;
+  }
+
+  for (int i = 0; i < ret; i++)
+    lengths[i] = msgs[i].msg_len - hdr_len;
+
+  if (vnet_hdrs && !vnet_hdr_enabled) {
+    for (int i = 0; i < ret; i++) {
+      uint32_t status = 0;
+      for (struct cmsghdr *cmsg = auxdata ? CMSG_FIRSTHDR(&msgs[i].msg_hdr)
+                                          : NULL;
+           cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_PACKET &&
+            cmsg->cmsg_type == PACKET_AUXDATA) {
+          struct tpacket_auxdata aux;
+          memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+          status = aux.tp_status;
+        }
+      }
+      vnet_hdr_from_status(&vnet_hdrs[i], status);
+    }
+  }
   return ret;
 }
 
+static size_t recv_burst_from_link_hdrs(size_t intidx, char *frames[],
+                                        size_t lengths[],
+                                        struct vnet_hdr vnet_hdrs[],
+                                        size_t max_frames) {
+  struct link_poll idle = {0};
+
+  if (xdp_enabled) {
+    while (1) {
+      size_t count = xsk_recv_burst(intidx, frames, lengths, max_frames);
+      if (count > 0 && vnet_hdrs)
+        memset(vnet_hdrs, 0, count * sizeof(vnet_hdrs[0]));
+      if (count > 0)
+        return count;
+      if (link_poll_again(&idle))
+        continue;
+
+      struct pollfd pfd = {.fd = xsks[intidx].fd, .events = POLLIN};
+      int res = poll(&pfd, 1, recv_timeout_ms);
+      DIE(res == -1 && errno != EINTR, "poll");
+      if (res == 0)
+        return 0;
+    }
+  }
+
+  if (!rings_enabled) {
+    /* Outside poll mode, the first call already blocks. A blocking recvmmsg
+     * would wait for the whole burst without MSG_WAITFORONE. */
+    int flags = poll_spin_ns != 0 ? MSG_DONTWAIT : MSG_WAITFORONE;
+    while (1) {
+      size_t count = recv_burst_from_socket(intidx, frames, lengths,
+                                            vnet_hdrs, max_frames, flags);
+      /* A blocking call only comes back empty once the receive timeout
+       * (SO_RCVTIMEO) expires */
+      if (count > 0 || flags == MSG_WAITFORONE)
+        return count;
+      if (!link_poll_again(&idle))
+        flags = MSG_WAITFORONE;
+    }
+  }
+
+  struct ring *ring = &rings[intidx];
+  ring_release_rx_blocks(ring);
+
+  while (1) {
+    size_t count =
+        ring_recv_burst(intidx, frames, lengths, vnet_hdrs, max_frames);
+    if (count > 0)
+      return count;
+    if (link_poll_again(&idle))
+      continue;
+
+    struct pollfd pfd = {.fd = interfaces[intidx], .events = POLLIN};
+    int res = poll(&pfd, 1, recv_timeout_ms);
+    DIE(res == -1 && errno != EINTR, "poll");
+    if (res == 0)
+      return 0;
+  }
+}
+
+size_t recv_burst_from_link(size_t intidx, char *frames[], size_t lengths[],
+                            size_t max_frames) {
+  return recv_burst_from_link_hdrs(intidx, frames, lengths, NULL, max_frames);
+}
+
+size_t recv_burst_from_link_vnet(size_t intidx, char *frames[],
+                                 size_t lengths[],
+                                 struct vnet_hdr vnet_hdrs[],
+                                 size_t max_frames) {
+  return recv_burst_from_link_hdrs(intidx, frames, lengths, vnet_hdrs,
+                                   max_frames);
+}
+
 ssize_t receive_from_link(int intidx, char *frame_data) {
-  ssize_t ret;
-  ret = read(interfaces[intidx], frame_data, MAX_PACKET_LEN);
-  return ret;
+  size_t length = 0;
+  recv_burst_from_socket(intidx, &frame_data, &length, NULL, 1, 0);
+  return length;
 }
 
 int socket_receive_message(int sockfd, char *frame_data, size_t *len) {
@@ -57,37 +1179,163 @@ int socket_receive_message(int sockfd, char *frame_data, size_t *len) {
    * Note that "buffer" should be at least the MTU size of the
    * interface, eg 1500 bytes
    * */
-  int ret = read(sockfd, frame_data, MAX_PACKET_LEN);
+  int ret = read(sockfd, frame_data, max_frame_len);
   DIE(ret < 0, "read");
   *len = ret;
   return 0;
 }
 
 size_t recv_from_any_link(char *frame_data, size_t *length) {
-  int res;
-  fd_set set;
+  size_t interface;
+  recv_burst_from_any_link(&frame_data, length, &interface, 1);
+  return interface;
+}
+
+static size_t recv_burst_from_any_link_hdrs(char *frames[], size_t lengths[],
+                                            size_t frame_interfaces[],
+                                            struct vnet_hdr vnet_hdrs[],
+                                            size_t max_frames) {
+  struct link_poll idle = {0};
+  /* In poll mode, the interfaces are polled until they have been idle for
+   * the spin time, before waiting for one of them to be readable */
+  int spinning = poll_spin_ns != 0;
+  size_t count = 0;
+
+  while (count == 0) {
+    int ready[ROUTER_NUM_INTERFACES];
+    size_t ready_count = spinning ? all_links(ready)
+                                  : wait_ready_links(link_epoll_fd, ready);
+    if (!spinning && ready_count == 0)
+      return 0;
+
+    /* Split the burst evenly between the ready interfaces, so a busy
+     * interface cannot starve the others */
+    while (ready_count > 0 && count < max_frames) {
+      size_t share = (max_frames - count) / ready_count;
+      if (share == 0)
+        share = 1;
+
+      size_t still_ready = 0;
+      for (size_t k = 0; k < ready_count && count < max_frames; k++) {
+        int i = ready[k];
+        if (share > max_frames - count)
+          share = max_frames - count;
+
+        size_t received = recv_burst_from_socket(
+            i, frames + count, lengths + count,
+            vnet_hdrs ? vnet_hdrs + count : NULL, share, MSG_DONTWAIT);
+        for (size_t j = 0; j < received; j++)
+          frame_interfaces[count + j] = i;
+        count += received;
+
+        /* Stop polling the interface once it has been drained */
+        if (received == share)
+          ready[still_ready++] = i;
+      }
+      ready_count = still_ready;
+    }
+
+    if (count == 0)
+      spinning = link_poll_again(&idle);
+  }
+
+  return count;
+}
+
+size_t recv_burst_from_any_link(char *frames[], size_t lengths[],
+                                size_t frame_interfaces[], size_t max_frames) {
+  return recv_burst_from_any_link_hdrs(frames, lengths, frame_interfaces, NULL,
+                                       max_frames);
+}
+
+size_t recv_burst_from_any_link_vnet(char *frames[], size_t lengths[],
+                                     size_t frame_interfaces[],
+                                     struct vnet_hdr vnet_hdrs[],
+                                     size_t max_frames) {
+  return recv_burst_from_any_link_hdrs(frames, lengths, frame_interfaces,
+                                       vnet_hdrs, max_frames);
+}
+
+/*
+ * Reads a single frame from each of the interfaces ready[0..ready_count),
+ * without waiting, up to max_frames. Returns the number of frames read.
+ */
+static size_t recv_one_per_link(const int ready[], size_t ready_count,
+                                char *frames[], size_t lengths[],
+                                size_t frame_interfaces[], size_t max_frames) {
+  size_t count = 0;
+  for (size_t k = 0; k < ready_count && count < max_frames; k++) {
+    int i = ready[k];
+    ssize_t ret;
+    do {
+      ret = recv(interfaces[i], frames[count], max_frame_len, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+      DIE(errno != EAGAIN && errno != EWOULDBLOCK, "recv");
+      continue;
+    }
+    lengths[count] = ret;
+    frame_interfaces[count] = i;
+    count++;
+  }
+  return count;
+}
 
-  FD_ZERO(&set);
+size_t recv_from_ready_links_select(char *frames[], size_t lengths[],
+                                    size_t frame_interfaces[],
+                                    size_t max_frames) {
   while (1) {
+    fd_set readable;
+    int max_fd = -1;
+    FD_ZERO(&readable);
     for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
-      FD_SET(interfaces[i], &set);
+      FD_SET(interfaces[i], &readable);
+      if (interfaces[i] > max_fd)
+        max_fd = interfaces[i];
     }
 
-    res = select(interfaces[ROUTER_NUM_INTERFACES - 1] + 1, &set, NULL, NULL,
-                 NULL);
+    /* select updates the timeout, so it is set again on every call */
+    struct timeval timeout = {.tv_sec = recv_timeout_ms / 1000,
+                              .tv_usec = (recv_timeout_ms % 1000) * 1000};
+    int res;
+    do {
+      res = select(max_fd + 1, &readable, NULL, NULL,
+                   recv_timeout_ms >= 0 ? &timeout : NULL);
+    } while (res == -1 && errno == EINTR);
     DIE(res == -1, "select");
+    if (res == 0)
+      return 0;
 
+    int ready[ROUTER_NUM_INTERFACES];
+    size_t ready_count = 0;
+    int first = rotate_links();
     for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
-      if (FD_ISSET(interfaces[i], &set)) {
-        ssize_t ret = receive_from_link(i, frame_data);
-        DIE(ret < 0, "receive_from_link");
-        *length = ret;
-        return i;
-      }
+      int link = (first + i) % ROUTER_NUM_INTERFACES;
+      if (FD_ISSET(interfaces[link], &readable))
+        ready[ready_count++] = link;
     }
+
+    size_t count = recv_one_per_link(ready, ready_count, frames, lengths,
+                                     frame_interfaces, max_frames);
+    if (count > 0)
+      return count;
   }
+}
 
-  return -1;
+size_t recv_from_ready_links_epoll(char *frames[], size_t lengths[],
+                                   size_t frame_interfaces[],
+                                   size_t max_frames) {
+  while (1) {
+    int ready[ROUTER_NUM_INTERFACES];
+    size_t ready_count = wait_ready_links(link_epoll_fd, ready);
+    if (ready_count == 0)
+      return 0;
+
+    size_t count = recv_one_per_link(ready, ready_count, frames, lengths,
+                                     frame_interfaces, max_frames);
+    if (count > 0)
+      return count;
+  }
 }
 
 char *get_interface_ip(int interface) {
@@ -116,6 +1364,29 @@ void get_interface_mac(size_t interface, uint8_t *mac) {
   memcpy(mac, ifr.ifr_addr.sa_data, 6);
 }
 
+int get_interface_ifindex(size_t interface) {
+  return interface_indices[interface];
+}
+
+int get_interface_mtu(size_t interface) { return interface_mtus[interface]; }
+
+size_t get_max_frame_len(void) { return max_frame_len; }
+
+/* Reads the MTU of an interface, growing max_frame_len to fit its frames */
+static void read_interface_mtu(int intidx, const char *if_name) {
+  struct ifreq ifr;
+  int res;
+
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", if_name);
+  res = ioctl(interfaces[intidx], SIOCGIFMTU, &ifr);
+  DIE(res == -1, "ioctl SIOCGIFMTU");
+  interface_mtus[intidx] = ifr.ifr_mtu;
+  /* The MTU excludes the Ethernet header */
+  if ((size_t)ifr.ifr_mtu + 14 > max_frame_len)
+    max_frame_len = (size_t)ifr.ifr_mtu + 14;
+}
+
 static int hex2num(char c) {
   if (c >= '0' && c <= '9')
     return c - '0';
@@ -160,19 +1431,158 @@ void init(char *argv[], int argc) {
   for (int i = 0; i < argc; ++i) {
     printf("Setting up interface: %s\n", argv[i]);
     interfaces[i] = get_sock(argv[i]);
+    interface_indices[i] = if_nametoindex(argv[i]);
+    read_interface_mtu(i, argv[i]);
   }
+  link_epoll_fd = create_link_epoll(interfaces, argc);
 }
 
-uint16_t checksum(uint16_t *data, size_t length) {
+/* Enables the busy polling of the driver queues by the system calls made on
+ * a socket. Not fatal: the router then only spins in user space. */
+static void set_busy_poll(int fd, int usecs) {
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+    perror("setsockopt SO_BUSY_POLL");
+#ifdef SO_PREFER_BUSY_POLL
+  /* Only supported since Linux 5.11, and only in effect when the interrupts
+   * of the device are deferred */
+  int prefer = 1;
+  setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+}
+
+void init_busy_poll(unsigned int spin_us) {
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+    set_busy_poll(interfaces[i], (int)spin_us);
+    if (xdp_enabled)
+      set_busy_poll(xsks[i].fd, (int)spin_us);
+  }
+  poll_spin_ns = (uint64_t)spin_us * 1000;
+}
+
+void init_recv_timeout(unsigned int timeout_ms) {
+  struct timeval timeout = {.tv_sec = timeout_ms / 1000,
+                            .tv_usec = (timeout_ms % 1000) * 1000};
+  for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+    int res = setsockopt(interfaces[i], SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                         sizeof(timeout));
+    DIE(res == -1, "setsockopt SO_RCVTIMEO");
+  }
+  recv_timeout_ms = (int)timeout_ms;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* The areas mapped by alloc_pages, for free_pages to know their size and
+ * backing. There are only a few of them, mapped and unmapped rarely. */
+struct page_area {
+  void *area;
+  size_t size;
+  enum page_backing backing;
+  struct page_area *next;
+};
+static struct page_area *page_areas;
+static size_t pages_usage[PAGE_BACKING_COUNT];
+static pthread_mutex_t page_areas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether the transparent huge pages are enabled, at least for the areas
+ * marked with MADV_HUGEPAGE */
+static int transparent_hugepages_enabled(void) {
+  char mode[64] = "";
+  FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (!file)
+    return 0;
+  char *line = fgets(mode, sizeof(mode), file);
+  fclose(file);
+  return line && !strstr(mode, "[never]");
+}
+
+void *alloc_pages(size_t size, int populate, enum page_backing *backing) {
+  size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+  if (size == 0)
+    return NULL;
+  struct page_area *entry = malloc(sizeof(*entry));
+  if (!entry)
+    return NULL;
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  /* Fails right away when the pool does not have enough free pages */
+  void *area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    flags | MAP_HUGETLB | (populate ? MAP_POPULATE : 0), -1, 0);
+  enum page_backing kind = PAGES_HUGETLB;
+  if (area == MAP_FAILED) {
+    /* Aligned on a huge page, so that all of it can be merged into huge
+     * pages: a larger area is mapped, and its unaligned ends unmapped */
+    uint8_t *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        flags, -1, 0);
+    if (raw == MAP_FAILED) {
+      free(entry);
+      return NULL;
+    }
+    uint8_t *aligned =
+        (uint8_t *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                    ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+    if (aligned != raw)
+      munmap(raw, aligned - raw);
+    munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+    area = aligned;
+
+    kind = PAGES_NORMAL;
+    if (transparent_hugepages_enabled() &&
+        madvise(area, size, MADV_HUGEPAGE) == 0)
+      kind = PAGES_TRANSPARENT;
+    /* Faulted in after madvise, for the faults to allocate huge pages. The
+     * zeroing fallback is for the kernels before 5.14. */
+    if (populate && madvise(area, size, MADV_POPULATE_WRITE) == -1)
+      memset(area, 0, size);
+  }
+
+  entry->area = area;
+  entry->size = size;
+  entry->backing = kind;
+  pthread_mutex_lock(&page_areas_lock);
+  entry->next = page_areas;
+  page_areas = entry;
+  pages_usage[kind] += size;
+  pthread_mutex_unlock(&page_areas_lock);
+  if (backing)
+    *backing = kind;
+  return area;
+}
+
+void free_pages(void *area) {
+  if (!area)
+    return;
+  pthread_mutex_lock(&page_areas_lock);
+  struct page_area **link = &page_areas;
+  while (*link && (*link)->area != area)
+    link = &(*link)->next;
+  struct page_area *entry = *link;
+  DIE(!entry, "free_pages: area not mapped by alloc_pages");
+  *link = entry->next;
+  pages_usage[entry->backing] -= entry->size;
+  pthread_mutex_unlock(&page_areas_lock);
+  munmap(entry->area, entry->size);
+  free(entry);
+}
+
+size_t get_pages_usage(enum page_backing backing) {
+  pthread_mutex_lock(&page_areas_lock);
+  size_t usage = pages_usage[backing];
+  pthread_mutex_unlock(&page_areas_lock);
+  return usage;
+}
+
+uint16_t checksum_scalar(uint16_t *data, size_t length) {
   unsigned long checksum = 0;
-  uint16_t extra_byte;
   while (length > 1) {
     checksum += ntohs(*data++);
     length -= 2;
   }
   if (length) {
-    *(uint8_t *)&extra_byte = *(uint8_t *)data;
-    checksum += extra_byte;
+    /* The trailing byte is padded with a zero byte to form a word */
+    checksum += (uint16_t)(*(uint8_t *)data << 8);
   }
 
   checksum = (checksum >> 16) + (checksum & 0xffff);
@@ -180,6 +1590,149 @@ uint16_t checksum(uint16_t *data, size_t length) {
   return (uint16_t)(~checksum);
 }
 
+/*
+ * The one's complement sum does not depend on the byte order (RFC 1071), so
+ * the kernels below add the 16-bit words in native order, without swapping
+ * each of them, and only the folded sum is converted. They return a partial
+ * sum of the even part of the data.
+ */
+typedef uint64_t (*checksum_kernel_t)(const uint8_t *data, size_t length);
+
+static uint64_t checksum_kernel_generic(const uint8_t *data, size_t length) {
+  uint64_t sum = 0;
+  while (length > 1) {
+    uint16_t word;
+    memcpy(&word, data, sizeof(word));
+    sum += word;
+    data += 2;
+    length -= 2;
+  }
+  return sum;
+}
+
+/*
+ * Number of vectors summed before the 32-bit lanes of the accumulator are
+ * spilled, small enough for them not to overflow
+ */
+#define CHECKSUM_SPILL_VECTORS 16384
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static uint64_t
+checksum_kernel_sse2(const uint8_t *data, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t sum = 0;
+
+  while (length >= 16) {
+    size_t vectors = length / 16;
+    if (vectors > CHECKSUM_SPILL_VECTORS)
+      vectors = CHECKSUM_SPILL_VECTORS;
+
+    /* Widen the words to 32-bit lanes and accumulate them */
+    __m128i acc = zero;
+    for (size_t i = 0; i < vectors; i++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)data);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+      data += 16;
+    }
+    length -= vectors * 16;
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  return sum + checksum_kernel_generic(data, length);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+checksum_kernel_avx2(const uint8_t *data, size_t length) {
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t sum = 0;
+
+  while (length >= 32) {
+    size_t vectors = length / 32;
+    if (vectors > CHECKSUM_SPILL_VECTORS)
+      vectors = CHECKSUM_SPILL_VECTORS;
+
+    /* Widen the words to 32-bit lanes and accumulate them */
+    __m256i acc = zero;
+    for (size_t i = 0; i < vectors; i++) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)data);
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+      data += 32;
+    }
+    length -= vectors * 32;
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    for (int i = 0; i < 8; i++)
+      sum += lanes[i];
+  }
+
+  /* The remaining data is shorter than a 256-bit vector */
+  return sum + checksum_kernel_sse2(data, length);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static uint64_t checksum_kernel_neon(const uint8_t *data, size_t length) {
+  uint64_t sum = 0;
+
+  while (length >= 16) {
+    size_t vectors = length / 16;
+    if (vectors > CHECKSUM_SPILL_VECTORS)
+      vectors = CHECKSUM_SPILL_VECTORS;
+
+    /* Add the pairs of adjacent words into 32-bit lanes */
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (size_t i = 0; i < vectors; i++) {
+      acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(data)));
+      data += 16;
+    }
+    length -= vectors * 16;
+
+    uint64x2_t wide = vpaddlq_u32(acc);
+    sum += vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+  }
+
+  return sum + checksum_kernel_generic(data, length);
+}
+#endif
+
+static checksum_kernel_t checksum_kernel = checksum_kernel_generic;
+
+/* Pick the widest checksum kernel supported by the CPU, before main runs */
+__attribute__((constructor)) static void select_checksum_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    checksum_kernel = checksum_kernel_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    checksum_kernel = checksum_kernel_sse2;
+#elif defined(__ARM_NEON)
+  /* NEON is always available when the compiler targets it */
+  checksum_kernel = checksum_kernel_neon;
+#endif
+}
+
+uint16_t checksum(uint16_t *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint64_t sum = checksum_kernel(bytes, length);
+
+  if (length & 1) {
+    /* The trailing byte is padded with a zero byte to form a word */
+    uint16_t word = 0;
+    memcpy(&word, bytes + length - 1, 1);
+    sum += word;
+  }
+
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)~ntohs((uint16_t)sum);
+}
+
 int read_rtable(const char *path, struct route_table_entry *rtable) {
   FILE *fp = fopen(path, "r");
   int j = 0, i;
@@ -25,6 +25,7 @@ constexpr uint8_t IP_DEFAULT_TTL = 64;
 
 constexpr uint8_t ICMP_TYPE_UNREACH = 3;
 constexpr uint8_t ICMP_CODE_UNREACH_NET = 0;
+constexpr uint8_t ICMP_CODE_UNREACH_FRAG_NEEDED = 4;
 constexpr uint8_t ICMP_TYPE_TIME_EXCEEDED = 11;
 constexpr uint8_t ICMP_CODE_TTL_EXCEEDED = 0;
 constexpr uint8_t ICMP_TYPE_ECHO_REQUEST = 8;
@@ -0,0 +1,231 @@
+#include "link-backend.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace router {
+
+namespace {
+
+// Send a burst with or without its offload metadata
+size_t send_burst(iface_t interface, char *frames[], size_t lengths[],
+                  const vnet_hdr offloads[], size_t count) {
+  if (offloads) {
+    return send_burst_to_link_vnet(interface, frames, lengths, offloads,
+                                   count);
+  }
+  return send_burst_to_link(interface, frames, lengths, count);
+}
+
+// The backends reading one frame per ready interface, without any offload
+class ReadyLinksBackend : public LinkBackend {
+public:
+  void setup(const LinkOptions &options) override {
+    if (options.vnet_hdr || options.auxdata) {
+      throw std::invalid_argument(std::string{"The "} + name() +
+                                  " link backend has no offloads");
+    }
+  }
+
+  // A single frame, read as soon as it arrives
+  size_t receive(iface_t interface, char *frames[], size_t lengths[],
+                 vnet_hdr[], size_t max) override {
+    return recv_burst_from_link(interface, frames, lengths,
+                                std::min<size_t>(max, 1));
+  }
+
+  size_t send(iface_t interface, char *frames[], size_t lengths[],
+              const vnet_hdr[], size_t count) override {
+    size_t sent = 0;
+    for (size_t i = 0; i < count; ++i) {
+      sent += send_to_link(lengths[i], frames[i], interface) >= 0;
+    }
+    return sent;
+  }
+};
+
+class SelectBackend : public ReadyLinksBackend {
+public:
+  const char *name() const override { return "select"; }
+
+  using ReadyLinksBackend::receive;
+  size_t receive(char *frames[], size_t lengths[], size_t interfaces[],
+                 vnet_hdr[], size_t max) override {
+    return recv_from_ready_links_select(frames, lengths, interfaces, max);
+  }
+};
+
+class EpollBackend : public ReadyLinksBackend {
+public:
+  const char *name() const override { return "epoll"; }
+
+  using ReadyLinksBackend::receive;
+  size_t receive(char *frames[], size_t lengths[], size_t interfaces[],
+                 vnet_hdr[], size_t max) override {
+    return recv_from_ready_links_epoll(frames, lengths, interfaces, max);
+  }
+};
+
+class RecvmmsgBackend : public LinkBackend {
+public:
+  const char *name() const override { return "recvmmsg"; }
+
+  void setup(const LinkOptions &options) override {
+    if (options.vnet_hdr) {
+      init_vnet_hdr();
+      vnet_hdr_ = true;
+    } else if (options.auxdata) {
+      init_auxdata();
+    }
+    offloads_ = options.vnet_hdr || options.auxdata;
+  }
+
+  bool offloads() const override { return offloads_; }
+
+  // A whole super-frame with PACKET_VNET_HDR
+  size_t rx_frame_room() const override {
+    return vnet_hdr_ ? MAX_SUPER_FRAME_LEN : get_max_frame_len();
+  }
+
+  size_t receive(char *frames[], size_t lengths[], size_t interfaces[],
+                 vnet_hdr offloads[], size_t max) override {
+    if (offloads_ && offloads) {
+      return recv_burst_from_any_link_vnet(frames, lengths, interfaces,
+                                           offloads, max);
+    }
+    return recv_burst_from_any_link(frames, lengths, interfaces, max);
+  }
+
+  size_t receive(iface_t interface, char *frames[], size_t lengths[],
+                 vnet_hdr offloads[], size_t max) override {
+    if (offloads_ && offloads) {
+      return recv_burst_from_link_vnet(interface, frames, lengths, offloads,
+                                       max);
+    }
+    return recv_burst_from_link(interface, frames, lengths, max);
+  }
+
+  size_t send(iface_t interface, char *frames[], size_t lengths[],
+              const vnet_hdr offloads[], size_t count) override {
+    return send_burst(interface, frames, lengths, offloads, count);
+  }
+
+private:
+  bool vnet_hdr_ = false;
+  bool offloads_ = false;
+};
+
+class RingBackend : public LinkBackend {
+public:
+  const char *name() const override { return "mmap"; }
+
+  void setup(const LinkOptions &options) override {
+    if (options.vnet_hdr) {
+      throw std::invalid_argument(
+          "PACKET_VNET_HDR cannot be combined with the rings");
+    }
+    init_rings();
+    // The frame headers of the rings always tell the checksum status
+    offloads_ = options.auxdata;
+  }
+
+  bool offloads() const override { return offloads_; }
+  RxBuffers rx_buffers() const override { return RxBuffers::BACKEND; }
+
+  // Handled in place in the ring blocks, without any room around them
+  PacketBuffer rx_packet(char *frame, size_t length) const override {
+    return PacketBuffer(reinterpret_cast<std::byte *>(frame), length);
+  }
+
+  size_t receive(char *frames[], size_t lengths[], size_t interfaces[],
+                 vnet_hdr offloads[], size_t max) override {
+    if (offloads_ && offloads) {
+      return recv_burst_from_rings_vnet(frames, lengths, interfaces, offloads,
+                                        max);
+    }
+    return recv_burst_from_rings(frames, lengths, interfaces, max);
+  }
+
+  size_t receive(iface_t interface, char *frames[], size_t lengths[],
+                 vnet_hdr offloads[], size_t max) override {
+    if (offloads_ && offloads) {
+      return recv_burst_from_link_vnet(interface, frames, lengths, offloads,
+                                       max);
+    }
+    return recv_burst_from_link(interface, frames, lengths, max);
+  }
+
+  size_t send(iface_t interface, char *frames[], size_t lengths[],
+              const vnet_hdr offloads[], size_t count) override {
+    return send_burst(interface, frames, lengths, offloads, count);
+  }
+
+private:
+  bool offloads_ = false;
+};
+
+class XskBackend : public LinkBackend {
+public:
+  const char *name() const override { return "xdp"; }
+
+  void setup(const LinkOptions &options) override {
+    if (options.vnet_hdr || options.auxdata) {
+      throw std::invalid_argument("AF_XDP has no offloads");
+    }
+    init_xdp();
+  }
+
+  RxBuffers rx_buffers() const override { return RxBuffers::BACKEND; }
+
+  // The frames of the UMEM have the rest of their chunk around them
+  PacketBuffer rx_packet(char *frame, size_t length) const override {
+    return PacketBuffer(reinterpret_cast<std::byte *>(frame), length,
+                        XSK_FRAME_HEADROOM,
+                        XSK_FRAME_SIZE - XSK_FRAME_HEADROOM - length);
+  }
+
+  size_t receive(char *frames[], size_t lengths[], size_t interfaces[],
+                 vnet_hdr[], size_t max) override {
+    return recv_burst_from_xdp(frames, lengths, interfaces, max);
+  }
+
+  size_t receive(iface_t interface, char *frames[], size_t lengths[],
+                 vnet_hdr[], size_t max) override {
+    return recv_burst_from_link(interface, frames, lengths, max);
+  }
+
+  size_t send(iface_t interface, char *frames[], size_t lengths[],
+              const vnet_hdr offloads[], size_t count) override {
+    return send_burst(interface, frames, lengths, offloads, count);
+  }
+};
+
+} // namespace
+
+const char *const LINK_BACKEND_NAMES = "select, epoll, recvmmsg, mmap, xdp";
+
+std::unique_ptr<LinkBackend> make_link_backend(std::string_view name) {
+  if (name == "select") {
+    return std::make_unique<SelectBackend>();
+  }
+  if (name == "epoll") {
+    return std::make_unique<EpollBackend>();
+  }
+  if (name == "recvmmsg") {
+    return std::make_unique<RecvmmsgBackend>();
+  }
+  if (name == "mmap") {
+    return std::make_unique<RingBackend>();
+  }
+  if (name == "xdp") {
+    return std::make_unique<XskBackend>();
+  }
+  return nullptr;
+}
+
+LinkBackend &default_link_backend() {
+  static RecvmmsgBackend backend;
+  return backend;
+}
+
+} // namespace router
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.hpp"
+#include "lib_wrapper.hpp"
+#include "packet-buffer.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace router {
+
+// The offloads requested from a link backend
+struct LinkOptions {
+  // Receive the frames merged by GRO whole, with their offload metadata, and
+  // send them back out with it (PACKET_VNET_HDR)
+  bool vnet_hdr = false;
+  // Tell which frames had their checksums validated by the NIC
+  // (PACKET_AUXDATA, or the status of the frames of the rings)
+  bool auxdata = false;
+};
+
+/**
+ * @brief The link layer the router receives and sends its frames through:
+ * burst receive and send, the ownership of the receive buffers, and the
+ * addresses of the interfaces.
+ *
+ * The backends of `make_link_backend` are built on lib.c, opened by its
+ * `init`, whose sockets, rings and UMEM are global: only one of them can be
+ * set up in a process, although any of them can then send. A backend is
+ * shared by all the threads, with the same guarantees as the functions of
+ * lib.c: the receive calls of different interfaces can run concurrently, and
+ * so can the send calls.
+ */
+class LinkBackend {
+public:
+  // Who owns the buffers the frames are received in
+  enum class RxBuffers : uint8_t {
+    // The frames are copied into the buffers given by the caller, each with
+    // `rx_frame_room` bytes
+    CALLER,
+    // The frames are handed in place, in the memory of the backend, and stay
+    // valid until the next receive call of the same thread. The buffers
+    // given are overwritten with their addresses.
+    BACKEND,
+  };
+
+  virtual ~LinkBackend() = default;
+
+  // The name the backend is selected by
+  virtual const char *name() const = 0;
+
+  /**
+   * @brief Set up the backend, once the interfaces have been opened by
+   * `init`.
+   *
+   * @throws std::invalid_argument if the backend lacks an offload requested
+   */
+  virtual void setup(const LinkOptions &options) = 0;
+
+  // Whether the frames are received along with their offload metadata
+  virtual bool offloads() const { return false; }
+
+  virtual RxBuffers rx_buffers() const { return RxBuffers::CALLER; }
+
+  // The longest frame received in a buffer of the caller
+  virtual size_t rx_frame_room() const { return get_max_frame_len(); }
+
+  /**
+   * @brief Get the packet buffer of a received frame, with the room around
+   * it the router can build its replies in. The frames received in the
+   * buffers of the caller must start PACKET_HEADROOM bytes into a buffer of
+   * PACKET_HEADROOM + `rx_frame_room` bytes.
+   */
+  virtual PacketBuffer rx_packet(char *frame, size_t length) const {
+    return PacketBuffer(reinterpret_cast<std::byte *>(frame), length,
+                        PACKET_HEADROOM, rx_frame_room() - length);
+  }
+
+  /**
+   * @brief Receive a burst of frames from any interface, blocking until one
+   * arrives or until the receive timeout expires (see `init_recv_timeout`).
+   *
+   * @param interfaces Set to the interface of every frame
+   * @param offloads Set to the offload metadata of every frame, if not
+   * nullptr and the backend has some
+   * @return The number of frames received, 0 on timeout
+   */
+  virtual size_t receive(char *frames[], size_t lengths[],
+                         size_t interfaces[], vnet_hdr offloads[],
+                         size_t max) = 0;
+
+  /**
+   * @brief Receive a burst of frames from one interface, like `receive`.
+   */
+  virtual size_t receive(iface_t interface, char *frames[], size_t lengths[],
+                         vnet_hdr offloads[], size_t max) = 0;
+
+  /**
+   * @brief Send a burst of frames on an interface.
+   *
+   * @param offloads The offload metadata of every frame, or nullptr if none
+   * has any
+   * @return The number of frames sent, the others having failed
+   */
+  virtual size_t send(iface_t interface, char *frames[], size_t lengths[],
+                      const vnet_hdr offloads[], size_t count) = 0;
+
+  // The IPv4 address of an interface, in network byte order
+  virtual uint32_t interface_ip(iface_t interface) const {
+    return get_interface_ip_addr(static_cast<int>(interface));
+  }
+
+  // The largest IP packet an interface sends, without the Ethernet header
+  virtual uint16_t interface_mtu(iface_t interface) const {
+    return static_cast<uint16_t>(get_interface_mtu(interface));
+  }
+
+  virtual std::array<uint8_t, 6> interface_mac(iface_t interface) const {
+    std::array<uint8_t, 6> mac;
+    get_interface_mac(interface, mac.data());
+    return mac;
+  }
+};
+
+/**
+ * @brief Create a link backend by name:
+ * - "select": one frame per ready interface, waited for with select and read
+ *   with recv, sent one by one (the baseline);
+ * - "epoll": the same, waited for with epoll;
+ * - "recvmmsg": bursts received and sent with recvmmsg and sendmmsg, the
+ *   interfaces being waited for with epoll (the default);
+ * - "mmap": the PACKET_MMAP rings, the frames being handled in place;
+ * - "xdp": the AF_XDP sockets, the frames being handled in place in the UMEM.
+ *
+ * Only recvmmsg has PACKET_VNET_HDR, and only recvmmsg and mmap tell the
+ * checksums validated by the NICs.
+ *
+ * @return nullptr if there is no backend of that name
+ */
+std::unique_ptr<LinkBackend> make_link_backend(std::string_view name);
+
+// The names of the backends, separated by commas, for the error messages
+extern const char *const LINK_BACKEND_NAMES;
+
+/**
+ * @brief Get the backend sending the frames of the routers created without
+ * one: recvmmsg, which sends through whatever lib.c has been set up with.
+ */
+LinkBackend &default_link_backend();
+
+} // namespace router
@@ -0,0 +1,130 @@
+#pragma once
+
+// The binary log records of the asynchronous logger, included by logger.hpp
+
+#include <spdlog/fmt/bin_to_hex.h>
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+namespace logger::detail {
+
+// Longest strings and hex dumps copied into a record, the longer ones being
+// truncated
+constexpr size_t MAX_STRING_SIZE = 64;
+constexpr size_t MAX_DUMP_SIZE = 64;
+// Room for the copied arguments of a record
+constexpr size_t MAX_ARGS_SIZE = 256;
+
+struct StoredString {
+  std::array<char, MAX_STRING_SIZE> data;
+  size_t size;
+};
+
+// The bytes of a spdlog::to_hex argument
+struct StoredDump {
+  std::array<unsigned char, MAX_DUMP_SIZE> data;
+  size_t size;
+  size_t size_per_line;
+};
+
+template <typename T> struct is_dump_info : std::false_type {};
+template <typename It>
+struct is_dump_info<spdlog::details::dump_info<It>> : std::true_type {};
+
+inline StoredString store_string(std::string_view text) {
+  StoredString stored;
+  stored.size = std::min(text.size(), stored.data.size());
+  std::copy_n(text.data(), stored.size, stored.data.begin());
+  return stored;
+}
+
+/**
+ * @brief Copy an argument into a record, so that it can be formatted after
+ * the call returns: the strings and the hex dumps by content, the other
+ * trivially copyable values by value (so they must not point to data that
+ * could change, like spans), and anything else formatted right away.
+ */
+template <typename T> auto store(const T &value) {
+  if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+    return store_string(value);
+  } else if constexpr (is_dump_info<T>::value) {
+    StoredDump stored;
+    stored.size = 0;
+    stored.size_per_line = value.size_per_line();
+    for (auto it = value.get_begin();
+         it != value.get_end() && stored.size < stored.data.size(); ++it) {
+      stored.data[stored.size++] = static_cast<unsigned char>(*it);
+    }
+    return stored;
+  } else if constexpr (std::is_trivially_copyable_v<T>) {
+    return value;
+  } else {
+    return store_string(fmt::format("{}", value));
+  }
+}
+
+// The value a stored argument is formatted as
+template <typename T> const T &view(const T &stored) { return stored; }
+inline std::string_view view(const StoredString &stored) {
+  return {stored.data.data(), stored.size};
+}
+inline auto view(const StoredDump &stored) {
+  return spdlog::to_hex(stored.data.begin(), stored.data.begin() + stored.size,
+                        stored.size_per_line);
+}
+
+/**
+ * @brief A log call captured by value, formatted later by the logger thread.
+ * The format string is not copied, as it is a literal.
+ */
+struct Record {
+  spdlog::log_clock::time_point time;
+  spdlog::source_loc location;
+  spdlog::level::level_enum level;
+  std::string_view format;
+  // Formats the message from the arguments stored in `args`
+  void (*format_message)(const Record &record, spdlog::memory_buf_t &out);
+  alignas(std::max_align_t) std::array<std::byte, MAX_ARGS_SIZE> args;
+};
+
+template <typename Stored>
+void format_stored(const Record &record, spdlog::memory_buf_t &out) {
+  const auto &stored =
+      *std::launder(reinterpret_cast<const Stored *>(record.args.data()));
+  std::apply(
+      [&](const auto &...args) {
+        fmt::format_to(std::back_inserter(out), fmt::runtime(record.format),
+                       view(args)...);
+      },
+      stored);
+}
+
+/**
+ * @brief Fill a record with the arguments of a log call.
+ */
+template <typename... Args>
+void fill_record(Record &record, spdlog::source_loc location,
+                 spdlog::level::level_enum level, std::string_view format,
+                 const Args &...args) {
+  using Stored = std::tuple<decltype(store(args))...>;
+  static_assert(sizeof(Stored) <= MAX_ARGS_SIZE,
+                "Too many arguments for an asynchronous log record");
+  static_assert(alignof(Stored) <= alignof(std::max_align_t));
+  static_assert(std::is_trivially_destructible_v<Stored>);
+
+  record.time = spdlog::log_clock::now();
+  record.location = location;
+  record.level = level;
+  record.format = format;
+  record.format_message = &format_stored<Stored>;
+  new (record.args.data()) Stored{store(args)...};
+}
+
+} // namespace logger::detail
@@ -1,18 +1,78 @@
 #include "logger.hpp"
 
+#include <chrono>
+#include <exception>
 #include <memory>
+#include <signal.h>
 #include <spdlog/sinks/basic_file_sink.h>
 #include <spdlog/sinks/stdout_sinks.h>
+#include <stdexcept>
+#include <thread>
 
 namespace {
 
 std::shared_ptr<spdlog::logger> global_logger{nullptr};
 logger::Level global_level{logger::Level::info};
 
+// Time the logger thread sleeps for once it has emptied the ring, the calls
+// never waking it up
+constexpr auto ASYNC_IDLE_SLEEP = std::chrono::milliseconds{10};
+
+// Format and write the records of the ring, and report the dropped ones,
+// until the process exits. The thread keeps its own reference to the logger,
+// which it can still be using while the global one is destroyed at exit.
+void run_async_logger(logger::detail::RecordRing &ring,
+                      std::shared_ptr<spdlog::logger> target) {
+  spdlog::memory_buf_t message;
+  uint64_t reported_drops = 0;
+  while (true) {
+    // Report the drops at least once per lap of the ring, even when it never
+    // gets empty
+    size_t handled = 0;
+    while (handled < ring.capacity()) {
+      auto *record = ring.front();
+      if (!record) {
+        break;
+      }
+      message.clear();
+      try {
+        record->format_message(*record, message);
+      } catch (const std::exception &e) {
+        message.clear();
+        fmt::format_to(std::back_inserter(message),
+                       "Cannot format the log message \"{}\": {}",
+                       record->format, e.what());
+      }
+      target->log(
+          record->time, record->location, record->level,
+          spdlog::string_view_t{message.data(), message.size()});
+      ring.pop();
+      ++handled;
+    }
+
+    uint64_t drops = logger::dropped_records();
+    if (drops != reported_drops) {
+      target->warn("{} log records dropped, the ring being full",
+                   drops - reported_drops);
+      reported_drops = drops;
+    }
+    if (handled == 0) {
+      std::this_thread::sleep_for(ASYNC_IDLE_SLEEP);
+    }
+  }
+}
+
 } // namespace
 
 namespace logger {
 
+namespace detail {
+
+std::atomic<RecordRing *> async_ring{nullptr};
+std::atomic<uint64_t> dropped{0};
+
+} // namespace detail
+
 void init(const std::filesystem::path &log_file, bool disable_stdout) {
   if (global_logger) {
     throw std::runtime_error("Logger already initialized");
@@ -59,4 +119,33 @@ void set_level(Level level) {
   }
 }
 
-} // namespace logger
\ No newline at end of file
+void start_async(size_t capacity) {
+  if (detail::async_ring.load()) {
+    throw std::logic_error("Logger already asynchronous");
+  }
+  if (!global_logger) {
+    init();
+  }
+  // Nothing is logged when the level is off
+  if (!global_logger) {
+    return;
+  }
+  // Never freed: the logger thread runs until the process exits
+  auto *ring = new detail::RecordRing(capacity);
+
+  // The logger thread leaves all the signals to the other threads
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  std::thread(run_async_logger, std::ref(*ring), global_logger).detach();
+  pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+
+  detail::async_ring.store(ring, std::memory_order_release);
+}
+
+uint64_t dropped_records() {
+  return detail::dropped.load(std::memory_order_relaxed);
+}
+
+} // namespace logger
@@ -14,19 +14,44 @@
 #ifdef DEBUG
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #endif
+#include "log-record.hpp"
+#include "mpsc-ring.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <spdlog/spdlog.h>
+#include <utility>
 
-#define LOG_TRACE(...) SPDLOG_LOGGER_TRACE(logger::get_instance(), __VA_ARGS__)
-#define LOG_DEBUG(...) SPDLOG_LOGGER_DEBUG(logger::get_instance(), __VA_ARGS__)
-#define LOG_INFO(...) SPDLOG_LOGGER_INFO(logger::get_instance(), __VA_ARGS__)
-#define LOG_WARN(...) SPDLOG_LOGGER_WARN(logger::get_instance(), __VA_ARGS__)
-#define LOG_ERROR(...) SPDLOG_LOGGER_ERROR(logger::get_instance(), __VA_ARGS__)
-#define LOG_CRITICAL(...)                                                      \
-  SPDLOG_LOGGER_CRITICAL(logger::get_instance(), __VA_ARGS__)
+#define LOG_AT(level, ...)                                                     \
+  logger::detail::log(                                                         \
+      spdlog::source_loc{__FILE__, __LINE__, SPDLOG_FUNCTION}, level,          \
+      __VA_ARGS__)
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(spdlog::level::trace, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) (void)0
+#endif
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(spdlog::level::debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) (void)0
+#endif
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(spdlog::level::info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) (void)0
+#endif
+#define LOG_WARN(...) LOG_AT(spdlog::level::warn, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(spdlog::level::err, __VA_ARGS__)
+#define LOG_CRITICAL(...) LOG_AT(spdlog::level::critical, __VA_ARGS__)
 
 namespace logger {
 
+// Number of records of the ring of the asynchronous mode
+constexpr size_t DEFAULT_ASYNC_CAPACITY = 8192;
+
 enum class Level {
   trace = SPDLOG_LEVEL_TRACE,
   debug = SPDLOG_LEVEL_DEBUG,
@@ -61,6 +86,57 @@ spdlog::logger *get_instance();
  */
 void set_level(Level level);
 
+/**
+ * @brief Log asynchronously from now on: the log calls copy their arguments
+ * into a binary record of a preallocated lock-free ring, and return without
+ * formatting anything, the records being formatted and written by a
+ * background thread. The records logged while the ring is full are dropped
+ * and counted. The critical messages are still written right away, the
+ * process being likely to stop after them.
+ *
+ * @param capacity The number of records of the ring, a power of two
+ *
+ * @throws std::invalid_argument if the capacity is not a power of two
+ * @throws std::logic_error if the logger is already asynchronous
+ */
+void start_async(size_t capacity = DEFAULT_ASYNC_CAPACITY);
+
+/**
+ * @brief Get the number of records dropped because the ring was full
+ */
+uint64_t dropped_records();
+
+namespace detail {
+
+using RecordRing = router::MpscRing<Record>;
+
+// The ring of the asynchronous mode, or nullptr while the logger is
+// synchronous
+extern std::atomic<RecordRing *> async_ring;
+extern std::atomic<uint64_t> dropped;
+
+template <typename... Args>
+void log(spdlog::source_loc location, spdlog::level::level_enum level,
+         spdlog::format_string_t<Args...> format, Args &&...args) {
+  spdlog::logger *target = get_instance();
+  if (!target->should_log(level)) {
+    return;
+  }
+  RecordRing *ring = async_ring.load(std::memory_order_acquire);
+  if (ring && level < spdlog::level::critical) {
+    std::string_view text{format.get().data(), format.get().size()};
+    if (!ring->try_push([&](Record &record) {
+          fill_record(record, location, level, text, args...);
+        })) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  target->log(location, level, format, std::forward<Args>(args)...);
+}
+
+} // namespace detail
+
 }; // namespace logger
 
 #endif // ENABLE_LOGGING
\ No newline at end of file
@@ -1,13 +1,637 @@
+#include "acl.hpp"
+#include "egress-qos.hpp"
+#include "link-backend.hpp"
 #include "logger.hpp"
+#include "page-allocator.hpp"
+#include "profiler.hpp"
 #include "router.hpp"
+#include "rtable-loader.hpp"
 #include "span.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <exception>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-static constexpr size_t MAX_ROUTING_TABLE_SIZE = 1e5;
+// Maximum number of frames received and processed at once
+static constexpr size_t RX_BURST_SIZE = 32;
+// Environment variable used to select the routing table backend
+static constexpr auto RTABLE_BACKEND_ENV = "ROUTER_RTABLE_BACKEND";
+// Flag selecting the link backend (see make_link_backend), given ahead of the
+// other arguments, e.g. "--link-backend=mmap"
+static constexpr std::string_view LINK_BACKEND_FLAG = "--link-backend=";
+// Environment variables selecting the PACKET_MMAP rings (the mmap link
+// backend) or the AF_XDP sockets (the xdp one) when set to 1, without the
+// flag
+static constexpr auto PACKET_MMAP_ENV = "ROUTER_PACKET_MMAP";
+static constexpr auto AF_XDP_ENV = "ROUTER_AF_XDP";
+// Environment variable receiving the frames merged by GRO whole, and sending
+// them back out with their GSO metadata, when set to 1 (PACKET_VNET_HDR).
+// Only supported by the recvmmsg link backend.
+static constexpr auto PACKET_VNET_HDR_ENV = "ROUTER_PACKET_VNET_HDR";
+// Environment variable skipping the verification of the IPv4 header checksums
+// already validated by the NIC when set to 1, as told by PACKET_AUXDATA (or by
+// the frame headers of the rings). Always done with PACKET_VNET_HDR, whose
+// headers tell it too, and cannot be combined with the AF_XDP sockets.
+static constexpr auto PACKET_AUXDATA_ENV = "ROUTER_PACKET_AUXDATA";
+// Environment variable forwarding the plain IPv4 packets with an XDP program,
+// in the driver, when set to 1, or in generic (SKB) mode when set to
+// "generic". Cannot be combined with the AF_XDP sockets.
+static constexpr auto XDP_OFFLOAD_ENV = "ROUTER_XDP_OFFLOAD";
+// Environment variable giving the ingress ACL file the packets to be forwarded
+// are filtered with (see load_acl). Cannot be combined with the XDP offload,
+// which would forward the packets without it.
+static constexpr auto ACL_ENV = "ROUTER_ACL";
+// Environment variables tracking the forwarded flows, pinning them to their
+// path (see FlowTable): the maximum number of flows, and how long a flow can
+// stay idle, in seconds. Cannot be combined with the XDP offload either.
+static constexpr auto FLOW_TABLE_ENV = "ROUTER_FLOW_TABLE";
+static constexpr auto FLOW_IDLE_TIMEOUT_ENV = "ROUTER_FLOW_IDLE_TIMEOUT";
+// Environment variable queueing the frames sent by traffic class (from their
+// DSCP) when set to 1, the variables overriding the weights of the classes
+// sharing the link by deficit round robin ("assured,best_effort,scavenger",
+// "4,2,1" by default), and those shaping every interface to a rate in bits
+// per second, with a burst in bytes (64 KiB by default)
+static constexpr auto EGRESS_QOS_ENV = "ROUTER_EGRESS_QOS";
+static constexpr auto EGRESS_WEIGHTS_ENV = "ROUTER_EGRESS_WEIGHTS";
+static constexpr auto EGRESS_RATE_ENV = "ROUTER_EGRESS_RATE";
+static constexpr auto EGRESS_BURST_ENV = "ROUTER_EGRESS_BURST";
+// Longest time the receive loops block for with shaping, before sending the
+// frames held back
+static constexpr unsigned int EGRESS_SHAPING_RECV_TIMEOUT_MS = 1;
+// Longest time the link benchmark blocks for, so that it ends on time even
+// without traffic
+static constexpr unsigned int LINK_BENCH_RECV_TIMEOUT_MS = 100;
+// Environment variable enabling the sampling of the forwarded packets, set to
+// the sFlow collector they are exported to, as "address[:port]" (port 6343 by
+// default), and the variable overriding the sampling rate (1 in 1000 packets
+// by default)
+static constexpr auto SFLOW_COLLECTOR_ENV = "ROUTER_SFLOW_COLLECTOR";
+static constexpr auto SFLOW_RATE_ENV = "ROUTER_SFLOW_RATE";
+// Environment variable enabling one RX worker thread per interface when set
+// to 1
+static constexpr auto RX_WORKERS_ENV = "ROUTER_RX_WORKERS";
+// Environment variable enabling the poll mode, set to the time in
+// microseconds the receive loops keep polling idle interfaces before blocking
+static constexpr auto BUSY_POLL_ENV = "ROUTER_BUSY_POLL";
+// Environment variable giving the CPUs the receive loops run on, in the format
+// of isolcpus (e.g. "2-4,6"). The RX workers are pinned to them in turn, and
+// the other threads of the router are kept off them.
+static constexpr auto RX_CPUS_ENV = "ROUTER_RX_CPUS";
+// Environment variable moving the handling of the exception frames (ARP,
+// ICMP, IPv6) to a slow path thread when set to 1
+static constexpr auto SLOW_PATH_ENV = "ROUTER_SLOW_PATH";
+// Environment variable overriding the level of the logger (e.g. "warning"),
+// when built with ENABLE_LOGGING
+static constexpr auto LOG_LEVEL_ENV = "ROUTER_LOG_LEVEL";
+// Environment variable formatting the log messages on a background thread when
+// set to 1, the log calls only copying their arguments
+static constexpr auto LOG_ASYNC_ENV = "ROUTER_LOG_ASYNC";
+// Environment variable overriding the name of the statistics shared memory
+static constexpr auto STATS_SHM_ENV = "ROUTER_STATS_SHM";
+static constexpr auto DEFAULT_STATS_SHM = "/router-stats";
+// Environment variable enabling the per-worker route cache, set to its number
+// of entries
+static constexpr auto ROUTE_CACHE_ENV = "ROUTER_ROUTE_CACHE";
+// Environment variable overriding the longest time a sent frame waits in its
+// TX queue while the rest of its burst is handled, in microseconds
+static constexpr auto TX_FLUSH_DEADLINE_ENV = "ROUTER_TX_FLUSH_DEADLINE";
+// Environment variable overriding the lifetime of the ARP entries, in seconds
+static constexpr auto ARP_TTL_ENV = "ROUTER_ARP_TTL";
+// Environment variable giving a static neighbor table preloaded into the ARP
+// table (see load_arp_table)
+static constexpr auto STATIC_ARP_ENV = "ROUTER_STATIC_ARP";
+// Environment variable giving the file the learned neighbors are saved to
+// every few seconds, and restored from on start, for the router to forward at
+// full speed right after a restart
+static constexpr auto NEIGHBOR_STATE_ENV = "ROUTER_NEIGHBOR_STATE";
+static constexpr auto NEIGHBOR_STATE_SAVE_INTERVAL = std::chrono::seconds(5);
+// Environment variable resolving the next hops of the routes as soon as they
+// are installed when set to 1, instead of on their first packet
+static constexpr auto RESOLVE_NEXT_HOPS_ENV = "ROUTER_RESOLVE_NEXT_HOPS";
+// Environment variables overriding the rate limits of the ICMP errors, like
+// the sysctls of Linux: the minimum interval between two errors to the same
+// destination, in ms, and the number of errors sent per second to all the
+// destinations together and at once (0 disables a limit)
+static constexpr auto ICMP_RATELIMIT_ENV = "ROUTER_ICMP_RATELIMIT";
+static constexpr auto ICMP_MSGS_PER_SEC_ENV = "ROUTER_ICMP_MSGS_PER_SEC";
+static constexpr auto ICMP_MSGS_BURST_ENV = "ROUTER_ICMP_MSGS_BURST";
+// Environment variable giving a snapshot of the routing table to start from,
+// written by `router --compile-rtable <rtable> <snapshot>`
+static constexpr auto RTABLE_SNAPSHOT_ENV = "ROUTER_RTABLE_SNAPSHOT";
+// Environment variable giving the IPv6 routing table file (see
+// load_ipv6_rtable). Without it, IPv6 is only handled for the router itself.
+static constexpr auto IPV6_RTABLE_ENV = "ROUTER_IPV6_RTABLE";
+// Environment variable mirroring the IPv4 routes of a kernel routing table,
+// set to its number (254 for the main table), next to those of the routing
+// table file
+static constexpr auto FIB_TABLE_ENV = "ROUTER_FIB_TABLE";
+// Environment variable giving the global IPv6 addresses of the interfaces,
+// comma-separated in the order of the interfaces (e.g. "2001:db8::1,,fd00::1").
+// An interface left empty only has its link-local address.
+static constexpr auto IPV6_ADDRESSES_ENV = "ROUTER_IPV6_ADDRESSES";
+
+namespace {
+
+bool is_env_enabled(const char *name) {
+  const char *value = std::getenv(name);
+  return value && std::string_view{value} == "1";
+}
+
+// Override `value` with the number given by the environment variable, if set
+void read_env_limit(const char *name, uint32_t &value) {
+  if (const char *text = std::getenv(name)) {
+    char *end;
+    long number = std::strtol(text, &end, 10);
+    DIE(*end != '\0' || number < 0 || number > UINT32_MAX, "Invalid %s: %s",
+        name, text);
+    value = static_cast<uint32_t>(number);
+  }
+}
+
+// Parse the sFlow collector, as "address[:port]", into `config`
+void parse_sflow_collector(std::string_view collector,
+                           router::SamplerConfig &config) {
+  std::string address{collector.substr(0, collector.find(':'))};
+  DIE(inet_pton(AF_INET, address.c_str(), &config.collector_address) != 1,
+      "Invalid sFlow collector address: %s", address.c_str());
+  if (address.size() < collector.size()) {
+    std::string port{collector.substr(address.size() + 1)};
+    char *end;
+    long number = std::strtol(port.c_str(), &end, 10);
+    DIE(*end != '\0' || number <= 0 || number > UINT16_MAX,
+        "Invalid sFlow collector port: %s", port.c_str());
+    config.collector_port = static_cast<uint16_t>(number);
+  }
+}
+
+// Read the egress QoS configuration from the environment
+router::EgressQosConfig egress_qos_from_env() {
+  router::EgressQosConfig config;
+  if (const char *weights = std::getenv(EGRESS_WEIGHTS_ENV)) {
+    const char *next = weights;
+    for (size_t i = 0; i < config.weights.size(); ++i) {
+      char *end;
+      long weight = std::strtol(next, &end, 10);
+      char separator = i + 1 < config.weights.size() ? ',' : '\0';
+      DIE(end == next || *end != separator || weight <= 0 ||
+              weight > UINT16_MAX,
+          "Invalid egress QoS weights: %s", weights);
+      config.weights[i] = static_cast<uint32_t>(weight);
+      next = end + 1;
+    }
+  }
+  if (const char *rate = std::getenv(EGRESS_RATE_ENV)) {
+    char *end;
+    unsigned long long bits = std::strtoull(rate, &end, 10);
+    DIE(*end != '\0' || end == rate, "Invalid egress rate: %s", rate);
+    config.rate = bits;
+  }
+  read_env_limit(EGRESS_BURST_ENV, config.burst);
+  return config;
+}
+
+// Select the routing table backend, defaulting to the multibit trie
+router::RoutingTable::Backend rtable_backend_from_env() {
+  const char *backend_name = std::getenv(RTABLE_BACKEND_ENV);
+  if (!backend_name) {
+    return router::RoutingTable::Backend::MULTIBIT_TRIE;
+  }
+  auto backend = router::RoutingTable::backend_from_string(backend_name);
+  DIE(!backend, "Unknown routing table backend: %s", backend_name);
+  return *backend;
+}
+
+std::vector<struct route_table_entry> read_rtable_or_die(const char *path) {
+  try {
+    return router::load_rtable(path);
+  } catch (const std::exception &e) {
+    DIE(true, "Cannot read routing table: %s", e.what());
+  }
+}
+
+std::vector<router::Ipv6RoutingTable::RoutingTableEntry>
+read_ipv6_rtable_or_die(const char *path) {
+  try {
+    return router::load_ipv6_rtable(path);
+  } catch (const std::exception &e) {
+    DIE(true, "Cannot read IPv6 routing table: %s", e.what());
+  }
+}
+
+#ifdef ENABLE_LOGGING
+// Log what the binary trie of the routing table is made of, the counts being
+// listed as depth:count, for the depths having any
+void log_trie_stats(const trie::TrieStats<32> &stats) {
+  auto histogram = [](const auto &counts) {
+    std::string text;
+    for (size_t depth = 0; depth < counts.size(); ++depth) {
+      if (counts[depth]) {
+        fmt::format_to(std::back_inserter(text), "{}{}:{}",
+                       text.empty() ? "" : " ", depth, counts[depth]);
+      }
+    }
+    return text;
+  };
+
+  LOG_INFO("Binary trie: {} nodes, {:.1f} KB, depth up to {}, {:.2f} nodes "
+           "per lookup on average",
+           stats.node_count, static_cast<double>(stats.memory_usage) / 1024,
+           stats.max_depth, stats.average_lookup_depth);
+  LOG_INFO("Binary trie nodes per depth: {}",
+           histogram(stats.nodes_per_depth));
+  LOG_INFO("Binary trie prefixes per length: {}",
+           histogram(stats.prefixes_per_length));
+}
+#endif
+
+// Give the interfaces the global IPv6 addresses listed in `addresses`
+void add_ipv6_addresses(router::Router &router, std::string_view addresses) {
+  router::iface_t interface = 0;
+  while (!addresses.empty()) {
+    size_t comma = std::min(addresses.find(','), addresses.size());
+    std::string_view text = addresses.substr(0, comma);
+    addresses.remove_prefix(std::min(comma + 1, addresses.size()));
+
+    if (!text.empty()) {
+      auto address = router::ipv6::parse(text);
+      DIE(!address || interface >= ROUTER_NUM_INTERFACES,
+          "Invalid IPv6 address for interface %zu: %.*s", interface,
+          static_cast<int>(text.size()), text.data());
+      router.add_ipv6_address(interface, *address);
+    }
+    ++interface;
+  }
+}
+
+// Build the routing table of `rtable_path` with the backend selected by the
+// environment, and save it as a snapshot for the routers started from it
+int compile_rtable(const char *rtable_path, const char *snapshot_path) {
+  router::AdjacencyTable adjacencies;
+  router::RoutingTable rtable{adjacencies, rtable_backend_from_env()};
+  rtable.replace_entries(read_rtable_or_die(rtable_path));
+
+  try {
+    router::save_rtable_snapshot(rtable, rtable_path, snapshot_path);
+  } catch (const std::exception &e) {
+    DIE(true, "Cannot write routing table snapshot: %s", e.what());
+  }
+  return 0;
+}
+
+// Buffers for a burst of received frames. With a backend handling the frames
+// in place (the rings or AF_XDP), the frames stay in its memory instead of
+// being copied into the burst buffers. With a backend having offloads, the
+// frames are received along with their offload metadata.
+class RxBurst {
+public:
+  explicit RxBurst(const router::LinkBackend &link)
+      : link_(link),
+        // Every buffer starts on a cache line
+        buffer_size_((router::PACKET_HEADROOM + link.rx_frame_room() + 63) &
+                     ~63UL),
+        bufs_(link.rx_buffers() == router::LinkBackend::RxBuffers::CALLER
+                  ? RX_BURST_SIZE * buffer_size_
+                  : 0) {
+    for (size_t i = 0; i < bufs_.size() / buffer_size_; ++i) {
+      data_[i] = reinterpret_cast<char *>(bufs_.data() + i * buffer_size_ +
+                                          router::PACKET_HEADROOM);
+    }
+  }
+
+  char **data() { return data_.data(); }
+  size_t *lengths() { return lens_.data(); }
+  size_t *interfaces() { return ifaces_.data(); }
+  vnet_hdr *offloads() {
+    return link_.offloads() ? offloads_.data() : nullptr;
+  }
+
+  // Build the frames of a burst of `count` frames received on `interfaces()`
+  tcb::span<const router::RxFrame> frames(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      frames_[i] = {link_.rx_packet(data_[i], lens_[i]), ifaces_[i],
+                    link_.offloads() ? &offloads_[i] : nullptr};
+    }
+    return {frames_.data(), count};
+  }
+
+  // Build the frames of a burst of `count` frames received on `interface`
+  tcb::span<const router::RxFrame> frames(size_t count,
+                                          router::iface_t interface) {
+    std::fill_n(ifaces_.begin(), count, interface);
+    return frames(count);
+  }
+
+private:
+  const router::LinkBackend &link_;
+  size_t buffer_size_;
+  // Every frame is received after some headroom. The buffers of the
+  // super-frames take megabytes, mapped on huge pages when possible.
+  memory::PageVector<std::byte> bufs_;
+  std::array<char *, RX_BURST_SIZE> data_{};
+  std::array<size_t, RX_BURST_SIZE> lens_{};
+  std::array<size_t, RX_BURST_SIZE> ifaces_{};
+  std::array<vnet_hdr, RX_BURST_SIZE> offloads_{};
+  std::array<router::RxFrame, RX_BURST_SIZE> frames_{};
+};
+
+// Receive and handle the bursts of all the interfaces on the calling thread
+[[noreturn]] void run_rx_loop(router::Router &router,
+                              router::LinkBackend &link) {
+  RxBurst burst{link};
+
+  while (true) {
+    size_t count = link.receive(burst.data(), burst.lengths(),
+                                burst.interfaces(), burst.offloads(),
+                                RX_BURST_SIZE);
+    // An empty burst (receive timeout) still sends the frames held back
+    if (count > 0) {
+      LOG_DEBUG("Received burst of {} frames", count);
+    }
+
+    router.handle_burst(burst.frames(count));
+  }
+}
+
+// Receive and handle the bursts of a single interface, processing every frame
+// end to end on the calling thread
+[[noreturn]] void run_rx_worker(router::Router &router,
+                                router::iface_t interface,
+                                router::LinkBackend &link) {
+  RxBurst burst{link};
+
+  while (true) {
+    size_t count = link.receive(interface, burst.data(), burst.lengths(),
+                                burst.offloads(), RX_BURST_SIZE);
+    if (count > 0) {
+      LOG_DEBUG("Worker {} received burst of {} frames", interface, count);
+    }
+
+    router.handle_burst(burst.frames(count, interface));
+  }
+}
+
+// Reload the routing table from `rtable_path`, and the IPv6 one from
+// `ipv6_rtable_path` if not empty, on every SIGHUP. The new routes are
+// published while the frames keep being forwarded. SIGHUP must be blocked in
+// all the threads.
+// Save the neighbors learned by the router periodically rather than on
+// exit, so that they survive a crash or a SIGKILL as well
+[[noreturn]] void run_neighbor_state_saver(const router::Router &router,
+                                           std::string path) {
+  while (true) {
+    std::this_thread::sleep_for(NEIGHBOR_STATE_SAVE_INTERVAL);
+    try {
+      router::save_neighbor_state(router.neighbor_state(), path.c_str());
+    } catch (const std::exception &e) {
+      LOG_ERROR("Cannot save the neighbor state: {}", e.what());
+    }
+  }
+}
+
+[[noreturn]] void run_rtable_reloader(router::Router &router,
+                                      std::string rtable_path,
+                                      std::string ipv6_rtable_path) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+
+  while (true) {
+    int sig;
+    if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+
+    std::vector<struct route_table_entry> rtable;
+    try {
+      rtable = router::load_rtable(rtable_path.c_str());
+    } catch (const std::exception &e) {
+      LOG_ERROR("Cannot read routing table: {}. Keeping the current routes",
+                e.what());
+      continue;
+    }
+    router.replace_rtable_entries(rtable);
+    LOG_INFO("Routing table reloaded with {} entries", rtable.size());
+
+    if (ipv6_rtable_path.empty()) {
+      continue;
+    }
+    std::vector<router::Ipv6RoutingTable::RoutingTableEntry> ipv6_rtable;
+    try {
+      ipv6_rtable = router::load_ipv6_rtable(ipv6_rtable_path.c_str());
+    } catch (const std::exception &e) {
+      LOG_ERROR("Cannot read IPv6 routing table: {}. Keeping the current "
+                "routes",
+                e.what());
+      continue;
+    }
+    router.replace_ipv6_rtable_entries(ipv6_rtable);
+    LOG_INFO("IPv6 routing table reloaded with {} entries",
+             ipv6_rtable.size());
+  }
+}
+
+// Parse a list of CPUs in the format of isolcpus and taskset -c: numbers and
+// ranges separated by commas (e.g. "2-4,6")
+std::vector<int> parse_cpu_list(std::string_view list) {
+  std::vector<int> cpus;
+  std::string text{list};
+  const char *next = text.c_str();
+  while (true) {
+    char *end;
+    long first = std::strtol(next, &end, 10);
+    long last = first;
+    if (end != next && *end == '-') {
+      next = end + 1;
+      last = std::strtol(next, &end, 10);
+    }
+    DIE(end == next || first < 0 || last < first || last >= CPU_SETSIZE ||
+            (*end != ',' && *end != '\0'),
+        "Invalid CPU list: %s", text.c_str());
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+    if (*end == '\0') {
+      return cpus;
+    }
+    next = end + 1;
+  }
+}
+
+// The CPUs the calling thread may run on. The cores isolated with isolcpus
+// are not part of them, unless the router was started on them.
+std::vector<int> allowed_cpus() {
+  cpu_set_t cpuset;
+  std::vector<int> cpus;
+  if (sched_getaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpuset)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// Restrict a thread to a set of CPUs
+bool set_affinity(pthread_t thread, const std::vector<int> &cpus) {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &cpuset);
+  }
+  return pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset) == 0;
+}
+
+// Pin the receive loop `index` to a CPU, taking the CPUs in turn
+void pin_rx_loop(pthread_t thread, size_t index, const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return;
+  }
+  int cpu = cpus[index % cpus.size()];
+  if (!set_affinity(thread, {cpu})) {
+    LOG_ERROR("Failed to pin RX loop {} to CPU {}", index, cpu);
+  }
+}
+
+// CPU time used by the calling thread, in user space and in the kernel
+std::chrono::nanoseconds thread_cpu_time() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return std::chrono::seconds{now.tv_sec} +
+         std::chrono::nanoseconds{now.tv_nsec};
+}
+
+// Benchmark a link backend alone, without the router: for `seconds`, receive
+// the frames of all the interfaces and send every one back out of its
+// interface with its MAC addresses swapped, as a reflector would, then report
+// the rate reached and the CPU time spent per frame. The traffic comes from an
+// external generator.
+int bench_link(router::LinkBackend &link, double seconds) {
+  init_recv_timeout(LINK_BENCH_RECV_TIMEOUT_MS);
+  RxBurst burst{link};
+  // The frames of a burst sent back, by interface
+  std::array<std::array<char *, RX_BURST_SIZE>, ROUTER_NUM_INTERFACES>
+      out_frames;
+  std::array<std::array<size_t, RX_BURST_SIZE>, ROUTER_NUM_INTERFACES>
+      out_lengths;
+  std::array<size_t, ROUTER_NUM_INTERFACES> out_counts{};
+
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  uint64_t bursts = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::duration<double>(seconds));
+  auto cpu_start = thread_cpu_time();
+  while (std::chrono::steady_clock::now() < end) {
+    size_t count = link.receive(burst.data(), burst.lengths(),
+                                burst.interfaces(), burst.offloads(),
+                                RX_BURST_SIZE);
+    for (size_t i = 0; i < count; ++i) {
+      char *frame = burst.data()[i];
+      size_t length = burst.lengths()[i];
+      if (length >= ETHER_HDR_SIZE) {
+        auto *eth_hdr = reinterpret_cast<ether_hdr *>(frame);
+        std::swap(eth_hdr->ethr_dhost, eth_hdr->ethr_shost);
+      }
+      size_t interface = burst.interfaces()[i];
+      out_frames[interface][out_counts[interface]] = frame;
+      out_lengths[interface][out_counts[interface]] = length;
+      ++out_counts[interface];
+      bytes += length;
+    }
+    for (router::iface_t interface = 0; interface < ROUTER_NUM_INTERFACES;
+         ++interface) {
+      if (out_counts[interface] > 0) {
+        size_t sent = link.send(interface, out_frames[interface].data(),
+                                out_lengths[interface].data(), nullptr,
+                                out_counts[interface]);
+        if (sent < out_counts[interface]) {
+          router::stats::add(
+              router::stats::interface(interface).drops[static_cast<size_t>(
+                  router::stats::DropReason::TX_FAILED)],
+              out_counts[interface] - sent);
+        }
+        out_counts[interface] = 0;
+      }
+    }
+    frames += count;
+    bursts += count > 0;
+  }
+  auto cpu = thread_cpu_time() - cpu_start;
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  auto per_frame = [&](double total) {
+    return frames ? total / static_cast<double>(frames) : 0.0;
+  };
+  printf("%s: %lu frames (%.1f MB) received and sent back in %.1f s: %.3f "
+         "Mpps, %.1f frames per burst, %.0f ns of CPU per frame\n",
+         link.name(), frames, static_cast<double>(bytes) / 1e6,
+         elapsed.count(), static_cast<double>(frames) / elapsed.count() / 1e6,
+         bursts ? static_cast<double>(frames) / static_cast<double>(bursts)
+                : 0.0,
+         per_frame(static_cast<double>(cpu.count())));
+  return 0;
+}
+
+} // namespace
 
 int main(int argc, char *argv[]) {
-  // c buf[MAX_PACKET_LEN];
-  std::array<std::byte, MAX_PACKET_LEN> buf;
+  if (argc == 4 && std::string_view{argv[1]} == "--compile-rtable") {
+    return compile_rtable(argv[2], argv[3]);
+  }
+
+  // The link backend is selected by the flag, or else by the variables of
+  // the rings and AF_XDP, the flag being taken out of the arguments
+  std::string_view link_name = "recvmmsg";
+  if (argc > 1 &&
+      std::string_view{argv[1]}.substr(0, LINK_BACKEND_FLAG.size()) ==
+          LINK_BACKEND_FLAG) {
+    link_name = std::string_view{argv[1]}.substr(LINK_BACKEND_FLAG.size());
+    ++argv;
+    --argc;
+  } else if (is_env_enabled(AF_XDP_ENV)) {
+    link_name = "xdp";
+  } else if (is_env_enabled(PACKET_MMAP_ENV)) {
+    link_name = "mmap";
+  }
+  std::unique_ptr<router::LinkBackend> link =
+      router::make_link_backend(link_name);
+  DIE(!link, "Unknown link backend: %.*s (one of %s)",
+      static_cast<int>(link_name.size()), link_name.data(),
+      router::LINK_BACKEND_NAMES);
+
+  // router [--link-backend=NAME] --bench-link <seconds> <interfaces...>
+  if (argc > 2 && std::string_view{argv[1]} == "--bench-link") {
+    char *end;
+    double seconds = std::strtod(argv[2], &end);
+    DIE(*end != '\0' || !(seconds > 0), "Invalid benchmark duration: %s",
+        argv[2]);
+    init(argv + 3, argc - 3);
+    try {
+      link->setup({});
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot set up the link backend: %s", e.what());
+    }
+    return bench_link(*link, seconds);
+  }
 
   const char *rtable_path = argv[1];
 
@@ -16,42 +640,327 @@ int main(int argc, char *argv[]) {
 
 #ifdef ENABLE_LOGGING
   // Initialize the logger
-  logger::set_level(logger::Level::debug);
+  auto log_level = logger::Level::debug;
+  if (const char *level_name = std::getenv(LOG_LEVEL_ENV)) {
+    auto level = spdlog::level::from_str(level_name);
+    DIE(level == spdlog::level::off && std::string_view{level_name} != "off",
+        "Unknown log level: %s", level_name);
+    log_level = static_cast<logger::Level>(level);
+  }
+  logger::set_level(log_level);
   logger::init();
   LOG_INFO("Router started");
 #endif
 
-  // Read the routing table
-  std::vector<struct route_table_entry> rtable(MAX_ROUTING_TABLE_SIZE);
+  // Keep the threads started from now on off the CPUs of the receive loops,
+  // which the main thread only moves to once it starts receiving
+  std::vector<int> rx_cpus;
+  if (const char *cpu_list = std::getenv(RX_CPUS_ENV)) {
+    rx_cpus = parse_cpu_list(cpu_list);
+    std::vector<int> other_cpus;
+    for (int cpu : allowed_cpus()) {
+      if (std::find(rx_cpus.begin(), rx_cpus.end(), cpu) == rx_cpus.end()) {
+        other_cpus.push_back(cpu);
+      }
+    }
+    if (other_cpus.empty() || !set_affinity(pthread_self(), other_cpus)) {
+      LOG_ERROR("No CPU left for the threads other than the RX loops");
+    }
+  }
 
-  int rtable_size = read_rtable(rtable_path, rtable.data());
-  rtable.resize(rtable_size);
-  LOG_INFO("Routing table read with {} entries", rtable_size);
+#ifdef ENABLE_LOGGING
+  // Started once the main thread is off the CPUs of the receive loops
+  if (is_env_enabled(LOG_ASYNC_ENV)) {
+    logger::start_async();
+    LOG_INFO("Logging asynchronously");
+  }
+#endif
 
-#ifdef DEBUG
-  uint32_t prefix = rtable[0].prefix;
-  uint32_t mask = rtable[0].mask;
-  uint32_t next_hop = rtable[0].next_hop;
-  int interface = rtable[0].interface;
-  LOG_DEBUG("First route entry prefix: {:x} mask: {:x} next_hop: {:x} "
-            "interface: {}",
-            prefix, mask, next_hop, interface);
+#ifdef ENABLE_PROFILING
+  // Dump the stage latencies on SIGUSR1 and at exit
+  profiler::init();
 #endif
 
+  // Export the counters through shared memory
+  const char *stats_shm = std::getenv(STATS_SHM_ENV);
+  if (!stats_shm) {
+    stats_shm = DEFAULT_STATS_SHM;
+  }
+  if (!router::stats::init(stats_shm)) {
+    LOG_ERROR("Cannot map the statistics page {}. Counters are not exported",
+              stats_shm);
+  }
+
+  router::arp::ArpTable::Config arp_config;
+  if (const char *arp_ttl = std::getenv(ARP_TTL_ENV)) {
+    char *end;
+    long seconds = std::strtol(arp_ttl, &end, 10);
+    // The expiry times are compared with wrap-around, on 32-bit milliseconds
+    DIE(*end != '\0' || seconds <= 0 || seconds > INT32_MAX / 1000,
+        "Invalid ARP entry lifetime: %s", arp_ttl);
+    arp_config.entry_ttl = std::chrono::seconds{seconds};
+    // Refresh the entries in the last twelfth of their lifetime
+    arp_config.refresh_ahead = arp_config.entry_ttl / 12;
+  }
+
+  size_t route_cache_size = 0;
+  if (const char *route_cache = std::getenv(ROUTE_CACHE_ENV)) {
+    char *end;
+    long entries = std::strtol(route_cache, &end, 10);
+    DIE(*end != '\0' || entries < 0, "Invalid route cache size: %s",
+        route_cache);
+    route_cache_size = entries;
+  }
+
+  auto tx_flush_deadline = router::TxQueues::DEFAULT_FLUSH_DEADLINE;
+  if (const char *deadline = std::getenv(TX_FLUSH_DEADLINE_ENV)) {
+    char *end;
+    long microseconds = std::strtol(deadline, &end, 10);
+    DIE(*end != '\0' || microseconds < 0, "Invalid TX flush deadline: %s",
+        deadline);
+    tx_flush_deadline = std::chrono::microseconds{microseconds};
+  }
+
+  router::IcmpRateLimits icmp_limits;
+  read_env_limit(ICMP_RATELIMIT_ENV, icmp_limits.source_interval_ms);
+  read_env_limit(ICMP_MSGS_PER_SEC_ENV, icmp_limits.messages_per_sec);
+  read_env_limit(ICMP_MSGS_BURST_ENV, icmp_limits.messages_burst);
+
   // Initialize the router
-  router::Router router{};
-  router.add_rtable_entries(rtable);
+  router::Router router{rtable_backend_from_env(), arp_config, route_cache_size,
+                        tx_flush_deadline, icmp_limits, *link};
 
-  while (true) {
-    size_t interface;
-    size_t len;
+  // Start from the snapshot when it is still up to date, falling back to the
+  // routing table file otherwise
+  const char *rtable_snapshot = std::getenv(RTABLE_SNAPSHOT_ENV);
+  if (rtable_snapshot &&
+      router.load_rtable_snapshot(rtable_path, rtable_snapshot)) {
+    LOG_INFO("Routing table restored from {}", rtable_snapshot);
+  } else {
+    std::vector<struct route_table_entry> rtable =
+        read_rtable_or_die(rtable_path);
+    LOG_INFO("Routing table read with {} entries", rtable.size());
+
+#ifdef DEBUG
+    uint32_t prefix = rtable[0].prefix;
+    uint32_t mask = rtable[0].mask;
+    uint32_t next_hop = rtable[0].next_hop;
+    int interface = rtable[0].interface;
+    LOG_DEBUG("First route entry prefix: {:x} mask: {:x} next_hop: {:x} "
+              "interface: {}",
+              prefix, mask, next_hop, interface);
+#endif
+
+    router.add_rtable_entries(rtable);
+  }
+#ifdef ENABLE_LOGGING
+  if (auto stats = router.rtable_trie_stats()) {
+    log_trie_stats(*stats);
+  }
+#endif
+
+  const char *ipv6_rtable_path = std::getenv(IPV6_RTABLE_ENV);
+  if (ipv6_rtable_path) {
+    auto ipv6_rtable = read_ipv6_rtable_or_die(ipv6_rtable_path);
+    LOG_INFO("IPv6 routing table read with {} entries", ipv6_rtable.size());
+    router.add_ipv6_rtable_entries(ipv6_rtable);
+  }
+  if (const char *ipv6_addresses = std::getenv(IPV6_ADDRESSES_ENV)) {
+    add_ipv6_addresses(router, ipv6_addresses);
+  }
+
+  if (const char *static_arp_path = std::getenv(STATIC_ARP_ENV)) {
+    std::vector<router::arp::ArpTableEntry> neighbors;
+    try {
+      neighbors = router::load_arp_table(static_arp_path);
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot read the static neighbor table: %s", e.what());
+    }
+    router.add_static_neighbors(neighbors);
+    LOG_INFO("Static neighbor table read with {} entries", neighbors.size());
+  }
+
+  // After the static neighbors, which the saved ones do not override
+  const char *neighbor_state_path = std::getenv(NEIGHBOR_STATE_ENV);
+  if (neighbor_state_path) {
+    if (auto state = router::load_neighbor_state(neighbor_state_path)) {
+      router.restore_neighbor_state(*state);
+      LOG_INFO("Restored {} IPv4 and {} IPv6 neighbors from {}",
+               state->ipv4.size(), state->ipv6.size(), neighbor_state_path);
+    }
+  }
+
+  if (const char *acl_path = std::getenv(ACL_ENV)) {
+    DIE(std::getenv(XDP_OFFLOAD_ENV),
+        "The ACL cannot be combined with the XDP offload");
+    std::vector<router::AclRule> acl;
+    try {
+      acl = router::load_acl(acl_path);
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot read the ACL: %s", e.what());
+    }
+    router.set_acl(acl);
+    LOG_INFO("Filtering the forwarded packets with {} ACL rules", acl.size());
+  }
+
+  if (std::getenv(FLOW_TABLE_ENV)) {
+    DIE(std::getenv(XDP_OFFLOAD_ENV),
+        "The flow table cannot be combined with the XDP offload");
+    uint32_t capacity = 0;
+    uint32_t idle_timeout_s = 30;
+    read_env_limit(FLOW_TABLE_ENV, capacity);
+    read_env_limit(FLOW_IDLE_TIMEOUT_ENV, idle_timeout_s);
+    router::FlowTableConfig flow_config;
+    flow_config.capacity = capacity;
+    flow_config.idle_timeout = std::chrono::seconds(idle_timeout_s);
+    try {
+      router.start_flow_tracking(flow_config);
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot create the flow table: %s", e.what());
+    }
+    LOG_INFO("Tracking up to {} flows, idle for at most {} s", capacity,
+             idle_timeout_s);
+  }
+
+  router::EgressQosConfig qos_config;
+  bool egress_qos = is_env_enabled(EGRESS_QOS_ENV);
+  if (egress_qos) {
+    qos_config = egress_qos_from_env();
+    router.set_egress_qos(qos_config);
+    LOG_INFO("Scheduling the frames sent by traffic class, with weights {}, "
+             "{} and {}, shaped to {} bit/s (0 for no shaping)",
+             qos_config.weights[0], qos_config.weights[1],
+             qos_config.weights[2], qos_config.rate);
+  }
 
-    interface = recv_from_any_link(reinterpret_cast<char *>(buf.data()), &len);
-    DIE(interface < 0, "recv_from_any_links");
+  // Handle the routing table reloads on a dedicated thread. SIGHUP is blocked
+  // before any other thread is started, so that they all inherit the mask.
+  sigset_t reload_signals;
+  sigemptyset(&reload_signals);
+  sigaddset(&reload_signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr);
 
-    auto frame = tcb::span<std::byte>(buf.data(), len);
-    LOG_DEBUG("Received frame of size {} on interface {}", len, interface);
+  // Started before the reloader, whose reloads make it dump the kernel routes
+  // again
+  if (std::getenv(FIB_TABLE_ENV)) {
+    router::FibSyncConfig fib_config;
+    read_env_limit(FIB_TABLE_ENV, fib_config.table);
+    try {
+      router.start_fib_sync(fib_config);
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot mirror the kernel routes: %s", e.what());
+    }
+  }
+
+  std::thread(run_rtable_reloader, std::ref(router), std::string{rtable_path},
+              std::string{ipv6_rtable_path ? ipv6_rtable_path : ""})
+      .detach();
 
-    router.handle_frame(frame, interface);
+  if (neighbor_state_path) {
+    std::thread(run_neighbor_state_saver, std::cref(router),
+                std::string{neighbor_state_path})
+        .detach();
+  }
+
+  // Started from the main thread, the slow path stays off the CPUs of the
+  // receive loops, with SIGHUP blocked
+  if (is_env_enabled(SLOW_PATH_ENV)) {
+    router.start_slow_path();
+    LOG_INFO("Handling the exception frames on the slow path");
+  }
+
+  if (const char *collector = std::getenv(SFLOW_COLLECTOR_ENV)) {
+    router::SamplerConfig sampler_config;
+    parse_sflow_collector(collector, sampler_config);
+    read_env_limit(SFLOW_RATE_ENV, sampler_config.rate);
+    try {
+      router.start_sampler(sampler_config);
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot start the packet sampler: %s", e.what());
+    }
+    LOG_INFO("Sampling 1 in {} forwarded packets to {}", sampler_config.rate,
+             collector);
+  }
+
+  // Started once the routes are loaded, so that the packets are not forwarded
+  // by the program before the router can handle its exceptions
+  if (const char *xdp_offload = std::getenv(XDP_OFFLOAD_ENV)) {
+    bool generic = std::string_view{xdp_offload} == "generic";
+    DIE(!generic && std::string_view{xdp_offload} != "1",
+        "Invalid XDP offload mode: %s", xdp_offload);
+    DIE(std::string_view{link->name()} == "xdp",
+        "The XDP offload cannot be combined with the AF_XDP sockets");
+    try {
+      router.start_xdp_offload(generic);
+    } catch (const std::exception &e) {
+      DIE(true, "Cannot start the XDP offload: %s", e.what());
+    }
+    LOG_INFO("Forwarding the plain IPv4 packets with XDP{}",
+             generic ? " in generic mode" : "");
+  }
+
+  router::LinkOptions link_options;
+  link_options.vnet_hdr = is_env_enabled(PACKET_VNET_HDR_ENV);
+  link_options.auxdata = is_env_enabled(PACKET_AUXDATA_ENV);
+  try {
+    link->setup(link_options);
+  } catch (const std::exception &e) {
+    DIE(true, "Cannot set up the %s link backend: %s", link->name(), e.what());
+  }
+  LOG_INFO("Using the {} link backend", link->name());
+  if (link_options.vnet_hdr) {
+    LOG_INFO("Forwarding the GRO super-frames with PACKET_VNET_HDR");
+  } else if (link_options.auxdata) {
+    LOG_INFO("Trusting the checksums validated by the NICs");
+  }
+
+  if (const char *busy_poll = std::getenv(BUSY_POLL_ENV)) {
+    char *end;
+    long spin_us = std::strtol(busy_poll, &end, 10);
+    DIE(*end != '\0' || spin_us <= 0 || spin_us > INT_MAX,
+        "Invalid busy poll time: %s", busy_poll);
+    init_busy_poll(static_cast<unsigned int>(spin_us));
+    LOG_INFO("Polling the idle interfaces for {} us before blocking", spin_us);
+  }
+  // The frames held back by the shapers leave even once the links are idle
+  if (egress_qos && qos_config.rate > 0) {
+    init_recv_timeout(EGRESS_SHAPING_RECV_TIMEOUT_MS);
+  }
+
+  // Once the links are set up, since the requests are sent right away
+  if (is_env_enabled(RESOLVE_NEXT_HOPS_ENV)) {
+    router.start_next_hop_resolution();
+  }
+
+  // Depends on the huge pages free on the machine, hence reported
+  LOG_INFO("Tables and buffer pools mapped on {} KiB of hugetlb pages, {} KiB "
+           "of transparent huge pages and {} KiB of normal pages",
+           get_pages_usage(PAGES_HUGETLB) >> 10,
+           get_pages_usage(PAGES_TRANSPARENT) >> 10,
+           get_pages_usage(PAGES_NORMAL) >> 10);
+
+  if (!is_env_enabled(RX_WORKERS_ENV)) {
+    pin_rx_loop(pthread_self(), 0, rx_cpus);
+    run_rx_loop(router, *link);
+  }
+
+  // Without a CPU list, the workers are spread over the CPUs the router may
+  // run on
+  if (rx_cpus.empty()) {
+    rx_cpus = allowed_cpus();
+  }
+
+  // Each interface is served by its own worker, which acts as a hardware RX
+  // queue would with RSS: the traffic is sharded by input interface
+  LOG_INFO("Starting {} RX workers", ROUTER_NUM_INTERFACES);
+  std::vector<std::thread> workers;
+  for (router::iface_t interface = 0; interface < ROUTER_NUM_INTERFACES;
+       ++interface) {
+    workers.emplace_back(run_rx_worker, std::ref(router), interface,
+                         std::ref(*link));
+    pin_rx_loop(workers.back().native_handle(), interface, rx_cpus);
+  }
+  for (auto &worker : workers) {
+    worker.join();
   }
 }
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+namespace router {
+
+/**
+ * @brief Lock-free bounded ring buffer between any number of producer threads
+ * and a single consumer thread (the bounded queue of D. Vyukov).
+ * Like SpscRing, the slots are filled and handled in place. Every slot has a
+ * sequence number telling whether it is free for the producer of a given lap
+ * or published for the consumer, so a producer only contends with the other
+ * producers on the tail index, for as long as a compare-and-swap takes.
+ * A producer that is preempted between claiming a slot and publishing it
+ * holds the consumer back on that slot until it resumes.
+ *
+ * @tparam T The type of the slots, default constructible
+ */
+template <typename T> class MpscRing {
+public:
+  /**
+   * @param capacity The number of slots, a power of two
+   *
+   * @throws std::invalid_argument if the capacity is not a power of two
+   */
+  explicit MpscRing(size_t capacity) : mask_(capacity - 1) {
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+      throw std::invalid_argument("The ring capacity must be a power of 2");
+    }
+    slots_ = std::make_unique<Slot[]>(capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Producer side, from any thread
+
+  /**
+   * @brief Claim the next free slot, fill it in place with `fill(T &)`, and
+   * publish it.
+   *
+   * @return false, without calling `fill`, if the ring is full
+   */
+  template <typename Fill> bool try_push(Fill &&fill) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots_[tail & mask_];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      auto lag = static_cast<intptr_t>(sequence - tail);
+      if (lag == 0) {
+        if (tail_.compare_exchange_weak(tail, tail + 1,
+                                        std::memory_order_relaxed)) {
+          std::forward<Fill>(fill)(slot.value);
+          slot.sequence.store(tail + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        // The slot still holds a value of the previous lap
+        return false;
+      } else {
+        // Another producer claimed the slot first
+        tail = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * @brief Claim `count` consecutive free slots with a single
+   * compare-and-swap, fill them in place with `fill(T &, size_t i)`, and
+   * publish them.
+   *
+   * @return false, without calling `fill`, if the ring has fewer free slots
+   */
+  template <typename Fill> bool try_push_batch(size_t count, Fill &&fill) {
+    if (count == 0 || count > mask_ + 1) {
+      return count == 0;
+    }
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      // The consumer frees the slots in order, so the last one being free
+      // for this lap means all of them are
+      size_t last = tail + count - 1;
+      size_t sequence =
+          slots_[last & mask_].sequence.load(std::memory_order_acquire);
+      auto lag = static_cast<intptr_t>(sequence - last);
+      if (lag == 0) {
+        if (tail_.compare_exchange_weak(tail, tail + count,
+                                        std::memory_order_relaxed)) {
+          for (size_t i = 0; i < count; ++i) {
+            fill(slots_[(tail + i) & mask_].value, i);
+          }
+          for (size_t i = 0; i < count; ++i) {
+            slots_[(tail + i) & mask_].sequence.store(
+                tail + i + 1, std::memory_order_release);
+          }
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        tail = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Consumer side
+
+  /**
+   * @return The oldest published slot, or nullptr if there is none
+   */
+  T *front() {
+    Slot &slot = slots_[head_ & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != head_ + 1) {
+      return nullptr;
+    }
+    return &slot.value;
+  }
+
+  // Hand the slot returned by `front` back to the producers
+  void pop() {
+    slots_[head_ & mask_].sequence.store(head_ + mask_ + 1,
+                                         std::memory_order_release);
+    ++head_;
+  }
+
+  /**
+   * @return The number of consecutive published slots, up to `max`, which
+   * can be read with `at`
+   */
+  size_t readable(size_t max) {
+    size_t count = 0;
+    while (count < max &&
+           slots_[(head_ + count) & mask_].sequence.load(
+               std::memory_order_acquire) == head_ + count + 1) {
+      ++count;
+    }
+    return count;
+  }
+
+  // The i-th published slot, i being less than the result of `readable`
+  T &at(size_t i) { return slots_[(head_ + i) & mask_].value; }
+
+  // Hand the first `count` published slots back to the producers
+  void pop(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      slots_[(head_ + i) & mask_].sequence.store(head_ + i + mask_ + 1,
+                                                 std::memory_order_release);
+    }
+    head_ += count;
+  }
+
+private:
+  struct alignas(64) Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  // Written by the producers
+  alignas(64) std::atomic<size_t> tail_{0};
+  // Written by the consumer
+  alignas(64) size_t head_{0};
+};
+
+} // namespace router
@@ -0,0 +1,273 @@
+#pragma once
+
+#include "page-allocator.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace trie {
+
+/**
+ * @brief Multibit trie with fixed strides and controlled prefix expansion.
+ *
+ * The key is consumed from the most significant bit in chunks of `Strides...`
+ * bits, one node per chunk. A prefix whose length does not end on a stride
+ * boundary is expanded over all the slots of its level that it covers, so a
+ * lookup touches exactly one slot per level (e.g. 3 for strides 16/8/8).
+ *
+ * Each slot keeps the prefix length of the value stored in it, which lets
+ * prefixes be inserted in any order: a slot is only overwritten by a prefix
+ * that is at least as long as the one it already holds.
+ */
+template <typename Key, typename Value, size_t... Strides>
+class MultibitTrie {
+  // unsigned __int128 is not an integral type in strict C++17, but works as
+  // one here, for the IPv6 addresses
+  static_assert((std::is_integral_v<Key> && std::is_unsigned_v<Key>) ||
+                    std::is_same_v<Key, unsigned __int128>,
+                "MultibitTrie keys must be unsigned integers");
+
+  constexpr static size_t BITS = sizeof(Key) * 8;
+  constexpr static size_t LEVELS = sizeof...(Strides);
+  // Number of lookups advanced in lockstep by longest_prefix_match_batch
+  constexpr static size_t BATCH_SIZE = 16;
+  constexpr static std::array<size_t, LEVELS> STRIDES{Strides...};
+
+  static_assert((Strides + ...) == BITS,
+                "The strides must add up to the key size in bits");
+  static_assert(((Strides > 0 && Strides <= 24) && ...),
+                "Each stride must be between 1 and 24 bits");
+
+  // Offset (in bits, from the most significant bit) of each level
+  constexpr static std::array<size_t, LEVELS> OFFSETS = [] {
+    std::array<size_t, LEVELS> offsets{};
+    size_t offset = 0;
+    for (size_t i = 0; i < LEVELS; ++i) {
+      offsets[i] = offset;
+      offset += STRIDES[i];
+    }
+    return offsets;
+  }();
+
+public:
+  MultibitTrie() {
+    // The root is the only node of the first level
+    levels_[0].resize(size_t{1} << STRIDES[0]);
+  }
+
+  /**
+   * @brief Insert a value into the trie at a given path with a specified
+   * prefix length.
+   * The prefix is represented as a number of bits from the most significant
+   * bit to the least significant bit.
+   * Inserting the same prefix twice replaces the previous value.
+   *
+   * @param path The path to insert the value at.
+   * @param prefix_len The length of the prefix in bits.
+   * @param value The value to insert.
+   */
+  void insert(Key path, size_t prefix_len, Value value) {
+    if (prefix_len == 0) {
+      default_value_ = std::move(value);
+      return;
+    }
+
+    values_.push_back(std::move(value));
+    auto value_index = static_cast<uint32_t>(values_.size());
+
+    uint32_t node = 0;
+    for (size_t level = 0; level < LEVELS; ++level) {
+      size_t slot_index = (size_t{node} << STRIDES[level]) | chunk(path, level);
+      size_t level_end = OFFSETS[level] + STRIDES[level];
+
+      if (prefix_len <= level_end) {
+        // The prefix ends in this level, expand it over the covered slots
+        size_t shift = level_end - prefix_len;
+        size_t first = (slot_index >> shift) << shift;
+        size_t last = first + (size_t{1} << shift);
+
+        for (size_t i = first; i < last; ++i) {
+          Slot &slot = levels_[level][i];
+          if (!slot.value_ || slot.prefix_len_ <= prefix_len) {
+            slot.value_ = value_index;
+            slot.prefix_len_ = static_cast<uint8_t>(prefix_len);
+          }
+        }
+        return;
+      }
+
+      if (!levels_[level][slot_index].child_) {
+        levels_[level][slot_index].child_ = allocate_node(level + 1);
+      }
+      node = levels_[level][slot_index].child_ - 1;
+    }
+  }
+
+  /**
+   * @brief Insert a range of prefixes, in order.
+   * Provided for the same bulk interface as trie::BinaryTrie::build, the
+   * order of the inserts not mattering here.
+   *
+   * @param first, last The prefixes, as elements with `path`, `prefix_len`
+   * and `value` members
+   */
+  template <typename It> void build(It first, It last) {
+    values_.reserve(values_.size() + std::distance(first, last));
+    for (It it = first; it != last; ++it) {
+      insert(it->path, it->prefix_len, it->value);
+    }
+  }
+
+  /**
+   * @brief Find the longest prefix match for a given path.
+   *
+   * @param path The path to search for.
+   * @return The value associated with the longest prefix match, or
+   * std::nullopt if no match is found.
+   */
+  std::optional<Value> longest_prefix_match(Key path) const {
+    uint32_t best = 0;
+    uint32_t node = 0;
+
+    for (size_t level = 0; level < LEVELS; ++level) {
+      const Slot &slot =
+          levels_[level][(size_t{node} << STRIDES[level]) | chunk(path, level)];
+      if (slot.value_) {
+        best = slot.value_;
+      }
+      if (!slot.child_) {
+        break;
+      }
+      node = slot.child_ - 1;
+    }
+
+    if (best) {
+      return values_[best - 1];
+    }
+    return default_value_;
+  }
+
+  /**
+   * @brief Find the longest prefix match of several paths.
+   * The lookups go through the levels in lockstep, groups of BATCH_SIZE of
+   * them moving one level at a time: the slot of each lookup in the next level
+   * is prefetched while the others advance, so that their cache misses
+   * overlap instead of adding up.
+   *
+   * @param paths The paths to search for.
+   * @param results Receives the result of `longest_prefix_match` for each
+   * path.
+   * @param count The number of paths.
+   */
+  void longest_prefix_match_batch(const Key *paths,
+                                  std::optional<Value> *results,
+                                  size_t count) const {
+    for (size_t first = 0; first < count; first += BATCH_SIZE) {
+      size_t size = std::min(BATCH_SIZE, count - first);
+      std::array<size_t, BATCH_SIZE> slot_index;
+      std::array<uint32_t, BATCH_SIZE> best;
+      // The lookups still going down, compacted at the front
+      std::array<uint8_t, BATCH_SIZE> active;
+      for (size_t i = 0; i < size; ++i) {
+        slot_index[i] = chunk(paths[first + i], 0);
+        best[i] = 0;
+        active[i] = static_cast<uint8_t>(i);
+        __builtin_prefetch(&levels_[0][slot_index[i]]);
+      }
+
+      size_t active_count = size;
+      for (size_t level = 0; level < LEVELS && active_count > 0; ++level) {
+        size_t still_active = 0;
+        for (size_t j = 0; j < active_count; ++j) {
+          size_t i = active[j];
+          const Slot &slot = levels_[level][slot_index[i]];
+          if (slot.value_) {
+            best[i] = slot.value_;
+          }
+          if (slot.child_ && level + 1 < LEVELS) {
+            slot_index[i] = (size_t{slot.child_ - 1} << STRIDES[level + 1]) |
+                            chunk(paths[first + i], level + 1);
+            __builtin_prefetch(&levels_[level + 1][slot_index[i]]);
+            active[still_active++] = static_cast<uint8_t>(i);
+          }
+        }
+        active_count = still_active;
+      }
+
+      for (size_t i = 0; i < size; ++i) {
+        results[first + i] =
+            best[i] ? std::optional<Value>{values_[best[i] - 1]}
+                    : default_value_;
+      }
+    }
+  }
+
+  /**
+   * @brief Write the whole trie with `writer` (see snapshot.hpp), to be
+   * restored as is by `load`.
+   */
+  template <typename Writer> void save(Writer &writer) const {
+    for (const auto &slots : levels_) {
+      writer.write(slots);
+    }
+    writer.write(values_);
+    writer.write(default_value_);
+  }
+
+  /**
+   * @brief Replace the trie with one written by `save`.
+   */
+  template <typename Reader> void load(Reader &reader) {
+    for (auto &slots : levels_) {
+      reader.read(slots);
+    }
+    reader.read(values_);
+    reader.read(default_value_);
+  }
+
+  // Bytes allocated for the slots of all the levels and the values
+  size_t memory_usage() const {
+    size_t bytes = values_.capacity() * sizeof(Value);
+    for (const auto &slots : levels_) {
+      bytes += slots.capacity() * sizeof(Slot);
+    }
+    return bytes;
+  }
+
+private:
+  struct Slot {
+    // Index of the child node in the next level + 1 (0 means no child)
+    uint32_t child_{0};
+    // Index in values_ + 1 (0 means no value)
+    uint32_t value_{0};
+    // Length of the prefix that owns value_
+    uint8_t prefix_len_{0};
+  };
+
+  static constexpr size_t chunk(Key path, size_t level) {
+    size_t shift = BITS - OFFSETS[level] - STRIDES[level];
+    return static_cast<size_t>(path >> shift) &
+           ((size_t{1} << STRIDES[level]) - 1);
+  }
+
+  // Allocate a new node in the given level and return its index + 1
+  uint32_t allocate_node(size_t level) {
+    auto &slots = levels_[level];
+    auto node_index = static_cast<uint32_t>(slots.size() >> STRIDES[level]);
+    slots.resize(slots.size() + (size_t{1} << STRIDES[level]));
+    return node_index + 1;
+  }
+
+  // All the nodes of a level are stored contiguously, node i occupying the
+  // slots [i << stride, (i + 1) << stride)
+  std::array<memory::PageVector<Slot>, LEVELS> levels_{};
+  std::vector<Value> values_{};
+  std::optional<Value> default_value_{};
+};
+
+} // namespace trie
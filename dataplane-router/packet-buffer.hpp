@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.hpp"
+#include "span.hpp"
+#include <cstddef>
+#include <cstring>
+extern "C" {
+#include "lib.h"
+}
+
+namespace router {
+
+// Room reserved before the received frames, enough to prepend the headers of
+// an ICMP error while keeping the frames aligned
+constexpr size_t PACKET_HEADROOM = 64;
+
+/**
+ * @brief View of a frame stored in a larger buffer, that keeps track of the
+ * free room before (headroom) and after (tailroom) the frame.
+ * Headers can thus be prepended and the frame grown in place, without
+ * allocating or moving the existing data. Like a span, it does not own the
+ * buffer and is meant to be passed by value.
+ */
+class PacketBuffer {
+public:
+  PacketBuffer() = default;
+
+  /**
+   * @brief A frame of `length` bytes at `data`, with `headroom` free bytes
+   * before it and `tailroom` free bytes after it.
+   */
+  PacketBuffer(std::byte *data, size_t length, size_t headroom = 0,
+               size_t tailroom = 0)
+      : data_(data), length_(length), headroom_(headroom),
+        tailroom_(tailroom) {}
+
+  tcb::span<std::byte> frame() const { return {data_, length_}; }
+  std::byte *data() const { return data_; }
+  size_t size() const { return length_; }
+  size_t headroom() const { return headroom_; }
+  size_t tailroom() const { return tailroom_; }
+
+  /**
+   * @brief Grow the frame by `length` bytes at the front, taken from the
+   * headroom. The new bytes are left uninitialized.
+   *
+   * @return false, leaving the frame untouched, if the headroom is too small
+   */
+  bool push(size_t length) {
+    if (length > headroom_) {
+      return false;
+    }
+    data_ -= length;
+    length_ += length;
+    headroom_ -= length;
+    return true;
+  }
+
+  /**
+   * @brief Set the length of the frame, growing it into the tailroom if
+   * needed. The new bytes are zeroed.
+   *
+   * @return false, leaving the frame untouched, if the tailroom is too small
+   */
+  bool resize(size_t length) {
+    if (length > length_ + tailroom_) {
+      return false;
+    }
+    if (length > length_) {
+      std::memset(data_ + length_, 0, length - length_);
+    }
+    tailroom_ = length_ + tailroom_ - length;
+    length_ = length;
+    return true;
+  }
+
+private:
+  std::byte *data_{nullptr};
+  size_t length_{0};
+  size_t headroom_{0};
+  size_t tailroom_{0};
+};
+
+// A frame received on an interface, as part of a burst
+struct RxFrame {
+  PacketBuffer packet;
+  iface_t interface;
+  // The offload metadata it was received with (PACKET_VNET_HDR), e.g. the GSO
+  // type and size of a super-frame merged by GRO, or nullptr without any
+  const vnet_hdr *offload = nullptr;
+};
+
+} // namespace router
@@ -0,0 +1,245 @@
+#include "packet-sampler.hpp"
+#include "lib_wrapper.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace router {
+
+namespace {
+
+// sFlow version 5 constants (see sflow_version_5.txt)
+constexpr uint32_t SFLOW_VERSION = 5;
+constexpr uint32_t SFLOW_ADDRESS_IPV4 = 1;
+constexpr uint32_t SFLOW_FLOW_SAMPLE = 1;
+constexpr uint32_t SFLOW_RAW_HEADER = 1;
+constexpr uint32_t SFLOW_EXTENDED_ROUTER = 1002;
+constexpr uint32_t SFLOW_HEADER_ETHERNET = 1;
+// Fields of a flow sample before its records
+constexpr uint32_t FLOW_SAMPLE_FIELDS = 8;
+constexpr uint32_t FLOW_SAMPLE_RECORDS = 2;
+// Size of the extended router data: the next hop and the two prefix lengths
+constexpr uint32_t EXTENDED_ROUTER_SIZE = 16;
+
+// State of the xorshift PRNG of the thread, seeded on its first sample
+thread_local uint32_t random_state = 0;
+
+uint32_t next_random() {
+  if (random_state == 0) {
+    random_state = std::random_device{}() | 1;
+  }
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+void put_u32(std::vector<uint8_t> &out, uint32_t value) {
+  value = util::hton(value);
+  auto *bytes = reinterpret_cast<const uint8_t *>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+// An address given in network byte order, written as is
+void put_address(std::vector<uint8_t> &out, uint32_t address) {
+  put_u32(out, SFLOW_ADDRESS_IPV4);
+  auto *bytes = reinterpret_cast<const uint8_t *>(&address);
+  out.insert(out.end(), bytes, bytes + sizeof(address));
+}
+
+} // namespace
+
+thread_local uint32_t PacketSampler::countdown = 0;
+thread_local uint32_t PacketSampler::skip = 0;
+
+PacketSampler::PacketSampler(const Config &config, size_t ring_size)
+    : config_(config), ring_(ring_size),
+      start_time_(std::chrono::steady_clock::now()) {
+  if (config.rate == 0 || config.rate > MAX_RATE) {
+    throw std::invalid_argument("Invalid sampling rate");
+  }
+  socket_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (socket_fd_ == -1) {
+    throw std::runtime_error(std::string{"Cannot open the sFlow socket: "} +
+                             std::strerror(errno));
+  }
+  for (size_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+    if_indices_[i] = static_cast<uint32_t>(get_interface_ifindex(i));
+  }
+  datagram_.reserve(1500);
+  thread_ = std::thread(&PacketSampler::run, this);
+}
+
+PacketSampler::~PacketSampler() {
+  stopping_.store(true);
+  thread_.join();
+  close(socket_fd_);
+}
+
+uint32_t PacketSampler::restart_countdown() {
+  // Uniform between 1 and 2 * rate - 1, so that the mean is the rate while
+  // the samples cannot synchronize with a periodic pattern of the traffic
+  uint32_t pool = skip;
+  uint32_t range = 2 * config_.rate - 1;
+  skip = 1 + static_cast<uint32_t>((uint64_t{next_random()} * range) >> 32);
+  // The very first packet of a thread only starts the countdown
+  bool started = countdown != 0;
+  countdown = skip;
+  return started ? pool : 0;
+}
+
+void PacketSampler::record(tcb::span<const std::byte> frame, iface_t input,
+                           iface_t output, uint32_t source_ip, uint32_t dest_ip,
+                           uint32_t next_hop, uint32_t pool) {
+  bool pushed = ring_.try_push([&](Sample &sample) {
+    sample.pool = pool;
+    sample.frame_size = static_cast<uint32_t>(frame.size());
+    sample.header_size =
+        static_cast<uint32_t>(std::min(frame.size(), HEADER_SIZE));
+    sample.input = input;
+    sample.output = output;
+    sample.source_ip = source_ip;
+    sample.dest_ip = dest_ip;
+    sample.next_hop = next_hop;
+    std::memcpy(sample.header.data(), frame.data(), sample.header_size);
+  });
+  if (!pushed) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void PacketSampler::update_routes(
+    tcb::span<const RoutingTable::Prefix> prefixes) {
+  std::vector<uint64_t> keys;
+  keys.reserve(prefixes.size());
+  uint64_t lengths = 0;
+  for (const auto &prefix : prefixes) {
+    keys.push_back(uint64_t{prefix.path} << 8 | prefix.prefix_len);
+    lengths |= uint64_t{1} << prefix.prefix_len;
+  }
+  std::sort(keys.begin(), keys.end());
+
+  std::lock_guard lock(prefixes_mutex_);
+  prefixes_ = std::move(keys);
+  prefix_lengths_ = lengths;
+}
+
+uint32_t PacketSampler::prefix_length(uint32_t address) {
+  uint32_t key = util::ntoh(address);
+  std::lock_guard lock(prefixes_mutex_);
+  // A search per length used, from the longest one
+  for (int length = 32; length > 0; --length) {
+    if (!(prefix_lengths_ & (uint64_t{1} << length))) {
+      continue;
+    }
+    uint32_t path = key & ~uint32_t{0} << (32 - length);
+    uint64_t prefix = uint64_t{path} << 8 | static_cast<uint64_t>(length);
+    if (std::binary_search(prefixes_.begin(), prefixes_.end(), prefix)) {
+      return static_cast<uint32_t>(length);
+    }
+  }
+  return 0;
+}
+
+void PacketSampler::encode(const Sample &sample) {
+  if (datagram_samples_ == 0) {
+    auto uptime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start_time_);
+    datagram_.clear();
+    put_u32(datagram_, SFLOW_VERSION);
+    put_address(datagram_, config_.agent_address);
+    put_u32(datagram_, 0); // Sub-agent
+    put_u32(datagram_, ++datagram_sequence_);
+    put_u32(datagram_, static_cast<uint32_t>(uptime.count()));
+    // The number of samples, written once the datagram is full
+    put_u32(datagram_, 0);
+  }
+
+  uint32_t padded_header_size = (sample.header_size + 3) & ~uint32_t{3};
+  uint32_t raw_header_size = 16 + padded_header_size;
+  uint32_t sample_size = FLOW_SAMPLE_FIELDS * 4 + 8 + raw_header_size + 8 +
+                         EXTENDED_ROUTER_SIZE;
+
+  // The source of the samples is the input interface, whose sequence and pool
+  // count its samples and the packets they stand for
+  pools_[sample.input] += sample.pool;
+  put_u32(datagram_, SFLOW_FLOW_SAMPLE);
+  put_u32(datagram_, sample_size);
+  put_u32(datagram_, ++sequences_[sample.input]);
+  put_u32(datagram_, if_indices_[sample.input]);
+  put_u32(datagram_, config_.rate);
+  put_u32(datagram_, pools_[sample.input]);
+  put_u32(datagram_, static_cast<uint32_t>(dropped()));
+  put_u32(datagram_, if_indices_[sample.input]);
+  put_u32(datagram_, if_indices_[sample.output]);
+  put_u32(datagram_, FLOW_SAMPLE_RECORDS);
+
+  put_u32(datagram_, SFLOW_RAW_HEADER);
+  put_u32(datagram_, raw_header_size);
+  put_u32(datagram_, SFLOW_HEADER_ETHERNET);
+  put_u32(datagram_, sample.frame_size);
+  put_u32(datagram_, 0); // Bytes stripped from the frame
+  put_u32(datagram_, sample.header_size);
+  auto *header = reinterpret_cast<const uint8_t *>(sample.header.data());
+  datagram_.insert(datagram_.end(), header, header + sample.header_size);
+  datagram_.resize(datagram_.size() + padded_header_size - sample.header_size);
+
+  put_u32(datagram_, SFLOW_EXTENDED_ROUTER);
+  put_u32(datagram_, EXTENDED_ROUTER_SIZE);
+  put_address(datagram_, sample.next_hop);
+  put_u32(datagram_, prefix_length(sample.source_ip));
+  put_u32(datagram_, prefix_length(sample.dest_ip));
+
+  if (++datagram_samples_ == SAMPLES_PER_DATAGRAM) {
+    send_datagram();
+  }
+}
+
+void PacketSampler::send_datagram() {
+  if (datagram_samples_ == 0) {
+    return;
+  }
+  // After the version, the agent address, the sub-agent, the sequence and
+  // the uptime
+  uint32_t count = util::hton(datagram_samples_);
+  std::memcpy(datagram_.data() + 24, &count, sizeof(count));
+
+  sockaddr_in collector{};
+  collector.sin_family = AF_INET;
+  collector.sin_addr.s_addr = config_.collector_address;
+  collector.sin_port = util::hton(config_.collector_port);
+  // A datagram that cannot be sent is lost, as with any UDP export
+  sendto(socket_fd_, datagram_.data(), datagram_.size(), 0,
+         reinterpret_cast<const sockaddr *>(&collector), sizeof(collector));
+  datagram_samples_ = 0;
+}
+
+void PacketSampler::run() {
+  while (!stopping_.load()) {
+    // Bounded, so that the datagram is sent even when the ring never gets
+    // empty
+    size_t handled = 0;
+    while (handled < ring_.capacity()) {
+      Sample *sample = ring_.front();
+      if (!sample) {
+        break;
+      }
+      encode(*sample);
+      ring_.pop();
+      ++handled;
+    }
+    send_datagram();
+    if (handled == 0) {
+      std::this_thread::sleep_for(IDLE_SLEEP);
+    }
+  }
+}
+
+} // namespace router
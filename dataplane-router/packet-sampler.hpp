@@ -0,0 +1,167 @@
+#pragma once
+
+#include "common.hpp"
+#include "mpsc-ring.hpp"
+#include "routing-table.hpp"
+#include "span.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace router {
+
+// Configuration of a PacketSampler
+struct SamplerConfig {
+  // One packet out of `rate` is sampled, on average
+  uint32_t rate = 1000;
+  // The collector of the datagrams, in network byte order
+  uint32_t collector_address = 0;
+  uint16_t collector_port = 6343;
+  // The address identifying the router to the collector (the agent address),
+  // in network byte order
+  uint32_t agent_address = 0;
+};
+
+/**
+ * @brief Sampling of the forwarded packets, exported to a collector as sFlow
+ * version 5 flow samples.
+ *
+ * Every RX thread counts down the packets it forwards until the next sample,
+ * a random skip drawn from a thread-local PRNG with a mean of `rate` packets,
+ * so a packet that is not sampled only costs a decrement. A sampled packet
+ * has its first HEADER_SIZE bytes and its metadata (input and output
+ * interfaces, next hop) copied into a lock-free ring, which is drained by a
+ * background thread. That thread adds the matched prefixes, looked up in its
+ * own copy of the prefixes of the routing table, and sends the samples over
+ * UDP, a few per datagram.
+ *
+ * The samples that do not fit in the ring are dropped, and reported in the
+ * drops field of the next samples.
+ */
+class PacketSampler {
+public:
+  using Config = SamplerConfig;
+
+  // Bytes of the frame copied into a sample, from the Ethernet header
+  constexpr static size_t HEADER_SIZE = 128;
+  constexpr static size_t DEFAULT_RING_SIZE = 1024;
+  // Largest sampling rate, for which the skips still fit in 32 bits
+  constexpr static uint32_t MAX_RATE = uint32_t{1} << 31;
+  // Flow samples sent in a datagram at most, which keeps it under 1200 bytes
+  constexpr static size_t SAMPLES_PER_DATAGRAM = 5;
+  // Time the background thread sleeps for when the ring is empty
+  constexpr static std::chrono::milliseconds IDLE_SLEEP{10};
+
+  /**
+   * @brief Start the background thread.
+   *
+   * @param ring_size The number of samples waiting to be exported at most, a
+   * power of two
+   *
+   * @throws std::invalid_argument if the rate is 0 or above MAX_RATE, or the
+   * ring size is not a power of two
+   * @throws std::runtime_error if the UDP socket cannot be opened
+   */
+  explicit PacketSampler(const Config &config,
+                         size_t ring_size = DEFAULT_RING_SIZE);
+  ~PacketSampler();
+
+  PacketSampler(const PacketSampler &) = delete;
+  PacketSampler &operator=(const PacketSampler &) = delete;
+
+  /**
+   * @brief Count a packet towards the next sample of the calling thread.
+   *
+   * @return 0 if the packet is not sampled, otherwise the number of packets
+   * the sample stands for (those counted by the thread since its previous
+   * sample, this one included), to be given to `record`
+   */
+  uint32_t take() {
+    if (countdown > 1) {
+      --countdown;
+      return 0;
+    }
+    return restart_countdown();
+  }
+
+  /**
+   * @brief Copy a sampled packet into the ring, or drop it if the ring is
+   * full.
+   *
+   * @param frame The frame as received, of which HEADER_SIZE bytes are copied
+   * @param source_ip, dest_ip The addresses of the packet, in network byte
+   * order
+   * @param next_hop The next hop of the packet, in network byte order
+   * @param pool The value returned by `take`
+   */
+  void record(tcb::span<const std::byte> frame, iface_t input, iface_t output,
+              uint32_t source_ip, uint32_t dest_ip, uint32_t next_hop,
+              uint32_t pool);
+
+  /**
+   * @brief Update the copy of the prefixes of the routing table, as its
+   * observer.
+   */
+  void update_routes(tcb::span<const RoutingTable::Prefix> prefixes);
+
+  // Number of samples dropped because the ring was full
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  struct Sample {
+    uint32_t pool;
+    uint32_t frame_size;
+    uint32_t header_size;
+    iface_t input;
+    iface_t output;
+    uint32_t source_ip;
+    uint32_t dest_ip;
+    uint32_t next_hop;
+    std::array<std::byte, HEADER_SIZE> header;
+  };
+
+  // Packets left before the next sample of the thread, 0 until the first
+  // countdown is drawn
+  static thread_local uint32_t countdown;
+  // The skip the countdown started from
+  static thread_local uint32_t skip;
+
+  // Draw the next skip. Out of line, as it is taken once per sample.
+  uint32_t restart_countdown();
+  // The length of the longest prefix matching an address, 0 if none
+  uint32_t prefix_length(uint32_t address);
+  // Add a flow sample to the datagram being built
+  void encode(const Sample &sample);
+  void send_datagram();
+  void run();
+
+  Config config_;
+  MpscRing<Sample> ring_;
+  std::atomic<uint64_t> dropped_{0};
+  int socket_fd_;
+  std::chrono::steady_clock::time_point start_time_;
+
+  // The prefixes of the routing table, sorted by prefix and length, and the
+  // mask of the lengths used
+  std::mutex prefixes_mutex_{};
+  std::vector<uint64_t> prefixes_{};
+  uint64_t prefix_lengths_ = 0;
+
+  // Only accessed by the background thread
+  std::array<uint32_t, ROUTER_NUM_INTERFACES> if_indices_{};
+  std::array<uint32_t, ROUTER_NUM_INTERFACES> sequences_{};
+  std::array<uint32_t, ROUTER_NUM_INTERFACES> pools_{};
+  uint32_t datagram_sequence_ = 0;
+  uint32_t datagram_samples_ = 0;
+  std::vector<uint8_t> datagram_{};
+
+  std::atomic<bool> stopping_{false};
+  std::thread thread_{};
+};
+
+} // namespace router
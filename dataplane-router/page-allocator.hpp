@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+extern "C" {
+#include "lib.h"
+}
+
+namespace memory {
+
+// Allocations from this size are mapped with alloc_pages, the smaller ones
+// still coming from the heap
+constexpr size_t PAGES_THRESHOLD = HUGE_PAGE_SIZE;
+
+/**
+ * @brief Allocator of the vectors of the lookup tables and of the buffer
+ * pools, which maps their large allocations on huge pages when possible (see
+ * alloc_pages), to save on TLB misses. Whether an allocation was mapped is
+ * told by its size alone, so it is stateless.
+ */
+template <typename T> struct PageAllocator {
+  using value_type = T;
+
+  PageAllocator() = default;
+  template <typename U> PageAllocator(const PageAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    if (!is_mapped(n)) {
+      return std::allocator<T>{}.allocate(n);
+    }
+    void *area = alloc_pages(n * sizeof(T), 0, nullptr);
+    if (!area) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(area);
+  }
+
+  void deallocate(T *values, size_t n) {
+    if (!is_mapped(n)) {
+      std::allocator<T>{}.deallocate(values, n);
+    } else {
+      free_pages(values);
+    }
+  }
+
+  template <typename U> bool operator==(const PageAllocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const PageAllocator<U> &) const {
+    return false;
+  }
+
+private:
+  static bool is_mapped(size_t n) {
+    static_assert(alignof(T) <= HUGE_PAGE_SIZE);
+    return n * sizeof(T) >= PAGES_THRESHOLD;
+  }
+};
+
+template <typename T> using PageVector = std::vector<T, PageAllocator<T>>;
+
+} // namespace memory
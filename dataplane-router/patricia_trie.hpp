@@ -0,0 +1,359 @@
+#pragma once
+
+#include "page-allocator.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace trie {
+
+/**
+ * @brief Path-compressed binary trie (Patricia trie).
+ *
+ * Same interface as BinaryTrie, but the chains of nodes having a single child
+ * and no value are collapsed: every node keeps the whole prefix it stands for
+ * (its bits and length), and a child may be any number of bits deeper than
+ * its parent. A lookup compares all the skipped bits of a node at once, so it
+ * visits at most one node per stored prefix on its path instead of one per
+ * bit, and the trie has fewer than two nodes per prefix.
+ */
+template <typename Key, typename Value = std::nullptr_t> class PatriciaTrie {
+  static_assert(std::is_integral_v<Key> && std::is_unsigned_v<Key>,
+                "PatriciaTrie keys must be unsigned integers");
+
+  constexpr static size_t BITS = sizeof(Key) * 8;
+  static_assert(BITS <= 64, "Keys are compared as 64-bit integers");
+  // Number of lookups advanced in lockstep by longest_prefix_match_batch
+  constexpr static size_t BATCH_SIZE = 16;
+
+public:
+  /**
+   * @brief Insert a value into the trie at a given path with a specified
+   * prefix length.
+   * The prefix is represented as a number of bits from the most significant
+   * bit to the least significant bit.
+   * Inserting the same prefix twice replaces the previous value.
+   *
+   * @param path The path to insert the value at.
+   * @param prefix_len The length of the prefix in bits.
+   * @param value The value to insert.
+   */
+  void insert(Key path, size_t prefix_len, Value value) {
+    path = mask(path, prefix_len);
+
+    uint32_t cur = ROOT;
+    while (nodes_[cur].prefix_len_ != prefix_len) {
+      size_t index = bit(path, nodes_[cur].prefix_len_);
+      uint32_t child = nodes_[cur].children_[index];
+      if (!child) {
+        uint32_t leaf = allocate_node(path, prefix_len);
+        nodes_[leaf].value_ = allocate_value(std::move(value));
+        nodes_[cur].children_[index] = leaf;
+        return;
+      }
+
+      size_t common = common_prefix_len(path, prefix_len, nodes_[child].prefix_,
+                                        nodes_[child].prefix_len_);
+      if (common == nodes_[child].prefix_len_) {
+        cur = child;
+        continue;
+      }
+
+      // The prefix diverges from the child, or ends, in the middle of the
+      // bits it skips: split them at the first differing bit
+      uint32_t split = allocate_node(mask(path, common), common);
+      nodes_[split].children_[bit(nodes_[child].prefix_, common)] = child;
+      nodes_[cur].children_[index] = split;
+      if (common == prefix_len) {
+        nodes_[split].value_ = allocate_value(std::move(value));
+      } else {
+        uint32_t leaf = allocate_node(path, prefix_len);
+        nodes_[leaf].value_ = allocate_value(std::move(value));
+        nodes_[split].children_[bit(path, common)] = leaf;
+      }
+      return;
+    }
+
+    Node &node = nodes_[cur];
+    if (node.value_) {
+      values_[node.value_ - 1] = std::move(value);
+    } else {
+      node.value_ = allocate_value(std::move(value));
+    }
+  }
+
+  /**
+   * @brief Insert a range of prefixes, in order.
+   * Provided for the same bulk interface as BinaryTrie::build; prefixes sorted
+   * by path then by length are inserted along mostly cached nodes.
+   *
+   * @param first, last The prefixes, as elements with `path`, `prefix_len`
+   * and `value` members
+   */
+  template <typename It> void build(It first, It last) {
+    values_.reserve(values_.size() + std::distance(first, last));
+    for (It it = first; it != last; ++it) {
+      insert(it->path, it->prefix_len, it->value);
+    }
+  }
+
+  /**
+   * @brief Find the longest prefix match for a given path.
+   *
+   * @param path The path to search for.
+   * @return The value associated with the longest prefix match, or
+   * std::nullopt if no match is found.
+   */
+  std::optional<Value> longest_prefix_match(Key path) const {
+    const Node *node = &nodes_[ROOT];
+    uint32_t result = node->value_;
+
+    // The skipped bits are only compared at the nodes holding a value: when
+    // a node does not match the path, none of the nodes below it do either,
+    // so the first one of them holding a value ends the lookup
+    while (node->prefix_len_ < BITS) {
+      uint32_t child = node->children_[bit(path, node->prefix_len_)];
+      if (!child) {
+        break;
+      }
+      node = &nodes_[child];
+      if (node->value_) {
+        if (mask(path, node->prefix_len_) != node->prefix_) {
+          break;
+        }
+        result = node->value_;
+      }
+    }
+
+    if (result) {
+      return values_[result - 1];
+    }
+    return std::nullopt;
+  }
+
+  /**
+   * @brief Find the longest prefix match of several paths.
+   * The lookups go down the trie in lockstep, groups of BATCH_SIZE of them
+   * moving one node at a time: the next node of each lookup is prefetched
+   * while the others advance, so that their cache misses overlap instead of
+   * adding up.
+   *
+   * @param paths The paths to search for.
+   * @param results Receives the result of `longest_prefix_match` for each
+   * path.
+   * @param count The number of paths.
+   */
+  void longest_prefix_match_batch(const Key *paths,
+                                  std::optional<Value> *results,
+                                  size_t count) const {
+    for (size_t first = 0; first < count; first += BATCH_SIZE) {
+      size_t size = std::min(BATCH_SIZE, count - first);
+      std::array<const Node *, BATCH_SIZE> cur;
+      std::array<uint32_t, BATCH_SIZE> best;
+      // The lookups still going down, compacted at the front
+      std::array<uint8_t, BATCH_SIZE> active;
+      for (size_t i = 0; i < size; ++i) {
+        cur[i] = &nodes_[ROOT];
+        best[i] = 0;
+        active[i] = static_cast<uint8_t>(i);
+      }
+
+      size_t active_count = size;
+      while (active_count > 0) {
+        size_t still_active = 0;
+        for (size_t j = 0; j < active_count; ++j) {
+          size_t i = active[j];
+          Key path = paths[first + i];
+          const Node &node = *cur[i];
+          // As in longest_prefix_match, only the nodes holding a value are
+          // compared with the path
+          if (node.value_) {
+            if (mask(path, node.prefix_len_) != node.prefix_) {
+              continue;
+            }
+            best[i] = node.value_;
+          }
+          if (node.prefix_len_ == BITS) {
+            continue;
+          }
+          uint32_t child = node.children_[bit(path, node.prefix_len_)];
+          if (child) {
+            __builtin_prefetch(&nodes_[child]);
+            cur[i] = &nodes_[child];
+            active[still_active++] = static_cast<uint8_t>(i);
+          }
+        }
+        active_count = still_active;
+      }
+
+      for (size_t i = 0; i < size; ++i) {
+        results[first + i] =
+            best[i] ? std::optional<Value>{values_[best[i] - 1]} : std::nullopt;
+      }
+    }
+  }
+
+  /**
+   * @brief Erase a value from the trie at a given path with a specified
+   * prefix length, collapsing the nodes that are left with a single child.
+   *
+   * @param path The path to erase the value from.
+   * @param prefix_len The length of the prefix in bits.
+   * @return true if the value was successfully erased, false otherwise.
+   */
+  bool erase(Key path, size_t prefix_len) {
+    path = mask(path, prefix_len);
+
+    uint32_t grandparent = ROOT;
+    uint32_t parent = ROOT;
+    uint32_t cur = ROOT;
+    while (nodes_[cur].prefix_len_ < prefix_len) {
+      uint32_t child = nodes_[cur].children_[bit(path, nodes_[cur].prefix_len_)];
+      if (!child || nodes_[child].prefix_len_ > prefix_len ||
+          mask(path, nodes_[child].prefix_len_) != nodes_[child].prefix_) {
+        return false;
+      }
+      grandparent = parent;
+      parent = cur;
+      cur = child;
+    }
+    if (nodes_[cur].prefix_ != path || !nodes_[cur].value_) {
+      return false;
+    }
+
+    free_value(nodes_[cur].value_);
+    nodes_[cur].value_ = 0;
+    if (cur == ROOT) {
+      return true;
+    }
+
+    // Without its value, the node is only kept if it still splits the paths
+    // of two children; otherwise it is removed, which may in turn leave its
+    // parent with a single child
+    if (!remove_if_redundant(parent, cur) || parent == ROOT ||
+        nodes_[parent].value_) {
+      return true;
+    }
+    remove_if_redundant(grandparent, parent);
+    return true;
+  }
+
+  /**
+   * @brief Write the whole trie with `writer` (see snapshot.hpp), to be
+   * restored as is by `load`.
+   */
+  template <typename Writer> void save(Writer &writer) const {
+    writer.write(nodes_);
+    writer.write(values_);
+    writer.write(free_nodes_);
+    writer.write(free_values_);
+  }
+
+  /**
+   * @brief Replace the trie with one written by `save`.
+   */
+  template <typename Reader> void load(Reader &reader) {
+    reader.read(nodes_);
+    reader.read(values_);
+    reader.read(free_nodes_);
+    reader.read(free_values_);
+  }
+
+  // Number of nodes in use, the root included
+  size_t node_count() const { return nodes_.size() - free_nodes_.size(); }
+
+  // Bytes allocated for the nodes and the values
+  size_t memory_usage() const {
+    return nodes_.capacity() * sizeof(Node) +
+           values_.capacity() * sizeof(Value) +
+           (free_nodes_.capacity() + free_values_.capacity()) *
+               sizeof(uint32_t);
+  }
+
+private:
+  // Nodes reference each other (and their values) through 32-bit indices, as
+  // in BinaryTrie. A child is indexed by the first bit of the key past the
+  // prefix of its parent.
+  struct Node {
+    Key prefix_{0};
+    std::array<uint32_t, 2> children_{0, 0};
+    uint32_t value_{0};
+    uint8_t prefix_len_{0};
+  };
+
+  constexpr static uint32_t ROOT = 0;
+
+  // Keep the `prefix_len` most significant bits of `path`
+  static constexpr Key mask(Key path, size_t prefix_len) {
+    return prefix_len == 0 ? 0 : path & (~Key{0} << (BITS - prefix_len));
+  }
+
+  // The bit of `path` at `position`, counted from the most significant bit
+  static constexpr size_t bit(Key path, size_t position) {
+    return (path >> (BITS - 1 - position)) & 1;
+  }
+
+  static size_t common_prefix_len(Key a, size_t a_len, Key b, size_t b_len) {
+    Key diff = a ^ b;
+    size_t common = diff ? __builtin_clzll(diff) - (64 - BITS) : BITS;
+    return std::min({common, a_len, b_len});
+  }
+
+  // Remove `node`, a child of `parent`, if it has no value and at most one
+  // child, which then takes its place. Return true if the node was removed.
+  bool remove_if_redundant(uint32_t parent, uint32_t node) {
+    const Node &removed = nodes_[node];
+    if (removed.value_ || (removed.children_[0] && removed.children_[1])) {
+      return false;
+    }
+    uint32_t heir = removed.children_[0] | removed.children_[1];
+    nodes_[parent].children_[bit(removed.prefix_, nodes_[parent].prefix_len_)] =
+        heir;
+    free_node(node);
+    return true;
+  }
+
+  uint32_t allocate_node(Key prefix, size_t prefix_len) {
+    Node node{};
+    node.prefix_ = prefix;
+    node.prefix_len_ = static_cast<uint8_t>(prefix_len);
+    if (!free_nodes_.empty()) {
+      uint32_t index = free_nodes_.back();
+      free_nodes_.pop_back();
+      nodes_[index] = node;
+      return index;
+    }
+    nodes_.push_back(node);
+    return static_cast<uint32_t>(nodes_.size() - 1);
+  }
+
+  void free_node(uint32_t node) {
+    nodes_[node] = Node{};
+    free_nodes_.push_back(node);
+  }
+
+  uint32_t allocate_value(Value value) {
+    if (!free_values_.empty()) {
+      uint32_t slot = free_values_.back();
+      free_values_.pop_back();
+      values_[slot - 1] = std::move(value);
+      return slot;
+    }
+    values_.push_back(std::move(value));
+    return static_cast<uint32_t>(values_.size());
+  }
+
+  void free_value(uint32_t slot) { free_values_.push_back(slot); }
+
+  memory::PageVector<Node> nodes_{Node{}};
+  std::vector<Value> values_{};
+  std::vector<uint32_t> free_nodes_{};
+  std::vector<uint32_t> free_values_{};
+};
+
+} // namespace trie
@@ -0,0 +1,130 @@
+#include "pmu-counters.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace pmu {
+
+namespace {
+
+constexpr uint64_t cache_event(uint64_t cache, uint64_t result) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+struct EventConfig {
+  uint32_t type;
+  uint64_t config;
+};
+
+// In the order of Event
+constexpr std::array<EventConfig, EVENT_COUNT> EVENT_CONFIGS{{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE,
+     cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE,
+     cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+}};
+
+int open_event(const EventConfig &event) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(
+      syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+} // namespace
+
+Counters::Counters() {
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    fds_[i] = open_event(EVENT_CONFIGS[i]);
+  }
+}
+
+Counters::~Counters() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+bool Counters::available() const {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Counters::start() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+Counts Counters::stop() {
+  Counts counts;
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    // The value, the time the event was enabled and that it was counted
+    uint64_t data[3];
+    if (fds_[i] < 0 || read(fds_[i], data, sizeof(data)) != sizeof(data) ||
+        data[2] == 0) {
+      continue;
+    }
+    counts.values[i] = static_cast<double>(data[0]) *
+                       static_cast<double>(data[1]) /
+                       static_cast<double>(data[2]);
+  }
+  return counts;
+}
+
+void print_per_unit(std::FILE *out, const char *prefix, const Counts &counts,
+                    double units, const char *unit) {
+  static constexpr std::array<const char *, EVENT_COUNT> NAMES{
+      "cycles",      "instructions",  "L1D misses",
+      "LLC misses",  "branch misses", "dTLB misses"};
+
+  bool any = false;
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    if (!counts.values[i]) {
+      continue;
+    }
+    std::fprintf(out, "%s%.2f %s", any ? ", " : prefix,
+                 *counts.values[i] / units, NAMES[i]);
+    any = true;
+  }
+  if (!any) {
+    return;
+  }
+  auto cycles = counts[Event::CYCLES];
+  auto instructions = counts[Event::INSTRUCTIONS];
+  if (cycles && instructions && *cycles > 0) {
+    std::fprintf(out, " per %s (IPC %.2f)\n", unit, *instructions / *cycles);
+  } else {
+    std::fprintf(out, " per %s\n", unit);
+  }
+}
+
+} // namespace pmu
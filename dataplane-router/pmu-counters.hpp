@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+
+namespace pmu {
+
+// The hardware events counted around the benchmarked regions
+enum class Event {
+  CYCLES,
+  INSTRUCTIONS,
+  L1D_MISSES,
+  LLC_MISSES,
+  BRANCH_MISSES,
+  DTLB_MISSES,
+  COUNT,
+};
+
+constexpr size_t EVENT_COUNT = static_cast<size_t>(Event::COUNT);
+
+// The counts of a region, without those of the events the kernel or the
+// processor cannot count (e.g. in a virtual machine without a virtual PMU).
+// The counts of events that shared the PMU with others are scaled to the
+// whole region.
+struct Counts {
+  std::array<std::optional<double>, EVENT_COUNT> values{};
+
+  std::optional<double> operator[](Event event) const {
+    return values[static_cast<size_t>(event)];
+  }
+};
+
+/**
+ * @brief The hardware counters of the calling thread, opened with
+ * perf_event_open, and of the threads it starts once they are opened. Only
+ * the user space is counted, which unprivileged processes may do with the
+ * default perf_event_paranoid.
+ */
+class Counters {
+public:
+  Counters();
+  ~Counters();
+
+  Counters(const Counters &) = delete;
+  Counters &operator=(const Counters &) = delete;
+
+  // Whether at least one of the events can be counted
+  bool available() const;
+
+  /**
+   * @brief Reset the counters and start counting
+   */
+  void start();
+
+  /**
+   * @brief Stop counting, and get the counts since the last start
+   */
+  Counts stop();
+
+  /**
+   * @brief Run a function between start and stop
+   */
+  template <typename Fn> Counts measure(Fn &&fn) {
+    start();
+    fn();
+    return stop();
+  }
+
+private:
+  std::array<int, EVENT_COUNT> fds_;
+};
+
+/**
+ * @brief Print the counts of a region divided by the units it handled (the
+ * packets or the lookups), with the instructions per cycle, on one line
+ * starting with `prefix`. Nothing is printed if no event was counted.
+ *
+ * @param unit The name of the units, e.g. "lookup"
+ */
+void print_per_unit(std::FILE *out, const char *prefix, const Counts &counts,
+                    double units, const char *unit);
+
+} // namespace pmu
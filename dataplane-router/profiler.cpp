@@ -0,0 +1,177 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
+#include <thread>
+#include <vector>
+
+namespace profiler {
+
+namespace {
+
+constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::COUNT);
+constexpr std::array<const char *, STAGE_COUNT> STAGE_NAMES{
+    "parse", "checksum", "acl", "lpm_lookup", "arp_lookup", "transmit"};
+
+/**
+ * HDR-style histogram: the values are grouped by magnitude (the position of
+ * their most significant bit), each magnitude being split in
+ * 2^SUB_BUCKET_BITS linear sub-buckets, for a relative error of at most
+ * 1/2^SUB_BUCKET_BITS over the whole 64-bit range.
+ * A histogram has a single writer, so updates are plain relaxed stores
+ * instead of atomic read-modify-writes, and readers may see slightly stale
+ * counts.
+ */
+class Histogram {
+public:
+  constexpr static size_t SUB_BUCKET_BITS = 4;
+  constexpr static size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+  constexpr static size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  void record(uint64_t value) {
+    auto &bucket = buckets_[bucket_index(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+
+  uint64_t count(size_t index) const {
+    return buckets_[index].load(std::memory_order_relaxed);
+  }
+
+  static size_t bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    size_t magnitude = 63 - __builtin_clzll(value);
+    size_t shift = magnitude - SUB_BUCKET_BITS;
+    size_t sub_bucket = (value >> shift) & (SUB_BUCKETS - 1);
+    return (shift + 1) * SUB_BUCKETS + sub_bucket;
+  }
+
+  // Upper bound of the values counted in a bucket
+  static uint64_t bucket_value(size_t index) {
+    if (index < SUB_BUCKETS) {
+      return index;
+    }
+    size_t shift = index / SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS | sub_bucket) << shift) + ((uint64_t{1} << shift) - 1);
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+};
+
+using ThreadHistograms = std::array<Histogram, STAGE_COUNT>;
+
+// The histograms of all the threads that ever recorded a duration. They are
+// kept after their thread exits, so that its results are still dumped.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadHistograms>> registry;
+
+thread_local ThreadHistograms *thread_histograms = nullptr;
+
+ThreadHistograms *register_thread() {
+  std::lock_guard lock(registry_mutex);
+  registry.push_back(std::make_unique<ThreadHistograms>());
+  return registry.back().get();
+}
+
+// Timestamp counter ticks per nanosecond, measured at startup
+double ticks_per_ns = 1.0;
+
+void calibrate() {
+  auto start_time = std::chrono::steady_clock::now();
+  uint64_t start_ticks = now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  uint64_t ticks = now() - start_ticks;
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_time);
+  ticks_per_ns = static_cast<double>(ticks) / elapsed.count();
+}
+
+void run_dumper(sigset_t signals) {
+  calibrate();
+
+  while (true) {
+    int sig;
+    if (sigwait(&signals, &sig) != 0) {
+      continue;
+    }
+
+    dump(stderr);
+    if (sig != SIGUSR1) {
+      std::fflush(nullptr);
+      std::_Exit(0);
+    }
+  }
+}
+
+} // namespace
+
+void record(Stage stage, uint64_t ticks) {
+  if (!thread_histograms) {
+    thread_histograms = register_thread();
+  }
+  (*thread_histograms)[static_cast<size_t>(stage)].record(ticks);
+}
+
+void init() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  std::thread(run_dumper, signals).detach();
+}
+
+void dump(std::FILE *out) {
+  constexpr std::array<double, 5> PERCENTILES{50.0, 90.0, 99.0, 99.9, 100.0};
+
+  std::lock_guard lock(registry_mutex);
+  std::fprintf(out, "%-12s %12s", "stage", "count");
+  for (double percentile : PERCENTILES) {
+    std::fprintf(out, " %10.1f%%", percentile);
+  }
+  std::fprintf(out, "   (ns, %.3f ticks/ns)\n", ticks_per_ns);
+
+  for (size_t stage = 0; stage < STAGE_COUNT; ++stage) {
+    // Merge the histograms of all the threads
+    std::vector<uint64_t> counts(Histogram::BUCKETS, 0);
+    uint64_t total = 0;
+    for (const auto &histograms : registry) {
+      for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+        uint64_t count = (*histograms)[stage].count(i);
+        counts[i] += count;
+        total += count;
+      }
+    }
+
+    std::fprintf(out, "%-12s %12lu", STAGE_NAMES[stage],
+                 static_cast<unsigned long>(total));
+    size_t bucket = 0;
+    uint64_t seen = 0;
+    for (double percentile : PERCENTILES) {
+      auto rank = static_cast<uint64_t>(total * percentile / 100.0);
+      while (bucket < Histogram::BUCKETS &&
+             (seen + counts[bucket] < std::max<uint64_t>(rank, 1))) {
+        seen += counts[bucket++];
+      }
+      double value =
+          total == 0 || bucket == Histogram::BUCKETS
+              ? 0.0
+              : Histogram::bucket_value(bucket) / ticks_per_ns;
+      std::fprintf(out, " %11.1f", value);
+    }
+    std::fprintf(out, "\n");
+  }
+}
+
+} // namespace profiler
@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef ENABLE_PROFILING
+
+#define PROFILE_SCOPE(stage) (void)0
+
+#else
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+// Time the rest of the enclosing scope as the given profiler::Stage
+#define PROFILE_SCOPE(stage)                                                   \
+  profiler::ScopedTimer PROFILE_CONCAT(profile_timer_, __LINE__) {             \
+    profiler::Stage::stage                                                     \
+  }
+
+namespace profiler {
+
+// The timed stages of the packet processing. Stages can nest: PARSE includes
+// the CHECKSUM of the IP header.
+enum class Stage {
+  PARSE,
+  CHECKSUM,
+  ACL,
+  LPM_LOOKUP,
+  ARP_LOOKUP,
+  TRANSMIT,
+  COUNT,
+};
+
+/**
+ * @brief Read the timestamp counter, in ticks. The TSC is used on x86, where
+ * reading it only takes a few cycles, and the monotonic clock elsewhere.
+ */
+inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+/**
+ * @brief Record a duration for a stage in the histogram of the calling
+ * thread. Lock-free: every thread only writes to its own histograms.
+ *
+ * @param stage The stage that was timed
+ * @param ticks The duration, in timestamp counter ticks
+ */
+void record(Stage stage, uint64_t ticks);
+
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Stage stage) : stage_(stage), start_(now()) {}
+  ~ScopedTimer() { record(stage_, now() - start_); }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  Stage stage_;
+  uint64_t start_;
+};
+
+/**
+ * @brief Start the thread dumping the histograms on SIGUSR1, as well as on
+ * SIGINT and SIGTERM before exiting. Must be called before any other thread
+ * is started, so that they all inherit the blocked signals.
+ */
+void init();
+
+/**
+ * @brief Print the percentiles of every stage, merged over all the threads
+ *
+ * @param out The stream to print to
+ */
+void dump(std::FILE *out);
+
+} // namespace profiler
+
+#endif // ENABLE_PROFILING
@@ -0,0 +1,72 @@
+#include "rcu.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+
+namespace router::rcu {
+
+namespace {
+
+// Maximum number of threads that can ever enter a read-side section
+constexpr size_t MAX_READERS = 64;
+// Epoch of a reader outside any read-side section
+constexpr uint64_t QUIESCENT = 0;
+
+// Each reader publishes the epoch in which its current read-side section
+// started, on its own cache line to avoid false sharing between readers
+struct alignas(64) ReaderSlot {
+  std::atomic<uint64_t> epoch{QUIESCENT};
+};
+
+std::array<ReaderSlot, MAX_READERS> reader_slots{};
+std::atomic<size_t> reader_count{0};
+std::atomic<uint64_t> global_epoch{1};
+
+std::atomic<uint64_t> *register_reader() {
+  size_t index = reader_count.fetch_add(1);
+  if (index >= MAX_READERS) {
+    throw std::length_error("Too many RCU readers");
+  }
+  return &reader_slots[index].epoch;
+}
+
+} // namespace
+
+namespace detail {
+
+thread_local ReaderState reader_state{};
+
+void read_lock() {
+  if (!reader_state.epoch) {
+    reader_state.epoch = register_reader();
+  }
+  // Sequentially consistent, so the epoch is visible to the writers before
+  // any protected pointer is read
+  reader_state.epoch->store(global_epoch.load());
+}
+
+void read_unlock() {
+  reader_state.epoch->store(QUIESCENT, std::memory_order_release);
+}
+
+} // namespace detail
+
+void synchronize() {
+  // Every read-side section that starts from now on observes the objects
+  // published before this point
+  uint64_t epoch = global_epoch.fetch_add(1) + 1;
+
+  size_t readers = std::min(reader_count.load(), MAX_READERS);
+  for (size_t i = 0; i < readers; ++i) {
+    const auto &slot = reader_slots[i].epoch;
+    uint64_t reader_epoch;
+    while ((reader_epoch = slot.load()) != QUIESCENT && reader_epoch < epoch) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+} // namespace router::rcu
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace router::rcu {
+
+namespace detail {
+
+struct ReaderState {
+  // Epoch slot of the thread, allocated on its first read-side section
+  std::atomic<uint64_t> *epoch;
+  // Depth of the nested read-side sections of the thread
+  unsigned int nesting;
+};
+
+extern thread_local ReaderState reader_state;
+
+void read_lock();
+void read_unlock();
+
+} // namespace detail
+
+/**
+ * @brief Read-side critical section of the RCU domain.
+ * The objects reachable when a guard is created are not reclaimed by writers
+ * until it is destroyed. Readers never take a lock or wait on writers, and
+ * only the outermost of nested guards touches shared memory, so a guard can
+ * be held around a whole burst to amortize its cost.
+ */
+class ReadGuard {
+public:
+  ReadGuard() {
+    if (detail::reader_state.nesting++ == 0) {
+      detail::read_lock();
+    }
+  }
+
+  ~ReadGuard() {
+    if (--detail::reader_state.nesting == 0) {
+      detail::read_unlock();
+    }
+  }
+
+  ReadGuard(const ReadGuard &) = delete;
+  ReadGuard &operator=(const ReadGuard &) = delete;
+};
+
+/**
+ * @brief Wait until all the read-side critical sections that started before
+ * the call have ended. A writer unpublishes an object, calls `synchronize`,
+ * then it can safely reclaim the object.
+ */
+void synchronize();
+
+} // namespace router::rcu
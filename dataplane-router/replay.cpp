@@ -0,0 +1,436 @@
+/**
+ * Offline end-to-end benchmark of the router: the frames of a pcap capture
+ * are fed straight into Router::handle_burst (or handle_frame), with the link
+ * layer stubbed out, and the time spent handling them is reported in packets
+ * per second and TSC cycles per packet.
+ *
+ * Usage: ./replay <rtable> <pcap> [passes] [burst_size]
+ *
+ * The capture must be a classic pcap file of Ethernet frames (not pcapng).
+ * All the frames are received on interface 0, and the ones larger than
+ * MAX_PACKET_LEN, the size of its receive buffers, are skipped. A
+ * burst size of 1 goes through handle_frame instead of handle_burst. The
+ * routing table backend and the route cache are configured by the same
+ * environment variables as the router (ROUTER_RTABLE_BACKEND,
+ * ROUTER_ROUTE_CACHE), and so are the ingress ACL (ROUTER_ACL) and the
+ * egress QoS (ROUTER_EGRESS_QOS, without shaping).
+ *
+ * The router is given a link backend of its own (ReplayLink): the interfaces
+ * get fixed addresses, and the frames sent are only counted. The ARP
+ * requests of the router are answered between the bursts, by a first pass
+ * that is not timed, so that the timed passes measure the forwarding and not
+ * the resolution of the next hops.
+ *
+ * The hardware counters of the timed passes (cycles, instructions, cache,
+ * branch and TLB misses) are reported per frame as well, when the processor
+ * and the kernel let them be counted. Unlike the TSC cycles, they include the
+ * copy of the frames into the RX buffers.
+ */
+#include "acl.hpp"
+#include "alloc-tracker.hpp"
+#include "lib_wrapper.hpp"
+#include "pmu-counters.hpp"
+#include "router.hpp"
+#include "routing-table.hpp"
+#include "rtable-loader.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr size_t DEFAULT_PASSES = 10;
+constexpr size_t DEFAULT_BURST_SIZE = 32;
+constexpr router::iface_t RX_INTERFACE = 0;
+
+// Magic numbers of the pcap files with microsecond and nanosecond timestamps,
+// as read in the byte order of the machine that wrote them
+constexpr uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+constexpr uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+constexpr uint32_t LINKTYPE_ETHERNET = 1;
+
+struct PcapFileHeader {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+};
+
+struct PcapRecordHeader {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+// The frames of a capture, stored back to back
+struct Capture {
+  std::vector<std::byte> data;
+  std::vector<size_t> offsets;
+  std::vector<size_t> lengths;
+  size_t skipped = 0;
+
+  size_t size() const { return lengths.size(); }
+};
+
+/**
+ * @brief Read the Ethernet frames of a pcap file.
+ *
+ * @throws std::runtime_error if the file cannot be read or is not a pcap
+ * capture of Ethernet frames
+ */
+Capture read_pcap(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error(std::string(path) + ": cannot open file");
+  }
+  std::vector<char> contents{std::istreambuf_iterator<char>(file),
+                             std::istreambuf_iterator<char>()};
+
+  PcapFileHeader header;
+  if (contents.size() < sizeof(header)) {
+    throw std::runtime_error(std::string(path) + ": not a pcap file");
+  }
+  std::memcpy(&header, contents.data(), sizeof(header));
+  bool swapped = false;
+  if (header.magic != PCAP_MAGIC_US && header.magic != PCAP_MAGIC_NS) {
+    swapped = true;
+    header.magic = __builtin_bswap32(header.magic);
+    header.network = __builtin_bswap32(header.network);
+    if (header.magic != PCAP_MAGIC_US && header.magic != PCAP_MAGIC_NS) {
+      throw std::runtime_error(std::string(path) +
+                               ": not a pcap file (pcapng is not supported)");
+    }
+  }
+  if (header.network != LINKTYPE_ETHERNET) {
+    throw std::runtime_error(std::string(path) + ": link type " +
+                             std::to_string(header.network) +
+                             " is not Ethernet");
+  }
+
+  Capture capture;
+  size_t offset = sizeof(header);
+  while (offset + sizeof(PcapRecordHeader) <= contents.size()) {
+    PcapRecordHeader record;
+    std::memcpy(&record, contents.data() + offset, sizeof(record));
+    offset += sizeof(record);
+    size_t length = swapped ? __builtin_bswap32(record.incl_len)
+                            : record.incl_len;
+    if (length > contents.size() - offset) {
+      throw std::runtime_error(std::string(path) + ": truncated frame " +
+                               std::to_string(capture.size() + 1));
+    }
+
+    if (length > MAX_PACKET_LEN) {
+      ++capture.skipped;
+    } else {
+      auto first = reinterpret_cast<const std::byte *>(contents.data() + offset);
+      capture.offsets.push_back(capture.data.size());
+      capture.lengths.push_back(length);
+      capture.data.insert(capture.data.end(), first, first + length);
+    }
+    offset += length;
+  }
+  return capture;
+}
+
+std::array<uint8_t, 6> interface_mac(router::iface_t interface) {
+  return {0x02, 0x00, 0x00, 0x00, 0x00, static_cast<uint8_t>(interface + 1)};
+}
+
+// MAC address given to every neighbour answering an ARP request
+std::array<uint8_t, 6> neighbour_mac(uint32_t ip) {
+  auto host = router::util::ntoh(ip);
+  return {0x02, 0x01, static_cast<uint8_t>(host >> 24),
+          static_cast<uint8_t>(host >> 16), static_cast<uint8_t>(host >> 8),
+          static_cast<uint8_t>(host)};
+}
+
+// The link layer of the router: the interfaces get fixed addresses, and the
+// frames sent are only counted
+class ReplayLink : public router::LinkBackend {
+public:
+  std::array<uint64_t, ROUTER_NUM_INTERFACES> frames{};
+  std::array<uint64_t, ROUTER_NUM_INTERFACES> bytes{};
+  // The ARP requests sent, as (target address, interface), waiting to be
+  // answered between two bursts
+  std::vector<std::pair<uint32_t, router::iface_t>> arp_requests;
+
+  const char *name() const override { return "replay"; }
+  void setup(const router::LinkOptions &) override {}
+
+  // The frames are fed to the router directly, never received
+  size_t receive(char *[], size_t[], size_t[], vnet_hdr[], size_t) override {
+    return 0;
+  }
+  size_t receive(router::iface_t, char *[], size_t[], vnet_hdr[],
+                 size_t) override {
+    return 0;
+  }
+
+  size_t send(router::iface_t interface, char *frames_sent[],
+              size_t lengths[], const vnet_hdr[], size_t count) override {
+    for (size_t i = 0; i < count; ++i) {
+      count_frame(interface, frames_sent[i], lengths[i]);
+    }
+    return count;
+  }
+
+  // The frames of the capture are read into buffers of MAX_PACKET_LEN
+  size_t rx_frame_room() const override { return MAX_PACKET_LEN; }
+  uint16_t interface_mtu(router::iface_t) const override { return 1500; }
+
+  uint32_t interface_ip(router::iface_t interface) const override {
+    return router::util::hton(uint32_t{10} << 24 | uint32_t{255} << 16 |
+                              static_cast<uint32_t>(interface) << 8 | 1);
+  }
+
+  std::array<uint8_t, 6>
+  interface_mac(router::iface_t interface) const override {
+    return ::interface_mac(interface);
+  }
+
+  void reset() {
+    frames.fill(0);
+    bytes.fill(0);
+  }
+
+  uint64_t total_frames() const {
+    uint64_t total = 0;
+    for (uint64_t count : frames) {
+      total += count;
+    }
+    return total;
+  }
+
+private:
+  void count_frame(router::iface_t interface, const char *frame,
+                   size_t length) {
+    frames[interface] += 1;
+    bytes[interface] += length;
+
+    const auto *eth_hdr = reinterpret_cast<const ether_hdr *>(frame);
+    if (length >= ETHER_HDR_SIZE + ARP_HDR_SIZE &&
+        router::util::ntoh(eth_hdr->ethr_type) == ETHERTYPE_ARP) {
+      const auto *arp_hdr =
+          reinterpret_cast<const struct arp_hdr *>(frame + ETHER_HDR_SIZE);
+      if (router::util::ntoh(arp_hdr->opcode) == ARP_OPCODE_REQUEST) {
+        arp_requests.emplace_back(arp_hdr->tprotoa, interface);
+      }
+    }
+  }
+};
+
+ReplayLink sink;
+
+// Answer the ARP requests sent by the router since the last call
+void answer_arp_requests(router::Router &router) {
+  auto requests = std::move(sink.arp_requests);
+  sink.arp_requests.clear();
+  for (auto [ip, interface] : requests) {
+    std::array<std::byte, ETHER_HDR_SIZE + ARP_HDR_SIZE> frame{};
+    auto *eth_hdr = reinterpret_cast<ether_hdr *>(frame.data());
+    auto *arp_hdr = reinterpret_cast<struct arp_hdr *>(frame.data() +
+                                                       ETHER_HDR_SIZE);
+    auto router_mac = interface_mac(interface);
+    auto mac = neighbour_mac(ip);
+
+    std::copy(router_mac.begin(), router_mac.end(), eth_hdr->ethr_dhost);
+    std::copy(mac.begin(), mac.end(), eth_hdr->ethr_shost);
+    eth_hdr->ethr_type = router::util::hton(ETHERTYPE_ARP);
+    arp_hdr->hw_type = router::util::hton(ARP_HW_TYPE_ETHERNET);
+    arp_hdr->proto_type = router::util::hton(ARP_PROTO_TYPE_IP);
+    arp_hdr->hw_len = ARP_HW_LEN;
+    arp_hdr->proto_len = ARP_PROTO_LEN;
+    arp_hdr->opcode = router::util::hton(ARP_OPCODE_REPLY);
+    std::copy(mac.begin(), mac.end(), arp_hdr->shwa);
+    arp_hdr->sprotoa = ip;
+    std::copy(router_mac.begin(), router_mac.end(), arp_hdr->thwa);
+    arp_hdr->tprotoa = sink.interface_ip(interface);
+
+    router.handle_frame(router::PacketBuffer(frame.data(), frame.size()),
+                        interface);
+  }
+}
+
+size_t size_from_env(const char *name, size_t default_value) {
+  const char *value = std::getenv(name);
+  return value ? std::strtoul(value, nullptr, 10) : default_value;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <rtable> <pcap> [passes] [burst_size]\n",
+            argv[0]);
+    return 1;
+  }
+  size_t passes = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : DEFAULT_PASSES;
+  size_t burst_size =
+      argc > 4 ? std::strtoul(argv[4], nullptr, 10) : DEFAULT_BURST_SIZE;
+  passes = std::max<size_t>(passes, 1);
+  burst_size = std::max<size_t>(burst_size, 1);
+
+  auto backend = router::RoutingTable::Backend::MULTIBIT_TRIE;
+  if (const char *name = std::getenv("ROUTER_RTABLE_BACKEND")) {
+    auto parsed = router::RoutingTable::backend_from_string(name);
+    if (!parsed) {
+      fprintf(stderr, "Unknown routing table backend: %s\n", name);
+      return 1;
+    }
+    backend = *parsed;
+  }
+
+  Capture capture;
+  std::vector<route_table_entry> routes;
+  try {
+    capture = read_pcap(argv[2]);
+    routes = router::load_rtable(argv[1]);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  if (capture.size() == 0) {
+    fprintf(stderr, "No frames to replay in %s\n", argv[2]);
+    return 1;
+  }
+
+  // The neighbours stay resolved for the whole run
+  router::arp::ArpTable::Config arp_config;
+  arp_config.entry_ttl = std::chrono::hours(24);
+  router::Router router{backend, arp_config,
+                        size_from_env("ROUTER_ROUTE_CACHE", 0),
+                        router::TxQueues::DEFAULT_FLUSH_DEADLINE,
+                        router::IcmpRateLimits{}, sink};
+  // The sample tables also route through interfaces that the router is not
+  // started with, which are folded onto the existing ones
+  for (auto &route : routes) {
+    route.interface %= ROUTER_NUM_INTERFACES;
+  }
+  router.add_rtable_entries(routes);
+  if (const char *acl_path = std::getenv("ROUTER_ACL")) {
+    try {
+      router.set_acl(router::load_acl(acl_path));
+    } catch (const std::exception &e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+  if (size_t flows = size_from_env("ROUTER_FLOW_TABLE", 0)) {
+    router.start_flow_tracking({flows, std::chrono::hours(1)});
+  }
+  if (size_from_env("ROUTER_EGRESS_QOS", 0) == 1) {
+    router.set_egress_qos(router::EgressQosConfig{});
+  }
+
+  // The frames are copied into the RX buffers before every burst, as the
+  // real links do, since the router rewrites them in place
+  std::vector<std::array<std::byte, router::PACKET_HEADROOM + MAX_PACKET_LEN>>
+      buffers(burst_size);
+  std::vector<router::RxFrame> burst(burst_size);
+
+  // Replay the capture once, and return the TSC cycles spent in the router
+  auto replay = [&] {
+    uint64_t cycles = 0;
+    for (size_t first = 0; first < capture.size(); first += burst_size) {
+      size_t count = std::min(burst_size, capture.size() - first);
+      for (size_t i = 0; i < count; ++i) {
+        size_t length = capture.lengths[first + i];
+        std::byte *data = buffers[i].data() + router::PACKET_HEADROOM;
+        std::memcpy(data, capture.data.data() + capture.offsets[first + i],
+                    length);
+        burst[i] = {router::PacketBuffer(data, length, router::PACKET_HEADROOM,
+                                         MAX_PACKET_LEN - length),
+                    RX_INTERFACE};
+      }
+
+      uint64_t start = router::util::read_tsc();
+      if (burst_size == 1) {
+        router.handle_frame(burst[0].packet, burst[0].interface);
+      } else {
+        router.handle_burst({burst.data(), count});
+      }
+      cycles += router::util::read_tsc() - start;
+
+      answer_arp_requests(router);
+    }
+    return cycles;
+  };
+
+  // Untimed pass resolving the next hops
+  replay();
+  answer_arp_requests(router);
+#ifdef ENABLE_ALLOC_TRACKING
+  // The buffers of the bursts have grown to their size
+  uint64_t warmup_violations = alloc_tracker::violations();
+  alloc_tracker::arm();
+#endif
+
+  sink.reset();
+  std::vector<uint64_t> pass_cycles;
+  pmu::Counters pmu_counters;
+  auto wall_start = std::chrono::steady_clock::now();
+  uint64_t tsc_start = router::util::read_tsc();
+  pmu::Counts pmu_counts = pmu_counters.measure([&] {
+    for (size_t pass = 0; pass < passes; ++pass) {
+      pass_cycles.push_back(replay());
+    }
+  });
+  double tsc_per_ns =
+      static_cast<double>(router::util::read_tsc() - tsc_start) /
+      std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - wall_start)
+          .count();
+
+  std::sort(pass_cycles.begin(), pass_cycles.end());
+  auto frames = static_cast<double>(capture.size());
+  auto report = [&](const char *name, uint64_t cycles) {
+    double cycles_per_frame = static_cast<double>(cycles) / frames;
+    double ns_per_frame = cycles_per_frame / tsc_per_ns;
+    printf("%s pass: %.3f Mpps, %.1f ns/frame, %.0f cycles/frame\n", name,
+           1e3 / ns_per_frame, ns_per_frame, cycles_per_frame);
+  };
+
+  printf("%s: %zu frames replayed %zu times in bursts of %zu (%zu larger "
+         "than %d bytes skipped)\n",
+         argv[2], capture.size(), passes, burst_size, capture.skipped,
+         MAX_PACKET_LEN);
+  report("median", pass_cycles[pass_cycles.size() / 2]);
+  report("best", pass_cycles.front());
+  printf("sent %.1f frames per pass:", static_cast<double>(sink.total_frames()) /
+                                           static_cast<double>(passes));
+  for (size_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+    printf(" interface %zu %.1f (%.1f KB)", i,
+           static_cast<double>(sink.frames[i]) / static_cast<double>(passes),
+           static_cast<double>(sink.bytes[i]) / 1024 /
+               static_cast<double>(passes));
+  }
+  printf("\n");
+  if (!pmu_counters.available()) {
+    printf("(no hardware counters: perf_event_open cannot count them here)\n");
+  }
+  pmu::print_per_unit(stdout, "pmu: ", pmu_counts,
+                      frames * static_cast<double>(passes), "frame");
+#ifdef ENABLE_ALLOC_TRACKING
+  alloc_tracker::dump(stdout);
+  if (alloc_tracker::violations() != warmup_violations) {
+    fprintf(stderr, "The timed passes allocated in the no-allocation scopes\n");
+    return 1;
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace router {
+
+/**
+ * @brief Lets the consumer of a ring sleep while it is empty, woken up by
+ * the producers through a futex.
+ * The consumer raises its flag and checks the ring once more before
+ * sleeping, and a producer looks at the flag only after publishing, so that
+ * either the consumer sees the new slots or the producer sees it sleeping.
+ * While the consumer keeps up, waking it costs the producers a fence and the
+ * load of a cache line they share with it, and no syscall.
+ *
+ * A waiter placed in memory shared between processes must be constructed
+ * with `shared`, the futex being then looked up by its physical page.
+ */
+class RingWaiter {
+public:
+  explicit RingWaiter(bool shared = false) : shared_(shared) {}
+
+  RingWaiter(const RingWaiter &) = delete;
+  RingWaiter &operator=(const RingWaiter &) = delete;
+
+  /**
+   * @brief Sleep until a producer calls `notify`, or the timeout expires,
+   * unless `ready()` tells that there is something to consume once the flag
+   * is raised.
+   *
+   * @return true if the consumer slept
+   */
+  template <typename Ready>
+  bool wait(Ready &&ready, std::chrono::nanoseconds timeout) {
+    sleeping_.store(1, std::memory_order_relaxed);
+    // Pairs with the fence of notify
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ready()) {
+      sleeping_.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    struct timespec relative {
+      static_cast<time_t>(timeout.count() / 1'000'000'000),
+          static_cast<long>(timeout.count() % 1'000'000'000)
+    };
+    // Returns at once if a producer lowered the flag meanwhile
+    futex(FUTEX_WAIT, 1, &relative);
+    sleeping_.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Wake the consumer up if it sleeps, once the slots are published
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // Only the producer lowering the flag makes the syscall
+    if (sleeping_.load(std::memory_order_relaxed) != 0 &&
+        sleeping_.exchange(0, std::memory_order_relaxed) != 0) {
+      futex(FUTEX_WAKE, 1, nullptr);
+    }
+  }
+
+private:
+  long futex(int operation, uint32_t value, const struct timespec *timeout) {
+    if (!shared_) {
+      operation |= FUTEX_PRIVATE_FLAG;
+    }
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sleeping_),
+                   operation, value, timeout, nullptr, 0);
+  }
+
+  // On its own cache line, written by the consumer on every sleep
+  alignas(64) std::atomic<uint32_t> sleeping_{0};
+  bool shared_;
+};
+
+} // namespace router
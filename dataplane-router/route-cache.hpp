@@ -0,0 +1,91 @@
+#pragma once
+
+#include "adjacency-table.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief Small direct-mapped cache of the routing table lookups, keyed by
+ * destination address.
+ *
+ * The cache is not synchronized, each RX worker keeping its own. It is tagged
+ * with the generation of the routing table it was filled from and emptied as
+ * a whole as soon as the table changes, so it never returns a stale route.
+ * Only the destinations that have a route are cached.
+ */
+class RouteCache {
+public:
+  /**
+   * @param size The number of entries, a power of two (0 to disable the
+   * cache)
+   *
+   * @throws std::invalid_argument if the size is not a power of two
+   */
+  explicit RouteCache(size_t size = 0) { resize(size); }
+
+  size_t size() const { return entries_.size(); }
+
+  void resize(size_t size) {
+    if (size & (size - 1)) {
+      throw std::invalid_argument("The route cache size must be a power of 2");
+    }
+    entries_.assign(size, Entry{});
+  }
+
+  /**
+   * @brief Find the adjacency cached for a destination.
+   *
+   * @param generation The current generation of the routing table
+   */
+  std::optional<AdjacencyTable::index_t> lookup(uint32_t dest_ip,
+                                                uint64_t generation) {
+    if (generation != generation_) {
+      entries_.assign(entries_.size(), Entry{});
+      generation_ = generation;
+      return std::nullopt;
+    }
+
+    const Entry &entry = entries_[slot(dest_ip)];
+    if (entry.adjacency && entry.dest_ip == dest_ip) {
+      return entry.adjacency - 1;
+    }
+    return std::nullopt;
+  }
+
+  /**
+   * @brief Cache the adjacency of a destination.
+   *
+   * @param generation The generation of the routing table read before the
+   * lookup that returned the adjacency
+   */
+  void insert(uint32_t dest_ip, AdjacencyTable::index_t adjacency,
+              uint64_t generation) {
+    if (generation == generation_) {
+      entries_[slot(dest_ip)] = {dest_ip, adjacency + 1};
+    }
+  }
+
+private:
+  struct Entry {
+    uint32_t dest_ip;
+    // Index of the adjacency + 1 (0 means an empty entry)
+    AdjacencyTable::index_t adjacency;
+  };
+
+  size_t slot(uint32_t dest_ip) const {
+    // Fibonacci hashing, the high bits of the product being the well mixed
+    // ones
+    uint32_t hash = dest_ip * 0x9e3779b1u;
+    return (hash ^ (hash >> 16)) & (entries_.size() - 1);
+  }
+
+  std::vector<Entry> entries_{};
+  uint64_t generation_{0};
+};
+
+} // namespace router
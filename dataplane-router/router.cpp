@@ -1,12 +1,21 @@
 #include "router.hpp"
+#include "alloc-tracker.hpp"
+#include "burst-classifier.hpp"
 #include "common.hpp"
+#include "flow-hash.hpp"
 #include "lib.h"
 #include "lib_wrapper.hpp"
 #include "logger.hpp"
+#include "profiler.hpp"
+#include "rcu.hpp"
+#include "route-cache.hpp"
+#include "stats.hpp"
+#include "tx-queue.hpp"
 #include "util.hpp"
 #include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <functional>
 #include <optional>
 #include <sys/types.h>
 
@@ -35,6 +44,85 @@ void recompute_checksum(T *header, uint16_t T::*checksum_field,
       util::hton(checksum(reinterpret_cast<uint16_t *>(header), size));
 }
 
+// Update a checksum in O(1) after a 16-bit word of the data it covers changed
+// from old_word to new_word, as HC' = ~(~HC + ~m + m') (RFC 1624). All the
+// values are in host byte order.
+constexpr uint16_t update_checksum(uint16_t checksum, uint16_t old_word,
+                                   uint16_t new_word) {
+  uint32_t sum = static_cast<uint16_t>(~checksum) +
+                 static_cast<uint16_t>(~old_word) + uint32_t{new_word};
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<uint16_t>(~sum);
+}
+
+// Decrement the TTL of a packet, adjusting its header checksum incrementally
+void decrement_ttl(struct ip_hdr *ip_hdr) {
+  // The TTL is the high byte of the TTL/protocol word of the header
+  uint16_t old_word = static_cast<uint16_t>((ip_hdr->ttl << 8) | ip_hdr->proto);
+  --ip_hdr->ttl;
+  uint16_t new_word = static_cast<uint16_t>((ip_hdr->ttl << 8) | ip_hdr->proto);
+  ip_hdr->checksum = util::hton(
+      update_checksum(util::ntoh(ip_hdr->checksum), old_word, new_word));
+}
+
+// Flags of the fragment word of an IPv4 header, and mask of its offset, in
+// units of 8 bytes, in host byte order
+constexpr uint16_t IP_FLAG_DONT_FRAGMENT = 0x4000;
+constexpr uint16_t IP_FLAG_MORE_FRAGMENTS = 0x2000;
+constexpr uint16_t IP_FRAGMENT_OFFSET_MASK = 0x1fff;
+
+// Copy the IPv4 options repeated in every fragment, those with the copied
+// flag (RFC 791), padded with zeros (end of options) to a multiple of 4 bytes.
+// Returns the number of bytes written.
+size_t copy_fragment_options(tcb::span<const std::byte> options,
+                             std::byte *out) {
+  size_t written = 0;
+  for (size_t i = 0; i < options.size();) {
+    auto type = static_cast<uint8_t>(options[i]);
+    if (type == 0) {
+      break;
+    }
+    if (type == 1) {
+      ++i;
+      continue;
+    }
+    if (i + 1 == options.size()) {
+      break;
+    }
+    size_t length = static_cast<uint8_t>(options[i + 1]);
+    if (length < 2 || i + length > options.size()) {
+      break;
+    }
+    if (type & 0x80) {
+      std::memcpy(out + written, options.data() + i, length);
+      written += length;
+    }
+    i += length;
+  }
+  size_t padded = (written + 3) & ~size_t{3};
+  std::memset(out + written, 0, padded - written);
+  return padded;
+}
+
+// Fold an IPv6 address into a key of the ICMP rate limits
+uint64_t fold_address(const Ipv6Address &address) {
+  std::array<uint64_t, 2> words;
+  std::memcpy(words.data(), address.data(), sizeof(words));
+  return words[0] ^ words[1];
+}
+
+void write_ether_header(tcb::span<std::byte> frame,
+                        const std::array<uint8_t, 6> &source_mac,
+                        const std::array<uint8_t, 6> &dest_mac,
+                        uint16_t eth_type) {
+  auto *eth_hdr = reinterpret_cast<ether_hdr *>(frame.data());
+  std::copy(source_mac.begin(), source_mac.end(),
+            std::begin(eth_hdr->ethr_shost));
+  std::copy(dest_mac.begin(), dest_mac.end(), std::begin(eth_hdr->ethr_dhost));
+  eth_hdr->ethr_type = util::hton(eth_type);
+}
+
 // Return a frame containing the ARP request
 // If dest_mac is not provided, this means it is a broadcast
 std::array<std::byte, ETHER_HDR_SIZE + ARP_HDR_SIZE>
@@ -97,46 +185,437 @@ generate_arp_frame(uint16_t arp_op, uint32_t source_ip,
   return frame;
 }
 
+void write_ipv6_header(struct ipv6_hdr *ip_hdr, const Ipv6Address &source_ip,
+                       const Ipv6Address &dest_ip, size_t payload_len,
+                       uint8_t hop_limit) {
+  *ip_hdr = {.ver_tc_flow = util::hton(uint32_t{IPV6_VERSION} << 28),
+             .payload_len = util::hton(static_cast<uint16_t>(payload_len)),
+             .next_header = IPV6_NEXT_HEADER_ICMPV6,
+             .hop_limit = hop_limit,
+             .source_addr = source_ip,
+             .dest_addr = dest_ip};
+}
+
+// Find the link-layer address option of type `type` among the options of a
+// neighbor discovery message. Returns false if the options are malformed.
+bool find_lladdr_option(tcb::span<const std::byte> options, uint8_t type,
+                        std::optional<std::array<uint8_t, 6>> &mac) {
+  while (options.size() >= 2) {
+    auto option_type = static_cast<uint8_t>(options[0]);
+    size_t length = static_cast<size_t>(options[1]) * 8;
+    if (length == 0 || length > options.size()) {
+      return false;
+    }
+    if (option_type == type && length >= ND_OPTION_LLADDR_SIZE) {
+      const auto *option =
+          reinterpret_cast<const struct nd_lladdr_option *>(options.data());
+      mac.emplace();
+      std::copy(std::begin(option->mac), std::end(option->mac), mac->begin());
+    }
+    options = options.subspan(length);
+  }
+  return true;
+}
+
+// State of a frame forwarded as part of a burst
+struct BurstForward {
+  Ipv4FrameView view;
+  iface_t in_interface;
+  AdjacencyTable::index_t adjacency;
+  iface_t out_interface;
+  const vnet_hdr *offload;
+  // Set once the frame has been dropped or queued for ARP resolution
+  bool done;
+};
+
+// Every RX worker handles its bursts with its own scratch state
+thread_local std::vector<BurstForward> burst_forwards{};
+// (the frames of burst_forwards missing from the route cache, with their
+// destinations and the result of their lookups)
+thread_local std::vector<size_t> burst_misses{};
+thread_local std::vector<uint32_t> burst_dest_ips{};
+thread_local std::vector<std::optional<AdjacencyTable::index_t>>
+    burst_adjacencies{};
+// and caches its own routes
+thread_local RouteCache route_cache{};
+// It queues the frames it sends until the end of the burst
+thread_local TxQueues tx_queues{};
+// (the burst being handled, whose frames stay valid until the queues are
+// flushed)
+thread_local tcb::span<const RxFrame> rx_burst{};
+
+// The route cache of the calling worker, or nullptr if it is disabled
+RouteCache *worker_route_cache(size_t size) {
+  if (size == 0) {
+    return nullptr;
+  }
+  if (route_cache.size() != size) {
+    route_cache.resize(size);
+  }
+  return &route_cache;
+}
+
+// The TX queues of the calling worker
+TxQueues &worker_tx_queues(std::chrono::microseconds flush_deadline,
+                           const EgressQosConfig *egress_qos,
+                           LinkBackend &link) {
+  if (tx_queues.flush_deadline() != flush_deadline) {
+    tx_queues.set_flush_deadline(flush_deadline);
+  }
+  if (tx_queues.link() != &link) {
+    tx_queues.set_link(&link);
+  }
+  if (tx_queues.egress_qos() != egress_qos) {
+    tx_queues.set_egress_qos(egress_qos);
+  }
+  return tx_queues;
+}
+
+// Whether a frame lies in the buffer of one of the frames of the burst being
+// handled, e.g. a reply built in place
+bool is_in_rx_burst(tcb::span<const std::byte> frame) {
+  std::less<const std::byte *> before;
+  for (const auto &rx : rx_burst) {
+    const std::byte *start = rx.packet.data() - rx.packet.headroom();
+    const std::byte *end =
+        rx.packet.data() + rx.packet.size() + rx.packet.tailroom();
+    if (!before(frame.data(), start) &&
+        !before(end, frame.data() + frame.size())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The offload metadata of a frame forwarded from its receive buffer, where it
+// still starts
+const vnet_hdr *received_offload(tcb::span<const std::byte> frame) {
+  for (const auto &rx : rx_burst) {
+    if (rx.packet.data() == frame.data()) {
+      return rx.offload;
+    }
+  }
+  return nullptr;
+}
+
+// Complete in software the offloads of a frame about to be copied without its
+// metadata, i.e. its partial checksum. Returns false for a super-frame, which
+// cannot be sent once it is no longer segmented on its way out.
+bool complete_offload(tcb::span<std::byte> frame,
+                      const vnet_hdr &offload) {
+  if (offload.gso_type != VNET_HDR_GSO_NONE) {
+    return false;
+  }
+  if (offload.flags & VNET_HDR_F_NEEDS_CSUM) {
+    // The checksum field holds the sum of the pseudo-header, summed along
+    // with the rest of the transport header and the payload
+    size_t start = offload.csum_start;
+    size_t field = start + offload.csum_offset;
+    if (field + sizeof(uint16_t) > frame.size()) {
+      return false;
+    }
+    uint16_t sum = util::hton(
+        checksum(reinterpret_cast<uint16_t *>(frame.data() + start),
+                 frame.size() - start));
+    std::memcpy(frame.data() + field, &sum, sizeof(sum));
+  }
+  return true;
+}
+
 } // namespace
 
-std::optional<std::pair<uint32_t, iface_t>>
-Router::get_next_hop(uint32_t dest_ip) {
-  auto entry = rtable_.lookup(dest_ip);
-  if (!entry) {
-    return std::nullopt;
+void Router::count_rx(tcb::span<const std::byte> frame, iface_t interface) {
+  auto &counters = stats::interface(interface);
+  stats::add(counters.rx_packets);
+  stats::add(counters.rx_bytes, frame.size());
+}
+
+void Router::count_tx(tcb::span<const std::byte> frame, iface_t interface) {
+  auto &counters = stats::interface(interface);
+  stats::add(counters.tx_packets);
+  stats::add(counters.tx_bytes, frame.size());
+}
+
+void Router::send_on_link(tcb::span<std::byte> frame, iface_t interface) {
+  count_tx(frame, interface);
+  TxQueues &queues =
+      worker_tx_queues(tx_flush_deadline_, egress_qos_.get(), link_);
+  if (is_in_rx_burst(frame)) {
+    queues.push(frame, interface);
+  } else {
+    queues.push_copy(frame, interface);
   }
+}
 
-  uint32_t next_hop_ip = entry->next_hop;
-  iface_t next_hop_iface = entry->interface;
+void Router::send_received_on_link(tcb::span<std::byte> frame,
+                                   iface_t interface,
+                                   const vnet_hdr *offload) {
+  count_tx(frame, interface);
+  worker_tx_queues(tx_flush_deadline_, egress_qos_.get(), link_)
+      .push(frame, interface, offload);
+}
+
+void Router::flush_tx_queues() {
+  worker_tx_queues(tx_flush_deadline_, egress_qos_.get(), link_).flush();
+  rx_burst = {};
+}
 
-  return std::make_pair(next_hop_ip, next_hop_iface);
+Router::Router(RoutingTable::Backend rtable_backend,
+               arp::ArpTable::Config arp_config, size_t route_cache_size,
+               std::chrono::microseconds tx_flush_deadline,
+               const IcmpRateLimits &icmp_limits, LinkBackend &link)
+    : rtable_(adjacencies_, rtable_backend), arp_table_(arp_config),
+      ndp_table_(arp_config),
+      route_cache_size_(
+          route_cache_size ? util::next_power_of_two(route_cache_size) : 0),
+      tx_flush_deadline_(tx_flush_deadline), link_(link),
+      icmp_limiter_(icmp_limits) {
+  for (iface_t interface = 0; interface < interface_info_.size();
+       ++interface) {
+    auto &info = interface_info_[interface];
+    info.ip = link_.interface_ip(interface);
+    info.mtu = link_.interface_mtu(interface);
+    if (info.mtu == 0) {
+      info.mtu = UINT16_MAX;
+    }
+    info.mac = link_.interface_mac(interface);
+    info.ipv6_link_local = ipv6::link_local(info.mac);
+    local_addresses_[interface] = info.ip;
+    LOG_DEBUG("Interface {}: {{ ip: {:x}, mac: {:xpn} }}", interface, info.ip,
+              spdlog::to_hex(info.mac));
+  }
+  select_burst_stages();
 }
 
-Router::interface_info Router::get_interface_info(iface_t interface) {
-  auto it = interface_ip_map_.find(interface);
+std::optional<AdjacencyTable::index_t>
+Router::get_adjacency(uint32_t dest_ip, iface_t interface) const {
+  PROFILE_SCOPE(LPM_LOOKUP);
+  RouteCache *cache = worker_route_cache(route_cache_size_);
+  if (!cache) {
+    return rtable_.lookup(dest_ip);
+  }
+
+  auto &counters = stats::interface(interface);
+  uint64_t generation = rtable_.generation();
+  if (auto adjacency = cache->lookup(dest_ip, generation)) {
+    stats::add(counters.route_cache_hits);
+    return adjacency;
+  }
+  stats::add(counters.route_cache_misses);
+
+  auto adjacency = rtable_.lookup(dest_ip);
+  if (adjacency) {
+    cache->insert(dest_ip, *adjacency, generation);
+  }
+  return adjacency;
+}
 
-  // If the interface info is already known, return it
-  if (it != interface_ip_map_.end()) {
-    return it->second;
+AdjacencyTable::index_t
+Router::select_path(AdjacencyTable::index_t route,
+                    const Ipv4FrameView &view, uint32_t now) {
+  size_t length = view.frame().size() - Ipv4FrameView::NETWORK_OFFSET;
+  std::optional<FlowKey> key;
+  if (flows_) {
+    key = FlowKey::of(view.network_header(), length);
+    auto flow = flows_->hit(*key, length, now);
+    if (flow && is_path_of(route, flow->adjacency)) {
+      return flow->adjacency;
+    }
   }
 
-  // Otherwise, get the IP address and MAC address from the interface
-  uint32_t ip = get_interface_ip_addr(interface);
-  std::array<uint8_t, 6> mac;
-  ::get_interface_mac(interface, mac.data());
+  AdjacencyTable::index_t adjacency = hash_path(route, view);
+  if (key) {
+    // A new flow, or one whose path was removed from its route
+    flows_->insert(*key, adjacency, length, now);
+  }
+  return adjacency;
+}
+
+AdjacencyTable::index_t Router::hash_path(AdjacencyTable::index_t route,
+                                          const Ipv4FrameView &view) const {
+  // Only the routes with several paths need the hash of the flow
+  if (!AdjacencyTable::is_group(route)) {
+    return route;
+  }
+  size_t length = view.frame().size() - Ipv4FrameView::NETWORK_OFFSET;
+  return adjacencies_.select(route,
+                             flow_hash(view.network_header(), length));
+}
+
+bool Router::is_path_of(AdjacencyTable::index_t route,
+                        AdjacencyTable::index_t adjacency) const {
+  if (!AdjacencyTable::is_group(route)) {
+    return adjacency == route;
+  }
+  auto paths = adjacencies_.paths(route);
+  return std::find(paths.begin(), paths.end(), adjacency) != paths.end();
+}
+
+void Router::handle_frame(PacketBuffer packet, iface_t interface) {
+  NO_ALLOC_SCOPE("handle_frame");
+  // The adjacencies found by the lookups are used past them, and are only
+  // reclaimed once no frame can still be sent to them
+  rcu::ReadGuard guard;
+  RxFrame rx{packet, interface};
+  rx_burst = {&rx, 1};
+  count_rx(packet.frame(), interface);
+  dispatch_frame(packet, interface);
+  flush_tx_queues();
+  if (slow_path_) {
+    slow_path_->notify();
+  }
+}
+
+void Router::start_slow_path(size_t ring_size) {
+  slow_path_ = std::make_unique<SlowPath>(
+      [this](tcb::span<const RxFrame> frames,
+             tcb::span<const PuntReason> reasons) {
+        handle_punted_frames(frames, reasons);
+      },
+      ring_size);
+}
+
+void Router::start_xdp_offload(bool generic) {
+  xdp_offload_ =
+      std::make_unique<XdpOffload>(adjacencies_, local_addresses_, generic);
+  rtable_.add_observer(
+      [offload = xdp_offload_.get()](
+          tcb::span<const RoutingTable::Prefix> prefixes) {
+        offload->update_routes(prefixes);
+      });
+}
+
+void Router::start_sampler(SamplerConfig config) {
+  if (config.agent_address == 0) {
+    config.agent_address = local_addresses_[0];
+  }
+  sampler_ = std::make_unique<PacketSampler>(config);
+  rtable_.add_observer([sampler = sampler_.get()](
+                           tcb::span<const RoutingTable::Prefix> prefixes) {
+    sampler->update_routes(prefixes);
+  });
+  select_burst_stages();
+}
+
+void Router::start_fib_sync(const FibSyncConfig &config) {
+  fib_sync_ = std::make_unique<FibSync>(rtable_, config);
+}
+
+void Router::start_next_hop_resolution() {
+  rtable_.add_observer(
+      [this](tcb::span<const RoutingTable::Prefix> prefixes) {
+        resolve_next_hops(prefixes);
+      });
+}
+
+void Router::resolve_next_hops(
+    tcb::span<const RoutingTable::Prefix> prefixes) {
+  // Many prefixes share their adjacencies, each one being checked once
+  std::vector<bool> seen(adjacencies_.size());
+  size_t requests = 0;
+  auto resolve = [&](AdjacencyTable::index_t adjacency) {
+    if (seen[adjacency]) {
+      return;
+    }
+    seen[adjacency] = true;
+    uint32_t next_hop = adjacencies_.next_hop(adjacency);
+    if (next_hop == 0) {
+      return;
+    }
+    iface_t interface = adjacencies_.interface(adjacency);
+    auto entry = lookup_arp_entry(next_hop);
+    if (!entry) {
+      send_arp_request(next_hop, interface);
+      ++requests;
+    } else if (entry->refresh) {
+      // The refresh is reported to this lookup only
+      send_arp_request(next_hop, interface, entry->mac);
+    }
+  };
+
+  for (const auto &prefix : prefixes) {
+    if (AdjacencyTable::is_group(prefix.value)) {
+      for (AdjacencyTable::index_t path : adjacencies_.paths(prefix.value)) {
+        resolve(path);
+      }
+    } else {
+      resolve(prefix.value);
+    }
+  }
+  flush_tx_queues();
+  LOG_INFO("Sent ARP requests for {} unresolved next hops", requests);
+}
+
+void Router::sample_packet(const Ipv4FrameView &view, iface_t interface,
+                           AdjacencyTable::index_t adjacency) {
+  if (!sampler_) {
+    return;
+  }
+  if (uint32_t pool = sampler_->take()) {
+    const auto *ip_hdr = view.network_header();
+    sampler_->record(view.frame(), interface, adjacencies_.interface(adjacency),
+                     ip_hdr->source_addr, ip_hdr->dest_addr,
+                     adjacencies_.next_hop(adjacency), pool);
+  }
+}
+
+bool Router::punt(PacketBuffer packet, iface_t interface, PuntReason reason) {
+  return slow_path_ && slow_path_->punt(packet, interface, reason);
+}
+
+void Router::handle_punted_frames(tcb::span<const RxFrame> frames,
+                                  tcb::span<const PuntReason> reasons) {
+  rcu::ReadGuard guard;
+  rx_burst = frames;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const auto &[packet, interface, offload] = frames[i];
+    switch (reasons[i]) {
+    case PuntReason::FRAME:
+      dispatch_frame(packet, interface);
+      break;
+    case PuntReason::NO_ROUTE:
+      // Already allowed by the rate limits before being punted
+      if (auto view = Ipv4FrameView::parse(packet)) {
+        transmit_icmp_error(*view, interface, ICMP_TYPE_UNREACH,
+                            ICMP_CODE_UNREACH_NET);
+      }
+      break;
+    }
+  }
+  flush_tx_queues();
+}
 
-  interface_info info{ip, mac};
-  interface_ip_map_.try_emplace(interface, info);
-  LOG_DEBUG("Inserted interface-info pair: {} -> {{ ip: {:x}, mac: {:xpn} }}",
-            interface, info.ip, spdlog::to_hex(info.mac));
+void Router::send_no_route_error(Ipv4FrameView view, iface_t interface) {
+  // Checked before punting, so that the suppressed errors do not take the
+  // room of the other exception frames
+  if (allow_icmp_error(view.network_header()->source_addr, interface) &&
+      !punt(view.packet(), interface, PuntReason::NO_ROUTE)) {
+    transmit_icmp_error(view, interface, ICMP_TYPE_UNREACH,
+                        ICMP_CODE_UNREACH_NET);
+  }
+}
 
-  return info;
+bool Router::allow_icmp_error(uint64_t dest_key, iface_t interface) {
+  auto &counters = stats::interface(interface);
+  switch (icmp_limiter_.allow(dest_key)) {
+  case IcmpRateLimiter::Verdict::ALLOWED:
+    return true;
+  case IcmpRateLimiter::Verdict::SOURCE_LIMITED:
+    stats::add(counters.icmp_errors_limited_per_source);
+    return false;
+  case IcmpRateLimiter::Verdict::GLOBAL_LIMITED:
+    stats::add(counters.icmp_errors_limited_global);
+    return false;
+  }
+  return false;
 }
 
-void Router::handle_frame(tcb::span<std::byte> frame, iface_t interface) {
+void Router::dispatch_frame(PacketBuffer packet, iface_t interface) {
+  tcb::span<std::byte> frame = packet.frame();
   // Check if the packet is too small
   if (frame.size() < sizeof(ether_hdr)) {
     LOG_ERROR("Cannot read ethernet header. Packet too small");
+    stats::count_drop(interface, stats::DropReason::TRUNCATED);
     return;
   }
 
@@ -144,25 +623,289 @@ void Router::handle_frame(tcb::span<std::byte> frame, iface_t interface) {
   const ether_hdr *eth_hdr = reinterpret_cast<const ether_hdr *>(frame.data());
   uint16_t eth_type = util::ntoh(eth_hdr->ethr_type);
 
+  // Only the IPv4 packets to be forwarded are handled on the fast path
+  if (eth_type != ETHERTYPE_IP && punt(packet, interface, PuntReason::FRAME)) {
+    return;
+  }
+
   switch (eth_type) {
   case ETHERTYPE_ARP:
     handle_arp_packet(frame, interface);
     break;
   case ETHERTYPE_IP:
-    handle_ip_packet(frame, interface);
+    handle_ip_packet(packet, interface);
+    break;
+  case ETHERTYPE_IPV6:
+    handle_ipv6_packet(packet, interface);
     break;
   default:
     LOG_ERROR("Unknown ethernet type: {}", eth_type);
+    stats::count_drop(interface, stats::DropReason::UNKNOWN_ETHERTYPE);
     return;
   }
 }
 
+void Router::handle_burst(tcb::span<const RxFrame> burst) {
+  NO_ALLOC_SCOPE("handle_burst");
+  // Held around the whole burst, as in handle_frame
+  rcu::ReadGuard guard;
+  burst_forwards.clear();
+  rx_burst = burst;
+
+  // Stage 1: classify the frames from their headers, a chunk at a time, then
+  // handle each class in its own loop. The frames to be forwarded only have
+  // their checksum left to check, the others are handled right away.
+  for (size_t first = 0; first < burst.size();
+       first += BurstClasses::MAX_FRAMES) {
+    auto frames = burst.subspan(
+        first, std::min(BurstClasses::MAX_FRAMES, burst.size() - first));
+    BurstClasses classes;
+    {
+      PROFILE_SCOPE(PARSE);
+      classes = classify_burst(frames, local_addresses_);
+    }
+    for (const auto &frame : frames) {
+      count_rx(frame.packet.frame(), frame.interface);
+    }
+
+    for (uint64_t bits = classes.arp; bits; bits &= bits - 1) {
+      const auto &[packet, interface, offload] = frames[__builtin_ctzll(bits)];
+      dispatch_frame(packet, interface);
+    }
+    for (uint64_t bits = classes.local; bits; bits &= bits - 1) {
+      const auto &[packet, interface, offload] = frames[__builtin_ctzll(bits)];
+      handle_ip_header(packet, interface, offload);
+    }
+    // Anything unusual goes through all the checks
+    for (uint64_t bits = classes.other; bits; bits &= bits - 1) {
+      const auto &[packet, interface, offload] = frames[__builtin_ctzll(bits)];
+      tcb::span<std::byte> frame = packet.frame();
+      if (frame.size() < sizeof(ether_hdr) ||
+          util::ntoh(reinterpret_cast<const ether_hdr *>(frame.data())
+                         ->ethr_type) != ETHERTYPE_IP) {
+        dispatch_frame(packet, interface);
+        continue;
+      }
+
+      PROFILE_SCOPE(PARSE);
+      if (auto view = handle_ip_header(packet, interface, offload)) {
+        burst_forwards.push_back({.view = *view,
+                                   .in_interface = interface,
+                                   .adjacency = 0,
+                                   .out_interface = 0,
+                                   .offload = offload,
+                                   .done = false});
+      }
+    }
+
+    PROFILE_SCOPE(PARSE);
+    for (uint64_t bits = classes.forward; bits; bits &= bits - 1) {
+      const auto &[packet, interface, offload] = frames[__builtin_ctzll(bits)];
+      // Known to be long enough for the headers
+      auto view = *Ipv4FrameView::parse(packet);
+      auto *ip_hdr_p = view.network_header();
+      if (!verify_ip_checksum(ip_hdr_p, interface, offload)) {
+        continue;
+      }
+      decrement_ttl(ip_hdr_p);
+      burst_forwards.push_back({.view = view,
+                                 .in_interface = interface,
+                                 .adjacency = 0,
+                                 .out_interface = 0,
+                                 .offload = offload,
+                                 .done = false});
+    }
+  }
+
+  (this->*forward_burst_)();
+}
+
+/**
+ * Stages 2 to 4 of handle_burst, for the frames of burst_forwards. The
+ * optional stages (the ACL, the flow table, the route cache and the sampler)
+ * are compiled in or out by the bits of Stages, each configuration running
+ * its own specialization, without checking the stages it does not have for
+ * every frame.
+ */
+template <unsigned Stages> void Router::forward_burst() {
+  constexpr bool with_acl = (Stages & ACL_STAGE) != 0;
+  constexpr bool with_flows = (Stages & FLOW_STAGE) != 0;
+  constexpr bool with_route_cache = (Stages & ROUTE_CACHE_STAGE) != 0;
+  constexpr bool with_sampler = (Stages & SAMPLER_STAGE) != 0;
+
+  // The packets denied by the ACL are dropped before their lookup
+  if constexpr (with_acl) {
+    burst_forwards.erase(
+        std::remove_if(burst_forwards.begin(), burst_forwards.end(),
+                       [&](const BurstForward &fwd) {
+                         return !acl_permits(fwd.view, fwd.in_interface);
+                       }),
+        burst_forwards.end());
+  }
+
+  // Stage 2: find the adjacency of every forwarded packet. The destinations
+  // missing from the route cache are looked up as a single batch, which
+  // interleaves their lookups and shares one RCU read-side section. The
+  // stage is timed for the whole burst.
+  uint32_t now = util::coarse_now_ms();
+  auto select = [&](AdjacencyTable::index_t route, const Ipv4FrameView &view) {
+    if constexpr (with_flows) {
+      return select_path(route, view, now);
+    } else {
+      return hash_path(route, view);
+    }
+  };
+  if constexpr (with_flows) {
+    for (const auto &fwd : burst_forwards) {
+      flows_->prefetch(FlowKey::of(fwd.view.network_header(),
+                                   fwd.view.frame().size() -
+                                       Ipv4FrameView::NETWORK_OFFSET));
+    }
+  }
+  {
+    PROFILE_SCOPE(LPM_LOOKUP);
+    [[maybe_unused]] RouteCache *cache = nullptr;
+    [[maybe_unused]] uint64_t generation = 0;
+    if constexpr (with_route_cache) {
+      cache = worker_route_cache(route_cache_size_);
+      generation = rtable_.generation();
+    }
+
+    burst_misses.clear();
+    burst_dest_ips.clear();
+    for (size_t i = 0; i < burst_forwards.size(); ++i) {
+      auto &fwd = burst_forwards[i];
+      uint32_t dest_ip = fwd.view.network_header()->dest_addr;
+      if constexpr (with_route_cache) {
+        auto &counters = stats::interface(fwd.in_interface);
+        if (auto adjacency = cache->lookup(dest_ip, generation)) {
+          stats::add(counters.route_cache_hits);
+          fwd.adjacency = select(*adjacency, fwd.view);
+          fwd.out_interface = adjacencies_.interface(fwd.adjacency);
+          continue;
+        }
+        stats::add(counters.route_cache_misses);
+      }
+      burst_misses.push_back(i);
+      burst_dest_ips.push_back(dest_ip);
+    }
+
+    burst_adjacencies.resize(burst_dest_ips.size());
+    rtable_.lookup_batch(burst_dest_ips, burst_adjacencies);
+    for (size_t j = 0; j < burst_misses.size(); ++j) {
+      auto &fwd = burst_forwards[burst_misses[j]];
+      auto adjacency = burst_adjacencies[j];
+      if (!adjacency) {
+        fwd.done = true;
+        continue;
+      }
+      fwd.adjacency = select(*adjacency, fwd.view);
+      fwd.out_interface = adjacencies_.interface(fwd.adjacency);
+      if constexpr (with_route_cache) {
+        cache->insert(burst_dest_ips[j], *adjacency, generation);
+      }
+    }
+  }
+  for (auto &fwd : burst_forwards) {
+    if (fwd.done) {
+      LOG_ERROR("No matching route found. Dropping packet");
+      stats::count_drop(fwd.in_interface, stats::DropReason::NO_ROUTE);
+      send_no_route_error(fwd.view, fwd.in_interface);
+    }
+  }
+
+  // Stage 3: rewrite the ethernet headers from the adjacencies, sampling the
+  // frames with the header they were received with
+  for (auto &fwd : burst_forwards) {
+    if (!fwd.done) {
+      if constexpr (with_sampler) {
+        sample_packet(fwd.view, fwd.in_interface, fwd.adjacency);
+      }
+      fwd.done = !fits_mtu(fwd.view, fwd.in_interface, fwd.adjacency, now,
+                           fwd.offload) ||
+                 !rewrite_ether_header(fwd.view.frame(), fwd.adjacency, now,
+                                       fwd.offload);
+    }
+  }
+
+  // Stage 4: queue the frames on their output interface, and send the
+  // queues of all the interfaces at once
+  PROFILE_SCOPE(TRANSMIT);
+  for (auto &fwd : burst_forwards) {
+    if (!fwd.done) {
+      send_received_on_link(fwd.view.frame(), fwd.out_interface,
+                            fwd.offload);
+    }
+  }
+  flush_tx_queues();
+  if (slow_path_) {
+    slow_path_->notify();
+  }
+}
+
+template <size_t... Stages>
+constexpr std::array<Router::ForwardBurst, sizeof...(Stages)>
+Router::forward_burst_table(std::index_sequence<Stages...>) {
+  return {&Router::forward_burst<Stages>...};
+}
+
+void Router::select_burst_stages() {
+  static constexpr auto table =
+      forward_burst_table(std::make_index_sequence<ALL_BURST_STAGES + 1>{});
+  unsigned stages = (acl_ ? ACL_STAGE : 0) | (flows_ ? FLOW_STAGE : 0) |
+                    (route_cache_size_ ? ROUTE_CACHE_STAGE : 0) |
+                    (sampler_ ? SAMPLER_STAGE : 0);
+  forward_burst_ = table[stages];
+}
+
+/**
+ * Write the ethernet header of a frame sent to an adjacency, resolving the
+ * adjacency through the ARP cache if its prebuilt header cannot be used.
+ * Returns false if the frame has been queued for ARP resolution instead, or
+ * dropped if it is a super-frame, which cannot be queued without its offload
+ * metadata.
+ */
+bool Router::rewrite_ether_header(tcb::span<std::byte> frame,
+                                  AdjacencyTable::index_t adjacency,
+                                  uint32_t now,
+                                  const vnet_hdr *offload) {
+  if (adjacencies_.rewrite(adjacency, frame, now)) {
+    return true;
+  }
+
+  uint32_t next_hop_ip = adjacencies_.next_hop(adjacency);
+  iface_t interface = adjacencies_.interface(adjacency);
+  LOG_DEBUG("Next hop IP: {:x}, interface: {}", next_hop_ip, interface);
+
+  auto dest_mac_entry = lookup_arp_entry(next_hop_ip);
+  if (!dest_mac_entry) {
+    if (offload && !complete_offload(frame, *offload)) {
+      stats::count_drop(interface, stats::DropReason::ARP_QUEUE_FULL);
+      return false;
+    }
+    queue_pending_frame(frame, interface, next_hop_ip);
+    return false;
+  }
+  if (dest_mac_entry->refresh) {
+    send_arp_request(next_hop_ip, interface, dest_mac_entry->mac);
+  }
+
+  std::array<uint8_t, 6> source_mac = get_interface_mac(interface);
+  if (util::is_before(now, dest_mac_entry->refresh_at)) {
+    adjacencies_.update(adjacency, dest_mac_entry->mac, source_mac,
+                        ETHERTYPE_IP, dest_mac_entry->refresh_at);
+  }
+  write_ether_header(frame, source_mac, dest_mac_entry->mac, ETHERTYPE_IP);
+  return true;
+}
+
 void Router::handle_arp_packet(tcb::span<std::byte> frame, iface_t interface) {
   LOG_DEBUG("Handling ARP packet");
 
   // Check if the packet is too small
   if (frame.size() < ETHER_HDR_SIZE + ARP_HDR_SIZE) {
     LOG_ERROR("Cannot read ARP header. Packet too small");
+    stats::count_drop(interface, stats::DropReason::TRUNCATED);
     return;
   }
 
@@ -182,132 +925,335 @@ void Router::handle_arp_packet(tcb::span<std::byte> frame, iface_t interface) {
     break;
   default:
     LOG_ERROR("Unknown ARP opcode: {}", opcode);
+    stats::count_drop(interface, stats::DropReason::UNKNOWN_ARP_OPCODE);
     return;
   }
 }
-void Router::handle_ip_packet(tcb::span<std::byte> frame, iface_t interface) {
+void Router::handle_ip_packet(PacketBuffer packet, iface_t interface) {
+  std::optional<Ipv4FrameView> view;
+  {
+    PROFILE_SCOPE(PARSE);
+    view = handle_ip_header(packet, interface,
+                            received_offload(packet.frame()));
+  }
+  if (view && acl_permits(*view, interface)) {
+    handle_forward_ip_packet(*view, interface);
+  }
+}
+
+/**
+ * Check the IP header of a packet and handle it if it is not to be forwarded
+ * (dropped or destined to the router).
+ * Returns the view of the packet if it must be forwarded. In that case, its
+ * TTL has already been decremented and its checksum updated.
+ */
+std::optional<Ipv4FrameView>
+Router::handle_ip_header(PacketBuffer packet, iface_t interface,
+                         const vnet_hdr *offload) {
   LOG_DEBUG("Handling IP packet");
 
   // Check if the packet is too small
-  if (frame.size() < ETHER_HDR_SIZE + IP_HDR_SIZE) {
+  auto view = Ipv4FrameView::parse(packet);
+  if (!view) {
     LOG_ERROR("Cannot read IP header. Packet too small");
-    return;
+    stats::count_drop(interface, stats::DropReason::TRUNCATED);
+    return std::nullopt;
   }
 
-  // Extract the IP header
-  auto *ip_hdr_p = reinterpret_cast<struct ip_hdr *>(
-      frame.subspan(sizeof(ether_hdr)).data());
-  bool for_this_router = is_for_this_router(ip_hdr_p->dest_addr, interface);
+  auto *ip_hdr_p = view->network_header();
+  bool for_this_router = is_for_this_router(ip_hdr_p->dest_addr);
+
+  // The packets for the router and those whose TTL expired are answered by
+  // the slow path, when there is one
+  if ((for_this_router || ip_hdr_p->ttl <= 1) &&
+      punt(packet, interface, PuntReason::FRAME)) {
+    return std::nullopt;
+  }
 
   // If TTL reached 1 or 0, we need to drop it
   if (ip_hdr_p->ttl <= 1 && !for_this_router) {
     LOG_DEBUG("TTL reached 0. Dropping packet");
-    send_icmp_error(frame, interface, ICMP_TYPE_TIME_EXCEEDED,
+    stats::count_drop(interface, stats::DropReason::TTL_EXCEEDED);
+    send_icmp_error(*view, interface, ICMP_TYPE_TIME_EXCEEDED,
                     ICMP_CODE_TTL_EXCEEDED);
-    return;
+    return std::nullopt;
   }
 
-  // Recalculate the checksum
-  if (!is_checksum_valid(ip_hdr_p)) {
-    LOG_ERROR("Checksum error. Dropping packet");
-    return;
+  if (!verify_ip_checksum(ip_hdr_p, interface, offload)) {
+    return std::nullopt;
   }
 
   // Check if the packet is for this router
   if (for_this_router) {
-    handle_local_ip_packet(frame, interface);
-    return;
+    handle_local_ip_packet(*view, interface);
+    return std::nullopt;
   }
 
-  // Decrement the TTL
-  --ip_hdr_p->ttl;
+  // Decrement the TTL, updating the checksum incrementally
+  decrement_ttl(ip_hdr_p);
 
-  // Recalculate the checksum
-  recompute_checksum(ip_hdr_p, &ip_hdr::checksum);
+  return view;
+}
 
-  handle_forward_ip_packet(frame, interface);
+bool Router::verify_ip_checksum(struct ip_hdr *ip_hdr_p, iface_t interface,
+                                const vnet_hdr *offload) {
+  // Recalculate the checksum, unless it was already validated on the way in
+  bool checksum_valid = true;
+  auto &counters = stats::interface(interface);
+  if (offload && (offload->flags & (VNET_HDR_F_DATA_VALID |
+                                    VNET_HDR_F_NEEDS_CSUM))) {
+    stats::add(counters.rx_csum_offloaded);
+  } else {
+    PROFILE_SCOPE(CHECKSUM);
+    stats::add(counters.rx_csum_verified);
+    checksum_valid = is_checksum_valid(ip_hdr_p);
+  }
+  if (!checksum_valid) {
+    LOG_ERROR("Checksum error. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::BAD_CHECKSUM);
+  }
+  return checksum_valid;
 }
 
-void Router::handle_local_ip_packet(tcb::span<std::byte> frame,
-                                    iface_t interface) {
+void Router::handle_local_ip_packet(Ipv4FrameView view, iface_t interface) {
   LOG_DEBUG("Handling local IP packet");
 
-  // The frame size has already been checked in handle_ip_packet
-  // Extract the IP header
-  const auto *ip_hdr = reinterpret_cast<const struct ip_hdr *>(
-      frame.subspan(sizeof(ether_hdr)).data());
-
-  switch (uint8_t proto = ip_hdr->proto) {
+  switch ([[maybe_unused]] uint8_t proto = view.network_header()->proto) {
   case IP_PROTO_ICMP:
     LOG_DEBUG("ICMP packet");
-    handle_icmp_packet(frame, interface);
+    handle_icmp_packet(view, interface);
     break;
   default:
     LOG_ERROR("Unknown IP protocol: {}", proto);
+    stats::count_drop(interface, stats::DropReason::UNKNOWN_IP_PROTO);
     return;
   }
 }
 
-void Router::handle_forward_ip_packet(tcb::span<std::byte> frame,
-                                      iface_t interface) {
-  LOG_DEBUG("Handling forward IP packet");
+bool Router::acl_permits(const Ipv4FrameView &view,
+                         iface_t interface) const {
+  if (!acl_) {
+    return true;
+  }
+  PROFILE_SCOPE(ACL);
+  auto *ip_hdr_p = view.network_header();
+  if (acl_->permits(AclKey::of(ip_hdr_p, view.frame().size() -
+                                             Ipv4FrameView::NETWORK_OFFSET))) {
+    return true;
+  }
+  LOG_DEBUG("Packet denied by the ACL. Dropping packet");
+  stats::count_drop(interface, stats::DropReason::ACL_DENIED);
+  return false;
+}
 
-  // The frame size has already been checked in handle_ip_packet
-  // Extract the IP header
-  const auto *ip_hdr = reinterpret_cast<const struct ip_hdr *>(
-      frame.subspan(sizeof(ether_hdr)).data());
+void Router::handle_forward_ip_packet(Ipv4FrameView view, iface_t interface) {
+  LOG_DEBUG("Handling forward IP packet");
 
-  uint32_t dest_ip = ip_hdr->dest_addr;
+  uint32_t dest_ip = view.network_header()->dest_addr;
 
   LOG_DEBUG("Destination IP: {:x}", dest_ip);
-  auto next_hop = get_next_hop(dest_ip);
-  if (!next_hop) {
+  auto route = get_adjacency(dest_ip, interface);
+  if (!route) {
     LOG_ERROR("No matching route found. Dropping packet");
-    send_icmp_error(frame, interface, ICMP_TYPE_UNREACH, ICMP_CODE_UNREACH_NET);
+    stats::count_drop(interface, stats::DropReason::NO_ROUTE);
+    send_no_route_error(view, interface);
+    return;
+  }
+
+  uint32_t now = util::coarse_now_ms();
+  AdjacencyTable::index_t adjacency = select_path(*route, view, now);
+  sample_packet(view, interface, adjacency);
+  const vnet_hdr *offload = received_offload(view.frame());
+  if (fits_mtu(view, interface, adjacency, now, offload) &&
+      rewrite_ether_header(view.frame(), adjacency, now, offload)) {
+    PROFILE_SCOPE(TRANSMIT);
+    send_received_on_link(view.frame(), adjacencies_.interface(adjacency),
+                          offload);
+  }
+}
+
+bool Router::fits_mtu(const Ipv4FrameView &view, iface_t in_interface,
+                      AdjacencyTable::index_t adjacency, uint32_t now,
+                      const vnet_hdr *offload) {
+  uint16_t mtu = interface_info_[adjacencies_.interface(adjacency)].mtu;
+  size_t length = view.frame().size() - Ipv4FrameView::NETWORK_OFFSET;
+  bool segmented = offload && offload->gso_type != VNET_HDR_GSO_NONE;
+  if (segmented) {
+    // A super-frame leaves as segments of gso_size bytes after its headers
+    length = std::min<size_t>(
+        length, offload->hdr_len - Ipv4FrameView::NETWORK_OFFSET +
+                    offload->gso_size);
+  }
+  if (length <= mtu) {
+    return true;
+  }
+
+  auto *ip_hdr_p = view.network_header();
+  if ((util::ntoh(ip_hdr_p->frag) & IP_FLAG_DONT_FRAGMENT) || segmented) {
+    LOG_DEBUG("Packet longer than the MTU {}. Dropping packet", mtu);
+    stats::count_drop(in_interface, stats::DropReason::FRAGMENTATION_NEEDED);
+    send_icmp_error(view, in_interface, ICMP_TYPE_UNREACH,
+                    ICMP_CODE_UNREACH_FRAG_NEEDED, mtu);
+    return false;
+  }
+  if (offload && !complete_offload(view.frame(), *offload)) {
+    return false;
+  }
+  send_fragments(view, in_interface, adjacency, now);
+  return false;
+}
+
+/**
+ * Send a packet longer than the MTU of its output interface as fragments
+ * (RFC 791), built one at a time in a buffer of the worker: the first one
+ * keeps all the options, the others only those to be copied. A packet that
+ * is already a fragment is split further, its offset and More Fragments
+ * flag carried over.
+ */
+void Router::send_fragments(const Ipv4FrameView &view, iface_t in_interface,
+                            AdjacencyTable::index_t adjacency, uint32_t now) {
+  thread_local std::vector<std::byte> fragment;
+
+  tcb::span<std::byte> frame = view.frame();
+  auto *ip_hdr_p = view.network_header();
+  size_t header_size = size_t{ip_hdr_p->ihl} * 4;
+  size_t packet_size =
+      std::min<size_t>(util::ntoh(ip_hdr_p->tot_len),
+                       frame.size() - Ipv4FrameView::NETWORK_OFFSET);
+  if (header_size < IP_HDR_SIZE || header_size >= packet_size) {
+    stats::count_drop(in_interface, stats::DropReason::TRUNCATED);
     return;
   }
-  auto [next_hop_ip, next_hop_iface] = *next_hop;
-  LOG_DEBUG("Next hop IP: {:x}, interface: {}", next_hop_ip, next_hop_iface);
 
-  send_frame(frame, next_hop_iface, next_hop_ip, ETHERTYPE_IP);
+  iface_t interface = adjacencies_.interface(adjacency);
+  uint16_t mtu = interface_info_[interface].mtu;
+  auto header = frame.subspan(Ipv4FrameView::NETWORK_OFFSET, header_size);
+  auto payload = frame.subspan(Ipv4FrameView::NETWORK_OFFSET + header_size,
+                               packet_size - header_size);
+  uint16_t flags = util::ntoh(ip_hdr_p->frag);
+  fragment.resize(ETHER_HDR_SIZE + mtu);
+
+  size_t fragments = 0;
+  for (size_t offset = 0; offset < payload.size();) {
+    std::byte *out = fragment.data() + ETHER_HDR_SIZE;
+    size_t fragment_header_size = header_size;
+    if (offset == 0) {
+      std::memcpy(out, header.data(), header_size);
+    } else {
+      std::memcpy(out, header.data(), IP_HDR_SIZE);
+      fragment_header_size =
+          IP_HDR_SIZE + copy_fragment_options(header.subspan(IP_HDR_SIZE),
+                                              out + IP_HDR_SIZE);
+    }
+    // Every fragment but the last carries a multiple of 8 bytes
+    size_t size = std::min(payload.size() - offset,
+                           (mtu - fragment_header_size) & ~size_t{7});
+    bool last = offset + size == payload.size();
+    std::memcpy(out + fragment_header_size, payload.data() + offset, size);
+
+    auto *fragment_hdr = reinterpret_cast<struct ip_hdr *>(out);
+    fragment_hdr->ihl = static_cast<uint8_t>(fragment_header_size / 4);
+    fragment_hdr->tot_len =
+        util::hton(static_cast<uint16_t>(fragment_header_size + size));
+    uint16_t fragment_offset =
+        (flags & IP_FRAGMENT_OFFSET_MASK) + static_cast<uint16_t>(offset / 8);
+    bool more = !last || (flags & IP_FLAG_MORE_FRAGMENTS);
+    fragment_hdr->frag = util::hton(static_cast<uint16_t>(
+        (fragment_offset & IP_FRAGMENT_OFFSET_MASK) |
+        (more ? IP_FLAG_MORE_FRAGMENTS : 0)));
+    recompute_checksum(fragment_hdr, &ip_hdr::checksum, fragment_header_size);
+
+    auto fragment_frame = tcb::span<std::byte>(
+        fragment.data(), ETHER_HDR_SIZE + fragment_header_size + size);
+    if (rewrite_ether_header(fragment_frame, adjacency, now)) {
+      send_on_link(fragment_frame, interface);
+    }
+    ++fragments;
+    offset += size;
+  }
+
+  auto &counters = stats::interface(interface);
+  stats::add(counters.ip_fragmented);
+  stats::add(counters.ip_fragments_sent, fragments);
 }
 
 void Router::send_frame(tcb::span<std::byte> frame, iface_t interface,
                         uint32_t dest_ip, uint16_t eth_type) {
-  std::array<uint8_t, 6> source_mac = get_interface_mac(interface);
-  auto dest_mac_entry = arp_table_.lookup(dest_ip);
+  auto dest_mac_entry = lookup_arp_entry(dest_ip);
   if (!dest_mac_entry) {
-    LOG_DEBUG("No matching ARP entry found for IP: {:x}", dest_ip);
-    send_arp_request(dest_ip, interface);
-    // Cache the packet for later
-    arp_table_.add_pending_packet(
-        dest_ip,
-        {interface, std::vector<std::byte>(frame.begin(), frame.end())});
+    queue_pending_frame(frame, interface, dest_ip);
     return;
   }
-  auto dest_mac = dest_mac_entry->mac;
+  if (dest_mac_entry->refresh) {
+    send_arp_request(dest_ip, interface, dest_mac_entry->mac);
+  }
 
-  ether_hdr *eth_hdr = reinterpret_cast<ether_hdr *>(frame.data());
-  std::copy(source_mac.begin(), source_mac.end(),
-            std::begin(eth_hdr->ethr_shost));
-  std::copy(dest_mac.begin(), dest_mac.end(), std::begin(eth_hdr->ethr_dhost));
-  eth_hdr->ethr_type = util::hton(eth_type);
+  transmit_frame(frame, interface, dest_mac_entry->mac, eth_type);
+}
+
+void Router::queue_pending_frame(tcb::span<std::byte> frame, iface_t interface,
+                                 uint32_t dest_ip) {
+  LOG_DEBUG("No matching ARP entry found for IP: {:x}", dest_ip);
+  // Cache the packet for later
+  auto [result, send_request] =
+      arp_table_.add_pending_packet(dest_ip, interface, frame);
+  switch (result) {
+  case arp::PendingResult::RESOLVED:
+    // Another worker received the ARP reply in the meantime
+    send_frame(frame, interface, dest_ip, ETHERTYPE_IP);
+    return;
+  case arp::PendingResult::DROPPED:
+    LOG_DEBUG("ARP queue full for IP: {:x}. Dropping packet", dest_ip);
+    break;
+  case arp::PendingResult::QUEUED:
+    break;
+  }
+
+  // Only send a request if none is in flight for this next hop
+  if (send_request) {
+    send_arp_request(dest_ip, interface);
+  }
+}
+
+void Router::transmit_frame(tcb::span<std::byte> frame, iface_t interface,
+                            const std::array<uint8_t, 6> &dest_mac,
+                            uint16_t eth_type) {
+  PROFILE_SCOPE(TRANSMIT);
+  write_ether_header(frame, get_interface_mac(interface), dest_mac, eth_type);
 
   // Send the frame
   LOG_DEBUG("Sending frame to interface {}: {:xpn}", interface,
             spdlog::to_hex(dest_mac));
-  send_to_link(frame.size(), reinterpret_cast<char *>(frame.data()), interface);
+  send_on_link(frame, interface);
 }
 
 void Router::send_arp_request(uint32_t dest_ip, iface_t interface) {
-  auto [source_ip, source_mac] = get_interface_info(interface);
+  uint32_t source_ip = get_interface_ip(interface);
+  std::array<uint8_t, 6> source_mac = get_interface_mac(interface);
 
   LOG_DEBUG("Sending ARP request to {:x} on interface {} with MAC {:xpn}",
             dest_ip, interface, spdlog::to_hex(source_mac));
 
   auto frame =
       generate_arp_frame(ARP_OPCODE_REQUEST, source_ip, source_mac, dest_ip);
-  send_to_link(frame.size(), reinterpret_cast<char *>(frame.data()), interface);
+  send_on_link(frame, interface);
+  stats::add(stats::interface(interface).arp_requests_sent);
+}
+
+void Router::send_arp_request(uint32_t dest_ip, iface_t interface,
+                              const std::array<uint8_t, 6> &dest_mac) {
+  uint32_t source_ip = get_interface_ip(interface);
+  std::array<uint8_t, 6> source_mac = get_interface_mac(interface);
+
+  // Unicast request, used to refresh an entry that is about to expire
+  // without disturbing the other hosts of the link
+  LOG_DEBUG("Refreshing ARP entry of {:x} on interface {} with MAC {:xpn}",
+            dest_ip, interface, spdlog::to_hex(dest_mac));
+
+  auto frame = generate_arp_frame(ARP_OPCODE_REQUEST, source_ip, source_mac,
+                                  dest_ip, dest_mac);
+  send_on_link(frame, interface);
+  stats::add(stats::interface(interface).arp_requests_sent);
 }
 
 void Router::handle_arp_reply(tcb::span<std::byte> frame, iface_t interface) {
@@ -330,18 +1276,28 @@ void Router::handle_arp_reply(tcb::span<std::byte> frame, iface_t interface) {
   LOG_DEBUG("Stored ARP entry: {:x} -> {:xpn}", sender_ip,
             spdlog::to_hex(sender_mac));
 
-  // Handle any pending packets for this IP address
-  auto pending_pkts = arp_table_.retrieve_pending_packets(sender_ip);
-  if (!pending_pkts) {
-    LOG_DEBUG("No pending packets for IP: {:x}", sender_ip);
-    return;
+  // The adjacencies of the next hop are updated right away, rather than once
+  // their header goes stale, in case its MAC address changed. The offload
+  // picks them up on its next scan.
+  if (auto entry = lookup_arp_entry(sender_ip);
+      entry && util::is_before(util::coarse_now_ms(), entry->refresh_at)) {
+    std::array<std::array<uint8_t, 6>, ROUTER_NUM_INTERFACES> source_macs;
+    for (iface_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+      source_macs[i] = get_interface_mac(i);
+    }
+    adjacencies_.update_next_hop(sender_ip, entry->mac, source_macs,
+                                 ETHERTYPE_IP, entry->refresh_at);
   }
 
-  for (const auto &pending_pkt : *pending_pkts) {
-    auto [iface, pkt] = pending_pkt;
-    LOG_DEBUG("Sending pending packet to interface {}: {:xpn}", iface,
-              spdlog::to_hex(sender_mac));
-    send_frame(pkt, iface, sender_ip, ETHERTYPE_IP);
+  // Handle any pending packets for this IP address
+  size_t pending_count = arp_table_.flush_pending_packets(
+      sender_ip, [&](iface_t iface, tcb::span<std::byte> pkt) {
+        LOG_DEBUG("Sending pending packet to interface {}: {:xpn}", iface,
+                  spdlog::to_hex(sender_mac));
+        send_frame(pkt, iface, sender_ip, ETHERTYPE_IP);
+      });
+  if (pending_count == 0) {
+    LOG_DEBUG("No pending packets for IP: {:x}", sender_ip);
   }
 }
 
@@ -368,120 +1324,632 @@ void Router::handle_arp_request(tcb::span<std::byte> frame, iface_t interface) {
 
 void Router::send_arp_reply(uint32_t dest_ip, iface_t interface,
                             const std::array<uint8_t, 6> &dest_mac) {
-  auto [source_ip, source_mac] = get_interface_info(interface);
+  uint32_t source_ip = get_interface_ip(interface);
+  std::array<uint8_t, 6> source_mac = get_interface_mac(interface);
 
   LOG_DEBUG("Sending ARP reply to {:x} on interface {} with MAC {:xpn}",
             dest_ip, interface, spdlog::to_hex(source_mac));
 
   auto frame = generate_arp_frame(ARP_OPCODE_REPLY, source_ip, source_mac,
                                   dest_ip, dest_mac);
-  send_to_link(frame.size(), reinterpret_cast<char *>(frame.data()), interface);
+  send_on_link(frame, interface);
+}
+
+void Router::send_icmp_error(Ipv4FrameView view, iface_t interface,
+                             uint8_t type, uint8_t code,
+                             uint16_t next_hop_mtu) {
+  if (allow_icmp_error(view.network_header()->source_addr, interface)) {
+    transmit_icmp_error(view, interface, type, code, next_hop_mtu);
+  }
 }
 
-void Router::send_icmp_error(tcb::span<std::byte> frame, iface_t interface,
-                             uint8_t type, uint8_t code) {
+void Router::transmit_icmp_error(Ipv4FrameView view, iface_t interface,
+                                 uint8_t type, uint8_t code,
+                                 uint16_t next_hop_mtu) {
   LOG_DEBUG("Sending ICMP error: type {}, code {}", type, code);
 
-  std::vector<std::byte> new_frame_buffer{};
-  tcb::span<std::byte> icmp_frame{};
-  size_t icmp_frame_size = ETHER_HDR_SIZE + 2 * IP_HDR_SIZE + ICMP_HDR_SIZE + 8;
-
-  // Check if the current frame is large enough to modify in place
-  if (frame.size() < icmp_frame_size) {
-    new_frame_buffer.resize(icmp_frame_size);
-    icmp_frame = tcb::span(new_frame_buffer.data(), icmp_frame_size);
-    // Copy the original IP header and the first 8 bytes of the payload
-    auto old_ip_hdr_payload =
-        frame.subspan(ETHER_HDR_SIZE,
-                      std::min(frame.size() - ETHER_HDR_SIZE, IP_HDR_SIZE + 8));
-    std::copy(old_ip_hdr_payload.begin(), old_ip_hdr_payload.end(),
-              icmp_frame.subspan(ETHER_HDR_SIZE).begin());
+  // The error quotes the IP header and the first 8 bytes of the payload of
+  // the original packet, right after the new IP and ICMP headers
+  constexpr size_t QUOTED_SIZE = IP_HDR_SIZE + 8;
+  constexpr size_t PREPENDED_SIZE = IP_HDR_SIZE + ICMP_HDR_SIZE;
+  constexpr size_t ICMP_FRAME_SIZE =
+      ETHER_HDR_SIZE + PREPENDED_SIZE + QUOTED_SIZE;
+  // Used when there is not enough room around the original frame, e.g. for
+  // the frames received in the PACKET_MMAP rings
+  alignas(16) thread_local std::array<std::byte, ICMP_FRAME_SIZE>
+      fallback_buffer;
+
+  PacketBuffer packet = view.packet();
+  size_t quoted_size = std::min(packet.size() - ETHER_HDR_SIZE, QUOTED_SIZE);
+  if (packet.headroom() >= PREPENDED_SIZE &&
+      packet.size() + packet.tailroom() + PREPENDED_SIZE >= ICMP_FRAME_SIZE) {
+    // The new headers take the place of the original ethernet header, so the
+    // quoted data is already where it belongs
+    packet.push(PREPENDED_SIZE);
+    packet.resize(ICMP_FRAME_SIZE);
   } else {
-    icmp_frame = frame.subspan(0, icmp_frame_size);
+    auto quoted = packet.frame().subspan(ETHER_HDR_SIZE, quoted_size);
+    packet = PacketBuffer(fallback_buffer.data(), fallback_buffer.size());
+    std::copy(quoted.begin(), quoted.end(),
+              fallback_buffer.begin() + ETHER_HDR_SIZE + PREPENDED_SIZE);
   }
+  tcb::span<std::byte> icmp_frame = packet.frame();
+  // Pad the quoted data if the original packet was shorter
+  std::fill(icmp_frame.begin() + ETHER_HDR_SIZE + PREPENDED_SIZE + quoted_size,
+            icmp_frame.end(), std::byte{0});
 
+  const auto *quoted_ip_hdr = reinterpret_cast<const struct ip_hdr *>(
+      icmp_frame.subspan(ETHER_HDR_SIZE + PREPENDED_SIZE).data());
   auto *ip_hdr = reinterpret_cast<struct ip_hdr *>(
       icmp_frame.subspan(ETHER_HDR_SIZE).data());
   auto *icmp_hdr = reinterpret_cast<struct icmp_hdr *>(
       icmp_frame.subspan(ETHER_HDR_SIZE + IP_HDR_SIZE).data());
 
-  uint32_t dest_ip = ip_hdr->source_addr;
-  uint32_t source_ip = get_interface_ip(interface);
-
-  // Copy the old IP header and 64 bits of the old payload to the payload of the
-  // icmp packet
-  {
-    auto icmp_payload = icmp_frame.subspan(ETHER_HDR_SIZE, IP_HDR_SIZE + 8);
-    std::copy(icmp_payload.begin(), icmp_payload.end(),
-              icmp_frame.subspan(ETHER_HDR_SIZE + IP_HDR_SIZE + ICMP_HDR_SIZE)
-                  .data());
-  }
-
-  ip_hdr->dest_addr = dest_ip;
-  ip_hdr->source_addr = source_ip;
-  ip_hdr->proto = IP_PROTO_ICMP;
-  ip_hdr->ttl = IP_DEFAULT_TTL;
-  ip_hdr->tot_len =
-      util::hton(static_cast<uint16_t>(icmp_frame.size() - ETHER_HDR_SIZE));
+  uint32_t dest_ip = quoted_ip_hdr->source_addr;
+  *ip_hdr = {.ihl = 5,
+             .ver = 4,
+             .tos = 0,
+             .tot_len = util::hton(
+                 static_cast<uint16_t>(icmp_frame.size() - ETHER_HDR_SIZE)),
+             .id = quoted_ip_hdr->id,
+             .frag = 0,
+             .ttl = IP_DEFAULT_TTL,
+             .proto = IP_PROTO_ICMP,
+             .checksum = 0,
+             .source_addr = get_interface_ip(interface),
+             .dest_addr = dest_ip};
   recompute_checksum(ip_hdr, &ip_hdr::checksum);
 
   icmp_hdr->mcode = code;
   icmp_hdr->mtype = type;
   std::memset(&icmp_hdr->un_t, 0, sizeof(icmp_hdr->un_t));
+  icmp_hdr->un_t.frag_t.mtu = util::hton(next_hop_mtu);
   recompute_checksum(icmp_hdr, &icmp_hdr::check,
                      icmp_frame.size() - ETHER_HDR_SIZE - IP_HDR_SIZE);
 
+  stats::add(stats::interface(interface).icmp_errors_sent);
   send_frame(icmp_frame, interface, dest_ip, ETHERTYPE_IP);
 }
 
-void Router::handle_icmp_packet(tcb::span<std::byte> frame, iface_t interface) {
+void Router::handle_icmp_packet(Ipv4FrameView view, iface_t interface) {
   LOG_DEBUG("Handling ICMP packet");
 
   // Check if the packet is too small
-  if (frame.size() < ETHER_HDR_SIZE + IP_HDR_SIZE + ICMP_HDR_SIZE) {
+  auto *icmp_hdr = view.payload_header<struct icmp_hdr>();
+  if (!icmp_hdr) {
     LOG_ERROR("Cannot read ICMP header. Packet too small");
+    stats::count_drop(interface, stats::DropReason::TRUNCATED);
     return;
   }
 
-  // Extract the ICMP header
-  auto *icmp_hdr = reinterpret_cast<struct icmp_hdr *>(
-      frame.subspan(ETHER_HDR_SIZE + IP_HDR_SIZE).data());
-
-  switch (uint8_t type = icmp_hdr->mtype) {
+  switch ([[maybe_unused]] uint8_t type = icmp_hdr->mtype) {
   case ICMP_TYPE_ECHO_REQUEST:
     LOG_DEBUG("ICMP echo request");
-    send_icmp_echo_reply(frame, interface);
+    send_icmp_echo_reply(view, icmp_hdr, interface);
     break;
   default:
     LOG_ERROR("Received unsupported ICMP type: {}", type);
+    stats::count_drop(interface, stats::DropReason::UNSUPPORTED_ICMP_TYPE);
     return;
   }
 }
 
-void Router::send_icmp_echo_reply(tcb::span<std::byte> frame,
+void Router::send_icmp_echo_reply(Ipv4FrameView view,
+                                  struct icmp_hdr *icmp_hdr,
                                   iface_t interface) {
   LOG_DEBUG("Sending ICMP echo reply");
 
-  // Extract the ICMP header
-  auto *icmp_hdr = reinterpret_cast<struct icmp_hdr *>(
-      frame.subspan(ETHER_HDR_SIZE + IP_HDR_SIZE).data());
-
-  // Swap the source and destination IP addresses
-  auto *ip_hdr =
-      reinterpret_cast<struct ip_hdr *>(frame.subspan(ETHER_HDR_SIZE).data());
+  // Swap the source and destination IP addresses, which leaves the checksum
+  // unchanged, and reset the TTL, updating the checksum incrementally
+  auto *ip_hdr = view.network_header();
   std::swap(ip_hdr->source_addr, ip_hdr->dest_addr);
+  uint16_t old_word = static_cast<uint16_t>((ip_hdr->ttl << 8) | ip_hdr->proto);
   ip_hdr->ttl = IP_DEFAULT_TTL;
-  recompute_checksum(ip_hdr, &ip_hdr::checksum);
+  uint16_t new_word = static_cast<uint16_t>((ip_hdr->ttl << 8) | ip_hdr->proto);
+  ip_hdr->checksum = util::hton(
+      update_checksum(util::ntoh(ip_hdr->checksum), old_word, new_word));
 
+  // The type and code share the first word of the ICMP header
+  old_word = static_cast<uint16_t>((icmp_hdr->mtype << 8) | icmp_hdr->mcode);
   icmp_hdr->mtype = ICMP_TYPE_ECHO_REPLY;
   icmp_hdr->mcode = ICMP_CODE_ECHO_REPLY;
+  new_word = static_cast<uint16_t>((icmp_hdr->mtype << 8) | icmp_hdr->mcode);
+  icmp_hdr->check = util::hton(
+      update_checksum(util::ntoh(icmp_hdr->check), old_word, new_word));
+
+  // Reflect the frame to the neighbor it came from, without an ARP lookup, so
+  // that a reply never waits for a resolution. The route back to a sender
+  // that is not on-link is assumed to go through the same neighbor.
+  auto *eth_hdr = reinterpret_cast<ether_hdr *>(view.frame().data());
+  std::array<uint8_t, 6> sender_mac;
+  std::copy(std::begin(eth_hdr->ethr_shost), std::end(eth_hdr->ethr_shost),
+            sender_mac.begin());
+  PROFILE_SCOPE(TRANSMIT);
+  write_ether_header(view.frame(), get_interface_mac(interface), sender_mac,
+                     ETHERTYPE_IP);
+  send_on_link(view.frame(), interface);
+}
 
-  // Recalculate the checksum
-  recompute_checksum(ip_hdr, &ip_hdr::checksum);
-  recompute_checksum(icmp_hdr, &icmp_hdr::check,
-                     frame.size() - ETHER_HDR_SIZE - IP_HDR_SIZE);
+bool Router::is_for_this_router(const Ipv6Address &dest_ip,
+                                iface_t interface) const {
+  if (ipv6::is_multicast(dest_ip)) {
+    // The groups joined on each interface: all the nodes, all the routers,
+    // and the solicited-node groups of its addresses
+    const auto &info = get_interface_info(interface);
+    return dest_ip == ipv6::ALL_NODES || dest_ip == ipv6::ALL_ROUTERS ||
+           dest_ip == ipv6::solicited_node(info.ipv6_link_local) ||
+           (!ipv6::is_unspecified(info.ipv6_global) &&
+            dest_ip == ipv6::solicited_node(info.ipv6_global));
+  }
+  for (iface_t other = 0; other < interface_info_.size(); ++other) {
+    if (is_interface_address(dest_ip, other)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Router::handle_ipv6_packet(PacketBuffer packet, iface_t interface) {
+  std::optional<Ipv6FrameView> view;
+  {
+    PROFILE_SCOPE(PARSE);
+    view = handle_ipv6_header(packet, interface);
+  }
+  if (view) {
+    handle_forward_ipv6_packet(*view, interface);
+  }
+}
 
-  send_frame(frame, interface, ip_hdr->dest_addr, ETHERTYPE_IP);
+/**
+ * Check the IPv6 header of a packet and handle it if it is not to be
+ * forwarded, as handle_ip_header does for IPv4.
+ * Returns the view of the packet if it must be forwarded. In that case, its
+ * hop limit has already been decremented (there is no header checksum to
+ * update).
+ */
+std::optional<Ipv6FrameView> Router::handle_ipv6_header(PacketBuffer packet,
+                                                        iface_t interface) {
+  LOG_DEBUG("Handling IPv6 packet");
+
+  // Check if the packet is too small
+  auto view = Ipv6FrameView::parse(packet);
+  if (!view) {
+    LOG_ERROR("Cannot read IPv6 header. Packet too small");
+    stats::count_drop(interface, stats::DropReason::TRUNCATED);
+    return std::nullopt;
+  }
+
+  auto *ip_hdr = view->network_header();
+  if (util::ntoh(ip_hdr->ver_tc_flow) >> 28 != IPV6_VERSION ||
+      util::ntoh(ip_hdr->payload_len) > view->payload().size() ||
+      ipv6::is_multicast(ip_hdr->source_addr)) {
+    LOG_ERROR("Invalid IPv6 header. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::BAD_IPV6_HEADER);
+    return std::nullopt;
+  }
+
+  if (is_for_this_router(ip_hdr->dest_addr, interface)) {
+    handle_local_ipv6_packet(*view, interface);
+    return std::nullopt;
+  }
+
+  // The router neither routes multicast nor lets the link-local addresses
+  // leave their link
+  if (ipv6::is_multicast(ip_hdr->dest_addr)) {
+    LOG_DEBUG("Multicast IPv6 packet not for this router. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::NO_ROUTE);
+    return std::nullopt;
+  }
+  if (ipv6::is_link_local(ip_hdr->dest_addr) ||
+      ipv6::is_link_local(ip_hdr->source_addr)) {
+    LOG_DEBUG("Link-local IPv6 packet not for this router. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::NO_ROUTE);
+    send_icmpv6_error(*view, interface, ICMPV6_TYPE_UNREACH,
+                      ICMPV6_CODE_UNREACH_BEYOND_SCOPE);
+    return std::nullopt;
+  }
+
+  if (ip_hdr->hop_limit <= 1) {
+    LOG_DEBUG("Hop limit reached 0. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::TTL_EXCEEDED);
+    send_icmpv6_error(*view, interface, ICMPV6_TYPE_TIME_EXCEEDED,
+                      ICMPV6_CODE_HOP_LIMIT_EXCEEDED);
+    return std::nullopt;
+  }
+
+  --ip_hdr->hop_limit;
+  return view;
+}
+
+void Router::handle_local_ipv6_packet(Ipv6FrameView view, iface_t interface) {
+  LOG_DEBUG("Handling local IPv6 packet");
+
+  // The extension headers are not supported, so ICMPv6 must come right after
+  // the IPv6 header
+  switch ([[maybe_unused]] uint8_t next_header =
+              view.network_header()->next_header) {
+  case IPV6_NEXT_HEADER_ICMPV6:
+    LOG_DEBUG("ICMPv6 packet");
+    handle_icmpv6_packet(view, interface);
+    break;
+  default:
+    LOG_ERROR("Unknown IPv6 next header: {}", next_header);
+    stats::count_drop(interface, stats::DropReason::UNKNOWN_IP_PROTO);
+    return;
+  }
+}
+
+void Router::handle_forward_ipv6_packet(Ipv6FrameView view,
+                                        iface_t interface) {
+  LOG_DEBUG("Handling forward IPv6 packet");
+
+  std::optional<Ipv6RoutingTable::NextHop> next_hop;
+  {
+    PROFILE_SCOPE(LPM_LOOKUP);
+    next_hop = rtable6_.lookup(view.network_header()->dest_addr);
+  }
+  if (!next_hop) {
+    LOG_ERROR("No matching IPv6 route found. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::NO_ROUTE);
+    send_icmpv6_error(view, interface, ICMPV6_TYPE_UNREACH,
+                      ICMPV6_CODE_UNREACH_NO_ROUTE);
+    return;
+  }
+
+  send_ipv6_frame(view.frame(), next_hop->interface, next_hop->address);
+}
+
+/**
+ * Send a packet originated by the router (ICMPv6 reply or error), routing it
+ * to its destination. The link-local destinations are on the link the packet
+ * that prompted it came from.
+ */
+void Router::send_ipv6_packet(tcb::span<std::byte> frame,
+                              iface_t in_interface) {
+  const auto *ip_hdr = reinterpret_cast<const struct ipv6_hdr *>(
+      frame.subspan(ETHER_HDR_SIZE).data());
+  Ipv6Address dest_ip = ip_hdr->dest_addr;
+
+  if (ipv6::is_link_local(dest_ip)) {
+    send_ipv6_frame(frame, in_interface, dest_ip);
+    return;
+  }
+  auto next_hop = rtable6_.lookup(dest_ip);
+  if (!next_hop) {
+    LOG_DEBUG("No IPv6 route back to the destination. Dropping packet");
+    return;
+  }
+  send_ipv6_frame(frame, next_hop->interface, next_hop->address);
+}
+
+void Router::send_ipv6_frame(tcb::span<std::byte> frame, iface_t interface,
+                             const Ipv6Address &neighbor) {
+  std::optional<arp::ArpLookup> dest_mac_entry;
+  {
+    PROFILE_SCOPE(ARP_LOOKUP);
+    dest_mac_entry = ndp_table_.lookup(neighbor);
+  }
+  if (!dest_mac_entry) {
+    queue_pending_ipv6_frame(frame, interface, neighbor);
+    return;
+  }
+  if (dest_mac_entry->refresh) {
+    send_neighbor_solicit(neighbor, interface, &dest_mac_entry->mac);
+  }
+
+  transmit_frame(frame, interface, dest_mac_entry->mac, ETHERTYPE_IPV6);
+}
+
+void Router::queue_pending_ipv6_frame(tcb::span<std::byte> frame,
+                                      iface_t interface,
+                                      const Ipv6Address &neighbor) {
+  LOG_DEBUG("No matching neighbor entry found");
+  auto [result, send_request] =
+      ndp_table_.add_pending_packet(neighbor, interface, frame);
+  switch (result) {
+  case arp::PendingResult::RESOLVED:
+    send_ipv6_frame(frame, interface, neighbor);
+    return;
+  case arp::PendingResult::DROPPED:
+    LOG_DEBUG("Neighbor queue full. Dropping packet");
+    break;
+  case arp::PendingResult::QUEUED:
+    break;
+  }
+
+  if (send_request) {
+    send_neighbor_solicit(neighbor, interface);
+  }
+}
+
+void Router::handle_icmpv6_packet(Ipv6FrameView view, iface_t interface) {
+  LOG_DEBUG("Handling ICMPv6 packet");
+
+  // The ethernet padding of the short frames is not part of the message. The
+  // payload length has already been checked against the frame size in
+  // handle_ipv6_header.
+  const auto *ip_hdr = view.network_header();
+  size_t length = util::ntoh(ip_hdr->payload_len);
+  view.truncate_payload(length);
+  auto *icmp_hdr = view.payload_header<struct icmpv6_hdr>();
+  if (!icmp_hdr) {
+    LOG_ERROR("Cannot read ICMPv6 header. Packet too small");
+    stats::count_drop(interface, stats::DropReason::TRUNCATED);
+    return;
+  }
+
+  bool checksum_valid;
+  {
+    PROFILE_SCOPE(CHECKSUM);
+    checksum_valid = ipv6::icmpv6_checksum(ip_hdr, icmp_hdr, length) == 0;
+  }
+  if (!checksum_valid) {
+    LOG_ERROR("ICMPv6 checksum error. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::BAD_CHECKSUM);
+    return;
+  }
+
+  switch ([[maybe_unused]] uint8_t type = icmp_hdr->type) {
+  case ICMPV6_TYPE_ECHO_REQUEST:
+    LOG_DEBUG("ICMPv6 echo request");
+    send_icmpv6_echo_reply(view, icmp_hdr, interface);
+    break;
+  case ICMPV6_TYPE_NEIGHBOR_SOLICIT:
+    LOG_DEBUG("Neighbor solicitation");
+    handle_neighbor_solicit(view, interface);
+    break;
+  case ICMPV6_TYPE_NEIGHBOR_ADVERT:
+    LOG_DEBUG("Neighbor advertisement");
+    handle_neighbor_advert(view, interface);
+    break;
+  default:
+    LOG_ERROR("Received unsupported ICMPv6 type: {}", type);
+    stats::count_drop(interface, stats::DropReason::UNSUPPORTED_ICMP_TYPE);
+    return;
+  }
+}
+
+void Router::send_icmpv6_echo_reply(Ipv6FrameView view,
+                                    struct icmpv6_hdr *icmp_hdr,
+                                    iface_t interface) {
+  LOG_DEBUG("Sending ICMPv6 echo reply");
+
+  auto *ip_hdr = view.network_header();
+
+  // The reply to a request sent to a multicast group comes from an address
+  // of the interface
+  Ipv6Address source_ip = ip_hdr->dest_addr;
+  ip_hdr->dest_addr = ip_hdr->source_addr;
+  ip_hdr->source_addr = ipv6::is_multicast(source_ip)
+                            ? ipv6_source_address(interface, ip_hdr->dest_addr)
+                            : source_ip;
+  ip_hdr->hop_limit = IPV6_DEFAULT_HOP_LIMIT;
+
+  // The pseudo-header may have changed with the source, so the checksum is
+  // computed again instead of being updated
+  icmp_hdr->type = ICMPV6_TYPE_ECHO_REPLY;
+  icmp_hdr->checksum = 0;
+  icmp_hdr->checksum = util::hton(
+      ipv6::icmpv6_checksum(ip_hdr, icmp_hdr, view.payload().size()));
+
+  send_ipv6_packet(view.frame(), interface);
+}
+
+void Router::send_icmpv6_error(Ipv6FrameView view, iface_t interface,
+                               uint8_t type, uint8_t code) {
+  LOG_DEBUG("Sending ICMPv6 error: type {}, code {}", type, code);
+
+  // The error quotes as much of the original packet as fits in the minimum
+  // MTU, right after the new IPv6 and ICMPv6 headers (RFC 4443)
+  constexpr size_t PREPENDED_SIZE = IPV6_HDR_SIZE + ICMPV6_HDR_SIZE;
+  constexpr size_t MAX_QUOTED_SIZE = IPV6_MIN_MTU - PREPENDED_SIZE;
+  alignas(16) thread_local std::array<std::byte, ETHER_HDR_SIZE + IPV6_MIN_MTU>
+      fallback_buffer;
+
+  // No error is sent about an ICMPv6 error, nor to a source that does not
+  // identify a single node
+  const auto *original = view.network_header();
+  auto payload = view.payload();
+  if (ipv6::is_unspecified(original->source_addr) ||
+      (original->next_header == IPV6_NEXT_HEADER_ICMPV6 && !payload.empty() &&
+       static_cast<uint8_t>(payload[0]) < ICMPV6_TYPE_ECHO_REQUEST)) {
+    return;
+  }
+  if (!allow_icmp_error(fold_address(original->source_addr), interface)) {
+    return;
+  }
+
+  PacketBuffer packet = view.packet();
+  size_t quoted_size =
+      std::min(packet.size() - ETHER_HDR_SIZE, MAX_QUOTED_SIZE);
+  size_t frame_size = ETHER_HDR_SIZE + PREPENDED_SIZE + quoted_size;
+  if (packet.headroom() >= PREPENDED_SIZE) {
+    // As for IPv4, the new headers take the place of the original ethernet
+    // header, and the quoted data is cut to the minimum MTU
+    packet.push(PREPENDED_SIZE);
+    packet.resize(frame_size);
+  } else {
+    auto quoted = packet.frame().subspan(ETHER_HDR_SIZE, quoted_size);
+    std::copy(quoted.begin(), quoted.end(),
+              fallback_buffer.begin() + ETHER_HDR_SIZE + PREPENDED_SIZE);
+    packet = PacketBuffer(fallback_buffer.data(), frame_size);
+  }
+  tcb::span<std::byte> icmp_frame = packet.frame();
+
+  const auto *quoted_ip_hdr = reinterpret_cast<const struct ipv6_hdr *>(
+      icmp_frame.subspan(ETHER_HDR_SIZE + PREPENDED_SIZE).data());
+  auto *ip_hdr = reinterpret_cast<struct ipv6_hdr *>(
+      icmp_frame.subspan(ETHER_HDR_SIZE).data());
+  auto *icmp_hdr = reinterpret_cast<struct icmpv6_hdr *>(
+      icmp_frame.subspan(ETHER_HDR_SIZE + IPV6_HDR_SIZE).data());
+
+  Ipv6Address dest_ip = quoted_ip_hdr->source_addr;
+  write_ipv6_header(ip_hdr, ipv6_source_address(interface, dest_ip), dest_ip,
+                    ICMPV6_HDR_SIZE + quoted_size, IPV6_DEFAULT_HOP_LIMIT);
+  *icmp_hdr = {.type = type, .code = code, .checksum = 0, .data = 0};
+  icmp_hdr->checksum = util::hton(
+      ipv6::icmpv6_checksum(ip_hdr, icmp_hdr, ICMPV6_HDR_SIZE + quoted_size));
+
+  stats::add(stats::interface(interface).icmp_errors_sent);
+  send_ipv6_packet(icmp_frame, interface);
+}
+
+void Router::send_neighbor_solicit(const Ipv6Address &target,
+                                   iface_t interface,
+                                   const std::array<uint8_t, 6> *dest_mac) {
+  constexpr size_t LENGTH = ND_MSG_SIZE + ND_OPTION_LLADDR_SIZE;
+  std::array<std::byte, ETHER_HDR_SIZE + IPV6_HDR_SIZE + LENGTH> frame{};
+  const auto &info = get_interface_info(interface);
+
+  // Multicast to the solicited-node group of the target, or unicast to
+  // refresh an entry that is about to expire
+  Ipv6Address dest_ip = dest_mac ? target : ipv6::solicited_node(target);
+  LOG_DEBUG("Sending neighbor solicitation on interface {}", interface);
+
+  auto *ip_hdr =
+      reinterpret_cast<struct ipv6_hdr *>(frame.data() + ETHER_HDR_SIZE);
+  auto *icmp_hdr = reinterpret_cast<struct icmpv6_hdr *>(
+      frame.data() + ETHER_HDR_SIZE + IPV6_HDR_SIZE);
+  auto *msg = reinterpret_cast<struct nd_msg *>(
+      frame.data() + ETHER_HDR_SIZE + IPV6_HDR_SIZE + ICMPV6_HDR_SIZE);
+  auto *option = reinterpret_cast<struct nd_lladdr_option *>(
+      frame.data() + ETHER_HDR_SIZE + IPV6_HDR_SIZE + ND_MSG_SIZE);
+
+  write_ipv6_header(ip_hdr, info.ipv6_link_local, dest_ip, LENGTH,
+                    ND_HOP_LIMIT);
+  icmp_hdr->type = ICMPV6_TYPE_NEIGHBOR_SOLICIT;
+  msg->target = target;
+  option->type = ND_OPTION_SOURCE_LLADDR;
+  option->length = ND_OPTION_LLADDR_SIZE / 8;
+  std::copy(info.mac.begin(), info.mac.end(), std::begin(option->mac));
+  icmp_hdr->checksum =
+      util::hton(ipv6::icmpv6_checksum(ip_hdr, icmp_hdr, LENGTH));
+
+  write_ether_header(frame, info.mac,
+                     dest_mac ? *dest_mac : ipv6::multicast_mac(dest_ip),
+                     ETHERTYPE_IPV6);
+  send_on_link(frame, interface);
+  stats::add(stats::interface(interface).neighbor_solicitations_sent);
+}
+
+void Router::send_neighbor_advert(const Ipv6Address &target,
+                                  const Ipv6Address &dest_ip,
+                                  iface_t interface,
+                                  const std::array<uint8_t, 6> &dest_mac,
+                                  bool solicited) {
+  constexpr size_t LENGTH = ND_MSG_SIZE + ND_OPTION_LLADDR_SIZE;
+  std::array<std::byte, ETHER_HDR_SIZE + IPV6_HDR_SIZE + LENGTH> frame{};
+  const auto &info = get_interface_info(interface);
+  LOG_DEBUG("Sending neighbor advertisement on interface {}", interface);
+
+  auto *ip_hdr =
+      reinterpret_cast<struct ipv6_hdr *>(frame.data() + ETHER_HDR_SIZE);
+  auto *icmp_hdr = reinterpret_cast<struct icmpv6_hdr *>(
+      frame.data() + ETHER_HDR_SIZE + IPV6_HDR_SIZE);
+  auto *msg = reinterpret_cast<struct nd_msg *>(
+      frame.data() + ETHER_HDR_SIZE + IPV6_HDR_SIZE + ICMPV6_HDR_SIZE);
+  auto *option = reinterpret_cast<struct nd_lladdr_option *>(
+      frame.data() + ETHER_HDR_SIZE + IPV6_HDR_SIZE + ND_MSG_SIZE);
+
+  write_ipv6_header(ip_hdr, target, dest_ip, LENGTH, ND_HOP_LIMIT);
+  icmp_hdr->type = ICMPV6_TYPE_NEIGHBOR_ADVERT;
+  icmp_hdr->data = util::hton(ND_ADVERT_ROUTER | ND_ADVERT_OVERRIDE |
+                              (solicited ? ND_ADVERT_SOLICITED : 0));
+  msg->target = target;
+  option->type = ND_OPTION_TARGET_LLADDR;
+  option->length = ND_OPTION_LLADDR_SIZE / 8;
+  std::copy(info.mac.begin(), info.mac.end(), std::begin(option->mac));
+  icmp_hdr->checksum =
+      util::hton(ipv6::icmpv6_checksum(ip_hdr, icmp_hdr, LENGTH));
+
+  write_ether_header(frame, info.mac, dest_mac, ETHERTYPE_IPV6);
+  send_on_link(frame, interface);
+}
+
+void Router::handle_neighbor_solicit(Ipv6FrameView view, iface_t interface) {
+  const auto *eth_hdr = view.ether_header();
+  const auto *ip_hdr = view.network_header();
+  auto message = view.payload();
+
+  // The messages that may have been forwarded are not trusted (RFC 4861)
+  std::optional<std::array<uint8_t, 6>> source_mac;
+  if (message.size() < ND_MSG_SIZE || ip_hdr->hop_limit != ND_HOP_LIMIT ||
+      !find_lladdr_option(message.subspan(ND_MSG_SIZE),
+                          ND_OPTION_SOURCE_LLADDR, source_mac)) {
+    LOG_ERROR("Invalid neighbor solicitation. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::BAD_IPV6_HEADER);
+    return;
+  }
+
+  const auto *msg =
+      reinterpret_cast<const struct nd_msg *>(message.data() + ICMPV6_HDR_SIZE);
+  Ipv6Address target = msg->target;
+  if (!is_interface_address(target, interface)) {
+    LOG_DEBUG("Neighbor solicitation not for this router. Ignoring");
+    return;
+  }
+
+  // Duplicate address detection probes come from the unspecified address,
+  // and are answered to all the nodes
+  Ipv6Address source_ip = ip_hdr->source_addr;
+  if (ipv6::is_unspecified(source_ip)) {
+    send_neighbor_advert(target, ipv6::ALL_NODES, interface,
+                         ipv6::multicast_mac(ipv6::ALL_NODES), false);
+    return;
+  }
+
+  std::array<uint8_t, 6> dest_mac{};
+  std::copy(std::begin(eth_hdr->ethr_shost), std::end(eth_hdr->ethr_shost),
+            dest_mac.begin());
+  if (source_mac) {
+    // The solicitation tells the address of its sender, which is about to
+    // be needed to reach it
+    dest_mac = *source_mac;
+    ndp_table_.add_entry({.ip = source_ip, .mac = dest_mac});
+    ndp_table_.flush_pending_packets(
+        source_ip, [&](iface_t iface, tcb::span<std::byte> pkt) {
+          send_ipv6_frame(pkt, iface, source_ip);
+        });
+  }
+  send_neighbor_advert(target, source_ip, interface, dest_mac, true);
+}
+
+void Router::handle_neighbor_advert(Ipv6FrameView view, iface_t interface) {
+  const auto *ip_hdr = view.network_header();
+  auto message = view.payload();
+
+  std::optional<std::array<uint8_t, 6>> target_mac;
+  if (message.size() < ND_MSG_SIZE || ip_hdr->hop_limit != ND_HOP_LIMIT ||
+      !find_lladdr_option(message.subspan(ND_MSG_SIZE),
+                          ND_OPTION_TARGET_LLADDR, target_mac)) {
+    LOG_ERROR("Invalid neighbor advertisement. Dropping packet");
+    stats::count_drop(interface, stats::DropReason::BAD_IPV6_HEADER);
+    return;
+  }
+  // The advertisements without the target address are only sent to confirm
+  // an entry the sender knows to be current, which is not tracked here
+  if (!target_mac) {
+    LOG_DEBUG("Neighbor advertisement without link-layer address. Ignoring");
+    return;
+  }
+
+  const auto *msg =
+      reinterpret_cast<const struct nd_msg *>(message.data() + ICMPV6_HDR_SIZE);
+  Ipv6Address target = msg->target;
+  if (ipv6::is_multicast(target)) {
+    LOG_ERROR("Neighbor advertisement for a multicast address. Dropping");
+    stats::count_drop(interface, stats::DropReason::BAD_IPV6_HEADER);
+    return;
+  }
+
+  ndp_table_.add_entry({.ip = target, .mac = *target_mac});
+  size_t pending_count = ndp_table_.flush_pending_packets(
+      target, [&](iface_t iface, tcb::span<std::byte> pkt) {
+        send_ipv6_frame(pkt, iface, target);
+      });
+  if (pending_count == 0) {
+    LOG_DEBUG("No pending packets for the advertised neighbor");
+  }
 }
 
 } // namespace router
\ No newline at end of file
@@ -1,18 +1,75 @@
 #pragma once
 
+#include "acl.hpp"
+#include "adjacency-table.hpp"
 #include "arp-table.hpp"
 #include "common.hpp"
+#include "egress-qos.hpp"
+#include "fib-sync.hpp"
+#include "flow-table.hpp"
+#include "frame-view.hpp"
+#include "icmp-rate-limiter.hpp"
+#include "ipv6-routing-table.hpp"
+#include "ipv6.hpp"
 #include "lib_wrapper.hpp"
+#include "link-backend.hpp"
+#include "packet-buffer.hpp"
+#include "packet-sampler.hpp"
+#include "profiler.hpp"
 #include "routing-table.hpp"
+#include "rtable-loader.hpp"
+#include "slow-path.hpp"
 #include "span.hpp"
+#include "tx-queue.hpp"
 #include "util.hpp"
+#include "xdp-offload.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
-#include <unordered_map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 namespace router {
 
+/**
+ * @brief The router, shared by all the RX workers.
+ * Once the routing table has been filled, `handle_frame` and `handle_burst`
+ * can be called concurrently from multiple threads: the interface addresses
+ * are read-only, the routing tables are updated with RCU, and the neighbor
+ * caches (ARP and NDP) and the adjacencies are synchronized.
+ *
+ * IPv6 is forwarded along IPv4, with its own routing table. Every interface
+ * has a link-local address derived from its MAC address, and optionally a
+ * global one (see `add_ipv6_address`); the IPv6 neighbors are resolved with
+ * Neighbor Discovery instead of ARP.
+ */
 class Router {
 public:
+  /**
+   * @brief Create the router. The interfaces must already be initialized, as
+   * their addresses are read once here, from the link backend the frames are
+   * sent through.
+   *
+   * @param route_cache_size Number of entries of the route cache of each
+   * worker, rounded up to a power of two (0 disables the cache)
+   * @param tx_flush_deadline Longest time a frame waits in the TX queue of its
+   * interface while the rest of its burst is handled
+   * @param icmp_limits The rate limits of the ICMP and ICMPv6 errors sent by
+   * the router (the echo replies are not limited)
+   * @param link The link backend, which must outlive the router
+   */
+  explicit Router(
+      RoutingTable::Backend rtable_backend = RoutingTable::Backend::MULTIBIT_TRIE,
+      arp::ArpTable::Config arp_config = {}, size_t route_cache_size = 0,
+      std::chrono::microseconds tx_flush_deadline =
+          TxQueues::DEFAULT_FLUSH_DEADLINE,
+      const IcmpRateLimits &icmp_limits = IcmpRateLimits{},
+      LinkBackend &link = default_link_backend());
+
   void add_rtable_entry(RoutingTable::RoutingTableEntry entry) {
     rtable_.add_entry(entry);
   }
@@ -22,46 +79,425 @@ public:
     rtable_.add_entries(entries);
   }
 
-  void handle_frame(tcb::span<std::byte> frame, iface_t interface);
+  void
+  remove_rtable_entries(tcb::span<const RoutingTable::RoutingTableEntry> entries) {
+    rtable_.remove_entries(entries);
+  }
+
+  /**
+   * @brief Replace the whole routing table. Safe to call while frames are
+   * being handled, which keep being forwarded with the old routes until the
+   * new ones are published.
+   */
+  void replace_rtable_entries(
+      tcb::span<const RoutingTable::RoutingTableEntry> entries) {
+    rtable_.replace_entries(entries);
+    // The routes mirrored from the kernel were replaced too
+    if (fib_sync_) {
+      fib_sync_->resync();
+    }
+  }
+
+  void add_ipv6_rtable_entries(
+      tcb::span<const Ipv6RoutingTable::RoutingTableEntry> entries) {
+    rtable6_.add_entries(entries);
+  }
+
+  /**
+   * @brief Replace the whole IPv6 routing table, like
+   * `replace_rtable_entries`.
+   */
+  void replace_ipv6_rtable_entries(
+      tcb::span<const Ipv6RoutingTable::RoutingTableEntry> entries) {
+    rtable6_.replace_entries(entries);
+  }
+
+  /**
+   * @brief Give a global IPv6 address to an interface, besides its link-local
+   * one. The interface addresses are read-only once frames are handled, so
+   * this must be called before.
+   *
+   * @throws std::out_of_range if the interface does not exist
+   */
+  void add_ipv6_address(iface_t interface, const Ipv6Address &address) {
+    interface_info_.at(interface).ipv6_global = address;
+  }
+
+  /**
+   * @brief Fill the routing table from a snapshot of the routes of
+   * `source_path` (see load_rtable_snapshot), before any route is added.
+   *
+   * @return false, leaving the routing table empty, if the snapshot cannot be
+   * used
+   */
+  bool load_rtable_snapshot(const char *source_path,
+                            const char *snapshot_path) {
+    return router::load_rtable_snapshot(rtable_, source_path, snapshot_path);
+  }
+
+  /**
+   * @brief Get the statistics of the routing table, when its backend is the
+   * binary trie (see RoutingTable::trie_stats).
+   */
+  std::optional<trie::TrieStats<32>> rtable_trie_stats() const {
+    return rtable_.trie_stats();
+  }
+
+  /**
+   * @brief Hand the exception frames (ARP, IPv6, packets for the router,
+   * expired TTLs, packets without a route) to a slow path thread from now on,
+   * so that only the IPv4 packets to be forwarded are handled by the callers
+   * of `handle_frame` and `handle_burst`. Must be called before frames are
+   * handled.
+   *
+   * @param ring_size The number of frames that can wait for the slow path, per
+   * RX thread, a power of two
+   */
+  void start_slow_path(size_t ring_size = SlowPath::DEFAULT_RING_SIZE);
+
+  /**
+   * @brief Forward the plain IPv4 packets with an XDP program from now on
+   * (see XdpOffload), the routing table and the resolved adjacencies being
+   * mirrored in its maps. The other frames keep reaching the router.
+   *
+   * @param generic Attach the program in generic (SKB) mode
+   *
+   * @throws std::runtime_error if the program cannot be loaded or attached
+   */
+  void start_xdp_offload(bool generic = false);
+
+  /**
+   * @brief Sample the forwarded IPv4 packets from now on, exporting them to
+   * an sFlow collector (see PacketSampler). Must be called before frames are
+   * handled.
+   *
+   * @param config The sampling rate and the collector. Without an agent
+   * address, the address of the first interface is used.
+   *
+   * @throws std::invalid_argument, std::runtime_error as PacketSampler
+   */
+  void start_sampler(SamplerConfig config);
+
+  /**
+   * @brief Filter the IPv4 packets to be forwarded with an ingress ACL from
+   * now on (see Acl), the packets denied being dropped before their route is
+   * looked up. The packets for the router are not filtered. Must be called
+   * before frames are handled.
+   */
+  void set_acl(tcb::span<const AclRule> rules) {
+    acl_ = std::make_unique<const Acl>(rules);
+    select_burst_stages();
+  }
+
+  /**
+   * @brief Track the forwarded IPv4 flows from now on (see FlowTable): every
+   * flow counts its packets and bytes, and stays pinned to the path it was
+   * first sent on while that path remains one of its route, so that adding
+   * or removing a path of an equal-cost route only moves the flows of the
+   * paths removed. Must be called before frames are handled.
+   *
+   * @throws std::invalid_argument as FlowTable
+   */
+  void start_flow_tracking(const FlowTableConfig &config) {
+    flows_ = std::make_unique<FlowTable>(config);
+    select_burst_stages();
+  }
+
+  const FlowTable *flow_table() const { return flows_.get(); }
+
+  /**
+   * @brief Queue the frames sent on every interface by traffic class from now
+   * on, with strict priority and deficit round robin scheduling, and shape
+   * them if the configuration has a rate (see EgressScheduler). Each worker
+   * schedules and shapes its own frames. Must be called before frames are
+   * handled.
+   */
+  void set_egress_qos(const EgressQosConfig &config) {
+    egress_qos_ = std::make_unique<const EgressQosConfig>(config);
+  }
+
+  /**
+   * @brief Mirror the IPv4 routes of a kernel routing table into the routing
+   * table from now on (see FibSync), next to the routes given to the router.
+   * Must be called before the routes are changed from other threads.
+   *
+   * @throws std::runtime_error as FibSync
+   */
+  void start_fib_sync(const FibSyncConfig &config);
+
+  /**
+   * @brief Add static entries to the ARP table, such as a neighbor table
+   * saved before a restart (see load_arp_table). They are never expired nor
+   * refreshed, and the ARP replies do not change them.
+   */
+  void add_static_neighbors(tcb::span<const arp::ArpTableEntry> entries) {
+    for (const auto &entry : entries) {
+      arp_table_.add_static_entry(entry);
+    }
+  }
+
+  // The neighbors learned so far, to be saved for a warm restart
+  NeighborState neighbor_state() const {
+    return {arp_table_.dynamic_entries(), ndp_table_.dynamic_entries()};
+  }
+
+  /**
+   * @brief Restore the neighbors saved by a previous run of the router (see
+   * load_neighbor_state), so that it forwards without resolving them again.
+   * They are used as they are while they are revalidated: the first packet
+   * towards each of them triggers a unicast request, and the ones that do
+   * not answer expire shortly after.
+   */
+  void restore_neighbor_state(const NeighborState &state) {
+    for (const auto &entry : state.ipv4) {
+      arp_table_.add_stale_entry(entry);
+    }
+    for (const auto &entry : state.ipv6) {
+      ndp_table_.add_stale_entry(entry);
+    }
+  }
+
+  /**
+   * @brief Resolve the next hops of the routes ahead of the traffic from now
+   * on: an ARP request is sent for every next hop missing from the ARP table
+   * right away, then whenever a new version of the routing table is
+   * published, so that the first packets of a route do not wait for a
+   * resolution. Must be called once the links are set up.
+   */
+  void start_next_hop_resolution();
+
+  /**
+   * @brief Handle a received frame. The ICMP messages sent in response are
+   * built in place, in the room around the frame when there is enough.
+   * The frames sent are queued on their output interface and transmitted
+   * before returning.
+   */
+  void handle_frame(PacketBuffer packet, iface_t interface);
+
+  /**
+   * @brief Handle a burst of received frames.
+   * The IPv4 frames to be forwarded go through the pipeline one stage at a
+   * time for the whole burst (header checks, route lookup, ARP resolution,
+   * transmission), while all the other frames are handled as in
+   * `handle_frame`. All the frames sent while handling the burst are
+   * transmitted in batches, with one system call per output interface.
+   * The received frames must stay valid until the call returns.
+   *
+   * @param burst The received frames
+   */
+  void handle_burst(tcb::span<const RxFrame> burst);
 
 private:
-  // Packet handlers
+  // Packet handlers. Past the header checks, the IP packets are passed around
+  // as views whose headers are known to be in bounds.
+  void dispatch_frame(PacketBuffer packet, iface_t interface);
   void handle_arp_packet(tcb::span<std::byte> frame, iface_t interface);
-  void handle_ip_packet(tcb::span<std::byte> frame, iface_t interface);
-  void handle_local_ip_packet(tcb::span<std::byte> frame, iface_t interface);
-  void handle_forward_ip_packet(tcb::span<std::byte> frame, iface_t interface);
+  void handle_ip_packet(PacketBuffer packet, iface_t interface);
+  std::optional<Ipv4FrameView>
+  handle_ip_header(PacketBuffer packet, iface_t interface,
+                   const vnet_hdr *offload = nullptr);
+  // Drops the packet if its header checksum is wrong, unless it was
+  // validated on the way in
+  bool verify_ip_checksum(struct ip_hdr *ip_hdr_p, iface_t interface,
+                          const vnet_hdr *offload);
+  void handle_local_ip_packet(Ipv4FrameView view, iface_t interface);
+  void handle_forward_ip_packet(Ipv4FrameView view, iface_t interface);
+  // Whether the ingress ACL, if any, lets the packet through, counting the
+  // packets denied
+  bool acl_permits(const Ipv4FrameView &view, iface_t interface) const;
+  void send_no_route_error(Ipv4FrameView view, iface_t interface);
+  // Whether a forwarded packet fits the MTU of the interface of its adjacency.
+  // The longer ones are handled here: answered with an ICMP "fragmentation
+  // needed" if they have Don't Fragment set, fragmented otherwise.
+  bool fits_mtu(const Ipv4FrameView &view, iface_t in_interface,
+                AdjacencyTable::index_t adjacency, uint32_t now,
+                const vnet_hdr *offload);
+  void send_fragments(const Ipv4FrameView &view, iface_t in_interface,
+                      AdjacencyTable::index_t adjacency, uint32_t now);
   void send_frame(tcb::span<std::byte> frame, iface_t interface,
                   uint32_t dest_ip, uint16_t eth_type);
+  bool rewrite_ether_header(tcb::span<std::byte> frame,
+                            AdjacencyTable::index_t adjacency, uint32_t now,
+                            const vnet_hdr *offload = nullptr);
+  void transmit_frame(tcb::span<std::byte> frame, iface_t interface,
+                      const std::array<uint8_t, 6> &dest_mac,
+                      uint16_t eth_type);
+  void queue_pending_frame(tcb::span<std::byte> frame, iface_t interface,
+                           uint32_t dest_ip);
   void send_arp_request(uint32_t dest_ip, iface_t interface);
+  void send_arp_request(uint32_t dest_ip, iface_t interface,
+                        const std::array<uint8_t, 6> &dest_mac);
   void send_arp_reply(uint32_t dest_ip, iface_t interface,
                       const std::array<uint8_t, 6> &dest_mac);
   void handle_arp_reply(tcb::span<std::byte> frame, iface_t interface);
   void handle_arp_request(tcb::span<std::byte> frame, iface_t interface);
-  void handle_icmp_packet(tcb::span<std::byte> frame, iface_t interface);
-  void send_icmp_error(tcb::span<std::byte> frame, iface_t interface,
-                       uint8_t type, uint8_t code);
-  void send_icmp_echo_reply(tcb::span<std::byte> frame, iface_t interface);
+  void handle_icmp_packet(Ipv4FrameView view, iface_t interface);
+  // The next hop MTU is only set for the "fragmentation needed" errors
+  void send_icmp_error(Ipv4FrameView view, iface_t interface, uint8_t type,
+                       uint8_t code, uint16_t next_hop_mtu = 0);
+  // Build and send an ICMP error already allowed by the rate limits
+  void transmit_icmp_error(Ipv4FrameView view, iface_t interface, uint8_t type,
+                           uint8_t code, uint16_t next_hop_mtu = 0);
+  void send_icmp_echo_reply(Ipv4FrameView view, struct icmp_hdr *icmp_hdr,
+                            iface_t interface);
+
+  // IPv6 handlers
+  void handle_ipv6_packet(PacketBuffer packet, iface_t interface);
+  std::optional<Ipv6FrameView> handle_ipv6_header(PacketBuffer packet,
+                                                  iface_t interface);
+  void handle_local_ipv6_packet(Ipv6FrameView view, iface_t interface);
+  void handle_forward_ipv6_packet(Ipv6FrameView view, iface_t interface);
+  void send_ipv6_packet(tcb::span<std::byte> frame, iface_t in_interface);
+  void send_ipv6_frame(tcb::span<std::byte> frame, iface_t interface,
+                       const Ipv6Address &neighbor);
+  void queue_pending_ipv6_frame(tcb::span<std::byte> frame, iface_t interface,
+                                const Ipv6Address &neighbor);
+  void handle_icmpv6_packet(Ipv6FrameView view, iface_t interface);
+  void send_icmpv6_error(Ipv6FrameView view, iface_t interface, uint8_t type,
+                         uint8_t code);
+  void send_icmpv6_echo_reply(Ipv6FrameView view,
+                              struct icmpv6_hdr *icmp_hdr, iface_t interface);
+  void handle_neighbor_solicit(Ipv6FrameView view, iface_t interface);
+  void handle_neighbor_advert(Ipv6FrameView view, iface_t interface);
+  void send_neighbor_solicit(const Ipv6Address &target, iface_t interface,
+                             const std::array<uint8_t, 6> *dest_mac = nullptr);
+  void send_neighbor_advert(const Ipv6Address &target,
+                            const Ipv6Address &dest_ip, iface_t interface,
+                            const std::array<uint8_t, 6> &dest_mac,
+                            bool solicited);
 
   struct interface_info {
     uint32_t ip;
+    // UINT16_MAX if the link backend does not know it
+    uint16_t mtu;
     std::array<uint8_t, 6> mac;
+    Ipv6Address ipv6_link_local;
+    // The unspecified address if the interface has none
+    Ipv6Address ipv6_global;
   };
   // Helper functions
-  interface_info get_interface_info(iface_t interface);
-  uint32_t get_interface_ip(iface_t interface) {
+  void count_rx(tcb::span<const std::byte> frame, iface_t interface);
+  void count_tx(tcb::span<const std::byte> frame, iface_t interface);
+  // Queue a frame on its output interface, copying it unless it lies in the
+  // buffer of a received frame of the current burst
+  void send_on_link(tcb::span<std::byte> frame, iface_t interface);
+  // Queue a frame known to be in its receive buffer, without copying it,
+  // along with the offload metadata it is forwarded with, if any
+  void send_received_on_link(tcb::span<std::byte> frame, iface_t interface,
+                             const vnet_hdr *offload = nullptr);
+  // Send the frames queued while handling the current burst
+  void flush_tx_queues();
+  // Take a token of the ICMP rate limits for an error to `dest_key` (an IPv4
+  // address, or a hash of an IPv6 one), counting the error as suppressed if
+  // there is none
+  bool allow_icmp_error(uint64_t dest_key, iface_t interface);
+  // Hand a frame to the slow path, returning false if it is to be handled
+  // right away (no slow path, or called from the slow path itself)
+  bool punt(PacketBuffer packet, iface_t interface, PuntReason reason);
+  // Send an ARP request for the next hops of the prefixes that are not
+  // resolved
+  void resolve_next_hops(tcb::span<const RoutingTable::Prefix> prefixes);
+  void handle_punted_frames(tcb::span<const RxFrame> frames,
+                            tcb::span<const PuntReason> reasons);
+  const interface_info &get_interface_info(iface_t interface) const {
+    return interface_info_[interface];
+  }
+  uint32_t get_interface_ip(iface_t interface) const {
     return get_interface_info(interface).ip;
   }
-  std::array<uint8_t, 6> get_interface_mac(iface_t interface) {
+  std::array<uint8_t, 6> get_interface_mac(iface_t interface) const {
     return get_interface_info(interface).mac;
   }
-  bool is_for_this_router(uint32_t dest_ip, iface_t interface) {
-    return (dest_ip == get_interface_ip(interface));
+  // Whether the address is one of the addresses of the router, whichever
+  // interface the packet was received on
+  bool is_for_this_router(uint32_t dest_ip) const {
+    // The addresses are packed together, so the scan stays in one cache line
+    return std::find(local_addresses_.begin(), local_addresses_.end(),
+                     dest_ip) != local_addresses_.end();
+  }
+  // Whether the address is one of the IPv6 addresses of the router, or a
+  // multicast group it listens to on the interface
+  bool is_for_this_router(const Ipv6Address &dest_ip, iface_t interface) const;
+  // Whether the address is one of the IPv6 addresses of the interface
+  bool is_interface_address(const Ipv6Address &address,
+                            iface_t interface) const {
+    const auto &info = get_interface_info(interface);
+    return address == info.ipv6_link_local ||
+           (address == info.ipv6_global && !ipv6::is_unspecified(address));
+  }
+  // The address the router sends its own packets to `dest_ip` from: the
+  // global address of the interface, unless the destination is link-local or
+  // the interface has none
+  const Ipv6Address &ipv6_source_address(iface_t interface,
+                                         const Ipv6Address &dest_ip) const {
+    const auto &info = get_interface_info(interface);
+    if (ipv6::is_link_local(dest_ip) || ipv6::is_unspecified(info.ipv6_global)) {
+      return info.ipv6_link_local;
+    }
+    return info.ipv6_global;
+  }
+  std::optional<AdjacencyTable::index_t> get_adjacency(uint32_t dest_ip,
+                                                       iface_t interface) const;
+  // Hand a forwarded frame to the sampler, if it is sampled
+  void sample_packet(const Ipv4FrameView &view, iface_t interface,
+                     AdjacencyTable::index_t adjacency);
+  // The adjacency of a frame among the paths of its route (see
+  // AdjacencyTable::select), or the one its flow is pinned to if the flows
+  // are tracked
+  AdjacencyTable::index_t select_path(AdjacencyTable::index_t route,
+                                      const Ipv4FrameView &view, uint32_t now);
+  // The adjacency of a frame among the paths of its route, from the hash of
+  // its flow alone
+  AdjacencyTable::index_t hash_path(AdjacencyTable::index_t route,
+                                    const Ipv4FrameView &view) const;
+
+  // The optional stages of handle_burst, each configuration of the router
+  // forwarding its bursts with the specialization of forward_burst made for
+  // it, without checking the stages it does not have for every packet
+  enum BurstStage : unsigned {
+    ACL_STAGE = 1u << 0,
+    FLOW_STAGE = 1u << 1,
+    ROUTE_CACHE_STAGE = 1u << 2,
+    SAMPLER_STAGE = 1u << 3,
+    ALL_BURST_STAGES = (1u << 4) - 1,
+  };
+  using ForwardBurst = void (Router::*)();
+  template <unsigned Stages> void forward_burst();
+  template <size_t... Stages>
+  static constexpr std::array<ForwardBurst, sizeof...(Stages)>
+      forward_burst_table(std::index_sequence<Stages...>);
+  // Point forward_burst_ to the specialization of the stages configured
+  void select_burst_stages();
+  // Whether an adjacency is one of the paths of a route
+  bool is_path_of(AdjacencyTable::index_t route,
+                  AdjacencyTable::index_t adjacency) const;
+  std::optional<arp::ArpLookup> lookup_arp_entry(uint32_t ip) const {
+    PROFILE_SCOPE(ARP_LOOKUP);
+    return arp_table_.lookup(ip);
   }
-  std::optional<std::pair<uint32_t, iface_t>> get_next_hop(uint32_t dest_ip);
 
-  RoutingTable rtable_{};
-  arp::ArpTable arp_table_{};
-  std::unordered_map<iface_t, interface_info> interface_ip_map_{};
+  AdjacencyTable adjacencies_{};
+  RoutingTable rtable_;
+  arp::ArpTable arp_table_;
+  Ipv6RoutingTable rtable6_{};
+  arp::NdpTable ndp_table_;
+  std::array<interface_info, ROUTER_NUM_INTERFACES> interface_info_{};
+  std::array<uint32_t, ROUTER_NUM_INTERFACES> local_addresses_{};
+  size_t route_cache_size_;
+  std::chrono::microseconds tx_flush_deadline_;
+  LinkBackend &link_;
+  IcmpRateLimiter icmp_limiter_;
+  std::unique_ptr<const Acl> acl_;
+  std::unique_ptr<FlowTable> flows_;
+  ForwardBurst forward_burst_ = nullptr;
+  std::unique_ptr<const EgressQosConfig> egress_qos_;
+  // Destroyed first, stopping the slow path thread before the tables it uses
+  std::unique_ptr<SlowPath> slow_path_;
+  std::unique_ptr<PacketSampler> sampler_;
+  // Destroyed before the tables it mirrors
+  std::unique_ptr<XdpOffload> xdp_offload_;
+  // Destroyed first, as it updates the routing table and so its observers
+  std::unique_ptr<FibSync> fib_sync_;
 };
 
 } // namespace router
\ No newline at end of file
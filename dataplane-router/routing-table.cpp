@@ -1,16 +1,297 @@
 #include "routing-table.hpp"
 
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <unordered_set>
+
 namespace router {
-void RoutingTable::add_entries(tcb::span<const RoutingTableEntry> entries) {
-  for (const auto &entry : entries) {
-    add_entry(entry);
+
+namespace {
+
+// An adjacency as written in a snapshot
+struct SavedAdjacency {
+  uint32_t next_hop;
+  iface_t interface;
+};
+
+// A next hop group as written in a snapshot
+struct SavedGroup {
+  uint32_t size;
+  std::array<AdjacencyTable::index_t, AdjacencyTable::MAX_PATHS> paths;
+};
+
+using Prefix = RoutingTable::Prefix;
+
+bool same_prefix(const Prefix &a, const Prefix &b) {
+  return a.path == b.path && a.prefix_len == b.prefix_len;
+}
+
+} // namespace
+
+RoutingTable::RoutingTable(AdjacencyTable &adjacencies, Backend backend)
+    : adjacencies_(adjacencies), backend_(backend),
+      lpm_(make_lpm(backend).release()) {}
+
+RoutingTable::~RoutingTable() { delete lpm_.load(); }
+
+std::unique_ptr<RoutingTable::Lpm> RoutingTable::make_lpm(Backend backend) {
+  switch (backend) {
+  case Backend::BINARY_TRIE:
+    return std::make_unique<Lpm>(
+        std::in_place_type<trie::BinaryTrie<uint32_t, Adjacency>>);
+  case Backend::PATRICIA_TRIE:
+    return std::make_unique<Lpm>(
+        std::in_place_type<trie::PatriciaTrie<uint32_t, Adjacency>>);
+  case Backend::MULTIBIT_TRIE:
+    return std::make_unique<Lpm>(
+        std::in_place_type<trie::MultibitTrie<uint32_t, Adjacency, 16, 8, 8>>);
+  case Backend::DIR_24_8:
+    return std::make_unique<Lpm>(
+        std::in_place_type<lpm::Dir24_8<Adjacency>>);
   }
+  throw std::invalid_argument("Unknown routing table backend");
+}
+
+std::optional<RoutingTable::Backend>
+RoutingTable::backend_from_string(std::string_view name) {
+  if (name == "binary") {
+    return Backend::BINARY_TRIE;
+  }
+  if (name == "patricia") {
+    return Backend::PATRICIA_TRIE;
+  }
+  if (name == "multibit") {
+    return Backend::MULTIBIT_TRIE;
+  }
+  if (name == "dir-24-8") {
+    return Backend::DIR_24_8;
+  }
+  return std::nullopt;
+}
+
+void RoutingTable::add_entries(tcb::span<const RoutingTableEntry> entries) {
+  std::lock_guard lock(update_mutex_);
+  routes_.insert(routes_.end(), entries.begin(), entries.end());
+  publish();
 }
 
 void RoutingTable::add_entry(RoutingTableEntry entry) {
-  int prefix_len = util::countl_one(util::ntoh(entry.mask));
-  uint32_t path = util::ntoh(entry.prefix);
-  route_trie_.insert(path, prefix_len, entry);
+  add_entries(tcb::span<const RoutingTableEntry>(&entry, 1));
+}
+
+void RoutingTable::remove_entries(tcb::span<const RoutingTableEntry> entries) {
+  update_entries(entries, {});
+}
+
+void RoutingTable::update_entries(tcb::span<const RoutingTableEntry> withdrawn,
+                                  tcb::span<const RoutingTableEntry> added) {
+  std::lock_guard lock(update_mutex_);
+  if (!withdrawn.empty()) {
+    // Hashed, as a batch may withdraw tens of thousands of prefixes
+    auto key = [](const RoutingTableEntry &entry) {
+      return uint64_t{entry.prefix} << 32 | entry.mask;
+    };
+    std::unordered_set<uint64_t> withdrawn_keys;
+    withdrawn_keys.reserve(withdrawn.size());
+    for (const auto &entry : withdrawn) {
+      withdrawn_keys.insert(key(entry));
+    }
+    routes_.erase(std::remove_if(routes_.begin(), routes_.end(),
+                                 [&](const RoutingTableEntry &route) {
+                                   return withdrawn_keys.count(key(route));
+                                 }),
+                  routes_.end());
+  }
+  routes_.insert(routes_.end(), added.begin(), added.end());
+  publish();
+}
+
+void RoutingTable::replace_entries(tcb::span<const RoutingTableEntry> entries) {
+  std::lock_guard lock(update_mutex_);
+  routes_.assign(entries.begin(), entries.end());
+  publish();
+}
+
+std::vector<RoutingTable::Prefix> RoutingTable::merge_routes() {
+  std::vector<Prefix> prefixes;
+  prefixes.reserve(routes_.size());
+  for (const auto &entry : routes_) {
+    prefixes.push_back(
+        {.path = util::ntoh(entry.prefix & entry.mask),
+         .prefix_len =
+             static_cast<uint8_t>(util::countl_one(util::ntoh(entry.mask))),
+         .value = adjacencies_.get(entry.next_hop, entry.interface)});
+  }
+  // The order of the single pass build of the binary trie. The sort is
+  // stable, so that the paths of a prefix keep the order of its routes.
+  std::stable_sort(prefixes.begin(), prefixes.end(),
+                   [](const Prefix &a, const Prefix &b) {
+                     return a.path < b.path ||
+                            (a.path == b.path && a.prefix_len < b.prefix_len);
+                   });
+
+  // Merge the routes of the same prefix into a single one, whose value is the
+  // next hop group of their distinct adjacencies
+  std::vector<AdjacencyTable::index_t> paths;
+  auto last = prefixes.begin();
+  for (auto first = prefixes.begin(); first != prefixes.end();) {
+    paths.clear();
+    auto it = first;
+    for (; it != prefixes.end() && same_prefix(*it, *first); ++it) {
+      if (paths.size() < AdjacencyTable::MAX_PATHS &&
+          std::find(paths.begin(), paths.end(), it->value) == paths.end()) {
+        paths.push_back(it->value);
+      }
+    }
+    *last = *first;
+    last->value = adjacencies_.get_group(paths);
+    ++last;
+    first = it;
+  }
+  prefixes.erase(last, prefixes.end());
+  return prefixes;
+}
+
+void RoutingTable::publish() {
+  std::vector<Prefix> prefixes = merge_routes();
+  auto lpm = make_lpm(backend_);
+  std::visit([&](auto &lpm) { lpm.build(prefixes.begin(), prefixes.end()); },
+             *lpm);
+  install(std::move(lpm));
+  for (const auto &observer : observers_) {
+    observer(prefixes);
+  }
+
+  // The lookups of the previous version have finished, so the adjacencies it
+  // alone used can be reused by the next updates
+  std::vector<AdjacencyTable::index_t> used(prefixes.size());
+  std::transform(prefixes.begin(), prefixes.end(), used.begin(),
+                 [](const Prefix &prefix) { return prefix.value; });
+  adjacencies_.reclaim(used);
+}
+
+void RoutingTable::add_observer(Observer observer) {
+  std::lock_guard lock(update_mutex_);
+  observer(merge_routes());
+  observers_.push_back(std::move(observer));
+}
+
+void RoutingTable::install(std::unique_ptr<Lpm> lpm) {
+  // Swap in the new version, then free the old one once the lookups that may
+  // still be using it have finished
+  const Lpm *old_lpm = lpm_.exchange(lpm.release());
+  // Bumped after the swap, so that a reader seeing the new generation also
+  // sees the new version
+  generation_.fetch_add(1, std::memory_order_release);
+  rcu::synchronize();
+  delete old_lpm;
+}
+
+void RoutingTable::save(snapshot::Writer &writer) {
+  std::lock_guard lock(update_mutex_);
+  writer.write(static_cast<uint32_t>(backend_));
+  writer.write(routes_);
+
+  // In index order, so that registering them again in an empty adjacency
+  // table gives them the indices stored in the longest prefix match structure
+  std::vector<SavedAdjacency> adjacencies(adjacencies_.size());
+  for (size_t i = 0; i < adjacencies.size(); ++i) {
+    auto index = static_cast<AdjacencyTable::index_t>(i);
+    adjacencies[i] = adjacencies_.is_free(index)
+                         ? SavedAdjacency{0, AdjacencyTable::FREE_INTERFACE}
+                         : SavedAdjacency{adjacencies_.next_hop(index),
+                                          adjacencies_.interface(index)};
+  }
+  writer.write(adjacencies);
+
+  std::vector<SavedGroup> groups(adjacencies_.group_count());
+  for (size_t i = 0; i < groups.size(); ++i) {
+    auto index =
+        static_cast<AdjacencyTable::index_t>(i) | AdjacencyTable::GROUP_FLAG;
+    if (adjacencies_.is_free(index)) {
+      continue;
+    }
+    auto paths = adjacencies_.paths(index);
+    groups[i].size = static_cast<uint32_t>(paths.size());
+    std::copy(paths.begin(), paths.end(), groups[i].paths.begin());
+  }
+  writer.write(groups);
+
+  // The writers are excluded, so the published version cannot be freed
+  std::visit([&](const auto &lpm) { lpm.save(writer); }, *lpm_.load());
+}
+
+size_t RoutingTable::memory_usage() const {
+  rcu::ReadGuard guard;
+  return std::visit([](const auto &lpm) { return lpm.memory_usage(); },
+                    *lpm_.load());
+}
+
+std::optional<trie::TrieStats<32>> RoutingTable::trie_stats() const {
+  rcu::ReadGuard guard;
+  return std::visit(
+      [](const auto &lpm) -> std::optional<trie::TrieStats<32>> {
+        using Backend = std::decay_t<decltype(lpm)>;
+        if constexpr (std::is_same_v<Backend,
+                                     trie::BinaryTrie<uint32_t, Adjacency>>) {
+          return lpm.stats();
+        } else {
+          return std::nullopt;
+        }
+      },
+      *lpm_.load());
+}
+
+bool RoutingTable::restore(snapshot::Reader &reader) {
+  uint32_t backend;
+  reader.read(backend);
+  if (backend != static_cast<uint32_t>(backend_)) {
+    return false;
+  }
+
+  std::vector<RoutingTableEntry> routes;
+  std::vector<SavedAdjacency> adjacencies;
+  std::vector<SavedGroup> groups;
+  reader.read(routes);
+  reader.read(adjacencies);
+  reader.read(groups);
+  auto lpm = make_lpm(backend_);
+  std::visit([&](auto &lpm) { lpm.load(reader); }, *lpm);
+
+  std::vector<std::pair<uint32_t, iface_t>> saved_adjacencies;
+  saved_adjacencies.reserve(adjacencies.size());
+  for (const auto &adjacency : adjacencies) {
+    saved_adjacencies.emplace_back(adjacency.next_hop, adjacency.interface);
+  }
+  std::vector<tcb::span<const AdjacencyTable::index_t>> saved_groups;
+  saved_groups.reserve(groups.size());
+  for (const auto &group : groups) {
+    if (group.size > AdjacencyTable::MAX_PATHS) {
+      return false;
+    }
+    saved_groups.emplace_back(group.paths.data(), group.size);
+  }
+
+  std::lock_guard lock(update_mutex_);
+  // Checked as a whole before any of them is registered, so that a snapshot
+  // that does not match leaves the table as it was
+  if (!adjacencies_.restore(saved_adjacencies, saved_groups)) {
+    return false;
+  }
+  routes_ = std::move(routes);
+  install(std::move(lpm));
+  if (!observers_.empty()) {
+    // The prefixes of the saved routes are merged into the same groups, which
+    // were checked above
+    std::vector<Prefix> prefixes = merge_routes();
+    for (const auto &observer : observers_) {
+      observer(prefixes);
+    }
+  }
+  return true;
 }
 
-} // namespace router
\ No newline at end of file
+} // namespace router
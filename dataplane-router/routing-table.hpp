@@ -1,29 +1,246 @@
 #pragma once
 
+#include "adjacency-table.hpp"
 #include "binary_trie.hpp"
+#include "dir_24_8.hpp"
 #include "lib_wrapper.hpp"
+#include "multibit_trie.hpp"
+#include "patricia_trie.hpp"
+#include "rcu.hpp"
+#include "snapshot.hpp"
 #include "span.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace router {
 
+/**
+ * @brief Routing table that can be updated while it is being used.
+ * Every update builds a whole new version of the longest prefix match
+ * structure off the hot path and publishes it with an atomic pointer swap, the
+ * old version being reclaimed once no lookup uses it anymore (RCU). Lookups
+ * never take a lock and never wait on a writer. As each update rebuilds the
+ * table, routes should be changed in bulk.
+ *
+ * The longest prefix match structure only stores the index of the adjacency
+ * of each route, registered in the given adjacency table. The routes of the
+ * same prefix with different next hops are the equal-cost paths of the
+ * prefix (ECMP, up to AdjacencyTable::MAX_PATHS of them): the prefix then
+ * stores the index of their next hop group, and each packet is sent on one of
+ * the paths with AdjacencyTable::select. The adjacencies and the groups no
+ * route uses anymore are reclaimed after each update.
+ */
 class RoutingTable {
 public:
   using RoutingTableEntry = route_table_entry;
 
+  // The longest prefix match structure backing the table
+  enum class Backend {
+    // One node per bit
+    BINARY_TRIE,
+    // Strides of 16/8/8 bits, at most 3 trie accesses per lookup
+    MULTIBIT_TRIE,
+    // 64MB flat table, a single memory access for prefixes up to /24
+    DIR_24_8,
+    // Binary trie without the single child chains, smallest memory footprint.
+    // Last, as the backends are stored by value in the snapshots.
+    PATRICIA_TRIE,
+  };
+
+  // A route as given to the bulk build of the longest prefix match
+  // structures, the routes of the same prefix being merged into one
+  struct Prefix {
+    // The prefix, in host byte order
+    uint32_t path;
+    uint8_t prefix_len;
+    // The adjacency, or the next hop group, of the prefix
+    AdjacencyTable::index_t value;
+  };
+
+  /**
+   * @brief Called with all the prefixes of the table, sorted by prefix, every
+   * time a new version is published, with the writers excluded. Used to
+   * mirror the table somewhere else (e.g. in the kernel).
+   */
+  using Observer = std::function<void(tcb::span<const Prefix> prefixes)>;
+
+  explicit RoutingTable(AdjacencyTable &adjacencies,
+                        Backend backend = Backend::MULTIBIT_TRIE);
+  ~RoutingTable();
+
+  RoutingTable(const RoutingTable &) = delete;
+  RoutingTable &operator=(const RoutingTable &) = delete;
+
+  /**
+   * @brief Parse the name of a backend ("binary", "patricia", "multibit" or
+   * "dir-24-8")
+   *
+   * @param name The name of the backend
+   * @return The backend, or std::nullopt if the name is unknown
+   */
+  static std::optional<Backend> backend_from_string(std::string_view name);
+
+  /**
+   * @brief Add routes. A route with the same prefix and mask as an existing
+   * one but another next hop adds a path to the prefix, so a route is changed
+   * by removing it first or by replacing all the routes.
+   */
   void add_entries(tcb::span<const RoutingTableEntry> entries);
 
   void add_entry(RoutingTableEntry entry);
 
-  [[nodiscard]] std::optional<RoutingTableEntry>
+  /**
+   * @brief Withdraw the routes having the same prefix and mask as one of the
+   * given entries, with all their paths.
+   */
+  void remove_entries(tcb::span<const RoutingTableEntry> entries);
+
+  /**
+   * @brief Withdraw the routes of the prefixes of `withdrawn`, as
+   * remove_entries, then add `added`, as add_entries, publishing a single new
+   * version. Used to apply a batch of changes at the cost of one rebuild, a
+   * prefix being changed by both withdrawing and adding it.
+   */
+  void update_entries(tcb::span<const RoutingTableEntry> withdrawn,
+                      tcb::span<const RoutingTableEntry> added);
+
+  /**
+   * @brief Replace all the routes of the table, e.g. after reloading them.
+   */
+  void replace_entries(tcb::span<const RoutingTableEntry> entries);
+
+  /**
+   * @brief Write the published version of the table: its routes, their
+   * adjacencies and the longest prefix match structure.
+   */
+  void save(snapshot::Writer &writer);
+
+  /**
+   * @brief Replace the table with a version written by `save`, publishing the
+   * saved longest prefix match structure without rebuilding it.
+   *
+   * @return false, leaving the routes untouched, if the version was saved with
+   * another backend or its adjacencies do not get the same indices in the
+   * adjacency table (which is the case when restoring into an empty one)
+   *
+   * @throws std::runtime_error if the saved version is truncated
+   */
+  bool restore(snapshot::Reader &reader);
+
+  /**
+   * @brief Add an observer of the table, called right away with the current
+   * prefixes, then after every update.
+   */
+  void add_observer(Observer observer);
+
+  /**
+   * @brief Get the number of bytes allocated by the published version of the
+   * longest prefix match structure.
+   */
+  size_t memory_usage() const;
+
+  /**
+   * @brief Get the statistics of the published version when it is a binary
+   * trie, std::nullopt with the other backends.
+   */
+  std::optional<trie::TrieStats<32>> trie_stats() const;
+
+  /**
+   * @brief Get the generation of the table, incremented by every update. It
+   * must be read before a lookup to tag any result cached from it.
+   */
+  uint64_t generation() const {
+    return generation_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief Find the adjacency, or the next hop group, of the longest prefix
+   * matching a destination.
+   */
+  [[nodiscard]] std::optional<AdjacencyTable::index_t>
   lookup(uint32_t dest_ip) const {
-    return route_trie_.longest_prefix_match(util::ntoh(dest_ip));
+    rcu::ReadGuard guard;
+    return std::visit(
+        [key = util::ntoh(dest_ip)](const auto &lpm) {
+          return lpm.longest_prefix_match(key);
+        },
+        *lpm_.load());
+  }
+
+  /**
+   * @brief Find the adjacencies of several destinations. The lookups are
+   * interleaved, so that the cache misses of each one are hidden behind the
+   * work on the others.
+   *
+   * @param dest_ips The destinations, in network byte order
+   * @param results Receives the result of `lookup` for each destination, must
+   * be at least as large as `dest_ips`
+   */
+  void lookup_batch(
+      tcb::span<const uint32_t> dest_ips,
+      tcb::span<std::optional<AdjacencyTable::index_t>> results) const {
+    rcu::ReadGuard guard;
+    std::visit(
+        [&](const auto &lpm) {
+          std::array<uint32_t, LOOKUP_BATCH_SIZE> keys;
+          for (size_t first = 0; first < dest_ips.size();
+               first += keys.size()) {
+            size_t size = std::min(keys.size(), dest_ips.size() - first);
+            for (size_t i = 0; i < size; ++i) {
+              keys[i] = util::ntoh(dest_ips[first + i]);
+            }
+            lpm.longest_prefix_match_batch(keys.data(), results.data() + first,
+                                           size);
+          }
+        },
+        *lpm_.load());
   }
 
 private:
-  trie::BinaryTrie<uint32_t, RoutingTableEntry> route_trie_{};
+  // Number of destinations converted to host byte order at once by
+  // lookup_batch
+  constexpr static size_t LOOKUP_BATCH_SIZE = 64;
+
+  using Adjacency = AdjacencyTable::index_t;
+  using Lpm = std::variant<trie::BinaryTrie<uint32_t, Adjacency>,
+                           trie::PatriciaTrie<uint32_t, Adjacency>,
+                           trie::MultibitTrie<uint32_t, Adjacency, 16, 8, 8>,
+                           lpm::Dir24_8<Adjacency>>;
+
+  static std::unique_ptr<Lpm> make_lpm(Backend backend);
+
+  // Get the prefixes of routes_, with the adjacencies of the routes of a
+  // prefix merged into a next hop group. Must be called with update_mutex_
+  // held.
+  std::vector<Prefix> merge_routes();
+
+  // Build a new version from routes_ and publish it. Must be called with
+  // update_mutex_ held.
+  void publish();
+
+  // Publish a version and wait for the previous one to be unused before
+  // freeing it. Must be called with update_mutex_ held.
+  void install(std::unique_ptr<Lpm> lpm);
+
+  AdjacencyTable &adjacencies_;
+  Backend backend_;
+  // The published version, read by the lookups
+  std::atomic<const Lpm *> lpm_;
+  std::atomic<uint64_t> generation_{1};
+  // The routes of the published version, only accessed by the writers
+  std::vector<RoutingTableEntry> routes_{};
+  std::vector<Observer> observers_{};
+  std::mutex update_mutex_{};
 };
 
-} // namespace router
\ No newline at end of file
+} // namespace router
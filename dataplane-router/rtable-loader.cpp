@@ -0,0 +1,576 @@
+#include "rtable-loader.hpp"
+#include "logger.hpp"
+#include "snapshot.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+namespace router {
+
+namespace {
+
+using RoutingTableEntry = RoutingTable::RoutingTableEntry;
+
+// Below this size, splitting the file costs more than it saves
+constexpr size_t MIN_CHUNK_SIZE = size_t{1} << 20;
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+  explicit MappedFile(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      int error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+      }
+      data_ = static_cast<const char *>(data);
+      // The whole file is about to be read, possibly by several threads
+      madvise(data, size_, MADV_WILLNEED);
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *begin() const { return data_; }
+  const char *end() const { return data_ + size_; }
+  size_t size() const { return size_; }
+
+private:
+  const char *data_{nullptr};
+  size_t size_{0};
+};
+
+// Thrown by the parser, turned into a runtime_error giving the line number
+struct ParseError {
+  const char *position;
+  const char *reason;
+};
+
+bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+const char *skip_blanks(const char *p, const char *end) {
+  while (p != end && is_blank(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+template <typename T>
+const char *parse_number(const char *p, const char *end, T &value) {
+  auto [next, ec] = std::from_chars(p, end, value);
+  if (ec != std::errc{}) {
+    throw ParseError{p, "invalid number"};
+  }
+  return next;
+}
+
+// Parse a dotted-quad address into network byte order
+const char *parse_address(const char *p, const char *end, uint32_t &address) {
+  p = skip_blanks(p, end);
+  uint32_t host_order = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (i > 0) {
+      if (p == end || *p != '.') {
+        throw ParseError{p, "expected '.' in address"};
+      }
+      ++p;
+    }
+    unsigned octet;
+    const char *octet_start = p;
+    p = parse_number(p, end, octet);
+    if (octet > 255) {
+      throw ParseError{octet_start, "address byte out of range"};
+    }
+    host_order = (host_order << 8) | octet;
+  }
+  address = util::hton(host_order);
+  return p;
+}
+
+// Parse the lines of [begin, end), which must start at the beginning of a line
+void parse_chunk(const char *begin, const char *end,
+                 std::vector<RoutingTableEntry> &entries) {
+  const char *p = begin;
+  while (p != end) {
+    const char *line_end = std::find(p, end, '\n');
+
+    p = skip_blanks(p, line_end);
+    if (p != line_end) {
+      // The fields of the packed entry cannot be bound to references
+      uint32_t prefix, next_hop, mask;
+      p = parse_address(p, line_end, prefix);
+      p = parse_address(p, line_end, next_hop);
+      p = parse_address(p, line_end, mask);
+
+      unsigned interface;
+      const char *interface_start = skip_blanks(p, line_end);
+      p = parse_number(interface_start, line_end, interface);
+      if (interface > INT32_MAX) {
+        throw ParseError{interface_start, "interface out of range"};
+      }
+
+      if (skip_blanks(p, line_end) != line_end) {
+        throw ParseError{p, "trailing characters"};
+      }
+      entries.push_back({.prefix = prefix,
+                         .next_hop = next_hop,
+                         .mask = mask,
+                         .interface = static_cast<int>(interface)});
+    }
+
+    p = line_end == end ? end : line_end + 1;
+  }
+}
+
+// Parse an IPv6 address, ending at the first blank or '/'
+const char *parse_ipv6_address(const char *p, const char *end,
+                               Ipv6Address &address) {
+  p = skip_blanks(p, end);
+  const char *address_end = std::find_if(
+      p, end, [](char c) { return is_blank(c) || c == '/'; });
+  auto parsed = ipv6::parse(std::string_view(p, address_end - p));
+  if (!parsed) {
+    throw ParseError{p, "invalid IPv6 address"};
+  }
+  address = *parsed;
+  return address_end;
+}
+
+// Parse the lines of an IPv6 routing table file
+void parse_ipv6_lines(const char *begin, const char *end,
+                      std::vector<Ipv6RoutingTable::RoutingTableEntry> &entries) {
+  const char *p = begin;
+  while (p != end) {
+    const char *line_end = std::find(p, end, '\n');
+
+    p = skip_blanks(p, line_end);
+    if (p != line_end) {
+      Ipv6RoutingTable::RoutingTableEntry entry{};
+      p = parse_ipv6_address(p, line_end, entry.prefix);
+      if (p == line_end || *p != '/') {
+        throw ParseError{p, "expected '/' after the prefix"};
+      }
+      unsigned prefix_len;
+      const char *prefix_len_start = ++p;
+      p = parse_number(p, line_end, prefix_len);
+      if (prefix_len > 128) {
+        throw ParseError{prefix_len_start, "prefix length out of range"};
+      }
+      entry.prefix_len = static_cast<uint8_t>(prefix_len);
+      p = parse_ipv6_address(p, line_end, entry.next_hop);
+
+      const char *interface_start = skip_blanks(p, line_end);
+      p = parse_number(interface_start, line_end, entry.interface);
+
+      if (skip_blanks(p, line_end) != line_end) {
+        throw ParseError{p, "trailing characters"};
+      }
+      entries.push_back(entry);
+    }
+
+    p = line_end == end ? end : line_end + 1;
+  }
+}
+
+// Parse a MAC address, as 6 hexadecimal bytes separated by ':'
+const char *parse_mac(const char *p, const char *end,
+                      std::array<uint8_t, 6> &mac) {
+  p = skip_blanks(p, end);
+  for (size_t i = 0; i < mac.size(); ++i) {
+    if (i > 0) {
+      if (p == end || *p != ':') {
+        throw ParseError{p, "expected ':' in MAC address"};
+      }
+      ++p;
+    }
+    const char *byte_start = p;
+    auto [next, ec] = std::from_chars(p, std::min(p + 2, end), mac[i], 16);
+    if (ec != std::errc{}) {
+      throw ParseError{byte_start, "invalid MAC address"};
+    }
+    p = next;
+  }
+  return p;
+}
+
+// Parse the lines of a neighbor table file
+void parse_arp_lines(const char *begin, const char *end,
+                     std::vector<arp::ArpTableEntry> &entries) {
+  const char *p = begin;
+  while (p != end) {
+    const char *line_end = std::find(p, end, '\n');
+
+    p = skip_blanks(p, line_end);
+    if (p != line_end) {
+      arp::ArpTableEntry entry{};
+      p = parse_address(p, line_end, entry.ip);
+      p = parse_mac(p, line_end, entry.mac);
+      if (skip_blanks(p, line_end) != line_end) {
+        throw ParseError{p, "trailing characters"};
+      }
+      entries.push_back(entry);
+    }
+
+    p = line_end == end ? end : line_end + 1;
+  }
+}
+
+// "RTSNAP" and 2 bytes of zeros, as read on a little-endian machine. A
+// snapshot written with another byte order does not match.
+constexpr uint64_t SNAPSHOT_MAGIC = 0x0000'5041'4e53'5452;
+// Incremented on any change to the layout of the snapshot or of the longest
+// prefix match structures
+constexpr uint64_t SNAPSHOT_VERSION = 2;
+
+struct SnapshotHeader {
+  uint64_t magic;
+  uint64_t version;
+  // Identity of the source file the table was built from
+  uint64_t source_size;
+  int64_t source_mtime_ns;
+  // Size and checksum of the data following the header
+  uint64_t payload_size;
+  uint64_t checksum;
+};
+// Keeps the payload aligned in the mapping, for the snapshot reader
+static_assert(sizeof(SnapshotHeader) % snapshot::ALIGNMENT == 0);
+
+// Identity of a file, changed by any rewrite of it
+struct FileStamp {
+  uint64_t size;
+  int64_t mtime_ns;
+};
+
+FileStamp stamp_file(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+  return {static_cast<uint64_t>(st.st_size),
+          st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec};
+}
+
+// FNV-1a over 64-bit words, with an extra shift to fold the high bits back
+// into the low ones. Hashing the 64MB of a DIR-24-8 table byte by byte would
+// take longer than building it.
+uint64_t checksum(tcb::span<const std::byte> data) {
+  constexpr uint64_t PRIME = 0x100000001b3;
+  uint64_t hash = 0xcbf29ce484222325;
+
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data.data() + i, sizeof(word));
+    hash = (hash ^ word) * PRIME;
+    hash ^= hash >> 32;
+  }
+  for (; i < data.size(); ++i) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * PRIME;
+  }
+  return hash;
+}
+
+void write_all(int fd, const void *data, size_t size, const std::string &path) {
+  auto bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    bytes += written;
+    size -= written;
+  }
+}
+
+// Write a header and its payload to a temporary file, then rename it over
+// `path`, so that a partially written file is never left behind
+void replace_file(const char *path, const void *header, size_t header_size,
+                  tcb::span<const std::byte> payload) {
+  std::string temp_path = std::string{path} + ".tmp";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(), temp_path);
+  }
+  write_all(fd, header, header_size, temp_path);
+  write_all(fd, payload.data(), payload.size(), temp_path);
+  if (fsync(fd) == -1 || close(fd) == -1) {
+    throw std::system_error(errno, std::generic_category(), temp_path);
+  }
+  if (std::rename(temp_path.c_str(), path) == -1) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+}
+
+// "NBSTAT" and 2 bytes of zeros, as read on a little-endian machine
+constexpr uint64_t NEIGHBOR_STATE_MAGIC = 0x0000'5441'5453'424e;
+// Incremented on any change to the layout of the state
+constexpr uint64_t NEIGHBOR_STATE_VERSION = 1;
+
+struct NeighborStateHeader {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t payload_size;
+  uint64_t checksum;
+};
+static_assert(sizeof(NeighborStateHeader) % snapshot::ALIGNMENT == 0);
+
+} // namespace
+
+std::vector<RoutingTableEntry> load_rtable(const char *path,
+                                           unsigned threads) {
+  MappedFile file{path};
+
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  size_t chunks = std::clamp<size_t>(file.size() / MIN_CHUNK_SIZE, 1, threads);
+
+  // Split the file in chunks of about the same size, ending at newlines
+  std::vector<const char *> bounds{file.begin()};
+  for (size_t i = 1; i < chunks; ++i) {
+    const char *bound = std::max(file.begin() + file.size() * i / chunks,
+                                 bounds.back());
+    bound = std::find(bound, file.end(), '\n');
+    bounds.push_back(bound == file.end() ? bound : bound + 1);
+  }
+  bounds.push_back(file.end());
+
+  std::vector<std::vector<RoutingTableEntry>> chunk_entries(chunks);
+  std::vector<std::exception_ptr> errors(chunks);
+  auto parse = [&](size_t chunk) {
+    try {
+      // The lines take a bit more than 40 bytes
+      chunk_entries[chunk].reserve((bounds[chunk + 1] - bounds[chunk]) / 40);
+      parse_chunk(bounds[chunk], bounds[chunk + 1], chunk_entries[chunk]);
+    } catch (...) {
+      errors[chunk] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t chunk = 1; chunk < chunks; ++chunk) {
+    workers.emplace_back(parse, chunk);
+  }
+  parse(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (const auto &error : errors) {
+    if (!error) {
+      continue;
+    }
+    try {
+      std::rethrow_exception(error);
+    } catch (const ParseError &parse_error) {
+      size_t line = std::count(file.begin(), parse_error.position, '\n') + 1;
+      throw std::runtime_error(std::string{path} + ":" + std::to_string(line) +
+                               ": " + parse_error.reason);
+    }
+  }
+
+  if (chunks == 1) {
+    return std::move(chunk_entries[0]);
+  }
+  size_t total = 0;
+  for (const auto &entries : chunk_entries) {
+    total += entries.size();
+  }
+  std::vector<RoutingTableEntry> entries;
+  entries.reserve(total);
+  for (const auto &chunk : chunk_entries) {
+    entries.insert(entries.end(), chunk.begin(), chunk.end());
+  }
+  return entries;
+}
+
+std::vector<Ipv6RoutingTable::RoutingTableEntry>
+load_ipv6_rtable(const char *path) {
+  MappedFile file{path};
+  std::vector<Ipv6RoutingTable::RoutingTableEntry> entries;
+  try {
+    parse_ipv6_lines(file.begin(), file.end(), entries);
+  } catch (const ParseError &parse_error) {
+    size_t line = std::count(file.begin(), parse_error.position, '\n') + 1;
+    throw std::runtime_error(std::string{path} + ":" + std::to_string(line) +
+                             ": " + parse_error.reason);
+  }
+  return entries;
+}
+
+std::vector<arp::ArpTableEntry> load_arp_table(const char *path) {
+  MappedFile file{path};
+  std::vector<arp::ArpTableEntry> entries;
+  try {
+    parse_arp_lines(file.begin(), file.end(), entries);
+  } catch (const ParseError &parse_error) {
+    size_t line = std::count(file.begin(), parse_error.position, '\n') + 1;
+    throw std::runtime_error(std::string{path} + ":" + std::to_string(line) +
+                             ": " + parse_error.reason);
+  }
+  return entries;
+}
+
+void save_rtable_snapshot(RoutingTable &table, const char *source_path,
+                          const char *snapshot_path) {
+  // Stamped before the table is saved: if the source changes in between, the
+  // snapshot is seen as stale
+  FileStamp source = stamp_file(source_path);
+
+  snapshot::Writer writer;
+  table.save(writer);
+  const auto &payload = writer.data();
+
+  SnapshotHeader header{.magic = SNAPSHOT_MAGIC,
+                        .version = SNAPSHOT_VERSION,
+                        .source_size = source.size,
+                        .source_mtime_ns = source.mtime_ns,
+                        .payload_size = payload.size(),
+                        .checksum = checksum(payload)};
+
+  replace_file(snapshot_path, &header, sizeof(header), payload);
+}
+
+bool load_rtable_snapshot(RoutingTable &table, const char *source_path,
+                          const char *snapshot_path) {
+  try {
+    MappedFile file{snapshot_path};
+    auto data = tcb::span<const std::byte>(
+        reinterpret_cast<const std::byte *>(file.begin()), file.size());
+
+    SnapshotHeader header;
+    if (data.size() < sizeof(header)) {
+      LOG_WARN("Routing table snapshot {} is truncated", snapshot_path);
+      return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    auto payload = data.subspan(sizeof(header));
+
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+      LOG_WARN("Routing table snapshot {} has an unsupported format",
+               snapshot_path);
+      return false;
+    }
+    FileStamp source = stamp_file(source_path);
+    if (header.source_size != source.size ||
+        header.source_mtime_ns != source.mtime_ns) {
+      LOG_WARN("Routing table snapshot {} is older than {}", snapshot_path,
+               source_path);
+      return false;
+    }
+    if (header.payload_size != payload.size() ||
+        header.checksum != checksum(payload)) {
+      LOG_WARN("Routing table snapshot {} is corrupted", snapshot_path);
+      return false;
+    }
+
+    snapshot::Reader reader{payload};
+    if (!table.restore(reader)) {
+      LOG_WARN("Routing table snapshot {} does not match the router "
+               "configuration",
+               snapshot_path);
+      return false;
+    }
+    return true;
+  } catch (const std::exception &e) {
+    LOG_WARN("Cannot read routing table snapshot {}: {}", snapshot_path,
+             e.what());
+    return false;
+  }
+}
+
+void save_neighbor_state(const NeighborState &state, const char *path) {
+  snapshot::Writer writer;
+  writer.write(state.ipv4);
+  writer.write(state.ipv6);
+  const auto &payload = writer.data();
+
+  NeighborStateHeader header{.magic = NEIGHBOR_STATE_MAGIC,
+                             .version = NEIGHBOR_STATE_VERSION,
+                             .payload_size = payload.size(),
+                             .checksum = checksum(payload)};
+  replace_file(path, &header, sizeof(header), payload);
+}
+
+std::optional<NeighborState> load_neighbor_state(const char *path) {
+  try {
+    MappedFile file{path};
+    auto data = tcb::span<const std::byte>(
+        reinterpret_cast<const std::byte *>(file.begin()), file.size());
+
+    NeighborStateHeader header;
+    if (data.size() < sizeof(header)) {
+      LOG_WARN("Neighbor state {} is truncated", path);
+      return std::nullopt;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    auto payload = data.subspan(sizeof(header));
+
+    if (header.magic != NEIGHBOR_STATE_MAGIC ||
+        header.version != NEIGHBOR_STATE_VERSION) {
+      LOG_WARN("Neighbor state {} has an unsupported format", path);
+      return std::nullopt;
+    }
+    if (header.payload_size != payload.size() ||
+        header.checksum != checksum(payload)) {
+      LOG_WARN("Neighbor state {} is corrupted", path);
+      return std::nullopt;
+    }
+
+    NeighborState state;
+    snapshot::Reader reader{payload};
+    reader.read(state.ipv4);
+    reader.read(state.ipv6);
+    return state;
+  } catch (const std::exception &e) {
+    LOG_WARN("Cannot read neighbor state {}: {}", path, e.what());
+    return std::nullopt;
+  }
+}
+
+} // namespace router
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "arp-table.hpp"
+#include "ipv6-routing-table.hpp"
+#include "routing-table.hpp"
+#include <optional>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief Read a routing table file, made of lines of the form
+ * "prefix next_hop mask interface" (dotted-quad addresses, e.g.
+ * "192.168.0.0 192.168.0.2 255.255.255.0 1").
+ *
+ * The file is mapped in memory and parsed in place, without any intermediate
+ * string. Big files are split in chunks at newlines and parsed in parallel,
+ * the entries being returned in the order of the file.
+ *
+ * @param path The path of the file
+ * @param threads The maximum number of parsing threads (0 to use all the
+ * cores)
+ * @return The entries, in network byte order
+ *
+ * @throws std::system_error if the file cannot be read
+ * @throws std::runtime_error if a line is malformed
+ */
+std::vector<RoutingTable::RoutingTableEntry> load_rtable(const char *path,
+                                                         unsigned threads = 0);
+
+/**
+ * @brief Read an IPv6 routing table file, made of lines of the form
+ * "prefix/length next_hop interface" (e.g. "2001:db8:1::/48 fe80::1 1"). The
+ * next hop of the directly connected networks is "::".
+ *
+ * The file is parsed in place like by `load_rtable`, on a single thread: the
+ * IPv6 tables are an order of magnitude smaller.
+ *
+ * @throws std::system_error if the file cannot be read
+ * @throws std::runtime_error if a line is malformed
+ */
+std::vector<Ipv6RoutingTable::RoutingTableEntry>
+load_ipv6_rtable(const char *path);
+
+/**
+ * @brief Read a static neighbor table file, made of lines of the form
+ * "ip mac" (e.g. "192.168.0.2 de:ad:be:ef:00:01"), as read by
+ * `parse_arp_table` of the lib, into entries for the ARP table.
+ *
+ * @return The entries, their addresses in network byte order
+ *
+ * @throws std::system_error if the file cannot be read
+ * @throws std::runtime_error if a line is malformed
+ */
+std::vector<arp::ArpTableEntry> load_arp_table(const char *path);
+
+/**
+ * @brief Write a snapshot of a routing table built from the file
+ * `source_path`, that `load_rtable_snapshot` restores without parsing the file
+ * nor building the table again.
+ *
+ * The snapshot holds the longest prefix match structure as is, so it can only
+ * be restored with the same backend, by a router built from the same sources.
+ * It is versioned, checksummed and stamped with the size and modification
+ * time of the source file. It is written to a temporary file first, then
+ * renamed over `snapshot_path`.
+ *
+ * @throws std::system_error if the source cannot be read or the snapshot
+ * cannot be written
+ */
+void save_rtable_snapshot(RoutingTable &table, const char *source_path,
+                          const char *snapshot_path);
+
+/**
+ * @brief Replace a routing table with a snapshot written by
+ * `save_rtable_snapshot`. The table must not have any route yet (see
+ * RoutingTable::restore).
+ *
+ * @return false, leaving the routes untouched, if the snapshot is missing,
+ * corrupted, written by another version or for another backend, or is stale
+ * because the source file has changed since
+ */
+bool load_rtable_snapshot(RoutingTable &table, const char *source_path,
+                          const char *snapshot_path);
+
+// The neighbors learned by a router, kept across its restarts
+struct NeighborState {
+  std::vector<arp::ArpTableEntry> ipv4;
+  std::vector<arp::NeighborEntry<Ipv6Address>> ipv6;
+};
+
+/**
+ * @brief Write the neighbors learned by a router, for the router started after
+ * it to restore with `load_neighbor_state`. Like a routing table snapshot, the
+ * state is versioned, checksummed, only meant to be read on the same machine,
+ * and written to a temporary file renamed over `path`.
+ *
+ * @throws std::system_error if the state cannot be written
+ */
+void save_neighbor_state(const NeighborState &state, const char *path);
+
+/**
+ * @brief Read the neighbors written by `save_neighbor_state`.
+ *
+ * @return nullopt if the file is missing, corrupted or written by another
+ * version
+ */
+std::optional<NeighborState> load_neighbor_state(const char *path);
+
+} // namespace router
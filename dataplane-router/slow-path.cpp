@@ -0,0 +1,120 @@
+#include "slow-path.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace router {
+
+namespace {
+
+std::atomic<uint64_t> next_slow_path_id{1};
+
+// Set on the slow path threads, whose frames are never punted again
+thread_local bool is_slow_path_thread = false;
+
+} // namespace
+
+SlowPath::SlowPath(Handler handler, size_t ring_size)
+    : handler_(std::move(handler)), id_(next_slow_path_id.fetch_add(1)) {
+  for (size_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+    rings_.push_back(std::make_unique<Ring>(ring_size));
+  }
+  batch_frames_.reserve(BATCH_SIZE);
+  batch_reasons_.reserve(BATCH_SIZE);
+  thread_ = std::thread(&SlowPath::run, this);
+}
+
+SlowPath::~SlowPath() {
+  stopping_.store(true);
+  waiter_.notify();
+  thread_.join();
+}
+
+SlowPath::Ring *SlowPath::producer_ring() {
+  // The ring taken by the thread, and the instance it belongs to
+  thread_local uint64_t owner = 0;
+  thread_local Ring *ring = nullptr;
+  if (owner != id_) {
+    size_t index = next_ring_.fetch_add(1);
+    ring = index < rings_.size() ? rings_[index].get() : nullptr;
+    owner = id_;
+  }
+  return ring;
+}
+
+bool SlowPath::punt(PacketBuffer packet, iface_t interface,
+                    PuntReason reason) {
+  if (is_slow_path_thread || PACKET_HEADROOM + packet.size() > SLOT_SIZE) {
+    return false;
+  }
+  Ring *ring = producer_ring();
+  if (!ring) {
+    return false;
+  }
+
+  Slot *slot = ring->producer_slot();
+  if (!slot) {
+    stats::count_drop(interface, stats::DropReason::SLOW_PATH_FULL);
+    return true;
+  }
+  slot->interface = interface;
+  slot->length = packet.size();
+  slot->reason = reason;
+  std::memcpy(slot->data.data() + PACKET_HEADROOM, packet.data(),
+              packet.size());
+  ring->push();
+  stats::add(stats::interface(interface).slow_path_punts);
+  return true;
+}
+
+void SlowPath::notify() { waiter_.notify(); }
+
+bool SlowPath::has_pending_frames() {
+  return std::any_of(rings_.begin(), rings_.end(),
+                     [](const auto &ring) { return ring->readable() > 0; });
+}
+
+bool SlowPath::handle_batches() {
+  bool handled = false;
+  for (auto &ring : rings_) {
+    size_t count = std::min(ring->readable(), BATCH_SIZE);
+    if (count == 0) {
+      continue;
+    }
+
+    batch_frames_.clear();
+    batch_reasons_.clear();
+    for (size_t i = 0; i < count; ++i) {
+      Slot &slot = ring->at(i);
+      batch_frames_.push_back(
+          {PacketBuffer(slot.data.data() + PACKET_HEADROOM, slot.length,
+                        PACKET_HEADROOM,
+                        SLOT_SIZE - PACKET_HEADROOM - slot.length),
+           slot.interface});
+      batch_reasons_.push_back(slot.reason);
+    }
+    handler_(batch_frames_, batch_reasons_);
+    ring->pop(count);
+    handled = true;
+  }
+  return handled;
+}
+
+void SlowPath::wait_for_frames() {
+  waiter_.wait([this] { return has_pending_frames() || stopping_.load(); },
+               IDLE_TIMEOUT);
+}
+
+void SlowPath::run() {
+  is_slow_path_thread = true;
+  while (!stopping_.load()) {
+    if (!handle_batches()) {
+      wait_for_frames();
+      // Even without frames, so that those its TX queues hold back (see
+      // EgressScheduler) are sent
+      handler_({}, {});
+    }
+  }
+}
+
+} // namespace router
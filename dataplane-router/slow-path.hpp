@@ -0,0 +1,123 @@
+#pragma once
+
+#include "common.hpp"
+#include "packet-buffer.hpp"
+#include "ring-waiter.hpp"
+#include "span.hpp"
+#include "spsc-ring.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace router {
+
+// Why a frame is handed to the slow path
+enum class PuntReason : uint8_t {
+  // To be handled from the start, as it was received (ARP, IPv6, packets for
+  // the router, expired TTL)
+  FRAME,
+  // An IPv4 packet without a route, to be answered with an ICMP error (already
+  // allowed by the rate limits)
+  NO_ROUTE,
+};
+
+/**
+ * @brief Thread handling the exception frames of the RX workers, so that a
+ * flood of them (pings, expired TTLs, ARP requests) cannot stall the
+ * forwarded traffic.
+ *
+ * Every RX thread gets its own lock-free SPSC ring towards the slow path, in
+ * which the frames are copied when punted, the received buffers being reused
+ * by the next burst. When the ring of a worker is full, its exception frames
+ * are dropped. The slow path thread handles the frames in batches, and sleeps
+ * while all the rings are empty.
+ */
+class SlowPath {
+public:
+  // Handles a batch of punted frames, the frames staying valid, and in their
+  // slot with some headroom around them, until it returns
+  using Handler = std::function<void(tcb::span<const RxFrame> frames,
+                                     tcb::span<const PuntReason> reasons)>;
+
+  constexpr static size_t DEFAULT_RING_SIZE = 256;
+  // Frames handled at once, per ring
+  constexpr static size_t BATCH_SIZE = 32;
+  // Size of a slot, enough for the frames of all the link layers (at most an
+  // AF_XDP chunk) after the headroom
+  constexpr static size_t SLOT_SIZE = 2048;
+
+  /**
+   * @brief Start the slow path thread, with a ring for each of the
+   * ROUTER_NUM_INTERFACES threads that can punt frames at most (a single RX
+   * loop, or one worker per interface).
+   *
+   * @param ring_size The number of slots of each ring, a power of two
+   *
+   * @throws std::invalid_argument if the ring size is not a power of two
+   */
+  explicit SlowPath(Handler handler, size_t ring_size = DEFAULT_RING_SIZE);
+  ~SlowPath();
+
+  SlowPath(const SlowPath &) = delete;
+  SlowPath &operator=(const SlowPath &) = delete;
+
+  /**
+   * @brief Hand a frame to the slow path, copying it into the ring of the
+   * calling thread, or drop it if the ring is full. `notify` must be called
+   * once the frames of the burst have been punted.
+   *
+   * @return false if the frame must be handled by the caller instead: the
+   * call is made from the slow path thread itself, the frame does not fit in
+   * a slot, or every ring is already taken by another thread
+   */
+  bool punt(PacketBuffer packet, iface_t interface, PuntReason reason);
+
+  // Wake the slow path thread up if it is waiting for frames
+  void notify();
+
+private:
+  struct Slot {
+    iface_t interface;
+    size_t length;
+    PuntReason reason;
+    alignas(64) std::array<std::byte, SLOT_SIZE> data;
+  };
+  using Ring = SpscRing<Slot>;
+
+  // The ring of the calling thread, taken on its first punt, or nullptr if
+  // there is none left
+  Ring *producer_ring();
+  bool has_pending_frames();
+  // Handle a batch of the frames of every ring, returning false if they were
+  // all empty
+  bool handle_batches();
+  void wait_for_frames();
+  void run();
+
+  // Time after which the thread checks the rings again, even when it has not
+  // been notified
+  constexpr static auto IDLE_TIMEOUT = std::chrono::milliseconds{1};
+
+  Handler handler_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  // Identifies the instance in the rings taken by the threads
+  uint64_t id_;
+  std::atomic<size_t> next_ring_{0};
+
+  RingWaiter waiter_;
+  std::atomic<bool> stopping_{false};
+
+  // The batch being handled
+  std::vector<RxFrame> batch_frames_;
+  std::vector<PuntReason> batch_reasons_;
+
+  std::thread thread_;
+};
+
+} // namespace router
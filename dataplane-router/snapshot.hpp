@@ -0,0 +1,111 @@
+#pragma once
+
+#include "span.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace router::snapshot {
+
+// Alignment of the elements of the vectors, relative to the start of the data
+constexpr size_t ALIGNMENT = 8;
+
+/**
+ * @brief Serializes trivially copyable values, and vectors or optionals of
+ * them, into a byte buffer. The values are written in the native byte order,
+ * a snapshot is only meant to be read back on the machine that wrote it.
+ */
+class Writer {
+public:
+  template <typename T> void write(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Only trivially copyable values can be written");
+    append(&value, sizeof(T));
+  }
+
+  template <typename T, typename Allocator>
+  void write(const std::vector<T, Allocator> &values) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Only trivially copyable values can be written");
+    static_assert(alignof(T) <= ALIGNMENT, "Overaligned vector elements");
+    write(static_cast<uint64_t>(values.size()));
+    data_.resize((data_.size() + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+    append(values.data(), values.size() * sizeof(T));
+  }
+
+  template <typename T> void write(const std::optional<T> &value) {
+    write(static_cast<uint8_t>(value.has_value()));
+    write(value.value_or(T{}));
+  }
+
+  const std::vector<std::byte> &data() const { return data_; }
+
+private:
+  void append(const void *data, size_t size) {
+    auto bytes = static_cast<const std::byte *>(data);
+    data_.insert(data_.end(), bytes, bytes + size);
+  }
+
+  std::vector<std::byte> data_{};
+};
+
+/**
+ * @brief Reads back the values written by a Writer, in the same order. The
+ * vectors are copied straight out of the data, which must be aligned on
+ * ALIGNMENT bytes (as a memory mapped file is, for instance).
+ *
+ * @throws std::runtime_error if the data is truncated
+ */
+class Reader {
+public:
+  explicit Reader(tcb::span<const std::byte> data) : data_(data) {}
+
+  template <typename T> void read(T &value) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Only trivially copyable values can be read");
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+  }
+
+  template <typename T, typename Allocator>
+  void read(std::vector<T, Allocator> &values) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Only trivially copyable values can be read");
+    uint64_t size;
+    read(size);
+    take(-offset_ & (ALIGNMENT - 1));
+    if (size > data_.size() / sizeof(T)) {
+      throw std::runtime_error("Truncated snapshot");
+    }
+    auto first = reinterpret_cast<const T *>(take(size * sizeof(T)));
+    values.assign(first, first + size);
+  }
+
+  template <typename T> void read(std::optional<T> &value) {
+    uint8_t has_value;
+    T read_value;
+    read(has_value);
+    read(read_value);
+    value = has_value ? std::optional<T>{read_value} : std::nullopt;
+  }
+
+private:
+  const std::byte *take(size_t size) {
+    if (size > data_.size()) {
+      throw std::runtime_error("Truncated snapshot");
+    }
+    const std::byte *data = data_.data();
+    data_ = data_.subspan(size);
+    offset_ += size;
+    return data;
+  }
+
+  tcb::span<const std::byte> data_;
+  // Number of bytes read so far
+  size_t offset_{0};
+};
+
+} // namespace router::snapshot
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "page-allocator.hpp"
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+
+namespace router {
+
+/**
+ * @brief Lock-free ring buffer between a single producer thread and a single
+ * consumer thread.
+ * The slots are filled and handled in place: the producer writes into the
+ * slot returned by `producer_slot` before publishing it with `push`, and the
+ * consumer reads the published slots with `at` before handing them back with
+ * `pop`. Either side may handle a batch of slots at once (`writable` and
+ * `producer_at`, `readable` and `at`), for the cost of a single store. Each side only writes its own index, on its own cache line, and
+ * keeps a copy of the other index to read it only when the ring looks full
+ * (or empty).
+ *
+ * @tparam T The type of the slots, default constructible
+ */
+template <typename T> class SpscRing {
+public:
+  /**
+   * @param capacity The number of slots, a power of two
+   *
+   * @throws std::invalid_argument if the capacity is not a power of two
+   */
+  explicit SpscRing(size_t capacity)
+      : slots_(capacity), mask_(capacity - 1) {
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+      throw std::invalid_argument("The ring capacity must be a power of 2");
+    }
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Producer side
+
+  /**
+   * @return The next free slot, or nullptr if the ring is full
+   */
+  T *producer_slot() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return nullptr;
+      }
+    }
+    return &slots_[tail & mask_];
+  }
+
+  /**
+   * @return The number of free slots, which can be filled with `producer_at`
+   */
+  size_t writable() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+    return mask_ + 1 - (tail - cached_head_);
+  }
+
+  // The i-th free slot, i being less than the result of `writable`
+  T &producer_at(size_t i) {
+    return slots_[(tail_.load(std::memory_order_relaxed) + i) & mask_];
+  }
+
+  // Publish the first `count` free slots, that returned by `producer_slot`
+  // by default
+  void push(size_t count = 1) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + count,
+                std::memory_order_release);
+  }
+
+  // Consumer side
+
+  /**
+   * @return The number of published slots, which can be read with `at`
+   */
+  size_t readable() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (cached_tail_ == head) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+    return cached_tail_ - head;
+  }
+
+  // The i-th published slot, i being less than the result of `readable`
+  T &at(size_t i) {
+    return slots_[(head_.load(std::memory_order_relaxed) + i) & mask_];
+  }
+
+  // Hand the first `count` published slots back to the producer
+  void pop(size_t count) {
+    head_.store(head_.load(std::memory_order_relaxed) + count,
+                std::memory_order_release);
+  }
+
+private:
+  // Allocated like a buffer pool, as the slots may hold whole frames
+  memory::PageVector<T> slots_;
+  size_t mask_;
+  // Written by the consumer
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_{0};
+  // Written by the producer
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_{0};
+};
+
+} // namespace router
@@ -0,0 +1,121 @@
+/**
+ * Exporter of the statistics of a running router in the Prometheus text
+ * format: the shared memory page of the counters is mapped read-only, so the
+ * router is never interrupted, and each scrape reads the counters in place.
+ *
+ * Usage: ./stats-exporter [socket]
+ *
+ * Without a socket, the counters are written once to stdout (e.g. for the
+ * textfile collector of node_exporter). With one, the exporter listens on
+ * that Unix socket, replacing the file left by a previous run, and writes the
+ * counters to each connection before closing it (e.g.
+ * `socat - UNIX-CONNECT:<socket>`). The page is found by the same environment
+ * variable as the router (ROUTER_STATS_SHM, "/router-stats" by default).
+ */
+#include "stats.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace router;
+
+namespace {
+
+constexpr auto STATS_SHM_ENV = "ROUTER_STATS_SHM";
+constexpr auto DEFAULT_STATS_SHM = "/router-stats";
+
+// Write the whole text to a connection, which may take several writes
+bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+int serve(const stats::Page &page, const char *path) {
+  sockaddr_un addr{};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "The socket path %s is too long\n", path);
+    return 1;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(listen_fd, 16) < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  // A scraper closing its connection early must not stop the exporter
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+      return 1;
+    }
+
+    // Built anew for each scrape, so it is written without blocking the
+    // formatting on the scraper
+    char *text = nullptr;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (out == nullptr) {
+      close(fd);
+      continue;
+    }
+    stats::write_prometheus(out, page);
+    fclose(out);
+    write_all(fd, text, size);
+    free(text);
+    close(fd);
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [socket]\n", argv[0]);
+    return 1;
+  }
+
+  const char *shm_name = getenv(STATS_SHM_ENV);
+  if (!shm_name) {
+    shm_name = DEFAULT_STATS_SHM;
+  }
+  const stats::Page *page = stats::open_page(shm_name);
+  if (page == nullptr) {
+    fprintf(stderr,
+            "Failed to map the statistics %s, or they come from another "
+            "version of the router\n",
+            shm_name);
+    return 1;
+  }
+
+  if (argc == 1) {
+    stats::write_prometheus(stdout, *page);
+    return 0;
+  }
+  return serve(*page, argv[1]);
+}
@@ -0,0 +1,152 @@
+#include "stats.hpp"
+
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace router::stats {
+
+namespace {
+
+Page *init_page(void *memory) {
+  auto *page = new (memory) Page{};
+  page->magic = PAGE_MAGIC;
+  page->version = PAGE_VERSION;
+  page->num_interfaces = ROUTER_NUM_INTERFACES;
+  page->num_drop_reasons = DROP_REASON_COUNT;
+  return page;
+}
+
+// Used until the shared memory page is set up
+alignas(Page) unsigned char local_page_memory[sizeof(Page)];
+
+constexpr std::array<const char *, DROP_REASON_COUNT> DROP_REASON_NAMES{
+    "truncated",         "bad_checksum",          "ttl_exceeded",
+    "no_route",          "unknown_ethertype",     "unknown_arp_opcode",
+    "unknown_ip_proto",  "unsupported_icmp_type", "arp_queue_full",
+    "arp_timeout",       "bad_ipv6_header",       "slow_path_full",
+    "acl_denied",        "egress_queue_full",     "fragmentation_needed",
+    "tx_failed",
+};
+static_assert(DROP_REASON_NAMES.back() != nullptr,
+              "Every drop reason needs a name");
+
+// A counter of InterfaceCounters, and its name without the router_ prefix
+// and the _total suffix
+struct InterfaceCounter {
+  const char *name;
+  std::atomic<uint64_t> InterfaceCounters::*counter;
+};
+
+constexpr std::array<InterfaceCounter, 17> INTERFACE_COUNTERS{{
+    {"rx_packets", &InterfaceCounters::rx_packets},
+    {"rx_bytes", &InterfaceCounters::rx_bytes},
+    {"tx_packets", &InterfaceCounters::tx_packets},
+    {"tx_bytes", &InterfaceCounters::tx_bytes},
+    {"icmp_errors_sent", &InterfaceCounters::icmp_errors_sent},
+    {"icmp_errors_limited_per_source",
+     &InterfaceCounters::icmp_errors_limited_per_source},
+    {"icmp_errors_limited_global",
+     &InterfaceCounters::icmp_errors_limited_global},
+    {"arp_requests_sent", &InterfaceCounters::arp_requests_sent},
+    {"neighbor_solicitations_sent",
+     &InterfaceCounters::neighbor_solicitations_sent},
+    {"route_cache_hits", &InterfaceCounters::route_cache_hits},
+    {"route_cache_misses", &InterfaceCounters::route_cache_misses},
+    {"slow_path_punts", &InterfaceCounters::slow_path_punts},
+    {"xdp_forwarded", &InterfaceCounters::xdp_forwarded},
+    {"rx_csum_offloaded", &InterfaceCounters::rx_csum_offloaded},
+    {"rx_csum_verified", &InterfaceCounters::rx_csum_verified},
+    {"ip_fragmented", &InterfaceCounters::ip_fragmented},
+    {"ip_fragments_sent", &InterfaceCounters::ip_fragments_sent},
+}};
+
+} // namespace
+
+namespace detail {
+Page *current_page = init_page(local_page_memory);
+} // namespace detail
+
+bool init(const char *shm_name) {
+  int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  if (ftruncate(fd, sizeof(Page)) == -1) {
+    close(fd);
+    return false;
+  }
+
+  void *memory =
+      mmap(nullptr, sizeof(Page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+
+  detail::current_page = init_page(memory);
+  return true;
+}
+
+const Page *open_page(const char *shm_name) {
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd == -1) {
+    return nullptr;
+  }
+
+  struct stat st {};
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(Page)) {
+    close(fd);
+    return nullptr;
+  }
+
+  void *memory = mmap(nullptr, sizeof(Page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  auto *page = static_cast<const Page *>(memory);
+  if (page->magic != PAGE_MAGIC || page->version != PAGE_VERSION ||
+      page->num_interfaces != ROUTER_NUM_INTERFACES ||
+      page->num_drop_reasons != DROP_REASON_COUNT) {
+    munmap(memory, sizeof(Page));
+    return nullptr;
+  }
+  return page;
+}
+
+const char *to_string(DropReason reason) {
+  return DROP_REASON_NAMES[static_cast<size_t>(reason)];
+}
+
+void write_prometheus(FILE *out, const Page &page) {
+  for (const auto &[name, counter] : INTERFACE_COUNTERS) {
+    fprintf(out, "# TYPE router_%s_total counter\n", name);
+    for (uint32_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+      fprintf(out, "router_%s_total{interface=\"%u\"} %lu\n", name, i,
+              (page.interfaces[i].*counter).load(std::memory_order_relaxed));
+    }
+  }
+
+  fprintf(out, "# TYPE router_drops_total counter\n");
+  for (uint32_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+    for (size_t reason = 0; reason < DROP_REASON_COUNT; ++reason) {
+      fprintf(out,
+              "router_drops_total{interface=\"%u\",reason=\"%s\"} %lu\n", i,
+              DROP_REASON_NAMES[reason],
+              page.interfaces[i].drops[reason].load(std::memory_order_relaxed));
+    }
+  }
+
+  fprintf(out,
+          "# TYPE router_pending_packets gauge\n"
+          "router_pending_packets %lu\n",
+          page.pending_packets.load(std::memory_order_relaxed));
+}
+
+} // namespace router::stats
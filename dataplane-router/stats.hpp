@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.hpp"
+#include "lib_wrapper.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+namespace router::stats {
+
+// Reasons for which the router drops a frame
+enum class DropReason : size_t {
+  // The frame is too small for the headers it should contain
+  TRUNCATED,
+  BAD_CHECKSUM,
+  TTL_EXCEEDED,
+  NO_ROUTE,
+  UNKNOWN_ETHERTYPE,
+  UNKNOWN_ARP_OPCODE,
+  UNKNOWN_IP_PROTO,
+  UNSUPPORTED_ICMP_TYPE,
+  // No room was left to queue the packet while its next hop is resolved
+  // (with ARP or Neighbor Discovery)
+  ARP_QUEUE_FULL,
+  // The next hop was not resolved in time
+  ARP_TIMEOUT,
+  // An IPv6 header with another version, or whose payload is longer than the
+  // frame
+  BAD_IPV6_HEADER,
+  // The ring of the worker towards the slow path was full
+  SLOW_PATH_FULL,
+  // Denied by the ingress ACL
+  ACL_DENIED,
+  // The egress queue of the traffic class of the frame was full, or the
+  // frame, a super-frame, could not be held back by the shaper. The frame was
+  // already counted as sent.
+  EGRESS_QUEUE_FULL,
+  // Longer than the MTU of the output interface, with Don't Fragment set
+  FRAGMENTATION_NEEDED,
+  // The link layer failed to send the frame (e.g. ENOBUFS, or the interface
+  // going down). The frame was already counted as sent.
+  TX_FAILED,
+  COUNT,
+};
+
+constexpr size_t DROP_REASON_COUNT = static_cast<size_t>(DropReason::COUNT);
+
+// Counters of an interface, on their own cache lines so that the workers of
+// different interfaces do not contend on them
+struct alignas(64) InterfaceCounters {
+  std::atomic<uint64_t> rx_packets;
+  std::atomic<uint64_t> rx_bytes;
+  std::atomic<uint64_t> tx_packets;
+  std::atomic<uint64_t> tx_bytes;
+  std::atomic<uint64_t> icmp_errors_sent;
+  // ICMP errors not sent because of the rate limit of their destination, or
+  // of the global one (see IcmpRateLimiter)
+  std::atomic<uint64_t> icmp_errors_limited_per_source;
+  std::atomic<uint64_t> icmp_errors_limited_global;
+  std::atomic<uint64_t> arp_requests_sent;
+  std::atomic<uint64_t> neighbor_solicitations_sent;
+  // Lookups of the packets received on the interface served by the route
+  // cache of their worker, or not
+  std::atomic<uint64_t> route_cache_hits;
+  std::atomic<uint64_t> route_cache_misses;
+  // Frames handed by the workers to the slow path
+  std::atomic<uint64_t> slow_path_punts;
+  // Packets forwarded out of the interface by the XDP program (see
+  // XdpOffload), without reaching the router
+  std::atomic<uint64_t> xdp_forwarded;
+  // IPv4 packets received on the interface whose header checksum was already
+  // validated (by the NIC, see PACKET_AUXDATA), or verified by the router
+  std::atomic<uint64_t> rx_csum_offloaded;
+  std::atomic<uint64_t> rx_csum_verified;
+  // IPv4 packets fragmented to fit the MTU of the interface they are sent on,
+  // and the fragments sent for them
+  std::atomic<uint64_t> ip_fragmented;
+  std::atomic<uint64_t> ip_fragments_sent;
+  // Indexed by DropReason
+  std::array<std::atomic<uint64_t>, DROP_REASON_COUNT> drops;
+};
+
+constexpr uint32_t PAGE_MAGIC = 0x52535441; // "RSTA"
+constexpr uint32_t PAGE_VERSION = 11;
+
+/**
+ * @brief Layout of the statistics page, shared with the scrapers.
+ * All the counters are 64-bit values updated atomically in place, so a
+ * scraper only has to map the page read-only and read them, without any
+ * cooperation from the router.
+ */
+struct Page {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_interfaces;
+  uint32_t num_drop_reasons;
+  // Number of packets currently waiting for an ARP resolution
+  alignas(64) std::atomic<uint64_t> pending_packets;
+  std::array<InterfaceCounters, ROUTER_NUM_INTERFACES> interfaces;
+};
+
+/**
+ * @brief Move the statistics to the POSIX shared memory object `shm_name`
+ * (e.g. "/router-stats"), creating it if needed. Until this is called, or if
+ * it fails, the counters are kept in process memory.
+ *
+ * @return true if the shared memory page could be set up
+ */
+bool init(const char *shm_name);
+
+/**
+ * @brief Map read-only the statistics page of a running router, from the
+ * POSIX shared memory object `shm_name`
+ *
+ * @return The page, or nullptr if it cannot be mapped or has another layout
+ * than that of this build
+ */
+const Page *open_page(const char *shm_name);
+
+// Name of a drop reason, as a label of the Prometheus text format
+const char *to_string(DropReason reason);
+
+/**
+ * @brief Write the counters of a page in the Prometheus text format, labeled
+ * by interface, the drops also by reason, and the packets waiting for a
+ * resolution as a gauge
+ */
+void write_prometheus(FILE *out, const Page &page);
+
+namespace detail {
+extern Page *current_page;
+} // namespace detail
+
+/**
+ * @brief Get the page holding the counters
+ */
+inline Page &page() { return *detail::current_page; }
+
+inline InterfaceCounters &interface(iface_t interface) {
+  return page().interfaces[interface];
+}
+
+inline void add(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void count_drop(iface_t interface, DropReason reason) {
+  add(stats::interface(interface).drops[static_cast<size_t>(reason)]);
+}
+
+} // namespace router::stats
@@ -1,6 +1,9 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
+#include "lib_wrapper.hpp"
 #include "util.hpp"
+#include <random>
+#include <vector>
 
 #define FWD(...) static_cast<decltype(__VA_ARGS__) &&>(__VA_ARGS__)
 #define LIFT(...)                                                              \
@@ -113,4 +116,57 @@ TEST_CASE("Serialize Non-POD") {
       "serialize_tuple should not be invocable with Non-POD");
 }
 
-} // namespace serialization
\ No newline at end of file
+} // namespace serialization
+
+namespace internet_checksum {
+
+uint16_t vector_checksum(std::vector<uint8_t> &buffer, size_t offset,
+                         size_t length) {
+  return checksum(reinterpret_cast<uint16_t *>(buffer.data() + offset),
+                  length);
+}
+
+uint16_t scalar_checksum(std::vector<uint8_t> &buffer, size_t offset,
+                         size_t length) {
+  return checksum_scalar(reinterpret_cast<uint16_t *>(buffer.data() + offset),
+                         length);
+}
+
+TEST_CASE("Checksum::matches the scalar version") {
+  std::mt19937 rng{42};
+  std::uniform_int_distribution<int> byte{0, 0xff};
+  std::vector<uint8_t> buffer(65535 + 8);
+
+  // Cover the vector tails and the unaligned starts
+  for (size_t length : {0, 1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1399, 1400,
+                        9000, 65535}) {
+    for (size_t offset = 0; offset < 4; ++offset) {
+      for (auto &b : buffer) {
+        b = static_cast<uint8_t>(byte(rng));
+      }
+      CHECK(vector_checksum(buffer, offset, length) ==
+            scalar_checksum(buffer, offset, length));
+    }
+  }
+}
+
+TEST_CASE("Checksum::carries are folded") {
+  std::vector<uint8_t> buffer(65535, 0xff);
+
+  for (size_t length : {2, 32, 1400, 65534, 65535}) {
+    CHECK(vector_checksum(buffer, 0, length) ==
+          scalar_checksum(buffer, 0, length));
+  }
+}
+
+TEST_CASE("Checksum::valid IP header") {
+  // Header with its checksum field (0xb861) already filled in
+  std::vector<uint8_t> header{0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40,
+                              0x00, 0x40, 0x11, 0xb8, 0x61, 0xc0, 0xa8,
+                              0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+
+  CHECK(vector_checksum(header, 0, header.size()) == 0);
+  CHECK(scalar_checksum(header, 0, header.size()) == 0);
+}
+
+} // namespace internet_checksum
@@ -0,0 +1,166 @@
+#include "tx-queue.hpp"
+#include "logger.hpp"
+#include "stats.hpp"
+#include <cstring>
+
+namespace router {
+
+TxQueues::TxQueues(std::chrono::microseconds flush_deadline)
+    : flush_deadline_(flush_deadline) {
+  for (auto &queue : queues_) {
+    queue.copies.resize(QUEUE_SIZE * MAX_PACKET_LEN);
+  }
+}
+
+void TxQueues::set_egress_qos(const EgressQosConfig *config) {
+  flush();
+  schedulers_.clear();
+  queued_ = 0;
+  egress_qos_ = config;
+  if (config) {
+    schedulers_.assign(queues_.size(), EgressScheduler{*config});
+  }
+}
+
+void TxQueues::push(tcb::span<std::byte> frame, iface_t interface,
+                    const vnet_hdr *offload) {
+  check_deadline();
+  if (!schedulers_.empty()) {
+    schedule(reinterpret_cast<char *>(frame.data()), frame.size(), interface,
+             offload, false);
+    return;
+  }
+  enqueue(reinterpret_cast<char *>(frame.data()), frame.size(), interface,
+          offload);
+}
+
+void TxQueues::push_copy(tcb::span<const std::byte> frame, iface_t interface) {
+  check_deadline();
+  Queue &queue = queues_[interface];
+  if (frame.size() > MAX_PACKET_LEN) {
+    // Keep the frames of the interface in order
+    flush(interface);
+    char *data =
+        const_cast<char *>(reinterpret_cast<const char *>(frame.data()));
+    size_t length = frame.size();
+    send(interface, &data, &length, nullptr, 1);
+    return;
+  }
+  if (!schedulers_.empty()) {
+    schedule(const_cast<char *>(reinterpret_cast<const char *>(frame.data())),
+             frame.size(), interface, nullptr, true);
+    return;
+  }
+
+  std::byte *copy = queue.copies.data() + queue.count * MAX_PACKET_LEN;
+  std::memcpy(copy, frame.data(), frame.size());
+  enqueue(reinterpret_cast<char *>(copy), frame.size(), interface);
+}
+
+void TxQueues::enqueue(char *frame, size_t length, iface_t interface,
+                       const vnet_hdr *offload) {
+  Queue &queue = queues_[interface];
+  queue.frames[queue.count] = frame;
+  queue.lengths[queue.count] = length;
+  if (offload) {
+    // Whether the checksum was verified only matters on the way in
+    vnet_hdr &sent = queue.offloads[queue.count];
+    sent = *offload;
+    sent.flags &= ~VNET_HDR_F_DATA_VALID;
+    queue.has_offloads = true;
+  } else {
+    queue.offloads[queue.count] = {};
+  }
+  ++queue.count;
+  ++queued_;
+  if (queue.count == QUEUE_SIZE) {
+    flush(interface);
+  }
+}
+
+void TxQueues::schedule(char *frame, size_t length, iface_t interface,
+                        const vnet_hdr *offload, bool copy) {
+  EgressScheduler &scheduler = schedulers_[interface];
+  if (!scheduler.enqueue(frame, length, offload, copy)) {
+    flush_scheduled(interface);
+    if (!scheduler.enqueue(frame, length, offload, copy)) {
+      stats::count_drop(interface, stats::DropReason::EGRESS_QUEUE_FULL);
+      return;
+    }
+  }
+  ++queued_;
+}
+
+void TxQueues::flush() {
+  for (iface_t interface = 0; interface < queues_.size() && queued_ > 0;
+       ++interface) {
+    flush(interface);
+  }
+  // The frames held back by the shapers wait for the deadline again
+  if (queued_ > 0) {
+    oldest_ = Clock::now();
+  }
+}
+
+void TxQueues::flush(iface_t interface) {
+  if (!schedulers_.empty()) {
+    flush_scheduled(interface);
+    return;
+  }
+  Queue &queue = queues_[interface];
+  if (queue.count == 0) {
+    return;
+  }
+  send(interface, queue.frames.data(), queue.lengths.data(),
+       queue.has_offloads ? queue.offloads.data() : nullptr, queue.count);
+  queued_ -= queue.count;
+  queue.count = 0;
+  queue.has_offloads = false;
+}
+
+void TxQueues::flush_scheduled(iface_t interface) {
+  EgressScheduler &scheduler = schedulers_[interface];
+  if (scheduler.queued() == 0) {
+    return;
+  }
+  size_t before = scheduler.queued();
+  Queue &batch = queues_[interface];
+  Clock::time_point now = Clock::now();
+  while (size_t count = scheduler.dequeue(
+             batch.frames.data(), batch.lengths.data(), batch.offloads.data(),
+             QUEUE_SIZE, batch.has_offloads, now)) {
+    send(interface, batch.frames.data(), batch.lengths.data(),
+         batch.has_offloads ? batch.offloads.data() : nullptr, count);
+    batch.has_offloads = false;
+  }
+  if (size_t dropped = scheduler.retain()) {
+    stats::add(stats::interface(interface).drops[static_cast<size_t>(
+                   stats::DropReason::EGRESS_QUEUE_FULL)],
+               dropped);
+  }
+  queued_ -= before - scheduler.queued();
+}
+
+void TxQueues::send(iface_t interface, char *frames[], size_t lengths[],
+                    const vnet_hdr offloads[], size_t count) {
+  size_t sent = link_->send(interface, frames, lengths, offloads, count);
+  if (sent < count) {
+    stats::add(stats::interface(interface).drops[static_cast<size_t>(
+                   stats::DropReason::TX_FAILED)],
+               count - sent);
+    LOG_WARN("Failed to send {} of {} frames on interface {}", count - sent,
+             count, interface);
+  }
+}
+
+void TxQueues::check_deadline() {
+  Clock::time_point now = Clock::now();
+  if (queued_ > 0 && now - oldest_ >= flush_deadline_) {
+    flush();
+  }
+  if (queued_ == 0) {
+    oldest_ = now;
+  }
+}
+
+} // namespace router
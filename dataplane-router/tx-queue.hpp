@@ -0,0 +1,129 @@
+#pragma once
+
+#include "common.hpp"
+#include "egress-qos.hpp"
+#include "lib_wrapper.hpp"
+#include "link-backend.hpp"
+#include "span.hpp"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief Queues of the frames sent by a worker, one per output interface,
+ * each transmitted with a single send call of the link backend (one
+ * `sendmmsg`, or one kick of the TX ring).
+ *
+ * A queue is flushed when it fills up, when its oldest frame has waited for
+ * the flush deadline, and whenever `flush` is called, which the router does
+ * at the end of every burst, before the next receive can block. Like the
+ * route cache, the queues are not synchronized, each RX worker keeping its
+ * own. The queues holding frames with offload metadata (see
+ * `init_vnet_hdr`) are sent along with it.
+ *
+ * With the egress QoS enabled (see `set_egress_qos`), the frames of each
+ * interface are queued in its EgressScheduler instead, by traffic class, and
+ * a flush sends them in the order of the scheduling, in bursts of
+ * QUEUE_SIZE frames, for as long as the shaper lets them out. The frames
+ * held back are copied out of the buffers they were pushed from and wait for
+ * the next flush, the queues being flushed again once the deadline passes.
+ */
+class TxQueues {
+public:
+  // Frames held by the queue of an interface, the size of an RX burst
+  constexpr static size_t QUEUE_SIZE = 32;
+  constexpr static auto DEFAULT_FLUSH_DEADLINE = std::chrono::microseconds{50};
+
+  explicit TxQueues(
+      std::chrono::microseconds flush_deadline = DEFAULT_FLUSH_DEADLINE);
+
+  std::chrono::microseconds flush_deadline() const { return flush_deadline_; }
+  void set_flush_deadline(std::chrono::microseconds flush_deadline) {
+    flush_deadline_ = flush_deadline;
+  }
+
+  LinkBackend *link() const { return link_; }
+  /**
+   * @brief Send the frames through another link backend from now on, the
+   * frames already queued being flushed first. The backend must outlive the
+   * queues.
+   */
+  void set_link(LinkBackend *link) {
+    flush();
+    link_ = link;
+  }
+
+  const EgressQosConfig *egress_qos() const { return egress_qos_; }
+  /**
+   * @brief Schedule the frames of every interface with the egress QoS from
+   * now on, or send them in the order they are queued if `config` is
+   * nullptr. The frames already queued are flushed first. The configuration
+   * must outlive the queues.
+   */
+  void set_egress_qos(const EgressQosConfig *config);
+
+  /**
+   * @brief Queue a frame that stays valid, and is not modified, until the
+   * queues are flushed, such as a frame handled in its receive buffer. The
+   * frame is sent from where it is, without being copied, with the offload
+   * metadata given, e.g. the GSO type and size of a forwarded super-frame.
+   */
+  void push(tcb::span<std::byte> frame, iface_t interface,
+            const vnet_hdr *offload = nullptr);
+
+  /**
+   * @brief Queue a copy of a frame, whose buffer can be reused as soon as the
+   * call returns. The frames too large for the copy buffers are sent right
+   * away, after the frames already queued on the interface.
+   */
+  void push_copy(tcb::span<const std::byte> frame, iface_t interface);
+
+  // Send the frames queued on every interface
+  void flush();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Queue {
+    std::array<char *, QUEUE_SIZE> frames{};
+    std::array<size_t, QUEUE_SIZE> lengths{};
+    size_t count = 0;
+    // The offload metadata of the frames, only sent if one of them has some
+    std::array<vnet_hdr, QUEUE_SIZE> offloads{};
+    bool has_offloads = false;
+    // A buffer of MAX_PACKET_LEN bytes for each slot of the queue, holding
+    // the copied frames
+    std::vector<std::byte> copies;
+  };
+
+  void enqueue(char *frame, size_t length, iface_t interface,
+               const vnet_hdr *offload = nullptr);
+  // Queue a frame in the scheduler of its interface, sending what the shaper
+  // lets out to make room if its class is full, or dropping it otherwise
+  void schedule(char *frame, size_t length, iface_t interface,
+                const vnet_hdr *offload, bool copy);
+  void flush(iface_t interface);
+  void flush_scheduled(iface_t interface);
+  // Hand frames to the link, counting those it failed to send as dropped
+  void send(iface_t interface, char *frames[], size_t lengths[],
+            const vnet_hdr offloads[], size_t count);
+  // Flush the queues if the first frame queued since the last flush has
+  // waited for the deadline, and record its time if there is none
+  void check_deadline();
+
+  // With the egress QoS, the queues only hold the bursts being sent
+  std::array<Queue, ROUTER_NUM_INTERFACES> queues_;
+  // One per interface with the egress QoS, none otherwise
+  std::vector<EgressScheduler> schedulers_;
+  const EgressQosConfig *egress_qos_ = nullptr;
+  LinkBackend *link_ = &default_link_backend();
+  std::chrono::microseconds flush_deadline_;
+  // Time the first frame was queued since the last flush
+  Clock::time_point oldest_;
+  size_t queued_ = 0;
+};
+
+} // namespace router
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <time.h>
 #include <type_traits>
 
 namespace router::util {
@@ -64,4 +67,49 @@ constexpr int countl_one(T value) {
   return countl_zero(~value);
 }
 
+template <typename T, typename = std::enable_if_t<std::is_integral_v<T> &&
+                                                  std::is_unsigned_v<T>>>
+constexpr T next_power_of_two(T value) {
+  T power = 1;
+  while (power < value) {
+    power <<= 1;
+  }
+  return power;
+}
+
+/**
+ * @brief Coarse monotonic time in milliseconds, wrapping around every ~49
+ * days. Precise enough for the protocol timers and much cheaper to read than
+ * the regular clocks, so it can be read for every packet.
+ */
+inline uint32_t coarse_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<uint32_t>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// Wrap-safe comparison of two times given by coarse_now_ms
+constexpr bool is_before(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) < 0;
+}
+
+/**
+ * @brief Read the timestamp counter, for timing short sections of code. The
+ * read is serialized: neither the CPU nor the compiler can move the timed code
+ * across it. The monotonic clock, in nanoseconds, is used where there is no
+ * TSC.
+ */
+inline uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t low;
+  uint32_t high;
+  asm volatile("lfence\n\trdtsc\n\tlfence" : "=a"(low), "=d"(high)::"memory");
+  return uint64_t{high} << 32 | low;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
 } // namespace router::util
\ No newline at end of file
@@ -0,0 +1,530 @@
+#include "xdp-offload.hpp"
+#include "lib_wrapper.hpp"
+#include "logger.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <stdexcept>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace router {
+
+namespace {
+
+// Value of the /32 routes of the local addresses, which is never a next hop
+constexpr AdjacencyTable::index_t NO_NEXT_HOP = UINT32_MAX;
+
+// A key of the LPM trie
+struct RouteKey {
+  uint32_t prefix_len;
+  // In network byte order, as the trie compares the bytes in order
+  uint32_t address;
+};
+
+// The next hop of an adjacency, as read by the program
+struct NextHop {
+  std::array<uint8_t, 6> dest_mac;
+  std::array<uint8_t, 6> source_mac;
+  // The kernel index of the output interface, and its index in the router
+  uint32_t ifindex;
+  uint32_t interface;
+};
+
+// Offsets of the IPv4 header fields in a frame, read by the program
+constexpr int16_t ETHER_TYPE_OFFSET = 12;
+constexpr int16_t IP_OFFSET = ETHER_HDR_SIZE;
+constexpr int16_t IP_TTL_OFFSET = IP_OFFSET + 8;
+constexpr int16_t IP_CHECKSUM_OFFSET = IP_OFFSET + 10;
+constexpr int16_t IP_DEST_OFFSET = IP_OFFSET + 16;
+constexpr int16_t IP_END_OFFSET = IP_OFFSET + IP_HDR_SIZE;
+// A version 4 header of 5 words, without options
+constexpr int32_t IP_VERSION_IHL = 0x45;
+
+long bpf(int cmd, union bpf_attr &attr) {
+  return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+[[noreturn]] void throw_errno(const std::string &what) {
+  throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+int create_map(bpf_map_type type, const char *name, uint32_t key_size,
+               uint32_t value_size, uint32_t max_entries, uint32_t flags) {
+  union bpf_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  attr.map_flags = flags;
+  std::strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+  int fd = static_cast<int>(bpf(BPF_MAP_CREATE, attr));
+  if (fd == -1) {
+    throw_errno(std::string{"Cannot create the BPF map "} + name);
+  }
+  return fd;
+}
+
+bool update_element(int fd, const void *key, const void *value) {
+  union bpf_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = reinterpret_cast<uintptr_t>(key);
+  attr.value = reinterpret_cast<uintptr_t>(value);
+  attr.flags = BPF_ANY;
+  return bpf(BPF_MAP_UPDATE_ELEM, attr) == 0;
+}
+
+// An element that is already missing counts as deleted
+bool delete_element(int fd, const void *key) {
+  union bpf_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = reinterpret_cast<uintptr_t>(key);
+  return bpf(BPF_MAP_DELETE_ELEM, attr) == 0 || errno == ENOENT;
+}
+
+bool lookup_element(int fd, const void *key, void *value) {
+  union bpf_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = reinterpret_cast<uintptr_t>(key);
+  attr.value = reinterpret_cast<uintptr_t>(value);
+  return bpf(BPF_MAP_LOOKUP_ELEM, attr) == 0;
+}
+
+/**
+ * @brief Get the number of possible CPUs, which is the number of values of
+ * the elements of a per-CPU map, from the highest CPU of the list in
+ * /sys/devices/system/cpu/possible (e.g. "0-7").
+ */
+size_t possible_cpu_count() {
+  std::ifstream file("/sys/devices/system/cpu/possible");
+  std::string list;
+  if (!std::getline(file, list)) {
+    throw std::runtime_error("Cannot read the list of possible CPUs");
+  }
+  size_t last = list.find_last_of(",-");
+  return std::stoul(last == std::string::npos ? list : list.substr(last + 1)) +
+         1;
+}
+
+/**
+ * @brief Builder of a BPF program, whose conditional jumps go forward to
+ * labels bound later.
+ */
+class ProgramBuilder {
+public:
+  enum Label { PASS, CHECKSUM_UPDATED, REDIRECT, LABEL_COUNT };
+
+  void emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    bpf_insn insn{};
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    insns_.push_back(insn);
+  }
+
+  void mov(uint8_t dst, uint8_t src) {
+    emit(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+  }
+  void mov_imm(uint8_t dst, int32_t imm) {
+    emit(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+  }
+  // Keep the low 32 bits of a register
+  void zero_extend(uint8_t reg) {
+    emit(BPF_ALU | BPF_MOV | BPF_X, reg, reg, 0, 0);
+  }
+  void alu(uint8_t op, uint8_t dst, uint8_t src) {
+    emit(BPF_ALU64 | op | BPF_X, dst, src, 0, 0);
+  }
+  void alu_imm(uint8_t op, uint8_t dst, int32_t imm) {
+    emit(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+  }
+  void load(uint8_t size, uint8_t dst, uint8_t src, int16_t off) {
+    emit(BPF_LDX | BPF_MEM | size, dst, src, off, 0);
+  }
+  void store(uint8_t size, uint8_t dst, int16_t off, uint8_t src) {
+    emit(BPF_STX | BPF_MEM | size, dst, src, off, 0);
+  }
+  void store_imm(uint8_t size, uint8_t dst, int16_t off, int32_t imm) {
+    emit(BPF_ST | BPF_MEM | size, dst, 0, off, imm);
+  }
+  // Load the address of a map, a double-wide instruction
+  void load_map(uint8_t dst, int fd) {
+    emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    emit(0, 0, 0, 0, 0);
+  }
+  void call(int32_t function) { emit(BPF_JMP | BPF_CALL, 0, 0, 0, function); }
+  void exit() { emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0); }
+
+  // Jump to a label if `dst <op> imm`
+  void jump_if(uint8_t op, uint8_t dst, int32_t imm, Label label) {
+    fixups_.push_back({insns_.size(), label});
+    emit(BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+  }
+  // Jump to a label if `dst <op> src`
+  void jump_if_reg(uint8_t op, uint8_t dst, uint8_t src, Label label) {
+    fixups_.push_back({insns_.size(), label});
+    emit(BPF_JMP | op | BPF_X, dst, src, 0, 0);
+  }
+  void bind(Label label) { labels_[label] = insns_.size(); }
+
+  std::vector<bpf_insn> finish() {
+    for (auto [at, label] : fixups_) {
+      insns_[at].off = static_cast<int16_t>(labels_[label] - at - 1);
+    }
+    return std::move(insns_);
+  }
+
+private:
+  std::vector<bpf_insn> insns_{};
+  std::vector<std::pair<size_t, Label>> fixups_{};
+  std::array<size_t, LABEL_COUNT> labels_{};
+};
+
+/**
+ * @brief Build the forwarding program. The registers r6 to r9 are kept across
+ * the helper calls: r8 holds the start of the frame, r9 the next hop.
+ */
+std::vector<bpf_insn> build_program(int routes_fd, int next_hops_fd,
+                                    int counters_fd) {
+  using Label = ProgramBuilder::Label;
+  ProgramBuilder p;
+
+  // The Ethernet and IPv4 headers must be in the frame
+  p.load(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(xdp_md, data));
+  p.load(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(xdp_md, data_end));
+  p.mov(BPF_REG_4, BPF_REG_2);
+  p.alu_imm(BPF_ADD, BPF_REG_4, IP_END_OFFSET);
+  p.jump_if_reg(BPF_JGT, BPF_REG_4, BPF_REG_3, Label::PASS);
+  p.mov(BPF_REG_8, BPF_REG_2);
+
+  // An IPv4 header without options, whose TTL does not expire here. The
+  // constants are compared to the fields as loaded, in network byte order.
+  p.load(BPF_H, BPF_REG_4, BPF_REG_8, ETHER_TYPE_OFFSET);
+  p.jump_if(BPF_JNE, BPF_REG_4, util::hton(ETHERTYPE_IP), Label::PASS);
+  p.load(BPF_B, BPF_REG_4, BPF_REG_8, IP_OFFSET);
+  p.jump_if(BPF_JNE, BPF_REG_4, IP_VERSION_IHL, Label::PASS);
+  p.load(BPF_B, BPF_REG_4, BPF_REG_8, IP_TTL_OFFSET);
+  p.jump_if(BPF_JLE, BPF_REG_4, 1, Label::PASS);
+
+  // The one's complement sum of the header, added as 32-bit words and folded
+  // to 16 bits, is 0xffff when the checksum is valid
+  p.mov_imm(BPF_REG_4, 0);
+  for (int16_t offset = IP_OFFSET; offset < IP_END_OFFSET;
+       offset += 4) {
+    p.load(BPF_W, BPF_REG_5, BPF_REG_8, offset);
+    p.alu(BPF_ADD, BPF_REG_4, BPF_REG_5);
+  }
+  for (int i = 0; i < 2; ++i) {
+    p.mov(BPF_REG_5, BPF_REG_4);
+    p.alu_imm(BPF_RSH, BPF_REG_5, 32);
+    p.zero_extend(BPF_REG_4);
+    p.alu(BPF_ADD, BPF_REG_4, BPF_REG_5);
+  }
+  for (int i = 0; i < 2; ++i) {
+    p.mov(BPF_REG_5, BPF_REG_4);
+    p.alu_imm(BPF_RSH, BPF_REG_5, 16);
+    p.alu_imm(BPF_AND, BPF_REG_4, 0xffff);
+    p.alu(BPF_ADD, BPF_REG_4, BPF_REG_5);
+  }
+  p.jump_if(BPF_JNE, BPF_REG_4, 0xffff, Label::PASS);
+
+  // The route of the destination, in a key on the stack
+  p.store_imm(BPF_W, BPF_REG_10, -8, 32);
+  p.load(BPF_W, BPF_REG_4, BPF_REG_8, IP_DEST_OFFSET);
+  p.store(BPF_W, BPF_REG_10, -4, BPF_REG_4);
+  p.load_map(BPF_REG_1, routes_fd);
+  p.mov(BPF_REG_2, BPF_REG_10);
+  p.alu_imm(BPF_ADD, BPF_REG_2, -8);
+  p.call(BPF_FUNC_map_lookup_elem);
+  p.jump_if(BPF_JEQ, BPF_REG_0, 0, Label::PASS);
+
+  // Its next hop, missing for the local addresses, the next hop groups and
+  // the adjacencies not resolved
+  p.load(BPF_W, BPF_REG_4, BPF_REG_0, 0);
+  p.store(BPF_W, BPF_REG_10, -12, BPF_REG_4);
+  p.load_map(BPF_REG_1, next_hops_fd);
+  p.mov(BPF_REG_2, BPF_REG_10);
+  p.alu_imm(BPF_ADD, BPF_REG_2, -12);
+  p.call(BPF_FUNC_map_lookup_elem);
+  p.jump_if(BPF_JEQ, BPF_REG_0, 0, Label::PASS);
+  p.mov(BPF_REG_9, BPF_REG_0);
+
+  // The destination and source MAC addresses
+  for (int16_t offset = 0; offset < 12; offset += 4) {
+    p.load(BPF_W, BPF_REG_4, BPF_REG_9, offset);
+    p.store(BPF_W, BPF_REG_8, offset, BPF_REG_4);
+  }
+
+  // Decrement the TTL, updating the checksum as ip_decrease_ttl does in Linux
+  p.load(BPF_H, BPF_REG_4, BPF_REG_8, IP_CHECKSUM_OFFSET);
+  p.alu_imm(BPF_ADD, BPF_REG_4, util::hton(uint16_t{0x0100}));
+  p.jump_if(BPF_JLT, BPF_REG_4, 0xffff, Label::CHECKSUM_UPDATED);
+  p.alu_imm(BPF_ADD, BPF_REG_4, 1);
+  p.bind(Label::CHECKSUM_UPDATED);
+  p.store(BPF_H, BPF_REG_8, IP_CHECKSUM_OFFSET, BPF_REG_4);
+  p.load(BPF_B, BPF_REG_4, BPF_REG_8, IP_TTL_OFFSET);
+  p.alu_imm(BPF_SUB, BPF_REG_4, 1);
+  p.store(BPF_B, BPF_REG_8, IP_TTL_OFFSET, BPF_REG_4);
+
+  // Count the packet on its output interface, the counters being per CPU
+  p.load(BPF_W, BPF_REG_4, BPF_REG_9, offsetof(NextHop, interface));
+  p.store(BPF_W, BPF_REG_10, -16, BPF_REG_4);
+  p.load_map(BPF_REG_1, counters_fd);
+  p.mov(BPF_REG_2, BPF_REG_10);
+  p.alu_imm(BPF_ADD, BPF_REG_2, -16);
+  p.call(BPF_FUNC_map_lookup_elem);
+  p.jump_if(BPF_JEQ, BPF_REG_0, 0, Label::REDIRECT);
+  p.load(BPF_DW, BPF_REG_4, BPF_REG_0, 0);
+  p.alu_imm(BPF_ADD, BPF_REG_4, 1);
+  p.store(BPF_DW, BPF_REG_0, 0, BPF_REG_4);
+  p.bind(Label::REDIRECT);
+
+  // return bpf_redirect(next_hop->ifindex, 0);
+  p.load(BPF_W, BPF_REG_1, BPF_REG_9, offsetof(NextHop, ifindex));
+  p.mov_imm(BPF_REG_2, 0);
+  p.call(BPF_FUNC_redirect);
+  p.exit();
+
+  p.bind(Label::PASS);
+  p.mov_imm(BPF_REG_0, XDP_PASS);
+  p.exit();
+  return p.finish();
+}
+
+int load_program(const std::vector<bpf_insn> &program) {
+  std::vector<char> log(1 << 16);
+  union bpf_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = reinterpret_cast<uintptr_t>(program.data());
+  attr.insn_cnt = static_cast<uint32_t>(program.size());
+  attr.license = reinterpret_cast<uintptr_t>("GPL");
+  attr.log_buf = reinterpret_cast<uintptr_t>(log.data());
+  attr.log_size = static_cast<uint32_t>(log.size());
+  attr.log_level = 1;
+  std::strncpy(attr.prog_name, "router_forward", sizeof(attr.prog_name) - 1);
+  int fd = static_cast<int>(bpf(BPF_PROG_LOAD, attr));
+  if (fd == -1) {
+    throw_errno(std::string{"Cannot load the XDP program ("} + log.data() +
+                ")");
+  }
+  return fd;
+}
+
+} // namespace
+
+XdpOffload::XdpOffload(
+    const AdjacencyTable &adjacencies,
+    const std::array<uint32_t, ROUTER_NUM_INTERFACES> &local_addresses,
+    bool generic)
+    : adjacencies_(adjacencies), local_addresses_(local_addresses),
+      possible_cpus_(possible_cpu_count()) {
+  try {
+    // The LPM tries cannot be preallocated, and the maps only grow with the
+    // tables of the router
+    routes_fd_ = create_map(BPF_MAP_TYPE_LPM_TRIE, "router_routes",
+                            sizeof(RouteKey), sizeof(AdjacencyTable::index_t),
+                            MAX_ROUTES, BPF_F_NO_PREALLOC);
+    next_hops_fd_ = create_map(BPF_MAP_TYPE_HASH, "router_next_hops",
+                               sizeof(AdjacencyTable::index_t), sizeof(NextHop),
+                               MAX_NEXT_HOPS, BPF_F_NO_PREALLOC);
+    counters_fd_ = create_map(BPF_MAP_TYPE_PERCPU_ARRAY, "router_counters",
+                              sizeof(uint32_t), sizeof(uint64_t),
+                              ROUTER_NUM_INTERFACES, 0);
+
+    int program_fd =
+        load_program(build_program(routes_fd_, next_hops_fd_, counters_fd_));
+    // The links detach the program when they are closed
+    for (size_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+      union bpf_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.link_create.prog_fd = program_fd;
+      attr.link_create.target_ifindex = get_interface_ifindex(i);
+      attr.link_create.attach_type = BPF_XDP;
+      attr.link_create.flags = generic ? XDP_FLAGS_SKB_MODE : 0;
+      int link_fd = static_cast<int>(bpf(BPF_LINK_CREATE, attr));
+      if (link_fd == -1) {
+        int error = errno;
+        close(program_fd);
+        errno = error;
+        throw_errno("Cannot attach the XDP program to interface " +
+                    std::to_string(i));
+      }
+      link_fds_.push_back(link_fd);
+    }
+    // Held by the links from now on
+    close(program_fd);
+  } catch (...) {
+    close_all();
+    throw;
+  }
+  thread_ = std::thread(&XdpOffload::run, this);
+}
+
+XdpOffload::~XdpOffload() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+    wake_.notify_one();
+  }
+  thread_.join();
+  close_all();
+}
+
+void XdpOffload::close_all() {
+  for (int fd : link_fds_) {
+    close(fd);
+  }
+  link_fds_.clear();
+  for (int *fd : {&routes_fd_, &next_hops_fd_, &counters_fd_}) {
+    if (*fd != -1) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+void XdpOffload::update_routes(
+    tcb::span<const RoutingTable::Prefix> prefixes) {
+  // The routes may use the slots of reclaimed adjacencies, whose previous
+  // next hops must be out of the map before the trie points to them again
+  {
+    std::lock_guard lock(mutex_);
+    if (!disabled_) {
+      sync_adjacencies();
+    }
+  }
+
+  auto key_of = [](uint32_t path, uint8_t prefix_len) {
+    return uint64_t{path} << 8 | prefix_len;
+  };
+  std::unordered_map<uint64_t, AdjacencyTable::index_t> routes;
+  routes.reserve(prefixes.size() + local_addresses_.size());
+  for (const auto &prefix : prefixes) {
+    routes[key_of(prefix.path, prefix.prefix_len)] = prefix.value;
+  }
+  // The packets for the router are always passed, whatever the routes
+  for (uint32_t address : local_addresses_) {
+    routes[key_of(util::ntoh(address), 32)] = NO_NEXT_HOP;
+  }
+
+  bool synced = true;
+  for (auto it = synced_routes_.begin();
+       synced && it != synced_routes_.end();) {
+    if (routes.count(it->first)) {
+      ++it;
+      continue;
+    }
+    RouteKey key{static_cast<uint32_t>(it->first & 0xff),
+                 util::hton(static_cast<uint32_t>(it->first >> 8))};
+    synced = delete_element(routes_fd_, &key);
+    it = synced ? synced_routes_.erase(it) : it;
+  }
+  for (auto it = routes.begin(); synced && it != routes.end(); ++it) {
+    auto synced_route = synced_routes_.find(it->first);
+    if (synced_route != synced_routes_.end() &&
+        synced_route->second == it->second) {
+      continue;
+    }
+    RouteKey key{static_cast<uint32_t>(it->first & 0xff),
+                 util::hton(static_cast<uint32_t>(it->first >> 8))};
+    synced = update_element(routes_fd_, &key, &it->second);
+    if (synced) {
+      synced_routes_[it->first] = it->second;
+    }
+  }
+
+  if (!synced) {
+    LOG_ERROR("Cannot update the XDP routes: {}. Disabling the offload",
+              std::strerror(errno));
+    std::lock_guard lock(mutex_);
+    disable();
+  }
+}
+
+void XdpOffload::disable() {
+  disabled_ = true;
+  for (size_t i = 0; i < synced_adjacencies_.size(); ++i) {
+    auto index = static_cast<AdjacencyTable::index_t>(i);
+    if (synced_adjacencies_[i].offloaded) {
+      delete_element(next_hops_fd_, &index);
+    }
+  }
+  synced_adjacencies_.clear();
+}
+
+void XdpOffload::sync_adjacencies() {
+  uint32_t now = util::coarse_now_ms();
+  synced_adjacencies_.resize(adjacencies_.size());
+  std::array<std::byte, ETHER_HDR_SIZE> header;
+  for (size_t i = 0; i < synced_adjacencies_.size(); ++i) {
+    auto index = static_cast<AdjacencyTable::index_t>(i);
+    auto &synced = synced_adjacencies_[i];
+    if (!adjacencies_.rewrite(index, header, now)) {
+      // Passed to the router until it resolves the adjacency again
+      if (synced.offloaded && delete_element(next_hops_fd_, &index)) {
+        synced.offloaded = false;
+      }
+      continue;
+    }
+
+    std::array<uint8_t, 12> macs;
+    std::memcpy(macs.data(), header.data(), macs.size());
+    iface_t interface = adjacencies_.interface(index);
+    if (synced.offloaded && synced.macs == macs &&
+        synced.interface == interface) {
+      continue;
+    }
+    NextHop next_hop{};
+    std::copy_n(macs.begin(), 6, next_hop.dest_mac.begin());
+    std::copy_n(macs.begin() + 6, 6, next_hop.source_mac.begin());
+    next_hop.interface = interface;
+    next_hop.ifindex = get_interface_ifindex(next_hop.interface);
+    if (update_element(next_hops_fd_, &index, &next_hop)) {
+      synced = {true, macs, interface};
+    } else {
+      LOG_WARN("Cannot offload adjacency {}: {}", index, std::strerror(errno));
+    }
+  }
+}
+
+void XdpOffload::sync_counters() {
+  std::vector<uint64_t> values(possible_cpus_);
+  for (uint32_t i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
+    if (!lookup_element(counters_fd_, &i, values.data())) {
+      continue;
+    }
+    uint64_t forwarded = 0;
+    for (uint64_t value : values) {
+      forwarded += value;
+    }
+    stats::add(stats::interface(i).xdp_forwarded, forwarded - forwarded_[i]);
+    forwarded_[i] = forwarded;
+  }
+}
+
+void XdpOffload::run() {
+  std::unique_lock lock(mutex_);
+  while (!stopping_) {
+    if (!disabled_) {
+      sync_adjacencies();
+    }
+    sync_counters();
+    wake_.wait_for(lock, SYNC_INTERVAL);
+  }
+}
+
+} // namespace router
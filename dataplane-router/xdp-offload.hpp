@@ -0,0 +1,128 @@
+#pragma once
+
+#include "adjacency-table.hpp"
+#include "common.hpp"
+#include "routing-table.hpp"
+#include "span.hpp"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace router {
+
+/**
+ * @brief Forwarding of the plain IPv4 packets by an XDP program, in the
+ * driver of the interfaces, before they reach the router.
+ *
+ * The program looks up the destination of a packet in a BPF LPM trie mirroring
+ * the routing table, then the resolved next hop of the route in a hash map
+ * mirroring the adjacency table, rewrites the Ethernet header, decrements the
+ * TTL (updating the checksum incrementally) and redirects the frame to its
+ * output interface. Everything else is passed to the stack, and so to the
+ * router: the frames other than IPv4, the packets with IP options, a bad
+ * checksum or an expiring TTL, those for the router itself (whose addresses
+ * are /32 routes without a next hop), and those whose next hop is not
+ * resolved, or is a next hop group (ECMP), which is selected by the router.
+ *
+ * The routes are updated by the routing table through its observer, only the
+ * changed prefixes being written to the trie. The next hops are updated by a
+ * background thread, which scans the adjacencies periodically: an adjacency
+ * whose header went stale, or that was reclaimed, is removed from the map, so
+ * that its packets go through the router again, which refreshes its ARP entry.
+ * A header changed by an ARP reply is written on the next scan. The same thread
+ * adds the number of packets forwarded by the program to the statistics.
+ *
+ * The program is written directly in BPF instructions and loaded with the bpf
+ * system call, like the one of the AF_XDP sockets, with which it cannot be
+ * combined.
+ */
+class XdpOffload {
+public:
+  // Maximum number of prefixes in the trie
+  constexpr static uint32_t MAX_ROUTES = uint32_t{1} << 20;
+  // Maximum number of next hops in the map
+  constexpr static uint32_t MAX_NEXT_HOPS = uint32_t{1} << 20;
+  // Interval between two scans of the adjacencies
+  constexpr static std::chrono::milliseconds SYNC_INTERVAL{100};
+
+  /**
+   * @brief Load the program and its maps, attach it to all the interfaces and
+   * start the background thread. The routes are only forwarded once given to
+   * `update_routes`.
+   *
+   * @param local_addresses The addresses of the interfaces, in network byte
+   * order, whose packets are always passed to the router
+   * @param generic Attach the program in generic (SKB) mode, for the drivers
+   * without native XDP support
+   *
+   * @throws std::runtime_error if the maps or the program cannot be created or
+   * attached, e.g. without CAP_BPF and CAP_NET_ADMIN
+   */
+  XdpOffload(const AdjacencyTable &adjacencies,
+             const std::array<uint32_t, ROUTER_NUM_INTERFACES> &local_addresses,
+             bool generic = false);
+  // Detaches the program
+  ~XdpOffload();
+
+  XdpOffload(const XdpOffload &) = delete;
+  XdpOffload &operator=(const XdpOffload &) = delete;
+
+  /**
+   * @brief Mirror the prefixes of the routing table in the trie, as the
+   * observer of the table (the calls being serialized by its writers). If the
+   * trie cannot be updated, the offload is disabled, all the packets being
+   * passed to the router from then on.
+   */
+  void update_routes(tcb::span<const RoutingTable::Prefix> prefixes);
+
+private:
+  // The Ethernet header and the interface of an adjacency as last written to
+  // the map, if any
+  struct SyncedAdjacency {
+    bool offloaded = false;
+    std::array<uint8_t, 12> macs{};
+    iface_t interface = 0;
+  };
+
+  // Close the links, detaching the program, and the maps
+  void close_all();
+  // Remove all the next hops, so that the program passes every packet. Must
+  // be called with mutex_ held.
+  void disable();
+  void sync_adjacencies();
+  // Add the packets forwarded by the program since the last call to the
+  // statistics of their output interface
+  void sync_counters();
+  void run();
+
+  const AdjacencyTable &adjacencies_;
+  std::array<uint32_t, ROUTER_NUM_INTERFACES> local_addresses_;
+  int routes_fd_ = -1;
+  int next_hops_fd_ = -1;
+  int counters_fd_ = -1;
+  std::vector<int> link_fds_{};
+  // Number of values of the per-CPU counters
+  size_t possible_cpus_;
+
+  // The trie as last written by update_routes, keyed by prefix and length
+  std::unordered_map<uint64_t, AdjacencyTable::index_t> synced_routes_{};
+  // Only accessed by the background thread
+  std::array<uint64_t, ROUTER_NUM_INTERFACES> forwarded_{};
+
+  std::mutex mutex_{};
+  // The map of the next hops as last written, guarded by mutex_
+  std::vector<SyncedAdjacency> synced_adjacencies_{};
+  // Set once the trie failed to be updated, guarded by mutex_
+  bool disabled_ = false;
+  bool stopping_ = false;
+  std::condition_variable wake_{};
+  std::thread thread_{};
+};
+
+} // namespace router
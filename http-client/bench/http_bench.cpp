@@ -0,0 +1,565 @@
+// Measures the throughput, latency and allocations of http::Client against
+// an in-process mock server on the loopback, so that the results depend on
+// the client rather than on a remote server. The hardware counters of the
+// client (cycles, instructions per cycle, L1D and LLC misses, branch misses
+// and dTLB misses) are reported per request as well, '-' when they cannot be
+// counted.
+//
+// Usage: http_bench [requests] [concurrency]
+
+#include "http/async_client.hpp"
+#include "http/client.hpp"
+#include "http/connection_pool.hpp"
+#include "http/event_loop.hpp"
+#include "http/executor.hpp"
+#include "pmu_counters.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// The allocations of the current thread, the client running on the thread
+// measuring it in every mode
+namespace {
+thread_local size_t allocations = 0;
+} // namespace
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// First opened once the mock server runs, so that only the threads of the
+// client are counted
+PmuCounters &pmu_counters() {
+  static PmuCounters counters;
+  return counters;
+}
+
+constexpr size_t MOCK_CHUNK_SIZE = 8 << 10;
+
+[[noreturn]] void fail(const char *what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Answers GET /body?size=N&chunked=0|1&delay_us=D with N bytes, with a
+// Content-Length or in chunks, D microseconds after the request. A single
+// thread serves every connection through epoll.
+class MockServer {
+public:
+  MockServer() : body_(MAX_BODY_SIZE, 'x') {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+      fail("socket");
+    }
+    int yes = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), length) < 0 ||
+        listen(listen_fd_, SOMAXCONN) < 0 ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&address),
+                    &length) < 0) {
+      fail("listen");
+    }
+    port_ = ntohs(address.sin_port);
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || stop_fd_ < 0) {
+      fail("epoll");
+    }
+    watch(listen_fd_, EPOLLIN, EPOLL_CTL_ADD);
+    watch(stop_fd_, EPOLLIN, EPOLL_CTL_ADD);
+
+    thread_ = std::thread([this] { serve(); });
+  }
+
+  ~MockServer() {
+    eventfd_write(stop_fd_, 1);
+    thread_.join();
+    for (auto &[fd, connection] : connections_) {
+      close(fd);
+    }
+    close(listen_fd_);
+    close(stop_fd_);
+    close(epoll_fd_);
+  }
+
+  MockServer(const MockServer &) = delete;
+  MockServer &operator=(const MockServer &) = delete;
+
+  uint16_t port() const { return port_; }
+
+  static constexpr size_t MAX_BODY_SIZE = 1 << 20;
+
+private:
+  struct Pending {
+    Clock::time_point ready;
+    std::string response;
+  };
+
+  struct Connection {
+    std::string input{};
+    // The responses waiting for their delay, in the order of the requests
+    std::deque<Pending> pending{};
+    std::string output{};
+    size_t written{};
+  };
+
+  void watch(int fd, uint32_t events, int operation) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd_, operation, fd, &event);
+  }
+
+  static size_t parameter(std::string_view target, std::string_view name) {
+    const auto query = target.find('?');
+    if (query == std::string_view::npos) {
+      return 0;
+    }
+    auto rest = target.substr(query + 1);
+    while (!rest.empty()) {
+      const auto end = std::min(rest.find('&'), rest.size());
+      const auto pair = rest.substr(0, end);
+      if (pair.starts_with(name) && pair.size() > name.size() &&
+          pair[name.size()] == '=') {
+        size_t value = 0;
+        const auto digits = pair.substr(name.size() + 1);
+        std::from_chars(digits.data(), digits.data() + digits.size(), value);
+        return value;
+      }
+      rest.remove_prefix(std::min(end + 1, rest.size()));
+    }
+    return 0;
+  }
+
+  std::string respond(std::string_view target) const {
+    const auto size = std::min(parameter(target, "size"), MAX_BODY_SIZE);
+    const auto body = std::string_view(body_).substr(0, size);
+
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+    if (parameter(target, "chunked") == 0) {
+      response += "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+      response += body;
+      return response;
+    }
+
+    response += "Transfer-Encoding: chunked\r\n\r\n";
+    for (size_t offset = 0; offset < body.size(); offset += MOCK_CHUNK_SIZE) {
+      const auto chunk = body.substr(offset, MOCK_CHUNK_SIZE);
+      char size_line[32];
+      const int length =
+          std::snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk.size());
+      response.append(size_line, length);
+      response += chunk;
+      response += "\r\n";
+    }
+    response += "0\r\n\r\n";
+    return response;
+  }
+
+  void accept_connections() {
+    while (true) {
+      int fd = accept4(listen_fd_, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      int yes = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+      connections_.emplace(fd, Connection{});
+      watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+  }
+
+  void drop(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections_.erase(fd);
+  }
+
+  // false once the connection is closed
+  bool read_requests(int fd, Connection &connection) {
+    char buffer[16 << 10];
+    while (true) {
+      ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+      if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+        return false;
+      }
+      if (bytes < 0) {
+        break;
+      }
+      connection.input.append(buffer, bytes);
+    }
+
+    // The benchmark only sends requests without a body
+    size_t end;
+    while ((end = connection.input.find("\r\n\r\n")) != std::string::npos) {
+      std::string_view line(connection.input);
+      line = line.substr(0, line.find("\r\n"));
+      const auto target_start = line.find(' ') + 1;
+      const auto target =
+          line.substr(target_start, line.find(' ', target_start) -
+                                        target_start);
+      connection.pending.push_back(
+          {Clock::now() +
+               std::chrono::microseconds(parameter(target, "delay_us")),
+           respond(target)});
+      connection.input.erase(0, end + 4);
+    }
+    return true;
+  }
+
+  // false once the connection is closed
+  bool write_responses(int fd, Connection &connection, Clock::time_point now) {
+    while (!connection.pending.empty() &&
+           connection.pending.front().ready <= now) {
+      connection.output += connection.pending.front().response;
+      connection.pending.pop_front();
+    }
+
+    while (connection.written < connection.output.size()) {
+      ssize_t bytes = send(fd, connection.output.data() + connection.written,
+                           connection.output.size() - connection.written,
+                           MSG_NOSIGNAL);
+      if (bytes < 0) {
+        if (errno != EAGAIN) {
+          return false;
+        }
+        break;
+      }
+      connection.written += bytes;
+    }
+    if (connection.written == connection.output.size()) {
+      connection.output.clear();
+      connection.written = 0;
+    }
+    watch(fd, connection.output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT,
+          EPOLL_CTL_MOD);
+    return true;
+  }
+
+  void serve() {
+    std::vector<epoll_event> events(64);
+    while (true) {
+      // Until the first delayed response is due
+      int timeout_ms = -1;
+      const auto now = Clock::now();
+      for (const auto &[fd, connection] : connections_) {
+        if (!connection.pending.empty()) {
+          const auto due = std::chrono::ceil<std::chrono::milliseconds>(
+              connection.pending.front().ready - now);
+          const int ms = static_cast<int>(std::max<int64_t>(due.count(), 0));
+          timeout_ms = timeout_ms < 0 ? ms : std::min(timeout_ms, ms);
+        }
+      }
+
+      int ready = epoll_wait(epoll_fd_, events.data(),
+                             static_cast<int>(events.size()), timeout_ms);
+      if (ready < 0 && errno != EINTR) {
+        fail("epoll_wait");
+      }
+
+      for (int i = 0; i < ready; ++i) {
+        const int fd = events[i].data.fd;
+        if (fd == stop_fd_) {
+          return;
+        }
+        if (fd == listen_fd_) {
+          accept_connections();
+          continue;
+        }
+        auto it = connections_.find(fd);
+        if (it == connections_.end()) {
+          continue;
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+            !read_requests(fd, it->second)) {
+          drop(fd);
+        }
+      }
+
+      const auto after = Clock::now();
+      std::vector<int> closed;
+      for (auto &[fd, connection] : connections_) {
+        if (!write_responses(fd, connection, after)) {
+          closed.push_back(fd);
+        }
+      }
+      for (int fd : closed) {
+        drop(fd);
+      }
+    }
+  }
+
+  std::string body_;
+  int listen_fd_{-1};
+  int epoll_fd_{-1};
+  int stop_fd_{-1};
+  uint16_t port_{};
+  std::unordered_map<int, Connection> connections_{};
+  std::thread thread_{};
+};
+
+struct Scenario {
+  size_t size;
+  bool chunked;
+  std::chrono::microseconds delay;
+};
+
+struct Measurement {
+  std::vector<std::chrono::microseconds> latencies{};
+  Clock::duration elapsed{};
+  size_t allocations{};
+  size_t failures{};
+  PmuCounters::Counts counts{};
+};
+
+std::string target(const Scenario &scenario) {
+  return "/body?size=" + std::to_string(scenario.size) +
+         "&chunked=" + std::to_string(scenario.chunked) +
+         "&delay_us=" + std::to_string(scenario.delay.count());
+}
+
+// One request after the other on a blocking client, with a new connection
+// for each unless the pool keeps them
+Measurement measure_sync(uint16_t port, const std::string &path,
+                         size_t requests, bool pooled) {
+  auto pool = std::make_shared<http::ConnectionPool>(http::ConnectionPoolConfig{
+      .idle_timeout = pooled ? http::constants::DEFAULT_POOL_IDLE_TIMEOUT
+                             : std::chrono::microseconds(0)});
+  http::Client client("127.0.0.1", port, pool);
+  client.Get(path);
+
+  Measurement measurement;
+  measurement.latencies.reserve(requests);
+  const size_t allocations_before = allocations;
+  pmu_counters().start();
+  const auto start = Clock::now();
+  for (size_t i = 0; i < requests; ++i) {
+    const auto request_start = Clock::now();
+    auto result = client.Get(path);
+    measurement.failures += !result || result->status_code != 200;
+    measurement.latencies.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - request_start));
+  }
+  measurement.elapsed = Clock::now() - start;
+  measurement.counts = pmu_counters().stop();
+  measurement.allocations = allocations - allocations_before;
+  return measurement;
+}
+
+http::Task<> async_worker(http::AsyncClient &client, const std::string &path,
+                          size_t &next, size_t requests,
+                          Measurement &measurement) {
+  while (next < requests) {
+    ++next;
+    const auto request_start = Clock::now();
+    auto result = co_await client.Get(path);
+    measurement.failures += !result || result->status_code != 200;
+    measurement.latencies.push_back(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - request_start));
+  }
+}
+
+// Requests kept in flight on a single thread, on as many pooled connections
+Measurement measure_async(uint16_t port, const std::string &path,
+                          size_t requests, size_t concurrency) {
+  auto pool = std::make_shared<http::ConnectionPool>(
+      http::ConnectionPoolConfig{.max_connections_per_host = concurrency});
+  http::EventLoop loop;
+  http::AsyncClient client(loop, "127.0.0.1", port, pool);
+  loop.run(client.Get(path));
+
+  Measurement measurement;
+  measurement.latencies.reserve(requests);
+  size_t next = 0;
+  const size_t allocations_before = allocations;
+  pmu_counters().start();
+  const auto start = Clock::now();
+  for (size_t i = 0; i < concurrency; ++i) {
+    loop.spawn(async_worker(client, path, next, requests, measurement));
+  }
+  loop.run();
+  measurement.elapsed = Clock::now() - start;
+  measurement.counts = pmu_counters().stop();
+  measurement.allocations = allocations - allocations_before;
+  return measurement;
+}
+
+// The same requests spread over the threads of an executor, each with its
+// own client and connections. Only the allocations of the submitting thread
+// are counted, the hardware counters counting the threads of the executor
+// too.
+Measurement measure_threads(uint16_t port, const std::string &path,
+                            size_t requests, size_t concurrency) {
+  const size_t threads =
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1, concurrency);
+  http::Executor executor(
+      "127.0.0.1", port,
+      {.threads = threads, .concurrency_per_thread = concurrency / threads});
+  executor.run(std::vector<http::Request>(
+      threads, http::Request{.method = http::RequestMethod::GET,
+                             .path = path}));
+
+  Measurement measurement;
+  measurement.latencies.reserve(requests);
+  const size_t allocations_before = allocations;
+  pmu_counters().start();
+  const auto start = Clock::now();
+  for (size_t i = 0; i < requests; ++i) {
+    executor.submit(
+        {.method = http::RequestMethod::GET, .path = path},
+        [&measurement, request_start = Clock::now()](http::Result result) {
+          measurement.failures += !result || result->status_code != 200;
+          measurement.latencies.push_back(
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                  Clock::now() - request_start));
+        });
+  }
+  executor.wait();
+  measurement.elapsed = Clock::now() - start;
+  measurement.counts = pmu_counters().stop();
+  measurement.allocations = allocations - allocations_before;
+  return measurement;
+}
+
+double percentile_ms(const std::vector<std::chrono::microseconds> &sorted,
+                     double q) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const auto index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+  return std::chrono::duration<double, std::milli>(sorted[index]).count();
+}
+
+void report(std::string_view mode, const Scenario &scenario,
+            Measurement measurement) {
+  auto &latencies = measurement.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  const double seconds =
+      std::chrono::duration<double>(measurement.elapsed).count();
+  const double count = static_cast<double>(latencies.size());
+
+  std::printf("%-7s %8zu %-8s %7lld %10.0f %8.3f %8.3f %8.3f %8.3f %8.1f %5zu",
+              mode.data(), scenario.size,
+              scenario.chunked ? "chunked" : "length",
+              static_cast<long long>(scenario.delay.count()),
+              count / seconds, percentile_ms(latencies, 0.5),
+              percentile_ms(latencies, 0.9), percentile_ms(latencies, 0.99),
+              percentile_ms(latencies, 1.0),
+              static_cast<double>(measurement.allocations) / count,
+              measurement.failures);
+
+  const auto &counts = measurement.counts;
+  auto per_request = [&](PmuCounters::Event event) {
+    if (auto value = counts[event]) {
+      std::printf(" %9.0f", *value / count);
+    } else {
+      std::printf(" %9s", "-");
+    }
+  };
+  per_request(PmuCounters::Event::CYCLES);
+  const auto cycles = counts[PmuCounters::Event::CYCLES];
+  const auto instructions = counts[PmuCounters::Event::INSTRUCTIONS];
+  if (cycles && instructions && *cycles > 0) {
+    std::printf(" %5.2f", *instructions / *cycles);
+  } else {
+    std::printf(" %5s", "-");
+  }
+  per_request(PmuCounters::Event::L1D_MISSES);
+  per_request(PmuCounters::Event::LLC_MISSES);
+  per_request(PmuCounters::Event::BRANCH_MISSES);
+  per_request(PmuCounters::Event::DTLB_MISSES);
+  std::printf("\n");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t requests = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+  const size_t concurrency =
+      argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16;
+  if (requests == 0 || concurrency == 0) {
+    std::fprintf(stderr, "Usage: %s [requests] [concurrency]\n", argv[0]);
+    return 1;
+  }
+
+  MockServer server;
+  if (!pmu_counters().available()) {
+    std::printf("(no hardware counters: perf_event_open cannot count them "
+                "here)\n");
+  }
+
+  const Scenario scenarios[] = {
+      {.size = 0, .chunked = false, .delay = {}},
+      {.size = 1 << 10, .chunked = false, .delay = {}},
+      {.size = 1 << 10, .chunked = true, .delay = {}},
+      {.size = 64 << 10, .chunked = false, .delay = {}},
+      {.size = 64 << 10, .chunked = true, .delay = {}},
+      {.size = MockServer::MAX_BODY_SIZE, .chunked = false, .delay = {}},
+      {.size = 1 << 10, .chunked = false,
+       .delay = std::chrono::milliseconds(1)},
+  };
+
+  std::printf("%-7s %8s %-8s %7s %10s %8s %8s %8s %8s %8s %5s %9s %5s %9s "
+              "%9s %9s %9s\n",
+              "mode", "body", "encoding", "delay", "req/s", "p50 ms", "p90 ms",
+              "p99 ms", "max ms", "allocs", "fails", "cycles", "IPC", "L1D",
+              "LLC", "brmiss", "dTLB");
+  for (const auto &scenario : scenarios) {
+    // The large bodies take longer to move around
+    const size_t count = scenario.size >= MockServer::MAX_BODY_SIZE
+                             ? std::max<size_t>(requests / 10, 1)
+                             : requests;
+    const auto path = target(scenario);
+
+    report("sync", scenario,
+           measure_sync(server.port(), path, count, false));
+    report("pooled", scenario,
+           measure_sync(server.port(), path, count, true));
+    report("async", scenario,
+           measure_async(server.port(), path, count, concurrency));
+    report("threads", scenario,
+           measure_threads(server.port(), path, count, concurrency));
+  }
+  return 0;
+}
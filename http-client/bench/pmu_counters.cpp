@@ -0,0 +1,100 @@
+#include "pmu_counters.hpp"
+
+#include <cstdint>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+struct EventConfig {
+  uint32_t type;
+  uint64_t config;
+};
+
+constexpr uint64_t cache_miss(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// In the order of PmuCounters::Event
+constexpr std::array<EventConfig, PmuCounters::EVENT_COUNT> EVENTS{{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)},
+}};
+
+int open_event(const EventConfig &event) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+} // namespace
+
+PmuCounters::PmuCounters() {
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    fds_[i] = open_event(EVENTS[i]);
+  }
+}
+
+PmuCounters::~PmuCounters() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+bool PmuCounters::available() const {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PmuCounters::start() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+PmuCounters::Counts PmuCounters::stop() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  Counts counts;
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    // The count, the time the event was enabled and the time it was counted
+    std::array<uint64_t, 3> data{};
+    if (fds_[i] < 0 ||
+        read(fds_[i], data.data(), sizeof(data)) !=
+            static_cast<ssize_t>(sizeof(data)) ||
+        data[2] == 0) {
+      continue;
+    }
+    counts.values[i] = static_cast<double>(data[0]) *
+                       static_cast<double>(data[1]) /
+                       static_cast<double>(data[2]);
+  }
+  return counts;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <optional>
+
+// The hardware counters of the thread creating them and of the threads it
+// starts afterwards, opened with perf_event_open. Only the user space is
+// counted, which the default perf_event_paranoid allows without privileges,
+// and the events the processor or the kernel cannot count (e.g. in a virtual
+// machine without a virtual PMU) are left out.
+class PmuCounters {
+public:
+  enum class Event {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    DTLB_MISSES,
+    COUNT,
+  };
+
+  static constexpr size_t EVENT_COUNT = static_cast<size_t>(Event::COUNT);
+
+  // The counts since the last reset, scaled to the whole time the events
+  // were enabled when they had to share the PMU
+  struct Counts {
+    std::array<std::optional<double>, EVENT_COUNT> values{};
+
+    std::optional<double> operator[](Event event) const {
+      return values[static_cast<size_t>(event)];
+    }
+  };
+
+  PmuCounters();
+  ~PmuCounters();
+
+  PmuCounters(const PmuCounters &) = delete;
+  PmuCounters &operator=(const PmuCounters &) = delete;
+
+  // Whether any of the events can be counted
+  bool available() const;
+
+  // Zeroes the counts and starts counting
+  void start();
+  // Stops counting and returns the counts since start
+  Counts stop();
+
+private:
+  std::array<int, EVENT_COUNT> fds_{};
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "json.hpp"
+#include "json_extractor.hpp"
+#include <optional>
+#include <string>
+#include <tuple>
+
+// The objects of the responses of the API, as bound to their JSON fields.
+// A field that is missing, or of another type, is left empty.
+
+struct User {
+  std::optional<std::string> username;
+  std::optional<std::string> password;
+
+  static constexpr auto json_fields() {
+    return std::tuple{json_member("username", &User::username),
+                      json_member("password", &User::password)};
+  }
+};
+
+struct Movie {
+  // A number or a string, printed as given
+  std::optional<nlohmann::json> id;
+  std::optional<std::string> title;
+
+  static constexpr auto json_fields() {
+    return std::tuple{json_member("id", &Movie::id),
+                      json_member("title", &Movie::title)};
+  }
+};
+
+struct Collection {
+  std::optional<nlohmann::json> id;
+  std::optional<std::string> title;
+  std::optional<std::string> owner;
+
+  static constexpr auto json_fields() {
+    return std::tuple{json_member("id", &Collection::id),
+                      json_member("title", &Collection::title),
+                      json_member("owner", &Collection::owner)};
+  }
+};
@@ -1,21 +1,30 @@
 #include "cli.hpp"
+#include "api_types.hpp"
 #include "ctre.hpp"
 #include "fmt/format.h"
 #include "http/client.hpp"
 #include "json.hpp"
+#include "json_extractor.hpp"
+#include "json_writer.hpp"
 #include "logger.hpp"
+#include "session_cache.hpp"
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <string_view>
 #include <type_traits>
-#include <thread>
+#include <vector>
 
 namespace {
 constexpr auto SESSION_COOKIE_FINDER = ctre::search<"session=[^;]*">;
+const auto ACCESS_ROUTE = fmt::format("{}/library/access", BASE_ROUTE);
 
 /**
- * Read a line from standard input and parse it into a key-value pair.
+ * Read a line from the input and parse it into a key-value pair.
  *
+ * @param in The input the line is read from.
+ * @param out The output the prompt is written to.
  * @param line_buffer The buffer to store the input line.
  * @param arg_name The name of the argument to read.
  * @param delimiter The delimiter used to separate the key and value.
@@ -26,13 +35,17 @@ constexpr auto SESSION_COOKIE_FINDER = ctre::search<"session=[^;]*">;
  */
 template <typename ValueType = std::string>
 [[nodiscard]] ValueType
-read_and_parse_arg_line(std::string &line_buffer, std::string_view arg_name,
+read_and_parse_arg_line(std::istream &in, std::ostream &out,
+                        std::string &line_buffer, std::string_view arg_name,
                         std::function<bool (const ValueType&)> validator = [](const ValueType&) { return true; }) {
-  std::cout << arg_name << '=';
-  std::flush(std::cout);
+  out << arg_name << '=';
+  std::flush(out);
 
   do {
-    std::getline(std::cin, line_buffer);
+    if (!std::getline(in, line_buffer)) {
+      throw std::invalid_argument(
+          fmt::format("Missing value for field {}", arg_name));
+    }
   } while (line_buffer.empty());
 
   if constexpr (std::is_arithmetic_v<ValueType>) {
@@ -73,32 +86,80 @@ bool is_success(const http::Response &response) {
   return response.status_code >= 200 && response.status_code < 300;
 }
 
+using AsyncRequestFn = std::function<http::Task<http::Result>()>;
+
 /**
- * Perform an HTTP request with retry logic.
- *
- * @param request_fn The function to perform the HTTP request.
- * @return An optional HTTP response.
+ * The requests of a bulk operation, shared by the workers performing them.
  */
-[[nodiscard]] http::Result
-perform_http_request_with_retry(std::function<http::Result()> request_fn) {
-  http::Result result;
+struct BulkRequests {
+  const std::vector<AsyncRequestFn> &request_fns;
+  std::vector<http::Result> &results;
+  http::EventLoop &loop;
+  http::ConcurrencyLimiter &limiter;
+  // The index of the next request to perform
+  size_t next_request = 0;
+  size_t workers = 0;
+};
+
+void start_http_request_workers(BulkRequests &bulk);
 
-  for (size_t i = 0; i < MAX_RETRY_COUNT; ++i) {
-    result = request_fn();
-    if (result) {
-      break;
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+/**
+ * Perform requests, one after the other, until none is left or there are
+ * more workers than the concurrency limit allows, starting more workers
+ * whenever the limit grows.
+ *
+ * @param bulk The requests, shared by the workers.
+ */
+http::Task<> perform_http_requests_worker(BulkRequests &bulk) {
+  while (bulk.next_request < bulk.request_fns.size() &&
+         bulk.workers <= bulk.limiter.limit()) {
+    size_t i = bulk.next_request++;
+    const auto start = std::chrono::steady_clock::now();
+    bulk.results[i] = co_await bulk.request_fns[i]();
+    bulk.limiter.add(bulk.results[i],
+                     std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start));
+    start_http_request_workers(bulk);
   }
-  return result;
+  --bulk.workers;
 }
 
-void print_success(std::string_view message) {
-  std::cout << "SUCCESS: " << message << "\n";
+/**
+ * Start workers until there are as many as the concurrency limit, or as the
+ * requests left.
+ *
+ * @param bulk The requests, shared by the workers.
+ */
+void start_http_request_workers(BulkRequests &bulk) {
+  while (bulk.workers < bulk.limiter.limit() &&
+         bulk.workers < bulk.request_fns.size() - bulk.next_request) {
+    ++bulk.workers;
+    bulk.loop.spawn(perform_http_requests_worker(bulk));
+  }
 }
 
-void print_error(std::string_view message) {
-  std::cout << "ERROR: " << message << "\n";
+/**
+ * Perform independent HTTP requests concurrently, each retried as the
+ * client's retry policy allows, as many at once as the concurrency limiter
+ * finds the server can take.
+ *
+ * @param client The HTTP client whose event loop runs the requests.
+ * @param limiter The concurrency limiter, adapted to the results.
+ * @param request_fns The functions starting the HTTP requests.
+ * @return The results of the requests, in the same order.
+ */
+[[nodiscard]] std::vector<http::Result> perform_http_requests_concurrently(
+    http::Client &client, http::ConcurrencyLimiter &limiter,
+    const std::vector<AsyncRequestFn> &request_fns) {
+  std::vector<http::Result> results(request_fns.size());
+  BulkRequests bulk{.request_fns = request_fns,
+                    .results = results,
+                    .loop = client.loop(),
+                    .limiter = limiter};
+  start_http_request_workers(bulk);
+  client.loop().run();
+
+  return results;
 }
 
 std::string dump_json_pretty(const nlohmann::json &json) {
@@ -107,6 +168,48 @@ std::string dump_json_pretty(const nlohmann::json &json) {
 
 } // namespace
 
+void Cli::print_success(std::string_view message, std::string_view details) {
+  if (records_) {
+    records_->key("success");
+    records_->value(true);
+    records_->key("message");
+    records_->value(message);
+    return;
+  }
+  *out_ << "SUCCESS: " << message << details << "\n";
+}
+
+void Cli::print_error(std::string_view message) {
+  command_failed_ = true;
+  if (records_) {
+    records_->rewind(record_start_);
+    records_->key("success");
+    records_->value(false);
+    records_->key("error");
+    records_->value(message);
+    return;
+  }
+  *out_ << "ERROR: " << message << "\n";
+}
+
+std::ostream &Cli::prompt_out() {
+  // A stream without a buffer, which drops what is written to it
+  thread_local std::ostream discarded(nullptr);
+  return records_ ? discarded : *out_;
+}
+
+bool Cli::extract_json(JsonExtractor &extractor, std::string_view body) {
+  switch (extractor.parse(body)) {
+  case JsonExtractor::Status::Complete:
+    return true;
+  case JsonExtractor::Status::Invalid:
+    print_error("Failed to parse JSON response");
+    return false;
+  default:
+    return false;
+  }
+}
+
 void Cli::handle_result(
     const http::Result &result,
     std::function<void(const http::Response &)> on_response_ok,
@@ -126,10 +229,10 @@ void Cli::handle_result(
 void Cli::handle_result(
     const http::Result &result,
     std::function<void(const http::Response &)> on_response_ok) {
-  auto default_on_request_failure = [](const http::Error error) {
+  auto default_on_request_failure = [this](const http::Error error) {
     print_error(to_str(error));
   };
-  auto default_on_response_error = [](const http::Response &response) {
+  auto default_on_response_error = [this](const http::Response &response) {
     const auto response_json =
         nlohmann::json::parse(response.body, nullptr, false);
     if (!response.body.empty() && !response_json.is_discarded() &&
@@ -149,6 +252,12 @@ void Cli::handle_result(
 
 using json = nlohmann::json;
 
+template <typename... Fields>
+const std::string &Cli::json_body(const Fields &...fields) {
+  JsonWriter(request_body_).object(fields...);
+  return request_body_;
+}
+
 void Cli::handle_command(std::string_view command){
   const static auto str_to_cmd = std::unordered_map<std::string_view, void (Cli::*)()>{
       {"login_admin", &Cli::handle_login_admin},
@@ -172,6 +281,8 @@ void Cli::handle_command(std::string_view command){
        &Cli::handle_add_movie_to_collection},
       {"delete_movie_from_collection",
        &Cli::handle_delete_movie_from_collection},
+      {"metrics", &Cli::handle_metrics},
+      {"metrics_prometheus", &Cli::handle_metrics_prometheus},
       {"exit", &Cli::handle_exit},
   };
 
@@ -185,86 +296,69 @@ void Cli::handle_command(std::string_view command){
 
 void Cli::handle_login_admin() {
   std::string username =
-      read_and_parse_arg_line<std::string>(line_buffer_, "username",
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "username",
                                           has_no_spaces);
   std::string password =
-      read_and_parse_arg_line<std::string>(line_buffer_, "password", has_no_spaces);
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "password", has_no_spaces);
 
   const static auto route = fmt::format("{}/admin/login", BASE_ROUTE);
-  const json payload = {
-      {"username", username},
-      {"password", password},
-  };
 
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Post(route, payload.dump(), http_headers_); });
-  handle_result(result, [this](const http::Response &response) {
-    print_success("Admin logged in successfully");
-    // Extract the session cookie from the response
-    auto cookie_header = response.headers.find("Set-Cookie");
-
-    if (cookie_header != response.headers.end()) {
-      auto session_cookie = SESSION_COOKIE_FINDER(cookie_header->second);
-      if (session_cookie) {
-        http_headers_.insert_or_assign("Cookie", std::move(session_cookie));
-      }
-    }
-  });
+  login("admin", route, json_body("username", username, "password", password),
+        "Admin logged in successfully");
 }
 
 void Cli::handle_add_user() {
   std::string username =
-      read_and_parse_arg_line<std::string>(line_buffer_, "username", has_no_spaces);
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "username", has_no_spaces);
   std::string password =
-      read_and_parse_arg_line<std::string>(line_buffer_, "password", has_no_spaces);
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "password", has_no_spaces);
 
   const static auto route = fmt::format("{}/admin/users", BASE_ROUTE);
-  const json payload = {
-      {"username", username},
-      {"password", password},
-  };
 
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Post(route, payload.dump(), http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] {
+    return http_client_.Post(
+        route, json_body("username", username, "password", password));
+  });
+  handle_result(result, [this](const http::Response &response) {
     print_success("User added successfully");
   });
 }
 
 void Cli::handle_get_users() {
   const static auto route = fmt::format("{}/admin/users", BASE_ROUTE);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
-    const json response_json = json::parse(response.body, nullptr, false);
-    if (response_json.is_discarded()) {
-      print_error("Failed to parse JSON response");
-      return;
+  const auto result = authenticated([&] { return http_client_.Get(route); });
+  handle_result(result, [this](const http::Response &response) {
+    std::ostringstream os;
+    os << "\n";
+    size_t count = 0;
+    if (records_) {
+      records_->key("users");
+      records_->begin_array();
     }
-
-    if (const auto users = response_json.find("users");
-        users != response_json.end()) {
-      std::ostringstream os;
-      os << "Users retrieved successfully\n";
-      bool is_success = true;
-      for (size_t i = 0; i < users->size(); ++i) {
-        const auto username = (*users)[i].find("username");
-        const auto password = (*users)[i].find("password");
-        if (username != (*users)[i].end() && password != (*users)[i].end()) {
-          os << "#" << i + 1 << " " << username->get<std::string_view>() << ":"
-             << password->get<std::string_view>();
-          if (i + 1 != users->size()) {
-            os << "\n";
-          }
-        } else {
-          print_error("Invalid user data format");
-          is_success = false;
-          break;
-        }
+    TypedJsonExtractor<User> extractor("users", [&](const User &user) {
+      if (!user.username || !user.password) {
+        print_error("Invalid user data format");
+        return false;
+      }
+      if (records_) {
+        records_->object(user);
+        return true;
+      }
+      if (count > 0) {
+        os << "\n";
       }
-      if (is_success) {
-        print_success(os.str());
+      os << "#" << ++count << " " << *user.username << ":" << *user.password;
+      return true;
+    });
+
+    if (!extract_json(extractor, response.body)) {
+      return;
+    }
+    if (extractor.found_array()) {
+      if (records_) {
+        records_->end_array();
       }
+      print_success("Users retrieved successfully", os.str());
     } else {
       print_error("'users' key not found in the response");
     }
@@ -273,90 +367,69 @@ void Cli::handle_get_users() {
 
 void Cli::handle_delete_user() {
   std::string username =
-      read_and_parse_arg_line<std::string>(line_buffer_, "username", has_no_spaces);
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "username", has_no_spaces);
 
   const auto route = fmt::format("{}/admin/users/{}", BASE_ROUTE, username);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Delete(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] { return http_client_.Delete(route); });
+  handle_result(result, [this](const http::Response &response) {
     print_success("User deleted successfully");
   });
 }
 
 void Cli::handle_logout_admin() {
   const static auto route = fmt::format("{}/admin/logout", BASE_ROUTE);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
+  const auto result = http_client_.Get(route);
   handle_result(result, [this](const http::Response &response) {
     print_success("Admin logged out successfully");
     // Remove the session cookie from the headers
-    auto cookie_header = http_headers_.find("Cookie");
-    if (cookie_header != http_headers_.end()) {
-      auto session_cookie = SESSION_COOKIE_FINDER(cookie_header->second);
-      if (session_cookie) {
-        http_headers_.erase(cookie_header);
-      }
-    }
+    http_client_.remove_default_header("Cookie");
+    end_session();
   });
 }
 
 void Cli::handle_login_user() {
   std::string admin_username =
-      read_and_parse_arg_line<std::string>(line_buffer_, "admin_username",
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "admin_username",
                                           has_no_spaces);
   std::string username =
-      read_and_parse_arg_line<std::string>(line_buffer_, "username", has_no_spaces);
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "username", has_no_spaces);
   std::string password =
-      read_and_parse_arg_line<std::string>(line_buffer_, "password", has_no_spaces);
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "password", has_no_spaces);
 
   const static auto route = fmt::format("{}/user/login", BASE_ROUTE);
-  const json payload = {
-      {"admin_username", admin_username},
-      {"username", username},
-      {"password", password},
-  };
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Post(route, payload.dump(), http_headers_); });
-  handle_result(result, [this](const http::Response &response) {
-    print_success("User logged in successfully");
-    // Extract the session cookie from the response
-    auto cookie_header = response.headers.find("Set-Cookie");
-
-    if (cookie_header != response.headers.end()) {
-      auto session_cookie = SESSION_COOKIE_FINDER(cookie_header->second);
-      if (session_cookie) {
-        http_headers_.insert_or_assign("Cookie", std::move(session_cookie));
-      }
-    }
-  });
+  login("user", route,
+        json_body("admin_username", admin_username, "username", username,
+                  "password", password),
+        "User logged in successfully");
 }
 
 void Cli::handle_logout_user() {
   const static auto route = fmt::format("{}/user/logout", BASE_ROUTE);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
+  const auto result = http_client_.Get(route);
   handle_result(result, [this](const http::Response &response) {
     print_success("User logged out successfully");
     // Remove the session cookie from the headers
-    auto cookie_header = http_headers_.find("Cookie");
-    if (cookie_header != http_headers_.end()) {
-      auto session_cookie = SESSION_COOKIE_FINDER(cookie_header->second);
-      if (session_cookie) {
-        http_headers_.erase(cookie_header);
-      }
-    }
+    http_client_.remove_default_header("Cookie");
     // Remove the JWT token from the headers
-    auto jwt_token_header = http_headers_.find("Authorization");
-    if (jwt_token_header != http_headers_.end()) {
-      http_headers_.erase(jwt_token_header);
-    }
+    http_client_.remove_default_header("Authorization");
+    end_session();
   });
 }
 
 void Cli::handle_get_access() {
-  const static auto route = fmt::format("{}/library/access", BASE_ROUTE);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
+  // The token the session was cached with, if it is still valid
+  if (session_cache_ && login_) {
+    if (const auto session = session_cache_->find(
+            login_->key, std::chrono::system_clock::now());
+        session && !session->jwt.empty()) {
+      print_success("JWT token retrieved successfully");
+      set_access_token(session->jwt);
+      return;
+    }
+  }
+
+  const auto result =
+      authenticated([&] { return http_client_.Get(ACCESS_ROUTE); });
   handle_result(result, [this](const http::Response &response) {
     const json response_json = json::parse(response.body, nullptr, false);
     if (response_json.is_discarded()) {
@@ -365,48 +438,166 @@ void Cli::handle_get_access() {
     }
 
     if (const auto jwt_token = response_json.find("token");
-        jwt_token != response_json.end()) {
+        jwt_token != response_json.end() && jwt_token->is_string()) {
       print_success("JWT token retrieved successfully");
-      // Add the JWT token to the headers
-      http_headers_.insert_or_assign(
-          "Authorization",
-          fmt::format("Bearer {}", jwt_token->get<std::string_view>()));
+      set_access_token(jwt_token->get<std::string>());
+      cache_access_token();
     } else {
       print_error("'token' key not found in the response");
     }
   });
 }
 
-void Cli::handle_get_movies() {
-  const static auto route = fmt::format("{}/library/movies", BASE_ROUTE);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
-    const json response_json = json::parse(response.body, nullptr, false);
-    if (response_json.is_discarded()) {
-      print_error("Failed to parse JSON response");
+void Cli::set_session_cache(std::string path) {
+  session_cache_ = std::make_unique<SessionCache>(std::move(path));
+}
+
+void Cli::login(std::string_view role, const std::string &route,
+                std::string payload, std::string_view message) {
+  auto key =
+      SessionCache::key(fmt::format("{}:{}", host_, port_), role, payload);
+  Login login{.route = route, .payload = std::move(payload), .key = key};
+
+  // A session cached by a previous run is trusted until the server rejects
+  // it, the login being done then
+  if (session_cache_) {
+    if (const auto session = session_cache_->find(
+            login.key, std::chrono::system_clock::now())) {
+      print_success(message);
+      http_client_.set_default_header("Cookie", session->cookie);
+      login_ = std::move(login);
+      session_restored_ = true;
+      has_access_ = false;
       return;
     }
+  }
+
+  const auto result = http_client_.Post(login.route, login.payload);
+  handle_result(result, [&](const http::Response &response) {
+    print_success(message);
+    login_ = std::move(login);
+    session_restored_ = false;
+    has_access_ = false;
+    start_session(response);
+  });
+}
+
+void Cli::start_session(const http::Response &response) {
+  // Extract the session cookie from the response
+  auto cookie_header = response.headers.find("Set-Cookie");
+  if (!cookie_header) {
+    return;
+  }
+  auto session_cookie = SESSION_COOKIE_FINDER(*cookie_header);
+  if (!session_cookie) {
+    return;
+  }
+  http_client_.set_default_header("Cookie", session_cookie.str());
+
+  if (session_cache_ && login_) {
+    session_cache_->store(
+        login_->key,
+        {.cookie = session_cookie.str(),
+         .cookie_expiry = parse_cookie_expiry(
+             *cookie_header, std::chrono::system_clock::now())});
+  }
+}
+
+void Cli::set_access_token(const std::string &token) {
+  // Add the JWT token to the headers
+  http_client_.set_default_header("Authorization",
+                                  fmt::format("Bearer {}", token));
+  access_token_ = token;
+  has_access_ = true;
+}
+
+void Cli::cache_access_token() {
+  if (!session_cache_ || !login_) {
+    return;
+  }
+  if (auto session = session_cache_->find(login_->key,
+                                          std::chrono::system_clock::now())) {
+    session->jwt = access_token_;
+    session->jwt_expiry = parse_jwt_expiry(access_token_);
+    session_cache_->store(login_->key, std::move(*session));
+  }
+}
+
+void Cli::end_session() {
+  if (session_cache_ && login_) {
+    session_cache_->erase(login_->key);
+  }
+  login_.reset();
+  session_restored_ = false;
+  has_access_ = false;
+}
+
+http::Result Cli::authenticated(const std::function<http::Result()> &request) {
+  auto result = request();
+  if (result && result->status_code == 401 && session_restored_ &&
+      renew_session()) {
+    result = request();
+  }
+  return result;
+}
 
-    if (const auto movies = response_json.find("movies");
-        movies != response_json.end()) {
-      std::ostringstream os;
-      os << "Movies retrieved successfully";
-      bool is_success = true;
-      for (size_t i = 0; i < movies->size(); ++i) {
-        const auto title = (*movies)[i].find("title");
-        const auto id = (*movies)[i].find("id");
-        if (title != (*movies)[i].end() && id != (*movies)[i].end()) {
-          os << "\n#" << *id << " " << title->get<std::string_view>();
-        } else {
-          print_error("Invalid movie data format");
-          is_success = false;
-          break;
-        }
+bool Cli::renew_session() {
+  session_restored_ = false;
+  session_cache_->erase(login_->key);
+
+  const auto login = http_client_.Post(login_->route, login_->payload);
+  if (!login || !is_success(*login)) {
+    return false;
+  }
+  start_session(*login);
+  if (!has_access_) {
+    return true;
+  }
+
+  const auto access = http_client_.Get(ACCESS_ROUTE);
+  if (!access || !is_success(*access)) {
+    return false;
+  }
+  const json response_json = json::parse(access->body, nullptr, false);
+  if (response_json.is_discarded() || !response_json.contains("token") ||
+      !response_json["token"].is_string()) {
+    return false;
+  }
+  set_access_token(response_json["token"].get<std::string>());
+  cache_access_token();
+  return true;
+}
+
+void Cli::handle_get_movies() {
+  const static auto route = fmt::format("{}/library/movies", BASE_ROUTE);
+  const auto result = authenticated([&] { return http_client_.Get(route); });
+  handle_result(result, [this](const http::Response &response) {
+    std::ostringstream os;
+    if (records_) {
+      records_->key("movies");
+      records_->begin_array();
+    }
+    TypedJsonExtractor<Movie> extractor("movies", [&](const Movie &movie) {
+      if (!movie.title || !movie.id) {
+        print_error("Invalid movie data format");
+        return false;
+      }
+      if (records_) {
+        records_->object(movie);
+        return true;
       }
-      if (is_success) {
-        print_success(os.str());
+      os << "\n#" << *movie.id << " " << *movie.title;
+      return true;
+    });
+
+    if (!extract_json(extractor, response.body)) {
+      return;
+    }
+    if (extractor.found_array()) {
+      if (records_) {
+        records_->end_array();
       }
+      print_success("Movies retrieved successfully", os.str());
     } else {
       print_error("'movies' key not found in the response");
     }
@@ -414,115 +605,117 @@ void Cli::handle_get_movies() {
 }
 
 void Cli::handle_get_movie() {
-  size_t id = read_and_parse_arg_line<size_t>(line_buffer_, "id");
+  size_t id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "id");
 
   const auto route = fmt::format("{}/library/movies/{}", BASE_ROUTE, id);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] { return http_client_.Get(route); });
+  handle_result(result, [this](const http::Response &response) {
     const json response_json = json::parse(response.body, nullptr, false);
     if (response_json.is_discarded()) {
       print_error("Failed to parse JSON response");
       return;
     }
-    print_success(fmt::format("Movie retrieved successfully\n{}",
-                              dump_json_pretty(response_json)));
+    if (records_) {
+      records_->key("movie");
+      records_->value(response_json);
+      print_success("Movie retrieved successfully");
+      return;
+    }
+    print_success("Movie retrieved successfully",
+                  fmt::format("\n{}", dump_json_pretty(response_json)));
   });
 }
 
 void Cli::handle_add_movie() {
   std::string title =
-      read_and_parse_arg_line<std::string>(line_buffer_, "title");
-  size_t year = read_and_parse_arg_line<size_t>(line_buffer_, "year");
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "title");
+  size_t year = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "year");
   std::string description =
-      read_and_parse_arg_line<std::string>(line_buffer_, "description");
-  double rating = read_and_parse_arg_line<double>(line_buffer_, "rating", [](const double &value) {
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "description");
+  double rating = read_and_parse_arg_line<double>(*in_, prompt_out(), line_buffer_, "rating", [](const double &value) {
     return value >= 0.0 && value <= 10.0;
   });
 
   const static auto route = fmt::format("{}/library/movies", BASE_ROUTE);
-  const json payload = {
-      {"title", title},
-      {"year", year},
-      {"description", description},
-      {"rating", rating},
-  };
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Post(route, payload.dump(), http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] {
+    return http_client_.Post(
+        route, json_body("title", title, "year", year, "description",
+                         description, "rating", rating));
+  });
+  handle_result(result, [this](const http::Response &response) {
     print_success("Movie added successfully");
   });
 }
 
 void Cli::handle_update_movie() {
-  size_t id = read_and_parse_arg_line<size_t>(line_buffer_, "id");
+  size_t id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "id");
   std::string title =
-      read_and_parse_arg_line<std::string>(line_buffer_, "title");
-  size_t year = read_and_parse_arg_line<size_t>(line_buffer_, "year");
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "title");
+  size_t year = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "year");
   std::string description =
-      read_and_parse_arg_line<std::string>(line_buffer_, "description");
-  double rating = read_and_parse_arg_line<double>(line_buffer_, "rating", [](const double &value) {
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "description");
+  double rating = read_and_parse_arg_line<double>(*in_, prompt_out(), line_buffer_, "rating", [](const double &value) {
     return value >= 0.0 && value <= 10.0;
   });
 
   const auto route = fmt::format("{}/library/movies/{}", BASE_ROUTE, id);
-  const json payload = {
-      {"title", title},
-      {"year", year},
-      {"description", description},
-      {"rating", rating},
-  };
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Put(route, payload.dump(), http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] {
+    return http_client_.Put(
+        route, json_body("title", title, "year", year, "description",
+                         description, "rating", rating));
+  });
+  handle_result(result, [this](const http::Response &response) {
     print_success("Movie updated successfully");
   });
 }
 
 void Cli::handle_delete_movie() {
-  size_t id = read_and_parse_arg_line<size_t>(line_buffer_, "id");
+  size_t id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "id");
 
   const auto route = fmt::format("{}/library/movies/{}", BASE_ROUTE, id);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Delete(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] { return http_client_.Delete(route); });
+  handle_result(result, [this](const http::Response &response) {
     print_success("Movie deleted successfully");
   });
 }
 
 void Cli::handle_get_collections() {
   const static auto route = fmt::format("{}/library/collections", BASE_ROUTE);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
-    const json response_json = json::parse(response.body, nullptr, false);
-    if (response_json.is_discarded()) {
-      print_error("Failed to parse JSON response");
-      return;
+  const auto result = authenticated([&] { return http_client_.Get(route); });
+  handle_result(result, [this](const http::Response &response) {
+    std::ostringstream os;
+    size_t count = 0;
+    if (records_) {
+      records_->key("collections");
+      records_->begin_array();
     }
-
-    if (const auto collections = response_json.find("collections");
-        collections != response_json.end()) {
-      std::ostringstream os;
-      os << "Collections retrieved successfully";
-      bool is_success = true;
-      for (size_t i = 0; i < collections->size(); ++i) {
-        const auto title = (*collections)[i].find("title");
-        const auto id = (*collections)[i].find("id");
-        if (title != (*collections)[i].end() && id != (*collections)[i].end()) {
-          os << "\n#" << *id << " " << title->get<std::string_view>();
-          if (i + 1 != collections->size()) {
+    TypedJsonExtractor<Collection> extractor(
+        "collections", [&](const Collection &collection) {
+          const auto &title = collection.title;
+          const auto &id = collection.id;
+          if (!title || !id) {
+            print_error("Invalid collection data format");
+            return false;
+          }
+          if (records_) {
+            records_->object(collection);
+            return true;
+          }
+          if (count++ > 0) {
             os << "\n";
           }
-        } else {
-          print_error("Invalid collection data format");
-          is_success = false;
-          break;
-        }
-      }
-      if (is_success) {
-        print_success(os.str());
+          os << "\n#" << *id << " " << *title;
+          return true;
+        });
+
+    if (!extract_json(extractor, response.body)) {
+      return;
+    }
+    if (extractor.found_array()) {
+      if (records_) {
+        records_->end_array();
       }
+      print_success("Collections retrieved successfully", os.str());
     } else {
       print_error("'collections' key not found in the response");
     }
@@ -530,73 +723,72 @@ void Cli::handle_get_collections() {
 }
 
 void Cli::handle_get_collection() {
-  size_t id = read_and_parse_arg_line<size_t>(line_buffer_, "id");
+  size_t id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "id");
 
   const auto route = fmt::format("{}/library/collections/{}", BASE_ROUTE, id);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Get(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
-    const json response_json = json::parse(response.body, nullptr, false);
-    if (response_json.is_discarded()) {
-      print_error("Failed to parse JSON response");
+  const auto result = authenticated([&] { return http_client_.Get(route); });
+  handle_result(result, [this](const http::Response &response) {
+    // The movies may come before the title and the owner
+    std::ostringstream movies_os;
+    if (records_) {
+      records_->key("movies");
+      records_->begin_array();
+    }
+    TypedJsonExtractor<Movie, Collection> extractor(
+        "movies", [&](const Movie &movie) {
+          if (!movie.title || !movie.id) {
+            print_error("Invalid movie data format");
+            return false;
+          }
+          if (records_) {
+            records_->object(movie);
+            return true;
+          }
+          movies_os << "\n#" << *movie.id << ": " << *movie.title;
+          return true;
+        });
+
+    if (!extract_json(extractor, response.body)) {
       return;
     }
-    std::ostringstream os;
-    os << "Collection retrieved successfully\n";
-
-    const auto title = response_json.find("title");
-    const auto owner = response_json.find("owner");
-    const auto movies = response_json.find("movies");
-    bool is_success = true;
-
-    if (title != response_json.end() && owner != response_json.end() &&
-        movies != response_json.end()) {
-      os << "title: " << title->get<std::string_view>() << "\n"
-         << "owner: " << owner->get<std::string_view>() << "\n";
-
-      for (size_t i = 0; i < movies->size(); ++i) {
-        const auto title = (*movies)[i].find("title");
-        const auto id = (*movies)[i].find("id");
-
-        if (title != (*movies)[i].end() && id != (*movies)[i].end()) {
-          os << "\n#" << *id << ": " << title->get<std::string_view>();
-        } else {
-          print_error("Invalid movie data format");
-          is_success = false;
-          break;
-        }
-      }
 
-      if (is_success) {
-        print_success(os.str());
+    const auto &title = extractor.fields().title;
+    const auto &owner = extractor.fields().owner;
+    if (title && owner && extractor.found_array()) {
+      if (records_) {
+        records_->end_array();
+        records_->key("title");
+        records_->value(*title);
+        records_->key("owner");
+        records_->value(*owner);
       }
+      print_success("Collection retrieved successfully",
+                    fmt::format("\ntitle: {}\nowner: {}\n{}", *title, *owner,
+                                movies_os.str()));
     } else {
       print_error("Invalid collection data format");
-      is_success = false;
     }
   });
 }
 
 void Cli::handle_add_collection() {
   std::string title =
-      read_and_parse_arg_line<std::string>(line_buffer_, "title");
+      read_and_parse_arg_line<std::string>(*in_, prompt_out(), line_buffer_, "title");
   size_t num_movies =
-      read_and_parse_arg_line<size_t>(line_buffer_, "num_movies");
+      read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "num_movies");
 
   std::vector<size_t> movie_ids;
   for (size_t i = 0; i < num_movies; ++i) {
     size_t movie_id = read_and_parse_arg_line<size_t>(
-        line_buffer_, fmt::format("movie_id[{}]", i));
+        *in_, prompt_out(), line_buffer_, fmt::format("movie_id[{}]", i));
     movie_ids.push_back(movie_id);
   }
 
   const static auto route = fmt::format("{}/library/collections", BASE_ROUTE);
-  const json payload = {
-      {"title", title},
-  };
 
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Post(route, payload.dump(), http_headers_); });
+  const auto result = authenticated([&] {
+    return http_client_.Post(route, json_body("title", title));
+  });
   handle_result(result, [this, &movie_ids](const http::Response &response) {
     const json response_json = json::parse(response.body, nullptr, false);
     if (response_json.is_discarded()) {
@@ -614,15 +806,19 @@ void Cli::handle_add_collection() {
 
     const auto route = fmt::format("{}/library/collections/{}/movies",
                                    BASE_ROUTE, collection_id);
-    size_t added_movies = 0;
-    // Add each movie to the collection
+    // Add the movies to the collection, independently of each other
+    std::vector<AsyncRequestFn> request_fns;
+    request_fns.reserve(movie_ids.size());
     for (const auto &movie_id : movie_ids) {
-      const json payload = {
-          {"id", movie_id},
-      };
-      const auto result = perform_http_request_with_retry([&] {
-        return http_client_.Post(route, payload.dump(), http_headers_);
+      request_fns.emplace_back([this, &route, movie_id] {
+        return http_client_.async().Post(route, json_body("id", movie_id));
       });
+    }
+
+    size_t added_movies = 0;
+    for (const auto &result :
+         perform_http_requests_concurrently(http_client_, concurrency_limiter_,
+                                            request_fns)) {
       handle_result(
           result,
           [&added_movies](const http::Response &response) { ++added_movies; },
@@ -640,60 +836,143 @@ void Cli::handle_add_collection() {
 }
 
 void Cli::handle_delete_collection() {
-  size_t id = read_and_parse_arg_line<size_t>(line_buffer_, "id");
+  size_t id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "id");
 
   const auto route = fmt::format("{}/library/collections/{}", BASE_ROUTE, id);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Delete(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] { return http_client_.Delete(route); });
+  handle_result(result, [this](const http::Response &response) {
     print_success("Collection deleted successfully");
   });
 }
 
 void Cli::handle_add_movie_to_collection() {
   size_t collection_id =
-      read_and_parse_arg_line<size_t>(line_buffer_, "collection_id");
-  size_t movie_id = read_and_parse_arg_line<size_t>(line_buffer_, "movie_id");
+      read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "collection_id");
+  size_t movie_id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "movie_id");
 
   const auto route = fmt::format("{}/library/collections/{}/movies", BASE_ROUTE,
                                  collection_id);
-  const json payload = {
-      {"id", movie_id},
-  };
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Post(route, payload.dump(), http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] {
+    return http_client_.Post(route, json_body("id", movie_id));
+  });
+  handle_result(result, [this](const http::Response &response) {
     print_success("Movie added to collection successfully");
   });
 }
 
 void Cli::handle_delete_movie_from_collection() {
   size_t collection_id =
-      read_and_parse_arg_line<size_t>(line_buffer_, "collection_id");
-  size_t movie_id = read_and_parse_arg_line<size_t>(line_buffer_, "movie_id");
+      read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "collection_id");
+  size_t movie_id = read_and_parse_arg_line<size_t>(*in_, prompt_out(), line_buffer_, "movie_id");
 
   const auto route = fmt::format("{}/library/collections/{}/movies/{}",
                                  BASE_ROUTE, collection_id, movie_id);
-  const auto result = perform_http_request_with_retry(
-      [&] { return http_client_.Delete(route, http_headers_); });
-  handle_result(result, [](const http::Response &response) {
+  const auto result = authenticated([&] { return http_client_.Delete(route); });
+  handle_result(result, [this](const http::Response &response) {
     print_success("Movie deleted from collection successfully");
   });
 }
 
+void Cli::handle_metrics() {
+  const auto metrics = metrics_->snapshot();
+  auto ms = [](std::chrono::microseconds duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  };
+
+  const std::pair<std::string_view, const http::LatencyHistogram &> phases[] = {
+      {"resolve", metrics.resolve},   {"connect", metrics.connect},
+      {"write", metrics.write},       {"ttfb", metrics.first_byte},
+      {"receive", metrics.receive},   {"total", metrics.total},
+  };
+
+  if (records_) {
+    records_->key("requests");
+    records_->value(static_cast<uint64_t>(metrics.requests));
+    records_->key("reused_connections");
+    records_->value(static_cast<uint64_t>(metrics.reused_connections));
+    records_->key("phases");
+    records_->begin_object();
+    for (const auto &[name, histogram] : phases) {
+      records_->key(name);
+      records_->begin_object();
+      records_->key("count");
+      records_->value(static_cast<uint64_t>(histogram.count()));
+      const std::pair<std::string_view, std::chrono::microseconds> stats[] = {
+          {"mean_ms", histogram.mean()},
+          {"p50_ms", histogram.quantile(0.5)},
+          {"p95_ms", histogram.quantile(0.95)},
+          {"p99_ms", histogram.quantile(0.99)},
+          {"max_ms", histogram.max()},
+      };
+      for (const auto &[stat, duration] : stats) {
+        records_->key(stat);
+        records_->value(ms(duration));
+      }
+      records_->end_object();
+    }
+    records_->end_object();
+    print_success("Request metrics");
+    return;
+  }
+
+  std::ostringstream os;
+  os << fmt::format("\nrequests: {}, reused connections: {}\n",
+                    metrics.requests, metrics.reused_connections)
+     << fmt::format("{:<10} {:>6} {:>10} {:>10} {:>10} {:>10} {:>10}", "phase",
+                    "count", "mean ms", "p50 ms", "p95 ms", "p99 ms",
+                    "max ms");
+  for (const auto &[name, histogram] : phases) {
+    os << fmt::format(
+        "\n{:<10} {:>6} {:>10.3f} {:>10.3f} {:>10.3f} {:>10.3f} {:>10.3f}",
+        name, histogram.count(), ms(histogram.mean()),
+        ms(histogram.quantile(0.5)), ms(histogram.quantile(0.95)),
+        ms(histogram.quantile(0.99)), ms(histogram.max()));
+  }
+  print_success("Request metrics", os.str());
+}
+
+void Cli::handle_metrics_prometheus() {
+  if (records_) {
+    std::ostringstream os;
+    metrics_->snapshot().write_prometheus(os);
+    records_->key("prometheus");
+    records_->value(os.view());
+    print_success("Request metrics");
+    return;
+  }
+
+  // Starts on a line of its own, after the message
+  std::ostringstream os;
+  os << '\n';
+  metrics_->snapshot().write_prometheus(os);
+  print_success("Request metrics", os.view());
+}
+
 void Cli::handle_exit() { should_exit_ = true; }
 
+void Cli::preconnect() {
+  // On a client of its own, the event loop of the other one running the
+  // commands meanwhile
+  preconnect_thread_ =
+      std::jthread([client = http::Client(host_, port_, pool_)]() mutable {
+        client.preconnect();
+      });
+}
+
 void Cli::run() {
   // Use application/json as the default content type
-  http_headers_.try_emplace("Content-Type", "application/json");
-  http_headers_.try_emplace("Accept", "application/json");
+  http_client_.set_default_header("Content-Type", "application/json");
+  http_client_.set_default_header("Accept", "application/json");
 
   // Enable logging for the HTTP client
-  auto log_fn = [](const http::Request &req, const http::Response &res) {
+  auto log_fn = [this](const http::Request &req, const http::Response &res) {
     std::ostringstream os;
     os << "Request:\n"
        << "METHOD: " << http::to_string(req.method) << "\nPATH: " << req.path
        << "\nPROTOCOL: " << req.protocol << "\nHEADERS:\n";
+    for (const auto &[header, value] : http_client_.default_headers()) {
+      os << header << " - " << value << "\n";
+    }
     for (const auto &[header, value] : req.headers) {
       os << header << " - " << value << "\n";
     }
@@ -709,18 +988,62 @@ void Cli::run() {
     LOG_INFO("{}", os.str());
   };
   http_client_.set_logger(log_fn);
+  http_client_.set_timed_logger(
+      [metrics = metrics_](const http::Request &, const http::Response &,
+                           const http::RequestTiming &timing) {
+        metrics->record(timing);
+      });
 
-  while (!should_exit_) {
-    do {
-      std::getline(std::cin, line_buffer_);
-    } while (line_buffer_.empty());
+  if (ndjson_output_) {
+    records_ = std::make_unique<NdjsonWriter>(*out_);
+  }
 
+  while (!should_exit_ && read_command_line()) {
+    // The line buffer is reused for the arguments
+    const std::string command = line_buffer_;
+    command_failed_ = false;
+    const auto start = std::chrono::steady_clock::now();
+
+    if (records_) {
+      records_->begin_record();
+      records_->key("command");
+      records_->value(command);
+      record_start_ = records_->mark();
+    }
     try {
-      handle_command(line_buffer_);
+      handle_command(command);
     } catch (const std::exception &e) {
       print_error(e.what());
     }
+    if (records_) {
+      records_->end_record();
+      // Written out before waiting for more commands, those already read
+      // being run first
+      if (in_->rdbuf()->in_avail() <= 0) {
+        records_->flush();
+      }
+    }
+
+    if (command_observer_) {
+      command_observer_(command,
+                        std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start),
+                        !command_failed_);
+    }
+  }
+
+  if (records_) {
+    records_.reset();
+    return;
   }
+  *out_ << "Exiting...\n";
+}
 
-  std::cout << "Exiting...\n";
+bool Cli::read_command_line() {
+  do {
+    if (!std::getline(*in_, line_buffer_)) {
+      return false;
+    }
+  } while (line_buffer_.empty());
+  return true;
 }
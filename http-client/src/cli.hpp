@@ -1,14 +1,47 @@
 #pragma once
 
 #include "http/client.hpp"
+#include "http/concurrency_limiter.hpp"
+#include "ndjson_writer.hpp"
+#include "session_cache.hpp"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
 
 static constexpr std::string_view BASE_ROUTE = "/api/v1/tema";
+// Attempts of a request that fails without a response
 static constexpr size_t MAX_RETRY_COUNT = 3;
+// Requests in flight at once when performing several independent ones, at
+// most: the concurrency limiter finds how many the server takes, those past
+// the connections of the pool waiting for one
+static constexpr size_t MAX_PARALLEL_REQUESTS = 32;
+
+class JsonExtractor;
 
 class Cli {
 public:
-  Cli(std::string host, uint16_t port = 80)
-      : http_client_(std::move(host), port) {}
+  /**
+   * Called after each command with how long it took and whether it
+   * succeeded.
+   */
+  using CommandObserver =
+      std::function<void(std::string_view command,
+                         std::chrono::microseconds duration, bool success)>;
+
+  Cli(std::string host, uint16_t port = 80,
+      std::shared_ptr<http::ConnectionPool> pool =
+          http::ConnectionPool::shared())
+      : host_(host), port_(port), pool_(pool),
+        http_client_(std::move(host), port, std::move(pool)) {
+    http_client_.set_retry_policy({.max_attempts = MAX_RETRY_COUNT});
+    http_client_.set_hedging_policy({.enabled = true});
+    http_client_.set_response_cache(std::make_shared<http::ResponseCache>());
+  }
 
   Cli() = delete;
   Cli(const Cli &) = delete;
@@ -16,9 +49,67 @@ public:
   Cli(Cli &&) = default;
   Cli &operator=(Cli &&) = default;
 
+  /**
+   * Run the commands read from the input until exit, or the end of the input.
+   */
   void run();
 
+  /**
+   * Read the commands from in and print their outcome to out, instead of the
+   * standard input and output.
+   */
+  void set_io(std::istream &in, std::ostream &out) {
+    in_ = &in;
+    out_ = &out;
+  }
+
+  void set_command_observer(CommandObserver observer) {
+    command_observer_ = std::move(observer);
+  }
+
+  /**
+   * Send the requests over a single HTTP/2 connection, the concurrent ones of
+   * a command as streams of it, the server supporting HTTP/2 without being
+   * asked.
+   */
+  void set_http2(bool enabled) { http_client_.set_http2(enabled); }
+
+  /**
+   * Open a connection to the server in the background, left in the pool, so
+   * that the first command does not wait for the host to be resolved and
+   * connected to.
+   */
+  void preconnect();
+
+  /**
+   * Keep the sessions of the logins in the file, so that the next runs
+   * logging in with the same credentials reuse them, along with their JWT,
+   * instead of asking the server for them. A session is reused until it
+   * expires or the server rejects it, in which case the login is done again
+   * and the request sent anew.
+   */
+  void set_session_cache(std::string path);
+
+  /**
+   * Print the outcome of each command as a JSON record of its own line
+   * (NDJSON) instead of text, the elements of the lists written as they are
+   * decoded from the response, and the prompts left out. The records are
+   * written out in large blocks, once the commands already read have run.
+   */
+  void set_ndjson_output(bool enabled) { ndjson_output_ = enabled; }
+
 private:
+  /**
+   * The last login, kept to log in again once its session is rejected.
+   */
+  struct Login {
+    std::string route;
+    std::string payload;
+    // The key of its session in the cache
+    std::string key;
+  };
+
+  bool read_command_line();
   void handle_command(std::string_view command);
   // Command handlers
   void handle_login_admin();
@@ -40,8 +131,37 @@ private:
   void handle_delete_collection();
   void handle_add_movie_to_collection();
   void handle_delete_movie_from_collection();
+  void handle_metrics();
+  void handle_metrics_prometheus();
   void handle_exit();
 
+  /**
+   * Log in, unless the cache has a session for the same credentials.
+   *
+   * @param role What logs in, part of the key of the session.
+   * @param route The route of the login.
+   * @param payload The credentials.
+   * @param message Printed once logged in.
+   */
+  void login(std::string_view role, const std::string &route,
+             std::string payload, std::string_view message);
+  /**
+   * Send the session cookie of the login response from then on, and cache it.
+   */
+  void start_session(const http::Response &response);
+  void set_access_token(const std::string &token);
+  // Adds the token to the cached session
+  void cache_access_token();
+  // Forgets the login, and its cached session
+  void end_session();
+  /**
+   * Perform a request on behalf of the session, which is renewed and the
+   * request performed again if the server rejects a session of the cache.
+   */
+  http::Result authenticated(const std::function<http::Result()> &request);
+  // Log in again, getting access again if it had it. false if that failed.
+  bool renew_session();
+
   void
   handle_result(const http::Result &result,
                 std::function<void(const http::Response &)> on_response_ok,
@@ -51,8 +171,68 @@ private:
   handle_result(const http::Result &result,
                 std::function<void(const http::Response &)> on_response_ok);
 
+  /**
+   * Report the success of the command.
+   *
+   * @param message What succeeded.
+   * @param details Printed after the message, in the text output only.
+   */
+  void print_success(std::string_view message, std::string_view details = {});
+  // Also marks the command as failed, replacing whatever its record has
+  void print_error(std::string_view message);
+  // Where the arguments are asked for, nowhere for the NDJSON output
+  std::ostream &prompt_out();
+  /**
+   * Extract the fields of a JSON response body, reporting it if invalid.
+   *
+   * @param extractor The extractor of the fields.
+   * @param body The body of the response.
+   * @return Whether the whole body was parsed, false if it is invalid or if an
+   * element callback stopped the extraction, having reported why.
+   */
+  bool extract_json(JsonExtractor &extractor, std::string_view body);
+  /**
+   * Write a JSON object of the fields into the request body buffer, without
+   * building a DOM.
+   *
+   * @param fields The fields, as key, value, key, value...
+   * @return The buffer, overwritten by the next body.
+   */
+  template <typename... Fields>
+  const std::string &json_body(const Fields &...fields);
+
   std::string line_buffer_;
+  // The JSON bodies of the requests, the client copying them when sent
+  std::string request_body_;
+  std::string host_;
+  uint16_t port_;
+  std::shared_ptr<http::ConnectionPool> pool_;
   http::Client http_client_;
-  http::Headers http_headers_;
+  // Kept between the bulk operations, which it adapts to the server
+  http::ConcurrencyLimiter concurrency_limiter_{
+      {.max_limit = MAX_PARALLEL_REQUESTS}};
+  // The timings of the requests, printed by the metrics command
+  std::shared_ptr<http::RequestMetrics> metrics_ =
+      std::make_shared<http::RequestMetrics>();
   bool should_exit_ = false;
+
+  std::unique_ptr<SessionCache> session_cache_;
+  std::optional<Login> login_;
+  // Whether the session comes from the cache, renewed if the server rejects
+  // it
+  bool session_restored_ = false;
+  bool has_access_ = false;
+  std::string access_token_;
+
+  std::istream *in_ = &std::cin;
+  std::ostream *out_ = &std::cout;
+  CommandObserver command_observer_;
+  bool command_failed_ = false;
+  bool ndjson_output_ = false;
+  // The record of each command, for the NDJSON output
+  std::unique_ptr<NdjsonWriter> records_;
+  // The record of the command, past its name
+  NdjsonWriter::Mark record_start_{};
+  // Joined before the rest is destroyed
+  std::jthread preconnect_thread_;
 };
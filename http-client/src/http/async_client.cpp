@@ -0,0 +1,1584 @@
+#include "async_client.hpp"
+
+#include "constants.hpp"
+#include "content_coding.hpp"
+#include "error.hpp"
+#include "resolver.hpp"
+#include "response_parser.hpp"
+#include "scope_guard.hpp"
+#include "socket.hpp"
+#include "socket_utils.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <fcntl.h>
+#include <optional>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace http::detail {
+// Whether the value of a Connection header lists the option, e.g. "close" in
+// "Keep-Alive, close"
+bool has_connection_option(std::optional<std::string_view> connection,
+                           std::string_view option) {
+  if (!connection) {
+    return false;
+  }
+
+  std::string_view options = *connection;
+  while (!options.empty()) {
+    auto comma = options.find(',');
+    auto token = options.substr(0, comma);
+    auto first = token.find_first_not_of(" \t");
+    if (first != std::string_view::npos) {
+      token = token.substr(first, token.find_last_not_of(" \t") - first + 1);
+      if (utils::iequals(token, option)) {
+        return true;
+      }
+    }
+    options = comma == std::string_view::npos ? std::string_view{}
+                                              : options.substr(comma + 1);
+  }
+  return false;
+}
+
+// HTTP/1.1 connections are persistent unless either side asks to close them,
+// HTTP/1.0 ones only if the server asks to keep them alive
+bool keeps_alive(const Request &request, const Headers &default_headers,
+                 const Response &response) {
+  auto request_connection = find_header(request.headers, "Connection");
+  if (!request_connection) {
+    request_connection = find_header(default_headers, "Connection");
+  }
+  const auto response_connection = response.headers.find("Connection");
+  if (has_connection_option(request_connection, "close") ||
+      has_connection_option(response_connection, "close")) {
+    return false;
+  }
+  if (response.version == "HTTP/1.0") {
+    return has_connection_option(response_connection, "keep-alive");
+  }
+  return true;
+}
+
+// Whether a request failed with the error as the connection was closed or
+// reset by the server, rather than timing out
+bool is_connection_lost(Error error) {
+  return error == Error::Read || error == Error::Write;
+}
+
+bool is_idempotent(RequestMethod method) {
+  return method == RequestMethod::GET || method == RequestMethod::HEAD ||
+         method == RequestMethod::PUT || method == RequestMethod::DELETE;
+}
+
+// The decimal number the value is made of, e.g. a Content-Length
+std::optional<size_t> parse_size(std::string_view value) {
+  size_t size = 0;
+  auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(),
+                                   size);
+  if (ec != std::errc{} || ptr != value.data() + value.size()) {
+    return std::nullopt;
+  }
+  return size;
+}
+
+// The first byte of a Content-Range, e.g. 100 in "bytes 100-199/1000"
+std::optional<size_t> content_range_start(std::string_view value) {
+  constexpr std::string_view unit = "bytes ";
+  if (!value.starts_with(unit)) {
+    return std::nullopt;
+  }
+  value.remove_prefix(unit.size());
+  return parse_size(value.substr(0, value.find('-')));
+}
+
+// The method, path and headers of the request, those of the client it does
+// not override included, with the names lowercase and sorted, so that two
+// requests with the same key get the same response
+std::string coalescing_key(const Request &request,
+                           const Headers &default_headers) {
+  std::vector<std::pair<std::string, std::string_view>> fields;
+  auto add_field = [&](const std::string &name, const std::string &value) {
+    std::string lower(name);
+    std::ranges::transform(lower, lower.begin(), [](unsigned char c) {
+      return static_cast<char>(std::tolower(c));
+    });
+    fields.emplace_back(std::move(lower), value);
+  };
+  for (const auto &[name, value] : request.headers) {
+    add_field(name, value);
+  }
+  for (const auto &[name, value] : default_headers) {
+    if (!find_header(request.headers, name)) {
+      add_field(name, value);
+    }
+  }
+  std::ranges::sort(fields);
+
+  std::string key = to_string(request.method);
+  key += ' ';
+  key += request.path;
+  for (const auto &[name, value] : fields) {
+    key += '\n';
+    key += name;
+    key += ": ";
+    key += value;
+  }
+  return key;
+}
+
+auto elapsed(EventLoop::Clock::time_point from, EventLoop::Clock::time_point to)
+    -> std::chrono::microseconds {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::max(to - from, EventLoop::Clock::duration::zero()));
+}
+
+} // namespace http::detail
+
+namespace http {
+
+using namespace detail;
+
+auto AsyncClient::acquire_connection(Error &error, RequestTiming &timing)
+    -> Task<std::optional<ConnectionPool::Connection>> {
+  const auto deadline = Clock::now() + connection_timeout_;
+
+  auto connection = pool_->try_acquire(host_, port_);
+  if (!connection) {
+    // Wait for a connection to the origin to be released
+    int released = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (released < 0) {
+      error = Error::Connection;
+      co_return std::nullopt;
+    }
+    bool waiting = false;
+    auto guard = scope_guard::make_scope_exit([&] {
+      // Cancelled once notified, the released connection is handed on to the
+      // next waiter
+      if (waiting && !pool_->remove_waiter(host_, port_, released)) {
+        if (auto unclaimed = pool_->try_acquire(host_, port_)) {
+          pool_->release(host_, port_, unclaimed->socket,
+                         unclaimed->socket.is_open());
+        }
+      }
+      close(released);
+    });
+
+    while (!connection) {
+      pool_->add_waiter(host_, port_, released);
+      waiting = true;
+      co_await loop_.readable(released, deadline);
+      waiting = false;
+
+      // Notified even if the deadline passed meanwhile
+      if (!pool_->remove_waiter(host_, port_, released)) {
+        eventfd_t count;
+        eventfd_read(released, &count);
+        connection = pool_->try_acquire(host_, port_);
+      }
+      if (!connection && Clock::now() >= deadline) {
+        error = Error::ConnectionTimeout;
+        co_return std::nullopt;
+      }
+    }
+  }
+
+  timing.reused_connection = connection->reused;
+  if (connection->socket.is_open()) {
+    error = Error::Success;
+    co_return connection;
+  }
+
+  // The slot of a new connection, given back if it cannot be connected
+  Socket socket{};
+  auto guard = scope_guard::make_scope_exit(
+      [&] { pool_->release(host_, port_, socket, false); });
+
+  const auto resolve_start = Clock::now();
+  auto addresses = co_await resolve(deadline, error);
+  const auto connect_start = Clock::now();
+  timing.resolve = elapsed(resolve_start, connect_start);
+  if (!addresses) {
+    co_return std::nullopt;
+  }
+  socket.sockfd = co_await connect(*addresses, deadline, error);
+  if (!socket.is_open()) {
+    if (error == Error::Connection) {
+      // The host may have moved, resolve it again next time
+      evict_cached_host(host_, port_);
+    }
+    co_return std::nullopt;
+  }
+  if (tls_) {
+    if (!co_await handshake(socket, deadline, error)) {
+      co_return std::nullopt;
+    }
+    timing.resumed_session = socket.tls->resumed();
+  }
+  timing.connect = elapsed(connect_start, Clock::now());
+
+  guard.dismiss();
+  connection->socket = socket;
+  co_return connection;
+}
+
+auto AsyncClient::acquire_http2_connection(
+    Error &error, RequestTiming &timing,
+    std::optional<ConnectionPool::Connection> &http1)
+    -> Task<std::shared_ptr<Http2Connection>> {
+  const auto deadline = Clock::now() + connection_timeout_;
+  while (http2_connecting_) {
+    int opened = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (opened < 0) {
+      error = Error::Connection;
+      co_return nullptr;
+    }
+    http2_waiters_.push_back(opened);
+    auto guard = scope_guard::make_scope_exit([&] {
+      std::erase(http2_waiters_, opened);
+      close(opened);
+    });
+    if (!co_await loop_.readable(opened, deadline)) {
+      error = Error::ConnectionTimeout;
+      co_return nullptr;
+    }
+  }
+
+  if (http2_connection_ && http2_connection_->usable()) {
+    timing.reused_connection = true;
+    error = Error::Success;
+    co_return http2_connection_;
+  }
+  if (http2_supported_ == false) {
+    co_return nullptr;
+  }
+
+  http2_connecting_ = true;
+  auto guard = scope_guard::make_scope_exit([&] {
+    http2_connecting_ = false;
+    for (int waiter : http2_waiters_) {
+      eventfd_write(waiter, 1);
+    }
+  });
+  // The idle connections of the pool carry HTTP/1.1, unless the server
+  // chose HTTP/2 for them, and are closed to make room for a new one
+  auto connection = co_await acquire_connection(error, timing);
+  while (connection && connection->reused &&
+         (connection->socket.tls == nullptr ||
+          !connection->socket.tls->http2())) {
+    pool_->release(host_, port_, connection->socket, false);
+    connection = co_await acquire_connection(error, timing);
+  }
+  if (!connection) {
+    co_return nullptr;
+  }
+  if (connection->socket.tls != nullptr &&
+      !connection->socket.tls->http2()) {
+    http2_supported_ = false;
+    http1 = connection;
+    co_return nullptr;
+  }
+
+  http2_supported_ = true;
+  http2_connection_ = std::make_shared<Http2Connection>(
+      loop_, pool_, host_, port_, connection->socket, authority());
+  http2_connection_->set_timeouts(read_timeout_, write_timeout_);
+  co_return http2_connection_;
+}
+
+std::string AsyncClient::authority() const {
+  if (is_unix_socket_host(host_)) {
+    return std::string(constants::UNIX_SOCKET_HOST);
+  }
+  const uint16_t default_port = tls_ ? 443 : 80;
+  return port_ == default_port ? host_
+                               : host_ + ':' + std::to_string(port_);
+}
+
+std::string_view AsyncClient::request_host() const {
+  return is_unix_socket_host(host_) ? constants::UNIX_SOCKET_HOST
+                                    : std::string_view(host_);
+}
+
+auto AsyncClient::resolve(Clock::time_point deadline, Error &error)
+    -> Task<std::optional<HostAddresses>> {
+  std::optional<HostAddresses> addresses = find_cached_host(host_, port_);
+
+  if (!addresses) {
+    auto query = resolve_in_background_
+                     ? Resolver::shared()->resolve(host_, port_)
+                     : nullptr;
+    if (query && query->done_fd() >= 0) {
+      // Left to the resolver on timeout, which still caches the addresses
+      while (!query->done()) {
+        if (!co_await loop_.readable(query->done_fd(), deadline)) {
+          error = Error::ConnectionTimeout;
+          co_return std::nullopt;
+        }
+      }
+      addresses = query->addresses();
+    } else {
+      addresses = resolve_host(host_, port_);
+    }
+  }
+
+  error = addresses ? Error::Success : Error::HostNotFound;
+  co_return addresses;
+}
+
+Task<bool> AsyncClient::handshake(Socket &socket, Clock::time_point deadline,
+                                  Error &error) {
+  // Owned by the socket from now on
+  socket.tls = new TlsStream(tls_, socket.sockfd, host_, port_,
+                             http2_ && http2_supported_ != false);
+
+  while (!socket.tls->handshake(error)) {
+    const bool would_block =
+        error == Error::ReadTimeout || error == Error::WriteTimeout;
+    if (!co_await wait_ready(socket, error, deadline)) {
+      if (would_block) {
+        error = Error::ConnectionTimeout;
+      }
+      co_return false;
+    }
+  }
+  co_return true;
+}
+
+Task<bool> AsyncClient::wait_ready(Socket socket, Error error,
+                                   Clock::time_point deadline) {
+  if (error == Error::ReadTimeout) {
+    co_return co_await loop_.readable(socket.sockfd, deadline);
+  }
+  if (error == Error::WriteTimeout) {
+    co_return co_await loop_.writable(socket.sockfd, deadline);
+  }
+  co_return false;
+}
+
+Task<socket_t> AsyncClient::connect(const HostAddresses &addresses,
+                                    Clock::time_point deadline, Error &error) {
+  // The pending attempts are waited on together, through an epoll instance
+  // that is readable once one of them is writable
+  int attempts_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (attempts_fd < 0) {
+    error = Error::Connection;
+    co_return INVALID_SOCKET;
+  }
+  std::vector<socket_t> attempts;
+  auto guard = scope_guard::make_scope_exit([&] {
+    for (auto sockfd : attempts) {
+      close_socket(sockfd);
+    }
+    close(attempts_fd);
+  });
+
+  size_t next = 0;
+  auto next_attempt = Clock::now();
+  while (true) {
+    const auto now = Clock::now();
+    if (now >= deadline) {
+      error = Error::ConnectionTimeout;
+      co_return INVALID_SOCKET;
+    }
+
+    if (next < addresses.size() && now >= next_attempt) {
+      socket_t sockfd =
+          open_client_socket(addresses[next++], socket_options_, error);
+      struct epoll_event event{};
+      event.events = EPOLLOUT;
+      event.data.fd = sockfd;
+      if (sockfd != INVALID_SOCKET &&
+          epoll_ctl(attempts_fd, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+        close_socket(sockfd);
+        sockfd = INVALID_SOCKET;
+      }
+      if (sockfd != INVALID_SOCKET) {
+        attempts.push_back(sockfd);
+        next_attempt = now + constants::CONNECTION_ATTEMPT_DELAY;
+      }
+      continue;
+    }
+    if (attempts.empty()) {
+      error = Error::Connection;
+      co_return INVALID_SOCKET;
+    }
+
+    co_await loop_.readable(attempts_fd, next < addresses.size()
+                                             ? std::min(next_attempt, deadline)
+                                             : deadline);
+
+    std::array<struct epoll_event, 8> events;
+    int ready = epoll_wait(attempts_fd, events.data(), events.size(), 0);
+    for (int i = 0; i < ready; ++i) {
+      socket_t sockfd = events[i].data.fd;
+      epoll_ctl(attempts_fd, EPOLL_CTL_DEL, sockfd, nullptr);
+      std::erase(attempts, sockfd);
+
+      if (get_connect_error(sockfd) == Error::Success) {
+        error = Error::Success;
+        co_return sockfd;
+      }
+      // The next address is tried right away
+      close_socket(sockfd);
+      next_attempt = Clock::now();
+    }
+  }
+}
+
+Task<ssize_t> AsyncClient::receive(Socket socket, std::span<std::byte> buffer,
+                                   Error &error,
+                                   std::optional<Clock::time_point> deadline) {
+  while (true) {
+    ssize_t bytes = socket.tls != nullptr
+                        ? socket.tls->read(buffer, error)
+                        : recv(socket.sockfd, buffer, buffer.size(), error);
+    if (bytes >= 0) {
+      co_return bytes;
+    }
+    // TLS may have to write, e.g. to answer a key update
+    if (!co_await wait_ready(socket, error,
+                             deadline.value_or(Clock::now() + read_timeout_))) {
+      if (error == Error::WriteTimeout) {
+        error = Error::ReadTimeout;
+      }
+      co_return -1;
+    }
+  }
+}
+
+Task<bool> AsyncClient::send_request(Socket socket,
+                                     std::span<const std::string_view> parts,
+                                     Error &error) {
+  // The part being sent, and how much of it was
+  size_t part = 0;
+  size_t offset = 0;
+
+  while (true) {
+    while (part < parts.size() && offset == parts[part].size()) {
+      ++part;
+      offset = 0;
+    }
+    if (part == parts.size()) {
+      break;
+    }
+
+    std::array<struct iovec, 16> buffers;
+    size_t count = 0;
+    for (size_t i = part; i < parts.size() && count < buffers.size(); ++i) {
+      const auto data = i == part ? parts[i].substr(offset) : parts[i];
+      if (!data.empty()) {
+        buffers[count++] = {const_cast<char *>(data.data()), data.size()};
+      }
+    }
+
+    const auto gathered = std::span(buffers.data(), count);
+    ssize_t bytes = socket.tls != nullptr
+                        ? socket.tls->write(gathered, error)
+                        : send(socket.sockfd, gathered, error);
+    if (bytes < 0) {
+      // TLS may have to read first, e.g. during a renegotiation
+      if (!co_await wait_ready(socket, error,
+                               Clock::now() + write_timeout_)) {
+        if (error == Error::ReadTimeout) {
+          error = Error::WriteTimeout;
+        }
+        co_return false;
+      }
+      continue;
+    }
+
+    for (auto sent = static_cast<size_t>(bytes); sent > 0;) {
+      const size_t length = std::min(sent, parts[part].size() - offset);
+      offset += length;
+      sent -= length;
+      if (offset == parts[part].size()) {
+        ++part;
+        offset = 0;
+      }
+    }
+  }
+
+  error = Error::Success;
+  co_return true;
+}
+
+Task<ssize_t> AsyncClient::receive_to_file(Socket socket,
+                                           const int (&pipe)[2], int fd,
+                                           size_t length, Error &error) {
+  while (true) {
+    ssize_t bytes = splice_to_file(socket.sockfd, pipe, fd, length, error);
+    if (bytes >= 0 || error != Error::ReadTimeout) {
+      co_return bytes;
+    }
+    if (!co_await loop_.readable(socket.sockfd,
+                                 Clock::now() + read_timeout_)) {
+      co_return -1;
+    }
+  }
+}
+
+Task<bool> AsyncClient::send_file(Socket socket, const FileBody &file,
+                                  Error &error) {
+  off_t offset = file.offset;
+  size_t remaining = file.length;
+  // What OpenSSL encrypts is read from the file in pieces
+  std::string piece;
+
+  while (remaining > 0) {
+    ssize_t bytes = -1;
+    if (socket.tls == nullptr || socket.tls->kernel_send()) {
+      bytes =
+          detail::send_file(socket.sockfd, file.fd, offset, remaining, error);
+    } else {
+      piece.resize(std::min(remaining, constants::STREAM_BUFFER_SIZE));
+      const ssize_t read = pread(file.fd, piece.data(), piece.size(), offset);
+      if (read <= 0) {
+        error = Error::File;
+        co_return false;
+      }
+      const struct iovec buffer{piece.data(), static_cast<size_t>(read)};
+      bytes = socket.tls->write(std::span(&buffer, 1), error);
+      if (bytes > 0) {
+        offset += bytes;
+      }
+    }
+
+    if (bytes < 0) {
+      if (!co_await wait_ready(socket, error,
+                               Clock::now() + write_timeout_)) {
+        if (error == Error::ReadTimeout) {
+          error = Error::WriteTimeout;
+        }
+        co_return false;
+      }
+      continue;
+    }
+    remaining -= bytes;
+  }
+
+  error = Error::Success;
+  co_return true;
+}
+
+auto AsyncClient::receive_response(
+    Socket socket, std::string &buffer, const Request &request, Error &error,
+    std::optional<Clock::time_point> &first_byte)
+    -> Task<std::optional<ReceivedResponse>> {
+  first_byte.reset();
+  if (!buffer.empty()) {
+    first_byte = Clock::now();
+  }
+
+  // The pieces of the body that come along with the header, or that are
+  // decoded, are written to the file sink by the parser, the rest is moved
+  // from the socket to the file by the kernel, unless TLS decrypts it
+  bool file_failed = false;
+  BodySink sink = request.body_sink;
+  if (request.file_sink) {
+    sink = [fd = request.file_sink->fd, &file_failed](std::string_view data) {
+      file_failed = file_failed || !write_file(fd, data);
+    };
+  }
+  int pipe_fds[2] = {-1, -1};
+  auto pipe_guard = scope_guard::make_scope_exit([&] {
+    if (pipe_fds[0] >= 0) {
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+    }
+  });
+  const bool splices = request.file_sink && socket.tls == nullptr &&
+                       pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0;
+
+  ResponseParser parser(std::move(buffer),
+                        request.method == RequestMethod::HEAD, std::move(sink),
+                        decodes(request), take_receive_arena());
+  auto arena_guard = scope_guard::make_scope_exit(
+      [&] { give_back_receive_arena(parser.take_arena()); });
+  buffer.clear();
+
+  while (parser.state() != ResponseParser::State::Complete &&
+         parser.state() != ResponseParser::State::Invalid && !file_failed) {
+    ssize_t bytes = -1;
+    if (const size_t length = parser.passthrough_length();
+        splices && length > 0) {
+      bytes = co_await receive_to_file(socket, pipe_fds,
+                                       request.file_sink->fd, length, error);
+      if (bytes > 0) {
+        parser.skip(bytes);
+        if (!first_byte) {
+          first_byte = Clock::now();
+        }
+        continue;
+      }
+    } else {
+      bytes = co_await receive(socket, parser.prepare(), error);
+    }
+
+    if (bytes < 0) {
+      co_return std::nullopt;
+    } else if (bytes == 0) {
+      // Closed before the end of the response
+      error = Error::Read;
+      co_return std::nullopt;
+    }
+    if (!first_byte) {
+      first_byte = Clock::now();
+    }
+    parser.commit(bytes);
+  }
+
+  if (file_failed) {
+    error = Error::File;
+    co_return std::nullopt;
+  }
+  if (parser.state() == ResponseParser::State::Invalid) {
+    error = Error::Read;
+    co_return std::nullopt;
+  }
+
+  // The start of the next response, when requests are pipelined
+  buffer = parser.take_leftover();
+  co_return ReceivedResponse{parser.take_response(), parser.delimited()};
+}
+
+auto AsyncClient::await_continue(Socket socket, std::string &buffer,
+                                 Error &error) -> Task<Expectation> {
+  const auto deadline = Clock::now() + constants::EXPECT_CONTINUE_TIMEOUT;
+  std::array<std::byte, constants::READ_BUFFER_SIZE> received;
+  while (true) {
+    const size_t header_end = buffer.find(constants::HTTP_HEADER_TERMINATOR);
+    if (header_end != std::string::npos) {
+      // The status code of "HTTP/1.1 100 Continue"
+      const auto status = header_end >= 12
+                              ? std::string_view(buffer).substr(9, 3)
+                              : std::string_view{};
+      if (status.empty() || status[0] != '1' || status == "101") {
+        co_return Expectation::Refused;
+      }
+      buffer.erase(0, header_end + constants::HTTP_HEADER_TERMINATOR.size());
+      if (status == "100") {
+        co_return Expectation::Continue;
+      }
+      continue;
+    }
+    if (buffer.size() > constants::MAX_HEADER_SIZE) {
+      // Rejected by the parser of the response
+      co_return Expectation::Refused;
+    }
+
+    const ssize_t bytes = co_await receive(socket, received, error, deadline);
+    if (bytes > 0) {
+      buffer.append(reinterpret_cast<const char *>(received.data()), bytes);
+      continue;
+    }
+    if (bytes == 0) {
+      error = Error::Read;
+      co_return Expectation::Failed;
+    }
+    if (error != Error::ReadTimeout) {
+      co_return Expectation::Failed;
+    }
+    // A response that started arriving is received in full, otherwise the
+    // server is assumed not to know the expectation
+    error = Error::Success;
+    co_return buffer.empty() ? Expectation::Continue : Expectation::Refused;
+  }
+}
+
+std::string AsyncClient::take_head_buffer() {
+  if (head_buffers_.empty()) {
+    return {};
+  }
+  auto buffer = std::move(head_buffers_.back());
+  head_buffers_.pop_back();
+  return buffer;
+}
+
+void AsyncClient::give_back_head_buffer(std::string buffer) {
+  buffer.clear();
+  head_buffers_.push_back(std::move(buffer));
+}
+
+auto AsyncClient::take_receive_arena() -> ResponseParser::Arena {
+  if (receive_arenas_.empty()) {
+    return {};
+  }
+  auto arena = std::move(receive_arenas_.back());
+  receive_arenas_.pop_back();
+  return arena;
+}
+
+void AsyncClient::give_back_receive_arena(ResponseParser::Arena arena) {
+  // The buffer of a chunked body sent in large pieces is not kept
+  if (arena.chunks.capacity() > constants::MAX_HEADER_SIZE) {
+    arena.chunks = {};
+  }
+  receive_arenas_.push_back(std::move(arena));
+}
+
+bool AsyncClient::decodes(const Request &request) const {
+  return decompression_ &&
+         !detail::find_header(request.headers, "Accept-Encoding") &&
+         !detail::find_header(default_headers_, "Accept-Encoding");
+}
+
+bool AsyncClient::expects_continue(const Request &request) const {
+  const size_t size =
+      request.body_file ? request.body_file->length : request.body.size();
+  return expect_continue_ > 0 && size >= expect_continue_ &&
+         !detail::find_header(request.headers, "Expect") &&
+         !detail::find_header(default_headers_, "Expect");
+}
+
+bool AsyncClient::is_retryable(const Request &request, Error error) {
+  switch (error) {
+  case Error::HostNotFound:
+  case Error::Connection:
+  case Error::ConnectionTimeout:
+    // Nothing was sent
+    return true;
+  case Error::Tls:
+    // The server or its certificate is not accepted
+    return false;
+  default:
+    // A streamed body may have been passed to the sink in part
+    return is_idempotent(request.method) && !request.streams_response();
+  }
+}
+
+Task<Result> AsyncClient::perform(Request request) {
+  const auto timeout = request.timeout.value_or(request_timeout_);
+  int done = timeout > std::chrono::microseconds::zero()
+                 ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)
+                 : -1;
+  if (done < 0) {
+    co_return co_await perform_shared(std::move(request));
+  }
+  auto guard = scope_guard::make_scope_exit([&] { close(done); });
+
+  // Destroyed before the eventfd is closed, which cancels the request
+  // wherever it is once the deadline passed, its connection being closed
+  std::optional<Result> result;
+  auto task = run_shared(std::move(request), result, done);
+  task.start();
+  if (!result) {
+    if (!co_await loop_.readable(done, Clock::now() + timeout)) {
+      co_return Result{std::nullopt, Error::Deadline};
+    }
+  }
+  co_return std::move(*result);
+}
+
+Task<> AsyncClient::run_shared(Request request, std::optional<Result> &result,
+                               int done_fd) {
+  result = co_await perform_shared(std::move(request));
+  eventfd_write(done_fd, 1);
+}
+
+Task<Result> AsyncClient::perform_shared(Request request) {
+  if (!coalescing_ || request.streams_response() || !request.body.empty() ||
+      request.body_file ||
+      (request.method != RequestMethod::GET &&
+       request.method != RequestMethod::HEAD)) {
+    co_return co_await perform_cached(std::move(request));
+  }
+
+  const auto key = detail::coalescing_key(request, default_headers_);
+  if (auto it = in_flight_.find(key); it != in_flight_.end()) {
+    auto flight = it->second;
+    int done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done >= 0) {
+      auto guard = scope_guard::make_scope_exit([&] {
+        std::erase(flight->waiters, done);
+        close(done);
+      });
+      flight->waiters.push_back(done);
+      co_await loop_.readable(done, Clock::time_point::max());
+      if (flight->result) {
+        co_return *flight->result;
+      }
+    }
+    // That request was cancelled, this one takes over
+    co_return co_await perform_shared(std::move(request));
+  }
+
+  auto flight = std::make_shared<InFlight>();
+  in_flight_.emplace(key, flight);
+  auto guard = scope_guard::make_scope_exit([&] {
+    in_flight_.erase(key);
+    for (int waiter : flight->waiters) {
+      eventfd_write(waiter, 1);
+    }
+  });
+  flight->result = co_await perform_cached(std::move(request));
+  co_return *flight->result;
+}
+
+Task<Result> AsyncClient::perform_cached(Request request) {
+  if (request_compression_ > 0 &&
+      request.body.size() >= request_compression_ &&
+      !detail::find_header(request.headers, "Content-Encoding")) {
+    request.body = detail::gzip(request.body);
+    request.headers.insert_or_assign("Content-Encoding", "gzip");
+  }
+
+  // The conditional requests of the caller get the response of the server
+  if (!cache_ || request.streams_response() ||
+      detail::find_header(request.headers, "If-None-Match") ||
+      detail::find_header(request.headers, "If-Modified-Since")) {
+    co_return co_await perform_with_retries(request);
+  }
+  const auto origin = host_ + ':' + std::to_string(port_);
+
+  if (request.method != RequestMethod::GET) {
+    auto result = co_await perform_with_retries(request);
+    if (request.method != RequestMethod::HEAD && result &&
+        result->status_code < 400) {
+      cache_->invalidate(origin, request.path);
+    }
+    co_return result;
+  }
+
+  auto cached = cache_->lookup(origin, request, default_headers_);
+  if (cached && cached->fresh) {
+    co_return Result{std::move(cached->response), Error::Success};
+  }
+  if (cached) {
+    request.headers.insert(cached->validators.begin(),
+                           cached->validators.end());
+  }
+
+  auto result = co_await perform_with_retries(request);
+  if (result && cached && result->status_code == 304) {
+    auto response = cache_->revalidate(origin, request, *result);
+    co_return Result{response ? std::move(*response)
+                              : std::move(cached->response),
+                     Error::Success};
+  }
+  if (result) {
+    cache_->store(origin, request, default_headers_, *result);
+  }
+  co_return result;
+}
+
+Task<Result> AsyncClient::perform_with_retries(const Request &request) {
+  retry_budget_.deposit();
+
+  for (size_t attempt = 1;; ++attempt) {
+    std::optional<std::chrono::microseconds> hedge_delay;
+    if (hedging_policy_.enabled && request.method == RequestMethod::GET &&
+        !request.streams_response()) {
+      hedge_delay = latencies_.quantile(hedging_policy_.quantile,
+                                        hedging_policy_.min_samples);
+    }
+
+    Result result;
+    if (hedge_delay) {
+      result = co_await hedge(request, *hedge_delay);
+    } else {
+      result = co_await process_request(request);
+    }
+    if (result || attempt >= retry_policy_.max_attempts ||
+        !is_retryable(request, result.error()) || !retry_budget_.withdraw()) {
+      co_return result;
+    }
+    co_await loop_.sleep_for(detail::backoff(retry_policy_, attempt, rng_));
+  }
+}
+
+Task<> AsyncClient::run_attempt(const Request &request,
+                                std::optional<Result> &result, int done_fd) {
+  result = co_await process_request(request);
+  eventfd_write(done_fd, 1);
+}
+
+Task<> AsyncClient::fetch_range(const Request &request, int fd, size_t begin,
+                                size_t end, std::optional<Result> &result,
+                                int done_fd) {
+  Request range = request;
+  bool failed = false;
+  size_t offset = begin;
+  // What comes past the range, if the server ignored it, is dropped
+  range.body_sink = [&](std::string_view data) {
+    data = data.substr(0, end - offset);
+    failed = failed || !write_file(fd, data, static_cast<off_t>(offset));
+    offset += data.size();
+  };
+
+  for (size_t attempt = 1;; ++attempt) {
+    const size_t from = offset;
+    range.headers.insert_or_assign("Range", "bytes=" + std::to_string(from) +
+                                                '-' + std::to_string(end - 1));
+    auto response = co_await perform(range);
+    if (failed) {
+      result = Result{std::nullopt, Error::File};
+      break;
+    }
+    if (response && response->status_code / 100 == 2 &&
+        (response->status_code != 206 ||
+         detail::content_range_start(
+             response->headers.find("Content-Range").value_or("")) != from)) {
+      result = Result{std::nullopt, Error::Range};
+      break;
+    }
+    if (response && (response->status_code != 206 || offset == end)) {
+      result = std::move(response);
+      break;
+    }
+
+    // Cut short, it is resumed as long as the attempts make progress
+    if (offset == from || attempt == constants::MAX_RANGE_ATTEMPTS) {
+      result = response ? Result{std::nullopt, Error::Read}
+                        : std::move(response);
+      break;
+    }
+  }
+  eventfd_write(done_fd, 1);
+}
+
+Task<Result> AsyncClient::hedge(const Request &request,
+                                std::chrono::microseconds delay) {
+  int done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (done < 0) {
+    co_return co_await process_request(request);
+  }
+  auto guard = scope_guard::make_scope_exit([&] { close(done); });
+
+  // Destroyed before the eventfd is closed, which cancels the attempt still
+  // running once the other one succeeded
+  std::array<std::optional<Result>, 2> results;
+  std::array<std::optional<Task<>>, 2> attempts;
+  attempts[0].emplace(run_attempt(request, results[0], done));
+  attempts[0]->start();
+  size_t started = 1;
+  const auto hedge_at = Clock::now() + delay;
+
+  while (true) {
+    bool all_done = true;
+    for (size_t i = 0; i < started; ++i) {
+      if (results[i] && *results[i]) {
+        co_return std::move(*results[i]);
+      }
+      all_done = all_done && results[i].has_value();
+    }
+    // The first one failed before being hedged, or both failed
+    if (all_done) {
+      co_return std::move(*results[0]);
+    }
+
+    if (!co_await loop_.readable(done, started == 1
+                                           ? hedge_at
+                                           : Clock::time_point::max())) {
+      attempts[1].emplace(run_attempt(request, results[1], done));
+      attempts[1]->start();
+      started = 2;
+      continue;
+    }
+    eventfd_t count;
+    eventfd_read(done, &count);
+  }
+}
+
+Task<Result> AsyncClient::process_request(const Request &request) {
+  Error error = Error::Success;
+  const auto start = Clock::now();
+  RequestTiming timing;
+
+  // The connection of a server that chose HTTP/1.1 carries the request
+  std::optional<ConnectionPool::Connection> http1;
+  if (http2_ && http2_supported_ != false) {
+    if (auto result = co_await process_http2_request(request, timing, http1)) {
+      co_return std::move(*result);
+    }
+  }
+
+  // The body is sent from the request, or from its file, after the head
+  std::string head = take_head_buffer();
+  auto head_guard = scope_guard::make_scope_exit(
+      [&] { give_back_head_buffer(std::move(head)); });
+  // The head of a large body is sent first on its own, for the server to
+  // refuse the request before the body is sent
+  const bool expects_continue = this->expects_continue(request);
+  std::string_view extra_fields =
+      decodes(request) ? constants::ACCEPT_ENCODING_FIELD : std::string_view{};
+  std::string expect_fields;
+  if (expects_continue) {
+    expect_fields.append(extra_fields).append(
+        constants::EXPECT_CONTINUE_FIELD);
+    extra_fields = expect_fields;
+  }
+  request.write_head(head, request_host(), default_headers_, extra_fields);
+  const std::array<std::string_view, 2> request_data{head, request.body};
+  const auto request_parts = std::span(request_data);
+
+  ConnectionPool::Connection connection;
+  std::string buffer;
+  std::optional<Clock::time_point> first_byte;
+  std::optional<ReceivedResponse> received_response;
+  // The server answered before the body was sent, which is then left unsent
+  bool refused = false;
+  while (!received_response) {
+    std::optional<ConnectionPool::Connection> connection_opt;
+    if (http1) {
+      connection_opt = std::exchange(http1, std::nullopt);
+    } else {
+      connection_opt = co_await acquire_connection(error, timing);
+    }
+    if (!connection_opt) {
+      co_return Result{std::nullopt, error};
+    }
+    connection = *connection_opt;
+
+    // A failed connection is never given back as idle
+    auto guard = scope_guard::make_scope_exit(
+        [&] { pool_->release(host_, port_, connection.socket, false); });
+
+    const auto write_start = Clock::now();
+    bool sent = co_await send_request(
+        connection.socket,
+        expects_continue ? request_parts.first(1) : request_parts, error);
+    refused = false;
+    if (sent && expects_continue) {
+      switch (co_await await_continue(connection.socket, buffer, error)) {
+      case Expectation::Continue:
+        sent = co_await send_request(connection.socket,
+                                     request_parts.subspan(1), error);
+        break;
+      case Expectation::Refused:
+        refused = true;
+        break;
+      case Expectation::Failed:
+        sent = false;
+        break;
+      }
+    }
+    if (sent && !refused && request.body_file) {
+      sent = co_await send_file(connection.socket, *request.body_file, error);
+    }
+    if (sent) {
+      const auto written = Clock::now();
+      timing.write = elapsed(write_start, written);
+      // The interim responses, e.g. a 100 Continue arriving after the body
+      // was sent without it, are skipped
+      do {
+        received_response = co_await receive_response(
+            connection.socket, buffer, request, error, first_byte);
+      } while (received_response &&
+               received_response->response.status_code / 100 == 1 &&
+               received_response->response.status_code != 101);
+      timing.first_byte = elapsed(written, first_byte.value_or(written));
+    }
+    if (received_response) {
+      guard.dismiss();
+      break;
+    }
+
+    // The server may close an idle connection just as it is reused, in which
+    // case the request fails before any of the response is received and is
+    // sent again at once on another connection if it is idempotent, without
+    // counting as an attempt of the retry policy
+    if (!connection.reused || first_byte || !is_connection_lost(error) ||
+        !is_idempotent(request.method)) {
+      co_return Result{std::nullopt, error};
+    }
+  }
+
+  auto &[response, delimited] = *received_response;
+
+  // Anything past the response was not asked for, so the connection is out of
+  // step with the requests, and the server still expects the body of a
+  // refused request
+  pool_->release(host_, port_, connection.socket,
+                 !refused && delimited && buffer.empty() &&
+                     keeps_alive(request, default_headers_, response));
+
+  const auto now = Clock::now();
+  timing.receive = elapsed(*first_byte, now);
+  timing.total = elapsed(start, now);
+  latencies_.add(timing.total);
+  log(request, response, timing);
+  co_return Result{std::move(response), error};
+}
+
+auto AsyncClient::process_http2_request(
+    const Request &request, RequestTiming &timing,
+    std::optional<ConnectionPool::Connection> &http1)
+    -> Task<std::optional<Result>> {
+  const auto start = Clock::now();
+  Error error = Error::Success;
+  // A stream the server refused, or lost along with its connection before
+  // any of the response, is sent once more on a new connection
+  for (size_t attempt = 1;; ++attempt) {
+    auto connection = co_await acquire_http2_connection(error, timing, http1);
+    if (!connection) {
+      if (http1 || http2_supported_ == false) {
+        co_return std::nullopt;
+      }
+      co_return Result{std::nullopt, error};
+    }
+
+    bool refused = false;
+    auto response = co_await connection->request(
+        request, default_headers_, decodes(request), timing, error, refused);
+    if (response) {
+      timing.total = elapsed(start, Clock::now());
+      latencies_.add(timing.total);
+      log(request, *response, timing);
+      co_return Result{std::move(*response), Error::Success};
+    }
+    if (!refused || attempt == 2) {
+      co_return Result{std::nullopt, error};
+    }
+  }
+}
+
+Task<> AsyncClient::pipeline_requests(const std::vector<Request> &requests,
+                                      size_t begin, size_t end,
+                                      std::vector<Result> &results) {
+  Error error = Error::Success;
+  while (begin < end) {
+    const auto start = Clock::now();
+    RequestTiming timing;
+    auto connection = co_await acquire_connection(error, timing);
+    if (!connection) {
+      break;
+    }
+
+    // A failed connection is never given back as idle
+    bool reusable = false;
+    auto guard = scope_guard::make_scope_exit(
+        [&] { pool_->release(host_, port_, connection->socket, reusable); });
+
+    // The heads are written in a single buffer, each followed by its body
+    std::string heads = take_head_buffer();
+    auto heads_guard = scope_guard::make_scope_exit(
+        [&] { give_back_head_buffer(std::move(heads)); });
+    std::vector<size_t> head_ends;
+    for (size_t i = begin; i < end; ++i) {
+      requests[i].write_head(heads, request_host(), default_headers_,
+                             decodes(requests[i])
+                                 ? constants::ACCEPT_ENCODING_FIELD
+                                 : std::string_view{});
+      head_ends.push_back(heads.size());
+    }
+    std::vector<std::string_view> request_data;
+    for (size_t i = begin, head = 0; i < end; ++i) {
+      request_data.push_back(std::string_view(heads).substr(
+          head, head_ends[i - begin] - head));
+      request_data.push_back(requests[i].body);
+      head = head_ends[i - begin];
+    }
+
+    // The responses come back in the order of the requests, their timing
+    // counted from the requests being written
+    const size_t first = begin;
+    std::optional<Clock::time_point> first_byte;
+    bool closed = false;
+    std::string buffer;
+    // Only the last request of the group may have its body in a file
+    const auto write_start = Clock::now();
+    bool sent = co_await send_request(connection->socket, request_data, error);
+    if (sent && requests[end - 1].body_file) {
+      sent = co_await send_file(connection->socket,
+                                *requests[end - 1].body_file, error);
+    }
+    if (sent) {
+      const auto written = Clock::now();
+      timing.write = elapsed(write_start, written);
+      while (begin < end && !closed) {
+        const auto &request = requests[begin];
+        auto received_response = co_await receive_response(
+            connection->socket, buffer, request, error, first_byte);
+        if (!received_response) {
+          break;
+        }
+
+        auto &[response, delimited] = *received_response;
+        closed =
+            !delimited || !keeps_alive(request, default_headers_, response);
+
+        const auto now = Clock::now();
+        timing.first_byte = elapsed(written, *first_byte);
+        timing.receive = elapsed(*first_byte, now);
+        timing.total = elapsed(start, now);
+        log(request, response, timing);
+        results[begin++] = Result{std::move(response), Error::Success};
+      }
+    }
+    reusable = begin == end && !closed && buffer.empty();
+
+    if (begin == end) {
+      break;
+    }
+
+    // The server closed the connection before answering every request: the
+    // last one is not retried if it is not idempotent, as it may have been
+    // processed, the others are sent again on another connection as long as
+    // this one made progress, or was reused and failed before any response
+    if (!is_idempotent(requests[end - 1].method)) {
+      results[--end] = Result{std::nullopt, closed ? Error::Read : error};
+    }
+    if (begin == first &&
+        (!connection->reused || first_byte || !is_connection_lost(error))) {
+      for (; begin < end; ++begin) {
+        results[begin] = Result{std::nullopt, error};
+      }
+    }
+  }
+
+  // Those left when no connection could be acquired
+  for (; begin < end; ++begin) {
+    results[begin] = Result{std::nullopt, error};
+  }
+}
+
+Task<std::vector<Result>> AsyncClient::Pipeline(std::vector<Request> requests) {
+  std::vector<Result> results(requests.size());
+
+  // Over HTTP/2 the requests are all sent at once, as streams of the
+  // connection, rather than pipelined
+  int done = http2_ && http2_supported_ != false
+                 ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)
+                 : -1;
+  if (done >= 0) {
+    auto guard = scope_guard::make_scope_exit([&] { close(done); });
+    std::vector<std::optional<Result>> streams(requests.size());
+    std::vector<Task<>> attempts;
+    attempts.reserve(requests.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+      attempts.push_back(run_attempt(requests[i], streams[i], done));
+      attempts.back().start();
+    }
+    while (!std::ranges::all_of(
+        streams, [](const auto &result) { return result.has_value(); })) {
+      co_await loop_.readable(done, Clock::time_point::max());
+      eventfd_t count;
+      eventfd_read(done, &count);
+    }
+    for (size_t i = 0; i < requests.size(); ++i) {
+      results[i] = std::move(*streams[i]);
+    }
+    co_return results;
+  }
+
+  // Up to the pipeline depth is written back to back, and nothing after a
+  // request that is not idempotent, until its response is received, or
+  // after one whose body is sent from a file
+  size_t begin = 0;
+  while (begin < requests.size()) {
+    size_t end = begin;
+    while (end < requests.size() &&
+           end - begin < std::max<size_t>(pipeline_depth_, 1)) {
+      const auto &request = requests[end++];
+      if (!is_idempotent(request.method) || request.body_file) {
+        break;
+      }
+    }
+    co_await pipeline_requests(requests, begin, end, results);
+    begin = end;
+  }
+
+  co_return results;
+}
+
+Task<Error> AsyncClient::preconnect(size_t connections) {
+  // A single HTTP/2 connection carries every request
+  if (http2_ && http2_supported_ != false) {
+    Error error = Error::Success;
+    RequestTiming timing;
+    std::optional<ConnectionPool::Connection> http1;
+    co_await acquire_http2_connection(error, timing, http1);
+    if (http1) {
+      pool_->release(host_, port_, http1->socket, true);
+    }
+    co_return error;
+  }
+
+  connections = std::min(
+      connections,
+      std::max<size_t>(pool_->config().max_connections_per_host, 1));
+
+  // Held until the last one is open, so that each is another connection
+  std::vector<ConnectionPool::Connection> opened;
+  auto guard = scope_guard::make_scope_exit([&] {
+    for (const auto &connection : opened) {
+      pool_->release(host_, port_, connection.socket, true);
+    }
+  });
+
+  Error last_error = Error::Success;
+  for (size_t i = 0; i < connections; ++i) {
+    Error error = Error::Success;
+    RequestTiming timing;
+    if (auto connection = co_await acquire_connection(error, timing)) {
+      opened.push_back(*connection);
+    } else {
+      last_error = error;
+    }
+  }
+  co_return last_error;
+}
+
+Task<Result> AsyncClient::Get(const std::string &path) {
+  Request request{
+      .method = RequestMethod::GET,
+      .path = path,
+  };
+  return Get(request);
+}
+
+Task<Result> AsyncClient::Get(const std::string &path, Headers headers) {
+  Request request{.method = RequestMethod::GET,
+                  .path = path,
+                  .headers = std::move(headers)};
+  return Get(request);
+}
+
+Task<Result> AsyncClient::Get(const std::string &path, Headers headers,
+                              BodySink sink) {
+  Request request{.method = RequestMethod::GET,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body_sink = std::move(sink)};
+  return Get(request);
+}
+
+Task<Result> AsyncClient::Get(const std::string &path, Headers headers,
+                              FileSink sink) {
+  Request request{.method = RequestMethod::GET,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .file_sink = sink};
+  return Get(request);
+}
+
+Task<Result> AsyncClient::Get(const Request &request) {
+  return perform(request);
+}
+
+Task<Result> AsyncClient::Post(const std::string &path) {
+  Request request{
+      .method = RequestMethod::POST,
+      .path = path,
+      .body = "",
+  };
+  return Post(request);
+}
+
+Task<Result> AsyncClient::Post(const std::string &path, Headers headers) {
+  Request request{.method = RequestMethod::POST,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body = ""};
+  return Post(request);
+}
+
+Task<Result> AsyncClient::Post(const std::string &path, const std::string &body) {
+  Request request{.method = RequestMethod::POST, .path = path, .body = body};
+  return Post(request);
+}
+
+Task<Result> AsyncClient::Post(const std::string &path, const std::string &body,
+                    Headers headers) {
+  Request request{.method = RequestMethod::POST,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body = body};
+  return Post(request);
+}
+
+Task<Result> AsyncClient::Post(const std::string &path, FileBody body,
+                               Headers headers) {
+  Request request{.method = RequestMethod::POST,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body_file = body};
+  return Post(request);
+}
+
+Task<Result> AsyncClient::Post(const Request &request) {
+  return perform(request);
+}
+
+Task<Result> AsyncClient::Put(const std::string &path) {
+  Request request{
+      .method = RequestMethod::PUT,
+      .path = path,
+      .body = "",
+  };
+  return Put(request);
+}
+
+Task<Result> AsyncClient::Put(const std::string &path, Headers headers) {
+  Request request{.method = RequestMethod::PUT,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body = ""};
+  return Put(request);
+}
+
+Task<Result> AsyncClient::Put(const std::string &path, const std::string &body) {
+  Request request{.method = RequestMethod::PUT, .path = path, .body = body};
+  return Put(request);
+}
+
+Task<Result> AsyncClient::Put(const std::string &path, const std::string &body,
+                   Headers headers) {
+  Request request{.method = RequestMethod::PUT,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body = body};
+  return Put(request);
+}
+
+Task<Result> AsyncClient::Put(const std::string &path, FileBody body,
+                              Headers headers) {
+  Request request{.method = RequestMethod::PUT,
+                  .path = path,
+                  .headers = std::move(headers),
+                  .body_file = body};
+  return Put(request);
+}
+
+Task<Result> AsyncClient::Put(const Request &request) {
+  return perform(request);
+}
+
+Task<Result> AsyncClient::Delete(const std::string &path) {
+  Request request{
+      .method = RequestMethod::DELETE,
+      .path = path,
+  };
+  return Delete(request);
+}
+
+Task<Result> AsyncClient::Delete(const std::string &path, Headers headers) {
+  Request request{.method = RequestMethod::DELETE,
+                  .path = path,
+                  .headers = std::move(headers)};
+  return Delete(request);
+}
+
+Task<Result> AsyncClient::Delete(const Request &request) {
+  return perform(request);
+}
+
+Task<Result> AsyncClient::Head(const std::string &path) {
+  Request request{
+      .method = RequestMethod::HEAD,
+      .path = path,
+  };
+  return Head(request);
+}
+
+Task<Result> AsyncClient::Head(const std::string &path, Headers headers) {
+  Request request{.method = RequestMethod::HEAD,
+                  .path = path,
+                  .headers = std::move(headers)};
+  return Head(request);
+}
+
+Task<Result> AsyncClient::Head(const Request &request) {
+  return perform(request);
+}
+
+Task<Result> AsyncClient::Download(std::string path, int fd,
+                                   DownloadOptions options) {
+  // The ranges are those of the resource, not of a coding of it
+  options.headers.insert_or_assign("Accept-Encoding", "identity");
+  Request request{.method = RequestMethod::HEAD,
+                  .path = std::move(path),
+                  .headers = std::move(options.headers)};
+  auto head = co_await perform(request);
+  if (!head || head->status_code != 200) {
+    co_return head;
+  }
+
+  const auto length =
+      detail::parse_size(head->headers.find("Content-Length").value_or(""));
+  // Accept-Ranges is a list of tokens, like Connection
+  size_t count = 1;
+  if (length && detail::has_connection_option(
+                    head->headers.find("Accept-Ranges"), "bytes")) {
+    count = std::clamp(*length / std::max<size_t>(options.min_range_size, 1),
+                       size_t{1},
+                       std::max<size_t>(
+                           std::min(options.connections,
+                                    pool_->config().max_connections_per_host),
+                           1));
+  }
+
+  // Allocated up front, so that running out of space fails the download
+  // before it starts, and the ranges are written in place
+  if (ftruncate(fd, static_cast<off_t>(length.value_or(0))) != 0 ||
+      (length.value_or(0) > 0 && fallocate(fd, 0, 0, *length) != 0 &&
+       errno != EOPNOTSUPP)) {
+    co_return Result{std::nullopt, Error::File};
+  }
+
+  request.method = RequestMethod::GET;
+  if (count == 1) {
+    bool failed = false;
+    off_t offset = 0;
+    request.body_sink = [&](std::string_view data) {
+      failed = failed || !write_file(fd, data, offset);
+      offset += data.size();
+    };
+    auto result = co_await perform(request);
+    if (failed) {
+      co_return Result{std::nullopt, Error::File};
+    }
+    co_return result;
+  }
+
+  // A range asked after the resource changed is answered with all of it
+  // instead, which fails the download rather than mixing the two
+  if (auto etag = head->headers.find("ETag");
+      etag && !etag->starts_with("W/")) {
+    request.headers.insert_or_assign("If-Range", std::string(*etag));
+  } else if (auto modified = head->headers.find("Last-Modified")) {
+    request.headers.insert_or_assign("If-Range", std::string(*modified));
+  }
+
+  int done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (done < 0) {
+    co_return Result{std::nullopt, Error::Unknown};
+  }
+  auto guard = scope_guard::make_scope_exit([&] { close(done); });
+
+  // Destroyed before the eventfd is closed, which cancels the ranges still
+  // being fetched once one of them failed
+  std::vector<std::optional<Result>> results(count);
+  std::vector<Task<>> ranges;
+  ranges.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    ranges.push_back(fetch_range(request, fd, *length * i / count,
+                                 *length * (i + 1) / count, results[i], done));
+    ranges.back().start();
+  }
+
+  while (true) {
+    size_t fetched = 0;
+    for (auto &result : results) {
+      if (result && (!*result || (*result)->status_code != 206)) {
+        co_return std::move(*result);
+      }
+      fetched += result.has_value();
+    }
+    if (fetched == count) {
+      co_return head;
+    }
+
+    co_await loop_.readable(done, Clock::time_point::max());
+    eventfd_t value;
+    eventfd_read(done, &value);
+  }
+}
+
+} // namespace http
@@ -0,0 +1,385 @@
+#pragma once
+
+#include "connection_pool.hpp"
+#include "constants.hpp"
+#include "error.hpp"
+#include "event_loop.hpp"
+#include "http2.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "response_cache.hpp"
+#include "response_parser.hpp"
+#include "retry_policy.hpp"
+#include "socket.hpp"
+#include "socket_utils.hpp"
+#include "task.hpp"
+#include "tls.hpp"
+#include "utils.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace http {
+
+struct DownloadOptions {
+  // The ranges fetched at once, each on its own connection
+  size_t connections{constants::DEFAULT_DOWNLOAD_CONNECTIONS};
+  // A smaller resource is fetched in fewer ranges, or whole
+  size_t min_range_size{constants::DEFAULT_MIN_RANGE_SIZE};
+  // Sent with each of the requests
+  Headers headers{};
+};
+
+// A client whose requests are coroutines run by an event loop, so that a
+// single thread can keep many of them in flight. The client must outlive the
+// requests it started.
+class AsyncClient {
+public:
+  AsyncClient(EventLoop &loop, std::string host, uint16_t port = 80,
+              std::shared_ptr<ConnectionPool> pool = ConnectionPool::shared())
+      : loop_(loop), host_(std::move(host)), port_(port),
+        pool_(std::move(pool)) {}
+
+  void set_connection_timeout(utils::Duration auto timeout) {
+    connection_timeout_ =
+        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  }
+  void set_read_timeout(utils::Duration auto timeout) {
+    read_timeout_ =
+        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  }
+  void set_write_timeout(utils::Duration auto timeout) {
+    write_timeout_ =
+        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  }
+  // The most a request may take from start to end, waiting for a connection,
+  // connecting, retrying and receiving the whole response included, after
+  // which it is cancelled and fails with Error::Deadline; zero for no limit.
+  // The timeouts above still bound each wait within it.
+  void set_request_timeout(utils::Duration auto timeout) {
+    request_timeout_ =
+        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  }
+
+  void set_socket_options(SocketOptions options) {
+    socket_options_ = options;
+  }
+
+  // Requests written back to back on a connection by Pipeline
+  void set_pipeline_depth(size_t depth) { pipeline_depth_ = depth; }
+
+  // Whether the host is resolved on the thread of the shared Resolver rather
+  // than by blocking the event loop, when its addresses are not cached
+  void set_resolve_in_background(bool background) {
+    resolve_in_background_ = background;
+  }
+
+  // The connections are over TLS (HTTPS), resuming the sessions the context
+  // keeps for the origin; nullptr for plaintext. The pool must not be shared
+  // with plaintext clients of the same origin.
+  void set_tls(std::shared_ptr<TlsContext> context = TlsContext::shared()) {
+    tls_ = std::move(context);
+  }
+
+  // Whether the requests are streams of a single HTTP/2 connection, over
+  // which they are sent at once, Pipeline included. Over TLS the server is
+  // offered HTTP/2 and HTTP/1.1 is used if it chooses so (ALPN); otherwise it
+  // must support HTTP/2 without being asked (prior knowledge).
+  void set_http2(bool enabled) { http2_ = enabled; }
+
+  void set_retry_policy(RetryPolicy policy) {
+    retry_policy_ = policy;
+    retry_budget_ = detail::RetryBudget(policy);
+  }
+  void set_hedging_policy(HedgingPolicy policy) {
+    hedging_policy_ = policy;
+    latencies_ = detail::LatencyWindow(policy.window);
+  }
+
+  // The GET responses are reused from the cache, which may be shared with
+  // other clients, and the requests that change a resource drop it. Pipeline
+  // does not go through it.
+  void set_response_cache(std::shared_ptr<ResponseCache> cache) {
+    cache_ = std::move(cache);
+  }
+
+  // Whether a GET or HEAD request identical to one in flight, down to its
+  // headers, waits for the response of that one instead of being sent as
+  // well. Pipeline does not go through it.
+  void set_coalescing(bool enabled) { coalescing_ = enabled; }
+
+  // Whether the responses are asked in gzip or deflate and decoded as they
+  // arrive, for the requests that give no Accept-Encoding of their own. The
+  // headers are kept as received.
+  void set_decompression(bool enabled) { decompression_ = enabled; }
+  // The bodies of at least min_size bytes that have no Content-Encoding are
+  // sent compressed with gzip, which the server must accept; 0 to never
+  void set_request_compression(size_t min_size) {
+    request_compression_ = min_size;
+  }
+  // The bodies of at least min_size bytes are sent over HTTP/1.1 with
+  // Expect: 100-continue, once the server answers the head with 100 Continue
+  // or fails to answer within EXPECT_CONTINUE_TIMEOUT; a final response
+  // given instead, e.g. 401 or 413, is returned without sending the body.
+  // Pipeline does not wait. 0 to never.
+  void set_expect_continue(size_t min_size) { expect_continue_ = min_size; }
+
+  void set_logger(Logger logger) { logger_ = std::move(logger); }
+  // Also given how long each phase of the request took, e.g. to be recorded
+  // in RequestMetrics
+  void set_timed_logger(TimedLogger logger) {
+    timed_logger_ = std::move(logger);
+  }
+
+  // Sent with every request that has no header of the same name, e.g. the
+  // credentials of a session
+  void set_default_header(std::string name, std::string value) {
+    default_headers_.insert_or_assign(std::move(name), std::move(value));
+  }
+  void remove_default_header(const std::string &name) {
+    default_headers_.erase(name);
+  }
+  const Headers &default_headers() const { return default_headers_; }
+
+  Task<Result> Get(const std::string &path);
+  Task<Result> Get(const std::string &path, Headers headers);
+  // The body is passed to the sink as it arrives, instead of being kept
+  Task<Result> Get(const std::string &path, Headers headers, BodySink sink);
+  Task<Result> Get(const std::string &path, Headers headers, FileSink sink);
+  Task<Result> Get(const Request &);
+
+  Task<Result> Post(const std::string &path);
+  Task<Result> Post(const std::string &path, const std::string &body);
+  Task<Result> Post(const std::string &path, Headers headers);
+  Task<Result> Post(const std::string &path, const std::string &body,
+                    Headers headers);
+  // The body is sent from the file
+  Task<Result> Post(const std::string &path, FileBody body, Headers headers);
+  Task<Result> Post(const Request &);
+
+  Task<Result> Put(const std::string &path);
+  Task<Result> Put(const std::string &path, const std::string &body);
+  Task<Result> Put(const std::string &path, Headers headers);
+  Task<Result> Put(const std::string &path, const std::string &body,
+                   Headers headers);
+  Task<Result> Put(const std::string &path, FileBody body, Headers headers);
+  Task<Result> Put(const Request &);
+
+  Task<Result> Delete(const std::string &path);
+  Task<Result> Delete(const std::string &path, Headers headers);
+  Task<Result> Delete(const Request &);
+
+  Task<Result> Head(const std::string &path);
+  Task<Result> Head(const std::string &path, Headers headers);
+  Task<Result> Head(const Request &);
+
+  // Download the resource into the file, which ends up its size. A HEAD
+  // request tells its size and whether the server accepts byte ranges, in
+  // which case they are fetched at once, over as many connections as the
+  // options and the pool allow, each written where it belongs in the file;
+  // otherwise it is fetched whole. The response to the HEAD request once
+  // done, or the first one that failed, without their bodies.
+  Task<Result> Download(std::string path, int fd,
+                        DownloadOptions options = {});
+
+  // Open connections to the origin ahead of the requests and leave them idle
+  // in the pool, so that the first requests find them resolved, connected and
+  // past the TLS handshake. As many as the pool allows at most, counting
+  // those already idle. The error of the last connection that failed.
+  Task<Error> preconnect(size_t connections = 1);
+
+  // Perform the requests on a single connection, written back to back up to
+  // the pipeline depth and their responses read in order, for servers that
+  // support HTTP/1.1 pipelining. Nothing is pipelined after a request that is
+  // not idempotent. The results are in the order of the requests.
+  Task<std::vector<Result>> Pipeline(std::vector<Request> requests);
+
+private:
+  using Clock = EventLoop::Clock;
+
+  // A request whose response the identical ones started meanwhile wait for
+  struct InFlight {
+    std::optional<Result> result{};
+    // The eventfds of the waiting requests, written once it completes
+    std::vector<int> waiters{};
+  };
+
+  struct ReceivedResponse {
+    Response response;
+    // Whether the end of the response is known without the server closing
+    // the connection
+    bool delimited{};
+  };
+
+  void log(const Request &request, const Response &response,
+           const RequestTiming &timing) {
+    if (logger_) {
+      logger_(request, response);
+    }
+    if (timed_logger_) {
+      timed_logger_(request, response, timing);
+    }
+  }
+
+  // The buffers the heads of the requests are written in, reused between
+  // them
+  std::string take_head_buffer();
+  void give_back_head_buffer(std::string buffer);
+  // The working buffers the responses are parsed with, likewise
+  ResponseParser::Arena take_receive_arena();
+  void give_back_receive_arena(ResponseParser::Arena arena);
+
+  // Whether the response to the request is asked encoded and decoded
+  bool decodes(const Request &request) const;
+
+  // Whether a request that failed with the error can be attempted again
+  static bool is_retryable(const Request &request, Error error);
+
+  // Performs the request within its deadline, if it has one
+  Task<Result> perform(Request request);
+  // Shares the response of an identical request in flight, if it can, and
+  // performs the request through the cache otherwise
+  Task<Result> perform_shared(Request request);
+  // Answers the request from the response cache, or revalidates it, when it
+  // can, and performs it otherwise
+  Task<Result> perform_cached(Request request);
+
+  // The coroutines below are awaited as soon as they are called, so their
+  // reference parameters outlive them
+  // Attempts the request as the retry policy allows, hedging it if it is an
+  // idempotent GET
+  Task<Result> perform_with_retries(const Request &request);
+  Task<Result> hedge(const Request &request, std::chrono::microseconds delay);
+  Task<Result> process_request(const Request &request);
+  // std::nullopt if the request is to be sent over HTTP/1.1 instead, on the
+  // connection given back by the server choosing it, if any
+  auto process_http2_request(const Request &request, RequestTiming &timing,
+                             std::optional<ConnectionPool::Connection> &http1)
+      -> Task<std::optional<Result>>;
+  Task<> pipeline_requests(const std::vector<Request> &requests, size_t begin,
+                           size_t end, std::vector<Result> &results);
+  // Records how long resolving and connecting took, if they were needed
+  auto acquire_connection(Error &error, RequestTiming &timing)
+      -> Task<std::optional<ConnectionPool::Connection>>;
+  // The HTTP/2 connection to the origin, opened by the first request that
+  // finds none usable while the others wait for it. nullptr if the server
+  // chose HTTP/1.1, the connection being handed over in http1, or on error.
+  auto acquire_http2_connection(
+      Error &error, RequestTiming &timing,
+      std::optional<ConnectionPool::Connection> &http1)
+      -> Task<std::shared_ptr<detail::Http2Connection>>;
+  // The host, and the port unless it is the default of the scheme
+  std::string authority() const;
+  // The Host of the requests, UNIX_SOCKET_HOST for a Unix domain socket
+  std::string_view request_host() const;
+  auto resolve(Clock::time_point deadline, Error &error)
+      -> Task<std::optional<detail::HostAddresses>>;
+  // Started by hedge, which owns it: writes the eventfd once done
+  Task<> run_attempt(const Request &request, std::optional<Result> &result,
+                     int done_fd);
+  // Started by perform, which cancels it past the deadline
+  Task<> run_shared(Request request, std::optional<Result> &result,
+                    int done_fd);
+  // Started by Download: fetches the bytes [begin, end) of the resource into
+  // the file, resuming where an attempt stopped, then writes the eventfd
+  Task<> fetch_range(const Request &request, int fd, size_t begin,
+                     size_t end, std::optional<Result> &result, int done_fd);
+  // Make the connected socket a TLS connection
+  Task<bool> handshake(detail::Socket &socket, Clock::time_point deadline,
+                       Error &error);
+  // Connect to the first address that accepts, the next one being tried
+  // whenever the previous attempts take longer than CONNECTION_ATTEMPT_DELAY
+  // or fail (Happy Eyeballs)
+  Task<detail::socket_t> connect(const detail::HostAddresses &addresses,
+                                 Clock::time_point deadline, Error &error);
+  // Times out after the read timeout, or at the deadline if given
+  Task<ssize_t> receive(detail::Socket socket, std::span<std::byte> buffer,
+                        Error &error,
+                        std::optional<Clock::time_point> deadline = {});
+  // Moves up to length bytes from the socket to the file, through the pipe
+  Task<ssize_t> receive_to_file(detail::Socket socket, const int (&pipe)[2],
+                                int fd, size_t length, Error &error);
+  // Waits for the socket to allow the operation that would have blocked, as
+  // the error says. false if it failed instead, or on timeout.
+  Task<bool> wait_ready(detail::Socket socket, Error error,
+                        Clock::time_point deadline);
+  // Sends the parts back to back, gathered in as few writes as possible
+  Task<bool> send_request(detail::Socket socket,
+                          std::span<const std::string_view> parts,
+                          Error &error);
+  // Sends the body file, after the head
+  Task<bool> send_file(detail::Socket socket, const FileBody &file,
+                       Error &error);
+  // Reads the response to the request, starting with the bytes of the
+  // buffer, where those received past the response are left. first_byte is
+  // when any of it was received, std::nullopt if none was.
+  auto receive_response(detail::Socket socket, std::string &buffer,
+                        const Request &request, Error &error,
+                        std::optional<Clock::time_point> &first_byte)
+      -> Task<std::optional<ReceivedResponse>>;
+
+  enum class Expectation {
+    // The server asked for the body, or did not answer in time
+    Continue,
+    // The server gave its final response, which starts in the buffer
+    Refused,
+    Failed,
+  };
+  // Waits for the answer to the head of a request sent with
+  // Expect: 100-continue, the interim responses being skipped
+  Task<Expectation> await_continue(detail::Socket socket, std::string &buffer,
+                                   Error &error);
+  bool expects_continue(const Request &request) const;
+
+  EventLoop &loop_;
+  Logger logger_{};
+  TimedLogger timed_logger_{};
+  Headers default_headers_{};
+  std::vector<std::string> head_buffers_{};
+  std::vector<ResponseParser::Arena> receive_arenas_{};
+
+  std::string host_;
+  uint16_t port_;
+  std::shared_ptr<ConnectionPool> pool_;
+  std::shared_ptr<TlsContext> tls_{};
+  bool http2_{};
+  // Whether the server speaks HTTP/2, unknown until connected to
+  std::optional<bool> http2_supported_{};
+  std::shared_ptr<detail::Http2Connection> http2_connection_{};
+  bool http2_connecting_{};
+  // The eventfds of the requests waiting for the connection being opened
+  std::vector<int> http2_waiters_{};
+
+  std::chrono::microseconds connection_timeout_{
+      constants::DEFAULT_CONNECTION_TIMEOUT};
+  std::chrono::microseconds read_timeout_{
+      constants::DEFAULT_CLIENT_READ_TIMEOUT};
+  std::chrono::microseconds write_timeout_{
+      constants::DEFAULT_CLIENT_WRITE_TIMEOUT};
+  std::chrono::microseconds request_timeout_{};
+  SocketOptions socket_options_{};
+  size_t pipeline_depth_{constants::DEFAULT_PIPELINE_DEPTH};
+  bool resolve_in_background_{true};
+
+  RetryPolicy retry_policy_{};
+  detail::RetryBudget retry_budget_{};
+  HedgingPolicy hedging_policy_{};
+  detail::LatencyWindow latencies_{};
+  std::shared_ptr<ResponseCache> cache_{};
+  bool coalescing_{true};
+  // Keyed by the method, path and headers of the requests
+  std::unordered_map<std::string, std::shared_ptr<InFlight>> in_flight_{};
+  bool decompression_{true};
+  size_t request_compression_{};
+  size_t expect_continue_{constants::DEFAULT_EXPECT_CONTINUE_SIZE};
+  std::mt19937 rng_{std::random_device{}()};
+};
+
+} // namespace http
@@ -1,112 +1,98 @@
 #pragma once
 
-#include "constants.hpp"
-#include "error.hpp"
-#include "socket.hpp"
+#include "async_client.hpp"
+#include "connection_pool.hpp"
+#include "event_loop.hpp"
+#include "message.hpp"
 #include "utils.hpp"
-#include <chrono>
 #include <cstdint>
-#include <functional>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <vector>
 
 namespace http {
 
-using Headers = std::unordered_map<std::string, std::string>;
-
-struct Response {
-  static auto from_str(std::string_view response_str)
-      -> std::optional<Response>;
-
-  std::string version;
-  int status_code = -1;
-  std::string status_message;
-  std::string body;
-  Headers headers{};
-};
+// A blocking client, running each request on its own event loop
+class Client {
+public:
+  Client(std::string host, uint16_t port = 80,
+         std::shared_ptr<ConnectionPool> pool = ConnectionPool::shared())
+      : loop_(std::make_unique<EventLoop>()),
+        client_(*loop_, std::move(host), port, std::move(pool)) {}
 
-enum class RequestMethod { UNDEFINED = 0, GET, HEAD, POST, PUT, DELETE };
-
-constexpr auto to_string(RequestMethod req_method) {
-  switch (req_method) {
-  case http::RequestMethod::UNDEFINED:
-    return "UNDEFINED";
-  case RequestMethod::GET:
-    return "GET";
-  case RequestMethod::HEAD:
-    return "HEAD";
-  case RequestMethod::POST:
-    return "POST";
-  case RequestMethod::PUT:
-    return "PUT";
-  case RequestMethod::DELETE:
-    return "DELETE";
-  default:
-    utils::unreachable();
+  void set_connection_timeout(utils::Duration auto timeout) {
+    client_.set_connection_timeout(timeout);
   }
-}
-
-struct Request {
-  void add_header(const std::string &key, const std::string &value) {
-    headers.insert_or_assign(key, value);
+  void set_read_timeout(utils::Duration auto timeout) {
+    client_.set_read_timeout(timeout);
+  }
+  void set_write_timeout(utils::Duration auto timeout) {
+    client_.set_write_timeout(timeout);
+  }
+  void set_request_timeout(utils::Duration auto timeout) {
+    client_.set_request_timeout(timeout);
   }
 
-  std::string to_http_string() const;
-
-  RequestMethod method;
-  std::string path;
-  static constexpr std::string_view protocol{"HTTP/1.1"};
-  Headers headers{};
-  std::string body;
-};
+  void set_socket_options(SocketOptions options) {
+    client_.set_socket_options(options);
+  }
 
-class Result {
-public:
-  Result(std::optional<Response> response, Error error)
-      : response_(std::move(response)), error_(error) {}
+  void set_pipeline_depth(size_t depth) { client_.set_pipeline_depth(depth); }
 
-  Result() = default;
+  void set_resolve_in_background(bool background) {
+    client_.set_resolve_in_background(background);
+  }
 
-  operator bool() const { return response_.has_value(); }
-  const Response &operator*() const { return *response_; }
-  Response &operator*() { return *response_; }
-  const Response *operator->() const { return &*response_; }
-  Response *operator->() { return &*response_; }
+  void set_tls(std::shared_ptr<TlsContext> context = TlsContext::shared()) {
+    client_.set_tls(std::move(context));
+  }
 
-  Error error() const { return error_; }
+  void set_http2(bool enabled) { client_.set_http2(enabled); }
 
-private:
-  std::optional<Response> response_;
-  Error error_ = Error::Unknown;
-};
+  void set_retry_policy(RetryPolicy policy) {
+    client_.set_retry_policy(policy);
+  }
+  void set_hedging_policy(HedgingPolicy policy) {
+    client_.set_hedging_policy(policy);
+  }
 
-using Logger = std::function<void(const Request &, const Response &)>;
+  void set_response_cache(std::shared_ptr<ResponseCache> cache) {
+    client_.set_response_cache(std::move(cache));
+  }
 
-class Client {
-public:
-  Client(std::string host, uint16_t port = 80)
-      : host_(std::move(host)), port_(port) {}
+  void set_coalescing(bool enabled) { client_.set_coalescing(enabled); }
 
-  ~Client() { close_connection(); }
+  void set_decompression(bool enabled) { client_.set_decompression(enabled); }
+  void set_request_compression(size_t min_size) {
+    client_.set_request_compression(min_size);
+  }
+  void set_expect_continue(size_t min_size) {
+    client_.set_expect_continue(min_size);
+  }
 
-  void set_connection_timeout(utils::Duration auto timeout) {
-    connection_timeout_ =
-        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  void set_logger(Logger logger) { client_.set_logger(std::move(logger)); }
+  void set_timed_logger(TimedLogger logger) {
+    client_.set_timed_logger(std::move(logger));
   }
-  void set_read_timeout(utils::Duration auto timeout) {
-    read_timeout_ =
-        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
-    ;
+
+  void set_default_header(std::string name, std::string value) {
+    client_.set_default_header(std::move(name), std::move(value));
   }
-  void set_write_timeout(utils::Duration auto timeout) {
-    write_timeout_ =
-        std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  void remove_default_header(const std::string &name) {
+    client_.remove_default_header(name);
   }
+  const Headers &default_headers() const { return client_.default_headers(); }
 
-  void set_logger(Logger logger) { logger_ = std::move(logger); }
+  // The async client the requests run on, and its event loop, to run several
+  // requests at once
+  AsyncClient &async() { return client_; }
+  EventLoop &loop() { return *loop_; }
 
   Result Get(const std::string &path);
   Result Get(const std::string &path, Headers headers);
+  // The body is passed to the sink as it arrives, instead of being kept
+  Result Get(const std::string &path, Headers headers, BodySink sink);
+  Result Get(const std::string &path, Headers headers, FileSink sink);
   Result Get(const Request &);
 
   Result Post(const std::string &path);
@@ -114,42 +100,38 @@ public:
   Result Post(const std::string &path, Headers headers);
   Result Post(const std::string &path, const std::string &body,
               Headers headers);
+  // The body is sent from the file
+  Result Post(const std::string &path, FileBody body, Headers headers);
   Result Post(const Request &);
 
   Result Put(const std::string &path);
   Result Put(const std::string &path, const std::string &body);
   Result Put(const std::string &path, Headers headers);
   Result Put(const std::string &path, const std::string &body, Headers headers);
+  Result Put(const std::string &path, FileBody body, Headers headers);
   Result Put(const Request &);
 
   Result Delete(const std::string &path);
   Result Delete(const std::string &path, Headers headers);
   Result Delete(const Request &);
 
+  Result Head(const std::string &path);
+  Result Head(const std::string &path, Headers headers);
+  Result Head(const Request &);
+
+  // Download the resource into the file, in byte ranges fetched at once when
+  // the server accepts them
+  Result Download(const std::string &path, int fd,
+                  DownloadOptions options = {});
+
+  std::vector<Result> Pipeline(std::vector<Request> requests);
+
+  Error preconnect(size_t connections = 1);
+
 private:
-  void close_connection();
-  bool create_and_connect_socket(Error &error);
-  void log(const Request &request, const Response &response) {
-    if (logger_) {
-      logger_(request, response);
-    }
-  }
-  auto process_request(Request request, Error &error)
-      -> std::optional<Response>;
-  auto receive_response_data(Error &error) -> std::optional<std::string>;
-
-  Logger logger_{};
-
-  std::string host_;
-  uint16_t port_;
-  detail::Socket socket_{};
-
-  std::chrono::microseconds connection_timeout_{
-      constants::DEFAULT_CONNECTION_TIMEOUT};
-  std::chrono::microseconds read_timeout_{
-      constants::DEFAULT_CLIENT_READ_TIMEOUT};
-  std::chrono::microseconds write_timeout_{
-      constants::DEFAULT_CLIENT_WRITE_TIMEOUT};
+  // Kept in place when the client is moved, the async client referring to it
+  std::unique_ptr<EventLoop> loop_;
+  AsyncClient client_;
 };
 
 } // namespace http
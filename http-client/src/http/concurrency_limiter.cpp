@@ -0,0 +1,51 @@
+#include "concurrency_limiter.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// How much the lowest latency rises with each successful request
+constexpr double MIN_LATENCY_DRIFT{1.01};
+
+} // namespace
+
+namespace http {
+
+ConcurrencyLimiter::ConcurrencyLimiter(ConcurrencyPolicy policy)
+    : policy_(policy) {
+  policy_.min_limit = std::max<size_t>(policy_.min_limit, 1);
+  policy_.max_limit = std::max(policy_.max_limit, policy_.min_limit);
+  limit_ = static_cast<double>(std::clamp(
+      policy_.initial_limit, policy_.min_limit, policy_.max_limit));
+}
+
+void ConcurrencyLimiter::add(const Result &result,
+                             std::chrono::microseconds latency) {
+  const auto elapsed = static_cast<double>(latency.count());
+  const bool throttled =
+      !result || result->status_code == 429 || result->status_code == 503;
+  if (!throttled) {
+    min_latency_ = min_latency_ ? std::min(elapsed, *min_latency_ *
+                                                        MIN_LATENCY_DRIFT)
+                                : elapsed;
+  }
+  const bool slow =
+      !throttled && elapsed > *min_latency_ * policy_.latency_tolerance;
+
+  if (cut_holdoff_ > 0) {
+    --cut_holdoff_;
+  }
+  if (throttled || slow) {
+    if (cut_holdoff_ == 0) {
+      cut_holdoff_ = static_cast<size_t>(std::ceil(limit_));
+      limit_ = std::max(limit_ * policy_.backoff_ratio,
+                        static_cast<double>(policy_.min_limit));
+    }
+    return;
+  }
+  limit_ = std::min(limit_ + 1 / std::floor(limit_),
+                    static_cast<double>(policy_.max_limit));
+}
+
+} // namespace http
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "constants.hpp"
+#include "message.hpp"
+#include <chrono>
+#include <cstddef>
+#include <optional>
+
+namespace http {
+
+// How a ConcurrencyLimiter adapts the requests in flight: the limit grows by
+// one for each limit requests that succeed in time, and is cut by the backoff
+// ratio when they fail, are throttled (429, 503) or take longer than the
+// tolerance times the lowest latency seen, the server then queueing them
+// (AIMD)
+struct ConcurrencyPolicy {
+  size_t initial_limit{constants::DEFAULT_INITIAL_CONCURRENCY};
+  size_t min_limit{1};
+  size_t max_limit{constants::DEFAULT_MAX_CONCURRENCY};
+  double latency_tolerance{2.0};
+  double backoff_ratio{0.5};
+};
+
+// The number of requests a bulk operation keeps in flight, found from the
+// results of those that completed
+class ConcurrencyLimiter {
+public:
+  explicit ConcurrencyLimiter(ConcurrencyPolicy policy = {});
+
+  size_t limit() const { return static_cast<size_t>(limit_); }
+
+  // A request completed with the result, after the latency
+  void add(const Result &result, std::chrono::microseconds latency);
+
+private:
+  ConcurrencyPolicy policy_;
+  double limit_;
+  // The lowest latency of a successful request, which creeps up with each of
+  // them so that a server that got slower for good becomes the new baseline
+  std::optional<double> min_latency_{};
+  // The requests to complete before the limit is cut again, those in flight
+  // when it was cut having been sent under the previous limit
+  size_t cut_holdoff_{};
+};
+
+} // namespace http
@@ -0,0 +1,108 @@
+#include "connection_pool.hpp"
+
+#include "socket_utils.hpp"
+#include <algorithm>
+#include <sys/eventfd.h>
+
+namespace http {
+
+using namespace detail;
+
+auto ConnectionPool::shared() -> std::shared_ptr<ConnectionPool> {
+  static auto pool = std::make_shared<ConnectionPool>();
+  return pool;
+}
+
+void ConnectionPool::close_expired(Origin &origin, Clock::time_point now) {
+  auto expired = std::remove_if(
+      origin.idle.begin(), origin.idle.end(),
+      [&](const IdleSocket &idle) { return idle.expiry <= now; });
+  for (auto it = expired; it != origin.idle.end(); ++it) {
+    close_socket(it->socket);
+    --origin.connections;
+  }
+  origin.idle.erase(expired, origin.idle.end());
+}
+
+// Written under the lock, so that a removed waiter is never written after
+void ConnectionPool::notify_waiter(Origin &origin) {
+  if (!origin.waiters.empty()) {
+    eventfd_write(origin.waiters.front(), 1);
+    origin.waiters.erase(origin.waiters.begin());
+  }
+}
+
+auto ConnectionPool::try_acquire(const std::string &host, uint16_t port)
+    -> std::optional<Connection> {
+  std::lock_guard lock(mutex_);
+  auto &origin = origins_[origin_key(host, port)];
+
+  close_expired(origin, Clock::now());
+
+  // Prefer the most recently used connection, the least likely to have been
+  // closed by the server
+  while (!origin.idle.empty()) {
+    Socket socket = origin.idle.back().socket;
+    origin.idle.pop_back();
+
+    if (is_idle_socket_usable(socket.sockfd)) {
+      return Connection{.socket = socket, .reused = true};
+    }
+    close_socket(socket);
+    --origin.connections;
+  }
+
+  if (origin.connections >=
+      std::max<size_t>(config_.max_connections_per_host, 1)) {
+    return std::nullopt;
+  }
+
+  ++origin.connections;
+  return Connection{};
+}
+
+void ConnectionPool::release(const std::string &host, uint16_t port,
+                             Socket socket, bool reusable) {
+  std::lock_guard lock(mutex_);
+  auto &origin = origins_[origin_key(host, port)];
+
+  if (socket.is_open() && reusable && config_.idle_timeout.count() > 0) {
+    origin.idle.push_back({socket, Clock::now() + config_.idle_timeout});
+  } else {
+    shutdown_socket(socket);
+    close_socket(socket);
+    --origin.connections;
+  }
+  notify_waiter(origin);
+}
+
+void ConnectionPool::add_waiter(const std::string &host, uint16_t port,
+                                int eventfd) {
+  std::lock_guard lock(mutex_);
+  origins_[origin_key(host, port)].waiters.push_back(eventfd);
+}
+
+bool ConnectionPool::remove_waiter(const std::string &host, uint16_t port,
+                                   int eventfd) {
+  std::lock_guard lock(mutex_);
+  auto &waiters = origins_[origin_key(host, port)].waiters;
+  auto it = std::ranges::find(waiters, eventfd);
+  if (it == waiters.end()) {
+    return false;
+  }
+  waiters.erase(it);
+  return true;
+}
+
+void ConnectionPool::clear() {
+  std::lock_guard lock(mutex_);
+  for (auto &[key, origin] : origins_) {
+    for (const auto &idle : origin.idle) {
+      close_socket(idle.socket);
+    }
+    origin.connections -= origin.idle.size();
+    origin.idle.clear();
+  }
+}
+
+} // namespace http
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "constants.hpp"
+#include "socket.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace http {
+
+struct ConnectionPoolConfig {
+  // Connections open to an origin at once, idle or in use
+  size_t max_connections_per_host{constants::DEFAULT_MAX_CONNECTIONS_PER_HOST};
+  // How long an idle connection is kept before being closed
+  std::chrono::microseconds idle_timeout{constants::DEFAULT_POOL_IDLE_TIMEOUT};
+};
+
+// Keeps the persistent connections to each origin (host and port) between
+// requests, so that clients of the same origin reuse them instead of opening
+// a new connection for every request
+class ConnectionPool {
+public:
+  struct Connection {
+    detail::Socket socket{};
+    // Whether the connection already carried a request, in which case the
+    // peer may have closed it in the meantime
+    bool reused{};
+  };
+
+  explicit ConnectionPool(ConnectionPoolConfig config = {})
+      : config_(config) {}
+
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+  ~ConnectionPool() { clear(); }
+
+  // The pool used by the clients that are not given one
+  static auto shared() -> std::shared_ptr<ConnectionPool>;
+
+  const ConnectionPoolConfig &config() const { return config_; }
+
+  // Take an idle connection to the origin, or reserve the slot of a new one,
+  // returned with a closed socket for the caller to connect. std::nullopt if
+  // the origin already has max_connections_per_host connections.
+  auto try_acquire(const std::string &host, uint16_t port)
+      -> std::optional<Connection>;
+
+  // Give back an acquired connection, kept idle if it can carry another
+  // request and closed otherwise, or the slot of one that was not connected
+  void release(const std::string &host, uint16_t port, detail::Socket socket,
+               bool reusable);
+
+  // Have an eventfd written once a connection to the origin is released, for
+  // a caller waiting on try_acquire
+  void add_waiter(const std::string &host, uint16_t port, int eventfd);
+
+  // Stop waiting on the origin. false if the eventfd was already written, in
+  // which case a connection may now be acquired.
+  bool remove_waiter(const std::string &host, uint16_t port, int eventfd);
+
+  // Close the idle connections
+  void clear();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct IdleSocket {
+    detail::Socket socket;
+    Clock::time_point expiry;
+  };
+
+  struct Origin {
+    // The most recently released last
+    std::vector<IdleSocket> idle{};
+    size_t connections{};
+    // The eventfds of the callers waiting for a connection, the first
+    // arrived first
+    std::vector<int> waiters{};
+  };
+
+  static auto origin_key(const std::string &host, uint16_t port)
+      -> std::string {
+    return host + ':' + std::to_string(port);
+  }
+
+  void close_expired(Origin &origin, Clock::time_point now);
+  void notify_waiter(Origin &origin);
+
+  ConnectionPoolConfig config_;
+  std::mutex mutex_{};
+  std::unordered_map<std::string, Origin> origins_{};
+};
+
+} // namespace http
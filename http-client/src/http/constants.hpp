@@ -12,7 +12,78 @@ constexpr auto DEFAULT_CONNECTION_TIMEOUT{std::chrono::seconds(10)};
 constexpr auto DEFAULT_CLIENT_READ_TIMEOUT{std::chrono::seconds(10)};
 constexpr auto DEFAULT_CLIENT_WRITE_TIMEOUT{std::chrono::seconds(5)};
 
+constexpr size_t DEFAULT_MAX_CONNECTIONS_PER_HOST{6};
+constexpr auto DEFAULT_POOL_IDLE_TIMEOUT{std::chrono::seconds(60)};
+// The idle time of a connection before it is probed, then the probes
+constexpr auto DEFAULT_KEEPALIVE_IDLE{std::chrono::seconds(30)};
+constexpr auto KEEPALIVE_INTERVAL{std::chrono::seconds(10)};
+constexpr int KEEPALIVE_PROBES{3};
+
+constexpr size_t DEFAULT_PIPELINE_DEPTH{8};
+
+// A request is attempted once unless the retry policy says otherwise
+constexpr size_t DEFAULT_MAX_ATTEMPTS{1};
+constexpr auto DEFAULT_BASE_BACKOFF{std::chrono::milliseconds(100)};
+constexpr auto DEFAULT_MAX_BACKOFF{std::chrono::seconds(2)};
+
+// The requests a bulk operation keeps in flight to begin with, and at most,
+// the concurrency limiter finding the best number in between
+constexpr size_t DEFAULT_INITIAL_CONCURRENCY{2};
+constexpr size_t DEFAULT_MAX_CONCURRENCY{64};
+// The requests each thread of an Executor keeps in flight
+constexpr size_t DEFAULT_EXECUTOR_CONCURRENCY{8};
+
+// The codings the responses are asked in, when decompression is enabled
+constexpr auto ACCEPT_ENCODING_FIELD = "Accept-Encoding: gzip, deflate\r\n"sv;
+
+// The bodies of at least this size are sent once the server agrees to take
+// them, which it may refuse at the sight of the head, or after the timeout
+// without an answer, the server not knowing the expectation
+constexpr size_t DEFAULT_EXPECT_CONTINUE_SIZE{1 << 20};
+constexpr auto EXPECT_CONTINUE_TIMEOUT{std::chrono::seconds(1)};
+constexpr auto EXPECT_CONTINUE_FIELD = "Expect: 100-continue\r\n"sv;
+
+// A download is split in up to this many ranges fetched at once, none of
+// them smaller than the minimum size
+constexpr size_t DEFAULT_DOWNLOAD_CONNECTIONS{4};
+constexpr size_t DEFAULT_MIN_RANGE_SIZE{1 << 20};
+// The attempts at a range, each resuming where the previous one stopped
+constexpr size_t MAX_RANGE_ATTEMPTS{3};
+
+// The most the HPACK table of the header fields of either direction may
+// hold, the default of HTTP/2
+constexpr size_t HPACK_TABLE_SIZE{4096};
+
+// HTTP/2: the window the server is given to send on each stream, and on the
+// connection as a whole, the streams it is assumed to allow until it tells,
+// and how much of the request bodies is queued ahead of what is written
+constexpr uint32_t HTTP2_STREAM_WINDOW{4 << 20};
+constexpr uint32_t HTTP2_CONNECTION_WINDOW{16 << 20};
+constexpr uint32_t HTTP2_DEFAULT_MAX_STREAMS{100};
+constexpr size_t HTTP2_OUTPUT_BUFFER_SIZE{64 << 10};
+
+constexpr size_t DEFAULT_CACHE_MAX_ENTRIES{256};
+// The responses with a larger body are not cached
+constexpr size_t DEFAULT_CACHE_MAX_BODY_SIZE{1 << 20};
+
+// How long the resolved addresses of a host are reused, getaddrinfo not
+// giving their TTL
+constexpr auto DNS_CACHE_TTL{std::chrono::seconds(30)};
+// A host naming a Unix domain socket, e.g. unix:///run/api.sock, rather than
+// a name to resolve
+constexpr std::string_view UNIX_SOCKET_PREFIX{"unix://"};
+// The Host of the requests to a Unix domain socket, which has no name
+constexpr std::string_view UNIX_SOCKET_HOST{"localhost"};
+// The head start of a connection attempt before the next address is tried
+// alongside it (Happy Eyeballs, RFC 8305)
+constexpr auto CONNECTION_ATTEMPT_DELAY{std::chrono::milliseconds(250)};
+
 constexpr size_t READ_BUFFER_SIZE{2048};
+constexpr size_t MAX_HEADER_SIZE{64 << 10};
+// The pieces of a body given to a BodySink, at most
+constexpr size_t STREAM_BUFFER_SIZE{16 << 10};
+// The line giving the size of a chunk, with its extensions, at most
+constexpr size_t MAX_CHUNK_LINE_SIZE{1 << 10};
 
 constexpr auto HTTP_HEADER_TERMINATOR = "\r\n\r\n"sv;
 } // namespace http::constants
@@ -0,0 +1,108 @@
+#include "content_coding.hpp"
+
+#include "constants.hpp"
+#include "utils.hpp"
+#include <new>
+
+namespace http::detail {
+
+namespace {
+// The window bits of inflateInit2 and deflateInit2 for each format
+constexpr int ZLIB_WINDOW_BITS = 15;
+constexpr int RAW_WINDOW_BITS = -15;
+constexpr int GZIP_WINDOW_BITS = 15 + 16;
+} // namespace
+
+ContentCoding parse_content_coding(std::optional<std::string_view> value) {
+  if (!value) {
+    return ContentCoding::Identity;
+  }
+  auto coding = *value;
+  coding.remove_prefix(
+      std::min(coding.find_first_not_of(" \t"), coding.size()));
+  coding = coding.substr(0, coding.find_last_not_of(" \t") + 1);
+
+  if (coding.empty() || utils::iequals(coding, "identity")) {
+    return ContentCoding::Identity;
+  }
+  if (utils::iequals(coding, "gzip") || utils::iequals(coding, "x-gzip")) {
+    return ContentCoding::Gzip;
+  }
+  if (utils::iequals(coding, "deflate")) {
+    return ContentCoding::Deflate;
+  }
+  return ContentCoding::Unsupported;
+}
+
+ContentDecoder::ContentDecoder(ContentCoding coding)
+    : may_be_raw_(coding == ContentCoding::Deflate) {
+  if (inflateInit2(&stream_, coding == ContentCoding::Gzip
+                                 ? GZIP_WINDOW_BITS
+                                 : ZLIB_WINDOW_BITS) != Z_OK) {
+    throw std::bad_alloc();
+  }
+}
+
+bool ContentDecoder::decode(std::string_view data, std::string &output) {
+  stream_.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream_.avail_in = static_cast<uInt>(data.size());
+
+  while (!ended_ && (stream_.avail_in > 0 || stream_.avail_out == 0)) {
+    const size_t size = output.size();
+    output.resize(size + constants::STREAM_BUFFER_SIZE);
+    stream_.next_out = reinterpret_cast<Bytef *>(output.data() + size);
+    stream_.avail_out = static_cast<uInt>(constants::STREAM_BUFFER_SIZE);
+
+    int status = inflate(&stream_, Z_NO_FLUSH);
+    output.resize(output.size() - stream_.avail_out);
+
+    // Not a zlib header: start over as raw deflate, when the bytes read so far
+    // are all in the data
+    if (status == Z_DATA_ERROR && may_be_raw_ &&
+        stream_.total_in <= data.size()) {
+      may_be_raw_ = false;
+      if (inflateReset2(&stream_, RAW_WINDOW_BITS) != Z_OK) {
+        return false;
+      }
+      stream_.next_in =
+          reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+      stream_.avail_in = static_cast<uInt>(data.size());
+      continue;
+    }
+    may_be_raw_ = may_be_raw_ && stream_.total_in < 2;
+
+    if (status == Z_STREAM_END) {
+      // Anything past the end of the stream is ignored
+      ended_ = true;
+    } else if (status == Z_BUF_ERROR) {
+      // No progress possible until more data arrives
+      break;
+    } else if (status != Z_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string gzip(std::string_view data) {
+  z_stream stream{};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::bad_alloc();
+  }
+
+  std::string compressed(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+  stream.avail_out = static_cast<uInt>(compressed.size());
+
+  // The output cannot be larger than the bound, so it ends in a single call
+  deflate(&stream, Z_FINISH);
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  return compressed;
+}
+
+} // namespace http::detail
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+
+namespace http::detail {
+
+enum class ContentCoding { Identity, Gzip, Deflate, Unsupported };
+
+// The coding of a Content-Encoding value. Only a single coding is supported.
+ContentCoding parse_content_coding(std::optional<std::string_view> value);
+
+// Decodes a gzip or deflate body as its pieces arrive
+class ContentDecoder {
+public:
+  explicit ContentDecoder(ContentCoding coding);
+  ~ContentDecoder() { inflateEnd(&stream_); }
+
+  ContentDecoder(const ContentDecoder &) = delete;
+  ContentDecoder &operator=(const ContentDecoder &) = delete;
+
+  // Append the bytes decoded from the data to the output, false if it is not
+  // validly encoded
+  bool decode(std::string_view data, std::string &output);
+
+  // Whether the encoded stream ended, or never started
+  bool finished() const { return ended_ || stream_.total_in == 0; }
+
+private:
+  z_stream stream_{};
+  // Some servers send a raw deflate stream rather than the zlib format
+  bool may_be_raw_{};
+  bool ended_{};
+};
+
+// The data compressed with gzip
+std::string gzip(std::string_view data);
+
+} // namespace http::detail
@@ -11,7 +11,11 @@ enum class Error {
   Read,
   ReadTimeout,
   Write,
-  WriteTimeout
+  WriteTimeout,
+  Tls,
+  File,
+  Range,
+  Deadline
 };
 
 constexpr auto to_str(Error error) {
@@ -32,6 +36,14 @@ constexpr auto to_str(Error error) {
     return "Failed to write to socket";
   case Error::WriteTimeout:
     return "Socket write timed out";
+  case Error::Tls:
+    return "TLS handshake failed";
+  case Error::File:
+    return "Failed to read or write the body file";
+  case Error::Range:
+    return "The server did not send the range asked for";
+  case Error::Deadline:
+    return "The request did not complete before its deadline";
   case Error::Unknown:
     return "Unknown error";
   default:
@@ -0,0 +1,153 @@
+#include "event_loop.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace http {
+
+bool EventLoop::WaitAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  wait_.handle = handle;
+  return loop_.add_wait(wait_, events_, deadline_);
+}
+
+EventLoop::WaitAwaiter::~WaitAwaiter() {
+  if (wait_.pending) {
+    loop_.cancel_wait(wait_);
+  }
+}
+
+EventLoop::EventLoop() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {
+  if (epoll_fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(), "epoll_create1");
+  }
+}
+
+EventLoop::~EventLoop() {
+  spawned_.clear();
+  close(epoll_fd_);
+}
+
+auto EventLoop::readable(int fd, Clock::time_point deadline) -> WaitAwaiter {
+  return WaitAwaiter(*this, fd, EPOLLIN | EPOLLRDHUP, deadline);
+}
+
+auto EventLoop::writable(int fd, Clock::time_point deadline) -> WaitAwaiter {
+  return WaitAwaiter(*this, fd, EPOLLOUT, deadline);
+}
+
+auto EventLoop::sleep_until(Clock::time_point deadline) -> WaitAwaiter {
+  return WaitAwaiter(*this, -1, 0, deadline);
+}
+
+bool EventLoop::add_wait(Wait &wait, uint32_t events,
+                         Clock::time_point deadline) {
+  struct epoll_event event{};
+  event.events = events;
+  event.data.ptr = &wait;
+
+  if (wait.fd >= 0 &&
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wait.fd, &event) < 0) {
+    // Not waited on, the next operation on it reports the error
+    wait.ready = true;
+    return false;
+  }
+
+  wait.timed = deadline != Clock::time_point::max();
+  if (wait.timed) {
+    wait.timer = timers_.emplace(deadline, &wait);
+  }
+  wait.pending = true;
+  ++waits_;
+  return true;
+}
+
+void EventLoop::remove_wait(Wait &wait) {
+  if (wait.fd >= 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, wait.fd, nullptr);
+  }
+  if (wait.timed) {
+    timers_.erase(wait.timer);
+  }
+  wait.pending = false;
+  --waits_;
+}
+
+// The coroutine was destroyed while waiting, possibly by one resumed from the
+// same batch of events, where the wait must not be completed
+void EventLoop::cancel_wait(Wait &wait) {
+  for (int i = next_event_ + 1; i < ready_; ++i) {
+    if (events_[i].data.ptr == &wait) {
+      events_[i].data.ptr = nullptr;
+    }
+  }
+  remove_wait(wait);
+}
+
+void EventLoop::complete_wait(Wait &wait, bool ready) {
+  remove_wait(wait);
+
+  wait.ready = ready;
+  wait.handle.resume();
+}
+
+void EventLoop::run_once() {
+  if (waits_ == 0) {
+    throw std::logic_error("No task of the event loop is waiting");
+  }
+
+  int timeout_ms = -1;
+  if (!timers_.empty()) {
+    auto until_deadline = std::chrono::ceil<std::chrono::milliseconds>(
+        timers_.begin()->first - Clock::now());
+    timeout_ms = static_cast<int>(
+        std::clamp<int64_t>(until_deadline.count(), 0, INT_MAX));
+  }
+
+  int ready =
+      epoll_wait(epoll_fd_, events_.data(), events_.size(), timeout_ms);
+  if (ready < 0) {
+    if (errno == EINTR) {
+      return;
+    }
+    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+  }
+
+  // A wait is in a single batch at most, and only completed from it
+  ready_ = ready;
+  for (next_event_ = 0; next_event_ < ready_; ++next_event_) {
+    if (auto *wait = static_cast<Wait *>(events_[next_event_].data.ptr)) {
+      complete_wait(*wait, true);
+    }
+  }
+  ready_ = 0;
+
+  auto now = Clock::now();
+  while (!timers_.empty() && timers_.begin()->first <= now) {
+    complete_wait(*timers_.begin()->second, false);
+  }
+}
+
+void EventLoop::spawn(Task<> task) {
+  task.start();
+  spawned_.push_back(std::move(task));
+}
+
+void EventLoop::run() {
+  while (std::ranges::any_of(spawned_,
+                             [](const Task<> &task) { return !task.done(); })) {
+    run_once();
+  }
+
+  auto spawned = std::move(spawned_);
+  spawned_.clear();
+  for (auto &task : spawned) {
+    task.result();
+  }
+}
+
+} // namespace http
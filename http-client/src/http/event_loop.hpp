@@ -0,0 +1,107 @@
+#pragma once
+
+#include "task.hpp"
+#include "utils.hpp"
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <map>
+#include <sys/epoll.h>
+#include <vector>
+
+namespace http {
+
+// An epoll reactor resuming the coroutines waiting on sockets, so that a
+// single thread can keep many requests in flight
+class EventLoop {
+public:
+  using Clock = std::chrono::steady_clock;
+
+private:
+  struct Wait {
+    std::coroutine_handle<> handle{};
+    int fd{-1};
+    bool ready{};
+    // Registered with the loop, until completed or cancelled
+    bool pending{};
+    bool timed{};
+    std::multimap<Clock::time_point, Wait *>::iterator timer{};
+  };
+
+public:
+  // Resumes the awaiting coroutine once the descriptor is ready, or at the
+  // deadline, with whether it is ready. Without a descriptor, only at the
+  // deadline. Destroying the suspended coroutine cancels the wait.
+  class WaitAwaiter {
+  public:
+    WaitAwaiter(const WaitAwaiter &) = delete;
+    WaitAwaiter &operator=(const WaitAwaiter &) = delete;
+    ~WaitAwaiter();
+
+    bool await_ready() noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() noexcept { return wait_.ready; }
+
+  private:
+    friend class EventLoop;
+
+    WaitAwaiter(EventLoop &loop, int fd, uint32_t events,
+              Clock::time_point deadline)
+        : loop_(loop), events_(events), deadline_(deadline) {
+      wait_.fd = fd;
+    }
+
+    EventLoop &loop_;
+    uint32_t events_;
+    Clock::time_point deadline_;
+    Wait wait_{};
+  };
+
+  // Throws std::system_error if the epoll instance cannot be created
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  auto readable(int fd, Clock::time_point deadline) -> WaitAwaiter;
+  auto writable(int fd, Clock::time_point deadline) -> WaitAwaiter;
+  auto sleep_until(Clock::time_point deadline) -> WaitAwaiter;
+  auto sleep_for(utils::Duration auto duration) -> WaitAwaiter {
+    return sleep_until(Clock::now() + duration);
+  }
+
+  // Start a task, run along with the others until run() returns
+  void spawn(Task<> task);
+
+  // Run until the spawned tasks complete, rethrowing what escaped them
+  void run();
+
+  // Run a task until it completes, along with the spawned ones
+  template <typename T> T run(Task<T> task) {
+    task.start();
+    while (!task.done()) {
+      run_once();
+    }
+    return task.result();
+  }
+
+private:
+  bool add_wait(Wait &wait, uint32_t events, Clock::time_point deadline);
+  void remove_wait(Wait &wait);
+  void cancel_wait(Wait &wait);
+  void complete_wait(Wait &wait, bool ready);
+  void run_once();
+
+  int epoll_fd_;
+  // The events being dispatched, and the next one
+  std::array<struct epoll_event, 64> events_{};
+  int ready_{};
+  int next_event_{};
+  size_t waits_{};
+  std::multimap<Clock::time_point, Wait *> timers_{};
+  std::vector<Task<>> spawned_{};
+};
+
+} // namespace http
@@ -0,0 +1,216 @@
+#include "executor.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace http {
+
+namespace {
+
+// The request performed with the method it names
+Task<Result> send(AsyncClient &client, const Request &request) {
+  switch (request.method) {
+  case RequestMethod::HEAD:
+    return client.Head(request);
+  case RequestMethod::POST:
+    return client.Post(request);
+  case RequestMethod::PUT:
+    return client.Put(request);
+  case RequestMethod::DELETE:
+    return client.Delete(request);
+  default:
+    return client.Get(request);
+  }
+}
+
+} // namespace
+
+Executor::Executor(std::string host, uint16_t port, ExecutorConfig config,
+                   Setup setup)
+    : host_(std::move(host)), port_(port), config_(config),
+      setup_(std::move(setup)),
+      completion_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  if (completion_fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(), "eventfd");
+  }
+  if (config_.threads == 0) {
+    config_.threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  config_.concurrency_per_thread =
+      std::max<size_t>(config_.concurrency_per_thread, 1);
+
+  for (size_t i = 0; i < config_.threads; ++i) {
+    auto worker = std::make_unique<Worker>();
+    worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->event_fd < 0) {
+      const int error = errno;
+      for (auto &created : workers_) {
+        close(created->event_fd);
+      }
+      close(completion_fd_);
+      throw std::system_error(error, std::generic_category(), "eventfd");
+    }
+    workers_.push_back(std::move(worker));
+  }
+  for (auto &worker : workers_) {
+    worker->thread = std::thread([this, &worker = *worker] {
+      run_worker(worker);
+    });
+  }
+}
+
+Executor::~Executor() {
+  stopping_.store(true);
+  for (auto &worker : workers_) {
+    wake(*worker);
+  }
+  for (auto &worker : workers_) {
+    worker->thread.join();
+    close(worker->event_fd);
+  }
+  close(completion_fd_);
+}
+
+void Executor::submit(Request request, Callback callback) {
+  ++pending_;
+  auto &worker = *workers_[next_worker_++ % workers_.size()];
+  {
+    std::lock_guard lock(worker.mutex);
+    worker.queue.push_back({std::move(request), std::move(callback)});
+  }
+  wake(worker);
+
+  // A thread with nothing to do takes it if it comes first
+  for (auto &other : workers_) {
+    if (other.get() != &worker && other->idle.exchange(false)) {
+      wake(*other);
+      break;
+    }
+  }
+}
+
+size_t Executor::poll() {
+  eventfd_t count;
+  eventfd_read(completion_fd_, &count);
+
+  std::vector<Completion> completions;
+  {
+    std::lock_guard lock(completions_mutex_);
+    completions.swap(completions_);
+  }
+  for (auto &completion : completions) {
+    --pending_;
+    if (completion.callback) {
+      completion.callback(std::move(completion.result));
+    }
+  }
+  return completions.size();
+}
+
+void Executor::wait() {
+  while (pending_ > 0) {
+    if (poll() == 0) {
+      struct pollfd completed {
+        .fd = completion_fd_, .events = POLLIN, .revents = 0
+      };
+      ::poll(&completed, 1, -1);
+    }
+  }
+}
+
+std::vector<Result> Executor::run(std::vector<Request> requests) {
+  std::vector<Result> results(requests.size());
+  for (size_t i = 0; i < requests.size(); ++i) {
+    submit(std::move(requests[i]),
+           [&results, i](Result result) { results[i] = std::move(result); });
+  }
+  wait();
+  return results;
+}
+
+void Executor::run_worker(Worker &worker) {
+  Client client(host_, port_,
+                std::make_shared<ConnectionPool>(ConnectionPoolConfig{
+                    .max_connections_per_host =
+                        config_.concurrency_per_thread}));
+  if (setup_) {
+    setup_(client);
+  }
+  client.loop().run(dispatch(worker, client));
+}
+
+Task<> Executor::dispatch(Worker &worker, Client &client) {
+  size_t in_flight = 0;
+  while (true) {
+    while (in_flight < config_.concurrency_per_thread) {
+      auto job = take(worker);
+      if (!job) {
+        // Taken again once marked idle, so that a request submitted
+        // meanwhile is not missed
+        worker.idle.store(true);
+        job = take(worker);
+        if (!job) {
+          break;
+        }
+      }
+      worker.idle.store(false);
+      ++in_flight;
+      client.loop().spawn(
+          perform(worker, client, std::move(*job), in_flight));
+    }
+
+    if (in_flight == 0 && stopping_.load()) {
+      co_return;
+    }
+    co_await client.loop().readable(worker.event_fd,
+                                    EventLoop::Clock::time_point::max());
+    eventfd_t count;
+    eventfd_read(worker.event_fd, &count);
+  }
+}
+
+Task<> Executor::perform(Worker &worker, Client &client, Job job,
+                         size_t &in_flight) {
+  auto result = co_await send(client.async(), job.request);
+  {
+    std::lock_guard lock(completions_mutex_);
+    completions_.push_back({std::move(job.callback), std::move(result)});
+  }
+  eventfd_write(completion_fd_, 1);
+
+  --in_flight;
+  wake(worker);
+}
+
+auto Executor::take(Worker &worker) -> std::optional<Job> {
+  {
+    std::lock_guard lock(worker.mutex);
+    if (!worker.queue.empty()) {
+      auto job = std::move(worker.queue.front());
+      worker.queue.pop_front();
+      return job;
+    }
+  }
+
+  // Those of the others are stolen from the back, away from their owner
+  for (auto &other : workers_) {
+    if (other.get() == &worker) {
+      continue;
+    }
+    std::lock_guard lock(other->mutex);
+    if (!other->queue.empty()) {
+      auto job = std::move(other->queue.back());
+      other->queue.pop_back();
+      return job;
+    }
+  }
+  return std::nullopt;
+}
+
+void Executor::wake(Worker &worker) { eventfd_write(worker.event_fd, 1); }
+
+} // namespace http
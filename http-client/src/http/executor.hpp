@@ -0,0 +1,112 @@
+#pragma once
+
+#include "client.hpp"
+#include "constants.hpp"
+#include "message.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace http {
+
+struct ExecutorConfig {
+  // The worker threads, as many as the cores if 0
+  size_t threads{0};
+  // The requests each thread keeps in flight at once, over as many pooled
+  // connections
+  size_t concurrency_per_thread{constants::DEFAULT_EXECUTOR_CONCURRENCY};
+};
+
+// Runs requests to an origin on a pool of threads, for workloads that one
+// event loop cannot keep up with. Each thread owns a Client, with its own
+// connection pool, and keeps several requests in flight on its event loop.
+// The requests are queued to the threads in turn, and a thread that runs out
+// of them steals the last ones queued to the others. The callbacks are run on
+// the thread that submits the requests, when it calls poll or wait, never on
+// the workers.
+class Executor {
+public:
+  using Callback = std::function<void(Result)>;
+  // Called on each worker thread with its client before it runs any request,
+  // to set its timeouts, TLS, default headers...
+  using Setup = std::function<void(Client &)>;
+
+  // Throws std::system_error if the eventfds cannot be created
+  Executor(std::string host, uint16_t port = 80, ExecutorConfig config = {},
+           Setup setup = {});
+  // Waits for the requests submitted to complete, dropping the callbacks not
+  // run yet
+  ~Executor();
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  size_t threads() const { return workers_.size(); }
+
+  // Queue the request, the callback being run with its result by poll or wait
+  // once it completes
+  void submit(Request request, Callback callback = {});
+
+  // Readable while there are callbacks to run
+  int completion_fd() const { return completion_fd_; }
+  // Run the callbacks of the requests completed so far, how many
+  size_t poll();
+  // Run the callbacks until all the requests submitted have completed
+  void wait();
+
+  // Perform the requests across the threads, the results in their order
+  std::vector<Result> run(std::vector<Request> requests);
+
+private:
+  struct Job {
+    Request request;
+    Callback callback;
+  };
+
+  struct Completion {
+    Callback callback;
+    Result result;
+  };
+
+  struct Worker {
+    std::mutex mutex{};
+    std::deque<Job> queue{};
+    // Written when there is a request to take
+    int event_fd{-1};
+    // Whether it waits with room for more requests
+    std::atomic<bool> idle{};
+    std::thread thread{};
+  };
+
+  void run_worker(Worker &worker);
+  Task<> dispatch(Worker &worker, Client &client);
+  Task<> perform(Worker &worker, Client &client, Job job, size_t &in_flight);
+  // The next request of the worker, or failing that the oldest one of another
+  auto take(Worker &worker) -> std::optional<Job>;
+  static void wake(Worker &worker);
+
+  std::string host_;
+  uint16_t port_;
+  ExecutorConfig config_;
+  Setup setup_;
+
+  std::vector<std::unique_ptr<Worker>> workers_{};
+  std::atomic<size_t> next_worker_{};
+  std::atomic<bool> stopping_{};
+
+  std::mutex completions_mutex_{};
+  std::vector<Completion> completions_{};
+  int completion_fd_;
+  // The requests submitted whose callback was not run yet, by the caller
+  size_t pending_{};
+};
+
+} // namespace http
@@ -0,0 +1,457 @@
+#include "hpack.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace {
+
+using namespace std::string_view_literals;
+
+constexpr std::array<std::pair<std::string_view, std::string_view>, 61>
+    STATIC_TABLE{{
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    }};
+
+// What a field adds to the size of the table, beyond its name and value
+constexpr size_t FIELD_OVERHEAD{32};
+
+// The length of the Huffman code of each byte, then of the end of string
+// (EOS)
+constexpr std::array<uint8_t, 257> HUFFMAN_LENGTHS{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30};
+constexpr size_t EOS{256};
+constexpr uint8_t MAX_HUFFMAN_LENGTH{30};
+
+struct HuffmanCode {
+  uint32_t bits;
+  uint8_t length;
+};
+
+// The code is canonical: those of each length are consecutive, in the order
+// of the symbols, and follow those of the shorter lengths
+constexpr auto HUFFMAN_CODES = [] {
+  std::array<HuffmanCode, 257> codes{};
+  uint32_t bits = 0;
+  for (uint8_t length = 1; length <= MAX_HUFFMAN_LENGTH; ++length) {
+    for (size_t symbol = 0; symbol < codes.size(); ++symbol) {
+      if (HUFFMAN_LENGTHS[symbol] == length) {
+        codes[symbol] = {bits++, length};
+      }
+    }
+    bits <<= 1;
+  }
+  return codes;
+}();
+
+// For each length, the first code, how many there are and where their
+// symbols start among those sorted by code
+struct HuffmanDecoding {
+  std::array<uint32_t, MAX_HUFFMAN_LENGTH + 1> first_code{};
+  std::array<uint16_t, MAX_HUFFMAN_LENGTH + 1> count{};
+  std::array<uint16_t, MAX_HUFFMAN_LENGTH + 1> first_symbol{};
+  std::array<uint16_t, 257> symbols{};
+};
+
+constexpr auto HUFFMAN_DECODING = [] {
+  HuffmanDecoding decoding{};
+  uint16_t sorted = 0;
+  for (uint8_t length = 1; length <= MAX_HUFFMAN_LENGTH; ++length) {
+    decoding.first_symbol[length] = sorted;
+    for (uint16_t symbol = 0; symbol < HUFFMAN_CODES.size(); ++symbol) {
+      if (HUFFMAN_CODES[symbol].length == length) {
+        if (decoding.count[length]++ == 0) {
+          decoding.first_code[length] = HUFFMAN_CODES[symbol].bits;
+        }
+        decoding.symbols[sorted++] = symbol;
+      }
+    }
+  }
+  return decoding;
+}();
+
+size_t huffman_size(std::string_view data) {
+  size_t bits = 0;
+  for (unsigned char byte : data) {
+    bits += HUFFMAN_CODES[byte].length;
+  }
+  return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string &output, std::string_view data) {
+  uint64_t bits = 0;
+  int pending = 0;
+  for (unsigned char byte : data) {
+    const auto &code = HUFFMAN_CODES[byte];
+    bits = (bits << code.length) | code.bits;
+    pending += code.length;
+    while (pending >= 8) {
+      pending -= 8;
+      output.push_back(static_cast<char>(bits >> pending));
+    }
+    bits &= (uint64_t{1} << pending) - 1;
+  }
+  // Padded with the first bits of EOS, all ones
+  if (pending > 0) {
+    output.push_back(
+        static_cast<char>((bits << (8 - pending)) | (0xff >> pending)));
+  }
+}
+
+bool huffman_decode(std::string_view data, std::string &output) {
+  const auto &decoding = HUFFMAN_DECODING;
+  uint32_t bits = 0;
+  uint8_t length = 0;
+  for (unsigned char byte : data) {
+    for (int bit = 7; bit >= 0; --bit) {
+      bits = (bits << 1) | ((byte >> bit) & 1);
+      if (++length > MAX_HUFFMAN_LENGTH) {
+        return false;
+      }
+      // Less than the first code of the length wraps around
+      const uint32_t offset = bits - decoding.first_code[length];
+      if (offset < decoding.count[length]) {
+        const auto symbol =
+            decoding.symbols[decoding.first_symbol[length] + offset];
+        if (symbol == EOS) {
+          return false;
+        }
+        output.push_back(static_cast<char>(symbol));
+        bits = 0;
+        length = 0;
+      }
+    }
+  }
+  // The padding is shorter than a byte, and a prefix of EOS
+  return length < 8 && bits == (uint32_t{1} << length) - 1;
+}
+
+// An integer in the prefix_bits low bits of a byte whose high bits are the
+// flags, continued in the next bytes if it does not fit (RFC 7541 5.1)
+void encode_integer(std::string &output, uint8_t flags, int prefix_bits,
+                    size_t value) {
+  const size_t max_prefix = (size_t{1} << prefix_bits) - 1;
+  if (value < max_prefix) {
+    output.push_back(static_cast<char>(flags | value));
+    return;
+  }
+  output.push_back(static_cast<char>(flags | max_prefix));
+  for (value -= max_prefix; value >= 0x80; value >>= 7) {
+    output.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+  }
+  output.push_back(static_cast<char>(value));
+}
+
+bool decode_integer(std::string_view &data, int prefix_bits, size_t &value) {
+  if (data.empty()) {
+    return false;
+  }
+  const size_t max_prefix = (size_t{1} << prefix_bits) - 1;
+  value = static_cast<uint8_t>(data[0]) & max_prefix;
+  data.remove_prefix(1);
+  if (value < max_prefix) {
+    return true;
+  }
+
+  // Larger values than any field or table could have are refused
+  for (int shift = 0; shift <= 28; shift += 7) {
+    if (data.empty()) {
+      return false;
+    }
+    const auto byte = static_cast<uint8_t>(data[0]);
+    data.remove_prefix(1);
+    value += static_cast<size_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Huffman coded when that is shorter
+void encode_string(std::string &output, std::string_view data) {
+  const size_t coded_size = huffman_size(data);
+  if (coded_size < data.size()) {
+    encode_integer(output, 0x80, 7, coded_size);
+    huffman_encode(output, data);
+  } else {
+    encode_integer(output, 0, 7, data.size());
+    output += data;
+  }
+}
+
+bool decode_string(std::string_view &data, std::string &output) {
+  if (data.empty()) {
+    return false;
+  }
+  const bool huffman = (static_cast<uint8_t>(data[0]) & 0x80) != 0;
+  size_t length = 0;
+  if (!decode_integer(data, 7, length) || length > data.size()) {
+    return false;
+  }
+
+  output.clear();
+  const auto string = data.substr(0, length);
+  data.remove_prefix(length);
+  if (huffman) {
+    return huffman_decode(string, output);
+  }
+  output = string;
+  return true;
+}
+
+} // namespace
+
+namespace http::detail {
+
+auto HpackTable::get(size_t index) const -> std::optional<Field> {
+  if (index == 0) {
+    return std::nullopt;
+  }
+  if (index <= STATIC_TABLE.size()) {
+    return STATIC_TABLE[index - 1];
+  }
+  index -= STATIC_TABLE.size() + 1;
+  if (index >= fields_.size()) {
+    return std::nullopt;
+  }
+  return Field{fields_[index].first, fields_[index].second};
+}
+
+auto HpackTable::find(std::string_view name, std::string_view value) const
+    -> std::pair<size_t, bool> {
+  size_t name_index = 0;
+  for (size_t i = 0; i < STATIC_TABLE.size(); ++i) {
+    if (STATIC_TABLE[i].first == name) {
+      if (STATIC_TABLE[i].second == value) {
+        return {i + 1, true};
+      }
+      if (name_index == 0) {
+        name_index = i + 1;
+      }
+    }
+  }
+  for (size_t i = 0; i < fields_.size(); ++i) {
+    if (fields_[i].first == name) {
+      if (fields_[i].second == value) {
+        return {STATIC_TABLE.size() + i + 1, true};
+      }
+      if (name_index == 0) {
+        name_index = STATIC_TABLE.size() + i + 1;
+      }
+    }
+  }
+  return {name_index, false};
+}
+
+void HpackTable::add(std::string_view name, std::string_view value) {
+  const size_t size = name.size() + value.size() + FIELD_OVERHEAD;
+  if (size > max_size_) {
+    evict(0);
+    return;
+  }
+  // Copied first, the name may be that of a field about to be evicted
+  std::pair<std::string, std::string> field{name, value};
+  evict(max_size_ - size);
+  fields_.push_front(std::move(field));
+  size_ += size;
+}
+
+void HpackTable::set_max_size(size_t size) {
+  max_size_ = size;
+  evict(size);
+}
+
+void HpackTable::evict(size_t size) {
+  while (size_ > size) {
+    const auto &[name, value] = fields_.back();
+    size_ -= name.size() + value.size() + FIELD_OVERHEAD;
+    fields_.pop_back();
+  }
+}
+
+void HpackEncoder::set_max_table_size(size_t size) {
+  size = std::min(size, constants::HPACK_TABLE_SIZE);
+  if (size == table_.max_size() && !size_update_) {
+    return;
+  }
+  table_.set_max_size(size);
+  min_size_update_ = std::min(min_size_update_.value_or(size), size);
+  size_update_ = size;
+}
+
+void HpackEncoder::begin_block(std::string &block) {
+  if (!size_update_) {
+    return;
+  }
+  // The peer evicts down to the smallest size as well (RFC 7541 4.2)
+  if (*min_size_update_ < *size_update_) {
+    encode_integer(block, 0x20, 5, *min_size_update_);
+  }
+  encode_integer(block, 0x20, 5, *size_update_);
+  min_size_update_.reset();
+  size_update_.reset();
+}
+
+void HpackEncoder::encode(std::string &block, std::string_view name,
+                          std::string_view value, bool sensitive) {
+  const auto [index, matches] = table_.find(name, value);
+  if (matches && !sensitive) {
+    encode_integer(block, 0x80, 7, index);
+    return;
+  }
+
+  // A field taking more than half of the table would evict most of the
+  // others
+  const bool indexed =
+      !sensitive && (name.size() + value.size() + FIELD_OVERHEAD) * 2 <=
+                        table_.max_size();
+  if (indexed) {
+    encode_integer(block, 0x40, 6, index);
+  } else {
+    encode_integer(block, sensitive ? 0x10 : 0, 4, index);
+  }
+  if (index == 0) {
+    encode_string(block, name);
+  }
+  encode_string(block, value);
+  if (indexed) {
+    table_.add(name, value);
+  }
+}
+
+bool HpackDecoder::decode(std::string_view block,
+                          const FieldCallback &on_field) {
+  bool has_fields = false;
+  while (!block.empty()) {
+    const auto first = static_cast<uint8_t>(block[0]);
+    size_t index = 0;
+
+    if ((first & 0x80) != 0) {
+      // Indexed field
+      if (!decode_integer(block, 7, index)) {
+        return false;
+      }
+      const auto field = table_.get(index);
+      if (!field) {
+        return false;
+      }
+      on_field(field->first, field->second);
+      has_fields = true;
+      continue;
+    }
+
+    if ((first & 0xe0) == 0x20) {
+      // Table size update, only at the start of the block
+      if (has_fields || !decode_integer(block, 5, index) ||
+          index > constants::HPACK_TABLE_SIZE) {
+        return false;
+      }
+      table_.set_max_size(index);
+      continue;
+    }
+
+    // Literal field, indexed or not, its name being indexed or literal
+    const bool indexed = (first & 0xc0) == 0x40;
+    if (!decode_integer(block, indexed ? 6 : 4, index)) {
+      return false;
+    }
+    if (index == 0) {
+      if (!decode_string(block, name_)) {
+        return false;
+      }
+    } else if (const auto field = table_.get(index)) {
+      name_ = field->first;
+    } else {
+      return false;
+    }
+    if (!decode_string(block, value_)) {
+      return false;
+    }
+
+    on_field(name_, value_);
+    if (indexed) {
+      table_.add(name_, value_);
+    }
+    has_fields = true;
+  }
+  return true;
+}
+
+} // namespace http::detail
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "constants.hpp"
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace http::detail {
+
+// The fields an HPACK encoder or decoder indexed, after those of the static
+// table, the most recent first and the oldest evicted once their size goes
+// past the maximum (RFC 7541)
+class HpackTable {
+public:
+  using Field = std::pair<std::string_view, std::string_view>;
+
+  // The field at the index, counted from 1 in the static table
+  auto get(size_t index) const -> std::optional<Field>;
+  // The index of the field, or failing that of a field with its name, 0 if
+  // there is none. Whether the value matches as well.
+  auto find(std::string_view name, std::string_view value) const
+      -> std::pair<size_t, bool>;
+
+  // A field larger than the maximum empties the table
+  void add(std::string_view name, std::string_view value);
+
+  size_t max_size() const { return max_size_; }
+  void set_max_size(size_t size);
+
+private:
+  // Evict the oldest fields until the size is at most the one given
+  void evict(size_t size);
+
+  std::deque<std::pair<std::string, std::string>> fields_{};
+  size_t size_{};
+  size_t max_size_{constants::HPACK_TABLE_SIZE};
+};
+
+// Compresses the header blocks of the requests on a connection
+class HpackEncoder {
+public:
+  // The SETTINGS_HEADER_TABLE_SIZE of the peer, which bounds the table
+  void set_max_table_size(size_t size);
+
+  // Start a header block, telling the peer of a change of the table size
+  void begin_block(std::string &block);
+
+  // Append the field to the block, as an index into the table when it is
+  // there. Otherwise the field is added to the table, unless it is
+  // sensitive, e.g. credentials, which are never indexed.
+  void encode(std::string &block, std::string_view name,
+              std::string_view value, bool sensitive = false);
+
+private:
+  HpackTable table_{};
+  // The smallest maximum size since the last block, then the new one
+  std::optional<size_t> min_size_update_{};
+  std::optional<size_t> size_update_{};
+};
+
+// Decompresses the header blocks of the responses on a connection
+class HpackDecoder {
+public:
+  using FieldCallback =
+      std::function<void(std::string_view name, std::string_view value)>;
+
+  // Pass the fields of the complete block to the callback in order. false if
+  // the block cannot be decoded, a connection error after which the table is
+  // out of step with that of the peer.
+  bool decode(std::string_view block, const FieldCallback &on_field);
+
+private:
+  HpackTable table_{};
+  // The name and the value of the field being decoded
+  std::string name_{};
+  std::string value_{};
+};
+
+} // namespace http::detail
@@ -0,0 +1,920 @@
+#include "http2.hpp"
+
+#include "constants.hpp"
+#include "content_coding.hpp"
+#include "scope_guard.hpp"
+#include "socket_utils.hpp"
+#include "tls.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+using namespace std::string_view_literals;
+
+constexpr auto CONNECTION_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"sv;
+constexpr size_t FRAME_HEADER_SIZE{9};
+// The largest frame the client accepts, the one it does not have to announce
+constexpr uint32_t MAX_FRAME_SIZE{16384};
+constexpr uint32_t MAX_ALLOWED_FRAME_SIZE{(1 << 24) - 1};
+constexpr int64_t MAX_WINDOW_SIZE{0x7fffffff};
+constexpr uint32_t DEFAULT_WINDOW_SIZE{65535};
+constexpr uint32_t MAX_STREAM_ID{0x7fffffff};
+
+enum FrameType : uint8_t {
+  DATA = 0x0,
+  HEADERS = 0x1,
+  RST_STREAM = 0x3,
+  SETTINGS = 0x4,
+  PUSH_PROMISE = 0x5,
+  PING = 0x6,
+  GOAWAY = 0x7,
+  WINDOW_UPDATE = 0x8,
+  CONTINUATION = 0x9
+};
+
+constexpr uint8_t END_STREAM{0x1};
+constexpr uint8_t ACK{0x1};
+constexpr uint8_t END_HEADERS{0x4};
+constexpr uint8_t PADDED{0x8};
+constexpr uint8_t PRIORITY{0x20};
+
+enum SettingId : uint16_t {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+enum ErrorCode : uint32_t {
+  NO_ERROR = 0x0,
+  PROTOCOL_ERROR = 0x1,
+  FLOW_CONTROL_ERROR = 0x3,
+  FRAME_SIZE_ERROR = 0x6,
+  REFUSED_STREAM = 0x7,
+  CANCEL = 0x8,
+  COMPRESSION_ERROR = 0x9
+};
+
+uint32_t read_u32(std::string_view data) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(data.data());
+  return uint32_t{bytes[0]} << 24 | uint32_t{bytes[1]} << 16 |
+         uint32_t{bytes[2]} << 8 | bytes[3];
+}
+
+void append_u32(std::string &buffer, uint32_t value) {
+  const char bytes[] = {static_cast<char>(value >> 24),
+                        static_cast<char>(value >> 16),
+                        static_cast<char>(value >> 8),
+                        static_cast<char>(value)};
+  buffer.append(bytes, sizeof bytes);
+}
+
+void append_setting(std::string &buffer, SettingId id, uint32_t value) {
+  buffer += static_cast<char>(id >> 8);
+  buffer += static_cast<char>(id);
+  append_u32(buffer, value);
+}
+
+// Removes the padding of a DATA or HEADERS frame, false if it is longer than
+// the frame
+bool remove_padding(uint8_t flags, std::string_view &payload) {
+  if ((flags & PADDED) == 0) {
+    return true;
+  }
+  if (payload.empty()) {
+    return false;
+  }
+  const auto padding = static_cast<uint8_t>(payload[0]);
+  if (padding >= payload.size()) {
+    return false;
+  }
+  payload = payload.substr(1, payload.size() - 1 - padding);
+  return true;
+}
+
+// The fields that only mean something to an HTTP/1.1 connection, which
+// HTTP/2 forbids (RFC 9113 8.2.2), the name lowercase
+bool is_connection_specific(std::string_view name, std::string_view value) {
+  if (name == "te") {
+    return !http::utils::iequals(value, "trailers");
+  }
+  return name == "connection" || name == "keep-alive" ||
+         name == "proxy-connection" || name == "transfer-encoding" ||
+         name == "upgrade";
+}
+
+// Whether nothing happened on the server if the request failed before any of
+// the response arrived
+bool is_safe(http::RequestMethod method) {
+  return method == http::RequestMethod::GET ||
+         method == http::RequestMethod::HEAD;
+}
+
+auto elapsed(http::EventLoop::Clock::time_point from,
+             http::EventLoop::Clock::time_point to)
+    -> std::chrono::microseconds {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::max(to - from, http::EventLoop::Clock::duration::zero()));
+}
+
+} // namespace
+
+namespace http::detail {
+
+Http2Connection::Http2Connection(EventLoop &loop,
+                                 std::shared_ptr<ConnectionPool> pool,
+                                 std::string host, uint16_t port,
+                                 Socket socket, std::string authority)
+    : loop_(loop), pool_(std::move(pool)), host_(std::move(host)),
+      port_(port), socket_(socket),
+      write_fd_(fcntl(socket.sockfd, F_DUPFD_CLOEXEC, 0)),
+      write_event_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      authority_(std::move(authority)),
+      max_concurrent_streams_(constants::HTTP2_DEFAULT_MAX_STREAMS),
+      initial_window_size_(DEFAULT_WINDOW_SIZE),
+      max_frame_size_(MAX_FRAME_SIZE), send_window_(DEFAULT_WINDOW_SIZE),
+      receive_window_(constants::HTTP2_CONNECTION_WINDOW) {
+  if (write_fd_ < 0 || write_event_ < 0) {
+    failed_ = true;
+    error_ = Error::Unknown;
+    return;
+  }
+
+  // The settings of the client follow the preface without waiting for those
+  // of the server, along with the larger window of the connection
+  output_ = CONNECTION_PREFACE;
+  std::string settings;
+  append_setting(settings, SETTINGS_ENABLE_PUSH, 0);
+  append_setting(settings, SETTINGS_INITIAL_WINDOW_SIZE,
+                 constants::HTTP2_STREAM_WINDOW);
+  queue_frame(SETTINGS, 0, 0, settings);
+  queue_window_update(0,
+                      constants::HTTP2_CONNECTION_WINDOW - DEFAULT_WINDOW_SIZE);
+
+  writer_.emplace(write_frames());
+  writer_->start();
+  reader_.emplace(read_frames());
+  reader_->start();
+}
+
+Http2Connection::~Http2Connection() {
+  reader_.reset();
+  writer_.reset();
+  if (write_fd_ >= 0) {
+    close(write_fd_);
+  }
+  if (write_event_ >= 0) {
+    close(write_event_);
+  }
+  pool_->release(host_, port_, socket_, false);
+}
+
+bool Http2Connection::usable() const {
+  return !failed_ && !going_away_ && next_stream_id_ <= MAX_STREAM_ID;
+}
+
+void Http2Connection::queue_frame(uint8_t type, uint8_t flags,
+                                  uint32_t stream_id,
+                                  std::string_view payload) {
+  const auto length = static_cast<uint32_t>(payload.size());
+  const char header[FRAME_HEADER_SIZE] = {
+      static_cast<char>(length >> 16), static_cast<char>(length >> 8),
+      static_cast<char>(length),       static_cast<char>(type),
+      static_cast<char>(flags),        static_cast<char>(stream_id >> 24),
+      static_cast<char>(stream_id >> 16), static_cast<char>(stream_id >> 8),
+      static_cast<char>(stream_id)};
+  output_.append(header, sizeof header);
+  output_ += payload;
+  if (!write_pending_) {
+    write_pending_ = true;
+    eventfd_write(write_event_, 1);
+  }
+}
+
+void Http2Connection::queue_window_update(uint32_t stream_id,
+                                          uint32_t increment) {
+  std::string payload;
+  append_u32(payload, increment);
+  queue_frame(WINDOW_UPDATE, 0, stream_id, payload);
+}
+
+void Http2Connection::credit(Stream *stream, uint32_t length) {
+  // A stream the server ended needs no more window
+  if (stream != nullptr && !stream->ended) {
+    stream->consumed += length;
+    if (stream->consumed >= constants::HTTP2_STREAM_WINDOW / 2) {
+      queue_window_update(stream->id, stream->consumed);
+      stream->receive_window += stream->consumed;
+      stream->consumed = 0;
+    }
+  }
+  consumed_ += length;
+  if (consumed_ >= constants::HTTP2_CONNECTION_WINDOW / 2) {
+    queue_window_update(0, consumed_);
+    receive_window_ += consumed_;
+    consumed_ = 0;
+  }
+}
+
+void Http2Connection::queue_headers(Stream &stream, const Request &request,
+                                    const Headers &default_headers,
+                                    bool decode, bool end_stream) {
+  std::string block;
+  encoder_.begin_block(block);
+  encoder_.encode(block, ":method", to_string(request.method));
+  encoder_.encode(block, ":scheme", socket_.tls ? "https" : "http");
+  encoder_.encode(block, ":authority", authority_);
+  encoder_.encode(block, ":path", request.path);
+
+  // Field names are lowercase, Host being replaced by :authority
+  std::string name;
+  auto encode_field = [&](std::string_view field, std::string_view value) {
+    name.assign(field);
+    std::ranges::transform(name, name.begin(), [](unsigned char c) {
+      return static_cast<char>(std::tolower(c));
+    });
+    if (name == "host" || name == "content-length" ||
+        is_connection_specific(name, value)) {
+      return;
+    }
+    encoder_.encode(block, name, value,
+                    name == "authorization" || name == "proxy-authorization");
+  };
+  for (const auto &[field, value] : default_headers) {
+    if (!find_header(request.headers, field)) {
+      encode_field(field, value);
+    }
+  }
+  for (const auto &[field, value] : request.headers) {
+    encode_field(field, value);
+  }
+  if (decode) {
+    encoder_.encode(block, "accept-encoding", "gzip, deflate");
+  }
+  const size_t length =
+      request.body_file ? request.body_file->length : request.body.size();
+  encoder_.encode(block, "content-length", std::to_string(length));
+
+  std::string_view rest = block;
+  uint8_t type = HEADERS;
+  uint8_t flags = end_stream ? END_STREAM : 0;
+  do {
+    const auto fragment = rest.substr(0, max_frame_size_);
+    rest.remove_prefix(fragment.size());
+    queue_frame(type, flags | (rest.empty() ? END_HEADERS : 0), stream.id,
+                fragment);
+    type = CONTINUATION;
+    flags = 0;
+  } while (!rest.empty());
+  stream.sent_end = end_stream;
+}
+
+Task<bool> Http2Connection::send_body(Stream &stream, const Request &request,
+                                      Error &error) {
+  const size_t length =
+      request.body_file ? request.body_file->length : request.body.size();
+  std::string piece;
+  for (size_t sent = 0; sent < length;) {
+    if (failed_) {
+      error = error_;
+      co_return false;
+    }
+    if (stream.reset) {
+      error = Error::Write;
+      co_return false;
+    }
+    if (stream.ended) {
+      // Answered before the whole body was sent
+      co_return true;
+    }
+
+    const int64_t window =
+        std::min({stream.send_window, send_window_,
+                  static_cast<int64_t>(max_frame_size_),
+                  static_cast<int64_t>(length - sent)});
+    if (window <= 0 ||
+        output_.size() - written_ >= constants::HTTP2_OUTPUT_BUFFER_SIZE) {
+      stream.blocked = true;
+      const bool notified =
+          co_await wait(stream, Clock::now() + write_timeout_);
+      stream.blocked = false;
+      if (!notified) {
+        error = Error::WriteTimeout;
+        co_return false;
+      }
+      continue;
+    }
+
+    std::string_view data;
+    if (request.body_file) {
+      piece.resize(window);
+      const ssize_t bytes =
+          pread(request.body_file->fd, piece.data(), piece.size(),
+                request.body_file->offset + static_cast<off_t>(sent));
+      if (bytes <= 0) {
+        error = Error::File;
+        co_return false;
+      }
+      data = std::string_view(piece).substr(0, bytes);
+    } else {
+      data = std::string_view(request.body).substr(sent, window);
+    }
+
+    stream.send_window -= static_cast<int64_t>(data.size());
+    send_window_ -= static_cast<int64_t>(data.size());
+    sent += data.size();
+    stream.sent_end = sent == length;
+    queue_frame(DATA, stream.sent_end ? END_STREAM : 0, stream.id, data);
+  }
+  co_return true;
+}
+
+void Http2Connection::notify(Stream &stream) {
+  eventfd_write(stream.event_fd, 1);
+}
+
+void Http2Connection::notify_all() {
+  for (auto &[id, stream] : streams_) {
+    notify(*stream);
+  }
+  for (auto *stream : waiting_streams_) {
+    notify(*stream);
+  }
+}
+
+Task<bool> Http2Connection::wait(Stream &stream, Clock::time_point deadline) {
+  if (!co_await loop_.readable(stream.event_fd, deadline)) {
+    co_return false;
+  }
+  eventfd_t count = 0;
+  eventfd_read(stream.event_fd, &count);
+  co_return true;
+}
+
+Task<> Http2Connection::write_frames() {
+  while (true) {
+    if (written_ == output_.size()) {
+      output_.clear();
+      written_ = 0;
+      write_pending_ = false;
+      if (failed_) {
+        co_return;
+      }
+      co_await loop_.readable(write_event_, Clock::time_point::max());
+      eventfd_t count = 0;
+      eventfd_read(write_event_, &count);
+      continue;
+    }
+
+    const auto pending = std::string_view(output_).substr(written_);
+    Error error = Error::Success;
+    ssize_t bytes = 0;
+    if (socket_.tls != nullptr) {
+      const struct iovec buffer{const_cast<char *>(pending.data()),
+                                pending.size()};
+      bytes = socket_.tls->write(std::span(&buffer, 1), error);
+    } else {
+      bytes = send(socket_.sockfd, std::as_bytes(std::span(pending)), error);
+    }
+
+    if (bytes < 0) {
+      if (error != Error::ReadTimeout && error != Error::WriteTimeout) {
+        fail(error);
+        co_return;
+      }
+      const auto deadline = Clock::now() + write_timeout_;
+      bool ready = false;
+      if (error == Error::ReadTimeout) {
+        ready = co_await loop_.readable(write_fd_, deadline);
+      } else {
+        ready = co_await loop_.writable(write_fd_, deadline);
+      }
+      if (!ready) {
+        fail(Error::WriteTimeout);
+        co_return;
+      }
+      continue;
+    }
+
+    written_ += static_cast<size_t>(bytes);
+    // The written frames are dropped once they are most of the buffer, rather
+    // than moving the rest after every write
+    if (written_ >= constants::HTTP2_OUTPUT_BUFFER_SIZE &&
+        written_ * 2 >= output_.size()) {
+      output_.erase(0, written_);
+      written_ = 0;
+    }
+    if (output_.size() - written_ < constants::HTTP2_OUTPUT_BUFFER_SIZE) {
+      for (auto &[id, stream] : streams_) {
+        if (stream->blocked) {
+          notify(*stream);
+        }
+      }
+    }
+  }
+}
+
+Task<> Http2Connection::read_frames() {
+  while (process_frames()) {
+    if (parsed_ > 0) {
+      input_.erase(0, parsed_);
+      parsed_ = 0;
+    }
+    const size_t size = input_.size();
+    input_.resize(size + constants::STREAM_BUFFER_SIZE);
+    const auto buffer = std::as_writable_bytes(
+        std::span(input_.data() + size, constants::STREAM_BUFFER_SIZE));
+    Error error = Error::Success;
+    ssize_t bytes = 0;
+    if (socket_.tls != nullptr) {
+      bytes = socket_.tls->read(buffer, error);
+    } else {
+      bytes = recv(socket_.sockfd, buffer, buffer.size(), error);
+    }
+    input_.resize(size + static_cast<size_t>(std::max<ssize_t>(bytes, 0)));
+
+    if (bytes > 0) {
+      continue;
+    }
+    if (bytes == 0) {
+      fail(Error::Read);
+      co_return;
+    }
+    // The connection stays open for as long as the client keeps it
+    if (error == Error::ReadTimeout) {
+      co_await loop_.readable(socket_.sockfd, Clock::time_point::max());
+    } else if (error == Error::WriteTimeout) {
+      co_await loop_.writable(socket_.sockfd, Clock::time_point::max());
+    } else {
+      fail(error);
+      co_return;
+    }
+  }
+}
+
+bool Http2Connection::process_frames() {
+  while (!failed_ && input_.size() - parsed_ >= FRAME_HEADER_SIZE) {
+    const auto header = std::string_view(input_).substr(parsed_);
+    const uint32_t length = read_u32(header) >> 8;
+    if (length > MAX_FRAME_SIZE) {
+      fail(Error::Read, FRAME_SIZE_ERROR);
+      return false;
+    }
+    if (header.size() < FRAME_HEADER_SIZE + length) {
+      break;
+    }
+    const auto type = static_cast<uint8_t>(header[3]);
+    const auto flags = static_cast<uint8_t>(header[4]);
+    const uint32_t stream_id = read_u32(header.substr(5)) & MAX_STREAM_ID;
+    parsed_ += FRAME_HEADER_SIZE + length;
+    if (!process_frame(type, flags, stream_id,
+                       header.substr(FRAME_HEADER_SIZE, length))) {
+      return false;
+    }
+  }
+  return !failed_;
+}
+
+bool Http2Connection::process_frame(uint8_t type, uint8_t flags,
+                                    uint32_t stream_id,
+                                    std::string_view payload) {
+  auto protocol_error = [&](ErrorCode code = PROTOCOL_ERROR) {
+    fail(Error::Read, code);
+    return false;
+  };
+
+  // Nothing comes between the frames of a header block
+  if (!header_complete_ &&
+      (type != CONTINUATION || stream_id != header_stream_)) {
+    return protocol_error();
+  }
+
+  auto it = streams_.find(stream_id);
+  Stream *stream = it == streams_.end() ? nullptr : it->second;
+  switch (type) {
+  case DATA: {
+    if (stream_id == 0) {
+      return protocol_error();
+    }
+    const auto length = static_cast<uint32_t>(payload.size());
+    if (!remove_padding(flags, payload)) {
+      return protocol_error();
+    }
+    receive_window_ -= length;
+    if (receive_window_ < 0) {
+      return protocol_error(FLOW_CONTROL_ERROR);
+    }
+    if (stream == nullptr) {
+      // A stream the client reset in the meantime
+      credit(nullptr, length);
+      return true;
+    }
+    stream->receive_window -= length;
+    if (stream->receive_window < 0) {
+      return protocol_error(FLOW_CONTROL_ERROR);
+    }
+    stream->data += payload;
+    if (flags & END_STREAM) {
+      stream->ended = true;
+    }
+    // The padding is given back at once, the data once consumed
+    credit(stream, length - static_cast<uint32_t>(payload.size()));
+    notify(*stream);
+    return true;
+  }
+
+  case HEADERS:
+    if (stream_id == 0 || !remove_padding(flags, payload)) {
+      return protocol_error();
+    }
+    if (flags & PRIORITY) {
+      if (payload.size() < 5) {
+        return protocol_error();
+      }
+      payload.remove_prefix(5);
+    }
+    header_block_ = payload;
+    header_stream_ = stream_id;
+    header_end_stream_ = flags & END_STREAM;
+    header_complete_ = flags & END_HEADERS;
+    break;
+
+  case CONTINUATION:
+    if (header_complete_) {
+      return protocol_error();
+    }
+    header_block_ += payload;
+    header_complete_ = flags & END_HEADERS;
+    break;
+
+  case RST_STREAM:
+    if (stream_id == 0 || payload.size() != 4) {
+      return protocol_error(FRAME_SIZE_ERROR);
+    }
+    if (stream != nullptr) {
+      stream->reset = read_u32(payload);
+      notify(*stream);
+    }
+    return true;
+
+  case SETTINGS:
+    if (stream_id != 0) {
+      return protocol_error();
+    }
+    if (flags & ACK) {
+      return payload.empty() || protocol_error(FRAME_SIZE_ERROR);
+    }
+    return process_settings(payload);
+
+  case PUSH_PROMISE:
+    // Disabled by the settings of the client
+    return protocol_error();
+
+  case PING:
+    if (stream_id != 0 || payload.size() != 8) {
+      return protocol_error(FRAME_SIZE_ERROR);
+    }
+    if ((flags & ACK) == 0) {
+      queue_frame(PING, ACK, 0, payload);
+    }
+    return true;
+
+  case GOAWAY:
+    if (stream_id != 0 || payload.size() < 8) {
+      return protocol_error(FRAME_SIZE_ERROR);
+    }
+    // The streams up to the last one are still answered
+    going_away_ = true;
+    last_stream_id_ = read_u32(payload) & MAX_STREAM_ID;
+    notify_all();
+    return true;
+
+  case WINDOW_UPDATE: {
+    if (payload.size() != 4) {
+      return protocol_error(FRAME_SIZE_ERROR);
+    }
+    const uint32_t increment = read_u32(payload) & MAX_STREAM_ID;
+    if (increment == 0) {
+      return protocol_error();
+    }
+    if (stream_id == 0) {
+      send_window_ += increment;
+      if (send_window_ > MAX_WINDOW_SIZE) {
+        return protocol_error(FLOW_CONTROL_ERROR);
+      }
+      notify_all();
+    } else if (stream != nullptr) {
+      stream->send_window += increment;
+      if (stream->send_window > MAX_WINDOW_SIZE) {
+        return protocol_error(FLOW_CONTROL_ERROR);
+      }
+      notify(*stream);
+    }
+    return true;
+  }
+
+  default:
+    // PRIORITY, and the frames of extensions
+    return true;
+  }
+
+  if (header_block_.size() > constants::MAX_HEADER_SIZE) {
+    return protocol_error();
+  }
+  return !header_complete_ || process_header_block();
+}
+
+bool Http2Connection::process_header_block() {
+  auto it = streams_.find(header_stream_);
+  // Trailers, and the blocks of reset streams, only go through the decoder
+  // to keep its table in step
+  Stream *stream = it != streams_.end() && !it->second->has_header
+                       ? it->second
+                       : nullptr;
+
+  int status_code = -1;
+  std::string section;
+  std::vector<HeaderMap::Field> fields;
+  const bool decoded = decoder_.decode(
+      header_block_, [&](std::string_view name, std::string_view value) {
+        if (stream == nullptr) {
+          return;
+        }
+        if (name == ":status") {
+          std::from_chars(value.data(), value.data() + value.size(),
+                          status_code);
+        } else if (!name.starts_with(':')) {
+          const auto offset = static_cast<uint32_t>(section.size());
+          fields.push_back({offset, static_cast<uint32_t>(name.size()),
+                            offset + static_cast<uint32_t>(name.size()) + 2,
+                            static_cast<uint32_t>(value.size())});
+          section.append(name).append(": ").append(value).append("\r\n");
+        }
+      });
+  header_block_.clear();
+  if (!decoded) {
+    fail(Error::Read, COMPRESSION_ERROR);
+    return false;
+  }
+  if (it == streams_.end()) {
+    return true;
+  }
+
+  if (stream != nullptr) {
+    // Informational responses come before the final one
+    if (status_code >= 100 && status_code < 200 && !header_end_stream_) {
+      return true;
+    }
+    stream->has_header = true;
+    stream->status_code = status_code;
+    stream->header_section = std::move(section);
+    stream->fields = std::move(fields);
+    stream->first_byte = Clock::now();
+  }
+  if (header_end_stream_) {
+    it->second->ended = true;
+  }
+  notify(*it->second);
+  return true;
+}
+
+bool Http2Connection::process_settings(std::string_view payload) {
+  if (payload.size() % 6 != 0) {
+    fail(Error::Read, FRAME_SIZE_ERROR);
+    return false;
+  }
+  for (; !payload.empty(); payload.remove_prefix(6)) {
+    const auto id = static_cast<uint16_t>(
+        static_cast<uint8_t>(payload[0]) << 8 |
+        static_cast<uint8_t>(payload[1]));
+    const uint32_t value = read_u32(payload.substr(2));
+    switch (id) {
+    case SETTINGS_HEADER_TABLE_SIZE:
+      encoder_.set_max_table_size(value);
+      break;
+    case SETTINGS_MAX_CONCURRENT_STREAMS:
+      max_concurrent_streams_ = value;
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE: {
+      if (value > MAX_WINDOW_SIZE) {
+        fail(Error::Read, FLOW_CONTROL_ERROR);
+        return false;
+      }
+      // The windows of the open streams move by the difference
+      const int64_t delta = int64_t{value} - initial_window_size_;
+      for (auto &[stream_id, stream] : streams_) {
+        stream->send_window += delta;
+        if (stream->send_window > MAX_WINDOW_SIZE) {
+          fail(Error::Read, FLOW_CONTROL_ERROR);
+          return false;
+        }
+      }
+      initial_window_size_ = value;
+      break;
+    }
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < MAX_FRAME_SIZE || value > MAX_ALLOWED_FRAME_SIZE) {
+        fail(Error::Read, PROTOCOL_ERROR);
+        return false;
+      }
+      max_frame_size_ = value;
+      break;
+    default:
+      break;
+    }
+  }
+  queue_frame(SETTINGS, ACK, 0, {});
+  notify_all();
+  return true;
+}
+
+void Http2Connection::fail(Error error, std::optional<uint32_t> code) {
+  if (failed_) {
+    return;
+  }
+  if (code) {
+    // The client opens no streams of the server's to report as processed
+    std::string payload;
+    append_u32(payload, 0);
+    append_u32(payload, *code);
+    queue_frame(GOAWAY, 0, 0, payload);
+  }
+  failed_ = true;
+  error_ = error;
+  notify_all();
+  // The writer sends what is left, the GOAWAY included, then stops
+  eventfd_write(write_event_, 1);
+}
+
+auto Http2Connection::request(const Request &request,
+                              const Headers &default_headers, bool decode,
+                              RequestTiming &timing, Error &error,
+                              bool &refused)
+    -> Task<std::optional<Response>> {
+  refused = false;
+  Stream stream{.id = 0, .event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)};
+  if (stream.event_fd < 0) {
+    error = Error::Unknown;
+    co_return std::nullopt;
+  }
+  auto guard = scope_guard::make_scope_exit([&] {
+    std::erase(waiting_streams_, &stream);
+    if (stream.id != 0) {
+      streams_.erase(stream.id);
+      // A stream left open on either side is reset, e.g. when the request
+      // timed out or was cancelled, so that the server stops sending
+      if (!failed_ && !stream.reset && (!stream.ended || !stream.sent_end)) {
+        std::string payload;
+        append_u32(payload, stream.ended ? NO_ERROR : CANCEL);
+        queue_frame(RST_STREAM, 0, stream.id, payload);
+      }
+      if (!waiting_streams_.empty()) {
+        notify(*waiting_streams_.front());
+      }
+    }
+    close(stream.event_fd);
+  });
+
+  // As many streams are open at once as the server allows
+  const auto wait_deadline = Clock::now() + read_timeout_;
+  while (!failed_ && !going_away_ &&
+         streams_.size() >= max_concurrent_streams_) {
+    waiting_streams_.push_back(&stream);
+    const bool notified = co_await wait(stream, wait_deadline);
+    std::erase(waiting_streams_, &stream);
+    if (!notified) {
+      error = Error::ReadTimeout;
+      co_return std::nullopt;
+    }
+  }
+  if (!usable()) {
+    error = failed_ ? error_ : Error::Connection;
+    refused = true;
+    co_return std::nullopt;
+  }
+
+  // Streams are opened in the order of their ids, so the HEADERS frame is
+  // queued along with the allocation of its id
+  stream.id = next_stream_id_;
+  next_stream_id_ += 2;
+  stream.send_window = initial_window_size_;
+  stream.receive_window = constants::HTTP2_STREAM_WINDOW;
+  streams_.emplace(stream.id, &stream);
+
+  const auto write_start = Clock::now();
+  const bool has_body = request.body_file ? request.body_file->length > 0
+                                          : !request.body.empty();
+  queue_headers(stream, request, default_headers, decode, !has_body);
+  if (has_body) {
+    if (!co_await send_body(stream, request, error)) {
+      refused = going_away_ && stream.id > last_stream_id_;
+      co_return std::nullopt;
+    }
+  }
+  const auto written = Clock::now();
+  timing.write = elapsed(write_start, written);
+
+  Response response;
+  response.version = "HTTP/2";
+  std::unique_ptr<ContentDecoder> decoder;
+  std::string decoded;
+  bool header_taken = false;
+  bool file_failed = false;
+  auto deliver = [&](std::string_view data) {
+    if (decoder) {
+      decoded.clear();
+      if (!decoder->decode(data, decoded)) {
+        return false;
+      }
+      data = decoded;
+    }
+    if (request.file_sink) {
+      file_failed = !write_file(request.file_sink->fd, data);
+      return !file_failed;
+    }
+    if (request.body_sink) {
+      if (!data.empty()) {
+        request.body_sink(data);
+      }
+    } else {
+      response.body += data;
+    }
+    return true;
+  };
+
+  auto deadline = Clock::now() + read_timeout_;
+  while (true) {
+    if (stream.has_header && !header_taken) {
+      header_taken = true;
+      response.status_code = stream.status_code;
+      response.headers = HeaderMap(std::move(stream.header_section),
+                                   std::move(stream.fields));
+      if (decode) {
+        const auto coding =
+            parse_content_coding(response.headers.find("Content-Encoding"));
+        if (coding == ContentCoding::Gzip ||
+            coding == ContentCoding::Deflate) {
+          decoder = std::make_unique<ContentDecoder>(coding);
+        }
+      }
+    }
+    if (header_taken && !stream.data.empty()) {
+      const auto length = static_cast<uint32_t>(stream.data.size());
+      if (!deliver(stream.data)) {
+        error = file_failed ? Error::File : Error::Read;
+        co_return std::nullopt;
+      }
+      stream.data.clear();
+      credit(&stream, length);
+      deadline = Clock::now() + read_timeout_;
+    }
+
+    if (stream.reset) {
+      error = Error::Read;
+      refused = *stream.reset == REFUSED_STREAM;
+      co_return std::nullopt;
+    }
+    if (stream.ended) {
+      if (!header_taken) {
+        // Data without a response
+        error = Error::Read;
+        co_return std::nullopt;
+      }
+      break;
+    }
+    if (going_away_ && stream.id > last_stream_id_) {
+      error = Error::Read;
+      refused = true;
+      co_return std::nullopt;
+    }
+    if (failed_) {
+      error = error_;
+      refused = !stream.first_byte && is_safe(request.method);
+      co_return std::nullopt;
+    }
+    if (!co_await wait(stream, deadline)) {
+      error = Error::ReadTimeout;
+      co_return std::nullopt;
+    }
+  }
+
+  if (decoder && !decoder->finished()) {
+    error = Error::Read;
+    co_return std::nullopt;
+  }
+  const auto received = Clock::now();
+  timing.first_byte = elapsed(written, *stream.first_byte);
+  timing.receive = elapsed(*stream.first_byte, received);
+  error = Error::Success;
+  co_return response;
+}
+
+} // namespace http::detail
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "connection_pool.hpp"
+#include "error.hpp"
+#include "event_loop.hpp"
+#include "hpack.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "socket.hpp"
+#include "task.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace http::detail {
+
+// An HTTP/2 connection (RFC 9113), carrying the requests of a client as
+// concurrent streams. Frames are queued in a buffer written by a coroutine of
+// the connection, while another one reads the frames of the server, decoding
+// the header blocks in order and queueing the data of each stream for the
+// request waiting on it, woken through an eventfd. Both run on the event loop
+// for as long as the connection is open.
+class Http2Connection {
+public:
+  // Takes over the connected socket, whose slot in the pool is given back
+  // once the connection is destroyed. authority: that of the requests, e.g.
+  // the host and the port.
+  Http2Connection(EventLoop &loop, std::shared_ptr<ConnectionPool> pool,
+                  std::string host, uint16_t port, Socket socket,
+                  std::string authority);
+  ~Http2Connection();
+
+  Http2Connection(const Http2Connection &) = delete;
+  Http2Connection &operator=(const Http2Connection &) = delete;
+
+  // Whether new streams can be opened on it
+  bool usable() const;
+
+  void set_timeouts(std::chrono::microseconds read_timeout,
+                    std::chrono::microseconds write_timeout) {
+    read_timeout_ = read_timeout;
+    write_timeout_ = write_timeout;
+  }
+
+  // Perform the request on a new stream, with the default headers it does not
+  // override, asking for a gzip or deflate body and decoding it if decode.
+  // refused: whether it failed before the server could process it, or
+  // before any of the response was received if its method is safe, so that
+  // it can be sent again on another connection.
+  auto request(const Request &request, const Headers &default_headers,
+               bool decode, RequestTiming &timing, Error &error,
+               bool &refused) -> Task<std::optional<Response>>;
+
+private:
+  using Clock = EventLoop::Clock;
+
+  struct Stream {
+    uint32_t id;
+    // Written when something arrives for the stream, or it can send more
+    int event_fd;
+    // The response once its header block is received, its fields as the
+    // lines of a header section
+    bool has_header{};
+    int status_code{-1};
+    std::string header_section{};
+    std::vector<HeaderMap::Field> fields{};
+    std::optional<Clock::time_point> first_byte{};
+    // The data received and not consumed yet
+    std::string data{};
+    bool ended{};
+    std::optional<uint32_t> reset{};
+    // The bytes that can be sent, and received before a WINDOW_UPDATE
+    int64_t send_window{};
+    int64_t receive_window{};
+    // The bytes received since the last WINDOW_UPDATE
+    uint32_t consumed{};
+    // Whether the request waits for a window, or for room in the buffer
+    bool blocked{};
+    // Whether the whole request was queued
+    bool sent_end{};
+  };
+
+  // Appends a frame to those being written
+  void queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+                   std::string_view payload);
+  void queue_window_update(uint32_t stream_id, uint32_t increment);
+  // Gives the bytes received on the stream back to the windows, nullptr if
+  // it is closed, telling the server once they amount to half of them
+  void credit(Stream *stream, uint32_t length);
+  // Queues the header block of the request in a HEADERS frame and as many
+  // CONTINUATION frames as it takes
+  void queue_headers(Stream &stream, const Request &request,
+                     const Headers &default_headers, bool decode,
+                     bool end_stream);
+  // Sends the body in DATA frames, as the flow control windows and the
+  // buffer allow
+  Task<bool> send_body(Stream &stream, const Request &request, Error &error);
+  // Wakes the request waiting on the stream
+  void notify(Stream &stream);
+  void notify_all();
+  // Waits to be notified, false on timeout
+  Task<bool> wait(Stream &stream, Clock::time_point deadline);
+
+  Task<> write_frames();
+  Task<> read_frames();
+  // false if the frames broke the protocol, a connection error
+  bool process_frames();
+  bool process_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+                     std::string_view payload);
+  bool process_header_block();
+  bool process_settings(std::string_view payload);
+  // The connection cannot be used any more, the server being told why if it
+  // broke the protocol
+  void fail(Error error, std::optional<uint32_t> code = std::nullopt);
+
+  EventLoop &loop_;
+  std::shared_ptr<ConnectionPool> pool_;
+  std::string host_;
+  uint16_t port_;
+  Socket socket_;
+  // The socket, duplicated so that writing waits on it while reading does on
+  // the socket
+  int write_fd_;
+  // Wakes the writing coroutine once frames are queued
+  int write_event_;
+  std::string authority_;
+  std::chrono::microseconds read_timeout_{};
+  std::chrono::microseconds write_timeout_{};
+
+  std::unordered_map<uint32_t, Stream *> streams_{};
+  uint32_t next_stream_id_{1};
+  // Requests waiting for the server to allow another stream
+  std::vector<Stream *> waiting_streams_{};
+
+  // The frames to write, from the offset
+  std::string output_{};
+  size_t written_{};
+  bool write_pending_{};
+  std::string input_{};
+  size_t parsed_{};
+  // The header block being received in CONTINUATION frames, for the stream
+  std::string header_block_{};
+  uint32_t header_stream_{};
+  bool header_end_stream_{};
+  bool header_complete_{true};
+
+  HpackEncoder encoder_{};
+  HpackDecoder decoder_{};
+  // The settings of the server
+  uint32_t max_concurrent_streams_;
+  uint32_t initial_window_size_;
+  uint32_t max_frame_size_;
+  int64_t send_window_;
+  int64_t receive_window_;
+  uint32_t consumed_{};
+
+  bool going_away_{};
+  uint32_t last_stream_id_{};
+  bool failed_{};
+  Error error_{Error::Success};
+
+  // Destroyed first, as they refer to the rest
+  std::optional<Task<>> writer_{};
+  std::optional<Task<>> reader_{};
+};
+
+} // namespace http::detail
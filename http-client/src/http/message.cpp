@@ -0,0 +1,77 @@
+#include "message.hpp"
+
+#include "fmt/format.h"
+#include "response_parser.hpp"
+#include <iterator>
+
+namespace http {
+
+namespace detail {
+auto find_header(const Headers &headers, std::string_view name)
+    -> std::optional<std::string_view> {
+  for (const auto &[header, value] : headers) {
+    if (utils::iequals(header, name)) {
+      return value;
+    }
+  }
+  return std::nullopt;
+}
+} // namespace detail
+
+void Request::write_head(std::string &buffer, std::string_view host,
+                         const Headers &default_headers,
+                         std::string_view extra_fields) const {
+  auto out = std::back_inserter(buffer);
+  fmt::format_to(out, "{} {} {}\r\n", to_string(method), path, protocol);
+
+  // Host and Content-Length are given by the client and the body
+  auto is_written = [&](std::string_view name) {
+    return (!host.empty() && utils::iequals(name, "Host")) ||
+           utils::iequals(name, "Content-Length");
+  };
+
+  if (!host.empty()) {
+    fmt::format_to(out, "Host: {}\r\n", host);
+  }
+  for (const auto &[header, value] : default_headers) {
+    if (!is_written(header) && !detail::find_header(headers, header)) {
+      fmt::format_to(out, "{}: {}\r\n", header, value);
+    }
+  }
+  for (const auto &[header, value] : headers) {
+    if (!is_written(header)) {
+      fmt::format_to(out, "{}: {}\r\n", header, value);
+    }
+  }
+  buffer += extra_fields;
+  fmt::format_to(out, "Content-Length: {}\r\n\r\n",
+                 body_file ? body_file->length : body.size());
+}
+
+std::string Request::to_http_string() const {
+  std::string data;
+  write_head(data);
+  data += body;
+  return data;
+}
+
+auto HeaderMap::find(std::string_view name) const
+    -> std::optional<std::string_view> {
+  for (const auto &[field_name, value] : *this) {
+    if (utils::iequals(field_name, name)) {
+      return value;
+    }
+  }
+  return std::nullopt;
+}
+
+auto Response::from_str(std::string_view response_str)
+    -> std::optional<Response> {
+  ResponseParser parser{std::string(response_str)};
+  if (parser.state() != ResponseParser::State::Complete) {
+    return std::nullopt;
+  }
+  return parser.take_response();
+}
+
+} // namespace http
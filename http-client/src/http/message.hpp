@@ -0,0 +1,199 @@
+#pragma once
+
+#include "error.hpp"
+#include "utils.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace http {
+
+using Headers = std::unordered_map<std::string, std::string>;
+
+namespace detail {
+// Header names are case-insensitive, the map is keyed by them as given
+auto find_header(const Headers &headers, std::string_view name)
+    -> std::optional<std::string_view>;
+} // namespace detail
+
+// The header fields of a response, as slices of its header section, looked up
+// by their case-insensitive names
+class HeaderMap {
+public:
+  // The offsets of a field in the header section
+  struct Field {
+    uint32_t name;
+    uint32_t name_length;
+    uint32_t value;
+    uint32_t value_length;
+  };
+
+  class Iterator {
+  public:
+    using value_type = std::pair<std::string_view, std::string_view>;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() = default;
+    Iterator(const HeaderMap *map, size_t index) : map_(map), index_(index) {}
+
+    value_type operator*() const { return map_->field(index_); }
+    Iterator &operator++() {
+      ++index_;
+      return *this;
+    }
+    Iterator operator++(int) {
+      auto it = *this;
+      ++index_;
+      return it;
+    }
+    bool operator==(const Iterator &other) const {
+      return index_ == other.index_;
+    }
+
+  private:
+    const HeaderMap *map_{};
+    size_t index_{};
+  };
+
+  HeaderMap() = default;
+  HeaderMap(std::string header_section, std::vector<Field> fields)
+      : header_section_(std::move(header_section)), fields_(std::move(fields)) {
+  }
+
+  // The value of the first field with the name
+  auto find(std::string_view name) const -> std::optional<std::string_view>;
+  bool contains(std::string_view name) const { return find(name).has_value(); }
+
+  size_t size() const { return fields_.size(); }
+  Iterator begin() const { return {this, 0}; }
+  Iterator end() const { return {this, fields_.size()}; }
+
+private:
+  auto field(size_t index) const -> Iterator::value_type {
+    const auto &f = fields_[index];
+    std::string_view section = header_section_;
+    return {section.substr(f.name, f.name_length),
+            section.substr(f.value, f.value_length)};
+  }
+
+  std::string header_section_;
+  std::vector<Field> fields_;
+};
+
+struct Response {
+  static auto from_str(std::string_view response_str)
+      -> std::optional<Response>;
+
+  std::string version;
+  int status_code = -1;
+  std::string status_message;
+  std::string body;
+  HeaderMap headers{};
+};
+
+enum class RequestMethod { UNDEFINED = 0, GET, HEAD, POST, PUT, DELETE };
+
+constexpr auto to_string(RequestMethod req_method) {
+  switch (req_method) {
+  case http::RequestMethod::UNDEFINED:
+    return "UNDEFINED";
+  case RequestMethod::GET:
+    return "GET";
+  case RequestMethod::HEAD:
+    return "HEAD";
+  case RequestMethod::POST:
+    return "POST";
+  case RequestMethod::PUT:
+    return "PUT";
+  case RequestMethod::DELETE:
+    return "DELETE";
+  default:
+    utils::unreachable();
+  }
+}
+
+// Receives the body of a response in pieces, as they arrive, instead of it
+// being kept in Response::body
+using BodySink = std::function<void(std::string_view)>;
+
+// The body of a request sent from a file, without being read in memory when
+// the connection allows it (sendfile). The descriptor stays the caller's, and
+// its position is not moved.
+struct FileBody {
+  int fd{-1};
+  off_t offset{};
+  size_t length{};
+};
+
+// A file the body of a response is written to as it arrives, from the
+// position of the descriptor, straight from the socket when the connection
+// allows it (splice). The descriptor stays the caller's.
+struct FileSink {
+  int fd{-1};
+};
+
+struct Request {
+  void add_header(const std::string &key, const std::string &value) {
+    headers.insert_or_assign(key, value);
+  }
+
+  // Append the request line and the header section to the buffer, with the
+  // Host header if given, the default headers the request does not override
+  // and the Content-Length of the body or body file, which is sent on its own
+  // extra_fields: header lines added by the client, written as given
+  void write_head(std::string &buffer, std::string_view host = {},
+                  const Headers &default_headers = {},
+                  std::string_view extra_fields = {}) const;
+
+  std::string to_http_string() const;
+
+  RequestMethod method;
+  std::string path;
+  static constexpr std::string_view protocol{"HTTP/1.1"};
+  Headers headers{};
+  std::string body;
+  BodySink body_sink{};
+  // Sent instead of the body
+  std::optional<FileBody> body_file{};
+  // Receives the body instead of the response, like the body sink
+  std::optional<FileSink> file_sink{};
+  // The most the request may take as a whole, retries included, instead of
+  // the request timeout of the client
+  std::optional<std::chrono::microseconds> timeout{};
+
+  // Whether the body of the response is passed on rather than kept, in which
+  // case it may be passed on in part before an error
+  bool streams_response() const { return body_sink || file_sink; }
+};
+
+class Result {
+public:
+  Result(std::optional<Response> response, Error error)
+      : response_(std::move(response)), error_(error) {}
+
+  Result() = default;
+
+  operator bool() const { return response_.has_value(); }
+  const Response &operator*() const { return *response_; }
+  Response &operator*() { return *response_; }
+  const Response *operator->() const { return &*response_; }
+  Response *operator->() { return &*response_; }
+
+  Error error() const { return error_; }
+
+private:
+  std::optional<Response> response_;
+  Error error_ = Error::Unknown;
+};
+
+using Logger = std::function<void(const Request &, const Response &)>;
+
+} // namespace http
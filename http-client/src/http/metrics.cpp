@@ -0,0 +1,157 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <string>
+
+namespace http {
+
+namespace {
+
+// The shard of the calling thread, the threads taking them in turn
+size_t shard_index() {
+  static std::atomic<size_t> next{0};
+  thread_local const size_t shard =
+      next.fetch_add(1, std::memory_order_relaxed) % RequestMetrics::SHARDS;
+  return shard;
+}
+
+// Writes a duration in seconds, in the shortest form that reads back exactly
+void write_seconds(std::ostream &out, std::chrono::microseconds duration) {
+  std::array<char, 32> buffer{};
+  const auto seconds = std::chrono::duration<double>(duration).count();
+  const auto result =
+      std::to_chars(buffer.data(), buffer.data() + buffer.size(), seconds);
+  out.write(buffer.data(), result.ptr - buffer.data());
+}
+
+} // namespace
+
+void LatencyHistogram::add(std::chrono::microseconds latency) {
+  const auto us = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+  // The bucket b holds the latencies up to 2^b us
+  const size_t bucket = us <= 1 ? 0 : std::bit_width(us - 1);
+  ++buckets_[std::min(bucket, BUCKETS - 1)];
+  ++count_;
+  sum_ += latency;
+  max_ = std::max(max_, latency);
+}
+
+auto LatencyHistogram::quantile(double q) const -> std::chrono::microseconds {
+  if (count_ == 0) {
+    return std::chrono::microseconds(0);
+  }
+
+  const auto rank = static_cast<size_t>(
+      std::ceil(std::clamp(q, 0.0, 1.0) * static_cast<double>(count_)));
+  size_t seen = 0;
+  for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+    seen += buckets_[bucket];
+    if (seen >= std::max<size_t>(rank, 1)) {
+      return std::min(std::chrono::microseconds(int64_t{1} << bucket), max_);
+    }
+  }
+  return max_;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+    buckets_[bucket] += other.buckets_[bucket];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  max_ = std::max(max_, other.max_);
+}
+
+void LatencyHistogram::write_prometheus(std::ostream &out,
+                                        std::string_view name,
+                                        std::string_view labels) const {
+  const char *separator = labels.empty() ? "" : ",";
+  size_t cumulative = 0;
+  // The last bucket also holds the longer latencies, so is only counted by
+  // +Inf
+  for (size_t bucket = 0; bucket + 1 < BUCKETS; ++bucket) {
+    cumulative += buckets_[bucket];
+    out << name << "_bucket{" << labels << separator << "le=\"";
+    write_seconds(out, std::chrono::microseconds(int64_t{1} << bucket));
+    out << "\"} " << cumulative << '\n';
+  }
+  out << name << "_bucket{" << labels << separator << "le=\"+Inf\"} "
+      << count_ << '\n';
+  const char *open = labels.empty() ? "" : "{";
+  const char *close = labels.empty() ? "" : "}";
+  out << name << "_sum" << open << labels << close << ' ';
+  write_seconds(out, sum_);
+  out << '\n' << name << "_count" << open << labels << close << ' ' << count_
+      << '\n';
+}
+
+void RequestMetrics::Snapshot::write_prometheus(std::ostream &out) const {
+  const std::pair<std::string_view, size_t> counters[] = {
+      {"http_client_requests_total", requests},
+      {"http_client_reused_connections_total", reused_connections},
+      {"http_client_resumed_sessions_total", resumed_sessions},
+  };
+  for (const auto &[name, value] : counters) {
+    out << "# TYPE " << name << " counter\n" << name << ' ' << value << '\n';
+  }
+
+  const std::pair<std::string_view, const LatencyHistogram &> phases[] = {
+      {"resolve", resolve},   {"connect", connect}, {"write", write},
+      {"ttfb", first_byte},   {"receive", receive}, {"total", total},
+  };
+  constexpr std::string_view name = "http_client_phase_duration_seconds";
+  out << "# TYPE " << name << " histogram\n";
+  for (const auto &[phase, histogram] : phases) {
+    std::string labels = "phase=\"";
+    labels.append(phase).append("\"");
+    histogram.write_prometheus(out, name, labels);
+  }
+}
+
+void RequestMetrics::record(const RequestTiming &timing) {
+  auto &shard = shards_[shard_index()];
+  std::lock_guard lock(shard.mutex);
+  auto &data = shard.data;
+  ++data.requests;
+  if (timing.reused_connection) {
+    ++data.reused_connections;
+  } else {
+    data.resumed_sessions += timing.resumed_session;
+    data.resolve.add(timing.resolve);
+    data.connect.add(timing.connect);
+  }
+  data.write.add(timing.write);
+  data.first_byte.add(timing.first_byte);
+  data.receive.add(timing.receive);
+  data.total.add(timing.total);
+}
+
+auto RequestMetrics::snapshot() const -> Snapshot {
+  Snapshot merged{};
+  for (const auto &shard : shards_) {
+    std::lock_guard lock(shard.mutex);
+    merged.requests += shard.data.requests;
+    merged.reused_connections += shard.data.reused_connections;
+    merged.resumed_sessions += shard.data.resumed_sessions;
+    merged.resolve.merge(shard.data.resolve);
+    merged.connect.merge(shard.data.connect);
+    merged.write.merge(shard.data.write);
+    merged.first_byte.merge(shard.data.first_byte);
+    merged.receive.merge(shard.data.receive);
+    merged.total.merge(shard.data.total);
+  }
+  return merged;
+}
+
+void RequestMetrics::clear() {
+  for (auto &shard : shards_) {
+    std::lock_guard lock(shard.mutex);
+    shard.data = {};
+  }
+}
+
+} // namespace http
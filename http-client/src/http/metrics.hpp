@@ -0,0 +1,110 @@
+#pragma once
+
+#include "message.hpp"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+
+namespace http {
+
+// How long the phases of an attempt of a request took. Resolving and
+// connecting are skipped when a pooled connection is reused.
+struct RequestTiming {
+  // Resolving the host, close to zero when its addresses are cached
+  std::chrono::microseconds resolve{};
+  // The TLS handshake included
+  std::chrono::microseconds connect{};
+  // Writing the request
+  std::chrono::microseconds write{};
+  // From the request written to the first byte of the response
+  std::chrono::microseconds first_byte{};
+  // From the first byte to the end of the response
+  std::chrono::microseconds receive{};
+  // From the start, waiting for a connection of the pool included
+  std::chrono::microseconds total{};
+  bool reused_connection{};
+  // Whether the new TLS connection resumed a session
+  bool resumed_session{};
+};
+
+// Called like a Logger, along with the timing of the request
+using TimedLogger = std::function<void(const Request &, const Response &,
+                                       const RequestTiming &)>;
+
+// The distribution of a latency, in buckets whose bounds double from 1 us
+class LatencyHistogram {
+public:
+  static constexpr size_t BUCKETS = 32;
+
+  void add(std::chrono::microseconds latency);
+
+  size_t count() const { return count_; }
+  std::chrono::microseconds mean() const {
+    return count_ == 0 ? std::chrono::microseconds(0)
+                       : sum_ / static_cast<int64_t>(count_);
+  }
+  std::chrono::microseconds max() const { return max_; }
+  // The upper bound of the bucket the quantile is in, so at most twice it
+  std::chrono::microseconds quantile(double q) const;
+
+  // Adds the latencies of another histogram, e.g. of another thread
+  void merge(const LatencyHistogram &other);
+
+  // Writes the samples of a Prometheus histogram in seconds, the bucket b
+  // being bounded by 2^b us, with labels such as phase="ttfb" if not empty
+  void write_prometheus(std::ostream &out, std::string_view name,
+                        std::string_view labels = {}) const;
+
+private:
+  std::array<size_t, BUCKETS> buckets_{};
+  size_t count_{};
+  std::chrono::microseconds sum_{};
+  std::chrono::microseconds max_{};
+};
+
+// Aggregates the timings of the requests in a histogram per phase, e.g. from
+// the TimedLogger of several clients. The threads record into shards of their
+// own, each on its own cache lines and behind its own mutex, so that the
+// clients of different threads do not contend; the shards are merged by
+// snapshot.
+class RequestMetrics {
+public:
+  struct Snapshot {
+    size_t requests{};
+    size_t reused_connections{};
+    size_t resumed_sessions{};
+    // resolve and connect only count the new connections
+    LatencyHistogram resolve{};
+    LatencyHistogram connect{};
+    LatencyHistogram write{};
+    LatencyHistogram first_byte{};
+    LatencyHistogram receive{};
+    LatencyHistogram total{};
+
+    // Writes the counters and the histograms, labeled by phase, in the
+    // Prometheus text format
+    void write_prometheus(std::ostream &out) const;
+  };
+
+  static constexpr size_t SHARDS = 16;
+
+  void record(const RequestTiming &timing);
+
+  Snapshot snapshot() const;
+  void clear();
+
+private:
+  struct alignas(64) Shard {
+    mutable std::mutex mutex{};
+    Snapshot data{};
+  };
+
+  std::array<Shard, SHARDS> shards_{};
+};
+
+} // namespace http
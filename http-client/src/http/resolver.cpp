@@ -0,0 +1,70 @@
+#include "resolver.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace http {
+
+Resolver::Query::Query(std::string host, uint16_t port)
+    : host_(std::move(host)), port_(port),
+      done_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+Resolver::Query::~Query() {
+  if (done_fd_ >= 0) {
+    close(done_fd_);
+  }
+}
+
+Resolver::~Resolver() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+auto Resolver::shared() -> std::shared_ptr<Resolver> {
+  static auto resolver = std::make_shared<Resolver>();
+  return resolver;
+}
+
+auto Resolver::resolve(std::string host, uint16_t port)
+    -> std::shared_ptr<Query> {
+  auto query = std::make_shared<Query>(std::move(host), port);
+  {
+    std::lock_guard lock(mutex_);
+    if (!thread_.joinable()) {
+      thread_ = std::thread([this] { run(); });
+    }
+    queries_.push_back(query);
+  }
+  queued_.notify_one();
+  return query;
+}
+
+void Resolver::run() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    queued_.wait(lock, [this] { return stopping_ || !queries_.empty(); });
+    if (stopping_) {
+      return;
+    }
+
+    auto query = std::move(queries_.front());
+    queries_.pop_front();
+    lock.unlock();
+
+    query->addresses_ = detail::resolve_host(query->host_, query->port_);
+    query->done_.store(true, std::memory_order_release);
+    if (query->done_fd_ >= 0) {
+      eventfd_write(query->done_fd_, 1);
+    }
+
+    lock.lock();
+  }
+}
+
+} // namespace http
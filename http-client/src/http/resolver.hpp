@@ -0,0 +1,70 @@
+#pragma once
+
+#include "socket_utils.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace http {
+
+// Resolves hosts on a background thread, so that an event loop does not
+// block on getaddrinfo. The addresses are cached like those of
+// detail::resolve_host.
+class Resolver {
+public:
+  // A resolution, whose eventfd is written once it is done
+  class Query {
+  public:
+    Query(std::string host, uint16_t port);
+    ~Query();
+
+    Query(const Query &) = delete;
+    Query &operator=(const Query &) = delete;
+
+    // Readable once done, -1 if it could not be created
+    int done_fd() const { return done_fd_; }
+    bool done() const { return done_.load(std::memory_order_acquire); }
+    // Once done, std::nullopt if the host was not found
+    auto &addresses() const { return addresses_; }
+
+  private:
+    friend class Resolver;
+
+    std::string host_;
+    uint16_t port_;
+    int done_fd_;
+    std::atomic<bool> done_{};
+    std::optional<detail::HostAddresses> addresses_{};
+  };
+
+  Resolver() = default;
+  Resolver(const Resolver &) = delete;
+  Resolver &operator=(const Resolver &) = delete;
+
+  // Waits for the resolution in progress, the queued ones being dropped
+  ~Resolver();
+
+  // The resolver used by the clients
+  static auto shared() -> std::shared_ptr<Resolver>;
+
+  // Queue the resolution of the host, the thread being started by the first
+  // one. The query is kept alive until done, even if the caller drops it.
+  auto resolve(std::string host, uint16_t port) -> std::shared_ptr<Query>;
+
+private:
+  void run();
+
+  std::mutex mutex_{};
+  std::condition_variable queued_{};
+  std::deque<std::shared_ptr<Query>> queries_{};
+  bool stopping_{};
+  std::thread thread_{};
+};
+
+} // namespace http
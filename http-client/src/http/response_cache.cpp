@@ -0,0 +1,298 @@
+#include "response_cache.hpp"
+
+#include "utils.hpp"
+#include <charconv>
+#include <ctime>
+
+namespace {
+using namespace http;
+
+// The value of a comma-separated list element, e.g. "max-age" in
+// "no-transform, max-age=60": empty if it has none, std::nullopt if it is not
+// in the list
+auto find_directive(std::optional<std::string_view> list,
+                    std::string_view name) -> std::optional<std::string_view> {
+  if (!list) {
+    return std::nullopt;
+  }
+
+  std::string_view rest = *list;
+  while (!rest.empty()) {
+    const auto comma = rest.find(',');
+    auto element = rest.substr(0, comma);
+    rest = comma == std::string_view::npos ? std::string_view{}
+                                           : rest.substr(comma + 1);
+
+    const auto first = element.find_first_not_of(" \t");
+    if (first == std::string_view::npos) {
+      continue;
+    }
+    element =
+        element.substr(first, element.find_last_not_of(" \t") + 1 - first);
+
+    const auto equals = element.find('=');
+    if (!utils::iequals(element.substr(0, equals), name)) {
+      continue;
+    }
+    if (equals == std::string_view::npos) {
+      return std::string_view{};
+    }
+    auto value = element.substr(equals + 1);
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+      value = value.substr(1, value.size() - 2);
+    }
+    return value;
+  }
+  return std::nullopt;
+}
+
+auto parse_seconds(std::optional<std::string_view> value)
+    -> std::optional<int64_t> {
+  if (!value) {
+    return std::nullopt;
+  }
+  int64_t seconds{};
+  auto [ptr, ec] =
+      std::from_chars(value->data(), value->data() + value->size(), seconds);
+  if (ec != std::errc{} || ptr != value->data() + value->size()) {
+    return std::nullopt;
+  }
+  return seconds;
+}
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+auto parse_http_date(std::optional<std::string_view> value)
+    -> std::optional<std::time_t> {
+  if (!value) {
+    return std::nullopt;
+  }
+  std::tm tm{};
+  const std::string date(*value);
+  const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == nullptr || *end != '\0') {
+    return std::nullopt;
+  }
+  return timegm(&tm);
+}
+
+// How long the response can be reused without revalidation, std::nullopt if
+// its header does not say
+auto freshness_lifetime(const Response &response)
+    -> std::optional<std::chrono::seconds> {
+  const auto cache_control = response.headers.find("Cache-Control");
+  if (find_directive(cache_control, "no-cache")) {
+    return std::chrono::seconds(0);
+  }
+  if (auto max_age = parse_seconds(find_directive(cache_control, "max-age"))) {
+    return std::chrono::seconds(std::max<int64_t>(*max_age, 0));
+  }
+
+  const auto expires_header = response.headers.find("Expires");
+  if (!expires_header) {
+    return std::nullopt;
+  }
+  // An invalid date means that it already expired
+  const auto expires = parse_http_date(expires_header);
+  const auto date = parse_http_date(response.headers.find("Date"))
+                        .value_or(std::time(nullptr));
+  return std::chrono::seconds(
+      expires ? std::max<int64_t>(*expires - date, 0) : 0);
+}
+
+// How long the response was kept by caches on the way
+auto age(const Response &response) -> std::chrono::seconds {
+  return std::chrono::seconds(
+      std::max<int64_t>(parse_seconds(response.headers.find("Age")).value_or(0),
+                        0));
+}
+
+auto request_header(const Request &request, const Headers &default_headers,
+                    std::string_view name) -> std::optional<std::string_view> {
+  if (auto value = detail::find_header(request.headers, name)) {
+    return value;
+  }
+  return detail::find_header(default_headers, name);
+}
+
+// Without its query, and the trailing slash
+auto resource_path(std::string_view path) -> std::string_view {
+  path = path.substr(0, path.find_first_of("?#"));
+  if (path.size() > 1 && path.back() == '/') {
+    path.remove_suffix(1);
+  }
+  return path;
+}
+
+bool is_below(std::string_view path, std::string_view ancestor) {
+  return path.starts_with(ancestor) &&
+         (ancestor.ends_with('/') || path[ancestor.size()] == '/');
+}
+
+} // namespace
+
+namespace http {
+
+auto ResponseCache::lookup(const std::string &origin, const Request &request,
+                           const Headers &default_headers)
+    -> std::optional<Lookup> {
+  const auto cache_control =
+      request_header(request, default_headers, "Cache-Control");
+  if (request.method != RequestMethod::GET ||
+      find_directive(cache_control, "no-store")) {
+    return std::nullopt;
+  }
+
+  std::lock_guard lock(mutex_);
+  auto it = entries_.find(key(origin, request.path));
+  if (it == entries_.end()) {
+    return std::nullopt;
+  }
+  auto &entry = it->second;
+
+  for (const auto &[name, value] : entry.varying) {
+    if (request_header(request, default_headers, name) != value) {
+      return std::nullopt;
+    }
+  }
+  uses_.splice(uses_.begin(), uses_, entry.use);
+
+  Lookup result{.response = entry.response,
+                .fresh = entry.expiry > Clock::now() &&
+                         !find_directive(cache_control, "no-cache")};
+  if (auto etag = entry.response.headers.find("ETag")) {
+    result.validators.emplace("If-None-Match", *etag);
+  }
+  if (auto last_modified = entry.response.headers.find("Last-Modified")) {
+    result.validators.emplace("If-Modified-Since", *last_modified);
+  }
+  return result;
+}
+
+void ResponseCache::store(const std::string &origin, const Request &request,
+                          const Headers &default_headers,
+                          const Response &response) {
+  if (request.method != RequestMethod::GET) {
+    return;
+  }
+
+  const auto vary = response.headers.find("Vary");
+  const auto lifetime = freshness_lifetime(response);
+  const bool storable =
+      response.status_code == 200 &&
+      response.body.size() <= config_.max_body_size &&
+      !find_directive(response.headers.find("Cache-Control"), "no-store") &&
+      !find_directive(request_header(request, default_headers, "Cache-Control"),
+                      "no-store") &&
+      !find_directive(vary, "*") &&
+      ((lifetime && lifetime->count() > 0) ||
+       response.headers.contains("ETag") ||
+       response.headers.contains("Last-Modified"));
+
+  std::lock_guard lock(mutex_);
+  const auto entry_key = key(origin, request.path);
+  auto it = entries_.find(entry_key);
+  if (!storable) {
+    if (it != entries_.end()) {
+      erase(it);
+    }
+    return;
+  }
+
+  // The response is only valid for the same credentials, and the same values
+  // of the headers listed by Vary
+  std::vector<VaryingHeader> varying;
+  auto add_varying = [&](std::string_view name) {
+    auto value = request_header(request, default_headers, name);
+    varying.emplace_back(std::string(name),
+                         value ? std::optional<std::string>(*value)
+                               : std::nullopt);
+  };
+  add_varying("Authorization");
+  add_varying("Cookie");
+  for (std::string_view names = vary.value_or(""); !names.empty();) {
+    const auto comma = names.find(',');
+    auto name = names.substr(0, comma);
+    names = comma == std::string_view::npos ? std::string_view{}
+                                            : names.substr(comma + 1);
+    const auto first = name.find_first_not_of(" \t");
+    if (first != std::string_view::npos) {
+      add_varying(
+          name.substr(first, name.find_last_not_of(" \t") + 1 - first));
+    }
+  }
+
+  const auto expiry =
+      Clock::now() + lifetime.value_or(std::chrono::seconds(0)) - age(response);
+
+  if (it == entries_.end()) {
+    uses_.push_front(entry_key);
+    it = entries_.emplace(entry_key, Entry{.use = uses_.begin()}).first;
+  } else {
+    uses_.splice(uses_.begin(), uses_, it->second.use);
+  }
+  it->second.response = response;
+  it->second.varying = std::move(varying);
+  it->second.expiry = expiry;
+
+  while (entries_.size() > std::max<size_t>(config_.max_entries, 1)) {
+    erase(entries_.find(uses_.back()));
+  }
+}
+
+auto ResponseCache::revalidate(const std::string &origin,
+                               const Request &request,
+                               const Response &not_modified)
+    -> std::optional<Response> {
+  std::lock_guard lock(mutex_);
+  auto it = entries_.find(key(origin, request.path));
+  if (it == entries_.end()) {
+    return std::nullopt;
+  }
+  auto &entry = it->second;
+
+  // The freshness given by the 304, or else by the stored response
+  auto lifetime = freshness_lifetime(not_modified);
+  if (!lifetime) {
+    lifetime = freshness_lifetime(entry.response);
+  }
+  entry.expiry = Clock::now() + lifetime.value_or(std::chrono::seconds(0)) -
+                 age(not_modified);
+  return entry.response;
+}
+
+void ResponseCache::invalidate(const std::string &origin,
+                               std::string_view path) {
+  const auto changed = resource_path(path);
+
+  std::lock_guard lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    const std::string_view entry_key = it->first;
+    if (!entry_key.starts_with(origin) ||
+        !entry_key.substr(origin.size()).starts_with('/')) {
+      ++it;
+      continue;
+    }
+
+    const auto cached = resource_path(entry_key.substr(origin.size()));
+    if (cached == changed || is_below(changed, cached) ||
+        is_below(cached, changed)) {
+      it = erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void ResponseCache::clear() {
+  std::lock_guard lock(mutex_);
+  entries_.clear();
+  uses_.clear();
+}
+
+auto ResponseCache::erase(std::unordered_map<std::string, Entry>::iterator it)
+    -> std::unordered_map<std::string, Entry>::iterator {
+  uses_.erase(it->second.use);
+  return entries_.erase(it);
+}
+
+} // namespace http
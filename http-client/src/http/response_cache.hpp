@@ -0,0 +1,90 @@
+#pragma once
+
+#include "constants.hpp"
+#include "message.hpp"
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace http {
+
+struct ResponseCacheConfig {
+  size_t max_entries{constants::DEFAULT_CACHE_MAX_ENTRIES};
+  size_t max_body_size{constants::DEFAULT_CACHE_MAX_BODY_SIZE};
+};
+
+// A private cache of the responses to GET requests, keyed by origin and path.
+// A response is reused as is while fresh (Cache-Control max-age, Expires),
+// then revalidated with a conditional request if it has a validator (ETag,
+// Last-Modified). It only matches the requests with the same credentials
+// (Authorization, Cookie) and the same values of the headers it varies on.
+class ResponseCache {
+public:
+  // A stored response matching a request
+  struct Lookup {
+    Response response;
+    // Whether it can be reused without asking the server
+    bool fresh{};
+    // The conditional headers to revalidate it with
+    Headers validators{};
+  };
+
+  explicit ResponseCache(ResponseCacheConfig config = {}) : config_(config) {}
+
+  ResponseCache(const ResponseCache &) = delete;
+  ResponseCache &operator=(const ResponseCache &) = delete;
+
+  auto lookup(const std::string &origin, const Request &request,
+              const Headers &default_headers) -> std::optional<Lookup>;
+
+  // Keep the response to a GET request if it can be reused, and drop the one
+  // it replaces otherwise
+  void store(const std::string &origin, const Request &request,
+             const Headers &default_headers, const Response &response);
+
+  // Refresh the stored response with the 304 that validated it, returned
+  // along with it. std::nullopt if it was dropped meanwhile.
+  auto revalidate(const std::string &origin, const Request &request,
+                  const Response &not_modified) -> std::optional<Response>;
+
+  // Drop the responses for the path, the collections above it and the
+  // resources below it, after a request that may have changed it
+  void invalidate(const std::string &origin, std::string_view path);
+
+  void clear();
+
+private:
+  using Clock = std::chrono::steady_clock;
+  // The value of a request header the response depends on, if any
+  using VaryingHeader = std::pair<std::string, std::optional<std::string>>;
+
+  struct Entry {
+    Response response;
+    std::vector<VaryingHeader> varying;
+    Clock::time_point expiry;
+    // The position in the recently used list
+    std::list<std::string>::iterator use;
+  };
+
+  static auto key(const std::string &origin, std::string_view path)
+      -> std::string {
+    return origin + std::string(path.substr(0, path.find('#')));
+  }
+
+  auto erase(std::unordered_map<std::string, Entry>::iterator it)
+      -> std::unordered_map<std::string, Entry>::iterator;
+
+  ResponseCacheConfig config_;
+  std::mutex mutex_{};
+  std::unordered_map<std::string, Entry> entries_{};
+  // The keys, the most recently used first
+  std::list<std::string> uses_{};
+};
+
+} // namespace http
@@ -0,0 +1,412 @@
+#include "response_parser.hpp"
+
+#include "constants.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+namespace http {
+
+ResponseParser::ResponseParser(std::string buffer, bool head, BodySink sink,
+                               bool decode, Arena arena)
+    : head_(head), sink_(std::move(sink)), decode_(decode),
+      buffer_(std::move(buffer)), scratch_(std::move(arena.scratch)),
+      chunks_(std::move(arena.chunks)) {
+  scratch_.clear();
+  chunks_.clear();
+  received_ = buffer_.size();
+  parse();
+  check_decoded();
+}
+
+auto ResponseParser::prepare() -> std::span<std::byte> {
+  // A body of known length, or the data of a chunk, is received in place,
+  // unless it is passed on or decoded
+  if (state_ == State::Body ||
+      (state_ == State::ChunkData && chunks_.empty())) {
+    if (sink_ || decoder_) {
+      target_ = Target::Scratch;
+      scratch_.resize(std::min(body_remaining_, constants::STREAM_BUFFER_SIZE));
+      return std::as_writable_bytes(std::span(scratch_));
+    }
+
+    target_ = Target::Body;
+    if (chunked_) {
+      received_ = body_.size();
+      const auto data = extend(
+          body_, received_,
+          std::min(body_remaining_, constants::STREAM_BUFFER_SIZE));
+      return data.first(std::min(data.size(), body_remaining_));
+    }
+    return std::as_writable_bytes(
+        std::span(body_).subspan(body_.size() - body_remaining_));
+  }
+
+  auto &buffer = state_ == State::StatusLine || state_ == State::Headers
+                     ? buffer_
+                     : chunks_;
+  target_ = &buffer == &buffer_ ? Target::Header : Target::Chunks;
+  received_ = buffer.size();
+  return extend(buffer, received_, constants::READ_BUFFER_SIZE);
+}
+
+auto ResponseParser::extend(std::string &buffer, size_t offset, size_t length)
+    -> std::span<std::byte> {
+  if (buffer.capacity() - offset < length) {
+    buffer.reserve(std::max(offset + length, buffer.capacity() * 2));
+  }
+  buffer.resize(buffer.capacity());
+  return std::as_writable_bytes(std::span(buffer).subspan(offset));
+}
+
+auto ResponseParser::commit(size_t length) -> State {
+  switch (target_) {
+  case Target::Header:
+    buffer_.resize(received_ + length);
+    received_ = buffer_.size();
+    parse();
+    break;
+  case Target::Chunks:
+    chunks_.resize(received_ + length);
+    parse_chunks();
+    break;
+  case Target::Body:
+  case Target::Scratch:
+    if (target_ == Target::Scratch) {
+      if (!consume_body(std::string_view(scratch_).substr(0, length))) {
+        break;
+      }
+    } else if (chunked_) {
+      body_.resize(received_ + length);
+    }
+    body_remaining_ -= length;
+    if (body_remaining_ == 0) {
+      state_ = chunked_ ? State::ChunkEnd : State::Complete;
+    }
+    break;
+  }
+  check_decoded();
+  return state_;
+}
+
+size_t ResponseParser::passthrough_length() const {
+  if (!sink_ || decoder_) {
+    return 0;
+  }
+  if (state_ == State::Body ||
+      (state_ == State::ChunkData && chunks_.empty())) {
+    return body_remaining_;
+  }
+  return 0;
+}
+
+auto ResponseParser::skip(size_t length) -> State {
+  body_remaining_ -= length;
+  if (body_remaining_ == 0) {
+    state_ = chunked_ ? State::ChunkEnd : State::Complete;
+  }
+  return state_;
+}
+
+void ResponseParser::parse() {
+  while (state_ == State::StatusLine || state_ == State::Headers) {
+    const auto line_end = std::string_view(buffer_).find("\r\n", searched_);
+    if (line_end == std::string_view::npos) {
+      // The CR of the line end may be the last byte
+      searched_ = std::max(parsed_, buffer_.size() - !buffer_.empty());
+      if (buffer_.size() > constants::MAX_HEADER_SIZE) {
+        state_ = State::Invalid;
+      }
+      return;
+    }
+
+    bool valid = state_ == State::StatusLine ? parse_status_line(line_end)
+                                             : parse_header_line(line_end);
+    if (!valid) {
+      state_ = State::Invalid;
+      return;
+    }
+    parsed_ = searched_ = line_end + 2;
+  }
+}
+
+// HTTP/1.x SP status-code [SP reason-phrase]
+bool ResponseParser::parse_status_line(size_t line_end) {
+  const auto line = std::string_view(buffer_).substr(0, line_end);
+  constexpr size_t version_length = 8;
+  constexpr size_t status_code_end = version_length + 4;
+
+  if (line.size() < status_code_end || !line.starts_with("HTTP/1.") ||
+      (line[7] != '0' && line[7] != '1') || line[version_length] != ' ') {
+    return false;
+  }
+
+  int status_code = 0;
+  for (size_t i = version_length + 1; i < status_code_end; ++i) {
+    if (!std::isdigit(static_cast<unsigned char>(line[i]))) {
+      return false;
+    }
+    status_code = status_code * 10 + (line[i] - '0');
+  }
+
+  if (line.size() > status_code_end) {
+    if (line[status_code_end] != ' ') {
+      return false;
+    }
+    status_message_ = status_code_end + 1;
+    status_message_length_ = line.size() - status_message_;
+  }
+
+  version_length_ = version_length;
+  status_code_ = status_code;
+  state_ = State::Headers;
+  return true;
+}
+
+// field-name ":" OWS field-value OWS, or the empty line ending the header
+bool ResponseParser::parse_header_line(size_t line_end) {
+  if (line_end == parsed_) {
+    complete_header(line_end + 2);
+    return true;
+  }
+
+  const auto line =
+      std::string_view(buffer_).substr(parsed_, line_end - parsed_);
+  const auto colon = line.find(':');
+  if (colon == std::string_view::npos || colon == 0) {
+    return false;
+  }
+
+  const auto name = line.substr(0, colon);
+  if (!std::ranges::all_of(name, [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '-';
+      })) {
+    return false;
+  }
+
+  const auto value_begin = line.find_first_not_of(" \t", colon + 1);
+  const size_t value =
+      value_begin == std::string_view::npos ? line.size() : value_begin;
+  const size_t value_length =
+      value_begin == std::string_view::npos
+          ? 0
+          : line.find_last_not_of(" \t") + 1 - value_begin;
+
+  if (utils::iequals(name, "Content-Length")) {
+    const auto length = line.substr(value, value_length);
+    auto [ptr, ec] = std::from_chars(length.data(),
+                                     length.data() + length.size(),
+                                     content_length_);
+    if (ec != std::errc{} || ptr != length.data() + length.size()) {
+      return false;
+    }
+    delimited_ = true;
+  } else if (utils::iequals(name, "Transfer-Encoding")) {
+    // The codings are listed in the order they were applied
+    const auto codings = line.substr(value, value_length);
+    auto last = codings.substr(codings.find_last_of(',') + 1);
+    last.remove_prefix(std::min(last.find_first_not_of(" \t"), last.size()));
+    transfer_encoded_ = true;
+    chunked_ = utils::iequals(last, "chunked");
+  } else if (utils::iequals(name, "Content-Encoding")) {
+    content_coding_ =
+        detail::parse_content_coding(line.substr(value, value_length));
+  }
+
+  fields_.push_back({.name = static_cast<uint32_t>(parsed_),
+                     .name_length = static_cast<uint32_t>(colon),
+                     .value = static_cast<uint32_t>(parsed_ + value),
+                     .value_length = static_cast<uint32_t>(value_length)});
+  return true;
+}
+
+void ResponseParser::complete_header(size_t header_end) {
+  // The responses that never have a body, whatever their header says
+  if (head_ || (status_code_ >= 100 && status_code_ < 200) ||
+      status_code_ == 204 || status_code_ == 304) {
+    content_length_ = 0;
+    chunked_ = false;
+    delimited_ = true;
+  } else if (transfer_encoded_) {
+    // The length is then given by the chunks, or by the server closing the
+    // connection
+    content_length_ = 0;
+    delimited_ = chunked_;
+  }
+
+  if (decode_ && (chunked_ || content_length_ > 0) &&
+      (content_coding_ == detail::ContentCoding::Gzip ||
+       content_coding_ == detail::ContentCoding::Deflate)) {
+    decoder_ = std::make_unique<detail::ContentDecoder>(content_coding_);
+  }
+
+  const auto rest = std::string_view(buffer_).substr(header_end);
+
+  if (chunked_) {
+    chunks_.assign(rest);
+    buffer_.resize(header_end);
+    state_ = State::ChunkSize;
+    parse_chunks();
+    return;
+  }
+
+  // The start of the body came along with the header, the rest is received
+  // directly in the body
+  const auto body_start = rest.substr(0, content_length_);
+  body_remaining_ = content_length_ - body_start.size();
+  if (sink_ || decoder_) {
+    // A decoded body is at least as large
+    if (!sink_) {
+      body_.reserve(content_length_);
+    }
+    if (!body_start.empty() && !consume_body(body_start)) {
+      return;
+    }
+  } else {
+    body_.resize(content_length_);
+    std::memcpy(body_.data(), body_start.data(), body_start.size());
+  }
+
+  leftover_.assign(rest.substr(body_start.size()));
+  buffer_.resize(header_end);
+
+  state_ = body_remaining_ == 0 ? State::Complete : State::Body;
+}
+
+bool ResponseParser::consume_body(std::string_view data) {
+  if (decoder_) {
+    if (!decoder_->decode(data, sink_ ? decoded_ : body_)) {
+      state_ = State::Invalid;
+      return false;
+    }
+    if (sink_ && !decoded_.empty()) {
+      sink_(decoded_);
+      decoded_.clear();
+    }
+  } else if (sink_) {
+    sink_(data);
+  } else {
+    body_.append(data);
+  }
+  return true;
+}
+
+void ResponseParser::check_decoded() {
+  if (state_ == State::Complete && decoder_ && !decoder_->finished()) {
+    state_ = State::Invalid;
+  }
+}
+
+// chunk-size [extensions] CRLF chunk-data CRLF ... 0 CRLF [trailers] CRLF
+void ResponseParser::parse_chunks() {
+  const auto data = std::string_view(chunks_);
+  size_t pos = 0;
+  bool progress = true;
+
+  while (progress) {
+    progress = false;
+
+    switch (state_) {
+    case State::ChunkSize: {
+      const auto line_end = data.find("\r\n", pos);
+      if (line_end == std::string_view::npos) {
+        if (data.size() - pos > constants::MAX_CHUNK_LINE_SIZE) {
+          state_ = State::Invalid;
+        }
+        break;
+      }
+      auto size = data.substr(pos, line_end - pos);
+      size = size.substr(0, size.find_first_of("; \t"));
+      size_t chunk_size{};
+      auto [ptr, ec] = std::from_chars(size.data(), size.data() + size.size(),
+                                       chunk_size, 16);
+      if (size.empty() || ec != std::errc{} ||
+          ptr != size.data() + size.size()) {
+        state_ = State::Invalid;
+        break;
+      }
+      pos = line_end + 2;
+      body_remaining_ = chunk_size;
+      state_ = chunk_size == 0 ? State::Trailers : State::ChunkData;
+      progress = true;
+      break;
+    }
+    case State::ChunkData: {
+      const auto piece = data.substr(pos, body_remaining_);
+      if (piece.empty()) {
+        break;
+      }
+      if (!consume_body(piece)) {
+        break;
+      }
+      pos += piece.size();
+      body_remaining_ -= piece.size();
+      if (body_remaining_ == 0) {
+        state_ = State::ChunkEnd;
+        progress = true;
+      }
+      break;
+    }
+    case State::ChunkEnd:
+      if (data.size() - pos < 2) {
+        break;
+      }
+      if (data.substr(pos, 2) != "\r\n") {
+        state_ = State::Invalid;
+        break;
+      }
+      pos += 2;
+      state_ = State::ChunkSize;
+      progress = true;
+      break;
+    case State::Trailers: {
+      // The trailer fields are skipped
+      const auto line_end = data.find("\r\n", pos);
+      if (line_end == std::string_view::npos) {
+        if (data.size() - pos > constants::MAX_HEADER_SIZE) {
+          state_ = State::Invalid;
+        }
+        break;
+      }
+      const bool last_line = line_end == pos;
+      pos = line_end + 2;
+      if (last_line) {
+        leftover_.assign(data.substr(pos));
+        pos = data.size();
+        state_ = State::Complete;
+      }
+      progress = !last_line;
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  chunks_.erase(0, pos);
+}
+
+auto ResponseParser::take_arena() -> Arena {
+  Arena arena{.chunks = std::move(chunks_), .scratch = std::move(scratch_)};
+  arena.chunks.clear();
+  arena.scratch.clear();
+  return arena;
+}
+
+Response ResponseParser::take_response() {
+  Response response;
+  const auto section = std::string_view(buffer_);
+
+  response.version = section.substr(0, version_length_);
+  response.status_code = status_code_;
+  response.status_message =
+      section.substr(status_message_, status_message_length_);
+  response.body = std::move(body_);
+  response.headers = HeaderMap(std::move(buffer_), std::move(fields_));
+  return response;
+}
+
+} // namespace http
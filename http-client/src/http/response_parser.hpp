@@ -0,0 +1,136 @@
+#pragma once
+
+#include "content_coding.hpp"
+#include "message.hpp"
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace http {
+
+// Parses a response in a single pass as its bytes are received, resuming
+// where it stopped. The header section is received in a buffer and its
+// fields kept as slices of it, then a body of known length is received
+// directly in the string of the response, and a chunked one decoded as it
+// arrives. Given a sink, the body is passed to it in pieces instead. A gzip or
+// deflate body can be decoded on the way. The bytes are received in the spare
+// capacity of the buffers, which grow geometrically.
+class ResponseParser {
+public:
+  // The working buffers of a parser, which can be given to the next one so
+  // that their memory is reused from one response to the next
+  struct Arena {
+    std::string chunks;
+    std::string scratch;
+  };
+
+  enum class State {
+    StatusLine,
+    Headers,
+    Body,
+    ChunkSize,
+    ChunkData,
+    ChunkEnd,
+    Trailers,
+    Complete,
+    Invalid
+  };
+
+  // buffer: the bytes received past the previous response on the connection
+  // head: whether the response is to a HEAD request, and so has no body
+  // sink: receives the body instead of the response
+  // decode: whether to decode the body given its Content-Encoding
+  // arena: the buffers of a previous parser
+  explicit ResponseParser(std::string buffer = {}, bool head = false,
+                          BodySink sink = {}, bool decode = false,
+                          Arena arena = {});
+
+  // Where to receive the next bytes, the rest of the body at most
+  auto prepare() -> std::span<std::byte>;
+  // Parse the bytes received where prepare pointed to
+  State commit(size_t length);
+
+  // How much of the body, or of the data of the current chunk, could be
+  // passed to the sink without going through prepare, being neither decoded
+  // nor buffered; 0 if none
+  size_t passthrough_length() const;
+  // Count the bytes of it passed on meanwhile
+  State skip(size_t length);
+
+  State state() const { return state_; }
+
+  // Whether the end of the response is known without the server closing the
+  // connection
+  bool delimited() const { return delimited_; }
+
+  // Once complete, the response, and the bytes received past it
+  Response take_response();
+  std::string take_leftover() { return std::move(leftover_); }
+  // The working buffers, emptied
+  Arena take_arena();
+
+private:
+  // Where prepare pointed to
+  enum class Target { Header, Body, Scratch, Chunks };
+
+  void parse();
+  bool parse_status_line(size_t line_end);
+  bool parse_header_line(size_t line_end);
+  void complete_header(size_t header_end);
+  void parse_chunks();
+  // false if the body is invalid
+  bool consume_body(std::string_view data);
+  // A response whose body was not entirely decoded is invalid
+  void check_decoded();
+  // Extends the buffer with the bytes to receive in it, at least length and
+  // as many as its capacity holds, from the offset
+  static auto extend(std::string &buffer, size_t offset, size_t length)
+      -> std::span<std::byte>;
+
+  State state_{State::StatusLine};
+  Target target_{Target::Header};
+  bool head_;
+  BodySink sink_;
+  bool decode_;
+
+  // The status line and the header section, then the bytes past them
+  std::string buffer_;
+  // The start of the next line of buffer_ to parse
+  size_t parsed_{};
+  // Where to search the end of the line from, the bytes before being part of
+  // the line
+  size_t searched_{};
+  // The length of buffer_ before the bytes being received
+  size_t received_{};
+
+  size_t version_length_{};
+  int status_code_{-1};
+  size_t status_message_{};
+  size_t status_message_length_{};
+  std::vector<HeaderMap::Field> fields_{};
+
+  size_t content_length_{};
+  // Whether the header has a Transfer-Encoding, whose last coding is chunked
+  bool transfer_encoded_{};
+  detail::ContentCoding content_coding_{detail::ContentCoding::Identity};
+  bool chunked_{};
+  bool delimited_{};
+
+  std::string body_{};
+  // The bytes of the body, or of the chunk, left to receive
+  size_t body_remaining_{};
+  // The pieces given to the sink are received there
+  std::string scratch_{};
+  // The chunked body received and not parsed yet
+  std::string chunks_{};
+  std::string leftover_{};
+  // Set once the header says that the body is to be decoded
+  std::unique_ptr<detail::ContentDecoder> decoder_{};
+  // The decoded bytes given to the sink
+  std::string decoded_{};
+};
+
+} // namespace http
@@ -0,0 +1,52 @@
+#include "retry_policy.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace http::detail {
+
+bool RetryBudget::withdraw() {
+  if (budget_ < 1) {
+    return false;
+  }
+  budget_ -= 1;
+  return true;
+}
+
+void LatencyWindow::add(std::chrono::microseconds latency) {
+  if (latencies_.size() < capacity_) {
+    latencies_.push_back(latency);
+    return;
+  }
+  latencies_[next_] = latency;
+  next_ = (next_ + 1) % capacity_;
+}
+
+auto LatencyWindow::quantile(double q, size_t min_samples) const
+    -> std::optional<std::chrono::microseconds> {
+  if (latencies_.empty() || latencies_.size() < min_samples) {
+    return std::nullopt;
+  }
+
+  auto sorted = latencies_;
+  const auto rank = static_cast<size_t>(
+      std::clamp(q, 0.0, 1.0) * static_cast<double>(sorted.size() - 1));
+  std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+  return sorted[rank];
+}
+
+auto backoff(const RetryPolicy &policy, size_t retry, std::mt19937 &rng)
+    -> std::chrono::microseconds {
+  // Doubled up to max_backoff, without overflowing for the late retries
+  const auto doublings = static_cast<int>(std::min<size_t>(retry - 1, 32));
+  const double cap = std::min(
+      std::ldexp(static_cast<double>(policy.base_backoff.count()), doublings),
+      static_cast<double>(policy.max_backoff.count()));
+
+  std::uniform_int_distribution<int64_t> jitter(
+      0, std::max<int64_t>(static_cast<int64_t>(cap), 0));
+  return std::chrono::microseconds(jitter(rng));
+}
+
+} // namespace http::detail
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "constants.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <random>
+#include <vector>
+
+namespace http {
+
+// How the requests that fail without a response are attempted again. Those
+// that may have reached the server are only retried if they are idempotent.
+struct RetryPolicy {
+  // Attempts of a request, the first one included
+  size_t max_attempts{constants::DEFAULT_MAX_ATTEMPTS};
+  // The delay before the first retry, doubled for each next one up to
+  // max_backoff, of which a random part is waited (full jitter), so that the
+  // requests that failed together are not retried together
+  std::chrono::microseconds base_backoff{constants::DEFAULT_BASE_BACKOFF};
+  std::chrono::microseconds max_backoff{constants::DEFAULT_MAX_BACKOFF};
+  // Each request adds retry_ratio to the retry budget and each retry takes
+  // one from it, so that a failing server is not flooded with retries
+  double retry_ratio{0.2};
+  // The budget at most, and to begin with
+  double max_retry_budget{10};
+};
+
+// When an idempotent GET is sent again on another connection, for the first
+// response to be kept, so that a stalled connection does not hold it up
+struct HedgingPolicy {
+  bool enabled{false};
+  // The latency quantile of the recent requests after which the request is
+  // sent again
+  double quantile{0.95};
+  // The recent latencies kept, and those needed to hedge at all
+  size_t window{256};
+  size_t min_samples{20};
+};
+
+namespace detail {
+
+class RetryBudget {
+public:
+  explicit RetryBudget(const RetryPolicy &policy = {})
+      : ratio_(policy.retry_ratio), max_(policy.max_retry_budget),
+        budget_(policy.max_retry_budget) {}
+
+  // A request is made
+  void deposit() { budget_ = std::min(budget_ + ratio_, max_); }
+  // Whether a retry is allowed, taken from the budget if so
+  bool withdraw();
+
+private:
+  double ratio_;
+  double max_;
+  double budget_;
+};
+
+// The latencies of the last requests that succeeded
+class LatencyWindow {
+public:
+  explicit LatencyWindow(size_t capacity = HedgingPolicy{}.window)
+      : capacity_(std::max<size_t>(capacity, 1)) {}
+
+  void add(std::chrono::microseconds latency);
+
+  // std::nullopt while fewer than min_samples latencies are known
+  auto quantile(double q, size_t min_samples) const
+      -> std::optional<std::chrono::microseconds>;
+
+private:
+  size_t capacity_;
+  std::vector<std::chrono::microseconds> latencies_{};
+  // Where the next latency is written, once the window is full
+  size_t next_{};
+};
+
+// The delay before the retry-th retry
+auto backoff(const RetryPolicy &policy, size_t retry, std::mt19937 &rng)
+    -> std::chrono::microseconds;
+
+} // namespace detail
+
+} // namespace http
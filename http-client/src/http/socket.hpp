@@ -1,14 +1,40 @@
 #pragma once
 
+#include "constants.hpp"
+#include <chrono>
+
+namespace http {
+
+// How the sockets of new connections are set up
+struct SocketOptions {
+  // Send small requests at once instead of holding them until the previous
+  // segment is acknowledged (Nagle's algorithm)
+  bool no_delay{true};
+  // Probe the connections left idle, so that those whose peer vanished are
+  // closed by the kernel rather than reused
+  bool keep_alive{true};
+  std::chrono::seconds keep_alive_idle{constants::DEFAULT_KEEPALIVE_IDLE};
+  // Send the start of the first request along with the SYN (TCP Fast Open),
+  // once the kernel has a cookie of the server. The network may deliver it
+  // twice, so this suits servers of idempotent requests.
+  bool fast_open{false};
+};
+
+} // namespace http
+
 namespace http::detail {
 
 static constexpr int INVALID_SOCKET{-1};
 
 using socket_t = int;
 
+class TlsStream;
+
 struct Socket {
 
   socket_t sockfd{INVALID_SOCKET};
+  // Owned along with the socket, if the connection is over TLS
+  TlsStream *tls{};
 
   bool is_open() const { return sockfd != INVALID_SOCKET; }
 };
@@ -1,27 +1,77 @@
 #include "socket_utils.hpp"
 
+#include "constants.hpp"
 #include "error.hpp"
 #include "scope_guard.hpp"
 #include "socket.hpp"
+#include "tls.hpp"
 #include "utils.hpp"
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
+#include <mutex>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <optional>
 #include <poll.h>
+#include <pthread.h>
 #include <string>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <unordered_map>
 
 namespace {
 using namespace http::detail;
 using namespace http::utils;
 
-auto get_host_addrinfo(const std::string &host, uint16_t port)
-    -> std::optional<struct addrinfo> {
+using Clock = std::chrono::steady_clock;
+
+struct CachedHost {
+  HostAddresses addresses;
+  Clock::time_point expiry;
+};
+
+std::mutex cache_mutex;
+std::unordered_map<std::string, CachedHost> cache;
+
+auto cache_key(const std::string &host, uint16_t port) -> std::string {
+  return host + ':' + std::to_string(port);
+}
+
+// Interleave the families, starting with the one of the first address, the
+// resolver having sorted them by preference
+void interleave_families(HostAddresses &addresses) {
+  if (addresses.empty()) {
+    return;
+  }
+  const int first_family = addresses.front().family;
+  HostAddresses preferred, others;
+  for (auto &address : addresses) {
+    (address.family == first_family ? preferred : others).push_back(address);
+  }
+
+  addresses.clear();
+  for (size_t i = 0; i < std::max(preferred.size(), others.size()); ++i) {
+    if (i < preferred.size()) {
+      addresses.push_back(preferred[i]);
+    }
+    if (i < others.size()) {
+      addresses.push_back(others[i]);
+    }
+  }
+}
+
+// The addresses are copied out, the addrinfo list being freed here
+auto get_host_addresses(const std::string &host, uint16_t port)
+    -> std::optional<HostAddresses> {
   struct addrinfo hints{};
   std::memset(&hints, 0, sizeof(hints));
 
@@ -35,61 +85,77 @@ auto get_host_addrinfo(const std::string &host, uint16_t port)
   if (status != 0) {
     return std::nullopt;
   }
-  auto host_addrinfo = *result;
-  freeaddrinfo(result);
-  return host_addrinfo;
-}
+  auto guard = scope_guard::make_scope_exit([&]() { freeaddrinfo(result); });
 
-template <bool NonBlocking = true> bool set_nonblocking(int sockfd) {
-  int flags = fcntl(sockfd, F_GETFL, 0);
-  if (flags == -1) {
-    return false;
+  HostAddresses addresses;
+  for (auto *info = result; info != nullptr; info = info->ai_next) {
+    if (info->ai_addrlen > sizeof(struct sockaddr_storage)) {
+      continue;
+    }
+    HostAddress address{.family = info->ai_family,
+                        .socktype = info->ai_socktype,
+                        .protocol = info->ai_protocol,
+                        .addr = {},
+                        .addrlen = info->ai_addrlen};
+    std::memcpy(&address.addr, info->ai_addr, info->ai_addrlen);
+    addresses.push_back(address);
   }
-  if (fcntl(sockfd, F_SETFL,
-            NonBlocking ? (flags | O_NONBLOCK) : (flags & (~O_NONBLOCK))) ==
-      -1) {
-    return false;
+  if (addresses.empty()) {
+    return std::nullopt;
   }
-  return true;
-}
-
-http::Error wait_until_ready_socket(socket_t sockfd, Duration auto timeout) {
-  struct pollfd pfd;
-  std::memset(&pfd, 0, sizeof(pfd));
-  pfd.fd = sockfd;
-  pfd.events = POLLOUT;
 
-  auto timeout_ms =
-      std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count();
-  int ret = poll(&pfd, 1, timeout_ms);
-
-  if (ret == 0) {
-    return http::Error::ConnectionTimeout;
-  }
+  interleave_families(addresses);
+  return addresses;
+}
 
-  if (ret > 0 && pfd.revents & POLLOUT) {
-    auto error = 0;
-    socklen_t len = sizeof(error);
-    auto res = getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
-                          reinterpret_cast<char *>(&error), &len);
-    auto successful = res >= 0 && !error;
-    return successful ? http::Error::Success : http::Error::Connection;
+// The path of the socket, if it fits in a sockaddr_un with its terminator
+auto get_unix_socket_address(const std::string &host)
+    -> std::optional<HostAddresses> {
+  const auto path =
+      std::string_view(host).substr(http::constants::UNIX_SOCKET_PREFIX.size());
+  struct sockaddr_un addr{};
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    return std::nullopt;
   }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.data(), path.size());
+
+  HostAddress address{.family = AF_UNIX,
+                      .socktype = SOCK_STREAM,
+                      .protocol = 0,
+                      .addr = {},
+                      .addrlen = static_cast<socklen_t>(
+                          offsetof(struct sockaddr_un, sun_path) +
+                          path.size() + 1)};
+  std::memcpy(&address.addr, &addr, sizeof(addr));
+  return HostAddresses{address};
+}
 
-  return http::Error::Connection;
+bool set_option(int sockfd, int level, int name, int value) {
+  return setsockopt(sockfd, level, name, &value, sizeof(value)) == 0;
 }
 
-bool set_sock_opt_time(socket_t sockfd, int level, int optname,
-                       Duration auto timeout) {
-  struct timeval tv;
-  tv.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(timeout).count();
-  tv.tv_usec =
-      std::chrono::duration_cast<std::chrono::microseconds>(timeout).count() %
-      1'000'000;
+bool set_options(int sockfd, const http::SocketOptions &options) {
+  using namespace http::constants;
 
-  if (setsockopt(sockfd, level, optname, &tv, sizeof(tv)) < 0) {
+  if (options.no_delay && !set_option(sockfd, IPPROTO_TCP, TCP_NODELAY, 1)) {
+    return false;
+  }
+  if (options.keep_alive &&
+      (!set_option(sockfd, SOL_SOCKET, SO_KEEPALIVE, 1) ||
+       !set_option(sockfd, IPPROTO_TCP, TCP_KEEPIDLE,
+                   static_cast<int>(options.keep_alive_idle.count())) ||
+       !set_option(sockfd, IPPROTO_TCP, TCP_KEEPINTVL,
+                   static_cast<int>(KEEPALIVE_INTERVAL.count())) ||
+       !set_option(sockfd, IPPROTO_TCP, TCP_KEEPCNT, KEEPALIVE_PROBES))) {
     return false;
   }
+#ifdef TCP_FASTOPEN_CONNECT
+  // Not supported by every kernel, the connection is then opened as usual
+  if (options.fast_open) {
+    set_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+  }
+#endif
   return true;
 }
 
@@ -97,6 +163,18 @@ bool set_sock_opt_time(socket_t sockfd, int level, int optname,
 
 namespace http::detail {
 
+bool is_idle_socket_usable(socket_t sockfd) {
+  struct pollfd pfd;
+  std::memset(&pfd, 0, sizeof(pfd));
+  pfd.fd = sockfd;
+  pfd.events = POLLIN | POLLRDHUP;
+
+  // Nothing should be readable between two requests: either the peer closed
+  // or shut down its side of the connection, or the data would be mistaken
+  // for the next response. Errors and resets are reported as well.
+  return poll(&pfd, 1, 0) == 0;
+}
+
 void close_socket(int sockfd) {
   if (sockfd != INVALID_SOCKET) {
     close(sockfd);
@@ -109,84 +187,149 @@ void shutdown_socket(int sockfd) {
   }
 }
 
-socket_t create_client_socket(const std::string &host, uint16_t port,
-                              std::chrono::microseconds connection_timeout,
-                              std::chrono::microseconds read_timeout,
-                              std::chrono::microseconds write_timeout,
-                              Error &error) {
-  auto host_addrinfo = get_host_addrinfo(host, port);
-  if (!host_addrinfo) {
-    error = Error::HostNotFound;
-    return INVALID_SOCKET;
+void close_socket(Socket socket) {
+  delete socket.tls;
+  close_socket(socket.sockfd);
+}
+
+void shutdown_socket(Socket socket) {
+  if (socket.tls != nullptr) {
+    socket.tls->shutdown();
+  }
+  shutdown_socket(socket.sockfd);
+}
+
+bool is_unix_socket_host(std::string_view host) {
+  return host.starts_with(constants::UNIX_SOCKET_PREFIX);
+}
+
+auto resolve_host(const std::string &host, uint16_t port)
+    -> std::optional<HostAddresses> {
+  if (is_unix_socket_host(host)) {
+    return get_unix_socket_address(host);
+  }
+  if (auto addresses = find_cached_host(host, port)) {
+    return addresses;
   }
 
-  socket_t sockfd = socket(host_addrinfo->ai_family, host_addrinfo->ai_socktype,
-                           host_addrinfo->ai_protocol);
+  // Resolved without the lock, a concurrent resolution of the same host
+  // replacing the entry with equivalent addresses
+  auto addresses = get_host_addresses(host, port);
+  if (addresses) {
+    std::lock_guard lock(cache_mutex);
+    cache[cache_key(host, port)] = {
+        *addresses, Clock::now() + constants::DNS_CACHE_TTL};
+  }
+  return addresses;
+}
+
+auto find_cached_host(const std::string &host, uint16_t port)
+    -> std::optional<HostAddresses> {
+  if (is_unix_socket_host(host)) {
+    return get_unix_socket_address(host);
+  }
+  std::lock_guard lock(cache_mutex);
+  auto it = cache.find(cache_key(host, port));
+  if (it == cache.end()) {
+    return std::nullopt;
+  }
+  if (it->second.expiry <= Clock::now()) {
+    cache.erase(it);
+    return std::nullopt;
+  }
+  return it->second.addresses;
+}
+
+void evict_cached_host(const std::string &host, uint16_t port) {
+  std::lock_guard lock(cache_mutex);
+  cache.erase(cache_key(host, port));
+}
+
+socket_t open_client_socket(const HostAddress &address,
+                            const SocketOptions &options, Error &error) {
+  socket_t sockfd =
+      socket(address.family, address.socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+             address.protocol);
   if (sockfd < 0) {
     error = Error::Connection;
     return INVALID_SOCKET;
   }
   auto guard = scope_guard::make_scope_exit([&]() { close_socket(sockfd); });
 
-  // Temporarily set the socket to non-blocking mode to be able to use the
-  // timeout during connect
-  if (!set_nonblocking(sockfd)) {
+  // The TCP options do not apply to a Unix domain socket
+  if (address.family != AF_UNIX && !set_options(sockfd, options)) {
     error = Error::Connection;
     return INVALID_SOCKET;
   }
 
-  if (connect(sockfd, host_addrinfo->ai_addr, host_addrinfo->ai_addrlen) < 0) {
+  if (connect(sockfd,
+              reinterpret_cast<const struct sockaddr *>(&address.addr),
+              address.addrlen) < 0) {
     if (errno != EINPROGRESS) {
       error = Error::Connection;
       return INVALID_SOCKET;
     }
   }
 
-  error = wait_until_ready_socket(sockfd, connection_timeout);
-  if (error != Error::Success) {
-    return INVALID_SOCKET;
-  }
+  guard.dismiss();
+  error = Error::Success;
+  return sockfd;
+}
 
-  // Restore the socket to blocking mode
-  if (!set_nonblocking<false>(sockfd)) {
-    error = Error::Connection;
-    return INVALID_SOCKET;
-  }
+Error get_connect_error(socket_t sockfd) {
+  auto error = 0;
+  socklen_t len = sizeof(error);
+  auto res = getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
+                        reinterpret_cast<char *>(&error), &len);
+  return res >= 0 && !error ? Error::Success : Error::Connection;
+}
 
-  // Set the socket options for read and write timeouts
-  if (!set_sock_opt_time(sockfd, SOL_SOCKET, SO_RCVTIMEO, read_timeout) ||
-      !set_sock_opt_time(sockfd, SOL_SOCKET, SO_SNDTIMEO, write_timeout)) {
-    error = Error::Connection;
-    return INVALID_SOCKET;
+ssize_t send(socket_t sockfd, std::span<const std::byte> data, Error &error) {
+  ssize_t ret;
+  do {
+    // A reused connection may have been closed by the server, which must not
+    // raise SIGPIPE
+    ret = ::send(sockfd, data.data(), data.size(), MSG_NOSIGNAL);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      error = Error::WriteTimeout;
+    } else {
+      error = Error::Write;
+    }
+
+    return -1;
   }
 
-  guard.dismiss();
   error = Error::Success;
-  return sockfd;
+  return ret;
 }
 
-bool send_all(socket_t sockfd, std::span<const std::byte> data, Error &error) {
-  while (data.size() > 0) {
-    ssize_t ret = write(sockfd, data.data(), data.size());
+ssize_t send(socket_t sockfd, std::span<const struct iovec> buffers,
+             Error &error) {
+  // sendmsg rather than writev, for MSG_NOSIGNAL
+  struct msghdr message{};
+  message.msg_iov = const_cast<struct iovec *>(buffers.data());
+  message.msg_iovlen = buffers.size();
 
-    if (ret < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        error = Error::WriteTimeout;
-      } else {
-        error = Error::Write;
-      }
+  ssize_t ret;
+  do {
+    ret = sendmsg(sockfd, &message, MSG_NOSIGNAL);
+  } while (ret < 0 && errno == EINTR);
 
-      return false;
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      error = Error::WriteTimeout;
+    } else {
+      error = Error::Write;
     }
 
-    data = data.subspan(ret);
+    return -1;
   }
 
   error = Error::Success;
-  return true;
+  return ret;
 }
 
 ssize_t recv(socket_t sockfd, std::span<std::byte> data, size_t nbytes,
@@ -210,4 +353,119 @@ ssize_t recv(socket_t sockfd, std::span<std::byte> data, size_t nbytes,
   return ret;
 }
 
+ssize_t send_file(socket_t sockfd, int fd, off_t &offset, size_t length,
+                  Error &error) {
+  SigpipeGuard guard;
+  ssize_t ret;
+  do {
+    ret = sendfile(sockfd, fd, &offset, length);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      error = Error::WriteTimeout;
+    } else {
+      // The socket or the file, as the next write on the socket tells
+      error = Error::Write;
+    }
+    return -1;
+  }
+  if (ret == 0 && length > 0) {
+    error = Error::File;
+    return -1;
+  }
+
+  error = Error::Success;
+  return ret;
+}
+
+ssize_t splice_to_file(socket_t sockfd, const int (&pipe)[2], int fd,
+                       size_t length, Error &error) {
+  ssize_t received;
+  do {
+    received = splice(sockfd, nullptr, pipe[1], nullptr, length,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while (received < 0 && errno == EINTR);
+
+  if (received < 0) {
+    error = errno == EAGAIN || errno == EWOULDBLOCK ? Error::ReadTimeout
+                                                    : Error::Read;
+    return -1;
+  }
+
+  for (size_t left = received; left > 0;) {
+    ssize_t moved = splice(pipe[0], nullptr, fd, nullptr, left, SPLICE_F_MOVE);
+    if (moved < 0 && errno == EINTR) {
+      continue;
+    }
+    if (moved < 0 && errno == EINVAL) {
+      // The file does not accept spliced data, e.g. as it is opened to
+      // append: copied instead
+      std::string data(left, '\0');
+      if (read(pipe[0], data.data(), left) != static_cast<ssize_t>(left) ||
+          !write_file(fd, data)) {
+        error = Error::File;
+        return -1;
+      }
+      break;
+    }
+    if (moved <= 0) {
+      error = Error::File;
+      return -1;
+    }
+    left -= moved;
+  }
+
+  error = Error::Success;
+  return received;
+}
+
+bool write_file(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+  return true;
+}
+
+bool write_file(int fd, std::string_view data, off_t offset) {
+  while (!data.empty()) {
+    ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data.remove_prefix(written);
+    offset += written;
+  }
+  return true;
+}
+
+SigpipeGuard::SigpipeGuard() {
+  sigemptyset(&sigpipe_);
+  sigaddset(&sigpipe_, SIGPIPE);
+  sigset_t pending;
+  sigpending(&pending);
+  was_pending_ = sigismember(&pending, SIGPIPE) == 1;
+  pthread_sigmask(SIG_BLOCK, &sigpipe_, &previous_);
+}
+
+SigpipeGuard::~SigpipeGuard() {
+  sigset_t pending;
+  sigpending(&pending);
+  if (!was_pending_ && sigismember(&pending, SIGPIPE) == 1) {
+    const struct timespec no_wait{};
+    sigtimedwait(&sigpipe_, nullptr, &no_wait);
+  }
+  pthread_sigmask(SIG_SETMASK, &previous_, nullptr);
+}
+
 } // namespace http::detail
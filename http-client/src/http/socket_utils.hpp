@@ -2,26 +2,115 @@
 
 #include "error.hpp"
 #include "socket.hpp"
-#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <signal.h>
 #include <span>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
 
 namespace http::detail {
 
-socket_t create_client_socket(const std::string &host, uint16_t port,
-                              std::chrono::microseconds connection_timeout,
-                              std::chrono::microseconds read_timeout,
-                              std::chrono::microseconds write_timeout,
-                              Error &error);
+// An address resolved for a host, owning its sockaddr
+struct HostAddress {
+  int family;
+  int socktype;
+  int protocol;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+// In the order to connect to them, alternating between IPv6 and IPv4 from the
+// family preferred by the resolver (RFC 8305)
+using HostAddresses = std::vector<HostAddress>;
+
+// Whether the host is the path of a Unix domain socket, UNIX_SOCKET_PREFIX
+// followed by the path
+bool is_unix_socket_host(std::string_view host);
+
+// The addresses of the host, kept in a cache for DNS_CACHE_TTL once resolved.
+// Blocks on getaddrinfo if they are not cached. That of a Unix domain socket
+// is given at once, never cached.
+auto resolve_host(const std::string &host, uint16_t port)
+    -> std::optional<HostAddresses>;
+
+// The addresses of the host if they are cached, without resolving them, or
+// that of a Unix domain socket
+auto find_cached_host(const std::string &host, uint16_t port)
+    -> std::optional<HostAddresses>;
+
+// Drop the cached addresses of the host, e.g. when none of them could be
+// connected to
+void evict_cached_host(const std::string &host, uint16_t port);
+
+// Start connecting a non-blocking socket, complete once it is writable. With
+// fast_open, it may be writable at once, the SYN leaving with the first write.
+socket_t open_client_socket(const HostAddress &address,
+                            const SocketOptions &options, Error &error);
+
+// The outcome of the connection of a socket, once it is writable
+Error get_connect_error(socket_t sockfd);
+
+// Whether an idle connection can still carry a request, i.e. the peer has
+// neither closed it nor sent anything unsolicited on it
+bool is_idle_socket_usable(socket_t sockfd);
 
 void close_socket(int sockfd);
 
 void shutdown_socket(int sockfd);
 
-bool send_all(socket_t sockfd, std::span<const std::byte> data, Error &error);
+// Along with the TLS stream of the socket, if any
+void close_socket(Socket socket);
+
+// After a close_notify, if the connection is over TLS
+void shutdown_socket(Socket socket);
+
+// The sockets are non-blocking: WriteTimeout and ReadTimeout mean that the
+// operation would block, to be retried once the socket is ready
+ssize_t send(socket_t sockfd, std::span<const std::byte> data, Error &error);
+
+// Gathers the buffers in a single write
+ssize_t send(socket_t sockfd, std::span<const struct iovec> buffers,
+             Error &error);
 
 ssize_t recv(socket_t sockfd, std::span<std::byte> data, size_t nbytes,
              Error &error);
 
+// Sends up to length bytes of the file from the offset, which is advanced
+// past them. File if the file ends before.
+ssize_t send_file(socket_t sockfd, int fd, off_t &offset, size_t length,
+                  Error &error);
+
+// Moves up to length bytes received on the socket to the file, through the
+// pipe, without copying them to user space. The pipe is empty in between.
+// ReadTimeout if nothing was received, 0 if the socket was closed.
+ssize_t splice_to_file(socket_t sockfd, const int (&pipe)[2], int fd,
+                       size_t length, Error &error);
+
+// Write all of the data at the position of the file
+bool write_file(int fd, std::string_view data);
+// Write all of the data at the offset, without moving the position
+bool write_file(int fd, std::string_view data, off_t offset);
+
+// Blocks SIGPIPE on the thread while writing to a socket without
+// MSG_NOSIGNAL, e.g. with sendfile or through OpenSSL, the signal raised by a
+// closed connection being discarded
+class SigpipeGuard {
+public:
+  SigpipeGuard();
+  ~SigpipeGuard();
+
+  SigpipeGuard(const SigpipeGuard &) = delete;
+  SigpipeGuard &operator=(const SigpipeGuard &) = delete;
+
+private:
+  sigset_t sigpipe_;
+  sigset_t previous_;
+  bool was_pending_;
+};
+
 } // namespace http::detail
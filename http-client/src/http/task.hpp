@@ -0,0 +1,125 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace http {
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+  // Resume the coroutine awaiting the task once it completes, nothing if the
+  // task was started by the event loop
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      return handle.promise().continuation;
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+
+  void rethrow_if_failed() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+
+  std::coroutine_handle<> continuation{std::noop_coroutine()};
+  std::exception_ptr exception{};
+};
+
+template <typename T> struct TaskPromise : TaskPromiseBase {
+  Task<T> get_return_object();
+  void return_value(T result) { value.emplace(std::move(result)); }
+  T result() {
+    rethrow_if_failed();
+    return std::move(*value);
+  }
+
+  std::optional<T> value{};
+};
+
+template <> struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() { rethrow_if_failed(); }
+};
+
+} // namespace detail
+
+// A coroutine that starts once it is awaited, or started by the event loop,
+// and resumes its awaiter with its result when it completes
+template <typename T> class Task {
+public:
+  using promise_type = detail::TaskPromise<T>;
+
+  explicit Task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  ~Task() { destroy(); }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+      T await_resume() { return handle.promise().result(); }
+
+      std::coroutine_handle<promise_type> handle;
+    };
+    return Awaiter{handle_};
+  }
+
+  void start() { handle_.resume(); }
+  bool done() const { return handle_.done(); }
+  // The result of a completed task, rethrowing what escaped it
+  T result() { return handle_.promise().result(); }
+
+private:
+  void destroy() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T> Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>{std::coroutine_handle<TaskPromise<T>>::from_promise(*this)};
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>{
+      std::coroutine_handle<TaskPromise<void>>::from_promise(*this)};
+}
+
+} // namespace detail
+
+} // namespace http
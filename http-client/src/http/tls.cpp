@@ -0,0 +1,284 @@
+#include "tls.hpp"
+
+#include "socket_utils.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <stdexcept>
+#include <string_view>
+
+namespace {
+
+std::string last_error(std::string_view operation) {
+  std::string message(operation);
+  if (const auto code = ERR_get_error(); code != 0) {
+    message += ": ";
+    message += ERR_reason_error_string(code) ? ERR_reason_error_string(code)
+                                             : "unknown error";
+  }
+  ERR_clear_error();
+  return message;
+}
+
+// Whether the host is an IPv4 or IPv6 address rather than a name, which is
+// not sent as the server name (RFC 6066)
+bool is_ip_address(const std::string &host) {
+  unsigned char address[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, host.c_str(), address) == 1 ||
+         inet_pton(AF_INET6, host.c_str(), address) == 1;
+}
+
+} // namespace
+
+namespace http {
+
+using namespace detail;
+
+TlsContext::TlsContext(TlsConfig config)
+    : config_(std::move(config)), ctx_(SSL_CTX_new(TLS_client_method())) {
+  if (ctx_ == nullptr) {
+    throw std::runtime_error(last_error("SSL_CTX_new"));
+  }
+
+  SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+  // A write may complete part of the data, and be retried from another
+  // buffer holding the same bytes
+  SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                             SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // The end of a response delimited by the connection closing is its end,
+  // whether the server sent a close_notify or not
+  SSL_CTX_set_options(ctx_, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (config_.kernel_offload) {
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+  }
+#endif
+
+  if (config_.verify_peer) {
+    const int loaded =
+        config_.ca_file.empty()
+            ? SSL_CTX_set_default_verify_paths(ctx_)
+            : SSL_CTX_load_verify_locations(ctx_, config_.ca_file.c_str(),
+                                            nullptr);
+    if (loaded != 1) {
+      const auto message = last_error("Loading the trusted CAs");
+      SSL_CTX_free(ctx_);
+      throw std::runtime_error(message);
+    }
+    SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
+  }
+
+  // The sessions are kept per origin rather than in the cache of OpenSSL,
+  // which is keyed by session ID. Those of TLS 1.3 arrive after the
+  // handshake, in the tickets read along with the response.
+  SSL_CTX_set_app_data(ctx_, this);
+  SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT |
+                                           SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx_, [](SSL *ssl, SSL_SESSION *session) {
+    auto *context = static_cast<TlsContext *>(
+        SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    const auto *origin =
+        static_cast<const std::string *>(SSL_get_app_data(ssl));
+    context->store_session(*origin, session);
+    return 1;
+  });
+}
+
+TlsContext::~TlsContext() {
+  clear_sessions();
+  SSL_CTX_free(ctx_);
+}
+
+auto TlsContext::shared() -> std::shared_ptr<TlsContext> {
+  static auto context = std::make_shared<TlsContext>();
+  return context;
+}
+
+void TlsContext::clear_sessions() {
+  std::lock_guard lock(mutex_);
+  for (auto &[origin, session] : sessions_) {
+    SSL_SESSION_free(session);
+  }
+  sessions_.clear();
+}
+
+void TlsContext::store_session(const std::string &origin,
+                               SSL_SESSION *session) {
+  std::lock_guard lock(mutex_);
+  auto &stored = sessions_[origin];
+  if (stored != nullptr) {
+    SSL_SESSION_free(stored);
+  }
+  stored = session;
+}
+
+SSL_SESSION *TlsContext::find_session(const std::string &origin) {
+  std::lock_guard lock(mutex_);
+  auto it = sessions_.find(origin);
+  if (it == sessions_.end() || SSL_SESSION_is_resumable(it->second) != 1) {
+    return nullptr;
+  }
+  SSL_SESSION_up_ref(it->second);
+  return it->second;
+}
+
+} // namespace http
+
+namespace http::detail {
+
+TlsStream::TlsStream(std::shared_ptr<TlsContext> context, socket_t sockfd,
+                     const std::string &host, uint16_t port, bool http2)
+    : context_(std::move(context)),
+      origin_(host + ':' + std::to_string(port)), sockfd_(sockfd),
+      ssl_(SSL_new(context_->ctx_)) {
+  const bool ip_address = is_ip_address(host);
+  bool configured = ssl_ != nullptr && SSL_set_fd(ssl_, sockfd) == 1 &&
+                    SSL_set_app_data(ssl_, &origin_) == 1;
+  if (configured && !ip_address) {
+    configured = SSL_set_tlsext_host_name(ssl_, host.c_str()) == 1;
+  }
+  if (configured && context_->config().verify_peer) {
+    configured = ip_address ? X509_VERIFY_PARAM_set1_ip_asc(
+                                  SSL_get0_param(ssl_), host.c_str()) == 1
+                            : SSL_set1_host(ssl_, host.c_str()) == 1;
+  }
+  if (configured && http2) {
+    // Length-prefixed protocol names, in order of preference
+    static constexpr unsigned char protocols[] = "\x02h2\x08http/1.1";
+    configured =
+        SSL_set_alpn_protos(ssl_, protocols, sizeof protocols - 1) == 0;
+  }
+  if (configured) {
+    if (auto *session = context_->find_session(origin_)) {
+      SSL_set_session(ssl_, session);
+      SSL_SESSION_free(session);
+    }
+    SSL_set_connect_state(ssl_);
+  }
+  failed_ = !configured;
+  ERR_clear_error();
+}
+
+TlsStream::~TlsStream() {
+  // OpenSSL drops the session of a connection freed before being shut down,
+  // which only matters if it failed
+  if (ssl_ != nullptr && !failed_) {
+    SSL_set_shutdown(ssl_, SSL_get_shutdown(ssl_) | SSL_SENT_SHUTDOWN);
+  }
+  SSL_free(ssl_);
+}
+
+bool TlsStream::http2() const {
+  const unsigned char *protocol = nullptr;
+  unsigned int length = 0;
+  SSL_get0_alpn_selected(ssl_, &protocol, &length);
+  return std::string_view(reinterpret_cast<const char *>(protocol), length) ==
+         "h2";
+}
+
+Error TlsStream::operation_error(int ssl_error, Error fatal) {
+  switch (ssl_error) {
+  case SSL_ERROR_WANT_READ:
+    return Error::ReadTimeout;
+  case SSL_ERROR_WANT_WRITE:
+    return Error::WriteTimeout;
+  default:
+    failed_ = true;
+    ERR_clear_error();
+    return fatal;
+  }
+}
+
+bool TlsStream::handshake(Error &error) {
+  if (failed_) {
+    error = Error::Tls;
+    return false;
+  }
+
+  ERR_clear_error();
+  // OpenSSL writes to the socket without MSG_NOSIGNAL
+  SigpipeGuard guard;
+  const int result = SSL_do_handshake(ssl_);
+  if (result != 1) {
+    error = operation_error(SSL_get_error(ssl_, result), Error::Tls);
+    return false;
+  }
+
+#ifndef OPENSSL_NO_KTLS
+  kernel_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+#endif
+  error = Error::Success;
+  return true;
+}
+
+ssize_t TlsStream::read(std::span<std::byte> data, Error &error) {
+  ERR_clear_error();
+  // A key update is answered while reading
+  SigpipeGuard guard;
+  size_t bytes = 0;
+  const int result = SSL_read_ex(ssl_, data.data(), data.size(), &bytes);
+  if (result == 1) {
+    error = Error::Success;
+    return static_cast<ssize_t>(bytes);
+  }
+
+  const int ssl_error = SSL_get_error(ssl_, result);
+  if (ssl_error == SSL_ERROR_ZERO_RETURN) {
+    // Closed by the peer
+    error = Error::Success;
+    return 0;
+  }
+  error = operation_error(ssl_error, Error::Read);
+  return -1;
+}
+
+ssize_t TlsStream::write(std::span<const struct iovec> buffers, Error &error) {
+  if (kernel_send_) {
+    // Sent as application data records, encrypted without copies to user
+    // space
+    return send(sockfd_, buffers, error);
+  }
+  if (buffers.empty()) {
+    error = Error::Success;
+    return 0;
+  }
+
+  // A record per buffer would send the head of a request apart from its body
+  std::string_view data(static_cast<const char *>(buffers[0].iov_base),
+                        buffers[0].iov_len);
+  if (buffers.size() > 1 && data.size() < SSL3_RT_MAX_PLAIN_LENGTH) {
+    record_.clear();
+    for (const auto &buffer : buffers) {
+      const size_t length = std::min(
+          buffer.iov_len, SSL3_RT_MAX_PLAIN_LENGTH - record_.size());
+      record_.append(static_cast<const char *>(buffer.iov_base), length);
+      if (record_.size() == SSL3_RT_MAX_PLAIN_LENGTH) {
+        break;
+      }
+    }
+    data = record_;
+  }
+
+  ERR_clear_error();
+  SigpipeGuard guard;
+  size_t written = 0;
+  const int result = SSL_write_ex(ssl_, data.data(), data.size(), &written);
+  if (result == 1) {
+    error = Error::Success;
+    return static_cast<ssize_t>(written);
+  }
+  error = operation_error(SSL_get_error(ssl_, result), Error::Write);
+  return -1;
+}
+
+void TlsStream::shutdown() {
+  if (!failed_ && SSL_is_init_finished(ssl_)) {
+    ERR_clear_error();
+    SigpipeGuard guard;
+    SSL_shutdown(ssl_);
+    ERR_clear_error();
+  }
+}
+
+} // namespace http::detail
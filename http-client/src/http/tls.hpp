@@ -0,0 +1,115 @@
+#pragma once
+
+#include "error.hpp"
+#include "socket.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <openssl/ssl.h>
+#include <span>
+#include <string>
+#include <sys/uio.h>
+#include <unordered_map>
+
+namespace http {
+
+struct TlsConfig {
+  // Whether the certificate of the server is checked against the trusted CAs
+  // and the name of the host
+  bool verify_peer{true};
+  // The trusted CAs, those of the system if empty
+  std::string ca_file{};
+  // Whether the records are encrypted by the kernel once the handshake is
+  // done (kTLS), when both it and the negotiated cipher support it
+  bool kernel_offload{false};
+};
+
+// The TLS settings of the clients, along with the last session of each
+// server, which new connections to it resume instead of a full handshake
+class TlsContext {
+public:
+  // Throws std::runtime_error if the CAs cannot be loaded
+  explicit TlsContext(TlsConfig config = {});
+  ~TlsContext();
+
+  TlsContext(const TlsContext &) = delete;
+  TlsContext &operator=(const TlsContext &) = delete;
+
+  // The context used by the clients that are not given one
+  static auto shared() -> std::shared_ptr<TlsContext>;
+
+  const TlsConfig &config() const { return config_; }
+
+  // Drop the sessions, so that the next connections do a full handshake
+  void clear_sessions();
+
+private:
+  friend class detail::TlsStream;
+
+  // The session becomes the one of the origin, owned by the context
+  void store_session(const std::string &origin, SSL_SESSION *session);
+  // A reference to the session of the origin, nullptr if there is none
+  SSL_SESSION *find_session(const std::string &origin);
+
+  TlsConfig config_;
+  SSL_CTX *ctx_;
+  std::mutex mutex_{};
+  std::unordered_map<std::string, SSL_SESSION *> sessions_{};
+};
+
+namespace detail {
+
+// The TLS connection over a connected socket, owned by its Socket. Like the
+// socket, it never blocks: WriteTimeout and ReadTimeout mean that the
+// operation is to be retried once the socket is writable or readable.
+class TlsStream {
+public:
+  // http2: whether HTTP/2 is offered to the server, ahead of HTTP/1.1 (ALPN)
+  TlsStream(std::shared_ptr<TlsContext> context, socket_t sockfd,
+            const std::string &host, uint16_t port, bool http2 = false);
+  ~TlsStream();
+
+  TlsStream(const TlsStream &) = delete;
+  TlsStream &operator=(const TlsStream &) = delete;
+
+  // true once the handshake is done
+  bool handshake(Error &error);
+
+  // Whether the handshake resumed a session of the context
+  bool resumed() const { return SSL_session_reused(ssl_) == 1; }
+
+  // Whether the kernel encrypts what is written on the socket (kTLS), which
+  // can then be sent from a file with sendfile
+  bool kernel_send() const { return kernel_send_; }
+
+  // Whether the server chose HTTP/2 during the handshake
+  bool http2() const;
+
+  ssize_t read(std::span<std::byte> data, Error &error);
+
+  // Encrypts the buffers in a single record, up to its maximum size
+  ssize_t write(std::span<const struct iovec> buffers, Error &error);
+
+  // Send a close_notify, without waiting for that of the peer
+  void shutdown();
+
+private:
+  // The error of an operation that failed with the SSL error, fatal unless
+  // it would block
+  Error operation_error(int ssl_error, Error fatal);
+
+  std::shared_ptr<TlsContext> context_;
+  std::string origin_;
+  socket_t sockfd_;
+  SSL *ssl_;
+  // Whether the kernel encrypts what is sent on the socket
+  bool kernel_send_{};
+  // The connection cannot be used, not even to shut it down
+  bool failed_{};
+  // Where the buffers written are gathered
+  std::string record_{};
+};
+
+} // namespace detail
+
+} // namespace http
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <string_view>
 #include <type_traits>
 
 namespace http::utils {
@@ -14,6 +17,14 @@ concept Duration =
     std::is_same_v<T,
                    std::chrono::duration<typename T::rep, typename T::period>>;
 
+// Case-insensitive comparison, as for the names of the header fields
+inline bool iequals(std::string_view lhs, std::string_view rhs) {
+  return std::ranges::equal(lhs, rhs, [](char a, char b) {
+    return std::tolower(static_cast<unsigned char>(a)) ==
+           std::tolower(static_cast<unsigned char>(b));
+  });
+}
+
 // Possible implementation of c++23 std::unreachable() taken from cppreference
 // https://en.cppreference.com/w/cpp/utility/unreachable
 [[noreturn]] inline void unreachable() {
@@ -0,0 +1,170 @@
+#include "json_extractor.hpp"
+
+#include <algorithm>
+
+const nlohmann::json *JsonFields::find(std::string_view name) const {
+  const auto it = std::ranges::find(names_, name);
+  if (it == names_.end()) {
+    return nullptr;
+  }
+  const auto &value = values_[it - names_.begin()];
+  return value ? &*value : nullptr;
+}
+
+std::optional<std::string_view>
+JsonFields::find_string(std::string_view name) const {
+  const auto *value = find(name);
+  if (value == nullptr || !value->is_string()) {
+    return std::nullopt;
+  }
+  return value->get_ref<const std::string &>();
+}
+
+std::optional<size_t> JsonFields::field(std::string_view key) const {
+  if (const auto it = std::ranges::find(names_, key); it != names_.end()) {
+    return it - names_.begin();
+  }
+  return std::nullopt;
+}
+
+void JsonFields::set(size_t field, nlohmann::json value) {
+  values_[field] = std::move(value);
+}
+
+void JsonFields::clear() {
+  for (auto &value : values_) {
+    value.reset();
+  }
+}
+
+JsonExtractor::Status JsonExtractor::parse(std::string_view document) {
+  top_sink_->clear();
+  element_sink_->clear();
+  levels_.clear();
+  key_.clear();
+  key_field_.reset();
+  found_array_ = false;
+  stopped_ = false;
+
+  const bool parsed = nlohmann::json::sax_parse(
+      document, static_cast<nlohmann::json_sax<nlohmann::json> *>(this));
+  if (stopped_) {
+    return Status::Stopped;
+  }
+  return parsed ? Status::Complete : Status::Invalid;
+}
+
+bool JsonExtractor::emit_element() {
+  if (on_element_ && !on_element_()) {
+    stopped_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool JsonExtractor::scalar(nlohmann::json value) {
+  switch (level()) {
+  case Level::TopLevel:
+    if (key_field_) {
+      top_sink_->set(*key_field_, std::move(value));
+    }
+    return true;
+  case Level::Element:
+    if (key_field_) {
+      element_sink_->set(*key_field_, std::move(value));
+    }
+    return true;
+  case Level::Array:
+    // An element that is not an object has none of the fields
+    element_sink_->clear();
+    return emit_element();
+  default:
+    return true;
+  }
+}
+
+bool JsonExtractor::null() { return scalar(nullptr); }
+
+bool JsonExtractor::boolean(bool value) { return scalar(value); }
+
+bool JsonExtractor::number_integer(number_integer_t value) {
+  return scalar(value);
+}
+
+bool JsonExtractor::number_unsigned(number_unsigned_t value) {
+  return scalar(value);
+}
+
+bool JsonExtractor::number_float(number_float_t value, const string_t &) {
+  return scalar(value);
+}
+
+bool JsonExtractor::string(string_t &value) { return scalar(std::move(value)); }
+
+bool JsonExtractor::binary(binary_t &) { return true; }
+
+bool JsonExtractor::start_object(std::size_t) {
+  switch (level()) {
+  case Level::Outside:
+    levels_.push_back(Level::TopLevel);
+    break;
+  case Level::Array:
+    element_sink_->clear();
+    levels_.push_back(Level::Element);
+    break;
+  default:
+    levels_.push_back(Level::Nested);
+    break;
+  }
+  return true;
+}
+
+bool JsonExtractor::key(string_t &key) {
+  // The fields are looked up once per key, the top-level key being kept to
+  // find the array
+  if (level() == Level::TopLevel) {
+    key_.assign(key);
+    key_field_ = top_sink_->field(key);
+  } else if (level() == Level::Element) {
+    key_field_ = element_sink_->field(key);
+  }
+  return true;
+}
+
+bool JsonExtractor::end_object() {
+  const auto ended = level();
+  levels_.pop_back();
+  return ended != Level::Element || emit_element();
+}
+
+bool JsonExtractor::start_array(std::size_t) {
+  switch (level()) {
+  case Level::TopLevel:
+    if (!array_.empty() && key_ == array_) {
+      found_array_ = true;
+      levels_.push_back(Level::Array);
+      return true;
+    }
+    break;
+  case Level::Array:
+    element_sink_->clear();
+    if (!emit_element()) {
+      return false;
+    }
+    break;
+  default:
+    break;
+  }
+  levels_.push_back(Level::Nested);
+  return true;
+}
+
+bool JsonExtractor::end_array() {
+  levels_.pop_back();
+  return true;
+}
+
+bool JsonExtractor::parse_error(std::size_t, const std::string &,
+                                const nlohmann::detail::exception &) {
+  return false;
+}
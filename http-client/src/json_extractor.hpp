@@ -0,0 +1,349 @@
+#pragma once
+
+#include "json.hpp"
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * Where an extractor keeps the scalar fields of an object, which it looks up
+ * once per key.
+ */
+class JsonObjectSink {
+public:
+  virtual ~JsonObjectSink() = default;
+
+  /**
+   * @param key The key of a field of the object.
+   * @return The index of the field, std::nullopt if it is not asked for.
+   */
+  [[nodiscard]] virtual std::optional<size_t>
+  field(std::string_view key) const = 0;
+
+  /**
+   * Keep the value of the field at the index.
+   */
+  virtual void set(size_t field, nlohmann::json value) = 0;
+
+  /**
+   * Forget the fields, before the next object.
+   */
+  virtual void clear() = 0;
+};
+
+/**
+ * The scalar fields of a JSON object that were asked for, in that order.
+ */
+class JsonFields final : public JsonObjectSink {
+public:
+  explicit JsonFields(std::vector<std::string_view> names)
+      : names_(std::move(names)), values_(names_.size()) {}
+
+  /**
+   * @param name The name of the field.
+   * @return Its value (a string, number, boolean or null), or nullptr if the
+   * object has no such scalar field.
+   */
+  [[nodiscard]] const nlohmann::json *find(std::string_view name) const;
+
+  /**
+   * @param name The name of the field.
+   * @return Its value, if it is a string.
+   */
+  [[nodiscard]] std::optional<std::string_view>
+  find_string(std::string_view name) const;
+
+  [[nodiscard]] std::optional<size_t>
+  field(std::string_view key) const override;
+  void set(size_t field, nlohmann::json value) override;
+  void clear() override;
+
+private:
+  std::vector<std::string_view> names_;
+  std::vector<std::optional<nlohmann::json>> values_;
+};
+
+/**
+ * Extracts fields from a JSON document in a single pass, through
+ * nlohmann::json::sax_parse, without building its DOM. Those of the top-level
+ * object are kept, while those of each object of one of its arrays are passed
+ * to a callback as soon as the object ends, so that the memory used does not
+ * grow with the array.
+ */
+class JsonExtractor : private nlohmann::json_sax<nlohmann::json> {
+public:
+  /**
+   * Called with the fields of each element of the array, false to stop.
+   */
+  using ElementCallback = std::function<bool(const JsonFields &)>;
+
+  enum class Status { Complete, Stopped, Invalid };
+
+  /**
+   * @param fields The fields of the top-level object to extract.
+   * @param array The key of the array in the top-level object, if any.
+   * @param element_fields The fields of its elements to extract.
+   * @param on_element The callback receiving them.
+   */
+  explicit JsonExtractor(std::vector<std::string_view> fields,
+                         std::string_view array = {},
+                         std::vector<std::string_view> element_fields = {},
+                         ElementCallback on_element = {})
+      : fields_(std::move(fields)), element_fields_(std::move(element_fields)),
+        top_sink_(&fields_), element_sink_(&element_fields_), array_(array),
+        on_element_(on_element ? [this, on_element = std::move(on_element)] {
+          return on_element(element_fields_);
+        } : std::function<bool()>{}) {}
+
+  JsonExtractor(const JsonExtractor &) = delete;
+  JsonExtractor &operator=(const JsonExtractor &) = delete;
+
+  /**
+   * @param document The JSON text.
+   * @return Stopped if the callback stopped it, Invalid if the document is
+   * not valid JSON.
+   */
+  Status parse(std::string_view document);
+
+  [[nodiscard]] const JsonFields &fields() const { return fields_; }
+
+  /**
+   * @return Whether the top-level object has the array.
+   */
+  [[nodiscard]] bool found_array() const { return found_array_; }
+
+protected:
+  /**
+   * Extract the fields into the sinks instead, on_element being called once
+   * those of an element are in element_sink.
+   */
+  JsonExtractor(JsonObjectSink &top_sink, std::string_view array,
+                JsonObjectSink &element_sink, std::function<bool()> on_element)
+      : fields_({}), element_fields_({}), top_sink_(&top_sink),
+        element_sink_(&element_sink), array_(array),
+        on_element_(std::move(on_element)) {}
+
+private:
+  // Where the values being parsed are
+  enum class Level { Outside, TopLevel, Array, Element, Nested };
+
+  Level level() const {
+    return levels_.empty() ? Level::Outside : levels_.back();
+  }
+  bool scalar(nlohmann::json value);
+  // Passes the fields of the element to the callback
+  bool emit_element();
+
+  bool null() override;
+  bool boolean(bool value) override;
+  bool number_integer(number_integer_t value) override;
+  bool number_unsigned(number_unsigned_t value) override;
+  bool number_float(number_float_t value, const string_t &) override;
+  bool string(string_t &value) override;
+  bool binary(binary_t &) override;
+  bool start_object(std::size_t) override;
+  bool key(string_t &key) override;
+  bool end_object() override;
+  bool start_array(std::size_t) override;
+  bool end_array() override;
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &) override;
+
+  JsonFields fields_;
+  JsonFields element_fields_;
+  JsonObjectSink *top_sink_;
+  JsonObjectSink *element_sink_;
+  std::string_view array_;
+  std::function<bool()> on_element_;
+
+  // The levels of the containers being parsed, the innermost last
+  std::vector<Level> levels_{};
+  // The last key of the top-level object
+  std::string key_{};
+  // The field of the last key of the top-level object, or of the element
+  std::optional<size_t> key_field_{};
+  bool found_array_{};
+  bool stopped_{};
+};
+
+/**
+ * A field of a struct bound to a JSON key. The member is left empty when the
+ * value has another type: a std::optional<std::string> takes strings, a
+ * std::optional<nlohmann::json> any scalar.
+ */
+template <typename T, typename Value> struct JsonMember {
+  std::string_view key;
+  std::optional<Value> T::*member;
+};
+
+template <typename T, typename Value>
+constexpr JsonMember<T, Value> json_member(std::string_view key,
+                                           std::optional<Value> T::*member) {
+  return {key, member};
+}
+
+/**
+ * A perfect hash of a fixed set of keys, found at compile time: each key has
+ * a slot of its own, so that a lookup hashes the key and compares it to a
+ * single candidate.
+ */
+template <size_t N> class JsonKeyIndex {
+public:
+  consteval explicit JsonKeyIndex(std::array<std::string_view, N> keys)
+      : keys_(keys) {
+    while (!place()) {
+      ++seed_;
+    }
+  }
+
+  /**
+   * @return The index of the key, std::nullopt if it is not one of them.
+   */
+  [[nodiscard]] constexpr std::optional<size_t>
+  find(std::string_view key) const {
+    if constexpr (N == 0) {
+      return std::nullopt;
+    } else {
+      const size_t index = slots_[hash(key, seed_) & (SLOTS - 1)];
+      if (index < N && keys_[index] == key) {
+        return index;
+      }
+      return std::nullopt;
+    }
+  }
+
+private:
+  // Twice as many as the keys, so that a seed is found quickly
+  static constexpr size_t SLOTS = std::bit_ceil(N) * 2;
+
+  // FNV-1a, from a seeded basis
+  static constexpr uint32_t hash(std::string_view key, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : key) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+  }
+
+  // Whether the seed gives each key a slot of its own, the slots being
+  // filled if so
+  constexpr bool place() {
+    slots_.fill(N);
+    for (size_t i = 0; i < N; ++i) {
+      auto &slot = slots_[hash(keys_[i], seed_) & (SLOTS - 1)];
+      if (slot != N) {
+        return false;
+      }
+      slot = i;
+    }
+    return true;
+  }
+
+  std::array<std::string_view, N> keys_;
+  std::array<size_t, SLOTS> slots_{};
+  uint32_t seed_{};
+};
+
+/**
+ * A struct filled from the fields of a JSON object, as bound by its static
+ * json_fields(), a tuple of JsonMember.
+ */
+template <typename T> class JsonRecord final : public JsonObjectSink {
+public:
+  [[nodiscard]] std::optional<size_t>
+  field(std::string_view key) const override {
+    return INDEX.find(key);
+  }
+
+  void set(size_t field, nlohmann::json value) override {
+    set(field, std::move(value), std::make_index_sequence<SIZE>{});
+  }
+
+  void clear() override { value_ = T{}; }
+
+  [[nodiscard]] const T &value() const { return value_; }
+
+private:
+  static constexpr auto MEMBERS = T::json_fields();
+  static constexpr size_t SIZE = std::tuple_size_v<decltype(MEMBERS)>;
+  static constexpr auto KEYS = std::apply(
+      [](const auto &...members) {
+        return std::array<std::string_view, SIZE>{members.key...};
+      },
+      MEMBERS);
+  static constexpr JsonKeyIndex<SIZE> INDEX{KEYS};
+
+  template <size_t... I>
+  void set(size_t field, nlohmann::json &&value, std::index_sequence<I...>) {
+    ((field == I ? assign(value_.*std::get<I>(MEMBERS).member, value)
+                 : void()),
+     ...);
+  }
+
+  static void assign(std::optional<std::string> &member,
+                     nlohmann::json &value) {
+    if (value.is_string()) {
+      member = std::move(value.get_ref<std::string &>());
+    }
+  }
+  static void assign(std::optional<nlohmann::json> &member,
+                     nlohmann::json &value) {
+    member = std::move(value);
+  }
+
+  T value_{};
+};
+
+/**
+ * A struct without fields, for the documents whose top-level fields are not
+ * needed.
+ */
+struct JsonNoFields {
+  static constexpr auto json_fields() { return std::tuple<>{}; }
+};
+
+/**
+ * Holds the records of a TypedJsonExtractor, built before the extractor
+ * refers to them.
+ */
+template <typename Element, typename Fields> struct JsonRecords {
+  JsonRecord<Fields> fields_record{};
+  JsonRecord<Element> element_record{};
+};
+
+/**
+ * An extractor filling structs instead of JsonFields: the top-level fields
+ * into a Fields, and those of each element of the array into an Element,
+ * their keys matched through the perfect hash of their bindings.
+ */
+template <typename Element, typename Fields = JsonNoFields>
+class TypedJsonExtractor : private JsonRecords<Element, Fields>,
+                           public JsonExtractor {
+public:
+  /**
+   * Called with each element of the array, false to stop.
+   */
+  using ElementCallback = std::function<bool(const Element &)>;
+
+  /**
+   * @param array The key of the array in the top-level object.
+   * @param on_element The callback receiving its elements.
+   */
+  TypedJsonExtractor(std::string_view array, ElementCallback on_element)
+      : JsonExtractor(this->fields_record, array, this->element_record,
+                      [this, on_element = std::move(on_element)] {
+                        return on_element(this->element_record.value());
+                      }) {}
+
+  [[nodiscard]] const Fields &fields() const {
+    return this->fields_record.value();
+  }
+};
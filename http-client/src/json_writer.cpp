@@ -0,0 +1,112 @@
+#include "json_writer.hpp"
+
+#include "fmt/format.h"
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+
+void append_json_string(std::string &out, std::string_view value) {
+  out += '"';
+  for (const char c : value) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        fmt::format_to(std::back_inserter(out), "\\u{:04x}",
+                       static_cast<unsigned>(c));
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+}
+
+JsonWriter::JsonWriter(std::string &out) : out_(&out) { out_->clear(); }
+
+void JsonWriter::key(std::string_view key) {
+  separate();
+  append_json_string(*out_, key);
+  *out_ += ':';
+  after_key_ = true;
+}
+
+void JsonWriter::begin_object() { open('{'); }
+
+void JsonWriter::end_object() { close('}'); }
+
+void JsonWriter::begin_array() { open('['); }
+
+void JsonWriter::end_array() { close(']'); }
+
+void JsonWriter::value(std::string_view value) {
+  separate();
+  append_json_string(*out_, value);
+}
+
+void JsonWriter::value(bool value) {
+  separate();
+  *out_ += value ? "true" : "false";
+}
+
+void JsonWriter::value(uint64_t value) {
+  separate();
+  fmt::format_to(std::back_inserter(*out_), "{}", value);
+}
+
+void JsonWriter::value(double value) {
+  separate();
+  if (!std::isfinite(value)) {
+    *out_ += "null";
+    return;
+  }
+  // The shortest text read back as the same double
+  const size_t begin = out_->size();
+  fmt::format_to(std::back_inserter(*out_), "{}", value);
+  if (out_->find_first_of(".e", begin) == std::string::npos) {
+    *out_ += ".0";
+  }
+}
+
+void JsonWriter::separate() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (depth_ > 0) {
+    const uint64_t bit = uint64_t{1} << (depth_ - 1);
+    if ((first_ & bit) == 0) {
+      *out_ += ',';
+    }
+    first_ &= ~bit;
+  }
+}
+
+void JsonWriter::open(char bracket) {
+  if (depth_ == MAX_DEPTH) {
+    throw std::length_error("JSON payload nested too deeply");
+  }
+  separate();
+  *out_ += bracket;
+  first_ |= uint64_t{1} << depth_;
+  ++depth_;
+}
+
+void JsonWriter::close(char bracket) {
+  *out_ += bracket;
+  --depth_;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Append a string to JSON text, quoted and escaped.
+ */
+void append_json_string(std::string &out, std::string_view value);
+
+/**
+ * Writes a JSON document straight into a buffer, without building a DOM: the
+ * request bodies are serialized into a buffer reused from one request to the
+ * next, so that a payload costs no allocation once the buffer is large
+ * enough.
+ */
+class JsonWriter {
+public:
+  /**
+   * @param out The buffer the document replaces the contents of, which must
+   * outlive the writer.
+   */
+  explicit JsonWriter(std::string &out);
+
+  void key(std::string_view key);
+  // @throws std::length_error past MAX_DEPTH nested containers
+  void begin_object();
+  void end_object();
+  // @throws std::length_error past MAX_DEPTH nested containers
+  void begin_array();
+  void end_array();
+
+  void value(std::string_view value);
+  void value(const char *value) { this->value(std::string_view(value)); }
+  void value(const std::string &value) {
+    this->value(std::string_view(value));
+  }
+  void value(bool value);
+  void value(uint64_t value);
+  // Written like nlohmann::json does: with a decimal point even when
+  // integral, and null when not finite
+  void value(double value);
+
+  /**
+   * Write an object of the fields, given as key, value, key, value...
+   */
+  template <typename... Fields> void object(const Fields &...fields) {
+    begin_object();
+    if constexpr (sizeof...(fields) > 0) {
+      this->fields(fields...);
+    }
+    end_object();
+  }
+
+private:
+  template <typename Value, typename... Rest>
+  void fields(std::string_view name, const Value &value, const Rest &...rest) {
+    key(name);
+    this->value(value);
+    if constexpr (sizeof...(rest) > 0) {
+      fields(rest...);
+    }
+  }
+
+  // Separates the value from the previous one of its container
+  void separate();
+  void open(char bracket);
+  void close(char bracket);
+
+  // The nesting of a request payload, deeper containers being rejected
+  static constexpr size_t MAX_DEPTH = 64;
+
+  std::string *out_;
+  // The containers open, a bit per container, set while it has no value yet
+  uint64_t first_{};
+  size_t depth_{};
+  // Whether a key was written, its value coming next
+  bool after_key_{};
+};
@@ -0,0 +1,112 @@
+#include "load_test.hpp"
+
+#include "cli.hpp"
+#include "fmt/format.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct CommandSample {
+  std::string command;
+  std::chrono::microseconds duration;
+  bool success;
+};
+
+/**
+ * The input of a virtual user: the scenario repeated, with its index.
+ */
+std::string user_script(const LoadTestConfig &config, size_t user) {
+  constexpr std::string_view placeholder = "{user}";
+  const auto index = std::to_string(user);
+
+  std::string scenario = config.scenario;
+  for (size_t pos = scenario.find(placeholder); pos != std::string::npos;
+       pos = scenario.find(placeholder, pos + index.size())) {
+    scenario.replace(pos, placeholder.size(), index);
+  }
+  if (!scenario.empty() && scenario.back() != '\n') {
+    scenario += '\n';
+  }
+
+  std::string script;
+  script.reserve(scenario.size() * config.iterations);
+  for (size_t i = 0; i < config.iterations; ++i) {
+    script += scenario;
+  }
+  return script;
+}
+
+double percentile_ms(const std::vector<std::chrono::microseconds> &sorted,
+                     double q) {
+  const auto index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+  return std::chrono::duration<double, std::milli>(sorted[index]).count();
+}
+
+} // namespace
+
+void run_load_test(const LoadTestConfig &config, std::ostream &report) {
+  std::vector<std::vector<CommandSample>> samples(config.users);
+  std::vector<std::thread> users;
+  users.reserve(config.users);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t user = 0; user < config.users; ++user) {
+    users.emplace_back([&config, &samples, user] {
+      // The output of the commands is discarded
+      std::istringstream in(user_script(config, user));
+      std::ostream out(nullptr);
+
+      Cli cli(config.host, config.port,
+              std::make_shared<http::ConnectionPool>());
+      cli.set_io(in, out);
+      cli.set_command_observer([&samples, user](
+                                   std::string_view command,
+                                   std::chrono::microseconds duration,
+                                   bool success) {
+        samples[user].push_back({std::string(command), duration, success});
+      });
+      cli.run();
+    });
+  }
+  for (auto &user : users) {
+    user.join();
+  }
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  struct CommandStats {
+    std::vector<std::chrono::microseconds> durations{};
+    size_t failures{};
+  };
+  std::map<std::string, CommandStats> commands;
+  for (const auto &user_samples : samples) {
+    for (const auto &sample : user_samples) {
+      auto &stats = commands[sample.command];
+      stats.durations.push_back(sample.duration);
+      stats.failures += !sample.success;
+    }
+  }
+
+  report << fmt::format("{} users x {} iterations in {:.3f} s\n",
+                        config.users, config.iterations, seconds)
+         << fmt::format("{:<30} {:>7} {:>7} {:>9} {:>9} {:>9} {:>9} {:>9}\n",
+                        "command", "count", "errors", "cmd/s", "p50 ms",
+                        "p90 ms", "p99 ms", "max ms");
+  for (auto &[command, stats] : commands) {
+    auto &durations = stats.durations;
+    std::sort(durations.begin(), durations.end());
+    report << fmt::format(
+        "{:<30} {:>7} {:>7} {:>9.1f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f}\n",
+        command, durations.size(), stats.failures,
+        static_cast<double>(durations.size()) / seconds,
+        percentile_ms(durations, 0.5), percentile_ms(durations, 0.9),
+        percentile_ms(durations, 0.99), percentile_ms(durations, 1.0));
+  }
+}
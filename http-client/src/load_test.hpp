@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+struct LoadTestConfig {
+  std::string host;
+  uint16_t port = 80;
+  // The commands and their arguments, one per line as typed in the CLI, where
+  // {user} stands for the index of the virtual user
+  std::string scenario;
+  // The virtual users running the scenario at once, each with its own
+  // session (cookie, JWT) and connections
+  size_t users = 1;
+  // The times each virtual user runs the scenario
+  size_t iterations = 1;
+};
+
+/**
+ * Run the scenario with concurrent virtual users and report the throughput
+ * and the latency percentiles of each command.
+ *
+ * @param config The scenario and how to run it.
+ * @param report The output the report is written to.
+ */
+void run_load_test(const LoadTestConfig &config, std::ostream &report);
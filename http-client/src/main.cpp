@@ -1,10 +1,17 @@
 #include "cli.hpp"
+#include "load_test.hpp"
 #include "logger.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
 
 constexpr auto HOST = "63.32.125.183";
 constexpr auto PORT = 8081;
 
-int main() {
+int main(int argc, char *argv[]) {
 
 #ifdef ENABLE_LOGGING
   // Initialize the logger
@@ -14,7 +21,64 @@ int main() {
   LOG_INFO("Http client started");
 #endif
 
-  Cli cli(HOST, PORT);
+  // Non-interactive load test: client --load <scenario> [users] [iterations]
+  if (argc > 1 && std::string_view(argv[1]) == "--load") {
+    std::ifstream scenario_file(argc > 2 ? argv[2] : "");
+    if (!scenario_file) {
+      std::cerr << "Usage: " << argv[0]
+                << " --load <scenario> [users] [iterations]\n";
+      return 1;
+    }
+    std::ostringstream scenario;
+    scenario << scenario_file.rdbuf();
+
+    LoadTestConfig config{
+        .host = HOST,
+        .port = PORT,
+        .scenario = scenario.str(),
+        .users = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1,
+        .iterations = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 1,
+    };
+    run_load_test(config, std::cout);
+    return 0;
+  }
+
+  // client --unix <path>: talk to a server running alongside over its Unix
+  // domain socket
+  std::string host = HOST;
+  for (int i = 1; i + 1 < argc; ++i) {
+    if (std::string_view(argv[i]) == "--unix") {
+      host = std::string("unix://") + argv[i + 1];
+    }
+  }
+
+  Cli cli(host, PORT);
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view option = argv[i];
+    // client --preconnect: connect to the server while the first command is
+    // typed
+    if (option == "--preconnect") {
+      cli.preconnect();
+    }
+    // client --http2: talk HTTP/2 to the server
+    if (option == "--http2") {
+      cli.set_http2(true);
+    }
+    // client --session-cache <file>: reuse the sessions of the previous runs
+    if (option == "--session-cache" && i + 1 < argc) {
+      cli.set_session_cache(argv[++i]);
+    }
+    // client --ndjson: print a JSON record per command, for scripts
+    if (option == "--ndjson") {
+      // The input is then buffered, which lets the records of the commands
+      // already read be written out together
+      std::ios::sync_with_stdio(false);
+      cli.set_ndjson_output(true);
+    }
+    if (option == "--unix") {
+      ++i;
+    }
+  }
   cli.run();
 
   return 0;
@@ -0,0 +1,125 @@
+#include "ndjson_writer.hpp"
+
+#include "fmt/format.h"
+#include "json_writer.hpp"
+#include <iterator>
+
+NdjsonWriter::NdjsonWriter(std::ostream &out, size_t capacity)
+    : out_(&out), capacity_(capacity) {
+  buffer_.reserve(capacity_);
+}
+
+NdjsonWriter::~NdjsonWriter() { flush(); }
+
+void NdjsonWriter::begin_record() {
+  record_begin_ = buffer_.size();
+  begin_object();
+}
+
+void NdjsonWriter::end_record() {
+  end_object();
+  buffer_ += '\n';
+  record_begin_ = buffer_.size();
+  if (buffer_.size() >= capacity_) {
+    flush();
+  }
+}
+
+void NdjsonWriter::flush() {
+  // The record being built stays in the buffer
+  const size_t ended = first_.empty() ? buffer_.size() : record_begin_;
+  if (ended > 0) {
+    out_->write(buffer_.data(), static_cast<std::streamsize>(ended));
+    buffer_.erase(0, ended);
+    record_begin_ -= ended;
+  }
+  out_->flush();
+}
+
+auto NdjsonWriter::mark() const -> Mark {
+  return {.size = buffer_.size(),
+          .depth = first_.size(),
+          .first = !first_.empty() && first_.back()};
+}
+
+void NdjsonWriter::rewind(const Mark &mark) {
+  buffer_.resize(mark.size);
+  first_.resize(mark.depth);
+  if (!first_.empty()) {
+    first_.back() = mark.first;
+  }
+  after_key_ = false;
+}
+
+void NdjsonWriter::key(std::string_view key) {
+  separate();
+  append_string(key);
+  buffer_ += ':';
+  after_key_ = true;
+}
+
+void NdjsonWriter::begin_object() {
+  separate();
+  buffer_ += '{';
+  first_.push_back(true);
+}
+
+void NdjsonWriter::end_object() {
+  buffer_ += '}';
+  first_.pop_back();
+}
+
+void NdjsonWriter::begin_array() {
+  separate();
+  buffer_ += '[';
+  first_.push_back(true);
+}
+
+void NdjsonWriter::end_array() {
+  buffer_ += ']';
+  first_.pop_back();
+}
+
+void NdjsonWriter::value(std::string_view value) {
+  separate();
+  append_string(value);
+}
+
+void NdjsonWriter::value(bool value) {
+  separate();
+  buffer_ += value ? "true" : "false";
+}
+
+void NdjsonWriter::value(uint64_t value) {
+  separate();
+  fmt::format_to(std::back_inserter(buffer_), "{}", value);
+}
+
+void NdjsonWriter::value(double value) {
+  separate();
+  fmt::format_to(std::back_inserter(buffer_), "{}", value);
+}
+
+void NdjsonWriter::value(const nlohmann::json &value) {
+  separate();
+  // Escaped as JSON text, never spanning lines
+  buffer_ += value.dump(-1, ' ', false,
+                        nlohmann::json::error_handler_t::replace);
+}
+
+void NdjsonWriter::separate() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (!first_.empty()) {
+    if (!first_.back()) {
+      buffer_ += ',';
+    }
+    first_.back() = false;
+  }
+}
+
+void NdjsonWriter::append_string(std::string_view value) {
+  append_json_string(buffer_, value);
+}
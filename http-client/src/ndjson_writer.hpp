@@ -0,0 +1,117 @@
+#pragma once
+
+#include "json.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// The records are written out once they take this much, or when asked
+static constexpr size_t NDJSON_BUFFER_SIZE = 64 << 10;
+
+/**
+ * Writes JSON records, one per line (NDJSON), into a buffer that is written
+ * to the output in large blocks: when it fills up, after a record, or when
+ * flushed. A record is never written out before it ends, so that it can be
+ * rewound while it is built.
+ */
+class NdjsonWriter {
+public:
+  /**
+   * Where the writer was, to go back to.
+   */
+  struct Mark {
+    size_t size;
+    size_t depth;
+    bool first;
+  };
+
+  /**
+   * @param out The output the records are written to, which must outlive the
+   * writer.
+   * @param capacity The size from which the records are written out.
+   */
+  explicit NdjsonWriter(std::ostream &out,
+                        size_t capacity = NDJSON_BUFFER_SIZE);
+  // Writes out the records ended
+  ~NdjsonWriter();
+
+  NdjsonWriter(const NdjsonWriter &) = delete;
+  NdjsonWriter &operator=(const NdjsonWriter &) = delete;
+
+  /**
+   * Start a record, an object.
+   */
+  void begin_record();
+  /**
+   * End the record, writing out the records if the buffer is full.
+   */
+  void end_record();
+  /**
+   * Write out the records ended, and flush the output.
+   */
+  void flush();
+
+  [[nodiscard]] Mark mark() const;
+  /**
+   * Drop what was written to the record since the mark.
+   */
+  void rewind(const Mark &mark);
+
+  void key(std::string_view key);
+  void begin_object();
+  void end_object();
+  void begin_array();
+  void end_array();
+
+  void value(std::string_view value);
+  void value(const char *value) { this->value(std::string_view(value)); }
+  void value(const std::string &value) {
+    this->value(std::string_view(value));
+  }
+  void value(bool value);
+  void value(uint64_t value);
+  void value(double value);
+  void value(const nlohmann::json &value);
+
+  /**
+   * Write a struct as an object, with the fields bound by its static
+   * json_fields() that have a value.
+   */
+  template <typename T> void object(const T &record) {
+    begin_object();
+    std::apply(
+        [&](const auto &...members) {
+          (field(members.key, record.*members.member), ...);
+        },
+        T::json_fields());
+    end_object();
+  }
+
+private:
+  template <typename Value>
+  void field(std::string_view name, const std::optional<Value> &member) {
+    if (member) {
+      key(name);
+      value(*member);
+    }
+  }
+
+  // Separates the value from the previous one of its container
+  void separate();
+  void append_string(std::string_view value);
+
+  std::ostream *out_;
+  size_t capacity_;
+  std::string buffer_;
+  // Where the record being built starts
+  size_t record_begin_{};
+  // The containers open, whether each has no value yet
+  std::vector<bool> first_{};
+  // Whether a key was written, its value coming next
+  bool after_key_{};
+};
@@ -0,0 +1,268 @@
+#include "session_cache.hpp"
+
+#include "fmt/format.h"
+#include "json.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <openssl/evp.h>
+#include <sstream>
+#include <unistd.h>
+
+namespace {
+
+// A session about to expire is not reused, as it could expire on its way
+constexpr auto EXPIRY_MARGIN = std::chrono::seconds(30);
+
+bool iequals(std::string_view a, std::string_view b) {
+  return std::ranges::equal(a, b, [](char x, char y) {
+    return std::tolower(static_cast<unsigned char>(x)) ==
+           std::tolower(static_cast<unsigned char>(y));
+  });
+}
+
+std::string_view trim(std::string_view value) {
+  const auto begin = value.find_first_not_of(" \t");
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  return value.substr(begin, value.find_last_not_of(" \t") + 1 - begin);
+}
+
+/**
+ * Decode base64url, padded or not.
+ *
+ * @return The bytes, std::nullopt if the text is not base64url.
+ */
+std::optional<std::string> decode_base64url(std::string_view text) {
+  while (!text.empty() && text.back() == '=') {
+    text.remove_suffix(1);
+  }
+
+  std::string decoded;
+  uint32_t bits = 0;
+  int bit_count = 0;
+  for (char c : text) {
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '-' || c == '+') {
+      value = 62;
+    } else if (c == '_' || c == '/') {
+      value = 63;
+    } else {
+      return std::nullopt;
+    }
+    bits = (bits << 6) | static_cast<uint32_t>(value);
+    bit_count += 6;
+    if (bit_count >= 8) {
+      bit_count -= 8;
+      decoded += static_cast<char>((bits >> bit_count) & 0xff);
+    }
+  }
+  return decoded;
+}
+
+std::optional<CachedSession::TimePoint> from_seconds(const nlohmann::json &json,
+                                                     std::string_view name) {
+  const auto it = json.find(name);
+  if (it == json.end() || !it->is_number_integer()) {
+    return std::nullopt;
+  }
+  return CachedSession::TimePoint(std::chrono::seconds(it->get<int64_t>()));
+}
+
+nlohmann::json to_seconds(const std::optional<CachedSession::TimePoint> &time) {
+  if (!time) {
+    return nullptr;
+  }
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             time->time_since_epoch())
+      .count();
+}
+
+bool is_valid(const std::optional<CachedSession::TimePoint> &expiry,
+              CachedSession::TimePoint now) {
+  return !expiry || now + EXPIRY_MARGIN < *expiry;
+}
+
+} // namespace
+
+SessionCache::SessionCache(std::string path) : path_(std::move(path)) {
+  std::ifstream file(path_);
+  if (!file) {
+    return;
+  }
+  const auto json = nlohmann::json::parse(file, nullptr, false);
+  if (!json.is_object()) {
+    return;
+  }
+
+  for (const auto &[key, entry] : json.items()) {
+    if (!entry.is_object() || !entry.contains("cookie") ||
+        !entry["cookie"].is_string()) {
+      continue;
+    }
+    CachedSession session{
+        .cookie = entry["cookie"].get<std::string>(),
+        .cookie_expiry = from_seconds(entry, "cookie_expiry")};
+    if (entry.contains("jwt") && entry["jwt"].is_string()) {
+      session.jwt = entry["jwt"].get<std::string>();
+      session.jwt_expiry = from_seconds(entry, "jwt_expiry");
+    }
+    sessions_.emplace(key, std::move(session));
+  }
+}
+
+std::string SessionCache::key(std::string_view origin, std::string_view role,
+                              std::string_view credentials) {
+  const auto text = fmt::format("{}\n{}\n{}", origin, role, credentials);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  EVP_Digest(text.data(), text.size(), digest, &length, EVP_sha256(), nullptr);
+
+  std::string key;
+  for (unsigned int i = 0; i < length; ++i) {
+    key += fmt::format("{:02x}", digest[i]);
+  }
+  return key;
+}
+
+std::optional<CachedSession>
+SessionCache::find(const std::string &key,
+                   CachedSession::TimePoint now) const {
+  const auto it = sessions_.find(key);
+  if (it == sessions_.end() || !is_valid(it->second.cookie_expiry, now)) {
+    return std::nullopt;
+  }
+  auto session = it->second;
+  if (!is_valid(session.jwt_expiry, now)) {
+    session.jwt.clear();
+    session.jwt_expiry.reset();
+  }
+  return session;
+}
+
+void SessionCache::store(const std::string &key, CachedSession session) {
+  sessions_.insert_or_assign(key, std::move(session));
+  save();
+}
+
+void SessionCache::erase(const std::string &key) {
+  if (sessions_.erase(key) > 0) {
+    save();
+  }
+}
+
+void SessionCache::save() const {
+  auto json = nlohmann::json::object();
+  for (const auto &[key, session] : sessions_) {
+    auto &entry = json[key];
+    entry["cookie"] = session.cookie;
+    entry["cookie_expiry"] = to_seconds(session.cookie_expiry);
+    if (!session.jwt.empty()) {
+      entry["jwt"] = session.jwt;
+      entry["jwt_expiry"] = to_seconds(session.jwt_expiry);
+    }
+  }
+  const auto contents = json.dump();
+
+  // Written aside, then moved over the file, which is never left half
+  // written
+  const auto temporary = path_ + ".tmp";
+  const int fd =
+      open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  size_t written = 0;
+  while (written < contents.size()) {
+    const ssize_t bytes =
+        write(fd, contents.data() + written, contents.size() - written);
+    if (bytes <= 0) {
+      break;
+    }
+    written += bytes;
+  }
+  close(fd);
+  if (written < contents.size() ||
+      std::rename(temporary.c_str(), path_.c_str()) != 0) {
+    unlink(temporary.c_str());
+  }
+}
+
+std::optional<CachedSession::TimePoint>
+parse_cookie_expiry(std::string_view set_cookie,
+                    CachedSession::TimePoint now) {
+  std::optional<CachedSession::TimePoint> expires;
+  std::string_view attributes = set_cookie;
+  // The name and the value of the cookie come first
+  attributes.remove_prefix(std::min(attributes.find(';'), attributes.size()));
+
+  while (!attributes.empty()) {
+    attributes.remove_prefix(1);
+    const auto end = std::min(attributes.find(';'), attributes.size());
+    const auto attribute = attributes.substr(0, end);
+    attributes.remove_prefix(end);
+
+    const auto equals = attribute.find('=');
+    if (equals == std::string_view::npos) {
+      continue;
+    }
+    const auto name = trim(attribute.substr(0, equals));
+    const auto value = trim(attribute.substr(equals + 1));
+
+    if (iequals(name, "Max-Age")) {
+      // Takes precedence over Expires (RFC 6265)
+      int64_t seconds{};
+      auto [ptr, ec] =
+          std::from_chars(value.data(), value.data() + value.size(), seconds);
+      if (ec == std::errc{} && ptr == value.data() + value.size()) {
+        return now + std::chrono::seconds(std::max<int64_t>(seconds, 0));
+      }
+    } else if (iequals(name, "Expires")) {
+      // e.g. Wed, 21 Oct 2015 07:28:00 GMT, or with dashes in the date
+      std::string date(value);
+      std::replace(date.begin(), date.end(), '-', ' ');
+      std::tm tm{};
+      std::istringstream in(date);
+      in >> std::get_time(&tm, "%a, %d %b %Y %H:%M:%S");
+      if (!in.fail()) {
+        expires = std::chrono::system_clock::from_time_t(timegm(&tm));
+      }
+    }
+  }
+  return expires;
+}
+
+std::optional<CachedSession::TimePoint> parse_jwt_expiry(std::string_view jwt) {
+  // header.payload.signature
+  const auto payload_begin = jwt.find('.');
+  if (payload_begin == std::string_view::npos) {
+    return std::nullopt;
+  }
+  const auto payload_end = jwt.find('.', payload_begin + 1);
+  if (payload_end == std::string_view::npos) {
+    return std::nullopt;
+  }
+  const auto payload = decode_base64url(
+      jwt.substr(payload_begin + 1, payload_end - payload_begin - 1));
+  if (!payload) {
+    return std::nullopt;
+  }
+
+  const auto claims = nlohmann::json::parse(*payload, nullptr, false);
+  if (!claims.is_object()) {
+    return std::nullopt;
+  }
+  return from_seconds(claims, "exp");
+}
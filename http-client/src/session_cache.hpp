@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * The credentials a login left in the headers of the client, along with when
+ * they expire, if known.
+ */
+struct CachedSession {
+  using TimePoint = std::chrono::system_clock::time_point;
+
+  // The session cookie, as sent in the Cookie header
+  std::string cookie;
+  std::optional<TimePoint> cookie_expiry;
+  // The JWT of the library, empty if none was obtained with the cookie
+  std::string jwt;
+  std::optional<TimePoint> jwt_expiry;
+};
+
+/**
+ * The sessions of the logins, kept in a file between the runs of the CLI so
+ * that a login with the same credentials reuses the session instead of asking
+ * the server for a new one. The file is only readable by its owner, and the
+ * passwords are not kept, the sessions being found by a digest of the
+ * credentials.
+ */
+class SessionCache {
+public:
+  /**
+   * Load the sessions of the file, none if it is missing or invalid.
+   *
+   * @param path The file the sessions are kept in.
+   */
+  explicit SessionCache(std::string path);
+
+  /**
+   * The key of the session of a login.
+   *
+   * @param origin The host and the port of the server.
+   * @param role What logged in, e.g. admin or user.
+   * @param credentials The fields of the login, the password included.
+   * @return A digest of them all.
+   */
+  [[nodiscard]] static std::string key(std::string_view origin,
+                                       std::string_view role,
+                                       std::string_view credentials);
+
+  /**
+   * @param key The key of the session.
+   * @param now The current time.
+   * @return The session, if its cookie has not expired, without its JWT if
+   * that has.
+   */
+  [[nodiscard]] std::optional<CachedSession>
+  find(const std::string &key, CachedSession::TimePoint now) const;
+
+  /**
+   * Keep the session and write the file, the file not being updated if it
+   * cannot be written.
+   */
+  void store(const std::string &key, CachedSession session);
+  void erase(const std::string &key);
+
+private:
+  void save() const;
+
+  std::string path_;
+  std::unordered_map<std::string, CachedSession> sessions_;
+};
+
+/**
+ * When the cookie set by a Set-Cookie header expires, from its Max-Age or
+ * Expires attribute.
+ *
+ * @param set_cookie The value of the Set-Cookie header.
+ * @param now The time the response was received.
+ * @return The expiry, std::nullopt for a cookie of the browsing session.
+ */
+[[nodiscard]] std::optional<CachedSession::TimePoint>
+parse_cookie_expiry(std::string_view set_cookie, CachedSession::TimePoint now);
+
+/**
+ * When a JWT expires, from the exp claim of its payload.
+ *
+ * @param jwt The token.
+ * @return The expiry, std::nullopt if it has none or cannot be decoded.
+ */
+[[nodiscard]] std::optional<CachedSession::TimePoint>
+parse_jwt_expiry(std::string_view jwt);
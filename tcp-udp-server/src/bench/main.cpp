@@ -0,0 +1,250 @@
+/**
+ * Micro-benchmark of the topic matching: the time to match a subscription
+ * against a published topic with the breadth-first search of
+ * TokenPattern::matches_bfs and with a compiled PatternMatcher, for a few
+ * shapes of patterns, from plain topics to the middle '*' wildcards against
+ * deep topics that make the search explode.
+ *
+ * Followed by the time to serialize and deserialize the fixed-size payloads of
+ * the responses with their FieldLayout and with the code writing them field
+ * by field that it replaced.
+ *
+ * Usage: ./bench [iterations]
+ */
+#include "pattern_matcher.hpp"
+#include "tcp_proto.hpp"
+#include "token_pattern.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr size_t DEFAULT_ITERATIONS = 1e6;
+// Number of random pairs of the last case
+constexpr size_t RANDOM_PAIRS = 1024;
+// Number of payloads serialized one after the other, fitting in the L1 cache
+constexpr size_t PAYLOADS = 1024;
+
+struct Case {
+  const char *name;
+  std::vector<TokenPattern> patterns;
+  std::vector<TokenPattern> topics;
+};
+
+auto repeat(const std::string &token, size_t count) -> std::string {
+  std::string topic = token;
+  for (size_t i = 1; i < count; ++i) {
+    topic += "/" + token;
+  }
+  return topic;
+}
+
+auto single_case(const char *name, const std::string &pattern,
+                 const std::string &topic) -> Case {
+  return {name,
+          {TokenPattern::from_string(pattern)},
+          {TokenPattern::from_string(topic)}};
+}
+
+// Patterns of 1 to 6 tokens, without consecutive wildcards, and topics of 1
+// to 10 tokens, over a small alphabet for them to match often
+auto random_case(std::mt19937 &rng) -> Case {
+  const char *tokens[] = {"a", "b", "c"};
+  Case result{"random", {}, {}};
+
+  for (size_t i = 0; i < RANDOM_PAIRS; ++i) {
+    std::string pattern;
+    bool wildcard = false;
+    for (size_t j = 0, size = 1 + rng() % 6; j < size; ++j) {
+      std::string token = tokens[rng() % 3];
+      if (!wildcard && rng() % 3 == 0) {
+        token = rng() % 2 ? "*" : "+";
+        wildcard = true;
+      } else {
+        wildcard = false;
+      }
+      pattern += (j ? "/" : "") + token;
+    }
+
+    std::string topic;
+    for (size_t j = 0, size = 1 + rng() % 10; j < size; ++j) {
+      topic += (j ? "/" : "") + std::string(tokens[rng() % 3]);
+    }
+
+    result.patterns.push_back(TokenPattern::from_string(pattern));
+    result.topics.push_back(TokenPattern::from_string(topic));
+  }
+  return result;
+}
+
+template <typename Match>
+auto time_matches(const Case &c, size_t iterations, Match &&match,
+                  size_t &matched) -> double {
+  matched = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t index = i % c.patterns.size();
+    matched += match(index, c.topics[index]);
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+// The FLOAT payload written field by field, advancing the buffer, as before
+// FieldLayout
+void serialize_by_field(const TcpResponsePayloadFloat &payload,
+                        std::byte *buffer) {
+  std::memcpy(buffer, &payload.sign, sizeof(payload.sign));
+  buffer += sizeof(payload.sign);
+
+  uint32_t value_network = hton(payload.value);
+  std::memcpy(buffer, &value_network, sizeof(value_network));
+  buffer += sizeof(value_network);
+
+  std::memcpy(buffer, &payload.exponent, sizeof(payload.exponent));
+}
+
+auto deserialize_by_field(TcpResponsePayloadFloat &payload,
+                          const std::byte *buffer, size_t buffer_size)
+    -> bool {
+  if (buffer_size < sizeof(payload.sign)) {
+    return false;
+  }
+  std::memcpy(&payload.sign, buffer, sizeof(payload.sign));
+  buffer += sizeof(payload.sign);
+  buffer_size -= sizeof(payload.sign);
+
+  uint32_t value_network;
+  if (buffer_size < sizeof(value_network)) {
+    return false;
+  }
+  std::memcpy(&value_network, buffer, sizeof(value_network));
+  payload.value = ntoh(value_network);
+  buffer += sizeof(value_network);
+  buffer_size -= sizeof(value_network);
+
+  if (buffer_size < sizeof(payload.exponent)) {
+    return false;
+  }
+  std::memcpy(&payload.exponent, buffer, sizeof(payload.exponent));
+  return true;
+}
+
+// Serialize PAYLOADS payloads into the buffer and read them back, returning
+// the time of a round trip of a payload and the checksum of the values read
+template <typename Serialize, typename Deserialize>
+auto time_payloads(size_t iterations, std::vector<std::byte> &buffer,
+                   Serialize &&serialize, Deserialize &&deserialize,
+                   uint64_t &checksum) -> double {
+  constexpr size_t size = TcpResponsePayloadFloat::MAX_SERIALIZED_SIZE;
+  checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i += PAYLOADS) {
+    for (size_t j = 0; j < PAYLOADS; ++j) {
+      auto index = static_cast<uint32_t>(i + j);
+      TcpResponsePayloadFloat payload{index, static_cast<uint8_t>(index & 1),
+                                      static_cast<uint8_t>(index % 10)};
+      serialize(payload, buffer.data() + j * size);
+    }
+    for (size_t j = 0; j < PAYLOADS; ++j) {
+      TcpResponsePayloadFloat payload{};
+      if (deserialize(payload, buffer.data() + j * size,
+                      buffer.size() - j * size)) {
+        checksum += payload.value + payload.sign + payload.exponent;
+      }
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  size_t rounded = (iterations + PAYLOADS - 1) / PAYLOADS * PAYLOADS;
+  return elapsed.count() / rounded;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 0;
+  if (iterations == 0) {
+    iterations = DEFAULT_ITERATIONS;
+  }
+
+  std::mt19937 rng(42);
+  std::vector<Case> cases{
+      single_case("exact", "sensors/floor/1/temp", "sensors/floor/1/temp"),
+      single_case("plus", "sensors/+/1/+", "sensors/floor/1/temp"),
+      single_case("trailing star", "sensors/*", "sensors/floor/1/temp/a/b/c"),
+      single_case("middle stars", "*/a/*/a/*/a/*/b", repeat("a", 24)),
+      random_case(rng),
+  };
+
+  std::printf("%-16s %14s %14s %8s\n", "case", "bfs ns/match",
+              "nfa ns/match", "speedup");
+  for (const auto &c : cases) {
+    std::vector<PatternMatcher> matchers(c.patterns.begin(),
+                                         c.patterns.end());
+
+    size_t bfs_matched = 0;
+    size_t nfa_matched = 0;
+    double bfs = time_matches(
+        c, iterations,
+        [&](size_t i, const TokenPattern &topic) {
+          return c.patterns[i].matches_bfs(topic);
+        },
+        bfs_matched);
+    double nfa = time_matches(
+        c, iterations,
+        [&](size_t i, const TokenPattern &topic) {
+          return matchers[i].matches(topic);
+        },
+        nfa_matched);
+
+    if (bfs_matched != nfa_matched) {
+      std::fprintf(stderr, "%s: the matchers disagree (%zu vs %zu matches)\n",
+                   c.name, bfs_matched, nfa_matched);
+      return 1;
+    }
+    std::printf("%-16s %14.1f %14.1f %7.1fx\n", c.name, bfs, nfa, bfs / nfa);
+  }
+
+  using Layout = TcpResponsePayloadFloat::Layout;
+  std::vector<std::byte> buffer(PAYLOADS * Layout::SIZE);
+  uint64_t field_checksum = 0;
+  uint64_t layout_checksum = 0;
+  double by_field = time_payloads(
+      iterations, buffer,
+      [](const auto &payload, std::byte *out) {
+        serialize_by_field(payload, out);
+      },
+      [](auto &payload, const std::byte *in, size_t in_size) {
+        return deserialize_by_field(payload, in, in_size);
+      },
+      field_checksum);
+  double by_layout = time_payloads(
+      iterations, buffer,
+      [](const auto &payload, std::byte *out) {
+        Layout::serialize(payload, out);
+      },
+      [](auto &payload, const std::byte *in, size_t in_size) {
+        return Layout::deserialize(payload, in, in_size);
+      },
+      layout_checksum);
+  if (field_checksum != layout_checksum) {
+    std::fprintf(stderr, "FLOAT: the layouts disagree (%llu vs %llu)\n",
+                 static_cast<unsigned long long>(field_checksum),
+                 static_cast<unsigned long long>(layout_checksum));
+    return 1;
+  }
+
+  std::printf("\n%-16s %14s %14s %8s\n", "payload", "field ns/trip",
+              "layout ns/trip", "speedup");
+  std::printf("%-16s %14.2f %14.2f %7.1fx\n", "FLOAT", by_field, by_layout,
+              by_field / by_layout);
+  return 0;
+}
@@ -0,0 +1,270 @@
+#include "content_filter.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace {
+
+auto trim(std::string_view str) -> std::string_view {
+  auto is_space = [](char c) {
+    return std::isspace(static_cast<unsigned char>(c)) != 0;
+  };
+  while (!str.empty() && is_space(str.front())) {
+    str.remove_prefix(1);
+  }
+  while (!str.empty() && is_space(str.back())) {
+    str.remove_suffix(1);
+  }
+  return str;
+}
+
+// The digits of a mantissa fitting in a uint64_t
+constexpr size_t MAX_DIGITS = std::numeric_limits<uint64_t>::digits10;
+
+} // namespace
+
+auto to_string(ContentFilterError error) -> const char * {
+  switch (error) {
+  case ContentFilterError::NONE:
+    return "none";
+  case ContentFilterError::EMPTY:
+    return "Filter is empty";
+  case ContentFilterError::INVALID_OPERATOR:
+    return "Invalid filter operator";
+  case ContentFilterError::INVALID_OPERAND:
+    return "Invalid filter operand";
+  case ContentFilterError::TOO_MANY_TERMS:
+    return "Too many filter terms";
+  default:
+    return "Unknown error";
+  }
+}
+
+auto ContentFilter::parse(std::string_view str, ContentFilter &filter)
+    -> ContentFilterError {
+  str = trim(str);
+  if (str.empty()) {
+    return ContentFilterError::EMPTY;
+  }
+
+  ContentFilter parsed{};
+  size_t offset = 0;
+  while (true) {
+    if (parsed.terms_.size() == MAX_TERMS) {
+      return ContentFilterError::TOO_MANY_TERMS;
+    }
+
+    size_t pos = str.find("&&", offset);
+    Term term{};
+    ContentFilterError error = parse_term(
+        trim(str.substr(offset, pos == std::string_view::npos
+                                    ? std::string_view::npos
+                                    : pos - offset)),
+        term);
+    if (error != ContentFilterError::NONE) {
+      return error;
+    }
+    parsed.terms_.push_back(std::move(term));
+
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    offset = pos + 2;
+  }
+
+  parsed.expression_ = str;
+  filter = std::move(parsed);
+  return ContentFilterError::NONE;
+}
+
+auto ContentFilter::parse_term(std::string_view str, Term &term)
+    -> ContentFilterError {
+  // The longer operators first, those sharing a prefix with a shorter one
+  static constexpr std::array<std::pair<std::string_view, Op>, 8> operators{{
+      {"<=", Op::LE},
+      {">=", Op::GE},
+      {"==", Op::EQ},
+      {"!=", Op::NE},
+      {"<", Op::LT},
+      {">", Op::GT},
+      {"prefix", Op::PREFIX},
+      {"contains", Op::CONTAINS},
+  }};
+
+  for (const auto &[name, op] : operators) {
+    if (str.substr(0, name.size()) != name) {
+      continue;
+    }
+    std::string_view operand = str.substr(name.size());
+    bool is_word = op == Op::PREFIX || op == Op::CONTAINS;
+    if (is_word && !operand.empty() &&
+        !std::isspace(static_cast<unsigned char>(operand.front()))) {
+      // Another word starting as the operator
+      continue;
+    }
+
+    operand = trim(operand);
+    term.op = op;
+    if (is_word) {
+      if (operand.empty()) {
+        return ContentFilterError::INVALID_OPERAND;
+      }
+      term.text = std::string(operand);
+      return ContentFilterError::NONE;
+    }
+    return parse_decimal(operand, term.number)
+               ? ContentFilterError::NONE
+               : ContentFilterError::INVALID_OPERAND;
+  }
+  return ContentFilterError::INVALID_OPERATOR;
+}
+
+auto ContentFilter::parse_decimal(std::string_view str, Decimal &number)
+    -> bool {
+  Decimal parsed{};
+  size_t i = 0;
+  if (i < str.size() && str[i] == '-') {
+    parsed.negative = true;
+    ++i;
+  }
+
+  size_t digits = 0;
+  size_t fraction_start = 0;
+  for (; i < str.size(); ++i) {
+    char c = str[i];
+    if (c == '.' && fraction_start == 0 && digits > 0) {
+      fraction_start = i + 1;
+      continue;
+    }
+    if (c < '0' || c > '9' || ++digits > MAX_DIGITS) {
+      return false;
+    }
+    parsed.mantissa = parsed.mantissa * 10 + static_cast<uint64_t>(c - '0');
+  }
+  if (digits == 0 || fraction_start == str.size()) {
+    return false;
+  }
+
+  if (fraction_start != 0) {
+    parsed.exponent = static_cast<uint8_t>(str.size() - fraction_start);
+  }
+  number = parsed;
+  return true;
+}
+
+auto ContentFilter::read_decimal(TcpResponsePayloadType type,
+                                 const std::byte *payload, size_t size,
+                                 Decimal &number) -> bool {
+  switch (type) {
+  case TcpResponsePayloadType::INT: {
+    uint32_t value{};
+    if (size < sizeof(uint8_t) + sizeof(value)) {
+      return false;
+    }
+    std::memcpy(&value, payload + sizeof(uint8_t), sizeof(value));
+    number = {ntoh(value), 0, payload[0] != std::byte{0}};
+    return true;
+  }
+  case TcpResponsePayloadType::SHORT_REAL: {
+    uint16_t value{};
+    if (size < sizeof(value)) {
+      return false;
+    }
+    std::memcpy(&value, payload, sizeof(value));
+    number = {ntoh(value), 2, false};
+    return true;
+  }
+  case TcpResponsePayloadType::FLOAT: {
+    uint32_t value{};
+    if (size < sizeof(uint8_t) + sizeof(value) + sizeof(uint8_t)) {
+      return false;
+    }
+    std::memcpy(&value, payload + sizeof(uint8_t), sizeof(value));
+    number = {ntoh(value),
+              static_cast<uint8_t>(payload[sizeof(uint8_t) + sizeof(value)]),
+              payload[0] != std::byte{0}};
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+auto ContentFilter::compare(const Decimal &lhs, const Decimal &rhs) -> int {
+  auto sign = [](const Decimal &number) {
+    return number.mantissa == 0 ? 0 : number.negative ? -1 : 1;
+  };
+  int lhs_sign = sign(lhs);
+  int rhs_sign = sign(rhs);
+  if (lhs_sign != rhs_sign) {
+    return lhs_sign < rhs_sign ? -1 : 1;
+  }
+  if (lhs_sign == 0) {
+    return 0;
+  }
+
+  // The magnitudes are compared at the same exponent, the one scaled up being
+  // the larger once it overflows
+  uint64_t lhs_mantissa = lhs.mantissa;
+  uint64_t rhs_mantissa = rhs.mantissa;
+  bool lhs_scaled = lhs.exponent < rhs.exponent;
+  uint64_t &scaled = lhs_scaled ? lhs_mantissa : rhs_mantissa;
+  int magnitude = 0;
+  for (int i = std::abs(lhs.exponent - rhs.exponent); i > 0; --i) {
+    if (scaled > std::numeric_limits<uint64_t>::max() / 10) {
+      magnitude = lhs_scaled ? 1 : -1;
+      break;
+    }
+    scaled *= 10;
+  }
+  if (magnitude == 0 && lhs_mantissa != rhs_mantissa) {
+    magnitude = lhs_mantissa < rhs_mantissa ? -1 : 1;
+  }
+  return lhs_sign * magnitude;
+}
+
+auto ContentFilter::matches_term(const Term &term, TcpResponsePayloadType type,
+                            const std::byte *payload, size_t size) -> bool {
+  if (term.op == Op::PREFIX || term.op == Op::CONTAINS) {
+    if (type != TcpResponsePayloadType::STRING) {
+      return false;
+    }
+    std::string_view value(reinterpret_cast<const char *>(payload), size);
+    return term.op == Op::PREFIX ? value.substr(0, term.text.size()) == term.text
+                                 : value.find(term.text) != value.npos;
+  }
+
+  Decimal value{};
+  if (!read_decimal(type, payload, size, value)) {
+    return false;
+  }
+  int order = compare(value, term.number);
+  switch (term.op) {
+  case Op::LT:
+    return order < 0;
+  case Op::LE:
+    return order <= 0;
+  case Op::GT:
+    return order > 0;
+  case Op::GE:
+    return order >= 0;
+  case Op::EQ:
+    return order == 0;
+  case Op::NE:
+    return order != 0;
+  default:
+    unreachable();
+  }
+}
+
+bool ContentFilter::matches(TcpResponsePayloadType type,
+                            const std::byte *payload, size_t size) const {
+  return std::all_of(terms_.begin(), terms_.end(), [&](const Term &term) {
+    return matches_term(term, type, payload, size);
+  });
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "tcp_proto.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Why a string is not a ContentFilter, as returned by ContentFilter::parse
+enum class ContentFilterError : uint8_t {
+  NONE = 0,
+  EMPTY,
+  INVALID_OPERATOR,
+  // A number which is not [-]digits[.digits], or an empty string
+  INVALID_OPERAND,
+  TOO_MANY_TERMS,
+  TOTAL_ERRORS
+};
+
+/**
+ * @brief Describe why a string is not a ContentFilter
+ *
+ * @param error The reason, not ContentFilterError::NONE
+ * @return The description
+ */
+auto to_string(ContentFilterError error) -> const char *;
+
+/**
+ * @brief A filter of the messages of a subscription on their payload,
+ * compiled once from its expression and evaluated for each delivery
+ *
+ * The expression is one or more terms joined by "&&", all of which must
+ * accept a message:
+ * - "<op> <number>", with op among <, <=, >, >=, ==, !=, compares the value of
+ *   an INT, SHORT_REAL or FLOAT message to the number, exactly, as decimals
+ * - "prefix <string>" and "contains <string>" apply to the value of a STRING
+ *   message, the string being the rest of the term, without its surrounding
+ *   spaces
+ * A message of a type a term does not apply to is not accepted by it.
+ */
+class ContentFilter {
+public:
+  static constexpr size_t MAX_TERMS = 4;
+
+  /**
+   * @brief Compile a filter from its expression, without throwing, so that
+   * the requests of a client sending garbage only cost the checks
+   *
+   * @param str The expression
+   * @param filter The filter compiled, left unchanged if the expression is
+   * invalid
+   * @return ContentFilterError::NONE, or why the expression is invalid
+   */
+  [[nodiscard]] static auto parse(std::string_view str, ContentFilter &filter)
+      -> ContentFilterError;
+
+  /**
+   * @brief Check if the filter accepts a message
+   *
+   * @param type The type of the payload
+   * @param payload The payload as laid out in a publication: the fields of a
+   * number, in network byte order, or the string itself
+   * @param size The size of the payload
+   * @return true if every term accepts the message
+   */
+  bool matches(TcpResponsePayloadType type, const std::byte *payload,
+               size_t size) const;
+
+  // The expression the filter was compiled from, without its surrounding
+  // spaces
+  auto expression() const -> const std::string & { return expression_; }
+
+private:
+  enum class Op : uint8_t { LT, LE, GT, GE, EQ, NE, PREFIX, CONTAINS };
+
+  // The value of a number: mantissa * 10^-exponent, negative if it is
+  struct Decimal {
+    uint64_t mantissa{};
+    uint8_t exponent{};
+    bool negative{};
+  };
+
+  struct Term {
+    Op op{};
+    // the operand of the comparisons
+    Decimal number{};
+    // the operand of PREFIX and CONTAINS
+    std::string text{};
+  };
+
+  static auto parse_term(std::string_view str, Term &term)
+      -> ContentFilterError;
+  static auto parse_decimal(std::string_view str, Decimal &number) -> bool;
+  static auto read_decimal(TcpResponsePayloadType type, const std::byte *payload,
+                           size_t size, Decimal &number) -> bool;
+  static auto compare(const Decimal &lhs, const Decimal &rhs) -> int;
+  static auto matches_term(const Term &term, TcpResponsePayloadType type,
+                           const std::byte *payload, size_t size) -> bool;
+
+  std::vector<Term> terms_{};
+  std::string expression_{};
+};
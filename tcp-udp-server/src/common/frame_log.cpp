@@ -0,0 +1,290 @@
+#include "frame_log.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// The header of a segment, at the start of its mapping
+struct SegmentHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t segment;
+  uint64_t size;
+  uint64_t reserved_end;
+};
+static_assert(sizeof(SegmentHeader) == FRAME_LOG_HEADER_SIZE);
+
+auto segment_path(const std::string &path, uint64_t segment) -> std::string {
+  return path + '.' + std::to_string(segment);
+}
+
+// The size of a record, published last by the writer
+auto record_size(const std::byte *record) -> std::atomic<uint32_t> & {
+  return *reinterpret_cast<std::atomic<uint32_t> *>(
+      const_cast<std::byte *>(record));
+}
+
+auto align_record(size_t size) -> size_t { return (size + 7) & ~size_t{7}; }
+
+/**
+ * @brief Call a function with the number of each segment of a log
+ *
+ * @param path The path of the segments, without their number
+ * @param fn Called with the number of each segment
+ */
+template <typename Fn> void for_each_segment(const std::string &path, Fn fn) {
+  std::filesystem::path prefix(path);
+  std::filesystem::path directory = prefix.parent_path();
+  if (directory.empty()) {
+    directory = ".";
+  }
+  std::string name = prefix.filename().string() + '.';
+
+  std::error_code ec{};
+  for (const auto &entry : std::filesystem::directory_iterator(directory, ec)) {
+    std::string file = entry.path().filename().string();
+    if (file.size() <= name.size() || file.compare(0, name.size(), name) != 0) {
+      continue;
+    }
+    uint64_t segment{};
+    const char *end = file.data() + file.size();
+    auto [ptr, err] = std::from_chars(file.data() + name.size(), end, segment);
+    if (err == std::errc{} && ptr == end) {
+      fn(segment);
+    }
+  }
+}
+
+} // namespace
+
+FrameLogWriter::FrameLogWriter(FrameLogConfig config)
+    : config_(std::move(config)) {
+  config_.segment_bytes &= ~size_t{7};
+  config_.segments = std::max<size_t>(config_.segments, 1);
+  if (config_.segment_bytes < FRAME_LOG_HEADER_SIZE +
+                                  FRAME_LOG_RECORD_HEADER_SIZE +
+                                  (UINT16_MAX + 3) ||
+      config_.segment_bytes >= FRAME_LOG_NEXT_SEGMENT) {
+    throw std::runtime_error("Invalid size of the segments of a frame log");
+  }
+
+  // Those of a previous log would be read after the new ones
+  for_each_segment(config_.path, [&](uint64_t segment) {
+    unlink(segment_path(config_.path, segment).c_str());
+  });
+  open_segment(0);
+}
+
+FrameLogWriter::~FrameLogWriter() { close_segment(); }
+
+/**
+ * @brief Create a segment, preallocated and mapped, and remove the one falling
+ * out of the log
+ *
+ * The segment is created under a temporary name, renamed once its header is
+ * written, so that a reader never opens it incomplete.
+ *
+ * @param segment The number of the segment
+ *
+ * @throws std::runtime_error if the segment cannot be created or mapped
+ */
+void FrameLogWriter::open_segment(uint64_t segment) {
+  std::string path = segment_path(config_.path, segment);
+  std::string temporary = path + ".tmp";
+  int fd =
+      ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create the frame log " + path + ": " +
+                             std::strerror(errno));
+  }
+  // Allocated now, so that the appends never find the disk full
+  int error = posix_fallocate(fd, 0, static_cast<off_t>(config_.segment_bytes));
+  if (error != 0) {
+    close(fd);
+    unlink(temporary.c_str());
+    throw std::runtime_error("Failed to allocate the frame log " + path +
+                             ": " + std::strerror(error));
+  }
+  void *mapping = mmap(nullptr, config_.segment_bytes, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    int map_error = errno;
+    unlink(temporary.c_str());
+    throw std::runtime_error("Failed to map the frame log " + path + ": " +
+                             std::strerror(map_error));
+  }
+  SegmentHeader header{FRAME_LOG_MAGIC, FRAME_LOG_VERSION, 0, segment,
+                       config_.segment_bytes, 0};
+  std::memcpy(mapping, &header, sizeof(header));
+  if (rename(temporary.c_str(), path.c_str()) < 0) {
+    int rename_error = errno;
+    munmap(mapping, config_.segment_bytes);
+    unlink(temporary.c_str());
+    throw std::runtime_error("Failed to create the frame log " + path + ": " +
+                             std::strerror(rename_error));
+  }
+
+  mapping_ = static_cast<std::byte *>(mapping);
+  segment_ = segment;
+  offset_ = FRAME_LOG_HEADER_SIZE;
+
+  if (segment >= config_.segments) {
+    unlink(segment_path(config_.path, segment - config_.segments).c_str());
+  }
+}
+
+void FrameLogWriter::close_segment() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, config_.segment_bytes);
+    mapping_ = nullptr;
+  }
+}
+
+auto FrameLogWriter::reserve(size_t size) -> std::byte * {
+  if (offset_ + FRAME_LOG_RECORD_HEADER_SIZE + size > config_.segment_bytes) {
+    // The reader goes on in the next segment, created before it is pointed to
+    std::byte *mapping = mapping_;
+    size_t offset = offset_;
+    open_segment(segment_ + 1);
+    if (offset + sizeof(uint32_t) <= config_.segment_bytes) {
+      record_size(mapping + offset)
+          .store(FRAME_LOG_NEXT_SEGMENT, std::memory_order_release);
+    }
+    munmap(mapping, config_.segment_bytes);
+  }
+  return mapping_ + offset_ + FRAME_LOG_RECORD_HEADER_SIZE;
+}
+
+void FrameLogWriter::commit(uint64_t timestamp_ns, size_t size) {
+  std::byte *record = mapping_ + offset_;
+  std::memcpy(record + sizeof(uint64_t), &timestamp_ns, sizeof(timestamp_ns));
+  record_size(record).store(static_cast<uint32_t>(size),
+                            std::memory_order_release);
+  offset_ += align_record(FRAME_LOG_RECORD_HEADER_SIZE + size);
+}
+
+void FrameLogWriter::append(uint64_t timestamp_ns, const std::byte *frame,
+                            size_t size) {
+  std::memcpy(reserve(size), frame, size);
+  commit(timestamp_ns, size);
+}
+
+FrameLogReader::FrameLogReader(std::string path,
+                               std::optional<uint64_t> segment)
+    : path_(std::move(path)) {
+  if (!segment.has_value()) {
+    segment = first_segment(path_);
+    if (!segment.has_value()) {
+      throw std::runtime_error("No segment of the frame log " + path_);
+    }
+  }
+  open_segment(segment.value());
+}
+
+FrameLogReader::~FrameLogReader() { close_segment(); }
+
+auto FrameLogReader::first_segment(const std::string &path)
+    -> std::optional<uint64_t> {
+  std::optional<uint64_t> first{};
+  for_each_segment(path, [&](uint64_t segment) {
+    if (!first.has_value() || segment < first.value()) {
+      first = segment;
+    }
+  });
+  return first;
+}
+
+/**
+ * @brief Map a segment, checking its header
+ *
+ * @param segment The number of the segment
+ *
+ * @throws std::runtime_error if the segment cannot be opened, or is not a
+ * segment of a frame log
+ */
+void FrameLogReader::open_segment(uint64_t segment) {
+  std::string path = segment_path(path_, segment);
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open the frame log " + path + ": " +
+                             std::strerror(errno));
+  }
+  struct stat st {};
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < FRAME_LOG_HEADER_SIZE) {
+    close(fd);
+    throw std::runtime_error("Invalid frame log " + path + ": too small");
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Failed to map the frame log " + path + ": " +
+                             std::strerror(errno));
+  }
+
+  SegmentHeader header{};
+  std::memcpy(&header, mapping, sizeof(header));
+  if (header.magic != FRAME_LOG_MAGIC || header.version != FRAME_LOG_VERSION ||
+      header.segment != segment || header.size != size) {
+    munmap(mapping, size);
+    throw std::runtime_error("Invalid frame log " + path + ": bad header");
+  }
+
+  close_segment();
+  mapping_ = static_cast<const std::byte *>(mapping);
+  size_ = size;
+  segment_ = segment;
+  offset_ = FRAME_LOG_HEADER_SIZE;
+}
+
+void FrameLogReader::close_segment() {
+  if (mapping_ != nullptr) {
+    munmap(const_cast<std::byte *>(mapping_), size_);
+    mapping_ = nullptr;
+  }
+}
+
+auto FrameLogReader::next() -> std::optional<Record> {
+  while (true) {
+    uint32_t size = offset_ + sizeof(uint32_t) <= size_
+                        ? record_size(mapping_ + offset_)
+                              .load(std::memory_order_acquire)
+                        : FRAME_LOG_NEXT_SEGMENT;
+    if (size == 0) {
+      return std::nullopt;
+    }
+    if (size != FRAME_LOG_NEXT_SEGMENT) {
+      if (offset_ + FRAME_LOG_RECORD_HEADER_SIZE + size > size_) {
+        throw std::runtime_error("Invalid record in the frame log " + path_);
+      }
+      Record record{};
+      std::memcpy(&record.timestamp_ns, mapping_ + offset_ + sizeof(uint64_t),
+                  sizeof(record.timestamp_ns));
+      record.frame = mapping_ + offset_ + FRAME_LOG_RECORD_HEADER_SIZE;
+      record.size = size;
+      offset_ += align_record(FRAME_LOG_RECORD_HEADER_SIZE + size);
+      return record;
+    }
+
+    // The writer created the next segment before pointing to it, unless the
+    // last one ends exactly at its size and the next is not created yet
+    if (access(segment_path(path_, segment_ + 1).c_str(), F_OK) != 0) {
+      return std::nullopt;
+    }
+    open_segment(segment_ + 1);
+  }
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// A log of the frames received by a subscriber is a sequence of segments,
+// the files <path>.<n>, numbered from 0, each preallocated to the same size
+// and mapped in memory. A segment starts with a header:
+//
+//   magic FRAME_LOG_MAGIC (4) | version (2) | reserved (2) | number of the
+//   segment (8) | size of the segment (8) | reserved (8)
+//
+// followed by the records, each aligned to 8 bytes:
+//
+//   size of the frame (4) | reserved (4) | receive timestamp (8) | frame
+//
+// The integers are in the byte order of the host, the log being read where it
+// is written, and the timestamp is in nanoseconds since the epoch. The frame
+// is the whole RESPONSE frame, as serialized by TcpMessage. The size of a
+// record is written last, so a reader of the mapping sees the records whole:
+// a size of 0 is where the writer is, and FRAME_LOG_NEXT_SEGMENT means the
+// records go on in the next segment.
+
+static constexpr uint32_t FRAME_LOG_MAGIC = 0x474c4654; // "TFLG"
+static constexpr uint16_t FRAME_LOG_VERSION = 1;
+static constexpr size_t FRAME_LOG_HEADER_SIZE = 32;
+static constexpr size_t FRAME_LOG_RECORD_HEADER_SIZE = 16;
+static constexpr uint32_t FRAME_LOG_NEXT_SEGMENT = UINT32_MAX;
+
+struct FrameLogConfig {
+  // The path of the segments, without their number
+  std::string path{};
+  // The size of a segment, in bytes
+  size_t segment_bytes{64 << 20};
+  // The number of segments kept, the oldest being removed once a new one is
+  // started
+  size_t segments{4};
+};
+
+/**
+ * @brief Appends the frames received to a log of memory-mapped segments,
+ * without a syscall per frame
+ *
+ * Each segment is preallocated and its pages faulted in before its first
+ * record, so that appending only costs a copy. Once a record does not fit in
+ * the segment, the next one is started, the oldest being removed beyond the
+ * number of segments kept.
+ */
+class FrameLogWriter {
+public:
+  /**
+   * @brief Start the log, at its first segment, replacing the segments of a
+   * previous log with the same path
+   *
+   * @param config The path and the sizes of the log
+   *
+   * @throws std::runtime_error if the segment cannot be created or mapped, or
+   * is too small for a frame
+   */
+  explicit FrameLogWriter(FrameLogConfig config);
+
+  FrameLogWriter(const FrameLogWriter &) = delete;
+  auto operator=(const FrameLogWriter &) -> FrameLogWriter & = delete;
+  ~FrameLogWriter();
+
+  /**
+   * @brief Get room for a frame in the log, to be written there before it is
+   * committed
+   *
+   * @param size The largest size of the frame
+   * @return Where to write the frame
+   *
+   * @throws std::runtime_error if the next segment cannot be created
+   */
+  auto reserve(size_t size) -> std::byte *;
+
+  /**
+   * @brief Publish the frame written where reserve pointed to
+   *
+   * @param timestamp_ns When the frame was received
+   * @param size The size of the frame, at most the one reserved
+   */
+  void commit(uint64_t timestamp_ns, size_t size);
+
+  /**
+   * @brief Append a frame, as reserve and commit
+   *
+   * @throws std::runtime_error if the next segment cannot be created
+   */
+  void append(uint64_t timestamp_ns, const std::byte *frame, size_t size);
+
+private:
+  void open_segment(uint64_t segment);
+  void close_segment();
+
+  FrameLogConfig config_{};
+  uint64_t segment_{};
+  std::byte *mapping_{};
+  // the offset of the next record in the segment
+  size_t offset_{};
+};
+
+/**
+ * @brief Reads the records of a frame log, while it is being written or once
+ * it is complete
+ */
+class FrameLogReader {
+public:
+  // A record of the log, whose frame is valid until the segment is left
+  struct Record {
+    uint64_t timestamp_ns{};
+    const std::byte *frame{};
+    size_t size{};
+  };
+
+  /**
+   * @brief Open a log at one of its segments
+   *
+   * @param path The path of the segments, without their number
+   * @param segment The segment to start at, the oldest one left by default
+   *
+   * @throws std::runtime_error if the segment cannot be opened, or is not a
+   * segment of a frame log
+   */
+  explicit FrameLogReader(std::string path,
+                          std::optional<uint64_t> segment = std::nullopt);
+
+  FrameLogReader(const FrameLogReader &) = delete;
+  auto operator=(const FrameLogReader &) -> FrameLogReader & = delete;
+  ~FrameLogReader();
+
+  /**
+   * @brief Get the next record, going on to the next segment at the end of
+   * one
+   *
+   * @return The record, or std::nullopt if the writer has not written it yet
+   *
+   * @throws std::runtime_error if the next segment cannot be opened, or a
+   * record is not valid
+   */
+  auto next() -> std::optional<Record>;
+
+  // The segment being read
+  auto segment() const -> uint64_t { return segment_; }
+
+  /**
+   * @brief Find the oldest segment of a log
+   *
+   * @param path The path of the segments, without their number
+   * @return The number of the segment, or std::nullopt if there is none
+   */
+  static auto first_segment(const std::string &path)
+      -> std::optional<uint64_t>;
+
+private:
+  void open_segment(uint64_t segment);
+  void close_segment();
+
+  std::string path_{};
+  uint64_t segment_{};
+  const std::byte *mapping_{};
+  size_t size_{};
+  size_t offset_{};
+};
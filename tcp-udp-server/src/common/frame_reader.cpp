@@ -0,0 +1,142 @@
+#include "frame_reader.hpp"
+
+#include "shm_ring.hpp"
+#include "tcp_utils.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+FrameReader::FrameReader(size_t capacity, size_t max_frame_size)
+    : max_frame_size_(max_frame_size) {
+  size_t size = 1;
+  while (size < std::max(capacity, HEADER_SIZE + max_frame_size_)) {
+    size <<= 1;
+  }
+  buffer_.resize(size);
+  mask_ = size - 1;
+}
+
+auto FrameReader::receive(int sockfd) -> size_t {
+  size_t free = buffer_.size() - size();
+  if (free == 0) {
+    return 0;
+  }
+
+  // The free space may wrap around the end of the buffer
+  size_t start = tail_ & mask_;
+  size_t first = std::min(free, buffer_.size() - start);
+  iovec iov[2] = {{buffer_.data() + start, first},
+                  {buffer_.data(), free - first}};
+
+  msghdr msg{};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = free > first ? 2 : 1;
+
+  while (true) {
+    ssize_t received = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+    if (received < 0) {
+      if (errno == EINTR) {
+        // Interrupted by a signal, retry receiving
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      throw TcpTransmissionError("recvmsg() failed with error: " +
+                                 std::string(std::strerror(errno)));
+    } else if (received == 0) {
+      // Connection closed
+      throw TcpConnectionClosed("Connection closed by peer");
+    }
+
+    tail_ += static_cast<size_t>(received);
+    return static_cast<size_t>(received);
+  }
+}
+
+auto FrameReader::receive(ShmRing &ring) -> size_t {
+  // The free space may wrap around the end of the buffer
+  size_t free = buffer_.size() - size();
+  size_t start = tail_ & mask_;
+  size_t first = std::min(free, buffer_.size() - start);
+
+  size_t received = ring.read(buffer_.data() + start, first);
+  if (received == first && free > first) {
+    received += ring.read(buffer_.data(), free - first);
+  }
+  tail_ += received;
+  return received;
+}
+
+auto FrameReader::append(const std::byte *data, size_t size) -> size_t {
+  size = std::min(size, buffer_.size() - this->size());
+
+  size_t start = tail_ & mask_;
+  size_t first = std::min(size, buffer_.size() - start);
+  std::memcpy(buffer_.data() + start, data, first);
+  std::memcpy(buffer_.data(), data + first, size - first);
+
+  tail_ += size;
+  return size;
+}
+
+void FrameReader::copy(std::vector<std::byte> &bytes) const {
+  bytes.resize(size());
+  size_t start = head_ & mask_;
+  size_t first = std::min(bytes.size(), buffer_.size() - start);
+  std::memcpy(bytes.data(), buffer_.data() + start, first);
+  std::memcpy(bytes.data() + first, buffer_.data(), bytes.size() - first);
+}
+
+auto FrameReader::next() -> std::optional<Frame> {
+  Frame frame{};
+  switch (read(frame)) {
+  case Status::READY:
+    return frame;
+  case Status::SIZE_EXCEEDS_LIMIT:
+    throw std::invalid_argument("Invalid TCP message: size exceeds max limit");
+  default:
+    return std::nullopt;
+  }
+}
+
+auto FrameReader::read(Frame &frame) -> Status {
+  if (size() < HEADER_SIZE) {
+    return Status::INCOMPLETE;
+  }
+
+  TcpMessageType type = static_cast<TcpMessageType>(at(0));
+  uint16_t payload_size{};
+  std::byte size_bytes[sizeof(payload_size)] = {at(1), at(2)};
+  std::memcpy(&payload_size, size_bytes, sizeof(payload_size));
+  size_t size = ntoh(payload_size);
+
+  if (size > max_frame_size_) {
+    head_ += HEADER_SIZE;
+    return Status::SIZE_EXCEEDS_LIMIT;
+  }
+  if (this->size() < HEADER_SIZE + size) {
+    return Status::INCOMPLETE;
+  }
+
+  // The payload is copied only if it wraps around the end of the buffer
+  frame.type = type;
+  frame.size = size;
+  size_t start = (head_ + HEADER_SIZE) & mask_;
+  if (start + frame.size <= buffer_.size()) {
+    frame.payload = buffer_.data() + start;
+  } else {
+    size_t first = buffer_.size() - start;
+    scratch_.resize(frame.size);
+    std::memcpy(scratch_.data(), buffer_.data() + start, first);
+    std::memcpy(scratch_.data() + first, buffer_.data(), frame.size - first);
+    frame.payload = scratch_.data();
+  }
+
+  head_ += HEADER_SIZE + frame.size;
+  return Status::READY;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "tcp_proto.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+class ShmRing;
+
+/**
+ * @brief Splits the bytes received on a TCP socket into the frames of
+ * TcpMessage: the type, the size and the payload of each message
+ *
+ * The bytes are received in a ring buffer, as many as are available with a
+ * single recvmsg, without blocking, so that a peer stopping in the middle of a
+ * frame does not stall the reader. The frames are then yielded one at a time,
+ * once they are complete.
+ */
+class FrameReader {
+public:
+  // A frame received, whose payload is only valid until the next call
+  struct Frame {
+    TcpMessageType type{};
+    const std::byte *payload{};
+    size_t size{};
+  };
+
+  // The outcome of read
+  enum class Status : uint8_t {
+    READY = 0,
+    // The frame was not entirely received yet
+    INCOMPLETE,
+    // The size of the frame exceeds the max limit, its header being skipped
+    SIZE_EXCEEDS_LIMIT,
+  };
+
+  // Size of the header of a frame, its type and size
+  static constexpr size_t HEADER_SIZE = sizeof(TcpMessageType) + sizeof(uint16_t);
+
+  /**
+   * @brief Construct a new FrameReader object
+   *
+   * @param capacity The size of the ring buffer, rounded up to a power of 2
+   * holding at least the largest frame
+   * @param max_frame_size The largest payload of a frame
+   */
+  explicit FrameReader(size_t capacity = 4096,
+                       size_t max_frame_size = TcpMessage::MAX_SERIALIZED_SIZE);
+
+  /**
+   * @brief Receive the bytes available on the socket, without blocking
+   *
+   * @param sockfd The socket file descriptor
+   * @return The number of bytes received, 0 if there were none or if the
+   * buffer is full
+   *
+   * @throws TcpConnectionClosed if the peer closed the connection
+   * @throws TcpTransmissionError if the receive fails
+   */
+  auto receive(int sockfd) -> size_t;
+
+  /**
+   * @brief Receive the bytes available in a ShmRing, without syscalls
+   *
+   * @param ring The ring, read by this process
+   * @return The number of bytes received, 0 if there were none or if the
+   * buffer is full
+   */
+  auto receive(ShmRing &ring) -> size_t;
+
+  /**
+   * @brief Add bytes received by the caller
+   *
+   * @param data The bytes
+   * @param size The number of bytes
+   * @return The number of bytes added, less than size if the buffer is full
+   */
+  auto append(const std::byte *data, size_t size) -> size_t;
+
+  /**
+   * @brief Copy the bytes received not yielded as frames yet, as when they are
+   * handed to another reader
+   *
+   * @param bytes Set to the bytes
+   */
+  void copy(std::vector<std::byte> &bytes) const;
+
+  /**
+   * @brief Get the next complete frame
+   *
+   * @return The frame, or std::nullopt if it was not entirely received yet
+   *
+   * @throws std::invalid_argument if the size of the frame exceeds the max
+   * limit, its header being skipped
+   */
+  auto next() -> std::optional<Frame>;
+
+  /**
+   * @brief Get the next complete frame, as next, without throwing
+   *
+   * @param frame The frame, set if it is ready
+   * @return Status::READY, or why there is no frame
+   */
+  auto read(Frame &frame) -> Status;
+
+  // The number of bytes received, not yielded as frames yet
+  auto size() const -> size_t { return tail_ - head_; }
+
+  void clear() { head_ = tail_ = 0; }
+
+private:
+  auto at(size_t offset) const -> std::byte {
+    return buffer_[(head_ + offset) & mask_];
+  }
+
+  std::vector<std::byte> buffer_{};
+  size_t mask_{};
+  size_t max_frame_size_{};
+  // The positions of the first byte not yielded and of the first byte free,
+  // only growing
+  size_t head_{};
+  size_t tail_{};
+  // The payload of a frame wrapping around the end of the buffer
+  std::vector<std::byte> scratch_{};
+};
@@ -0,0 +1,204 @@
+#include "lz4_block.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+constexpr size_t MIN_MATCH = 4;
+// The bytes at the end of a block which are always literals, and those before
+// its end after which no match starts
+constexpr size_t LAST_LITERALS = 5;
+constexpr size_t MFLIMIT = 12;
+constexpr size_t MAX_OFFSET = UINT16_MAX;
+constexpr size_t HASH_BITS = 12;
+// A length of the token continuing in the bytes after it
+constexpr uint8_t RUN_MASK = 15;
+
+auto read32(const std::byte *ptr) -> uint32_t {
+  uint32_t value;
+  std::memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+auto hash(uint32_t sequence) -> size_t {
+  // The multiplier of LZ4, spreading the 4 bytes over the top bits
+  return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// The size of a length of the token, in its continuation bytes
+auto length_size(size_t length) -> size_t {
+  return length < RUN_MASK ? 0 : (length - RUN_MASK) / 255 + 1;
+}
+
+auto write_length(std::byte *dst, size_t length) -> std::byte * {
+  for (length -= RUN_MASK; length >= 255; length -= 255) {
+    *dst++ = std::byte{255};
+  }
+  *dst++ = static_cast<std::byte>(length);
+  return dst;
+}
+
+auto read_length(const std::byte *&src, const std::byte *end) -> size_t {
+  size_t length = 0;
+  uint8_t byte;
+  do {
+    if (src == end) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: truncated length");
+    }
+    byte = static_cast<uint8_t>(*src++);
+    length += byte;
+  } while (byte == 255);
+  return length;
+}
+
+} // namespace
+
+auto lz4_compress(const std::byte *src, size_t src_size, std::byte *dst,
+                  size_t capacity) -> size_t {
+  std::byte *out = dst;
+  std::byte *out_end = dst + capacity;
+  size_t anchor = 0;
+
+  // Writes the literals since the anchor, followed by the match if any
+  auto write_sequence = [&](size_t literals_end, size_t offset,
+                            size_t match_length) {
+    size_t literals = literals_end - anchor;
+    size_t match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+    size_t size = 1 + length_size(literals) + literals +
+                  (match_length > 0 ? 2 + length_size(match_code) : 0);
+    if (size > static_cast<size_t>(out_end - out)) {
+      return false;
+    }
+
+    std::byte *token = out++;
+    *token = static_cast<std::byte>(std::min<size_t>(literals, RUN_MASK) << 4);
+    if (literals >= RUN_MASK) {
+      out = write_length(out, literals);
+    }
+    std::memcpy(out, src + anchor, literals);
+    out += literals;
+    if (match_length == 0) {
+      return true;
+    }
+
+    *out++ = static_cast<std::byte>(offset & 0xff);
+    *out++ = static_cast<std::byte>(offset >> 8);
+    *token |= static_cast<std::byte>(std::min<size_t>(match_code, RUN_MASK));
+    if (match_code >= RUN_MASK) {
+      out = write_length(out, match_code);
+    }
+    return true;
+  };
+
+  if (src_size > MFLIMIT) {
+    // The positions plus 1, 0 for none
+    std::array<uint32_t, size_t{1} << HASH_BITS> table{};
+    size_t match_limit = src_size - LAST_LITERALS;
+    size_t pos = 0;
+    while (pos + MFLIMIT <= src_size) {
+      uint32_t sequence = read32(src + pos);
+      uint32_t &slot = table[hash(sequence)];
+      size_t candidate = slot;
+      slot = static_cast<uint32_t>(pos + 1);
+      if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET ||
+          read32(src + candidate - 1) != sequence) {
+        ++pos;
+        continue;
+      }
+      --candidate;
+
+      size_t length = MIN_MATCH;
+      while (pos + length < match_limit &&
+             src[candidate + length] == src[pos + length]) {
+        ++length;
+      }
+      // Into the literals before it, as far as they repeat too
+      while (pos > anchor && candidate > 0 &&
+             src[pos - 1] == src[candidate - 1]) {
+        --pos;
+        --candidate;
+        ++length;
+      }
+
+      if (!write_sequence(pos, pos - candidate, length)) {
+        return 0;
+      }
+      pos += length;
+      anchor = pos;
+    }
+  }
+
+  if (!write_sequence(src_size, 0, 0)) {
+    return 0;
+  }
+  return out - dst;
+}
+
+auto lz4_decompress(const std::byte *src, size_t src_size, std::byte *dst,
+                    size_t capacity) -> size_t {
+  const std::byte *end = src + src_size;
+  std::byte *out = dst;
+  std::byte *out_end = dst + capacity;
+
+  while (true) {
+    if (src == end) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: truncated sequence");
+    }
+    auto token = static_cast<uint8_t>(*src++);
+
+    size_t literals = token >> 4;
+    if (literals == RUN_MASK) {
+      literals += read_length(src, end);
+    }
+    if (literals > static_cast<size_t>(end - src) ||
+        literals > static_cast<size_t>(out_end - out)) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: literals out of bounds");
+    }
+    std::memcpy(out, src, literals);
+    src += literals;
+    out += literals;
+    if (src == end) {
+      // The last sequence, without a match
+      return out - dst;
+    }
+
+    if (end - src < 2) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: truncated offset");
+    }
+    size_t offset = static_cast<size_t>(src[0]) |
+                    static_cast<size_t>(src[1]) << 8;
+    src += 2;
+    if (offset == 0 || offset > static_cast<size_t>(out - dst)) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: offset out of bounds");
+    }
+
+    size_t length = token & RUN_MASK;
+    if (length == RUN_MASK) {
+      length += read_length(src, end);
+    }
+    length += MIN_MATCH;
+    if (length > static_cast<size_t>(out_end - out)) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: match out of bounds");
+    }
+
+    const std::byte *match = out - offset;
+    if (offset >= length) {
+      std::memcpy(out, match, length);
+      out += length;
+    } else {
+      // The match overlaps the bytes it produces
+      for (size_t i = 0; i < length; ++i) {
+        *out++ = match[i];
+      }
+    }
+  }
+}
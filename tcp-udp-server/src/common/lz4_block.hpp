@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// ##############################################################################
+// # LZ4 block format
+// ##############################################################################
+//
+// The blocks of the LZ4 block format, readable by LZ4_decompress_safe, as a
+// sequence of:
+//
+//   uint8   token: the literal length << 4 | the match length - 4, each 15
+//           continuing in the bytes after it
+//   ...     the bytes added to the literal length, 255 while it continues
+//   ...     the literals
+//   uint16  offset of the match, back from its start, little endian
+//   ...     the bytes added to the match length, 255 while it continues
+//
+// The last sequence only has literals, the last 5 bytes of a block always
+// being literals and the last match starting at least 12 bytes before its end.
+
+/**
+ * @brief Compresses a buffer into an LZ4 block, with a greedy search of the
+ * matches through a hash table of the last position of each 4 bytes
+ *
+ * @param src The bytes to compress
+ * @param src_size The number of bytes to compress
+ * @param dst The buffer to store the block
+ * @param capacity The size of the buffer
+ * @return The size of the block, 0 if it does not fit in the buffer
+ */
+auto lz4_compress(const std::byte *src, size_t src_size, std::byte *dst,
+                  size_t capacity) -> size_t;
+
+/**
+ * @brief Decompresses an LZ4 block
+ *
+ * @param src The block
+ * @param src_size The size of the block
+ * @param dst The buffer to store the decompressed bytes
+ * @param capacity The size of the buffer
+ * @return The number of decompressed bytes
+ *
+ * @throws std::invalid_argument if the block is invalid or decompresses to
+ * more than the capacity
+ */
+auto lz4_decompress(const std::byte *src, size_t src_size, std::byte *dst,
+                    size_t capacity) -> size_t;
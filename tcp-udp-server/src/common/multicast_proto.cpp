@@ -0,0 +1,57 @@
+#include "multicast_proto.hpp"
+
+#include "util.hpp"
+#include <arpa/inet.h>
+#include <charconv>
+#include <cstring>
+#include <string>
+
+void MulticastNack::serialize(const MulticastNack &nack, std::byte *buffer) {
+  write_multicast_seq(nack.first, buffer);
+  uint16_t count = hton(nack.count);
+  std::memcpy(buffer + sizeof(nack.first), &count, sizeof(count));
+}
+
+auto MulticastNack::parse(MulticastNack &nack, const std::byte *buffer,
+                          size_t buffer_size) -> bool {
+  if (buffer_size != SERIALIZED_SIZE) {
+    return false;
+  }
+  nack.first = read_multicast_seq(buffer);
+  uint16_t count{};
+  std::memcpy(&count, buffer + sizeof(nack.first), sizeof(count));
+  nack.count = ntoh(count);
+  return true;
+}
+
+auto read_multicast_seq(const std::byte *buffer) -> uint64_t {
+  uint64_t seq{};
+  std::memcpy(&seq, buffer, sizeof(seq));
+  return ntoh(seq);
+}
+
+void write_multicast_seq(uint64_t seq, std::byte *buffer) {
+  seq = hton(seq);
+  std::memcpy(buffer, &seq, sizeof(seq));
+}
+
+auto parse_endpoint(std::string_view str, sockaddr_in &addr) -> bool {
+  size_t colon = str.rfind(':');
+  if (colon == std::string_view::npos) {
+    return false;
+  }
+
+  uint16_t port{};
+  std::string_view port_str = str.substr(colon + 1);
+  auto [ptr, ec] =
+      std::from_chars(port_str.data(), port_str.data() + port_str.size(), port);
+  if (ec != std::errc{} || ptr != port_str.data() + port_str.size()) {
+    return false;
+  }
+
+  std::string address(str.substr(0, colon));
+  addr = sockaddr_in{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = hton(port);
+  return inet_pton(AF_INET, address.c_str(), &addr.sin_addr) == 1;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <string_view>
+
+// A message multicast to the group is its sequence number, on 8 bytes in
+// network byte order, then its RESPONSE frame, as sent on TCP. The same bytes
+// are the payload of the MULTICAST_DATA frame retransmitting it on TCP.
+static constexpr size_t MULTICAST_SEQ_SIZE = sizeof(uint64_t);
+
+/**
+ * @brief The payload of a MULTICAST_NACK frame, sent by a subscriber missing
+ * multicast messages for the server to retransmit them on TCP
+ */
+struct MulticastNack {
+  // the sequence number of the first message missing
+  uint64_t first{};
+  // the number of consecutive messages missing, from the first
+  uint16_t count{};
+
+  static constexpr size_t SERIALIZED_SIZE = sizeof(first) + sizeof(count);
+
+  /**
+   * @brief Serialize the NACK into a buffer of SERIALIZED_SIZE bytes
+   *
+   * @param nack The NACK to serialize
+   * @param buffer The buffer
+   */
+  static void serialize(const MulticastNack &nack, std::byte *buffer);
+
+  /**
+   * @brief Deserialize a NACK, without throwing
+   *
+   * @param nack The NACK to deserialize into
+   * @param buffer The payload of the frame
+   * @param buffer_size The size of the payload
+   * @return true if the payload is a NACK
+   */
+  [[nodiscard]] static auto parse(MulticastNack &nack, const std::byte *buffer,
+                                  size_t buffer_size) -> bool;
+};
+
+/**
+ * @brief Read the sequence number at the start of a multicast message
+ *
+ * @param buffer The message, of at least MULTICAST_SEQ_SIZE bytes
+ * @return The sequence number
+ */
+auto read_multicast_seq(const std::byte *buffer) -> uint64_t;
+
+/**
+ * @brief Write the sequence number at the start of a multicast message
+ *
+ * @param seq The sequence number
+ * @param buffer The message, of at least MULTICAST_SEQ_SIZE bytes
+ */
+void write_multicast_seq(uint64_t seq, std::byte *buffer);
+
+/**
+ * @brief Parse an IPv4 address and a port, as <address>:<port>
+ *
+ * @param str The string to parse
+ * @param addr The address parsed, in network byte order
+ * @return true if the string is valid
+ */
+[[nodiscard]] auto parse_endpoint(std::string_view str, sockaddr_in &addr)
+    -> bool;
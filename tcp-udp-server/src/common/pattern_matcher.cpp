@@ -0,0 +1,67 @@
+#include "pattern_matcher.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+PatternMatcher::PatternMatcher(const TokenPattern &pattern) {
+  const auto &tokens = pattern.tokens();
+  if (tokens.size() > MAX_TOKENS) {
+    throw std::length_error("Too many tokens to compile the TokenPattern");
+  }
+
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    StateSet state = StateSet{1} << i;
+    bool last = i + 1 == tokens.size();
+
+    if (tokens[i] == TokenInterner::PLUS_ID) {
+      any_ |= state;
+    } else if (tokens[i] == TokenInterner::STAR_ID) {
+      if (last) {
+        // Matches 1 or more tokens, until the end of the topic
+        any_ |= state;
+        loop_ |= state << 1;
+      } else {
+        // Matches 0 or more tokens before the next string token
+        loop_ |= state;
+        skip_ |= state;
+      }
+    } else {
+      auto end = literals_.begin() + literals_size_;
+      auto it = std::find_if(literals_.begin(), end, [&](const auto &literal) {
+        return literal.token == tokens[i];
+      });
+      if (it == end) {
+        *it = Literal{tokens[i], 0};
+        ++literals_size_;
+      }
+      it->states |= state;
+    }
+  }
+
+  accept_ = StateSet{1} << tokens.size();
+}
+
+bool PatternMatcher::matches(const TokenId *topic, size_t size) const {
+  StateSet states = close(1);
+  auto literals_end = literals_.begin() + literals_size_;
+
+  for (size_t i = 0; i < size && states != 0; ++i) {
+    StateSet moving = any_;
+    for (auto it = literals_.begin(); it != literals_end; ++it) {
+      if (it->token == topic[i]) {
+        moving |= it->states;
+        break;
+      }
+    }
+    states = close(((states & moving) << 1) | (states & loop_));
+  }
+
+  return (states & accept_) != 0;
+}
+
+bool PatternMatcher::matches(const TokenPattern &topic) const {
+  if (topic.has_wildcard()) {
+    throw std::invalid_argument(
+        "The TokenPattern to match against contains wildcards");
+  }
+  return matches(topic.tokens().data(), topic.tokens().size());
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "token_pattern.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A TokenPattern compiled into a bit-parallel NFA, matching a topic in
+ * a single pass over its tokens, without allocating
+ *
+ * The state i of the NFA is the position before the i-th token of the
+ * pattern, and the set of the active states is kept in a single 64-bit word.
+ * Each topic token moves the states of the tokens it matches to the next
+ * ones, while the middle '*' wildcards keep their state active (skipping the
+ * token) and the last state stays active after a trailing '*'. So the cost of
+ * a match is linear in the length of the topic, whatever the wildcards.
+ *
+ * The matching rules are those of TokenPattern::matches
+ */
+class PatternMatcher {
+public:
+  using TokenId = TokenPattern::TokenId;
+
+  // The number of states must fit in the bits of a word
+  static constexpr size_t MAX_TOKENS = 63;
+
+  /**
+   * @brief Compile a TokenPattern
+   *
+   * @param pattern The pattern, of at most MAX_TOKENS tokens
+   *
+   * @throws std::length_error if the pattern has too many tokens
+   */
+  explicit PatternMatcher(const TokenPattern &pattern);
+
+  /**
+   * @brief Check if the pattern matches a topic
+   *
+   * @param topic The ids of the tokens of the topic, without wildcards
+   * @param size The number of tokens of the topic
+   * @return true if the pattern matches the topic
+   */
+  bool matches(const TokenId *topic, size_t size) const;
+
+  /**
+   * @brief Check if the pattern matches a topic
+   *
+   * @param topic The topic, without wildcards
+   * @return true if the pattern matches the topic
+   *
+   * @throws std::invalid_argument if the topic contains wildcards
+   */
+  bool matches(const TokenPattern &topic) const;
+
+private:
+  using StateSet = uint64_t;
+
+  // The states of a string token of the pattern
+  struct Literal {
+    TokenId token{};
+    StateSet states{};
+  };
+
+  // Add the states reached without consuming a token, after a middle '*'
+  constexpr StateSet close(StateSet states) const {
+    return states | ((states & skip_) << 1);
+  }
+
+  std::array<Literal, MAX_TOKENS> literals_{};
+  size_t literals_size_{};
+  // The states of the '+' and trailing '*', moving on any token
+  StateSet any_{};
+  // The states staying active on any token: the middle '*' and the final
+  // state after a trailing '*'
+  StateSet loop_{};
+  // The states of the middle '*', which may also match no token
+  StateSet skip_{};
+  StateSet accept_{};
+};
@@ -0,0 +1,138 @@
+#include "pmu_counters.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+struct EventConfig {
+  uint32_t type;
+  uint64_t config;
+  const char *name;
+};
+
+constexpr auto cache_miss(uint64_t cache) -> uint64_t {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// In the order of PmuCounters::Event
+constexpr std::array<EventConfig, PmuCounters::EVENT_COUNT> EVENTS{{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D), "L1D misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses"},
+    {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB), "dTLB misses"},
+}};
+
+auto open_event(const EventConfig &event) -> int {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+} // namespace
+
+PmuCounters::PmuCounters() {
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    fds_[i] = open_event(EVENTS[i]);
+  }
+}
+
+PmuCounters::~PmuCounters() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+auto PmuCounters::available() const -> bool {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PmuCounters::reset() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    }
+  }
+}
+
+void PmuCounters::start() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void PmuCounters::stop() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+auto PmuCounters::read() const -> Counts {
+  Counts counts{};
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    // The count, then the time the event was enabled and that it was counted
+    std::array<uint64_t, 3> data{};
+    if (fds_[i] < 0 ||
+        ::read(fds_[i], data.data(), sizeof(data)) !=
+            static_cast<ssize_t>(sizeof(data)) ||
+        data[2] == 0) {
+      continue;
+    }
+    counts.values[i] = static_cast<double>(data[0]) *
+                       static_cast<double>(data[1]) /
+                       static_cast<double>(data[2]);
+  }
+  return counts;
+}
+
+auto PmuCounters::Counts::describe_per(double units, const char *unit) const
+    -> std::string {
+  std::string out{};
+  std::array<char, 64> buffer{};
+  for (size_t i = 0; i < EVENT_COUNT; ++i) {
+    if (!values[i]) {
+      continue;
+    }
+    std::snprintf(buffer.data(), buffer.size(), "%s%.2f %s",
+                  out.empty() ? "" : ", ", *values[i] / units, EVENTS[i].name);
+    out += buffer.data();
+  }
+  if (out.empty()) {
+    return out;
+  }
+  out += std::string(" per ") + unit;
+  auto cycles = (*this)[Event::CYCLES];
+  auto instructions = (*this)[Event::INSTRUCTIONS];
+  if (cycles && instructions && *cycles > 0) {
+    std::snprintf(buffer.data(), buffer.size(), " (IPC %.2f)",
+                  *instructions / *cycles);
+    out += buffer.data();
+  }
+  return out;
+}
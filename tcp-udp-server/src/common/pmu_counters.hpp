@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <string>
+
+/**
+ * @brief The hardware counters of the calling thread, and of the threads it
+ * starts once they are created, opened with perf_event_open, for the
+ * benchmarks to tell why a change is faster or slower
+ *
+ * Only the user space is counted, which the unprivileged processes may do
+ * with the default perf_event_paranoid. The events the processor or the
+ * kernel cannot count (e.g. in a virtual machine without a virtual PMU) are
+ * left out of the counts.
+ */
+class PmuCounters {
+public:
+  enum class Event {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    DTLB_MISSES,
+    COUNT,
+  };
+
+  static constexpr size_t EVENT_COUNT = static_cast<size_t>(Event::COUNT);
+
+  // The counts of the events, those of the events sharing the PMU with
+  // others being scaled to the whole time they were enabled
+  struct Counts {
+    std::array<std::optional<double>, EVENT_COUNT> values{};
+
+    auto operator[](Event event) const -> std::optional<double> {
+      return values[static_cast<size_t>(event)];
+    }
+
+    /**
+     * @brief Describe the counts divided by the units they were spent on
+     *
+     * @param units The messages or the records the counts were spent on
+     * @param unit The name of the units, e.g. "message"
+     * @return e.g. "412.3 cycles, 501.2 instructions (IPC 1.22), ... per
+     * message", empty if no event was counted
+     */
+    auto describe_per(double units, const char *unit) const -> std::string;
+  };
+
+  PmuCounters();
+  ~PmuCounters();
+
+  PmuCounters(const PmuCounters &) = delete;
+  auto operator=(const PmuCounters &) -> PmuCounters & = delete;
+
+  /**
+   * @brief Check if at least one event can be counted
+   */
+  auto available() const -> bool;
+
+  /**
+   * @brief Zero the counts
+   */
+  void reset();
+
+  /**
+   * @brief Count from now on, adding to the counts since the last reset
+   */
+  void start();
+
+  /**
+   * @brief Stop counting until the next start
+   */
+  void stop();
+
+  /**
+   * @brief Get the counts since the last reset
+   */
+  auto read() const -> Counts;
+
+private:
+  std::array<int, EVENT_COUNT> fds_{};
+};
@@ -1,6 +1,12 @@
 #pragma once
 
+#include "util.hpp"
 #include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <utility>
 #include <variant>
 
 template <typename PayloadVariant, auto... Idx>
@@ -28,3 +34,125 @@ template <typename PayloadVariant> constexpr size_t min_serialized_size() {
   return min_serialized_size_impl<PayloadVariant>(
       std::make_index_sequence<std::variant_size_v<PayloadVariant>>{});
 }
+
+// The type of an alternative of a payload variant, handed to the function
+// building its entry of a payload table
+template <typename Payload> struct PayloadTag {
+  using type = Payload;
+};
+
+template <typename PayloadVariant, typename MakeEntry, auto... Idx>
+constexpr auto payload_table_impl(MakeEntry make_entry,
+                                  std::index_sequence<Idx...>) {
+  return std::array{make_entry(
+      PayloadTag<std::variant_alternative_t<Idx, PayloadVariant>>{})...};
+}
+
+// Helper function to build a table of an entry per alternative of a payload
+// variant, in the order of the variant, so that a payload type read from the
+// wire is dispatched on by indexing the table instead of by a switch
+template <typename PayloadVariant, typename MakeEntry>
+constexpr auto payload_table(MakeEntry make_entry) {
+  return payload_table_impl<PayloadVariant>(
+      make_entry,
+      std::make_index_sequence<std::variant_size_v<PayloadVariant>>{});
+}
+
+template <typename> struct field_traits;
+
+template <typename Struct, typename T> struct field_traits<T Struct::*> {
+  using type = std::remove_cv_t<T>;
+};
+
+/**
+ * @brief The layout of a fixed-size payload, described by pointers to its
+ * members in the order they are serialized, each an unsigned integer in
+ * network byte order
+ *
+ * The offsets of the fields and the size of the payload are computed at
+ * compile time, so that the payload is written and read with a single check
+ * of the buffer size and a copy at a constant offset per field.
+ */
+template <auto... Fields> class FieldLayout {
+  static_assert(sizeof...(Fields) > 0, "A layout needs at least a field");
+  static_assert(
+      (std::is_unsigned_v<typename field_traits<decltype(Fields)>::type> &&
+       ...),
+      "The fields of a layout must be unsigned integers");
+
+public:
+  static constexpr size_t SIZE =
+      (sizeof(typename field_traits<decltype(Fields)>::type) + ...);
+
+  /**
+   * @brief Serialize the fields of a payload into a buffer of at least SIZE
+   * bytes.
+   *
+   * @param payload The payload to serialize.
+   * @param buffer The byte buffer to store the serialized data.
+   */
+  template <typename Struct>
+  static void serialize(const Struct &payload, std::byte *buffer) {
+    serialize_impl(payload, buffer,
+                   std::make_index_sequence<sizeof...(Fields)>{});
+  }
+
+  /**
+   * @brief Deserialize the fields of a payload from a buffer.
+   *
+   * @param payload The payload to deserialize into.
+   * @param buffer The byte buffer containing the serialized data.
+   * @param buffer_size The size of the byte buffer.
+   * @return false if the buffer is smaller than SIZE, the payload being left
+   * unchanged.
+   */
+  template <typename Struct>
+  static auto deserialize(Struct &payload, const std::byte *buffer,
+                          size_t buffer_size) -> bool {
+    if (buffer_size < SIZE) {
+      return false;
+    }
+    deserialize_impl(payload, buffer,
+                     std::make_index_sequence<sizeof...(Fields)>{});
+    return true;
+  }
+
+private:
+  static constexpr auto offsets() {
+    constexpr size_t sizes[] = {
+        sizeof(typename field_traits<decltype(Fields)>::type)...};
+    std::array<size_t, sizeof...(Fields)> result{};
+    size_t offset = 0;
+    for (size_t i = 0; i < result.size(); ++i) {
+      result[i] = offset;
+      offset += sizes[i];
+    }
+    return result;
+  }
+
+  static constexpr std::array<size_t, sizeof...(Fields)> OFFSETS = offsets();
+
+  template <typename Struct, size_t... Idx>
+  static void serialize_impl(const Struct &payload, std::byte *buffer,
+                             std::index_sequence<Idx...>) {
+    (write_field(buffer + OFFSETS[Idx], payload.*Fields), ...);
+  }
+
+  template <typename Struct, size_t... Idx>
+  static void deserialize_impl(Struct &payload, const std::byte *buffer,
+                               std::index_sequence<Idx...>) {
+    (read_field(buffer + OFFSETS[Idx], payload.*Fields), ...);
+  }
+
+  template <typename T> static void write_field(std::byte *buffer, T value) {
+    T value_network = hton(value);
+    std::memcpy(buffer, &value_network, sizeof(value_network));
+  }
+
+  template <typename T>
+  static void read_field(const std::byte *buffer, T &value) {
+    T value_network;
+    std::memcpy(&value_network, buffer, sizeof(value_network));
+    value = ntoh(value_network);
+  }
+};
@@ -0,0 +1,259 @@
+#include "shm_ring.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <netinet/in.h>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * @brief Find the socket at the other end of a TCP connection over the
+ * loopback, in /proc/net/tcp
+ *
+ * @param socket The end of the connection of this process
+ * @return The inode of the other end, or 0 if the connection is not over the
+ * loopback or the other end is not found
+ */
+auto loopback_peer_inode(int socket) -> unsigned long {
+  sockaddr_in local{};
+  sockaddr_in peer{};
+  socklen_t local_len = sizeof(local);
+  socklen_t peer_len = sizeof(peer);
+  if (getsockname(socket, reinterpret_cast<sockaddr *>(&local), &local_len) <
+          0 ||
+      getpeername(socket, reinterpret_cast<sockaddr *>(&peer), &peer_len) <
+          0 ||
+      peer.sin_family != AF_INET ||
+      (ntohl(peer.sin_addr.s_addr) >> 24) != IN_LOOPBACKNET) {
+    return 0;
+  }
+
+  // The addresses are written as the hex of their 32-bit value, the ports as
+  // host order numbers, the other end having the local and remote ones swapped
+  std::ifstream file("/proc/net/tcp");
+  std::string line;
+  std::getline(file, line);
+  while (std::getline(file, line)) {
+    unsigned int local_address = 0;
+    unsigned int local_port = 0;
+    unsigned int remote_address = 0;
+    unsigned int remote_port = 0;
+    unsigned long inode = 0;
+    if (std::sscanf(line.c_str(),
+                    " %*u: %x:%x %x:%x %*x %*x:%*x %*x:%*x %*x %*u %*u %lu",
+                    &local_address, &local_port, &remote_address, &remote_port,
+                    &inode) == 5 &&
+        local_address == peer.sin_addr.s_addr &&
+        local_port == ntohs(peer.sin_port) &&
+        remote_address == local.sin_addr.s_addr &&
+        remote_port == ntohs(local.sin_port)) {
+      return inode;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Check whether a process holds a socket among its file descriptors
+ *
+ * @param pid The process
+ * @param inode The inode of the socket
+ */
+auto holds_socket(pid_t pid, unsigned long inode) -> bool {
+  std::string directory = "/proc/" + std::to_string(pid) + "/fd";
+  DIR *dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+  std::string expected = "socket:[" + std::to_string(inode) + "]";
+  std::string path;
+  char target[64];
+  bool found = false;
+  while (const dirent *entry = readdir(dir)) {
+    path = directory + "/" + entry->d_name;
+    ssize_t size = readlink(path.c_str(), target, sizeof(target));
+    if (size > 0 && std::string_view(target, static_cast<size_t>(size)) ==
+                        expected) {
+      found = true;
+      break;
+    }
+  }
+  closedir(dir);
+  return found;
+}
+
+} // namespace
+
+auto ShmRing::create(size_t capacity) -> std::unique_ptr<ShmRing> {
+  capacity = std::max<size_t>(capacity, DATA_OFFSET);
+  capacity = size_t{1} << (64 - __builtin_clzll(capacity - 1));
+
+  int fd = memfd_create("shm_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create the memfd of a ring: " +
+                             std::string(std::strerror(errno)));
+  }
+  size_t mapping_size = DATA_OFFSET + capacity;
+  if (ftruncate(fd, static_cast<off_t>(mapping_size)) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+    close(fd);
+    throw std::runtime_error("Failed to size the memfd of a ring: " +
+                             std::string(std::strerror(errno)));
+  }
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    throw std::runtime_error("Failed to map the memfd of a ring: " +
+                             std::string(std::strerror(errno)));
+  }
+
+  auto *header = new (mapping) Header{};
+  header->magic = MAGIC;
+  header->capacity = capacity;
+  return std::unique_ptr<ShmRing>(new ShmRing(fd, mapping, mapping_size));
+}
+
+auto ShmRing::open(pid_t pid, int fd, int socket)
+    -> std::unique_ptr<ShmRing> {
+  // Otherwise, any client could write into the memfd of any process of the
+  // host the writer can open
+  unsigned long peer_inode = loopback_peer_inode(socket);
+  if (peer_inode == 0) {
+    throw std::runtime_error("The reader is not connected over the loopback");
+  }
+  if (!holds_socket(pid, peer_inode)) {
+    throw std::runtime_error("The process " + std::to_string(pid) +
+                             " does not hold the connection of the reader");
+  }
+
+  std::string path =
+      "/proc/" + std::to_string(pid) + "/fd/" + std::to_string(fd);
+  int ring_fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (ring_fd < 0) {
+    throw std::runtime_error("Failed to open the ring " + path + ": " +
+                             std::strerror(errno));
+  }
+
+  // Unless it cannot shrink, the memory mapped could vanish
+  if ((fcntl(ring_fd, F_GET_SEALS) & F_SEAL_SHRINK) == 0) {
+    close(ring_fd);
+    throw std::runtime_error("Invalid ring " + path + ": not sealed");
+  }
+  struct stat st {};
+  if (fstat(ring_fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < DATA_OFFSET + DATA_OFFSET) {
+    close(ring_fd);
+    throw std::runtime_error("Invalid ring " + path + ": too small");
+  }
+  auto mapping_size = static_cast<size_t>(st.st_size);
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ring_fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(ring_fd);
+    throw std::runtime_error("Failed to map the ring " + path + ": " +
+                             std::strerror(errno));
+  }
+
+  // The header is trusted only if it describes the whole memfd
+  const auto *header = static_cast<const Header *>(mapping);
+  uint64_t capacity = header->capacity;
+  if (header->magic != MAGIC || capacity == 0 ||
+      (capacity & (capacity - 1)) != 0 ||
+      DATA_OFFSET + capacity != mapping_size) {
+    munmap(mapping, mapping_size);
+    close(ring_fd);
+    throw std::runtime_error("Invalid ring " + path + ": bad header");
+  }
+  return std::unique_ptr<ShmRing>(
+      new ShmRing(ring_fd, mapping, mapping_size));
+}
+
+ShmRing::ShmRing(int fd, void *mapping, size_t mapping_size)
+    : fd_(fd), mapping_(mapping), mapping_size_(mapping_size),
+      header_(static_cast<Header *>(mapping)),
+      data_(static_cast<std::byte *>(mapping) + DATA_OFFSET),
+      mask_(mapping_size - DATA_OFFSET - 1) {}
+
+ShmRing::~ShmRing() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+auto ShmRing::write(const std::byte *data, size_t size) -> size_t {
+  uint64_t tail = position_;
+  uint64_t used = tail - header_->head.load(std::memory_order_acquire);
+  size = used > mask_ + 1 ? 0 : std::min<size_t>(size, mask_ + 1 - used);
+
+  size_t start = tail & mask_;
+  size_t first = std::min<size_t>(size, mask_ + 1 - start);
+  std::memcpy(data_ + start, data, first);
+  std::memcpy(data_, data + first, size - first);
+
+  // Ordered with the check of the flag of the reader, by wake_reader
+  position_ = tail + size;
+  header_->tail.store(position_, std::memory_order_seq_cst);
+  return size;
+}
+
+auto ShmRing::wait_for_space() -> bool {
+  header_->writer_waiting.store(1, std::memory_order_seq_cst);
+  if (position_ - header_->head.load(std::memory_order_seq_cst) <= mask_) {
+    header_->writer_waiting.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+auto ShmRing::wake_reader() -> bool {
+  return header_->reader_waiting.load(std::memory_order_seq_cst) != 0 &&
+         header_->reader_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+}
+
+auto ShmRing::read(std::byte *data, size_t size) -> size_t {
+  uint64_t head = position_;
+  uint64_t tail = header_->tail.load(std::memory_order_acquire);
+  size = std::min<size_t>(size, tail - head);
+
+  size_t start = head & mask_;
+  size_t first = std::min<size_t>(size, mask_ + 1 - start);
+  std::memcpy(data, data_ + start, first);
+  std::memcpy(data + first, data_, size - first);
+
+  // Ordered with the check of the flag of the writer, by wake_writer
+  position_ = head + size;
+  header_->head.store(position_, std::memory_order_seq_cst);
+  return size;
+}
+
+auto ShmRing::wait_for_data() -> bool {
+  header_->reader_waiting.store(1, std::memory_order_seq_cst);
+  if (header_->tail.load(std::memory_order_seq_cst) != position_) {
+    header_->reader_waiting.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+auto ShmRing::wake_writer() -> bool {
+  return header_->writer_waiting.load(std::memory_order_seq_cst) != 0 &&
+         header_->writer_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+}
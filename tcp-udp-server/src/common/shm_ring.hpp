@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sys/types.h>
+
+/**
+ * @brief Single-producer single-consumer ring of bytes in a memfd, shared by
+ * the server, writing the frames of a subscriber, and the subscriber, reading
+ * them without syscalls
+ *
+ * The memfd is created by the reader, and opened by the writer through
+ * /proc/<pid>/fd, since a file descriptor cannot be passed over TCP. The
+ * writer only opens it for a reader connected over the loopback whose process
+ * holds the other end of the connection, so that a client cannot name the
+ * ring of another process. The
+ * positions of both sides only grow, the free space being the capacity minus
+ * their difference. A side waiting for the other, the reader for data or the
+ * writer for space, raises its flag and checks again before sleeping, the
+ * other side sending it a wakeup only if it finds the flag raised, so the
+ * wakeups are rare while both are busy.
+ *
+ * The writer does not trust the reader: it keeps its own position, treats a
+ * ring whose positions are inconsistent as full, and requires the memfd to be
+ * sealed against shrinking, so that the reader cannot make it fault.
+ */
+class ShmRing {
+public:
+  // The size of a ring, unless the reader asks for another power of 2
+  static constexpr size_t DEFAULT_CAPACITY = 1 << 20;
+
+  /**
+   * @brief Create a ring in a new memfd, for the reader
+   *
+   * @param capacity The size of the data, rounded up to a power of 2
+   *
+   * @throws std::runtime_error if the memfd cannot be created or mapped
+   */
+  static auto create(size_t capacity = DEFAULT_CAPACITY)
+      -> std::unique_ptr<ShmRing>;
+
+  /**
+   * @brief Map the ring created by another process, for the writer
+   *
+   * @param pid The process of the reader
+   * @param fd The memfd of the ring in that process
+   * @param socket The TCP connection of the writer to the reader, whose other
+   * end the process must hold
+   *
+   * @throws std::runtime_error if the connection is not a loopback one of the
+   * process, or if the memfd cannot be opened, or does not hold a sealed ring
+   */
+  static auto open(pid_t pid, int fd, int socket) -> std::unique_ptr<ShmRing>;
+
+  ShmRing(const ShmRing &) = delete;
+  auto operator=(const ShmRing &) -> ShmRing & = delete;
+  ~ShmRing();
+
+  // The memfd of the ring
+  auto fd() const -> int { return fd_; }
+
+  /**
+   * @brief Copy bytes into the ring, as many as it has room for
+   *
+   * @param data The bytes
+   * @param size The number of bytes
+   * @return The number of bytes copied
+   */
+  auto write(const std::byte *data, size_t size) -> size_t;
+
+  /**
+   * @brief Wait for the reader to free some space, once the ring is full
+   *
+   * @return true if the writer must wait for a wakeup, false if space was
+   * freed meanwhile
+   */
+  auto wait_for_space() -> bool;
+
+  /**
+   * @brief Check whether the reader must be woken up, after a write
+   *
+   * @return true once per time the reader waited for data
+   */
+  auto wake_reader() -> bool;
+
+  /**
+   * @brief Copy bytes out of the ring, as many as it holds
+   *
+   * @param data The buffer to copy to
+   * @param size The size of the buffer
+   * @return The number of bytes copied
+   */
+  auto read(std::byte *data, size_t size) -> size_t;
+
+  /**
+   * @brief Wait for the writer to write some data, once the ring is empty
+   *
+   * @return true if the reader must wait for a wakeup, false if data was
+   * written meanwhile
+   */
+  auto wait_for_data() -> bool;
+
+  /**
+   * @brief Check whether the writer must be woken up, after a read
+   *
+   * @return true once per time the writer waited for space
+   */
+  auto wake_writer() -> bool;
+
+private:
+  // The start of the memfd, the data following it
+  struct Header {
+    uint64_t magic{};
+    uint64_t capacity{};
+    // the positions, on their own cache lines
+    alignas(64) std::atomic<uint64_t> tail{};
+    alignas(64) std::atomic<uint64_t> head{};
+    // the sides waiting for a wakeup
+    alignas(64) std::atomic<uint32_t> reader_waiting{};
+    std::atomic<uint32_t> writer_waiting{};
+  };
+
+  static constexpr uint64_t MAGIC = 0x676e6972206d6873; // "shm ring"
+  static constexpr size_t DATA_OFFSET = 4096;
+
+  ShmRing(int fd, void *mapping, size_t mapping_size);
+
+  int fd_{-1};
+  void *mapping_{};
+  size_t mapping_size_{};
+  Header *header_{};
+  std::byte *data_{};
+  uint64_t mask_{};
+  // the position of this side, as written to the header
+  uint64_t position_{};
+};
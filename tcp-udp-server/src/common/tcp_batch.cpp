@@ -0,0 +1,118 @@
+#include "tcp_batch.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+auto serialize_varint(uint32_t value, std::byte *buffer) -> size_t {
+  size_t size = 0;
+  while (value >= 0x80) {
+    buffer[size++] = static_cast<std::byte>(value | 0x80);
+    value >>= 7;
+  }
+  buffer[size++] = static_cast<std::byte>(value);
+  return size;
+}
+
+auto deserialize_varint(const std::byte *&buffer, const std::byte *end)
+    -> uint32_t {
+  uint32_t value = 0;
+  for (size_t i = 0; i < VARINT_MAX_SIZE; ++i) {
+    if (buffer == end) {
+      throw std::invalid_argument(
+          "Failed to deserialize varint: buffer size is too small");
+    }
+    auto byte = static_cast<uint8_t>(*buffer++);
+    value |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  throw std::invalid_argument("Failed to deserialize varint: too long");
+}
+
+void TcpBatchReader::next(TcpResponse &response, const std::byte *&buffer,
+                          const std::byte *end) {
+  auto require = [&](size_t size) {
+    if (static_cast<size_t>(end - buffer) < size) {
+      throw std::invalid_argument(
+          "Failed to deserialize tcp response batch: buffer size is too small");
+    }
+  };
+
+  uint32_t key = deserialize_varint(buffer, end);
+  uint32_t topic_id = key >> 1;
+  if (key & 1) {
+    require(sizeof(response.topic_size));
+    memcpy(&response.topic_size, buffer, sizeof(response.topic_size));
+    buffer += sizeof(response.topic_size);
+    if (response.topic_size > TCP_RESP_TOPIC_MAX_SIZE) {
+      throw std::invalid_argument("Failed to deserialize tcp response batch: "
+                                  "topic size exceeds maximum limit");
+    }
+    require(response.topic_size);
+    memcpy(response.topic.data(), buffer, response.topic_size);
+    buffer += response.topic_size;
+
+    if (topic_id > TCP_BATCH_MAX_TOPIC_ID) {
+      throw std::invalid_argument(
+          "Failed to deserialize tcp response batch: invalid topic ID");
+    } else if (topic_id > 0) {
+      if (topics_.size() < topic_id) {
+        topics_.resize(topic_id);
+      }
+      topics_[topic_id - 1].assign(response.topic.data(), response.topic_size);
+    }
+  } else {
+    if (topic_id == 0 || topic_id > topics_.size()) {
+      throw std::invalid_argument(
+          "Failed to deserialize tcp response batch: unknown topic ID");
+    }
+    const auto &topic = topics_[topic_id - 1];
+    memcpy(response.topic.data(), topic.data(), topic.size());
+    response.topic_size = topic.size();
+  }
+  response.topic[response.topic_size] = '\0';
+
+  TcpResponsePayloadType payload_type{};
+  require(sizeof(response.udp_client_ip) + sizeof(response.udp_client_port) +
+          sizeof(payload_type));
+  memcpy(&response.udp_client_ip, buffer, sizeof(response.udp_client_ip));
+  buffer += sizeof(response.udp_client_ip);
+  memcpy(&response.udp_client_port, buffer, sizeof(response.udp_client_port));
+  buffer += sizeof(response.udp_client_port);
+  memcpy(&payload_type, buffer, sizeof(payload_type));
+  buffer += sizeof(payload_type);
+
+  auto buffer_size = static_cast<size_t>(end - buffer);
+  switch (payload_type) {
+  case TcpResponsePayloadType::INT: {
+    auto &payload = response.payload.emplace<TcpResponsePayloadInt>();
+    TcpResponsePayloadInt::deserialize(payload, buffer, buffer_size);
+    buffer += payload.serialized_size();
+    break;
+  }
+  case TcpResponsePayloadType::SHORT_REAL: {
+    auto &payload = response.payload.emplace<TcpResponsePayloadShortReal>();
+    TcpResponsePayloadShortReal::deserialize(payload, buffer, buffer_size);
+    buffer += payload.serialized_size();
+    break;
+  }
+  case TcpResponsePayloadType::FLOAT: {
+    auto &payload = response.payload.emplace<TcpResponsePayloadFloat>();
+    TcpResponsePayloadFloat::deserialize(payload, buffer, buffer_size);
+    buffer += payload.serialized_size();
+    break;
+  }
+  case TcpResponsePayloadType::STRING: {
+    uint32_t value_size = deserialize_varint(buffer, end);
+    require(value_size);
+    auto &payload = response.payload.emplace<TcpResponsePayloadString>();
+    payload.set(reinterpret_cast<const char *>(buffer), value_size);
+    buffer += value_size;
+    break;
+  }
+  default:
+    throw std::invalid_argument(
+        "Failed to deserialize tcp response batch: unknown payload type");
+  }
+}
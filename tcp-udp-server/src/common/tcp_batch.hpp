@@ -0,0 +1,86 @@
+#pragma once
+
+#include "tcp_proto.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// ##############################################################################
+// # Protocol v2
+// ##############################################################################
+//
+// A subscriber connecting with TCP_CONNECT_PROTOCOL_V2 may get its responses
+// batched in the frames of TcpMessageType::RESPONSE_BATCH, whose payload is a
+// sequence of entries:
+//
+//   varint  topic key: the ID of the topic << 1, | 1 if the topic follows
+//   uint8   topic size, then the topic, only if the key says so
+//   uint32  IP of the UDP client, network byte order
+//   uint16  port of the UDP client, network byte order
+//   uint8   TcpResponsePayloadType
+//   ...     INT, SHORT_REAL, FLOAT payload as in TcpResponse, or the varint
+//           size of the STRING followed by its bytes
+//
+// A topic is sent in full with its first delivery, along with the ID its next
+// deliveries refer to. The ID 0 is never assigned: its topic always follows.
+// The varints are little endian base 128, 7 bits per byte.
+//
+// A subscriber also connecting with TCP_CONNECT_COMPRESSION may get the
+// batches in the frames of TcpMessageType::RESPONSE_BATCH_LZ4 instead:
+//
+//   uint16  size of the payload of the RESPONSE_BATCH, network byte order
+//   ...     the payload, compressed in an LZ4 block, lz4_block.hpp
+
+// The largest frame of a batch, whose size is 16 bits
+static constexpr size_t TCP_BATCH_MAX_SIZE = UINT16_MAX;
+// The largest topic ID, the topics delivered once these are all assigned
+// being sent in full each time
+static constexpr uint32_t TCP_BATCH_MAX_TOPIC_ID = 1 << 16;
+// The largest varint of a 32 bit value
+static constexpr size_t VARINT_MAX_SIZE = 5;
+
+/**
+ * @brief Serializes a varint into a byte buffer, of at least VARINT_MAX_SIZE
+ *
+ * @param value The value to serialize
+ * @param buffer The byte buffer to store the serialized data
+ * @return The number of bytes written
+ */
+auto serialize_varint(uint32_t value, std::byte *buffer) -> size_t;
+
+/**
+ * @brief Deserializes a varint, advancing the buffer past it
+ *
+ * @param buffer The byte buffer containing the serialized data, advanced
+ * @param end The end of the byte buffer
+ * @return The value
+ *
+ * @throws std::invalid_argument if the varint is truncated or too long
+ */
+auto deserialize_varint(const std::byte *&buffer, const std::byte *end)
+    -> uint32_t;
+
+/**
+ * @brief Reads the responses of the RESPONSE_BATCH frames of a connection,
+ * remembering the topics they define
+ */
+class TcpBatchReader {
+public:
+  /**
+   * @brief Deserializes the next response of a batch
+   *
+   * @param response The response to deserialize into
+   * @param buffer The byte buffer of the batch, advanced past the response
+   * @param end The end of the batch
+   *
+   * @throws std::invalid_argument if the response is invalid, the rest of the
+   * batch being unreadable
+   */
+  void next(TcpResponse &response, const std::byte *&buffer,
+            const std::byte *end);
+
+private:
+  // the topics by their ID, minus 1
+  std::vector<std::string> topics_{};
+};
@@ -1,8 +1,9 @@
 #include "tcp_proto.hpp"
 #include "util.hpp"
-#include <cmath>
+#include <charconv>
 #include <cstring>
 #include <stdexcept>
+#include <string>
 #include <variant>
 
 // ##############################################################################
@@ -10,6 +11,34 @@
 // ##############################################################################
 
 namespace {
+// Append the decimal digits of a number
+void append_digits(std::string &out, uint32_t value) {
+  std::array<char, 10> digits{};
+  auto [end, ec] = std::to_chars(digits.begin(), digits.end(), value);
+  out.append(digits.data(), end);
+}
+
+// Append the number value * 10^-exponent, with exactly exponent decimals,
+// from its digits, as printf("%.*f") would
+void append_decimal(std::string &out, uint32_t value, uint8_t exponent) {
+  std::array<char, 10> digits{};
+  auto [end, ec] = std::to_chars(digits.begin(), digits.end(), value);
+  size_t size = static_cast<size_t>(end - digits.data());
+  if (exponent == 0) {
+    out.append(digits.data(), size);
+    return;
+  }
+  if (size > exponent) {
+    out.append(digits.data(), size - exponent);
+    out += '.';
+    out.append(digits.data() + size - exponent, exponent);
+    return;
+  }
+  out += "0.";
+  out.append(exponent - size, '0');
+  out.append(digits.data(), size);
+}
+
 template <typename V> void serialize_variant(V &&variant, std::byte *buffer) {
   std::visit(
       [&buffer](auto &&arg) {
@@ -24,6 +53,21 @@ template <typename V> void serialize_variant(V &&variant, std::byte *buffer) {
 // # TcpRequest implementations
 // ####################################################################
 
+auto to_string(TcpParseError error) -> const char * {
+  switch (error) {
+  case TcpParseError::NONE:
+    return "none";
+  case TcpParseError::TOO_SHORT:
+    return "buffer size is too small";
+  case TcpParseError::SIZE_EXCEEDS_LIMIT:
+    return "size exceeds maximum limit";
+  case TcpParseError::UNKNOWN_TYPE:
+    return "unknown type";
+  default:
+    return "unknown error";
+  }
+}
+
 void TcpRequestPayloadId::set(const char *id_data, size_t size) {
   if (size > TCP_CLIENT_ID_MAX_SIZE) {
     throw std::invalid_argument("ID size exceeds maximum limit");
@@ -44,14 +88,26 @@ void TcpRequestPayloadId::serialize(const TcpRequestPayloadId &payload,
   buffer += sizeof(cast_id_size);
 
   memcpy(buffer, payload.id.data(), payload.id_size);
+  buffer += payload.id_size;
+
+  if (payload.flags != 0) {
+    memcpy(buffer, &payload.flags, sizeof(payload.flags));
+    buffer += sizeof(payload.flags);
+  }
+
+  if (payload.flags & TCP_CONNECT_SHM) {
+    uint32_t shm_pid = hton(payload.shm_pid);
+    uint32_t shm_fd = hton(payload.shm_fd);
+    memcpy(buffer, &shm_pid, sizeof(shm_pid));
+    memcpy(buffer + sizeof(shm_pid), &shm_fd, sizeof(shm_fd));
+  }
 }
 
-void TcpRequestPayloadId::deserialize(TcpRequestPayloadId &payload,
-                                      const std::byte *buffer,
-                                      size_t buffer_size) {
+auto TcpRequestPayloadId::parse(TcpRequestPayloadId &payload,
+                                const std::byte *buffer,
+                                size_t buffer_size) noexcept -> TcpParseError {
   if (buffer_size < sizeof(uint8_t)) {
-    throw std::invalid_argument(
-        "Failed to deserialize tcp request ID size: buffer size is too small");
+    return TcpParseError::TOO_SHORT;
   }
 
   uint8_t id_size{};
@@ -60,17 +116,39 @@ void TcpRequestPayloadId::deserialize(TcpRequestPayloadId &payload,
   buffer_size -= sizeof(id_size);
 
   if (id_size > TCP_CLIENT_ID_MAX_SIZE) {
-    throw std::invalid_argument(
-        "Failed to deserialize tcp request ID: ID size exceeds maximum limit");
+    return TcpParseError::SIZE_EXCEEDS_LIMIT;
   }
   if (id_size > buffer_size) {
-    throw std::invalid_argument(
-        "Failed to deserialize tcp request ID data: buffer size is too small");
+    return TcpParseError::TOO_SHORT;
   }
 
   memcpy(payload.id.data(), buffer, id_size);
   payload.id[id_size] = '\0';
   payload.id_size = id_size;
+  buffer += id_size;
+  buffer_size -= id_size;
+
+  // The flags are optional, none being set otherwise
+  payload.flags = 0;
+  if (buffer_size >= sizeof(payload.flags)) {
+    memcpy(&payload.flags, buffer, sizeof(payload.flags));
+    buffer += sizeof(payload.flags);
+    buffer_size -= sizeof(payload.flags);
+  }
+
+  payload.shm_pid = payload.shm_fd = 0;
+  if (payload.flags & TCP_CONNECT_SHM) {
+    uint32_t shm_pid{};
+    uint32_t shm_fd{};
+    if (buffer_size < sizeof(shm_pid) + sizeof(shm_fd)) {
+      return TcpParseError::TOO_SHORT;
+    }
+    memcpy(&shm_pid, buffer, sizeof(shm_pid));
+    memcpy(&shm_fd, buffer + sizeof(shm_pid), sizeof(shm_fd));
+    payload.shm_pid = ntoh(shm_pid);
+    payload.shm_fd = ntoh(shm_fd);
+  }
+  return TcpParseError::NONE;
 }
 
 void TcpRequestPayloadTopic::set(const char *topic_data, size_t size) {
@@ -81,6 +159,22 @@ void TcpRequestPayloadTopic::set(const char *topic_data, size_t size) {
   topic_size = size;
 }
 
+void TcpRequestPayloadTopic::set_filter(const char *filter_data, size_t size) {
+  if (size > TCP_REQ_FILTER_MAX_SIZE) {
+    throw std::invalid_argument("FILTER size exceeds maximum limit");
+  }
+  memcpy(filter.data(), filter_data, size);
+  filter[size] = '\0';
+  filter_size = size;
+  flags |= TCP_SUBSCRIBE_FILTER;
+}
+
+void TcpRequestPayloadTopic::set_limit(uint32_t rate, uint16_t every) {
+  max_rate = rate;
+  sample_every = every;
+  flags |= TCP_SUBSCRIBE_LIMIT;
+}
+
 void TcpRequestPayloadTopic::serialize(const TcpRequestPayloadTopic &payload,
                                        std::byte *buffer) {
   if (payload.topic_size > TCP_RESP_TOPIC_MAX_SIZE) {
@@ -93,14 +187,38 @@ void TcpRequestPayloadTopic::serialize(const TcpRequestPayloadTopic &payload,
   buffer += sizeof(cast_topic_size);
 
   memcpy(buffer, payload.topic.data(), payload.topic_size);
+  buffer += payload.topic_size;
+
+  if (payload.flags != 0) {
+    memcpy(buffer, &payload.flags, sizeof(payload.flags));
+    buffer += sizeof(payload.flags);
+  }
+
+  if (payload.flags & TCP_SUBSCRIBE_FILTER) {
+    if (payload.filter_size > TCP_REQ_FILTER_MAX_SIZE) {
+      throw std::invalid_argument(
+          "Failed to serialize filter: size exceeds maximum limit");
+    }
+    memcpy(buffer, &payload.filter_size, sizeof(payload.filter_size));
+    buffer += sizeof(payload.filter_size);
+    memcpy(buffer, payload.filter.data(), payload.filter_size);
+    buffer += payload.filter_size;
+  }
+
+  if (payload.flags & TCP_SUBSCRIBE_LIMIT) {
+    uint32_t max_rate = hton(payload.max_rate);
+    uint16_t sample_every = hton(payload.sample_every);
+    memcpy(buffer, &max_rate, sizeof(max_rate));
+    memcpy(buffer + sizeof(max_rate), &sample_every, sizeof(sample_every));
+  }
 }
 
-void TcpRequestPayloadTopic::deserialize(TcpRequestPayloadTopic &topic,
-                                         const std::byte *buffer,
-                                         size_t buffer_size) {
+auto TcpRequestPayloadTopic::parse(TcpRequestPayloadTopic &topic,
+                                   const std::byte *buffer,
+                                   size_t buffer_size) noexcept
+    -> TcpParseError {
   if (buffer_size < sizeof(uint8_t)) {
-    throw std::invalid_argument(
-        "Failed to deserialize topic size: buffer size is too small");
+    return TcpParseError::TOO_SHORT;
   }
 
   uint8_t topic_size{};
@@ -109,17 +227,130 @@ void TcpRequestPayloadTopic::deserialize(TcpRequestPayloadTopic &topic,
   buffer_size -= sizeof(topic_size);
 
   if (topic_size > TCP_RESP_TOPIC_MAX_SIZE) {
-    throw std::invalid_argument(
-        "Failed to deserialize topic: topic size exceeds maximum limit");
+    return TcpParseError::SIZE_EXCEEDS_LIMIT;
   }
   if (topic_size > buffer_size) {
-    throw std::invalid_argument(
-        "Failed to deserialize topic data: buffer size is too small");
+    return TcpParseError::TOO_SHORT;
   }
 
   memcpy(topic.topic.data(), buffer, topic_size);
   topic.topic[topic_size] = '\0';
   topic.topic_size = topic_size;
+  buffer += topic_size;
+  buffer_size -= topic_size;
+
+  // The flags are optional, none being set otherwise
+  topic.flags = 0;
+  topic.filter_size = 0;
+  topic.max_rate = 0;
+  topic.sample_every = 0;
+  if (buffer_size < sizeof(topic.flags)) {
+    return TcpParseError::NONE;
+  }
+  memcpy(&topic.flags, buffer, sizeof(topic.flags));
+  buffer += sizeof(topic.flags);
+  buffer_size -= sizeof(topic.flags);
+
+  if (topic.flags & TCP_SUBSCRIBE_FILTER) {
+    uint8_t filter_size{};
+    if (buffer_size < sizeof(filter_size)) {
+      return TcpParseError::TOO_SHORT;
+    }
+    memcpy(&filter_size, buffer, sizeof(filter_size));
+    buffer += sizeof(filter_size);
+    buffer_size -= sizeof(filter_size);
+
+    if (filter_size > TCP_REQ_FILTER_MAX_SIZE) {
+      return TcpParseError::SIZE_EXCEEDS_LIMIT;
+    }
+    if (filter_size > buffer_size) {
+      return TcpParseError::TOO_SHORT;
+    }
+    memcpy(topic.filter.data(), buffer, filter_size);
+    topic.filter[filter_size] = '\0';
+    topic.filter_size = filter_size;
+    buffer += filter_size;
+    buffer_size -= filter_size;
+  }
+
+  if (topic.flags & TCP_SUBSCRIBE_LIMIT) {
+    uint32_t max_rate{};
+    uint16_t sample_every{};
+    if (buffer_size < sizeof(max_rate) + sizeof(sample_every)) {
+      return TcpParseError::TOO_SHORT;
+    }
+    memcpy(&max_rate, buffer, sizeof(max_rate));
+    memcpy(&sample_every, buffer + sizeof(max_rate), sizeof(sample_every));
+    topic.max_rate = ntoh(max_rate);
+    topic.sample_every = ntoh(sample_every);
+  }
+  return TcpParseError::NONE;
+}
+
+bool TcpRequestPayloadTopics::add(const char *topic_data, size_t size) {
+  if (size > TCP_RESP_TOPIC_MAX_SIZE) {
+    throw std::invalid_argument("TOPIC size exceeds maximum limit");
+  }
+  if (topics_size + sizeof(uint8_t) + size > TCP_REQ_TOPICS_MAX_SIZE) {
+    return false;
+  }
+
+  topics[topics_size] = static_cast<char>(size);
+  memcpy(topics.data() + topics_size + sizeof(uint8_t), topic_data, size);
+  topics_size += sizeof(uint8_t) + size;
+  return true;
+}
+
+void TcpRequestPayloadTopics::serialize(const TcpRequestPayloadTopics &payload,
+                                        std::byte *buffer) {
+  if (payload.topics_size > TCP_REQ_TOPICS_MAX_SIZE) {
+    throw std::invalid_argument(
+        "Failed to serialize topics: size exceeds maximum limit");
+  }
+
+  uint16_t topics_size_network = hton(payload.topics_size);
+  memcpy(buffer, &topics_size_network, sizeof(topics_size_network));
+  buffer += sizeof(topics_size_network);
+
+  memcpy(buffer, payload.topics.data(), payload.topics_size);
+}
+
+auto TcpRequestPayloadTopics::parse(TcpRequestPayloadTopics &payload,
+                                    const std::byte *buffer,
+                                    size_t buffer_size) noexcept
+    -> TcpParseError {
+  if (buffer_size < sizeof(uint16_t)) {
+    return TcpParseError::TOO_SHORT;
+  }
+
+  uint16_t topics_size_network{};
+  memcpy(&topics_size_network, buffer, sizeof(topics_size_network));
+  uint16_t topics_size = ntoh(topics_size_network);
+  buffer += sizeof(topics_size_network);
+  buffer_size -= sizeof(topics_size_network);
+
+  if (topics_size > TCP_REQ_TOPICS_MAX_SIZE) {
+    return TcpParseError::SIZE_EXCEEDS_LIMIT;
+  }
+  if (topics_size > buffer_size) {
+    return TcpParseError::TOO_SHORT;
+  }
+
+  // Each topic must fit in the payload, as for_each reads them
+  for (size_t offset = 0; offset < topics_size;) {
+    auto topic_size = static_cast<uint8_t>(buffer[offset]);
+    if (topic_size > TCP_RESP_TOPIC_MAX_SIZE) {
+      return TcpParseError::SIZE_EXCEEDS_LIMIT;
+    }
+    offset += sizeof(topic_size) + topic_size;
+    if (offset > topics_size) {
+      return TcpParseError::TOO_SHORT;
+    }
+  }
+
+  memcpy(payload.topics.data(), buffer, topics_size);
+  payload.topics_size = topics_size;
+  return TcpParseError::NONE;
 }
 
 void TcpRequest::serialize(const TcpRequest &request, std::byte *buffer) {
@@ -130,11 +361,10 @@ void TcpRequest::serialize(const TcpRequest &request, std::byte *buffer) {
   serialize_variant(request.payload, buffer);
 }
 
-void TcpRequest::deserialize(TcpRequest &request, const std::byte *buffer,
-                             size_t buffer_size) {
+auto TcpRequest::parse(TcpRequest &request, const std::byte *buffer,
+                       size_t buffer_size) noexcept -> TcpParseError {
   if (buffer_size < sizeof(TcpRequestType)) {
-    throw std::invalid_argument(
-        "Failed to deserialize request type: buffer size is too small");
+    return TcpParseError::TOO_SHORT;
   }
 
   uint8_t type{};
@@ -146,18 +376,28 @@ void TcpRequest::deserialize(TcpRequest &request, const std::byte *buffer,
 
   switch (request.type) {
   case TcpRequestType::CONNECT:
-    request.payload.emplace<TcpRequestPayloadId>();
-    TcpRequestPayloadId::deserialize(
-        std::get<TcpRequestPayloadId>(request.payload), buffer, buffer_size);
-    break;
+    return TcpRequestPayloadId::parse(
+        request.payload.emplace<TcpRequestPayloadId>(), buffer, buffer_size);
   case TcpRequestType::SUBSCRIBE:
   case TcpRequestType::UNSUBSCRIBE:
-    request.payload.emplace<TcpRequestPayloadTopic>();
-    TcpRequestPayloadTopic::deserialize(
-        std::get<TcpRequestPayloadTopic>(request.payload), buffer, buffer_size);
-    break;
+    return TcpRequestPayloadTopic::parse(
+        request.payload.emplace<TcpRequestPayloadTopic>(), buffer, buffer_size);
+  case TcpRequestType::SUBSCRIBE_BULK:
+  case TcpRequestType::UNSUBSCRIBE_BULK:
+    return TcpRequestPayloadTopics::parse(
+        request.payload.emplace<TcpRequestPayloadTopics>(), buffer,
+        buffer_size);
   default:
-    throw std::invalid_argument("Failed to deserialize request: unknown type");
+    return TcpParseError::UNKNOWN_TYPE;
+  }
+}
+
+void TcpRequest::deserialize(TcpRequest &request, const std::byte *buffer,
+                             size_t buffer_size) {
+  TcpParseError error = parse(request, buffer, buffer_size);
+  if (error != TcpParseError::NONE) {
+    throw std::invalid_argument(
+        std::string("Failed to deserialize tcp request: ") + to_string(error));
   }
 }
 
@@ -167,110 +407,83 @@ void TcpRequest::deserialize(TcpRequest &request, const std::byte *buffer,
 
 void TcpResponsePayloadInt::serialize(const TcpResponsePayloadInt &payload,
                                       std::byte *buffer) {
-  memcpy(buffer, &payload.sign, sizeof(sign));
-  buffer += sizeof(sign);
-
-  uint32_t value_network = hton(payload.value);
-  memcpy(buffer, &value_network, sizeof(value_network));
+  Layout::serialize(payload, buffer);
 }
 
 void TcpResponsePayloadInt::deserialize(TcpResponsePayloadInt &payload,
                                         const std::byte *buffer,
                                         size_t buffer_size) {
-  if (buffer_size < sizeof(sign) + sizeof(value)) {
+  if (!Layout::deserialize(payload, buffer, buffer_size)) {
     throw std::invalid_argument(
         "Failed to deserialize tcp response INT: buffer size is too small");
   }
-
-  memcpy(&payload.sign, buffer, sizeof(sign));
-  buffer += sizeof(sign);
-
-  uint32_t value_network;
-  memcpy(&value_network, buffer, sizeof(value_network));
-  payload.value = ntoh(value_network);
 }
 
 std::string TcpResponsePayloadInt::to_string() const {
-  int64_t signed_value =
-      static_cast<int64_t>(sign ? -1 : 1) * static_cast<int64_t>(value);
-  return std::to_string(signed_value);
+  std::string str{};
+  append_to(str);
+  return str;
+}
+
+void TcpResponsePayloadInt::append_to(std::string &out) const {
+  if (sign && value != 0) {
+    out += '-';
+  }
+  append_digits(out, value);
 }
 
 void TcpResponsePayloadShortReal::serialize(
     const TcpResponsePayloadShortReal &payload, std::byte *buffer) {
-  uint16_t value_network = hton(payload.value);
-  memcpy(buffer, &value_network, sizeof(value_network));
+  Layout::serialize(payload, buffer);
 }
 
 void TcpResponsePayloadShortReal::deserialize(
     TcpResponsePayloadShortReal &payload, const std::byte *buffer,
     size_t buffer_size) {
-  if (buffer_size < sizeof(value)) {
+  if (!Layout::deserialize(payload, buffer, buffer_size)) {
     throw std::invalid_argument("Failed to deserialize tcp response "
                                 "SHORT_REAL: buffer size is too small");
   }
-
-  uint16_t value_network;
-  memcpy(&value_network, buffer, sizeof(value_network));
-  payload.value = ntoh(value_network);
 }
 
 std::string TcpResponsePayloadShortReal::to_string() const {
-  static constexpr auto fmt = "%.2f";
-  float fvalue = static_cast<float>(value) / 100.0f;
-  size_t size = std::snprintf(nullptr, 0, fmt, fvalue) + 1;
-
-  std::string str(size, '\0');
-  std::snprintf(str.data(), size, fmt, fvalue);
-
+  std::string str{};
+  append_to(str);
   return str;
 }
 
+void TcpResponsePayloadShortReal::append_to(std::string &out) const {
+  append_decimal(out, value, 2);
+}
+
 void TcpResponsePayloadFloat::serialize(const TcpResponsePayloadFloat &payload,
                                         std::byte *buffer) {
-  memcpy(buffer, &payload.sign, sizeof(sign));
-  buffer += sizeof(sign);
-
-  uint32_t value_network = hton(payload.value);
-  memcpy(buffer, &value_network, sizeof(value_network));
-  buffer += sizeof(value_network);
-
-  memcpy(buffer, &payload.exponent, sizeof(exponent));
+  Layout::serialize(payload, buffer);
 }
 
 void TcpResponsePayloadFloat::deserialize(TcpResponsePayloadFloat &payload,
                                           const std::byte *buffer,
                                           size_t buffer_size) {
-  if (buffer_size < sizeof(sign) + sizeof(value) + sizeof(exponent)) {
+  if (!Layout::deserialize(payload, buffer, buffer_size)) {
     throw std::invalid_argument(
         "Failed to deserialize tcp response FLOAT: buffer size is too small");
   }
-
-  memcpy(&payload.sign, buffer, sizeof(sign));
-  buffer += sizeof(sign);
-
-  uint32_t value_network;
-  memcpy(&value_network, buffer, sizeof(value_network));
-  payload.value = ntoh(value_network);
-  buffer += sizeof(value_network);
-
-  memcpy(&payload.exponent, buffer, sizeof(exponent));
 }
 
 std::string TcpResponsePayloadFloat::to_string() const {
-  static constexpr auto fmt = "%.*f";
-  double dvalue = static_cast<double>(sign ? -1 : 1) *
-                  static_cast<double>(value) /
-                  static_cast<double>(std::pow(10, exponent));
-  size_t size =
-      std::snprintf(nullptr, 0, fmt, static_cast<int>(exponent), dvalue) + 1;
-
-  std::string str(size, '\0');
-  std::snprintf(str.data(), size, fmt, static_cast<int>(exponent), dvalue);
-
+  std::string str{};
+  append_to(str);
   return str;
 }
 
+void TcpResponsePayloadFloat::append_to(std::string &out) const {
+  // Exact, where a double would print the binary error of a large exponent
+  if (sign) {
+    out += '-';
+  }
+  append_decimal(out, value, exponent);
+}
+
 void TcpResponsePayloadString::serialize(
     const TcpResponsePayloadString &payload, std::byte *buffer) {
   if (payload.value_size > TCP_RESP_STRING_MAX_SIZE) {
@@ -328,6 +541,10 @@ std::string TcpResponsePayloadString::to_string() const {
   return std::string(value.data(), value_size);
 }
 
+void TcpResponsePayloadString::append_to(std::string &out) const {
+  out.append(value.data(), value_size);
+}
+
 void TcpResponse::serialize(const TcpResponse &response, std::byte *buffer) {
   memcpy(buffer, &response.udp_client_ip, sizeof(udp_client_ip));
   buffer += sizeof(udp_client_ip);
@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <variant>
 
 // ##############################################################################
@@ -16,6 +17,42 @@ static constexpr size_t TCP_CLIENT_ID_MAX_SIZE = 10;
 static constexpr size_t TCP_REQ_PAYLOAD_MAX_SIZE = 50;
 static constexpr size_t TCP_RESP_TOPIC_MAX_SIZE = 50;
 static constexpr size_t TCP_RESP_STRING_MAX_SIZE = 1500;
+// The topics of a bulk request, with their sizes, fitting in the largest
+// message
+static constexpr size_t TCP_REQ_TOPICS_MAX_SIZE = 1500;
+// The expression of the content filter of a subscription, content_filter.hpp
+static constexpr size_t TCP_REQ_FILTER_MAX_SIZE = 100;
+
+// Flags of the CONNECT request
+// The subscriber gets each message at once, its deliveries not being coalesced
+static constexpr uint8_t TCP_CONNECT_NO_COALESCING = 1 << 0;
+// The subscriber reads the RESPONSE_BATCH frames of protocol v2, tcp_batch.hpp
+static constexpr uint8_t TCP_CONNECT_PROTOCOL_V2 = 1 << 1;
+// The subscriber, on the host of the server, reads its frames from the
+// ShmRing of shm_ring.hpp whose process and memfd follow the flags
+static constexpr uint8_t TCP_CONNECT_SHM = 1 << 2;
+// The subscriber joined the multicast group of the server, and filters the
+// messages multicast to it by its own subscriptions, multicast_proto.hpp
+static constexpr uint8_t TCP_CONNECT_MULTICAST = 1 << 3;
+// The subscriber is a broker of the federation, whose subscriptions are the
+// interest of its own subscribers, the messages it is sent not being
+// forwarded to the other brokers
+static constexpr uint8_t TCP_CONNECT_PEER = 1 << 4;
+// The subscriber of protocol v2 reads the RESPONSE_BATCH_LZ4 frames, the
+// batches being compressed from a size set by the server, tcp_batch.hpp
+static constexpr uint8_t TCP_CONNECT_COMPRESSION = 1 << 5;
+
+// Flags of the SUBSCRIBE request
+// While the subscriber has messages waiting to be sent, a new message of a
+// topic of the subscription replaces the queued one of the same topic
+static constexpr uint8_t TCP_SUBSCRIBE_CONFLATE = 1 << 0;
+// Only the messages of the subscription accepted by the ContentFilter of
+// content_filter.hpp whose expression follows the flags are sent
+static constexpr uint8_t TCP_SUBSCRIBE_FILTER = 1 << 1;
+// Only a share of the messages of the subscription are sent, the limits of
+// the DeliveryLimit of delivery_limit.hpp following the filter: at most a rate
+// of messages per second, and one message in a number of them
+static constexpr uint8_t TCP_SUBSCRIBE_LIMIT = 1 << 2;
 
 // ##############################################################################
 // # TcpRequest
@@ -24,12 +61,38 @@ static constexpr size_t TCP_RESP_STRING_MAX_SIZE = 1500;
 enum class TcpRequestPayloadType : uint8_t {
   ID = 0,
   TOPIC,
+  TOPICS,
   TOTAL_PAYLOAD_TYPES
 };
 
+// Why a request is rejected, as returned by TcpRequest::parse
+enum class TcpParseError : uint8_t {
+  NONE = 0,
+  // Shorter than its fields, or than the sizes they declare
+  TOO_SHORT,
+  // An ID, a topic, the topics or a filter longer than their limit
+  SIZE_EXCEEDS_LIMIT,
+  UNKNOWN_TYPE,
+  TOTAL_PARSE_ERRORS
+};
+
+/**
+ * @brief Describe why a request is rejected
+ *
+ * @param error The reason, not TcpParseError::NONE
+ * @return The description, as in the exceptions of the deserialization
+ */
+auto to_string(TcpParseError error) -> const char *;
+
 struct TcpRequestPayloadId {
   std::array<char, TCP_CLIENT_ID_MAX_SIZE + 1> id{};
   uint8_t id_size{};
+  // TCP_CONNECT_* flags, only serialized if any is set, after the ID
+  uint8_t flags{};
+  // The process of the subscriber and its memfd, only serialized with
+  // TCP_CONNECT_SHM, after the flags
+  uint32_t shm_pid{};
+  uint32_t shm_fd{};
 
   /**
    * @brief Sets the ID value and its size.
@@ -57,26 +120,41 @@ struct TcpRequestPayloadId {
   static void serialize(const TcpRequestPayloadId &payload, std::byte *buffer);
 
   /**
-   * @brief Deserializes the ID payload from a byte buffer.
+   * @brief Deserializes the ID payload from a byte buffer, without throwing.
    *
    * @param payload The ID payload to deserialize into.
    * @param buffer The byte buffer containing the serialized data.
    * @param buffer_size The size of the byte buffer.
-   *
-   * @throws std::invalid_argument if the deserialization fails.
+   * @return TcpParseError::NONE, or why the payload is invalid.
    */
-  static void deserialize(TcpRequestPayloadId &payload, const std::byte *buffer,
-                          size_t buffer_size);
+  [[nodiscard]] static auto parse(TcpRequestPayloadId &payload,
+                                  const std::byte *buffer,
+                                  size_t buffer_size) noexcept
+      -> TcpParseError;
 
-  constexpr size_t serialized_size() const { return sizeof(id_size) + id_size; }
+  constexpr size_t serialized_size() const {
+    return sizeof(id_size) + id_size + (flags != 0 ? sizeof(flags) : 0) +
+           (flags & TCP_CONNECT_SHM ? sizeof(shm_pid) + sizeof(shm_fd) : 0);
+  }
 
   static constexpr size_t MAX_SERIALIZED_SIZE =
-      sizeof(id_size) + TCP_CLIENT_ID_MAX_SIZE;
+      sizeof(id_size) + TCP_CLIENT_ID_MAX_SIZE + sizeof(flags) +
+      sizeof(shm_pid) + sizeof(shm_fd);
 };
 
 struct TcpRequestPayloadTopic {
   std::array<char, TCP_RESP_TOPIC_MAX_SIZE + 1> topic{};
   uint8_t topic_size{};
+  // TCP_SUBSCRIBE_* flags, only serialized if any is set, after the topic
+  uint8_t flags{};
+  // The expression of the filter, preceded by its size, only serialized with
+  // TCP_SUBSCRIBE_FILTER, after the flags
+  std::array<char, TCP_REQ_FILTER_MAX_SIZE + 1> filter{};
+  uint8_t filter_size{};
+  // The messages per second and the one in how many messages sent, 0 for no
+  // limit, only serialized with TCP_SUBSCRIBE_LIMIT, after the filter
+  uint32_t max_rate{};
+  uint16_t sample_every{};
 
   /**
    * @brief Sets the topic value and its size.
@@ -90,6 +168,25 @@ struct TcpRequestPayloadTopic {
    */
   void set(const char *topic_data, size_t size);
 
+  /**
+   * @brief Sets the filter expression and its size, and the
+   * TCP_SUBSCRIBE_FILTER flag.
+   *
+   * @param filter_data The filter expression to copy from.
+   * @param size The size of the filter expression in bytes.
+   *
+   * @throws std::invalid_argument if the size exceeds the maximum allowed size.
+   */
+  void set_filter(const char *filter_data, size_t size);
+
+  /**
+   * @brief Sets the limits of the delivery, and the TCP_SUBSCRIBE_LIMIT flag.
+   *
+   * @param rate The messages per second sent at most, 0 for no limit.
+   * @param every Send one message in this many, 0 or 1 for all of them.
+   */
+  void set_limit(uint32_t rate, uint16_t every);
+
   /**
    * @brief Serializes the topic payload into a byte buffer.
    * The caller is responsible for ensuring that the buffer is large enough to
@@ -105,34 +202,111 @@ struct TcpRequestPayloadTopic {
                         std::byte *buffer);
 
   /**
-   * @brief Deserializes the topic payload from a byte buffer.
+   * @brief Deserializes the topic payload from a byte buffer, without
+   * throwing.
    *
    * @param payload The topic payload to deserialize into.
    * @param buffer The byte buffer containing the serialized data.
    * @param buffer_size The size of the byte buffer.
+   * @return TcpParseError::NONE, or why the payload is invalid.
+   */
+  [[nodiscard]] static auto parse(TcpRequestPayloadTopic &payload,
+                                  const std::byte *buffer,
+                                  size_t buffer_size) noexcept
+      -> TcpParseError;
+
+  constexpr size_t serialized_size() const {
+    return sizeof(topic_size) + topic_size + (flags != 0 ? sizeof(flags) : 0) +
+           (flags & TCP_SUBSCRIBE_FILTER ? sizeof(filter_size) + filter_size
+                                         : 0) +
+           (flags & TCP_SUBSCRIBE_LIMIT ? sizeof(max_rate) + sizeof(sample_every)
+                                        : 0);
+  }
+
+  static constexpr size_t MAX_SERIALIZED_SIZE =
+      sizeof(topic_size) + TCP_RESP_TOPIC_MAX_SIZE + sizeof(flags) +
+      sizeof(filter_size) + TCP_REQ_FILTER_MAX_SIZE + sizeof(max_rate) +
+      sizeof(sample_every);
+};
+
+struct TcpRequestPayloadTopics {
+  // The topics, each preceded by its size, as serialized
+  std::array<char, TCP_REQ_TOPICS_MAX_SIZE> topics{};
+  uint16_t topics_size{};
+
+  /**
+   * @brief Adds a topic after the others, if there is space left for it.
    *
-   * @throws std::invalid_argument if the deserialization fails.
+   * @param topic_data The topic data buffer to copy from.
+   * @param size The size of the topic data in bytes.
+   * @return true if the topic was added, false if the payload is full.
+   *
+   * @throws std::invalid_argument if the size exceeds the maximum allowed size.
    */
-  static void deserialize(TcpRequestPayloadTopic &payload,
-                          const std::byte *buffer, size_t buffer_size);
+  bool add(const char *topic_data, size_t size);
+
+  /**
+   * @brief Calls a function with each topic, in the order they were added.
+   *
+   * @param visit The function called with the std::string_view of each topic.
+   */
+  template <typename Visitor> void for_each(Visitor &&visit) const {
+    for (size_t offset = 0; offset < topics_size;) {
+      auto size = static_cast<uint8_t>(topics[offset]);
+      visit(std::string_view(topics.data() + offset + sizeof(size), size));
+      offset += sizeof(size) + size;
+    }
+  }
+
+  /**
+   * @brief Serializes the topics payload into a byte buffer.
+   * The caller is responsible for ensuring that the buffer is large enough to
+   * hold the serialized data.
+   * The required size is given by `serialized_size()`.
+   *
+   * @param payload The topics payload to serialize.
+   * @param buffer The byte buffer to store the serialized data.
+   *
+   * @throws std::invalid_argument if the serialization fails.
+   */
+  static void serialize(const TcpRequestPayloadTopics &payload,
+                        std::byte *buffer);
+
+  /**
+   * @brief Deserializes the topics payload from a byte buffer, without
+   * throwing, each topic being checked to fit in it.
+   *
+   * @param payload The topics payload to deserialize into.
+   * @param buffer The byte buffer containing the serialized data.
+   * @param buffer_size The size of the byte buffer.
+   * @return TcpParseError::NONE, or why the payload is invalid.
+   */
+  [[nodiscard]] static auto parse(TcpRequestPayloadTopics &payload,
+                                  const std::byte *buffer,
+                                  size_t buffer_size) noexcept
+      -> TcpParseError;
 
   constexpr size_t serialized_size() const {
-    return sizeof(topic_size) + topic_size;
+    return sizeof(topics_size) + topics_size;
   }
 
   static constexpr size_t MAX_SERIALIZED_SIZE =
-      sizeof(topic_size) + TCP_RESP_TOPIC_MAX_SIZE;
+      sizeof(topics_size) + TCP_REQ_TOPICS_MAX_SIZE;
 };
 
 enum TcpRequestType : uint8_t {
   CONNECT = 0,
   SUBSCRIBE,
   UNSUBSCRIBE,
+  // Requests of several topics at once, with a TOPICS payload
+  SUBSCRIBE_BULK,
+  UNSUBSCRIBE_BULK,
   TOTAL_REQUEST_TYPES
 };
 
 using TcpRequestPayloadVariant =
-    std::variant<TcpRequestPayloadId, TcpRequestPayloadTopic>;
+    std::variant<TcpRequestPayloadId, TcpRequestPayloadTopic,
+                 TcpRequestPayloadTopics>;
 
 struct TcpRequest {
   TcpRequestPayloadVariant payload;
@@ -152,7 +326,20 @@ struct TcpRequest {
   static void serialize(const TcpRequest &request, std::byte *buffer);
 
   /**
-   * @brief Deserializes the request from a byte buffer.
+   * @brief Deserializes the request from a byte buffer, without throwing, so
+   * that a client sending garbage only costs the checks.
+   *
+   * @param request The request to deserialize into.
+   * @param buffer The byte buffer containing the serialized data.
+   * @param buffer_size The size of the byte buffer.
+   * @return TcpParseError::NONE, or why the request is invalid.
+   */
+  [[nodiscard]] static auto parse(TcpRequest &request, const std::byte *buffer,
+                                  size_t buffer_size) noexcept
+      -> TcpParseError;
+
+  /**
+   * @brief Deserializes the request from a byte buffer, as parse.
    *
    * @param request The request to deserialize into.
    * @param buffer The byte buffer containing the serialized data.
@@ -193,6 +380,10 @@ struct TcpResponsePayloadInt {
   uint32_t value;
   uint8_t sign;
 
+  // The sign, followed by the value
+  using Layout = FieldLayout<&TcpResponsePayloadInt::sign,
+                             &TcpResponsePayloadInt::value>;
+
   /**
    * @brief Converts the INT payload to a string representation.
    *
@@ -200,6 +391,14 @@ struct TcpResponsePayloadInt {
    */
   std::string to_string() const;
 
+  /**
+   * @brief Appends the string representation of the INT payload, as
+   * to_string, without allocating once the string has the capacity.
+   *
+   * @param out The string to append to.
+   */
+  void append_to(std::string &out) const;
+
   /**
    * @brief Serializes the INT payload into a byte buffer.
    * The caller is responsible for ensuring that the buffer is large enough to
@@ -226,11 +425,9 @@ struct TcpResponsePayloadInt {
   static void deserialize(TcpResponsePayloadInt &payload,
                           const std::byte *buffer, size_t buffer_size);
 
-  static constexpr size_t serialized_size() {
-    return sizeof(sign) + sizeof(value);
-  }
+  static constexpr size_t serialized_size() { return Layout::SIZE; }
 
-  static constexpr size_t MAX_SERIALIZED_SIZE = sizeof(sign) + sizeof(value);
+  static constexpr size_t MAX_SERIALIZED_SIZE = Layout::SIZE;
 };
 
 struct TcpResponsePayloadShortReal {
@@ -238,6 +435,8 @@ struct TcpResponsePayloadShortReal {
   // by 100
   uint16_t value;
 
+  using Layout = FieldLayout<&TcpResponsePayloadShortReal::value>;
+
   /**
    * @brief Converts the SHORT_REAL payload to a string representation.
    *
@@ -245,6 +444,14 @@ struct TcpResponsePayloadShortReal {
    */
   std::string to_string() const;
 
+  /**
+   * @brief Appends the string representation of the SHORT_REAL payload, as
+   * to_string, without allocating once the string has the capacity.
+   *
+   * @param out The string to append to.
+   */
+  void append_to(std::string &out) const;
+
   /**
    * @brief Serializes the SHORT_REAL payload into a byte buffer.
    * The caller is responsible for ensuring that the buffer is large enough to
@@ -271,9 +478,9 @@ struct TcpResponsePayloadShortReal {
   static void deserialize(TcpResponsePayloadShortReal &payload,
                           const std::byte *buffer, size_t buffer_size);
 
-  static constexpr size_t serialized_size() { return sizeof(value); }
+  static constexpr size_t serialized_size() { return Layout::SIZE; }
 
-  static constexpr size_t MAX_SERIALIZED_SIZE = sizeof(value);
+  static constexpr size_t MAX_SERIALIZED_SIZE = Layout::SIZE;
 };
 
 struct TcpResponsePayloadFloat {
@@ -284,6 +491,11 @@ struct TcpResponsePayloadFloat {
   // Absolute value of the negative exponent of 10 used to scale the number
   uint8_t exponent;
 
+  // The sign, followed by the value and the exponent
+  using Layout = FieldLayout<&TcpResponsePayloadFloat::sign,
+                             &TcpResponsePayloadFloat::value,
+                             &TcpResponsePayloadFloat::exponent>;
+
   /**
    * @brief Converts the FLOAT payload to a string representation.
    *
@@ -291,6 +503,14 @@ struct TcpResponsePayloadFloat {
    */
   std::string to_string() const;
 
+  /**
+   * @brief Appends the string representation of the FLOAT payload, as
+   * to_string, without allocating once the string has the capacity.
+   *
+   * @param out The string to append to.
+   */
+  void append_to(std::string &out) const;
+
   /**
    * @brief Serializes the FLOAT payload into a byte buffer.
    * The caller is responsible for ensuring that the buffer is large enough to
@@ -317,12 +537,9 @@ struct TcpResponsePayloadFloat {
   static void deserialize(TcpResponsePayloadFloat &payload,
                           const std::byte *buffer, size_t buffer_size);
 
-  static constexpr size_t serialized_size() {
-    return sizeof(sign) + sizeof(value) + sizeof(exponent);
-  }
+  static constexpr size_t serialized_size() { return Layout::SIZE; }
 
-  static constexpr size_t MAX_SERIALIZED_SIZE =
-      sizeof(sign) + sizeof(value) + sizeof(exponent);
+  static constexpr size_t MAX_SERIALIZED_SIZE = Layout::SIZE;
 };
 
 struct TcpResponsePayloadString {
@@ -336,6 +553,14 @@ struct TcpResponsePayloadString {
    */
   std::string to_string() const;
 
+  /**
+   * @brief Appends the string representation of the STRING payload, as
+   * to_string, without allocating once the string has the capacity.
+   *
+   * @param out The string to append to.
+   */
+  void append_to(std::string &out) const;
+
   /**
    * @brief Sets the STRING value and its size.
    * The function copies `size` bytes from `value_data` to the `value` buffer
@@ -445,9 +670,33 @@ struct TcpResponse {
 enum class TcpMessageType : uint8_t {
   REQUEST = 0,
   RESPONSE,
+  // Responses of protocol v2, serialized as in tcp_batch.hpp
+  RESPONSE_BATCH,
+  // Keepalive without payload, sent by the server to an idle subscriber, which
+  // sends it back
+  HEARTBEAT,
+  // Wakeup without payload of the side of a ShmRing waiting for the other,
+  // the reader for data or the writer for space
+  SHM_WAKE,
+  // A multicast message retransmitted to a subscriber, as multicast_proto.hpp
+  MULTICAST_DATA,
+  // The multicast messages a subscriber missed, a MulticastNack
+  MULTICAST_NACK,
+  // A RESPONSE_BATCH compressed in an LZ4 block, as tcp_batch.hpp
+  RESPONSE_BATCH_LZ4,
   TOTAL_MESSAGE_TYPES
 };
 
+// The whole frame of a heartbeat, its payload being empty
+inline constexpr std::array<std::byte, 3> TCP_HEARTBEAT_FRAME{
+    std::byte{static_cast<uint8_t>(TcpMessageType::HEARTBEAT)}, std::byte{0},
+    std::byte{0}};
+
+// The whole frame of a wakeup of a ShmRing, its payload being empty
+inline constexpr std::array<std::byte, 3> TCP_SHM_WAKE_FRAME{
+    std::byte{static_cast<uint8_t>(TcpMessageType::SHM_WAKE)}, std::byte{0},
+    std::byte{0}};
+
 using TcpMessageVariant = std::variant<TcpRequest, TcpResponse>;
 
 struct TcpMessage {
@@ -1,5 +1,6 @@
 #include "tcp_utils.hpp"
 
+#include <cerrno>
 #include <cstring>
 #include <sys/socket.h>
 
@@ -7,7 +8,10 @@ void send_all(int sockfd, const std::byte *buffer, size_t buffer_size) {
   size_t total_sent = 0;
 
   while (total_sent < buffer_size) {
-    ssize_t sent = send(sockfd, buffer, buffer_size - total_sent, 0);
+    // A connection closed by the peer is reported as EPIPE rather than
+    // raising SIGPIPE, which would kill the process
+    ssize_t sent =
+        send(sockfd, buffer, buffer_size - total_sent, MSG_NOSIGNAL);
 
     if (sent < 0) {
       if (errno == EINTR) {
@@ -29,7 +29,8 @@ public:
  * @param buffer The buffer to send.
  * @param buffer_size The size of the buffer.
  *
- * @throws TcpSocketException If the send fails.
+ * @throws TcpSocketException If the send fails, TcpConnectionClosed if the
+ * peer closed the connection.
  */
 void send_all(int sockfd, const std::byte *buffer, size_t buffer_size);
 
@@ -0,0 +1,32 @@
+#include "token_interner.hpp"
+
+TokenInterner::TokenInterner() {
+  intern("*");
+  intern("+");
+}
+
+auto TokenInterner::instance() -> TokenInterner & {
+  static TokenInterner interner{};
+  return interner;
+}
+
+auto TokenInterner::intern(std::string_view token) -> TokenId {
+  auto it = ids_.find(token);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+
+  auto id = static_cast<TokenId>(tokens_.size());
+  const auto &stored = tokens_.emplace_back(token);
+  ids_.emplace(stored, id);
+  return id;
+}
+
+auto TokenInterner::find(std::string_view token) const
+    -> std::optional<TokenId> {
+  auto it = ids_.find(token);
+  if (it == ids_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
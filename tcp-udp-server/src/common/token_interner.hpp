@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * @brief Global table of the tokens of the topics, giving each distinct token
+ * a 32-bit id, so that the token patterns are compared and hashed as integers
+ *
+ * The wildcards have reserved ids. The ids are never released, and the table
+ * is not thread safe.
+ */
+class TokenInterner {
+public:
+  using TokenId = uint32_t;
+  // mapping of the tokens to their id
+  using TokenIds = std::unordered_map<std::string_view, TokenId>;
+
+  static constexpr TokenId STAR_ID{0};
+  static constexpr TokenId PLUS_ID{1};
+
+  /**
+   * @brief Get the interner shared by all the token patterns
+   *
+   * @return The global interner
+   */
+  static auto instance() -> TokenInterner &;
+
+  /**
+   * @brief Get the id of a token, adding it to the table if it is new
+   *
+   * @param token The token
+   * @return The id of the token
+   */
+  auto intern(std::string_view token) -> TokenId;
+
+  /**
+   * @brief Get the id of a token, without adding it to the table
+   *
+   * @param token The token
+   * @return The id of the token, or std::nullopt if it was never interned
+   */
+  auto find(std::string_view token) const -> std::optional<TokenId>;
+
+  /**
+   * @brief Get the token of an id
+   *
+   * @param id An id returned by intern
+   * @return The token
+   */
+  auto token(TokenId id) const -> const std::string & { return tokens_[id]; }
+
+  /**
+   * @brief Get the ids of all the tokens
+   * The tokens viewed are never moved nor released, so a copy of the mapping
+   * can be read by another thread while tokens are added to the table.
+   *
+   * @return The mapping of the tokens to their id
+   */
+  auto ids() const -> const TokenIds & { return ids_; }
+
+private:
+  TokenInterner();
+
+  // the tokens by id, a deque so that they are never moved
+  std::deque<std::string> tokens_{};
+  // viewing the tokens of tokens_
+  TokenIds ids_{};
+};
@@ -1,10 +1,18 @@
 #include "token_pattern.hpp"
+#include "pattern_matcher.hpp"
 #include "util.hpp"
 #include <queue>
 #include <stdexcept>
 
+namespace {
+
+constexpr auto WILDCARD_TOPIC_ERROR =
+    "The TokenPattern to match against contains wildcards";
+
+} // namespace
+
 bool TokenPattern::is_valid_pattern() const {
-  if (tokens_.empty() || !is_valid_token(tokens_[0])) {
+  if (tokens_.empty()) {
     return false;
   }
 
@@ -13,10 +21,8 @@ bool TokenPattern::is_valid_pattern() const {
   for (size_t i = 1; i < tokens_.size(); ++i) {
     bool cur_is_wildcard{};
 
-    // Check that the current token is valid and that there are no 2 consecutive
-    // wildcards
-    if (!is_valid_token(tokens_[i]) ||
-        ((cur_is_wildcard = is_wildcard(tokens_[i])) && prev_is_wildcard)) {
+    // Check that there are no 2 consecutive wildcards
+    if ((cur_is_wildcard = is_wildcard(tokens_[i])) && prev_is_wildcard) {
       return false;
     }
 
@@ -26,18 +32,35 @@ bool TokenPattern::is_valid_pattern() const {
   return true;
 }
 
-TokenPattern TokenPattern::from_string(std::string_view str) {
+auto to_string(TokenPatternError error) -> const char * {
+  switch (error) {
+  case TokenPatternError::NONE:
+    return "none";
+  case TokenPatternError::EMPTY:
+    return "Input string is empty";
+  case TokenPatternError::INVALID_TOKEN:
+    return "Invalid token";
+  case TokenPatternError::INVALID_PATTERN:
+    return "Invalid token pattern";
+  default:
+    return "Unknown error";
+  }
+}
+
+auto TokenPattern::parse(std::string_view str, TokenPattern &pattern)
+    -> TokenPatternError {
   if (str.empty()) {
-    throw std::invalid_argument("Input string is empty");
+    return TokenPatternError::EMPTY;
   }
 
   TokenPattern token_pat{};
+  auto &interner = TokenInterner::instance();
 
   size_t offset = 0;
 
   while (offset < str.size()) {
     size_t pos = str.find_first_of(separator_, offset);
-    std::string token;
+    std::string_view token;
 
     if (pos == offset) {
       ++offset;
@@ -52,24 +75,67 @@ TokenPattern TokenPattern::from_string(std::string_view str) {
       offset = pos + 1;
     }
 
-    if (is_valid_token(token)) {
-      token_pat.tokens_.push_back(token);
-    } else {
-      throw std::invalid_argument("Invalid token: " + std::string(token));
+    if (!is_valid_token(token)) {
+      return TokenPatternError::INVALID_TOKEN;
     }
+    token_pat.tokens_.push_back(interner.intern(token));
   }
 
   if (!token_pat.is_valid_pattern()) {
-    throw std::invalid_argument("Invalid token pattern");
+    return TokenPatternError::INVALID_PATTERN;
+  }
+
+  for (auto token : token_pat.tokens_) {
+    hash_combine(token_pat.hash_, token);
+  }
+  if (token_pat.has_wildcard() &&
+      token_pat.tokens_.size() <= PatternMatcher::MAX_TOKENS) {
+    token_pat.matcher_ = std::make_shared<const PatternMatcher>(token_pat);
   }
 
+  pattern = std::move(token_pat);
+  return TokenPatternError::NONE;
+}
+
+TokenPattern TokenPattern::from_string(std::string_view str) {
+  TokenPattern token_pat{};
+  TokenPatternError error = parse(str, token_pat);
+  if (error != TokenPatternError::NONE) {
+    throw std::invalid_argument(::to_string(error));
+  }
   return token_pat;
 }
 
+auto TokenPattern::to_string() const -> std::string {
+  const auto &interner = TokenInterner::instance();
+  std::string str{};
+  for (TokenId token : tokens_) {
+    if (!str.empty()) {
+      str += separator_;
+    }
+    str += interner.token(token);
+  }
+  return str;
+}
+
 bool TokenPattern::matches(const TokenPattern &other) const {
+  if (matcher_) {
+    return matcher_->matches(other);
+  }
+  if (has_wildcard()) {
+    return matches_bfs(other);
+  }
+
+  // Without wildcards, only the same tokens match
   if (other.has_wildcard()) {
-    throw std::invalid_argument(
-        "The TokenPattern to match against contains wildcards");
+    throw std::invalid_argument(WILDCARD_TOPIC_ERROR);
+  }
+  return *this == other;
+}
+
+bool TokenPattern::matches_bfs(const TokenPattern &other) const {
+  if (other.has_wildcard()) {
+    throw std::invalid_argument(WILDCARD_TOPIC_ERROR);
   }
 
   std::queue<std::pair<size_t, size_t>> positions{};
@@ -87,7 +153,7 @@ bool TokenPattern::matches(const TokenPattern &other) const {
       continue;
     }
 
-    if (tokens_[this_index] == "*") {
+    if (tokens_[this_index] == TokenInterner::STAR_ID) {
       ++this_index;
 
       if (this_index == tokens_.size()) {
@@ -104,7 +170,7 @@ bool TokenPattern::matches(const TokenPattern &other) const {
         it = std::find(it, low_limit, tokens_[this_index]);
       }
 
-    } else if (tokens_[this_index] == "+" ||
+    } else if (tokens_[this_index] == TokenInterner::PLUS_ID ||
                tokens_[this_index] == other.tokens_[other_index]) {
       positions.push({this_index + 1, other_index + 1});
     }
@@ -112,13 +178,3 @@ bool TokenPattern::matches(const TokenPattern &other) const {
 
   return false;
 }
-
-std::size_t TokenPattern::hashValue() const {
-  std::size_t seed = 0;
-
-  for (const auto &token : tokens_) {
-    hash_combine(seed, token);
-  }
-
-  return seed;
-}
@@ -1,14 +1,39 @@
 #pragma once
 
+#include "token_interner.hpp"
 #include <algorithm>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
 
+// Why a string is not a TokenPattern, as returned by TokenPattern::parse
+enum class TokenPatternError : uint8_t {
+  NONE = 0,
+  EMPTY,
+  INVALID_TOKEN,
+  // Without tokens, or with 2 consecutive wildcards
+  INVALID_PATTERN,
+  TOTAL_ERRORS
+};
+
+/**
+ * @brief Describe why a string is not a TokenPattern
+ *
+ * @param error The reason, not TokenPatternError::NONE
+ * @return The description, as in the exceptions of from_string
+ */
+auto to_string(TokenPatternError error) -> const char *;
+
+class PatternMatcher;
+
 class TokenPattern {
 
 public:
+  using TokenId = TokenInterner::TokenId;
+
   /**
    * @brief Build a TokenPattern from a string
    *
@@ -27,9 +52,25 @@ public:
    */
   [[nodiscard]] static TokenPattern from_string(std::string_view str);
 
+  /**
+   * @brief Build a TokenPattern from a string, as from_string, without
+   * throwing for an invalid string, so that the requests of a client sending
+   * garbage only cost the checks
+   *
+   * @param str The string to parse
+   * @param pattern The TokenPattern built, left unchanged if the string is
+   * invalid
+   * @return TokenPatternError::NONE, or why the string is invalid
+   */
+  [[nodiscard]] static auto parse(std::string_view str, TokenPattern &pattern)
+      -> TokenPatternError;
+
   /**
    * @brief Check if the TokenPattern matches another TokenPattern
    *
+   * A pattern with wildcards is compiled into a PatternMatcher once, when it
+   * is parsed, and the copies of the pattern share it
+   *
    * The TokenPattern matched agains must only contain string tokens
    *
    * The matching rules are:
@@ -45,14 +86,61 @@ public:
   [[nodiscard]] bool matches(const TokenPattern &other) const;
 
   /**
-   * @brief Compute the hash value of the TokenPattern
+   * @brief Check if the TokenPattern matches another TokenPattern, with a
+   * breadth-first search over the positions in both patterns
+   *
+   * Same as matches, which uses the PatternMatcher compiled from the
+   * TokenPattern instead and only this search for the patterns too long for
+   * it. Kept as the reference the PatternMatcher is benchmarked against.
+   *
+   * @param other The TokenPattern to match against
+   * @return true if the TokenPattern matches the other TokenPattern
+   *
+   * @throws std::invalid_argument if the other TokenPattern contains wildcards
+   */
+  [[nodiscard]] bool matches_bfs(const TokenPattern &other) const;
+
+  /**
+   * @brief Build the string of the TokenPattern, its tokens joined by '/'
+   *
+   * @return The string the TokenPattern was parsed from
+   */
+  auto to_string() const -> std::string;
+
+  /**
+   * @brief Check if the TokenPattern contains any wildcard token
+   *
+   * @return true if at least one token is '*' or '+'
+   */
+  bool has_wildcard() const {
+    return std::any_of(tokens_.begin(), tokens_.end(), is_wildcard);
+  }
+
+  /**
+   * @brief Get the ids of the tokens of the TokenPattern, wildcards included,
+   * as given by the TokenInterner
+   *
+   * @return The token ids, in order
+   */
+  auto tokens() const -> const std::vector<TokenId> & { return tokens_; }
+
+  /**
+   * @brief Get the PatternMatcher compiled from the TokenPattern
+   *
+   * @return The matcher, or nullptr if the TokenPattern has no wildcards or
+   * more than PatternMatcher::MAX_TOKENS tokens
+   */
+  auto matcher() const -> const PatternMatcher * { return matcher_.get(); }
+
+  /**
+   * @brief Get the hash value of the TokenPattern, computed at construction
    *
    * @return The hash value of the TokenPattern
    */
-  std::size_t hashValue() const;
+  std::size_t hashValue() const { return hash_; }
 
   friend bool operator==(const TokenPattern &lhs, const TokenPattern &rhs) {
-    return lhs.tokens_ == rhs.tokens_;
+    return lhs.hash_ == rhs.hash_ && lhs.tokens_ == rhs.tokens_;
   }
 
 private:
@@ -60,17 +148,16 @@ private:
     return token.size() > 0;
   }
 
-  static constexpr bool is_wildcard(std::string_view token) {
-    return token == "*" || token == "+";
-  }
-
-  bool has_wildcard() const {
-    return std::any_of(tokens_.begin(), tokens_.end(), is_wildcard);
+  static constexpr bool is_wildcard(TokenId token) {
+    return token == TokenInterner::STAR_ID || token == TokenInterner::PLUS_ID;
   }
 
   bool is_valid_pattern() const;
 
-  std::vector<std::string> tokens_{};
+  std::vector<TokenId> tokens_{};
+  std::size_t hash_{};
+  // Immutable, so shared by the copies of the pattern
+  std::shared_ptr<const PatternMatcher> matcher_{};
   static constexpr char separator_{'/'};
 };
 
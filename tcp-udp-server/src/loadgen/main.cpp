@@ -0,0 +1,617 @@
+/**
+ * Load generator and end-to-end latency benchmark of the server: connects N
+ * subscribers, each subscribed to one of the sets of patterns given, then
+ * publishes STRING messages over UDP at a target rate, round-robin over a
+ * range of topics, each message carrying the time it was sent. The deliveries
+ * expected are counted from the patterns matching each topic, so the messages
+ * never delivered, dropped by the server or lost by UDP, are reported along
+ * with the delivered throughput and the latency percentiles.
+ *
+ * Usage: ./loadgen [-H host] [-p port] [-s subscribers] [-w patterns]...
+ *                  [-t topics] [-P prefix] [-r rate] [-d seconds] [-b bytes]
+ *                  [-j threads] [-m records] [-2] [-n]
+ *
+ *   -w  a set of patterns separated by commas, the subscriber i getting the
+ *       set i modulo the number of sets, "<prefix>/+" by default
+ *   -t  the topics published, "<prefix>/0" to "<prefix>/<topics - 1>"
+ *   -r  the messages published per second
+ *   -b  the size of the payload of the messages, at least the 20 digits of
+ *       their send time
+ *   -j  the threads reading the subscribers, each reading a share of them
+ *   -m  the messages batched in a datagram, as many as fit in the MTU, each
+ *       message being sent in its own datagram by default
+ *   -2  the subscribers read the batches of protocol v2
+ *   -n  the deliveries to the subscribers are not coalesced
+ */
+#include "frame_reader.hpp"
+#include "tcp_batch.hpp"
+#include "tcp_proto.hpp"
+#include "tcp_utils.hpp"
+#include "token_pattern.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string host{"127.0.0.1"};
+  uint16_t port{12345};
+  size_t subscribers{10};
+  std::vector<std::vector<std::string>> pattern_sets{};
+  size_t topics{100};
+  std::string prefix{"load"};
+  size_t rate{10000};
+  double seconds{5};
+  size_t payload_size{64};
+  size_t threads{1};
+  // 0 to send the messages as single datagrams
+  size_t batch_records{};
+  uint8_t connect_flags{};
+};
+
+// Size of the frame reader of a subscriber
+constexpr size_t READER_CAPACITY = 256 << 10;
+// The topic, NUL padded, and the payload type of the UDP messages
+constexpr size_t UDP_HEADER_SIZE = 50 + 1;
+// The magic byte and the version starting a datagram batching messages, then
+// the size of the topic, the payload type and the size of the payload
+// preceding each of them
+constexpr size_t UDP_BATCH_HEADER_SIZE = 2;
+constexpr size_t UDP_BATCH_RECORD_HEADER_SIZE = 1 + 1 + 2;
+// The UDP payload of an Ethernet frame, which the batches do not exceed
+constexpr size_t UDP_BATCH_MAX_SIZE = 1500 - 20 - 8;
+// Digits of the send time, in nanoseconds, starting the payload
+constexpr size_t TIME_SIZE = 20;
+// How long the deliveries are waited for once the publishing is over
+constexpr auto DRAIN_IDLE = std::chrono::milliseconds(500);
+constexpr auto DRAIN_MAX = std::chrono::seconds(5);
+
+struct Subscriber {
+  int fd{-1};
+  FrameReader reader{READER_CAPACITY, TCP_BATCH_MAX_SIZE};
+  TcpBatchReader batch_reader{};
+};
+
+// What a receiving thread measured
+struct Deliveries {
+  size_t count{};
+  // the payloads without a valid time
+  size_t invalid{};
+  // the latencies, in nanoseconds, saturated at 2^32 - 1
+  std::vector<uint32_t> latencies{};
+  Clock::time_point last{};
+};
+
+auto now_ns() -> uint64_t {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now().time_since_epoch())
+          .count());
+}
+
+auto split(const std::string &str, char separator)
+    -> std::vector<std::string> {
+  std::vector<std::string> parts{};
+  size_t start = 0;
+  while (true) {
+    size_t end = str.find(separator, start);
+    parts.push_back(str.substr(start, end - start));
+    if (end == std::string::npos) {
+      return parts;
+    }
+    start = end + 1;
+  }
+}
+
+template <typename T> bool parse_number(const char *str, T &value) {
+  auto [ptr, ec] = std::from_chars(str, str + std::strlen(str), value);
+  return ec == std::errc{} && *ptr == '\0';
+}
+
+void usage(const char *name) {
+  std::fprintf(stderr,
+               "Usage: %s [-H host] [-p port] [-s subscribers] "
+               "[-w patterns]... [-t topics] [-P prefix] [-r rate] "
+               "[-d seconds] [-b bytes] [-j threads] [-m records] [-2] "
+               "[-n]\n",
+               name);
+}
+
+bool parse_options(int argc, char *argv[], Options &options) {
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "H:p:s:w:t:P:r:d:b:j:m:2n")) != -1) {
+    bool valid = true;
+    switch (opt) {
+    case 'H':
+      options.host = optarg;
+      break;
+    case 'p':
+      valid = parse_number(optarg, options.port);
+      break;
+    case 's':
+      valid = parse_number(optarg, options.subscribers) &&
+              options.subscribers > 0;
+      break;
+    case 'w':
+      options.pattern_sets.push_back(split(optarg, ','));
+      break;
+    case 't':
+      valid = parse_number(optarg, options.topics) && options.topics > 0;
+      break;
+    case 'P':
+      options.prefix = optarg;
+      break;
+    case 'r':
+      valid = parse_number(optarg, options.rate) && options.rate > 0;
+      break;
+    case 'd':
+      options.seconds = std::strtod(optarg, nullptr);
+      valid = options.seconds > 0;
+      break;
+    case 'b':
+      valid = parse_number(optarg, options.payload_size) &&
+              options.payload_size <= TCP_RESP_STRING_MAX_SIZE;
+      break;
+    case 'j':
+      valid = parse_number(optarg, options.threads) && options.threads > 0;
+      break;
+    case 'm':
+      valid = parse_number(optarg, options.batch_records) &&
+              options.batch_records > 0;
+      break;
+    case '2':
+      options.connect_flags |= TCP_CONNECT_PROTOCOL_V2;
+      break;
+    case 'n':
+      options.connect_flags |= TCP_CONNECT_NO_COALESCING;
+      break;
+    default:
+      valid = false;
+      break;
+    }
+    if (!valid) {
+      usage(argv[0]);
+      return false;
+    }
+  }
+
+  if (optind != argc) {
+    usage(argv[0]);
+    return false;
+  }
+  if (options.pattern_sets.empty()) {
+    options.pattern_sets.push_back({options.prefix + "/+"});
+  }
+  // A batched message fits in a datagram, whatever its topic
+  if (options.batch_records > 0 &&
+      UDP_BATCH_HEADER_SIZE + UDP_BATCH_RECORD_HEADER_SIZE + UDP_HEADER_SIZE -
+              1 + std::max(options.payload_size, TIME_SIZE) >
+          UDP_BATCH_MAX_SIZE) {
+    usage(argv[0]);
+    return false;
+  }
+  return true;
+}
+
+auto topic_name(const Options &options, size_t index) -> std::string {
+  return options.prefix + "/" + std::to_string(index);
+}
+
+// Count the subscribers getting the messages of each topic, once each however
+// many of their patterns match it
+auto expected_fanouts(const Options &options) -> std::vector<size_t> {
+  std::vector<std::vector<TokenPattern>> sets{};
+  for (const auto &patterns : options.pattern_sets) {
+    auto &set = sets.emplace_back();
+    for (const auto &pattern : patterns) {
+      set.push_back(TokenPattern::from_string(pattern));
+    }
+  }
+
+  std::vector<size_t> fanouts(options.topics);
+  for (size_t i = 0; i < options.topics; ++i) {
+    auto topic = TokenPattern::from_string(topic_name(options, i));
+    for (size_t j = 0; j < options.subscribers; ++j) {
+      const auto &set = sets[j % sets.size()];
+      fanouts[i] += std::any_of(set.begin(), set.end(), [&](const auto &p) {
+        return p.matches(topic);
+      });
+    }
+  }
+  return fanouts;
+}
+
+void send_request(int sockfd, TcpMessage &message) {
+  std::vector<std::byte> buffer(message.serialized_size());
+  TcpMessage::serialize(message, buffer.data());
+  send_all(sockfd, buffer.data(), buffer.size());
+}
+
+// Connect a subscriber and subscribe it to its patterns, its socket being
+// left non-blocking
+auto connect_subscriber(const Options &options, const sockaddr_in &addr,
+                        size_t index) -> int {
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    throw std::runtime_error("Failed to create TCP socket");
+  }
+  if (connect(sockfd, reinterpret_cast<const sockaddr *>(&addr),
+              sizeof(addr)) < 0) {
+    close(sockfd);
+    throw std::runtime_error("Failed to connect to server: " +
+                             std::string(std::strerror(errno)));
+  }
+  int enable = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+  try {
+    TcpMessage message{};
+    auto &request = message.payload.emplace<TcpRequest>();
+    request.type = TcpRequestType::CONNECT;
+    auto &id_payload = request.payload.emplace<TcpRequestPayloadId>();
+    std::string id = "lg" + std::to_string(index);
+    id_payload.set(id.c_str(), id.size());
+    id_payload.flags = options.connect_flags;
+    send_request(sockfd, message);
+
+    request.type = TcpRequestType::SUBSCRIBE;
+    auto &topic_payload = request.payload.emplace<TcpRequestPayloadTopic>();
+    for (const auto &pattern :
+         options.pattern_sets[index % options.pattern_sets.size()]) {
+      topic_payload.set(pattern.c_str(), pattern.size());
+      send_request(sockfd, message);
+    }
+  } catch (const std::exception &) {
+    close(sockfd);
+    throw;
+  }
+
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+  return sockfd;
+}
+
+void record_delivery(const TcpResponse &response, Deliveries &deliveries) {
+  ++deliveries.count;
+  uint64_t sent_ns = 0;
+  if (const auto *string =
+          std::get_if<TcpResponsePayloadString>(&response.payload)) {
+    const char *value = string->value.data();
+    auto [ptr, ec] = std::from_chars(value, value + string->value_size, sent_ns);
+    if (ec != std::errc{} || ptr == value) {
+      sent_ns = 0;
+    }
+  }
+  if (sent_ns == 0) {
+    ++deliveries.invalid;
+    return;
+  }
+
+  uint64_t now = now_ns();
+  uint64_t latency = now - std::min(now, sent_ns);
+  deliveries.latencies.push_back(
+      static_cast<uint32_t>(std::min<uint64_t>(latency, UINT32_MAX)));
+}
+
+// Handle the whole frames received by a subscriber
+void read_frames(Subscriber &subscriber, Deliveries &deliveries) {
+  TcpResponse response{};
+  while (auto frame = subscriber.reader.next()) {
+    switch (frame->type) {
+    case TcpMessageType::RESPONSE:
+      TcpResponse::deserialize(response, frame->payload, frame->size);
+      record_delivery(response, deliveries);
+      break;
+    case TcpMessageType::RESPONSE_BATCH: {
+      const std::byte *batch = frame->payload;
+      const std::byte *end = batch + frame->size;
+      while (batch != end) {
+        subscriber.batch_reader.next(response, batch, end);
+        record_delivery(response, deliveries);
+      }
+      break;
+    }
+    case TcpMessageType::HEARTBEAT:
+      // Sent back at once, a failure being noticed by the deliveries missing
+      send(subscriber.fd, TCP_HEARTBEAT_FRAME.data(), TCP_HEARTBEAT_FRAME.size(),
+           MSG_NOSIGNAL);
+      break;
+    default:
+      throw std::invalid_argument("Invalid TCP message type: not a response");
+    }
+  }
+  deliveries.last = Clock::now();
+}
+
+// Publish round-robin over the topics at the target rate, until the duration
+// is over, counting the deliveries expected
+void publish(const Options &options, const sockaddr_in &addr,
+             const std::vector<size_t> &fanouts, size_t &sent,
+             size_t &expected, size_t &failed, double &elapsed_seconds) {
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0 || connect(sockfd, reinterpret_cast<const sockaddr *>(&addr),
+                            sizeof(addr)) < 0) {
+    std::fprintf(stderr, "Failed to create the UDP socket: %s\n",
+                 std::strerror(errno));
+    if (sockfd >= 0) {
+      close(sockfd);
+    }
+    return;
+  }
+
+  // The topic, NUL padded, then the STRING type and the payload
+  std::vector<std::vector<char>> headers(options.topics);
+  for (size_t i = 0; i < options.topics; ++i) {
+    auto name = topic_name(options, i);
+    headers[i].resize(UDP_HEADER_SIZE);
+    std::memcpy(headers[i].data(), name.data(),
+                std::min(name.size(), UDP_HEADER_SIZE - 1));
+    headers[i].back() = 3;
+  }
+  std::vector<char> payload(std::max(options.payload_size, TIME_SIZE), '.');
+
+  // The messages batched, sent once they are batch_records or the next one
+  // does not fit, and the deliveries they are expected to make
+  std::vector<char> datagram{};
+  size_t batched = 0;
+  size_t batched_fanout = 0;
+  auto flush = [&]() {
+    if (batched == 0) {
+      return;
+    }
+    if (send(sockfd, datagram.data(), datagram.size(), 0) < 0) {
+      failed += batched;
+    } else {
+      expected += batched_fanout;
+    }
+    batched = 0;
+    batched_fanout = 0;
+  };
+  auto batch = [&](size_t topic) {
+    std::string_view name(headers[topic].data(),
+                          strnlen(headers[topic].data(), UDP_HEADER_SIZE - 1));
+    size_t record_size =
+        UDP_BATCH_RECORD_HEADER_SIZE + name.size() + payload.size();
+    if (batched > 0 && datagram.size() + record_size > UDP_BATCH_MAX_SIZE) {
+      flush();
+    }
+    if (batched == 0) {
+      datagram.assign({'\0', '\1'});
+    }
+    datagram.push_back(static_cast<char>(name.size()));
+    datagram.insert(datagram.end(), name.begin(), name.end());
+    datagram.push_back(3);
+    datagram.push_back(static_cast<char>(payload.size() >> 8));
+    datagram.push_back(static_cast<char>(payload.size() & 0xff));
+    datagram.insert(datagram.end(), payload.begin(), payload.end());
+    batched_fanout += fanouts[topic];
+    if (++batched == options.batch_records) {
+      flush();
+    }
+  };
+
+  auto start = Clock::now();
+  auto duration = std::chrono::duration<double>(options.seconds);
+  while (true) {
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    if (elapsed >= duration) {
+      break;
+    }
+
+    auto due = static_cast<size_t>(elapsed.count() * options.rate);
+    for (; sent < due; ++sent) {
+      size_t topic = sent % options.topics;
+      auto [end, ec] =
+          std::to_chars(payload.data(), payload.data() + TIME_SIZE, now_ns());
+      std::fill(end, payload.data() + TIME_SIZE, '.');
+
+      if (options.batch_records > 0) {
+        batch(topic);
+        continue;
+      }
+      iovec iov[2] = {{headers[topic].data(), headers[topic].size()},
+                      {payload.data(), payload.size()}};
+      msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = 2;
+      if (sendmsg(sockfd, &msg, 0) < 0) {
+        ++failed;
+        continue;
+      }
+      expected += fanouts[topic];
+    }
+    // The messages due are not held back until the next ones
+    flush();
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  elapsed_seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  close(sockfd);
+}
+
+// Read the deliveries to a share of the subscribers, registered in an epoll
+// instance, until they stop once the publishing is over
+void receive(int epoll_fd, size_t count, const std::atomic<bool> &published,
+             Deliveries &deliveries) {
+  std::vector<epoll_event> events(256);
+  size_t closed = 0;
+  std::optional<Clock::time_point> drain_start{};
+  while (closed < count) {
+    auto now = Clock::now();
+    if (!drain_start && published.load(std::memory_order_acquire)) {
+      drain_start = now;
+    }
+    if (drain_start && (now - *drain_start > DRAIN_MAX ||
+                        now - std::max(deliveries.last, *drain_start) >
+                            DRAIN_IDLE)) {
+      break;
+    }
+
+    int ready = epoll_wait(epoll_fd, events.data(),
+                           static_cast<int>(events.size()), 50);
+    for (int i = 0; i < ready; ++i) {
+      auto &subscriber = *static_cast<Subscriber *>(events[i].data.ptr);
+      try {
+        subscriber.reader.receive(subscriber.fd);
+        read_frames(subscriber, deliveries);
+      } catch (const std::exception &e) {
+        std::fprintf(stderr, "Subscriber disconnected: %s\n", e.what());
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscriber.fd, nullptr);
+        ++closed;
+      }
+    }
+  }
+}
+
+auto percentile(std::vector<uint32_t> &values, double fraction) -> double {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t rank = std::min(values.size() - 1,
+                         static_cast<size_t>(fraction * values.size()));
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank] / 1e3;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options{};
+  if (!parse_options(argc, argv, options)) {
+    return 1;
+  }
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = hton(options.port);
+  if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) != 1) {
+    std::fprintf(stderr, "Invalid host: %s\n", options.host.c_str());
+    return 1;
+  }
+
+  // The subscriber i is read by the thread i modulo the number of threads
+  options.threads = std::min(options.threads, options.subscribers);
+  std::vector<int> epoll_fds(options.threads, -1);
+  for (auto &epoll_fd : epoll_fds) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      std::fprintf(stderr, "Failed to create the epoll instance\n");
+      return 1;
+    }
+  }
+
+  std::vector<size_t> fanouts{};
+  std::vector<Subscriber> subscribers(options.subscribers);
+  try {
+    fanouts = expected_fanouts(options);
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+      subscribers[i].fd = connect_subscriber(options, addr, i);
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.ptr = &subscribers[i];
+      epoll_ctl(epoll_fds[i % epoll_fds.size()], EPOLL_CTL_ADD,
+                subscribers[i].fd, &event);
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  // The subscriptions are not acknowledged
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  size_t sent = 0;
+  size_t expected = 0;
+  size_t failed = 0;
+  double publish_seconds = 0;
+  std::atomic<bool> published{false};
+  auto start = Clock::now();
+  std::thread publisher([&]() {
+    publish(options, addr, fanouts, sent, expected, failed, publish_seconds);
+    published.store(true, std::memory_order_release);
+  });
+
+  std::vector<Deliveries> shares(options.threads);
+  std::vector<std::thread> receivers{};
+  for (size_t i = 0; i < options.threads; ++i) {
+    size_t count = options.subscribers / options.threads +
+                   (i < options.subscribers % options.threads);
+    receivers.emplace_back([&, i, count]() {
+      receive(epoll_fds[i], count, published, shares[i]);
+    });
+  }
+  for (auto &receiver : receivers) {
+    receiver.join();
+  }
+  publisher.join();
+
+  Deliveries deliveries{};
+  for (auto &share : shares) {
+    deliveries.count += share.count;
+    deliveries.invalid += share.invalid;
+    deliveries.latencies.insert(deliveries.latencies.end(),
+                                share.latencies.begin(), share.latencies.end());
+    share.latencies = {};
+    deliveries.last = std::max(deliveries.last, share.last);
+  }
+  double receive_seconds =
+      std::chrono::duration<double>(deliveries.last - start).count();
+
+  for (auto &subscriber : subscribers) {
+    close(subscriber.fd);
+  }
+  for (int epoll_fd : epoll_fds) {
+    close(epoll_fd);
+  }
+
+  size_t dropped = expected > deliveries.count ? expected - deliveries.count : 0;
+  std::printf("subscribers %zu, %zu pattern sets, %zu topics\n",
+              options.subscribers, options.pattern_sets.size(),
+              options.topics);
+  std::printf("published   %zu messages in %.2f s, %.0f msg/s (target %zu), "
+              "%zu failed\n",
+              sent - failed, publish_seconds,
+              publish_seconds > 0 ? (sent - failed) / publish_seconds : 0.0,
+              options.rate, failed);
+  std::printf("delivered   %zu of %zu expected, %.0f msg/s, %zu dropped "
+              "(%.2f%%)\n",
+              deliveries.count, expected,
+              receive_seconds > 0 ? deliveries.count / receive_seconds : 0.0,
+              dropped, expected > 0 ? 100.0 * dropped / expected : 0.0);
+  if (deliveries.invalid > 0) {
+    std::printf("invalid     %zu deliveries without a send time\n",
+                deliveries.invalid);
+  }
+
+  auto &latencies = deliveries.latencies;
+  uint32_t max = latencies.empty()
+                     ? 0
+                     : *std::max_element(latencies.begin(), latencies.end());
+  std::printf("latency us  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  "
+              "max %.1f\n",
+              percentile(latencies, 0.5), percentile(latencies, 0.9),
+              percentile(latencies, 0.99), percentile(latencies, 0.999),
+              max / 1e3);
+  return 0;
+}
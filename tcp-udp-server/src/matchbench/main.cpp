@@ -0,0 +1,358 @@
+/**
+ * Benchmark of the subscription matching as the subscriptions grow: for each
+ * count of subscriptions, over a hierarchy of topics shaped like those of the
+ * sample payloads (<campus>/<building>/<kind>/<index>/<metric>), scaled up, a
+ * mix of exact, '+' and '*' subscriptions is parsed with
+ * TokenPattern::from_string, subscribed in a SubscribersRegistry and matched
+ * against published topics, with TokenPattern::matches and with
+ * SubscribersRegistry::retrieve_topic_subscribers, both for topics missing
+ * its cache and for a few topics published over and over.
+ *
+ * Reported for each step: the operations per second, the allocations per
+ * operation, counted by replacing the global operator new (by the tracking of
+ * the server when built with ALLOC_TRACKING=1), the hardware counters per
+ * operation (cycles, instructions per cycle, L1D and LLC misses, branch
+ * misses and dTLB misses, '-' for those that cannot be counted), and the
+ * memory of the registry per subscription, as the bytes it holds allocated.
+ *
+ * Usage: ./matchbench [subscriptions]...
+ *
+ *   The counts of subscriptions, 1000 10000 100000 1000000 by default, each
+ *   subscriber having SUBSCRIPTIONS_PER_SUBSCRIBER of them
+ *
+ *   MATCHBENCH_SHARDS sets the shards of the wildcard subscriptions of the
+ *   registry, walked in parallel, 1 by default
+ */
+#include "alloc_tracking.hpp"
+#include "pmu_counters.hpp"
+#include "subscribers_registry.hpp"
+#include "token_pattern.hpp"
+#include "topic_view.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef ENABLE_ALLOC_TRACKING
+
+namespace {
+
+// The allocations made through the global operator new, and the bytes they
+// hold, as given by malloc_usable_size
+size_t allocation_count = 0;
+size_t live_byte_count = 0;
+
+auto counted_alloc(size_t size) -> void * {
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  ++allocation_count;
+  live_byte_count += malloc_usable_size(ptr);
+  return ptr;
+}
+
+void counted_free(void *ptr) noexcept {
+  if (ptr != nullptr) {
+    live_byte_count -= malloc_usable_size(ptr);
+    std::free(ptr);
+  }
+}
+
+auto allocations() -> size_t { return allocation_count; }
+auto live_bytes() -> size_t { return live_byte_count; }
+
+} // namespace
+
+void *operator new(size_t size) { return counted_alloc(size); }
+void *operator new[](size_t size) { return counted_alloc(size); }
+void operator delete(void *ptr) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr) noexcept { counted_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { counted_free(ptr); }
+
+#else
+
+namespace {
+
+// The operators are those of the tracking of the server, the registry being
+// built and matched on this thread
+auto allocations() -> size_t {
+  return alloc_tracking::thread_counters().allocations;
+}
+auto live_bytes() -> size_t {
+  return static_cast<size_t>(alloc_tracking::thread_counters().live_bytes);
+}
+
+} // namespace
+
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t SUBSCRIPTIONS_PER_SUBSCRIBER = 10;
+// The published topics, drawn from the hierarchy, and those published over
+// and over, which the registry keeps cached
+constexpr size_t PUBLISHED_TOPICS = 1 << 16;
+constexpr size_t HOT_TOPICS = 64;
+// Each measure runs for at least this long
+constexpr std::chrono::milliseconds MIN_DURATION{300};
+// Out of 100 subscriptions, the exact ones and the ones with a '+', the rest
+// having a '*'
+constexpr unsigned EXACT_PERCENT = 70;
+constexpr unsigned PLUS_PERCENT = 20;
+
+// The hierarchy, of 4 * 16 * 4 * 64 * 6 = 98304 topics
+const char *const CAMPUSES[] = {"upb", "unibuc", "ase", "umf"};
+constexpr size_t BUILDINGS = 16;
+const char *const KINDS[] = {"elevator", "room", "lab", "hall"};
+constexpr size_t INDICES = 64;
+const char *const METRICS[] = {"temperature", "humidity", "people",
+                               "floor",       "co2",      "light"};
+constexpr size_t LEVELS = 5;
+
+template <typename T, size_t N> constexpr size_t count(const T (&)[N]) {
+  return N;
+}
+
+// The tokens of a random topic of the hierarchy
+auto random_tokens(std::mt19937 &rng) -> std::vector<std::string> {
+  return {CAMPUSES[rng() % count(CAMPUSES)],
+          "b" + std::to_string(rng() % BUILDINGS),
+          KINDS[rng() % count(KINDS)], std::to_string(rng() % INDICES),
+          METRICS[rng() % count(METRICS)]};
+}
+
+auto join(const std::vector<std::string> &tokens) -> std::string {
+  std::string topic = tokens.front();
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    topic += "/" + tokens[i];
+  }
+  return topic;
+}
+
+auto random_topic(std::mt19937 &rng) -> std::string {
+  return join(random_tokens(rng));
+}
+
+// An exact subscription, one with one or two '+' in place of tokens, or one
+// with a '*' in place of the tokens after a prefix or between two of them
+auto random_subscription(std::mt19937 &rng) -> std::string {
+  auto tokens = random_tokens(rng);
+  unsigned kind = rng() % 100;
+  if (kind < EXACT_PERCENT) {
+    return join(tokens);
+  }
+  if (kind < EXACT_PERCENT + PLUS_PERCENT) {
+    size_t level = rng() % LEVELS;
+    tokens[level] = "+";
+    // Two tokens apart, as consecutive wildcards are rejected
+    if (rng() % 2) {
+      tokens[(level + 2) % LEVELS] = "+";
+    }
+    return join(tokens);
+  }
+
+  size_t first = 1 + rng() % (LEVELS - 1);
+  if (rng() % 2) {
+    // sensors/*
+    tokens.resize(first);
+    tokens.emplace_back("*");
+  } else {
+    // upb/*/temperature
+    tokens.erase(tokens.begin() + first, tokens.end() - 1);
+    tokens.insert(tokens.end() - 1, "*");
+  }
+  return join(tokens);
+}
+
+struct Measure {
+  double per_second{};
+  double allocations_per_op{};
+  double ops{};
+  PmuCounters::Counts counts{};
+};
+
+// Opened before the registries, so that the threads walking their shards are
+// counted too
+auto pmu_counters() -> PmuCounters & {
+  static PmuCounters counters{};
+  return counters;
+}
+
+// Run an operation over the indices of its inputs, round-robin, for at least
+// MIN_DURATION and at least min_ops times
+template <typename Op>
+auto measure(size_t inputs, size_t min_ops, Op &&op) -> Measure {
+  // The clock is read once every so many operations
+  constexpr size_t batch = 64;
+  size_t ops = 0;
+  size_t start_allocations = allocations();
+  auto &counters = pmu_counters();
+  counters.reset();
+  counters.start();
+  auto start = Clock::now();
+  auto elapsed = Clock::duration{};
+  do {
+    for (size_t end = ops + batch; ops < end; ++ops) {
+      op(ops % inputs);
+    }
+    elapsed = Clock::now() - start;
+  } while (elapsed < MIN_DURATION || ops < min_ops);
+  counters.stop();
+
+  std::chrono::duration<double> seconds = elapsed;
+  return {ops / seconds.count(),
+          static_cast<double>(allocations() - start_allocations) / ops,
+          static_cast<double>(ops), counters.read()};
+}
+
+void print(const char *step, size_t subscriptions, const Measure &m) {
+  std::printf("%-10zu %-12s %14.0f %12.2f", subscriptions, step, m.per_second,
+              m.allocations_per_op);
+  auto per_op = [&](PmuCounters::Event event) {
+    if (auto count = m.counts[event]) {
+      std::printf(" %10.1f", *count / m.ops);
+    } else {
+      std::printf(" %10s", "-");
+    }
+  };
+  per_op(PmuCounters::Event::CYCLES);
+  auto cycles = m.counts[PmuCounters::Event::CYCLES];
+  auto instructions = m.counts[PmuCounters::Event::INSTRUCTIONS];
+  if (cycles && instructions && *cycles > 0) {
+    std::printf(" %6.2f", *instructions / *cycles);
+  } else {
+    std::printf(" %6s", "-");
+  }
+  per_op(PmuCounters::Event::L1D_MISSES);
+  per_op(PmuCounters::Event::LLC_MISSES);
+  per_op(PmuCounters::Event::BRANCH_MISSES);
+  per_op(PmuCounters::Event::DTLB_MISSES);
+  std::printf("\n");
+}
+
+void run(size_t subscriptions, size_t shards, std::mt19937 &rng) {
+  std::vector<std::string> strings(subscriptions);
+  for (auto &str : strings) {
+    str = random_subscription(rng);
+  }
+
+  std::vector<TokenPattern> patterns(subscriptions);
+  auto parsed = measure(subscriptions, subscriptions, [&](size_t i) {
+    patterns[i] = TokenPattern::from_string(strings[i]);
+  });
+  print("from_string", subscriptions, parsed);
+
+  // Each subscriber holding SUBSCRIPTIONS_PER_SUBSCRIBER of the patterns,
+  // those it gets twice counting once
+  size_t bytes_before = live_bytes();
+  std::optional<SubscribersRegistry> registry{std::in_place, false, 0,
+                                              PriorityClasses{}, false, 0,
+                                              shards};
+  size_t subscribers = (subscriptions + SUBSCRIPTIONS_PER_SUBSCRIBER - 1) /
+                       SUBSCRIPTIONS_PER_SUBSCRIBER;
+  constexpr int first_sockfd = 1000;
+  for (size_t i = 0; i < subscribers; ++i) {
+    int sockfd = first_sockfd + static_cast<int>(i);
+    registry->connect_subscriber(sockfd, "s" + std::to_string(i));
+  }
+  auto subscribe_start = Clock::now();
+  for (size_t i = 0; i < subscriptions; ++i) {
+    int sockfd =
+        first_sockfd + static_cast<int>(i / SUBSCRIPTIONS_PER_SUBSCRIBER);
+    registry->subscribe_to_topic(sockfd, patterns[i]);
+  }
+  std::chrono::duration<double> subscribe_seconds =
+      Clock::now() - subscribe_start;
+  size_t registry_bytes = live_bytes() - bytes_before;
+
+  std::vector<std::string> topic_strings(PUBLISHED_TOPICS);
+  std::vector<TokenPattern> topics(PUBLISHED_TOPICS);
+  std::vector<TopicView> views;
+  views.reserve(PUBLISHED_TOPICS);
+  for (size_t i = 0; i < PUBLISHED_TOPICS; ++i) {
+    topic_strings[i] = random_topic(rng);
+    topics[i] = TokenPattern::from_string(topic_strings[i]);
+    views.push_back(*TopicView::from_string(topic_strings[i]));
+  }
+
+  // Each topic against the subscriptions in turn, so that every pattern is
+  // matched
+  size_t matched = 0;
+  auto matches = measure(subscriptions, 0, [&](size_t i) {
+    matched += patterns[i].matches(topics[i % PUBLISHED_TOPICS]);
+  });
+  print("matches", subscriptions, matches);
+
+  // The published topics are more than the registry caches, so that every
+  // lookup recomputes the subscribers of its topic
+  size_t delivered = 0;
+  size_t cold_lookups = 0;
+  auto retrieved = measure(PUBLISHED_TOPICS, 0, [&](size_t i) {
+    delivered += registry->retrieve_topic_subscribers(views[i]).sockets.size();
+    ++cold_lookups;
+  });
+  print("retrieve", subscriptions, retrieved);
+  auto cached = measure(HOT_TOPICS, 0, [&](size_t i) {
+    registry->retrieve_topic_subscribers(views[i]);
+  });
+  print("cached", subscriptions, cached);
+
+  std::printf("%-10zu %-12s %14.0f %12s   %.1f B/subscription, "
+              "%.2f subscribers/topic\n",
+              subscriptions, "subscribe",
+              subscriptions / subscribe_seconds.count(), "-",
+              static_cast<double>(registry_bytes) / subscriptions,
+              static_cast<double>(delivered) / cold_lookups);
+  registry.reset();
+  // Keeps the matches from being optimized away
+  if (matched == ~size_t{0}) {
+    std::printf("%zu\n", matched);
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector<size_t> counts;
+  for (int i = 1; i < argc; ++i) {
+    size_t subscriptions = std::strtoull(argv[i], nullptr, 10);
+    if (subscriptions == 0) {
+      std::fprintf(stderr, "Invalid subscriptions count: %s\n", argv[i]);
+      return 1;
+    }
+    counts.push_back(subscriptions);
+  }
+  if (counts.empty()) {
+    counts = {1000, 10000, 100000, 1000000};
+  }
+  size_t shards = 1;
+  if (const char *value = std::getenv("MATCHBENCH_SHARDS"); value != nullptr) {
+    shards = std::strtoull(value, nullptr, 10);
+    if (shards == 0 || shards > MatchPool::MAX_TASKS) {
+      std::fprintf(stderr, "Invalid MATCHBENCH_SHARDS: %s\n", value);
+      return 1;
+    }
+  }
+
+  std::mt19937 rng(42);
+  if (!pmu_counters().available()) {
+    std::printf("(no hardware counters: perf_event_open cannot count them "
+                "here)\n");
+  }
+  std::printf("%-10s %-12s %14s %12s %10s %6s %10s %10s %10s %10s\n", "subs",
+              "step", "ops/s", "allocs/op", "cycles/op", "IPC", "L1D/op",
+              "LLC/op", "brmiss/op", "dTLB/op");
+  for (size_t subscriptions : counts) {
+    run(subscriptions, shards, rng);
+  }
+  return 0;
+}
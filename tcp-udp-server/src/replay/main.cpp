@@ -0,0 +1,405 @@
+/**
+ * Replay of a capture of the input of the server, recorded with
+ * SERVER_CAPTURE_FILE: a Server, on a single thread with epoll and its
+ * statistics collected, is driven from the records of the capture instead of
+ * its sockets. The datagrams are handed to it in batches of consecutive
+ * datagrams, as received by a recvmmsg, and each subscriber is a socket pair,
+ * the server writing to one end and the other being a sink counting the bytes
+ * and the frames delivered, read after each record.
+ *
+ * Reported: the records, datagrams and requests processed per second, over
+ * the whole replay and over the time spent in the server, the deliveries to
+ * the sinks, the profile of the stages of the server, as given by its
+ * statistics, and the hardware counters of the time spent in the server per
+ * record (cycles, instructions, cache, branch and TLB misses), when the
+ * processor and the kernel let them be counted.
+ *
+ * Usage: ./replay [-f] capture
+ *
+ *   -f  the records are replayed as fast as possible, instead of at the
+ *       times they were recorded at
+ */
+#include "capture.hpp"
+#include "frame_reader.hpp"
+#include "pmu_counters.hpp"
+#include "server.hpp"
+#include "tcp_utils.hpp"
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Most sinks read per epoll_wait
+constexpr size_t SINK_EVENTS = 64;
+
+struct Options {
+  bool fast{};
+  std::string capture{};
+};
+
+// The end of the socket pair of a subscriber read by the replay
+struct Sink {
+  int fd{-1};
+  FrameReader input{};
+};
+
+// What the replay processed and delivered
+struct Totals {
+  size_t records{};
+  size_t datagrams{};
+  size_t batches{};
+  size_t requests{};
+  size_t connections{};
+  uint64_t delivered_bytes{};
+  uint64_t delivered_frames{};
+  // the time spent in the server, the pacing and the sinks excluded
+  Clock::duration busy{};
+};
+
+// Opened before the server, so that the threads it starts are counted too
+auto pmu_counters() -> PmuCounters & {
+  static PmuCounters counters{};
+  return counters;
+}
+
+// Run a call into the server, timed and counted as its busy time
+template <typename Fn> void in_server(Totals &totals, Fn &&fn) {
+  auto start = Clock::now();
+  pmu_counters().start();
+  fn();
+  pmu_counters().stop();
+  totals.busy += Clock::now() - start;
+}
+
+void usage(const char *name) {
+  std::fprintf(stderr, "Usage: %s [-f] capture\n", name);
+}
+
+bool parse_options(int argc, char *argv[], Options &options) {
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "f")) != -1) {
+    switch (opt) {
+    case 'f':
+      options.fast = true;
+      break;
+    default:
+      usage(argv[0]);
+      return false;
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return false;
+  }
+  options.capture = argv[optind];
+  return true;
+}
+
+/**
+ * @brief Read the frames delivered to the sinks which are readable
+ *
+ * @param epoll_fd The epoll instance watching the sinks
+ * @param totals The bytes and frames delivered, counted
+ * @return Whether any sink was readable
+ */
+bool drain_sinks(int epoll_fd, Totals &totals) {
+  std::array<epoll_event, SINK_EVENTS> events{};
+  int ready = epoll_wait(epoll_fd, events.data(),
+                         static_cast<int>(events.size()), 0);
+  for (int i = 0; i < ready; ++i) {
+    auto &sink = *static_cast<Sink *>(events[i].data.ptr);
+    if (sink.fd < 0) {
+      continue;
+    }
+    try {
+      while (true) {
+        // The complete frames first, so that the buffer has room
+        FrameReader::Frame frame{};
+        while (sink.input.read(frame) !=
+               FrameReader::Status::INCOMPLETE) {
+          ++totals.delivered_frames;
+        }
+        size_t received = sink.input.receive(sink.fd);
+        if (received == 0) {
+          break;
+        }
+        totals.delivered_bytes += received;
+      }
+    } catch (const TcpSocketException &) {
+      // Disconnected by the server, its end being closed with the record
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sink.fd, nullptr);
+    }
+  }
+  return ready > 0;
+}
+
+/**
+ * @brief Write a frame of a subscriber to its end of the socket pair, the
+ * server reading it at its next round
+ *
+ * @param server The server, run while the socket is full
+ * @param epoll_fd The epoll instance watching the sinks
+ * @param sink The sink of the subscriber
+ * @param record The request, a whole frame
+ * @param totals What the replay delivered
+ */
+void write_request(Server &server, int epoll_fd, Sink &sink,
+                   const CaptureReader::Record &record, Totals &totals) {
+  size_t written = 0;
+  while (written < record.size) {
+    ssize_t result = send(sink.fd, record.data + written, record.size - written,
+                          MSG_NOSIGNAL);
+    if (result >= 0) {
+      written += static_cast<size_t>(result);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      in_server(totals, [&] { server.run_once(); });
+      drain_sinks(epoll_fd, totals);
+    } else if (errno != EINTR) {
+      // The server closed the connection
+      return;
+    }
+  }
+}
+
+void print_stage(const char *name, const Histogram &stage, double busy_ns) {
+  if (stage.count() == 0) {
+    std::printf("%-10s  %10s\n", name, "-");
+    return;
+  }
+  std::printf("%-10s  %10llu  %10.0f  %10llu  %10llu  %10llu  %5.1f%%\n", name,
+              static_cast<unsigned long long>(stage.count()),
+              static_cast<double>(stage.sum()) /
+                  static_cast<double>(stage.count()),
+              static_cast<unsigned long long>(stage.percentile(0.5)),
+              static_cast<unsigned long long>(stage.percentile(0.99)),
+              static_cast<unsigned long long>(stage.max()),
+              busy_ns > 0 ? 100.0 * static_cast<double>(stage.sum()) / busy_ns
+                          : 0.0);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options{};
+  if (!parse_options(argc, argv, options)) {
+    return 1;
+  }
+
+  std::optional<CaptureReader> reader{};
+  try {
+    reader.emplace(options.capture);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  // The server reads no commands, and its messages about the clients and its
+  // errors are those of the capture, the report being printed with printf
+  int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0) {
+    std::fprintf(stderr, "Failed to redirect stdin: %s\n",
+                 std::strerror(errno));
+    return 1;
+  }
+  close(null_fd);
+  std::cout.setstate(std::ios::badbit);
+#ifndef ENABLE_ERROR_MESSAGES
+  std::cerr.setstate(std::ios::badbit);
+#endif
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    std::fprintf(stderr, "Failed to create the epoll instance\n");
+    return 1;
+  }
+
+  pmu_counters();
+  std::unique_ptr<Server> server{};
+  try {
+    BrokerStatsConfig stats_config{};
+    stats_config.enabled = true;
+    server = std::make_unique<Server>(0, OutputQueueConfig{}, 1,
+                                      IoBackend::EPOLL, MessageStoreConfig{},
+                                      stats_config);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  // The sinks by the source of their records, the id of their connection
+  std::unordered_map<uint32_t, std::unique_ptr<Sink>> sinks{};
+  std::array<sockaddr_in, UdpBatch::CAPACITY> senders{};
+  std::array<const std::byte *, UdpBatch::CAPACITY> datagrams{};
+  std::array<size_t, UdpBatch::CAPACITY> sizes{};
+  Totals totals{};
+  uint64_t last_ns = 0;
+
+  auto start = Clock::now();
+  auto due = [&](uint64_t time_ns) {
+    return options.fast ||
+           Clock::now() >= start + std::chrono::nanoseconds(time_ns);
+  };
+
+  try {
+    auto record = reader->next();
+    while (record) {
+      if (!options.fast) {
+        std::this_thread::sleep_until(start +
+                                      std::chrono::nanoseconds(record->time_ns));
+      }
+      last_ns = record->time_ns;
+
+      switch (record->kind) {
+      case CaptureKind::DATAGRAM: {
+        // The consecutive datagrams already due, as a single recvmmsg
+        size_t count = 0;
+        do {
+          senders[count] = sockaddr_in{};
+          senders[count].sin_family = AF_INET;
+          senders[count].sin_addr.s_addr = record->source;
+          senders[count].sin_port = record->port;
+          datagrams[count] = record->data;
+          sizes[count] = record->size;
+          ++count;
+          last_ns = record->time_ns;
+          record = reader->next();
+        } while (record && record->kind == CaptureKind::DATAGRAM &&
+                 count < UdpBatch::CAPACITY && due(record->time_ns));
+        totals.records += count;
+        totals.datagrams += count;
+        ++totals.batches;
+
+        in_server(totals, [&] {
+          server->publish_datagrams(senders.data(), datagrams.data(),
+                                    sizes.data(), count);
+          server->run_once();
+        });
+        break;
+      }
+      case CaptureKind::CONNECT: {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                       fds) < 0) {
+          throw std::runtime_error(std::string("Failed to create a socket "
+                                               "pair: ") +
+                                   std::strerror(errno));
+        }
+        auto sink = std::make_unique<Sink>();
+        sink->fd = fds[1];
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = sink.get();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sink->fd, &event);
+        if (auto it = sinks.find(record->source); it != sinks.end()) {
+          close(it->second->fd);
+        }
+        sinks[record->source] = std::move(sink);
+        ++totals.connections;
+
+        in_server(totals, [&] { server->adopt_client(fds[0]); });
+        record = reader->next();
+        ++totals.records;
+        break;
+      }
+      case CaptureKind::DISCONNECT:
+      case CaptureKind::REQUEST: {
+        auto it = sinks.find(record->source);
+        if (it != sinks.end() && record->kind == CaptureKind::REQUEST) {
+          write_request(*server, epoll_fd, *it->second, *record, totals);
+          ++totals.requests;
+        } else if (it != sinks.end()) {
+          close(it->second->fd);
+          sinks.erase(it);
+        }
+
+        in_server(totals, [&] { server->run_once(); });
+        record = reader->next();
+        ++totals.records;
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown record in the capture");
+      }
+
+      drain_sinks(epoll_fd, totals);
+    }
+
+    // The messages still queued by the server, sent as the sinks are read
+    do {
+      in_server(totals, [&] { server->run_once(); });
+    } while (drain_sinks(epoll_fd, totals));
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  double busy_ns = std::chrono::duration<double, std::nano>(totals.busy).count();
+  double busy_seconds = busy_ns / 1e9;
+
+  std::printf("capture     %zu records over %.3f s, replayed %s\n",
+              totals.records, static_cast<double>(last_ns) / 1e9,
+              options.fast ? "as fast as possible" : "at the recorded speed");
+  std::printf("replay      %.3f s, %.0f records/s, %.0f datagrams/s, "
+              "%.0f requests/s\n",
+              seconds, static_cast<double>(totals.records) / seconds,
+              static_cast<double>(totals.datagrams) / seconds,
+              static_cast<double>(totals.requests) / seconds);
+  std::printf("server      %.3f s busy, %.0f datagrams/s, %.0f requests/s\n",
+              busy_seconds,
+              busy_seconds > 0
+                  ? static_cast<double>(totals.datagrams) / busy_seconds
+                  : 0.0,
+              busy_seconds > 0
+                  ? static_cast<double>(totals.requests) / busy_seconds
+                  : 0.0);
+  std::printf("input       %zu datagrams in %zu batches, %zu requests, "
+              "%zu connections\n",
+              totals.datagrams, totals.batches, totals.requests,
+              totals.connections);
+  std::printf("delivered   %llu frames, %llu bytes\n",
+              static_cast<unsigned long long>(totals.delivered_frames),
+              static_cast<unsigned long long>(totals.delivered_bytes));
+  std::string pmu_line = pmu_counters().read().describe_per(
+      static_cast<double>(totals.records), "record");
+  std::printf("pmu         %s\n",
+              pmu_line.empty()
+                  ? "no hardware counters, perf_event_open cannot count them"
+                  : pmu_line.c_str());
+
+  // The share of the time in the server of each stage, the matching being
+  // part of the fan-out
+  const BrokerStats &stats = *server->stats();
+  std::printf("\n%-10s  %10s  %10s  %10s  %10s  %10s  %6s\n", "stage ns",
+              "count", "mean", "p50", "p99", "max", "busy");
+  print_stage("parse", stats.parse_ns.merged(), busy_ns);
+  print_stage("fanout", stats.fanout_ns.merged(), busy_ns);
+  print_stage("  match", stats.match_ns.merged(), busy_ns);
+  print_stage("flush", stats.flush_ns.merged(), busy_ns);
+  print_stage("request", stats.request_ns.merged(), busy_ns);
+
+  server.reset();
+  for (auto &[source, sink] : sinks) {
+    close(sink->fd);
+  }
+  close(epoll_fd);
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include "acceptor.hpp"
+
+#include "async_log.hpp"
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+
+// How long the thread waits before accepting again, once out of fds
+constexpr std::chrono::milliseconds FD_EXHAUSTED_DELAY{10};
+
+} // namespace
+
+Acceptor::Acceptor(int listen_fd) : listen_fd_(listen_fd) {
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    throw std::runtime_error("Failed to create the eventfd of the acceptor");
+  }
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0) {
+    close(event_fd_);
+    throw std::runtime_error("Failed to create the eventfd of the acceptor");
+  }
+
+  thread_ = std::thread(&Acceptor::run, this);
+}
+
+Acceptor::~Acceptor() {
+  stop();
+  while (auto sockfd = pop()) {
+    close(*sockfd);
+  }
+  close(stop_fd_);
+  close(event_fd_);
+}
+
+void Acceptor::stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) < 0) {
+    log_error("Failed to stop the acceptor: ", std::strerror(errno));
+  }
+  thread_.join();
+}
+
+auto Acceptor::pop() -> std::optional<int> { return accepted_.pop(); }
+
+void Acceptor::clear_event() {
+  uint64_t count{};
+  if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    log_error("Failed to read the eventfd of the acceptor: ",
+              std::strerror(errno));
+  }
+}
+
+void Acceptor::wake() {
+  uint64_t one = 1;
+  if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log_error("Failed to wake the event loop up: ", std::strerror(errno));
+  }
+}
+
+void Acceptor::run() {
+  std::array<pollfd, 2> fds{pollfd{listen_fd_, POLLIN, 0},
+                            pollfd{stop_fd_, POLLIN, 0}};
+
+  while (true) {
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Error in the poll of the acceptor: ", std::strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+    if (!(fds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    // Drained, the event loop being woken up once for all the connections
+    size_t accepted = 0;
+    while (true) {
+      int client_fd =
+          accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd >= 0) {
+        accepted_.push(client_fd);
+        ++accepted;
+        continue;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error("Error accepting TCP connection: ", std::strerror(errno));
+        // The socket stays readable, so it is not polled again at once
+        if (errno == EMFILE || errno == ENFILE) {
+          std::this_thread::sleep_for(FD_EXHAUSTED_DELAY);
+        }
+      }
+      break;
+    }
+    if (accepted > 0) {
+      wake();
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "mpsc_queue.hpp"
+#include <optional>
+#include <sys/socket.h>
+#include <thread>
+
+struct AcceptConfig {
+  // The length of the queue of the connections not accepted yet, capped by
+  // net.core.somaxconn
+  int backlog{SOMAXCONN};
+  // Whether the connections are accepted by a dedicated thread, with epoll
+  bool thread{};
+};
+
+/**
+ * @brief Thread accepting the TCP connections of a listening socket, so that
+ * a storm of connections does not delay the event loop
+ *
+ * The connections are accepted until the socket would block, non-blocking
+ * and closed on exec, and handed to the event loop through a lock-free queue,
+ * which is woken up once per drain by an eventfd.
+ */
+class Acceptor {
+public:
+  /**
+   * @brief Start an acceptor thread
+   *
+   * @param listen_fd The listening socket, non-blocking, owned by the caller
+   *
+   * @throws std::runtime_error if the eventfds cannot be created
+   */
+  explicit Acceptor(int listen_fd);
+
+  /**
+   * @brief Stop the acceptor thread, closing the connections not popped
+   */
+  ~Acceptor();
+
+  /**
+   * @brief Stop the acceptor thread, the connections not popped yet staying
+   * to be popped
+   */
+  void stop();
+
+  Acceptor(const Acceptor &) = delete;
+  auto operator=(const Acceptor &) -> Acceptor & = delete;
+
+  /**
+   * @brief Get the eventfd readable once connections were accepted, reset by
+   * clear_event
+   */
+  auto event_fd() const -> int { return event_fd_; }
+
+  /**
+   * @brief Get the next accepted connection, from the thread of the event
+   * loop only
+   *
+   * @return The socket of the connection, or std::nullopt if there is none
+   */
+  auto pop() -> std::optional<int>;
+
+  /**
+   * @brief Reset the eventfd, before the connections are popped
+   */
+  void clear_event();
+
+private:
+  void run();
+  void wake();
+
+  int listen_fd_{-1};
+  int event_fd_{-1};
+  // written to stop the thread
+  int stop_fd_{-1};
+  MpscQueue<int> accepted_{};
+
+  std::thread thread_{};
+};
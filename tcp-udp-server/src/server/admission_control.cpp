@@ -0,0 +1,114 @@
+#include "admission_control.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+// The mixing of splitmix64, spreading the addresses of a subnet across the
+// table
+auto mix(uint64_t key) -> uint64_t {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111eb;
+  return key ^ (key >> 31);
+}
+
+} // namespace
+
+AdmissionControl::AdmissionControl(const AdmissionConfig &config)
+    : publisher_limit_(make_limit(config.publisher_rate, config.publisher_burst)),
+      global_limit_(make_limit(config.global_rate, config.global_burst)) {
+  // Mostly free, so that a publisher is found within a few probes
+  size_t slots = MAX_PROBES;
+  while (slots < 2 * config.max_publishers) {
+    slots *= 2;
+  }
+  if (publisher_limit_.rate > 0) {
+    slots_.resize(slots);
+  }
+  global_bucket_.tokens = global_limit_.capacity;
+}
+
+auto AdmissionControl::make_limit(size_t rate, size_t burst) -> Limit {
+  Limit limit{};
+  if (rate == 0) {
+    return limit;
+  }
+  // Capped so that the tokens of a bucket fit in 64 bits
+  constexpr uint64_t max_burst = 1000000000;
+  limit.rate = std::min<uint64_t>(rate, max_burst);
+  uint64_t packets = std::min<uint64_t>(burst > 0 ? burst : rate, max_burst);
+  limit.capacity = packets * TOKEN;
+  limit.fill_ns = limit.capacity / limit.rate;
+  return limit;
+}
+
+auto AdmissionControl::refill(Bucket &bucket, const Limit &limit,
+                              uint64_t now_ns) -> bool {
+  uint64_t elapsed = now_ns - bucket.last_ns;
+  bucket.last_ns = now_ns;
+  // Below fill_ns, elapsed * rate stays below the capacity
+  if (elapsed >= limit.fill_ns) {
+    bucket.tokens = limit.capacity;
+  } else {
+    bucket.tokens = std::min(limit.capacity, bucket.tokens + elapsed * limit.rate);
+  }
+  return bucket.tokens >= TOKEN;
+}
+
+auto AdmissionControl::find_bucket(uint64_t key, uint64_t now_ns) -> Bucket & {
+  size_t mask = slots_.size() - 1;
+  size_t start = mix(key) & mask;
+  Slot *victim = nullptr;
+  for (size_t probe = 0; probe < MAX_PROBES; ++probe) {
+    Slot &slot = slots_[(start + probe) & mask];
+    if (slot.key == key) {
+      return slot.bucket;
+    }
+    if (slot.key == 0) {
+      victim = &slot;
+      break;
+    }
+    if (victim == nullptr || slot.bucket.last_ns < victim->bucket.last_ns) {
+      victim = &slot;
+    }
+  }
+
+  // A new publisher starts with a full bucket
+  victim->key = key;
+  victim->bucket = Bucket{publisher_limit_.capacity, now_ns};
+  return victim->bucket;
+}
+
+auto AdmissionControl::admit(const sockaddr_in &sender, uint64_t now_ns)
+    -> AdmissionResult {
+  Bucket *publisher = nullptr;
+  if (publisher_limit_.rate > 0) {
+    // The bit above the address and the port keeps a key from being 0
+    uint64_t key = (uint64_t{sender.sin_addr.s_addr} << 16 | sender.sin_port) |
+                   uint64_t{1} << 48;
+    publisher = &find_bucket(key, now_ns);
+    if (!refill(*publisher, publisher_limit_, now_ns)) {
+      return AdmissionResult::PUBLISHER_LIMITED;
+    }
+  }
+  if (global_limit_.rate > 0) {
+    if (!refill(global_bucket_, global_limit_, now_ns)) {
+      return AdmissionResult::GLOBAL_LIMITED;
+    }
+    global_bucket_.tokens -= TOKEN;
+  }
+  if (publisher != nullptr) {
+    publisher->tokens -= TOKEN;
+  }
+  return AdmissionResult::ADMITTED;
+}
+
+auto AdmissionControl::now_ns() -> uint64_t {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
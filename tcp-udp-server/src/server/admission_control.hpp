@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <vector>
+
+struct AdmissionConfig {
+  // The UDP packets admitted per second from a single publisher, by its
+  // address, and how many may come at once above the rate, the rate itself if
+  // 0, the publishers being unlimited if the rate is 0
+  size_t publisher_rate{};
+  size_t publisher_burst{};
+  // The same limits, for all the publishers together
+  size_t global_rate{};
+  size_t global_burst{};
+  // The number of publishers kept track of, the table of their buckets having
+  // twice as many slots
+  size_t max_publishers{4096};
+
+  bool enabled() const { return publisher_rate > 0 || global_rate > 0; }
+};
+
+// Whether a UDP packet is processed, as returned by AdmissionControl::admit
+enum class AdmissionResult : uint8_t {
+  ADMITTED = 0,
+  // Its publisher exceeded its own rate
+  PUBLISHER_LIMITED,
+  // All the publishers together exceeded the global rate
+  GLOBAL_LIMITED,
+};
+
+/**
+ * @brief Token buckets limiting the rate of the UDP packets, of each
+ * publisher and of all of them, checked before the packets are parsed
+ *
+ * The buckets of the publishers are kept in an open-addressing table of a
+ * fixed size, keyed by the address and the port of the publisher, so that a
+ * flood of senders costs neither allocations nor an unbounded table: a new
+ * publisher takes the first free slot among the few it is probed in, or that
+ * of the publisher seen the longest ago among them. The tokens are counted in
+ * nanoseconds of the rate, so that refilling them is integer arithmetic.
+ */
+class AdmissionControl {
+public:
+  explicit AdmissionControl(const AdmissionConfig &config);
+
+  /**
+   * @brief Decide whether a packet is processed, taking a token from the
+   * bucket of its publisher and from the global one if both have one
+   *
+   * @param sender The address of the publisher
+   * @param now_ns The current time of a monotonic clock, in nanoseconds
+   * @return AdmissionResult::ADMITTED, or the limit the packet exceeds
+   */
+  auto admit(const sockaddr_in &sender, uint64_t now_ns) -> AdmissionResult;
+
+  /**
+   * @brief Get the time of the steady clock, as given to admit
+   *
+   * @return The nanoseconds since an unspecified point
+   */
+  static auto now_ns() -> uint64_t;
+
+private:
+  // A packet costs a second of the rate
+  static constexpr uint64_t TOKEN = 1000000000;
+  // The slots a publisher is looked up in, from the one of its hash
+  static constexpr size_t MAX_PROBES = 8;
+
+  struct Limit {
+    uint64_t rate{};
+    // the tokens of a full bucket, and the time it takes to fill an empty one
+    uint64_t capacity{};
+    uint64_t fill_ns{};
+  };
+
+  struct Bucket {
+    uint64_t tokens{};
+    uint64_t last_ns{};
+  };
+
+  struct Slot {
+    // the address and the port of the publisher, 0 if the slot is free
+    uint64_t key{};
+    Bucket bucket{};
+  };
+
+  static auto make_limit(size_t rate, size_t burst) -> Limit;
+  // Refill the bucket up to the current time, and check it has a token
+  static auto refill(Bucket &bucket, const Limit &limit, uint64_t now_ns)
+      -> bool;
+  auto find_bucket(uint64_t key, uint64_t now_ns) -> Bucket &;
+
+  Limit publisher_limit_{};
+  Limit global_limit_{};
+  Bucket global_bucket_{};
+
+  // a power of 2, empty if the publishers are unlimited
+  std::vector<Slot> slots_{};
+};
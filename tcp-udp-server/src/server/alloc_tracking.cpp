@@ -0,0 +1,208 @@
+#include "alloc_tracking.hpp"
+
+#ifdef ENABLE_ALLOC_TRACKING
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+
+namespace alloc_tracking {
+
+namespace {
+
+// The scopes counted apart, the others being counted with the last one
+constexpr size_t MAX_SCOPES = 16;
+
+struct ScopeCount {
+  std::atomic<const char *> name{nullptr};
+  std::atomic<uint64_t> allocations{0};
+};
+
+std::array<ScopeCount, MAX_SCOPES> scope_counts{};
+std::atomic<uint64_t> total_violations{0};
+std::atomic<bool> armed{false};
+
+// Constant-initialized, so usable from operator new before anything else
+thread_local Counters counters{};
+// The outermost scope entered by the thread, if any
+thread_local const char *current_scope = nullptr;
+
+auto scope_count(const char *name) -> ScopeCount & {
+  for (auto &count : scope_counts) {
+    const char *seen = count.name.load(std::memory_order_acquire);
+    if (seen == nullptr &&
+        count.name.compare_exchange_strong(seen, name,
+                                           std::memory_order_acq_rel)) {
+      return count;
+    }
+    if (seen == name) {
+      return count;
+    }
+  }
+  return scope_counts.back();
+}
+
+void count_violation(size_t size) {
+  const char *scope = current_scope;
+  // What is done here is not checked
+  current_scope = nullptr;
+  scope_count(scope).allocations.fetch_add(1, std::memory_order_relaxed);
+  total_violations.fetch_add(1, std::memory_order_relaxed);
+#ifdef DEBUG
+  if (armed.load(std::memory_order_relaxed)) {
+    std::fprintf(stderr, "Allocation of %zu bytes in the scope %s\n", size,
+                 scope);
+    std::abort();
+  }
+#else
+  (void)size;
+#endif
+  current_scope = scope;
+}
+
+auto allocate(size_t size, size_t alignment) noexcept -> void * {
+  void *ptr = nullptr;
+  size = size == 0 ? 1 : size;
+  if (alignment <= alignof(std::max_align_t)) {
+    ptr = std::malloc(size);
+  } else if (posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = nullptr;
+  }
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+  ++counters.allocations;
+  counters.live_bytes += static_cast<int64_t>(malloc_usable_size(ptr));
+  if (current_scope != nullptr) {
+    count_violation(size);
+  }
+  return ptr;
+}
+
+auto allocate_or_throw(size_t size, size_t alignment) -> void * {
+  void *ptr = allocate(size, alignment);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void deallocate(void *ptr) noexcept {
+  if (ptr == nullptr) {
+    return;
+  }
+  ++counters.deallocations;
+  counters.live_bytes -= static_cast<int64_t>(malloc_usable_size(ptr));
+  std::free(ptr);
+}
+
+} // namespace
+
+auto thread_counters() -> const Counters & { return counters; }
+
+void arm() { armed.store(true, std::memory_order_relaxed); }
+
+auto violations() -> uint64_t {
+  return total_violations.load(std::memory_order_relaxed);
+}
+
+auto report() -> std::string {
+  std::string out{};
+  for (const auto &count : scope_counts) {
+    const char *name = count.name.load(std::memory_order_acquire);
+    if (name == nullptr) {
+      break;
+    }
+    out += std::string(name) + ": " +
+           std::to_string(count.allocations.load(std::memory_order_relaxed)) +
+           " allocations\n";
+  }
+  return out;
+}
+
+NoAllocScope::NoAllocScope(const char *name) : previous_(current_scope) {
+  if (current_scope == nullptr) {
+    current_scope = name;
+  }
+}
+
+NoAllocScope::~NoAllocScope() { current_scope = previous_; }
+
+AllowAllocScope::AllowAllocScope() : previous_(current_scope) {
+  current_scope = nullptr;
+}
+
+AllowAllocScope::~AllowAllocScope() { current_scope = previous_; }
+
+} // namespace alloc_tracking
+
+namespace {
+
+constexpr size_t DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+} // namespace
+
+using alloc_tracking::allocate;
+using alloc_tracking::allocate_or_throw;
+using alloc_tracking::deallocate;
+
+void *operator new(size_t size) {
+  return allocate_or_throw(size, DEFAULT_ALIGNMENT);
+}
+void *operator new[](size_t size) {
+  return allocate_or_throw(size, DEFAULT_ALIGNMENT);
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, DEFAULT_ALIGNMENT);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, DEFAULT_ALIGNMENT);
+}
+void *operator new(size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  deallocate(ptr);
+}
+
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Tracking of the allocations of the hot paths, built with
+ * ALLOC_TRACKING=1
+ *
+ * The global operator new and operator delete are replaced by ones counting
+ * the allocations of each thread, and a NoAllocScope marks the rest of its
+ * block as allocating nothing: an allocation made in it is counted for it,
+ * and aborts the debug builds (DEBUG=1) once the checks are armed, the
+ * buffers and the pools growing with the first messages being only counted
+ * until then. Without the flag, the scopes are empty and nothing is
+ * replaced.
+ */
+namespace alloc_tracking {
+
+// The allocations of a thread, and the bytes they hold, as given by
+// malloc_usable_size, those freed by another thread being subtracted from it
+struct Counters {
+  uint64_t allocations{};
+  uint64_t deallocations{};
+  int64_t live_bytes{};
+};
+
+#ifdef ENABLE_ALLOC_TRACKING
+
+/**
+ * @brief The counters of the calling thread
+ */
+auto thread_counters() -> const Counters &;
+
+/**
+ * @brief Make the allocations in the scopes abort the debug builds from now on
+ */
+void arm();
+
+/**
+ * @brief The allocations made in the scopes so far, by all the threads
+ */
+auto violations() -> uint64_t;
+
+/**
+ * @brief Describe the allocations made in each scope, one per line
+ */
+auto report() -> std::string;
+
+/**
+ * @brief Check that the rest of the enclosing block allocates nothing, the
+ * allocations of nested scopes being counted for the outermost one
+ */
+class NoAllocScope {
+public:
+  /**
+   * @param name The string literal naming the scope
+   */
+  explicit NoAllocScope(const char *name);
+  ~NoAllocScope();
+
+  NoAllocScope(const NoAllocScope &) = delete;
+  auto operator=(const NoAllocScope &) -> NoAllocScope & = delete;
+
+private:
+  const char *previous_;
+};
+
+/**
+ * @brief Let the rest of the enclosing block allocate, within a NoAllocScope,
+ * for the paths allocating by design such as the registrations
+ */
+class AllowAllocScope {
+public:
+  AllowAllocScope();
+  ~AllowAllocScope();
+
+  AllowAllocScope(const AllowAllocScope &) = delete;
+  auto operator=(const AllowAllocScope &) -> AllowAllocScope & = delete;
+
+private:
+  const char *previous_;
+};
+
+#else
+
+inline auto violations() -> uint64_t { return 0; }
+
+class NoAllocScope {
+public:
+  explicit NoAllocScope(const char *) {}
+};
+
+class AllowAllocScope {
+public:
+  // User-provided, as the scopes are never used otherwise
+  AllowAllocScope() {}
+};
+
+#endif
+
+} // namespace alloc_tracking
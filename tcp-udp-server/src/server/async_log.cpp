@@ -0,0 +1,250 @@
+#include "async_log.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+
+// How often the writer thread wakes up without lines, to report the lines
+// suppressed once the second of their message is over
+constexpr int IDLE_TIMEOUT_MS = 1000;
+
+auto now_second() -> uint64_t {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// The mixing of the addresses of the messages, literals a few bytes apart
+auto mix(uintptr_t key) -> size_t {
+  key ^= key >> 17;
+  key *= 0xed5ad4bb;
+  key ^= key >> 11;
+  return static_cast<size_t>(key);
+}
+
+} // namespace
+
+auto AsyncLog::instance() -> AsyncLog & {
+  static AsyncLog log;
+  return log;
+}
+
+AsyncLog::~AsyncLog() { stop(); }
+
+void AsyncLog::start(const AsyncLogConfig &config) {
+  if (started_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
+    throw std::runtime_error("Failed to create the eventfd of the log");
+  }
+
+  errors_ = config.errors;
+  message_rate_ = config.message_rate;
+  size_t capacity = 2;
+  while (capacity < config.capacity) {
+    capacity *= 2;
+  }
+  slots_ = std::make_unique<Slot[]>(capacity);
+  for (size_t i = 0; i < capacity; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  mask_ = capacity - 1;
+  push_position_.store(0, std::memory_order_relaxed);
+  pop_position_ = 0;
+  stopping_.store(false, std::memory_order_relaxed);
+
+  thread_ = std::thread(&AsyncLog::run, this);
+  started_.store(true, std::memory_order_release);
+}
+
+void AsyncLog::stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  // The threads logging meanwhile still push to the ring, written before the
+  // writer exits
+  stopping_.store(true, std::memory_order_seq_cst);
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    std::cerr << "Failed to stop the log: " << std::strerror(errno)
+              << std::endl;
+  }
+  thread_.join();
+  started_.store(false, std::memory_order_release);
+  close(wake_fd_);
+  wake_fd_ = -1;
+}
+
+void AsyncLog::submit(const Line &line, const char *message) {
+  if (!within_rate(line.level, message)) {
+    return;
+  }
+
+  if (!started_.load(std::memory_order_acquire)) {
+    auto &out = line.level == LogLevel::ERROR ? std::cerr : std::cout;
+    out.write(line.text.data(), line.size);
+    out << std::endl;
+    return;
+  }
+
+  if (!push(line)) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // Pairs with the fence of the writer, so that either it sees the line or
+  // it is seen sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed) &&
+      sleeping_.exchange(false, std::memory_order_relaxed)) {
+    uint64_t one = 1;
+    // A failure leaves the line to the next wake-up of the writer
+    (void)!write(wake_fd_, &one, sizeof(one));
+  }
+}
+
+auto AsyncLog::within_rate(LogLevel level, const char *message) -> bool {
+  if (message_rate_ == 0) {
+    return true;
+  }
+  auto &rate = rates_[mix(reinterpret_cast<uintptr_t>(message)) &
+                      (MESSAGE_RATES - 1)];
+  uint64_t second = now_second();
+  uint64_t current = rate.second.load(std::memory_order_relaxed);
+  if (current != second &&
+      rate.second.compare_exchange_strong(current, second,
+                                          std::memory_order_relaxed)) {
+    rate.lines.store(0, std::memory_order_relaxed);
+  }
+  if (rate.lines.fetch_add(1, std::memory_order_relaxed) < message_rate_) {
+    return true;
+  }
+  rate.message.store(message, std::memory_order_relaxed);
+  rate.level.store(level, std::memory_order_relaxed);
+  rate.suppressed.fetch_add(1, std::memory_order_relaxed);
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+auto AsyncLog::push(const Line &line) -> bool {
+  size_t position = push_position_.load(std::memory_order_relaxed);
+  while (true) {
+    Slot &slot = slots_[position & mask_];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+    if (diff == 0) {
+      if (push_position_.compare_exchange_weak(position, position + 1,
+                                               std::memory_order_relaxed)) {
+        slot.line = line;
+        slot.sequence.store(position + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // The writer has not written the line a lap ahead yet
+      return false;
+    } else {
+      position = push_position_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+auto AsyncLog::pop(Line &line) -> bool {
+  Slot &slot = slots_[pop_position_ & mask_];
+  if (slot.sequence.load(std::memory_order_acquire) != pop_position_ + 1) {
+    return false;
+  }
+  line = slot.line;
+  slot.sequence.store(pop_position_ + mask_ + 1, std::memory_order_release);
+  ++pop_position_;
+  return true;
+}
+
+void AsyncLog::run() {
+  std::string out{};
+  std::string err{};
+  pollfd fd{wake_fd_, POLLIN, 0};
+  while (true) {
+    drain(out, err);
+    if (stopping_.load(std::memory_order_seq_cst)) {
+      // The lines pushed before the flag was seen
+      drain(out, err);
+      return;
+    }
+
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Slot &next = slots_[pop_position_ & mask_];
+    if (next.sequence.load(std::memory_order_acquire) == pop_position_ + 1) {
+      sleeping_.store(false, std::memory_order_relaxed);
+      continue;
+    }
+    if (poll(&fd, 1, IDLE_TIMEOUT_MS) > 0) {
+      uint64_t count{};
+      (void)!read(wake_fd_, &count, sizeof(count));
+    }
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+}
+
+void AsyncLog::drain(std::string &out, std::string &err) {
+  out.clear();
+  err.clear();
+  Line line{};
+  // At most a lap of the ring, the lines still coming being written next
+  for (size_t i = 0; i <= mask_ && pop(line); ++i) {
+    auto &text = line.level == LogLevel::ERROR ? err : out;
+    text.append(line.text.data(), line.size);
+    text.push_back('\n');
+  }
+
+  uint64_t drops = dropped_.load(std::memory_order_relaxed);
+  if (drops != reported_drops_ && errors_) {
+    err += "Dropped " + std::to_string(drops - reported_drops_) +
+           " log lines, the log being full\n";
+  }
+  reported_drops_ = drops;
+
+  // The lines of the messages whose second is over, or all of them once the
+  // log stops
+  uint64_t second = now_second();
+  bool stopping = stopping_.load(std::memory_order_relaxed);
+  for (auto &rate : rates_) {
+    if (rate.suppressed.load(std::memory_order_relaxed) == 0 ||
+        (rate.second.load(std::memory_order_relaxed) == second && !stopping)) {
+      continue;
+    }
+    uint64_t suppressed = rate.suppressed.exchange(0, std::memory_order_relaxed);
+    auto &text =
+        rate.level.load(std::memory_order_relaxed) == LogLevel::ERROR ? err
+                                                                      : out;
+    text += "Suppressed " + std::to_string(suppressed) +
+            " log lines starting with \"" +
+            rate.message.load(std::memory_order_relaxed) + "\"\n";
+  }
+
+  write_all(STDOUT_FILENO, out);
+  write_all(STDERR_FILENO, err);
+}
+
+void AsyncLog::write_all(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(fd, data.data() + written, data.size() - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Nowhere left to report it
+      return;
+    }
+    written += static_cast<size_t>(result);
+  }
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+struct AsyncLogConfig {
+  // The lines waiting to be written, rounded up to a power of 2, those logged
+  // while they are all taken being dropped
+  size_t capacity{4096};
+  // The lines of a same message written per second, the others being counted
+  // and reported once the second is over, unlimited if 0
+  size_t message_rate{100};
+  // Whether the errors are written, to stderr, the other lines going to
+  // stdout
+  bool errors{true};
+};
+
+enum class LogLevel : uint8_t {
+  INFO = 0,
+  ERROR,
+};
+
+/**
+ * @brief Log of the broker, whose lines are written by a thread of their own
+ * so that the event loop never waits for the terminal or a file
+ *
+ * A line is formatted in place, in a slot of a bounded ring taken with a
+ * compare-and-swap, from any thread, and the writer thread writes all the
+ * lines of the ring at once. A line logged while the ring is full is dropped
+ * and counted, as are the lines of a message beyond its rate, the message
+ * being the string literal a line starts with. Until the writer is started,
+ * the lines are written to std::cout and std::cerr by the thread logging
+ * them, as the tools embedding the server expect.
+ */
+class AsyncLog {
+public:
+  // The longest line, the rest being cut
+  static constexpr size_t LINE_SIZE = 256;
+
+  static auto instance() -> AsyncLog &;
+
+  AsyncLog(const AsyncLog &) = delete;
+  auto operator=(const AsyncLog &) -> AsyncLog & = delete;
+  ~AsyncLog();
+
+  /**
+   * @brief Start the writer thread, the lines being written by it from now
+   * on
+   *
+   * @param config The size of the ring and the limits of the lines
+   *
+   * @throws std::runtime_error if the eventfd of the writer cannot be created
+   */
+  void start(const AsyncLogConfig &config);
+
+  /**
+   * @brief Write the lines of the ring and stop the writer thread, the lines
+   * being written by the threads logging them again
+   */
+  void stop();
+
+  /**
+   * @brief Log a line, the concatenation of a message and of its arguments
+   *
+   * @param level The level of the line
+   * @param message The string literal the line starts with, which its rate is
+   * limited by
+   * @param args The strings, characters and integers following it
+   */
+  template <typename... Args>
+  void log(LogLevel level, const char *message, const Args &...args) {
+    if (level == LogLevel::ERROR && !errors_) {
+      return;
+    }
+    Line line{};
+    line.level = level;
+    append(line, message);
+    (append(line, args), ...);
+    submit(line, message);
+  }
+
+  // The lines dropped, the ring being full, and those beyond the rate of
+  // their message
+  auto dropped() const -> uint64_t {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+  auto suppressed() const -> uint64_t {
+    return suppressed_.load(std::memory_order_relaxed);
+  }
+
+private:
+  AsyncLog() = default;
+
+  struct Line {
+    LogLevel level{};
+    uint16_t size{};
+    std::array<char, LINE_SIZE> text{};
+  };
+
+  struct Slot {
+    // the position of the line it holds, plus 1 once written, or of the line
+    // it is free for
+    std::atomic<size_t> sequence{};
+    Line line{};
+  };
+
+  // The rate of the lines starting with a message, those of the messages of a
+  // same hash sharing it
+  struct MessageRate {
+    std::atomic<uint64_t> second{};
+    std::atomic<uint64_t> lines{};
+    std::atomic<uint64_t> suppressed{};
+    std::atomic<const char *> message{};
+    std::atomic<LogLevel> level{};
+  };
+  static constexpr size_t MESSAGE_RATES = 256;
+
+  static void append(Line &line, std::string_view str) {
+    size_t size = std::min(str.size(), LINE_SIZE - line.size);
+    std::memcpy(line.text.data() + line.size, str.data(), size);
+    line.size += static_cast<uint16_t>(size);
+  }
+
+  template <typename T> static void append(Line &line, const T &value) {
+    if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+      append(line, std::string_view(value));
+    } else if constexpr (std::is_same_v<T, char>) {
+      append(line, std::string_view(&value, 1));
+    } else {
+      static_assert(std::is_integral_v<T>, "Unsupported type of log argument");
+      char *begin = line.text.data() + line.size;
+      auto [end, ec] = std::to_chars(begin, line.text.data() + LINE_SIZE,
+                                     value);
+      if (ec == std::errc{}) {
+        line.size = static_cast<uint16_t>(end - line.text.data());
+      }
+    }
+  }
+
+  // Write a line, or queue it for the writer thread
+  void submit(const Line &line, const char *message);
+  // Check that the rate of its message lets a line be written
+  auto within_rate(LogLevel level, const char *message) -> bool;
+  auto push(const Line &line) -> bool;
+  auto pop(Line &line) -> bool;
+  void run();
+  // Write the lines of the ring, and report those dropped or suppressed
+  void drain(std::string &out, std::string &err);
+  static void write_all(int fd, const std::string &data);
+
+  bool errors_{true};
+  size_t message_rate_{};
+  std::array<MessageRate, MESSAGE_RATES> rates_{};
+
+  // the ring, empty until the writer is started
+  std::unique_ptr<Slot[]> slots_{};
+  size_t mask_{};
+  std::atomic<size_t> push_position_{0};
+  // owned by the writer thread
+  size_t pop_position_{0};
+
+  std::atomic<bool> started_{false};
+  std::atomic<bool> stopping_{false};
+  // whether the writer waits for the eventfd, to be woken up
+  std::atomic<bool> sleeping_{false};
+  int wake_fd_{-1};
+  std::thread thread_{};
+
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> suppressed_{0};
+  uint64_t reported_drops_{0};
+};
+
+/**
+ * @brief Log a line of information, written to stdout
+ *
+ * @param message The string literal the line starts with
+ * @param args The strings, characters and integers following it
+ */
+template <size_t N, typename... Args>
+void log_info(const char (&message)[N], const Args &...args) {
+  AsyncLog::instance().log(LogLevel::INFO, message, args...);
+}
+
+/**
+ * @brief Log an error, written to stderr
+ *
+ * @param message The string literal the line starts with
+ * @param args The strings, characters and integers following it
+ */
+template <size_t N, typename... Args>
+void log_error(const char (&message)[N], const Args &...args) {
+  AsyncLog::instance().log(LogLevel::ERROR, message, args...);
+}
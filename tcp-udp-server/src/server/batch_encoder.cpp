@@ -0,0 +1,144 @@
+#include "batch_encoder.hpp"
+
+#include "lz4_block.hpp"
+#include "util.hpp"
+#include <cstring>
+
+auto BatchEncoder::push(const OutgoingMessage &message, OutputQueue &queue)
+    -> OutputQueue::PushResult {
+  // The response as serialized by TcpMessage::serialize: the frame header,
+  // the address of the UDP client, the topic and the payload
+  const std::byte *response =
+      message.bytes.data() + sizeof(TcpMessageType) + sizeof(uint16_t);
+  const std::byte *topic = response + sizeof(uint32_t) + sizeof(uint16_t);
+  auto topic_size = static_cast<uint8_t>(topic[0]);
+  const std::byte *payload = topic + sizeof(topic_size) + topic_size;
+  auto payload_type = static_cast<TcpResponsePayloadType>(payload[0]);
+  const std::byte *value = payload + sizeof(payload_type);
+  size_t value_size = message.bytes.data() + message.bytes.size() - value;
+  if (payload_type == TcpResponsePayloadType::STRING) {
+    value += sizeof(uint16_t);
+    value_size -= sizeof(uint16_t);
+  }
+
+  size_t max_entry_size = VARINT_MAX_SIZE + sizeof(topic_size) + topic_size +
+                          sizeof(uint32_t) + sizeof(uint16_t) +
+                          sizeof(payload_type) + VARINT_MAX_SIZE + value_size;
+  auto result = OutputQueue::PushResult::QUEUED;
+  if (!empty() && (batch_->priority != message.priority ||
+                   batch_->bytes.size() + max_entry_size >
+                       sizeof(TcpMessageType) + sizeof(uint16_t) +
+                           TCP_BATCH_MAX_SIZE)) {
+    result = flush(queue);
+  }
+
+  if (!batch_) {
+    batch_ = std::make_shared<OutgoingMessage>();
+  }
+  auto &bytes = batch_->bytes;
+  if (bytes.empty()) {
+    // The size of the frame is set once it is queued
+    bytes.resize(sizeof(TcpMessageType) + sizeof(uint16_t));
+    bytes[0] = static_cast<std::byte>(TcpMessageType::RESPONSE_BATCH);
+    // The latency of the batch is that of its oldest response
+    batch_->received_ns = message.received_ns;
+    batch_->priority = message.priority;
+  }
+  size_t offset = bytes.size();
+  bytes.resize(offset + max_entry_size);
+  std::byte *entry = bytes.data() + offset;
+
+  // The topic follows its first delivery, or every one once the IDs run out
+  uint32_t key{};
+  if (auto it = topic_ids_.find(message.topic); it != topic_ids_.end()) {
+    key = it->second << 1;
+  } else {
+    uint32_t topic_id = 0;
+    if (next_topic_id_ <= TCP_BATCH_MAX_TOPIC_ID) {
+      topic_id = next_topic_id_++;
+      topic_ids_.emplace(message.topic, topic_id);
+      defined_topics_.push_back(message.topic);
+    }
+    key = topic_id << 1 | 1;
+  }
+  entry += serialize_varint(key, entry);
+  if (key & 1) {
+    std::memcpy(entry, topic, sizeof(topic_size) + topic_size);
+    entry += sizeof(topic_size) + topic_size;
+  }
+
+  std::memcpy(entry, response, sizeof(uint32_t) + sizeof(uint16_t));
+  entry += sizeof(uint32_t) + sizeof(uint16_t);
+  std::memcpy(entry, &payload_type, sizeof(payload_type));
+  entry += sizeof(payload_type);
+  if (payload_type == TcpResponsePayloadType::STRING) {
+    entry += serialize_varint(static_cast<uint32_t>(value_size), entry);
+  }
+  std::memcpy(entry, value, value_size);
+  entry += value_size;
+
+  bytes.resize(entry - bytes.data());
+  return result;
+}
+
+auto BatchEncoder::flush(OutputQueue &queue) -> OutputQueue::PushResult {
+  if (empty()) {
+    return OutputQueue::PushResult::QUEUED;
+  }
+
+  auto &bytes = batch_->bytes;
+  uint16_t size_network = hton(static_cast<uint16_t>(
+      bytes.size() - sizeof(TcpMessageType) - sizeof(uint16_t)));
+  std::memcpy(bytes.data() + sizeof(TcpMessageType), &size_network,
+              sizeof(size_network));
+  if (compression_threshold_ > 0 &&
+      bytes.size() - sizeof(TcpMessageType) - sizeof(uint16_t) >=
+          compression_threshold_) {
+    compress();
+  }
+
+  auto result = queue.push(batch_);
+  if (result == OutputQueue::PushResult::QUEUED) {
+    // The next response opens a new batch, this one being shared by the queue
+    batch_ = nullptr;
+  } else {
+    // The subscriber never gets the topics of the batch
+    for (const auto &topic : defined_topics_) {
+      topic_ids_.erase(topic);
+    }
+    bytes.clear();
+  }
+  defined_topics_.clear();
+  return result;
+}
+
+void BatchEncoder::compress() {
+  constexpr size_t header_size = sizeof(TcpMessageType) + sizeof(uint16_t);
+  auto &bytes = batch_->bytes;
+  const std::byte *batch = bytes.data() + header_size;
+  size_t batch_size = bytes.size() - header_size;
+  if (batch_size <= sizeof(uint16_t) + 1) {
+    return;
+  }
+
+  // Only kept if it saves more than the size of the batch it adds
+  compressed_.resize(bytes.size());
+  std::byte *block = compressed_.data() + header_size + sizeof(uint16_t);
+  size_t capacity = batch_size - sizeof(uint16_t) - 1;
+  size_t block_size = lz4_compress(batch, batch_size, block, capacity);
+  if (block_size == 0) {
+    return;
+  }
+
+  compressed_[0] = static_cast<std::byte>(TcpMessageType::RESPONSE_BATCH_LZ4);
+  uint16_t size_network =
+      hton(static_cast<uint16_t>(sizeof(uint16_t) + block_size));
+  std::memcpy(compressed_.data() + sizeof(TcpMessageType), &size_network,
+              sizeof(size_network));
+  uint16_t batch_size_network = hton(static_cast<uint16_t>(batch_size));
+  std::memcpy(compressed_.data() + header_size, &batch_size_network,
+              sizeof(batch_size_network));
+  compressed_.resize(header_size + sizeof(uint16_t) + block_size);
+  // The buffer of the batch is reused for the next compression
+  bytes.swap(compressed_);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "output_queue.hpp"
+#include "tcp_batch.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Batches the responses sent to a subscriber of protocol v2 in the
+ * RESPONSE_BATCH frames, tcp_batch.hpp, giving IDs to their topics
+ *
+ * The responses are added to an open batch, queued as a single message when
+ * flushed or once full. A topic is only given an ID once its batch is queued:
+ * the IDs of a dropped batch are given again, with their topic, by the next
+ * deliveries. A batch only holds responses of the same priority, being queued
+ * before a response of another one.
+ *
+ * For a subscriber reading the compressed batches, a batch of at least the
+ * compression threshold is queued as a RESPONSE_BATCH_LZ4 frame, if it is
+ * smaller so.
+ */
+class BatchEncoder {
+public:
+  /**
+   * @param compression_threshold The size of the payload of a batch from which
+   * it is compressed, 0 to never compress it
+   */
+  explicit BatchEncoder(size_t compression_threshold = 0)
+      : compression_threshold_(compression_threshold) {}
+
+  /**
+   * @brief Add a response to the open batch, queueing the batch first if the
+   * response does not fit in it
+   *
+   * @param message The response, as serialized by FanoutEncoder::encode
+   * @param queue The output queue of the subscriber
+   * @return The result of queueing the full batch, QUEUED if it was not full
+   */
+  auto push(const OutgoingMessage &message, OutputQueue &queue)
+      -> OutputQueue::PushResult;
+
+  /**
+   * @brief Queue the open batch, unless it is empty
+   *
+   * @param queue The output queue of the subscriber
+   * @return The result of queueing the batch, QUEUED if it is empty
+   */
+  auto flush(OutputQueue &queue) -> OutputQueue::PushResult;
+
+  bool empty() const { return batch_ == nullptr || batch_->bytes.empty(); }
+
+private:
+  // Replace the open batch by its compressed frame, if it is smaller
+  void compress();
+
+  size_t compression_threshold_{};
+  // the compressed frame, swapped with the open batch
+  std::vector<std::byte> compressed_{};
+  std::unordered_map<std::string, uint32_t> topic_ids_{};
+  uint32_t next_topic_id_{1};
+  // the topics given an ID by the open batch
+  std::vector<std::string> defined_topics_{};
+  // the open batch, starting with the header of its frame
+  std::shared_ptr<OutgoingMessage> batch_{};
+};
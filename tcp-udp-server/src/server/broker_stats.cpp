@@ -0,0 +1,423 @@
+#include "broker_stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+
+namespace {
+
+// Write a string as a JSON string, escaping its quotes and control characters
+void write_json_string(std::ostream &out, std::string_view str) {
+  out << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+          << static_cast<int>(c) << std::dec << std::setfill(' ');
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// Write counters indexed by the reasons of a rejection as a JSON object, the
+// reason NONE at index 0 being skipped
+template <size_t N>
+void write_json_reasons(std::ostream &out,
+                        const std::array<ShardedCounter, N> &counts,
+                        const std::array<const char *, N> &names) {
+  out << '{';
+  for (size_t i = 1; i < N; ++i) {
+    out << (i > 1 ? ",\"" : "\"") << names[i] << "\":" << counts[i].value();
+  }
+  out << '}';
+}
+
+// Write a label value of the Prometheus text format, escaping its
+// backslashes, quotes and line feeds
+void write_label_value(std::ostream &out, std::string_view str) {
+  out << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c == '\n') {
+      out << "\\n";
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+void write_metric(std::ostream &out, const char *type, std::string_view name,
+                  uint64_t value) {
+  out << "# TYPE " << name << ' ' << type << '\n'
+      << name << ' ' << value << '\n';
+}
+
+// Write counters indexed by the reasons of a rejection as a counter labeled
+// by the reason, the reason NONE at index 0 being skipped
+template <size_t N>
+void write_prometheus_reasons(std::ostream &out, std::string_view name,
+                              const std::array<ShardedCounter, N> &counts,
+                              const std::array<const char *, N> &names) {
+  out << "# TYPE " << name << " counter\n";
+  for (size_t i = 1; i < N; ++i) {
+    out << name << "{reason=\"" << names[i] << "\"} " << counts[i].value()
+        << '\n';
+  }
+}
+
+constexpr std::array<const char *, 6> UDP_REJECT_NAMES{
+    "none", "too_short", "unknown_payload_type", "payload_too_short",
+    "invalid_batch", "unknown_topic_id"};
+constexpr std::array<const char *, 4> REQUEST_REJECT_NAMES{
+    "none", "too_short", "size_exceeds_limit", "unknown_type"};
+constexpr std::array<const char *, 4> PATTERN_REJECT_NAMES{
+    "none", "empty", "invalid_token", "invalid_pattern"};
+
+// The mixing of splitmix64, the cells of the rows being taken from its bits
+auto mix(uint64_t key) -> uint64_t {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111eb;
+  return key ^ (key >> 31);
+}
+
+} // namespace
+
+auto Histogram::percentile(double fraction) const -> uint64_t {
+  if (count_ == 0) {
+    return 0;
+  }
+
+  auto rank = static_cast<uint64_t>(std::ceil(fraction * count_));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      uint64_t upper = i == 0 ? 0 : i == 64 ? UINT64_MAX : (1ULL << i) - 1;
+      return std::min(upper, max_);
+    }
+  }
+  return max_;
+}
+
+void Histogram::write_json(std::ostream &out) const {
+  out << "{\"count\":" << count_ << ",\"sum\":" << sum_
+      << ",\"max\":" << max_ << ",\"p50\":" << percentile(0.5)
+      << ",\"p90\":" << percentile(0.9) << ",\"p99\":" << percentile(0.99)
+      << ",\"p999\":" << percentile(0.999) << '}';
+}
+
+void Histogram::write_prometheus(std::ostream &out, std::string_view name,
+                                 std::string_view labels) const {
+  const char *separator = labels.empty() ? "" : ",";
+  uint64_t cumulative = 0;
+  // The last bucket, of the values from 2^63, is only counted by +Inf
+  for (size_t i = 0; i + 1 < BUCKETS; ++i) {
+    cumulative += buckets_[i];
+    uint64_t upper = i == 0 ? 0 : (uint64_t{1} << i) - 1;
+    out << name << "_bucket{" << labels << separator << "le=\"" << upper
+        << "\"} " << cumulative << '\n';
+  }
+  out << name << "_bucket{" << labels << separator << "le=\"+Inf\"} "
+      << count_ << '\n';
+  const char *open = labels.empty() ? "" : "{";
+  const char *close = labels.empty() ? "" : "}";
+  out << name << "_sum" << open << labels << close << ' ' << sum_ << '\n'
+      << name << "_count" << open << labels << close << ' ' << count_ << '\n';
+}
+
+auto ShardedHistogram::merged() const -> Histogram {
+  Histogram histogram{};
+  for (const auto &shard : shards_) {
+    for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+      histogram.buckets_[i] += shard.buckets[i].load(std::memory_order_relaxed);
+    }
+    histogram.count_ += shard.count.load(std::memory_order_relaxed);
+    histogram.sum_ += shard.sum.load(std::memory_order_relaxed);
+    histogram.max_ =
+        std::max(histogram.max_, shard.max.load(std::memory_order_relaxed));
+  }
+  return histogram;
+}
+
+void BrokerStats::write_json(std::ostream &out,
+                             const std::vector<QueueDepth> &queues) const {
+  out << "{\"time_ms\":" << realtime_ns() / 1000000
+      << ",\"udp_received\":" << udp_received.value()
+      << ",\"udp_kernel_dropped\":" << udp_kernel_dropped.value()
+      << ",\"udp_receive_buffer\":" << udp_receive_buffer
+      << ",\"udp_publisher_limited\":" << udp_publisher_limited.value()
+      << ",\"udp_global_limited\":" << udp_global_limited.value()
+      << ",\"udp_unmatched\":" << udp_unmatched.value()
+      << ",\"queued\":" << queued.value()
+      << ",\"dropped\":" << dropped.value()
+      << ",\"multicast_sent\":" << multicast_sent.value()
+      << ",\"multicast_retransmitted\":" << multicast_retransmitted.value()
+      << ",\"filtered\":" << filtered.value()
+      << ",\"udp_rejected\":";
+  write_json_reasons(out, udp_rejected, UDP_REJECT_NAMES);
+  out << ",\"udp_invalid_topic\":" << udp_invalid_topic.value()
+      << ",\"filters_rejected\":" << filters_rejected.value()
+      << ",\"subscriptions_refused\":" << subscriptions_refused.value()
+      << ",\"frames_too_large\":" << frames_too_large.value()
+      << ",\"frames_not_request\":" << frames_not_request.value()
+      << ",\"requests_rejected\":";
+  write_json_reasons(out, requests_rejected, REQUEST_REJECT_NAMES);
+  out << ",\"patterns_rejected\":";
+  write_json_reasons(out, patterns_rejected, PATTERN_REJECT_NAMES);
+  out << ",\"log_dropped\":" << log_dropped
+      << ",\"log_suppressed\":" << log_suppressed << ",\"match_ns\":";
+  match_ns.merged().write_json(out);
+  out << ",\"parse_ns\":";
+  parse_ns.merged().write_json(out);
+  out << ",\"fanout_ns\":";
+  fanout_ns.merged().write_json(out);
+  out << ",\"flush_ns\":";
+  flush_ns.merged().write_json(out);
+  out << ",\"request_ns\":";
+  request_ns.merged().write_json(out);
+  out << ",\"fanout\":";
+  fanout.merged().write_json(out);
+  out << ",\"queue_bytes\":";
+  queue_bytes.merged().write_json(out);
+  out << ",\"receive_to_send_ns\":";
+  receive_to_send_ns.merged().write_json(out);
+  out << ",\"lane_receive_to_send_ns\":[";
+  for (size_t i = 0; i < lanes; ++i) {
+    out << (i > 0 ? "," : "");
+    lane_receive_to_send_ns[i].merged().write_json(out);
+  }
+  out << ']';
+
+  if (topics.enabled()) {
+    out << ",\"top_topics\":";
+    topics.write_json(out);
+  }
+
+  if (queue_budget > 0) {
+    out << ",\"queue_budget\":" << queue_budget
+        << ",\"queue_budget_used\":" << queue_budget_used;
+  }
+
+  out << ",\"queues\":[";
+  for (size_t i = 0; i < queues.size(); ++i) {
+    out << (i > 0 ? ",{\"id\":" : "{\"id\":");
+    write_json_string(out, queues[i].id);
+    out << ",\"bytes\":" << queues[i].bytes
+        << ",\"subscription_bytes\":" << queues[i].subscription_bytes << '}';
+  }
+  out << "]}\n";
+}
+
+void BrokerStats::write_prometheus(
+    std::ostream &out, const std::vector<QueueDepth> &queues) const {
+  for (auto [name, value] :
+       {std::pair{"broker_udp_received_total", udp_received.value()},
+        {"broker_udp_kernel_dropped_total", udp_kernel_dropped.value()},
+        {"broker_udp_publisher_limited_total", udp_publisher_limited.value()},
+        {"broker_udp_global_limited_total", udp_global_limited.value()},
+        {"broker_udp_unmatched_total", udp_unmatched.value()},
+        {"broker_queued_total", queued.value()},
+        {"broker_dropped_total", dropped.value()},
+        {"broker_multicast_sent_total", multicast_sent.value()},
+        {"broker_multicast_retransmitted_total",
+         multicast_retransmitted.value()},
+        {"broker_filtered_total", filtered.value()},
+        {"broker_udp_invalid_topic_total", udp_invalid_topic.value()},
+        {"broker_filters_rejected_total", filters_rejected.value()},
+        {"broker_subscriptions_refused_total", subscriptions_refused.value()},
+        {"broker_frames_too_large_total", frames_too_large.value()},
+        {"broker_frames_not_request_total", frames_not_request.value()},
+        {"broker_log_dropped_total", log_dropped},
+        {"broker_log_suppressed_total", log_suppressed}}) {
+    write_metric(out, "counter", name, value);
+  }
+  write_prometheus_reasons(out, "broker_udp_rejected_total", udp_rejected,
+                           UDP_REJECT_NAMES);
+  write_prometheus_reasons(out, "broker_requests_rejected_total",
+                           requests_rejected, REQUEST_REJECT_NAMES);
+  write_prometheus_reasons(out, "broker_patterns_rejected_total",
+                           patterns_rejected, PATTERN_REJECT_NAMES);
+
+  write_metric(out, "gauge", "broker_udp_receive_buffer_bytes",
+               udp_receive_buffer);
+  if (queue_budget > 0) {
+    write_metric(out, "gauge", "broker_queue_budget_bytes", queue_budget);
+    write_metric(out, "gauge", "broker_queue_budget_used_bytes",
+                 queue_budget_used);
+  }
+
+  for (auto [name, histogram] :
+       {std::pair{"broker_match_ns", &match_ns},
+        {"broker_parse_ns", &parse_ns},
+        {"broker_fanout_ns", &fanout_ns},
+        {"broker_flush_ns", &flush_ns},
+        {"broker_request_ns", &request_ns},
+        {"broker_fanout", &fanout},
+        {"broker_queue_bytes", &queue_bytes},
+        {"broker_receive_to_send_ns", &receive_to_send_ns}}) {
+    out << "# TYPE " << name << " histogram\n";
+    histogram->merged().write_prometheus(out, name);
+  }
+  out << "# TYPE broker_lane_receive_to_send_ns histogram\n";
+  for (size_t i = 0; i < lanes; ++i) {
+    std::string labels = "lane=\"" + std::to_string(i) + '"';
+    lane_receive_to_send_ns[i].merged().write_prometheus(
+        out, "broker_lane_receive_to_send_ns", labels);
+  }
+
+  if (topics.enabled()) {
+    auto top = topics.top();
+    for (auto [name, deliveries] : {std::pair{"broker_topic_messages", false},
+                                    {"broker_topic_deliveries", true}}) {
+      out << "# TYPE " << name << " gauge\n";
+      for (const auto &topic : top) {
+        out << name << "{topic=";
+        write_label_value(out, topic.topic);
+        out << "} " << (deliveries ? topic.deliveries : topic.messages)
+            << '\n';
+      }
+    }
+  }
+
+  for (auto [name, subscription] :
+       {std::pair{"broker_subscriber_queue_bytes", false},
+        {"broker_subscriber_subscription_bytes", true}}) {
+    out << "# TYPE " << name << " gauge\n";
+    for (const auto &queue : queues) {
+      out << name << "{subscriber=";
+      write_label_value(out, queue.id);
+      out << "} " << (subscription ? queue.subscription_bytes : queue.bytes)
+          << '\n';
+    }
+  }
+}
+
+TopicHeat::TopicHeat(size_t top_k) : top_k_(top_k) {
+  if (top_k_ > 0) {
+    cells_.resize(DEPTH * WIDTH);
+    heap_.reserve(top_k_);
+  }
+}
+
+void TopicHeat::record(std::string_view topic, size_t fanout) {
+  static_assert(DEPTH * WIDTH_BITS <= 64, "The rows take the bits of a hash");
+  size_t hash = std::hash<std::string_view>{}(topic);
+  uint64_t bits = mix(hash);
+  uint64_t messages = UINT64_MAX;
+  uint64_t deliveries = UINT64_MAX;
+  for (size_t row = 0; row < DEPTH; ++row) {
+    Cell &cell = cells_[row * WIDTH + (bits & (WIDTH - 1))];
+    bits >>= WIDTH_BITS;
+    messages = std::min(messages, ++cell.messages);
+    deliveries = std::min(deliveries, cell.deliveries += fanout);
+  }
+
+  // A topic of the heap has at least the messages of its root, those it had
+  // when it was last counted
+  if (heap_.size() == top_k_ && messages < heap_.front().messages) {
+    return;
+  }
+  for (size_t i = 0; i < heap_.size(); ++i) {
+    Entry &entry = heap_[i];
+    if (entry.hash == hash &&
+        std::string_view(entry.topic.data(), entry.topic_size) == topic) {
+      entry.messages = messages;
+      entry.deliveries = deliveries;
+      entry.fanout = fanout;
+      sift_down(i);
+      return;
+    }
+  }
+
+  size_t index = 0;
+  if (heap_.size() < top_k_) {
+    index = heap_.size();
+    heap_.emplace_back();
+  }
+  Entry &entry = heap_[index];
+  entry.hash = hash;
+  entry.messages = messages;
+  entry.deliveries = deliveries;
+  entry.fanout = fanout;
+  entry.topic_size =
+      static_cast<uint8_t>(std::min(topic.size(), entry.topic.size()));
+  std::memcpy(entry.topic.data(), topic.data(), entry.topic_size);
+  if (index == 0) {
+    sift_down(0);
+  } else {
+    sift_up(index);
+  }
+}
+
+void TopicHeat::sift_down(size_t index) {
+  while (true) {
+    size_t smallest = index;
+    for (size_t child = 2 * index + 1;
+         child <= 2 * index + 2 && child < heap_.size(); ++child) {
+      if (heap_[child].messages < heap_[smallest].messages) {
+        smallest = child;
+      }
+    }
+    if (smallest == index) {
+      return;
+    }
+    std::swap(heap_[index], heap_[smallest]);
+    index = smallest;
+  }
+}
+
+void TopicHeat::sift_up(size_t index) {
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (heap_[parent].messages <= heap_[index].messages) {
+      return;
+    }
+    std::swap(heap_[index], heap_[parent]);
+    index = parent;
+  }
+}
+
+auto TopicHeat::top() const -> std::vector<HotTopic> {
+  std::vector<HotTopic> topics{};
+  topics.reserve(heap_.size());
+  for (const auto &entry : heap_) {
+    topics.push_back({std::string(entry.topic.data(), entry.topic_size),
+                      entry.messages, entry.deliveries, entry.fanout});
+  }
+  std::sort(topics.begin(), topics.end(),
+            [](const HotTopic &lhs, const HotTopic &rhs) {
+              return lhs.messages > rhs.messages;
+            });
+  return topics;
+}
+
+void TopicHeat::write_json(std::ostream &out) const {
+  auto topics = top();
+  out << '[';
+  for (size_t i = 0; i < topics.size(); ++i) {
+    out << (i > 0 ? ",{\"topic\":" : "{\"topic\":");
+    write_json_string(out, topics[i].topic);
+    out << ",\"messages\":" << topics[i].messages
+        << ",\"deliveries\":" << topics[i].deliveries
+        << ",\"fanout\":" << topics[i].fanout << '}';
+  }
+  out << ']';
+}
+
+auto realtime_ns() -> uint64_t {
+  timespec now{};
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 +
+         static_cast<uint64_t>(now.tv_nsec);
+}
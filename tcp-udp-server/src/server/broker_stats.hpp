@@ -0,0 +1,380 @@
+#pragma once
+
+#include "priority_classes.hpp"
+#include "tcp_proto.hpp"
+#include "token_pattern.hpp"
+#include "udp_proto.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct BrokerStatsConfig {
+  // Whether the statistics are collected, as they are once dumped to a file
+  bool enabled{};
+  // The file the statistics are appended to periodically, as JSON lines,
+  // none if it is empty
+  std::string file{};
+  // How often the statistics are appended to the file
+  std::chrono::milliseconds interval{1000};
+  // The number of the most published topics kept track of, none if it is 0
+  size_t top_topics{16};
+  // The Unix socket the statistics are served on, in the Prometheus text
+  // format, to each connection, none if it is empty
+  std::string metrics_socket{};
+};
+
+/**
+ * @brief Distribution of values, counted in buckets of powers of 2
+ *
+ * The bucket i > 0 counts the values in [2^(i-1), 2^i), the bucket 0 the
+ * zeros, so recording a value is a few instructions and the percentiles are
+ * known within a factor of 2.
+ */
+class Histogram {
+public:
+  static constexpr size_t BUCKETS = 65;
+
+  void record(uint64_t value) {
+    size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    ++buckets_[bucket];
+    ++count_;
+    sum_ += value;
+    if (value > max_) {
+      max_ = value;
+    }
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+  uint64_t max() const { return max_; }
+
+  /**
+   * @brief Get an upper bound of a percentile of the values
+   *
+   * @param fraction The fraction of the values below the percentile, in [0, 1]
+   * @return The upper bound of the bucket of the percentile, at most the
+   * largest value, 0 if there are no values
+   */
+  auto percentile(double fraction) const -> uint64_t;
+
+  /**
+   * @brief Write the count, the sum, the largest value and the median, 90th,
+   * 99th and 99.9th percentiles, as a JSON object
+   *
+   * @param out The stream to write to
+   */
+  void write_json(std::ostream &out) const;
+
+  /**
+   * @brief Write the buckets, cumulative, the sum and the count, in the
+   * Prometheus text format, the bucket i being bounded by 2^i - 1
+   *
+   * @param out The stream to write to
+   * @param name The name of the metric
+   * @param labels The labels of the samples, such as lane="0", none if empty
+   */
+  void write_prometheus(std::ostream &out, std::string_view name,
+                        std::string_view labels = {}) const;
+
+private:
+  friend class ShardedHistogram;
+
+  std::array<uint64_t, BUCKETS> buckets_{};
+  uint64_t count_{};
+  uint64_t sum_{};
+  uint64_t max_{};
+};
+
+// The number of shards of the statistics recorded by several threads
+constexpr size_t STATS_SHARDS = 16;
+
+/**
+ * @brief Get the shard of the statistics the calling thread records into,
+ * the threads taking the shards in turn as they first record
+ */
+inline auto stats_shard() -> size_t {
+  static std::atomic<size_t> next{0};
+  thread_local const size_t shard =
+      next.fetch_add(1, std::memory_order_relaxed) % STATS_SHARDS;
+  return shard;
+}
+
+/**
+ * @brief Counter incremented by several threads, each into a shard on a
+ * cache line of its own, the shards being summed only once it is read
+ *
+ * A thread thus never writes to the cache line of another one, unless there
+ * are more threads than shards.
+ */
+class ShardedCounter {
+public:
+  auto operator++() -> ShardedCounter & { return *this += 1; }
+
+  auto operator+=(uint64_t value) -> ShardedCounter & {
+    shards_[stats_shard()].value.fetch_add(value, std::memory_order_relaxed);
+    return *this;
+  }
+
+  auto value() const -> uint64_t {
+    uint64_t sum = 0;
+    for (const auto &shard : shards_) {
+      sum += shard.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{};
+  };
+
+  std::array<Shard, STATS_SHARDS> shards_{};
+};
+
+/**
+ * @brief Histogram recorded by several threads, each into a shard of its
+ * own, the shards being merged only once it is read, see ShardedCounter
+ */
+class ShardedHistogram {
+public:
+  void record(uint64_t value) {
+    size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    auto &shard = shards_[stats_shard()];
+    shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = shard.max.load(std::memory_order_relaxed);
+    while (value > max && !shard.max.compare_exchange_weak(
+                              max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  /**
+   * @brief Merge the shards, which may be recorded into meanwhile, the
+   * values being then counted or not
+   *
+   * @return The distribution of the values recorded by all the threads
+   */
+  auto merged() const -> Histogram;
+
+private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, Histogram::BUCKETS> buckets{};
+    std::atomic<uint64_t> count{};
+    std::atomic<uint64_t> sum{};
+    std::atomic<uint64_t> max{};
+  };
+
+  std::array<Shard, STATS_SHARDS> shards_{};
+};
+
+/**
+ * @brief The most published topics, with the messages and the deliveries of
+ * each, estimated by a count-min sketch
+ *
+ * Each published message adds 1 to its messages and its fan-out to its
+ * deliveries in a cell of every row of the sketch, chosen by the hash of its
+ * topic string (not that of its TopicView, shared by the topics whose tokens
+ * no subscription uses), the estimates being the smallest counts of its cells, which exceed
+ * the true counts only by the collisions. The topics with the largest
+ * estimates are kept in a min-heap of a fixed size, so that a topic of fewer
+ * messages than the least of them costs the 4 cells and a comparison.
+ */
+class TopicHeat {
+public:
+  // A topic of the heap, with its estimates and its last fan-out
+  struct HotTopic {
+    std::string topic{};
+    uint64_t messages{};
+    uint64_t deliveries{};
+    size_t fanout{};
+  };
+
+  TopicHeat() = default;
+
+  /**
+   * @param top_k The number of topics kept track of, none if it is 0
+   */
+  explicit TopicHeat(size_t top_k);
+
+  bool enabled() const { return top_k_ > 0; }
+
+  /**
+   * @brief Count a published message
+   *
+   * @param topic The topic of the message
+   * @param fanout The number of subscribers of the message
+   */
+  void record(std::string_view topic, size_t fanout);
+
+  /**
+   * @brief Get the topics kept track of
+   *
+   * @return The topics, the most published first
+   */
+  auto top() const -> std::vector<HotTopic>;
+
+  /**
+   * @brief Write the topics kept track of, the most published first, as a
+   * JSON array
+   *
+   * @param out The stream to write to
+   */
+  void write_json(std::ostream &out) const;
+
+private:
+  static constexpr size_t DEPTH = 4;
+  static constexpr size_t WIDTH_BITS = 11;
+  static constexpr size_t WIDTH = size_t{1} << WIDTH_BITS;
+
+  struct Cell {
+    uint64_t messages{};
+    uint64_t deliveries{};
+  };
+
+  struct Entry {
+    size_t hash{};
+    uint64_t messages{};
+    uint64_t deliveries{};
+    size_t fanout{};
+    uint8_t topic_size{};
+    std::array<char, UDP_MSG_TOPIC_SIZE> topic{};
+  };
+
+  // Restore the order of the heap from an entry whose messages grew, or
+  // which was just added
+  void sift_down(size_t index);
+  void sift_up(size_t index);
+
+  size_t top_k_{};
+  // DEPTH rows of WIDTH cells
+  std::vector<Cell> cells_{};
+  // a min-heap by the messages
+  std::vector<Entry> heap_{};
+};
+
+/**
+ * @brief Counters and distributions of the broker, collected by the thread of
+ * the server and the I/O workers since it started
+ *
+ * The counters and distributions are sharded by thread, see ShardedCounter,
+ * and summed when the statistics are written. The other fields are set by
+ * the thread of the server only.
+ */
+struct BrokerStats {
+  // The size of the output queue of a connected subscriber, and the memory
+  // held by its subscriptions
+  struct QueueDepth {
+    std::string id{};
+    size_t bytes{};
+    size_t subscription_bytes{};
+  };
+
+  ShardedCounter udp_received{};
+  // the UDP packets dropped by the kernel, the receive buffer of the socket
+  // being full, and the size of that buffer, in bytes
+  ShardedCounter udp_kernel_dropped{};
+  size_t udp_receive_buffer{};
+  // the UDP packets not processed, their publisher or all of them together
+  // exceeding their rate
+  ShardedCounter udp_publisher_limited{};
+  ShardedCounter udp_global_limited{};
+  // the UDP messages without subscribers, of those published to a valid topic
+  ShardedCounter udp_unmatched{};
+  // the messages queued for a subscriber, or dropped
+  ShardedCounter queued{};
+  ShardedCounter dropped{};
+  // the messages sent once to the multicast group, and those retransmitted on
+  // TCP to the subscribers missing them
+  ShardedCounter multicast_sent{};
+  ShardedCounter multicast_retransmitted{};
+  // the messages not sent to a subscriber, its filters rejecting them
+  ShardedCounter filtered{};
+
+  // The rejected publications and requests, by reason
+  std::array<ShardedCounter,
+             static_cast<size_t>(UdpParseError::TOTAL_PARSE_ERRORS)>
+      udp_rejected{};
+  ShardedCounter udp_invalid_topic{};
+  // the subscriptions whose filter is invalid, or exceeding the quota of
+  // their subscriber
+  ShardedCounter filters_rejected{};
+  ShardedCounter subscriptions_refused{};
+  // the frames of a size exceeding the max limit, or of another type than a
+  // request
+  ShardedCounter frames_too_large{};
+  ShardedCounter frames_not_request{};
+  std::array<ShardedCounter,
+             static_cast<size_t>(TcpParseError::TOTAL_PARSE_ERRORS)>
+      requests_rejected{};
+  // the topics of the subscribe and unsubscribe requests
+  std::array<ShardedCounter,
+             static_cast<size_t>(TokenPatternError::TOTAL_ERRORS)>
+      patterns_rejected{};
+  // the lines of the log dropped, its ring being full, and those suppressed,
+  // beyond the rate of their message, see AsyncLog
+  uint64_t log_dropped{};
+  uint64_t log_suppressed{};
+
+  // Duration of the matching of a published topic, in nanoseconds
+  ShardedHistogram match_ns{};
+  // Duration of the stages of the loop, in nanoseconds: the parsing of a
+  // batch of UDP packets into its messages grouped by topic and their
+  // fan-out, the matching included, with epoll, the flush of the output
+  // queues after the fan-out, and the handling of a request of a subscriber
+  ShardedHistogram parse_ns{};
+  ShardedHistogram fanout_ns{};
+  ShardedHistogram flush_ns{};
+  ShardedHistogram request_ns{};
+  // Number of subscribers of a published message, offline ones included
+  ShardedHistogram fanout{};
+  // Size of the output queue of a subscriber, in bytes, once a message is
+  // queued for it
+  ShardedHistogram queue_bytes{};
+  // Time from the reception of a UDP message by the kernel until its
+  // response is entirely accepted by the socket of a subscriber, in
+  // nanoseconds
+  ShardedHistogram receive_to_send_ns{};
+  // The same times by priority, for the lanes of the output queues
+  std::array<ShardedHistogram, PriorityClasses::MAX_LANES>
+      lane_receive_to_send_ns{};
+  size_t lanes{1};
+  // The most published topics, if they are kept track of
+  TopicHeat topics{};
+  // The budget of the output queues, in bytes, 0 if they have none, and the
+  // bytes queued against it
+  size_t queue_budget{};
+  size_t queue_budget_used{};
+
+  /**
+   * @brief Write the statistics as a single line of JSON
+   *
+   * @param out The stream to write to
+   * @param queues The output queues of the connected subscribers
+   */
+  void write_json(std::ostream &out,
+                  const std::vector<QueueDepth> &queues) const;
+
+  /**
+   * @brief Write the statistics in the Prometheus text format, the counters
+   * with the suffix _total and the rejections labeled by their reason
+   *
+   * @param out The stream to write to
+   * @param queues The output queues of the connected subscribers
+   */
+  void write_prometheus(std::ostream &out,
+                        const std::vector<QueueDepth> &queues) const;
+};
+
+/**
+ * @brief Get the time of CLOCK_REALTIME, that of the SO_TIMESTAMPNS timestamps
+ *
+ * @return The nanoseconds since the epoch
+ */
+auto realtime_ns() -> uint64_t;
@@ -0,0 +1,176 @@
+#include "capture.hpp"
+
+#include "async_log.hpp"
+#include "frame_reader.hpp"
+#include "util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// The header of a capture, at the start of the file
+struct CaptureHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t start_ns;
+};
+static_assert(sizeof(CaptureHeader) == CAPTURE_HEADER_SIZE);
+
+} // namespace
+
+CaptureWriter::CaptureWriter(const std::string &path)
+    : start_(std::chrono::steady_clock::now()) {
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Failed to create the capture " + path + ": " +
+                             std::strerror(errno));
+  }
+  buffer_.reserve(BUFFER_SIZE);
+
+  CaptureHeader header{CAPTURE_MAGIC, CAPTURE_VERSION, 0,
+                       static_cast<uint64_t>(
+                           std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::system_clock::now()
+                                   .time_since_epoch())
+                               .count())};
+  const auto *bytes = reinterpret_cast<const std::byte *>(&header);
+  buffer_.insert(buffer_.end(), bytes, bytes + sizeof(header));
+}
+
+CaptureWriter::~CaptureWriter() {
+  flush();
+  close(fd_);
+}
+
+void CaptureWriter::datagram(const sockaddr_in &sender, const std::byte *data,
+                             size_t size) {
+  std::byte *record = append(CaptureKind::DATAGRAM, sender.sin_addr.s_addr,
+                             sender.sin_port, size);
+  std::memcpy(record, data, size);
+}
+
+void CaptureWriter::connection(CaptureKind kind, uint64_t connection) {
+  append(kind, static_cast<uint32_t>(connection), 0, 0);
+}
+
+void CaptureWriter::request(uint64_t connection, TcpMessageType type,
+                            const std::byte *payload, size_t size) {
+  std::byte *record =
+      append(CaptureKind::REQUEST, static_cast<uint32_t>(connection), 0,
+             FrameReader::HEADER_SIZE + size);
+  // The header of the frame, as received
+  auto size_network = hton(static_cast<uint16_t>(size));
+  record[0] = static_cast<std::byte>(type);
+  std::memcpy(record + sizeof(type), &size_network, sizeof(size_network));
+  std::memcpy(record + FrameReader::HEADER_SIZE, payload, size);
+}
+
+auto CaptureWriter::append(CaptureKind kind, uint32_t source, uint16_t port,
+                           size_t size) -> std::byte * {
+  if (buffer_.size() + CAPTURE_RECORD_HEADER_SIZE + size > BUFFER_SIZE) {
+    flush();
+  }
+  auto time_ns = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_)
+          .count());
+  auto data_size = static_cast<uint16_t>(size);
+
+  size_t offset = buffer_.size();
+  buffer_.resize(offset + CAPTURE_RECORD_HEADER_SIZE + size);
+  std::byte *record = buffer_.data() + offset;
+  record[0] = static_cast<std::byte>(kind);
+  std::memcpy(record + 1, &data_size, sizeof(data_size));
+  std::memcpy(record + 3, &time_ns, sizeof(time_ns));
+  std::memcpy(record + 11, &source, sizeof(source));
+  std::memcpy(record + 15, &port, sizeof(port));
+  return record + CAPTURE_RECORD_HEADER_SIZE;
+}
+
+/**
+ * @brief Write the buffered records to the file, a failure only being
+ * reported, as the broker goes on without them
+ */
+void CaptureWriter::flush() {
+  size_t written = 0;
+  while (written < buffer_.size()) {
+    ssize_t result =
+        write(fd_, buffer_.data() + written, buffer_.size() - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Failed to write the capture: ", std::strerror(errno));
+      break;
+    }
+    written += static_cast<size_t>(result);
+  }
+  buffer_.clear();
+}
+
+CaptureReader::CaptureReader(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open the capture " + path + ": " +
+                             std::strerror(errno));
+  }
+  struct stat st {};
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < CAPTURE_HEADER_SIZE) {
+    close(fd);
+    throw std::runtime_error("Invalid capture " + path + ": too small");
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Failed to map the capture " + path + ": " +
+                             std::strerror(errno));
+  }
+  mapping_ = static_cast<const std::byte *>(mapping);
+  // Read once, from the start to the end
+  madvise(mapping, size_, MADV_SEQUENTIAL);
+
+  CaptureHeader header{};
+  std::memcpy(&header, mapping_, sizeof(header));
+  if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+    munmap(mapping, size_);
+    throw std::runtime_error("Invalid capture " + path + ": bad header");
+  }
+  start_ns_ = header.start_ns;
+}
+
+CaptureReader::~CaptureReader() {
+  munmap(const_cast<std::byte *>(mapping_), size_);
+}
+
+auto CaptureReader::next() -> std::optional<Record> {
+  if (offset_ == size_) {
+    return std::nullopt;
+  }
+  if (size_ - offset_ < CAPTURE_RECORD_HEADER_SIZE) {
+    throw std::runtime_error("Truncated record in the capture");
+  }
+
+  const std::byte *header = mapping_ + offset_;
+  Record record{};
+  uint16_t data_size{};
+  record.kind = static_cast<CaptureKind>(header[0]);
+  std::memcpy(&data_size, header + 1, sizeof(data_size));
+  std::memcpy(&record.time_ns, header + 3, sizeof(record.time_ns));
+  std::memcpy(&record.source, header + 11, sizeof(record.source));
+  std::memcpy(&record.port, header + 15, sizeof(record.port));
+  if (size_ - offset_ - CAPTURE_RECORD_HEADER_SIZE < data_size) {
+    throw std::runtime_error("Truncated record in the capture");
+  }
+  record.data = header + CAPTURE_RECORD_HEADER_SIZE;
+  record.size = data_size;
+  offset_ += CAPTURE_RECORD_HEADER_SIZE + data_size;
+  return record;
+}
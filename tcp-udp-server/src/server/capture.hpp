@@ -0,0 +1,161 @@
+#pragma once
+
+#include "tcp_proto.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A capture of the input of the broker starts with a header:
+//
+//   magic CAPTURE_MAGIC (4) | version (2) | reserved (2) | start of the
+//   capture, in nanoseconds since the epoch (8)
+//
+// followed by the records, packed without any padding:
+//
+//   kind (1) | size of the data (2) | time since the start of the capture, in
+//   nanoseconds (8) | source (4) | port (2) | data
+//
+// The integers are in the byte order of the host, the capture being replayed
+// on the same kind of machine, except the source and the port of a datagram,
+// the address and the port of its publisher, kept as in its sockaddr_in. The
+// source of the other records is the id of the connection of the subscriber,
+// modulo 2^32, and their port is 0. A datagram is recorded as it was
+// received, before its admission, and a request as its whole frame, the
+// header and the payload.
+
+static constexpr uint32_t CAPTURE_MAGIC = 0x50414354; // "TCAP"
+static constexpr uint16_t CAPTURE_VERSION = 1;
+static constexpr size_t CAPTURE_HEADER_SIZE = 16;
+static constexpr size_t CAPTURE_RECORD_HEADER_SIZE = 17;
+
+enum class CaptureKind : uint8_t {
+  DATAGRAM = 0,
+  // A subscriber connected, or closed its connection, without data
+  CONNECT,
+  DISCONNECT,
+  // A frame received from a subscriber
+  REQUEST,
+};
+
+struct CaptureConfig {
+  // The file the input is recorded to, replaced if it exists, none if it is
+  // empty
+  std::string file{};
+};
+
+/**
+ * @brief Records the input of the broker to a capture file, to be replayed
+ *
+ * The records are appended to a buffer, written to the file once it is full
+ * and when the writer is destroyed, so that a record only costs a copy.
+ */
+class CaptureWriter {
+public:
+  /**
+   * @brief Start a capture, replacing the file
+   *
+   * @param path The file
+   *
+   * @throws std::runtime_error if the file cannot be created
+   */
+  explicit CaptureWriter(const std::string &path);
+
+  CaptureWriter(const CaptureWriter &) = delete;
+  auto operator=(const CaptureWriter &) -> CaptureWriter & = delete;
+  ~CaptureWriter();
+
+  /**
+   * @brief Record a UDP datagram
+   *
+   * @param sender The address of its publisher
+   * @param data The datagram
+   * @param size The size of the datagram, at most UINT16_MAX
+   */
+  void datagram(const sockaddr_in &sender, const std::byte *data, size_t size);
+
+  /**
+   * @brief Record a connection of a subscriber, or its end
+   *
+   * @param kind CaptureKind::CONNECT or CaptureKind::DISCONNECT
+   * @param connection The id of the connection
+   */
+  void connection(CaptureKind kind, uint64_t connection);
+
+  /**
+   * @brief Record a frame received from a subscriber
+   *
+   * @param connection The id of the connection
+   * @param type The type of the frame
+   * @param payload The payload of the frame
+   * @param size The size of the payload
+   */
+  void request(uint64_t connection, TcpMessageType type,
+               const std::byte *payload, size_t size);
+
+private:
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+  // Append the header of a record, and room for its data, returned
+  auto append(CaptureKind kind, uint32_t source, uint16_t port, size_t size)
+      -> std::byte *;
+  void flush();
+
+  int fd_{-1};
+  std::vector<std::byte> buffer_{};
+  std::chrono::steady_clock::time_point start_{};
+};
+
+/**
+ * @brief Reads the records of a capture file, mapped in memory
+ */
+class CaptureReader {
+public:
+  // A record of the capture, whose data is valid while the reader is
+  struct Record {
+    CaptureKind kind{};
+    uint64_t time_ns{};
+    uint32_t source{};
+    uint16_t port{};
+    const std::byte *data{};
+    size_t size{};
+  };
+
+  /**
+   * @brief Open a capture
+   *
+   * @param path The file
+   *
+   * @throws std::runtime_error if the file cannot be mapped, or is not a
+   * capture
+   */
+  explicit CaptureReader(const std::string &path);
+
+  CaptureReader(const CaptureReader &) = delete;
+  auto operator=(const CaptureReader &) -> CaptureReader & = delete;
+  ~CaptureReader();
+
+  /**
+   * @brief Get the next record
+   *
+   * @return The record, or std::nullopt at the end of the capture
+   *
+   * @throws std::runtime_error if the record is truncated
+   */
+  auto next() -> std::optional<Record>;
+
+  // Go back to the first record
+  void rewind() { offset_ = CAPTURE_HEADER_SIZE; }
+
+  // When the capture started, in nanoseconds since the epoch
+  auto start_ns() const -> uint64_t { return start_ns_; }
+
+private:
+  const std::byte *mapping_{};
+  size_t size_{};
+  size_t offset_{CAPTURE_HEADER_SIZE};
+  uint64_t start_ns_{};
+};
@@ -0,0 +1,136 @@
+#include "cpu_placement.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/sysinfo.h>
+
+namespace {
+
+// Above the CPUs of the machines it runs on, for the affinity masks
+constexpr int MAX_CPU = CPU_SETSIZE - 1;
+
+auto parse_cpu(std::string_view str, int &cpu) -> bool {
+  const char *end = str.data() + str.size();
+  auto [ptr, ec] = std::from_chars(str.data(), end, cpu);
+  return ec == std::errc{} && ptr == end && cpu >= 0 && cpu <= MAX_CPU;
+}
+
+} // namespace
+
+auto parse_cpu_list(std::string_view str, std::vector<int> &cpus) -> bool {
+  cpus.clear();
+  while (!str.empty()) {
+    size_t comma = str.find(',');
+    std::string_view item = str.substr(0, comma);
+    str = comma == std::string_view::npos ? std::string_view{}
+                                          : str.substr(comma + 1);
+
+    size_t dash = item.find('-');
+    int first = 0;
+    int last = 0;
+    if (!parse_cpu(item.substr(0, dash), first) ||
+        !parse_cpu(dash == std::string_view::npos ? item.substr(0, dash)
+                                                  : item.substr(dash + 1),
+                   last) ||
+        last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return !cpus.empty();
+}
+
+auto pin_current_thread(int cpu) -> bool {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+auto cpu_node(int cpu) -> int {
+  // The directory of the CPU links to that of its node, node<N>
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return -1;
+  }
+  int node = -1;
+  while (const dirent *entry = readdir(dir)) {
+    std::string_view name(entry->d_name);
+    if (name.size() > 4 && name.substr(0, 4) == "node" &&
+        parse_cpu(name.substr(4), node)) {
+      break;
+    }
+    node = -1;
+  }
+  closedir(dir);
+  return node;
+}
+
+ConnectionSteering::ConnectionSteering(const PlacementConfig &config,
+                                       size_t workers) {
+  if (!config.steer_connections || config.worker_cpus.empty()) {
+    return;
+  }
+  int cpus = std::max(get_nprocs_conf(), 1);
+  cpu_workers_.assign(static_cast<size_t>(cpus), -1);
+  cpu_nodes_.resize(static_cast<size_t>(cpus));
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    cpu_nodes_[static_cast<size_t>(cpu)] = cpu_node(cpu);
+  }
+
+  for (size_t i = 0; i < workers; ++i) {
+    auto cpu = static_cast<size_t>(
+        config.worker_cpus[i % config.worker_cpus.size()]);
+    if (cpu >= cpu_workers_.size()) {
+      continue;
+    }
+    // The first worker pinned to a CPU gets its connections
+    if (cpu_workers_[cpu] < 0) {
+      cpu_workers_[cpu] = static_cast<int>(i);
+    }
+    int node = cpu_nodes_[cpu];
+    if (node >= 0) {
+      if (static_cast<size_t>(node) >= node_workers_.size()) {
+        node_workers_.resize(static_cast<size_t>(node) + 1);
+      }
+      node_workers_[static_cast<size_t>(node)].push_back(i);
+    }
+  }
+}
+
+auto ConnectionSteering::worker(int sockfd, size_t fallback) -> size_t {
+  if (cpu_workers_.empty()) {
+    return fallback;
+  }
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 ||
+      cpu < 0 || static_cast<size_t>(cpu) >= cpu_workers_.size()) {
+    return fallback;
+  }
+  if (cpu_workers_[static_cast<size_t>(cpu)] >= 0) {
+    return static_cast<size_t>(cpu_workers_[static_cast<size_t>(cpu)]);
+  }
+  int node = cpu_nodes_[static_cast<size_t>(cpu)];
+  if (node < 0 || static_cast<size_t>(node) >= node_workers_.size() ||
+      node_workers_[static_cast<size_t>(node)].empty()) {
+    return fallback;
+  }
+  const auto &local = node_workers_[static_cast<size_t>(node)];
+  return local[next_++ % local.size()];
+}
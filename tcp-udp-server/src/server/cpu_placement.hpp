@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+struct PlacementConfig {
+  // The CPUs the UDP ingest threads, which also match the messages, and the
+  // I/O workers are pinned to, the i-th thread to the i-th CPU, wrapping
+  // around, the threads not being pinned if empty
+  std::vector<int> ingest_cpus{};
+  std::vector<int> worker_cpus{};
+  // Whether a new subscriber goes to the I/O worker pinned to the CPU its
+  // connection is received on, as given by SO_INCOMING_CPU, or else to one on
+  // the same NUMA node, instead of the worker of its socket
+  bool steer_connections{};
+  // Whether the UDP packets go to the ingest thread of the hash of their
+  // topic, instead of that of the addresses of their publisher, keeping the
+  // messages of a topic in order
+  bool steer_topics{};
+};
+
+/**
+ * @brief Parse a list of CPUs, as in /sys/devices/system/cpu/online: numbers
+ * and ranges separated by commas, such as 0-3,8,10-11
+ *
+ * @param str The list
+ * @param cpus The CPUs, in order
+ * @return false if the list is invalid
+ */
+auto parse_cpu_list(std::string_view str, std::vector<int> &cpus) -> bool;
+
+/**
+ * @brief Pin the calling thread to a CPU, before it allocates its memory, so
+ * that the kernel places its pages on the NUMA node of the CPU
+ *
+ * @param cpu The CPU
+ * @return false if the thread cannot be pinned, errno being set
+ */
+auto pin_current_thread(int cpu) -> bool;
+
+/**
+ * @brief Get the NUMA node of a CPU, from sysfs
+ *
+ * @param cpu The CPU
+ * @return The node, -1 if it is unknown
+ */
+auto cpu_node(int cpu) -> int;
+
+/**
+ * @brief Pick the I/O worker of the new connections, by the CPU they are
+ * received on
+ *
+ * The CPU of a connection is the one the kernel processed its packets on,
+ * that of the interrupt of the queue of the NIC they arrived on, so the
+ * worker pinned to it, or close to it, sends on memory local to the NIC.
+ */
+class ConnectionSteering {
+public:
+  /**
+   * @brief Build the steering of the workers of a placement
+   *
+   * @param config The placement, the connections being steered only if
+   * steer_connections is set and the workers are pinned
+   * @param workers The number of I/O workers
+   */
+  ConnectionSteering(const PlacementConfig &config, size_t workers);
+
+  /**
+   * @brief Pick the worker of a connection: the one pinned to its CPU, else
+   * one on the node of its CPU, else the worker of its socket
+   *
+   * @param sockfd The socket of the connection
+   * @param fallback The worker picked if the connection is not steered
+   * @return The index of the worker
+   */
+  auto worker(int sockfd, size_t fallback) -> size_t;
+
+private:
+  // The worker pinned to each CPU, -1 if none, and the node of each CPU, by
+  // index, empty if the connections are not steered
+  std::vector<int> cpu_workers_{};
+  std::vector<int> cpu_nodes_{};
+  // the workers pinned to the CPUs of each node
+  std::vector<std::vector<size_t>> node_workers_{};
+  // spreads the connections among the workers of a node
+  size_t next_{};
+};
@@ -0,0 +1,48 @@
+#include "delivery_limit.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+constexpr uint64_t NS_PER_SECOND = 1000000000;
+
+} // namespace
+
+DeliveryLimit::DeliveryLimit(uint32_t max_rate, uint16_t sample_every)
+    : max_rate_(max_rate), sample_every_(sample_every) {
+  if (max_rate_ > 0) {
+    // A message may be sent at most every nanosecond
+    interval_ns_ = std::max<uint64_t>(NS_PER_SECOND / max_rate_, 1);
+    // A full bucket sends a second of the rate at once
+    tolerance_ns_ = NS_PER_SECOND - std::min(interval_ns_, NS_PER_SECOND);
+  }
+}
+
+auto DeliveryLimit::admit() -> bool {
+  if (sample_every_ > 1 &&
+      seen_.fetch_add(1, std::memory_order_relaxed) % sample_every_ != 0) {
+    return false;
+  }
+  if (max_rate_ == 0) {
+    return true;
+  }
+
+  auto now_ns = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+  uint64_t full_at_ns = full_at_ns_.load(std::memory_order_relaxed);
+  while (true) {
+    // The bucket lacks the tokens taken since it was last full
+    uint64_t taken_until = std::max(full_at_ns, now_ns);
+    if (taken_until - now_ns > tolerance_ns_) {
+      return false;
+    }
+    if (full_at_ns_.compare_exchange_weak(full_at_ns,
+                                          taken_until + interval_ns_,
+                                          std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "content_filter.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * @brief Limits the share of the messages of a subscription sent to its
+ * subscriber: one message in a number of them, and at most a rate of
+ * messages per second
+ *
+ * The messages are sampled first, those skipped not counting against the
+ * rate. The rate is a token bucket holding a second of it, kept as the time
+ * the bucket is full again (GCRA), so that a single compare-and-swap takes a
+ * token: a limit is shared by the threads matching the publications, through
+ * the snapshots of the registry, and by the fan-out of the main thread.
+ */
+class DeliveryLimit {
+public:
+  /**
+   * @brief Create the limits of a subscription
+   *
+   * @param max_rate The messages per second sent at most, 0 for no limit
+   * @param sample_every Send one message in this many, the first one
+   * included, 0 or 1 for all of them
+   */
+  DeliveryLimit(uint32_t max_rate, uint16_t sample_every);
+
+  DeliveryLimit(const DeliveryLimit &) = delete;
+  auto operator=(const DeliveryLimit &) -> DeliveryLimit & = delete;
+
+  /**
+   * @brief Decide whether a message of the subscription is sent, counting it
+   *
+   * @return true if it is sampled, and the rate allows it
+   */
+  auto admit() -> bool;
+
+  auto max_rate() const -> uint32_t { return max_rate_; }
+  auto sample_every() const -> uint16_t { return sample_every_; }
+
+private:
+  uint32_t max_rate_{};
+  uint16_t sample_every_{};
+  // the time between two messages at the rate, and how far ahead of the
+  // current time the bucket may be emptied, in nanoseconds
+  uint64_t interval_ns_{};
+  uint64_t tolerance_ns_{};
+
+  // the messages seen by the sampling
+  std::atomic<uint64_t> seen_{0};
+  // when the bucket would be full again, on the steady clock
+  std::atomic<uint64_t> full_at_ns_{0};
+};
+
+/**
+ * @brief The filter of the messages of a subscription: its content filter
+ * and its delivery limits, each null if it has none
+ */
+struct SubscriptionFilter {
+  std::shared_ptr<const ContentFilter> content{};
+  std::shared_ptr<DeliveryLimit> limit{};
+
+  explicit operator bool() const { return content || limit; }
+
+  /**
+   * @brief Check if a message of the subscription is sent, which counts it
+   * against the limits once the content filter accepted it
+   *
+   * @param type The type of the payload of the message
+   * @param payload The payload, as laid out in the publication
+   * @param size The size of the payload
+   * @return true if the message is sent
+   */
+  bool accepts(TcpResponsePayloadType type, const std::byte *payload,
+               size_t size) const {
+    return (!content || content->matches(type, payload, size)) &&
+           (!limit || limit->admit());
+  }
+};
@@ -0,0 +1,131 @@
+#include "fanout_encoder.hpp"
+
+#include "util.hpp"
+#include <algorithm>
+#include <cstring>
+
+static_assert(UDP_PAYLOAD_FORMATS.size() ==
+                  static_cast<size_t>(
+                      TcpResponsePayloadType::TOTAL_PAYLOAD_TYPES),
+              "A UDP payload is framed as the TCP payload of the same type");
+
+auto FanoutEncoder::encode(const UdpMessageView &udp_msg,
+                           const sockaddr_in &udp_sender,
+                           uint64_t received_ns, uint8_t priority)
+    -> std::shared_ptr<const OutgoingMessage> {
+  // The frame is gathered straight from the datagram, the only copy of its
+  // payload
+  ResponseFrame frame{};
+  frame_response(udp_msg, udp_sender, frame);
+  size_t size = 0;
+  for (size_t i = 0; i < frame.count; ++i) {
+    size += frame.iov[i].iov_len;
+  }
+
+  auto message = take_message(size);
+  auto &bytes = message->bytes;
+  bytes.clear();
+  for (size_t i = 0; i < frame.count; ++i) {
+    const auto *base = static_cast<const std::byte *>(frame.iov[i].iov_base);
+    bytes.insert(bytes.end(), base, base + frame.iov[i].iov_len);
+  }
+  message->topic.assign(udp_msg.topic, udp_msg.topic_size);
+  message->received_ns = received_ns;
+  message->priority = priority;
+  return message;
+}
+
+/**
+ * @brief Take a message of the smallest size class fitting a response
+ *
+ * The message handed out the longest ago is reused if it is no longer
+ * referenced, the messages being mostly released in the order they were
+ * queued. Otherwise, a new message is added to the pool, in place of the
+ * newest one, until the pool is full.
+ *
+ * @param size The size of the serialized response
+ * @return The message, whose bytes have the capacity of the size class
+ */
+auto FanoutEncoder::take_message(size_t size)
+    -> std::shared_ptr<OutgoingMessage> {
+  size_t size_class = static_cast<size_t>(
+      std::lower_bound(SIZE_CLASSES.begin(), SIZE_CLASSES.end(), size) -
+      SIZE_CLASSES.begin());
+  size_t capacity = SIZE_CLASSES[size_class];
+  auto make_message = [capacity]() {
+    auto message = std::make_shared<OutgoingMessage>();
+    message->bytes.reserve(capacity);
+    message->topic.reserve(TCP_RESP_TOPIC_MAX_SIZE);
+    return message;
+  };
+  if (!reuse_messages_) {
+    return make_message();
+  }
+
+  auto &pool = pools_[size_class];
+  if (!pool.messages.empty() && pool.messages[pool.next].use_count() == 1) {
+    auto &message = pool.messages[pool.next];
+    pool.next = (pool.next + 1) % pool.messages.size();
+    return message;
+  }
+  if (pool.messages.size() >= MAX_POOLED) {
+    return make_message();
+  }
+  auto it = pool.messages.insert(pool.messages.begin() +
+                                     static_cast<std::ptrdiff_t>(pool.next),
+                                 make_message());
+  pool.next = (pool.next + 1) % pool.messages.size();
+  return *it;
+}
+
+/**
+ * @brief Frame the TCP response to a UDP message, without copying its topic
+ * nor its payload
+ *
+ * The frame is the same as the one of TcpMessage::serialize. The payloads of
+ * the UDP messages are laid out as those of the TCP responses, so only the
+ * headers around them are serialized in the frame.
+ *
+ * @param udp_msg The UDP message, whose datagram outlives the frame
+ * @param udp_sender_addr The address of the UDP sender
+ * @param frame The frame to fill, whose iovecs point to itself
+ */
+void FanoutEncoder::frame_response(const UdpMessageView &udp_msg,
+                                   const sockaddr_in &udp_sender_addr,
+                                   ResponseFrame &frame) {
+  // The size of the payload is always written, but only sent before those
+  // whose format has it, a string
+  std::byte *payload_header = frame.payload_header.data();
+  payload_header[0] = static_cast<std::byte>(udp_msg.payload_type);
+  uint16_t value_size_network = hton(udp_msg.payload_size);
+  std::memcpy(payload_header + sizeof(TcpResponsePayloadType),
+              &value_size_network, sizeof(value_size_network));
+  size_t payload_header_size =
+      sizeof(TcpResponsePayloadType) +
+      UDP_PAYLOAD_FORMATS[static_cast<size_t>(udp_msg.payload_type)]
+          .response_prefix_size;
+
+  size_t response_size = sizeof(uint32_t) + sizeof(uint16_t) +
+                         sizeof(uint8_t) + udp_msg.topic_size +
+                         payload_header_size + udp_msg.payload_size;
+
+  std::byte *header = frame.header.data();
+  header[0] = static_cast<std::byte>(TcpMessageType::RESPONSE);
+  header += sizeof(TcpMessageType);
+  uint16_t response_size_network = hton(static_cast<uint16_t>(response_size));
+  std::memcpy(header, &response_size_network, sizeof(response_size_network));
+  header += sizeof(response_size_network);
+  // The address is already in network byte order
+  std::memcpy(header, &udp_sender_addr.sin_addr.s_addr, sizeof(uint32_t));
+  header += sizeof(uint32_t);
+  std::memcpy(header, &udp_sender_addr.sin_port, sizeof(uint16_t));
+  header += sizeof(uint16_t);
+  std::memcpy(header, &udp_msg.topic_size, sizeof(uint8_t));
+
+  frame.iov[0] = {frame.header.data(), frame.header.size()};
+  frame.iov[1] = {const_cast<char *>(udp_msg.topic), udp_msg.topic_size};
+  frame.iov[2] = {frame.payload_header.data(), payload_header_size};
+  frame.iov[3] = {const_cast<std::byte *>(udp_msg.payload),
+                  udp_msg.payload_size};
+  frame.count = udp_msg.payload_size > 0 ? 4 : 3;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "output_queue.hpp"
+#include "tcp_proto.hpp"
+#include "udp_proto.hpp"
+#include <array>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <vector>
+
+/**
+ * @brief Turns the published UDP messages into the TCP responses sent to
+ * their subscribers, serialized once for all of them
+ *
+ * The messages are taken from pools by size class, so that a queued INT
+ * response holds tens of bytes instead of room for the largest string, and
+ * are reused once the output queues release them, so that the steady state
+ * does not allocate.
+ */
+class FanoutEncoder {
+public:
+  // The capacities of the messages of the pools, the last one fitting any
+  // response
+  static constexpr std::array<size_t, 4> SIZE_CLASSES{64, 256, 1024, 2048};
+  static_assert(SIZE_CLASSES.back() >= TcpMessage::MAX_SERIALIZED_SIZE);
+  // The messages kept by each pool, those allocated past it being freed once
+  // released
+  static constexpr size_t MAX_POOLED = 4096;
+
+  /**
+   * @param reuse_messages Whether to reuse the messages no longer referenced,
+   * which only holds when they are released on the same thread, as use_count
+   * does not order the reads of the other threads
+   */
+  explicit FanoutEncoder(bool reuse_messages = true)
+      : reuse_messages_(reuse_messages) {}
+
+  /**
+   * @brief Serialize the TCP response to a UDP message
+   *
+   * The message is the oldest one of its size class no longer referenced, by
+   * the output queues in particular, a new one being allocated while all of
+   * them are still queued.
+   *
+   * @param udp_msg The UDP message, pointing to its datagram
+   * @param udp_sender The address of the sender of the UDP message
+   * @param received_ns When the UDP message was received, 0 if it is unknown
+   * @param priority The priority of the topic, see PriorityClasses
+   * @return The serialized message, immutable
+   */
+  auto encode(const UdpMessageView &udp_msg, const sockaddr_in &udp_sender,
+              uint64_t received_ns = 0, uint8_t priority = 0)
+      -> std::shared_ptr<const OutgoingMessage>;
+
+private:
+  // The TCP response to a UDP message, as iovecs pointing to the headers built
+  // here and to the topic and the payload in the datagram
+  struct ResponseFrame {
+    // message type and size, sender address and topic size
+    static constexpr size_t HEADER_SIZE =
+        sizeof(TcpMessageType) + sizeof(uint16_t) + sizeof(uint32_t) +
+        sizeof(uint16_t) + sizeof(uint8_t);
+    // payload type, then the size of a string
+    static constexpr size_t PAYLOAD_HEADER_SIZE =
+        sizeof(TcpResponsePayloadType) + sizeof(uint16_t);
+
+    std::array<std::byte, HEADER_SIZE> header{};
+    std::array<std::byte, PAYLOAD_HEADER_SIZE> payload_header{};
+    std::array<iovec, 4> iov{};
+    size_t count{};
+  };
+
+  // The messages of a size class, in the order they were handed out from
+  // next, the oldest being the first to be released
+  struct Pool {
+    std::vector<std::shared_ptr<OutgoingMessage>> messages{};
+    size_t next{};
+  };
+
+  static void frame_response(const UdpMessageView &udp_msg,
+                             const sockaddr_in &udp_sender,
+                             ResponseFrame &frame);
+  auto take_message(size_t size) -> std::shared_ptr<OutgoingMessage>;
+
+  bool reuse_messages_{true};
+  std::array<Pool, SIZE_CLASSES.size()> pools_{};
+};
@@ -0,0 +1,202 @@
+#include "federation_link.hpp"
+
+#include "tcp_utils.hpp"
+#include "util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+FederationLink::FederationLink(const sockaddr_in &peer, std::string id,
+                               std::chrono::milliseconds retry_interval)
+    : peer_(peer), id_(std::move(id)), retry_interval_(retry_interval) {}
+
+FederationLink::~FederationLink() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+auto FederationLink::open(std::chrono::steady_clock::time_point now) -> int {
+  fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    retry_deadline_ = now + retry_interval_;
+    return -1;
+  }
+  // The changes of the interest are sent at once
+  int enable = 1;
+  setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+  if (connect(fd_, reinterpret_cast<const sockaddr *>(&peer_),
+              sizeof(peer_)) < 0 &&
+      errno != EINPROGRESS) {
+    close(now);
+    return -1;
+  }
+  return fd_;
+}
+
+auto FederationLink::finish_connect(const std::vector<TokenPattern> &interest)
+    -> bool {
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+      error != 0) {
+    return false;
+  }
+  connected_ = true;
+
+  // The forwarded messages are not held back, as they were already by the
+  // publishing broker
+  TcpMessage message{};
+  auto &request = message.payload.emplace<TcpRequest>();
+  request.type = TcpRequestType::CONNECT;
+  auto &id_payload = request.payload.emplace<TcpRequestPayloadId>();
+  id_payload.set(id_.c_str(), id_.size());
+  id_payload.flags = TCP_CONNECT_PEER | TCP_CONNECT_NO_COALESCING;
+  queue_message(message);
+
+  queue_topics(TcpRequestType::SUBSCRIBE_BULK, interest);
+  return true;
+}
+
+void FederationLink::queue_topics(TcpRequestType type,
+                                  const std::vector<TokenPattern> &patterns) {
+  if (patterns.empty()) {
+    return;
+  }
+
+  TcpMessage message{};
+  auto &request = message.payload.emplace<TcpRequest>();
+  request.type = type;
+  auto &topics = request.payload.emplace<TcpRequestPayloadTopics>();
+  for (const auto &pattern : patterns) {
+    std::string topic = pattern.to_string();
+    if (!topics.add(topic.c_str(), topic.size())) {
+      queue_message(message);
+      topics.topics_size = 0;
+      topics.add(topic.c_str(), topic.size());
+    }
+  }
+  queue_message(message);
+}
+
+void FederationLink::queue_heartbeat() {
+  output_.insert(output_.end(), TCP_HEARTBEAT_FRAME.begin(),
+                 TCP_HEARTBEAT_FRAME.end());
+}
+
+void FederationLink::queue_message(const TcpMessage &message) {
+  size_t offset = output_.size();
+  output_.resize(offset + message.serialized_size());
+  TcpMessage::serialize(message, output_.data() + offset);
+}
+
+void FederationLink::flush() {
+  while (sent_ < output_.size()) {
+    ssize_t sent = send(fd_, output_.data() + sent_, output_.size() - sent_,
+                        MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // The rest is sent once the socket is writable again
+        return;
+      }
+      throw TcpTransmissionError("send() failed with error: " +
+                                 std::string(std::strerror(errno)));
+    }
+    sent_ += static_cast<size_t>(sent);
+  }
+  output_.clear();
+  sent_ = 0;
+}
+
+void FederationLink::close(std::chrono::steady_clock::time_point now) {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  fd_ = -1;
+  connected_ = false;
+  output_.clear();
+  sent_ = 0;
+  input.clear();
+  retry_deadline_ = now + retry_interval_;
+}
+
+auto FederationLink::parse_forwarded(const FrameReader::Frame &frame,
+                                     UdpMessageView &msg,
+                                     sockaddr_in &sender) noexcept -> bool {
+  // The address of the publisher, the size of the topic, the topic and the
+  // type of the payload, as framed by FanoutEncoder
+  const std::byte *response = frame.payload;
+  size_t left = frame.size;
+  constexpr size_t address_size = sizeof(uint32_t) + sizeof(uint16_t);
+  if (frame.type != TcpMessageType::RESPONSE ||
+      left < address_size + sizeof(uint8_t)) {
+    return false;
+  }
+  sender = sockaddr_in{};
+  sender.sin_family = AF_INET;
+  // Already in network byte order
+  std::memcpy(&sender.sin_addr.s_addr, response, sizeof(uint32_t));
+  std::memcpy(&sender.sin_port, response + sizeof(uint32_t), sizeof(uint16_t));
+  response += address_size;
+  left -= address_size;
+
+  uint8_t topic_size{};
+  std::memcpy(&topic_size, response, sizeof(topic_size));
+  if (topic_size == 0 || topic_size > UDP_MSG_TOPIC_SIZE ||
+      left < sizeof(topic_size) + topic_size + sizeof(UdpPayloadType)) {
+    return false;
+  }
+  const char *topic = reinterpret_cast<const char *>(response + 1);
+  response += sizeof(topic_size) + topic_size;
+  left -= sizeof(topic_size) + topic_size;
+
+  auto payload_type = static_cast<UdpPayloadType>(*response);
+  response += sizeof(UdpPayloadType);
+  left -= sizeof(UdpPayloadType);
+
+  size_t payload_size{};
+  switch (payload_type) {
+  case UdpPayloadType::INT:
+    payload_size = UdpPayloadInt::MIN_SERIALIZED_SIZE;
+    break;
+  case UdpPayloadType::SHORT_REAL:
+    payload_size = UdpPayloadShortReal::MIN_SERIALIZED_SIZE;
+    break;
+  case UdpPayloadType::FLOAT:
+    payload_size = UdpPayloadFloat::MIN_SERIALIZED_SIZE;
+    break;
+  case UdpPayloadType::STRING: {
+    // The string is preceded by its size
+    uint16_t size_network{};
+    if (left < sizeof(size_network)) {
+      return false;
+    }
+    std::memcpy(&size_network, response, sizeof(size_network));
+    response += sizeof(size_network);
+    left -= sizeof(size_network);
+    payload_size = ntoh(size_network);
+    if (payload_size > UdpPayloadString::MAX_SERIALIZED_SIZE) {
+      return false;
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+  if (left != payload_size) {
+    return false;
+  }
+
+  msg.topic = topic;
+  msg.topic_size = topic_size;
+  msg.payload_type = payload_type;
+  msg.payload = response;
+  msg.payload_size = static_cast<uint16_t>(payload_size);
+  return true;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "frame_reader.hpp"
+#include "tcp_proto.hpp"
+#include "token_pattern.hpp"
+#include "udp_proto.hpp"
+#include <chrono>
+#include <cstddef>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+struct FederationConfig {
+  // The brokers peered with, on their TCP port, none if the broker is not
+  // federated
+  std::vector<sockaddr_in> peers{};
+  // The id the broker connects to its peers with, as a subscriber
+  std::string id{};
+  // How long a link waits after a failure before connecting again
+  std::chrono::milliseconds retry_interval{1000};
+};
+
+/**
+ * @brief The link of a broker to a peer of its federation, over which the
+ * peer forwards the publications matching the interest of the local
+ * subscribers
+ *
+ * The broker connects to the peer as a subscriber with TCP_CONNECT_PEER,
+ * subscribes to its whole interest with bulk requests, then to each change of
+ * it. The peer sends back the RESPONSE frames of the matching publications,
+ * which are only published to the local subscribers, so a publication makes a
+ * single hop across a full mesh of brokers. A link which fails is closed and
+ * connected again after the retry interval, its interest being sent again.
+ */
+class FederationLink {
+public:
+  /**
+   * @param peer The address of the TCP port of the peer
+   * @param id The id the broker connects with
+   * @param retry_interval How long to wait after a failure before connecting
+   * again
+   */
+  FederationLink(const sockaddr_in &peer, std::string id,
+                 std::chrono::milliseconds retry_interval);
+
+  /**
+   * @brief Destroy the FederationLink object, closing its socket
+   */
+  ~FederationLink();
+
+  FederationLink(const FederationLink &) = delete;
+  FederationLink &operator=(const FederationLink &) = delete;
+
+  int fd() const { return fd_; }
+  bool connected() const { return connected_; }
+  // When to connect again, while the link is closed
+  auto retry_deadline() const -> std::chrono::steady_clock::time_point {
+    return retry_deadline_;
+  }
+  // Whether the socket is waited for until it is writable: still connecting,
+  // or with requests left to send
+  bool wants_write() const { return !connected_ || sent_ < output_.size(); }
+
+  /**
+   * @brief Start connecting to the peer, without blocking
+   *
+   * @param now The current time
+   * @return The socket, to be waited for until it is writable, or -1 if
+   * connecting failed at once, retried after the interval
+   */
+  auto open(std::chrono::steady_clock::time_point now) -> int;
+
+  /**
+   * @brief Complete the connection once the socket is writable, queueing the
+   * CONNECT request and the whole interest
+   *
+   * @param interest The topic patterns of the local subscribers
+   * @return false if connecting failed
+   */
+  auto finish_connect(const std::vector<TokenPattern> &interest) -> bool;
+
+  /**
+   * @brief Queue the bulk requests of topic patterns, as many as fit in each
+   *
+   * @param type TcpRequestType::SUBSCRIBE_BULK or UNSUBSCRIBE_BULK
+   * @param patterns The topic patterns
+   */
+  void queue_topics(TcpRequestType type,
+                    const std::vector<TokenPattern> &patterns);
+
+  /**
+   * @brief Queue a heartbeat, sent back to the peer which sent it
+   */
+  void queue_heartbeat();
+
+  /**
+   * @brief Send the queued requests, without blocking
+   *
+   * @throws TcpSocketException if the send fails
+   */
+  void flush();
+
+  /**
+   * @brief Close the connection, connecting again after the retry interval
+   *
+   * @param now The current time
+   */
+  void close(std::chrono::steady_clock::time_point now);
+
+  /**
+   * @brief Validate a RESPONSE frame forwarded by a peer in place, as the
+   * publication it was framed from, without throwing
+   *
+   * @param frame The frame, which must outlive the view
+   * @param msg The view to point to the frame, set if it is valid
+   * @param sender Set to the address of the UDP publisher
+   * @return true if the frame is a valid response
+   */
+  [[nodiscard]] static auto parse_forwarded(const FrameReader::Frame &frame,
+                                            UdpMessageView &msg,
+                                            sockaddr_in &sender) noexcept
+      -> bool;
+
+  // the bytes received from the peer not forming a whole frame yet
+  FrameReader input{};
+
+private:
+  void queue_message(const TcpMessage &message);
+
+  sockaddr_in peer_{};
+  std::string id_{};
+  std::chrono::milliseconds retry_interval_{};
+  int fd_{-1};
+  bool connected_{};
+  std::chrono::steady_clock::time_point retry_deadline_{};
+  // the serialized requests, those before sent_ having been sent
+  std::vector<std::byte> output_{};
+  size_t sent_{};
+};
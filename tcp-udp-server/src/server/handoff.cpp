@@ -0,0 +1,311 @@
+#include "handoff.hpp"
+
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+
+constexpr std::array<char, 4> HANDOFF_MAGIC{'T', 'U', 'S', 'H'};
+constexpr uint8_t HANDOFF_VERSION = 1;
+// The socket of the handoff, in the process taking over
+constexpr int CHILD_FD = 3;
+// The file descriptors passed by a single message, below SCM_MAX_FD
+constexpr size_t FDS_PER_MESSAGE = 250;
+
+auto error_message(const char *what) -> std::string {
+  return std::string(what) + ": " + std::strerror(errno);
+}
+
+void send_bytes(int sockfd, const std::byte *data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(sockfd, data, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(error_message("Failed to send the handoff"));
+    }
+    data += sent;
+    size -= static_cast<size_t>(sent);
+  }
+}
+
+void receive_bytes(int sockfd, std::byte *data, size_t size) {
+  while (size > 0) {
+    ssize_t received = recv(sockfd, data, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      throw std::runtime_error(received == 0
+                                   ? "The handoff ended early"
+                                   : error_message("Failed to receive the "
+                                                   "handoff"));
+    }
+    data += received;
+    size -= static_cast<size_t>(received);
+  }
+}
+
+// Append the bytes of a number, in network byte order
+template <typename T> void append(std::vector<std::byte> &buffer, T value) {
+  value = hton(value);
+  const auto *bytes = reinterpret_cast<const std::byte *>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+void append_bytes(std::vector<std::byte> &buffer,
+                  const std::vector<std::byte> &bytes) {
+  append(buffer, static_cast<uint32_t>(bytes.size()));
+  buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+}
+
+// Reads a state, throwing once past its end
+class Reader {
+public:
+  Reader(const std::byte *data, size_t size) : data_(data), end_(data + size) {}
+
+  auto bytes(size_t size) -> const std::byte * {
+    if (static_cast<size_t>(end_ - data_) < size) {
+      throw std::runtime_error("Invalid handoff: truncated");
+    }
+    const std::byte *bytes = data_;
+    data_ += size;
+    return bytes;
+  }
+
+  template <typename T> auto number() -> T {
+    T value{};
+    std::memcpy(&value, bytes(sizeof(value)), sizeof(value));
+    return ntoh(value);
+  }
+
+  auto sized_bytes() -> std::vector<std::byte> {
+    auto size = number<uint32_t>();
+    const std::byte *data = bytes(size);
+    return {data, data + size};
+  }
+
+  bool at_end() const { return data_ == end_; }
+
+private:
+  const std::byte *data_;
+  const std::byte *end_;
+};
+
+} // namespace
+
+auto spawn_handoff_child(const std::vector<std::string> &command,
+                         std::chrono::milliseconds timeout) -> HandoffChild {
+  if (command.empty()) {
+    throw std::runtime_error("No command to start the handoff with");
+  }
+
+  // Built before the fork, the child only making async-signal-safe calls
+  std::vector<char *> argv{};
+  for (const auto &arg : command) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  std::string fd_var = std::string(HANDOFF_FD_ENV) + "=" +
+                       std::to_string(CHILD_FD);
+  std::string prefix = std::string(HANDOFF_FD_ENV) + "=";
+  std::vector<char *> envp{};
+  for (char **var = environ; *var != nullptr; ++var) {
+    if (std::strncmp(*var, prefix.c_str(), prefix.size()) != 0) {
+      envp.push_back(*var);
+    }
+  }
+  envp.push_back(fd_var.data());
+  envp.push_back(nullptr);
+
+  std::array<int, 2> fds{};
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds.data()) < 0) {
+    throw std::runtime_error(error_message("Failed to create the handoff "
+                                           "socket"));
+  }
+  timeval tv{};
+  tv.tv_sec = timeout.count() / 1000;
+  tv.tv_usec = timeout.count() % 1000 * 1000;
+  if (setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+      setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+    std::string message = error_message("Failed to set the handoff timeout");
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error(message);
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    std::string message = error_message("Failed to fork the handoff");
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error(message);
+  }
+  if (pid == 0) {
+    // dup2 clears FD_CLOEXEC, but not on the same descriptor
+    if (fds[1] == CHILD_FD) {
+      fcntl(CHILD_FD, F_SETFD, 0);
+    } else if (dup2(fds[1], CHILD_FD) < 0) {
+      _exit(127);
+    }
+    close_range(CHILD_FD + 1, ~0U, 0);
+    execve(argv[0], argv.data(), envp.data());
+    _exit(127);
+  }
+
+  close(fds[1]);
+  return {pid, fds[0]};
+}
+
+void send_handoff(int sockfd, const HandoffState &state) {
+  std::vector<std::byte> buffer{};
+  // The size is set once the state is written
+  append(buffer, uint64_t{0});
+  for (char c : HANDOFF_MAGIC) {
+    buffer.push_back(static_cast<std::byte>(c));
+  }
+  buffer.push_back(static_cast<std::byte>(HANDOFF_VERSION));
+  append_bytes(buffer, state.registry);
+  append(buffer, static_cast<uint32_t>(state.connections.size()));
+  for (const auto &connection : state.connections) {
+    buffer.push_back(static_cast<std::byte>(connection.id.size()));
+    const auto *id = reinterpret_cast<const std::byte *>(connection.id.data());
+    buffer.insert(buffer.end(), id, id + connection.id.size());
+    buffer.push_back(static_cast<std::byte>(connection.flags));
+    append_bytes(buffer, connection.input);
+    append_bytes(buffer, connection.output);
+  }
+  uint64_t size = hton(static_cast<uint64_t>(buffer.size() - sizeof(size)));
+  std::memcpy(buffer.data(), &size, sizeof(size));
+  send_bytes(sockfd, buffer.data(), buffer.size());
+
+  std::vector<int> fds{state.listen_fd, state.udp_fd};
+  for (const auto &connection : state.connections) {
+    fds.push_back(connection.fd);
+  }
+  std::array<char, CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))> control{};
+  for (size_t first = 0; first < fds.size(); first += FDS_PER_MESSAGE) {
+    size_t count = std::min(FDS_PER_MESSAGE, fds.size() - first);
+    std::byte data{};
+    iovec iov{&data, sizeof(data)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), fds.data() + first, count * sizeof(int));
+    while (sendmsg(sockfd, &msg, MSG_NOSIGNAL) < 0) {
+      if (errno != EINTR) {
+        throw std::runtime_error(error_message("Failed to send the handoff "
+                                               "sockets"));
+      }
+    }
+  }
+}
+
+auto receive_handoff(int sockfd) -> HandoffState {
+  uint64_t size{};
+  receive_bytes(sockfd, reinterpret_cast<std::byte *>(&size), sizeof(size));
+  std::vector<std::byte> buffer(ntoh(size));
+  receive_bytes(sockfd, buffer.data(), buffer.size());
+
+  HandoffState state{};
+  Reader reader(buffer.data(), buffer.size());
+  const std::byte *magic = reader.bytes(HANDOFF_MAGIC.size());
+  if (std::memcmp(magic, HANDOFF_MAGIC.data(), HANDOFF_MAGIC.size()) != 0 ||
+      reader.number<uint8_t>() != HANDOFF_VERSION) {
+    throw std::runtime_error("Invalid handoff: unknown format");
+  }
+  state.registry = reader.sized_bytes();
+  state.connections.resize(reader.number<uint32_t>());
+  for (auto &connection : state.connections) {
+    auto id_size = reader.number<uint8_t>();
+    const auto *id = reinterpret_cast<const char *>(reader.bytes(id_size));
+    connection.id.assign(id, id_size);
+    connection.flags = reader.number<uint8_t>();
+    connection.input = reader.sized_bytes();
+    connection.output = reader.sized_bytes();
+  }
+  if (!reader.at_end()) {
+    throw std::runtime_error("Invalid handoff: trailing bytes");
+  }
+
+  // Received as sent, one group at a time
+  std::vector<int> fds{};
+  size_t expected = 2 + state.connections.size();
+  std::array<char, CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))> control{};
+  while (fds.size() < expected) {
+    std::byte data{};
+    iovec iov{&data, sizeof(data)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t received = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      throw std::runtime_error("Failed to receive the handoff sockets");
+    }
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      size_t offset = fds.size();
+      fds.resize(offset + count);
+      std::memcpy(fds.data() + offset, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+      throw std::runtime_error("Invalid handoff: sockets truncated");
+    }
+  }
+  if (fds.size() != expected) {
+    throw std::runtime_error("Invalid handoff: unexpected sockets");
+  }
+
+  state.listen_fd = fds[0];
+  state.udp_fd = fds[1];
+  for (size_t i = 0; i < state.connections.size(); ++i) {
+    state.connections[i].fd = fds[2 + i];
+  }
+  return state;
+}
+
+void acknowledge_handoff(int sockfd) {
+  std::byte ack{1};
+  try {
+    send_bytes(sockfd, &ack, sizeof(ack));
+  } catch (const std::exception &) {
+    // The previous process gave up, and keeps running
+  }
+  close(sockfd);
+}
+
+auto wait_handoff_ack(int sockfd) -> bool {
+  std::byte ack{};
+  try {
+    receive_bytes(sockfd, &ack, sizeof(ack));
+  } catch (const std::exception &) {
+    return false;
+  }
+  return ack == std::byte{1};
+}
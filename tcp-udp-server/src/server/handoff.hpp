@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// The environment variable naming, in the process taking over, the socket the
+// state of the previous one is received on
+static constexpr const char *HANDOFF_FD_ENV = "SERVER_HANDOFF_FD";
+
+struct HandoffConfig {
+  // The socket the state of the previous process is received on, if the server
+  // takes over from it, -1 otherwise
+  int fd{-1};
+  // The command the server is started again with by the handoff, its
+  // executable and its arguments, the handoff being disabled if it is empty
+  std::vector<std::string> command{};
+};
+
+// A client connection handed to the process taking over
+struct HandedConnection {
+  int fd{-1};
+  // the id of the subscriber, empty if it did not connect yet, and the flags
+  // of its CONNECT request, TCP_CONNECT_*
+  std::string id{};
+  uint8_t flags{};
+  // the bytes received not forming a whole request yet, and those queued not
+  // sent yet
+  std::vector<std::byte> input{};
+  std::vector<std::byte> output{};
+};
+
+// What a process hands to the one taking over from it
+struct HandoffState {
+  int listen_fd{-1};
+  int udp_fd{-1};
+  // the registry, as saved by SubscribersRegistry::save
+  std::vector<std::byte> registry{};
+  std::vector<HandedConnection> connections{};
+};
+
+// The process started to take over, and the socket it is handed the state on
+struct HandoffChild {
+  pid_t pid{-1};
+  int fd{-1};
+};
+
+/**
+ * @brief Start the process taking over, with the command of the server, its
+ * end of the socket being HANDOFF_FD_ENV in its environment
+ *
+ * The process only inherits the standard streams and its socket, the other
+ * file descriptors being closed before the exec.
+ *
+ * @param command The executable and its arguments
+ * @param timeout How long the sends and the receives on the socket may block
+ * @return The process, and the end of the socket of the caller
+ *
+ * @throws std::runtime_error if the socket or the process cannot be created
+ */
+auto spawn_handoff_child(const std::vector<std::string> &command,
+                         std::chrono::milliseconds timeout) -> HandoffChild;
+
+/**
+ * @brief Send the state to the process taking over, the file descriptors being
+ * passed with SCM_RIGHTS, the caller keeping its own
+ *
+ * The state is sent as its size, on 8 bytes, then the magic and the version,
+ * the size of the registry, on 4 bytes, the registry and the number of
+ * connections, on 4 bytes. Each connection is the size of its id, on a byte,
+ * the id, its flags, on a byte, and its input and its output, each preceded by
+ * its size, on 4 bytes. The numbers are in network byte order. The file
+ * descriptors follow, the listening socket, the UDP socket and those of the
+ * connections, in order, by groups carried by a byte each.
+ *
+ * @param sockfd The socket of the handoff
+ * @param state The state
+ *
+ * @throws std::runtime_error if the send fails
+ */
+void send_handoff(int sockfd, const HandoffState &state);
+
+/**
+ * @brief Receive the state sent by send_handoff, the file descriptors being
+ * closed on exec
+ *
+ * @param sockfd The socket of the handoff
+ * @return The state
+ *
+ * @throws std::runtime_error if the receive fails or the state is invalid
+ */
+auto receive_handoff(int sockfd) -> HandoffState;
+
+/**
+ * @brief Tell the previous process that the state was taken over, so that it
+ * stops, and close the socket of the handoff
+ *
+ * @param sockfd The socket of the handoff
+ */
+void acknowledge_handoff(int sockfd);
+
+/**
+ * @brief Wait for the process taking over to acknowledge the state
+ *
+ * @param sockfd The socket of the handoff, whose receives time out
+ * @return true if it was acknowledged, false if the process failed or timed
+ * out
+ */
+auto wait_handoff_ack(int sockfd) -> bool;
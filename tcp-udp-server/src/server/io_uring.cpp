@@ -0,0 +1,209 @@
+#include "io_uring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+auto io_uring_setup(unsigned entries, io_uring_params &params) -> int {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+}
+
+auto io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags, const io_uring_getevents_arg *arg) -> int {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, arg,
+                                  arg != nullptr ? sizeof(*arg) : 0));
+}
+
+auto io_uring_register(int ring_fd, unsigned opcode, void *arg,
+                       unsigned nr_args) -> int {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+auto map(size_t size, int fd, off_t offset) -> void * {
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  if (ptr == MAP_FAILED) {
+    throw std::runtime_error("Failed to map the io_uring queues: " +
+                             std::string(std::strerror(errno)));
+  }
+  return ptr;
+}
+
+} // namespace
+
+IoUring::IoUring(unsigned entries) {
+  io_uring_params params{};
+  ring_fd_ = io_uring_setup(entries, params);
+  if (ring_fd_ < 0) {
+    throw std::runtime_error("Failed to set io_uring up: " +
+                             std::string(std::strerror(errno)));
+  }
+
+  try {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // Both queues may share a single mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = map(sq_ring_size_, ring_fd_, IORING_OFF_SQ_RING);
+    cq_ring_ = params.features & IORING_FEAT_SINGLE_MMAP
+                   ? sq_ring_
+                   : map(cq_ring_size_, ring_fd_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(
+        map(sqes_size_, ring_fd_, IORING_OFF_SQES));
+  } catch (const std::exception &) {
+    release();
+    throw;
+  }
+
+  auto *sq = static_cast<std::byte *>(sq_ring_);
+  auto *cq = static_cast<std::byte *>(cq_ring_);
+  sq_entries_ = params.sq_entries;
+  sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  // Each slot of the queue holds the entry of the same index
+  auto *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i) {
+    array[i] = i;
+  }
+  sqe_tail_ = *sq_tail_;
+}
+
+IoUring::~IoUring() { release(); }
+
+void IoUring::release() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  close(ring_fd_);
+}
+
+auto IoUring::get_sqe() -> io_uring_sqe & {
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) {
+    submit_and_wait(0);
+  }
+
+  auto &sqe = sqes_[sqe_tail_ & *sq_mask_];
+  std::memset(&sqe, 0, sizeof(sqe));
+  ++sqe_tail_;
+  return sqe;
+}
+
+void IoUring::submit_and_wait(unsigned wait_nr,
+                              const __kernel_timespec *timeout) {
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+  io_uring_getevents_arg arg{};
+  arg.ts = reinterpret_cast<uint64_t>(timeout);
+
+  while (true) {
+    unsigned to_submit =
+        sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (timeout != nullptr) {
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (io_uring_enter(ring_fd_, to_submit, wait_nr, flags,
+                       timeout != nullptr ? &arg : nullptr) >= 0) {
+      return;
+    }
+    if (errno == ETIME) {
+      // The timeout expired before the completions
+      return;
+    } else if (errno == EINTR) {
+      // Interrupted by a signal, the entries left are submitted again
+      continue;
+    } else if (errno == EBUSY || errno == EAGAIN) {
+      // The completion queue is full, the caller consumes it before the rest
+      // is submitted
+      return;
+    }
+    throw std::runtime_error("io_uring_enter() failed with error: " +
+                             std::string(std::strerror(errno)));
+  }
+}
+
+IoUringBufferRing::IoUringBufferRing(IoUring &ring, uint16_t group,
+                                     uint16_t entries, size_t buffer_size)
+    : ring_(ring), group_(group), entries_(entries),
+      buffer_size_(buffer_size) {
+  bufs_size_ = entries_ * sizeof(io_uring_buf);
+  void *bufs = mmap(nullptr, bufs_size_, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (bufs == MAP_FAILED) {
+    throw std::runtime_error("Failed to allocate an io_uring buffer ring");
+  }
+  bufs_ = static_cast<io_uring_buf_ring *>(bufs);
+
+  buffers_size_ = entries_ * buffer_size_;
+  void *buffers = mmap(nullptr, buffers_size_, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (buffers == MAP_FAILED) {
+    munmap(bufs_, bufs_size_);
+    throw std::runtime_error("Failed to allocate the io_uring buffers");
+  }
+  buffers_ = static_cast<std::byte *>(buffers);
+
+  io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<uint64_t>(bufs_);
+  reg.ring_entries = entries_;
+  reg.bgid = group_;
+  if (io_uring_register(ring_.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int error = errno;
+    munmap(buffers_, buffers_size_);
+    munmap(bufs_, bufs_size_);
+    throw std::runtime_error("Failed to register an io_uring buffer ring: " +
+                             std::string(std::strerror(error)));
+  }
+
+  for (uint16_t id = 0; id < entries_; ++id) {
+    recycle(id);
+  }
+}
+
+IoUringBufferRing::~IoUringBufferRing() {
+  io_uring_buf_reg reg{};
+  reg.bgid = group_;
+  io_uring_register(ring_.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(buffers_, buffers_size_);
+  munmap(bufs_, bufs_size_);
+}
+
+void IoUringBufferRing::recycle(uint16_t id) {
+  // The tail shares its place with the reserved field of the first entry. The
+  // entries start with the ring, bufs being shifted by the empty struct that
+  // declares it in C++.
+  auto *entries = reinterpret_cast<io_uring_buf *>(bufs_);
+  auto &buf = entries[tail_ & (entries_ - 1)];
+  buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+  buf.len = static_cast<uint32_t>(buffer_size_);
+  buf.bid = id;
+  ++tail_;
+  __atomic_store_n(&bufs_->tail, tail_, __ATOMIC_RELEASE);
+}
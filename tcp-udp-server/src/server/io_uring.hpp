@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+/**
+ * @brief Minimal io_uring instance, over the system calls of the kernel
+ *
+ * The submission queue entries are only handed to the kernel by submit, or
+ * when the queue is full. The completions are consumed by for_each_cqe.
+ */
+class IoUring {
+public:
+  /**
+   * @brief Create the io_uring instance
+   *
+   * @param entries The size of the submission queue
+   *
+   * @throws std::runtime_error if io_uring is not supported
+   */
+  explicit IoUring(unsigned entries);
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  auto operator=(const IoUring &) -> IoUring & = delete;
+
+  int fd() const { return ring_fd_; }
+
+  /**
+   * @brief Get a cleared submission queue entry, submitting the entries
+   * already filled if the queue is full
+   *
+   * @return The entry
+   *
+   * @throws std::runtime_error if the submission fails
+   */
+  auto get_sqe() -> io_uring_sqe &;
+
+  /**
+   * @brief Submit the filled entries and wait for completions
+   *
+   * @param wait_nr The number of completions to wait for
+   * @param timeout How long to wait at most, or nullptr to wait until they
+   * complete
+   *
+   * @throws std::runtime_error if the submission fails
+   */
+  void submit_and_wait(unsigned wait_nr,
+                       const __kernel_timespec *timeout = nullptr);
+
+  /**
+   * @brief Call a function with the available completions, consuming them
+   *
+   * @param visit The function called with each completion
+   */
+  template <typename Visitor> void for_each_cqe(Visitor &&visit) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      visit(static_cast<const io_uring_cqe &>(cqes_[head & *cq_mask_]));
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+private:
+  // Unmap the queues and close the instance
+  void release();
+
+  int ring_fd_{-1};
+  unsigned sq_entries_{};
+
+  void *sq_ring_{};
+  size_t sq_ring_size_{};
+  void *cq_ring_{};
+  size_t cq_ring_size_{};
+  io_uring_sqe *sqes_{};
+  size_t sqes_size_{};
+
+  unsigned *sq_head_{};
+  unsigned *sq_tail_{};
+  unsigned *sq_mask_{};
+  unsigned *cq_head_{};
+  unsigned *cq_tail_{};
+  unsigned *cq_mask_{};
+  io_uring_cqe *cqes_{};
+
+  // the tail of the entries filled, published to the kernel by submit
+  unsigned sqe_tail_{};
+};
+
+/**
+ * @brief Buffers provided to an io_uring instance, from which the kernel picks
+ * one for each completion of a request with IOSQE_BUFFER_SELECT
+ */
+class IoUringBufferRing {
+public:
+  /**
+   * @brief Register the buffers, all given to the kernel
+   *
+   * @param ring The io_uring instance, outliving the buffers
+   * @param group The id of the group of buffers, set in the requests
+   * @param entries The number of buffers, a power of 2
+   * @param buffer_size The size of each buffer
+   *
+   * @throws std::runtime_error if the registration fails
+   */
+  IoUringBufferRing(IoUring &ring, uint16_t group, uint16_t entries,
+                    size_t buffer_size);
+  ~IoUringBufferRing();
+
+  IoUringBufferRing(const IoUringBufferRing &) = delete;
+  auto operator=(const IoUringBufferRing &) -> IoUringBufferRing & = delete;
+
+  auto group() const -> uint16_t { return group_; }
+  auto buffer_size() const -> size_t { return buffer_size_; }
+  auto buffer(uint16_t id) const -> std::byte * {
+    return buffers_ + id * buffer_size_;
+  }
+
+  /**
+   * @brief Give a buffer picked by the kernel back to it
+   *
+   * @param id The id of the buffer, from the flags of the completion
+   */
+  void recycle(uint16_t id);
+
+private:
+  IoUring &ring_;
+  uint16_t group_{};
+  uint16_t entries_{};
+  size_t buffer_size_{};
+
+  io_uring_buf_ring *bufs_{};
+  size_t bufs_size_{};
+  std::byte *buffers_{};
+  size_t buffers_size_{};
+  uint16_t tail_{};
+};
@@ -0,0 +1,229 @@
+#include "io_worker.hpp"
+
+#include "async_log.hpp"
+#include "cpu_placement.hpp"
+#include "tcp_utils.hpp"
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+// Number of events handled per epoll_wait
+constexpr size_t MAX_EVENTS = 64;
+
+} // namespace
+
+IoWorker::IoWorker(const OutputQueueConfig &queue_config, BrokerStats *stats,
+                   int cpu)
+    : queue_config_(queue_config), stats_(stats), cpu_(cpu) {
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    throw std::runtime_error("Failed to create the eventfd of an I/O worker");
+  }
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    close(event_fd_);
+    throw std::runtime_error("Failed to create the epoll of an I/O worker");
+  }
+
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = event_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event) < 0) {
+    close(epoll_fd_);
+    close(event_fd_);
+    throw std::runtime_error("Failed to register the eventfd of an I/O worker");
+  }
+
+  thread_ = std::thread(&IoWorker::run, this);
+}
+
+IoWorker::~IoWorker() {
+  stopped_.store(true, std::memory_order_release);
+  wake();
+  thread_.join();
+
+  for (const auto &[sockfd, connection] : connections_) {
+    close(sockfd);
+  }
+  close(epoll_fd_);
+  close(event_fd_);
+}
+
+void IoWorker::add_connection(int sockfd, uint64_t connection) {
+  post(Command{Command::Type::ADD, sockfd, connection, {}});
+}
+
+void IoWorker::remove_connection(int sockfd) {
+  post(Command{Command::Type::REMOVE, sockfd, 0, {}});
+}
+
+void IoWorker::send(std::vector<Send> messages) {
+  post(Command{Command::Type::SEND, -1, 0, std::move(messages)});
+}
+
+void IoWorker::post(Command command) {
+  commands_.push(std::move(command));
+  wake();
+}
+
+void IoWorker::wake() {
+  // The counter only saturates while the worker is busy, which then pops the
+  // command anyway
+  uint64_t one = 1;
+  if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log_error("Failed to wake an I/O worker up: ", std::strerror(errno));
+  }
+}
+
+void IoWorker::run() {
+  if (cpu_ >= 0 && !pin_current_thread(cpu_)) {
+    log_error("Failed to pin an I/O worker to CPU ", cpu_, ": ",
+              std::strerror(errno));
+  }
+  std::array<epoll_event, MAX_EVENTS> events{};
+
+  while (true) {
+    int ready = epoll_wait(epoll_fd_, events.data(),
+                           static_cast<int>(events.size()), -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Error in the epoll_wait of an I/O worker: ",
+                std::strerror(errno));
+      return;
+    }
+
+    for (int i = 0; i < ready; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == event_fd_) {
+        uint64_t count{};
+        if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+          log_error("Failed to read the eventfd of an I/O worker: ",
+                    std::strerror(errno));
+        }
+        continue;
+      }
+
+      // The socket is writable again
+      auto it = connections_.find(fd);
+      if (it != connections_.end() && !it->second.failed) {
+        flush(fd, it->second);
+      }
+    }
+
+    // The commands posted before the stop are all popped below
+    bool stopped = stopped_.load(std::memory_order_acquire);
+    while (auto command = commands_.pop()) {
+      handle_command(command.value());
+    }
+
+    for (int sockfd : pending_flushes_) {
+      auto it = connections_.find(sockfd);
+      if (it != connections_.end() && !it->second.failed) {
+        flush(sockfd, it->second);
+      }
+    }
+    pending_flushes_.clear();
+
+    if (stopped) {
+      return;
+    }
+  }
+}
+
+void IoWorker::handle_command(Command &command) {
+  switch (command.type) {
+  case Command::Type::ADD: {
+    auto [it, inserted] = connections_.insert_or_assign(
+        command.sockfd,
+        Connection{command.connection, OutputQueue(queue_config_), false});
+
+    epoll_event event{};
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.fd = command.sockfd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, command.sockfd, &event) < 0) {
+      log_error("Failed to register a subscriber with an I/O worker: ",
+                std::strerror(errno));
+      fail(command.sockfd, it->second);
+    }
+    break;
+  }
+  case Command::Type::REMOVE: {
+    auto it = connections_.find(command.sockfd);
+    if (it == connections_.end()) {
+      break;
+    }
+    // Closing the socket also removes it from the epoll instance
+    close(command.sockfd);
+    connections_.erase(it);
+    break;
+  }
+  case Command::Type::SEND:
+    for (auto &send : command.messages) {
+      queue_message(send);
+    }
+    break;
+  }
+}
+
+void IoWorker::queue_message(Send &send) {
+  auto it = connections_.find(send.sockfd);
+  if (it == connections_.end() || it->second.id != send.connection ||
+      it->second.failed) {
+    return;
+  }
+  auto &connection = it->second;
+
+  bool was_empty = connection.output_queue.empty();
+  auto result = connection.output_queue.push(std::move(send.message));
+  if (stats_) {
+    if (result == OutputQueue::PushResult::QUEUED) {
+      ++stats_->queued;
+      stats_->queue_bytes.record(connection.output_queue.size());
+    } else {
+      ++stats_->dropped;
+    }
+  }
+
+  switch (result) {
+  case OutputQueue::PushResult::QUEUED:
+    break;
+  case OutputQueue::PushResult::DROPPED:
+    return;
+  case OutputQueue::PushResult::OVERFLOWED:
+    log_error("Client on socket ", send.sockfd,
+              " is too slow, disconnecting it");
+    fail(send.sockfd, connection);
+    return;
+  }
+
+  // Otherwise, the queue is flushed once the socket is writable
+  if (was_empty) {
+    pending_flushes_.push_back(send.sockfd);
+  }
+}
+
+void IoWorker::flush(int sockfd, Connection &connection) {
+  try {
+    connection.output_queue.flush(sockfd);
+  } catch (const TcpSocketException &e) {
+    log_error("Error sending TCP message: ", e.what());
+    fail(sockfd, connection);
+  }
+}
+
+void IoWorker::fail(int sockfd, Connection &connection) {
+  connection.failed = true;
+  connection.output_queue.clear();
+  // The server sees the socket closed, and removes it
+  shutdown(sockfd, SHUT_RDWR);
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "broker_stats.hpp"
+#include "mpsc_queue.hpp"
+#include "output_queue.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Thread sending the messages to a shard of the subscribers, in the
+ * multi-threaded mode of the server
+ *
+ * The worker owns the output queues of its subscribers, and gets its commands
+ * from the other threads through a lock-free queue, waking up on an eventfd.
+ * A subscriber goes to the worker of IoWorker::shard, or to the one its
+ * connection is steered to, and stays there, so the commands about a socket
+ * are handled in order.
+ *
+ * The connections and their output queues are created by the thread of the
+ * worker, so that, once it is pinned to a CPU, their memory is allocated on
+ * the NUMA node of the CPU.
+ *
+ * The worker does not tell the server about its failures: it shuts the socket
+ * of the subscriber down instead, the server then seeing it closed.
+ */
+class IoWorker {
+public:
+  // A message to queue for a subscriber
+  struct Send {
+    int sockfd{-1};
+    // the connection meant, the message being dropped for a later one
+    uint64_t connection{};
+    std::shared_ptr<const OutgoingMessage> message{};
+  };
+
+  /**
+   * @brief Start a worker
+   *
+   * @param queue_config The limits of the output queues
+   * @param stats The statistics of the server, the messages queued and
+   * dropped being counted into them, none if they are not collected
+   * @param cpu The CPU the thread is pinned to, -1 to leave it to the
+   * scheduler
+   *
+   * @throws std::runtime_error if the eventfd or epoll instance cannot be
+   * created
+   */
+  IoWorker(const OutputQueueConfig &queue_config, BrokerStats *stats,
+           int cpu = -1);
+
+  /**
+   * @brief Stop the worker, once the commands already posted are handled,
+   * closing the sockets left
+   */
+  ~IoWorker();
+
+  IoWorker(const IoWorker &) = delete;
+  auto operator=(const IoWorker &) -> IoWorker & = delete;
+
+  /**
+   * @brief Get the worker of a subscriber
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @param workers The number of workers
+   * @return The index of the worker
+   */
+  static auto shard(int sockfd, size_t workers) -> size_t {
+    return static_cast<size_t>(sockfd) % workers;
+  }
+
+  /**
+   * @brief Hand a connected socket over to the worker
+   *
+   * @param sockfd The socket file descriptor, of this shard
+   * @param connection The id of the connection
+   */
+  void add_connection(int sockfd, uint64_t connection);
+
+  /**
+   * @brief Drop the messages of a socket and close it
+   *
+   * @param sockfd The socket file descriptor, added before
+   */
+  void remove_connection(int sockfd);
+
+  /**
+   * @brief Queue messages for subscribers of this shard, and send them
+   *
+   * @param messages The messages, in the order they are sent
+   */
+  void send(std::vector<Send> messages);
+
+private:
+  struct Command {
+    enum class Type : uint8_t { ADD, REMOVE, SEND };
+
+    Type type{};
+    int sockfd{-1};
+    uint64_t connection{};
+    std::vector<Send> messages{};
+  };
+
+  struct Connection {
+    uint64_t id{};
+    OutputQueue output_queue;
+    // shut down, the messages being dropped until it is removed
+    bool failed{};
+  };
+
+  void post(Command command);
+  void wake();
+  void run();
+  void handle_command(Command &command);
+  void queue_message(Send &send);
+  void flush(int sockfd, Connection &connection);
+  void fail(int sockfd, Connection &connection);
+
+  OutputQueueConfig queue_config_{};
+  BrokerStats *stats_{};
+  int cpu_{-1};
+  int event_fd_{-1};
+  int epoll_fd_{-1};
+  std::atomic<bool> stopped_{};
+  MpscQueue<Command> commands_{};
+
+  // owned by the thread of the worker
+  std::unordered_map<int, Connection> connections_{};
+  // the sockets whose queue got messages from the commands, flushed after them
+  std::vector<int> pending_flushes_{};
+
+  std::thread thread_{};
+};
@@ -1,10 +1,171 @@
+#include "async_log.hpp"
+#include "multicast_proto.hpp"
 #include "server.hpp"
+#include <arpa/inet.h>
 #include <charconv>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <string_view>
+#include <utility>
+
+using namespace std::literals;
+
+namespace {
+
+// Read a size from an environment variable, if it is set
+bool read_env_size(const char *name, size_t &value) {
+  const char *str = std::getenv(name);
+  if (str == nullptr) {
+    return true;
+  }
+
+  auto [ptr, ec] = std::from_chars(str, str + strlen(str), value);
+  if (ec != std::errc{} || *ptr != '\0') {
+    std::cerr << "Invalid " << name << ": " << str << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Read the limits of the output queues from the environment:
+// SERVER_QUEUE_HIGH_WATERMARK and SERVER_QUEUE_LOW_WATERMARK, in bytes,
+// SERVER_SLOW_CONSUMER_POLICY, one of drop, conflate or disconnect, and the
+// coalescing window
+bool read_queue_config(OutputQueueConfig &config) {
+  if (!read_env_size("SERVER_QUEUE_HIGH_WATERMARK", config.high_watermark) ||
+      !read_env_size("SERVER_QUEUE_LOW_WATERMARK", config.low_watermark)) {
+    return false;
+  }
+  if (config.low_watermark > config.high_watermark) {
+    std::cerr << "The low watermark of the output queues is above the high one"
+              << std::endl;
+    return false;
+  }
+
+  // SERVER_COALESCE_WINDOW_US and SERVER_COALESCE_BYTES, the window in which
+  // the deliveries to a subscriber are written together
+  size_t window = 0;
+  if (!read_env_size("SERVER_COALESCE_WINDOW_US", window) ||
+      !read_env_size("SERVER_COALESCE_BYTES", config.coalesce_bytes)) {
+    return false;
+  }
+  config.coalesce_window = std::chrono::microseconds(window);
+
+  // SERVER_ZEROCOPY_BYTES, the size of a send from which the messages are not
+  // copied by the kernel
+  if (!read_env_size("SERVER_ZEROCOPY_BYTES", config.zerocopy_bytes)) {
+    return false;
+  }
+
+  // SERVER_COMPRESSION_THRESHOLD, the size of a batch from which it is
+  // compressed for the subscribers asking for it, 0 to never compress
+  if (!read_env_size("SERVER_COMPRESSION_THRESHOLD",
+                     config.compression_threshold)) {
+    return false;
+  }
+
+  // SERVER_WRITE_QUANTUM, the bytes a subscriber may be sent per round of the
+  // event loop, unlimited by default
+  if (!read_env_size("SERVER_WRITE_QUANTUM", config.write_quantum)) {
+    return false;
+  }
+
+  // SERVER_SNDBUF and SERVER_NOTSENT_LOWAT, the send buffer of the subscriber
+  // sockets and the bytes they leave unsent, in bytes, those of the kernel
+  // by default
+  if (!read_env_size("SERVER_SNDBUF", config.send_buffer) ||
+      !read_env_size("SERVER_NOTSENT_LOWAT", config.notsent_lowat)) {
+    return false;
+  }
+  if (config.send_buffer > INT_MAX / 2 || config.notsent_lowat > INT_MAX) {
+    std::cerr << "The send buffer of the subscribers is too large"
+              << std::endl;
+    return false;
+  }
+
+  const char *policy = std::getenv("SERVER_SLOW_CONSUMER_POLICY");
+  if (policy == nullptr) {
+    return true;
+  }
+  if (policy == "drop"sv) {
+    config.policy = SlowConsumerPolicy::DROP;
+  } else if (policy == "conflate"sv) {
+    config.policy = SlowConsumerPolicy::CONFLATE;
+  } else if (policy == "disconnect"sv) {
+    config.policy = SlowConsumerPolicy::DISCONNECT;
+  } else {
+    std::cerr << "Invalid SERVER_SLOW_CONSUMER_POLICY: " << policy << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Read the multicast group from the environment: SERVER_MULTICAST_GROUP, as
+// <address>:<port>, none by default, SERVER_MULTICAST_IF, the address of the
+// interface it is sent on, SERVER_MULTICAST_THRESHOLD, the number of
+// subscribers of a topic which joined it from which its messages are sent to
+// it, and SERVER_MULTICAST_HISTORY, the number of messages kept to be
+// retransmitted
+bool read_multicast_config(MulticastConfig &config) {
+  if (const char *group = std::getenv("SERVER_MULTICAST_GROUP");
+      group != nullptr && !parse_endpoint(group, config.group)) {
+    std::cerr << "Invalid SERVER_MULTICAST_GROUP: " << group << std::endl;
+    return false;
+  }
+  if (const char *interface = std::getenv("SERVER_MULTICAST_IF");
+      interface != nullptr &&
+      inet_pton(AF_INET, interface, &config.interface) != 1) {
+    std::cerr << "Invalid SERVER_MULTICAST_IF: " << interface << std::endl;
+    return false;
+  }
+  return read_env_size("SERVER_MULTICAST_THRESHOLD", config.threshold) &&
+         read_env_size("SERVER_MULTICAST_HISTORY", config.history);
+}
+
+// Read the federation from the environment: SERVER_FEDERATION_PEERS, the
+// brokers peered with, as <address>:<port> separated by ',', none by default,
+// SERVER_FEDERATION_ID, the id the broker connects to them with, and
+// SERVER_FEDERATION_RETRY_MS, how long a failed link waits before connecting
+// again
+bool read_federation_config(FederationConfig &config) {
+  const char *peers = std::getenv("SERVER_FEDERATION_PEERS");
+  if (peers == nullptr || *peers == '\0') {
+    return true;
+  }
+  for (std::string_view rest = peers; !rest.empty();) {
+    size_t comma = rest.find(',');
+    std::string_view peer = rest.substr(0, comma);
+    rest = comma == std::string_view::npos ? ""sv : rest.substr(comma + 1);
+    if (!parse_endpoint(peer, config.peers.emplace_back())) {
+      std::cerr << "Invalid SERVER_FEDERATION_PEERS: " << peers << std::endl;
+      return false;
+    }
+  }
+
+  const char *id = std::getenv("SERVER_FEDERATION_ID");
+  if (id == nullptr || *id == '\0' || strlen(id) > TCP_CLIENT_ID_MAX_SIZE) {
+    std::cerr << "Invalid SERVER_FEDERATION_ID: " << (id ? id : "") << std::endl;
+    return false;
+  }
+  config.id = id;
+
+  size_t retry = config.retry_interval.count();
+  if (!read_env_size("SERVER_FEDERATION_RETRY_MS", retry)) {
+    return false;
+  }
+  config.retry_interval = std::chrono::milliseconds(retry);
+  return true;
+}
+
+} // namespace
 
 int main(int argc, char *argv[]) {
+  AsyncLogConfig log_config{};
 #ifndef ENABLE_ERROR_MESSAGES
   std::cerr.setstate(std::ios::badbit);
+  log_config.errors = false;
 #endif
 
   if (argc != 2) {
@@ -20,8 +181,283 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  OutputQueueConfig queue_config{};
+  if (!read_queue_config(queue_config)) {
+    return 1;
+  }
+
+  // SERVER_THREADS, the number of UDP ingest threads and of I/O worker
+  // threads, the server running on a single thread by default
+  size_t threads = 1;
+  if (!read_env_size("SERVER_THREADS", threads)) {
+    return 1;
+  }
+  if (threads == 0) {
+    std::cerr << "Invalid SERVER_THREADS: 0" << std::endl;
+    return 1;
+  }
+
+  // SERVER_IO_BACKEND, epoll by default or io_uring, which runs on a single
+  // thread
+  IoBackend backend = IoBackend::EPOLL;
+  if (const char *name = std::getenv("SERVER_IO_BACKEND"); name != nullptr) {
+    if (name == "epoll"sv) {
+      backend = IoBackend::EPOLL;
+    } else if (name == "io_uring"sv) {
+      backend = IoBackend::IO_URING;
+    } else {
+      std::cerr << "Invalid SERVER_IO_BACKEND: " << name << std::endl;
+      return 1;
+    }
+  }
+
+  // SERVER_STORE_DIR, the directory where the messages of the offline
+  // subscribers are stored until they connect again, and
+  // SERVER_STORE_SEGMENT_SIZE, the size of its segment files in bytes
+  MessageStoreConfig store_config{};
+  if (const char *directory = std::getenv("SERVER_STORE_DIR");
+      directory != nullptr) {
+    store_config.directory = directory;
+  }
+  if (!read_env_size("SERVER_STORE_SEGMENT_SIZE", store_config.segment_size)) {
+    return 1;
+  }
+
+  // SERVER_STATS=1, to collect the statistics printed by the stats command,
+  // SERVER_STATS_FILE, the file they are also appended to every
+  // SERVER_STATS_INTERVAL_MS milliseconds, and SERVER_METRICS_SOCKET, the Unix
+  // socket they are served on in the Prometheus text format, both of which
+  // enable them as well
+  BrokerStatsConfig stats_config{};
+  if (const char *enabled = std::getenv("SERVER_STATS"); enabled != nullptr) {
+    stats_config.enabled = enabled != "0"sv && enabled != ""sv;
+  }
+  if (const char *file = std::getenv("SERVER_STATS_FILE"); file != nullptr) {
+    stats_config.file = file;
+    stats_config.enabled = stats_config.enabled || !stats_config.file.empty();
+  }
+  if (const char *path = std::getenv("SERVER_METRICS_SOCKET");
+      path != nullptr) {
+    stats_config.metrics_socket = path;
+    stats_config.enabled =
+        stats_config.enabled || !stats_config.metrics_socket.empty();
+  }
+  size_t interval = stats_config.interval.count();
+  if (!read_env_size("SERVER_STATS_INTERVAL_MS", interval)) {
+    return 1;
+  }
+  stats_config.interval = std::chrono::milliseconds(interval);
+  // SERVER_STATS_TOP_TOPICS, the number of the most published topics kept
+  // track of, with their deliveries, 0 to disable it
+  if (!read_env_size("SERVER_STATS_TOP_TOPICS", stats_config.top_topics)) {
+    return 1;
+  }
+
+  // SERVER_HEARTBEAT_INTERVAL_MS, the silence after which a subscriber is sent
+  // a heartbeat, and SERVER_IDLE_TIMEOUT_MS, the one after which a client is
+  // disconnected, both disabled by default
+  KeepaliveConfig keepalive_config{};
+  size_t heartbeat_interval = 0;
+  size_t idle_timeout = 0;
+  if (!read_env_size("SERVER_HEARTBEAT_INTERVAL_MS", heartbeat_interval) ||
+      !read_env_size("SERVER_IDLE_TIMEOUT_MS", idle_timeout)) {
+    return 1;
+  }
+  keepalive_config.heartbeat_interval =
+      std::chrono::milliseconds(heartbeat_interval);
+  keepalive_config.idle_timeout = std::chrono::milliseconds(idle_timeout);
+
+  // SERVER_LISTEN_BACKLOG, the backlog of the listening socket, SOMAXCONN by
+  // default, and SERVER_ACCEPT_THREAD=1, to accept the connections on a
+  // dedicated thread
+  AcceptConfig accept_config{};
+  size_t backlog = static_cast<size_t>(accept_config.backlog);
+  if (!read_env_size("SERVER_LISTEN_BACKLOG", backlog)) {
+    return 1;
+  }
+  if (backlog > static_cast<size_t>(INT_MAX)) {
+    std::cerr << "Invalid SERVER_LISTEN_BACKLOG: " << backlog << std::endl;
+    return 1;
+  }
+  accept_config.backlog = static_cast<int>(backlog);
+  if (const char *enabled = std::getenv("SERVER_ACCEPT_THREAD");
+      enabled != nullptr) {
+    accept_config.thread = enabled != "0"sv && enabled != ""sv;
+  }
+
+  MulticastConfig multicast_config{};
+  if (!read_multicast_config(multicast_config)) {
+    return 1;
+  }
+
+  // SERVER_PRIORITY_CLASSES, the patterns of the topics of each priority
+  // class, from the highest, the classes separated by ';' and the patterns by
+  // ',', none by default
+  PriorityClasses priorities{};
+  if (const char *classes = std::getenv("SERVER_PRIORITY_CLASSES");
+      classes != nullptr && !PriorityClasses::parse(classes, priorities)) {
+    std::cerr << "Invalid SERVER_PRIORITY_CLASSES: " << classes << std::endl;
+    return 1;
+  }
+
+  FederationConfig federation_config{};
+  if (!read_federation_config(federation_config)) {
+    return 1;
+  }
+
+  // SERVER_REGISTRY_FILE, the file the subscribers and their subscriptions
+  // are saved to every SERVER_REGISTRY_INTERVAL_MS milliseconds, if they
+  // changed, and loaded from at startup, none by default
+  RegistryCheckpointConfig checkpoint_config{};
+  if (const char *file = std::getenv("SERVER_REGISTRY_FILE"); file != nullptr) {
+    checkpoint_config.file = file;
+  }
+  size_t checkpoint_interval = checkpoint_config.interval.count();
+  if (!read_env_size("SERVER_REGISTRY_INTERVAL_MS", checkpoint_interval)) {
+    return 1;
+  }
+  checkpoint_config.interval = std::chrono::milliseconds(checkpoint_interval);
+
+  // SERVER_UDP_RCVBUF, the size of the receive buffer of the UDP sockets, in
+  // bytes, that of the kernel by default
+  UdpReceiveConfig udp_config{};
+  if (!read_env_size("SERVER_UDP_RCVBUF", udp_config.receive_buffer)) {
+    return 1;
+  }
+  // SERVER_UDP_GRO=1 lets the kernel coalesce the datagrams of a publisher,
+  // split back by the server, with the epoll backend only
+  if (const char *enabled = std::getenv("SERVER_UDP_GRO"); enabled != nullptr) {
+    udp_config.gro = enabled != "0"sv && enabled != ""sv;
+  }
+  if (udp_config.gro && backend == IoBackend::IO_URING) {
+    std::cerr << "SERVER_UDP_GRO is not supported by io_uring" << std::endl;
+    return 1;
+  }
+
+  // SERVER_RETAIN=1 keeps the last message of each topic, of at most
+  // SERVER_RETAIN_MAX_TOPICS topics, sent to the new subscriptions matching it
+  RetainedStoreConfig retained_config{};
+  if (const char *enabled = std::getenv("SERVER_RETAIN"); enabled != nullptr) {
+    retained_config.enabled = enabled != "0"sv && enabled != ""sv;
+  }
+  if (!read_env_size("SERVER_RETAIN_MAX_TOPICS", retained_config.max_topics)) {
+    return 1;
+  }
+
+  // SERVER_PUBLISHER_RATE, the UDP packets processed per second from each
+  // publisher, and SERVER_GLOBAL_RATE, from all of them, with bursts of
+  // SERVER_PUBLISHER_BURST and SERVER_GLOBAL_BURST packets, for at most
+  // SERVER_MAX_PUBLISHERS publishers, unlimited by default
+  AdmissionConfig admission_config{};
+  if (!read_env_size("SERVER_PUBLISHER_RATE", admission_config.publisher_rate) ||
+      !read_env_size("SERVER_PUBLISHER_BURST",
+                     admission_config.publisher_burst) ||
+      !read_env_size("SERVER_GLOBAL_RATE", admission_config.global_rate) ||
+      !read_env_size("SERVER_GLOBAL_BURST", admission_config.global_burst) ||
+      !read_env_size("SERVER_MAX_PUBLISHERS",
+                     admission_config.max_publishers)) {
+    return 1;
+  }
+
+  // The handoff command starts the server again as it was started, the new
+  // process finding the socket of the handoff in SERVER_HANDOFF_FD
+  HandoffConfig handoff_config{};
+  handoff_config.command.assign(argv, argv + argc);
+  if (std::getenv(HANDOFF_FD_ENV) != nullptr) {
+    size_t fd = 0;
+    if (!read_env_size(HANDOFF_FD_ENV, fd)) {
+      return 1;
+    }
+    if (fd > static_cast<size_t>(INT_MAX)) {
+      std::cerr << "Invalid " << HANDOFF_FD_ENV << ": " << fd << std::endl;
+      return 1;
+    }
+    handoff_config.fd = static_cast<int>(fd);
+  }
+
+  // SERVER_MAX_SUBSCRIPTION_BYTES, the memory the subscriptions of each
+  // subscriber may hold, and SERVER_QUEUE_BUDGET, the bytes queued for all the
+  // subscribers together, unlimited by default
+  QuotaConfig quota_config{};
+  if (!read_env_size("SERVER_MAX_SUBSCRIPTION_BYTES",
+                     quota_config.subscription_bytes) ||
+      !read_env_size("SERVER_QUEUE_BUDGET", quota_config.queued_bytes)) {
+    return 1;
+  }
+
+  // SERVER_INGEST_CPUS and SERVER_WORKER_CPUS, the CPUs the UDP ingest
+  // threads and the I/O workers are pinned to, such as 0-3,8,
+  // SERVER_STEER_CONNECTIONS=1, to hand the subscribers to the worker of the
+  // CPU their connection is received on, and SERVER_STEER_TOPICS=1, to send
+  // the UDP packets of a topic to the same ingest thread
+  PlacementConfig placement_config{};
+  for (auto [name, cpus] : {std::pair{"SERVER_INGEST_CPUS",
+                                      &placement_config.ingest_cpus},
+                            std::pair{"SERVER_WORKER_CPUS",
+                                      &placement_config.worker_cpus}}) {
+    const char *list = std::getenv(name);
+    if (list != nullptr && !parse_cpu_list(list, *cpus)) {
+      std::cerr << "Invalid " << name << ": " << list << std::endl;
+      return 1;
+    }
+  }
+  if (const char *enabled = std::getenv("SERVER_STEER_CONNECTIONS");
+      enabled != nullptr) {
+    placement_config.steer_connections = enabled != "0"sv && enabled != ""sv;
+  }
+  if (const char *enabled = std::getenv("SERVER_STEER_TOPICS");
+      enabled != nullptr) {
+    placement_config.steer_topics = enabled != "0"sv && enabled != ""sv;
+  }
+
+  // SERVER_CAPTURE_FILE, the file the UDP datagrams and the requests of the
+  // subscribers are recorded to, for the replay tool, none by default
+  CaptureConfig capture_config{};
+  if (const char *file = std::getenv("SERVER_CAPTURE_FILE"); file != nullptr) {
+    capture_config.file = file;
+  }
+
+  // SERVER_MATCH_SHARDS, the shards of the wildcard subscriptions walked in
+  // parallel for a topic missing the cache of the registry, 1 by default
+  MatchConfig match_config{};
+  if (!read_env_size("SERVER_MATCH_SHARDS", match_config.shards)) {
+    return 1;
+  }
+  if (match_config.shards == 0 || match_config.shards > MatchPool::MAX_TASKS) {
+    std::cerr << "Invalid SERVER_MATCH_SHARDS: " << match_config.shards
+              << std::endl;
+    return 1;
+  }
+
+  // SERVER_LOG_CAPACITY, the lines of the log waiting to be written, and
+  // SERVER_LOG_RATE, the lines of a same message written per second, 0 for
+  // no limit
+  if (!read_env_size("SERVER_LOG_CAPACITY", log_config.capacity) ||
+      !read_env_size("SERVER_LOG_RATE", log_config.message_rate)) {
+    return 1;
+  }
+  if (log_config.capacity == 0 || log_config.capacity > (1 << 20)) {
+    std::cerr << "Invalid SERVER_LOG_CAPACITY: " << log_config.capacity
+              << std::endl;
+    return 1;
+  }
+
+  // The lines logged by the server are written by the thread of the log,
+  // which writes those left when the process exits
+  try {
+    AsyncLog::instance().start(log_config);
+  } catch (const std::exception &e) {
+    std::cerr << "Exception occurred: " << e.what() << std::endl;
+    return 1;
+  }
+
   try {
-    Server server(server_port);
+    Server server(server_port, queue_config, threads, backend, store_config,
+                  stats_config, keepalive_config, accept_config,
+                  multicast_config, priorities, federation_config,
+                  checkpoint_config, udp_config, retained_config,
+                  admission_config, handoff_config, quota_config,
+                  placement_config, capture_config, match_config);
     server.run();
   } catch (const std::exception &e) {
     std::cerr << "Exception occurred: " << e.what() << std::endl;
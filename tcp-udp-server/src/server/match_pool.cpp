@@ -0,0 +1,84 @@
+#include "match_pool.hpp"
+
+namespace {
+
+// The bits of the counter holding the next task, the others holding the
+// generation
+constexpr uint64_t TASK_BITS = 8;
+constexpr uint64_t TASK_MASK = (uint64_t{1} << TASK_BITS) - 1;
+
+} // namespace
+
+MatchPool::MatchPool(size_t threads) {
+  threads_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&MatchPool::work, this);
+  }
+}
+
+MatchPool::~MatchPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void MatchPool::run(size_t tasks, Call call, void *task) {
+  uint64_t generation{};
+  {
+    std::lock_guard lock(mutex_);
+    generation = ++generation_;
+    tasks_ = tasks;
+    call_ = call;
+    task_ = task;
+    pending_.store(tasks, std::memory_order_relaxed);
+    next_.store(generation << TASK_BITS, std::memory_order_release);
+  }
+  wake_.notify_all();
+
+  claim_tasks(generation, tasks, call, task);
+  // The tasks claimed by the other threads are short, they are waited for
+  // without sleeping
+  while (pending_.load(std::memory_order_acquire) != 0) {
+    std::this_thread::yield();
+  }
+}
+
+void MatchPool::claim_tasks(uint64_t generation, size_t tasks, Call call,
+                            void *task) {
+  uint64_t next = next_.load(std::memory_order_acquire);
+  while ((next >> TASK_BITS) == generation && (next & TASK_MASK) < tasks) {
+    if (next_.compare_exchange_weak(next, next + 1,
+                                    std::memory_order_acq_rel)) {
+      call(task, next & TASK_MASK);
+      pending_.fetch_sub(1, std::memory_order_release);
+      next = next_.load(std::memory_order_acquire);
+    }
+  }
+}
+
+void MatchPool::work() {
+  uint64_t seen = 0;
+  while (true) {
+    uint64_t generation{};
+    size_t tasks{};
+    Call call{};
+    void *task{};
+    {
+      std::unique_lock lock(mutex_);
+      wake_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+      if (stopping_) {
+        return;
+      }
+      seen = generation = generation_;
+      tasks = tasks_;
+      call = call_;
+      task = task_;
+    }
+    claim_tasks(generation, tasks, call, task);
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Threads running the tasks of a call together with the calling
+ * thread, such as the walks of the shards of the subscriptions matching a
+ * topic
+ *
+ * The tasks are claimed one at a time from a counter, the calling thread
+ * claiming them as well, so that the call never waits for a thread woken up
+ * late: the tasks left are run by the threads already running. The counter
+ * holds the generation of the call with the next task, so that a thread woken
+ * up once the call returned claims nothing of the next one with the tasks of
+ * the previous one. Running the tasks allocates nothing.
+ */
+class MatchPool {
+public:
+  // The tasks of a call, at most
+  static constexpr size_t MAX_TASKS = 64;
+
+  /**
+   * @brief Start the threads
+   *
+   * @param threads The threads besides the calling one
+   */
+  explicit MatchPool(size_t threads);
+
+  /**
+   * @brief Stop the threads
+   */
+  ~MatchPool();
+
+  MatchPool(const MatchPool &) = delete;
+  auto operator=(const MatchPool &) -> MatchPool & = delete;
+
+  /**
+   * @brief Run tasks on the threads and the calling thread, returning once
+   * they all ran
+   *
+   * @param tasks The number of tasks, at most MAX_TASKS
+   * @param task The function called with the index of each task, from any of
+   * the threads
+   */
+  template <typename Task> void run(size_t tasks, Task &task) {
+    run(tasks, &call<Task>, &task);
+  }
+
+private:
+  using Call = void (*)(void *task, size_t index);
+
+  template <typename Task> static void call(void *task, size_t index) {
+    (*static_cast<Task *>(task))(index);
+  }
+
+  void run(size_t tasks, Call call, void *task);
+  // Run the tasks of a generation left to claim
+  void claim_tasks(uint64_t generation, size_t tasks, Call call, void *task);
+  void work();
+
+  std::mutex mutex_{};
+  std::condition_variable wake_{};
+  // the call being run, guarded by the mutex
+  uint64_t generation_{};
+  size_t tasks_{};
+  Call call_{};
+  void *task_{};
+  bool stopping_{};
+
+  // the generation of the call, shifted by TASK_BITS, and its next task
+  std::atomic<uint64_t> next_{0};
+  // the tasks of the call not run yet
+  std::atomic<size_t> pending_{0};
+  std::vector<std::thread> threads_{};
+};
@@ -0,0 +1,226 @@
+#include "message_store.hpp"
+
+#include "tcp_proto.hpp"
+#include "tcp_utils.hpp"
+#include "util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::string_view SEGMENT_PREFIX = "segment-";
+constexpr std::string_view SEGMENT_SUFFIX = ".log";
+
+// Size of the header of a frame, its type and its size
+constexpr size_t FRAME_HEADER_SIZE = sizeof(TcpMessageType) + sizeof(uint16_t);
+
+} // namespace
+
+MessageStore::MessageStore(const MessageStoreConfig &config)
+    : config_(config) {
+  if (config_.segment_size < TcpMessage::MAX_SERIALIZED_SIZE) {
+    throw std::invalid_argument(
+        "The segments of the store are smaller than a message");
+  }
+  if (mkdir(config_.directory.c_str(), 0755) < 0 && errno != EEXIST) {
+    throw std::runtime_error("Failed to create the store directory: " +
+                             std::string(std::strerror(errno)));
+  }
+
+  // The cursors of the segments left by a previous run are lost
+  DIR *dir = opendir(config_.directory.c_str());
+  if (dir == nullptr) {
+    throw std::runtime_error("Failed to open the store directory: " +
+                             std::string(std::strerror(errno)));
+  }
+  while (const dirent *entry = readdir(dir)) {
+    std::string_view name(entry->d_name);
+    if (name.size() > SEGMENT_PREFIX.size() + SEGMENT_SUFFIX.size() &&
+        name.substr(0, SEGMENT_PREFIX.size()) == SEGMENT_PREFIX &&
+        name.substr(name.size() - SEGMENT_SUFFIX.size()) == SEGMENT_SUFFIX) {
+      unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+MessageStore::~MessageStore() {
+  for (auto &[index, segment] : segments_) {
+    munmap(segment.data, config_.segment_size);
+    close(segment.fd);
+    unlink(segment_path(index).c_str());
+  }
+}
+
+auto MessageStore::segment_path(uint64_t index) const -> std::string {
+  return config_.directory + "/" + std::string(SEGMENT_PREFIX) +
+         std::to_string(index) + std::string(SEGMENT_SUFFIX);
+}
+
+auto MessageStore::open_segment(uint64_t index) -> Segment & {
+  std::string path = segment_path(index);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create the segment " + path + ": " +
+                             std::string(std::strerror(errno)));
+  }
+
+  // The file is sparse until the messages are written through the mapping
+  void *data = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(config_.segment_size)) == 0) {
+    data = mmap(nullptr, config_.segment_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+  }
+  if (data == MAP_FAILED) {
+    int error = errno;
+    close(fd);
+    unlink(path.c_str());
+    throw std::runtime_error("Failed to map the segment " + path + ": " +
+                             std::string(std::strerror(error)));
+  }
+
+  auto &segment = segments_[index];
+  segment.fd = fd;
+  segment.data = static_cast<std::byte *>(data);
+  return segment;
+}
+
+void MessageStore::release(uint64_t index) {
+  auto it = segments_.find(index);
+  --it->second.refs;
+  remove_unused(it);
+}
+
+void MessageStore::remove_unused(std::map<uint64_t, Segment>::iterator it) {
+  if (it->second.refs > 0 || it->first == tail_ / config_.segment_size) {
+    // The segment appended to is kept, even once no cursor refers to it
+    return;
+  }
+
+  munmap(it->second.data, config_.segment_size);
+  close(it->second.fd);
+  unlink(segment_path(it->first).c_str());
+  segments_.erase(it);
+}
+
+void MessageStore::append(const OutgoingMessage &message,
+                          const std::vector<std::string> &ids) {
+  if (ids.empty()) {
+    return;
+  }
+
+  // A message never spans two segments, so that its extents fit in one
+  size_t size = message.bytes.size();
+  if (tail_ % config_.segment_size + size > config_.segment_size) {
+    auto previous = segments_.find(tail_ / config_.segment_size);
+    tail_ = (tail_ / config_.segment_size + 1) * config_.segment_size;
+    if (previous != segments_.end()) {
+      remove_unused(previous);
+    }
+  }
+  uint64_t index = tail_ / config_.segment_size;
+  auto it = segments_.find(index);
+  auto &segment = it != segments_.end() ? it->second : open_segment(index);
+
+  uint64_t offset = tail_;
+  std::memcpy(segment.data + offset % config_.segment_size,
+              message.bytes.data(), size);
+  tail_ += size;
+
+  for (const auto &id : ids) {
+    auto &cursor = cursors_[id];
+    if (!cursor.extents.empty()) {
+      auto &last = cursor.extents.back();
+      if (last.offset + last.size == offset &&
+          last.offset / config_.segment_size == index) {
+        last.size += size;
+        continue;
+      }
+    } else {
+      cursor.frame = offset;
+    }
+    cursor.extents.push_back(Extent{offset, size});
+    ++segment.refs;
+  }
+}
+
+bool MessageStore::replay(const std::string &id, int sockfd) {
+  auto it = cursors_.find(id);
+  if (it == cursors_.end()) {
+    return true;
+  }
+
+  auto &cursor = it->second;
+  while (!cursor.extents.empty()) {
+    auto &extent = cursor.extents.front();
+    uint64_t index = extent.offset / config_.segment_size;
+    const auto &segment = segments_.at(index);
+
+    auto offset = static_cast<off_t>(extent.offset % config_.segment_size);
+    ssize_t sent = sendfile(sockfd, segment.fd, &offset, extent.size);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        // Interrupted by a signal, retry sending
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // The socket buffer is full, the rest is sent once it is writable
+        return false;
+      } else if (errno == EPIPE || errno == ECONNRESET) {
+        throw TcpConnectionClosed("Connection closed by peer");
+      }
+      throw TcpTransmissionError("sendfile() failed with error: " +
+                                 std::string(std::strerror(errno)));
+    } else if (sent == 0) {
+      throw TcpTransmissionError("sendfile() sent nothing");
+    }
+
+    extent.offset += static_cast<size_t>(sent);
+    extent.size -= static_cast<size_t>(sent);
+    if (extent.size == 0) {
+      cursor.extents.pop_front();
+      release(index);
+      if (!cursor.extents.empty()) {
+        cursor.frame = cursor.extents.front().offset;
+      }
+      continue;
+    }
+
+    // Find the message the rest of the extent starts in
+    while (true) {
+      const std::byte *header =
+          segment.data + cursor.frame % config_.segment_size;
+      uint16_t size_network{};
+      std::memcpy(&size_network, header + sizeof(TcpMessageType),
+                  sizeof(size_network));
+      uint64_t frame_end =
+          cursor.frame + FRAME_HEADER_SIZE + ntoh(size_network);
+      if (frame_end > extent.offset) {
+        break;
+      }
+      cursor.frame = frame_end;
+    }
+  }
+
+  cursors_.erase(it);
+  return true;
+}
+
+void MessageStore::interrupt_replay(const std::string &id) {
+  auto it = cursors_.find(id);
+  if (it == cursors_.end()) {
+    return;
+  }
+
+  // What was sent of the message is lost with the connection
+  auto &extent = it->second.extents.front();
+  extent.size += extent.offset - it->second.frame;
+  extent.offset = it->second.frame;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "output_queue.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct MessageStoreConfig {
+  // The directory of the segment files, the messages of the offline
+  // subscribers being dropped if it is empty
+  std::string directory{};
+  // Size of a segment file, in bytes, at least that of the largest message
+  size_t segment_size{64 << 20};
+};
+
+/**
+ * @brief Keeps the messages published to the offline subscribers, until they
+ * connect again
+ *
+ * The messages are appended once, whatever the number of their subscribers,
+ * to a log split into segment files of a fixed size, each mapped in memory. The
+ * cursor of a subscriber is the list of the ranges of the log holding its
+ * messages, the consecutive messages of a segment sharing a range. Once the
+ * subscriber is back, its ranges are sent with sendfile, straight from the page
+ * cache of the segments, without copying them to the user space, before the
+ * messages published since. A segment is removed as soon as no cursor refers
+ * to it.
+ *
+ * The cursors are kept in memory, as the subscriptions: the segments left by a
+ * previous run are removed.
+ */
+class MessageStore {
+public:
+  /**
+   * @brief Open the log in its directory, created if needed
+   *
+   * @param config The directory and the size of the segments
+   *
+   * @throws std::runtime_error if the directory cannot be created
+   */
+  explicit MessageStore(const MessageStoreConfig &config);
+
+  /**
+   * @brief Unmap and remove the segments
+   */
+  ~MessageStore();
+
+  MessageStore(const MessageStore &) = delete;
+  auto operator=(const MessageStore &) -> MessageStore & = delete;
+
+  /**
+   * @brief Append a message to the log, and to the cursors of its subscribers
+   *
+   * @param message The message, as serialized by FanoutEncoder::encode
+   * @param ids The ids of the offline subscribers of its topic
+   *
+   * @throws std::runtime_error if a new segment cannot be created
+   */
+  void append(const OutgoingMessage &message,
+              const std::vector<std::string> &ids);
+
+  /**
+   * @brief Check if messages are stored for a subscriber
+   *
+   * @param id The id of the subscriber
+   * @return true if its cursor is not empty
+   */
+  bool has_backlog(const std::string &id) const {
+    return cursors_.find(id) != cursors_.end();
+  }
+
+  /**
+   * @brief Send the messages stored for a subscriber, as long as its socket
+   * accepts them, without blocking
+   *
+   * @param id The id of the subscriber
+   * @param sockfd The socket of the subscriber, non-blocking
+   * @return true if all its messages were sent
+   *
+   * @throws TcpSocketException if the send fails
+   */
+  bool replay(const std::string &id, int sockfd);
+
+  /**
+   * @brief Keep the messages of a subscriber disconnected during its replay
+   * for its next connection, from the beginning of the one partly sent
+   *
+   * @param id The id of the subscriber
+   */
+  void interrupt_replay(const std::string &id);
+
+private:
+  // A range of the log, within a single segment
+  struct Extent {
+    // counted from the beginning of the log, the segment i starting at
+    // i * segment_size_
+    uint64_t offset{};
+    size_t size{};
+  };
+
+  struct Cursor {
+    std::deque<Extent> extents{};
+    // the beginning of the message the first extent starts in, once partly
+    // sent
+    uint64_t frame{};
+  };
+
+  struct Segment {
+    int fd{-1};
+    std::byte *data{};
+    // the extents referring to the segment
+    size_t refs{};
+  };
+
+  auto open_segment(uint64_t index) -> Segment &;
+  // Drop a reference to a segment
+  void release(uint64_t index);
+  void remove_unused(std::map<uint64_t, Segment>::iterator it);
+  auto segment_path(uint64_t index) const -> std::string;
+
+  MessageStoreConfig config_{};
+  // by their index, the last one being appended to
+  std::map<uint64_t, Segment> segments_{};
+  // the end of the log
+  uint64_t tail_{};
+  // the subscribers with stored messages, by id
+  std::unordered_map<std::string, Cursor> cursors_{};
+};
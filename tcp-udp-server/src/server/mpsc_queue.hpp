@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+/**
+ * @brief Unbounded lock-free queue with many producers and a single consumer
+ *
+ * The producers link their nodes with a single atomic exchange, and the
+ * consumer pops them without any atomic read-modify-write. While a producer is
+ * between its exchange and the link of its node, the consumer sees the queue
+ * as ending before it, so the producer must notify the consumer after pushing.
+ *
+ * @tparam T The type of the values, movable and default constructible
+ */
+template <typename T> class MpscQueue {
+  struct Node {
+    std::atomic<Node *> next{nullptr};
+    T value{};
+  };
+
+public:
+  MpscQueue() : head_(new Node{}), tail_(head_.load()) {}
+  MpscQueue(const MpscQueue &) = delete;
+  auto operator=(const MpscQueue &) -> MpscQueue & = delete;
+
+  ~MpscQueue() {
+    while (pop().has_value()) {
+    }
+    delete tail_;
+  }
+
+  /**
+   * @brief Add a value to the queue, from any thread
+   *
+   * @param value The value to add
+   */
+  void push(T value) {
+    auto *node = new Node{};
+    node->value = std::move(value);
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  /**
+   * @brief Remove the oldest value of the queue, from the consumer thread only
+   *
+   * @return The value, or std::nullopt if the queue is empty
+   */
+  auto pop() -> std::optional<T> {
+    // tail_ is a node whose value was already popped
+    Node *next = tail_->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return std::nullopt;
+    }
+
+    std::optional<T> value{std::move(next->value)};
+    delete tail_;
+    tail_ = next;
+    return value;
+  }
+
+private:
+  // the last node pushed, shared by the producers
+  std::atomic<Node *> head_;
+  // owned by the consumer
+  Node *tail_;
+};
@@ -0,0 +1,67 @@
+#include "multicast_egress.hpp"
+
+#include "async_log.hpp"
+#include "multicast_proto.hpp"
+#include "tcp_proto.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+MulticastEgress::MulticastEgress(const MulticastConfig &config)
+    : group_(config.group), threshold_(std::max<size_t>(config.threshold, 1)),
+      history_(std::max<size_t>(config.history, 1)) {
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    throw std::runtime_error("Failed to create the multicast socket");
+  }
+
+  // The subscribers on the host of the server get the group as well
+  unsigned char loop = 1;
+  if (setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &config.interface,
+                 sizeof(config.interface)) < 0 ||
+      setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+    close(fd_);
+    throw std::runtime_error("Failed to set the interface of the multicast "
+                             "socket: " +
+                             std::string(std::strerror(errno)));
+  }
+}
+
+MulticastEgress::~MulticastEgress() { close(fd_); }
+
+void MulticastEgress::send(const OutgoingMessage &response) {
+  uint64_t seq = next_seq_++;
+  auto frame = std::make_shared<OutgoingMessage>();
+  size_t size = MULTICAST_SEQ_SIZE + response.bytes.size();
+  frame->bytes.resize(sizeof(TcpMessageType) + sizeof(uint16_t) + size);
+
+  std::byte *header = frame->bytes.data();
+  header[0] = static_cast<std::byte>(TcpMessageType::MULTICAST_DATA);
+  uint16_t size_network = hton(static_cast<uint16_t>(size));
+  std::memcpy(header + sizeof(TcpMessageType), &size_network,
+              sizeof(size_network));
+  std::byte *datagram = header + sizeof(TcpMessageType) + sizeof(uint16_t);
+  write_multicast_seq(seq, datagram);
+  std::memcpy(datagram + MULTICAST_SEQ_SIZE, response.bytes.data(),
+              response.bytes.size());
+
+  if (sendto(fd_, datagram, size, MSG_DONTWAIT,
+             reinterpret_cast<const sockaddr *>(&group_), sizeof(group_)) < 0) {
+    log_error("Failed to multicast message ", seq, ": ", std::strerror(errno));
+  }
+  history_[seq % history_.size()] = {seq, std::move(frame)};
+}
+
+auto MulticastEgress::retransmit(uint64_t seq) const
+    -> std::shared_ptr<const OutgoingMessage> {
+  const auto &sent = history_[seq % history_.size()];
+  if (!sent.frame || sent.seq != seq) {
+    return nullptr;
+  }
+  return sent.frame;
+}
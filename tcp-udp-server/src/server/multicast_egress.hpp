@@ -0,0 +1,80 @@
+#pragma once
+
+#include "output_queue.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <vector>
+
+struct MulticastConfig {
+  // The group the messages of the topics with a large fan-out are sent to,
+  // disabled if its port is 0
+  sockaddr_in group{};
+  // The address of the interface the group is sent on, the default one if it
+  // is INADDR_ANY
+  in_addr interface{};
+  // The number of subscribers of a topic which joined the group, from which
+  // its messages are multicast to them
+  size_t threshold{64};
+  // The number of the last messages multicast kept to be retransmitted
+  size_t history{4096};
+};
+
+/**
+ * @brief Sends the messages of the topics with a large fan-out once to a
+ * multicast group, instead of a TCP copy to each of their subscribers
+ *
+ * Each message gets the next sequence number of the group, so that a
+ * subscriber detects the ones it missed, which are kept in a ring of the last
+ * messages to be retransmitted on its TCP connection.
+ */
+class MulticastEgress {
+public:
+  /**
+   * @brief Open the socket the group is sent on
+   *
+   * @param config The group and the interface
+   *
+   * @throws std::runtime_error if the socket cannot be set up
+   */
+  explicit MulticastEgress(const MulticastConfig &config);
+  ~MulticastEgress();
+
+  MulticastEgress(const MulticastEgress &) = delete;
+  auto operator=(const MulticastEgress &) -> MulticastEgress & = delete;
+
+  /**
+   * @brief Send a message once to the group, without blocking
+   *
+   * A message the socket does not accept is only kept to be retransmitted, as
+   * one lost on the network.
+   *
+   * @param response The RESPONSE frame of the message, as sent on TCP
+   */
+  void send(const OutgoingMessage &response);
+
+  /**
+   * @brief Get a message multicast, to retransmit it on TCP
+   *
+   * @param seq The sequence number of the message
+   * @return Its MULTICAST_DATA frame, or nullptr if it is no longer kept or
+   * was never sent
+   */
+  auto retransmit(uint64_t seq) const -> std::shared_ptr<const OutgoingMessage>;
+
+  auto threshold() const -> size_t { return threshold_; }
+
+private:
+  struct Sent {
+    uint64_t seq{};
+    std::shared_ptr<const OutgoingMessage> frame{};
+  };
+
+  int fd_{-1};
+  sockaddr_in group_{};
+  size_t threshold_{};
+  uint64_t next_seq_{};
+  // the last messages sent, by sequence number modulo its size
+  std::vector<Sent> history_{};
+};
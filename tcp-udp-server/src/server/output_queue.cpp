@@ -0,0 +1,351 @@
+#include "output_queue.hpp"
+
+#include "broker_stats.hpp"
+#include "shm_ring.hpp"
+#include "tcp_utils.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+auto OutputQueue::push(std::shared_ptr<const OutgoingMessage> message,
+                       bool conflated) -> PushResult {
+  // The batches of protocol v2 have no topic, and are not conflated
+  conflated = conflated && !message->topic.empty();
+  if (conflated && replace(message)) {
+    return PushResult::QUEUED;
+  }
+
+  size_t message_size = message->bytes.size();
+  size_t index = lane_index(*message);
+
+  if (!slow_ && (size() + message_size > config_.high_watermark ||
+                 over_budget(message_size))) {
+    slow_ = true;
+  }
+
+  if (slow_) {
+    switch (config_.policy) {
+    case SlowConsumerPolicy::DROP:
+      return PushResult::DROPPED;
+    case SlowConsumerPolicy::CONFLATE:
+      // The batches of protocol v2 have no topic, and are not conflated
+      if (!message->topic.empty()) {
+        conflate(message->topic, index);
+      }
+      if (size() + message_size > config_.high_watermark ||
+          over_budget(message_size)) {
+        return PushResult::DROPPED;
+      }
+      break;
+    case SlowConsumerPolicy::DISCONNECT:
+      return PushResult::OVERFLOWED;
+    }
+  }
+
+  auto &lane = lanes_[index];
+  if (conflated) {
+    lane.conflated[message->topic] = lane.popped + lane.messages.size();
+  }
+  queued_bytes_ += message_size;
+  budget_.update(queued_bytes_);
+  lane.messages.push_back(std::move(message));
+  return PushResult::QUEUED;
+}
+
+void OutputQueue::restore(std::shared_ptr<const OutgoingMessage> message) {
+  // In the highest lane, which is sent first
+  queued_bytes_ += message->bytes.size();
+  budget_.update(queued_bytes_);
+  lanes_.back().messages.push_back(std::move(message));
+  if (size() > config_.high_watermark) {
+    slow_ = true;
+  }
+}
+
+size_t OutputQueue::kept(size_t lane) const {
+  bool partly_sent = sent_bytes_ > 0 && partial_lane_ == lane;
+  return std::max<size_t>(lanes_[lane].in_flight, partly_sent ? 1 : 0);
+}
+
+bool OutputQueue::replace(std::shared_ptr<const OutgoingMessage> &message) {
+  size_t index = lane_index(*message);
+  auto &lane = lanes_[index];
+  auto it = lane.conflated.find(message->topic);
+  if (it == lane.conflated.end()) {
+    return false;
+  }
+
+  // The first message cannot be replaced once partly sent, nor the messages
+  // given to a send still running
+  if (it->second < lane.popped + kept(index) ||
+      it->second >= lane.popped + lane.messages.size()) {
+    lane.conflated.erase(it);
+    return false;
+  }
+
+  auto &queued = lane.messages[it->second - lane.popped];
+  queued_bytes_ = queued_bytes_ - queued->bytes.size() + message->bytes.size();
+  budget_.update(queued_bytes_);
+  queued = std::move(message);
+  return true;
+}
+
+auto OutputQueue::flush(int sockfd, size_t &budget) -> FlushResult {
+  std::array<iovec, IOV_BATCH> iov{};
+  if (!zerocopy_sends_.empty()) {
+    reap(sockfd);
+  }
+
+  // Set once the kernel runs out of memory to pin the messages
+  bool copy = false;
+  while (!empty()) {
+    msghdr msg{};
+    msg.msg_iov = iov.data();
+    size_t count = prepare(iov.data(), iov.size());
+    // The messages fitting whole in the budget
+    size_t bytes = 0;
+    msg.msg_iovlen = 0;
+    while (msg.msg_iovlen < count &&
+           bytes + iov[msg.msg_iovlen].iov_len <= budget) {
+      bytes += iov[msg.msg_iovlen++].iov_len;
+    }
+    if (msg.msg_iovlen == 0) {
+      consume(0);
+      return FlushResult::BUDGET_SPENT;
+    }
+    bool zerocopy = !copy && use_zerocopy(sockfd, iov.data(), msg.msg_iovlen);
+    ssize_t sent = sendmsg(sockfd, &msg,
+                           MSG_DONTWAIT | MSG_NOSIGNAL |
+                               (zerocopy ? MSG_ZEROCOPY : 0));
+
+    if (sent < 0) {
+      consume(0);
+      if (errno == ENOBUFS && zerocopy) {
+        copy = true;
+        continue;
+      } else if (errno == EINTR) {
+        // Interrupted by a signal, retry sending
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // The socket buffer is full, the rest is sent once it is writable
+        return FlushResult::BLOCKED;
+      } else if (errno == EPIPE || errno == ECONNRESET) {
+        throw TcpConnectionClosed("Connection closed by peer");
+      }
+      throw TcpTransmissionError("sendmsg() failed with error: " +
+                                 std::string(std::strerror(errno)));
+    }
+    if (zerocopy) {
+      hold(iov.data(), msg.msg_iovlen, static_cast<size_t>(sent));
+    }
+    consume(static_cast<size_t>(sent));
+    budget -= static_cast<size_t>(sent);
+  }
+
+  return FlushResult::EMPTY;
+}
+
+bool OutputQueue::use_zerocopy(int sockfd, const iovec *iov, size_t count) {
+  if (config_.zerocopy_bytes == 0 || zerocopy_ == ZerocopyState::DISABLED) {
+    return false;
+  }
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; ++i) {
+    bytes += iov[i].iov_len;
+  }
+  if (bytes < config_.zerocopy_bytes) {
+    return false;
+  }
+
+  if (zerocopy_ == ZerocopyState::UNKNOWN) {
+    int enable = 1;
+    zerocopy_ = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &enable,
+                           sizeof(enable)) == 0
+                    ? ZerocopyState::ENABLED
+                    : ZerocopyState::DISABLED;
+  }
+  return zerocopy_ == ZerocopyState::ENABLED;
+}
+
+void OutputQueue::hold(const iovec *iov, size_t count, size_t sent) {
+  // The kernel numbers every send made with MSG_ZEROCOPY which succeeds
+  ZerocopySend send{zerocopy_id_++, {}};
+  // The buffers of a lane are its first messages, in order
+  std::vector<size_t> positions(lanes_.size());
+  for (size_t i = 0; i < count && sent > 0; ++i) {
+    size_t lane = prepared_[i];
+    send.messages.push_back(lanes_[lane].messages[positions[lane]++]);
+    sent -= std::min(sent, iov[i].iov_len);
+  }
+  zerocopy_sends_.push_back(std::move(send));
+}
+
+void OutputQueue::reap(int sockfd) {
+  alignas(cmsghdr) std::array<
+      std::byte, CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in))>
+      control{};
+
+  while (!zerocopy_sends_.empty()) {
+    msghdr msg{};
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      // No notification is left, the errors of the socket being reported by
+      // the sends and the receives
+      return;
+    }
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+        continue;
+      }
+      sock_extended_err err{};
+      std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      // The sends from ee_info to ee_data completed, those of TCP completing
+      // in order
+      while (!zerocopy_sends_.empty() &&
+             static_cast<int32_t>(err.ee_data - zerocopy_sends_.front().id) >=
+                 0) {
+        zerocopy_sends_.pop_front();
+      }
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // The kernel copied the messages anyway, as for a loopback
+        // connection, which costs more than copying them in the send
+        zerocopy_ = ZerocopyState::DISABLED;
+      }
+    }
+  }
+}
+
+bool OutputQueue::flush(ShmRing &ring) {
+  std::array<iovec, IOV_BATCH> iov{};
+
+  while (!empty()) {
+    size_t count = prepare(iov.data(), iov.size());
+    size_t written = 0;
+    for (size_t i = 0; i < count; ++i) {
+      size_t size = ring.write(static_cast<const std::byte *>(iov[i].iov_base),
+                               iov[i].iov_len);
+      written += size;
+      if (size < iov[i].iov_len) {
+        // The ring is full, the rest is copied once the reader frees space
+        consume(written);
+        return false;
+      }
+    }
+    consume(written);
+  }
+
+  return true;
+}
+
+auto OutputQueue::prepare(iovec *iov, size_t max_count) -> size_t {
+  prepared_.clear();
+  auto add = [&](size_t lane, size_t position, size_t offset) {
+    const auto &bytes = lanes_[lane].messages[position]->bytes;
+    iov[prepared_.size()].iov_base =
+        const_cast<std::byte *>(bytes.data() + offset);
+    iov[prepared_.size()].iov_len = bytes.size() - offset;
+    prepared_.push_back(static_cast<uint8_t>(lane));
+    ++lanes_[lane].in_flight;
+  };
+
+  // The rest of the frame partly sent comes first, whatever its priority
+  if (sent_bytes_ > 0 && max_count > 0) {
+    add(partial_lane_, 0, sent_bytes_);
+  }
+  for (size_t lane = lanes_.size(); lane-- > 0;) {
+    const auto &messages = lanes_[lane].messages;
+    for (size_t i = lanes_[lane].in_flight;
+         i < messages.size() && prepared_.size() < max_count; ++i) {
+      add(lane, i, 0);
+    }
+  }
+  return prepared_.size();
+}
+
+void OutputQueue::consume(size_t sent) {
+  // Read once per send, rather than per message sent
+  uint64_t now = config_.receive_to_send_ns && sent > 0 ? realtime_ns() : 0;
+
+  // Release the messages sent entirely, from the lanes they were taken from
+  for (size_t i = 0; i < prepared_.size() && sent > 0; ++i) {
+    size_t index = prepared_[i];
+    auto &lane = lanes_[index];
+    const auto &message = lane.messages.front();
+    size_t message_size = message->bytes.size();
+    size_t remaining = message_size - sent_bytes_;
+    if (sent < remaining) {
+      sent_bytes_ += sent;
+      partial_lane_ = index;
+      break;
+    }
+    sent -= remaining;
+    if (now > 0 && message->received_ns > 0) {
+      uint64_t elapsed = now - std::min(now, message->received_ns);
+      config_.receive_to_send_ns->record(elapsed);
+      if (config_.lane_receive_to_send_ns) {
+        config_.lane_receive_to_send_ns[index].record(elapsed);
+      }
+    }
+    queued_bytes_ -= message_size;
+    budget_.update(queued_bytes_);
+    sent_bytes_ = 0;
+    lane.messages.pop_front();
+    ++lane.popped;
+  }
+  for (auto &lane : lanes_) {
+    lane.in_flight = 0;
+  }
+  prepared_.clear();
+
+  if (slow_ && size() < config_.low_watermark) {
+    slow_ = false;
+  }
+}
+
+void OutputQueue::clear() {
+  // The messages given to a send still running are kept until it completes
+  for (auto &lane : lanes_) {
+    for (size_t i = lane.in_flight; i < lane.messages.size(); ++i) {
+      queued_bytes_ -= lane.messages[i]->bytes.size();
+    }
+    lane.messages.erase(lane.messages.begin() + lane.in_flight,
+                        lane.messages.end());
+    lane.conflated.clear();
+  }
+  budget_.update(queued_bytes_);
+  if (prepared_.empty()) {
+    sent_bytes_ = 0;
+  }
+  slow_ = false;
+}
+
+void OutputQueue::conflate(const std::string &topic, size_t index) {
+  // The first message cannot be removed once partly sent, nor the messages
+  // given to a send still running
+  auto &lane = lanes_[index];
+  auto &messages = lane.messages;
+  auto first = messages.begin() + std::min(kept(index), messages.size());
+  auto last = std::remove_if(first, messages.end(), [&](const auto &message) {
+    if (message->topic != topic) {
+      return false;
+    }
+    queued_bytes_ -= message->bytes.size();
+    return true;
+  });
+  messages.erase(last, messages.end());
+  budget_.update(queued_bytes_);
+  // The positions of the messages that followed have changed
+  lane.conflated.clear();
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <sys/uio.h>
+#include <utility>
+#include <vector>
+
+class ShardedHistogram;
+class ShmRing;
+
+/**
+ * @brief What to do with a subscriber whose output queue is full, because it
+ * reads its messages slower than they are published
+ */
+enum class SlowConsumerPolicy : uint8_t {
+  // Drop the new messages
+  DROP = 0,
+  // Replace the queued messages of the same topic with the new one, dropping
+  // it if the queue is still full
+  CONFLATE,
+  // Disconnect the subscriber
+  DISCONNECT,
+};
+
+struct OutputQueueConfig {
+  // Size of the queued messages, in bytes, from which a subscriber is slow
+  size_t high_watermark{4 << 20};
+  // Size of the queued messages, in bytes, below which a slow subscriber is
+  // no longer slow
+  size_t low_watermark{1 << 20};
+  SlowConsumerPolicy policy{SlowConsumerPolicy::DROP};
+  // How long the deliveries to a subscriber are held back to be written
+  // together, unless it opted out when connecting: 0 sends them after each
+  // batch of events, as do the I/O workers of the multi-threaded mode
+  std::chrono::microseconds coalesce_window{0};
+  // Size of the queued messages, in bytes, written without waiting for the
+  // end of the window
+  size_t coalesce_bytes{64 << 10};
+  // The bytes a subscriber may be sent per round of the event loop, the deficit
+  // round robin of the server carrying what it did not use over to the next
+  // round while its messages do not fit, 0 to send as much as the socket
+  // accepts
+  size_t write_quantum{};
+  // Size of a send, in bytes, from which the messages are sent without being
+  // copied by the kernel, with MSG_ZEROCOPY, 0 to always copy them
+  size_t zerocopy_bytes{};
+  // Size of the payload of a batch of protocol v2, in bytes, from which it is
+  // compressed for the subscribers asking for it, 0 to never compress it
+  size_t compression_threshold{512};
+  // The distribution of the times from the reception of the messages until
+  // they are entirely sent, recorded if the statistics of the server are
+  // collected, by the thread sending them
+  ShardedHistogram *receive_to_send_ns{};
+  // The number of lanes of a queue, one for each priority of PriorityClasses
+  size_t lanes{1};
+  // The distributions of the same times by priority, an array of as many
+  // histograms as lanes, recorded as above
+  ShardedHistogram *lane_receive_to_send_ns{};
+  // Size of the messages queued for all the subscribers together, in bytes,
+  // from which the policy applies to the new messages of every subscriber,
+  // unlimited if 0
+  size_t queue_budget{};
+  // The bytes queued by all the queues, counted against the budget, by the
+  // thread of the server only
+  size_t *budget_used{};
+  // The send buffer of the subscriber sockets, in bytes, and the bytes not
+  // sent yet above which the kernel takes no more (TCP_NOTSENT_LOWAT), the
+  // socket being writable again below them, so that the messages wait in the
+  // queues, where the conflation, the lanes and the policy apply, rather than
+  // in the kernel; the defaults of the kernel if 0
+  size_t send_buffer{};
+  size_t notsent_lowat{};
+};
+
+/**
+ * @brief A serialized message, shared by the output queues of all the
+ * subscribers it is sent to
+ */
+struct OutgoingMessage {
+  std::vector<std::byte> bytes{};
+  // The topic of the message, for the conflation, empty for the batches of
+  // protocol v2
+  std::string topic{};
+  // When the kernel received the UDP message, or the first one of a batch, in
+  // nanoseconds of CLOCK_REALTIME, 0 if it is unknown
+  uint64_t received_ns{};
+  // The priority of the topic of the message, that of the lane of the output
+  // queues it is queued in, 0 for the other messages
+  uint8_t priority{};
+};
+
+/**
+ * @brief The messages waiting to be sent to a subscriber, whose socket is
+ * written without blocking
+ *
+ * The messages are sent as long as the socket accepts them, the rest being
+ * queued until the socket is writable again. Once the queued messages reach
+ * the high watermark, or the messages queued for all the subscribers reach
+ * the budget, the subscriber is slow and the policy applies to the new
+ * messages, until the queue drains below the low watermark.
+ *
+ * The messages are queued in the lane of their priority, the higher lanes
+ * being sent first, so a flood of a low priority topic does not delay the
+ * messages of the higher ones. Only the message partly sent, whose frame was
+ * cut, is sent before them. The watermarks apply to all the lanes together.
+ */
+class OutputQueue {
+public:
+  enum class PushResult : uint8_t {
+    QUEUED = 0,
+    DROPPED,
+    // The subscriber must be disconnected, as by SlowConsumerPolicy::DISCONNECT
+    OVERFLOWED,
+  };
+
+  // Number of messages given to a single sendmsg
+  static constexpr size_t IOV_BATCH = 64;
+
+  explicit OutputQueue(const OutputQueueConfig &config)
+      : config_(config), lanes_(std::max<size_t>(config.lanes, 1)),
+        budget_(config.budget_used) {}
+
+  /**
+   * @brief Queue a message, applying the slow consumer policy if the queue is
+   * full. The message is not sent, see flush.
+   *
+   * A conflated message takes the place of the last conflated message of its
+   * topic still queued, unless that one is already being sent, so a slow
+   * subscriber only gets the latest message of the topic
+   *
+   * @param message The message to queue
+   * @param conflated Whether the message replaces the queued one of its topic
+   * @return Whether the message was queued
+   */
+  auto push(std::shared_ptr<const OutgoingMessage> message,
+            bool conflated = false) -> PushResult;
+
+  /**
+   * @brief Queue the bytes taken from another queue, whatever the watermarks,
+   * as a message sent before the ones queued after it, whatever their
+   * priority, as the frame it starts with may be cut
+   *
+   * @param message The bytes, in a message, the queue being empty
+   */
+  void restore(std::shared_ptr<const OutgoingMessage> message);
+
+  // Why a flush stopped
+  enum class FlushResult : uint8_t {
+    // The queue is empty
+    EMPTY = 0,
+    // The socket would block, the rest being sent once it is writable
+    BLOCKED,
+    // The next message does not fit in what is left of the budget
+    BUDGET_SPENT,
+  };
+
+  /**
+   * @brief Send as many queued messages as the socket accepts, without
+   * blocking
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @return true if the queue is left empty
+   *
+   * @throws TcpSocketException if the send fails
+   */
+  bool flush(int sockfd) {
+    size_t budget = SIZE_MAX;
+    return flush(sockfd, budget) == FlushResult::EMPTY;
+  }
+
+  /**
+   * @brief Send the queued messages which fit in a budget, as many as the
+   * socket accepts, without blocking
+   *
+   * A message is only sent once the budget covers the rest of it, so that
+   * the budget of a deficit round robin can grow across the rounds until it
+   * does.
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @param budget The bytes which may be sent, lowered by those sent
+   * @return Why the flush stopped
+   *
+   * @throws TcpSocketException if the send fails
+   */
+  auto flush(int sockfd, size_t &budget) -> FlushResult;
+
+  /**
+   * @brief Copy as many queued messages as the ring of the subscriber has
+   * room for, instead of sending them on its socket
+   *
+   * @param ring The ring of the subscriber, written by the server
+   * @return true if the queue is left empty
+   */
+  bool flush(ShmRing &ring);
+
+  /**
+   * @brief Release the messages sent without being copied which the kernel
+   * no longer reads, as notified on the error queue of the socket. flush reaps
+   * them as well.
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   */
+  void reap(int sockfd);
+
+  /**
+   * @brief Point to the first queued messages, for a send made by the caller.
+   * These messages are kept until consume is called, even by clear.
+   *
+   * @param iov The buffers to fill
+   * @param max_count The number of buffers
+   * @return The number of buffers filled
+   */
+  auto prepare(iovec *iov, size_t max_count) -> size_t;
+
+  /**
+   * @brief Release what was sent of the messages given by prepare
+   *
+   * @param sent The number of bytes sent, 0 if the send failed
+   */
+  void consume(size_t sent);
+
+  bool empty() const {
+    return std::all_of(lanes_.begin(), lanes_.end(),
+                       [](const Lane &lane) { return lane.messages.empty(); });
+  }
+
+  /**
+   * @brief Check if the queues together reached their budget
+   *
+   * @param message_size The size of a message about to be queued
+   * @return true if the message does not fit in the budget
+   */
+  bool over_budget(size_t message_size) const {
+    return config_.queue_budget > 0 && config_.budget_used != nullptr &&
+           *config_.budget_used + message_size > config_.queue_budget;
+  }
+
+  /**
+   * @brief Get the size of the queued messages, minus what was already sent
+   * of the first one
+   *
+   * @return The number of bytes still to be sent
+   */
+  size_t size() const { return queued_bytes_ - sent_bytes_; }
+
+  void clear();
+
+private:
+  // The messages of a priority, in the order they are sent
+  struct Lane {
+    std::deque<std::shared_ptr<const OutgoingMessage>> messages{};
+    // The number of messages removed from the front of the lane, for the
+    // positions below
+    uint64_t popped{};
+    // The position, counted since the first message ever queued in the lane,
+    // of the last conflated message of each topic
+    std::unordered_map<std::string, uint64_t> conflated{};
+    // The messages given by prepare, until consume
+    size_t in_flight{};
+  };
+
+  auto lane_index(const OutgoingMessage &message) const -> size_t {
+    return std::min<size_t>(message.priority, lanes_.size() - 1);
+  }
+  // The messages at the front of a lane which can neither be replaced nor
+  // removed: those partly sent or given to a send still running
+  size_t kept(size_t lane) const;
+  // Remove the queued messages of a topic, from its lane, except those kept
+  void conflate(const std::string &topic, size_t lane);
+  // Replace the last conflated message of the topic of a message, if it can
+  // still be replaced
+  bool replace(std::shared_ptr<const OutgoingMessage> &message);
+  // Check if a send is large enough not to be copied, enabling SO_ZEROCOPY
+  // on the socket the first time
+  bool use_zerocopy(int sockfd, const iovec *iov, size_t count);
+  // Keep the messages read by a send made without copying them, until the
+  // kernel notifies its completion
+  void hold(const iovec *iov, size_t count, size_t sent);
+
+  enum class ZerocopyState : uint8_t { UNKNOWN = 0, ENABLED, DISABLED };
+
+  // The share of a queue in the bytes counted against the budget, given back
+  // when the queue is destroyed, and moved along with it
+  class BudgetShare {
+  public:
+    explicit BudgetShare(size_t *used) : used_(used) {}
+    BudgetShare(BudgetShare &&other) noexcept
+        : used_(std::exchange(other.used_, nullptr)), bytes_(other.bytes_) {}
+    BudgetShare &operator=(BudgetShare &&other) noexcept {
+      update(0);
+      used_ = std::exchange(other.used_, nullptr);
+      bytes_ = other.bytes_;
+      return *this;
+    }
+    ~BudgetShare() { update(0); }
+
+    // Count the bytes the queue now holds
+    void update(size_t bytes) {
+      if (used_ != nullptr) {
+        *used_ = *used_ - bytes_ + bytes;
+      }
+      bytes_ = bytes;
+    }
+
+  private:
+    size_t *used_{};
+    size_t bytes_{};
+  };
+
+  // A send made with MSG_ZEROCOPY, numbered as by the kernel, and the messages
+  // it reads
+  struct ZerocopySend {
+    uint32_t id{};
+    std::vector<std::shared_ptr<const OutgoingMessage>> messages{};
+  };
+
+  OutputQueueConfig config_{};
+  // by priority
+  std::vector<Lane> lanes_{};
+  size_t queued_bytes_{};
+  BudgetShare budget_{nullptr};
+  // The bytes already sent of the first message of the lane partial_lane_
+  size_t sent_bytes_{};
+  size_t partial_lane_{};
+  // The lane of each message given by prepare, in the order of the buffers
+  std::vector<uint8_t> prepared_{};
+  bool slow_{};
+  ZerocopyState zerocopy_{};
+  // the sends whose completion is not notified yet, in order
+  std::deque<ZerocopySend> zerocopy_sends_{};
+  // the number of the next send made with MSG_ZEROCOPY
+  uint32_t zerocopy_id_{};
+};
@@ -0,0 +1,47 @@
+#include "priority_classes.hpp"
+
+#include <algorithm>
+
+auto PriorityClasses::parse(std::string_view str, PriorityClasses &classes)
+    -> bool {
+  PriorityClasses parsed{};
+  while (!str.empty()) {
+    if (parsed.classes_.size() == MAX_CLASSES) {
+      return false;
+    }
+    size_t end = std::min(str.find(';'), str.size());
+    std::string_view patterns = str.substr(0, end);
+    str.remove_prefix(std::min(end + 1, str.size()));
+
+    auto &patterns_parsed = parsed.classes_.emplace_back();
+    while (true) {
+      size_t separator = std::min(patterns.find(','), patterns.size());
+      TokenPattern pattern{};
+      if (TokenPattern::parse(patterns.substr(0, separator), pattern) !=
+          TokenPatternError::NONE) {
+        return false;
+      }
+      patterns_parsed.push_back(std::move(pattern));
+      if (separator == patterns.size()) {
+        break;
+      }
+      patterns.remove_prefix(separator + 1);
+    }
+  }
+
+  classes = std::move(parsed);
+  return true;
+}
+
+auto PriorityClasses::priority(const TopicView &topic) const -> uint8_t {
+  for (size_t i = 0; i < classes_.size(); ++i) {
+    const auto &patterns = classes_[i];
+    if (std::any_of(patterns.begin(), patterns.end(),
+                    [&](const TokenPattern &pattern) {
+                      return topic.is_matched_by(pattern);
+                    })) {
+      return static_cast<uint8_t>(classes_.size() - i);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "token_pattern.hpp"
+#include "topic_view.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief The priority classes of the published topics, each given by the
+ * patterns of its topics, whose messages are sent to a subscriber before those
+ * of the lower classes
+ *
+ * The priority of a topic is that of the first class matching it, from the
+ * highest, the topics matched by none getting the priority 0, below every
+ * class. The output queue of a subscriber has a lane for each priority.
+ */
+class PriorityClasses {
+public:
+  static constexpr size_t MAX_CLASSES = 3;
+  // the classes, and the priority 0 of the other topics
+  static constexpr size_t MAX_LANES = MAX_CLASSES + 1;
+
+  /**
+   * @brief Parse the classes, without throwing
+   *
+   * @param str The classes from the highest priority, separated by ';', each
+   * a list of patterns separated by ','
+   * @param classes The classes parsed, left unchanged if the string is invalid
+   * @return true if every pattern is valid and there are at most MAX_CLASSES
+   */
+  [[nodiscard]] static auto parse(std::string_view str,
+                                  PriorityClasses &classes) -> bool;
+
+  /**
+   * @brief Get the priority of a published topic
+   *
+   * @param topic The topic
+   * @return The priority of the first class matching it, in [1, lanes()), or
+   * 0 if none does
+   */
+  auto priority(const TopicView &topic) const -> uint8_t;
+
+  // The number of priorities, the classes and the topics matched by none
+  size_t lanes() const { return classes_.size() + 1; }
+
+private:
+  // the patterns of each class, from the highest priority
+  std::vector<std::vector<TokenPattern>> classes_{};
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "udp_proto.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief The topic ids registered by the UDP publishers, see
+ * UDP_TOPIC_REGISTRATION, each mapped to its topic and to what its messages
+ * are fanned out with, compiled once rather than for every batch
+ *
+ * The table is bounded: a publisher registers at most MAX_TOPICS ids, and
+ * the publisher that registered last the longest ago is forgotten to make room
+ * for a new one, its batches of ids being then rejected until it registers
+ * again. The topics stay valid until release_retired, even if their id is
+ * registered again or their publisher is forgotten, so that the messages of a
+ * batch can point to them across the registrations of the same batch.
+ *
+ * @tparam Compiled What the messages of a topic are fanned out with, default
+ * constructible, left to its user to compile and to check
+ */
+template <typename Compiled> class PublisherTopics {
+public:
+  static constexpr size_t MAX_PUBLISHERS = 256;
+  static constexpr size_t MAX_TOPICS = 1024;
+
+  // A registered topic
+  struct Topic {
+    std::string name{};
+    Compiled compiled{};
+  };
+
+  /**
+   * @brief Register the id of a topic of a publisher, replacing the topic it
+   * was registered with before
+   *
+   * @param publisher The address of the publisher
+   * @param id The id
+   * @param name The topic, already validated
+   * @param compiled What its messages are fanned out with
+   * @return The topic, or nullptr if the publisher has MAX_TOPICS ids
+   */
+  auto add(const sockaddr_in &publisher, uint16_t id, std::string_view name,
+           Compiled compiled) -> Topic * {
+    auto &entry = find_or_add_publisher(key(publisher));
+    entry.registered = ++registrations_;
+
+    auto it = entry.topics.find(id);
+    if (it != entry.topics.end()) {
+      if (it->second->name == name) {
+        return it->second.get();
+      }
+      retired_.push_back(std::move(it->second));
+    } else if (entry.topics.size() >= MAX_TOPICS) {
+      return nullptr;
+    } else {
+      it = entry.topics.try_emplace(id).first;
+    }
+    it->second = std::make_unique<Topic>(Topic{std::string(name),
+                                               std::move(compiled)});
+    return it->second.get();
+  }
+
+  /**
+   * @brief Resolve the topic of a message sent by id
+   *
+   * @param publisher The address of the publisher
+   * @param id The id, as given by UdpMessageCursor::topic_id
+   * @param view The message, its topic set to the one of the id if it is
+   * registered
+   * @return The topic, or nullptr if the publisher did not register the id
+   */
+  auto resolve(const sockaddr_in &publisher, uint16_t id, UdpMessageView &view)
+      -> Topic * {
+    auto entry = publishers_.find(key(publisher));
+    if (entry == publishers_.end()) {
+      return nullptr;
+    }
+    auto it = entry->second.topics.find(id);
+    if (it == entry->second.topics.end()) {
+      return nullptr;
+    }
+    Topic *topic = it->second.get();
+    view.topic = topic->name.data();
+    view.topic_size = static_cast<uint8_t>(topic->name.size());
+    return topic;
+  }
+
+  // Free the topics replaced or forgotten, once no message points to them
+  void release_retired() { retired_.clear(); }
+
+private:
+  struct Publisher {
+    std::unordered_map<uint16_t, std::unique_ptr<Topic>> topics{};
+    // when the publisher last registered a topic, in registrations
+    uint64_t registered{};
+  };
+
+  static auto key(const sockaddr_in &publisher) -> uint64_t {
+    return uint64_t{publisher.sin_addr.s_addr} << 16 | publisher.sin_port;
+  }
+
+  auto find_or_add_publisher(uint64_t publisher_key) -> Publisher & {
+    auto it = publishers_.find(publisher_key);
+    if (it != publishers_.end()) {
+      return it->second;
+    }
+    if (publishers_.size() >= MAX_PUBLISHERS) {
+      // Rare enough for the oldest publisher to be looked for
+      auto oldest = publishers_.begin();
+      for (auto other = publishers_.begin(); other != publishers_.end();
+           ++other) {
+        if (other->second.registered < oldest->second.registered) {
+          oldest = other;
+        }
+      }
+      for (auto &[id, topic] : oldest->second.topics) {
+        retired_.push_back(std::move(topic));
+      }
+      publishers_.erase(oldest);
+    }
+    return publishers_[publisher_key];
+  }
+
+  std::unordered_map<uint64_t, Publisher> publishers_{};
+  // the topics replaced or forgotten, pointed to by the messages of the batch
+  std::vector<std::unique_ptr<Topic>> retired_{};
+  uint64_t registrations_{};
+};
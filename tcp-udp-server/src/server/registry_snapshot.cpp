@@ -0,0 +1,56 @@
+#include "registry_snapshot.hpp"
+#include <algorithm>
+
+void RegistrySnapshot::match_topic_subscribers(
+    const TopicView &topic, std::vector<Subscriber> &subscribers) const {
+  subscribers.clear();
+
+  auto add_subscriber = [&](int sockfd) {
+    auto it = connections_.find(sockfd);
+    if (it != connections_.end()) {
+      subscribers.push_back(it->second);
+    }
+  };
+
+  // The subscribers to the same topic, without wildcards
+  auto [it, end] = exact_subscribers_.equal_range(topic.hashValue());
+  for (; it != end; ++it) {
+    if (topic == it->second.topic) {
+      for (int sockfd : it->second.subscribers_sockets) {
+        add_subscriber(sockfd);
+      }
+      break;
+    }
+  }
+
+  // Walk the subscriber topic patterns that match the given topic
+  wildcard_subscribers_.for_each_match(topic, add_subscriber);
+
+  // Deduplicate the subscribers matching through several topics
+  auto by_socket = [](const Subscriber &lhs, const Subscriber &rhs) {
+    return lhs.sockfd < rhs.sockfd;
+  };
+  auto same_socket = [](const Subscriber &lhs, const Subscriber &rhs) {
+    return lhs.sockfd == rhs.sockfd;
+  };
+  std::sort(subscribers.begin(), subscribers.end(), by_socket);
+  subscribers.erase(
+      std::unique(subscribers.begin(), subscribers.end(), same_socket),
+      subscribers.end());
+}
+
+auto RegistrySnapshot::accepts(int sockfd, const TopicView &topic,
+                               TcpResponsePayloadType type,
+                               const std::byte *payload, size_t size) const
+    -> bool {
+  auto it = filtered_subscribers_.find(sockfd);
+  if (it == filtered_subscribers_.end()) {
+    return true;
+  }
+  return std::any_of(it->second.begin(), it->second.end(),
+                     [&](const Subscription &subscription) {
+                       const auto &[pattern, filter] = subscription;
+                       return topic.is_matched_by(pattern) &&
+                              filter.accepts(type, payload, size);
+                     });
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "delivery_limit.hpp"
+#include "priority_classes.hpp"
+#include "token_interner.hpp"
+#include "token_pattern.hpp"
+#include "topic_trie.hpp"
+#include "topic_view.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Immutable copy of the subscriptions of the connected subscribers,
+ * matched by the UDP ingest threads while the registry keeps changing on the
+ * thread of the server
+ *
+ * The topics are parsed with a copy of the ids of the TokenInterner rather
+ * than with the interner itself, which is not thread safe. A new snapshot is
+ * built for every change, so the snapshots are read much more often than they
+ * are built.
+ */
+class RegistrySnapshot {
+public:
+  // A subscriber to send a message to
+  struct Subscriber {
+    int sockfd{-1};
+    // the id of the connection of the socket, telling it apart from a later
+    // connection getting the same socket
+    uint64_t connection{};
+    // the I/O worker of the connection
+    size_t worker{};
+  };
+
+  /**
+   * @brief Parse a published topic, as by TopicView::from_string
+   *
+   * @param str The topic
+   * @return The topic, or std::nullopt if it is invalid
+   */
+  auto parse_topic(std::string_view str) const -> std::optional<TopicView> {
+    return TopicView::from_string(str, token_ids_);
+  }
+
+  /**
+   * @brief Retrieve the subscribers of a published topic, once for all the
+   * messages of the topic in a batch
+   *
+   * @param topic The topic, as parsed by parse_topic
+   * @param subscribers Set to the subscribers, each appearing once, including
+   * those whose filters may reject a message, see accepts
+   */
+  void match_topic_subscribers(const TopicView &topic,
+                               std::vector<Subscriber> &subscribers) const;
+
+  // Whether any subscriber filters the messages of some of its topics
+  bool filters() const { return !filtered_subscribers_.empty(); }
+
+  /**
+   * @brief Check if a message of a topic is sent to a subscriber
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @param topic The topic, as parsed by parse_topic
+   * @param type The type of the payload of the message
+   * @param payload The payload, as laid out in the publication
+   * @param size The size of the payload
+   * @return true if the subscriber does not filter the topic, or if one of its
+   * subscriptions matching the topic does not filter it or accepts the message
+   */
+  auto accepts(int sockfd, const TopicView &topic, TcpResponsePayloadType type,
+               const std::byte *payload, size_t size) const -> bool;
+
+  /**
+   * @brief Get the priority of a published topic, see PriorityClasses
+   *
+   * @param topic The topic, as parsed by parse_topic
+   * @return The priority
+   */
+  auto priority(const TopicView &topic) const -> uint8_t {
+    return priorities_.priority(topic);
+  }
+
+  /**
+   * @brief Set the id of the connection of a subscriber socket
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @param connection The id of its connection
+   * @param worker The I/O worker the connection was handed to
+   */
+  void set_connection(int sockfd, uint64_t connection, size_t worker = 0) {
+    connections_[sockfd] = {sockfd, connection, worker};
+  }
+
+private:
+  friend class SubscribersRegistry;
+
+  struct ExactTopic {
+    TokenPattern topic{};
+    std::vector<int> subscribers_sockets{};
+  };
+
+  // A subscription of a subscriber filtering some of its topics, with its
+  // filter, empty if its messages are neither filtered nor limited
+  using Subscription = std::pair<TokenPattern, SubscriptionFilter>;
+
+  TokenInterner::TokenIds token_ids_{};
+  // keyed by the hash of the topic, as in SubscribersRegistry
+  std::unordered_multimap<std::size_t, ExactTopic> exact_subscribers_{};
+  TopicTrie<int> wildcard_subscribers_{};
+  std::unordered_map<int, Subscriber> connections_{};
+  // the subscriptions of the subscribers filtering some of their topics, by
+  // socket
+  std::unordered_map<int, std::vector<Subscription>> filtered_subscribers_{};
+  PriorityClasses priorities_{};
+};
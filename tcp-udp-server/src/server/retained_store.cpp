@@ -0,0 +1,76 @@
+#include "retained_store.hpp"
+
+auto RetainedStore::retain(const UdpMessageView &msg, const TopicView &topic,
+                           const sockaddr_in &sender, uint8_t priority)
+    -> bool {
+  auto [it, end] = topics_.equal_range(topic.hashValue());
+  for (; it != end; ++it) {
+    if (topic == entries_[it->second].topic) {
+      write_record(entries_[it->second], msg, sender, priority);
+      return true;
+    }
+  }
+  if (entries_.size() >= max_topics_) {
+    return false;
+  }
+
+  // A new topic, whose tokens are interned once
+  auto index = static_cast<uint32_t>(entries_.size());
+  auto &entry = entries_.emplace_back();
+  entry.topic = TokenPattern::from_string(msg.topic_str());
+  topics_.emplace(entry.topic.hashValue(), index);
+  Node *node = &root_;
+  for (auto token : entry.topic.tokens()) {
+    auto &next = node->children[token];
+    if (!next) {
+      next = std::make_unique<Node>();
+    }
+    node = next.get();
+  }
+  node->entry = index;
+  write_record(entry, msg, sender, priority);
+  return true;
+}
+
+void RetainedStore::write_record(Entry &entry, const UdpMessageView &msg,
+                                 const sockaddr_in &sender, uint8_t priority) {
+  size_t size = RECORD_HEADER_SIZE + msg.topic_size + msg.payload_size;
+  if (size > entry.capacity) {
+    // Moved to the end of the arena, its place being left unused
+    garbage_ += entry.capacity;
+    entry.offset = arena_.size();
+    entry.capacity = size;
+    arena_.resize(arena_.size() + size);
+  }
+  entry.size = size;
+
+  std::byte *record = arena_.data() + entry.offset;
+  std::memcpy(record, &sender.sin_addr.s_addr, sizeof(uint32_t));
+  std::memcpy(record + sizeof(uint32_t), &sender.sin_port, sizeof(uint16_t));
+  record += sizeof(uint32_t) + sizeof(uint16_t);
+  *record++ = static_cast<std::byte>(priority);
+  *record++ = static_cast<std::byte>(msg.payload_type);
+  std::memcpy(record, &msg.payload_size, sizeof(msg.payload_size));
+  record += sizeof(msg.payload_size);
+  *record++ = static_cast<std::byte>(msg.topic_size);
+  std::memcpy(record, msg.topic, msg.topic_size);
+  std::memcpy(record + msg.topic_size, msg.payload, msg.payload_size);
+
+  if (garbage_ >= MIN_COMPACTED_SIZE && garbage_ * 2 > arena_.size()) {
+    compact();
+  }
+}
+
+void RetainedStore::compact() {
+  std::vector<std::byte> arena{};
+  arena.reserve(arena_.size() - garbage_);
+  for (auto &entry : entries_) {
+    size_t offset = arena.size();
+    arena.insert(arena.end(), arena_.begin() + entry.offset,
+                 arena_.begin() + entry.offset + entry.size);
+    entry.offset = offset;
+    entry.capacity = entry.size;
+  }
+  arena_ = std::move(arena);
+  garbage_ = 0;
+}
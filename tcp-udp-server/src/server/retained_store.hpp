@@ -0,0 +1,172 @@
+#pragma once
+
+#include "token_pattern.hpp"
+#include "topic_view.hpp"
+#include "udp_proto.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <unordered_map>
+#include <vector>
+
+struct RetainedStoreConfig {
+  // Whether the last message of each topic is retained, and sent to the new
+  // subscriptions matching the topic
+  bool enabled{};
+  // The number of topics retained, the messages of the topics past it not
+  // being retained
+  size_t max_topics{65536};
+};
+
+/**
+ * @brief The last message published to each topic, sent to a subscriber as
+ * soon as it subscribes to a pattern matching the topic, so that it does not
+ * wait for the next publication to learn the current value
+ *
+ * The messages are kept in a single arena, each as the address of its
+ * publisher, its priority, the type and the size of its payload, the topic
+ * and the payload, a new message of a topic overwriting the previous one when
+ * it fits in its place. The arena is compacted once most of it holds replaced
+ * messages. The topics are indexed by a trie of their tokens, which a pattern
+ * is walked down, a '+' following every edge of a node and a '*' visiting the
+ * whole subtree, so only the topics sharing the literal prefix of a pattern
+ * are looked at.
+ */
+class RetainedStore {
+public:
+  /**
+   * @param max_topics The number of topics retained
+   */
+  explicit RetainedStore(size_t max_topics) : max_topics_(max_topics) {}
+
+  /**
+   * @brief Retain a message, in place of the last one of its topic
+   *
+   * @param msg The message, pointing to its datagram
+   * @param topic The topic of the message, parsed
+   * @param sender The address of the publisher
+   * @param priority The priority of the topic, see PriorityClasses
+   * @return false if the topic is new and the store already holds max_topics
+   */
+  auto retain(const UdpMessageView &msg, const TopicView &topic,
+              const sockaddr_in &sender, uint8_t priority) -> bool;
+
+  /**
+   * @brief Call a function with the messages of every topic matching a
+   * pattern, each visited once
+   *
+   * The function is called as visit(msg, sender, priority), the message
+   * pointing to the arena, valid until the store is changed.
+   *
+   * @param pattern The pattern, which may contain wildcards
+   * @param visit The function called with each message
+   */
+  template <typename Visitor>
+  void for_each_match(const TokenPattern &pattern, Visitor &&visit) const {
+    match(root_, pattern, 0, visit);
+  }
+
+  size_t size() const { return entries_.size(); }
+
+private:
+  using TokenId = TokenPattern::TokenId;
+
+  static constexpr uint32_t NO_ENTRY = ~uint32_t{0};
+  // the address and the priority, the type and the size of the payload and
+  // the size of the topic
+  static constexpr size_t RECORD_HEADER_SIZE =
+      sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t) +
+      sizeof(UdpPayloadType) + sizeof(uint16_t) + sizeof(uint8_t);
+  // The arena is not compacted below this size of replaced messages
+  static constexpr size_t MIN_COMPACTED_SIZE = 64 << 10;
+
+  struct Node {
+    std::unordered_map<TokenId, std::unique_ptr<Node>> children{};
+    // the entry of the topic ending at this node, if any
+    uint32_t entry{NO_ENTRY};
+  };
+
+  struct Entry {
+    TokenPattern topic{};
+    // the record of the message in the arena, and the size it may grow to in
+    // place
+    size_t offset{};
+    size_t size{};
+    size_t capacity{};
+  };
+
+  void write_record(Entry &entry, const UdpMessageView &msg,
+                    const sockaddr_in &sender, uint8_t priority);
+  void compact();
+
+  template <typename Visitor>
+  void visit_entry(uint32_t index, Visitor &visit) const {
+    const std::byte *record = arena_.data() + entries_[index].offset;
+    sockaddr_in sender{};
+    sender.sin_family = AF_INET;
+    // Already in network byte order
+    std::memcpy(&sender.sin_addr.s_addr, record, sizeof(uint32_t));
+    std::memcpy(&sender.sin_port, record + sizeof(uint32_t), sizeof(uint16_t));
+    record += sizeof(uint32_t) + sizeof(uint16_t);
+    auto priority = static_cast<uint8_t>(*record++);
+
+    UdpMessageView msg{};
+    msg.payload_type = static_cast<UdpPayloadType>(*record++);
+    std::memcpy(&msg.payload_size, record, sizeof(msg.payload_size));
+    record += sizeof(msg.payload_size);
+    msg.topic_size = static_cast<uint8_t>(*record++);
+    msg.topic = reinterpret_cast<const char *>(record);
+    msg.payload = record + msg.topic_size;
+    visit(static_cast<const UdpMessageView &>(msg),
+          static_cast<const sockaddr_in &>(sender), priority);
+  }
+
+  template <typename Visitor>
+  void match(const Node &node, const TokenPattern &pattern, size_t index,
+             Visitor &visit) const {
+    const auto &tokens = pattern.tokens();
+    if (index == tokens.size()) {
+      if (node.entry != NO_ENTRY) {
+        visit_entry(node.entry, visit);
+      }
+      return;
+    }
+
+    auto token = tokens[index];
+    if (token == TokenInterner::STAR_ID) {
+      // The tokens matched by the '*' are not known in advance
+      match_subtree(node, pattern, visit);
+    } else if (token == TokenInterner::PLUS_ID) {
+      for (const auto &[id, child] : node.children) {
+        match(*child, pattern, index + 1, visit);
+      }
+    } else if (auto it = node.children.find(token);
+               it != node.children.end()) {
+      match(*it->second, pattern, index + 1, visit);
+    }
+  }
+
+  template <typename Visitor>
+  void match_subtree(const Node &node, const TokenPattern &pattern,
+                     Visitor &visit) const {
+    if (node.entry != NO_ENTRY &&
+        pattern.matches(entries_[node.entry].topic)) {
+      visit_entry(node.entry, visit);
+    }
+    for (const auto &[id, child] : node.children) {
+      match_subtree(*child, pattern, visit);
+    }
+  }
+
+  size_t max_topics_{};
+  std::vector<Entry> entries_{};
+  // the entries by the hash of their topic, so that a TopicView is looked up
+  // without building a TokenPattern
+  std::unordered_multimap<std::size_t, uint32_t> topics_{};
+  Node root_{};
+  std::vector<std::byte> arena_{};
+  // the bytes of the arena no longer holding a message
+  size_t garbage_{};
+};
@@ -1,33 +1,334 @@
 #include "server.hpp"
 
+#include "alloc_tracking.hpp"
+#include "async_log.hpp"
+#include "content_filter.hpp"
 #include "tcp_proto.hpp"
 #include "tcp_utils.hpp"
 #include "udp_proto.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <sstream>
 #include <stdexcept>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 using namespace std::literals;
 
-Server::Server(uint16_t port) {
-  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_fd_ < 0) {
-    listen_fd_ = -1;
-    throw std::runtime_error("Failed to create TCP socket");
+namespace {
+
+/**
+ * @brief Record the duration of a stage of the loop, and start the next one
+ *
+ * @param stage The histogram of the stage
+ * @param start When the stage started, set to now
+ */
+void record_stage(ShardedHistogram &stage,
+                  std::chrono::steady_clock::time_point &start) {
+  auto now = std::chrono::steady_clock::now();
+  stage.record(static_cast<uint64_t>(
+      std::chrono::nanoseconds(now - start).count()));
+  start = now;
+}
+
+} // namespace
+
+Server::Server(uint16_t port, const OutputQueueConfig &queue_config,
+               size_t threads, IoBackend backend,
+               const MessageStoreConfig &store_config,
+               const BrokerStatsConfig &stats_config,
+               const KeepaliveConfig &keepalive_config,
+               const AcceptConfig &accept_config,
+               const MulticastConfig &multicast_config,
+               const PriorityClasses &priorities,
+               const FederationConfig &federation_config,
+               const RegistryCheckpointConfig &checkpoint_config,
+               const UdpReceiveConfig &udp_config,
+               const RetainedStoreConfig &retained_config,
+               const AdmissionConfig &admission_config,
+               const HandoffConfig &handoff_config,
+               const QuotaConfig &quota_config,
+               const PlacementConfig &placement_config,
+               const CaptureConfig &capture_config,
+               const MatchConfig &match_config)
+    : udp_batch_(udp_config.gro), udp_receive_buffer_(udp_config.receive_buffer),
+      udp_gro_(udp_config.gro),
+      admission_config_(admission_config),
+      queue_config_(queue_config), threads_(std::max<size_t>(threads, 1)),
+      subscribers_registry_(!store_config.directory.empty(),
+                            multicast_config.group.sin_port != 0
+                                ? std::max<size_t>(multicast_config.threshold, 1)
+                                : 0,
+                            priorities, !federation_config.peers.empty(),
+                            quota_config.subscription_bytes,
+                            match_config.shards),
+      checkpoint_file_(checkpoint_config.file),
+      checkpoint_interval_(
+          std::max(checkpoint_config.interval, std::chrono::milliseconds(1))),
+      handoff_command_(handoff_config.command),
+      placement_(placement_config), steering_(placement_config, threads_),
+      accept_thread_(accept_config.thread), backend_(backend) {
+  // A lane of the output queues for each priority
+  queue_config_.lanes = priorities.lanes();
+  if ((!placement_config.ingest_cpus.empty() ||
+       !placement_config.worker_cpus.empty() ||
+       placement_config.steer_connections) &&
+      threads_ == 1) {
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("The placement of the threads requires several "
+                             "threads");
+  }
+  if (queue_config_.write_quantum > 0 &&
+      (backend_ != IoBackend::EPOLL || threads_ > 1)) {
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("The write scheduling runs on a single thread, "
+                             "with epoll");
+  }
+  if (quota_config.queued_bytes > 0) {
+    if (threads_ > 1) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error("The budget of the output queues is kept on a "
+                               "single thread");
+    }
+    queue_config_.queue_budget = quota_config.queued_bytes;
+    queue_config_.budget_used = &queue_budget_used_;
+  }
+
+  // The state of the process taken over from, whose registry is more recent
+  // than its checkpoint
+  std::optional<HandoffState> handoff{};
+  if (handoff_config.fd >= 0) {
+    if (backend_ != IoBackend::EPOLL || threads_ > 1 ||
+        !store_config.directory.empty()) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error("The handoff runs on a single thread, with "
+                               "epoll and without the store-and-forward");
+    }
+    try {
+      handoff = receive_handoff(handoff_config.fd);
+    } catch (const std::exception &) {
+      close(handoff_config.fd);
+      listen_fd_ = udp_fd_ = -1;
+      throw;
+    }
+    if (!subscribers_registry_.load(handoff->registry.data(),
+                                    handoff->registry.size())) {
+      log_error("Ignoring the invalid registry of the handoff");
+    }
+    checkpoint_dirty_ = true;
+  } else {
+    // The subscribers of the previous run, before any connects again
+    load_checkpoint();
+  }
+  if (backend_ == IoBackend::IO_URING && threads_ > 1) {
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("The io_uring backend runs on a single thread");
+  }
+  if (backend_ == IoBackend::IO_URING && accept_thread_) {
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error(
+        "The io_uring backend accepts the connections itself");
+  }
+  if (!store_config.directory.empty()) {
+    if (backend_ != IoBackend::EPOLL || threads_ > 1) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error(
+          "The store-and-forward runs on a single thread, with epoll");
+    }
+    store_ = std::make_unique<MessageStore>(store_config);
+    // A subscriber closing its socket during a sendfile raises it, which
+    // cannot be masked by a flag as for sendmsg
+    signal(SIGPIPE, SIG_IGN);
+  }
+  if (stats_config.enabled) {
+    stats_ = std::make_unique<BrokerStats>();
+    // Recorded by the output queues of the connections, on the thread
+    // sending them
+    queue_config_.receive_to_send_ns = &stats_->receive_to_send_ns;
+    queue_config_.lane_receive_to_send_ns =
+        stats_->lane_receive_to_send_ns.data();
+    stats_->lanes = priorities.lanes();
+    stats_->topics = TopicHeat(stats_config.top_topics);
+    if (!stats_config.file.empty()) {
+      stats_file_.open(stats_config.file, std::ios::app);
+      if (!stats_file_) {
+        listen_fd_ = udp_fd_ = -1;
+        throw std::runtime_error("Failed to open the statistics file " +
+                                 stats_config.file);
+      }
+      stats_interval_ = std::max(stats_config.interval,
+                                 std::chrono::milliseconds(1));
+      next_stats_dump_ = std::chrono::steady_clock::now() + stats_interval_;
+    }
+  }
+  if (!capture_config.file.empty()) {
+    if (threads_ > 1) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error("The capture runs on a single thread");
+    }
+    try {
+      capture_ = std::make_unique<CaptureWriter>(capture_config.file);
+    } catch (const std::exception &) {
+      listen_fd_ = udp_fd_ = -1;
+      throw;
+    }
+  }
+  if (multicast_config.group.sin_port != 0) {
+    if (threads_ > 1) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error("The multicast group is sent on a single thread");
+    }
+    try {
+      multicast_ = std::make_unique<MulticastEgress>(multicast_config);
+    } catch (const std::exception &) {
+      listen_fd_ = udp_fd_ = -1;
+      throw;
+    }
+  }
+  if (admission_config.enabled()) {
+    admission_ = std::make_unique<AdmissionControl>(admission_config);
+  }
+  if (retained_config.enabled) {
+    if (threads_ > 1) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error("The retained messages are kept on a single "
+                               "thread");
+    }
+    retained_ = std::make_unique<RetainedStore>(retained_config.max_topics);
+  }
+  if (!federation_config.peers.empty()) {
+    if (backend_ != IoBackend::EPOLL || threads_ > 1) {
+      listen_fd_ = udp_fd_ = -1;
+      throw std::runtime_error(
+          "The federation runs on a single thread, with epoll");
+    }
+    // Connected once the server runs
+    for (const auto &peer : federation_config.peers) {
+      peer_links_.push_back(std::make_unique<PeerLink>(peer, federation_config));
+    }
+  }
+  if (keepalive_config.heartbeat_interval.count() > 0 ||
+      keepalive_config.idle_timeout.count() > 0) {
+    keepalive_config_ = keepalive_config;
+    keepalive_timers_ = std::make_unique<TimerWheel>(
+        KEEPALIVE_TICK, std::chrono::steady_clock::now());
+    auto heartbeat = std::make_shared<OutgoingMessage>();
+    heartbeat->bytes.assign(TCP_HEARTBEAT_FRAME.begin(),
+                            TCP_HEARTBEAT_FRAME.end());
+    heartbeat_ = std::move(heartbeat);
+  }
+
+  if (handoff) {
+    // Already bound, with the connections and the packets received meanwhile
+    listen_fd_ = handoff->listen_fd;
+    udp_fd_ = handoff->udp_fd;
+  } else {
+    // The socket is drained of its connections, as its events are
+    // edge-triggered
+    listen_fd_ =
+        socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+      listen_fd_ = -1;
+      throw std::runtime_error("Failed to create TCP socket");
+    }
+
+    udp_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_fd_ < 0) {
+      close(listen_fd_);
+      udp_fd_ = -1;
+      throw std::runtime_error("Failed to create UDP socket");
+    }
+  }
+
+  // The UDP ingest threads bind their own sockets to the same port
+  int enable = 1;
+  if (threads_ > 1 && setsockopt(udp_fd_, SOL_SOCKET, SO_REUSEPORT, &enable,
+                                 sizeof(enable)) < 0) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set SO_REUSEPORT on UDP socket");
+  }
+
+  // Nagle's algorithm is disabled for the clients, whose sockets inherit the
+  // option from the listening socket
+  if (setsockopt(listen_fd_, IPPROTO_TCP, TCP_NODELAY, &enable,
+                 sizeof(enable)) < 0) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set TCP_NODELAY on TCP socket");
+  }
+  // As are the limits of their send queues in the kernel
+  int send_buffer = static_cast<int>(queue_config_.send_buffer);
+  if (send_buffer > 0 && setsockopt(listen_fd_, SOL_SOCKET, SO_SNDBUF,
+                                    &send_buffer, sizeof(send_buffer)) < 0) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set SO_SNDBUF on TCP socket");
+  }
+  int notsent_lowat = static_cast<int>(queue_config_.notsent_lowat);
+  if (notsent_lowat > 0 &&
+      setsockopt(listen_fd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat,
+                 sizeof(notsent_lowat)) < 0) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set TCP_NOTSENT_LOWAT on TCP socket");
   }
 
-  udp_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
-  if (udp_fd_ < 0) {
+  // The kernel timestamps the packets, for the receive-to-send latencies
+  if (stats_ && setsockopt(udp_fd_, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                           sizeof(enable)) < 0) {
     close(listen_fd_);
-    udp_fd_ = -1;
-    throw std::runtime_error("Failed to create UDP socket");
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set SO_TIMESTAMPNS on UDP socket");
+  }
+  // And counts the packets it drops, the receive buffer being full, in the
+  // control messages of each packet
+  if (stats_ && setsockopt(udp_fd_, SOL_SOCKET, SO_RXQ_OVFL, &enable,
+                           sizeof(enable)) < 0) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set SO_RXQ_OVFL on UDP socket");
+  }
+
+  // A burst of publications waits in the receive buffer instead of being
+  // dropped while the event loop is busy
+  if (!UdpBatch::set_receive_buffer(udp_fd_, udp_receive_buffer_)) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set SO_RCVBUF on UDP socket");
+  }
+  if (stats_) {
+    stats_->udp_receive_buffer = UdpBatch::receive_buffer(udp_fd_);
+  }
+
+  // The datagrams of a publisher are coalesced by the kernel, set either way
+  // as the socket of a handoff keeps the option of the previous process
+  if (!UdpBatch::set_gro(udp_fd_, udp_gro_)) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to set UDP_GRO on UDP socket");
   }
 
   sockaddr_in addr{};
@@ -35,31 +336,121 @@ Server::Server(uint16_t port) {
   addr.sin_addr.s_addr = hton(INADDR_ANY);
   addr.sin_port = hton(port);
 
-  if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+  if (!handoff &&
+      bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
     close(listen_fd_);
     close(udp_fd_);
     listen_fd_ = udp_fd_ = -1;
     throw std::runtime_error("Failed to bind TCP socket");
   }
 
-  if (bind(udp_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+  if (!handoff &&
+      bind(udp_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
     close(listen_fd_);
     close(udp_fd_);
     listen_fd_ = udp_fd_ = -1;
     throw std::runtime_error("Failed to bind UDP socket");
   }
 
-  if (listen(listen_fd_, 0) < 0) {
+  // A storm of connections, as when the subscribers reconnect after a restart,
+  // waits in the backlog instead of being refused
+  if (listen(listen_fd_, accept_config.backlog) < 0) {
     close(listen_fd_);
     close(udp_fd_);
     listen_fd_ = udp_fd_ = -1;
     throw std::runtime_error("Failed to listen on TCP socket");
   }
 
-  // Register the initial pollfds
-  register_pollfd(listen_fd_, POLLIN);
-  register_pollfd(udp_fd_, POLLIN);
-  register_pollfd(STDIN_FILENO, POLLIN);
+  if (backend_ == IoBackend::IO_URING) {
+    try {
+      uring_ = std::make_unique<IoUring>(URING_ENTRIES);
+      tcp_buffers_ = std::make_unique<IoUringBufferRing>(
+          *uring_, TCP_BUFFER_GROUP, TCP_BUFFERS, TCP_BUFFER_SIZE);
+      udp_buffers_ = std::make_unique<IoUringBufferRing>(
+          *uring_, UDP_BUFFER_GROUP, UDP_BUFFERS, UDP_BUFFER_SIZE);
+    } catch (const std::exception &) {
+      udp_buffers_.reset();
+      tcp_buffers_.reset();
+      uring_.reset();
+      close(listen_fd_);
+      close(udp_fd_);
+      listen_fd_ = udp_fd_ = -1;
+      throw;
+    }
+
+    // As with epoll, a regular file cannot be watched
+    struct stat stdin_stat {};
+    read_stdin_ = fstat(STDIN_FILENO, &stdin_stat) == 0 &&
+                  !S_ISREG(stdin_stat.st_mode) && !S_ISDIR(stdin_stat.st_mode);
+    if (!read_stdin_) {
+      log_error("Not reading commands from stdin");
+    }
+    if (!stats_config.metrics_socket.empty()) {
+      try {
+        open_metrics_socket(stats_config.metrics_socket);
+      } catch (const std::exception &) {
+        udp_buffers_.reset();
+        tcp_buffers_.reset();
+        uring_.reset();
+        close(listen_fd_);
+        close(udp_fd_);
+        listen_fd_ = udp_fd_ = -1;
+        throw;
+      }
+    }
+    return;
+  }
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    close(listen_fd_);
+    close(udp_fd_);
+    listen_fd_ = udp_fd_ = -1;
+    throw std::runtime_error("Failed to create the epoll instance");
+  }
+
+  // Register the initial fds, the listening socket being watched by the
+  // acceptor thread instead, once it runs
+  try {
+    if (!accept_thread_) {
+      listen_context_.fd = listen_fd_;
+      register_fd(listen_context_, EPOLLIN | EPOLLET);
+    }
+    // Otherwise, the UDP socket is read by the ingest threads
+    if (threads_ == 1) {
+      udp_context_.fd = udp_fd_;
+      register_fd(udp_context_, EPOLLIN | EPOLLET);
+    }
+    // Level-triggered, the connections being accepted a batch at a time
+    if (!stats_config.metrics_socket.empty()) {
+      open_metrics_socket(stats_config.metrics_socket);
+      register_fd(metrics_context_, EPOLLIN);
+    }
+  } catch (const std::exception &) {
+    if (metrics_context_.fd >= 0) {
+      close(metrics_context_.fd);
+      metrics_context_.fd = -1;
+    }
+    close(listen_fd_);
+    close(udp_fd_);
+    close(epoll_fd_);
+    listen_fd_ = udp_fd_ = epoll_fd_ = -1;
+    throw;
+  }
+
+  // Level-triggered, as std::cin reads a single command at a time. A regular
+  // file cannot be watched, in which case there are no commands.
+  stdin_context_.fd = STDIN_FILENO;
+  try {
+    register_fd(stdin_context_, EPOLLIN);
+  } catch (const std::exception &e) {
+    log_error("Not reading commands from stdin: ", e.what());
+  }
+
+  if (handoff) {
+    adopt_connections(*handoff);
+    acknowledge_handoff(handoff_config.fd);
+  }
 }
 
 Server::~Server() {
@@ -69,254 +460,1022 @@ Server::~Server() {
   if (udp_fd_ >= 0) {
     close(udp_fd_);
   }
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+  if (metrics_context_.fd >= 0) {
+    close(metrics_context_.fd);
+    // Unless bound again by the process taking over
+    if (!handed_off_) {
+      unlink(metrics_path_.c_str());
+    }
+  }
 }
 
 /**
- * @brief Register a pollfd with the server
+ * @brief Register a file descriptor with the epoll instance
+ *
+ * The context is given back with the events of the file descriptor, so it
+ * must live as long as it is registered.
  *
- * This function adds a new pollfd to the poll_fds_ vector.
+ * @param context The context of the file descriptor to register
+ * @param events The events to monitor (e.g., EPOLLIN, EPOLLOUT, EPOLLET)
  *
- * @param fd The file descriptor to register
- * @param events The events to monitor (e.g., POLLIN, POLLOUT)
+ * @throws std::runtime_error if the registration fails
  */
-void Server::register_pollfd(int fd, short events) {
-  pollfd pfd{};
-  pfd.fd = fd;
-  pfd.events = events;
-  poll_fds_.push_back(pfd);
+void Server::register_fd(EventContext &context, uint32_t events) {
+  epoll_event event{};
+  event.events = events;
+  event.data.ptr = &context;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, context.fd, &event) < 0) {
+    throw std::runtime_error("Failed to register fd with epoll: " +
+                             std::string(std::strerror(errno)));
+  }
 }
 
 /**
- * @brief Unregister a pollfd from the server
+ * @brief Start the threads of the multi-threaded mode
  *
- * This function closes the file descriptor and removes it from the poll_fds_
- * vector.
+ * @throws std::runtime_error if a thread or its socket cannot be created
+ */
+void Server::start_threads() {
+  // The i-th thread on the i-th CPU of its list
+  auto cpu = [](const std::vector<int> &cpus, size_t i) {
+    return cpus.empty() ? -1 : cpus[i % cpus.size()];
+  };
+  for (size_t i = 0; i < threads_; ++i) {
+    io_workers_.push_back(std::make_unique<IoWorker>(
+        queue_config_, stats_.get(), cpu(placement_.worker_cpus, i)));
+  }
+  publish_snapshot();
+
+  sockaddr_in addr{};
+  socklen_t addr_len = sizeof(addr);
+  if (getsockname(udp_fd_, reinterpret_cast<sockaddr *>(&addr), &addr_len) <
+      0) {
+    throw std::runtime_error("Failed to get the address of the UDP socket");
+  }
+
+  // The first ingest thread reads the socket of the server
+  for (size_t i = 0; i < threads_; ++i) {
+    int fd = i == 0 ? dup(udp_fd_) : open_ingest_socket(addr);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open the UDP socket of an ingest "
+                               "thread: " +
+                               std::string(std::strerror(errno)));
+    }
+    udp_ingests_.push_back(std::make_unique<UdpIngest>(
+        fd, snapshot_, io_workers_, stats_.get(), admission_config_,
+        cpu(placement_.ingest_cpus, i), udp_gro_));
+  }
+
+  // Once all the sockets of the ingest threads are in the reuseport group
+  if (placement_.steer_topics) {
+    attach_topic_steering(udp_fd_, threads_);
+  }
+}
+
+/**
+ * @brief Stop the threads of the multi-threaded mode, the ingest threads
+ * first as they hand the messages to the workers
+ */
+void Server::stop_threads() {
+  udp_ingests_.clear();
+  io_workers_.clear();
+}
+
+/**
+ * @brief Open a UDP socket bound to the same address as the one of the
+ * server, with SO_REUSEPORT
  *
- * @param pollfd_index The index of the pollfd to unregister
+ * @param addr The address of the UDP socket of the server
+ * @return The socket, or -1 if it cannot be opened
+ */
+auto Server::open_ingest_socket(const sockaddr_in &addr) -> int {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int enable = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ||
+      !UdpBatch::set_receive_buffer(fd, udp_receive_buffer_) ||
+      !UdpBatch::set_gro(fd, udp_gro_) ||
+      bind(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Make the current subscriptions visible to the UDP ingest threads
  */
-void Server::unregister_pollfd(size_t pollfd_index) {
+void Server::publish_snapshot() {
+  auto snapshot = subscribers_registry_.snapshot();
+  for (const auto &[sockfd, connection] : connections_) {
+    snapshot->set_connection(sockfd, connection->id, connection->worker);
+  }
+
+  std::atomic_store(&snapshot_, std::shared_ptr<const RegistrySnapshot>(
+                                    std::move(snapshot)));
+  snapshot_dirty_ = false;
+}
 
-  if (poll_fds_[pollfd_index].fd > 0) {
-    close(poll_fds_[pollfd_index].fd);
+/**
+ * @brief Close the socket of a client connection
+ *
+ * This function closes the file descriptor, which also removes it from the
+ * epoll instance, and drops the messages queued for it. The connection is
+ * only freed after the current events, which may still point to it.
+ *
+ * With io_uring, the socket is shut down instead, so that the requests about
+ * it complete, and closed after them: its fd cannot be reused meanwhile.
+ *
+ * @param connection The connection to close
+ */
+void Server::close_connection(Connection &connection) {
+  auto it = connections_.find(connection.fd);
+  if (it == connections_.end()) {
+    return;
+  }
+  if (keepalive_timers_) {
+    keepalive_timers_->cancel(connection);
+  }
+  if (capture_) {
+    capture_->connection(CaptureKind::DISCONNECT, connection.id);
   }
 
-  poll_fds_[pollfd_index] = poll_fds_.back();
-  poll_fds_.pop_back();
+  if (threads_ > 1) {
+    // The worker of the connection closes its socket, after the messages
+    // already handed to it
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection.fd, nullptr);
+    io_workers_[connection.worker]->remove_connection(connection.fd);
+  } else if (uring_ && connection.inflight_ops > 0) {
+    shutdown(connection.fd, SHUT_RDWR);
+    connection.closing_fd = connection.fd;
+    connection.fd = -1;
+    connection.output_queue.clear();
+    closing_connections_.emplace(&connection, std::move(it->second));
+    connections_.erase(it);
+    return;
+  } else {
+    close(connection.fd);
+  }
+  connection.fd = -1;
+  connection.output_queue.clear();
+  closed_connections_.push_back(std::move(it->second));
+  connections_.erase(it);
 }
 
 /**
  * @brief Handle commands from stdin
  *
- * At the moment, it only handles the "exit" command to stop the server, but the
- * functionality could be extended.
+ * The "exit" command stops the server, the "handoff" command stops it once
+ * it handed its sockets to a new process started with its command, the
+ * "stats" command prints the statistics as a line of JSON, if they are
+ * collected, the "stats topics" command only the most published topics, the
+ * "stats metrics" command the statistics in the Prometheus text format, and
+ * the "allocs" command the allocations made in the no-allocation scopes, if
+ * they are tracked, "allocs arm" arming their checks first.
  *
  * @param stop A reference to a boolean that indicates whether the server should
  * stop
  */
 void Server::handle_stdin_cmd(bool &stop) {
+  std::string line;
+  std::getline(std::cin, line);
+  std::istringstream words(line);
   std::string input;
-  std::cin >> input;
+  std::string argument;
+  words >> input >> argument;
 
   if (input == "exit") {
     // Stop the server
     stop = true;
     return;
   }
-}
 
-/**
- * @brief Handle an incoming UDP packet (message)
- *
- * @return std::optional<sockaddr_in> The address of the sender, or std::nullopt
- * if an error occurred or the packet was invalid
- */
-auto Server::handle_udp_msg() -> std::optional<sockaddr_in> {
-  sockaddr_in addr{};
-  socklen_t addr_len = sizeof(addr);
-  ssize_t bytes_received =
-      recvfrom(udp_fd_, udp_buffer_.data(), udp_buffer_.size(), 0,
-               reinterpret_cast<sockaddr *>(&addr), &addr_len);
+  if (input == "handoff") {
+    stop = hand_off();
+    return;
+  }
 
-  if (bytes_received < 0) {
-    std::cerr << "Error receiving UDP packet: " << std::strerror(errno)
-              << std::endl;
-    return std::nullopt;
+  if (input == "allocs") {
+#ifdef ENABLE_ALLOC_TRACKING
+    if (argument == "arm") {
+      alloc_tracking::arm();
+    }
+    std::cout << alloc_tracking::report();
+    std::cout.flush();
+#else
+    log_error("The allocations are not tracked, see ALLOC_TRACKING");
+#endif
+    return;
   }
 
-  try {
-    UdpMessage::deserialize(udp_msg_, udp_buffer_.data(), bytes_received);
-    return addr;
-  } catch (const std::invalid_argument &e) {
-    std::cerr << "Error deserializing UDP payload: " << e.what() << std::endl;
-    return std::nullopt;
+  if (input == "stats") {
+    if (!stats_) {
+      log_error("The statistics are not collected, see SERVER_STATS");
+      return;
+    }
+    if (argument == "topics") {
+      write_top_topics(std::cout);
+    } else if (argument == "metrics") {
+      write_metrics(std::cout);
+    } else {
+      write_stats(std::cout);
+    }
+    std::cout.flush();
   }
 }
 
 /**
- * @brief Prepare the TCP response based on the UDP message
+ * @brief Hand the listening socket, the UDP socket and the connections, with
+ * the registry, to a new process started with the command of the server, so
+ * that it takes over without the subscribers reconnecting
  *
- * This function populates the `tcp_msg_` member with the appropriate
- * TcpResponse.
- * This function does not send the message, nor does it serialize the response.
- * After calling this function, the `tcp_msg_` member can be serialized and
- * transmitted.
+ * The new process is sent its state on a Unix socket, the sockets being
+ * passed with SCM_RIGHTS, and the server keeps running if it does not
+ * acknowledge it in HANDOFF_TIMEOUT. The brokers of the federation are not
+ * handed, as they send their interest again once they reconnect.
  *
- * @param udp_sender_addr The address of the UDP sender
+ * @return true if the new process took over, the server having to stop then
  */
-void Server::prepare_tcp_response(const sockaddr_in &udp_sender_addr) {
-  // Prepare the TCP response
-  tcp_msg_.payload.emplace<TcpResponse>();
-  auto &response = std::get<TcpResponse>(tcp_msg_.payload);
-
-  response.udp_client_ip = udp_sender_addr.sin_addr.s_addr;
-  response.udp_client_port = udp_sender_addr.sin_port;
-
-  // Set the topic
-  response.topic_size = udp_msg_.topic_size;
-  std::memcpy(response.topic.data(), udp_msg_.topic.data(),
-              udp_msg_.topic_size);
-
-  // Set the payload
-  switch (udp_msg_.payload_type()) {
-  case UdpPayloadType::INT: {
-    response.payload.emplace<TcpResponsePayloadInt>();
-
-    auto &udp_payload = std::get<UdpPayloadInt>(udp_msg_.payload);
-    auto &tcp_payload = std::get<TcpResponsePayloadInt>(response.payload);
-
-    tcp_payload.sign = udp_payload.sign;
-    tcp_payload.value = udp_payload.value;
-
-    break;
+auto Server::hand_off() -> bool {
+  if (handoff_command_.empty() || uring_ || threads_ > 1 || store_) {
+    log_error("The handoff runs on a single thread, with epoll and without "
+              "the store-and-forward");
+    return false;
   }
-  case UdpPayloadType::SHORT_REAL: {
-    response.payload.emplace<TcpResponsePayloadShortReal>();
 
-    auto &udp_payload = std::get<UdpPayloadShortReal>(udp_msg_.payload);
-    auto &tcp_payload = std::get<TcpResponsePayloadShortReal>(response.payload);
-
-    tcp_payload.value = udp_payload.value;
-    break;
+  HandoffChild child{};
+  try {
+    child = spawn_handoff_child(handoff_command_, HANDOFF_TIMEOUT);
+  } catch (const std::exception &e) {
+    log_error("Failed to start the handoff: ", e.what());
+    return false;
   }
-  case UdpPayloadType::FLOAT: {
-    response.payload.emplace<TcpResponsePayloadFloat>();
-
-    auto &udp_payload = std::get<UdpPayloadFloat>(udp_msg_.payload);
-    auto &tcp_payload = std::get<TcpResponsePayloadFloat>(response.payload);
 
-    tcp_payload.sign = udp_payload.sign;
-    tcp_payload.value = udp_payload.value;
-    tcp_payload.exponent = udp_payload.exponent;
-    break;
+  // The connections accepted meanwhile wait in the backlog of the socket
+  if (acceptor_) {
+    acceptor_->stop();
+    accept_handed_clients();
+  }
+  auto state = collect_handoff();
+  bool acknowledged = false;
+  try {
+    send_handoff(child.fd, state);
+    acknowledged = wait_handoff_ack(child.fd);
+  } catch (const std::exception &e) {
+    log_error("Failed to hand off: ", e.what());
+  }
+  close(child.fd);
+  if (acknowledged) {
+    log_error("Handed off to process ", child.pid);
+    handed_off_ = true;
+    // Closed at once, so that nothing else is sent on them, the new process
+    // keeping them open
+    for (const auto &handed : state.connections) {
+      if (auto it = connections_.find(handed.fd); it != connections_.end()) {
+        close_connection(*it->second);
+      }
+    }
+    return true;
   }
-  case UdpPayloadType::STRING: {
-    response.payload.emplace<TcpResponsePayloadString>();
-
-    auto &udp_payload = std::get<UdpPayloadString>(udp_msg_.payload);
-    auto &tcp_payload = std::get<TcpResponsePayloadString>(response.payload);
 
-    tcp_payload.value_size = udp_payload.value_size;
-    std::memcpy(tcp_payload.value.data(), udp_payload.value.data(),
-                udp_payload.value_size);
-    break;
+  log_error("The handoff was not acknowledged, resuming");
+  kill(child.pid, SIGKILL);
+  waitpid(child.pid, nullptr, 0);
+  // The messages taken from the queues are sent first
+  for (auto &handed : state.connections) {
+    auto it = connections_.find(handed.fd);
+    if (it != connections_.end() && !handed.output.empty()) {
+      auto message = std::make_shared<OutgoingMessage>();
+      message->bytes = std::move(handed.output);
+      it->second->output_queue.restore(std::move(message));
+      flush_connection(*it->second);
+    }
   }
-  default:
-    unreachable();
-    break;
+  if (acceptor_) {
+    acceptor_ = std::make_unique<Acceptor>(listen_fd_);
+    acceptor_context_.fd = acceptor_->event_fd();
+    register_fd(acceptor_context_, EPOLLIN | EPOLLET);
   }
+  return false;
 }
 
 /**
- * @brief Fetch the TCP request from the socket
- *
- * @param sockfd The socket file descriptor of the client
+ * @brief Collect the state handed to the process taking over: the sockets,
+ * the registry and, for each connection, the bytes of its requests not
+ * received whole and those of its messages not sent yet, taken from its queue
  *
- * @throws TcpSocketException if the receive operation fails
- * @throws std::invalid_argument if the message is invalid
+ * @return The state
  */
-void Server::fetch_tcp_request(int sockfd) {
-  uint8_t payload_type{};
-  recv_all(sockfd, reinterpret_cast<std::byte *>(&payload_type),
-           sizeof(payload_type));
+auto Server::collect_handoff() -> HandoffState {
+  HandoffState state{};
+  state.listen_fd = listen_fd_;
+  state.udp_fd = udp_fd_;
+  subscribers_registry_.save(state.registry);
+
+  std::array<iovec, OutputQueue::IOV_BATCH> iov{};
+  for (const auto &[sockfd, connection] : connections_) {
+    if (subscribers_registry_.is_peer(sockfd)) {
+      continue;
+    }
+    auto &handed = state.connections.emplace_back();
+    handed.fd = sockfd;
+    if (subscribers_registry_.is_subscriber_connected(sockfd)) {
+      handed.id = subscribers_registry_.get_subscriber_id(sockfd);
+      // The ring is left to the subscriber, the new process using the socket
+      handed.flags = connection->connect_flags & ~TCP_CONNECT_SHM;
+    }
+    connection->input.copy(handed.input);
 
-  if (static_cast<TcpMessageType>(payload_type) != TcpMessageType::REQUEST) {
-    throw std::invalid_argument("Invalid TCP message type: not a request");
+    auto &queue = connection->output_queue;
+    if (connection->batch_encoder) {
+      connection->batch_encoder->flush(queue);
+    }
+    while (!queue.empty()) {
+      size_t count = queue.prepare(iov.data(), iov.size());
+      size_t size = 0;
+      for (size_t i = 0; i < count; ++i) {
+        const auto *base = static_cast<const std::byte *>(iov[i].iov_base);
+        handed.output.insert(handed.output.end(), base, base + iov[i].iov_len);
+        size += iov[i].iov_len;
+      }
+      queue.consume(size);
+    }
   }
+  return state;
+}
 
-  uint16_t payload_size{};
-  recv_all(sockfd, reinterpret_cast<std::byte *>(&payload_size),
-           sizeof(payload_size));
-  payload_size = ntoh(payload_size);
-
-  if (payload_size > TcpMessage::MAX_SERIALIZED_SIZE) {
-    throw std::invalid_argument("Invalid TCP message: size exceeds max limit");
+/**
+ * @brief Watch the connections handed by the process taken over from, the
+ * subscribers among them being connected again with their flags
+ *
+ * @param state The state handed, whose connections are taken
+ */
+void Server::adopt_connections(HandoffState &state) {
+  for (auto &handed : state.connections) {
+    int sockfd = handed.fd;
+    add_connection(sockfd);
+    auto it = connections_.find(sockfd);
+    if (it == connections_.end()) {
+      continue;
+    }
+    auto &connection = *it->second;
+    connection.input.append(handed.input.data(), handed.input.size());
+
+    if (!handed.id.empty()) {
+      try {
+        subscribers_registry_.connect_subscriber(
+            sockfd, handed.id,
+            multicast_ && (handed.flags & TCP_CONNECT_MULTICAST));
+      } catch (const std::exception &e) {
+        log_error("Failed to adopt the connection of ", handed.id, ": ",
+                  e.what());
+        close_connection(connection);
+        continue;
+      }
+      set_connect_flags(connection, handed.flags);
+    }
+    if (!handed.output.empty()) {
+      auto message = std::make_shared<OutgoingMessage>();
+      message->bytes = std::move(handed.output);
+      connection.output_queue.restore(std::move(message));
+    }
   }
+  snapshot_dirty_ = true;
+  closed_connections_.clear();
+}
 
-  recv_all(sockfd, tcp_buffer_.data(), payload_size);
-
-  tcp_msg_.payload.emplace<TcpRequest>();
-
-  TcpRequest::deserialize(std::get<TcpRequest>(tcp_msg_.payload),
-                          tcp_buffer_.data(), payload_size);
+/**
+ * @brief Write the most published topics, with their messages, deliveries and
+ * fan-out, as a line of JSON
+ *
+ * @param out The stream to write to
+ */
+void Server::write_top_topics(std::ostream &out) {
+  if (!stats_->topics.enabled()) {
+    log_error("The topics are not kept track of, see SERVER_STATS_TOP_TOPICS");
+    return;
+  }
+  out << "{\"time_ms\":" << realtime_ns() / 1000000
+      << ",\"udp_received\":" << stats_->udp_received.value()
+      << ",\"top_topics\":";
+  stats_->topics.write_json(out);
+  out << "}\n";
 }
 
 /**
- * @brief Disconnect the client and unregister the pollfd
+ * @brief Get the output queues of the connected subscribers, updating the
+ * statistics kept outside of them
  *
- * @param pollfd_index The index of the pollfd associated with the client in the
- * poll_fds_ vector
+ * @return The queues
  */
-void Server::disconnect_client(size_t pollfd_index) {
-  int sockfd = poll_fds_[pollfd_index].fd;
-  if (subscribers_registry_.is_subscriber_connected(sockfd)) {
-    subscribers_registry_.disconnect_subscriber(sockfd);
+auto Server::queue_depths() -> std::vector<BrokerStats::QueueDepth> {
+  std::vector<BrokerStats::QueueDepth> queues{};
+  queues.reserve(connections_.size());
+  for (const auto &[sockfd, connection] : connections_) {
+    if (subscribers_registry_.is_subscriber_connected(sockfd)) {
+      queues.push_back({subscribers_registry_.get_subscriber_id(sockfd),
+                        connection->output_queue.size(),
+                        subscribers_registry_.subscription_bytes(sockfd)});
+    }
   }
-  unregister_pollfd(pollfd_index);
+  stats_->queue_budget = queue_config_.queue_budget;
+  stats_->queue_budget_used = queue_budget_used_;
+  stats_->log_dropped = AsyncLog::instance().dropped();
+  stats_->log_suppressed = AsyncLog::instance().suppressed();
+  return queues;
 }
 
 /**
- * @brief Handle the TCP request from the client
+ * @brief Write the statistics, with the output queues of the connected
+ * subscribers, as a line of JSON
  *
- * @param pollfd_index The index of the pollfd associated with the client in the
- * poll_fds_ vector
+ * @param out The stream to write to
  */
-void Server::handle_tcp_request(size_t pollfd_index) {
-  int sockfd = poll_fds_[pollfd_index].fd;
+void Server::write_stats(std::ostream &out) {
+  stats_->write_json(out, queue_depths());
+}
 
-  // Use a scope guard to ensure proper cleanup and avoid code duplication
-  auto guard = make_scope_guard(
-      std::bind(&Server::disconnect_client, this, pollfd_index));
+/**
+ * @brief Write the statistics, with the output queues of the connected
+ * subscribers, in the Prometheus text format
+ *
+ * @param out The stream to write to
+ */
+void Server::write_metrics(std::ostream &out) {
+  stats_->write_prometheus(out, queue_depths());
+}
 
-  auto &request = std::get<TcpRequest>(tcp_msg_.payload);
-  switch (request.type) {
-  case TcpRequestType::CONNECT: {
+/**
+ * @brief Listen on the Unix socket the statistics are served on, replacing
+ * the file left by a previous run
+ *
+ * @param path The path of the socket
+ *
+ * @throws std::runtime_error if the socket cannot be bound
+ */
+void Server::open_metrics_socket(const std::string &path) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("The path of the metrics socket is too long");
+  }
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.data(), path.size());
 
-    if (request.payload_type() != TcpRequestPayloadType::ID) {
-      std::cerr << "Invalid payload type for CONNECT request" << std::endl;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create the metrics socket");
+  }
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    throw std::runtime_error("Failed to listen on the metrics socket " + path +
+                             ": " + std::strerror(errno));
+  }
+  metrics_context_.fd = fd;
+  metrics_path_ = path;
+}
+
+/**
+ * @brief Write the statistics to each pending connection of the metrics
+ * socket, then close it
+ *
+ * The statistics are written once for all of them, without waiting for the
+ * connections: the text fits in the send buffer of a Unix socket, whatever
+ * does not being cut off.
+ */
+void Server::serve_metrics() {
+  std::string text{};
+  while (true) {
+    int fd = accept4(metrics_context_.fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error("Failed to accept on the metrics socket: ",
+                  std::strerror(errno));
+      }
       return;
     }
 
-    if (subscribers_registry_.is_subscriber_connected(sockfd)) {
-      std::cerr << "Invalid CONNECT request: subscriber already connected"
-                << std::endl;
-      return;
+    if (text.empty()) {
+      std::ostringstream out{};
+      write_metrics(out);
+      text = out.str();
     }
+    for (size_t sent = 0; sent < text.size();) {
+      ssize_t result = send(fd, text.data() + sent, text.size() - sent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        break;
+      }
+      sent += static_cast<size_t>(result);
+    }
+    close(fd);
+  }
+}
 
-    auto &id_payload = std::get<TcpRequestPayloadId>(request.payload);
-    auto id = std::string(id_payload.id.data(), id_payload.id_size);
+/**
+ * @brief Append the statistics to their file, once their interval is over
+ */
+void Server::dump_stats() {
+  if (!stats_file_.is_open()) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (now < next_stats_dump_) {
+    return;
+  }
+  write_stats(stats_file_);
+  stats_file_.flush();
+  // The dumps missed while the event loop was busy are skipped
+  next_stats_dump_ += stats_interval_;
+  if (next_stats_dump_ <= now) {
+    next_stats_dump_ = now + stats_interval_;
+  }
+}
+
+/**
+ * @brief Load the subscribers saved by the previous run, if there is a
+ * checkpoint, starting without them if it is invalid
+ */
+void Server::load_checkpoint() {
+  if (checkpoint_file_.empty()) {
+    return;
+  }
+  std::ifstream file(checkpoint_file_, std::ios::binary);
+  if (!file) {
+    // The first run
+    return;
+  }
+  std::vector<char> data((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+  if (!subscribers_registry_.load(reinterpret_cast<const std::byte *>(
+                                      data.data()),
+                                  data.size())) {
+    log_error("Ignoring the invalid registry checkpoint ", checkpoint_file_);
+  }
+}
+
+/**
+ * @brief Save the registry to its checkpoint, atomically: written to a
+ * temporary file, synced, then renamed over the previous one, so that a crash
+ * leaves either of them whole
+ */
+void Server::save_checkpoint() {
+  subscribers_registry_.save(checkpoint_);
+  checkpoint_dirty_ = false;
+
+  std::string temp = checkpoint_file_ + ".tmp";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    log_error("Failed to open ", temp, ": ", std::strerror(errno));
+    return;
+  }
+  size_t written = 0;
+  while (written < checkpoint_.size()) {
+    ssize_t ret =
+        write(fd, checkpoint_.data() + written, checkpoint_.size() - written);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      break;
+    }
+    written += static_cast<size_t>(ret);
+  }
+  bool synced = written == checkpoint_.size() && fsync(fd) == 0;
+  close(fd);
+  if (!synced || std::rename(temp.c_str(), checkpoint_file_.c_str()) != 0) {
+    log_error("Failed to save the registry checkpoint ", checkpoint_file_, ": ",
+              std::strerror(errno));
+    unlink(temp.c_str());
+    // Saved again at the next interval
+    checkpoint_dirty_ = true;
+  }
+}
+
+/**
+ * @brief Save the registry to its checkpoint, once its interval is over, if
+ * the subscriptions changed
+ */
+void Server::checkpoint_registry() {
+  if (checkpoint_file_.empty() || !checkpoint_dirty_) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (now < next_checkpoint_) {
+    return;
+  }
+  save_checkpoint();
+  next_checkpoint_ = now + checkpoint_interval_;
+}
+
+/**
+ * @brief Send the UDP messages of a batch to their subscribers
+ *
+ * The messages are first grouped by topic, each distinct topic of the batch
+ * being parsed and matched once, then fanned out in the order they were
+ * received. The matching and the queuing run for the whole batch before the
+ * queues are flushed, so that a subscriber gets the messages of the batch with
+ * a single sendmsg.
+ *
+ * @param count The number of packets received in udp_batch_
+ */
+void Server::publish_udp_batch(size_t count) {
+  // The count is that of the socket when the packet was queued, the last
+  // packet giving the drops before the whole batch
+  if (stats_ && count > 0) {
+    record_kernel_drops(udp_batch_.drop_count(count - 1));
+  }
+  std::chrono::steady_clock::time_point stage_start{};
+  if (stats_) {
+    stage_start = std::chrono::steady_clock::now();
+  }
+  {
+    // Once the buffers of the batches and the pools of the messages are warm,
+    // the publications are parsed, matched and fanned out without allocating
+    alloc_tracking::NoAllocScope no_alloc("publish_udp_batch");
+    uint64_t now_ns = admission_ ? AdmissionControl::now_ns() : 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (capture_) {
+        capture_->datagram(udp_batch_.sender(i), udp_batch_.packet(i),
+                           udp_batch_.packet_size(i));
+      }
+      // Before the packet is parsed, a flood only costing the lookup
+      if (admission_ && !admit_udp_packet(udp_batch_.sender(i), now_ns)) {
+        continue;
+      }
+      const std::byte *packet = udp_batch_.packet(i);
+      size_t packet_size = udp_batch_.packet_size(i);
+      if (UdpMessageCursor::is_registration(packet, packet_size)) {
+        // The topics of a publisher are parsed and matched once, as it
+        // registers them
+        alloc_tracking::AllowAllocScope allow_alloc;
+        register_udp_topics(udp_batch_.sender(i), packet, packet_size);
+        continue;
+      }
+      // The messages of a datagram batching several, as those of the packets
+      for (UdpMessageCursor cursor(packet, packet_size); !cursor.done();) {
+        UdpParseError error = cursor.next(udp_msg_);
+        PublisherTopics<RegisteredTopic>::Topic *registered = nullptr;
+        if (error == UdpParseError::NONE && cursor.by_topic_id()) {
+          registered = publisher_topics_.resolve(udp_batch_.sender(i),
+                                                 cursor.topic_id(), udp_msg_);
+          if (registered == nullptr) {
+            error = UdpParseError::UNKNOWN_TOPIC_ID;
+          }
+        }
+        if (error != UdpParseError::NONE) {
+          reject_udp_msg(error);
+          continue;
+        }
+        uint32_t topic = topic_batch_.add(udp_msg_, i);
+        if (registered != nullptr) {
+          if (batch_registered_.size() <= topic) {
+            batch_registered_.resize(topic + 1);
+          }
+          batch_registered_[topic] = registered;
+        }
+      }
+    }
+
+    if (stats_ && count > 0) {
+      record_stage(stats_->parse_ns, stage_start);
+    }
+
+    const auto &topics = topic_batch_.topics();
+    batch_topics_.assign(topics.size(), BatchTopic{});
+    for (size_t i = 0; i < topics.size(); ++i) {
+      auto &batch_topic = batch_topics_[i];
+      if (i < batch_registered_.size() && batch_registered_[i] != nullptr) {
+        // Parsed and matched once for all the batches of its publisher
+        batch_topic.subscribers =
+            &registered_subscribers(*batch_registered_[i]);
+        batch_topic.topic = batch_registered_[i]->compiled.topic;
+        batch_topic.evictions = subscribers_registry_.fanout_evictions();
+      } else {
+        batch_topic.topic = TopicView::from_string(topics[i]);
+      }
+    }
+    for (const auto &message : topic_batch_.messages()) {
+      auto &batch_topic = batch_topics_[message.topic];
+      udp_msg_ = message.view;
+      if (!batch_topic.topic.has_value()) {
+        reject_topic(udp_msg_.topic_str());
+        continue;
+      }
+      // Retrieved again if the cache was emptied for a later topic
+      if (batch_topic.subscribers == nullptr ||
+          batch_topic.evictions != subscribers_registry_.fanout_evictions()) {
+        batch_topic.subscribers = &match_topic(*batch_topic.topic);
+        batch_topic.evictions = subscribers_registry_.fanout_evictions();
+      }
+      uint64_t received_ns =
+          stats_ ? udp_batch_.receive_time(message.packet) : 0;
+      fan_out_udp_msg(*batch_topic.topic, *batch_topic.subscribers,
+                      udp_batch_.sender(message.packet), received_ns, false);
+    }
+    topic_batch_.clear();
+    batch_registered_.clear();
+    publisher_topics_.release_retired();
+    if (stats_ && count > 0) {
+      record_stage(stats_->fanout_ns, stage_start);
+    }
+  }
+
+  // After the fan-out, which uses the subscribers of the registry
+  disconnect_slow_consumers();
+  flush_pending_messages();
+  if (stats_ && count > 0) {
+    record_stage(stats_->flush_ns, stage_start);
+  }
+}
+
+/**
+ * @brief Count the UDP packets dropped by the kernel since the last packet
+ * received, by the SO_RXQ_OVFL count of a packet
+ *
+ * @param drop_count The count of the packet, wrapping around, 0 if it has
+ * none
+ */
+void Server::record_kernel_drops(uint32_t drop_count) {
+  if (drop_count == 0) {
+    return;
+  }
+  stats_->udp_kernel_dropped += drop_count - udp_drop_count_;
+  udp_drop_count_ = drop_count;
+}
+
+/**
+ * @brief Check a UDP packet against the rates of its publisher and of all of
+ * them, counting it if it exceeds one
+ *
+ * @param sender The address of the publisher
+ * @param now_ns The current time of the steady clock, in nanoseconds
+ * @return true if the packet is processed
+ */
+auto Server::admit_udp_packet(const sockaddr_in &sender, uint64_t now_ns)
+    -> bool {
+  AdmissionResult result = admission_->admit(sender, now_ns);
+  if (stats_) {
+    if (result == AdmissionResult::PUBLISHER_LIMITED) {
+      ++stats_->udp_publisher_limited;
+    } else if (result == AdmissionResult::GLOBAL_LIMITED) {
+      ++stats_->udp_global_limited;
+    }
+  }
+  return result == AdmissionResult::ADMITTED;
+}
+
+/**
+ * @brief Count a UDP message which is not valid, without throwing, so that a
+ * sender of garbage only costs the checks
+ *
+ * @param error Why the message is not valid
+ */
+void Server::reject_udp_msg(UdpParseError error) {
+  if (stats_) {
+    ++stats_->udp_rejected[static_cast<size_t>(error)];
+  }
+  log_error("Error deserializing UDP payload: ", to_string(error));
+}
+
+/**
+ * @brief Handle the whole requests received from a client, the bytes of the
+ * next one being kept by its frame reader
+ *
+ * The invalid frames and requests are skipped and counted, without throwing.
+ *
+ * @param connection The connection of the client
+ */
+void Server::fetch_tcp_requests(Connection &connection) {
+  if (keepalive_timers_) {
+    // Anything received shows the client is alive, its timer being moved once
+    // it expires
+    connection.last_received = std::chrono::steady_clock::now();
+  }
+
+  FrameReader::Frame frame{};
+  while (connection.fd >= 0) {
+    FrameReader::Status status = connection.input.read(frame);
+    if (status == FrameReader::Status::INCOMPLETE) {
+      break;
+    }
+    if (status == FrameReader::Status::SIZE_EXCEEDS_LIMIT) {
+      if (stats_) {
+        ++stats_->frames_too_large;
+      }
+      log_error("Error while fetching TCP request: size exceeds max limit");
+      continue;
+    }
+    if (capture_) {
+      capture_->request(connection.id, frame.type, frame.payload, frame.size);
+    }
+    if (frame.type == TcpMessageType::HEARTBEAT) {
+      continue;
+    }
+    if (frame.type == TcpMessageType::SHM_WAKE) {
+      // The subscriber freed space in its ring
+      if (connection.shm) {
+        flush_connection(connection);
+      }
+      continue;
+    }
+    if (frame.type == TcpMessageType::MULTICAST_NACK) {
+      // The subscriber missed some messages of the group
+      MulticastNack nack{};
+      if (multicast_ && MulticastNack::parse(nack, frame.payload, frame.size) &&
+          subscribers_registry_.is_subscriber_connected(connection.fd)) {
+        retransmit_multicast(connection, nack);
+      }
+      continue;
+    }
+    if (frame.type != TcpMessageType::REQUEST) {
+      if (stats_) {
+        ++stats_->frames_not_request;
+      }
+      log_error("Error while fetching TCP request: not a request");
+      continue;
+    }
+
+    std::chrono::steady_clock::time_point request_start{};
+    if (stats_) {
+      request_start = std::chrono::steady_clock::now();
+    }
+    TcpParseError error = TcpRequest::parse(
+        tcp_msg_.payload.emplace<TcpRequest>(), frame.payload, frame.size);
+    if (error != TcpParseError::NONE) {
+      if (stats_) {
+        ++stats_->requests_rejected[static_cast<size_t>(error)];
+      }
+      log_error("Error while fetching TCP request: ", to_string(error));
+      continue;
+    }
+
+    handle_tcp_request(connection);
+    if (stats_) {
+      record_stage(stats_->request_ns, request_start);
+    }
+  }
+
+  // The retained messages of the new subscriptions
+  if (retained_ && !pending_flushes_.empty()) {
+    disconnect_slow_consumers();
+    flush_pending_messages();
+  }
+
+  // Nothing is left once the connection is closed
+  if (connection.fd < 0) {
+    connection.input.clear();
+  }
+}
+
+/**
+ * @brief Disconnect the client and close its connection
+ *
+ * @param connection The connection of the client
+ */
+void Server::disconnect_client(Connection &connection) {
+  int sockfd = connection.fd;
+  if (subscribers_registry_.is_subscriber_connected(sockfd)) {
+    if (connection.replaying) {
+      // The rest of its stored messages is sent once it connects again
+      store_->interrupt_replay(subscribers_registry_.get_subscriber_id(sockfd));
+      connection.replaying = false;
+    }
+    subscribers_registry_.disconnect_subscriber(sockfd);
+    snapshot_dirty_ = true;
+  }
+  close_connection(connection);
+}
+
+/**
+ * @brief Disconnect a client whose socket was closed or failed, telling it
+ *
+ * @param connection The connection of the client
+ */
+void Server::report_disconnected(Connection &connection) {
+  if (subscribers_registry_.is_subscriber_connected(connection.fd)) {
+    log_info("Client ", subscribers_registry_.get_subscriber_id(connection.fd),
+             " disconnected.");
+  }
+  disconnect_client(connection);
+}
+
+/**
+ * @brief Parse the topic of a subscribe or unsubscribe request, counting it if
+ * it is not valid
+ *
+ * @param topic_str The topic
+ * @param pattern The pattern parsed
+ * @return true if the topic is valid
+ */
+auto Server::parse_topic_pattern(std::string_view topic_str,
+                                 TokenPattern &pattern) -> bool {
+  TokenPatternError error = TokenPattern::parse(topic_str, pattern);
+  if (error == TokenPatternError::NONE) {
+    return true;
+  }
+  if (stats_) {
+    ++stats_->patterns_rejected[static_cast<size_t>(error)];
+  }
+  log_error("Invalid topic: ", to_string(error));
+  return false;
+}
+
+/**
+ * @brief Count a subscription refused for exceeding the quota of its
+ * subscriber
+ *
+ * @param sockfd The socket file descriptor of the subscriber
+ * @param topics The topics of the subscription
+ */
+void Server::refuse_subscription(int sockfd, std::string_view topics) {
+  if (stats_) {
+    ++stats_->subscriptions_refused;
+  }
+  log_error("Refusing the subscription of ",
+            subscribers_registry_.get_subscriber_id(sockfd), " to ", topics,
+            ": its subscriptions hold ",
+            subscribers_registry_.subscription_bytes(sockfd),
+            " bytes of their quota");
+}
+
+/**
+ * @brief Handle the TCP request from the client
+ *
+ * @param connection The connection of the client
+ */
+void Server::handle_tcp_request(Connection &connection) {
+  int sockfd = connection.fd;
+  snapshot_dirty_ = true;
+  checkpoint_dirty_ = true;
+
+  // Use a scope guard to ensure proper cleanup and avoid code duplication
+  auto guard = make_scope_guard(
+      std::bind(&Server::disconnect_client, this, std::ref(connection)));
+
+  auto &request = std::get<TcpRequest>(tcp_msg_.payload);
+  switch (request.type) {
+  case TcpRequestType::CONNECT: {
+
+    if (request.payload_type() != TcpRequestPayloadType::ID) {
+      log_error("Invalid payload type for CONNECT request");
+      return;
+    }
+
+    if (subscribers_registry_.is_subscriber_connected(sockfd)) {
+      log_error("Invalid CONNECT request: subscriber already connected");
+      return;
+    }
+
+    auto &id_payload = std::get<TcpRequestPayloadId>(request.payload);
+    auto id = std::string(id_payload.id.data(), id_payload.id_size);
 
     try {
-      subscribers_registry_.connect_subscriber(sockfd, id);
+      // A subscriber which joined the group is only sent the topics with a
+      // small fan-out on its connection, a broker of the federation all of
+      // them
+      bool peer = id_payload.flags & TCP_CONNECT_PEER;
+      subscribers_registry_.connect_subscriber(
+          sockfd, id,
+          multicast_ && !peer && (id_payload.flags & TCP_CONNECT_MULTICAST),
+          peer);
       guard.dismiss();
+      set_connect_flags(connection, id_payload.flags);
+      if (id_payload.flags & TCP_CONNECT_SHM) {
+        attach_shm(connection, id_payload);
+      }
       sockaddr_in addr{};
       socklen_t addr_len = sizeof(addr);
       getpeername(sockfd, reinterpret_cast<sockaddr *>(&addr), &addr_len);
-      std::cout << "New client " << id << " connected from "
-                << inet_ntoa(addr.sin_addr) << ":" << addr.sin_port << '.'
-                << std::endl;
+      log_info("New client ", id, " connected from ", inet_ntoa(addr.sin_addr),
+               ":", addr.sin_port, '.');
+
+      // The messages stored while it was offline come before the new ones
+      if (store_ && store_->has_backlog(id)) {
+        // The socket is non-blocking, as sendfile cannot be told not to block
+        connection.replaying = true;
+        flush_connection(connection);
+      }
 
     } catch (const std::exception &e) {
-      std::cout << "Client " << id << " already connected." << std::endl;
+      log_info("Client ", id, " already connected.");
       return;
     }
     break;
@@ -327,14 +1486,12 @@ void Server::handle_tcp_request(size_t pollfd_index) {
     std::string_view actionName = isSubscribe ? "SUBSCRIBE"sv : "UNSUBSCRIBE"sv;
 
     if (request.payload_type() != TcpRequestPayloadType::TOPIC) {
-      std::cerr << "Invalid payload type for " << actionName << " request"
-                << std::endl;
+      log_error("Invalid payload type for ", actionName, " request");
       return;
     }
 
     if (!subscribers_registry_.is_subscriber_connected(sockfd)) {
-      std::cerr << "Invalid " << actionName
-                << " request: subscriber not connected" << std::endl;
+      log_error("Invalid ", actionName, " request: subscriber not connected");
       return;
     }
 
@@ -342,20 +1499,104 @@ void Server::handle_tcp_request(size_t pollfd_index) {
     std::string_view topic_str(topic_payload.topic.data(),
                                topic_payload.topic_size);
 
-    try {
-      auto topic_pat = TokenPattern::from_string(topic_str);
+    TokenPattern topic_pat{};
+    if (!parse_topic_pattern(topic_str, topic_pat)) {
+      return;
+    }
+
+    // The filter is compiled once, and evaluated for each delivery
+    SubscriptionFilter filter{};
+    if (isSubscribe && (topic_payload.flags & TCP_SUBSCRIBE_FILTER)) {
+      auto content = std::make_shared<ContentFilter>();
+      std::string_view filter_str(topic_payload.filter.data(),
+                                  topic_payload.filter_size);
+      ContentFilterError error = ContentFilter::parse(filter_str, *content);
+      if (error != ContentFilterError::NONE) {
+        if (stats_) {
+          ++stats_->filters_rejected;
+        }
+        log_error("Invalid filter: ", filter_str, ": ", to_string(error));
+        return;
+      }
+      filter.content = std::move(content);
+    }
+    // Limits sending every message are none
+    if (isSubscribe && (topic_payload.flags & TCP_SUBSCRIBE_LIMIT) &&
+        (topic_payload.max_rate > 0 || topic_payload.sample_every > 1)) {
+      filter.limit = std::make_shared<DeliveryLimit>(
+          topic_payload.max_rate, topic_payload.sample_every);
+    }
 
+    try {
       if (isSubscribe) {
-        subscribers_registry_.subscribe_to_topic(sockfd, topic_pat);
+        bool conflate = (topic_payload.flags & TCP_SUBSCRIBE_CONFLATE) != 0;
+        if (!subscribers_registry_.subscribe_to_topic(sockfd, topic_pat,
+                                                      conflate, filter)) {
+          refuse_subscription(sockfd, topic_str);
+          return;
+        }
+        send_retained(sockfd, topic_pat, filter.content.get(), conflate);
       } else {
         subscribers_registry_.unsubscribe_from_topic(sockfd, topic_pat);
       }
 
       guard.dismiss();
     } catch (const std::exception &e) {
-      std::cerr << "Error "
-                << (isSubscribe ? "subscribing to" : "unsubscribing from")
-                << " topic: " << e.what() << std::endl;
+      log_error("Error ",
+                (isSubscribe ? "subscribing to" : "unsubscribing from"),
+                " topic: ", e.what());
+      return;
+    }
+
+    break;
+  }
+  case TcpRequestType::SUBSCRIBE_BULK:
+  case TcpRequestType::UNSUBSCRIBE_BULK: {
+    const bool isSubscribe = request.type == TcpRequestType::SUBSCRIBE_BULK;
+    std::string_view actionName =
+        isSubscribe ? "SUBSCRIBE_BULK"sv : "UNSUBSCRIBE_BULK"sv;
+
+    if (request.payload_type() != TcpRequestPayloadType::TOPICS) {
+      log_error("Invalid payload type for ", actionName, " request");
+      return;
+    }
+
+    if (!subscribers_registry_.is_subscriber_connected(sockfd)) {
+      log_error("Invalid ", actionName, " request: subscriber not connected");
+      return;
+    }
+
+    // The topics are applied together, once all of them are valid
+    auto &topics_payload = std::get<TcpRequestPayloadTopics>(request.payload);
+    topic_patterns_.clear();
+    bool valid = true;
+    topics_payload.for_each([&](std::string_view topic_str) {
+      valid = valid && parse_topic_pattern(topic_str,
+                                           topic_patterns_.emplace_back());
+    });
+    if (!valid) {
+      return;
+    }
+
+    try {
+      if (isSubscribe) {
+        if (!subscribers_registry_.subscribe_to_topics(sockfd,
+                                                       topic_patterns_)) {
+          refuse_subscription(sockfd, "several topics"sv);
+          return;
+        }
+        for (const auto &pattern : topic_patterns_) {
+          send_retained(sockfd, pattern, nullptr, false);
+        }
+      } else {
+        subscribers_registry_.unsubscribe_from_topics(sockfd, topic_patterns_);
+      }
+
+      guard.dismiss();
+    } catch (const std::exception &e) {
+      log_error("Error ",
+                (isSubscribe ? "subscribing to" : "unsubscribing from"),
+                " topics: ", e.what());
       return;
     }
 
@@ -363,165 +1604,1680 @@ void Server::handle_tcp_request(size_t pollfd_index) {
   }
 
   default:
-    std::cerr << "Invalid request type" << std::endl;
+    log_error("Invalid request type");
     return;
   }
 }
 
 /**
- * @brief Send the TCP message to the client
+ * @brief Queue a serialized TCP message for the client
  *
- * @param sockfd The socket file descriptor of the client
+ * The message is queued behind the ones not sent yet, and the client recorded
+ * in pending_flushes_ if there are none, to be sent once the fan-out is over.
+ * When the queue of the client is full, the slow consumer policy applies: the
+ * message may be dropped, or the client recorded in slow_consumers_ to be
+ * disconnected. For a client of protocol v2, the message is added to its open
+ * batch instead, queued when flushed.
  *
- * @throws TcpSocketException if the send operation fails
+ * @param sockfd The socket file descriptor of the client
+ * @param message The message, as returned by FanoutEncoder::encode
+ * @param conflate Whether the message replaces the one of its topic still
+ * queued for the client, which does not apply to the batches of protocol v2
  */
-void Server::send_tcp_message(int sockfd) {
-  // Serialize the TCP message
-  TcpMessage::serialize(tcp_msg_, tcp_buffer_.data());
-  size_t msg_size = tcp_msg_.serialized_size();
+void Server::send_tcp_message(int sockfd,
+                              std::shared_ptr<const OutgoingMessage> message,
+                              bool conflate) {
+  auto it = connections_.find(sockfd);
+  if (it == connections_.end()) {
+    return;
+  }
+  auto &connection = *it->second;
+  auto &queue = connection.output_queue;
+
+  // The responses of protocol v2 are queued once their batch is flushed
+  auto &batch_encoder = connection.batch_encoder;
+  bool was_empty = batch_encoder ? batch_encoder->empty() : queue.empty();
+  OutputQueue::PushResult result{};
+  {
+    // The deque of a lane takes a block every so many messages, and a
+    // conflated topic an entry, the only allocations of a warm fan-out
+    alloc_tracking::AllowAllocScope allow_alloc;
+    result = batch_encoder ? batch_encoder->push(*message, queue)
+                           : queue.push(std::move(message), conflate);
+  }
+  if (stats_) {
+    if (result == OutputQueue::PushResult::QUEUED) {
+      ++stats_->queued;
+      stats_->queue_bytes.record(queue.size());
+    } else {
+      ++stats_->dropped;
+    }
+  }
 
-  send_all(sockfd, tcp_buffer_.data(), msg_size);
+  switch (result) {
+  case OutputQueue::PushResult::QUEUED:
+    break;
+  case OutputQueue::PushResult::DROPPED:
+    return;
+  case OutputQueue::PushResult::OVERFLOWED:
+    slow_consumers_.push_back(sockfd);
+    return;
+  }
+
+  // Otherwise, the queue is flushed once the socket is writable
+  if (was_empty) {
+    pending_flushes_.push_back(sockfd);
+  }
 }
 
-void Server::run() {
-  bool stopped = false;
+/**
+ * @brief Apply the flags of the CONNECT request of a subscriber to its
+ * connection, but for the shared memory ring
+ *
+ * @param connection The connection of the subscriber
+ * @param flags The flags of the request, TCP_CONNECT_*
+ */
+void Server::set_connect_flags(Connection &connection, uint8_t flags) {
+  connection.connect_flags = flags;
+  // The I/O workers send the messages after each batch
+  connection.coalesce = threads_ == 1 &&
+                        queue_config_.coalesce_window.count() > 0 &&
+                        !(flags & TCP_CONNECT_NO_COALESCING);
+  if (threads_ == 1 && (flags & TCP_CONNECT_PROTOCOL_V2)) {
+    // Not worth it on the host of the server
+    bool compress =
+        (flags & TCP_CONNECT_COMPRESSION) && !(flags & TCP_CONNECT_SHM);
+    connection.batch_encoder = std::make_unique<BatchEncoder>(
+        compress ? queue_config_.compression_threshold : 0);
+  }
+}
 
-  while (!stopped) {
-    if (poll(poll_fds_.data(), poll_fds_.size(), -1) == -1) {
-      if (errno == EINTR) {
-        // Interrupted by a signal, continue polling
-        continue;
-      } else {
-        std::cerr << "Error in poll: " << std::strerror(errno) << std::endl;
-        throw std::runtime_error("Poll error");
-      }
+/**
+ * @brief Send the messages queued by the fan-out, without blocking, unless
+ * they are held back for the coalescing window
+ */
+void Server::flush_pending_messages() {
+  for (int sockfd : pending_flushes_) {
+    auto it = connections_.find(sockfd);
+    if (it == connections_.end() || hold_back(*it->second)) {
+      continue;
     }
+    flush_connection(*it->second);
+  }
+  pending_flushes_.clear();
+  // Whose batch overflowed the queue
+  disconnect_slow_consumers();
+}
 
-    // Check STDIN_FILENO
-    if (poll_fds_[2].revents & POLLIN) {
-      handle_stdin_cmd(stopped);
-    }
+/**
+ * @brief Hold the messages of a subscriber back until the end of its
+ * coalescing window, starting it if needed, so that they are written together
+ *
+ * @param connection The connection of the subscriber
+ * @return true if the messages are held back, false if they must be sent now
+ */
+auto Server::hold_back(Connection &connection) -> bool {
+  if (!connection.coalesce ||
+      connection.output_queue.size() >= queue_config_.coalesce_bytes) {
+    return false;
+  }
 
-    // Check udp_fd_
-    if (poll_fds_[1].revents & POLLIN) {
-      do {
-        auto msg = handle_udp_msg();
+  if (connection.flush_deadline == std::chrono::steady_clock::time_point{}) {
+    connection.flush_deadline =
+        std::chrono::steady_clock::now() + queue_config_.coalesce_window;
+    coalescing_.push_back(connection.fd);
+  }
+  return true;
+}
 
-        if (!msg.has_value()) {
-          continue;
-        }
+/**
+ * @brief Send the messages held back whose coalescing window is over, or
+ * which reached the size from which they are written at once
+ */
+void Server::flush_coalesced_messages() {
+  if (coalescing_.empty()) {
+    return;
+  }
 
-        TokenPattern topic;
-        std::unordered_set<int> subscribers;
-        try {
-          std::string_view topic_str(udp_msg_.topic.data(),
-                                     udp_msg_.topic_size);
-          topic = TokenPattern::from_string(topic_str);
-          subscribers = subscribers_registry_.retrieve_topic_subscribers(topic);
-        } catch (const std::exception &e) {
-          std::cerr << "Invalid topic pattern: " << e.what() << std::endl;
-          continue;
-        }
+  auto now = std::chrono::steady_clock::now();
+  size_t kept = 0;
+  for (size_t i = 0; i < coalescing_.size(); ++i) {
+    auto it = connections_.find(coalescing_[i]);
+    // The connection may be closed, its fd reused by one not held back
+    if (it == connections_.end() ||
+        it->second->flush_deadline == std::chrono::steady_clock::time_point{}) {
+      continue;
+    }
+    auto &connection = *it->second;
 
-        if (subscribers.empty()) {
-          continue;
-        }
-        auto &udp_sender_addr = msg.value();
-        prepare_tcp_response(udp_sender_addr);
+    if (now < connection.flush_deadline &&
+        connection.output_queue.size() < queue_config_.coalesce_bytes) {
+      coalescing_[kept++] = coalescing_[i];
+      continue;
+    }
+    connection.flush_deadline = {};
+    flush_connection(connection);
+  }
+  coalescing_.resize(kept);
+  disconnect_slow_consumers();
+}
 
-        for (auto &sub_sockfd : subscribers) {
-          if (sub_sockfd < 0) {
-            continue;
-          }
+/**
+ * @brief Get how long the event loop may wait for events, before the end of
+ * the first coalescing window, the first keepalive deadline, the next dump
+ * of the statistics, the next checkpoint of the registry or the first retry
+ * of a link to a peer broker, at once if a round of the writes is due
+ *
+ * @return The timeout, or std::nullopt if no messages are held back, no
+ * keepalive deadlines are scheduled, the statistics are not dumped, the
+ * registry is not to be saved and no link is closed
+ */
+auto Server::next_timeout() const -> std::optional<std::chrono::nanoseconds> {
+  // The next round of the writes runs at once
+  if (!write_round_.empty()) {
+    return std::chrono::nanoseconds(0);
+  }
+  std::optional<std::chrono::steady_clock::time_point> deadline{};
+  if (stats_file_.is_open()) {
+    deadline = next_stats_dump_;
+  }
+  if (!checkpoint_file_.empty() && checkpoint_dirty_ &&
+      (!deadline || next_checkpoint_ < *deadline)) {
+    deadline = next_checkpoint_;
+  }
+  for (const auto &peer : peer_links_) {
+    if (peer->fd < 0 &&
+        (!deadline || peer->link.retry_deadline() < *deadline)) {
+      deadline = peer->link.retry_deadline();
+    }
+  }
+  if (keepalive_timers_) {
+    auto keepalive = keepalive_timers_->next_deadline();
+    if (keepalive && (!deadline || *keepalive < *deadline)) {
+      deadline = keepalive;
+    }
+  }
+  for (int sockfd : coalescing_) {
+    auto it = connections_.find(sockfd);
+    if (it == connections_.end() ||
+        it->second->flush_deadline == std::chrono::steady_clock::time_point{}) {
+      continue;
+    }
+    if (!deadline || it->second->flush_deadline < *deadline) {
+      deadline = it->second->flush_deadline;
+    }
+  }
 
-          // Send the TCP message to the subscriber
-          try {
-            send_tcp_message(sub_sockfd);
-          } catch (const TcpConnectionClosed &e) {
-            std::cerr << "Failed to send TCP message. Client "
-                      << subscribers_registry_.get_subscriber_id(sub_sockfd)
-                      << " disconnected." << std::endl;
-            continue;
-          } catch (const TcpSocketException &e) {
-            std::cerr << "Error sending TCP message: " << e.what() << std::endl;
-            continue;
-          }
-        }
-      } while (false);
+  if (!deadline) {
+    return std::nullopt;
+  }
+  return std::max(std::chrono::nanoseconds(0),
+                  std::chrono::nanoseconds(*deadline -
+                                           std::chrono::steady_clock::now()));
+}
+
+/**
+ * @brief Send the queued messages of a client, without blocking
+ *
+ * @param connection The connection of the client
+ */
+void Server::flush_connection(Connection &connection) {
+  if (connection.batch_encoder &&
+      connection.batch_encoder->flush(connection.output_queue) ==
+          OutputQueue::PushResult::OVERFLOWED) {
+    slow_consumers_.push_back(connection.fd);
+    return;
+  }
+
+  if (connection.shm) {
+    flush_shm(connection);
+    return;
+  }
+
+  if (uring_) {
+    // The send completes later, and sends the rest of the queue
+    submit_send(connection);
+    return;
+  }
+
+  int sockfd = connection.fd;
+  auto &queue = connection.output_queue;
+  try {
+    if (connection.replaying && !replay_backlog(connection)) {
+      return;
     }
+    send_queued(connection);
+  } catch (const TcpConnectionClosed &e) {
+    // The client is disconnected when its socket reports the error
+    log_error("Failed to send TCP message. Client ",
+              subscribers_registry_.get_subscriber_id(sockfd),
+              " disconnected.");
+    queue.clear();
+  } catch (const TcpSocketException &e) {
+    log_error("Error sending TCP message: ", e.what());
+    queue.clear();
+  }
+}
 
-    // Check listen_fd_
-    if (poll_fds_[0].revents & POLLIN) {
-      do {
-        // Accept a new TCP connection
-        int client_fd = accept(listen_fd_, nullptr, nullptr);
-        if (client_fd < 0) {
-          std::cerr << "Error accepting TCP connection: "
-                    << std::strerror(errno) << std::endl;
-          continue;
-        }
+/**
+ * @brief Send the queued messages of a subscriber, as many as its socket
+ * accepts or, with the write scheduling, as its deficit covers
+ *
+ * The write scheduling is a deficit round robin: a subscriber gets its
+ * quantum once per round, a round per iteration of the event loop, and keeps
+ * what it did not spend while its messages do not fit, up to a quantum once
+ * its queue is empty. A subscriber whose deficit runs out before its queue
+ * waits for the next round, at the end of the iteration, so a few subscribers
+ * with a backlog do not hold the others back for a whole iteration.
+ *
+ * @param connection The connection of the subscriber
+ *
+ * @throws TcpSocketException if the send fails
+ */
+void Server::send_queued(Connection &connection) {
+  size_t quantum = queue_config_.write_quantum;
+  if (quantum == 0) {
+    connection.output_queue.flush(connection.fd);
+    return;
+  }
 
-        // Disable Nagle's algorithm for the TCP client
-        int enable = 1;
-        if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &enable,
-                       sizeof(enable)) < 0) {
-          std::cerr << "Error setting TCP_NODELAY: " << std::strerror(errno)
-                    << std::endl;
-          close(client_fd);
-          continue;
-        }
+  if (connection.write_turn != write_rounds_) {
+    connection.write_turn = write_rounds_;
+    connection.write_deficit += quantum;
+  }
+  switch (connection.output_queue.flush(connection.fd,
+                                        connection.write_deficit)) {
+  case OutputQueue::FlushResult::EMPTY:
+    connection.write_deficit = std::min(connection.write_deficit, quantum);
+    break;
+  case OutputQueue::FlushResult::BLOCKED:
+    // Sent on EPOLLOUT
+    break;
+  case OutputQueue::FlushResult::BUDGET_SPENT:
+    if (!connection.write_scheduled) {
+      connection.write_scheduled = true;
+      write_round_.push_back(connection.fd);
+    }
+    break;
+  }
+}
+
+/**
+ * @brief Run a round of the write scheduling, giving their next quantum to
+ * the subscribers whose deficit ran out in the previous one
+ */
+void Server::run_write_round() {
+  ++write_rounds_;
+  if (write_round_.empty()) {
+    return;
+  }
 
-        // Add the new client fd to the pollfds
-        register_pollfd(client_fd, POLLIN);
-      } while (false);
+  // Those whose deficit runs out again wait for the next round
+  write_turns_.swap(write_round_);
+  for (int sockfd : write_turns_) {
+    auto it = connections_.find(sockfd);
+    // The connection may be closed, its fd reused by one not scheduled
+    if (it == connections_.end() || !it->second->write_scheduled) {
+      continue;
     }
+    it->second->write_scheduled = false;
+    flush_connection(*it->second);
+  }
+  write_turns_.clear();
+  disconnect_slow_consumers();
+}
 
-    // Check other pollfds (subscribers)
-    for (size_t i = 3; i < poll_fds_.size();) {
-      size_t initial_size = poll_fds_.size();
+/**
+ * @brief Write the messages of a subscriber to the ring it asked for, if it can
+ * be mapped, its socket being used otherwise: the subscriber must be connected
+ * over the loopback, from the process that holds the ring
+ *
+ * Only the epoll backend running on a single thread writes to the rings, and
+ * not with the message store, whose replays are sent on the socket, so that
+ * the messages stay in order.
+ *
+ * @param connection The connection of the subscriber, just connected
+ * @param payload The CONNECT request, naming its process and memfd
+ */
+void Server::attach_shm(Connection &connection,
+                        const TcpRequestPayloadId &payload) {
+  if (uring_ || threads_ > 1 || store_) {
+    log_error("Shared memory delivery not supported, using TCP");
+    return;
+  }
+  try {
+    connection.shm = ShmRing::open(static_cast<pid_t>(payload.shm_pid),
+                                   static_cast<int>(payload.shm_fd),
+                                   connection.fd);
+  } catch (const std::runtime_error &e) {
+    log_error("Shared memory delivery failed, using TCP: ", e.what());
+  }
+}
 
-      do {
-        if (poll_fds_[i].revents & POLLIN) {
-          int sockfd = poll_fds_[i].fd;
-
-          try {
-            fetch_tcp_request(sockfd);
-          } catch (const TcpConnectionClosed &e) {
-            if (subscribers_registry_.is_subscriber_connected(sockfd)) {
-              std::cout << "Client "
-                        << subscribers_registry_.get_subscriber_id(sockfd)
-                        << " disconnected." << std::endl;
+/**
+ * @brief Copy the queued messages of a subscriber to its ring, waking it up
+ * over its socket if it waits for them
+ *
+ * Once the ring is full, the rest stays queued, as for a socket, until the
+ * subscriber frees space and wakes the server up.
+ *
+ * @param connection The connection of the subscriber, with a ring
+ */
+void Server::flush_shm(Connection &connection) {
+  auto &ring = *connection.shm;
+  while (!connection.output_queue.flush(ring)) {
+    if (ring.wait_for_space()) {
+      break;
+    }
+  }
+
+  if (ring.wake_reader() &&
+      send(connection.fd, TCP_SHM_WAKE_FRAME.data(), TCP_SHM_WAKE_FRAME.size(),
+           MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    // The client is disconnected when its socket reports the error
+    log_error("Failed to wake up a subscriber: ", std::strerror(errno));
+  }
+}
+
+/**
+ * @brief Send the messages stored for a client while it was offline, as long
+ * as its socket accepts them
+ *
+ * @param connection The connection of the client, replaying
+ * @return true if they were all sent, the queued messages being sent next
+ *
+ * @throws TcpSocketException if the send fails
+ */
+auto Server::replay_backlog(Connection &connection) -> bool {
+  const auto &id = subscribers_registry_.get_subscriber_id(connection.fd);
+  connection.replaying = !store_->replay(id, connection.fd);
+  return !connection.replaying;
+}
+
+/**
+ * @brief Disconnect the clients whose output queue overflowed during the
+ * fan-out, by SlowConsumerPolicy::DISCONNECT
+ */
+void Server::disconnect_slow_consumers() {
+  for (int sockfd : slow_consumers_) {
+    auto it = connections_.find(sockfd);
+    if (it == connections_.end()) {
+      continue;
+    }
+
+    if (subscribers_registry_.is_subscriber_connected(sockfd)) {
+      log_error("Client ", subscribers_registry_.get_subscriber_id(sockfd),
+                " is too slow, disconnecting it");
+      log_info("Client ", subscribers_registry_.get_subscriber_id(sockfd),
+               " disconnected.");
+    }
+    disconnect_client(*it->second);
+  }
+  slow_consumers_.clear();
+}
+
+/**
+ * @brief Schedule the keepalive deadlines of a new connection, if the
+ * keepalive is enabled
+ *
+ * @param connection The connection, just accepted
+ */
+void Server::start_keepalive(Connection &connection) {
+  if (!keepalive_timers_) {
+    return;
+  }
+  connection.last_received = std::chrono::steady_clock::now();
+  handle_keepalive(connection, connection.last_received);
+}
+
+/**
+ * @brief Handle the connections whose keepalive deadline is over
+ *
+ * The timer of a connection is not moved by each receive: it only expires
+ * once the client may have been silent for too long, and is scheduled again
+ * from when the client was last heard of.
+ */
+void Server::expire_keepalive_timers() {
+  if (!keepalive_timers_) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  keepalive_timers_->advance(now, [&](TimerWheel::Timer &timer) {
+    handle_keepalive(static_cast<Connection &>(timer), now);
+  });
+  // Whose heartbeat overflowed the queue
+  disconnect_slow_consumers();
+}
+
+/**
+ * @brief Disconnect a client silent for longer than the idle timeout, or send
+ * a heartbeat to a subscriber silent for longer than the heartbeat interval,
+ * then schedule its next deadline
+ *
+ * @param connection The connection of the client
+ * @param now The current time
+ */
+void Server::handle_keepalive(Connection &connection,
+                              std::chrono::steady_clock::time_point now) {
+  const auto &config = keepalive_config_;
+  if (config.idle_timeout.count() > 0 &&
+      now - connection.last_received >= config.idle_timeout) {
+    log_error("Connection ", connection.id, " is idle, disconnecting it");
+    report_disconnected(connection);
+    return;
+  }
+
+  std::optional<std::chrono::steady_clock::time_point> deadline{};
+  if (config.idle_timeout.count() > 0) {
+    deadline = connection.last_received + config.idle_timeout;
+  }
+  if (config.heartbeat_interval.count() > 0 &&
+      subscribers_registry_.is_subscriber_connected(connection.fd)) {
+    // At most one heartbeat per interval of silence
+    auto silent_since =
+        std::max(connection.last_received, connection.last_heartbeat);
+    if (now - silent_since >= config.heartbeat_interval) {
+      send_heartbeat(connection);
+      connection.last_heartbeat = silent_since = now;
+    }
+    auto heartbeat = silent_since + config.heartbeat_interval;
+    if (!deadline || heartbeat < *deadline) {
+      deadline = heartbeat;
+    }
+  } else if (config.heartbeat_interval.count() > 0) {
+    // Whether the client connected as a subscriber is checked again
+    auto check = now + config.heartbeat_interval;
+    if (!deadline || check < *deadline) {
+      deadline = check;
+    }
+  }
+
+  if (deadline && connection.fd >= 0) {
+    keepalive_timers_->schedule(connection, *deadline);
+  }
+}
+
+/**
+ * @brief Queue a heartbeat for a subscriber, and send it without blocking
+ *
+ * @param connection The connection of the subscriber
+ */
+void Server::send_heartbeat(Connection &connection) {
+  if (threads_ > 1) {
+    io_workers_[connection.worker]->send(
+        {{connection.fd, connection.id, heartbeat_}});
+    return;
+  }
+  push_control_message(connection, heartbeat_);
+}
+
+/**
+ * @brief Queue a message for a subscriber on a single thread, not batched nor
+ * conflated, and send it without blocking
+ *
+ * @param connection The connection of the subscriber
+ * @param message The whole frame
+ */
+void Server::push_control_message(
+    Connection &connection, std::shared_ptr<const OutgoingMessage> message) {
+  switch (connection.output_queue.push(std::move(message), false)) {
+  case OutputQueue::PushResult::QUEUED:
+    if (!hold_back(connection)) {
+      flush_connection(connection);
+    }
+    break;
+  case OutputQueue::PushResult::DROPPED:
+    break;
+  case OutputQueue::PushResult::OVERFLOWED:
+    slow_consumers_.push_back(connection.fd);
+    break;
+  }
+}
+
+/**
+ * @brief Retransmit on TCP the messages of the multicast group a subscriber
+ * missed, those no longer kept being skipped
+ *
+ * @param connection The connection of the subscriber
+ * @param nack The messages missed
+ */
+void Server::retransmit_multicast(Connection &connection,
+                                  const MulticastNack &nack) {
+  for (uint16_t i = 0; i < nack.count && connection.fd >= 0; ++i) {
+    auto frame = multicast_->retransmit(nack.first + i);
+    if (!frame) {
+      continue;
+    }
+    if (stats_) {
+      ++stats_->multicast_retransmitted;
+    }
+    push_control_message(connection, std::move(frame));
+  }
+  disconnect_slow_consumers();
+}
+
+/**
+ * @brief Send the received UDP message to the subscribers of its topic
+ *
+ * @param udp_sender The address of the sender of the message
+ * @param received_ns When the kernel received the message, 0 if it is unknown
+ * @param forwarded Whether the message was forwarded by a broker of the
+ * federation, in which case it is not forwarded to the others
+ */
+void Server::publish_udp_msg(const sockaddr_in &udp_sender,
+                             uint64_t received_ns, bool forwarded) {
+  auto topic = TopicView::from_string(udp_msg_.topic_str());
+  if (!topic.has_value()) {
+    reject_topic(udp_msg_.topic_str());
+    return;
+  }
+
+  fan_out_udp_msg(topic.value(), match_topic(topic.value()), udp_sender,
+                  received_ns, forwarded);
+}
+
+/**
+ * @brief Register the topic ids of a publisher, acknowledging those
+ * registered, the messages of the others being left to be sent by topic
+ *
+ * @param sender The address of the publisher
+ * @param buffer The datagram, as checked by UdpMessageCursor::is_registration
+ * @param size The size of the datagram
+ */
+void Server::register_udp_topics(const sockaddr_in &sender,
+                                 const std::byte *buffer, size_t size) {
+  start_registration_ack(registration_ack_);
+  for (UdpRegistrationCursor cursor(buffer, size); !cursor.done();) {
+    uint16_t id{};
+    std::string_view name{};
+    UdpParseError error = cursor.next(id, name);
+    if (error != UdpParseError::NONE) {
+      reject_udp_msg(error);
+      continue;
+    }
+    auto topic = TopicView::from_string(name);
+    if (!topic.has_value()) {
+      reject_topic(name);
+      continue;
+    }
+    if (publisher_topics_.add(sender, id, name, {*topic}) != nullptr) {
+      append_registered_id(registration_ack_, id);
+    }
+  }
+
+  if (sendto(udp_fd_, registration_ack_.data(), registration_ack_.size(),
+             MSG_DONTWAIT, reinterpret_cast<const sockaddr *>(&sender),
+             sizeof(sender)) < 0) {
+    log_error("Error acknowledging the topic registration: ",
+              std::strerror(errno));
+  }
+}
+
+/**
+ * @brief Retrieve the subscribers of a registered topic, matched again only
+ * once the cache of the registry changed
+ *
+ * @param registered The topic
+ * @return The subscribers, as returned by
+ * SubscribersRegistry::retrieve_topic_subscribers
+ */
+auto Server::registered_subscribers(
+    PublisherTopics<RegisteredTopic>::Topic &registered)
+    -> const SubscribersRegistry::TopicSubscribers & {
+  auto &compiled = registered.compiled;
+  if (compiled.subscribers == nullptr ||
+      compiled.version != subscribers_registry_.fanout_version()) {
+    // The topic, valid when registered, may have tokens interned since
+    compiled.topic = *TopicView::from_string(registered.name);
+    compiled.subscribers = &match_topic(compiled.topic);
+    compiled.version = subscribers_registry_.fanout_version();
+  }
+  return *compiled.subscribers;
+}
+
+/**
+ * @brief Count a UDP message whose topic is not valid
+ *
+ * @param topic_str The topic of the message
+ */
+void Server::reject_topic(std::string_view topic_str) {
+  if (stats_) {
+    ++stats_->udp_invalid_topic;
+  }
+  log_error("Invalid topic: ", topic_str);
+}
+
+/**
+ * @brief Retrieve the subscribers of a published topic, timing the matching
+ *
+ * @param topic The topic
+ * @return The subscribers, as returned by
+ * SubscribersRegistry::retrieve_topic_subscribers
+ */
+auto Server::match_topic(const TopicView &topic)
+    -> const SubscribersRegistry::TopicSubscribers & {
+  std::chrono::steady_clock::time_point match_start{};
+  if (stats_) {
+    match_start = std::chrono::steady_clock::now();
+  }
+  const auto &subscribers =
+      subscribers_registry_.retrieve_topic_subscribers(topic);
+  if (stats_) {
+    stats_->match_ns.record(static_cast<uint64_t>(
+        std::chrono::nanoseconds(std::chrono::steady_clock::now() - match_start)
+            .count()));
+  }
+  return subscribers;
+}
+
+/**
+ * @brief Send the UDP message in udp_msg_ to the subscribers of its topic
+ *
+ * @param topic The topic of the message, parsed
+ * @param subscribers The subscribers of the topic, as returned by match_topic
+ * @param udp_sender The address of the sender of the message
+ * @param received_ns When the kernel received the message, 0 if it is unknown
+ * @param forwarded Whether the message was forwarded by a broker of the
+ * federation
+ */
+void Server::fan_out_udp_msg(
+    const TopicView &topic,
+    const SubscribersRegistry::TopicSubscribers &subscribers,
+    const sockaddr_in &udp_sender, uint64_t received_ns, bool forwarded) {
+  std::string_view topic_str = udp_msg_.topic_str();
+  if (stats_) {
+    ++stats_->udp_received;
+    size_t fanout = subscribers.sockets.size() +
+                    subscribers.multicast_sockets.size() +
+                    subscribers.offline_ids.size();
+    stats_->fanout.record(fanout);
+    if (fanout == 0) {
+      ++stats_->udp_unmatched;
+    }
+    if (stats_->topics.enabled()) {
+      stats_->topics.record(topic_str, fanout);
+    }
+  }
+
+  // Whether it has subscribers or not, for those to come
+  if (retained_) {
+    retained_->retain(udp_msg_, topic, udp_sender,
+                      subscribers.priority);
+  }
+
+  if (subscribers.sockets.empty() && subscribers.multicast_sockets.empty() &&
+      subscribers.offline_ids.empty()) {
+    return;
+  }
+  // The same bytes are sent to every subscriber
+  auto message = fanout_encoder_.encode(udp_msg_, udp_sender, received_ns,
+                                        subscribers.priority);
+
+  if (!subscribers.multicast_sockets.empty()) {
+    // Sent once for all the subscribers which joined the group
+    multicast_->send(*message);
+    if (stats_) {
+      ++stats_->multicast_sent;
+    }
+  }
+
+  auto payload_type = static_cast<TcpResponsePayloadType>(udp_msg_.payload_type);
+  if (!subscribers.offline_ids.empty()) {
+    const auto *offline_ids = &subscribers.offline_ids;
+    if (!subscribers.filtered_offline.empty()) {
+      // Only the offline subscribers whose filters accept it
+      offline_ids_.clear();
+      auto filtered = subscribers.filtered_offline.begin();
+      for (size_t i = 0; i < subscribers.offline_ids.size(); ++i) {
+        if (filtered != subscribers.filtered_offline.end() &&
+            filtered->first == i) {
+          bool accepted = SubscribersRegistry::TopicSubscribers::any_accepts(
+              filtered->second, payload_type, udp_msg_.payload,
+              udp_msg_.payload_size);
+          ++filtered;
+          if (!accepted) {
+            if (stats_) {
+              ++stats_->filtered;
             }
-            disconnect_client(i);
-            continue;
-          } catch (const std::exception &e) {
-            std::cerr << "Error while fetching TCP request: " << e.what()
-                      << std::endl;
             continue;
           }
+        }
+        offline_ids_.push_back(subscribers.offline_ids[i]);
+      }
+      offline_ids = &offline_ids_;
+    }
 
-          handle_tcp_request(i);
-        } else if (poll_fds_[i].revents & (POLLERR | POLLHUP)) {
-          int sockfd = poll_fds_[i].fd;
+    // Stored once for all the offline subscribers
+    try {
+      if (!offline_ids->empty()) {
+        store_->append(*message, *offline_ids);
+      }
+    } catch (const std::runtime_error &e) {
+      log_error("Error storing UDP message: ", e.what());
+    }
+  }
 
-          std::cout << "Client "
-                    << subscribers_registry_.get_subscriber_id(sockfd)
-                    << " disconnected." << std::endl;
+  for (auto &sub_sockfd : subscribers.sockets) {
+    if (sub_sockfd < 0 || (forwarded && subscribers.is_peer(sub_sockfd))) {
+      continue;
+    }
+    if (!subscribers.accepts(sub_sockfd, payload_type, udp_msg_.payload,
+                             udp_msg_.payload_size)) {
+      if (stats_) {
+        ++stats_->filtered;
+      }
+      continue;
+    }
 
-          disconnect_client(i);
-          continue;
-        }
-      } while (false);
+    // Queue the TCP message for the subscriber
+    send_tcp_message(sub_sockfd, message, subscribers.conflates(sub_sockfd));
+  }
+}
+
+/**
+ * @brief Queue the retained messages of the topics matching a new
+ * subscription of a subscriber, sent once its requests are handled
+ *
+ * The brokers of the federation are not sent them, as they would publish
+ * them again to their subscribers.
+ *
+ * @param sockfd The socket file descriptor of the subscriber
+ * @param pattern The pattern of the subscription
+ * @param filter The filter of the subscription, if any
+ * @param conflate Whether the subscription is conflated
+ */
+void Server::send_retained(int sockfd, const TokenPattern &pattern,
+                           const ContentFilter *filter, bool conflate) {
+  if (!retained_ || subscribers_registry_.is_peer(sockfd)) {
+    return;
+  }
+  retained_->for_each_match(pattern, [&](const UdpMessageView &msg,
+                                         const sockaddr_in &sender,
+                                         uint8_t priority) {
+    if (filter != nullptr &&
+        !filter->matches(static_cast<TcpResponsePayloadType>(msg.payload_type),
+                         msg.payload, msg.payload_size)) {
+      return;
+    }
+    send_tcp_message(sockfd, fanout_encoder_.encode(msg, sender, 0, priority),
+                     conflate);
+  });
+}
 
-      // If we removed the current pollfd, we should not increment the index
-      if (initial_size <= poll_fds_.size()) {
-        ++i;
+/**
+ * @brief Accept the pending TCP connections, until there is none left
+ */
+void Server::accept_clients() {
+  while (true) {
+    // Accept a new TCP connection, non-blocking as all the client sockets
+    int client_fd =
+        accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
       }
+      log_error("Error accepting TCP connection: ", std::strerror(errno));
+      return;
     }
+    add_connection(client_fd);
   }
+}
+
+/**
+ * @brief Add the connections accepted by the acceptor thread
+ */
+void Server::accept_handed_clients() {
+  // Reset first, a connection handed after it waking the loop up again
+  acceptor_->clear_event();
+  while (auto client_fd = acceptor_->pop()) {
+    add_connection(*client_fd);
+  }
+}
+
+/**
+ * @brief Watch a client accepted with SOCK_NONBLOCK, which inherited
+ * TCP_NODELAY and the limits of its send queue from the listening socket
+ *
+ * @param client_fd The socket of the client
+ */
+void Server::add_connection(int client_fd) {
+  // Watch the client, its socket being writable again only matters once
+  // its output queue is not empty. The worker of the client sends its
+  // messages instead, in the multi-threaded mode.
+  auto connection = std::make_unique<Connection>(
+      client_fd, next_connection_id_++, queue_config_);
+  uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  try {
+    register_fd(*connection, threads_ > 1 ? events : events | EPOLLOUT);
+  } catch (const std::exception &e) {
+    log_error("Failed to watch a client: ", e.what());
+    close(client_fd);
+    return;
+  }
+  if (threads_ > 1) {
+    connection->worker =
+        steering_.worker(client_fd, IoWorker::shard(client_fd, threads_));
+    io_workers_[connection->worker]->add_connection(client_fd, connection->id);
+  }
+  start_keepalive(*connection);
+  if (capture_) {
+    capture_->connection(CaptureKind::CONNECT, connection->id);
+  }
+  connections_.insert_or_assign(client_fd, std::move(connection));
+}
 
-  // Cleanup remaining tcp connections
-  for (size_t i = 3; i < poll_fds_.size(); ++i) {
-    disconnect_client(i);
+/**
+ * @brief Handle the events of a client: flush its queued messages and read
+ * its requests, until its socket would block
+ *
+ * @param connection The connection of the client
+ * @param events The events of the client socket
+ */
+void Server::handle_client_events(Connection &connection, uint32_t events) {
+  auto disconnected = [&]() { report_disconnected(connection); };
+
+  // The messages written to a ring are not sent on the socket
+  if ((events & EPOLLOUT) && !connection.shm) {
+    try {
+      if (!connection.replaying || replay_backlog(connection)) {
+        send_queued(connection);
+      }
+    } catch (const TcpSocketException &e) {
+      disconnected();
+      return;
+    }
+  }
+
+  // The completions of the sends made without copying are notified as errors
+  if ((events & EPOLLERR) && !connection.shm) {
+    connection.output_queue.reap(connection.fd);
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+    // The requests are read while there is data, the event being only
+    // reported again for new data
+    while (connection.fd >= 0) {
+      try {
+        if (connection.input.receive(connection.fd) == 0) {
+          break;
+        }
+      } catch (const TcpSocketException &e) {
+        disconnected();
+        return;
+      }
+
+      fetch_tcp_requests(connection);
+    }
+  }
+}
+
+/**
+ * @brief Connect the links to the peer brokers which are closed, once their
+ * retry deadline passed
+ */
+void Server::open_peer_links() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto &peer : peer_links_) {
+    if (peer->fd >= 0 || now < peer->link.retry_deadline()) {
+      continue;
+    }
+    peer->fd = peer->link.open(now);
+    if (peer->fd < 0) {
+      continue;
+    }
+    // Writable once connected, then each time the requests left are sent
+    try {
+      register_fd(*peer, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    } catch (const std::exception &e) {
+      log_error("Failed to watch a peer broker: ", e.what());
+      close_peer_link(*peer);
+    }
+  }
+}
+
+/**
+ * @brief Close a link to a peer broker, connected again after its retry
+ * interval
+ *
+ * @param peer The link
+ */
+void Server::close_peer_link(PeerLink &peer) {
+  // Closing the socket removes it from the epoll instance
+  peer.link.close(std::chrono::steady_clock::now());
+  peer.fd = -1;
+}
+
+/**
+ * @brief Handle the events of a link to a peer broker: complete its
+ * connection, send its requests and publish the messages it forwards, until
+ * its socket would block
+ *
+ * @param peer The link
+ * @param events The events of its socket
+ */
+void Server::handle_peer_events(PeerLink &peer, uint32_t events) {
+  auto &link = peer.link;
+  if (!link.connected()) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+      return;
+    }
+    // The interest is sent whole, its changes from now on
+    if (!link.finish_connect(subscribers_registry_.interest())) {
+      log_error("Failed to connect to a peer broker");
+      close_peer_link(peer);
+      return;
+    }
+    events |= EPOLLOUT;
+  }
+
+  try {
+    if (events & EPOLLOUT) {
+      link.flush();
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+      while (link.input.receive(peer.fd) > 0) {
+        publish_forwarded(peer);
+      }
+    }
+  } catch (const TcpSocketException &e) {
+    log_error("Lost the link to a peer broker: ", e.what());
+    close_peer_link(peer);
+    return;
+  }
+  // After the fan-out of the forwarded messages
+  disconnect_slow_consumers();
+  flush_pending_messages();
+}
+
+/**
+ * @brief Publish to the local subscribers the messages forwarded by a peer
+ * broker and received whole, sending back its heartbeats
+ *
+ * @param peer The link
+ */
+void Server::publish_forwarded(PeerLink &peer) {
+  auto &link = peer.link;
+  FrameReader::Frame frame{};
+  sockaddr_in sender{};
+  while (true) {
+    FrameReader::Status status = link.input.read(frame);
+    if (status == FrameReader::Status::INCOMPLETE) {
+      break;
+    }
+    if (status != FrameReader::Status::READY) {
+      log_error("Invalid frame forwarded by a peer broker");
+      continue;
+    }
+
+    if (frame.type == TcpMessageType::HEARTBEAT) {
+      link.queue_heartbeat();
+      link.flush();
+    } else if (FederationLink::parse_forwarded(frame, udp_msg_, sender)) {
+      publish_udp_msg(sender, 0, true);
+    } else {
+      log_error("Invalid message forwarded by a peer broker");
+    }
+  }
+}
+
+/**
+ * @brief Send the changes of the interest of the local subscribers to the
+ * connected peer brokers, the consecutive ones of the same kind in bulk
+ * requests
+ */
+void Server::send_interest_changes() {
+  auto changes = subscribers_registry_.take_interest_changes();
+  if (changes.empty()) {
+    return;
+  }
+
+  for (auto &peer : peer_links_) {
+    if (peer->fd < 0 || !peer->link.connected()) {
+      continue;
+    }
+    for (size_t i = 0; i < changes.size();) {
+      topic_patterns_.clear();
+      bool added = changes[i].added;
+      for (; i < changes.size() && changes[i].added == added; ++i) {
+        topic_patterns_.push_back(changes[i].pattern);
+      }
+      peer->link.queue_topics(added ? TcpRequestType::SUBSCRIBE_BULK
+                                    : TcpRequestType::UNSUBSCRIBE_BULK,
+                              topic_patterns_);
+    }
+    try {
+      peer->link.flush();
+    } catch (const TcpSocketException &e) {
+      log_error("Lost the link to a peer broker: ", e.what());
+      close_peer_link(*peer);
+    }
+  }
+}
+
+void Server::run() {
+  if (backend_ == IoBackend::IO_URING) {
+    run_io_uring();
+    return;
+  }
+
+  bool stopped = false;
+
+  if (threads_ > 1) {
+    start_threads();
+  }
+  if (accept_thread_) {
+    acceptor_ = std::make_unique<Acceptor>(listen_fd_);
+    acceptor_context_.fd = acceptor_->event_fd();
+    register_fd(acceptor_context_, EPOLLIN | EPOLLET);
+  }
+  open_peer_links();
+
+  while (!stopped) {
+    // Wake up at the first deadline: coalescing window, keepalive or dump
+    timespec timeout{};
+    auto flush_timeout = next_timeout();
+    if (flush_timeout) {
+      auto seconds =
+          std::chrono::duration_cast<std::chrono::seconds>(*flush_timeout);
+      timeout.tv_sec = seconds.count();
+      timeout.tv_nsec = (*flush_timeout - seconds).count();
+    }
+    handle_events(flush_timeout ? &timeout : nullptr, stopped);
+  }
+
+  // The subscriptions changed since the last checkpoint are kept as well,
+  // unless the process taking over saves them
+  if (!checkpoint_file_.empty() && checkpoint_dirty_ && !handed_off_) {
+    save_checkpoint();
+  }
+
+  // Cleanup remaining tcp connections, once none are handed anymore
+  acceptor_.reset();
+  while (!connections_.empty()) {
+    disconnect_client(*connections_.begin()->second);
+  }
+  closed_connections_.clear();
+  stop_threads();
+}
+
+void Server::run_once() {
+  bool stopped = false;
+  timespec timeout{};
+  handle_events(&timeout, stopped);
+}
+
+void Server::adopt_client(int client_fd) { add_connection(client_fd); }
+
+void Server::publish_datagrams(const sockaddr_in *senders,
+                               const std::byte *const *datagrams,
+                               const size_t *sizes, size_t count) {
+  publish_udp_batch(udp_batch_.load(senders, datagrams, sizes, count));
+}
+
+/**
+ * @brief Wait for the events of the epoll instance, handle them, then run
+ * the work due after each round of events
+ *
+ * @param timeout How long to wait for an event, without limit if nullptr
+ * @param stopped Set to true once the server should stop
+ * @throws std::runtime_error if epoll fails
+ */
+void Server::handle_events(const timespec *timeout, bool &stopped) {
+  int ready = epoll_pwait2(epoll_fd_, events_.data(),
+                           static_cast<int>(events_.size()), timeout,
+                           nullptr);
+  if (ready == -1) {
+    if (errno == EINTR) {
+      // Interrupted by a signal, the caller waits again
+      return;
+    } else {
+      log_error("Error in epoll_wait: ", std::strerror(errno));
+      throw std::runtime_error("Epoll error");
+    }
+  }
+
+  for (int i = 0; i < ready && !stopped; ++i) {
+    auto *context = static_cast<EventContext *>(events_[i].data.ptr);
+    uint32_t events = events_[i].events;
+
+    switch (context->type) {
+    case EventContext::Type::STDIN:
+      handle_stdin_cmd(stopped);
+      break;
+    case EventContext::Type::UDP: {
+      // Receive until the socket is drained, as the event is edge-triggered.
+      // A partial batch drained it, any later packet raising a new event.
+      size_t count = 0;
+      do {
+        count = udp_batch_.receive(udp_fd_);
+        publish_udp_batch(count);
+      } while (udp_batch_.full());
+      break;
+    }
+    case EventContext::Type::LISTEN:
+      accept_clients();
+      break;
+    case EventContext::Type::ACCEPTOR:
+      accept_handed_clients();
+      break;
+    case EventContext::Type::METRICS:
+      serve_metrics();
+      break;
+    case EventContext::Type::CLIENT: {
+      auto &connection = static_cast<Connection &>(*context);
+      // Skip the events of the connections closed by the previous events
+      if (connection.fd >= 0) {
+        handle_client_events(connection, events);
+      }
+      break;
+    }
+    case EventContext::Type::PEER: {
+      auto &peer = static_cast<PeerLink &>(*context);
+      if (peer.fd >= 0) {
+        handle_peer_events(peer, events);
+      }
+      break;
+    }
+    }
+  }
+
+  expire_keepalive_timers();
+  flush_coalesced_messages();
+  run_write_round();
+  if (!peer_links_.empty()) {
+    send_interest_changes();
+    open_peer_links();
+  }
+
+  // No event points to the closed connections anymore
+  closed_connections_.clear();
+
+  if (threads_ > 1 && snapshot_dirty_) {
+    publish_snapshot();
+  }
+  dump_stats();
+  checkpoint_registry();
+}
+
+/**
+ * @brief Run the main event loop on io_uring
+ *
+ * The listening socket, the UDP socket and the clients each have a multishot
+ * request, completing with the connections accepted or the data received in
+ * the buffers provided to the kernel. The messages of a client are sent by a
+ * single send at a time, of the messages queued until it was submitted.
+ *
+ * @throws std::runtime_error if a submission fails
+ */
+void Server::run_io_uring() {
+  bool stopped = false;
+
+  arm_accept();
+  arm_udp_recv();
+  if (read_stdin_) {
+    arm_stdin_poll();
+  }
+  if (metrics_context_.fd >= 0) {
+    arm_metrics_poll();
+  }
+
+  while (!stopped) {
+    // Wake up at the first deadline: coalescing window, keepalive or dump
+    __kernel_timespec timeout{};
+    auto flush_timeout = next_timeout();
+    if (flush_timeout) {
+      auto seconds =
+          std::chrono::duration_cast<std::chrono::seconds>(*flush_timeout);
+      timeout.tv_sec = seconds.count();
+      timeout.tv_nsec = (*flush_timeout - seconds).count();
+    }
+    uring_->submit_and_wait(1, flush_timeout ? &timeout : nullptr);
+    uring_->for_each_cqe(
+        [&](const io_uring_cqe &cqe) { handle_completion(cqe, stopped); });
+
+    // After the fan-out of the batch, as with epoll
+    std::chrono::steady_clock::time_point flush_start{};
+    if (stats_) {
+      flush_start = std::chrono::steady_clock::now();
+    }
+    disconnect_slow_consumers();
+    flush_pending_messages();
+    if (stats_) {
+      record_stage(stats_->flush_ns, flush_start);
+    }
+    expire_keepalive_timers();
+    flush_coalesced_messages();
+    closed_connections_.clear();
+    dump_stats();
+    checkpoint_registry();
+  }
+
+  if (!checkpoint_file_.empty() && checkpoint_dirty_) {
+    save_checkpoint();
+  }
+
+  // Cleanup remaining tcp connections, then wait for their requests
+  uring_stopping_ = true;
+  while (!connections_.empty()) {
+    disconnect_client(*connections_.begin()->second);
+  }
+  pending_flushes_.clear();
+  slow_consumers_.clear();
+  coalescing_.clear();
+  cancel_requests();
+
+  bool ignored = false;
+  while (uring_inflight_ > 0) {
+    uring_->submit_and_wait(1);
+    uring_->for_each_cqe(
+        [&](const io_uring_cqe &cqe) { handle_completion(cqe, ignored); });
+  }
+  closed_connections_.clear();
+}
+
+/**
+ * @brief Accept the TCP connections, until the request is stopped
+ */
+void Server::arm_accept() {
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_ACCEPT;
+  sqe.fd = listen_fd_;
+  sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe.user_data = reinterpret_cast<uint64_t>(&listen_context_);
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Receive the UDP packets, each in a buffer of udp_buffers_, until the
+ * request is stopped
+ */
+void Server::arm_udp_recv() {
+  udp_recv_msg_ = {};
+  udp_recv_msg_.msg_namelen = sizeof(sockaddr_in);
+  // Room for the timestamp and the count of drops of the packet, once enabled
+  udp_recv_msg_.msg_controllen = stats_ ? UdpBatch::CONTROL_SIZE : 0;
+
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_RECVMSG;
+  sqe.fd = udp_fd_;
+  sqe.addr = reinterpret_cast<uint64_t>(&udp_recv_msg_);
+  sqe.len = 1;
+  sqe.ioprio = IORING_RECV_MULTISHOT;
+  sqe.flags = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = UDP_BUFFER_GROUP;
+  sqe.user_data = reinterpret_cast<uint64_t>(&udp_context_);
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Wait for a command on stdin, std::cin reading a single one at a time
+ */
+void Server::arm_stdin_poll() {
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_POLL_ADD;
+  sqe.fd = STDIN_FILENO;
+  sqe.poll32_events = POLLIN;
+  sqe.user_data = reinterpret_cast<uint64_t>(&stdin_context_);
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Wait for a connection to the metrics socket, served by the loop
+ */
+void Server::arm_metrics_poll() {
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_POLL_ADD;
+  sqe.fd = metrics_context_.fd;
+  sqe.poll32_events = POLLIN;
+  sqe.user_data = reinterpret_cast<uint64_t>(&metrics_context_);
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Receive the requests of a client, in the buffers of tcp_buffers_,
+ * until the request is stopped
+ *
+ * @param connection The connection of the client
+ */
+void Server::arm_client_recv(Connection &connection) {
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_RECV;
+  sqe.fd = connection.fd;
+  sqe.ioprio = IORING_RECV_MULTISHOT;
+  sqe.flags = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = TCP_BUFFER_GROUP;
+  sqe.user_data = reinterpret_cast<uint64_t>(&connection);
+  ++connection.inflight_ops;
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Receive the next bytes of a client into its own buffer, once its
+ * multishot receive stopped for want of provided buffers. The bytes are left
+ * in the socket until then, so waiting for buffers to be recycled could
+ * delay the requests, and the end of the connection, indefinitely.
+ *
+ * @param connection The connection of the client
+ */
+void Server::arm_client_recv_into_buffer(Connection &connection) {
+  if (!connection.recv_buffer) {
+    connection.recv_buffer = std::make_unique<std::byte[]>(TCP_BUFFER_SIZE);
+  }
+
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_RECV;
+  sqe.fd = connection.fd;
+  sqe.addr = reinterpret_cast<uint64_t>(connection.recv_buffer.get());
+  sqe.len = TCP_BUFFER_SIZE;
+  sqe.user_data = reinterpret_cast<uint64_t>(&connection);
+  ++connection.inflight_ops;
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Send the queued messages of a client, unless a send is already in
+ * flight, which submits the rest once it completes
+ *
+ * @param connection The connection of the client
+ */
+void Server::submit_send(Connection &connection) {
+  if (connection.fd < 0 || connection.sending ||
+      connection.output_queue.empty()) {
+    return;
+  }
+
+  connection.send_msg = {};
+  connection.send_msg.msg_iov = connection.send_iov.data();
+  connection.send_msg.msg_iovlen = connection.output_queue.prepare(
+      connection.send_iov.data(), connection.send_iov.size());
+
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_SENDMSG;
+  sqe.fd = connection.fd;
+  sqe.addr = reinterpret_cast<uint64_t>(&connection.send_msg);
+  sqe.len = 1;
+  sqe.msg_flags = MSG_NOSIGNAL;
+  sqe.user_data = reinterpret_cast<uint64_t>(&connection) | SEND_TAG;
+  connection.sending = true;
+  ++connection.inflight_ops;
+  ++uring_inflight_;
+}
+
+/**
+ * @brief Cancel all the requests in flight, once the server is stopping
+ */
+void Server::cancel_requests() {
+  auto &sqe = uring_->get_sqe();
+  sqe.opcode = IORING_OP_ASYNC_CANCEL;
+  sqe.fd = -1;
+  sqe.cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+  // Its own completion is ignored
+  sqe.user_data = 0;
+}
+
+/**
+ * @brief Handle a completion of the io_uring instance
+ *
+ * A request is over once it completes without IORING_CQE_F_MORE, after which
+ * a closed connection having no request left is closed for good.
+ *
+ * @param cqe The completion
+ * @param stop A reference to a boolean that indicates whether the server should
+ * stop
+ */
+void Server::handle_completion(const io_uring_cqe &cqe, bool &stop) {
+  if (cqe.user_data == 0) {
+    return;
+  }
+  bool over = !(cqe.flags & IORING_CQE_F_MORE);
+  if (over) {
+    --uring_inflight_;
+  }
+
+  auto *context = reinterpret_cast<EventContext *>(cqe.user_data & ~SEND_TAG);
+  switch (context->type) {
+  case EventContext::Type::STDIN:
+    if (uring_stopping_) {
+      break;
+    } else if (cqe.res < 0) {
+      log_error("Not reading commands from stdin: ", std::strerror(-cqe.res));
+      break;
+    }
+    handle_stdin_cmd(stop);
+    if (!stop) {
+      arm_stdin_poll();
+    }
+    break;
+  case EventContext::Type::UDP:
+    handle_udp_completion(cqe);
+    if (over && !uring_stopping_) {
+      arm_udp_recv();
+    }
+    break;
+  case EventContext::Type::LISTEN:
+    handle_accept_completion(cqe);
+    if (over && !uring_stopping_) {
+      arm_accept();
+    }
+    break;
+  case EventContext::Type::ACCEPTOR:
+    // Only with epoll
+    break;
+  case EventContext::Type::METRICS:
+    if (uring_stopping_) {
+      break;
+    }
+    serve_metrics();
+    arm_metrics_poll();
+    break;
+  case EventContext::Type::CLIENT: {
+    auto &connection = static_cast<Connection &>(*context);
+    if (over) {
+      --connection.inflight_ops;
+    }
+    if (cqe.user_data & SEND_TAG) {
+      handle_send_completion(connection, cqe);
+    } else {
+      handle_recv_completion(connection, cqe);
+      if (over && connection.fd >= 0) {
+        if (cqe.res == -ENOBUFS) {
+          arm_client_recv_into_buffer(connection);
+        } else {
+          arm_client_recv(connection);
+        }
+      }
+    }
+
+    if (connection.fd < 0 && connection.inflight_ops == 0) {
+      auto it = closing_connections_.find(&connection);
+      if (it != closing_connections_.end()) {
+        close(connection.closing_fd);
+        closed_connections_.push_back(std::move(it->second));
+        closing_connections_.erase(it);
+      }
+    }
+    break;
+  }
+  case EventContext::Type::PEER:
+    // The federation runs with epoll
+    break;
+  }
+}
+
+/**
+ * @brief Register a connection accepted by the multishot accept
+ *
+ * @param cqe The completion, holding the socket of the client
+ */
+void Server::handle_accept_completion(const io_uring_cqe &cqe) {
+  if (cqe.res < 0) {
+    if (cqe.res != -ECANCELED) {
+      log_error("Error accepting TCP connection: ", std::strerror(-cqe.res));
+    }
+    return;
+  }
+
+  // Non-blocking and without Nagle's algorithm, as with epoll
+  int client_fd = cqe.res;
+  if (uring_stopping_) {
+    close(client_fd);
+    return;
+  }
+
+  auto connection = std::make_unique<Connection>(
+      client_fd, next_connection_id_++, queue_config_);
+  arm_client_recv(*connection);
+  start_keepalive(*connection);
+  if (capture_) {
+    capture_->connection(CaptureKind::CONNECT, connection->id);
+  }
+  connections_.insert_or_assign(client_fd, std::move(connection));
+}
+
+/**
+ * @brief Send a UDP packet received by the multishot receive to its
+ * subscribers, the queues being flushed after the whole batch of completions
+ *
+ * @param cqe The completion, holding the buffer of the packet
+ */
+void Server::handle_udp_completion(const io_uring_cqe &cqe) {
+  if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+    if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+      log_error("Error receiving UDP packet: ", std::strerror(-cqe.res));
+    }
+    return;
+  }
+
+  auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+  auto guard = make_scope_guard([&]() { udp_buffers_->recycle(id); });
+  if (uring_stopping_ || cqe.res < 0) {
+    return;
+  }
+
+  // The buffer holds the header, the address of the sender, the control
+  // messages and the payload
+  const std::byte *buffer = udp_buffers_->buffer(id);
+  io_uring_recvmsg_out out{};
+  std::memcpy(&out, buffer, sizeof(out));
+  if (out.flags & MSG_TRUNC) {
+    log_error("Error deserializing UDP payload: packet too long");
+    return;
+  }
+
+  sockaddr_in sender{};
+  std::memcpy(&sender, buffer + sizeof(out),
+              std::min<size_t>(out.namelen, sizeof(sender)));
+  const std::byte *control = buffer + sizeof(out) + udp_recv_msg_.msg_namelen;
+  const std::byte *payload = control + udp_recv_msg_.msg_controllen;
+  if (capture_) {
+    capture_->datagram(sender, payload, out.payloadlen);
+  }
+  if (admission_ && !admit_udp_packet(sender, AdmissionControl::now_ns())) {
+    return;
+  }
+
+  uint64_t received_ns = 0;
+  if (stats_) {
+    msghdr header{};
+    header.msg_control = const_cast<std::byte *>(control);
+    header.msg_controllen = out.controllen;
+    received_ns = UdpBatch::timestamp(header);
+    record_kernel_drops(UdpBatch::drop_count(header));
+  }
+
+  if (UdpMessageCursor::is_registration(payload, out.payloadlen)) {
+    register_udp_topics(sender, payload, out.payloadlen);
+    publisher_topics_.release_retired();
+    return;
+  }
+  for (UdpMessageCursor cursor(payload, out.payloadlen); !cursor.done();) {
+    UdpParseError error = cursor.next(udp_msg_);
+    if (error == UdpParseError::NONE && cursor.by_topic_id()) {
+      auto *registered =
+          publisher_topics_.resolve(sender, cursor.topic_id(), udp_msg_);
+      if (registered != nullptr) {
+        const auto &subscribers = registered_subscribers(*registered);
+        fan_out_udp_msg(registered->compiled.topic, subscribers, sender,
+                        received_ns, false);
+        continue;
+      }
+      error = UdpParseError::UNKNOWN_TOPIC_ID;
+    }
+    if (error != UdpParseError::NONE) {
+      reject_udp_msg(error);
+      continue;
+    }
+    publish_udp_msg(sender, received_ns);
+  }
+}
+
+/**
+ * @brief Handle the data received from a client by its multishot receive, or
+ * by the plain receive into its own buffer that replaces it while the
+ * provided buffers run out
+ *
+ * @param connection The connection of the client
+ * @param cqe The completion, holding the buffer of the data
+ */
+void Server::handle_recv_completion(Connection &connection,
+                                    const io_uring_cqe &cqe) {
+  // The requests are handled as the reader fills, the bytes received
+  // possibly exceeding its free space
+  auto receive = [&](const std::byte *buffer) {
+    auto size = static_cast<size_t>(cqe.res);
+    while (size > 0 && connection.fd >= 0) {
+      size_t appended = connection.input.append(buffer, size);
+      buffer += appended;
+      size -= appended;
+      fetch_tcp_requests(connection);
+    }
+  };
+
+  if (cqe.flags & IORING_CQE_F_BUFFER) {
+    auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe.res > 0 && connection.fd >= 0) {
+      receive(tcp_buffers_->buffer(id));
+    }
+    tcp_buffers_->recycle(id);
+  } else if (cqe.res > 0 && connection.fd >= 0) {
+    receive(connection.recv_buffer.get());
+  }
+  if (connection.fd < 0) {
+    return;
+  }
+
+  // Without provided buffers left, the bytes are still in the socket and read
+  // into the buffer of the connection next
+  if (cqe.res <= 0 && cqe.res != -ENOBUFS) {
+    // Closed by the client, or failed
+    report_disconnected(connection);
+  }
+}
+
+/**
+ * @brief Release what a send of the client sent, and send the rest
+ *
+ * @param connection The connection of the client
+ * @param cqe The completion, holding the number of bytes sent
+ */
+void Server::handle_send_completion(Connection &connection,
+                                    const io_uring_cqe &cqe) {
+  connection.sending = false;
+  connection.output_queue.consume(cqe.res > 0 ? static_cast<size_t>(cqe.res)
+                                              : 0);
+  if (connection.fd < 0) {
+    return;
+  }
+
+  if (cqe.res < 0) {
+    // The client is disconnected when its receive reports the error
+    log_error("Error sending TCP message: ", std::strerror(-cqe.res));
+    connection.output_queue.clear();
+    return;
   }
+  submit_send(connection);
 }
@@ -1,29 +1,158 @@
 #pragma once
 
+#include "acceptor.hpp"
+#include "admission_control.hpp"
+#include "batch_encoder.hpp"
+#include "broker_stats.hpp"
+#include "capture.hpp"
+#include "cpu_placement.hpp"
+#include "fanout_encoder.hpp"
+#include "federation_link.hpp"
+#include "frame_reader.hpp"
+#include "handoff.hpp"
+#include "io_uring.hpp"
+#include "io_worker.hpp"
+#include "message_store.hpp"
+#include "multicast_egress.hpp"
+#include "multicast_proto.hpp"
+#include "output_queue.hpp"
+#include "priority_classes.hpp"
+#include "publisher_topics.hpp"
+#include "registry_snapshot.hpp"
+#include "retained_store.hpp"
+#include "shm_ring.hpp"
 #include "subscribers_registry.hpp"
 #include "tcp_proto.hpp"
+#include "timer_wheel.hpp"
+#include "topic_batch.hpp"
+#include "topic_steering.hpp"
+#include "udp_batch.hpp"
+#include "udp_ingest.hpp"
 #include "udp_proto.hpp"
+#include <array>
+#include <chrono>
 #include <cstdint>
+#include <fstream>
+#include <memory>
 #include <netinet/in.h>
 #include <optional>
-#include <poll.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unordered_map>
 #include <vector>
 
+/**
+ * @brief How the server waits for its sockets, on a single thread
+ */
+enum class IoBackend : uint8_t {
+  // Readiness events, the sockets being read and written without blocking
+  EPOLL = 0,
+  // Completions of the receives and sends, made by the kernel
+  IO_URING,
+};
+
+struct KeepaliveConfig {
+  // How long a subscriber may stay silent before it is sent a heartbeat,
+  // which it sends back, none are sent if it is zero
+  std::chrono::milliseconds heartbeat_interval{0};
+  // How long a client may stay silent before it is disconnected, never if it
+  // is zero
+  std::chrono::milliseconds idle_timeout{0};
+};
+
+struct QuotaConfig {
+  // The memory the subscriptions of a subscriber may hold, in bytes, as
+  // estimated by SubscribersRegistry::subscription_size, its subscriptions
+  // past it being refused, unlimited if 0
+  size_t subscription_bytes{};
+  // Size of the messages queued for all the subscribers together, in bytes,
+  // from which the slow consumer policy applies to every subscriber, unlimited
+  // if 0
+  size_t queued_bytes{};
+};
+
 class Server {
 public:
   /**
    * @brief Construct a new Server object
    *
    * @param port The port to bind the server to
+   * @param queue_config The limits of the output queues of the subscribers
+   * @param threads The number of UDP ingest threads and of I/O worker threads,
+   * the server running on a single thread if it is 1
+   * @param backend How the sockets are waited for, io_uring requiring a
+   * single thread
+   * @param store_config Where the messages of the offline subscribers are
+   * stored, requiring a single thread and epoll, none by default
+   * @param stats_config Whether the statistics are collected, requiring a
+   * single thread, where they are dumped and the Unix socket they are
+   * served on, disabled by default
+   * @param keepalive_config When the idle clients are sent heartbeats or
+   * disconnected, neither by default
+   * @param accept_config The backlog of the listening socket, and whether the
+   * connections are accepted by a dedicated thread, requiring epoll
+   * @param multicast_config The group the messages of the topics with a large
+   * fan-out are sent to, requiring a single thread, none by default
+   * @param priorities The priority classes of the published topics, a lane
+   * of the output queues being given to each
+   * @param federation_config The brokers the publications matching the
+   * interest of the local subscribers are forwarded from, requiring a single
+   * thread and epoll, none by default
+   * @param checkpoint_config The file the registry is saved to periodically
+   * and loaded from, so that the subscribers keep their subscriptions across
+   * restarts, none by default
+   * @param udp_config The size of the receive buffer of the UDP sockets, that
+   * of the kernel by default
+   * @param retained_config Whether the last message of each topic is sent to
+   * its new subscribers, requiring a single thread, disabled by default
+   * @param admission_config The rates of the UDP packets of each publisher
+   * and of all of them, unlimited by default
+   * @param handoff_config The command the server is started again with by
+   * the handoff command, and the socket the state of the process it takes
+   * over from is received on, if any
+   * @param quota_config The memory the subscriptions of each subscriber and
+   * the output queues of all of them may hold, the queues requiring a single
+   * thread, unlimited by default
+   * @param placement_config The CPUs the threads are pinned to, and whether
+   * the new subscribers go to the worker of the CPU they are received on,
+   * requiring several threads, neither by default
+   * @param capture_config The file the UDP datagrams and the requests of the
+   * subscribers are recorded to, to be replayed, requiring a single thread,
+   * none by default
+   * @param match_config The shards of the wildcard subscriptions, walked in
+   * parallel, a single one by default
    *
-   * @throws std::runtime_error if the socket creation or binding fails
+   * @throws std::runtime_error if the socket creation or binding fails, if
+   * the backend, the store, the statistics, the acceptor thread, the
+   * multicast group, the federation, the retained messages, the budget of
+   * the queues, the placement or the capture are not supported, if the file
+   * of the statistics, the capture or the multicast socket cannot be opened,
+   * or if the handoff cannot be received
    */
-  explicit Server(uint16_t port);
+  explicit Server(uint16_t port, const OutputQueueConfig &queue_config = {},
+                  size_t threads = 1, IoBackend backend = IoBackend::EPOLL,
+                  const MessageStoreConfig &store_config = {},
+                  const BrokerStatsConfig &stats_config = {},
+                  const KeepaliveConfig &keepalive_config = {},
+                  const AcceptConfig &accept_config = {},
+                  const MulticastConfig &multicast_config = {},
+                  const PriorityClasses &priorities = {},
+                  const FederationConfig &federation_config = {},
+                  const RegistryCheckpointConfig &checkpoint_config = {},
+                  const UdpReceiveConfig &udp_config = {},
+                  const RetainedStoreConfig &retained_config = {},
+                  const AdmissionConfig &admission_config = {},
+                  const HandoffConfig &handoff_config = {},
+                  const QuotaConfig &quota_config = {},
+                  const PlacementConfig &placement_config = {},
+                  const CaptureConfig &capture_config = {},
+                  const MatchConfig &match_config = {});
 
   /**
    * @brief Destroy the Server object
    *
-   * Closes the TCP and UDP sockets
+   * Closes the TCP and UDP sockets, and the epoll instance
    */
   ~Server();
 
@@ -37,26 +166,391 @@ public:
    */
   void run();
 
+  /**
+   * @brief Handle the events ready, without waiting, as a round of the loop
+   * of run, for a replay driving the server itself, with epoll
+   *
+   * @throws std::runtime_error if epoll fails
+   */
+  void run_once();
+
+  /**
+   * @brief Watch a connected socket as a new subscriber, for a replay
+   *
+   * @param client_fd The socket, non-blocking
+   */
+  void adopt_client(int client_fd);
+
+  /**
+   * @brief Send a batch of UDP datagrams to their subscribers, as if they
+   * were received by a single recvmmsg, for a replay, with epoll
+   *
+   * @param senders The addresses of their publishers
+   * @param datagrams The datagrams
+   * @param sizes Their sizes
+   * @param count The number of datagrams, at most UdpBatch::CAPACITY
+   */
+  void publish_datagrams(const sockaddr_in *senders,
+                         const std::byte *const *datagrams,
+                         const size_t *sizes, size_t count);
+
+  // The statistics, nullptr if they are not collected
+  auto stats() const -> const BrokerStats * { return stats_.get(); }
+
 private:
-  void register_pollfd(int fd, short events);
-  void unregister_pollfd(size_t pollfd_index);
+  // What an epoll event is about, pointed to by its data
+  struct EventContext {
+    enum class Type : uint8_t {
+      LISTEN,
+      ACCEPTOR,
+      UDP,
+      STDIN,
+      CLIENT,
+      PEER,
+      METRICS
+    };
+
+    Type type{};
+    int fd{-1};
+  };
+
+  // A TCP client, closed once its fd is -1, its timer being that of its
+  // keepalive deadlines
+  struct Connection : EventContext, TimerWheel::Timer {
+    explicit Connection(int fd, uint64_t id,
+                        const OutputQueueConfig &queue_config)
+        : EventContext{Type::CLIENT, fd}, id(id), output_queue(queue_config) {}
+
+    // unique over the connections, unlike the fd
+    uint64_t id{};
+    // the flags of the CONNECT request of the subscriber, TCP_CONNECT_*
+    uint8_t connect_flags{};
+    // the I/O worker sending its messages, in the multi-threaded mode
+    size_t worker{};
+    // The state of the deficit round robin of the writes: the bytes the
+    // subscriber may still be sent, the last round it was given its quantum
+    // in, and whether it waits for the next round, in write_round_
+    size_t write_deficit{};
+    uint64_t write_turn{};
+    bool write_scheduled{};
+    // the messages waiting to be sent, by the server running on a single
+    // thread
+    OutputQueue output_queue;
+    // the deliveries are held back for the coalescing window, unless the
+    // subscriber opted out when connecting
+    bool coalesce{};
+    // the end of the window of the queued messages, while in coalescing_
+    std::chrono::steady_clock::time_point flush_deadline{};
+    // the responses are batched for a subscriber of protocol v2, by the
+    // server running on a single thread
+    std::unique_ptr<BatchEncoder> batch_encoder{};
+    // the messages stored while the subscriber was offline are sent before
+    // the queued ones
+    bool replaying{};
+    // the ring the messages are written to instead of the socket, for a
+    // subscriber on the host of the server which asked for it when connecting
+    std::unique_ptr<ShmRing> shm{};
+
+    // the bytes received not forming a whole request yet
+    FrameReader input{};
+    // when the client last sent anything, or connected, and when it was last
+    // sent a heartbeat, if the keepalive is enabled
+    std::chrono::steady_clock::time_point last_received{};
+    std::chrono::steady_clock::time_point last_heartbeat{};
+
+    // The state of the io_uring backend: the single send in flight
+    std::array<iovec, OutputQueue::IOV_BATCH> send_iov{};
+    msghdr send_msg{};
+    bool sending{};
+    // the buffer of the plain receive armed when the provided buffers ran
+    // out, allocated the first time
+    std::unique_ptr<std::byte[]> recv_buffer{};
+    // the requests not completed yet, the socket being closed after them
+    size_t inflight_ops{};
+    // the socket shut down until then
+    int closing_fd{-1};
+  };
+
+  // A link to a broker of the federation, its fd being -1 while it is closed
+  struct PeerLink : EventContext {
+    PeerLink(const sockaddr_in &peer, const FederationConfig &config)
+        : EventContext{Type::PEER, -1},
+          link(peer, config.id, config.retry_interval) {}
+
+    FederationLink link;
+  };
+
+  // A topic registered by a publisher, parsed, and its subscribers, once
+  // retrieved, with the version of the cache of the registry then
+  struct RegisteredTopic {
+    TopicView topic{};
+    const SubscribersRegistry::TopicSubscribers *subscribers{};
+    uint64_t version{};
+  };
+
+  // Number of events handled per epoll_wait
+  static constexpr size_t MAX_EVENTS = 256;
+
+  // Size of the io_uring submission queue
+  static constexpr unsigned URING_ENTRIES = 1024;
+  // Buffers provided for the receives of the io_uring backend. A client whose
+  // receive finds none left is read into its own buffer instead.
+  static constexpr uint16_t TCP_BUFFER_GROUP = 0;
+  static constexpr uint16_t TCP_BUFFERS = 256;
+  static constexpr size_t TCP_BUFFER_SIZE = 512;
+  static constexpr uint16_t UDP_BUFFER_GROUP = 1;
+  static constexpr uint16_t UDP_BUFFERS = 256;
+  static constexpr size_t UDP_BUFFER_SIZE =
+      sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) +
+      UdpBatch::CONTROL_SIZE + UdpMessage::MAX_SERIALIZED_SIZE;
+  // Tag of the user data of the sends, pointing to their connection
+  static constexpr uint64_t SEND_TAG = 1;
+  // Resolution of the keepalive deadlines
+  static constexpr std::chrono::milliseconds KEEPALIVE_TICK{10};
+  // How long the process taking over may take to acknowledge the handoff
+  static constexpr std::chrono::milliseconds HANDOFF_TIMEOUT{5000};
+
+  void register_fd(EventContext &context, uint32_t events);
+  void start_threads();
+  void stop_threads();
+  auto open_ingest_socket(const sockaddr_in &addr) -> int;
+  void publish_snapshot();
+  void close_connection(Connection &connection);
   void handle_stdin_cmd(bool &stop);
-  auto handle_udp_msg() -> std::optional<sockaddr_in>;
-  void handle_tcp_request(size_t pollfd_index);
-  void fetch_tcp_request(int sockfd);
-  void prepare_tcp_response(const sockaddr_in &udp_sender);
-  void send_tcp_message(int sockfd);
-  void disconnect_client(size_t pollfd_index);
+  auto hand_off() -> bool;
+  auto collect_handoff() -> HandoffState;
+  void adopt_connections(HandoffState &state);
+  void set_connect_flags(Connection &connection, uint8_t flags);
+  void publish_udp_batch(size_t count);
+  void register_udp_topics(const sockaddr_in &sender, const std::byte *buffer,
+                           size_t size);
+  void record_kernel_drops(uint32_t drop_count);
+  auto admit_udp_packet(const sockaddr_in &sender, uint64_t now_ns) -> bool;
+  void publish_udp_msg(const sockaddr_in &udp_sender, uint64_t received_ns,
+                       bool forwarded = false);
+  auto match_topic(const TopicView &topic)
+      -> const SubscribersRegistry::TopicSubscribers &;
+  auto registered_subscribers(PublisherTopics<RegisteredTopic>::Topic &topic)
+      -> const SubscribersRegistry::TopicSubscribers &;
+  void fan_out_udp_msg(const TopicView &topic,
+                       const SubscribersRegistry::TopicSubscribers &subscribers,
+                       const sockaddr_in &udp_sender, uint64_t received_ns,
+                       bool forwarded);
+  void reject_topic(std::string_view topic_str);
+  void send_retained(int sockfd, const TokenPattern &pattern,
+                     const ContentFilter *filter, bool conflate);
+  void reject_udp_msg(UdpParseError error);
+  void accept_clients();
+  void accept_handed_clients();
+  void add_connection(int client_fd);
+  void handle_client_events(Connection &connection, uint32_t events);
+  void handle_tcp_request(Connection &connection);
+  auto parse_topic_pattern(std::string_view topic_str, TokenPattern &pattern)
+      -> bool;
+  void refuse_subscription(int sockfd, std::string_view topics);
+  void fetch_tcp_requests(Connection &connection);
+  void send_tcp_message(int sockfd,
+                        std::shared_ptr<const OutgoingMessage> message,
+                        bool conflate);
+  void flush_pending_messages();
+  void send_queued(Connection &connection);
+  void run_write_round();
+  auto hold_back(Connection &connection) -> bool;
+  void flush_coalesced_messages();
+  auto next_timeout() const -> std::optional<std::chrono::nanoseconds>;
+  auto queue_depths() -> std::vector<BrokerStats::QueueDepth>;
+  void write_stats(std::ostream &out);
+  void write_metrics(std::ostream &out);
+  void write_top_topics(std::ostream &out);
+  void dump_stats();
+  void open_metrics_socket(const std::string &path);
+  void serve_metrics();
+  void load_checkpoint();
+  void save_checkpoint();
+  void checkpoint_registry();
+  void flush_connection(Connection &connection);
+  void attach_shm(Connection &connection, const TcpRequestPayloadId &payload);
+  void flush_shm(Connection &connection);
+  auto replay_backlog(Connection &connection) -> bool;
+  void disconnect_slow_consumers();
+  void start_keepalive(Connection &connection);
+  void expire_keepalive_timers();
+  void handle_keepalive(Connection &connection,
+                        std::chrono::steady_clock::time_point now);
+  void send_heartbeat(Connection &connection);
+  void push_control_message(Connection &connection,
+                            std::shared_ptr<const OutgoingMessage> message);
+  void retransmit_multicast(Connection &connection, const MulticastNack &nack);
+  void disconnect_client(Connection &connection);
+  void report_disconnected(Connection &connection);
+  void open_peer_links();
+  void close_peer_link(PeerLink &peer);
+  void handle_peer_events(PeerLink &peer, uint32_t events);
+  void publish_forwarded(PeerLink &peer);
+  void send_interest_changes();
+
+  void run_io_uring();
+  void handle_events(const timespec *timeout, bool &stopped);
+  void arm_accept();
+  void arm_udp_recv();
+  void arm_stdin_poll();
+  void arm_metrics_poll();
+  void arm_client_recv(Connection &connection);
+  void arm_client_recv_into_buffer(Connection &connection);
+  void submit_send(Connection &connection);
+  void cancel_requests();
+  void handle_completion(const io_uring_cqe &cqe, bool &stop);
+  void handle_accept_completion(const io_uring_cqe &cqe);
+  void handle_udp_completion(const io_uring_cqe &cqe);
+  void handle_recv_completion(Connection &connection, const io_uring_cqe &cqe);
+  void handle_send_completion(Connection &connection, const io_uring_cqe &cqe);
 
   int listen_fd_{};
   int udp_fd_{};
+  int epoll_fd_{-1};
 
-  std::vector<std::byte> udp_buffer_{UdpMessage::MAX_SERIALIZED_SIZE};
-  UdpMessage udp_msg_{};
+  // A distinct topic of the UDP batch, parsed once, and its subscribers, once
+  // retrieved, with the evictions of the cache of the registry then
+  struct BatchTopic {
+    std::optional<TopicView> topic{};
+    const SubscribersRegistry::TopicSubscribers *subscribers{};
+    uint64_t evictions{};
+  };
+
+  UdpBatch udp_batch_{};
+  UdpMessageView udp_msg_{};
+  // the messages of the UDP batch being published, by topic, and the
+  // registered topic of each distinct topic sent by id, nullptr for the others
+  TopicBatch topic_batch_{};
+  std::vector<BatchTopic> batch_topics_{};
+  std::vector<PublisherTopics<RegisteredTopic>::Topic *> batch_registered_{};
+  // the topic ids of the publishers, and the acknowledgement of the last
+  // registration, kept allocated
+  PublisherTopics<RegisteredTopic> publisher_topics_{};
+  std::vector<std::byte> registration_ack_{};
+  // the size of the receive buffer of the UDP sockets, 0 for that of the
+  // kernel, and the last SO_RXQ_OVFL count of drops of udp_fd_
+  size_t udp_receive_buffer_{};
+  uint32_t udp_drop_count_{};
+  // whether UDP_GRO is enabled on the UDP sockets
+  bool udp_gro_{};
+  // the rates of the UDP packets, if they are limited, each ingest thread
+  // having its own
+  AdmissionConfig admission_config_{};
+  std::unique_ptr<AdmissionControl> admission_{};
+  FanoutEncoder fanout_encoder_{};
 
-  std::vector<std::byte> tcp_buffer_{TcpMessage::MAX_SERIALIZED_SIZE};
   TcpMessage tcp_msg_{};
+  // the topics of a bulk request, reused between the requests
+  std::vector<TokenPattern> topic_patterns_{};
+  // the offline subscribers whose filters accept a message, reused between
+  // the messages
+  std::vector<std::string> offline_ids_{};
+
+  OutputQueueConfig queue_config_{};
+  // the bytes queued for all the subscribers, if the queues have a budget
+  size_t queue_budget_used_{};
+  size_t threads_{1};
+  // the subscribers whose queue got messages during the fan-out, flushed
+  // once it is over
+  std::vector<int> pending_flushes_{};
+  // the subscribers to disconnect once the fan-out is over
+  std::vector<int> slow_consumers_{};
+  // the subscribers whose queue is held back until the end of its coalescing
+  // window, in the order of their deadlines
+  std::vector<int> coalescing_{};
+  // the subscribers whose deficit was spent before their queue, given another
+  // quantum in the next round of the writes, the one being run, and the
+  // number of the current round
+  std::vector<int> write_round_{};
+  std::vector<int> write_turns_{};
+  uint64_t write_rounds_{1};
 
   SubscribersRegistry subscribers_registry_{};
-  std::vector<pollfd> poll_fds_{};
+  // the messages of the offline subscribers, if they are stored
+  std::unique_ptr<MessageStore> store_{};
+  // the group the messages of the topics with a large fan-out are sent to, if
+  // there is one
+  std::unique_ptr<MulticastEgress> multicast_{};
+  // the last message of each topic, if they are retained
+  std::unique_ptr<RetainedStore> retained_{};
+
+  // the file the registry is saved to, if any, at checkpoint_interval_ once
+  // it changed
+  std::string checkpoint_file_{};
+  std::chrono::milliseconds checkpoint_interval_{};
+  std::chrono::steady_clock::time_point next_checkpoint_{};
+  bool checkpoint_dirty_{};
+  // the checkpoint being written, reused between them
+  std::vector<std::byte> checkpoint_{};
+
+  // the command the server is started again with by the handoff, and whether
+  // it handed its sockets off, the process taking over saving the registry
+  std::vector<std::string> handoff_command_{};
+  bool handed_off_{};
+
+  // the links to the brokers of the federation, if it is federated
+  std::vector<std::unique_ptr<PeerLink>> peer_links_{};
+
+  // the statistics, if they are collected
+  std::unique_ptr<BrokerStats> stats_{};
+  // the input recorded, if it is captured
+  std::unique_ptr<CaptureWriter> capture_{};
+  // the file they are dumped to, if it is open, at stats_interval_
+  std::ofstream stats_file_{};
+  std::chrono::milliseconds stats_interval_{};
+  std::chrono::steady_clock::time_point next_stats_dump_{};
+  // the Unix socket they are served on, if any, and its path
+  EventContext metrics_context_{EventContext::Type::METRICS, -1};
+  std::string metrics_path_{};
+
+  // the keepalive deadlines of the connections, if the keepalive is enabled
+  KeepaliveConfig keepalive_config_{};
+  std::unique_ptr<TimerWheel> keepalive_timers_{};
+  // the same bytes are sent as every heartbeat
+  std::shared_ptr<const OutgoingMessage> heartbeat_{};
+
+  // The threads of the multi-threaded mode: the subscribers are sharded across
+  // the I/O workers, and the UDP ingest threads match the messages against
+  // the last snapshot of the registry, which they load atomically
+  std::shared_ptr<const RegistrySnapshot> snapshot_{};
+  // the registry changed since the last snapshot
+  bool snapshot_dirty_{};
+  std::vector<std::unique_ptr<IoWorker>> io_workers_{};
+  // the CPUs of the threads, and the worker of each new subscriber
+  PlacementConfig placement_{};
+  ConnectionSteering steering_{{}, 0};
+  // destroyed first, as they use the snapshot and the workers
+  std::vector<std::unique_ptr<UdpIngest>> udp_ingests_{};
+
+  EventContext listen_context_{EventContext::Type::LISTEN, -1};
+  // the connections are accepted by acceptor_ instead of the event loop, which
+  // is woken up by its eventfd
+  bool accept_thread_{};
+  std::unique_ptr<Acceptor> acceptor_{};
+  EventContext acceptor_context_{EventContext::Type::ACCEPTOR, -1};
+  EventContext udp_context_{EventContext::Type::UDP, -1};
+  EventContext stdin_context_{EventContext::Type::STDIN, -1};
+  // mapping of the client sockets to their connection
+  std::unordered_map<int, std::unique_ptr<Connection>> connections_{};
+  uint64_t next_connection_id_{};
+  // the connections closed while handling the current events, which may still
+  // point to them, freed after them
+  std::vector<std::unique_ptr<Connection>> closed_connections_{};
+  std::vector<epoll_event> events_{MAX_EVENTS};
+
+  IoBackend backend_{IoBackend::EPOLL};
+  std::unique_ptr<IoUring> uring_{};
+  std::unique_ptr<IoUringBufferRing> tcp_buffers_{};
+  std::unique_ptr<IoUringBufferRing> udp_buffers_{};
+  // the header of the multishot UDP receive, in which the kernel only reads
+  // the size of the sender address
+  msghdr udp_recv_msg_{};
+  bool read_stdin_{};
+  // the requests not completed yet, waited for once the server is stopping
+  size_t uring_inflight_{};
+  bool uring_stopping_{};
+  // the connections closed, still having requests in flight
+  std::unordered_map<const Connection *, std::unique_ptr<Connection>>
+      closing_connections_{};
 };
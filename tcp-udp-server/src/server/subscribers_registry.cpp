@@ -1,8 +1,29 @@
 #include "subscribers_registry.hpp"
+#include "pattern_matcher.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
+#include <string_view>
 
-auto SubscribersRegistry::get_subscriber_by_sockfd(int sockfd)
-    -> std::shared_ptr<SubscriberInfo> {
+SubscribersRegistry::SubscribersRegistry(bool track_offline,
+                                         size_t multicast_threshold,
+                                         PriorityClasses priorities,
+                                         bool track_interest,
+                                         size_t subscription_quota,
+                                         size_t match_shards)
+    : wildcard_shards_(
+          std::clamp<size_t>(match_shards, 1, MatchPool::MAX_TASKS)),
+      track_offline_(track_offline), multicast_threshold_(multicast_threshold),
+      priorities_(std::move(priorities)), track_interest_(track_interest),
+      subscription_quota_(subscription_quota) {
+  if (wildcard_shards_.size() > 1) {
+    // The thread of the registry walks a shard as well
+    match_pool_ = std::make_unique<MatchPool>(wildcard_shards_.size() - 1);
+  }
+}
+
+auto SubscribersRegistry::get_subscriber_by_sockfd(int sockfd) -> Slot {
   auto it = sock_subscribers_.find(sockfd);
   if (it == sock_subscribers_.end()) {
     throw std::runtime_error("Subscriber not connected");
@@ -10,22 +31,38 @@ auto SubscribersRegistry::get_subscriber_by_sockfd(int sockfd)
   return it->second;
 }
 
-void SubscribersRegistry::connect_subscriber(int sockfd,
-                                             const std::string &id) {
+void SubscribersRegistry::connect_subscriber(int sockfd, const std::string &id,
+                                             bool multicast, bool peer) {
   // If the subscriber already exists and is not connected, mark it as connected
   // If the subscriber already exists and is connected, throw an error
   auto it = id_subscribers_.find(id);
   if (it != id_subscribers_.end()) {
-    if (it->second->is_connected()) {
+    auto &subscriber = subscribers_[it->second];
+    if (subscriber.is_connected()) {
       throw std::runtime_error("Subscriber already connected");
     }
-    it->second->sockfd = sockfd;
+    bool counted = counts_interest(subscriber);
+    subscriber.sockfd = sockfd;
+    subscriber.multicast = multicast;
+    subscriber.peer = peer;
     sock_subscribers_[sockfd] = it->second;
+    if (!counted && counts_interest(subscriber)) {
+      for (const auto &topic : subscriber.topics) {
+        add_interest(topic);
+      }
+    }
+
+    // The subscriber gets back the topics it kept subscribed to
+    for (const auto &topic : subscriber.topics) {
+      invalidate_fanout(topic);
+    }
   } else {
-    // If the subscriber does not exist, create a new one
-    auto subscriber = std::make_shared<SubscriberInfo>(id, sockfd);
-    sock_subscribers_[sockfd] = subscriber;
-    id_subscribers_[id] = subscriber;
+    // If the subscriber does not exist, create a new one in the next slot
+    auto slot = static_cast<Slot>(subscribers_.size());
+    subscribers_.emplace_back(id, sockfd, multicast, peer);
+    sock_subscribers_[sockfd] = slot;
+    id_subscribers_[id] = slot;
+    resize_matched();
   }
 }
 
@@ -36,54 +73,751 @@ void SubscribersRegistry::disconnect_subscriber(int sockfd) {
     return;
   }
 
-  auto subscriber = it->second;
-  subscriber->sockfd = -1;
+  auto slot = it->second;
+  auto &subscriber = subscribers_[slot];
+  bool counted = counts_interest(subscriber);
+  subscriber.sockfd = -1;
   sock_subscribers_.erase(it);
+
+  if (subscriber.peer) {
+    // A broker sends its whole interest again once it reconnects, so nothing
+    // is stored for it meanwhile
+    std::vector<TokenPattern> topics(subscriber.topics.begin(),
+                                     subscriber.topics.end());
+    invalidate_fanout(topics);
+    for (const auto &topic : topics) {
+      remove_subscription(slot, topic);
+    }
+    return;
+  }
+  if (counted && !counts_interest(subscriber)) {
+    for (const auto &topic : subscriber.topics) {
+      remove_interest(topic);
+    }
+  }
+
+  if (track_offline_ || subscriber.multicast) {
+    // The subscriber is now among the offline ones of its topics, or the
+    // others of its topics may fall under the multicast threshold
+    for (const auto &topic : subscriber.topics) {
+      invalidate_fanout(topic);
+    }
+    return;
+  }
+
+  for (auto &[hash, cached] : fanout_cache_) {
+    for (auto *sockets : {&cached.subscribers.sockets,
+                          &cached.subscribers.conflating_sockets,
+                          &cached.subscribers.peer_sockets}) {
+      sockets->erase(std::remove(sockets->begin(), sockets->end(), sockfd),
+                     sockets->end());
+    }
+    auto &filtered = cached.subscribers.filtered_sockets;
+    filtered.erase(std::remove_if(filtered.begin(), filtered.end(),
+                                  [&](const auto &entry) {
+                                    return entry.first == sockfd;
+                                  }),
+                   filtered.end());
+  }
 }
 
 auto SubscribersRegistry::get_subscriber_id(int sockfd) -> const std::string & {
-  auto subscriber = get_subscriber_by_sockfd(sockfd);
-  return subscriber->id;
+  return subscribers_[get_subscriber_by_sockfd(sockfd)].id;
+}
+
+auto SubscribersRegistry::find_exact_topic(const TokenPattern &topic)
+    -> ExactTopics::iterator {
+  auto [it, end] = exact_subscribers_.equal_range(topic.hashValue());
+  it = std::find_if(it, end, [&](const auto &entry) {
+    return entry.second.topic == topic;
+  });
+  return it == end ? exact_subscribers_.end() : it;
 }
 
-void SubscribersRegistry::subscribe_to_topic(int sockfd, TokenPattern topic) {
+auto SubscribersRegistry::subscription_size(const TokenPattern &topic,
+                                            const SubscriptionFilter *filter)
+    -> size_t {
+  // The nodes of the hash tables and of the trie, and the heap blocks of the
+  // tokens, near the bytes per subscription measured by the matchbench
+  constexpr size_t overhead = 160;
+  size_t size = 2 * (sizeof(TokenPattern) +
+                     topic.tokens().size() * sizeof(TokenPattern::TokenId)) +
+                overhead;
+  if (filter != nullptr && filter->content) {
+    size += sizeof(ContentFilter) + filter->content->expression().size() +
+            overhead;
+  }
+  if (filter != nullptr && filter->limit) {
+    size += sizeof(DeliveryLimit) + overhead;
+  }
+  return size;
+}
 
-  auto subscriber = get_subscriber_by_sockfd(sockfd);
+auto SubscribersRegistry::held_bytes(const SubscriberInfo &subscriber,
+                                     const TokenPattern &topic) -> size_t {
+  if (subscriber.topics.find(topic) == subscriber.topics.end()) {
+    return 0;
+  }
+  auto it = subscriber.filtered_topics.find(topic);
+  return subscription_size(topic, it == subscriber.filtered_topics.end()
+                                      ? nullptr
+                                      : &it->second);
+}
 
-  subscriber->topics.insert(topic);
-  topic_subscribers_[topic].insert(subscriber);
+auto SubscribersRegistry::fits_quota(const SubscriberInfo &subscriber,
+                                     size_t added) const -> bool {
+  return subscription_quota_ == 0 || subscriber.peer ||
+         subscriber.subscription_bytes + added <= subscription_quota_;
+}
+
+auto SubscribersRegistry::subscribe_to_topic(
+    int sockfd, TokenPattern topic, bool conflate, SubscriptionFilter filter)
+    -> bool {
+  auto slot = get_subscriber_by_sockfd(sockfd);
+  const auto &subscriber = subscribers_[slot];
+  size_t size = subscription_size(topic, &filter);
+  size_t held = held_bytes(subscriber, topic);
+  if (size > held && !fits_quota(subscriber, size - held)) {
+    return false;
+  }
+  invalidate_fanout(topic);
+  add_subscription(slot, topic, conflate, std::move(filter));
+  return true;
 }
 
 void SubscribersRegistry::unsubscribe_from_topic(int sockfd,
                                                  TokenPattern topic) {
-  auto subscriber = get_subscriber_by_sockfd(sockfd);
-  subscriber->topics.erase(topic);
-
-  auto it = topic_subscribers_.find(topic);
-  if (it != topic_subscribers_.end()) {
-    auto &subscribers = it->second;
-    if (subscribers.size() == 1) {
-      topic_subscribers_.erase(it);
+  auto slot = get_subscriber_by_sockfd(sockfd);
+  invalidate_fanout(topic);
+  remove_subscription(slot, topic);
+}
+
+auto SubscribersRegistry::subscribe_to_topics(
+    int sockfd, const std::vector<TokenPattern> &topics) -> bool {
+  auto slot = get_subscriber_by_sockfd(sockfd);
+  const auto &subscriber = subscribers_[slot];
+  // The topics already subscribed to only lose their filters
+  size_t added = 0;
+  for (const auto &topic : topics) {
+    if (subscriber.topics.find(topic) == subscriber.topics.end()) {
+      added += subscription_size(topic, nullptr);
+    }
+  }
+  if (!fits_quota(subscriber, added)) {
+    return false;
+  }
+  invalidate_fanout(topics);
+  for (const auto &topic : topics) {
+    add_subscription(slot, topic, false, {});
+  }
+  return true;
+}
+
+void SubscribersRegistry::unsubscribe_from_topics(
+    int sockfd, const std::vector<TokenPattern> &topics) {
+  auto slot = get_subscriber_by_sockfd(sockfd);
+  invalidate_fanout(topics);
+  for (const auto &topic : topics) {
+    remove_subscription(slot, topic);
+  }
+}
+
+void SubscribersRegistry::add_subscription(
+    Slot slot, const TokenPattern &topic, bool conflate,
+    SubscriptionFilter filter) {
+  auto &subscriber = subscribers_[slot];
+  subscriber.subscription_bytes -= held_bytes(subscriber, topic);
+  if (subscriber.topics.insert(topic).second && counts_interest(subscriber)) {
+    add_interest(topic);
+  }
+  if (conflate) {
+    subscriber.conflated_topics.insert(topic);
+  } else {
+    subscriber.conflated_topics.erase(topic);
+  }
+  if (filter) {
+    subscriber.filtered_topics.insert_or_assign(topic, std::move(filter));
+  } else {
+    subscriber.filtered_topics.erase(topic);
+  }
+  subscriber.subscription_bytes += held_bytes(subscriber, topic);
+  if (topic.has_wildcard()) {
+    wildcard_shard(topic).insert(topic, slot);
+    return;
+  }
+
+  auto it = find_exact_topic(topic);
+  if (it == exact_subscribers_.end()) {
+    it = exact_subscribers_.emplace(topic.hashValue(), ExactTopic{topic, {}});
+  }
+  auto &slots = it->second.subscribers;
+  auto pos = std::lower_bound(slots.begin(), slots.end(), slot);
+  if (pos == slots.end() || *pos != slot) {
+    slots.insert(pos, slot);
+  }
+}
+
+void SubscribersRegistry::remove_subscription(Slot slot,
+                                              const TokenPattern &topic) {
+  auto &subscriber = subscribers_[slot];
+  subscriber.subscription_bytes -= held_bytes(subscriber, topic);
+  if (subscriber.topics.erase(topic) > 0 && counts_interest(subscriber)) {
+    remove_interest(topic);
+  }
+  subscriber.conflated_topics.erase(topic);
+  subscriber.filtered_topics.erase(topic);
+  if (topic.has_wildcard()) {
+    wildcard_shard(topic).erase(topic, slot);
+    return;
+  }
+
+  auto it = find_exact_topic(topic);
+  if (it != exact_subscribers_.end()) {
+    auto &slots = it->second.subscribers;
+    auto pos = std::lower_bound(slots.begin(), slots.end(), slot);
+    if (pos != slots.end() && *pos == slot) {
+      slots.erase(pos);
+    }
+    if (slots.empty()) {
+      exact_subscribers_.erase(it);
+    }
+  }
+}
+
+auto SubscribersRegistry::counts_interest(
+    const SubscriberInfo &subscriber) const -> bool {
+  // An offline subscriber still gets the messages stored for it
+  return track_interest_ && !subscriber.peer &&
+         (track_offline_ || subscriber.is_connected());
+}
+
+void SubscribersRegistry::add_interest(const TokenPattern &topic) {
+  if (++interest_[topic] == 1) {
+    interest_changes_.push_back({topic, true});
+  }
+}
+
+void SubscribersRegistry::remove_interest(const TokenPattern &topic) {
+  auto it = interest_.find(topic);
+  if (it != interest_.end() && --it->second == 0) {
+    interest_.erase(it);
+    interest_changes_.push_back({topic, false});
+  }
+}
+
+auto SubscribersRegistry::interest() const -> std::vector<TokenPattern> {
+  std::vector<TokenPattern> patterns{};
+  patterns.reserve(interest_.size());
+  for (const auto &[pattern, count] : interest_) {
+    patterns.push_back(pattern);
+  }
+  return patterns;
+}
+
+void SubscribersRegistry::invalidate_fanout(const TokenPattern &pattern) {
+  ++fanout_version_;
+  if (!pattern.has_wildcard()) {
+    // Only the same topic is matched
+    auto [it, end] = fanout_cache_.equal_range(pattern.hashValue());
+    for (; it != end; ++it) {
+      if (it->second.tokens == pattern.tokens()) {
+        fanout_cache_.erase(it);
+        return;
+      }
+    }
+    return;
+  }
+
+  if (pattern.tokens().size() > PatternMatcher::MAX_TOKENS) {
+    fanout_cache_.clear();
+    return;
+  }
+
+  PatternMatcher matcher(pattern);
+  for (auto it = fanout_cache_.begin(); it != fanout_cache_.end();) {
+    const auto &tokens = it->second.tokens;
+    if (matcher.matches(tokens.data(), tokens.size())) {
+      it = fanout_cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void SubscribersRegistry::invalidate_fanout(
+    const std::vector<TokenPattern> &patterns) {
+  ++fanout_version_;
+  // The cache is walked once for all the wildcard patterns
+  std::vector<PatternMatcher> matchers{};
+  for (const auto &pattern : patterns) {
+    if (!pattern.has_wildcard()) {
+      invalidate_fanout(pattern);
+    } else if (pattern.tokens().size() > PatternMatcher::MAX_TOKENS) {
+      fanout_cache_.clear();
+      return;
+    } else {
+      matchers.emplace_back(pattern);
+    }
+  }
+  if (matchers.empty()) {
+    return;
+  }
+
+  for (auto it = fanout_cache_.begin(); it != fanout_cache_.end();) {
+    const auto &tokens = it->second.tokens;
+    bool matched = std::any_of(
+        matchers.begin(), matchers.end(), [&](const PatternMatcher &matcher) {
+          return matcher.matches(tokens.data(), tokens.size());
+        });
+    if (matched) {
+      it = fanout_cache_.erase(it);
     } else {
-      subscribers.erase(subscriber);
+      ++it;
+    }
+  }
+}
+
+auto SubscribersRegistry::retrieve_topic_subscribers(const TopicView &topic)
+    -> const TopicSubscribers & {
+  // The unknown tokens of a topic share an id that no subscription uses, so
+  // the topics differing only by them share their entry. Once such a token is
+  // interned by a subscription, the topics with it get their own entry.
+  auto [it, end] = fanout_cache_.equal_range(topic.hashValue());
+  for (; it != end; ++it) {
+    const auto &tokens = it->second.tokens;
+    if (std::equal(topic.begin(), topic.end(), tokens.begin(), tokens.end())) {
+      return it->second.subscribers;
+    }
+  }
+
+  if (fanout_cache_.size() >= MAX_CACHED_TOPICS) {
+    fanout_cache_.clear();
+    ++fanout_evictions_;
+    ++fanout_version_;
+  }
+  auto cached = fanout_cache_.emplace(
+      topic.hashValue(),
+      CachedTopic{std::vector<TopicView::TokenId>(topic.begin(), topic.end()),
+                  {}});
+  collect_topic_subscribers(topic, cached->second.subscribers);
+  return cached->second.subscribers;
+}
+
+void SubscribersRegistry::collect_topic_subscribers(
+    const TopicView &topic, TopicSubscribers &subscribers) {
+  subscribers.sockets.clear();
+  subscribers.conflating_sockets.clear();
+  subscribers.peer_sockets.clear();
+  subscribers.multicast_sockets.clear();
+  subscribers.offline_ids.clear();
+  subscribers.filtered_sockets.clear();
+  subscribers.filtered_offline.clear();
+  // Cached with the subscribers, as the topic is
+  subscribers.priority = priorities_.priority(topic);
+
+  // The subscribers matching through several topics are deduplicated by
+  // setting their bit, the words between the first and the last set being
+  // walked afterwards
+  size_t first_word = matched_.size();
+  size_t last_word = 0;
+  auto add_subscriber = [&](Slot slot) {
+    size_t word = slot / 64;
+    matched_[word] |= uint64_t{1} << (slot % 64);
+    first_word = std::min(first_word, word);
+    last_word = std::max(last_word, word);
+  };
+
+  // The subscribers to the same topic, without wildcards
+  auto [it, end] = exact_subscribers_.equal_range(topic.hashValue());
+  for (; it != end; ++it) {
+    if (topic == it->second.topic) {
+      for (Slot slot : it->second.subscribers) {
+        add_subscriber(slot);
+      }
+      break;
+    }
+  }
+
+  // Walk the subscriber topic patterns that match the given topic
+  if (wildcard_shards_.size() == 1) {
+    wildcard_shards_.front().subscribers.for_each_match(topic, add_subscriber);
+  } else {
+    match_wildcard_shards(topic, first_word, last_word);
+  }
+
+  // A subscriber conflates the topic if any of its subscriptions matching the
+  // topic does, which is only checked for those with such subscriptions
+  auto conflates = [&](const SubscriberInfo &subscriber) {
+    return std::any_of(
+        subscriber.conflated_topics.begin(), subscriber.conflated_topics.end(),
+        [&](const TokenPattern &pattern) {
+          return topic.is_matched_by(pattern);
+        });
+  };
+  TopicSubscribers::Filters filters{};
+
+  for (size_t word = first_word; word <= last_word && word < matched_.size();
+       ++word) {
+    uint64_t bits = matched_[word];
+    matched_[word] = 0;
+    for (; bits != 0; bits &= bits - 1) {
+      const auto &subscriber =
+          subscribers_[word * 64 + static_cast<Slot>(__builtin_ctzll(bits))];
+      bool filtered = !subscriber.filtered_topics.empty() &&
+                      collect_filters(subscriber, topic, filters);
+      if (subscriber.is_connected()) {
+        if (subscriber.peer) {
+          subscribers.peer_sockets.push_back(subscriber.sockfd);
+        }
+        bool conflating =
+            !subscriber.conflated_topics.empty() && conflates(subscriber);
+        if (conflating || filtered) {
+          // A message replacing the queued one, or checked by a filter, is
+          // only sent on its connection
+          subscribers.sockets.push_back(subscriber.sockfd);
+          if (conflating) {
+            subscribers.conflating_sockets.push_back(subscriber.sockfd);
+          }
+          if (!filters.empty()) {
+            subscribers.filtered_sockets.emplace_back(subscriber.sockfd,
+                                                      std::move(filters));
+          }
+        } else if (subscriber.multicast && multicast_threshold_ > 0) {
+          subscribers.multicast_sockets.push_back(subscriber.sockfd);
+        } else {
+          subscribers.sockets.push_back(subscriber.sockfd);
+        }
+      } else if (track_offline_) {
+        if (!filters.empty()) {
+          subscribers.filtered_offline.emplace_back(
+              subscribers.offline_ids.size(), std::move(filters));
+        }
+        subscribers.offline_ids.push_back(subscriber.id);
+      }
+      filters.clear();
+    }
+  }
+
+  std::sort(subscribers.conflating_sockets.begin(),
+            subscribers.conflating_sockets.end());
+  std::sort(subscribers.peer_sockets.begin(), subscribers.peer_sockets.end());
+  std::sort(subscribers.filtered_sockets.begin(),
+            subscribers.filtered_sockets.end(),
+            [](const auto &lhs, const auto &rhs) {
+              return lhs.first < rhs.first;
+            });
+
+  // Below the threshold, a copy on each connection is cheaper than the group
+  if (subscribers.multicast_sockets.size() < multicast_threshold_) {
+    subscribers.sockets.insert(subscribers.sockets.end(),
+                               subscribers.multicast_sockets.begin(),
+                               subscribers.multicast_sockets.end());
+    subscribers.multicast_sockets.clear();
+  }
+  std::sort(subscribers.multicast_sockets.begin(),
+            subscribers.multicast_sockets.end());
+}
+
+void SubscribersRegistry::match_wildcard_shards(const TopicView &topic,
+                                                size_t &first_word,
+                                                size_t &last_word) {
+  auto walk = [&](size_t index) {
+    auto &shard = wildcard_shards_[index];
+    shard.first_word = shard.matched.size();
+    shard.last_word = 0;
+    shard.subscribers.for_each_match(topic, [&](Slot slot) {
+      size_t word = slot / 64;
+      shard.matched[word] |= uint64_t{1} << (slot % 64);
+      shard.first_word = std::min(shard.first_word, word);
+      shard.last_word = std::max(shard.last_word, word);
+    });
+  };
+  match_pool_->run(wildcard_shards_.size(), walk);
+
+  // The subscribers of the shards merged into those of the exact topic
+  for (auto &shard : wildcard_shards_) {
+    for (size_t word = shard.first_word; word <= shard.last_word &&
+                                         word < shard.matched.size();
+         ++word) {
+      matched_[word] |= shard.matched[word];
+      shard.matched[word] = 0;
+    }
+    if (shard.first_word <= shard.last_word) {
+      first_word = std::min(first_word, shard.first_word);
+      last_word = std::max(last_word, shard.last_word);
+    }
+  }
+}
+
+auto SubscribersRegistry::wildcard_shard(const TokenPattern &pattern)
+    -> TopicTrie<Slot> & {
+  return wildcard_shards_[pattern.hashValue() % wildcard_shards_.size()]
+      .subscribers;
+}
+
+void SubscribersRegistry::resize_matched() {
+  matched_.resize((subscribers_.size() + 63) / 64);
+  if (wildcard_shards_.size() > 1) {
+    for (auto &shard : wildcard_shards_) {
+      shard.matched.resize(matched_.size());
+    }
+  }
+}
+
+/**
+ * @brief Collect the filters of the subscriptions of a subscriber matching a
+ * published topic
+ *
+ * @param subscriber The subscriber, with filtered subscriptions
+ * @param topic The topic
+ * @param filters Set to the filters, or left empty if a subscription matching
+ * the topic is not filtered, all of its messages being sent then
+ * @return true if any subscription matching the topic is filtered
+ */
+auto SubscribersRegistry::collect_filters(
+    const SubscriberInfo &subscriber, const TopicView &topic,
+    TopicSubscribers::Filters &filters) const -> bool {
+  filters.clear();
+  for (const auto &[pattern, filter] : subscriber.filtered_topics) {
+    if (topic.is_matched_by(pattern)) {
+      filters.push_back(filter);
+    }
+  }
+  if (filters.empty()) {
+    return false;
+  }
+
+  bool unfiltered = std::any_of(
+      subscriber.topics.begin(), subscriber.topics.end(),
+      [&](const TokenPattern &pattern) {
+        return subscriber.filtered_topics.find(pattern) ==
+                   subscriber.filtered_topics.end() &&
+               topic.is_matched_by(pattern);
+      });
+  if (unfiltered) {
+    filters.clear();
+  }
+  return true;
+}
+
+auto SubscribersRegistry::snapshot() const
+    -> std::shared_ptr<RegistrySnapshot> {
+  auto snapshot = std::make_shared<RegistrySnapshot>();
+  snapshot->token_ids_ = TokenInterner::instance().ids();
+  snapshot->priorities_ = priorities_;
+
+  auto &exact_subscribers = snapshot->exact_subscribers_;
+  for (const auto &[sockfd, slot] : sock_subscribers_) {
+    const auto &subscriber = subscribers_[slot];
+    if (!subscriber.filtered_topics.empty()) {
+      // Its subscriptions are checked for each message matching one of them,
+      // sharing their limits with the registry
+      auto &subscriptions = snapshot->filtered_subscribers_[sockfd];
+      for (const auto &topic : subscriber.topics) {
+        auto filter = subscriber.filtered_topics.find(topic);
+        subscriptions.emplace_back(topic,
+                                   filter != subscriber.filtered_topics.end()
+                                       ? filter->second
+                                       : SubscriptionFilter{});
+      }
+    }
+
+    for (const auto &topic : subscriber.topics) {
+      if (topic.has_wildcard()) {
+        snapshot->wildcard_subscribers_.insert(topic, sockfd);
+        continue;
+      }
+
+      auto [it, end] = exact_subscribers.equal_range(topic.hashValue());
+      it = std::find_if(it, end, [&](const auto &entry) {
+        return entry.second.topic == topic;
+      });
+      if (it == end) {
+        it = exact_subscribers.emplace(topic.hashValue(),
+                                       RegistrySnapshot::ExactTopic{topic, {}});
+      }
+      it->second.subscribers_sockets.push_back(sockfd);
+    }
+  }
+  return snapshot;
+}
+
+void SubscribersRegistry::save(std::vector<std::byte> &buffer) const {
+  buffer.clear();
+  auto put = [&](const void *data, size_t size) {
+    const auto *bytes = static_cast<const std::byte *>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+  };
+  auto put_size = [&](uint8_t size) { put(&size, sizeof(size)); };
+  auto put_count = [&](uint32_t count) {
+    uint32_t count_network = hton(count);
+    put(&count_network, sizeof(count_network));
+  };
+
+  put(CHECKPOINT_MAGIC.data(), CHECKPOINT_MAGIC.size());
+  put(&CHECKPOINT_VERSION, sizeof(CHECKPOINT_VERSION));
+  // The brokers send their interest again once they connect
+  put_count(static_cast<uint32_t>(std::count_if(
+      subscribers_.begin(), subscribers_.end(),
+      [](const SubscriberInfo &subscriber) { return !subscriber.peer; })));
+
+  for (const auto &subscriber : subscribers_) {
+    if (subscriber.peer) {
+      continue;
+    }
+    put_size(static_cast<uint8_t>(subscriber.id.size()));
+    put(subscriber.id.data(), subscriber.id.size());
+    put_count(static_cast<uint32_t>(subscriber.topics.size()));
+
+    for (const auto &topic : subscriber.topics) {
+      // The patterns and the filters were received with their size on a byte
+      std::string pattern = topic.to_string();
+      put_size(static_cast<uint8_t>(pattern.size()));
+      put(pattern.data(), pattern.size());
+
+      auto it = subscriber.filtered_topics.find(topic);
+      const SubscriptionFilter *filter =
+          it != subscriber.filtered_topics.end() ? &it->second : nullptr;
+      uint8_t flags =
+          (subscriber.conflated_topics.count(topic) ? CHECKPOINT_CONFLATE : 0) |
+          (filter != nullptr && filter->content ? CHECKPOINT_FILTER : 0) |
+          (filter != nullptr && filter->limit ? CHECKPOINT_LIMIT : 0);
+      put(&flags, sizeof(flags));
+      if (flags & CHECKPOINT_FILTER) {
+        const auto &expression = filter->content->expression();
+        put_size(static_cast<uint8_t>(expression.size()));
+        put(expression.data(), expression.size());
+      }
+      if (flags & CHECKPOINT_LIMIT) {
+        uint32_t max_rate = hton(filter->limit->max_rate());
+        uint16_t sample_every = hton(filter->limit->sample_every());
+        put(&max_rate, sizeof(max_rate));
+        put(&sample_every, sizeof(sample_every));
+      }
     }
   }
 }
 
-auto SubscribersRegistry::retrieve_topic_subscribers(const TokenPattern &topic)
-    -> std::unordered_set<int> {
-  std::unordered_set<int> subscribers_sockets{};
+auto SubscribersRegistry::load(const std::byte *data, size_t size) -> bool {
+  size_t offset = 0;
+  auto take = [&](size_t count) -> const std::byte * {
+    if (size - offset < count) {
+      return nullptr;
+    }
+    const std::byte *bytes = data + offset;
+    offset += count;
+    return bytes;
+  };
+  auto take_string = [&](std::string_view &str) {
+    const std::byte *bytes = take(sizeof(uint8_t));
+    if (bytes == nullptr) {
+      return false;
+    }
+    auto str_size = static_cast<uint8_t>(*bytes);
+    bytes = take(str_size);
+    if (bytes == nullptr) {
+      return false;
+    }
+    str = {reinterpret_cast<const char *>(bytes), str_size};
+    return true;
+  };
+  auto take_count = [&](uint32_t &count) {
+    const std::byte *bytes = take(sizeof(count));
+    if (bytes == nullptr) {
+      return false;
+    }
+    std::memcpy(&count, bytes, sizeof(count));
+    count = ntoh(count);
+    return true;
+  };
+
+  const std::byte *header =
+      take(CHECKPOINT_MAGIC.size() + sizeof(CHECKPOINT_VERSION));
+  if (header == nullptr ||
+      std::memcmp(header, CHECKPOINT_MAGIC.data(), CHECKPOINT_MAGIC.size()) !=
+          0 ||
+      static_cast<uint8_t>(header[CHECKPOINT_MAGIC.size()]) !=
+          CHECKPOINT_VERSION) {
+    return false;
+  }
+
+  // Parsed whole before any subscriber is added
+  struct Subscription {
+    TokenPattern topic{};
+    bool conflate{};
+    SubscriptionFilter filter{};
+  };
+  std::vector<std::pair<std::string, std::vector<Subscription>>> loaded{};
+  uint32_t subscribers = 0;
+  if (!take_count(subscribers)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < subscribers; ++i) {
+    std::string_view id{};
+    uint32_t topics = 0;
+    if (!take_string(id) || id.empty() || !take_count(topics)) {
+      return false;
+    }
+    auto &[loaded_id, subscriptions] = loaded.emplace_back();
+    loaded_id = id;
 
-  // Search for subscriber topics that match the given topic
-  for (const auto &[subscriber_topic, subscribers] : topic_subscribers_) {
-    if (subscriber_topic.matches(topic)) {
-      for (const auto &subscriber : subscribers) {
-        if (subscriber->is_connected()) {
-          subscribers_sockets.insert(subscriber->sockfd);
+    for (uint32_t j = 0; j < topics; ++j) {
+      std::string_view pattern{};
+      const std::byte *flags = nullptr;
+      Subscription subscription{};
+      if (!take_string(pattern) ||
+          TokenPattern::parse(pattern, subscription.topic) !=
+              TokenPatternError::NONE ||
+          (flags = take(sizeof(uint8_t))) == nullptr) {
+        return false;
+      }
+      subscription.conflate =
+          static_cast<uint8_t>(*flags) & CHECKPOINT_CONFLATE;
+      if (static_cast<uint8_t>(*flags) & CHECKPOINT_FILTER) {
+        std::string_view expression{};
+        ContentFilter filter{};
+        if (!take_string(expression) ||
+            ContentFilter::parse(expression, filter) !=
+                ContentFilterError::NONE) {
+          return false;
         }
+        subscription.filter.content =
+            std::make_shared<const ContentFilter>(std::move(filter));
       }
+      if (static_cast<uint8_t>(*flags) & CHECKPOINT_LIMIT) {
+        uint32_t max_rate{};
+        uint16_t sample_every{};
+        const std::byte *limit = take(sizeof(max_rate) + sizeof(sample_every));
+        if (limit == nullptr) {
+          return false;
+        }
+        std::memcpy(&max_rate, limit, sizeof(max_rate));
+        std::memcpy(&sample_every, limit + sizeof(max_rate),
+                    sizeof(sample_every));
+        subscription.filter.limit =
+            std::make_shared<DeliveryLimit>(ntoh(max_rate), ntoh(sample_every));
+      }
+      subscriptions.push_back(std::move(subscription));
     }
   }
+  if (offset != size) {
+    return false;
+  }
 
-  return subscribers_sockets;
+  for (auto &[id, subscriptions] : loaded) {
+    if (id_subscribers_.count(id)) {
+      continue;
+    }
+    auto slot = static_cast<Slot>(subscribers_.size());
+    subscribers_.emplace_back(id, -1, false, false);
+    id_subscribers_[id] = slot;
+    for (auto &subscription : subscriptions) {
+      add_subscription(slot, subscription.topic, subscription.conflate,
+                       std::move(subscription.filter));
+    }
+  }
+  resize_matched();
+  fanout_cache_.clear();
+  ++fanout_version_;
+  return true;
 }
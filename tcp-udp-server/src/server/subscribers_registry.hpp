@@ -1,32 +1,229 @@
 #pragma once
 
+#include "delivery_limit.hpp"
+#include "match_pool.hpp"
+#include "priority_classes.hpp"
+#include "registry_snapshot.hpp"
 #include "token_pattern.hpp"
+#include "topic_trie.hpp"
+#include "topic_view.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
+
+struct RegistryCheckpointConfig {
+  // The file the registry is saved to, and loaded from at startup, none if it
+  // is empty
+  std::string file{};
+  // How often the registry is saved, if it changed
+  std::chrono::milliseconds interval{1000};
+};
+
+struct MatchConfig {
+  // The shards the wildcard subscriptions are split into, walked in parallel
+  // by as many threads for a topic missing the cache, 1 for a single walk
+  size_t shards{1};
+};
 
 class SubscribersRegistry {
+public:
+  // A checkpoint starts with this magic and the version of its format
+  static constexpr std::array<char, 4> CHECKPOINT_MAGIC{'T', 'U', 'S', 'R'};
+  static constexpr uint8_t CHECKPOINT_VERSION = 1;
+
+  // The subscribers of a published topic
+  struct TopicSubscribers {
+    // the socket file descriptors of the subscribers, in the order of their
+    // slots, those which joined the multicast group last
+    std::vector<int> sockets{};
+    // the sockets, among the above, of the subscribers conflating the topic,
+    // sorted
+    std::vector<int> conflating_sockets{};
+    // the sockets of the subscribers which joined the multicast group, not
+    // among the above, once they are at least as many as the threshold,
+    // sorted
+    std::vector<int> multicast_sockets{};
+    // the sockets, among the above, of the brokers of the federation, sorted
+    std::vector<int> peer_sockets{};
+    // the ids of the offline subscribers, if they are kept track of
+    std::vector<std::string> offline_ids{};
+
+    // The filters of the subscriptions of a subscriber matching the topic, a
+    // message being sent to it if any of them accepts it
+    using Filters = std::vector<SubscriptionFilter>;
+    // the sockets, among the above, of the subscribers whose subscriptions
+    // matching the topic all filter its messages, with their filters, sorted
+    std::vector<std::pair<int, Filters>> filtered_sockets{};
+    // the offline subscribers whose subscriptions matching the topic all
+    // filter its messages, by their index in offline_ids, with their filters
+    std::vector<std::pair<size_t, Filters>> filtered_offline{};
+    // the priority of the topic, see PriorityClasses
+    uint8_t priority{};
+
+    bool is_peer(int sockfd) const {
+      return !peer_sockets.empty() &&
+             std::binary_search(peer_sockets.begin(), peer_sockets.end(),
+                                sockfd);
+    }
+
+    bool conflates(int sockfd) const {
+      return !conflating_sockets.empty() &&
+             std::binary_search(conflating_sockets.begin(),
+                                conflating_sockets.end(), sockfd);
+    }
+
+    /**
+     * @brief Check if a message of the topic is sent to a subscriber
+     *
+     * @param sockfd The socket of the subscriber, among the sockets
+     * @param type The type of the payload of the message
+     * @param payload The payload, as laid out in the publication
+     * @param size The size of the payload
+     * @return true if the subscriber does not filter the topic, or if one of
+     * its filters accepts the message
+     */
+    bool accepts(int sockfd, TcpResponsePayloadType type,
+                 const std::byte *payload, size_t size) const {
+      if (filtered_sockets.empty()) {
+        return true;
+      }
+      auto it = std::lower_bound(
+          filtered_sockets.begin(), filtered_sockets.end(), sockfd,
+          [](const auto &entry, int fd) { return entry.first < fd; });
+      return it == filtered_sockets.end() || it->first != sockfd ||
+             any_accepts(it->second, type, payload, size);
+    }
+
+    static bool any_accepts(const Filters &filters, TcpResponsePayloadType type,
+                            const std::byte *payload, size_t size) {
+      return std::any_of(filters.begin(), filters.end(),
+                         [&](const auto &filter) {
+                           return filter.accepts(type, payload, size);
+                         });
+    }
+  };
+
+private:
+  // The index of a subscriber in subscribers_, never reused as a subscriber is
+  // kept once disconnected
+  using Slot = uint32_t;
+
   struct SubscriberInfo {
-    explicit SubscriberInfo(std::string id, int sockfd)
-        : id(std::move(id)), sockfd(sockfd) {}
+    explicit SubscriberInfo(std::string id, int sockfd, bool multicast,
+                            bool peer)
+        : id(std::move(id)), sockfd(sockfd), multicast(multicast), peer(peer) {}
 
     bool is_connected() const { return sockfd > 0; }
 
     std::string id{};
     std::unordered_set<TokenPattern> topics{};
+    // the topics, among the above, whose messages are conflated
+    std::unordered_set<TokenPattern> conflated_topics{};
+    // the topics, among the above, whose messages are filtered or limited,
+    // with their filters
+    std::unordered_map<TokenPattern, SubscriptionFilter> filtered_topics{};
     int sockfd{-1};
+    // whether it joined the multicast group
+    bool multicast{};
+    // whether it is a broker of the federation
+    bool peer{};
+    // the memory held by its subscriptions, as estimated by subscription_size
+    size_t subscription_bytes{};
+  };
+
+  struct ExactTopic {
+    TokenPattern topic{};
+    // sorted
+    std::vector<Slot> subscribers{};
   };
 
+  // keyed by the hash of the topic, so that a TopicView can be looked up
+  // without building a TokenPattern
+  using ExactTopics = std::unordered_multimap<std::size_t, ExactTopic>;
+
+  // the subscribers of a published topic, as returned for it
+  struct CachedTopic {
+    std::vector<TopicView::TokenId> tokens{};
+    TopicSubscribers subscribers{};
+  };
+
+  // keyed by the hash of the topic, as ExactTopics
+  using FanoutCache = std::unordered_multimap<std::size_t, CachedTopic>;
+
+  // A part of the wildcard subscriptions, with the subscribers matched in it,
+  // a cache line apart from the others as each is walked by its own thread
+  struct alignas(64) WildcardShard {
+    TopicTrie<Slot> subscribers{};
+    // a bit per slot, left cleared, and the words between the first and the
+    // last set
+    std::vector<uint64_t> matched{};
+    size_t first_word{};
+    size_t last_word{};
+  };
+
+  // The flags of a subscription in a checkpoint
+  static constexpr uint8_t CHECKPOINT_CONFLATE = 1 << 0;
+  static constexpr uint8_t CHECKPOINT_FILTER = 1 << 1;
+  static constexpr uint8_t CHECKPOINT_LIMIT = 1 << 2;
+
+  // The cache is emptied when it reaches this number of topics
+  static constexpr size_t MAX_CACHED_TOPICS = 4096;
+
 public:
+  // A change of the interest of the local subscribers
+  struct InterestChange {
+    TokenPattern pattern{};
+    // whether the pattern got its first local subscriber, or lost its last
+    bool added{};
+  };
+
+  /**
+   * @brief Construct a new SubscribersRegistry object
+   *
+   * @param track_offline Whether the subscribers of a published topic include
+   * the offline ones, for the store-and-forward of their messages
+   * @param multicast_threshold The number of subscribers of a published topic
+   * which joined the multicast group, from which they get its messages from
+   * the group instead of their connection, 0 if there is no group
+   * @param priorities The priority classes of the published topics
+   * @param track_interest Whether the changes of the interest of the local
+   * subscribers are recorded, for the brokers of the federation
+   * @param subscription_quota The memory the subscriptions of a subscriber may
+   * hold, in bytes, as estimated by subscription_size, unlimited if 0, the
+   * brokers of the federation being unlimited
+   * @param match_shards The shards the wildcard subscriptions are split into,
+   * by the hash of their pattern, and walked in parallel for a topic missing
+   * the cache, at most MatchPool::MAX_TASKS
+   */
+  explicit SubscribersRegistry(bool track_offline = false,
+                               size_t multicast_threshold = 0,
+                               PriorityClasses priorities = {},
+                               bool track_interest = false,
+                               size_t subscription_quota = 0,
+                               size_t match_shards = 1);
+
   /**
    * @brief Handle a new subscriber connection
    *
    * @param sockfd The socket file descriptor of the subscriber
    * @param id The id of the subscriber
+   * @param multicast Whether the subscriber joined the multicast group
+   * @param peer Whether the subscriber is a broker of the federation, whose
+   * subscriptions are dropped as it sends them all again
    *
    * @throws std::runtime_error if the subscriber is already connected
    */
-  void connect_subscriber(int sockfd, const std::string &id);
+  void connect_subscriber(int sockfd, const std::string &id,
+                          bool multicast = false, bool peer = false);
 
   /**
    * @brief Handle a subscriber disconnection
@@ -46,6 +243,17 @@ public:
     return sock_subscribers_.find(sockfd) != sock_subscribers_.end();
   }
 
+  /**
+   * @brief Check if a connected subscriber is a broker of the federation
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @return true if the subscriber is connected and connected as a peer
+   */
+  bool is_peer(int sockfd) {
+    auto it = sock_subscribers_.find(sockfd);
+    return it != sock_subscribers_.end() && subscribers_[it->second].peer;
+  }
+
   /**
    * @brief Retrieve the id of a subscriber
    *
@@ -57,16 +265,51 @@ public:
    */
   auto get_subscriber_id(int sockfd) -> const std::string &;
 
+  /**
+   * @brief Retrieve the memory held by the subscriptions of a subscriber
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @return The bytes, as estimated by subscription_size
+   *
+   * @throws std::runtime_error if there is no subscriber connected on the given
+   * socket
+   */
+  auto subscription_bytes(int sockfd) -> size_t {
+    return subscribers_[get_subscriber_by_sockfd(sockfd)].subscription_bytes;
+  }
+
+  /**
+   * @brief Estimate the memory held by a subscription: its pattern, kept by
+   * the subscriber and by the index of the topics, the nodes holding them, its
+   * filter and its limits
+   *
+   * @param topic The topic of the subscription
+   * @param filter Its filter, null if it has none
+   * @return The bytes
+   */
+  static auto subscription_size(const TokenPattern &topic,
+                                const SubscriptionFilter *filter) -> size_t;
+
   /**
    * @brief Subscribe a subscriber to a topic
    *
+   * A subscriber already subscribed to the topic only changes its conflation
+   * and its filter, its limits starting over. The subscription is refused if it does not fit in the
+   * quota of the subscriber.
+   *
    * @param sockfd The socket file descriptor of the subscriber
    * @param topic The topic to subscribe to
+   * @param conflate Whether a new message of the topic replaces the one queued
+   * for the subscriber, see OutputQueue::push
+   * @param filter The filter and the limits of the messages of the topic sent
+   * to the subscriber, all of them if it has neither
+   * @return false if the subscription was refused
    *
    * @throws std::runtime_error if there is no subscriber connected on the given
    * socket
    */
-  void subscribe_to_topic(int sockfd, TokenPattern topic);
+  auto subscribe_to_topic(int sockfd, TokenPattern topic, bool conflate = false,
+                          SubscriptionFilter filter = {}) -> bool;
 
   /**
    * @brief Unsubscribe a subscriber from a topic
@@ -79,30 +322,201 @@ public:
    */
   void unsubscribe_from_topic(int sockfd, TokenPattern topic);
 
+  /**
+   * @brief Subscribe a subscriber to several topics at once, the cached
+   * subscribers of the published topics being invalidated once for all
+   *
+   * The subscriptions are all refused if they do not fit together in the
+   * quota of the subscriber.
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @param topics The topics to subscribe to
+   * @return false if the subscriptions were refused
+   *
+   * @throws std::runtime_error if there is no subscriber connected on the given
+   * socket
+   */
+  auto subscribe_to_topics(int sockfd, const std::vector<TokenPattern> &topics)
+      -> bool;
+
+  /**
+   * @brief Unsubscribe a subscriber from several topics at once, as
+   * subscribe_to_topics
+   *
+   * @param sockfd The socket file descriptor of the subscriber
+   * @param topics The topics to unsubscribe from
+   *
+   * @throws std::runtime_error if there is no subscriber connected on the given
+   * socket
+   */
+  void unsubscribe_from_topics(int sockfd,
+                               const std::vector<TokenPattern> &topics);
+
   /**
    * @brief Retrieve the socket file descriptors of subscribers subscribed to a
-   * topic
+   * published topic
+   *
+   * The list is cached for the topic until a change of the subscriptions or of
+   * the connected subscribers affects it, so publishing again to the same
+   * topic only costs a lookup in the cache
    *
    * @param topic The topic to retrieve subscribers for
-   * @return A set of socket file descriptors of subscribers subscribed to the
+   * @return The socket file descriptors of the connected subscribers
+   * subscribed to the topic, each appearing once, valid until the next call to
+   * a function of the registry
+   */
+  auto retrieve_topic_subscribers(const TopicView &topic)
+      -> const TopicSubscribers &;
+
+  /**
+   * @brief Get the number of times the cache was emptied to make room for a
    * topic
    *
-   * @throws std::invalid_argument if the given topic contains wildcards
+   * While the subscriptions and the connected subscribers do not change, the
+   * lists returned by retrieve_topic_subscribers stay valid across the calls
+   * to it until the count changes, so that the distinct topics of a batch can
+   * be kept retrieved for the whole batch.
+   *
+   * @return The number of times the cache was emptied
    */
-  auto retrieve_topic_subscribers(const TokenPattern &topic)
-      -> std::unordered_set<int>;
+  auto fanout_evictions() const -> uint64_t { return fanout_evictions_; }
+
+  /**
+   * @brief Get the number of times cached lists were dropped, by a change of
+   * the subscriptions or of the connected subscribers, or to make room for a
+   * topic
+   *
+   * A list returned by retrieve_topic_subscribers stays valid, and up to date,
+   * until the count changes, so that it can be kept for a topic across the
+   * batches. The count also changes once a subscription with tokens interned
+   * since is added, so the topics parsed before must then be parsed again.
+   *
+   * @return The number of times cached lists were dropped
+   */
+  auto fanout_version() const -> uint64_t { return fanout_version_; }
+
+  /**
+   * @brief Copy the subscriptions of the connected subscribers, to be matched
+   * by other threads
+   *
+   * @return The snapshot, whose connections are left to be set
+   */
+  auto snapshot() const -> std::shared_ptr<RegistrySnapshot>;
+
+  /**
+   * @brief Get the interest of the local subscribers: the topic patterns the
+   * subscribers other than the brokers of the federation are subscribed to,
+   * the offline ones included if they are kept track of
+   *
+   * @return The patterns, each appearing once
+   */
+  auto interest() const -> std::vector<TokenPattern>;
+
+  /**
+   * @brief Take the changes of the interest since the last call, if they are
+   * recorded
+   *
+   * @return The changes, in order
+   */
+  auto take_interest_changes() -> std::vector<InterestChange> {
+    return std::exchange(interest_changes_, {});
+  }
+
+  /**
+   * @brief Save the ids of the subscribers and their subscriptions, the
+   * brokers of the federation excepted, as a checkpoint loaded by load
+   *
+   * After the magic and the version, the checkpoint holds the number of
+   * subscribers, on 4 bytes, then, for each, the size of its id, on a byte,
+   * the id and the number of its subscriptions, on 4 bytes. Each subscription
+   * is the size of its pattern, on a byte, the pattern, its flags, on a byte,
+   * CHECKPOINT_CONFLATE, CHECKPOINT_FILTER and CHECKPOINT_LIMIT, and, if
+   * filtered, the size of the expression of the filter, on a byte, and the
+   * expression, then, if limited, its rate, on 4 bytes, and its sampling, on 2
+   * bytes. The numbers are in network byte order.
+   *
+   * @param buffer Set to the checkpoint
+   */
+  void save(std::vector<std::byte> &buffer) const;
+
+  /**
+   * @brief Add the subscribers of a checkpoint, offline until they connect
+   * again with their id, with their subscriptions
+   *
+   * The subscribers already known are left as they are.
+   *
+   * @param data The checkpoint, as saved by save
+   * @param size The size of the checkpoint
+   * @return false if the checkpoint is invalid, nothing being added then
+   */
+  [[nodiscard]] auto load(const std::byte *data, size_t size) -> bool;
 
 private:
-  auto get_subscriber_by_sockfd(int sockfd) -> std::shared_ptr<SubscriberInfo>;
-
-  // mapping of socket file descriptors to subscriber's info
-  std::unordered_map<int, std::shared_ptr<SubscriberInfo>> sock_subscribers_;
-  // mapping of subscriber's id to subscriber's info
-  std::unordered_map<std::string, std::shared_ptr<SubscriberInfo>>
-      id_subscribers_;
-
-  // mapping of topic to subscriber's info
-  std::unordered_map<TokenPattern,
-                     std::unordered_set<std::shared_ptr<SubscriberInfo>>>
-      topic_subscribers_;
+  auto get_subscriber_by_sockfd(int sockfd) -> Slot;
+  auto find_exact_topic(const TokenPattern &topic) -> ExactTopics::iterator;
+  void collect_topic_subscribers(const TopicView &topic,
+                                 TopicSubscribers &subscribers);
+  // Set the bits of the subscribers of the wildcard subscriptions matching a
+  // topic, walking the shards in parallel
+  void match_wildcard_shards(const TopicView &topic, size_t &first_word,
+                             size_t &last_word);
+  auto wildcard_shard(const TokenPattern &pattern) -> TopicTrie<Slot> &;
+  void resize_matched();
+  void add_subscription(Slot slot, const TokenPattern &topic, bool conflate,
+                        SubscriptionFilter filter);
+  auto collect_filters(const SubscriberInfo &subscriber, const TopicView &topic,
+                       TopicSubscribers::Filters &filters) const -> bool;
+  void remove_subscription(Slot slot, const TokenPattern &topic);
+  // The memory held by a subscription of a subscriber, 0 if it has none to
+  // the topic
+  static auto held_bytes(const SubscriberInfo &subscriber,
+                         const TokenPattern &topic) -> size_t;
+  // Check if the subscriptions of a subscriber may grow by so many bytes
+  auto fits_quota(const SubscriberInfo &subscriber, size_t added) const
+      -> bool;
+  // Count the subscriptions of a subscriber in the interest, or stop counting
+  // them
+  auto counts_interest(const SubscriberInfo &subscriber) const -> bool;
+  void add_interest(const TokenPattern &topic);
+  void remove_interest(const TokenPattern &topic);
+  // Drop the cached topics matched by a subscription that changed
+  void invalidate_fanout(const TokenPattern &pattern);
+  void invalidate_fanout(const std::vector<TokenPattern> &patterns);
+
+  // the subscriber's info, by slot, in chunks whose elements are not moved
+  // when new subscribers are added
+  std::deque<SubscriberInfo> subscribers_;
+  // mapping of socket file descriptors to subscriber's slot
+  std::unordered_map<int, Slot> sock_subscribers_;
+  // mapping of subscriber's id to subscriber's slot
+  std::unordered_map<std::string, Slot> id_subscribers_;
+
+  // mapping of the topics without wildcards to subscriber's slots, looked up
+  // directly with the published topic
+  ExactTopics exact_subscribers_;
+  // index of the topic patterns with wildcards to subscriber's slots, split
+  // into shards by the hash of the pattern
+  std::vector<WildcardShard> wildcard_shards_;
+  // the threads walking the shards with the thread of the registry, if there
+  // are several shards
+  std::unique_ptr<MatchPool> match_pool_;
+
+  // mapping of the published topics to their subscribers
+  FanoutCache fanout_cache_;
+  uint64_t fanout_evictions_{};
+  uint64_t fanout_version_{};
+  // the subscribers matching the topic being collected, a bit per slot, left
+  // cleared
+  std::vector<uint64_t> matched_;
+  bool track_offline_{};
+  size_t multicast_threshold_{};
+  PriorityClasses priorities_{};
+
+  // the number of the local subscribers subscribed to each pattern, the
+  // brokers of the federation excepted
+  std::unordered_map<TokenPattern, size_t> interest_{};
+  bool track_interest_{};
+  // the changes of interest_ not taken yet, if they are recorded
+  std::vector<InterestChange> interest_changes_{};
+  size_t subscription_quota_{};
 };
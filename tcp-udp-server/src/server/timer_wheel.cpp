@@ -0,0 +1,107 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel(Clock::duration tick, Clock::time_point start)
+    : tick_(tick), start_(start) {
+  for (auto &level : slots_) {
+    for (auto &sentinel : level) {
+      sentinel.prev = sentinel.next = &sentinel;
+    }
+  }
+}
+
+auto TimerWheel::ticks(Clock::time_point time) const -> uint64_t {
+  if (time <= start_) {
+    return 0;
+  }
+  return static_cast<uint64_t>((time - start_) / tick_);
+}
+
+void TimerWheel::schedule(Timer &timer, Clock::time_point deadline) {
+  if (timer.scheduled()) {
+    unlink(timer);
+  }
+
+  // Rounded up, and at the earliest the next tick processed
+  uint64_t expiry = 0;
+  if (deadline > start_) {
+    auto elapsed = deadline - start_;
+    expiry = static_cast<uint64_t>(elapsed / tick_) +
+             (elapsed % tick_ != Clock::duration::zero());
+  }
+  timer.expiry = std::max(expiry, current_);
+  place(timer);
+  ++size_;
+}
+
+void TimerWheel::cancel(Timer &timer) {
+  if (timer.scheduled()) {
+    unlink(timer);
+  }
+}
+
+void TimerWheel::place(Timer &timer) {
+  // The span of the wheel, the further timers expiring at its end
+  constexpr uint64_t SPAN = (uint64_t{1} << (SLOT_BITS * LEVELS)) - 1;
+  timer.expiry = std::min(timer.expiry, current_ + SPAN);
+
+  // The slots of the highest level wrap around, a timer up to 64 of its slots
+  // away cascading once the current tick enters its slot
+  uint64_t differing = timer.expiry ^ current_;
+  size_t level = 0;
+  while (level + 1 < LEVELS && differing >> (SLOT_BITS * (level + 1)) != 0) {
+    ++level;
+  }
+  size_t slot = (timer.expiry >> (SLOT_BITS * level)) & SLOT_MASK;
+
+  Timer &sentinel = slots_[level][slot];
+  timer.prev = sentinel.prev;
+  timer.next = &sentinel;
+  sentinel.prev->next = &timer;
+  sentinel.prev = &timer;
+  timer.slot = static_cast<uint16_t>(level * SLOTS + slot);
+  occupied_[level] |= uint64_t{1} << slot;
+}
+
+void TimerWheel::unlink(Timer &timer) {
+  timer.prev->next = timer.next;
+  timer.next->prev = timer.prev;
+  timer.prev = timer.next = nullptr;
+  --size_;
+
+  size_t level = timer.slot / SLOTS;
+  size_t slot = timer.slot % SLOTS;
+  Timer &sentinel = slots_[level][slot];
+  if (sentinel.next == &sentinel) {
+    occupied_[level] &= ~(uint64_t{1} << slot);
+  }
+}
+
+void TimerWheel::cascade(size_t level) {
+  size_t slot = (current_ >> (SLOT_BITS * level)) & SLOT_MASK;
+  Timer &sentinel = slots_[level][slot];
+  while (sentinel.next != &sentinel) {
+    Timer &timer = *sentinel.next;
+    sentinel.next = timer.next;
+    timer.next->prev = &sentinel;
+    place(timer);
+  }
+  occupied_[level] &= ~(uint64_t{1} << slot);
+}
+
+auto TimerWheel::next_deadline() const -> std::optional<Clock::time_point> {
+  if (size_ == 0) {
+    return std::nullopt;
+  }
+
+  // The timers of the level 0 expire in the current group of 64 ticks, the
+  // others cascading at its start, if it is not processed yet, or at its end
+  uint64_t tick = current_;
+  if ((current_ & SLOT_MASK) != 0) {
+    uint64_t pending = occupied_[0] >> (current_ & SLOT_MASK);
+    tick = pending != 0 ? current_ + __builtin_ctzll(pending)
+                        : (current_ | SLOT_MASK) + 1;
+  }
+  return start_ + tick * tick_;
+}
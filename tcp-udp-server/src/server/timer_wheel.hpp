@@ -0,0 +1,153 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+/**
+ * @brief Hierarchical timer wheel, scheduling and cancelling a timer in O(1)
+ * whatever the number of timers
+ *
+ * Time is counted in ticks. Each level has 64 slots, a slot of the level l
+ * spanning 64^l ticks, and each slot is an intrusive list of the timers
+ * expiring in it: a timer is placed at the level of the highest group of 6
+ * bits in which its expiry differs from the current tick. Once the current
+ * tick enters the span of a slot of a higher level, its timers cascade to the
+ * lower levels, until they expire from a slot of the level 0. The slots of
+ * the highest level wrap around, and a timer further than the span of the
+ * wheel expires at its end, early. The timers are owned
+ * by the caller, and must be cancelled before they are destroyed.
+ */
+class TimerWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // A timer, linked into a slot while it is scheduled
+  struct Timer {
+    Timer *prev{};
+    Timer *next{};
+    // the tick it expires at
+    uint64_t expiry{};
+    // the level and slot of its list
+    uint16_t slot{};
+
+    bool scheduled() const { return prev != nullptr; }
+  };
+
+  static constexpr size_t LEVELS = 4;
+  static constexpr size_t SLOT_BITS = 6;
+  static constexpr size_t SLOTS = size_t{1} << SLOT_BITS;
+
+  /**
+   * @brief Construct an empty wheel
+   *
+   * @param tick The resolution of the timers
+   * @param start The time of the tick 0
+   */
+  TimerWheel(Clock::duration tick, Clock::time_point start);
+
+  TimerWheel(const TimerWheel &) = delete;
+  auto operator=(const TimerWheel &) -> TimerWheel & = delete;
+
+  /**
+   * @brief Schedule a timer, or move it if it is already scheduled
+   *
+   * @param timer The timer
+   * @param deadline The time it expires at, rounded up to the next tick, so it
+   * never expires early, unless it is further than the span of the wheel
+   */
+  void schedule(Timer &timer, Clock::time_point deadline);
+
+  /**
+   * @brief Cancel a timer, if it is scheduled
+   *
+   * @param timer The timer
+   */
+  void cancel(Timer &timer);
+
+  /**
+   * @brief Expire the timers of the ticks up to a time
+   *
+   * The timers are unlinked before their callback is called, which may
+   * schedule them again, or cancel the other timers.
+   *
+   * @param now The current time
+   * @param expire Called with each expired timer
+   */
+  template <typename Expire> void advance(Clock::time_point now, Expire &&expire);
+
+  /**
+   * @brief Get when advance must be called next, at the latest
+   *
+   * @return The time of the first tick expiring or cascading timers, or
+   * std::nullopt if there are no timers
+   */
+  auto next_deadline() const -> std::optional<Clock::time_point>;
+
+  auto size() const -> size_t { return size_; }
+
+private:
+  static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+  auto ticks(Clock::time_point time) const -> uint64_t;
+  // Link a timer into the slot of its expiry
+  void place(Timer &timer);
+  void unlink(Timer &timer);
+  // Move the timers of the slot of a level reached by the current tick to
+  // the lower levels
+  void cascade(size_t level);
+
+  Clock::duration tick_{};
+  Clock::time_point start_{};
+  // the first tick not processed yet
+  uint64_t current_{};
+  size_t size_{};
+  // the sentinels of the lists of the slots, by level
+  std::array<std::array<Timer, SLOTS>, LEVELS> slots_{};
+  // the slots whose list is not empty, by level
+  std::array<uint64_t, LEVELS> occupied_{};
+};
+
+template <typename Expire>
+void TimerWheel::advance(Clock::time_point now, Expire &&expire) {
+  uint64_t target = ticks(now);
+  while (current_ <= target) {
+    if (size_ == 0) {
+      // Nothing to cascade nor to expire
+      current_ = target + 1;
+      return;
+    }
+
+    // The higher levels first, their timers possibly cascading to the level 0
+    for (size_t level = LEVELS - 1; level > 0; --level) {
+      if ((current_ & ((uint64_t{1} << (SLOT_BITS * level)) - 1)) == 0) {
+        cascade(level);
+      }
+    }
+
+    // Take the list out of the slot first, the callbacks rescheduling their
+    // timers to the next ticks
+    Timer &sentinel = slots_[0][current_ & SLOT_MASK];
+    Timer expired{};
+    if (sentinel.next != &sentinel) {
+      expired.next = sentinel.next;
+      expired.prev = sentinel.prev;
+      expired.next->prev = &expired;
+      expired.prev->next = &expired;
+      sentinel.next = sentinel.prev = &sentinel;
+      occupied_[0] &= ~(uint64_t{1} << (current_ & SLOT_MASK));
+    }
+    ++current_;
+
+    while (expired.next != nullptr && expired.next != &expired) {
+      Timer &timer = *expired.next;
+      timer.prev->next = timer.next;
+      timer.next->prev = timer.prev;
+      timer.prev = timer.next = nullptr;
+      --size_;
+      expire(timer);
+    }
+  }
+}
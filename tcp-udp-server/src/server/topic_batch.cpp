@@ -0,0 +1,54 @@
+#include "topic_batch.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+// The slots of the first batch, kept at least twice the topics
+constexpr size_t MIN_SLOTS = 16;
+
+} // namespace
+
+auto TopicBatch::add(const UdpMessageView &view, size_t packet) -> uint32_t {
+  std::string_view topic = view.topic_str();
+  if ((topics_.size() + 1) * 2 > slots_.size()) {
+    grow();
+  }
+
+  size_t mask = slots_.size() - 1;
+  size_t slot = std::hash<std::string_view>{}(topic) & mask;
+  while (slots_[slot] != 0 && topics_[slots_[slot] - 1] != topic) {
+    slot = (slot + 1) & mask;
+  }
+  if (slots_[slot] == 0) {
+    topics_.push_back(topic);
+    topic_slots_.push_back(static_cast<uint32_t>(slot));
+    slots_[slot] = static_cast<uint32_t>(topics_.size());
+  }
+  uint32_t index = slots_[slot] - 1;
+  messages_.push_back({view, static_cast<uint32_t>(packet), index});
+  return index;
+}
+
+void TopicBatch::clear() {
+  messages_.clear();
+  for (uint32_t slot : topic_slots_) {
+    slots_[slot] = 0;
+  }
+  topics_.clear();
+  topic_slots_.clear();
+}
+
+void TopicBatch::grow() {
+  slots_.assign(std::max(slots_.size() * 2, MIN_SLOTS), 0);
+  size_t mask = slots_.size() - 1;
+  for (size_t i = 0; i < topics_.size(); ++i) {
+    size_t slot = std::hash<std::string_view>{}(topics_[i]) & mask;
+    while (slots_[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    slots_[slot] = static_cast<uint32_t>(i + 1);
+    topic_slots_[i] = static_cast<uint32_t>(slot);
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "udp_proto.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief The messages of a batch of UDP packets, grouped by their topic
+ *
+ * The messages are kept in the order they were received, each with the index
+ * of its topic among the distinct topics of the batch, so that a topic
+ * published several times in a burst is parsed and matched once for the
+ * batch, the messages still being fanned out in order. The messages point into
+ * the datagrams, and are valid until the next batch is received. The topics
+ * are indexed by a hash table of their own, kept from a batch to the next, so
+ * that a batch allocates nothing once the batches are as large as the largest
+ * one received so far.
+ */
+class TopicBatch {
+public:
+  // A message of the batch
+  struct Message {
+    UdpMessageView view{};
+    // the index of its packet in the UdpBatch
+    uint32_t packet{};
+    // the index of its topic in topics()
+    uint32_t topic{};
+  };
+
+  /**
+   * @brief Add a message of the batch, after those received before it
+   *
+   * @param view The message, pointing into its datagram
+   * @param packet The index of its packet in the UdpBatch
+   * @return The index of its topic in topics()
+   */
+  auto add(const UdpMessageView &view, size_t packet) -> uint32_t;
+
+  auto messages() const -> const std::vector<Message> & { return messages_; }
+  // The distinct topics of the batch, in the order of their first message
+  auto topics() const -> const std::vector<std::string_view> & {
+    return topics_;
+  }
+
+  void clear();
+
+private:
+  std::vector<Message> messages_{};
+  // Double the slots of the topics, indexing them again
+  void grow();
+
+  std::vector<std::string_view> topics_{};
+  // the index of each topic in topics_, plus 1, by the hash of the topic, 0
+  // for an empty slot, with linear probing, and the slot of each topic
+  std::vector<uint32_t> slots_{};
+  std::vector<uint32_t> topic_slots_{};
+};
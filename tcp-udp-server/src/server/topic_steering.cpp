@@ -0,0 +1,134 @@
+#include "topic_steering.hpp"
+
+#include "udp_proto.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/bpf.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t FNV_OFFSET_BASIS = 2166136261u;
+constexpr uint32_t FNV_PRIME = 16777619u;
+
+// The registers of the program: the context, kept in R6 for the packet
+// loads, the hash, the offset of the topic and its size
+constexpr uint8_t R0 = 0;
+constexpr uint8_t R1 = 1;
+constexpr uint8_t CTX = 6;
+constexpr uint8_t HASH = 7;
+constexpr uint8_t TOPIC = 8;
+constexpr uint8_t TOPIC_SIZE = 9;
+
+// Offset of the kind of a batch, its version, after the magic byte, and of the
+// size of the topic of its first record
+constexpr int32_t BATCH_KIND_OFFSET = 1;
+constexpr int32_t BATCH_TOPIC_SIZE_OFFSET = 2;
+
+auto insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+    -> bpf_insn {
+  bpf_insn instruction{};
+  instruction.code = code;
+  instruction.dst_reg = dst;
+  instruction.src_reg = src;
+  instruction.off = off;
+  instruction.imm = imm;
+  return instruction;
+}
+
+/**
+ * @brief Build the program, whose packet data starts after the UDP header,
+ * the loads beyond the packet ending it with socket 0
+ *
+ * The registrations of topic ids and the batches sent by id get an index out
+ * of the group, for the kernel to fall back to the hash of the addresses, so
+ * that the ids of a publisher are registered with the socket they are
+ * resolved by.
+ */
+auto steering_program(size_t sockets) -> std::vector<bpf_insn> {
+  std::vector<bpf_insn> program{
+      insn(BPF_ALU64 | BPF_MOV | BPF_X, CTX, R1, 0, 0),
+      insn(BPF_ALU | BPF_MOV | BPF_K, HASH, 0, 0,
+           static_cast<int32_t>(FNV_OFFSET_BASIS)),
+      // A single message, its topic padded to UDP_MSG_TOPIC_SIZE bytes
+      insn(BPF_ALU | BPF_MOV | BPF_K, TOPIC, 0, 0, 0),
+      insn(BPF_ALU | BPF_MOV | BPF_K, TOPIC_SIZE, 0, 0, UDP_MSG_TOPIC_SIZE),
+      insn(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 0),
+      insn(BPF_JMP | BPF_JNE | BPF_K, R0, 0, 8,
+           static_cast<int32_t>(UDP_BATCH_MAGIC)),
+      // Or a datagram of topic ids, steered by its publisher
+      insn(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, BATCH_KIND_OFFSET),
+      insn(BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 1, UDP_TOPIC_REGISTRATION),
+      insn(BPF_JMP | BPF_JNE | BPF_K, R0, 0, 2, UDP_TOPIC_ID_BATCH),
+      insn(BPF_ALU | BPF_MOV | BPF_K, R0, 0, 0, static_cast<int32_t>(sockets)),
+      insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      // Or a batch, starting with the size of the topic of its first record
+      insn(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, BATCH_TOPIC_SIZE_OFFSET),
+      insn(BPF_ALU | BPF_MOV | BPF_X, TOPIC_SIZE, R0, 0, 0),
+      insn(BPF_ALU | BPF_MOV | BPF_K, TOPIC, 0, 0,
+           BATCH_TOPIC_SIZE_OFFSET + 1),
+  };
+
+  // The bytes of the topic, unrolled, until its size or its NUL, each jump
+  // being patched to the end
+  std::vector<size_t> exits;
+  for (int32_t i = 0; i < static_cast<int32_t>(UDP_MSG_TOPIC_SIZE); ++i) {
+    exits.push_back(program.size());
+    program.push_back(insn(BPF_JMP | BPF_JLE | BPF_K, TOPIC_SIZE, 0, 0, i));
+    program.push_back(insn(BPF_LD | BPF_IND | BPF_B, 0, TOPIC, 0, i));
+    exits.push_back(program.size());
+    program.push_back(insn(BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0, 0));
+    program.push_back(insn(BPF_ALU | BPF_XOR | BPF_X, HASH, R0, 0, 0));
+    program.push_back(insn(BPF_ALU | BPF_MUL | BPF_K, HASH, 0, 0,
+                           static_cast<int32_t>(FNV_PRIME)));
+  }
+  for (size_t exit : exits) {
+    program[exit].off = static_cast<int16_t>(program.size() - exit - 1);
+  }
+
+  program.push_back(insn(BPF_ALU | BPF_MOV | BPF_X, R0, HASH, 0, 0));
+  program.push_back(insn(BPF_ALU | BPF_MOD | BPF_K, R0, 0, 0,
+                         static_cast<int32_t>(sockets)));
+  program.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+  return program;
+}
+
+} // namespace
+
+void attach_topic_steering(int sockfd, size_t sockets) {
+  if (sockets == 0 || sockets > INT32_MAX) {
+    throw std::invalid_argument("Invalid number of steered sockets");
+  }
+
+  auto program = steering_program(sockets);
+  bpf_attr attr{};
+  attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+  attr.insns = reinterpret_cast<uint64_t>(program.data());
+  attr.insn_cnt = static_cast<uint32_t>(program.size());
+  attr.license = reinterpret_cast<uint64_t>("GPL");
+
+  int prog_fd = static_cast<int>(
+      syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr)));
+  if (prog_fd < 0) {
+    throw std::runtime_error(
+        std::string("Failed to load the topic steering program: ") +
+        std::strerror(errno));
+  }
+
+  // The group keeps its own reference to the program
+  int result = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+                          &prog_fd, sizeof(prog_fd));
+  int error = errno;
+  close(prog_fd);
+  if (result < 0) {
+    throw std::runtime_error(
+        std::string("Failed to attach the topic steering program: ") +
+        std::strerror(error));
+  }
+}
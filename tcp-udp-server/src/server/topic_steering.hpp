@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * @brief Steer the UDP packets of a reuseport group to the socket of the hash
+ * of their topic, instead of that of the addresses of their publisher
+ *
+ * A program written directly in eBPF instructions, without libbpf, and
+ * attached with SO_ATTACH_REUSEPORT_EBPF, reads the topic of the packet (that
+ * of a single message, or of the first record of a batch), up to its NUL or
+ * its size, hashes it with FNV-1a and returns the index of its socket, the
+ * hash modulo the number of sockets. The sockets of a group are indexed in
+ * the order they were bound, so the i-th ingest thread gets the i-th share of
+ * the topics, each topic always landing on the same thread, in order. The
+ * datagrams of topic ids (UDP_TOPIC_REGISTRATION and UDP_TOPIC_ID_BATCH) are
+ * left to the hash of the addresses, their ids being known to a single socket.
+ *
+ * The program is owned by the group once attached, and applies to the
+ * sockets bound to the port afterwards.
+ *
+ * @param sockfd A socket of the group, bound with SO_REUSEPORT
+ * @param sockets The number of sockets of the group
+ * @throws std::runtime_error if the program cannot be loaded or attached
+ */
+void attach_topic_steering(int sockfd, size_t sockets);
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "token_pattern.hpp"
+#include "topic_view.hpp"
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief Index of subscription patterns, as a trie of their tokens
+ *
+ * Each node has an edge per string token (by its interned id), and an edge
+ * for each wildcard ('+' and '*'). A topic is matched by walking the trie once,
+ * following at each token the edge of the token itself and the wildcard edges,
+ * so the cost depends on the depth of the topic and the number of matches
+ * rather than on the number of patterns.
+ *
+ * The matching rules are those of TokenPattern::matches
+ *
+ * @tparam Value The values stored for each pattern, hashable
+ */
+template <typename Value> class TopicTrie {
+  using TokenId = TokenPattern::TokenId;
+
+  struct Node {
+    bool empty() const {
+      return values.empty() && children.empty() && !plus && !star;
+    }
+
+    std::unordered_map<TokenId, std::unique_ptr<Node>> children{};
+    std::unique_ptr<Node> plus{};
+    std::unique_ptr<Node> star{};
+    // The values of the patterns ending at this node
+    std::unordered_set<Value> values{};
+  };
+
+public:
+  /**
+   * @brief Add a value to a pattern
+   *
+   * @param pattern The pattern, which may contain wildcards
+   * @param value The value to add
+   */
+  void insert(const TokenPattern &pattern, const Value &value) {
+    Node *node = &root_;
+    for (auto token : pattern.tokens()) {
+      auto &next = edge(*node, token);
+      if (!next) {
+        next = std::make_unique<Node>();
+      }
+      node = next.get();
+    }
+    node->values.insert(value);
+  }
+
+  /**
+   * @brief Remove a value from a pattern, and the nodes left unused
+   * If the value is not stored for the pattern, this function does nothing
+   *
+   * @param pattern The pattern, which may contain wildcards
+   * @param value The value to remove
+   */
+  void erase(const TokenPattern &pattern, const Value &value) {
+    erase(root_, pattern.tokens(), 0, value);
+  }
+
+  /**
+   * @brief Call a function with the values of every pattern matching a topic
+   * A value may be visited several times, when stored for several matching
+   * patterns or when a pattern matches the topic in several ways
+   *
+   * @param topic The topic to match, without wildcards
+   * @param visit The function called with each value
+   */
+  template <typename Visitor>
+  void for_each_match(const TokenPattern &topic, Visitor &&visit) const {
+    match(root_, topic.tokens().data(), topic.tokens().size(), 0, visit);
+  }
+
+  /**
+   * @brief Call a function with the values of every pattern matching a
+   * published topic, without allocating
+   *
+   * @param topic The topic to match
+   * @param visit The function called with each value
+   */
+  template <typename Visitor>
+  void for_each_match(const TopicView &topic, Visitor &&visit) const {
+    match(root_, topic.begin(), topic.size(), 0, visit);
+  }
+
+private:
+  static auto edge(Node &node, TokenId token) -> std::unique_ptr<Node> & {
+    if (token == TokenInterner::PLUS_ID) {
+      return node.plus;
+    }
+    if (token == TokenInterner::STAR_ID) {
+      return node.star;
+    }
+    return node.children[token];
+  }
+
+  // Returns true if the node is left empty
+  static bool erase(Node &node, const std::vector<TokenId> &tokens,
+                    size_t index, const Value &value) {
+    if (index == tokens.size()) {
+      node.values.erase(value);
+      return node.empty();
+    }
+
+    auto token = tokens[index];
+    if (token == TokenInterner::PLUS_ID || token == TokenInterner::STAR_ID) {
+      auto &next = token == TokenInterner::PLUS_ID ? node.plus : node.star;
+      if (next && erase(*next, tokens, index + 1, value)) {
+        next.reset();
+      }
+    } else {
+      auto it = node.children.find(token);
+      if (it != node.children.end() &&
+          erase(*it->second, tokens, index + 1, value)) {
+        node.children.erase(it);
+      }
+    }
+    return node.empty();
+  }
+
+  template <typename Visitor>
+  static void match(const Node &node, const TokenId *topic, size_t size,
+                    size_t index, Visitor &visit) {
+    if (index == size) {
+      for (const auto &value : node.values) {
+        visit(value);
+      }
+      return;
+    }
+
+    auto it = node.children.find(topic[index]);
+    if (it != node.children.end()) {
+      match(*it->second, topic, size, index + 1, visit);
+    }
+    if (node.plus) {
+      match(*node.plus, topic, size, index + 1, visit);
+    }
+    if (node.star) {
+      match_star(*node.star, topic, size, index, visit);
+    }
+  }
+
+  // Match the tokens following a '*' starting at `index`. A trailing '*'
+  // matches the rest of the topic (1 or more tokens), while a '*' followed by
+  // a string token (never by a wildcard) matches the tokens before any
+  // occurrence of it (0 or more tokens), as in TokenPattern::matches.
+  template <typename Visitor>
+  static void match_star(const Node &star, const TokenId *topic, size_t size,
+                         size_t index, Visitor &visit) {
+    for (const auto &value : star.values) {
+      visit(value);
+    }
+    if (star.children.empty()) {
+      return;
+    }
+    for (size_t i = index; i < size; ++i) {
+      auto it = star.children.find(topic[i]);
+      if (it != star.children.end()) {
+        match(*it->second, topic, size, i + 1, visit);
+      }
+    }
+  }
+
+  Node root_{};
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "pattern_matcher.hpp"
+#include "token_pattern.hpp"
+#include "udp_proto.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+/**
+ * @brief Non-owning, allocation-free, parsed form of the topic of a published
+ * message, as the ids of its tokens stored inline
+ *
+ * The tokens are looked up in the TokenInterner without being added to it, a
+ * token never interned getting an id that no subscription uses. The hash is
+ * the one of the equal TokenPattern, so that the topics can be looked up in
+ * the maps keyed by TokenPattern.
+ */
+class TopicView {
+public:
+  using TokenId = TokenPattern::TokenId;
+
+  // A topic has at most one token every two characters
+  static constexpr size_t MAX_TOKENS = (UDP_MSG_TOPIC_SIZE + 1) / 2;
+  // The id of the tokens that were never interned
+  static constexpr TokenId UNKNOWN_ID{~TokenId{0}};
+
+  /**
+   * @brief Parse a published topic
+   * The tokens are split as by TokenPattern::from_string
+   *
+   * @param str The topic, of at most UDP_MSG_TOPIC_SIZE characters
+   * @return The topic, or std::nullopt if it is empty, too long or contains
+   * wildcards
+   */
+  static auto from_string(std::string_view str) -> std::optional<TopicView> {
+    return from_string(str, TokenInterner::instance().ids());
+  }
+
+  /**
+   * @brief Parse a published topic, looking its tokens up in a copy of the
+   * ids of the TokenInterner
+   *
+   * @param str The topic, of at most UDP_MSG_TOPIC_SIZE characters
+   * @param ids The ids of the tokens, as given by TokenInterner::ids
+   * @return The topic, or std::nullopt if it is empty, too long or contains
+   * wildcards
+   */
+  static auto from_string(std::string_view str,
+                          const TokenInterner::TokenIds &ids)
+      -> std::optional<TopicView> {
+    TopicView view{};
+
+    size_t offset = 0;
+    while (offset < str.size()) {
+      size_t pos = std::min(str.find_first_of(separator_, offset), str.size());
+      if (pos == offset) {
+        ++offset;
+        continue;
+      }
+      if (view.size_ == MAX_TOKENS) {
+        return std::nullopt;
+      }
+
+      auto it = ids.find(str.substr(offset, pos - offset));
+      auto id = it != ids.end() ? it->second : UNKNOWN_ID;
+      if (id == TokenInterner::STAR_ID || id == TokenInterner::PLUS_ID) {
+        return std::nullopt;
+      }
+      view.tokens_[view.size_++] = id;
+      hash_combine(view.hash_, id);
+      offset = pos + 1;
+    }
+
+    if (view.size_ == 0) {
+      return std::nullopt;
+    }
+    return view;
+  }
+
+  auto begin() const -> const TokenId * { return tokens_.data(); }
+  auto end() const -> const TokenId * { return tokens_.data() + size_; }
+  size_t size() const { return size_; }
+
+  /**
+   * @brief Get the hash value of the topic, equal to the one of the
+   * TokenPattern with the same tokens
+   *
+   * @return The hash value of the topic
+   */
+  std::size_t hashValue() const { return hash_; }
+
+  /**
+   * @brief Check if a subscription matches the topic
+   *
+   * @param pattern The pattern of the subscription
+   * @return true if the pattern matches the topic, a pattern of more than
+   * PatternMatcher::MAX_TOKENS tokens never matching
+   */
+  bool is_matched_by(const TokenPattern &pattern) const {
+    if (!pattern.has_wildcard()) {
+      return *this == pattern;
+    }
+    const PatternMatcher *matcher = pattern.matcher();
+    return matcher != nullptr && matcher->matches(begin(), size());
+  }
+
+  friend bool operator==(const TopicView &lhs, const TokenPattern &rhs) {
+    return lhs.hash_ == rhs.hashValue() &&
+           std::equal(lhs.begin(), lhs.end(), rhs.tokens().begin(),
+                      rhs.tokens().end());
+  }
+
+private:
+  std::array<TokenId, MAX_TOKENS> tokens_{};
+  size_t size_{};
+  std::size_t hash_{};
+  static constexpr char separator_{'/'};
+};
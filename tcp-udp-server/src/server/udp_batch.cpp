@@ -0,0 +1,150 @@
+#include "udp_batch.hpp"
+
+#include "async_log.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <netinet/udp.h>
+
+UdpBatch::UdpBatch(bool gro)
+    : gro_(gro),
+      slice_size_(gro ? GRO_BUFFER_SIZE : UdpMessage::MAX_SERIALIZED_SIZE),
+      buffer_(CAPACITY * slice_size_) {
+  packets_.reserve(gro ? CAPACITY * MAX_GRO_SEGMENTS : CAPACITY);
+  // Point each header to its slice of the buffer
+  for (size_t i = 0; i < CAPACITY; ++i) {
+    iovecs_[i].iov_base = buffer_.data() + i * slice_size_;
+    iovecs_[i].iov_len = slice_size_;
+    headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+    headers_[i].msg_hdr.msg_iovlen = 1;
+    headers_[i].msg_hdr.msg_name = &senders_[i];
+    headers_[i].msg_hdr.msg_control = controls_[i].bytes.data();
+  }
+}
+
+auto UdpBatch::receive(int sockfd) -> size_t {
+  for (auto &header : headers_) {
+    header.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    header.msg_hdr.msg_controllen = CONTROL_SIZE;
+  }
+
+  packets_.clear();
+  buffers_ = 0;
+  while (true) {
+    int received = recvmmsg(sockfd, headers_.data(), headers_.size(),
+                            MSG_DONTWAIT, nullptr);
+    if (received >= 0) {
+      buffers_ = static_cast<size_t>(received);
+      break;
+    }
+
+    if (errno == EINTR) {
+      continue;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      log_error("Error receiving UDP packets: ", std::strerror(errno));
+    }
+    return 0;
+  }
+
+  for (size_t i = 0; i < buffers_; ++i) {
+    const auto *data = static_cast<const std::byte *>(iovecs_[i].iov_base);
+    size_t size = headers_[i].msg_len;
+    auto buffer = static_cast<uint32_t>(i);
+    size_t segment = gro_ ? segment_size(headers_[i].msg_hdr) : 0;
+    if (segment == 0 || segment >= size) {
+      packets_.push_back({data, static_cast<uint32_t>(size), buffer});
+      continue;
+    }
+    // A coalesced buffer, split into its datagrams
+    for (size_t offset = 0; offset < size; offset += segment) {
+      auto length = static_cast<uint32_t>(std::min(segment, size - offset));
+      packets_.push_back({data + offset, length, buffer});
+    }
+  }
+  return packets_.size();
+}
+
+auto UdpBatch::load(const sockaddr_in *senders,
+                    const std::byte *const *datagrams, const size_t *sizes,
+                    size_t count) -> size_t {
+  packets_.clear();
+  buffers_ = std::min(count, CAPACITY);
+  for (size_t i = 0; i < buffers_; ++i) {
+    auto *data = static_cast<std::byte *>(iovecs_[i].iov_base);
+    size_t size = std::min(sizes[i], slice_size_);
+    std::memcpy(data, datagrams[i], size);
+    senders_[i] = senders[i];
+    headers_[i].msg_hdr.msg_controllen = 0;
+    headers_[i].msg_len = static_cast<unsigned int>(size);
+    packets_.push_back({data, static_cast<uint32_t>(size),
+                        static_cast<uint32_t>(i)});
+  }
+  return packets_.size();
+}
+
+auto UdpBatch::timestamp(const msghdr &header) -> uint64_t {
+  for (const cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&header),
+                          const_cast<cmsghdr *>(cmsg))) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      timespec time{};
+      std::memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+      return static_cast<uint64_t>(time.tv_sec) * 1000000000 +
+             static_cast<uint64_t>(time.tv_nsec);
+    }
+  }
+  return 0;
+}
+
+auto UdpBatch::drop_count(const msghdr &header) -> uint32_t {
+  for (const cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&header),
+                          const_cast<cmsghdr *>(cmsg))) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t count{};
+      std::memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+      return count;
+    }
+  }
+  return 0;
+}
+
+auto UdpBatch::segment_size(const msghdr &header) -> size_t {
+  for (const cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&header),
+                          const_cast<cmsghdr *>(cmsg))) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int size{};
+      std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      return size > 0 ? static_cast<size_t>(size) : 0;
+    }
+  }
+  return 0;
+}
+
+auto UdpBatch::set_gro(int sockfd, bool enabled) -> bool {
+  int value = enabled ? 1 : 0;
+  return setsockopt(sockfd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+}
+
+auto UdpBatch::set_receive_buffer(int sockfd, size_t size) -> bool {
+  if (size == 0) {
+    return true;
+  }
+  // The kernel doubles the size, for its bookkeeping
+  int value = static_cast<int>(std::min<size_t>(size, INT_MAX / 2));
+  return setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &value,
+                    sizeof(value)) == 0 ||
+         setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) == 0;
+}
+
+auto UdpBatch::receive_buffer(int sockfd) -> size_t {
+  int value = 0;
+  socklen_t value_len = sizeof(value);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &value, &value_len) < 0 ||
+      value < 0) {
+    return 0;
+  }
+  return static_cast<size_t>(value);
+}
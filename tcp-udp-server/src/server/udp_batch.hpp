@@ -0,0 +1,196 @@
+#pragma once
+
+#include "udp_proto.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+struct UdpReceiveConfig {
+  // The size of the receive buffer of the UDP sockets, in bytes, raised past
+  // net.core.rmem_max when the server has CAP_NET_ADMIN, the default of the
+  // kernel if 0
+  size_t receive_buffer{};
+  // Whether the kernel may coalesce the datagrams of a publisher into a
+  // single buffer (UDP_GRO), for the epoll backend only
+  bool gro{};
+};
+
+/**
+ * @brief Preallocated buffers of a batch of UDP packets, received with a
+ * single recvmmsg
+ *
+ * Each buffer has its own slice of UdpMessage::MAX_SERIALIZED_SIZE bytes, and
+ * room for its SO_TIMESTAMPNS timestamp and its SO_RXQ_OVFL count of drops,
+ * given once enabled on the socket. The headers point into the batch, which
+ * can thus be neither copied nor moved.
+ *
+ * With UDP_GRO, the kernel hands the datagrams of a flow as a single buffer of
+ * segments of the size given by its UDP_GRO control message, the last one
+ * possibly shorter, the slices then being of GRO_BUFFER_SIZE bytes. The
+ * buffers are split back into their datagrams as they are received, the
+ * packets of the batch being the datagrams.
+ */
+class UdpBatch {
+public:
+  // Number of UDP buffers received per recvmmsg
+  static constexpr size_t CAPACITY = 64;
+  // Size of the control messages of a packet, its timestamp, the count of
+  // drops and its UDP_GRO segment size
+  static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(timespec)) +
+                                         CMSG_SPACE(sizeof(uint32_t)) +
+                                         CMSG_SPACE(sizeof(int));
+  // Largest buffer of datagrams coalesced by UDP_GRO, and the most datagrams
+  // it holds
+  static constexpr size_t GRO_BUFFER_SIZE = 65535;
+  static constexpr size_t MAX_GRO_SEGMENTS = 64;
+
+  /**
+   * @param gro Whether UDP_GRO is enabled on the socket the batch is received
+   * from
+   */
+  explicit UdpBatch(bool gro = false);
+  UdpBatch(const UdpBatch &) = delete;
+  auto operator=(const UdpBatch &) -> UdpBatch & = delete;
+
+  /**
+   * @brief Receive a batch of UDP packets, without blocking
+   *
+   * @param sockfd The UDP socket
+   * @return The number of packets received, 0 if there was none
+   */
+  auto receive(int sockfd) -> size_t;
+
+  /**
+   * @brief Fill the batch with datagrams received before, as by a receive,
+   * for a replay, the packets having no control messages
+   *
+   * @param senders The addresses of their publishers
+   * @param datagrams The datagrams
+   * @param sizes Their sizes, the datagrams larger than a slice being
+   * truncated as by the kernel
+   * @param count The number of datagrams, at most CAPACITY
+   * @return The number of packets of the batch
+   */
+  auto load(const sockaddr_in *senders, const std::byte *const *datagrams,
+            const size_t *sizes, size_t count) -> size_t;
+
+  /**
+   * @brief Tell whether the last receive filled all the buffers, the socket
+   * possibly holding more packets
+   */
+  auto full() const -> bool { return buffers_ == CAPACITY; }
+
+  auto packet(size_t index) const -> const std::byte * {
+    return packets_[index].data;
+  }
+  auto packet_size(size_t index) const -> size_t {
+    return packets_[index].size;
+  }
+  auto sender(size_t index) const -> const sockaddr_in & {
+    return senders_[packets_[index].buffer];
+  }
+
+  /**
+   * @brief Get when the kernel received a packet, by its SO_TIMESTAMPNS
+   * timestamp
+   *
+   * @param index The index of the packet in the batch
+   * @return The nanoseconds of CLOCK_REALTIME, 0 if the packet has no
+   * timestamp
+   */
+  auto receive_time(size_t index) const -> uint64_t {
+    return timestamp(headers_[packets_[index].buffer].msg_hdr);
+  }
+
+  /**
+   * @brief Read the SO_TIMESTAMPNS timestamp of the control messages of a
+   * received packet
+   *
+   * @param header The header of the packet, pointing to its control messages
+   * @return The nanoseconds of CLOCK_REALTIME, 0 if there is no timestamp
+   */
+  static auto timestamp(const msghdr &header) -> uint64_t;
+
+  /**
+   * @brief Get how many packets the socket dropped, its receive buffer being
+   * full, until a packet was received, by its SO_RXQ_OVFL count
+   *
+   * @param index The index of the packet in the batch
+   * @return The count since SO_RXQ_OVFL was enabled, wrapping around, 0 if
+   * the packet has none, as before the first drop
+   */
+  auto drop_count(size_t index) const -> uint32_t {
+    return drop_count(headers_[packets_[index].buffer].msg_hdr);
+  }
+
+  /**
+   * @brief Read the SO_RXQ_OVFL count of the control messages of a received
+   * packet
+   *
+   * @param header The header of the packet, pointing to its control messages
+   * @return The count of the packets dropped, 0 if there is none
+   */
+  static auto drop_count(const msghdr &header) -> uint32_t;
+
+  /**
+   * @brief Read the UDP_GRO segment size of the control messages of a
+   * received buffer
+   *
+   * @param header The header of the buffer, pointing to its control messages
+   * @return The size of its datagrams, 0 if it holds a single one
+   */
+  static auto segment_size(const msghdr &header) -> size_t;
+
+  /**
+   * @brief Let the kernel coalesce the datagrams received by a UDP socket, or
+   * stop it
+   *
+   * @param sockfd The UDP socket
+   * @param enabled Whether UDP_GRO is enabled
+   * @return false if the option cannot be set, errno being set
+   */
+  static auto set_gro(int sockfd, bool enabled) -> bool;
+
+  /**
+   * @brief Size the receive buffer of a UDP socket, with SO_RCVBUFFORCE or,
+   * without CAP_NET_ADMIN, SO_RCVBUF, capped by net.core.rmem_max
+   *
+   * @param sockfd The UDP socket
+   * @param size The requested size, in bytes, left to the kernel if 0
+   * @return false if neither option can be set, errno being set
+   */
+  static auto set_receive_buffer(int sockfd, size_t size) -> bool;
+
+  /**
+   * @brief Get the size the kernel gave to the receive buffer of a socket
+   *
+   * @param sockfd The socket
+   * @return The size, in bytes, its bookkeeping included, 0 if it is unknown
+   */
+  static auto receive_buffer(int sockfd) -> size_t;
+
+private:
+  // A datagram of the batch, in the buffer it was received in
+  struct Packet {
+    const std::byte *data;
+    uint32_t size;
+    uint32_t buffer;
+  };
+
+  bool gro_{};
+  size_t slice_size_{};
+  std::vector<std::byte> buffer_{};
+  std::array<iovec, CAPACITY> iovecs_{};
+  std::array<mmsghdr, CAPACITY> headers_{};
+  std::array<sockaddr_in, CAPACITY> senders_{};
+  struct alignas(cmsghdr) Control {
+    std::array<std::byte, CONTROL_SIZE> bytes;
+  };
+  std::array<Control, CAPACITY> controls_{};
+  // the buffers received by the last recvmmsg, and their datagrams
+  size_t buffers_{};
+  std::vector<Packet> packets_{};
+};
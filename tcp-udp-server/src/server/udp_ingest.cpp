@@ -0,0 +1,269 @@
+#include "udp_ingest.hpp"
+
+#include "async_log.hpp"
+#include "cpu_placement.hpp"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+UdpIngest::UdpIngest(int udp_fd,
+                     const std::shared_ptr<const RegistrySnapshot> &snapshot,
+                     const std::vector<std::unique_ptr<IoWorker>> &workers,
+                     BrokerStats *stats,
+                     const AdmissionConfig &admission_config, int cpu,
+                     bool gro)
+    : udp_fd_(udp_fd), snapshot_(snapshot), workers_(workers), stats_(stats),
+      cpu_(cpu), gro_(gro), sends_(workers.size()) {
+  if (admission_config.enabled()) {
+    admission_ = std::make_unique<AdmissionControl>(admission_config);
+  }
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0) {
+    close(udp_fd_);
+    throw std::runtime_error("Failed to create the eventfd of a UDP ingest");
+  }
+
+  thread_ = std::thread(&UdpIngest::run, this);
+}
+
+UdpIngest::~UdpIngest() {
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) < 0) {
+    log_error("Failed to stop a UDP ingest: ", std::strerror(errno));
+  }
+  thread_.join();
+
+  close(stop_fd_);
+  close(udp_fd_);
+}
+
+void UdpIngest::run() {
+  if (cpu_ >= 0 && !pin_current_thread(cpu_)) {
+    log_error("Failed to pin a UDP ingest to CPU ", cpu_, ": ",
+              std::strerror(errno));
+  }
+  batch_ = std::make_unique<UdpBatch>(gro_);
+  std::array<pollfd, 2> fds{pollfd{udp_fd_, POLLIN, 0},
+                            pollfd{stop_fd_, POLLIN, 0}};
+
+  while (true) {
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Error in the poll of a UDP ingest: ", std::strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      size_t count = 0;
+      do {
+        count = batch_->receive(udp_fd_);
+        // A batch is matched against a single snapshot, the registered topics
+        // being matched again once it changed
+        auto snapshot = std::atomic_load(&snapshot_);
+        if (snapshot != snapshot_held_) {
+          snapshot_held_ = std::move(snapshot);
+          ++snapshot_generation_;
+        }
+        publish_batch(count, *snapshot_held_);
+      } while (batch_->full());
+    }
+  }
+}
+
+void UdpIngest::publish_batch(size_t count, const RegistrySnapshot &snapshot) {
+  uint64_t now_ns = admission_ ? AdmissionControl::now_ns() : 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (admission_) {
+      AdmissionResult result = admission_->admit(batch_->sender(i), now_ns);
+      if (result != AdmissionResult::ADMITTED) {
+        if (stats_ && result == AdmissionResult::PUBLISHER_LIMITED) {
+          ++stats_->udp_publisher_limited;
+        } else if (stats_) {
+          ++stats_->udp_global_limited;
+        }
+        continue;
+      }
+    }
+    const std::byte *packet = batch_->packet(i);
+    size_t packet_size = batch_->packet_size(i);
+    if (UdpMessageCursor::is_registration(packet, packet_size)) {
+      register_topics(batch_->sender(i), packet, packet_size, snapshot);
+      continue;
+    }
+    // A datagram batching several messages is sent with the others
+    for (UdpMessageCursor cursor(packet, packet_size); !cursor.done();) {
+      UdpParseError error = cursor.next(udp_msg_);
+      PublisherTopics<RegisteredTopic>::Topic *registered = nullptr;
+      if (error == UdpParseError::NONE && cursor.by_topic_id()) {
+        registered = publisher_topics_.resolve(batch_->sender(i),
+                                               cursor.topic_id(), udp_msg_);
+        if (registered == nullptr) {
+          error = UdpParseError::UNKNOWN_TOPIC_ID;
+        }
+      }
+      if (error != UdpParseError::NONE) {
+        if (stats_) {
+          ++stats_->udp_rejected[static_cast<size_t>(error)];
+        }
+        log_error("Error deserializing UDP payload: ", to_string(error));
+        continue;
+      }
+      uint32_t topic = topic_batch_.add(udp_msg_, i);
+      if (registered != nullptr) {
+        if (batch_registered_.size() <= topic) {
+          batch_registered_.resize(topic + 1);
+        }
+        batch_registered_[topic] = registered;
+      }
+    }
+  }
+
+  // Each distinct topic of the batch is parsed and matched once, the messages
+  // being fanned out in the order they were received
+  const auto &topics = topic_batch_.topics();
+  if (batch_topics_.size() < topics.size()) {
+    batch_topics_.resize(topics.size());
+  }
+  for (size_t i = 0; i < topics.size(); ++i) {
+    auto &batch_topic = batch_topics_[i];
+    if (i < batch_registered_.size() && batch_registered_[i] != nullptr) {
+      // Parsed and matched once for all the batches of the snapshot
+      auto &compiled = batch_registered_[i]->compiled;
+      if (compiled.generation != snapshot_generation_) {
+        compiled.topic = snapshot.parse_topic(topics[i]);
+        match(snapshot, *compiled.topic, compiled.subscribers);
+        compiled.generation = snapshot_generation_;
+      }
+      batch_topic.topic = compiled.topic;
+      batch_topic.subscribers = &compiled.subscribers;
+      continue;
+    }
+    batch_topic.topic = snapshot.parse_topic(topics[i]);
+    batch_topic.subscribers = &batch_topic.matched;
+    if (batch_topic.topic.has_value()) {
+      match(snapshot, *batch_topic.topic, batch_topic.matched);
+    }
+  }
+  for (const auto &message : topic_batch_.messages()) {
+    udp_msg_ = message.view;
+    uint64_t received_ns = stats_ ? batch_->receive_time(message.packet) : 0;
+    publish_msg(batch_->sender(message.packet), batch_topics_[message.topic],
+                snapshot, received_ns);
+  }
+  topic_batch_.clear();
+  batch_registered_.clear();
+  publisher_topics_.release_retired();
+
+  for (size_t worker = 0; worker < workers_.size(); ++worker) {
+    if (!sends_[worker].empty()) {
+      workers_[worker]->send(std::move(sends_[worker]));
+      sends_[worker].clear();
+    }
+  }
+}
+
+void UdpIngest::match(const RegistrySnapshot &snapshot,
+                      const TopicView &topic,
+                      std::vector<RegistrySnapshot::Subscriber> &subscribers) {
+  std::chrono::steady_clock::time_point match_start{};
+  if (stats_) {
+    match_start = std::chrono::steady_clock::now();
+  }
+  snapshot.match_topic_subscribers(topic, subscribers);
+  if (stats_) {
+    stats_->match_ns.record(static_cast<uint64_t>(
+        std::chrono::nanoseconds(std::chrono::steady_clock::now() - match_start)
+            .count()));
+  }
+}
+
+void UdpIngest::publish_msg(const sockaddr_in &sender,
+                            const BatchTopic &batch_topic,
+                            const RegistrySnapshot &snapshot,
+                            uint64_t received_ns) {
+  if (!batch_topic.topic.has_value()) {
+    if (stats_) {
+      ++stats_->udp_invalid_topic;
+    }
+    log_error("Invalid topic: ", udp_msg_.topic_str());
+    return;
+  }
+  const auto &topic = *batch_topic.topic;
+  if (stats_) {
+    ++stats_->udp_received;
+    stats_->fanout.record(batch_topic.subscribers->size());
+    if (batch_topic.subscribers->empty()) {
+      ++stats_->udp_unmatched;
+    }
+  }
+
+  // Only the subscribers whose filters accept the message
+  const auto *subscribers = batch_topic.subscribers;
+  if (snapshot.filters() && !subscribers->empty()) {
+    auto type = static_cast<TcpResponsePayloadType>(udp_msg_.payload_type);
+    subscribers_.clear();
+    for (const auto &subscriber : *batch_topic.subscribers) {
+      if (snapshot.accepts(subscriber.sockfd, topic, type, udp_msg_.payload,
+                           udp_msg_.payload_size)) {
+        subscribers_.push_back(subscriber);
+      }
+    }
+    subscribers = &subscribers_;
+    if (stats_) {
+      stats_->filtered += batch_topic.subscribers->size() - subscribers->size();
+    }
+  }
+  if (subscribers->empty()) {
+    return;
+  }
+  // The same bytes are sent to every subscriber, by every worker
+  auto message = fanout_encoder_.encode(udp_msg_, sender, received_ns,
+                                        snapshot.priority(topic));
+
+  for (const auto &subscriber : *subscribers) {
+    sends_[subscriber.worker].push_back(
+        {subscriber.sockfd, subscriber.connection, message});
+  }
+}
+
+void UdpIngest::register_topics(const sockaddr_in &sender,
+                                const std::byte *buffer, size_t size,
+                                const RegistrySnapshot &snapshot) {
+  start_registration_ack(registration_ack_);
+  for (UdpRegistrationCursor cursor(buffer, size); !cursor.done();) {
+    uint16_t id{};
+    std::string_view name{};
+    UdpParseError error = cursor.next(id, name);
+    if (error != UdpParseError::NONE) {
+      log_error("Error deserializing UDP payload: ", to_string(error));
+      continue;
+    }
+    if (!snapshot.parse_topic(name).has_value()) {
+      log_error("Invalid topic: ", name);
+      continue;
+    }
+    if (publisher_topics_.add(sender, id, name, {}) != nullptr) {
+      append_registered_id(registration_ack_, id);
+    }
+  }
+
+  if (sendto(udp_fd_, registration_ack_.data(), registration_ack_.size(),
+             MSG_DONTWAIT, reinterpret_cast<const sockaddr *>(&sender),
+             sizeof(sender)) < 0) {
+    log_error("Error acknowledging the topic registration: ",
+              std::strerror(errno));
+  }
+}
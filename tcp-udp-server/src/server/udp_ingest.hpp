@@ -0,0 +1,124 @@
+#pragma once
+
+#include "admission_control.hpp"
+#include "fanout_encoder.hpp"
+#include "io_worker.hpp"
+#include "publisher_topics.hpp"
+#include "registry_snapshot.hpp"
+#include "topic_batch.hpp"
+#include "udp_batch.hpp"
+#include "udp_proto.hpp"
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Thread receiving the UDP messages of a socket, in the multi-threaded
+ * mode of the server
+ *
+ * The sockets of the ingest threads are bound to the same port with
+ * SO_REUSEPORT, the kernel spreading the publishers across them. A batch of
+ * messages is matched against the last snapshot of the registry, once for each
+ * distinct topic of the batch, and the messages handed to the I/O workers of
+ * their subscribers, once per worker.
+ *
+ * The buffers of the batch and the messages are allocated by the thread
+ * itself, on the NUMA node of its CPU once it is pinned.
+ */
+class UdpIngest {
+public:
+  /**
+   * @brief Start an ingest thread
+   *
+   * @param udp_fd The UDP socket, owned by the ingest thread
+   * @param snapshot The snapshot of the registry, loaded atomically
+   * @param workers The I/O workers of the subscribers, outliving the thread
+   * @param stats The statistics of the server, the UDP messages being
+   * counted into them, none if they are not collected
+   * @param admission_config The rates of the UDP packets of the socket,
+   * limited by the thread
+   * @param cpu The CPU the thread is pinned to, -1 to leave it to the
+   * scheduler
+   * @param gro Whether UDP_GRO is enabled on the socket
+   *
+   * @throws std::runtime_error if the eventfd cannot be created
+   */
+  UdpIngest(int udp_fd, const std::shared_ptr<const RegistrySnapshot> &snapshot,
+            const std::vector<std::unique_ptr<IoWorker>> &workers,
+            BrokerStats *stats, const AdmissionConfig &admission_config = {},
+            int cpu = -1,
+            bool gro = false);
+
+  /**
+   * @brief Stop the ingest thread and close its socket
+   */
+  ~UdpIngest();
+
+  UdpIngest(const UdpIngest &) = delete;
+  auto operator=(const UdpIngest &) -> UdpIngest & = delete;
+
+private:
+  // A distinct topic of the batch, parsed once, and its subscribers, before
+  // their filters, those matched for the batch or those of its registered
+  // topic
+  struct BatchTopic {
+    std::optional<TopicView> topic{};
+    const std::vector<RegistrySnapshot::Subscriber> *subscribers{};
+    std::vector<RegistrySnapshot::Subscriber> matched{};
+  };
+
+  // A topic registered by a publisher, parsed and matched against the snapshot
+  // of a generation
+  struct RegisteredTopic {
+    std::optional<TopicView> topic{};
+    std::vector<RegistrySnapshot::Subscriber> subscribers{};
+    uint64_t generation{};
+  };
+
+  void run();
+  void publish_batch(size_t count, const RegistrySnapshot &snapshot);
+  void register_topics(const sockaddr_in &sender, const std::byte *buffer,
+                       size_t size, const RegistrySnapshot &snapshot);
+  void publish_msg(const sockaddr_in &sender, const BatchTopic &batch_topic,
+                   const RegistrySnapshot &snapshot, uint64_t received_ns);
+  void match(const RegistrySnapshot &snapshot, const TopicView &topic,
+             std::vector<RegistrySnapshot::Subscriber> &subscribers);
+
+  int udp_fd_{-1};
+  // written to stop the thread
+  int stop_fd_{-1};
+  const std::shared_ptr<const RegistrySnapshot> &snapshot_;
+  const std::vector<std::unique_ptr<IoWorker>> &workers_;
+  BrokerStats *stats_{};
+
+  int cpu_{-1};
+  bool gro_{};
+  // allocated by the thread
+  std::unique_ptr<UdpBatch> batch_{};
+  UdpMessageView udp_msg_{};
+  // the rates of the packets of the socket, if they are limited
+  std::unique_ptr<AdmissionControl> admission_{};
+  // the messages are released by the workers
+  FanoutEncoder fanout_encoder_{false};
+  // the messages of the batch, by topic, the subscribers of each topic, kept
+  // allocated across the batches, and those of a message accepting it
+  TopicBatch topic_batch_{};
+  std::vector<BatchTopic> batch_topics_{};
+  // the registered topic of each distinct topic of the batch sent by id,
+  // nullptr for the others
+  std::vector<PublisherTopics<RegisteredTopic>::Topic *> batch_registered_{};
+  // the topic ids of the publishers of the socket, and the acknowledgement of
+  // the last registration
+  PublisherTopics<RegisteredTopic> publisher_topics_{};
+  std::vector<std::byte> registration_ack_{};
+  // the snapshot the batches are matched against, kept while the registered
+  // topics are matched against it, and its generation
+  std::shared_ptr<const RegistrySnapshot> snapshot_held_{};
+  uint64_t snapshot_generation_{};
+  std::vector<RegistrySnapshot::Subscriber> subscribers_{};
+  // the messages of the batch, by worker
+  std::vector<std::vector<IoWorker::Send>> sends_{};
+
+  std::thread thread_{};
+};
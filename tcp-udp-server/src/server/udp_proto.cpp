@@ -1,52 +1,34 @@
 #include "udp_proto.hpp"
 #include "util.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
+#include <string>
 
 void UdpPayloadInt::deserialize(UdpPayloadInt &payload, const std::byte *buffer,
                                 size_t buffer_size) {
-  if (buffer_size < UdpPayloadInt::MIN_SERIALIZED_SIZE) {
+  if (!Layout::deserialize(payload, buffer, buffer_size)) {
     throw std::invalid_argument(
         "Failed to deserialize UDP payload: buffer size is too small");
   }
-  memcpy(&payload.sign, buffer, sizeof(payload.sign));
-  buffer += sizeof(payload.sign);
-
-  uint32_t value_network;
-  memcpy(&value_network, buffer, sizeof(value_network));
-  payload.value = ntoh(value_network);
 }
 
 void UdpPayloadShortReal::deserialize(UdpPayloadShortReal &payload,
                                       const std::byte *buffer,
                                       size_t buffer_size) {
-  if (buffer_size < UdpPayloadShortReal::MIN_SERIALIZED_SIZE) {
+  if (!Layout::deserialize(payload, buffer, buffer_size)) {
     throw std::invalid_argument(
         "Failed to deserialize UDP payload: buffer size is too small");
   }
-
-  uint16_t value_network;
-  memcpy(&value_network, buffer, sizeof(value_network));
-  payload.value = ntoh(value_network);
 }
 
 void UdpPayloadFloat::deserialize(UdpPayloadFloat &payload,
                                   const std::byte *buffer, size_t buffer_size) {
-  if (buffer_size < UdpPayloadFloat::MIN_SERIALIZED_SIZE) {
+  if (!Layout::deserialize(payload, buffer, buffer_size)) {
     throw std::invalid_argument(
         "Failed to deserialize UDP payload: buffer size is too small");
   }
-
-  memcpy(&payload.sign, buffer, sizeof(payload.sign));
-  buffer += sizeof(payload.sign);
-
-  uint32_t value_network;
-  memcpy(&value_network, buffer, sizeof(value_network));
-  payload.value = ntoh(value_network);
-  buffer += sizeof(value_network);
-
-  memcpy(&payload.exponent, buffer, sizeof(payload.exponent));
 }
 
 void UdpPayloadString::deserialize(UdpPayloadString &payload,
@@ -118,3 +100,216 @@ void UdpMessage::deserialize(UdpMessage &msg, const std::byte *buffer,
         "Failed to deserialize UDP message: unknown payload type");
   }
 }
+
+auto to_string(UdpParseError error) -> const char * {
+  switch (error) {
+  case UdpParseError::NONE:
+    return "none";
+  case UdpParseError::TOO_SHORT:
+    return "buffer size is too small";
+  case UdpParseError::UNKNOWN_PAYLOAD_TYPE:
+    return "unknown payload type";
+  case UdpParseError::PAYLOAD_TOO_SHORT:
+    return "payload size is too small";
+  case UdpParseError::INVALID_BATCH:
+    return "invalid batch";
+  case UdpParseError::UNKNOWN_TOPIC_ID:
+    return "unknown topic id";
+  default:
+    return "unknown error";
+  }
+}
+
+auto UdpMessageView::parse(UdpMessageView &view, const std::byte *buffer,
+                           size_t buffer_size) noexcept -> UdpParseError {
+  if (buffer_size < UdpMessage::MIN_SERIALIZED_SIZE) {
+    return UdpParseError::TOO_SHORT;
+  }
+
+  const char *topic = reinterpret_cast<const char *>(buffer);
+  buffer += UDP_MSG_TOPIC_SIZE;
+
+  uint8_t type;
+  memcpy(&type, buffer, sizeof(type));
+  auto payload_type = static_cast<UdpPayloadType>(type);
+  buffer += sizeof(UdpPayloadType);
+
+  buffer_size -= UDP_MSG_TOPIC_SIZE + sizeof(UdpPayloadType);
+
+  if (type >= static_cast<uint8_t>(UdpPayloadType::TOTAL_PAYLOAD_TYPES)) {
+    return UdpParseError::UNKNOWN_PAYLOAD_TYPE;
+  }
+  const UdpPayloadFormat &format = UDP_PAYLOAD_FORMATS[type];
+  if (buffer_size < format.min_size) {
+    return UdpParseError::PAYLOAD_TOO_SHORT;
+  }
+  view.topic = topic;
+  view.topic_size = strnlen(topic, UDP_MSG_TOPIC_SIZE);
+  view.payload_type = payload_type;
+  view.payload = buffer;
+  view.payload_size =
+      static_cast<uint16_t>(format.view_size(buffer, buffer_size));
+  return UdpParseError::NONE;
+}
+
+void UdpMessageView::deserialize(UdpMessageView &view, const std::byte *buffer,
+                                 size_t buffer_size) {
+  UdpParseError error = parse(view, buffer, buffer_size);
+  if (error != UdpParseError::NONE) {
+    throw std::invalid_argument(
+        std::string("Failed to deserialize UDP message: ") + to_string(error));
+  }
+}
+
+auto UdpMessageCursor::next(UdpMessageView &view) noexcept -> UdpParseError {
+  if (!is_batch(buffer_, size_)) {
+    done_ = true;
+    return UdpMessageView::parse(view, buffer_, size_);
+  }
+  if (offset_ == 0) {
+    auto kind = static_cast<uint8_t>(buffer_[1]);
+    if (kind != UDP_BATCH_VERSION && kind != UDP_TOPIC_ID_BATCH) {
+      done_ = true;
+      return UdpParseError::INVALID_BATCH;
+    }
+    by_topic_id_ = kind == UDP_TOPIC_ID_BATCH;
+    offset_ = UDP_BATCH_HEADER_SIZE;
+  }
+
+  UdpParseError error = by_topic_id_ ? next_id_record(view) : next_record(view);
+  if (error != UdpParseError::NONE || offset_ == size_) {
+    done_ = true;
+  }
+  return error;
+}
+
+auto UdpMessageCursor::next_record(UdpMessageView &view) noexcept
+    -> UdpParseError {
+  const std::byte *record = buffer_ + offset_;
+  size_t left = size_ - offset_;
+
+  uint8_t topic_size{};
+  if (left < sizeof(topic_size)) {
+    return UdpParseError::INVALID_BATCH;
+  }
+  memcpy(&topic_size, record, sizeof(topic_size));
+  if (topic_size == 0 || topic_size > UDP_MSG_TOPIC_SIZE ||
+      left < UDP_BATCH_RECORD_HEADER_SIZE + topic_size) {
+    return UdpParseError::INVALID_BATCH;
+  }
+  const char *topic = reinterpret_cast<const char *>(record + sizeof(uint8_t));
+  record += sizeof(topic_size) + topic_size;
+
+  uint8_t type{};
+  memcpy(&type, record, sizeof(type));
+  uint16_t payload_size_network{};
+  memcpy(&payload_size_network, record + sizeof(type),
+         sizeof(payload_size_network));
+  uint16_t payload_size = ntoh(payload_size_network);
+  const std::byte *payload =
+      record + sizeof(type) + sizeof(payload_size_network);
+  if (payload_size > UdpPayloadString::MAX_SERIALIZED_SIZE ||
+      left < UDP_BATCH_RECORD_HEADER_SIZE + topic_size + payload_size) {
+    return UdpParseError::INVALID_BATCH;
+  }
+  offset_ += UDP_BATCH_RECORD_HEADER_SIZE + topic_size + payload_size;
+
+  UdpParseError error = parse_record_payload(view, type, payload, payload_size);
+  if (error != UdpParseError::NONE) {
+    return error;
+  }
+  view.topic = topic;
+  view.topic_size = static_cast<uint8_t>(strnlen(topic, topic_size));
+  return UdpParseError::NONE;
+}
+
+auto UdpMessageCursor::next_id_record(UdpMessageView &view) noexcept
+    -> UdpParseError {
+  const std::byte *record = buffer_ + offset_;
+  size_t left = size_ - offset_;
+  if (left < UDP_ID_RECORD_HEADER_SIZE) {
+    return UdpParseError::INVALID_BATCH;
+  }
+
+  uint16_t id_network{};
+  memcpy(&id_network, record, sizeof(id_network));
+  uint8_t type{};
+  memcpy(&type, record + sizeof(id_network), sizeof(type));
+  uint16_t payload_size_network{};
+  memcpy(&payload_size_network, record + sizeof(id_network) + sizeof(type),
+         sizeof(payload_size_network));
+  uint16_t payload_size = ntoh(payload_size_network);
+  const std::byte *payload = record + UDP_ID_RECORD_HEADER_SIZE;
+  if (payload_size > UdpPayloadString::MAX_SERIALIZED_SIZE ||
+      left < UDP_ID_RECORD_HEADER_SIZE + payload_size) {
+    return UdpParseError::INVALID_BATCH;
+  }
+  offset_ += UDP_ID_RECORD_HEADER_SIZE + payload_size;
+
+  UdpParseError error = parse_record_payload(view, type, payload, payload_size);
+  if (error != UdpParseError::NONE) {
+    return error;
+  }
+  topic_id_ = ntoh(id_network);
+  view.topic = nullptr;
+  view.topic_size = 0;
+  return UdpParseError::NONE;
+}
+
+auto UdpMessageCursor::parse_record_payload(UdpMessageView &view,
+                                            uint8_t type,
+                                            const std::byte *payload,
+                                            uint16_t payload_size) noexcept
+    -> UdpParseError {
+  // The payloads are checked as those of a single message
+  if (type >= static_cast<uint8_t>(UdpPayloadType::TOTAL_PAYLOAD_TYPES)) {
+    return UdpParseError::UNKNOWN_PAYLOAD_TYPE;
+  }
+  const UdpPayloadFormat &format = UDP_PAYLOAD_FORMATS[type];
+  if (payload_size < format.min_size) {
+    return UdpParseError::PAYLOAD_TOO_SHORT;
+  }
+
+  view.payload_type = static_cast<UdpPayloadType>(type);
+  view.payload = payload;
+  view.payload_size =
+      static_cast<uint16_t>(format.view_size(payload, payload_size));
+  return UdpParseError::NONE;
+}
+
+auto UdpRegistrationCursor::next(uint16_t &id, std::string_view &topic) noexcept
+    -> UdpParseError {
+  const std::byte *record = buffer_ + offset_;
+  size_t left = size_ - offset_;
+
+  uint8_t topic_size{};
+  if (left < UDP_REGISTRATION_RECORD_HEADER_SIZE) {
+    offset_ = size_;
+    return UdpParseError::INVALID_BATCH;
+  }
+  memcpy(&topic_size, record + sizeof(id), sizeof(topic_size));
+  if (topic_size == 0 || topic_size > UDP_MSG_TOPIC_SIZE ||
+      left < UDP_REGISTRATION_RECORD_HEADER_SIZE + topic_size) {
+    offset_ = size_;
+    return UdpParseError::INVALID_BATCH;
+  }
+  offset_ += UDP_REGISTRATION_RECORD_HEADER_SIZE + topic_size;
+
+  uint16_t id_network{};
+  memcpy(&id_network, record, sizeof(id_network));
+  id = ntoh(id_network);
+  const char *name = reinterpret_cast<const char *>(
+      record + UDP_REGISTRATION_RECORD_HEADER_SIZE);
+  topic = std::string_view(name, strnlen(name, topic_size));
+  return UdpParseError::NONE;
+}
+
+void start_registration_ack(std::vector<std::byte> &datagram) {
+  datagram.assign({UDP_BATCH_MAGIC, std::byte{UDP_TOPIC_REGISTRATION}});
+}
+
+void append_registered_id(std::vector<std::byte> &datagram, uint16_t id) {
+  uint16_t id_network = hton(id);
+  const auto *bytes = reinterpret_cast<const std::byte *>(&id_network);
+  datagram.insert(datagram.end(), bytes, bytes + sizeof(id_network));
+}
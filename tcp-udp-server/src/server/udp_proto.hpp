@@ -4,7 +4,11 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
 #include <variant>
+#include <vector>
 
 // ##############################################################################
 // # Constants
@@ -13,6 +17,33 @@
 static constexpr size_t UDP_MSG_TOPIC_SIZE = 50;
 static constexpr size_t UDP_PAYLOAD_STRING_MAX_SIZE = 1500;
 
+// A datagram batching several messages starts with a NUL byte, which no topic
+// starts with, and the version of the format. Each record follows as the size
+// of its topic, on a byte, the topic, the payload type, the size of the
+// payload, on 2 bytes in network byte order, and the payload, laid out as in
+// a single message, a string being sent without its NUL terminator.
+static constexpr std::byte UDP_BATCH_MAGIC{0};
+static constexpr uint8_t UDP_BATCH_VERSION = 1;
+static constexpr size_t UDP_BATCH_HEADER_SIZE =
+    sizeof(UDP_BATCH_MAGIC) + sizeof(UDP_BATCH_VERSION);
+static constexpr size_t UDP_BATCH_RECORD_HEADER_SIZE =
+    sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t);
+
+// A publisher can instead map its topics to ids of 2 bytes once, with a
+// datagram starting with the NUL byte and UDP_TOPIC_REGISTRATION, followed by
+// records of the id, in network byte order, the size of the topic, on a byte,
+// and the topic. The broker acknowledges it with a datagram of the same header
+// followed by the ids it registered, those missing being left to be sent by
+// topic. The batches of UDP_TOPIC_ID_BATCH then have records laid out as
+// those of UDP_BATCH_VERSION, the id taking the place of the size of the
+// topic and of the topic.
+static constexpr uint8_t UDP_TOPIC_REGISTRATION = 2;
+static constexpr uint8_t UDP_TOPIC_ID_BATCH = 3;
+static constexpr size_t UDP_REGISTRATION_RECORD_HEADER_SIZE =
+    sizeof(uint16_t) + sizeof(uint8_t);
+static constexpr size_t UDP_ID_RECORD_HEADER_SIZE =
+    sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint16_t);
+
 // ##############################################################################
 // # UdpMessage
 // ##############################################################################
@@ -25,10 +56,37 @@ enum class UdpPayloadType : uint8_t {
   TOTAL_PAYLOAD_TYPES
 };
 
+// Why a message is rejected, as returned by UdpMessageView::parse
+enum class UdpParseError : uint8_t {
+  NONE = 0,
+  // Shorter than the topic, the type and the smallest payload
+  TOO_SHORT,
+  UNKNOWN_PAYLOAD_TYPE,
+  // Shorter than the smallest payload of its type
+  PAYLOAD_TOO_SHORT,
+  // A batch of an unknown version, or a record of a batch exceeding the
+  // datagram or the size limits
+  INVALID_BATCH,
+  // A record of UDP_TOPIC_ID_BATCH whose id the publisher did not register
+  UNKNOWN_TOPIC_ID,
+  TOTAL_PARSE_ERRORS
+};
+
+/**
+ * @brief Describe why a message is rejected
+ *
+ * @param error The reason, not UdpParseError::NONE
+ * @return The description, as in the exceptions of the deserialization
+ */
+auto to_string(UdpParseError error) -> const char *;
+
 struct UdpPayloadInt {
   uint32_t value;
   uint8_t sign;
 
+  // The sign, followed by the value
+  using Layout = FieldLayout<&UdpPayloadInt::sign, &UdpPayloadInt::value>;
+
   /**
    * @brief Deserializes the INT payload from a byte buffer.
    *
@@ -41,8 +99,8 @@ struct UdpPayloadInt {
   static void deserialize(UdpPayloadInt &payload, const std::byte *buffer,
                           size_t buffer_size);
 
-  static constexpr size_t MAX_SERIALIZED_SIZE = sizeof(sign) + sizeof(value);
-  static constexpr size_t MIN_SERIALIZED_SIZE = sizeof(sign) + sizeof(value);
+  static constexpr size_t MAX_SERIALIZED_SIZE = Layout::SIZE;
+  static constexpr size_t MIN_SERIALIZED_SIZE = Layout::SIZE;
 };
 
 struct UdpPayloadShortReal {
@@ -50,6 +108,8 @@ struct UdpPayloadShortReal {
   // by 100
   uint16_t value;
 
+  using Layout = FieldLayout<&UdpPayloadShortReal::value>;
+
   /**
    * @brief Deserializes the SHORT_REAL payload from a byte buffer.
    *
@@ -62,8 +122,8 @@ struct UdpPayloadShortReal {
   static void deserialize(UdpPayloadShortReal &payload, const std::byte *buffer,
                           size_t buffer_size);
 
-  static constexpr size_t MAX_SERIALIZED_SIZE = sizeof(value);
-  static constexpr size_t MIN_SERIALIZED_SIZE = sizeof(value);
+  static constexpr size_t MAX_SERIALIZED_SIZE = Layout::SIZE;
+  static constexpr size_t MIN_SERIALIZED_SIZE = Layout::SIZE;
 };
 
 struct UdpPayloadFloat {
@@ -74,6 +134,10 @@ struct UdpPayloadFloat {
   // Absolute value of the negative exponent of 10 used to scale the number
   uint8_t exponent;
 
+  // The sign, followed by the value and the exponent
+  using Layout = FieldLayout<&UdpPayloadFloat::sign, &UdpPayloadFloat::value,
+                             &UdpPayloadFloat::exponent>;
+
   /**
    * @brief Deserializes the FLOAT payload from a byte buffer.
    *
@@ -86,10 +150,8 @@ struct UdpPayloadFloat {
   static void deserialize(UdpPayloadFloat &payload, const std::byte *buffer,
                           size_t buffer_size);
 
-  static constexpr size_t MAX_SERIALIZED_SIZE =
-      sizeof(sign) + sizeof(value) + sizeof(exponent);
-  static constexpr size_t MIN_SERIALIZED_SIZE =
-      sizeof(sign) + sizeof(value) + sizeof(exponent);
+  static constexpr size_t MAX_SERIALIZED_SIZE = Layout::SIZE;
+  static constexpr size_t MIN_SERIALIZED_SIZE = Layout::SIZE;
 };
 
 struct UdpPayloadString {
@@ -115,6 +177,47 @@ struct UdpPayloadString {
 
 using UdpPayloadVariant = std::variant<UdpPayloadInt, UdpPayloadShortReal,
                                        UdpPayloadFloat, UdpPayloadString>;
+static_assert(std::variant_size_v<UdpPayloadVariant> ==
+                  static_cast<size_t>(UdpPayloadType::TOTAL_PAYLOAD_TYPES),
+              "A payload type per alternative of the variant");
+
+/**
+ * @brief How a payload is checked in a datagram and framed in the TCP
+ * response, an entry per payload type, generated from the alternatives of
+ * UdpPayloadVariant
+ */
+struct UdpPayloadFormat {
+  size_t min_size;
+  // The size of the payload kept in a view, given the bytes left in the
+  // datagram, at least min_size: the fields of a number, or the string up to
+  // its NUL
+  size_t (*view_size)(const std::byte *payload, size_t size) noexcept;
+  // Size of the size of the payload, before it in the TCP response, that of
+  // a string
+  size_t response_prefix_size;
+};
+
+template <typename Payload>
+auto udp_payload_view_size(const std::byte *payload, size_t size) noexcept
+    -> size_t {
+  if constexpr (std::is_same_v<Payload, UdpPayloadString>) {
+    return strnlen(reinterpret_cast<const char *>(payload),
+                   std::min(size, Payload::MAX_SERIALIZED_SIZE));
+  } else {
+    (void)payload;
+    (void)size;
+    return Payload::MAX_SERIALIZED_SIZE;
+  }
+}
+
+// The formats of the payloads, indexed by their UdpPayloadType
+static constexpr auto UDP_PAYLOAD_FORMATS =
+    payload_table<UdpPayloadVariant>([](auto tag) constexpr {
+      using Payload = typename decltype(tag)::type;
+      return UdpPayloadFormat{
+          Payload::MIN_SERIALIZED_SIZE, &udp_payload_view_size<Payload>,
+          std::is_same_v<Payload, UdpPayloadString> ? sizeof(uint16_t) : 0};
+    });
 
 struct UdpMessage {
   std::array<char, UDP_MSG_TOPIC_SIZE + 1> topic{};
@@ -144,3 +247,187 @@ struct UdpMessage {
       UDP_MSG_TOPIC_SIZE + sizeof(UdpPayloadType) +
       min_serialized_size<UdpPayloadVariant>();
 };
+
+/**
+ * @brief A UDP message validated in place, pointing to the bytes of the
+ * datagram instead of copying them, valid while the datagram is
+ *
+ * The number payloads are laid out in the datagram as in the TCP responses, so
+ * the payload bytes are kept as received: the fields of a number, or the
+ * string without its padding.
+ */
+struct UdpMessageView {
+  const char *topic{};
+  uint8_t topic_size{};
+  UdpPayloadType payload_type{};
+  const std::byte *payload{};
+  uint16_t payload_size{};
+
+  /**
+   * @brief Validates the message in a byte buffer, as UdpMessage::deserialize,
+   * without throwing, so that a publisher sending garbage only costs the
+   * checks.
+   *
+   * @param view The view to point to the buffer, set if the message is valid.
+   * @param buffer The byte buffer containing the serialized data.
+   * @param buffer_size The size of the byte buffer.
+   * @return UdpParseError::NONE if the message is valid, or why it is not.
+   */
+  [[nodiscard]] static auto parse(UdpMessageView &view, const std::byte *buffer,
+                                  size_t buffer_size) noexcept
+      -> UdpParseError;
+
+  /**
+   * @brief Validates the message in a byte buffer, as parse.
+   *
+   * @param view The view to point to the buffer.
+   * @param buffer The byte buffer containing the serialized data.
+   * @param buffer_size The size of the byte buffer.
+   *
+   * @throws std::invalid_argument if the message is invalid.
+   */
+  static void deserialize(UdpMessageView &view, const std::byte *buffer,
+                          size_t buffer_size);
+
+  auto topic_str() const -> std::string_view { return {topic, topic_size}; }
+};
+
+/**
+ * @brief Iterates over the messages of a datagram, a single message or a
+ * batch of them, each validated in place as by UdpMessageView::parse
+ *
+ *   for (UdpMessageCursor cursor(buffer, size); !cursor.done();) {
+ *     UdpParseError error = cursor.next(view);
+ *     ...
+ *   }
+ *
+ * The messages of a batch of UDP_TOPIC_ID_BATCH are left without their topic,
+ * to be resolved by the id given by topic_id.
+ */
+class UdpMessageCursor {
+public:
+  /**
+   * @param buffer The datagram, which must outlive the cursor and the views
+   * @param buffer_size The size of the datagram
+   */
+  UdpMessageCursor(const std::byte *buffer, size_t buffer_size) noexcept
+      : buffer_(buffer), size_(buffer_size) {}
+
+  /**
+   * @brief Check if the datagram is a batch, by its first bytes
+   *
+   * @param buffer The datagram
+   * @param buffer_size The size of the datagram
+   * @return true if it starts with UDP_BATCH_MAGIC and a version
+   */
+  static auto is_batch(const std::byte *buffer, size_t buffer_size) noexcept
+      -> bool {
+    return buffer_size >= UDP_BATCH_HEADER_SIZE &&
+           buffer[0] == UDP_BATCH_MAGIC && buffer[1] != std::byte{0};
+  }
+
+  /**
+   * @brief Check if the datagram registers topic ids, see
+   * UdpRegistrationCursor
+   *
+   * @param buffer The datagram
+   * @param buffer_size The size of the datagram
+   * @return true if it starts with UDP_BATCH_MAGIC and UDP_TOPIC_REGISTRATION
+   */
+  static auto is_registration(const std::byte *buffer,
+                              size_t buffer_size) noexcept -> bool {
+    return is_batch(buffer, buffer_size) &&
+           static_cast<uint8_t>(buffer[1]) == UDP_TOPIC_REGISTRATION;
+  }
+
+  bool done() const { return done_; }
+
+  // Whether the messages are sent by topic id, the datagram being a batch of
+  // UDP_TOPIC_ID_BATCH
+  bool by_topic_id() const { return by_topic_id_; }
+  // The topic id of the last message, if by_topic_id
+  uint16_t topic_id() const { return topic_id_; }
+
+  /**
+   * @brief Validate the next message, without throwing
+   *
+   * An invalid record ends a batch, as the position of the next one cannot be
+   * trusted.
+   *
+   * @param view The view to point to the message, set if it is valid
+   * @return UdpParseError::NONE if the message is valid, or why it is not
+   */
+  [[nodiscard]] auto next(UdpMessageView &view) noexcept -> UdpParseError;
+
+private:
+  auto next_record(UdpMessageView &view) noexcept -> UdpParseError;
+  auto next_id_record(UdpMessageView &view) noexcept -> UdpParseError;
+  // Check the payload of a record, setting it in the view if it is valid
+  static auto parse_record_payload(UdpMessageView &view, uint8_t type,
+                                   const std::byte *payload,
+                                   uint16_t payload_size) noexcept
+      -> UdpParseError;
+
+  const std::byte *buffer_{};
+  size_t size_{};
+  size_t offset_{};
+  uint16_t topic_id_{};
+  bool by_topic_id_{};
+  bool done_{};
+};
+
+/**
+ * @brief Iterates over the records of a datagram of UDP_TOPIC_REGISTRATION,
+ * the topics pointing into the datagram
+ *
+ *   for (UdpRegistrationCursor cursor(buffer, size); !cursor.done();) {
+ *     UdpParseError error = cursor.next(id, topic);
+ *     ...
+ *   }
+ */
+class UdpRegistrationCursor {
+public:
+  /**
+   * @param buffer The datagram, as checked by
+   * UdpMessageCursor::is_registration, which must outlive the topics
+   * @param buffer_size The size of the datagram
+   */
+  UdpRegistrationCursor(const std::byte *buffer, size_t buffer_size) noexcept
+      : buffer_(buffer), size_(buffer_size), offset_(UDP_BATCH_HEADER_SIZE) {}
+
+  bool done() const { return offset_ >= size_; }
+
+  /**
+   * @brief Validate the next record, without throwing
+   *
+   * An invalid record ends the datagram, as the position of the next one
+   * cannot be trusted.
+   *
+   * @param id Set to the id of the topic, if the record is valid
+   * @param topic Set to the topic, up to its NUL, if the record is valid
+   * @return UdpParseError::NONE if the record is valid, or INVALID_BATCH
+   */
+  [[nodiscard]] auto next(uint16_t &id, std::string_view &topic) noexcept
+      -> UdpParseError;
+
+private:
+  const std::byte *buffer_{};
+  size_t size_{};
+  size_t offset_{};
+};
+
+/**
+ * @brief Append the header of the acknowledgement of a registration to a
+ * datagram, the ids registered being appended by append_registered_id
+ *
+ * @param datagram The datagram, cleared
+ */
+void start_registration_ack(std::vector<std::byte> &datagram);
+
+/**
+ * @brief Append a registered id to the acknowledgement of a registration
+ *
+ * @param datagram The datagram, started by start_registration_ack
+ * @param id The id
+ */
+void append_registered_id(std::vector<std::byte> &datagram, uint16_t id);
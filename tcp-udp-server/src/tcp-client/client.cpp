@@ -1,76 +1,166 @@
 #include "client.hpp"
+#include "content_filter.hpp"
+#include "lz4_block.hpp"
+#include "multicast_proto.hpp"
 #include "tcp_proto.hpp"
 #include "tcp_utils.hpp"
 #include "token_pattern.hpp"
 #include "util.hpp"
 #include <arpa/inet.h>
+#include <algorithm>
 #include <cerrno>
+#include <charconv>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sstream>
 #include <stdexcept>
 #include <unistd.h>
 
-Client::Client(std::string id) : id_(std::move(id)) {
-  sockfd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd_ < 0) {
+Client::Client(std::string id, uint8_t connect_flags,
+               OutputFormat output_format)
+    : id_(std::move(id)), connect_flags_(connect_flags),
+      output_format_(output_format) {
+  // With room for the message overflowing it, so it is never reallocated
+  output_.reserve(OUTPUT_BUFFER_SIZE + TcpMessage::MAX_SERIALIZED_SIZE * 2);
+  if (connect_flags_ & TCP_CONNECT_SHM) {
+    shm_ = ShmRing::create();
+  }
+
+  // Add stdin to the pollfd list
+  poll_fds_.push_back({STDIN_FILENO, POLLIN, 0});
+}
+
+Client::~Client() {
+  flush_output();
+  for (const auto &broker : brokers_) {
+    if (broker.fd >= 0) {
+      close(broker.fd);
+    }
+    if (broker.multicast_fd >= 0) {
+      close(broker.multicast_fd);
+    }
+  }
+}
+
+void Client::add_broker(const sockaddr_in &server_addr) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
     throw std::runtime_error("Failed to create TCP socket");
   }
 
   // Disable Nagle's algorithm
   int enable = 1;
-  if (setsockopt(sockfd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) <
-      0) {
-    close(sockfd_);
-    sockfd_ = -1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0) {
+    close(fd);
     throw std::runtime_error("Failed to set TCP_NODELAY");
   }
 
-  // Add stdin to the pollfd list
-  poll_fds_[0].fd = STDIN_FILENO;
-  poll_fds_[0].events = POLLIN;
+  auto &broker = brokers_.emplace_back();
+  broker.addr = server_addr;
+  broker.fd = fd;
+  // A single ring, written by the first broker
+  broker.connect_flags = brokers_.size() == 1
+                             ? connect_flags_
+                             : connect_flags_ & ~TCP_CONNECT_SHM;
 
-  // Add the socket to the pollfd list
-  poll_fds_[1].fd = sockfd_;
-  poll_fds_[1].events = POLLIN;
+  // Add the socket to the pollfd list, the multicast socket being ignored
+  // until the group is joined
+  poll_fds_.push_back({fd, POLLIN, 0});
+  poll_fds_.push_back({-1, POLLIN, 0});
 }
 
-Client::~Client() {
-  if (sockfd_ >= 0) {
-    close(sockfd_);
+void Client::join_multicast(const sockaddr_in &group, in_addr interface) {
+  if (brokers_.empty()) {
+    throw std::runtime_error("No broker to join the multicast group of");
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create the multicast socket");
   }
+
+  // Bound to the group, so that only its datagrams are received, by each
+  // subscriber of the host
+  int enable = 1;
+  ip_mreq membership{};
+  membership.imr_multiaddr = group.sin_addr;
+  membership.imr_interface = interface;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+      bind(fd, reinterpret_cast<const sockaddr *>(&group), sizeof(group)) < 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) < 0) {
+    close(fd);
+    throw std::runtime_error("Failed to join the multicast group: " +
+                             std::string(std::strerror(errno)));
+  }
+
+  auto &broker = brokers_.back();
+  broker.multicast_fd = fd;
+  broker.connect_flags |= TCP_CONNECT_MULTICAST;
+  multicast_buffer_.resize(MULTICAST_SEQ_SIZE + sizeof(TcpMessageType) +
+                           sizeof(uint16_t) + TcpResponse::MAX_SERIALIZED_SIZE);
+  poll_fds_.back().fd = fd;
+}
+
+void Client::open_log(const FrameLogConfig &config) {
+  log_ = std::make_unique<FrameLogWriter>(config);
+  output_format_ = OutputFormat::LOG;
 }
 
 /**
- * @brief Connect to the server
+ * @brief Connect to a broker
  *
- * This function connects to the server using the provided address.
+ * This function connects to the broker using its address.
  *
- * @param server_addr The server address to connect to.
+ * @param broker The broker to connect to.
  *
  * @throws std::runtime_error if the connection fails
  */
-void Client::connect_to_server(const sockaddr_in &server_addr) {
+void Client::connect_to_server(Broker &broker) {
 
-  if (connect(sockfd_, reinterpret_cast<const sockaddr *>(&server_addr),
-              sizeof(server_addr)) < 0) {
-    close(sockfd_);
-    sockfd_ = -1;
+  if (connect(broker.fd, reinterpret_cast<const sockaddr *>(&broker.addr),
+              sizeof(broker.addr)) < 0) {
     throw std::runtime_error("Failed to connect to server");
   }
 }
 
+/**
+ * @brief Close the connection to a broker and its multicast socket, the
+ * subscriber being stopped once it has none left
+ *
+ * @param index The index of the broker
+ */
+void Client::close_broker(size_t index) {
+  auto &broker = brokers_[index];
+  if (broker.fd < 0) {
+    return;
+  }
+  close(broker.fd);
+  broker.fd = -1;
+  if (broker.multicast_fd >= 0) {
+    close(broker.multicast_fd);
+    broker.multicast_fd = -1;
+  }
+  poll_fds_[1 + 2 * index].fd = -1;
+  poll_fds_[2 + 2 * index].fd = -1;
+  --connected_brokers_;
+}
+
 /**
  * @brief Prepare the TCP connect request message
  *
  * This function populates the `tcp_msg_` member with the appropriate
- * TcpRequest for connecting to the server.
+ * TcpRequest for connecting to a broker.
  * This function does not send the message, nor does it serialize the request.
  * After calling this function, the `tcp_msg_` member can be serialized and
  * transmitted.
+ *
+ * @param connect_flags The TCP_CONNECT_* flags of the broker
  */
-void Client::prepare_id_message() {
+void Client::prepare_id_message(uint8_t connect_flags) {
   // Prepare the connect request
   tcp_msg_.payload.emplace<TcpRequest>();
   auto &req_ = std::get<TcpRequest>(tcp_msg_.payload);
@@ -79,6 +169,12 @@ void Client::prepare_id_message() {
   req_.payload.emplace<TcpRequestPayloadId>();
   auto &id_payload = std::get<TcpRequestPayloadId>(req_.payload);
   id_payload.set(id_.c_str(), id_.size());
+  id_payload.flags = connect_flags;
+  if (connect_flags & TCP_CONNECT_SHM) {
+    // The server opens the memfd through /proc
+    id_payload.shm_pid = static_cast<uint32_t>(getpid());
+    id_payload.shm_fd = static_cast<uint32_t>(shm_->fd());
+  }
 }
 
 /**
@@ -99,6 +195,9 @@ void Client::prepare_command_message(const ClientCommand &cmd) {
 
   switch (cmd.type) {
   case ClientCommand::Type::SUBSCRIBE:
+  case ClientCommand::Type::SUBSCRIBE_CONFLATED:
+  case ClientCommand::Type::SUBSCRIBE_FILTERED:
+  case ClientCommand::Type::SUBSCRIBE_LIMITED:
     req_.type = TcpRequestType::SUBSCRIBE;
     break;
   case ClientCommand::Type::UNSUBSCRIBE:
@@ -110,20 +209,91 @@ void Client::prepare_command_message(const ClientCommand &cmd) {
 
   req_.payload.emplace<TcpRequestPayloadTopic>();
   auto &topic_payload = std::get<TcpRequestPayloadTopic>(req_.payload);
-  topic_payload.set(cmd.topic->c_str(), cmd.topic->size());
+  topic_payload.set(cmd.topics[0].c_str(), cmd.topics[0].size());
+  if (cmd.type == ClientCommand::Type::SUBSCRIBE_CONFLATED) {
+    topic_payload.flags = TCP_SUBSCRIBE_CONFLATE;
+  } else if (cmd.type == ClientCommand::Type::SUBSCRIBE_FILTERED) {
+    topic_payload.set_filter(cmd.filter.c_str(), cmd.filter.size());
+  } else if (cmd.type == ClientCommand::Type::SUBSCRIBE_LIMITED) {
+    topic_payload.set_limit(cmd.max_rate, cmd.sample_every);
+  }
 }
 
 /**
- * @brief Sends the TCP message to the server
+ * @brief Sends the TCP message to a broker
+ *
+ * @param broker The broker
  *
  * @throws TcpSocketException if the send operation fails
  */
-void Client::send_tcp_message() {
+void Client::send_tcp_message(Broker &broker) {
   // Serialize the message
   TcpMessage::serialize(tcp_msg_, tcp_msg_buffer_.data());
   size_t msg_size = tcp_msg_.serialized_size();
 
-  send_all(sockfd_, tcp_msg_buffer_.data(), msg_size);
+  send_all(broker.fd, tcp_msg_buffer_.data(), msg_size);
+}
+
+/**
+ * @brief Sends the TCP message to each broker still connected
+ *
+ * @throws TcpSocketException if a send operation fails
+ */
+void Client::send_tcp_message() {
+  TcpMessage::serialize(tcp_msg_, tcp_msg_buffer_.data());
+  send_to_brokers(tcp_msg_buffer_.data(), tcp_msg_.serialized_size());
+}
+
+/**
+ * @brief Send the same bytes to each broker still connected
+ *
+ * @param data The bytes
+ * @param size The number of bytes
+ *
+ * @throws TcpSocketException if a send operation fails
+ */
+void Client::send_to_brokers(const std::byte *data, size_t size) {
+  for (const auto &broker : brokers_) {
+    if (broker.fd >= 0) {
+      send_all(broker.fd, data, size);
+    }
+  }
+}
+
+/**
+ * @brief Send the requests of a bulk command, as many topics as fit in each
+ * of them, with a single send
+ *
+ * @param cmd The bulk client command
+ *
+ * @throws TcpSocketException if the send operation fails
+ */
+void Client::send_bulk_command(const ClientCommand &cmd) {
+  tcp_msg_.payload.emplace<TcpRequest>();
+  auto &req_ = std::get<TcpRequest>(tcp_msg_.payload);
+  req_.type = cmd.type == ClientCommand::Type::SUBSCRIBE_BULK
+                  ? TcpRequestType::SUBSCRIBE_BULK
+                  : TcpRequestType::UNSUBSCRIBE_BULK;
+  auto &topics_payload = req_.payload.emplace<TcpRequestPayloadTopics>();
+
+  // The requests are pipelined, the server applying each one as it comes
+  std::vector<std::byte> requests{};
+  auto append_request = [&]() {
+    size_t offset = requests.size();
+    requests.resize(offset + tcp_msg_.serialized_size());
+    TcpMessage::serialize(tcp_msg_, requests.data() + offset);
+    topics_payload.topics_size = 0;
+  };
+
+  for (const auto &topic : cmd.topics) {
+    if (!topics_payload.add(topic.c_str(), topic.size())) {
+      append_request();
+      topics_payload.add(topic.c_str(), topic.size());
+    }
+  }
+  append_request();
+
+  send_to_brokers(requests.data(), requests.size());
 }
 
 /**
@@ -138,133 +308,634 @@ auto Client::parse_stdin_command() -> ClientCommand {
   std::cin >> command;
 
   if (command == "exit") {
-    return ClientCommand{ClientCommand::Type::EXIT, nullptr};
-  }
-
-  std::string topic;
-  std::cin >> topic;
-
-  if (topic.size() > TCP_RESP_TOPIC_MAX_SIZE) {
-    throw std::invalid_argument("Topic size exceeds maximum allowed size");
-  }
-
-  // Try to create a TokenPattern from the topic string
-  // This helps validating the topic pattern to avoid sending invalid
-  // patterns to the server
-  try {
-    auto pattern =
-        std::make_unique<TokenPattern>(TokenPattern::from_string(topic));
-  } catch (const std::invalid_argument &e) {
-    std::cerr << "Error while creating TokenPattern: " << e.what() << std::endl;
-    throw std::invalid_argument("Invalid topic pattern provided: " + topic);
+    return ClientCommand{ClientCommand::Type::EXIT, {}};
   }
 
   ClientCommand client_command{};
 
   if (command == "subscribe") {
     client_command.type = ClientCommand::Type::SUBSCRIBE;
+  } else if (command == "subscribe_conflated") {
+    client_command.type = ClientCommand::Type::SUBSCRIBE_CONFLATED;
+  } else if (command == "subscribe_filtered") {
+    client_command.type = ClientCommand::Type::SUBSCRIBE_FILTERED;
+  } else if (command == "subscribe_limited") {
+    client_command.type = ClientCommand::Type::SUBSCRIBE_LIMITED;
   } else if (command == "unsubscribe") {
     client_command.type = ClientCommand::Type::UNSUBSCRIBE;
+  } else if (command == "subscribe_bulk") {
+    client_command.type = ClientCommand::Type::SUBSCRIBE_BULK;
+  } else if (command == "unsubscribe_bulk") {
+    client_command.type = ClientCommand::Type::UNSUBSCRIBE_BULK;
   } else {
+    // Its topic is skipped, as for the known commands
+    std::string topic;
+    std::cin >> topic;
     throw std::invalid_argument("Unknown command: " + command);
   }
-  client_command.topic = std::make_unique<std::string>(std::move(topic));
+
+  // A bulk command takes the topics up to the end of its line
+  if (client_command.type == ClientCommand::Type::SUBSCRIBE_BULK ||
+      client_command.type == ClientCommand::Type::UNSUBSCRIBE_BULK) {
+    std::string line;
+    std::getline(std::cin, line);
+    std::istringstream topics(line);
+    for (std::string topic; topics >> topic;) {
+      client_command.topics.push_back(std::move(topic));
+    }
+    if (client_command.topics.empty()) {
+      throw std::invalid_argument("No topic provided for command: " + command);
+    }
+  } else {
+    std::string topic;
+    std::cin >> topic;
+    client_command.topics.push_back(std::move(topic));
+  }
+
+  // A filtered subscription takes its filter up to the end of its line,
+  // checked here so that only valid filters are sent to the server
+  if (client_command.type == ClientCommand::Type::SUBSCRIBE_FILTERED) {
+    std::getline(std::cin, client_command.filter);
+    client_command.filter.erase(
+        0, client_command.filter.find_first_not_of(" \t"));
+    ContentFilter filter{};
+    ContentFilterError error =
+        ContentFilter::parse(client_command.filter, filter);
+    if (error != ContentFilterError::NONE) {
+      throw std::invalid_argument(std::string("Invalid filter: ") +
+                                  to_string(error));
+    }
+    if (client_command.filter.size() > TCP_REQ_FILTER_MAX_SIZE) {
+      throw std::invalid_argument("Filter size exceeds maximum allowed size");
+    }
+  }
+
+  // A limited subscription takes the messages per second and the one in how
+  // many messages sent, up to the end of its line, 0 for no limit
+  if (client_command.type == ClientCommand::Type::SUBSCRIBE_LIMITED) {
+    std::string line;
+    std::getline(std::cin, line);
+    std::istringstream limits(line);
+    uint64_t max_rate = 0;
+    uint64_t sample_every = 0;
+    std::string rest;
+    if (!(limits >> max_rate >> sample_every) || limits >> rest ||
+        max_rate > UINT32_MAX || sample_every > UINT16_MAX) {
+      throw std::invalid_argument(
+          "Invalid limits, expected: subscribe_limited <topic> <max_rate> "
+          "<sample_every>");
+    }
+    client_command.max_rate = static_cast<uint32_t>(max_rate);
+    client_command.sample_every = static_cast<uint16_t>(sample_every);
+  }
+
+  for (const auto &topic : client_command.topics) {
+    if (topic.size() > TCP_RESP_TOPIC_MAX_SIZE) {
+      throw std::invalid_argument("Topic size exceeds maximum allowed size");
+    }
+
+    // Try to create a TokenPattern from the topic string
+    // This helps validating the topic pattern to avoid sending invalid
+    // patterns to the server
+    try {
+      auto pattern =
+          std::make_unique<TokenPattern>(TokenPattern::from_string(topic));
+    } catch (const std::invalid_argument &e) {
+      std::cerr << "Error while creating TokenPattern: " << e.what()
+                << std::endl;
+      throw std::invalid_argument("Invalid topic pattern provided: " + topic);
+    }
+  }
 
   return client_command;
 }
 
 /**
- * @brief Fetch the TCP response from the server
+ * @brief Fetch the TCP responses available from a broker, with a single
+ * receive, and handle each whole one, sending the heartbeats back
+ *
+ * @param broker The broker whose socket is readable
  *
- * @throws TcpSocketException if the receive operation fails
- * @throws std::invalid_argument if the message is invalid
+ * @throws TcpSocketException if the receive or send operation fails
  */
-void Client::fetch_tcp_response() {
-  uint8_t payload_type{};
-  recv_all(sockfd_, reinterpret_cast<std::byte *>(&payload_type),
-           sizeof(payload_type));
+void Client::fetch_tcp_responses(Broker &broker) {
+  broker.reader.receive(broker.fd);
+  stamp_receive();
+  handle_frames(broker.reader, broker);
+}
 
-  if (static_cast<TcpMessageType>(payload_type) != TcpMessageType::RESPONSE) {
-    throw std::invalid_argument("Invalid TCP message type: not a response");
+/**
+ * @brief Fetch the responses written to the ring by the first broker, until
+ * it is empty, waking the broker up if it waits for space
+ *
+ * @throws TcpSocketException if a send operation fails
+ */
+void Client::fetch_shm_responses() {
+  auto &broker = brokers_.front();
+  while (shm_reader_.receive(*shm_) > 0) {
+    stamp_receive();
+    if (shm_->wake_writer()) {
+      send_all(broker.fd, TCP_SHM_WAKE_FRAME.data(),
+               TCP_SHM_WAKE_FRAME.size());
+    }
+    handle_frames(shm_reader_, broker);
   }
+}
 
-  uint16_t payload_size{};
-  recv_all(sockfd_, reinterpret_cast<std::byte *>(&payload_size),
-           sizeof(payload_size));
-  payload_size = ntoh(payload_size);
+/**
+ * @brief Handle the whole frames received from a broker, sending the
+ * heartbeats back
+ *
+ * @param reader The frames received on its socket or from the ring
+ * @param broker The broker
+ *
+ * @throws TcpSocketException if a send operation fails
+ */
+void Client::handle_frames(FrameReader &reader, Broker &broker) {
+  while (true) {
+    std::optional<FrameReader::Frame> frame{};
+    try {
+      frame = reader.next();
+    } catch (const std::invalid_argument &e) {
+      std::cerr << "Error while fetching TCP response: " << e.what()
+                << std::endl;
+      continue;
+    }
+    if (!frame) {
+      break;
+    }
 
-  if (payload_size > TcpMessage::MAX_SERIALIZED_SIZE) {
-    throw std::invalid_argument("Invalid TCP message: size exceeds max limit");
+    switch (frame->type) {
+    case TcpMessageType::RESPONSE:
+      if (log_) {
+        // Logged as received, without being parsed
+        log_frame(*frame);
+        break;
+      }
+      try {
+        tcp_msg_.payload.emplace<TcpResponse>();
+        TcpResponse::deserialize(std::get<TcpResponse>(tcp_msg_.payload),
+                                 frame->payload, frame->size);
+      } catch (const std::invalid_argument &e) {
+        std::cerr << "Error while fetching TCP response: " << e.what()
+                  << std::endl;
+        continue;
+      }
+      handle_tcp_response();
+      break;
+    case TcpMessageType::RESPONSE_BATCH:
+      fetch_batched_responses(frame->payload, frame->size);
+      break;
+    case TcpMessageType::RESPONSE_BATCH_LZ4:
+      fetch_compressed_batch(frame->payload, frame->size);
+      break;
+    case TcpMessageType::HEARTBEAT:
+      // Sent back, so the server knows the subscriber is still alive
+      send_all(broker.fd, TCP_HEARTBEAT_FRAME.data(),
+               TCP_HEARTBEAT_FRAME.size());
+      break;
+    case TcpMessageType::SHM_WAKE:
+      // The ring is read before each poll
+      break;
+    case TcpMessageType::MULTICAST_DATA:
+      deliver_multicast(broker, frame->payload, frame->size);
+      break;
+    default:
+      std::cerr << "Error while fetching TCP response: Invalid TCP message "
+                   "type: not a response"
+                << std::endl;
+      break;
+    }
   }
+}
 
-  recv_all(sockfd_, tcp_msg_buffer_.data(), payload_size);
+/**
+ * @brief Handle the responses of a batch of protocol v2
+ *
+ * @param batch The payload of the RESPONSE_BATCH frame
+ * @param batch_size The size of the payload
+ */
+void Client::fetch_batched_responses(const std::byte *batch,
+                                     size_t batch_size) {
+  const std::byte *end = batch + batch_size;
+  while (batch != end) {
+    auto &response = tcp_msg_.payload.emplace<TcpResponse>();
+    try {
+      batch_reader_.next(response, batch, end);
+    } catch (const std::invalid_argument &e) {
+      // The responses after an invalid one cannot be delimited
+      std::cerr << "Error while fetching TCP response: " << e.what()
+                << std::endl;
+      return;
+    }
+    handle_tcp_response();
+  }
+}
 
-  tcp_msg_.payload.emplace<TcpResponse>();
+/**
+ * @brief Handle the responses of a compressed batch of protocol v2, once it
+ * is decompressed
+ *
+ * @param frame The payload of the RESPONSE_BATCH_LZ4 frame
+ * @param frame_size The size of the payload
+ */
+void Client::fetch_compressed_batch(const std::byte *frame, size_t frame_size) {
+  uint16_t batch_size_network{};
+  if (frame_size < sizeof(batch_size_network)) {
+    std::cerr << "Error while fetching TCP response: Invalid compressed batch"
+              << std::endl;
+    return;
+  }
+  std::memcpy(&batch_size_network, frame, sizeof(batch_size_network));
+  size_t batch_size = ntoh(batch_size_network);
+
+  decompressed_batch_.resize(batch_size);
+  try {
+    size_t size = lz4_decompress(frame + sizeof(batch_size_network),
+                                 frame_size - sizeof(batch_size_network),
+                                 decompressed_batch_.data(), batch_size);
+    if (size != batch_size) {
+      throw std::invalid_argument(
+          "Failed to decompress LZ4 block: size mismatch");
+    }
+  } catch (const std::invalid_argument &e) {
+    // The topics it defines are lost, along with it
+    std::cerr << "Error while fetching TCP response: " << e.what()
+              << std::endl;
+    return;
+  }
+  fetch_batched_responses(decompressed_batch_.data(), batch_size);
+}
+
+/**
+ * @brief Receive the datagrams of the multicast group of a broker, until there
+ * are none left
+ *
+ * @param broker The broker
+ *
+ * @throws TcpSocketException if a NACK cannot be sent
+ */
+void Client::fetch_multicast_messages(Broker &broker) {
+  while (true) {
+    ssize_t size = recv(broker.multicast_fd, multicast_buffer_.data(),
+                        multicast_buffer_.size(), MSG_DONTWAIT);
+    if (size < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        std::cerr << "Error receiving multicast message: "
+                  << std::strerror(errno) << std::endl;
+      }
+      return;
+    }
+    stamp_receive();
+    deliver_multicast(broker, multicast_buffer_.data(),
+                      static_cast<size_t>(size));
+  }
+}
+
+/**
+ * @brief Handle a message of the multicast group of a broker, received from
+ * it or retransmitted on TCP, asking for the ones missed before it
+ *
+ * The messages of the group are only handled once each, by their sequence
+ * number, which is only unique within the group of the broker, and only those
+ * of a subscribed topic not conflated, the others being sent on TCP. A
+ * message missed is handled once retransmitted, after the ones following it.
+ *
+ * @param broker The broker
+ * @param message The sequence number, then the RESPONSE frame
+ * @param size The size of the message
+ *
+ * @throws TcpSocketException if a NACK cannot be sent
+ */
+void Client::deliver_multicast(Broker &broker, const std::byte *message,
+                               size_t size) {
+  constexpr size_t header_size =
+      MULTICAST_SEQ_SIZE + sizeof(TcpMessageType) + sizeof(uint16_t);
+  if (size < header_size ||
+      message[MULTICAST_SEQ_SIZE] !=
+          static_cast<std::byte>(TcpMessageType::RESPONSE)) {
+    std::cerr << "Invalid multicast message" << std::endl;
+    return;
+  }
+
+  // The first message received starts the sequence
+  uint64_t seq = read_multicast_seq(message);
+  if (!broker.multicast_started) {
+    broker.multicast_started = true;
+    broker.next_multicast_seq = seq;
+  }
+  if (seq < broker.next_multicast_seq) {
+    if (broker.missing_multicast.erase(seq) == 0) {
+      // Already handled
+      return;
+    }
+  } else {
+    if (seq > broker.next_multicast_seq) {
+      request_retransmit(broker, broker.next_multicast_seq, seq);
+    }
+    broker.next_multicast_seq = seq + 1;
+  }
+
+  auto &response = tcp_msg_.payload.emplace<TcpResponse>();
+  try {
+    TcpResponse::deserialize(response, message + header_size,
+                             size - header_size);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << "Error while fetching multicast message: " << e.what()
+              << std::endl;
+    return;
+  }
+  if (is_delivered_by_multicast(
+          std::string_view(response.topic.data(), response.topic_size))) {
+    handle_tcp_response();
+  }
+}
+
+/**
+ * @brief Ask a broker to retransmit the messages of its group missed, the
+ * oldest being given up beyond MAX_MISSING_MULTICAST
+ *
+ * @param broker The broker
+ * @param first The sequence number of the first message missed
+ * @param end The sequence number following the last one
+ *
+ * @throws TcpSocketException if the send operation fails
+ */
+void Client::request_retransmit(Broker &broker, uint64_t first,
+                                uint64_t end) {
+  first = std::max(first, end - std::min<uint64_t>(end, MAX_MISSING_MULTICAST));
+
+  std::vector<std::byte> nacks{};
+  for (uint64_t seq = first; seq < end;) {
+    MulticastNack nack{};
+    nack.first = seq;
+    nack.count = static_cast<uint16_t>(std::min<uint64_t>(end - seq, UINT16_MAX));
+    seq += nack.count;
+
+    size_t offset = nacks.size();
+    nacks.resize(offset + sizeof(TcpMessageType) + sizeof(uint16_t) +
+                 MulticastNack::SERIALIZED_SIZE);
+    nacks[offset] = static_cast<std::byte>(TcpMessageType::MULTICAST_NACK);
+    uint16_t size_network =
+        hton(static_cast<uint16_t>(MulticastNack::SERIALIZED_SIZE));
+    std::memcpy(nacks.data() + offset + sizeof(TcpMessageType), &size_network,
+                sizeof(size_network));
+    MulticastNack::serialize(
+        nack, nacks.data() + offset + sizeof(TcpMessageType) + sizeof(uint16_t));
+  }
+
+  for (uint64_t seq = first; seq < end; ++seq) {
+    broker.missing_multicast.insert(broker.missing_multicast.end(), seq);
+  }
+  while (broker.missing_multicast.size() > MAX_MISSING_MULTICAST) {
+    broker.missing_multicast.erase(broker.missing_multicast.begin());
+  }
+  send_all(broker.fd, nacks.data(), nacks.size());
+}
+
+/**
+ * @brief Keep track of the subscriptions changed by a command, once it is
+ * sent, if a multicast group was joined
+ *
+ * @param cmd The command sent
+ */
+void Client::update_subscriptions(const ClientCommand &cmd) {
+  if (multicast_buffer_.empty()) {
+    return;
+  }
+
+  for (const auto &topic : cmd.topics) {
+    TokenPattern pattern{};
+    if (TokenPattern::parse(topic, pattern) != TokenPatternError::NONE) {
+      continue;
+    }
+    switch (cmd.type) {
+    case ClientCommand::Type::SUBSCRIBE:
+    case ClientCommand::Type::SUBSCRIBE_BULK:
+      subscriptions_[std::move(pattern)] = false;
+      break;
+    case ClientCommand::Type::SUBSCRIBE_CONFLATED:
+    case ClientCommand::Type::SUBSCRIBE_FILTERED:
+    case ClientCommand::Type::SUBSCRIBE_LIMITED:
+      subscriptions_[std::move(pattern)] = true;
+      break;
+    case ClientCommand::Type::UNSUBSCRIBE:
+    case ClientCommand::Type::UNSUBSCRIBE_BULK:
+      subscriptions_.erase(pattern);
+      break;
+    default:
+      unreachable();
+    }
+  }
+}
+
+/**
+ * @brief Check whether the messages of a topic are delivered to this
+ * subscriber by a group, as decided by its broker
+ *
+ * @param topic The topic of a message of the group
+ * @return true if a subscription matches the topic, and none of those
+ * matching it are conflated, filtered or limited, their messages being sent on
+ * TCP
+ */
+bool Client::is_delivered_by_multicast(std::string_view topic) {
+  TokenPattern topic_pattern{};
+  if (TokenPattern::parse(topic, topic_pattern) != TokenPatternError::NONE ||
+      topic_pattern.has_wildcard()) {
+    return false;
+  }
 
-  TcpResponse::deserialize(std::get<TcpResponse>(tcp_msg_.payload),
-                           tcp_msg_buffer_.data(), payload_size);
+  bool matched = false;
+  for (const auto &[pattern, on_tcp] : subscriptions_) {
+    if (pattern.matches(topic_pattern)) {
+      if (on_tcp) {
+        return false;
+      }
+      matched = true;
+    }
+  }
+  return matched;
 }
 
 /**
  * @brief Handle the TCP response received from the server
  *
- * This function processes the TCP response and displays the relevant.
- * information to the stdout.
+ * This function processes the TCP response and buffers the relevant
+ * information, written to the stdout with the next ones.
  */
 void Client::handle_tcp_response() {
-  auto &res = std::get<TcpResponse>(tcp_msg_.payload);
+  const auto &res = std::get<TcpResponse>(tcp_msg_.payload);
+  if (output_format_ == OutputFormat::LOG) {
+    size_t size = tcp_msg_.serialized_size();
+    TcpMessage::serialize(tcp_msg_, log_->reserve(size));
+    log_->commit(receive_ns_, size);
+    return;
+  }
+  if (output_.empty()) {
+    output_since_ = std::chrono::steady_clock::now();
+  }
+
+  if (output_format_ == OutputFormat::BINARY) {
+    size_t offset = output_.size();
+    output_.resize(offset + tcp_msg_.serialized_size());
+    TcpMessage::serialize(tcp_msg_,
+                          reinterpret_cast<std::byte *>(output_.data()) +
+                              offset);
+  } else {
+    format_response(res);
+  }
+
+  if (output_.size() >= OUTPUT_BUFFER_SIZE) {
+    flush_output();
+  }
+}
 
-  // Display the response
-  std::string udp_sender_ip(16, '\0');
-  {
-    in_addr udp_sender_addr{
-        .s_addr = res.udp_client_ip,
-    };
-    inet_ntop(AF_INET, &udp_sender_addr, udp_sender_ip.data(),
-              udp_sender_ip.size());
+/**
+ * @brief Append a RESPONSE frame received to the log, as the bytes it was
+ * received as
+ *
+ * @param frame The frame
+ */
+void Client::log_frame(const FrameReader::Frame &frame) {
+  size_t size = FrameReader::HEADER_SIZE + frame.size;
+  std::byte *record = log_->reserve(size);
+  record[0] = static_cast<std::byte>(frame.type);
+  uint16_t size_network = hton(static_cast<uint16_t>(frame.size));
+  std::memcpy(record + sizeof(TcpMessageType), &size_network,
+              sizeof(size_network));
+  std::memcpy(record + FrameReader::HEADER_SIZE, frame.payload, frame.size);
+  log_->commit(receive_ns_, size);
+}
+
+/**
+ * @brief Read the time the frames being handled were received at, once per
+ * receive, if they are logged
+ */
+void Client::stamp_receive() {
+  if (!log_) {
+    return;
   }
-  uint16_t udp_sender_port = ntoh(res.udp_client_port);
+  timespec now{};
+  clock_gettime(CLOCK_REALTIME, &now);
+  receive_ns_ = static_cast<uint64_t>(now.tv_sec) * 1000000000 +
+                static_cast<uint64_t>(now.tv_nsec);
+}
 
-  std::cout << udp_sender_ip << ":" << udp_sender_port << " - "
-            << res.topic.data() << " - ";
+/**
+ * @brief Format the line of a response into the output buffer, with
+ * std::to_chars instead of the streams
+ *
+ * @param res The response
+ */
+void Client::format_response(const TcpResponse &res) {
+  // The address is in network byte order, its first byte being the first
+  // number
+  std::array<uint8_t, sizeof(res.udp_client_ip)> ip{};
+  std::memcpy(ip.data(), &res.udp_client_ip, ip.size());
+  std::array<char, 8> number{};
+  for (size_t i = 0; i < ip.size(); ++i) {
+    if (i > 0) {
+      output_ += '.';
+    }
+    auto [end, ec] = std::to_chars(number.begin(), number.end(), ip[i]);
+    output_.append(number.data(), end);
+  }
+  output_ += ':';
+  auto [end, ec] = std::to_chars(number.begin(), number.end(),
+                                 ntoh(res.udp_client_port));
+  output_.append(number.data(), end);
+
+  output_ += " - ";
+  output_.append(res.topic.data(), res.topic_size);
+  output_ += " - ";
 
   switch (res.payload_type()) {
   case TcpResponsePayloadType::INT:
-    std::cout << "INT";
+    output_ += "INT";
     break;
   case TcpResponsePayloadType::SHORT_REAL:
-    std::cout << "SHORT_REAL";
+    output_ += "SHORT_REAL";
     break;
   case TcpResponsePayloadType::FLOAT:
-    std::cout << "FLOAT";
+    output_ += "FLOAT";
     break;
   case TcpResponsePayloadType::STRING:
-    std::cout << "STRING";
+    output_ += "STRING";
     break;
   default:
     unreachable();
   }
 
-  std::cout << " - "
-            << std::visit([](auto &&arg) { return arg.to_string(); },
-                          res.payload)
-            << std::endl;
+  output_ += " - ";
+  std::visit([&](auto &&arg) { arg.append_to(output_); }, res.payload);
+  output_ += '\n';
 }
 
-void Client::run(const sockaddr_in &server_addr) {
-  connect_to_server(server_addr);
-  prepare_id_message();
-  try {
-    send_tcp_message();
-  } catch (const std::runtime_error &e) {
-    throw std::runtime_error("Failed to send connect request: " +
-                             std::string(e.what()));
+/**
+ * @brief Write the buffered messages to stdout, with a single write
+ */
+void Client::flush_output() {
+  if (output_.empty()) {
+    return;
+  }
+  std::cout.write(output_.data(), static_cast<std::streamsize>(output_.size()));
+  std::cout.flush();
+  output_.clear();
+}
+
+void Client::run() {
+  if (brokers_.empty()) {
+    throw std::runtime_error("No broker to connect to");
+  }
+  for (auto &broker : brokers_) {
+    connect_to_server(broker);
+    prepare_id_message(broker.connect_flags);
+    try {
+      send_tcp_message(broker);
+    } catch (const std::runtime_error &e) {
+      throw std::runtime_error("Failed to send connect request: " +
+                               std::string(e.what()));
+    }
   }
+  connected_brokers_ = brokers_.size();
 
   bool stopped = false;
 
   while (!stopped) {
-    if (poll(poll_fds_.data(), poll_fds_.size(), -1) < 0) {
+    // Only sleeps once the server is told to wake it up for new data
+    int timeout = -1;
+    for (size_t i = 0; i < brokers_.size(); ++i) {
+      if (brokers_[i].multicast_fd >= 0 &&
+          (poll_fds_[2 + 2 * i].revents & POLLIN)) {
+        try {
+          fetch_multicast_messages(brokers_[i]);
+        } catch (const TcpSocketException &e) {
+          std::cerr << "Connection closed by server: " << e.what()
+                    << std::endl;
+          close_broker(i);
+        }
+      }
+    }
+    if (shm_ && brokers_.front().fd >= 0) {
+      try {
+        fetch_shm_responses();
+        timeout = shm_->wait_for_data() ? -1 : 0;
+      } catch (const TcpSocketException &e) {
+        std::cerr << "Connection closed by server: " << e.what() << std::endl;
+        close_broker(0);
+      }
+    }
+    if (connected_brokers_ == 0) {
+      break;
+    }
+    // The messages are written before waiting, or once they waited long
+    // enough while the ring is polled
+    if (timeout != 0 || std::chrono::steady_clock::now() - output_since_ >=
+                            OUTPUT_FLUSH_INTERVAL) {
+      flush_output();
+    }
+
+    if (poll(poll_fds_.data(), poll_fds_.size(), timeout) < 0) {
       if (errno == EINTR) {
         // Interrupted by a signal, continue polling
         continue;
@@ -288,41 +959,69 @@ void Client::run(const sockaddr_in &server_addr) {
         continue;
       }
 
-      prepare_command_message(command);
+      const bool bulk = command.type == ClientCommand::Type::SUBSCRIBE_BULK ||
+                        command.type == ClientCommand::Type::UNSUBSCRIBE_BULK;
       try {
-        send_tcp_message();
+        if (bulk) {
+          send_bulk_command(command);
+        } else {
+          prepare_command_message(command);
+          send_tcp_message();
+        }
       } catch (const std::runtime_error &e) {
         throw std::runtime_error("Failed to send request: " +
                                  std::string(e.what()));
       }
+      update_subscriptions(command);
+      if (output_format_ != OutputFormat::TEXT) {
+        continue;
+      }
 
-      switch (command.type) {
-      case ClientCommand::Type::SUBSCRIBE:
-        std::cout << "Subscribed to topic: " << *command.topic << std::endl;
-        break;
-      case ClientCommand::Type::UNSUBSCRIBE:
-        std::cout << "Unsubscribed from topic: " << *command.topic << std::endl;
-        break;
-      default:
-        unreachable();
+      // After the messages received before the command
+      flush_output();
+      for (const auto &topic : command.topics) {
+        switch (command.type) {
+        case ClientCommand::Type::SUBSCRIBE:
+        case ClientCommand::Type::SUBSCRIBE_CONFLATED:
+        case ClientCommand::Type::SUBSCRIBE_FILTERED:
+        case ClientCommand::Type::SUBSCRIBE_LIMITED:
+        case ClientCommand::Type::SUBSCRIBE_BULK:
+          std::cout << "Subscribed to topic: " << topic << std::endl;
+          break;
+        case ClientCommand::Type::UNSUBSCRIBE:
+        case ClientCommand::Type::UNSUBSCRIBE_BULK:
+          std::cout << "Unsubscribed from topic: " << topic << std::endl;
+          break;
+        default:
+          unreachable();
+        }
       }
+      continue;
+    }
 
-    } else if (poll_fds_[1].revents & POLLIN) {
-      try {
-        fetch_tcp_response();
-      } catch (const TcpConnectionClosed &e) {
-        std::cerr << "Connection closed by server: " << e.what() << std::endl;
-        stopped = true;
-        continue;
-      } catch (const std::exception &e) {
-        std::cerr << "Error while fetching TCP response: " << e.what()
-                  << std::endl;
+    // Each broker readable, the one closing its connection being dropped
+    for (size_t i = 0; i < brokers_.size(); ++i) {
+      short revents = poll_fds_[1 + 2 * i].revents;
+      if (brokers_[i].fd < 0) {
         continue;
       }
-      handle_tcp_response();
-    } else if (poll_fds_[1].revents & (POLLERR | POLLHUP)) {
-      std::cerr << "Connection closed by server" << std::endl;
-      stopped = true;
+      if (revents & POLLIN) {
+        try {
+          fetch_tcp_responses(brokers_[i]);
+        } catch (const TcpConnectionClosed &e) {
+          std::cerr << "Connection closed by server: " << e.what()
+                    << std::endl;
+          close_broker(i);
+        } catch (const std::exception &e) {
+          std::cerr << "Error while fetching TCP response: " << e.what()
+                    << std::endl;
+        }
+      } else if (revents & (POLLERR | POLLHUP)) {
+        std::cerr << "Connection closed by server" << std::endl;
+        close_broker(i);
+      }
     }
+    stopped = connected_brokers_ == 0;
   }
+  flush_output();
 }
@@ -1,23 +1,86 @@
 #pragma once
 
+#include "frame_log.hpp"
+#include "frame_reader.hpp"
+#include "shm_ring.hpp"
+#include "tcp_batch.hpp"
 #include "tcp_proto.hpp"
+#include "token_pattern.hpp"
 #include <array>
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <netinet/in.h>
 #include <poll.h>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+// How the subscriber writes the messages it receives to stdout
+enum class OutputFormat : uint8_t {
+  // A line for each message, the address of the publisher, the topic, the
+  // type and the value
+  TEXT = 0,
+  // The RESPONSE frame of each message, as serialized by TcpMessage, the
+  // confirmations of the commands not being written
+  BINARY,
+  // The RESPONSE frame of each message appended to a FrameLogWriter, with its
+  // receive timestamp, instead of stdout, as set by Client::open_log
+  LOG,
+};
+
 class Client {
 public:
   /**
    * @brief Construct a new Client object.
    *
    * @param id The client ID.
+   * @param connect_flags The TCP_CONNECT_* flags of the CONNECT request, a
+   * ShmRing being created for TCP_CONNECT_SHM.
+   * @param output_format How the messages received are written to stdout.
+   *
+   * @throws std::runtime_error if the ring creation fails.
+   */
+  explicit Client(std::string id, uint8_t connect_flags = 0,
+                  OutputFormat output_format = OutputFormat::TEXT);
+
+  /**
+   * @brief Add a broker to connect to, before running
+   *
+   * The subscriber connects to each broker added, with the same ID, and sends
+   * each command to all of them, so that the topics sharded across brokers
+   * are received on a single event loop. The ring of TCP_CONNECT_SHM is only
+   * asked for from the first one.
+   *
+   * @param server_addr The address of the TCP port of the broker.
    *
    * @throws std::runtime_error if the socket creation fails.
    */
-  explicit Client(std::string id);
+  void add_broker(const sockaddr_in &server_addr);
+
+  /**
+   * @brief Join the multicast group of the last broker added, before running,
+   * so that the messages of the topics with a large fan-out are received from
+   * it
+   *
+   * @param group The address and port of the group.
+   * @param interface The address of the interface to join it on, the default
+   * one if it is INADDR_ANY.
+   *
+   * @throws std::runtime_error if the group cannot be joined.
+   */
+  void join_multicast(const sockaddr_in &group, in_addr interface);
+
+  /**
+   * @brief Append the messages received to a frame log instead of writing
+   * them to stdout, before running
+   *
+   * @param config The path and the sizes of the log.
+   *
+   * @throws std::runtime_error if the log cannot be created.
+   */
+  void open_log(const FrameLogConfig &config);
 
   Client(const Client &) = delete;
   Client &operator=(const Client &) = delete;
@@ -27,38 +90,130 @@ public:
 
   /**
    * @brief Run the client.
-   * This function will connect to the server and start the main event loop,
-   * listening for commands from stdin and responses from the server that are
+   * This function will connect to the brokers and start the main event loop,
+   * listening for commands from stdin and responses from the brokers that are
    * handled accordingly. The function will block until the client is stopped or
-   * the connection is closed.
-   *
-   * @param server_addr The server address to connect to.
+   * the connections to all the brokers are closed.
    *
    * @throws std::runtime_error if any critical error occurs
    */
-  void run(const sockaddr_in &server_addr);
+  void run();
 
   ~Client();
 
 private:
   struct ClientCommand {
-    enum class Type { SUBSCRIBE, UNSUBSCRIBE, EXIT } type;
-    std::unique_ptr<std::string> topic;
+    enum class Type {
+      SUBSCRIBE,
+      // a subscription whose messages are conflated by the server
+      SUBSCRIBE_CONFLATED,
+      // a subscription whose messages are filtered by the server
+      SUBSCRIBE_FILTERED,
+      // a subscription of which the server sends only a share of the messages
+      SUBSCRIBE_LIMITED,
+      UNSUBSCRIBE,
+      SUBSCRIBE_BULK,
+      UNSUBSCRIBE_BULK,
+      EXIT
+    } type;
+    // a single one, unless the command is a bulk one
+    std::vector<std::string> topics;
+    // the expression of the filter of a filtered subscription
+    std::string filter{};
+    // the messages per second and the one in how many messages of a limited
+    // subscription, 0 for no limit
+    uint32_t max_rate{};
+    uint16_t sample_every{};
+  };
+
+  // A broker the subscriber is connected to, and the multicast group it
+  // joined for it, whose sequence numbers are its own
+  struct Broker {
+    sockaddr_in addr{};
+    int fd{-1};
+    // the TCP_CONNECT_* flags of its CONNECT request
+    uint8_t connect_flags{};
+    // large enough to take a coalesced delivery with a single receive, and the
+    // batches of protocol v2
+    FrameReader reader{64 << 10, TCP_BATCH_MAX_SIZE};
+
+    // the socket of the multicast group, if it was joined
+    int multicast_fd{-1};
+    // the sequence number of the next message of the group, once one was
+    // received, and those missing, retransmitted on TCP
+    bool multicast_started{};
+    uint64_t next_multicast_seq{};
+    std::set<uint64_t> missing_multicast{};
   };
 
-  void connect_to_server(const sockaddr_in &server_addr);
+  void connect_to_server(Broker &broker);
+  void close_broker(size_t index);
   auto parse_stdin_command() -> ClientCommand;
-  void prepare_id_message();
+  void prepare_id_message(uint8_t connect_flags);
   void prepare_command_message(const ClientCommand &client_command);
+  void send_tcp_message(Broker &broker);
   void send_tcp_message();
-  void fetch_tcp_response();
+  void send_to_brokers(const std::byte *data, size_t size);
+  void send_bulk_command(const ClientCommand &client_command);
+  void fetch_tcp_responses(Broker &broker);
+  void fetch_shm_responses();
+  void handle_frames(FrameReader &reader, Broker &broker);
+  void fetch_batched_responses(const std::byte *batch, size_t batch_size);
+  void fetch_compressed_batch(const std::byte *frame, size_t frame_size);
   void handle_tcp_response();
+  void log_frame(const FrameReader::Frame &frame);
+  void stamp_receive();
+  void format_response(const TcpResponse &response);
+  void flush_output();
+  void fetch_multicast_messages(Broker &broker);
+  void deliver_multicast(Broker &broker, const std::byte *message, size_t size);
+  void request_retransmit(Broker &broker, uint64_t first, uint64_t end);
+  void update_subscriptions(const ClientCommand &client_command);
+  bool is_delivered_by_multicast(std::string_view topic);
 
-  int sockfd_{-1};
   std::string id_{};
+  uint8_t connect_flags_{};
+  // the brokers connected to, in the order they were added, those whose
+  // connection was closed having no socket
+  std::vector<Broker> brokers_{};
+  size_t connected_brokers_{};
 
   TcpMessage tcp_msg_{};
   std::vector<std::byte> tcp_msg_buffer_{TcpMessage::MAX_SERIALIZED_SIZE};
+  TcpBatchReader batch_reader_{};
+  // the payload of the last compressed batch, once decompressed
+  std::vector<std::byte> decompressed_batch_{};
+
+  // the ring the first broker writes the responses to, used along its socket,
+  // and the bytes read from it not forming a whole frame yet
+  std::unique_ptr<ShmRing> shm_{};
+  FrameReader shm_reader_{64 << 10, TCP_BATCH_MAX_SIZE};
+
+  // the datagram received from a multicast group, empty until one is joined
+  std::vector<std::byte> multicast_buffer_{};
+  // the subscriptions, and whether they are conflated, filtered or limited,
+  // their messages being sent on TCP then, the messages of the groups being
+  // filtered by them
+  std::unordered_map<TokenPattern, bool> subscriptions_{};
+
+  // Beyond this number of messages missing, the oldest ones are given up
+  static constexpr size_t MAX_MISSING_MULTICAST = 4096;
+
+  // stdin, then the socket and the multicast socket of each broker
+  std::vector<pollfd> poll_fds_{};
+
+  // the messages received not written to stdout yet, written once the buffer
+  // is full, before waiting for the server, or OUTPUT_FLUSH_INTERVAL after
+  // the first of them
+  OutputFormat output_format_{};
+  std::string output_{};
+  std::chrono::steady_clock::time_point output_since_{};
+
+  // the log the messages are appended to, and when the frames being handled
+  // were received
+  std::unique_ptr<FrameLogWriter> log_{};
+  uint64_t receive_ns_{};
 
-  std::array<pollfd, 2> poll_fds_{};
+  static constexpr size_t OUTPUT_BUFFER_SIZE = 64 << 10;
+  static constexpr std::chrono::milliseconds OUTPUT_FLUSH_INTERVAL{10};
 };
@@ -1,10 +1,37 @@
 #include "client.hpp"
+#include "multicast_proto.hpp"
 #include "util.hpp"
 #include <arpa/inet.h>
 #include <charconv>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <netinet/in.h>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+// Read a size from the environment, leaving it unchanged if it is not set
+bool read_env_size(const char *name, size_t &value) {
+  const char *str = std::getenv(name);
+  if (str == nullptr) {
+    return true;
+  }
+
+  auto [ptr, ec] = std::from_chars(str, str + strlen(str), value);
+  if (ec != std::errc{} || *ptr != '\0') {
+    std::cerr << "Invalid " << name << ": " << str << std::endl;
+    return false;
+  }
+  return true;
+}
+
+} // namespace
 
 int main(int argc, char *argv[]) {
 #ifndef ENABLE_ERROR_MESSAGES
@@ -37,9 +64,109 @@ int main(int argc, char *argv[]) {
   server_addr.sin_port = hton(server_port);
   server_addr.sin_addr.s_addr = server_ip;
 
+  // SUBSCRIBER_NO_COALESCING=1 asks the server to send each message at once
+  uint8_t connect_flags = 0;
+  if (const char *flag = std::getenv("SUBSCRIBER_NO_COALESCING");
+      flag != nullptr && std::string(flag) == "1") {
+    connect_flags |= TCP_CONNECT_NO_COALESCING;
+  }
+  // SUBSCRIBER_PROTOCOL=2 asks the server to batch the responses
+  if (const char *protocol = std::getenv("SUBSCRIBER_PROTOCOL");
+      protocol != nullptr && std::string(protocol) == "2") {
+    connect_flags |= TCP_CONNECT_PROTOCOL_V2;
+  }
+  // SUBSCRIBER_COMPRESSION=1 asks the server to compress the large batches,
+  // the responses being batched for it
+  if (const char *compression = std::getenv("SUBSCRIBER_COMPRESSION");
+      compression != nullptr && std::string(compression) == "1") {
+    connect_flags |= TCP_CONNECT_PROTOCOL_V2 | TCP_CONNECT_COMPRESSION;
+  }
+  // SUBSCRIBER_SHM=1 asks the server, on the same host, to write the responses
+  // to shared memory
+  if (const char *shm = std::getenv("SUBSCRIBER_SHM");
+      shm != nullptr && std::string(shm) == "1") {
+    connect_flags |= TCP_CONNECT_SHM;
+  }
+
+  // SUBSCRIBER_MULTICAST, the group of the server as <address>:<port>, to
+  // receive the topics with a large fan-out from it, on the interface of
+  // SUBSCRIBER_MULTICAST_IF
+  sockaddr_in multicast_group{};
+  in_addr multicast_interface{};
+  if (const char *group = std::getenv("SUBSCRIBER_MULTICAST");
+      group != nullptr && !parse_endpoint(group, multicast_group)) {
+    std::cerr << "Invalid SUBSCRIBER_MULTICAST: " << group << std::endl;
+    return 1;
+  }
+  if (const char *interface = std::getenv("SUBSCRIBER_MULTICAST_IF");
+      interface != nullptr &&
+      inet_pton(AF_INET, interface, &multicast_interface) != 1) {
+    std::cerr << "Invalid SUBSCRIBER_MULTICAST_IF: " << interface << std::endl;
+    return 1;
+  }
+
+  // SUBSCRIBER_BROKERS, the other brokers as <address>:<port>,..., each command
+  // being sent to all of them, for the topics sharded across brokers
+  std::vector<sockaddr_in> brokers{server_addr};
+  if (const char *list = std::getenv("SUBSCRIBER_BROKERS");
+      list != nullptr && *list != '\0') {
+    for (std::string_view rest = list; !rest.empty();) {
+      size_t comma = rest.find(',');
+      std::string_view broker = rest.substr(0, comma);
+      rest = comma == std::string_view::npos ? ""sv : rest.substr(comma + 1);
+      if (!parse_endpoint(broker, brokers.emplace_back())) {
+        std::cerr << "Invalid SUBSCRIBER_BROKERS: " << list << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  // SUBSCRIBER_OUTPUT=binary writes the RESPONSE frames received instead of
+  // a line for each message, SUBSCRIBER_OUTPUT=log appends them to the frame
+  // log of SUBSCRIBER_LOG, in segments of SUBSCRIBER_LOG_SEGMENT_BYTES, the
+  // last SUBSCRIBER_LOG_SEGMENTS being kept
+  OutputFormat output_format = OutputFormat::TEXT;
+  std::optional<FrameLogConfig> log_config{};
+  if (const char *output = std::getenv("SUBSCRIBER_OUTPUT"); output != nullptr) {
+    if (std::string(output) == "binary") {
+      output_format = OutputFormat::BINARY;
+    } else if (std::string(output) == "log") {
+      const char *path = std::getenv("SUBSCRIBER_LOG");
+      if (path == nullptr || *path == '\0') {
+        std::cerr << "Missing SUBSCRIBER_LOG" << std::endl;
+        return 1;
+      }
+      log_config.emplace().path = path;
+      if (!read_env_size("SUBSCRIBER_LOG_SEGMENT_BYTES",
+                         log_config->segment_bytes) ||
+          !read_env_size("SUBSCRIBER_LOG_SEGMENTS", log_config->segments)) {
+        return 1;
+      }
+    } else if (std::string(output) != "text") {
+      std::cerr << "Invalid SUBSCRIBER_OUTPUT: " << output << std::endl;
+      return 1;
+    }
+  }
+
   try {
-    Client client(client_id);
-    client.run(server_addr);
+    Client client(client_id, connect_flags, output_format);
+    if (log_config.has_value()) {
+      client.open_log(log_config.value());
+    }
+    // The multicast group is the one of the broker of the arguments
+    client.add_broker(server_addr);
+    if (multicast_group.sin_port != 0) {
+      // All the messages are sent on TCP otherwise
+      try {
+        client.join_multicast(multicast_group, multicast_interface);
+      } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+    for (size_t i = 1; i < brokers.size(); ++i) {
+      client.add_broker(brokers[i]);
+    }
+    client.run();
   } catch (const std::exception &e) {
     std::cerr << "Exception occurred: " << e.what() << std::endl;
     return 1;